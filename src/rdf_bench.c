@@ -0,0 +1,828 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_bench.c - RDF storage, parser and query benchmark suite
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * Generates synthetic graphs at several sizes and, for each storage,
+ * measures the load rate, find latency for each combination of bound
+ * statement parts, serialising, SPARQL basic graph pattern joins and
+ * the memory used.  Parsing is measured once per size.
+ *
+ * Results are written one per line as tab separated
+ *   STORAGE STATEMENTS BENCHMARK VALUE UNIT
+ * after comment lines starting with # giving the settings, so runs of
+ * different releases can be compared with standard text tools.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* for gettimeofday */
+#if TIME_WITH_SYS_TIME
+#include <sys/time.h>
+#include <time.h>
+#else
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/* one prototype needed */
+int main(int argc, char *argv[]);
+
+
+#define BENCH_ARCS_PER_SUBJECT 8
+#define BENCH_MAX_SCALES 16
+#define BENCH_MAX_STORAGES 16
+#define BENCH_BASE_URI "http://data.example.org/bench/"
+
+
+typedef struct {
+  int predicates;
+  /* exponent of the Zipf distribution of predicates; 0 for uniform */
+  double skew;
+  int literal_size;
+  int contexts;
+  int lookups;
+  u64 seed;
+} bench_config;
+
+
+typedef struct {
+  librdf_world* world;
+  int count;
+  librdf_statement** statements;
+  librdf_node** predicates;
+  librdf_node** contexts;
+  u64 random;
+} bench_graph;
+
+
+/* storages tried when none are given, if present */
+static const char * const bench_default_storages[][2]={
+  { "memory", "" },
+  { "hashes", "hash-type='memory'" },
+  { "trees",  "" },
+  { NULL, NULL }
+};
+
+
+/* xorshift64* so graphs are the same on every platform */
+static u64
+bench_random(u64* state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * (u64)2685821657736338717ULL;
+}
+
+
+static double
+bench_random_double(u64* state)
+{
+  return (double)(bench_random(state) >> 11) / 9007199254740992.0;
+}
+
+
+static double
+bench_now(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+
+  if(!gettimeofday(&tv, NULL))
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+#endif
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+
+/* Resident memory in bytes, or -1 where /proc/self/statm is missing */
+static long
+bench_resident(void)
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_PAGESIZE)
+  FILE* fh;
+  long size;
+  long resident= -1;
+
+  fh=fopen("/proc/self/statm", "r");
+  if(!fh)
+    return -1;
+  if(fscanf(fh, "%ld %ld", &size, &resident) != 2)
+    resident= -1;
+  fclose(fh);
+  if(resident >= 0)
+    resident *= sysconf(_SC_PAGESIZE);
+  return resident;
+#else
+  return -1;
+#endif
+}
+
+
+static void
+bench_result(const char* storage_name, int count, const char* name,
+             double value, const char* unit)
+{
+  fprintf(stdout, "%s\t%d\t%s\t%.6g\t%s\n", storage_name, count, name,
+          value, unit);
+}
+
+
+static void
+bench_rate(const char* storage_name, int count, const char* name,
+           double amount, double seconds, const char* unit)
+{
+  bench_result(storage_name, count, name,
+               seconds > 0.0 ? amount / seconds : 0.0, unit);
+}
+
+
+/* Predicates with index 3 mod 4 have literal objects, the rest link
+ * to other subjects so joins find paths */
+static int
+bench_predicate_is_literal(int predicate)
+{
+  return (predicate % 4) == 3;
+}
+
+
+static librdf_node*
+bench_subject(librdf_world* world, int subject)
+{
+  char uri_string[256];
+
+  sprintf(uri_string, BENCH_BASE_URI "%d/item-%d", subject % 97, subject);
+  return librdf_new_node_from_uri_string(world,
+                                         (const unsigned char*)uri_string);
+}
+
+
+static librdf_node*
+bench_literal(bench_graph* graph, int literal_size)
+{
+  unsigned char* buffer;
+  librdf_node* node;
+  int i;
+
+  buffer = LIBRDF_MALLOC(unsigned char*, literal_size + 1);
+  if(!buffer)
+    return NULL;
+
+  for(i=0; i < literal_size; i++) {
+    u64 r=bench_random(&graph->random);
+
+    buffer[i]=(unsigned char)((r % 7) ? 'a' + (char)((r >> 8) % 26) : ' ');
+  }
+  buffer[literal_size]='\0';
+
+  node=librdf_new_node_from_literal(graph->world, buffer, NULL, 0);
+  LIBRDF_FREE(char*, buffer);
+  return node;
+}
+
+
+static void
+bench_free_graph(bench_graph* graph)
+{
+  int i;
+
+  if(graph->statements) {
+    for(i=0; i < graph->count; i++)
+      if(graph->statements[i])
+        librdf_free_statement(graph->statements[i]);
+    LIBRDF_FREE(librdf_statement**, graph->statements);
+  }
+  if(graph->predicates) {
+    for(i=0; graph->predicates[i]; i++)
+      librdf_free_node(graph->predicates[i]);
+    LIBRDF_FREE(librdf_node**, graph->predicates);
+  }
+  if(graph->contexts) {
+    for(i=0; graph->contexts[i]; i++)
+      librdf_free_node(graph->contexts[i]);
+    LIBRDF_FREE(librdf_node**, graph->contexts);
+  }
+}
+
+
+/*
+ * A graph of count statements with BENCH_ARCS_PER_SUBJECT arcs for
+ * each subject, predicates picked with the configured skew and objects
+ * either literals or random subjects.
+ */
+static int
+bench_make_graph(bench_graph* graph, librdf_world* world,
+                 bench_config* config, int count)
+{
+  double* cdf;
+  double total=0.0;
+  int subjects=(count + BENCH_ARCS_PER_SUBJECT - 1) / BENCH_ARCS_PER_SUBJECT;
+  char uri_string[256];
+  int i;
+
+  memset(graph, 0, sizeof(*graph));
+  graph->world=world;
+  graph->random=config->seed ? config->seed : 1;
+
+  cdf = LIBRDF_MALLOC(double*, config->predicates * sizeof(double));
+  graph->predicates = LIBRDF_CALLOC(librdf_node**, config->predicates + 1,
+                                    sizeof(librdf_node*));
+  graph->contexts = LIBRDF_CALLOC(librdf_node**, config->contexts + 1,
+                                  sizeof(librdf_node*));
+  graph->statements = LIBRDF_CALLOC(librdf_statement**, count,
+                                    sizeof(librdf_statement*));
+  if(!cdf || !graph->predicates || !graph->contexts || !graph->statements)
+    goto failed;
+  graph->count=count;
+
+  for(i=0; i < config->predicates; i++) {
+    sprintf(uri_string, BENCH_BASE_URI "vocabulary#property%d", i);
+    graph->predicates[i]=librdf_new_node_from_uri_string(world,
+      (const unsigned char*)uri_string);
+    if(!graph->predicates[i])
+      goto failed;
+    total += 1.0 / pow((double)(i + 1), config->skew);
+    cdf[i]=total;
+  }
+
+  for(i=0; i < config->contexts; i++) {
+    sprintf(uri_string, BENCH_BASE_URI "graph-%d", i);
+    graph->contexts[i]=librdf_new_node_from_uri_string(world,
+      (const unsigned char*)uri_string);
+    if(!graph->contexts[i])
+      goto failed;
+  }
+
+  for(i=0; i < count; i++) {
+    double u=bench_random_double(&graph->random) * total;
+    int predicate=0;
+    librdf_node* object;
+
+    while(predicate < config->predicates - 1 && u >= cdf[predicate])
+      predicate++;
+
+    if(bench_predicate_is_literal(predicate))
+      object=bench_literal(graph, config->literal_size);
+    else
+      object=bench_subject(world,
+                           (int)(bench_random(&graph->random) % (u64)subjects));
+
+    graph->statements[i]=librdf_new_statement_from_nodes(world,
+      bench_subject(world, i / BENCH_ARCS_PER_SUBJECT),
+      librdf_new_node_from_node(graph->predicates[predicate]),
+      object);
+    if(!graph->statements[i])
+      goto failed;
+  }
+
+  LIBRDF_FREE(double*, cdf);
+  return 0;
+
+  failed:
+  if(cdf)
+    LIBRDF_FREE(double*, cdf);
+  bench_free_graph(graph);
+  return 1;
+}
+
+
+static long
+bench_count_stream(librdf_stream* stream)
+{
+  long count=0;
+
+  if(!stream)
+    return -1;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    if(librdf_stream_get_object(stream))
+      count++;
+  }
+  librdf_free_stream(stream);
+
+  return count;
+}
+
+
+/*
+ * Time finds of patterns made from random statements of the graph
+ * with the parts in mask bound, giving the mean and worst latency and
+ * the mean number of statements found.
+ */
+static void
+bench_find(bench_config* config, bench_graph* graph, librdf_model* model,
+           const char* storage_name, int mask)
+{
+  librdf_statement* pattern;
+  char name[32];
+  double total=0.0;
+  double worst=0.0;
+  long results=0;
+  int lookups=config->lookups;
+  int i;
+
+  /* only a few different patterns have just the predicate bound */
+  if(mask == LIBRDF_STATEMENT_PREDICATE && lookups > config->predicates)
+    lookups=config->predicates;
+
+  pattern=librdf_new_statement(graph->world);
+  if(!pattern)
+    return;
+
+  for(i=0; i < lookups; i++) {
+    librdf_statement* statement;
+    double start;
+    double seconds;
+    long count;
+
+    statement=graph->statements[bench_random(&graph->random) % (u64)graph->count];
+    if(mask == LIBRDF_STATEMENT_PREDICATE)
+      statement=NULL;
+
+    librdf_statement_clear(pattern);
+    if(mask & LIBRDF_STATEMENT_SUBJECT)
+      librdf_statement_set_subject(pattern,
+        librdf_new_node_from_node(librdf_statement_get_subject(statement)));
+    if(mask & LIBRDF_STATEMENT_PREDICATE)
+      librdf_statement_set_predicate(pattern,
+        librdf_new_node_from_node(statement ? librdf_statement_get_predicate(statement) : graph->predicates[i]));
+    if(mask & LIBRDF_STATEMENT_OBJECT)
+      librdf_statement_set_object(pattern,
+        librdf_new_node_from_node(librdf_statement_get_object(statement)));
+
+    start=bench_now();
+    count=bench_count_stream(librdf_model_find_statements(model, pattern));
+    seconds=bench_now() - start;
+
+    if(count > 0)
+      results += count;
+    total += seconds;
+    if(seconds > worst)
+      worst=seconds;
+  }
+  librdf_free_statement(pattern);
+
+  if(!lookups)
+    return;
+
+  sprintf(name, "find-%c%c%c",
+          (mask & LIBRDF_STATEMENT_SUBJECT) ? 's' : '?',
+          (mask & LIBRDF_STATEMENT_PREDICATE) ? 'p' : '?',
+          (mask & LIBRDF_STATEMENT_OBJECT) ? 'o' : '?');
+  bench_result(storage_name, graph->count, name,
+               total * 1e6 / lookups, "us/op");
+  strcat(name, "-max");
+  bench_result(storage_name, graph->count, name, worst * 1e6, "us");
+  sprintf(name + 8, "-results");
+  bench_result(storage_name, graph->count, name,
+               (double)results / lookups, "statements/op");
+}
+
+
+/* Time a SPARQL query and count its results */
+static void
+bench_query(librdf_world* world, librdf_model* model,
+            const char* storage_name, int count, const char* name,
+            const char* query_string)
+{
+  librdf_query* query;
+  librdf_query_results* results;
+  char result_name[64];
+  double start;
+  double seconds;
+  long rows=0;
+
+  query=librdf_new_query(world, "sparql", NULL,
+                         (const unsigned char*)query_string, NULL);
+  if(!query)
+    return;
+
+  start=bench_now();
+  results=librdf_model_query_execute(model, query);
+  if(results) {
+    while(!librdf_query_results_finished(results)) {
+      rows++;
+      librdf_query_results_next(results);
+    }
+    librdf_free_query_results(results);
+  }
+  seconds=bench_now() - start;
+  librdf_free_query(query);
+
+  if(!results)
+    return;
+
+  bench_result(storage_name, count, name, seconds * 1e3, "ms");
+  sprintf(result_name, "%s-results", name);
+  bench_result(storage_name, count, result_name, (double)rows, "rows");
+}
+
+
+/* Run every measurement on one storage loaded with the graph */
+static int
+bench_storage(bench_config* config, bench_graph* graph,
+              const char* storage_name, const char* storage_options)
+{
+  librdf_world* world=graph->world;
+  librdf_storage* storage;
+  librdf_model* model;
+  librdf_serializer* serializer;
+  char* options;
+  char* query_string;
+  unsigned char* string;
+  unsigned char* p0;
+  unsigned char* p1;
+  double start;
+  long resident;
+  long size;
+  int count=graph->count;
+  int mask;
+  int i;
+
+  options = LIBRDF_MALLOC(char*, strlen(storage_options) + 32);
+  if(!options)
+    return 1;
+  sprintf(options, "%s%snew='yes'%s", storage_options,
+          *storage_options ? "," : "",
+          config->contexts ? ",contexts='yes'" : "");
+
+  resident=bench_resident();
+  storage=librdf_new_storage(world, storage_name, "test-bench", options);
+  LIBRDF_FREE(char*, options);
+  if(!storage)
+    return 1;
+  model=librdf_new_model(world, storage, NULL);
+  if(!model) {
+    librdf_free_storage(storage);
+    return 1;
+  }
+
+  start=bench_now();
+  for(i=0; i < count; i++) {
+    if(config->contexts)
+      librdf_model_context_add_statement(model,
+                                         graph->contexts[i % config->contexts],
+                                         graph->statements[i]);
+    else
+      librdf_model_add_statement(model, graph->statements[i]);
+  }
+  librdf_model_sync(model);
+  bench_rate(storage_name, count, "load", count, bench_now() - start,
+             "statements/s");
+
+  size=librdf_model_size(model);
+  if(size >= 0)
+    bench_result(storage_name, count, "size", (double)size, "statements");
+
+  if(resident >= 0) {
+    long used=bench_resident() - resident;
+
+    bench_result(storage_name, count, "memory", (double)used, "bytes");
+    bench_result(storage_name, count, "memory-per-statement",
+                 (double)used / count, "bytes");
+  }
+
+  for(mask=1; mask <= 7; mask++)
+    bench_find(config, graph, model, storage_name, mask);
+
+  start=bench_now();
+  size=bench_count_stream(librdf_model_as_stream(model));
+  bench_rate(storage_name, count, "serialise", (double)size,
+             bench_now() - start, "statements/s");
+
+  serializer=librdf_new_serializer(world, "ntriples", NULL, NULL);
+  if(serializer) {
+    start=bench_now();
+    string=librdf_serializer_serialize_model_to_string(serializer, NULL,
+                                                       model);
+    if(string) {
+      bench_rate(storage_name, count, "serialize-ntriples",
+                 (double)strlen((const char*)string), bench_now() - start,
+                 "bytes/s");
+      librdf_free_memory(string);
+    }
+    librdf_free_serializer(serializer);
+  }
+
+  /* the two most used predicates link subjects */
+  p0=librdf_uri_as_string(librdf_node_get_uri(graph->predicates[0]));
+  p1=librdf_uri_as_string(librdf_node_get_uri(graph->predicates[config->predicates > 1 ? 1 : 0]));
+  query_string = LIBRDF_MALLOC(char*, strlen((const char*)p0) +
+                               strlen((const char*)p1) + 128);
+  if(query_string) {
+    sprintf(query_string,
+            "SELECT ?a ?c WHERE { ?a <%s> ?b . ?b <%s> ?c }", p0, p1);
+    bench_query(world, model, storage_name, count, "sparql-path-join",
+                query_string);
+    sprintf(query_string,
+            "SELECT ?s ?b ?c WHERE { ?s <%s> ?b . ?s <%s> ?c }", p0, p1);
+    bench_query(world, model, storage_name, count, "sparql-star-join",
+                query_string);
+    LIBRDF_FREE(char*, query_string);
+  }
+
+  librdf_free_model(model);
+  librdf_free_storage(storage);
+  return 0;
+}
+
+
+/* Time parsing the graph written in a syntax, without storing it */
+static void
+bench_parse(bench_graph* graph, const char* syntax_name)
+{
+  librdf_world* world=graph->world;
+  librdf_storage* storage;
+  librdf_model* model=NULL;
+  librdf_serializer* serializer=NULL;
+  librdf_parser* parser=NULL;
+  librdf_uri* base_uri=NULL;
+  unsigned char* string=NULL;
+  char name[64];
+  double start;
+  double seconds;
+  long count;
+  int i;
+
+  storage=librdf_new_storage(world, "memory", NULL, NULL);
+  if(!storage)
+    return;
+  model=librdf_new_model(world, storage, NULL);
+  serializer=librdf_new_serializer(world, syntax_name, NULL, NULL);
+  parser=librdf_new_parser(world, syntax_name, NULL, NULL);
+  base_uri=librdf_new_uri(world, (const unsigned char*)BENCH_BASE_URI);
+  if(!model || !serializer || !parser || !base_uri)
+    goto tidy;
+
+  for(i=0; i < graph->count; i++)
+    librdf_model_add_statement(model, graph->statements[i]);
+  string=librdf_serializer_serialize_model_to_string(serializer, base_uri,
+                                                     model);
+  if(!string)
+    goto tidy;
+
+  start=bench_now();
+  count=bench_count_stream(librdf_parser_parse_string_as_stream(parser,
+                                                                string,
+                                                                base_uri));
+  seconds=bench_now() - start;
+  if(count < 0)
+    goto tidy;
+
+  sprintf(name, "parse-%s", syntax_name);
+  bench_rate("-", graph->count, name, (double)count, seconds,
+             "statements/s");
+  strcat(name, "-bytes");
+  bench_rate("-", graph->count, name, (double)strlen((const char*)string),
+             seconds, "bytes/s");
+
+  tidy:
+  if(string)
+    librdf_free_memory(string);
+  if(base_uri)
+    librdf_free_uri(base_uri);
+  if(parser)
+    librdf_free_parser(parser);
+  if(serializer)
+    librdf_free_serializer(serializer);
+  if(model)
+    librdf_free_model(model);
+  librdf_free_storage(storage);
+}
+
+
+static int
+bench_storage_present(librdf_world* world, const char* storage_name)
+{
+  const char* name;
+  unsigned int i;
+
+  for(i=0; !librdf_storage_enumerate(world, i, &name, NULL); i++) {
+    if(!strcmp(name, storage_name))
+      return 1;
+  }
+  return 0;
+}
+
+
+static void
+bench_usage(const char* program)
+{
+  fprintf(stderr,
+          "USAGE: %s [OPTIONS]\n"
+          "  -n N[,N...]        statement counts (default 1000,10000,100000)\n"
+          "  -s NAME[:OPTIONS]  storage to measure, may be repeated\n"
+          "                     (default memory, hashes and trees)\n"
+          "  -p N               number of predicates (default 16)\n"
+          "  -k SKEW            Zipf exponent of predicate use, 0 for uniform\n"
+          "                     (default 1.0)\n"
+          "  -l N               literal size in bytes (default 32)\n"
+          "  -c N               number of contexts, 0 for none (default 0)\n"
+          "  -q N               finds per pattern (default 1000)\n"
+          "  -r SEED            random seed (default 1)\n",
+          program);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  librdf_world* world;
+  const char *program=librdf_basename((const char*)argv[0]);
+  bench_config config;
+  int counts[BENCH_MAX_SCALES];
+  int counts_count=0;
+  const char* storage_names[BENCH_MAX_STORAGES];
+  const char* storage_options[BENCH_MAX_STORAGES];
+  char* storage_args[BENCH_MAX_STORAGES];
+  int storages_count=0;
+  int scale;
+  int i;
+
+  config.predicates=16;
+  config.skew=1.0;
+  config.literal_size=32;
+  config.contexts=0;
+  config.lookups=1000;
+  config.seed=1;
+
+  for(i=1; i < argc; i++) {
+    const char* arg=argv[i];
+    const char* value;
+
+    if(arg[0] != '-' || !arg[1] || arg[2] || i + 1 >= argc) {
+      bench_usage(program);
+      return 1;
+    }
+    value=argv[++i];
+
+    switch(arg[1]) {
+      case 'n':
+        while(*value && counts_count < BENCH_MAX_SCALES) {
+          char* end;
+
+          counts[counts_count++]=(int)strtol(value, &end, 10);
+          value=(*end == ',') ? end + 1 : end;
+          if(*end && *end != ',')
+            break;
+        }
+        break;
+
+      case 's':
+        if(storages_count < BENCH_MAX_STORAGES) {
+          const char* colon=strchr(value, ':');
+          size_t len=colon ? (size_t)(colon - value) : strlen(value);
+
+          storage_args[storages_count] = LIBRDF_MALLOC(char*, len + 1);
+          if(!storage_args[storages_count])
+            return 1;
+          memcpy(storage_args[storages_count], value, len);
+          storage_args[storages_count][len]='\0';
+          storage_names[storages_count]=storage_args[storages_count];
+          storage_options[storages_count]=colon ? colon + 1 : "";
+          storages_count++;
+        }
+        break;
+
+      case 'p':
+        config.predicates=atoi(value);
+        break;
+
+      case 'k':
+        config.skew=atof(value);
+        break;
+
+      case 'l':
+        config.literal_size=atoi(value);
+        break;
+
+      case 'c':
+        config.contexts=atoi(value);
+        break;
+
+      case 'q':
+        config.lookups=atoi(value);
+        break;
+
+      case 'r':
+        config.seed=(u64)strtoul(value, NULL, 10);
+        break;
+
+      default:
+        bench_usage(program);
+        return 1;
+    }
+  }
+
+  if(config.predicates < 1 || config.skew < 0.0 || config.literal_size < 0 ||
+     config.contexts < 0 || config.lookups < 0) {
+    bench_usage(program);
+    return 1;
+  }
+  for(i=0; i < counts_count; i++) {
+    if(counts[i] < 1) {
+      bench_usage(program);
+      return 1;
+    }
+  }
+  if(!counts_count) {
+    counts[counts_count++]=1000;
+    counts[counts_count++]=10000;
+    counts[counts_count++]=100000;
+  }
+
+  world=librdf_new_world();
+  librdf_world_open(world);
+
+  if(!storages_count) {
+    for(i=0; bench_default_storages[i][0]; i++) {
+      if(!bench_storage_present(world, bench_default_storages[i][0]))
+        continue;
+      storage_args[storages_count]=NULL;
+      storage_names[storages_count]=bench_default_storages[i][0];
+      storage_options[storages_count]=bench_default_storages[i][1];
+      storages_count++;
+    }
+  }
+
+  fprintf(stdout, "# %s: redland %s predicates=%d skew=%g literal-size=%d contexts=%d lookups=%d seed=%lu\n",
+          program, librdf_version_string, config.predicates, config.skew,
+          config.literal_size, config.contexts, config.lookups,
+          (unsigned long)config.seed);
+  fprintf(stdout, "# storage\tstatements\tbenchmark\tvalue\tunit\n");
+
+  for(scale=0; scale < counts_count; scale++) {
+    bench_graph graph;
+
+    if(bench_make_graph(&graph, world, &config, counts[scale])) {
+      fprintf(stderr, "%s: Failed to create a graph of %d statements\n",
+              program, counts[scale]);
+      return 1;
+    }
+
+    bench_parse(&graph, "ntriples");
+    bench_parse(&graph, "turtle");
+
+    for(i=0; i < storages_count; i++) {
+      if(bench_storage(&config, &graph, storage_names[i],
+                       storage_options[i]))
+        fprintf(stderr, "%s: Failed to create a '%s' storage with options '%s'\n",
+                program, storage_names[i], storage_options[i]);
+      fflush(stdout);
+    }
+
+    bench_free_graph(&graph);
+  }
+
+  for(i=0; i < storages_count; i++) {
+    if(storage_args[i])
+      LIBRDF_FREE(char*, storage_args[i]);
+  }
+
+  librdf_free_world(world);
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_binary_internal.h - librdf binary RDF syntax definitions
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+
+#ifndef LIBRDF_BINARY_INTERNAL_H
+#define LIBRDF_BINARY_INTERNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The librdf binary syntax is a dictionary of terms built up as the
+ * statements are written, with statements as integer term ids, so
+ * that a librdf to librdf transfer neither tokenises text nor
+ * resolves URIs.
+ *
+ *   document := MAGIC record* END
+ *   record   := TERM varint(length) node-encoding
+ *             | TRIPLE varint(s) varint(p) varint(o)
+ *             | QUAD varint(s) varint(p) varint(o) varint(g)
+ *             | RESET
+ *
+ * A TERM record gives the next term id, from 0, to the term in
+ * librdf_node_encode() form.  RESET forgets all terms so the tables on
+ * both sides stay bounded.  varints are unsigned LEB128: 7 bits per
+ * byte, least significant first, high bit set on all but the last.
+ */
+
+/* 7 bytes of magic followed by a version byte */
+#define LIBRDF_BINARY_MAGIC "LRDFBIN\001"
+#define LIBRDF_BINARY_MAGIC_LEN 8
+
+#define LIBRDF_BINARY_TERM   'N'
+#define LIBRDF_BINARY_TRIPLE 'T'
+#define LIBRDF_BINARY_QUAD   'Q'
+#define LIBRDF_BINARY_RESET  'R'
+#define LIBRDF_BINARY_END    'E'
+
+/* terms written before the serializer resets the dictionary */
+#define LIBRDF_BINARY_MAX_TERMS (1 << 20)
+
+#define LIBRDF_BINARY_MIME_TYPE "application/x-librdf-binary"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
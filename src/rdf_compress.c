@@ -0,0 +1,638 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_compress.c - librdf compressed file iostreams
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+ 
+ 
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <redland.h>
+
+
+/*
+ * Compressed files
+ *
+ * gzip and zstd files are read and written through raptor iostreams
+ * that compress or decompress with a buffer of
+ * LIBRDF_COMPRESS_BUFFER_SIZE bytes as the data passes, so parsers
+ * and serializers work on them without a temporary file or an
+ * external process.  Files of several gzip members or zstd frames, as
+ * made by appending, are read as one.
+ */
+
+#define LIBRDF_COMPRESS_BUFFER_SIZE (128 * 1024)
+
+
+static const struct {
+  const char *name;
+  const char *suffix;
+} librdf_compression_info[] = {
+  { "none", NULL },
+  { "gzip", ".gz" },
+  { "zstd", ".zst" }
+};
+
+
+/*
+ * librdf_compression_from_filename:
+ * @filename: file name
+ *
+ * INTERNAL - Get the compression of a file from its name suffix
+ *
+ * Return value: compression, LIBRDF_COMPRESSION_NONE if not known
+ */
+librdf_compression
+librdf_compression_from_filename(const char *filename)
+{
+  size_t len;
+  int i;
+
+  if(!filename)
+    return LIBRDF_COMPRESSION_NONE;
+
+  len = strlen(filename);
+  for(i = LIBRDF_COMPRESSION_GZIP; i <= LIBRDF_COMPRESSION_ZSTD; i++) {
+    const char *suffix = librdf_compression_info[i].suffix;
+    size_t suffix_len = strlen(suffix);
+
+    if(len > suffix_len && !strcmp(filename + len - suffix_len, suffix))
+      return (librdf_compression)i;
+  }
+
+  return LIBRDF_COMPRESSION_NONE;
+}
+
+
+/*
+ * librdf_compression_from_string:
+ * @string: "none", "gzip", "zstd" or "auto"
+ * @compression_p: pointer to store compression
+ *
+ * INTERNAL - Get a compression from its name
+ *
+ * Return value: non 0 if the name is not known
+ */
+int
+librdf_compression_from_string(const char *string,
+                               librdf_compression *compression_p)
+{
+  int i;
+
+  if(!strcmp(string, "auto")) {
+    *compression_p = LIBRDF_COMPRESSION_AUTO;
+    return 0;
+  }
+
+  for(i = LIBRDF_COMPRESSION_NONE; i <= LIBRDF_COMPRESSION_ZSTD; i++) {
+    if(!strcmp(string, librdf_compression_info[i].name)) {
+      *compression_p = (librdf_compression)i;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*
+ * librdf_compression_to_string:
+ * @compression: compression
+ *
+ * INTERNAL - Get the name of a compression
+ *
+ * Return value: shared name string
+ */
+const char*
+librdf_compression_to_string(librdf_compression compression)
+{
+  if(compression == LIBRDF_COMPRESSION_AUTO)
+    return "auto";
+
+  return librdf_compression_info[compression].name;
+}
+
+
+/*
+ * librdf_compression_choose:
+ * @compression: compression chosen by an option or LIBRDF_COMPRESSION_AUTO
+ * @filename: file name or NULL
+ *
+ * INTERNAL - Get the compression to use for a file
+ *
+ * Return value: @compression or the one from the name when AUTO
+ */
+librdf_compression
+librdf_compression_choose(librdf_compression compression,
+                          const char *filename)
+{
+  if(compression != LIBRDF_COMPRESSION_AUTO)
+    return compression;
+
+  return librdf_compression_from_filename(filename);
+}
+
+
+typedef struct {
+  FILE *fh;
+  librdf_compression compression;
+  /* non 0 when compressing, 0 when decompressing */
+  int writing;
+
+  unsigned char *buffer;
+
+  /* when decompressing, the input in buffer from buffer_position */
+  size_t buffer_len;
+  size_t buffer_position;
+  int input_eof;
+
+  /* non 0 at the end of the decompressed data or on an error */
+  int eof;
+  int failed;
+
+#ifdef HAVE_ZLIB
+  z_stream z;
+  int z_started;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CStream *cstream;
+  ZSTD_DStream *dstream;
+#endif
+} librdf_compress_context;
+
+
+static void
+librdf_compress_iostream_finish(void *user_data)
+{
+  librdf_compress_context* context = (librdf_compress_context*)user_data;
+
+#ifdef HAVE_ZLIB
+  if(context->z_started) {
+    if(context->writing)
+      deflateEnd(&context->z);
+    else
+      inflateEnd(&context->z);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if(context->cstream)
+    ZSTD_freeCStream(context->cstream);
+  if(context->dstream)
+    ZSTD_freeDStream(context->dstream);
+#endif
+
+  if(context->buffer)
+    LIBRDF_FREE(char*, context->buffer);
+  LIBRDF_FREE(librdf_compress_context, context);
+}
+
+
+/* Write the compressed bytes of buffer out to the file */
+static int
+librdf_compress_iostream_write_out(librdf_compress_context* context,
+                                   size_t len)
+{
+  if(len && fwrite(context->buffer, 1, len, context->fh) != len)
+    context->failed = 1;
+
+  return context->failed;
+}
+
+
+/*
+ * librdf_compress_iostream_compress:
+ * @context: compress context
+ * @ptr: bytes to compress
+ * @len: number of bytes
+ * @end: non 0 to end the compressed data
+ *
+ * INTERNAL - Compress bytes and write them out as the buffer fills
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_compress_iostream_compress(librdf_compress_context* context,
+                                  const void *ptr, size_t len, int end)
+{
+  if(context->failed)
+    return 1;
+
+#ifdef HAVE_ZLIB
+  if(context->compression == LIBRDF_COMPRESSION_GZIP) {
+    int flush = end ? Z_FINISH : Z_NO_FLUSH;
+    int rc;
+
+    context->z.next_in = (Bytef*)ptr;
+    context->z.avail_in = LIBRDF_BAD_CAST(uInt, len);
+    do {
+      context->z.next_out = context->buffer;
+      context->z.avail_out = LIBRDF_COMPRESS_BUFFER_SIZE;
+      rc = deflate(&context->z, flush);
+      if(rc == Z_STREAM_ERROR) {
+        context->failed = 1;
+        return 1;
+      }
+      if(librdf_compress_iostream_write_out(context,
+                                            LIBRDF_COMPRESS_BUFFER_SIZE - context->z.avail_out))
+        return 1;
+    } while(context->z.avail_in || !context->z.avail_out ||
+            (end && rc != Z_STREAM_END));
+    return 0;
+  }
+#endif
+
+#ifdef HAVE_ZSTD
+  if(context->compression == LIBRDF_COMPRESSION_ZSTD) {
+    ZSTD_EndDirective mode = end ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_inBuffer input;
+    size_t remaining;
+
+    input.src = ptr;
+    input.size = len;
+    input.pos = 0;
+    do {
+      ZSTD_outBuffer output;
+
+      output.dst = context->buffer;
+      output.size = LIBRDF_COMPRESS_BUFFER_SIZE;
+      output.pos = 0;
+      remaining = ZSTD_compressStream2(context->cstream, &output, &input,
+                                       mode);
+      if(ZSTD_isError(remaining)) {
+        context->failed = 1;
+        return 1;
+      }
+      if(librdf_compress_iostream_write_out(context, output.pos))
+        return 1;
+    } while(input.pos < input.size || (end && remaining));
+    return 0;
+  }
+#endif
+
+  context->failed = 1;
+  return 1;
+}
+
+
+static int
+librdf_compress_iostream_write_byte(void *user_data, const int byte)
+{
+  unsigned char c = LIBRDF_BAD_CAST(unsigned char, byte);
+
+  return librdf_compress_iostream_compress((librdf_compress_context*)user_data,
+                                           &c, 1, 0);
+}
+
+
+static int
+librdf_compress_iostream_write_bytes(void *user_data, const void *ptr,
+                                     size_t size, size_t nmemb)
+{
+  librdf_compress_context* context = (librdf_compress_context*)user_data;
+
+  if(librdf_compress_iostream_compress(context, ptr, size * nmemb, 0))
+    return -1;
+
+  return LIBRDF_BAD_CAST(int, nmemb);
+}
+
+
+static int
+librdf_compress_iostream_write_end(void *user_data)
+{
+  librdf_compress_context* context = (librdf_compress_context*)user_data;
+
+  if(librdf_compress_iostream_compress(context, NULL, 0, 1))
+    return 1;
+
+  return fflush(context->fh) ? 1 : 0;
+}
+
+
+/* Refill the input buffer from the file when it is used up */
+static int
+librdf_compress_iostream_fill(librdf_compress_context* context)
+{
+  if(context->buffer_position < context->buffer_len || context->input_eof)
+    return 0;
+
+  context->buffer_len = fread(context->buffer, 1, LIBRDF_COMPRESS_BUFFER_SIZE,
+                              context->fh);
+  context->buffer_position = 0;
+  if(context->buffer_len < LIBRDF_COMPRESS_BUFFER_SIZE) {
+    if(ferror(context->fh)) {
+      context->failed = 1;
+      return 1;
+    }
+    context->input_eof = 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_compress_iostream_decompress:
+ * @context: compress context
+ * @ptr: output
+ * @len: size of @ptr
+ *
+ * INTERNAL - Decompress into ptr until it is full or the data ends
+ *
+ * Return value: bytes decompressed or <0 on failure
+ */
+static long
+librdf_compress_iostream_decompress(librdf_compress_context* context,
+                                    void *ptr, size_t len)
+{
+  size_t out_len = 0;
+
+  while(out_len < len && !context->eof) {
+    size_t avail;
+
+    if(librdf_compress_iostream_fill(context))
+      return -1;
+
+    avail = context->buffer_len - context->buffer_position;
+    if(!avail && context->input_eof) {
+      context->eof = 1;
+      break;
+    }
+
+#ifdef HAVE_ZLIB
+    if(context->compression == LIBRDF_COMPRESSION_GZIP) {
+      int rc;
+
+      context->z.next_in = context->buffer + context->buffer_position;
+      context->z.avail_in = LIBRDF_BAD_CAST(uInt, avail);
+      context->z.next_out = (Bytef*)ptr + out_len;
+      context->z.avail_out = LIBRDF_BAD_CAST(uInt, len - out_len);
+      rc = inflate(&context->z, Z_NO_FLUSH);
+      context->buffer_position += avail - context->z.avail_in;
+      out_len = len - context->z.avail_out;
+
+      if(rc == Z_STREAM_END) {
+        /* another member may follow */
+        inflateReset(&context->z);
+      } else if(rc != Z_OK && rc != Z_BUF_ERROR) {
+        context->failed = 1;
+        return -1;
+      }
+      continue;
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    if(context->compression == LIBRDF_COMPRESSION_ZSTD) {
+      ZSTD_inBuffer input;
+      ZSTD_outBuffer output;
+      size_t rc;
+
+      input.src = context->buffer + context->buffer_position;
+      input.size = avail;
+      input.pos = 0;
+      output.dst = ptr;
+      output.size = len;
+      output.pos = out_len;
+      /* frames that follow each other are decoded in turn */
+      rc = ZSTD_decompressStream(context->dstream, &output, &input);
+      if(ZSTD_isError(rc)) {
+        context->failed = 1;
+        return -1;
+      }
+      context->buffer_position += input.pos;
+      out_len = output.pos;
+      continue;
+    }
+#endif
+
+    context->failed = 1;
+    return -1;
+  }
+
+  return LIBRDF_BAD_CAST(long, out_len);
+}
+
+
+static int
+librdf_compress_iostream_read_bytes(void *user_data, void *ptr,
+                                    size_t size, size_t nmemb)
+{
+  librdf_compress_context* context = (librdf_compress_context*)user_data;
+  long len;
+
+  if(!size)
+    return 0;
+
+  len = librdf_compress_iostream_decompress(context, ptr, size * nmemb);
+  if(len < 0)
+    return -1;
+
+  return LIBRDF_BAD_CAST(int, LIBRDF_GOOD_CAST(size_t, len) / size);
+}
+
+
+static int
+librdf_compress_iostream_read_eof(void *user_data)
+{
+  librdf_compress_context* context = (librdf_compress_context*)user_data;
+
+  return context->eof || context->failed;
+}
+
+
+static const raptor_iostream_handler librdf_compress_iostream_write_handler = {
+  /* .version     = */ 2,
+  /* .init        = */ NULL,
+  /* .finish      = */ librdf_compress_iostream_finish,
+  /* .write_byte  = */ librdf_compress_iostream_write_byte,
+  /* .write_bytes = */ librdf_compress_iostream_write_bytes,
+  /* .write_end   = */ librdf_compress_iostream_write_end,
+  /* .read_bytes  = */ NULL,
+  /* .read_eof    = */ NULL
+};
+
+static const raptor_iostream_handler librdf_compress_iostream_read_handler = {
+  /* .version     = */ 2,
+  /* .init        = */ NULL,
+  /* .finish      = */ librdf_compress_iostream_finish,
+  /* .write_byte  = */ NULL,
+  /* .write_bytes = */ NULL,
+  /* .write_end   = */ NULL,
+  /* .read_bytes  = */ librdf_compress_iostream_read_bytes,
+  /* .read_eof    = */ librdf_compress_iostream_read_eof
+};
+
+
+/*
+ * librdf_new_compress_context:
+ * @world: world
+ * @fh: file handle
+ * @compression: compression
+ * @writing: non 0 to compress, 0 to decompress
+ *
+ * INTERNAL - Make the state of a compressing or decompressing iostream
+ *
+ * Return value: new context or NULL on failure
+ */
+static librdf_compress_context*
+librdf_new_compress_context(librdf_world* world, FILE *fh,
+                            librdf_compression compression, int writing)
+{
+  librdf_compress_context* context;
+  int ok = 0;
+
+  context = LIBRDF_CALLOC(librdf_compress_context*, 1, sizeof(*context));
+  if(!context)
+    return NULL;
+
+  context->fh = fh;
+  context->compression = compression;
+  context->writing = writing;
+
+  context->buffer = LIBRDF_MALLOC(unsigned char*, LIBRDF_COMPRESS_BUFFER_SIZE);
+  if(!context->buffer) {
+    librdf_compress_iostream_finish(context);
+    return NULL;
+  }
+
+  switch(compression) {
+    case LIBRDF_COMPRESSION_GZIP:
+#ifdef HAVE_ZLIB
+      /* 16 + window bits writes a gzip header; 32 + reads gzip or zlib */
+      if(writing)
+        ok = (deflateInit2(&context->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                           16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+      else
+        ok = (inflateInit2(&context->z, 32 + MAX_WBITS) == Z_OK);
+      context->z_started = ok;
+#endif
+      break;
+
+    case LIBRDF_COMPRESSION_ZSTD:
+#ifdef HAVE_ZSTD
+      if(writing) {
+        context->cstream = ZSTD_createCStream();
+        ok = (context->cstream != NULL);
+      } else {
+        context->dstream = ZSTD_createDStream();
+        ok = (context->dstream != NULL);
+      }
+#endif
+      break;
+
+    case LIBRDF_COMPRESSION_AUTO:
+    case LIBRDF_COMPRESSION_NONE:
+    default:
+      break;
+  }
+
+  if(!ok) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_FILES, NULL,
+               "%s compression is not supported",
+               librdf_compression_to_string(compression));
+    librdf_compress_iostream_finish(context);
+    return NULL;
+  }
+
+  return context;
+}
+
+
+/*
+ * librdf_new_compressed_iostream_to_file_handle:
+ * @world: world
+ * @fh: file handle to write to
+ * @compression: compression
+ *
+ * INTERNAL - Make an iostream writing compressed data to a file handle
+ *
+ * The compressed data is ended when the iostream is freed.  The file
+ * handle is not closed.
+ *
+ * Return value: new iostream or NULL on failure
+ */
+raptor_iostream*
+librdf_new_compressed_iostream_to_file_handle(librdf_world* world, FILE *fh,
+                                              librdf_compression compression)
+{
+  librdf_compress_context* context;
+  raptor_iostream* iostr;
+
+  context = librdf_new_compress_context(world, fh, compression, 1);
+  if(!context)
+    return NULL;
+
+  iostr = raptor_new_iostream_from_handler(world->raptor_world_ptr, context,
+                                           &librdf_compress_iostream_write_handler);
+  if(!iostr)
+    librdf_compress_iostream_finish(context);
+
+  return iostr;
+}
+
+
+/*
+ * librdf_new_decompressed_iostream_from_file_handle:
+ * @world: world
+ * @fh: file handle to read from
+ * @compression: compression
+ *
+ * INTERNAL - Make an iostream reading decompressed data from a file handle
+ *
+ * The file handle is not closed.
+ *
+ * Return value: new iostream or NULL on failure
+ */
+raptor_iostream*
+librdf_new_decompressed_iostream_from_file_handle(librdf_world* world,
+                                                  FILE *fh,
+                                                  librdf_compression compression)
+{
+  librdf_compress_context* context;
+  raptor_iostream* iostr;
+
+  context = librdf_new_compress_context(world, fh, compression, 0);
+  if(!context)
+    return NULL;
+
+  iostr = raptor_new_iostream_from_handler(world->raptor_world_ptr, context,
+                                           &librdf_compress_iostream_read_handler);
+  if(!iostr)
+    librdf_compress_iostream_finish(context);
+
+  return iostr;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_compress_internal.h - librdf compressed file internals
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+
+#ifndef LIBRDF_COMPRESS_INTERNAL_H
+#define LIBRDF_COMPRESS_INTERNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  /* compression not chosen; use the file name */
+  LIBRDF_COMPRESSION_AUTO = -1,
+  LIBRDF_COMPRESSION_NONE,
+  LIBRDF_COMPRESSION_GZIP,
+  LIBRDF_COMPRESSION_ZSTD
+} librdf_compression;
+
+librdf_compression librdf_compression_from_filename(const char *filename);
+int librdf_compression_from_string(const char *string, librdf_compression *compression_p);
+const char* librdf_compression_to_string(librdf_compression compression);
+librdf_compression librdf_compression_choose(librdf_compression compression, const char *filename);
+
+raptor_iostream* librdf_new_compressed_iostream_to_file_handle(librdf_world* world, FILE *fh, librdf_compression compression);
+raptor_iostream* librdf_new_decompressed_iostream_from_file_handle(librdf_world* world, FILE *fh, librdf_compression compression);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -81,12 +81,12 @@ static const unsigned char * const librdf_concept_schema_namespace=(const unsign
  *
  * INTERNAL - Initialise the concepts module.
  * 
+ * Only the namespace URIs are made here; the concept nodes are made
+ * by the first call that returns one.
  **/
 void
 librdf_init_concepts(librdf_world *world)
 {
-  int i;
-
   /* Create the Unique URI objects */
   world->concept_ms_namespace_uri = librdf_new_uri(world, librdf_concept_ms_namespace);
   world->concept_schema_namespace_uri = librdf_new_uri(world, librdf_concept_schema_namespace);
@@ -95,6 +95,19 @@ librdf_init_concepts(librdf_world *world)
      !world->concept_schema_namespace_uri ||
      !world->xsd_namespace_uri)
     LIBRDF_FATAL1(world, LIBRDF_FROM_CONCEPTS, "Out of memory creating namespace URIs");
+}
+
+
+/*
+ * librdf_concepts_load:
+ * @world: redland world object
+ *
+ * INTERNAL - Make the RDF and RDF Schema concept nodes and URIs.
+ */
+static void
+librdf_concepts_load(librdf_world *world)
+{
+  int i;
 
   /* Create arrays for the M&S and Schema resource nodes and uris */
   world->concept_uris = LIBRDF_CALLOC(librdf_uri**, LIBRDF_CONCEPT_LAST + 1,
@@ -175,6 +188,7 @@ librdf_get_concept_by_name(librdf_world *world, int is_ms,
   int i;
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->concepts_loaded, librdf_concepts_load);
 
   for (i=0; i < LIBRDF_CONCEPT_LAST; i++) {
     int this_is_ms = !(LIBRDF_CONCEPT_FIRST_S_ID <= i && 
@@ -206,6 +220,7 @@ librdf_get_concept_resource_by_index(librdf_world *world,
                                      librdf_concepts_index idx)
 {
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->concepts_loaded, librdf_concepts_load);
 
   if ((int)idx < 0 || idx > LIBRDF_CONCEPT_LAST)
     return NULL;
@@ -228,6 +243,7 @@ librdf_get_concept_uri_by_index(librdf_world *world,
                                 librdf_concepts_index idx)
 {
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->concepts_loaded, librdf_concepts_load);
 
   if ((int)idx < 0 || idx > LIBRDF_CONCEPT_LAST)
     return NULL;
@@ -281,6 +297,7 @@ librdf_finish_concepts(librdf_world *world)
     LIBRDF_FREE(librdf_uri**, world->concept_uris);
     world->concept_uris=NULL;
   }
+  world->concepts_loaded=0;
 }
 
 #endif
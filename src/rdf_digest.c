@@ -416,6 +416,76 @@ librdf_digest_print(librdf_digest* digest, FILE* fh)
 }
 
 
+/* digest contexts no larger than this are kept on the stack */
+#define LIBRDF_DIGEST_BUFFER_CONTEXT_SIZE 512
+
+/**
+ * librdf_digest_buffer:
+ * @world: redland world object
+ * @name: the digest name such as "MD5" or "SHA1" or NULL for the default
+ * @data: the bytes to digest
+ * @length: number of bytes in @data
+ * @out: buffer to write the digest into
+ *
+ * Digest a buffer in one call without constructing a #librdf_digest.
+ *
+ * This avoids the allocation of a digest object and its context for
+ * each value, which dominates the cost of digesting short strings such
+ * as node values.  @out must be large enough for the digest, 20 bytes
+ * holds MD5 and SHA1 digests.
+ *
+ * Return value: the length of the digest written to @out or 0 on failure
+ **/
+size_t
+librdf_digest_buffer(librdf_world* world, const char* name,
+                     const unsigned char* data, size_t length,
+                     unsigned char* out)
+{
+  librdf_digest_factory* factory;
+  union {
+    double d;
+    void* p;
+    long l;
+    unsigned char bytes[LIBRDF_DIGEST_BUFFER_CONTEXT_SIZE];
+  } stack_context;
+  void* context;
+  size_t digest_length;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, 0);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(out, unsigned char*, 0);
+
+  librdf_world_open(world);
+
+  if(name)
+    factory = librdf_get_digest_factory(world, name);
+  else
+    factory = world->digest_factory;
+  if(!factory)
+    return 0;
+
+  if(factory->context_length <= sizeof(stack_context))
+    context = &stack_context;
+  else {
+    context = LIBRDF_MALLOC(void*, factory->context_length);
+    if(!context)
+      return 0;
+  }
+
+  factory->init(context);
+  if(length)
+    factory->update(context, data, length);
+  factory->final(context);
+
+  digest_length = factory->digest_length;
+  memcpy(out, factory->get_digest(context), digest_length);
+
+  if(context != &stack_context)
+    LIBRDF_FREE(void*, context);
+
+  return digest_length;
+}
+
+
 /**
  * librdf_init_digest:
  * @world: redland world object
@@ -429,14 +499,18 @@ librdf_init_digest(librdf_world *world)
 #ifdef HAVE_OPENSSL_DIGESTS
   librdf_digest_openssl_constructor(world);
 #endif
+  /* the local implementations are only used where OpenSSL did not
+   * provide the digest */
 #ifdef HAVE_LOCAL_MD5_DIGEST
-  librdf_digest_md5_constructor(world);
+  if(!librdf_get_digest_factory(world, "MD5"))
+    librdf_digest_md5_constructor(world);
 #endif
 #ifdef HAVE_LOCAL_RIPEMD160_DIGEST
   librdf_digest_rmd160_constructor(world);
 #endif
 #ifdef HAVE_LOCAL_SHA1_DIGEST
-  librdf_digest_sha1_constructor(world);
+  if(!librdf_get_digest_factory(world, "SHA1"))
+    librdf_digest_sha1_constructor(world);
 #endif
 
   /* set default */
@@ -484,6 +558,7 @@ main(int argc, char *argv[])
     {NULL, NULL},
   };
   int failures=0;
+  unsigned char buffer_digest[64];
 
   int i;
   struct t *answer=NULL;
@@ -523,6 +598,15 @@ main(int argc, char *argv[])
     } else
       fprintf(stderr, "%s: %s digest is correct\n", program, answer->type);
     LIBRDF_FREE(char*, s);
+
+    if(librdf_digest_buffer(world, answer->type,
+                            (const unsigned char*)test_data, strlen(test_data),
+                            buffer_digest) != librdf_digest_get_digest_length(d) ||
+       memcmp(buffer_digest, librdf_digest_get_digest(d),
+              librdf_digest_get_digest_length(d))) {
+      fprintf(stderr, "%s: %s buffer digest is wrong\n", program, answer->type);
+      failures++;
+    }
     
     fprintf(stdout, "%s: Freeing digest\n", program);
     librdf_free_digest(d);
@@ -63,6 +63,9 @@ char* librdf_digest_to_string(librdf_digest* digest);
 REDLAND_API
 void librdf_digest_print(librdf_digest* digest, FILE* fh);
 
+REDLAND_API
+size_t librdf_digest_buffer(librdf_world* world, const char* name, const unsigned char* data, size_t length, unsigned char* out);
+
 #ifdef __cplusplus
 }
 #endif
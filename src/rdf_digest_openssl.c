@@ -0,0 +1,177 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_digest_openssl.c - RDF Digest OpenSSL Digest interface
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+/* The MD5 and SHA1 functions below are deprecated from OpenSSL 3.0 in
+ * favour of EVP, which needs a context freed after use that the digest
+ * factory has no method for.  They remain and use the same assembler
+ * and CPU SHA instructions. */
+#define OPENSSL_SUPPRESS_DEPRECATED 1
+
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+#include <redland.h>
+
+
+/* The OpenSSL context and the digest from the final call */
+typedef struct {
+  MD5_CTX context;
+  unsigned char digest[MD5_DIGEST_LENGTH];
+} librdf_digest_openssl_md5_context;
+
+typedef struct {
+  SHA_CTX context;
+  unsigned char digest[SHA_DIGEST_LENGTH];
+} librdf_digest_openssl_sha1_context;
+
+
+/* MD5 */
+
+static void
+librdf_digest_openssl_md5_init(void *context)
+{
+  librdf_digest_openssl_md5_context* c=(librdf_digest_openssl_md5_context*)context;
+
+  MD5_Init(&c->context);
+}
+
+
+static void
+librdf_digest_openssl_md5_update(void *context,
+                                 const unsigned char *buf, size_t length)
+{
+  librdf_digest_openssl_md5_context* c=(librdf_digest_openssl_md5_context*)context;
+
+  MD5_Update(&c->context, buf, length);
+}
+
+
+static void
+librdf_digest_openssl_md5_final(void *context)
+{
+  librdf_digest_openssl_md5_context* c=(librdf_digest_openssl_md5_context*)context;
+
+  MD5_Final(c->digest, &c->context);
+}
+
+
+static unsigned char *
+librdf_digest_openssl_md5_get_digest(void *context)
+{
+  librdf_digest_openssl_md5_context* c=(librdf_digest_openssl_md5_context*)context;
+
+  return c->digest;
+}
+
+
+static void
+librdf_digest_openssl_md5_register_factory(librdf_digest_factory *factory)
+{
+  factory->context_length = sizeof(librdf_digest_openssl_md5_context);
+  factory->digest_length = MD5_DIGEST_LENGTH;
+
+  factory->init  = librdf_digest_openssl_md5_init;
+  factory->update = librdf_digest_openssl_md5_update;
+  factory->final = librdf_digest_openssl_md5_final;
+  factory->get_digest  = librdf_digest_openssl_md5_get_digest;
+}
+
+
+/* SHA1 */
+
+static void
+librdf_digest_openssl_sha1_init(void *context)
+{
+  librdf_digest_openssl_sha1_context* c=(librdf_digest_openssl_sha1_context*)context;
+
+  SHA1_Init(&c->context);
+}
+
+
+static void
+librdf_digest_openssl_sha1_update(void *context,
+                                  const unsigned char *buf, size_t length)
+{
+  librdf_digest_openssl_sha1_context* c=(librdf_digest_openssl_sha1_context*)context;
+
+  SHA1_Update(&c->context, buf, length);
+}
+
+
+static void
+librdf_digest_openssl_sha1_final(void *context)
+{
+  librdf_digest_openssl_sha1_context* c=(librdf_digest_openssl_sha1_context*)context;
+
+  SHA1_Final(c->digest, &c->context);
+}
+
+
+static unsigned char *
+librdf_digest_openssl_sha1_get_digest(void *context)
+{
+  librdf_digest_openssl_sha1_context* c=(librdf_digest_openssl_sha1_context*)context;
+
+  return c->digest;
+}
+
+
+static void
+librdf_digest_openssl_sha1_register_factory(librdf_digest_factory *factory)
+{
+  factory->context_length = sizeof(librdf_digest_openssl_sha1_context);
+  factory->digest_length = SHA_DIGEST_LENGTH;
+
+  factory->init  = librdf_digest_openssl_sha1_init;
+  factory->update = librdf_digest_openssl_sha1_update;
+  factory->final = librdf_digest_openssl_sha1_final;
+  factory->get_digest  = librdf_digest_openssl_sha1_get_digest;
+}
+
+
+/**
+ * librdf_digest_openssl_constructor:
+ * @world: redland world object
+ *
+ * Initialise the OpenSSL MD5 and SHA1 digest factories.
+ *
+ **/
+void
+librdf_digest_openssl_constructor(librdf_world *world)
+{
+  librdf_digest_register_factory(world,
+                                 "MD5", &librdf_digest_openssl_md5_register_factory);
+  librdf_digest_register_factory(world,
+                                 "SHA1", &librdf_digest_openssl_sha1_register_factory);
+}
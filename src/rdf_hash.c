@@ -88,6 +88,10 @@ librdf_init_hash(librdf_world *world)
 #ifdef HAVE_BDB_HASH
   librdf_init_hash_bdb(world);
 #endif
+#ifdef HAVE_MMAP_HASH
+  librdf_init_hash_mmap(world);
+#endif
+  librdf_init_hash_memory_flat(world);
   /* Always have hash in memory implementation available */
   librdf_init_hash_memory(world);
 }
@@ -131,7 +135,10 @@ librdf_delete_hash_factories(librdf_world *world)
 static void
 librdf_init_hash_datums(librdf_world *world)
 {
-  world->hash_datums_list=NULL;
+  int i;
+
+  for(i=0; i < LIBRDF_HASH_DATUMS_STRIPES; i++)
+    world->hash_datums_list[i]=NULL;
 }
 
 
@@ -139,21 +146,53 @@ static void
 librdf_free_hash_datums(librdf_world *world)
 {
   librdf_hash_datum *datum, *next;
+  int i;
   
+  for(i=0; i < LIBRDF_HASH_DATUMS_STRIPES; i++) {
 #ifdef WITH_THREADS
-  if(world->hash_datums_mutex)
-    pthread_mutex_lock(world->hash_datums_mutex);
+    if(world->hash_datums_mutex)
+      pthread_mutex_lock(&world->hash_datums_mutex[i]);
 #endif
 
-  for(datum = world->hash_datums_list; datum; datum = next) {
-    next = datum->next;
-    LIBRDF_FREE(librdf_hash_datum, datum);
+    for(datum = world->hash_datums_list[i]; datum; datum = next) {
+      next = datum->next;
+      LIBRDF_FREE(librdf_hash_datum, datum);
+    }
+    world->hash_datums_list[i] = NULL;
+
+#ifdef WITH_THREADS
+    if(world->hash_datums_mutex)
+      pthread_mutex_unlock(&world->hash_datums_mutex[i]);
+#endif
   }
-  world->hash_datums_list = NULL;
+}
 
+
+/*
+ * librdf_hash_datums_stripe:
+ *
+ * INTERNAL - Get the hash datum free list stripe for the calling thread.
+ *
+ * pthread_t is opaque so its bytes are hashed.  Datums may be freed
+ * onto a different stripe from the one they came from, which only
+ * moves them between free lists.
+ */
+static int
+librdf_hash_datums_stripe(void)
+{
 #ifdef WITH_THREADS
-  if(world->hash_datums_mutex)
-    pthread_mutex_unlock(world->hash_datums_mutex);
+  pthread_t self=pthread_self();
+  const unsigned char *p=(const unsigned char*)&self;
+  unsigned int h=0;
+  size_t i;
+
+  for(i=0; i < sizeof(self); i++)
+    h = (h * 31) + p[i];
+  h ^= (h >> 16);
+  h ^= (h >> 7);
+  return (int)(h & (LIBRDF_HASH_DATUMS_STRIPES - 1));
+#else
+  return 0;
 #endif
 }
 
@@ -172,26 +211,31 @@ librdf_hash_datum*
 librdf_new_hash_datum(librdf_world *world, void *data, size_t size)
 {
   librdf_hash_datum *datum;
+  int stripe;
 
   librdf_world_open(world);
 
+  stripe=librdf_hash_datums_stripe();
+
 #ifdef WITH_THREADS
-  pthread_mutex_lock(world->hash_datums_mutex);
+  pthread_mutex_lock(&world->hash_datums_mutex[stripe]);
 #endif
 
-  /* get one from free list, or allocate new one */ 
-  if((datum = world->hash_datums_list)) {
-    world->hash_datums_list = datum->next;
-  } else {
+  /* get one from free list */ 
+  if((datum = world->hash_datums_list[stripe]))
+    world->hash_datums_list[stripe] = datum->next;
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&world->hash_datums_mutex[stripe]);
+#endif
+
+  /* or allocate new one, outside the lock */
+  if(!datum) {
     datum = LIBRDF_CALLOC(librdf_hash_datum*, 1, sizeof(*datum));
     if(datum)
       datum->world = world;
   }
 
-#ifdef WITH_THREADS
-   pthread_mutex_unlock(world->hash_datums_mutex);
-#endif
-
   if(datum) {
     datum->data = data;
     datum->size = size;
@@ -211,6 +255,9 @@ librdf_new_hash_datum(librdf_world *world, void *data, size_t size)
 void
 librdf_free_hash_datum(librdf_hash_datum *datum) 
 {
+  librdf_world *world;
+  int stripe;
+
   if(!datum)
     return;
   
@@ -222,15 +269,18 @@ librdf_free_hash_datum(librdf_hash_datum *datum)
     datum->data = NULL;
   }
 
+  world=datum->world;
+  stripe=librdf_hash_datums_stripe();
+
 #ifdef WITH_THREADS
-  pthread_mutex_lock(datum->world->hash_datums_mutex);
+  pthread_mutex_lock(&world->hash_datums_mutex[stripe]);
 #endif
 
-  datum->next = datum->world->hash_datums_list;
-  datum->world->hash_datums_list = datum;
+  datum->next = world->hash_datums_list[stripe];
+  world->hash_datums_list[stripe] = datum;
 
 #ifdef WITH_THREADS
-  pthread_mutex_unlock(datum->world->hash_datums_mutex);
+  pthread_mutex_unlock(&world->hash_datums_mutex[stripe]);
 #endif
 }
 
@@ -512,6 +562,55 @@ librdf_new_hash_from_hash(librdf_hash* old_hash)
 }
 
 
+/**
+ * librdf_new_hash_snapshot:
+ * @old_hash: the open hash to take a snapshot of
+ *
+ * Constructor - create a read-only view of an existing hash.
+ *
+ * The new hash sees the keys and values of @old_hash as they were
+ * when the snapshot was taken, whatever is written to @old_hash
+ * afterwards.  No data is copied so @old_hash must not be freed
+ * before the snapshot.  The snapshot is returned open; puts and
+ * deletes on it fail.
+ *
+ * Return value: a new #librdf_hash object or NULL on failure or if
+ * the hash factory does not support snapshots
+ */
+librdf_hash*
+librdf_new_hash_snapshot(librdf_hash* old_hash)
+{
+  librdf_hash* hash;
+
+  if(!old_hash->factory->snapshot || !old_hash->is_open)
+    return NULL;
+
+  hash = LIBRDF_CALLOC(librdf_hash*, 1, sizeof(*hash));
+  if(!hash)
+    return NULL;
+
+  hash->world=old_hash->world;
+  hash->factory=old_hash->factory;
+
+  hash->context = LIBRDF_CALLOC(void*, 1, hash->factory->context_length);
+  if(!hash->context) {
+    librdf_free_hash(hash);
+    return NULL;
+  }
+
+  if(hash->factory->snapshot(hash, hash->context, old_hash->context)) {
+    LIBRDF_FREE(librdf_hash_context, hash->context);
+    LIBRDF_FREE(librdf_hash, hash);
+    return NULL;
+  }
+
+  /* so that librdf_free_hash() closes it */
+  hash->is_open=1;
+
+  return hash;
+}
+
+
 /**
  * librdf_free_hash:
  * @hash: hash object
@@ -718,9 +817,41 @@ typedef struct {
   librdf_hash_datum next_value;
   int is_end;
   int one_key;
+
+  /* for librdf_hash_get_prefix: copy of the prefix and if the cursor
+   * returns keys in order so the scan can stop at the first mismatch */
+  unsigned char* prefix;
+  size_t prefix_len;
+  int ordered;
 } librdf_hash_get_all_iterator_context;
 
 
+/*
+ * librdf_hash_get_all_iterator_match_prefix - skip to the next key
+ * with the prefix, given the status of the last cursor move
+ */
+static int
+librdf_hash_get_all_iterator_match_prefix(librdf_hash_get_all_iterator_context* context,
+                                          int status)
+{
+  while(!status) {
+    if(context->next_key.size >= context->prefix_len &&
+       !memcmp(context->next_key.data, context->prefix, context->prefix_len))
+      return 0;
+
+    /* all keys with the prefix have been passed */
+    if(context->ordered)
+      return 1;
+
+    context->next_key.data=NULL;
+    status=librdf_hash_cursor_get_next(context->cursor, &context->next_key,
+                                       &context->next_value);
+  }
+
+  return status;
+}
+
+
 
 /**
  * librdf_hash_get_all:
@@ -813,6 +944,9 @@ librdf_hash_get_all_iterator_next_method(void* iterator)
                                        &context->next_value);
   }
   
+  if(context->prefix)
+    status=librdf_hash_get_all_iterator_match_prefix(context, status);
+
   if(status)
     context->is_end=1;
 
@@ -840,7 +974,8 @@ librdf_hash_get_all_iterator_get_method(void* iterator, int flags)
       break;
 
     case LIBRDF_ITERATOR_GET_METHOD_GET_KEY:
-      result = &context->next_key;
+      /* next_key is not used when iterating the values of one key */
+      result = context->one_key ? context->key : &context->next_key;
       break;
       
     case LIBRDF_ITERATOR_GET_METHOD_GET_VALUE:
@@ -873,10 +1008,81 @@ librdf_hash_get_all_iterator_finished(void* iterator)
   if(context->value)
     context->value->data=NULL;
 
+  if(context->prefix)
+    LIBRDF_FREE(char*, context->prefix);
+
   LIBRDF_FREE(librdf_hash_get_all_iterator_context, context);
 }
 
 
+/**
+ * librdf_hash_get_prefix:
+ * @hash: hash object
+ * @prefix: pointer to key prefix
+ *
+ * Retrieve all key/value pairs from hash with keys starting with a prefix.
+ * 
+ * Ordered hashes (see librdf_hash_is_ordered()) seek straight to the
+ * prefix and return the keys in order; otherwise every key is tested.
+ * The iterator returns #librdf_hash_datum objects for the keys and values
+ * which are shared and valid only until the iterator moves.
+ * 
+ * Return value: a #librdf_iterator of the key/value pairs or NULL on failure
+ **/
+librdf_iterator*
+librdf_hash_get_prefix(librdf_hash* hash, librdf_hash_datum *prefix)
+{
+  librdf_hash_get_all_iterator_context* context;
+  int status;
+  librdf_iterator* iterator;
+  
+  context = LIBRDF_CALLOC(librdf_hash_get_all_iterator_context*, 1,
+                          sizeof(*context));
+  if(!context)
+    return NULL;
+
+  context->hash=hash;
+
+  /* +1 so that an empty prefix is still allocated */
+  context->prefix=LIBRDF_MALLOC(unsigned char*, prefix->size + 1);
+  if(!context->prefix) {
+    librdf_hash_get_all_iterator_finished(context);
+    return NULL;
+  }
+  if(prefix->size)
+    memcpy(context->prefix, prefix->data, prefix->size);
+  context->prefix_len=prefix->size;
+
+  if(!(context->cursor=librdf_new_hash_cursor(hash))) {
+    librdf_hash_get_all_iterator_finished(context);
+    return NULL;
+  }
+
+  context->ordered=librdf_hash_is_ordered(hash);
+  if(context->ordered) {
+    context->next_key.data=context->prefix;
+    context->next_key.size=context->prefix_len;
+    status=librdf_hash_cursor_set_range(context->cursor, &context->next_key,
+                                        &context->next_value);
+  } else
+    status=librdf_hash_cursor_get_first(context->cursor, &context->next_key, 
+                                        &context->next_value);
+
+  status=librdf_hash_get_all_iterator_match_prefix(context, status);
+  context->is_end=(status != 0);
+  
+  iterator=librdf_new_iterator(hash->world,
+                               (void*)context,
+                               librdf_hash_get_all_iterator_is_end,
+                               librdf_hash_get_all_iterator_next_method,
+                               librdf_hash_get_all_iterator_get_method,
+                               librdf_hash_get_all_iterator_finished);
+  if(!iterator)
+    librdf_hash_get_all_iterator_finished(context);
+  return iterator;
+}
+
+
 /**
  * librdf_hash_get_del:
  * @hash: hash object
@@ -948,6 +1154,77 @@ librdf_hash_exists(librdf_hash* hash, librdf_hash_datum *key,
 }
 
 
+/**
+ * librdf_hash_put_batch:
+ * @hash: hash object
+ * @keys: array of keys
+ * @values: array of values
+ * @count: number of key/value pairs
+ *
+ * Insert an array of key/value pairs into the hash.
+ *
+ * Factories may reorder the pairs to group keys; pairs are inserted
+ * one at a time with librdf_hash_put() if the factory has no batch
+ * method.  As with librdf_hash_put() the keys and values are copied.
+ * On failure some of the pairs may have been inserted.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_put_batch(librdf_hash* hash, librdf_hash_datum *keys,
+                      librdf_hash_datum *values, int count)
+{
+  int i;
+
+  if(hash->factory->put_batch)
+    return hash->factory->put_batch(hash->context, keys, values, count);
+
+  for(i=0; i < count; i++) {
+    if(hash->factory->put(hash->context, &keys[i], &values[i]))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_exists_batch:
+ * @hash: hash object
+ * @keys: array of keys
+ * @values: array of values or NULL to check the keys alone
+ * @count: number of keys
+ * @results: array of count ints to store the results
+ *
+ * Check if each of an array of keys (or key/value pairs) is in the hash.
+ *
+ * results[i] is set as for librdf_hash_exists() on the i-th pair.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_exists_batch(librdf_hash* hash, librdf_hash_datum *keys,
+                         librdf_hash_datum *values, int count,
+                         int *results)
+{
+  int status=0;
+  int i;
+
+  if(hash->factory->exists_batch)
+    return hash->factory->exists_batch(hash->context, keys, values, count,
+                                       results);
+
+  for(i=0; i < count; i++) {
+    results[i]=hash->factory->exists(hash->context, &keys[i],
+                                     values ? &values[i] : NULL);
+    if(results[i] < 0)
+      status=1;
+  }
+
+  return status;
+}
+
+
 /**
  * librdf_hash_delete:
  * @hash: hash object
@@ -1160,6 +1437,205 @@ librdf_hash_get_fd(librdf_hash* hash)
 }
 
 
+/**
+ * librdf_hash_transaction_start:
+ * @hash: hash object
+ *
+ * Start a transaction covering later changes to the hash.
+ *
+ * For the bdb hash this needs the bdb-env-dir and bdb-txn options and
+ * the transaction covers all hashes opened in the same environment.
+ * 
+ * Return value: non 0 on failure or if transactions are not supported
+ **/
+int
+librdf_hash_transaction_start(librdf_hash* hash)
+{
+  if(!hash->factory->transaction_start)
+    return 1;
+  return hash->factory->transaction_start(hash->context);
+}
+
+
+/**
+ * librdf_hash_transaction_commit:
+ * @hash: hash object
+ *
+ * Commit the transaction started with librdf_hash_transaction_start().
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_transaction_commit(librdf_hash* hash)
+{
+  if(!hash->factory->transaction_commit)
+    return 1;
+  return hash->factory->transaction_commit(hash->context);
+}
+
+
+/**
+ * librdf_hash_transaction_rollback:
+ * @hash: hash object
+ *
+ * Discard the changes made since librdf_hash_transaction_start().
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_hash_transaction_rollback(librdf_hash* hash)
+{
+  if(!hash->factory->transaction_rollback)
+    return 1;
+  return hash->factory->transaction_rollback(hash->context);
+}
+
+
+/**
+ * librdf_hash_is_ordered:
+ * @hash: hash object
+ *
+ * Check if hash cursors return keys in byte order and can seek to a key
+ * with librdf_hash_cursor_set_range().
+ *
+ * Return value: non 0 if the hash is ordered
+ **/
+int
+librdf_hash_is_ordered(librdf_hash* hash)
+{
+  if(!hash->factory->is_ordered)
+    return 0;
+  return hash->factory->is_ordered(hash->context);
+}
+
+
+/*
+ * librdf_hash_compact:
+ * @hash: hash object
+ *
+ * INTERNAL - Rewrite the hash in key order, reclaiming the space left
+ * by deleted values.
+ *
+ * The hash stays usable by the same #librdf_hash object afterwards.
+ * Fails while any cursor over the hash is open.
+ *
+ * Return value: non 0 on failure, <0 if the hash cannot be compacted
+ */
+int
+librdf_hash_compact(librdf_hash* hash)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(hash, librdf_hash, 1);
+
+  if(!hash->factory->compact)
+    return -1;
+
+  if(hash->cursors_open) {
+    librdf_log(hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Cannot compact hash %s with %d cursors open",
+               hash->identifier ? hash->identifier : "", hash->cursors_open);
+    return 1;
+  }
+
+  return hash->factory->compact(hash->context);
+}
+
+
+/*
+ * librdf_hash_get_memory_size:
+ * @hash: hash object
+ *
+ * INTERNAL - Get the approximate bytes of process memory held by the hash
+ *
+ * Hashes kept in files such as BerkeleyDB report 0.
+ *
+ * Return value: size in bytes
+ */
+size_t
+librdf_hash_get_memory_size(librdf_hash* hash)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(hash, librdf_hash, 0);
+
+  if(!hash->factory->get_memory_size)
+    return 0;
+  return hash->factory->get_memory_size(hash->context);
+}
+
+
+/*
+ * librdf_hash_put_stat:
+ * @stats: hash of statistics
+ * @key: statistic name
+ * @value: counter value
+ *
+ * INTERNAL - Add a counter to a hash of statistics as a decimal string.
+ *
+ * Return value: non 0 on failure
+ */
+int
+librdf_hash_put_stat(librdf_hash* stats, const char *key, unsigned long value)
+{
+  char buffer[32];
+
+  sprintf(buffer, "%lu", value);
+  return librdf_hash_put_strings(stats, key, buffer);
+}
+
+
+/**
+ * librdf_hash_get_stats:
+ * @hash: hash object
+ *
+ * Get statistics about how the hash is stored, for tuning.
+ *
+ * The result maps statistic names to decimal strings.  All hashes
+ * give <literal>type</literal>, the hash factory name, and
+ * <literal>cursors</literal>, the number of cursors created over the
+ * hash; <literal>values</literal> is given when the hash keeps a
+ * count.  The memory hash adds <literal>keys</literal>,
+ * <literal>buckets</literal>, <literal>buckets-used</literal>,
+ * <literal>load-factor</literal>, <literal>chain-max</literal>,
+ * <literal>chain-mean</literal>, <literal>chains</literal> (the number
+ * of buckets with chains of 1, 2, ... 8 or more keys) and
+ * <literal>resizes</literal>.  The BerkeleyDB hash adds the btree
+ * page counts and the cache counters of its environment including
+ * <literal>cache-hit-rate</literal> and <literal>page-faults</literal>,
+ * the pages read into the cache; getting these reads the whole file.
+ *
+ * Return value: new #librdf_hash of statistics or NULL on failure
+ **/
+librdf_hash*
+librdf_hash_get_stats(librdf_hash* hash)
+{
+  librdf_hash* stats;
+  int count;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(hash, librdf_hash, NULL);
+
+  stats=librdf_new_hash(hash->world, NULL);
+  if(!stats)
+    return NULL;
+
+  if(librdf_hash_put_strings(stats, "type", hash->factory->name) ||
+     librdf_hash_put_stat(stats, "cursors", hash->cursors_count))
+    goto failed;
+
+  count=librdf_hash_values_count(hash);
+  if(count >= 0 &&
+     librdf_hash_put_stat(stats, "values", (unsigned long)count))
+    goto failed;
+
+  if(hash->factory->get_stats &&
+     hash->factory->get_stats(hash->context, stats))
+    goto failed;
+
+  return stats;
+
+  failed:
+  librdf_free_hash(stats);
+  return NULL;
+}
+
+
 /**
  * librdf_hash_print:
  * @hash: the hash
@@ -1871,12 +2347,43 @@ librdf_hash_interpret_template(const unsigned char* template_string,
 /* one more prototype */
 int main(int argc, char *argv[]);
 
+/* keys added to a memory-flat hash to test growing past 2^22 slots */
+#define TEST_HASH_MANY_KEYS ((1 << 22) + 1)
+
+
+/* count the pairs returned for a prefix, -1 if a key does not match */
+static int
+test_hash_prefix_count(librdf_hash* h, const char *prefix)
+{
+  librdf_hash_datum hd_prefix;
+  librdf_iterator* iterator;
+  size_t len=strlen(prefix);
+  int count=0;
+
+  hd_prefix.data=(char*)prefix;
+  hd_prefix.size=len;
+  iterator=librdf_hash_get_prefix(h, &hd_prefix);
+  if(!iterator)
+    return -1;
+  while(!librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    if(k->size < len || memcmp(k->data, prefix, len)) {
+      count=-1;
+      break;
+    }
+    count++;
+    librdf_iterator_next(iterator);
+  }
+  librdf_free_iterator(iterator);
+  return count;
+}
+
 
 int
 main(int argc, char *argv[]) 
 {
   librdf_hash *h, *h2, *ch;
-  const char *test_hash_types[]={"bdb", "memory", NULL};
+  const char *test_hash_types[]={"bdb", "memory", "memory-flat", "mmap", NULL};
   const char *test_hash_values[]={"colour","yellow", /* Made in UK, can you guess? */
 			    "age", "new",
 			    "size", "large",
@@ -1998,6 +2505,205 @@ main(int argc, char *argv[])
     fprintf(stdout, "%s: Freeing hash\n", program);
     librdf_free_hash(h);
   }
+
+  fprintf(stdout, "%s: Trying memory hash with arena='yes', capacity='100'\n", program);
+  h2=librdf_new_hash_from_string(world, NULL, "arena='yes', capacity='100'");
+  h=librdf_new_hash(world, "memory");
+  if(!h2 || !h || librdf_hash_open(h, "test", 0644, 1, 1, h2)) {
+    fprintf(stderr, "%s: Failed to open memory hash with arena\n", program);
+    return(1);
+  }
+  for(j=0; test_hash_values[j]; j+=2) {
+    hd_key.data=(char*)test_hash_values[j];
+    hd_key.size=strlen((char*)hd_key.data);
+    hd_value.data=(char*)test_hash_values[j+1];
+    hd_value.size=strlen((char*)hd_value.data);
+    librdf_hash_put(h, &hd_key, &hd_value);
+  }
+  hd_key.data=(char*)test_hash_delete_key;
+  hd_key.size=strlen((char*)hd_key.data);
+  librdf_hash_delete_all(h, &hd_key);
+  ch=librdf_new_hash_from_hash(h);
+  if(!ch || librdf_hash_values_count(h) != 5 ||
+     librdf_hash_values_count(ch) != 5) {
+    fprintf(stderr, "%s: memory hash with arena has wrong values count %d\n",
+            program, librdf_hash_values_count(h));
+    return(1);
+  }
+  fprintf(stdout, "%s: resulting arena ", program);
+  librdf_hash_print(h, stdout);
+  fputc('\n', stdout);
+  librdf_free_hash(ch);
+  librdf_free_hash(h);
+  librdf_free_hash(h2);
+
+  for(i=0; (type=test_hash_types[i]); i++) {
+    librdf_hash_datum hd_keys[6], hd_values[6];
+    int results[6];
+
+    fprintf(stdout, "%s: Trying batch put/exists on %s hash\n", program, type);
+    h=librdf_new_hash(world, type);
+    if(!h)
+      continue;
+    if(librdf_hash_open(h, "test", 0644, 1, 1, NULL)) {
+      librdf_free_hash(h);
+      continue;
+    }
+
+    for(j=0; j < 6; j++) {
+      hd_keys[j].data=(char*)test_hash_values[j*2];
+      hd_keys[j].size=strlen((char*)hd_keys[j].data);
+      hd_values[j].data=(char*)test_hash_values[j*2+1];
+      hd_values[j].size=strlen((char*)hd_values[j].data);
+    }
+    if(librdf_hash_put_batch(h, hd_keys, hd_values, 6) ||
+       librdf_hash_exists_batch(h, hd_keys, hd_values, 6, results)) {
+      fprintf(stderr, "%s: Batch put/exists failed on %s hash\n", program,
+              type);
+      return(1);
+    }
+    for(j=0; j < 6; j++) {
+      if(results[j] <= 0) {
+        fprintf(stderr, "%s: Batch exists did not find %s=%s in %s hash\n",
+                program, (char*)hd_keys[j].data, (char*)hd_values[j].data,
+                type);
+        return(1);
+      }
+    }
+
+    if(test_hash_prefix_count(h, "s") != 1 ||
+       test_hash_prefix_count(h, "fruits") != 0 ||
+       test_hash_prefix_count(h, "") != librdf_hash_values_count(h)) {
+      fprintf(stderr, "%s: Prefix scan failed on %s hash\n", program, type);
+      return(1);
+    }
+
+    librdf_hash_close(h);
+    librdf_free_hash(h);
+  }
+
+#ifdef HAVE_MMAP_HASH
+  /* the batch loop above left the pairs in test.mmap */
+  fprintf(stdout, "%s: Reopening mmap hash read-only\n", program);
+  h=librdf_new_hash(world, "mmap");
+  if(!h || librdf_hash_open(h, "test", 0644, 0, 0, NULL)) {
+    fprintf(stderr, "%s: Failed to open mmap hash read-only\n", program);
+    return(1);
+  }
+  for(j=0; test_hash_values[j]; j+=2) {
+    hd_key.data=(char*)test_hash_values[j];
+    hd_key.size=strlen((char*)hd_key.data);
+    hd_value.data=(char*)test_hash_values[j+1];
+    hd_value.size=strlen((char*)hd_value.data);
+    if(librdf_hash_exists(h, &hd_key, &hd_value) <= 0) {
+      fprintf(stderr, "%s: Read-only mmap hash is missing %s=%s\n", program,
+              (char*)hd_key.data, (char*)hd_value.data);
+      return(1);
+    }
+  }
+  if(!librdf_hash_is_ordered(h) ||
+     test_hash_prefix_count(h, "f") != 1 ||
+     test_hash_prefix_count(h, "b") != 0 ||
+     test_hash_prefix_count(h, "") != librdf_hash_values_count(h)) {
+    fprintf(stderr, "%s: Prefix scan failed on read-only mmap hash\n",
+            program);
+    return(1);
+  }
+  fprintf(stdout, "%s: resulting read-only ", program);
+  librdf_hash_print(h, stdout);
+  fputc('\n', stdout);
+  librdf_hash_close(h);
+  librdf_free_hash(h);
+#endif
+
+  fprintf(stdout, "%s: Taking a snapshot of a memory hash\n", program);
+  h=librdf_new_hash(world, "memory");
+  if(!h || librdf_hash_open(h, NULL, 0644, 1, 1, NULL)) {
+    fprintf(stderr, "%s: Failed to open memory hash\n", program);
+    return(1);
+  }
+  for(j=0; test_hash_values[j]; j+=2)
+    librdf_hash_put_strings(h, test_hash_values[j], test_hash_values[j+1]);
+  h2=librdf_new_hash_snapshot(h);
+  if(!h2) {
+    fprintf(stderr, "%s: Failed to take snapshot of memory hash\n", program);
+    return(1);
+  }
+  /* change the hash under the snapshot */
+  hd_key.data=(char*)test_duplicate_key;
+  hd_key.size=strlen(test_duplicate_key);
+  librdf_hash_delete_all(h, &hd_key);
+  librdf_hash_put_strings(h, "shape", "cube");
+  hd_value.data=(char*)"cube";
+  hd_value.size=4;
+  ch=librdf_new_hash_snapshot(h);
+  if(librdf_hash_values_count(h2) != 6 ||
+     test_hash_prefix_count(h2, "") != 6 ||
+     test_hash_prefix_count(h2, test_duplicate_key) != 3 ||
+     librdf_hash_exists(h2, &hd_key, NULL) <= 0 ||
+     test_hash_prefix_count(h, "") != 4 ||
+     !ch || test_hash_prefix_count(ch, "") != 4 ||
+     librdf_hash_exists(ch, &hd_key, NULL) != 0) {
+    fprintf(stderr, "%s: Memory hash snapshot sees the wrong values\n",
+            program);
+    return(1);
+  }
+  hd_key.data=(char*)"shape";
+  hd_key.size=5;
+  if(librdf_hash_exists(h2, &hd_key, &hd_value) != 0 ||
+     librdf_hash_exists(ch, &hd_key, &hd_value) <= 0 ||
+     !librdf_hash_put(h2, &hd_key, &hd_value)) {
+    fprintf(stderr, "%s: Memory hash snapshot sees the wrong values\n",
+            program);
+    return(1);
+  }
+  fprintf(stdout, "%s: resulting snapshot ", program);
+  librdf_hash_print(h2, stdout);
+  fputc('\n', stdout);
+  librdf_free_hash(ch);
+  librdf_free_hash(h2);
+  /* removed values are freed now the snapshots are gone */
+  if(librdf_hash_values_count(h) != 4 ||
+     test_hash_prefix_count(h, "") != 4) {
+    fprintf(stderr, "%s: Memory hash has wrong values after snapshots\n",
+            program);
+    return(1);
+  }
+  librdf_hash_close(h);
+  librdf_free_hash(h);
+
+  /* past 2^22 keys, where a load check in int arithmetic overflows */
+  fprintf(stdout, "%s: Adding %d keys to a memory-flat hash\n", program,
+          TEST_HASH_MANY_KEYS);
+  h=librdf_new_hash(world, "memory-flat");
+  if(!h || librdf_hash_open(h, NULL, 0644, 1, 1, NULL)) {
+    fprintf(stderr, "%s: Failed to open memory-flat hash\n", program);
+    return(1);
+  }
+  for(j=0; j < TEST_HASH_MANY_KEYS; j++) {
+    char key[16];
+
+    hd_key.data=key;
+    hd_key.size=LIBRDF_GOOD_CAST(size_t, sprintf(key, "k%d", j));
+    hd_value.data=(char*)"v";
+    hd_value.size=1;
+    if(librdf_hash_put(h, &hd_key, &hd_value)) {
+      fprintf(stderr, "%s: Failed to add key %d to memory-flat hash\n",
+              program, j);
+      return(1);
+    }
+  }
+  hd_key.data=(char*)"k0";
+  hd_key.size=2;
+  if(librdf_hash_values_count(h) != TEST_HASH_MANY_KEYS ||
+     librdf_hash_exists(h, &hd_key, &hd_value) <= 0) {
+    fprintf(stderr, "%s: memory-flat hash has %d values, expected %d\n",
+            program, librdf_hash_values_count(h), TEST_HASH_MANY_KEYS);
+    return(1);
+  }
+  librdf_hash_close(h);
+  librdf_free_hash(h);
+
   fprintf(stdout, "%s: Getting default hash factory\n", program);
   h2=librdf_new_hash(world, NULL);
   if(!h2) {
@@ -80,6 +80,10 @@ int librdf_hash_from_string(librdf_hash* hash, const char *string);
 REDLAND_API
 char* librdf_hash_to_string(librdf_hash* hash, const char *filter[]);
 
+/* statistics about the hash implementation */
+REDLAND_API
+librdf_hash* librdf_hash_get_stats(librdf_hash* hash);
+
 REDLAND_API
 void librdf_hash_print(librdf_hash* hash, FILE *fh);
 REDLAND_API
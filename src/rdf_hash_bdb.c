@@ -35,6 +35,9 @@
 #include <stdarg.h>
 
 #include <sys/types.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
 
 /* for the memory allocation functions */
 #ifdef HAVE_STDLIB_H
@@ -50,6 +53,47 @@
 #include <rdf_hash.h>
 
 
+/* Shared environments need the V4.1+ DB->open with a DB_TXN argument */
+#if defined(HAVE_DB_CREATE) && defined(HAVE_BDB_OPEN_7_ARGS)
+#define LIBRDF_HASH_BDB_ENV 1
+#endif
+
+/* Snapshots need multiversion databases, BDB 4.5+ */
+#if defined(LIBRDF_HASH_BDB_ENV) && defined(DB_TXN_SNAPSHOT) && defined(DB_MULTIVERSION)
+#define LIBRDF_HASH_BDB_SNAPSHOT 1
+#endif
+
+/* Statistics need the V4.3+ DB->stat with a DB_TXN argument and
+ * DB_ENV->memp_stat */
+#if defined(LIBRDF_HASH_BDB_ENV) && defined(DB_VERSION_MAJOR) && (DB_VERSION_MAJOR > 4 || (DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR >= 3))
+#define LIBRDF_HASH_BDB_STATS 1
+#endif
+
+/* Compaction copies private files in key order with a V4.1+ cursor;
+ * files in a shared environment are compacted in place, BDB 4.4+ */
+#if defined(LIBRDF_HASH_BDB_ENV) && defined(HAVE_BDB_CURSOR_4_ARGS)
+#define LIBRDF_HASH_BDB_COMPACT 1
+#endif
+
+
+#ifdef LIBRDF_HASH_BDB_ENV
+/* A BDB environment shared by all hashes opened with the same
+ * bdb-env-dir option, kept on the world hash_bdb_envs list */
+struct librdf_hash_bdb_env_s
+{
+  struct librdf_hash_bdb_env_s* next;
+  char* dir;
+  DB_ENV* env;
+  /* number of open hashes using this environment */
+  int usage;
+  int is_transactional;
+  /* transaction in progress or NULL */
+  DB_TXN* txn;
+};
+typedef struct librdf_hash_bdb_env_s librdf_hash_bdb_env;
+#endif
+
+
 typedef struct 
 {
   librdf_hash *hash;
@@ -59,9 +103,32 @@ typedef struct
   /* for BerkeleyDB only */
   DB* db;
   char* file_name;
+  /* page size for new files and private cache size in bytes or 0 */
+  long page_size;
+  long cache_size;
+#ifdef LIBRDF_HASH_BDB_ENV
+  /* shared environment or NULL */
+  librdf_hash_bdb_env* env;
+#endif
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  /* non 0 if the file was opened with DB_MULTIVERSION */
+  int is_multiversion;
+  /* for a snapshot: the snapshot transaction reading the shared db */
+  DB_TXN* snapshot_txn;
+#endif
 } librdf_hash_bdb_context;
 
 
+/* transaction to pass to BDB methods */
+#if defined(LIBRDF_HASH_BDB_SNAPSHOT)
+#define LIBRDF_HASH_BDB_TXN(context) ((context)->snapshot_txn ? (context)->snapshot_txn : ((context)->env ? (context)->env->txn : NULL))
+#elif defined(LIBRDF_HASH_BDB_ENV)
+#define LIBRDF_HASH_BDB_TXN(context) ((context)->env ? (context)->env->txn : NULL)
+#else
+#define LIBRDF_HASH_BDB_TXN(context) NULL
+#endif
+
+
 /* Implementing the hash cursor */
 static int librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context);
 static int librdf_hash_bdb_cursor_get(void *context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
@@ -74,13 +141,28 @@ static int librdf_hash_bdb_destroy(void* context);
 static int librdf_hash_bdb_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
 static int librdf_hash_bdb_close(void* context);
 static int librdf_hash_bdb_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+static int librdf_hash_bdb_snapshot(librdf_hash* new_hash, void *new_context, void* old_context);
+#endif
 static int librdf_hash_bdb_values_count(void *context);
+#ifdef LIBRDF_HASH_BDB_STATS
+static int librdf_hash_bdb_get_stats(void* context, librdf_hash* stats);
+#endif
+#ifdef LIBRDF_HASH_BDB_COMPACT
+static int librdf_hash_bdb_compact(void* context);
+#endif
 static int librdf_hash_bdb_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
 static int librdf_hash_bdb_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_bdb_put_batch(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+static int librdf_hash_bdb_exists_batch(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
 static int librdf_hash_bdb_delete_key(void* context, librdf_hash_datum *key);
 static int librdf_hash_bdb_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_bdb_sync(void* context);
 static int librdf_hash_bdb_get_fd(void* context);
+static int librdf_hash_bdb_transaction_start(void* context);
+static int librdf_hash_bdb_transaction_commit(void* context);
+static int librdf_hash_bdb_transaction_rollback(void* context);
+static int librdf_hash_bdb_is_ordered(void* context);
 
 static void librdf_hash_bdb_register_factory(librdf_hash_factory *factory);
 
@@ -106,6 +188,134 @@ librdf_hash_bdb_create(librdf_hash* hash, void* context)
 }
 
 
+#ifdef LIBRDF_HASH_BDB_ENV
+/*
+ * librdf_hash_bdb_get_env:
+ * @world: redland world object
+ * @dir: environment home directory
+ * @cache_size: shared cache size in bytes or 0 for the BDB default
+ * @is_transactional: non 0 to enable transactions
+ * @mode: file creation mode
+ *
+ * INTERNAL - Get a shared BDB environment, opening it on first use.
+ *
+ * The cache size and transaction settings are taken from the first
+ * hash that opens the environment.
+ *
+ * Return value: environment or NULL on failure
+ */
+static librdf_hash_bdb_env*
+librdf_hash_bdb_get_env(librdf_world* world, const char* dir,
+                        long cache_size, int is_transactional, int mode)
+{
+  librdf_hash_bdb_env* env;
+  u_int32_t flags;
+  int ret;
+
+  for(env=world->hash_bdb_envs; env; env=env->next) {
+    if(!strcmp(env->dir, dir)) {
+      env->usage++;
+      return env;
+    }
+  }
+
+  env = LIBRDF_CALLOC(librdf_hash_bdb_env*, 1, sizeof(*env));
+  if(!env)
+    return NULL;
+
+  env->dir = LIBRDF_MALLOC(char*, strlen(dir) + 1);
+  if(!env->dir) {
+    LIBRDF_FREE(librdf_hash_bdb_env, env);
+    return NULL;
+  }
+  strcpy(env->dir, dir);
+
+  ret = db_env_create(&env->env, 0);
+  if(ret) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB environment create failed - %s", db_strerror(ret));
+    goto failed;
+  }
+
+  if(cache_size > 0) {
+    ret = env->env->set_cachesize(env->env,
+                                  (u_int32_t)(cache_size / (1024L * 1024L * 1024L)),
+                                  (u_int32_t)(cache_size % (1024L * 1024L * 1024L)),
+                                  1);
+    if(ret) {
+      librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "BDB environment cache size %ld failed - %s", cache_size,
+                 db_strerror(ret));
+      goto failed;
+    }
+  }
+
+  flags = DB_CREATE | DB_INIT_MPOOL;
+#ifdef WITH_THREADS
+  /* storage index threads may use hashes sharing this environment */
+  flags |= DB_THREAD;
+#endif
+  if(is_transactional) {
+    flags |= DB_INIT_LOCK | DB_INIT_LOG | DB_INIT_TXN;
+    env->env->set_lk_detect(env->env, DB_LOCK_DEFAULT);
+  }
+
+  ret = env->env->open(env->env, dir, flags, mode);
+  if(ret) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB environment open of '%s' failed - %s", dir,
+               db_strerror(ret));
+    goto failed;
+  }
+
+  env->is_transactional=is_transactional;
+  env->usage=1;
+  env->next=world->hash_bdb_envs;
+  world->hash_bdb_envs=env;
+
+  return env;
+
+  failed:
+  if(env->env)
+    env->env->close(env->env, 0);
+  LIBRDF_FREE(char*, env->dir);
+  LIBRDF_FREE(librdf_hash_bdb_env, env);
+  return NULL;
+}
+
+
+/*
+ * librdf_hash_bdb_release_env:
+ * @world: redland world object
+ * @env: environment from librdf_hash_bdb_get_env()
+ *
+ * INTERNAL - Stop using a shared BDB environment, closing it when the
+ * last hash is done with it.  Any open transaction is aborted.
+ */
+static void
+librdf_hash_bdb_release_env(librdf_world* world, librdf_hash_bdb_env* env)
+{
+  librdf_hash_bdb_env **prev;
+
+  if(--env->usage > 0)
+    return;
+
+  for(prev=&world->hash_bdb_envs; *prev; prev=&(*prev)->next) {
+    if(*prev == env) {
+      *prev=env->next;
+      break;
+    }
+  }
+
+  if(env->txn)
+    env->txn->abort(env->txn);
+  env->env->close(env->env, 0);
+  LIBRDF_FREE(char*, env->dir);
+  LIBRDF_FREE(librdf_hash_bdb_env, env);
+}
+#endif
+
+
 /**
  * librdf_hash_bdb_destroy:
  * @context: BerkeleyDB hash context
@@ -117,7 +327,14 @@ librdf_hash_bdb_create(librdf_hash* hash, void* context)
 static int
 librdf_hash_bdb_destroy(void* context) 
 {
-  /* NOP */
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+
+  if(bdb_context->env) {
+    librdf_hash_bdb_release_env(bdb_context->hash->world, bdb_context->env);
+    bdb_context->env=NULL;
+  }
+#endif
   return 0;
 }
 
@@ -129,9 +346,22 @@ librdf_hash_bdb_destroy(void* context)
  * @mode: file creation mode
  * @is_writable: is hash writable?
  * @is_new: is hash new?
- * @options: hash options (currently unused)
+ * @options: hash options
  *
  * Open and maybe create a BerkeleyDB hash.
+ *
+ * Options (all optional):
+ *   bdb-page-size - page size in bytes used when creating the file
+ *   bdb-cache-size - cache size in bytes, shared if bdb-env-dir is set
+ *   bdb-env-dir - open the file in a Berkeley DB environment in this
+ *     directory, shared by every hash opened with the same directory.
+ *     File names are taken relative to it, so the directory part of
+ *     the identifier is ignored.
+ *   bdb-txn - if true, the environment is transactional; see
+ *     librdf_hash_transaction_start()
+ *   bdb-mvcc - if true and the environment is transactional, open the
+ *     file for multiversion concurrency control so that
+ *     librdf_new_hash_snapshot() can be used
  * 
  * Return value: non 0 on failure.
  **/
@@ -146,19 +376,60 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   int ret;
   u_int32_t flags = 0;
 
+#ifdef LIBRDF_HASH_BDB_ENV
+  const char *db_file;
+#endif
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
   
 #ifdef HAVE_DB_OPEN
   DB_INFO bdb_info;
 #endif
   
-  /* NOTE: If the options parameter is ever used here, the data must be
-   * copied into a private part of the context so that the clone
-   * method can access them
+  /* NOTE: Option values used here must be copied into a private part
+   * of the context so that the clone method can access them; clone
+   * calls this with no options.
    */
   bdb_context->mode=mode;
   bdb_context->is_writable=is_writable;
   bdb_context->is_new=is_new;
+
+  if(options) {
+    long lvalue;
+
+    lvalue=librdf_hash_get_as_long(options, "bdb-page-size");
+    bdb_context->page_size=(lvalue > 0) ? lvalue : 0;
+    lvalue=librdf_hash_get_as_long(options, "bdb-cache-size");
+    bdb_context->cache_size=(lvalue > 0) ? lvalue : 0;
+
+#ifdef LIBRDF_HASH_BDB_ENV
+    if(!bdb_context->env) {
+      char *env_dir=librdf_hash_get(options, "bdb-env-dir");
+
+      if(env_dir) {
+        int is_transactional=(librdf_hash_get_as_boolean(options, "bdb-txn") > 0);
+
+        bdb_context->env=librdf_hash_bdb_get_env(bdb_context->hash->world,
+                                                 env_dir,
+                                                 bdb_context->cache_size,
+                                                 is_transactional, mode);
+        LIBRDF_FREE(char*, env_dir);
+        if(!bdb_context->env)
+          return 1;
+      }
+    }
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+    bdb_context->is_multiversion=(librdf_hash_get_as_boolean(options, "bdb-mvcc") > 0);
+#endif
+#else
+    if(librdf_hash_get_as_boolean(options, "bdb-txn") > 0) {
+      librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+                 LIBRDF_FROM_STORAGE, NULL,
+                 "BDB environments are not supported by this Berkeley DB version");
+      return 1;
+    }
+#endif
+  }
   
   file = LIBRDF_MALLOC(char*, strlen(identifier) + 4);
   if(!file)
@@ -169,7 +440,12 @@ librdf_hash_bdb_open(void* context, const char *identifier,
   /* V3 prototype:
    * int db_create(DB **dbp, DB_ENV *dbenv, u_int32_t flags);
    */
+#ifdef LIBRDF_HASH_BDB_ENV
+  ret = db_create(&bdb, bdb_context->env ? bdb_context->env->env : NULL,
+                  flags);
+#else
   ret = db_create(&bdb, NULL, flags);
+#endif
   if(ret) {
     LIBRDF_DEBUG2("Failed to create BDB context - %d\n", ret);
     return 1;
@@ -181,6 +457,30 @@ librdf_hash_bdb_open(void* context, const char *identifier,
     return 1;
   }
 #endif
+
+#ifdef HAVE_BDB_OPEN_7_ARGS
+  if(bdb_context->page_size &&
+     (ret=bdb->set_pagesize(bdb, (u_int32_t)bdb_context->page_size))) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL,
+               "BDB page size %ld failed - %s", bdb_context->page_size,
+               db_strerror(ret));
+    return 1;
+  }
+
+  /* a shared environment has one cache set when it is opened */
+  if(bdb_context->cache_size && !bdb_context->env &&
+     (ret=bdb->set_cachesize(bdb,
+                             (u_int32_t)(bdb_context->cache_size / (1024L * 1024L * 1024L)),
+                             (u_int32_t)(bdb_context->cache_size % (1024L * 1024L * 1024L)),
+                             1))) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL,
+               "BDB cache size %ld failed - %s", bdb_context->cache_size,
+               db_strerror(ret));
+    return 1;
+  }
+#endif
   
   /* V3 prototype:
    * int DB->open(DB *db, const char *file, const char *database,
@@ -212,7 +512,33 @@ librdf_hash_bdb_open(void* context, const char *identifier,
  * int DB->open(DB *db, DB_TXN *txnid, const char *file,
  *              const char *database, DBTYPE type, u_int32_t flags, int mode);
  */
+#ifdef LIBRDF_HASH_BDB_ENV
+  db_file=file;
+  if(bdb_context->env) {
+    /* files live in the environment directory */
+    const char *p=strrchr(file, '/');
+    if(p)
+      db_file=p + 1;
+
+    if(bdb_context->env->is_transactional) {
+      /* DB_TRUNCATE cannot be transaction protected - truncate below */
+      flags &= ~((u_int32_t)DB_TRUNCATE);
+      flags |= DB_AUTO_COMMIT;
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+      if(bdb_context->is_multiversion)
+        flags |= DB_MULTIVERSION;
+#endif
+    }
+  }
+  ret = bdb->open(bdb, NULL, db_file, NULL, DB_BTREE, flags, mode);
+  if(!ret && is_new && bdb_context->env &&
+     bdb_context->env->is_transactional) {
+    u_int32_t count=0;
+    ret = bdb->truncate(bdb, NULL, &count, DB_AUTO_COMMIT);
+  }
+#else
   ret = bdb->open(bdb, NULL, file, NULL, DB_BTREE, flags, mode);
+#endif
   if(ret) {
     librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "BDB V4.1+ open of '%s' failed - %s", file, db_strerror(ret));
@@ -297,6 +623,16 @@ librdf_hash_bdb_close(void* context)
   DB* db=bdb_context->db;
   int ret;
   
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  /* a snapshot only ends its transaction; the db belongs to the hash */
+  if(bdb_context->snapshot_txn) {
+    ret=bdb_context->snapshot_txn->abort(bdb_context->snapshot_txn);
+    bdb_context->snapshot_txn=NULL;
+    bdb_context->db=NULL;
+    return ret;
+  }
+#endif
+
 #ifdef HAVE_BDB_CLOSE_2_ARGS
   /* V2/V3 */
   ret=db->close(db, 0);
@@ -336,8 +672,17 @@ librdf_hash_bdb_clone(librdf_hash *hash, void* context, char *new_identifier,
   /* copy data fields that might change */
   hcontext->hash=hash;
 
-  /* Note: The options are not used at present, so no need to make a copy 
-   */
+  /* copy the option values since open is called without options */
+  hcontext->page_size=old_hcontext->page_size;
+  hcontext->cache_size=old_hcontext->cache_size;
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  hcontext->is_multiversion=old_hcontext->is_multiversion;
+#endif
+#ifdef LIBRDF_HASH_BDB_ENV
+  if((hcontext->env=old_hcontext->env))
+    hcontext->env->usage++;
+#endif
+
   if(librdf_hash_bdb_open(context, new_identifier,
                           old_hcontext->mode, old_hcontext->is_writable,
                           old_hcontext->is_new, NULL))
@@ -373,6 +718,60 @@ librdf_hash_bdb_clone(librdf_hash *hash, void* context, char *new_identifier,
 }
 
 
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+/**
+ * librdf_hash_bdb_snapshot:
+ * @hash: new #librdf_hash that this implements
+ * @context: new BerkeleyDB hash context
+ * @old_context: BerkeleyDB hash context to take a snapshot of
+ *
+ * Make a read-only view of a BerkeleyDB hash as it is now.
+ *
+ * The snapshot shares the open db of the old hash and reads it in a
+ * DB_TXN_SNAPSHOT transaction, so it sees the committed contents at
+ * this point without blocking or being blocked by writers.  The old
+ * hash must have been opened with bdb-mvcc in a transactional
+ * environment and must outlive the snapshot.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_snapshot(librdf_hash *hash, void* context,
+                         void *old_context) 
+{
+  librdf_hash_bdb_context* hcontext=(librdf_hash_bdb_context*)context;
+  librdf_hash_bdb_context* old_hcontext=(librdf_hash_bdb_context*)old_context;
+  librdf_hash_bdb_env* env=old_hcontext->env;
+  int ret;
+
+  /* a snapshot transaction cannot be shared, nor started at an older point */
+  if(!env || !env->is_transactional || !old_hcontext->is_multiversion ||
+     old_hcontext->snapshot_txn)
+    return 1;
+
+  ret=env->env->txn_begin(env->env, NULL, &hcontext->snapshot_txn,
+                          DB_TXN_SNAPSHOT);
+  if(ret) {
+    hcontext->snapshot_txn=NULL;
+    librdf_log(hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB snapshot transaction begin failed - %s",
+               db_strerror(ret));
+    return 1;
+  }
+
+  hcontext->hash=hash;
+  hcontext->mode=old_hcontext->mode;
+  hcontext->is_writable=0;
+  hcontext->db=old_hcontext->db;
+  hcontext->is_multiversion=1;
+  hcontext->env=env;
+  env->usage++;
+
+  return 0;
+}
+#endif
+
+
 /**
  * librdf_hash_bdb_values_count:
  * @context: BerkeleyDB hash context
@@ -388,11 +787,278 @@ librdf_hash_bdb_values_count(void *context)
 }
 
 
+#ifdef LIBRDF_HASH_BDB_STATS
+/**
+ * librdf_hash_bdb_get_stats:
+ * @context: BerkeleyDB hash context
+ * @stats: hash to add statistics to
+ *
+ * Add the btree statistics of the file, which walks all of it, and the
+ * cache statistics of its environment.  A shared environment has one
+ * cache so the cache statistics cover all the hashes using it.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_get_stats(void* context, librdf_hash* stats)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  DB* db=bdb_context->db;
+  DB_ENV* env;
+  DB_BTREE_STAT* bt_stat=NULL;
+  DB_MPOOL_STAT* mp_stat=NULL;
+  int ret;
+  int rc=0;
+
+  if(!db)
+    return 0;
+
+  ret=db->stat(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bt_stat, 0);
+  if(ret) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL,
+               "BDB stat failed - %s", db_strerror(ret));
+    return 1;
+  }
+
+  if(librdf_hash_put_stat(stats, "keys", (unsigned long)bt_stat->bt_nkeys) ||
+     librdf_hash_put_stat(stats, "page-size", (unsigned long)bt_stat->bt_pagesize) ||
+     librdf_hash_put_stat(stats, "levels", (unsigned long)bt_stat->bt_levels) ||
+     librdf_hash_put_stat(stats, "internal-pages", (unsigned long)bt_stat->bt_int_pg) ||
+     librdf_hash_put_stat(stats, "leaf-pages", (unsigned long)bt_stat->bt_leaf_pg) ||
+     librdf_hash_put_stat(stats, "overflow-pages", (unsigned long)bt_stat->bt_over_pg) ||
+     librdf_hash_put_stat(stats, "free-pages", (unsigned long)bt_stat->bt_free)) {
+    rc=1;
+    goto tidy;
+  }
+
+  if(bt_stat->bt_leaf_pg) {
+    char buffer[32];
+    double leaf_bytes=(double)bt_stat->bt_leaf_pg * bt_stat->bt_pagesize;
+
+    sprintf(buffer, "%.3f",
+            (leaf_bytes - (double)bt_stat->bt_leaf_pgfree) / leaf_bytes);
+    if(librdf_hash_put_strings(stats, "leaf-fill", buffer)) {
+      rc=1;
+      goto tidy;
+    }
+  }
+
+  env=bdb_context->env ? bdb_context->env->env : db->dbenv;
+  ret=env->memp_stat(env, &mp_stat, NULL, 0);
+  if(ret) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL,
+               "BDB cache stat failed - %s", db_strerror(ret));
+    rc=1;
+    goto tidy;
+  }
+
+  if(librdf_hash_put_stat(stats, "cache-bytes",
+                          (unsigned long)mp_stat->st_gbytes * 1024UL * 1024UL * 1024UL + (unsigned long)mp_stat->st_bytes) ||
+     librdf_hash_put_stat(stats, "cache-hits", (unsigned long)mp_stat->st_cache_hit) ||
+     librdf_hash_put_stat(stats, "cache-misses", (unsigned long)mp_stat->st_cache_miss) ||
+     librdf_hash_put_stat(stats, "page-faults", (unsigned long)mp_stat->st_page_in) ||
+     librdf_hash_put_stat(stats, "pages-written", (unsigned long)mp_stat->st_page_out)) {
+    rc=1;
+    goto tidy;
+  }
+
+  if(mp_stat->st_cache_hit || mp_stat->st_cache_miss) {
+    char buffer[32];
+    double hits=(double)mp_stat->st_cache_hit;
+
+    sprintf(buffer, "%.3f", hits / (hits + (double)mp_stat->st_cache_miss));
+    if(librdf_hash_put_strings(stats, "cache-hit-rate", buffer))
+      rc=1;
+  }
+
+  tidy:
+  /* BDB allocates the stat structures with malloc() */
+  if(mp_stat)
+    free(mp_stat);
+  free(bt_stat);
+  return rc;
+}
+#endif
+
+
+#ifdef LIBRDF_HASH_BDB_COMPACT
+/**
+ * librdf_hash_bdb_compact:
+ * @context: BerkeleyDB hash context
+ *
+ * Rewrite the BerkeleyDB file in key order.
+ *
+ * A private file is copied in key order into a new file beside it
+ * which is then renamed over the old one, so the file name always
+ * holds a whole database, and the hash is reopened on it.  Other
+ * processes with the file open go on reading the old copy until they
+ * reopen it.  Files in a shared environment cannot be replaced under
+ * the other handles so they are compacted in place with the BDB 4.4+
+ * DB->compact, returning emptied pages to the filesystem.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_compact(void* context)
+{
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  librdf_world* world=bdb_context->hash->world;
+  DB* db=bdb_context->db;
+  DB* new_db=NULL;
+  DBC* dbc=NULL;
+  DBT bdb_key;
+  DBT bdb_value;
+  char* new_file;
+  char* identifier;
+  size_t len;
+  int ret;
+
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  if(bdb_context->snapshot_txn)
+    return 1;
+#endif
+  if(!db || !bdb_context->is_writable)
+    return 1;
+
+  if(bdb_context->env) {
+#ifdef DB_FREE_SPACE
+    ret=db->compact(db, LIBRDF_HASH_BDB_TXN(bdb_context), NULL, NULL, NULL,
+                    DB_FREE_SPACE, NULL);
+    if(ret) {
+      librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "BDB compact of '%s' failed - %s", bdb_context->file_name,
+                 db_strerror(ret));
+      return 1;
+    }
+    return 0;
+#else
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB files in an environment cannot be compacted by this Berkeley DB version");
+    return 1;
+#endif
+  }
+
+  len=strlen(bdb_context->file_name);
+  new_file=LIBRDF_MALLOC(char*, len + 9);
+  if(!new_file)
+    return 1;
+  sprintf(new_file, "%s.compact", bdb_context->file_name);
+
+  /* the same btree settings as librdf_hash_bdb_open */
+  ret=db_create(&new_db, NULL, 0);
+  if(ret)
+    new_db=NULL;
+  if(!ret)
+    ret=new_db->set_flags(new_db, DB_DUP);
+  if(!ret && bdb_context->page_size)
+    ret=new_db->set_pagesize(new_db, (u_int32_t)bdb_context->page_size);
+  if(!ret && bdb_context->cache_size)
+    ret=new_db->set_cachesize(new_db,
+                              (u_int32_t)(bdb_context->cache_size / (1024L * 1024L * 1024L)),
+                              (u_int32_t)(bdb_context->cache_size % (1024L * 1024L * 1024L)),
+                              1);
+  if(!ret)
+    ret=new_db->open(new_db, NULL, new_file, NULL, DB_BTREE,
+                     DB_CREATE | DB_TRUNCATE, bdb_context->mode);
+
+  /* copy in key order; duplicates are appended so keep their order */
+  if(!ret)
+    ret=db->cursor(db, NULL, &dbc, 0);
+  if(!ret) {
+    memset(&bdb_key, 0, sizeof(DBT));
+    memset(&bdb_value, 0, sizeof(DBT));
+    while(!(ret=dbc->c_get(dbc, &bdb_key, &bdb_value, DB_NEXT))) {
+      ret=new_db->put(new_db, NULL, &bdb_key, &bdb_value, 0);
+      if(ret)
+        break;
+    }
+    if(ret == DB_NOTFOUND)
+      ret=0;
+    dbc->c_close(dbc);
+  }
+
+  if(!ret)
+    ret=new_db->sync(new_db, 0);
+  if(new_db) {
+    int close_ret=new_db->close(new_db, 0);
+    if(!ret)
+      ret=close_ret;
+  }
+
+  if(ret) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB compact of '%s' failed - %s", bdb_context->file_name,
+               db_strerror(ret));
+    remove(new_file);
+    LIBRDF_FREE(char*, new_file);
+    return 1;
+  }
+
+  /* close frees the file name so keep a copy */
+  identifier=LIBRDF_MALLOC(char*, len + 1);
+  if(!identifier) {
+    remove(new_file);
+    LIBRDF_FREE(char*, new_file);
+    return 1;
+  }
+  strcpy(identifier, bdb_context->file_name);
+
+  /* swap the files with the old handle closed, then reopen */
+  librdf_hash_bdb_close(context);
+  bdb_context->db=NULL;
+
+  ret=0;
+  if(rename(new_file, identifier)) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "BDB compact could not rename '%s' to '%s'",
+               new_file, identifier);
+    remove(new_file);
+    ret=1;
+  }
+  LIBRDF_FREE(char*, new_file);
+
+  /* reopen by identifier, the file name without the .db suffix */
+  identifier[len - 3]='\0';
+  if(librdf_hash_bdb_open(context, identifier, bdb_context->mode,
+                          bdb_context->is_writable, 0, NULL))
+    ret=1;
+  LIBRDF_FREE(char*, identifier);
+
+  return ret;
+}
+#endif
+
+
+
+/* BDB V2 and later can fill buffers owned by the cursor */
+#ifdef DB_DBT_USERMEM
+#define LIBRDF_HASH_BDB_USERMEM 1
+#ifdef DB_BUFFER_SMALL
+#define LIBRDF_HASH_BDB_BUFFER_SMALL DB_BUFFER_SMALL
+#else
+/* before V4.3 */
+#define LIBRDF_HASH_BDB_BUFFER_SMALL ENOMEM
+#endif
+#endif
+
 
 typedef struct {
   librdf_hash_bdb_context* hash;
-  void *last_key;
-  void *last_value;
+  /* Keys and values returned by cursor_get are kept in these buffers
+   * until the next cursor move so they are not copied again.  Two key
+   * buffers alternate so the previous key can be compared with the
+   * one just read.
+   */
+  void *key_buffer[2];
+  size_t key_buffer_size[2];
+  void *value_buffer;
+  size_t value_buffer_size;
+  /* key_buffer holding the last key returned, if has_last_key */
+  int last_key_index;
+  size_t last_key_len;
+  int has_last_key;
 #ifdef HAVE_BDB_CURSOR
   DBC* cursor;
 #endif
@@ -424,13 +1090,13 @@ librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
   /* V3 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp, u_int32_t flags);
    */
-  if(db->cursor(db, NULL, &cursor->cursor, 0))
+  if(db->cursor(db, LIBRDF_HASH_BDB_TXN(cursor->hash), &cursor->cursor, 0))
     return 1;
 #else
   /* V2 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp);
    */
-  if(db->cursor(db, NULL, &cursor->cursor))
+  if(db->cursor(db, LIBRDF_HASH_BDB_TXN(cursor->hash), &cursor->cursor))
     return 1;
 #endif
 #endif
@@ -439,6 +1105,135 @@ librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
 }
 
 
+/*
+ * librdf_hash_bdb_cursor_grow - make sure a cursor buffer holds at
+ * least needed bytes.  The old contents are not kept.
+ */
+static int
+librdf_hash_bdb_cursor_grow(void **buffer, size_t *size, size_t needed)
+{
+  void *new_buffer;
+  size_t new_size;
+
+  if(needed <= *size)
+    return 0;
+
+  new_size=(*size * 2 > needed) ? *size * 2 : needed;
+  new_buffer=LIBRDF_MALLOC(void*, new_size);
+  if(!new_buffer)
+    return 1;
+
+  if(*buffer)
+    LIBRDF_FREE(char*, *buffer);
+  *buffer=new_buffer;
+  *size=new_size;
+  return 0;
+}
+
+
+#ifdef HAVE_BDB_CURSOR
+/*
+ * librdf_hash_bdb_cursor_c_get - DBcursor->c_get into the cursor buffers
+ * @cursor: cursor context
+ * @bdb_key: key DBT; the input key for DB_SET and DB_SET_RANGE
+ * @bdb_value: value DBT
+ * @want_value: non 0 if the value is wanted
+ * @key_index: key_buffer to read the key into
+ * @bdb_flags: c_get flags
+ *
+ * Buffers that are too small are grown and the read retried, which
+ * leaves the cursor where it was.
+ */
+static int
+librdf_hash_bdb_cursor_c_get(librdf_hash_bdb_cursor_context *cursor,
+                             DBT *bdb_key, DBT *bdb_value, int want_value,
+                             int key_index, u_int32_t bdb_flags)
+{
+  DBC *bdb_cursor=cursor->cursor;
+  int ret;
+#ifdef LIBRDF_HASH_BDB_USERMEM
+  librdf_hash_datum range_key;
+
+  /* DB_SET_RANGE reads the search key from and returns the found key
+   * into the same buffer, so copy it to the cursor first */
+  if(bdb_flags == DB_SET_RANGE) {
+    range_key.data=LIBRDF_MALLOC(void*, bdb_key->size + 1);
+    if(!range_key.data)
+      return 1;
+    memcpy(range_key.data, bdb_key->data, bdb_key->size);
+    range_key.size=bdb_key->size;
+  }
+#endif
+
+  while(1) {
+#ifdef LIBRDF_HASH_BDB_USERMEM
+    if(bdb_flags == DB_SET_RANGE) {
+      if(librdf_hash_bdb_cursor_grow(&cursor->key_buffer[key_index],
+                                     &cursor->key_buffer_size[key_index],
+                                     range_key.size)) {
+        ret=1;
+        break;
+      }
+      memcpy(cursor->key_buffer[key_index], range_key.data, range_key.size);
+      bdb_key->size=(u_int32_t)range_key.size;
+    }
+    if(bdb_flags != DB_SET) {
+      bdb_key->data=cursor->key_buffer[key_index];
+      bdb_key->ulen=(u_int32_t)cursor->key_buffer_size[key_index];
+      bdb_key->flags=DB_DBT_USERMEM;
+    }
+    bdb_value->data=cursor->value_buffer;
+    bdb_value->ulen=(u_int32_t)cursor->value_buffer_size;
+    bdb_value->flags=DB_DBT_USERMEM;
+#ifdef DB_DBT_PARTIAL
+    if(!want_value) {
+      /* read no value bytes at all */
+      bdb_value->flags |= DB_DBT_PARTIAL;
+      bdb_value->dlen=0;
+      bdb_value->doff=0;
+    }
+#endif
+#endif
+
+    /* V2/V3 prototype:
+     * int DBcursor->c_get(DBC *cursor, DBT *key, DBT *data, u_int32_t flags);
+     */
+    ret=bdb_cursor->c_get(bdb_cursor, bdb_key, bdb_value, bdb_flags);
+
+#ifdef LIBRDF_HASH_BDB_USERMEM
+    if(ret == LIBRDF_HASH_BDB_BUFFER_SMALL) {
+      int grown=0;
+
+      if(bdb_flags != DB_SET && bdb_key->size > bdb_key->ulen) {
+        if(librdf_hash_bdb_cursor_grow(&cursor->key_buffer[key_index],
+                                       &cursor->key_buffer_size[key_index],
+                                       bdb_key->size))
+          return ret;
+        grown=1;
+      }
+      if(bdb_value->size > bdb_value->ulen) {
+        if(librdf_hash_bdb_cursor_grow(&cursor->value_buffer,
+                                       &cursor->value_buffer_size,
+                                       bdb_value->size))
+          return ret;
+        grown=1;
+      }
+      if(grown)
+        continue;
+    }
+#endif
+    break;
+  }
+
+#ifdef LIBRDF_HASH_BDB_USERMEM
+  if(bdb_flags == DB_SET_RANGE)
+    LIBRDF_FREE(char*, range_key.data);
+#endif
+  return ret;
+}
+#endif
+
+
 /**
  * librdf_hash_bdb_cursor_get:
  * @context: BerkeleyDB hash cursor context
@@ -447,6 +1242,9 @@ librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
  * @flags: flags
  *
  * Retrieve a hash value for the given key.
+ *
+ * The returned key and value point into buffers owned by the cursor
+ * and are valid until the next cursor move.
  * 
  * Return value: non 0 on failure
  **/
@@ -456,14 +1254,13 @@ librdf_hash_bdb_cursor_get(void* context,
                            unsigned int flags)
 {
   librdf_hash_bdb_cursor_context *cursor=(librdf_hash_bdb_cursor_context*)context;
-#ifdef HAVE_BDB_CURSOR
-  DBC *bdb_cursor=cursor->cursor;
-#else
+#ifndef HAVE_BDB_CURSOR
   /* For BDB V1 */
   DB* db;
 #endif
   DBT bdb_key;
   DBT bdb_value;
+  int key_index;
   int ret;
 
   /* docs say you must zero DBT's before use */
@@ -473,12 +1270,9 @@ librdf_hash_bdb_cursor_get(void* context,
   /* Always initialise BDB version of key */
   bdb_key.data = (char*)key->data;
   bdb_key.size = LIBRDF_BAD_CAST(u_int32_t, key->size);
-  
-#ifdef DB_DBT_MALLOC
-  /* BDB V2 or later? */
-  bdb_key.flags=DB_DBT_MALLOC;   /* Return in malloc() allocated memory */
-  bdb_value.flags=DB_DBT_MALLOC;
-#endif
+
+  /* read keys into the buffer not holding the last key */
+  key_index=cursor->has_last_key ? 1 - cursor->last_key_index : 0;
 
 #ifndef HAVE_BDB_CURSOR
   /* For BDB V1 */
@@ -489,10 +1283,8 @@ librdf_hash_bdb_cursor_get(void* context,
     case LIBRDF_HASH_CURSOR_SET:
 
 #ifdef HAVE_BDB_CURSOR
-      /* V2/V3 prototype:
-       * int DBcursor->c_get(DBC *cursor, DBT *key, DBT *data, u_int32_t flags);
-       */
-      ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_SET);
+      ret=librdf_hash_bdb_cursor_c_get(cursor, &bdb_key, &bdb_value, 1,
+                                       key_index, DB_SET);
 #else
       /* V1 */
       ret=db->seq(db, &bdb_key, &bdb_value, 0);
@@ -501,10 +1293,8 @@ librdf_hash_bdb_cursor_get(void* context,
       
     case LIBRDF_HASH_CURSOR_FIRST:
 #ifdef HAVE_BDB_CURSOR
-      /* V2/V3 prototype:
-       * int DBcursor->c_get(DBC *cursor, DBT *key, DBT *data, u_int32_t flags);
-       */
-      ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_FIRST);
+      ret=librdf_hash_bdb_cursor_c_get(cursor, &bdb_key, &bdb_value,
+                                       (value != NULL), key_index, DB_FIRST);
 #else
       /* V1 */
       ret=db->seq(db, &bdb_key, &bdb_value, R_FIRST);
@@ -514,20 +1304,18 @@ librdf_hash_bdb_cursor_get(void* context,
     case LIBRDF_HASH_CURSOR_NEXT_VALUE:
 #ifdef HAVE_BDB_CURSOR
       /* V2/V3 */
-      ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_NEXT);
+      ret=librdf_hash_bdb_cursor_c_get(cursor, &bdb_key, &bdb_value, 1,
+                                       key_index, DB_NEXT);
 #else
       /* V1 */
       ret=db->seq(db, &bdb_key, &bdb_value, R_NEXT);
 #endif
       
       /* If succeeded and key has changed, end */
-      if(!ret && cursor->last_key &&
-         memcmp(cursor->last_key, bdb_key.data, bdb_key.size)) {
-        
-        /* always allocated by BDB using system malloc */
-        SYSTEM_FREE(bdb_key.data);
-        SYSTEM_FREE(bdb_value.data);
-
+      if(!ret && cursor->has_last_key &&
+         (bdb_key.size != cursor->last_key_len ||
+          memcmp(cursor->key_buffer[cursor->last_key_index], bdb_key.data,
+                 bdb_key.size))) {
 #ifdef DB_NOTFOUND
         /* V2 and V3 */
         ret=DB_NOTFOUND;
@@ -544,8 +1332,9 @@ librdf_hash_bdb_cursor_get(void* context,
       /* V3 */
 
       /* Get next key, or next key/value (when value defined) */
-      ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value,
-                            (value) ? DB_NEXT : DB_NEXT_NODUP);
+      ret=librdf_hash_bdb_cursor_c_get(cursor, &bdb_key, &bdb_value,
+                                       (value != NULL), key_index,
+                                       (value) ? DB_NEXT : DB_NEXT_NODUP);
 #else
       /* V2 */
 
@@ -553,19 +1342,19 @@ librdf_hash_bdb_cursor_get(void* context,
        * the bdb btree having the keys in sorted order
        */
       while(1) {
-        ret=bdb_cursor->c_get(bdb_cursor, &bdb_key, &bdb_value, DB_NEXT);
+        ret=librdf_hash_bdb_cursor_c_get(cursor, &bdb_key, &bdb_value,
+                                         (value != NULL), key_index,
+                                         DB_NEXT);
         /* finish on error, want all values or no previous key */
-        if(ret || value || !cursor->last_key)
+        if(ret || value || !cursor->has_last_key)
           break;
         /* else have previous key and want unique keys, so keep
          * going until the key changes
          */
-        if(memcmp(cursor->last_key, bdb_key.data, bdb_key.size))
+        if(bdb_key.size != cursor->last_key_len ||
+           memcmp(cursor->key_buffer[cursor->last_key_index], bdb_key.data,
+                  bdb_key.size))
           break;
-        
-        /* always allocated by BDB using system malloc */
-        SYSTEM_FREE(bdb_key.data);
-        SYSTEM_FREE(bdb_value.data);
       }
 #endif
 #else
@@ -574,6 +1363,17 @@ librdf_hash_bdb_cursor_get(void* context,
 #endif
       break;
       
+    case LIBRDF_HASH_CURSOR_SET_RANGE:
+#ifdef HAVE_BDB_CURSOR
+      ret=librdf_hash_bdb_cursor_c_get(cursor, &bdb_key, &bdb_value,
+                                       (value != NULL), key_index,
+                                       DB_SET_RANGE);
+#else
+      /* V1 */
+      ret=db->seq(db, &bdb_key, &bdb_value, R_CURSOR);
+#endif
+      break;
+      
     default:
       librdf_log(cursor->hash->hash->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
@@ -582,19 +1382,6 @@ librdf_hash_bdb_cursor_get(void* context,
   }
 
 
-  /* Free previous key and values */
-  if(cursor->last_key) {
-    LIBRDF_FREE(char*, cursor->last_key);
-    cursor->last_key=NULL;
-  }
-    
-  if(cursor->last_value) {
-    LIBRDF_FREE(char*, cursor->last_value);
-    cursor->last_value=NULL;
-  }
-
-  
-
   if(ret) {
 #ifdef LIBRDF_DEBUG
 #ifdef DB_NOTFOUND
@@ -603,41 +1390,45 @@ librdf_hash_bdb_cursor_get(void* context,
       LIBRDF_DEBUG2("BDB cursor error - %d\n", ret);
 #endif
 #endif
+    cursor->has_last_key=0;
     key->data=NULL;
     return ret;
   }
-  
-  cursor->last_key = key->data = LIBRDF_MALLOC(void*, bdb_key.size);
-  if(!key->data) {
-    /* always allocated by BDB using system malloc */
-    if(flags != LIBRDF_HASH_CURSOR_SET)
-      SYSTEM_FREE(bdb_key.data);
-    SYSTEM_FREE(bdb_value.data);
-    return 1;
+
+#ifdef LIBRDF_HASH_BDB_USERMEM
+  if(flags == LIBRDF_HASH_CURSOR_SET)
+#endif
+  {
+    /* the key was not read into the cursor buffer - copy it */
+    if(librdf_hash_bdb_cursor_grow(&cursor->key_buffer[key_index],
+                                   &cursor->key_buffer_size[key_index],
+                                   bdb_key.size)) {
+      cursor->has_last_key=0;
+      return 1;
+    }
+    memcpy(cursor->key_buffer[key_index], bdb_key.data, bdb_key.size);
   }
-  
-  memcpy(key->data, bdb_key.data, bdb_key.size);
+
+  key->data = cursor->key_buffer[key_index];
   key->size = bdb_key.size;
 
+  cursor->last_key_index=key_index;
+  cursor->last_key_len=bdb_key.size;
+  cursor->has_last_key=1;
+
   if(value) {
-    cursor->last_value = value->data = LIBRDF_MALLOC(void*, bdb_value.size);
-    if(!value->data) {
-      /* always allocated by BDB using system malloc */
-      if(flags != LIBRDF_HASH_CURSOR_SET)
-        SYSTEM_FREE(bdb_key.data);
-      SYSTEM_FREE(bdb_value.data);
+#ifndef LIBRDF_HASH_BDB_USERMEM
+    /* V1 data is owned by BDB - copy it */
+    if(librdf_hash_bdb_cursor_grow(&cursor->value_buffer,
+                                   &cursor->value_buffer_size,
+                                   bdb_value.size))
       return 1;
-    }
-    
-    memcpy(value->data, bdb_value.data, bdb_value.size);
+    memcpy(cursor->value_buffer, bdb_value.data, bdb_value.size);
+#endif
+    value->data = cursor->value_buffer;
     value->size = bdb_value.size;
   }
 
-  /* always allocated by BDB using system malloc */
-  if(flags != LIBRDF_HASH_CURSOR_SET)
-    SYSTEM_FREE(bdb_key.data);
-  SYSTEM_FREE(bdb_value.data);
-
   return 0;
 }
 
@@ -659,11 +1450,14 @@ librdf_hash_bdb_cursor_finish(void* context)
   if(cursor->cursor)
     cursor->cursor->c_close(cursor->cursor);
 #endif
-  if(cursor->last_key)
-    LIBRDF_FREE(char*, cursor->last_key);
-    
-  if(cursor->last_value)
-    LIBRDF_FREE(char*, cursor->last_value);
+  if(cursor->key_buffer[0])
+    LIBRDF_FREE(char*, cursor->key_buffer[0]);
+
+  if(cursor->key_buffer[1])
+    LIBRDF_FREE(char*, cursor->key_buffer[1]);
+
+  if(cursor->value_buffer)
+    LIBRDF_FREE(char*, cursor->value_buffer);
 }
 
 
@@ -688,6 +1482,12 @@ librdf_hash_bdb_put(void* context, librdf_hash_datum *key,
   int ret;
   u_int32_t flags = 0;
 
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  /* snapshots are read-only */
+  if(bdb_context->snapshot_txn)
+    return 1;
+#endif
+
   /* docs say you must zero DBT's before use */
   memset(&bdb_value, 0, sizeof(DBT));
   memset(&bdb_key, 0, sizeof(DBT));
@@ -704,7 +1504,7 @@ librdf_hash_bdb_put(void* context, librdf_hash_datum *key,
   /* V2/V3 prototype:
    * int DB->put(DB *db, DB_TXN *txnid, DBT *key, DBT *data, u_int32_t flags); 
    */
-  ret = db->put(db, NULL, &bdb_key, &bdb_value, flags);
+  ret = db->put(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value, flags);
 #else
   /* V1 */
   ret = db->put(db, &bdb_key, &bdb_value, flags);
@@ -760,7 +1560,7 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
   /* later V2 (sigh)/V3 */
   if(value)
     flags = DB_GET_BOTH;
-  ret = db->get(db, NULL, &bdb_key, &bdb_value, flags);
+  ret = db->get(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value, flags);
   if(ret == DB_NOTFOUND)
     ret= 0;
   else if(ret) /* failed */
@@ -771,7 +1571,7 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
   /* earlier V2 */
   if(!value) {
     /* don't care about value, can use standard get */
-    ret = db->get(db, NULL, &bdb_key, &bdb_value, flags);
+    ret = db->get(db, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, &bdb_value, flags);
     if(ret == DB_NOTFOUND)
       ret= 0;
     else if(ret) /* failed */
@@ -784,7 +1584,7 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
     
     ret=1;
     
-    if(db->cursor(db, NULL, &dbc))
+    if(db->cursor(db, LIBRDF_HASH_BDB_TXN(bdb_context), &dbc))
       ret= -1;
 
     if(ret >= 0) {
@@ -865,6 +1665,150 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
 }
 
 
+/* one entry of a batch of key/value pairs, sorted into key order */
+typedef struct {
+  librdf_hash_datum *key;
+  librdf_hash_datum *value;
+  int index;
+} librdf_hash_bdb_batch_item;
+
+
+static int
+librdf_hash_bdb_batch_item_compare(const void *a, const void *b)
+{
+  const librdf_hash_bdb_batch_item* item_a=(const librdf_hash_bdb_batch_item*)a;
+  const librdf_hash_bdb_batch_item* item_b=(const librdf_hash_bdb_batch_item*)b;
+  size_t len;
+  int rc;
+
+  /* same ordering as the default BDB btree key comparison */
+  len=(item_a->key->size < item_b->key->size) ? item_a->key->size : item_b->key->size;
+  rc=memcmp(item_a->key->data, item_b->key->data, len);
+  if(rc)
+    return rc;
+  if(item_a->key->size != item_b->key->size)
+    return (item_a->key->size < item_b->key->size) ? -1 : 1;
+  /* keep the original order of equal keys */
+  return item_a->index - item_b->index;
+}
+
+
+/*
+ * librdf_hash_bdb_batch_sort:
+ * @keys: array of keys
+ * @values: array of values or NULL
+ * @count: number of keys
+ *
+ * INTERNAL - Sort a batch into btree key order, so that successive
+ * operations touch neighbouring pages.
+ *
+ * Return value: new array of count items or NULL on failure
+ */
+static librdf_hash_bdb_batch_item*
+librdf_hash_bdb_batch_sort(librdf_hash_datum *keys, librdf_hash_datum *values,
+                           int count)
+{
+  librdf_hash_bdb_batch_item* items;
+  int i;
+
+  items = LIBRDF_MALLOC(librdf_hash_bdb_batch_item*,
+                        sizeof(*items) * LIBRDF_GOOD_CAST(size_t, count));
+  if(!items)
+    return NULL;
+
+  for(i=0; i < count; i++) {
+    items[i].key=&keys[i];
+    items[i].value=values ? &values[i] : NULL;
+    items[i].index=i;
+  }
+
+  qsort(items, LIBRDF_GOOD_CAST(size_t, count), sizeof(*items),
+        librdf_hash_bdb_batch_item_compare);
+
+  return items;
+}
+
+
+/**
+ * librdf_hash_bdb_put_batch:
+ * @context: BerkeleyDB hash context
+ * @keys: array of keys to store
+ * @values: array of values to store
+ * @count: number of key/value pairs
+ *
+ * Store an array of key/value pairs in the hash, in key order.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_put_batch(void* context, librdf_hash_datum *keys,
+                          librdf_hash_datum *values, int count)
+{
+  librdf_hash_bdb_batch_item* items;
+  int status=0;
+  int i;
+
+  if(count <= 0)
+    return 0;
+
+  items=librdf_hash_bdb_batch_sort(keys, values, count);
+  if(!items)
+    return 1;
+
+  for(i=0; i < count; i++) {
+    if(librdf_hash_bdb_put(context, items[i].key, items[i].value)) {
+      status=1;
+      break;
+    }
+  }
+
+  LIBRDF_FREE(librdf_hash_bdb_batch_item, items);
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_bdb_exists_batch:
+ * @context: BerkeleyDB hash context
+ * @keys: array of keys
+ * @values: array of values or NULL
+ * @count: number of keys
+ * @results: array to store exists results in the original order
+ *
+ * Test the existence of an array of keys or key/values, in key order.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_exists_batch(void* context, librdf_hash_datum *keys,
+                             librdf_hash_datum *values, int count,
+                             int *results)
+{
+  librdf_hash_bdb_batch_item* items;
+  int status=0;
+  int i;
+
+  if(count <= 0)
+    return 0;
+
+  items=librdf_hash_bdb_batch_sort(keys, values, count);
+  if(!items)
+    return 1;
+
+  for(i=0; i < count; i++) {
+    int rc=librdf_hash_bdb_exists(context, items[i].key, items[i].value);
+    results[items[i].index]=rc;
+    if(rc < 0)
+      status=1;
+  }
+
+  LIBRDF_FREE(librdf_hash_bdb_batch_item, items);
+
+  return status;
+}
+
+
 /**
  * librdf_hash_bdb_delete_key:
  * @context: BerkeleyDB hash context
@@ -883,6 +1827,12 @@ librdf_hash_bdb_delete_key(void* context, librdf_hash_datum *key)
   int ret;
   u_int32_t flags = 0;
 
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  /* snapshots are read-only */
+  if(bdb_context->snapshot_txn)
+    return 1;
+#endif
+
   memset(&bdb_key, 0, sizeof(DBT));
 
   /* Initialise BDB version of key */
@@ -891,7 +1841,7 @@ librdf_hash_bdb_delete_key(void* context, librdf_hash_datum *key)
   
 #ifdef HAVE_BDB_DB_TXN
   /* V2/V3 */
-  ret = bdb->del(bdb, NULL, &bdb_key, flags);
+  ret = bdb->del(bdb, LIBRDF_HASH_BDB_TXN(bdb_context), &bdb_key, flags);
 #else
   /* V1 */
   ret = bdb->del(bdb, &bdb_key, flags);
@@ -928,6 +1878,12 @@ librdf_hash_bdb_delete_key_value(void* context,
   DBC* dbc;
 #endif
 
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  /* snapshots are read-only */
+  if(bdb_context->snapshot_txn)
+    return 1;
+#endif
+
   memset(&bdb_key, 0, sizeof(DBT));
   memset(&bdb_value, 0, sizeof(DBT));
 
@@ -943,13 +1899,13 @@ librdf_hash_bdb_delete_key_value(void* context,
   /* V3 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp, u_int32_t flags);
    */
-  if(bdb->cursor(bdb, NULL, &dbc, flags))
+  if(bdb->cursor(bdb, LIBRDF_HASH_BDB_TXN(bdb_context), &dbc, flags))
     return 1;
 #else
   /* V2 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp);
    */
-  if(bdb->cursor(bdb, NULL, &dbc))
+  if(bdb->cursor(bdb, LIBRDF_HASH_BDB_TXN(bdb_context), &dbc))
     return 1;
 #endif
   
@@ -1042,6 +1998,130 @@ librdf_hash_bdb_get_fd(void* context)
 }
 
 
+/**
+ * librdf_hash_bdb_transaction_start:
+ * @context: BerkeleyDB hash context
+ *
+ * Start a transaction in the shared environment of the hash.
+ *
+ * The transaction covers every hash in the environment so starting
+ * it again from another hash in the same environment is not an error.
+ * 
+ * Return value: non 0 on failure or if the hash is not transactional
+ **/
+static int
+librdf_hash_bdb_transaction_start(void* context) 
+{
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  librdf_hash_bdb_env* env=bdb_context->env;
+  int ret;
+
+  if(!env || !env->is_transactional)
+    return 1;
+
+  if(env->txn)
+    return 0;
+
+  ret=env->env->txn_begin(env->env, NULL, &env->txn, 0);
+  if(ret) {
+    env->txn=NULL;
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL,
+               "BDB transaction begin failed - %s", db_strerror(ret));
+    return 1;
+  }
+
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+
+/**
+ * librdf_hash_bdb_transaction_commit:
+ * @context: BerkeleyDB hash context
+ *
+ * Commit the transaction in the shared environment of the hash.
+ *
+ * Cursors opened during the transaction must be finished first.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_transaction_commit(void* context) 
+{
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  librdf_hash_bdb_env* env=bdb_context->env;
+  DB_TXN* txn;
+  int ret;
+
+  if(!env || !env->txn)
+    return 0;
+
+  /* the handle is freed by commit whether or not it succeeds */
+  txn=env->txn;
+  env->txn=NULL;
+  ret=txn->commit(txn, 0);
+  if(ret) {
+    librdf_log(bdb_context->hash->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL,
+               "BDB transaction commit failed - %s", db_strerror(ret));
+    return 1;
+  }
+
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+
+/**
+ * librdf_hash_bdb_transaction_rollback:
+ * @context: BerkeleyDB hash context
+ *
+ * Abort the transaction in the shared environment of the hash.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_bdb_transaction_rollback(void* context) 
+{
+#ifdef LIBRDF_HASH_BDB_ENV
+  librdf_hash_bdb_context* bdb_context=(librdf_hash_bdb_context*)context;
+  librdf_hash_bdb_env* env=bdb_context->env;
+  DB_TXN* txn;
+
+  if(!env || !env->txn)
+    return 0;
+
+  txn=env->txn;
+  env->txn=NULL;
+  return (txn->abort(txn) != 0);
+#else
+  return 1;
+#endif
+}
+
+
+/**
+ * librdf_hash_bdb_is_ordered:
+ * @context: BerkeleyDB hash context
+ *
+ * The hash is always a btree with the default byte order comparison.
+ * 
+ * Return value: non 0
+ **/
+static int
+librdf_hash_bdb_is_ordered(void* context) 
+{
+  return 1;
+}
+
+
 /* local function to register BDB hash functions */
 
 /**
@@ -1063,16 +2143,33 @@ librdf_hash_bdb_register_factory(librdf_hash_factory *factory)
   factory->open    = librdf_hash_bdb_open;
   factory->close   = librdf_hash_bdb_close;
   factory->clone   = librdf_hash_bdb_clone;
+#ifdef LIBRDF_HASH_BDB_SNAPSHOT
+  factory->snapshot = librdf_hash_bdb_snapshot;
+#endif
 
   factory->values_count = librdf_hash_bdb_values_count;
 
   factory->put     = librdf_hash_bdb_put;
   factory->exists  = librdf_hash_bdb_exists;
+  factory->put_batch = librdf_hash_bdb_put_batch;
+  factory->exists_batch = librdf_hash_bdb_exists_batch;
   factory->delete_key  = librdf_hash_bdb_delete_key;
   factory->delete_key_value  = librdf_hash_bdb_delete_key_value;
   factory->sync    = librdf_hash_bdb_sync;
   factory->get_fd  = librdf_hash_bdb_get_fd;
 
+  factory->transaction_start    = librdf_hash_bdb_transaction_start;
+  factory->transaction_commit   = librdf_hash_bdb_transaction_commit;
+  factory->transaction_rollback = librdf_hash_bdb_transaction_rollback;
+
+  factory->is_ordered    = librdf_hash_bdb_is_ordered;
+#ifdef LIBRDF_HASH_BDB_STATS
+  factory->get_stats     = librdf_hash_bdb_get_stats;
+#endif
+#ifdef LIBRDF_HASH_BDB_COMPACT
+  factory->compact       = librdf_hash_bdb_compact;
+#endif
+
   factory->cursor_init   = librdf_hash_bdb_cursor_init;
   factory->cursor_get    = librdf_hash_bdb_cursor_get;
   factory->cursor_finish = librdf_hash_bdb_cursor_finish;
@@ -0,0 +1,198 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_bench.c - RDF memory hash key function micro-benchmark
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/* one prototype needed */
+int main(int argc, char *argv[]);
+
+
+#define BENCH_ROUNDS 20
+
+
+/*
+ * Keys are encoded (subject, predicate) statement parts, as used for
+ * the sp2o index of the hashes storage, with realistic long URIs.
+ */
+static unsigned char**
+bench_make_keys(librdf_world* world, int count, size_t** key_lens_p,
+                size_t* total_p)
+{
+  const char * const predicates[]={
+    "http://www.w3.org/1999/02/22-rdf-syntax-ns#type",
+    "http://www.w3.org/2000/01/rdf-schema#label",
+    "http://purl.org/dc/elements/1.1/title",
+    "http://xmlns.com/foaf/0.1/knows",
+    "http://example.org/vocabulary/2008/properties#hasVeryLongPropertyName"
+  };
+  unsigned char** keys;
+  size_t* key_lens;
+  char uri_string[256];
+  int i;
+
+  keys = LIBRDF_CALLOC(unsigned char**, count, sizeof(unsigned char*));
+  key_lens = LIBRDF_CALLOC(size_t*, count, sizeof(size_t));
+  if(!keys || !key_lens)
+    return NULL;
+
+  *total_p=0;
+  for(i=0; i < count; i++) {
+    librdf_statement* statement;
+    size_t len;
+
+    sprintf(uri_string, "http://data.example.org/dataset/%d/resource/item-%d",
+            i % 97, i);
+    statement=librdf_new_statement_from_nodes(world,
+      librdf_new_node_from_uri_string(world, (const unsigned char*)uri_string),
+      librdf_new_node_from_uri_string(world, (const unsigned char*)predicates[i % 5]),
+      librdf_new_node_from_literal(world, (const unsigned char*)"x", NULL, 0));
+    if(!statement)
+      return NULL;
+
+    len=librdf_statement_encode_parts2(world, statement, NULL, NULL, 0,
+                                       (librdf_statement_part)(LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE));
+    keys[i] = LIBRDF_MALLOC(unsigned char*, len);
+    if(!keys[i])
+      return NULL;
+    librdf_statement_encode_parts2(world, statement, NULL, keys[i], len,
+                                   (librdf_statement_part)(LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE));
+    key_lens[i]=len;
+    *total_p += len;
+
+    librdf_free_statement(statement);
+  }
+
+  *key_lens_p=key_lens;
+  return keys;
+}
+
+
+static void
+bench_report(const char* program, const char* name, u32* hashes, int count,
+             size_t total, clock_t ticks)
+{
+  int capacity;
+  int* buckets;
+  int i;
+  int used=0;
+  int longest=0;
+  double seconds=(double)ticks / CLOCKS_PER_SEC;
+
+  /* bucket spread for a power of 2 table at the memory hash load factor */
+  for(capacity=8; capacity * 3 < count * 4; capacity <<= 1)
+    ;
+  buckets = LIBRDF_CALLOC(int*, capacity, sizeof(int));
+  if(!buckets)
+    return;
+  for(i=0; i < count; i++) {
+    int b=(int)(hashes[i] & (u32)(capacity - 1));
+    if(!buckets[b]++)
+      used++;
+    if(buckets[b] > longest)
+      longest=buckets[b];
+  }
+  LIBRDF_FREE(int*, buckets);
+
+  fprintf(stdout,
+          "%s: %-14s %8.1f ns/key %8.1f MB/s  buckets %d/%d used, longest chain %d\n",
+          program, name,
+          seconds * 1e9 / ((double)count * BENCH_ROUNDS),
+          seconds > 0 ? ((double)total * BENCH_ROUNDS) / (seconds * 1e6) : 0.0,
+          used, capacity, longest);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  librdf_world* world;
+  const char *program=librdf_basename((const char*)argv[0]);
+  int count=100000;
+  unsigned char** keys;
+  size_t* key_lens=NULL;
+  size_t total=0;
+  u32* hashes;
+  clock_t start;
+  int round;
+  int i;
+
+  if(argc > 1)
+    count=atoi(argv[1]);
+  if(count < 1) {
+    fprintf(stderr, "USAGE: %s [KEY-COUNT]\n", program);
+    return 1;
+  }
+
+  world=librdf_new_world();
+  librdf_world_open(world);
+
+  keys=bench_make_keys(world, count, &key_lens, &total);
+  hashes = LIBRDF_CALLOC(u32*, count, sizeof(u32));
+  if(!keys || !hashes) {
+    fprintf(stderr, "%s: Failed to create keys\n", program);
+    return 1;
+  }
+
+  fprintf(stdout, "%s: %d keys, average length %.1f bytes, %d rounds\n",
+          program, count, (double)total / count, BENCH_ROUNDS);
+
+  start=clock();
+  for(round=0; round < BENCH_ROUNDS; round++)
+    for(i=0; i < count; i++)
+      LIBRDF_ONE_AT_A_TIME_HASH(hashes[i], keys[i], key_lens[i]);
+  bench_report(program, "one-at-a-time", hashes, count, total,
+               clock() - start);
+
+  start=clock();
+  for(round=0; round < BENCH_ROUNDS; round++)
+    for(i=0; i < count; i++)
+      LIBRDF_WORD_AT_A_TIME_HASH(hashes[i], keys[i], key_lens[i]);
+  bench_report(program, "word-at-a-time", hashes, count, total,
+               clock() - start);
+
+  for(i=0; i < count; i++)
+    LIBRDF_FREE(char*, keys[i]);
+  LIBRDF_FREE(char**, keys);
+  LIBRDF_FREE(size_t*, key_lens);
+  LIBRDF_FREE(u32*, hashes);
+
+  librdf_free_world(world);
+
+  return 0;
+}
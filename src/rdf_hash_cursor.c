@@ -73,6 +73,8 @@ librdf_new_hash_cursor (librdf_hash* hash)
 
   cursor->hash=hash;
   cursor->context=cursor_context;
+  hash->cursors_count++;
+  hash->cursors_open++;
 
   if(hash->factory->cursor_init(cursor->context, hash->context)) {
     librdf_free_hash_cursor(cursor);
@@ -101,6 +103,7 @@ librdf_free_hash_cursor (librdf_hash_cursor* cursor)
     LIBRDF_FREE(librdf_hash_cursor_context, cursor->context);
   }
 
+  cursor->hash->cursors_open--;
   LIBRDF_FREE(librdf_hash_cursor, cursor);
 }
 
@@ -141,3 +144,15 @@ librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *key,
   return cursor->hash->factory->cursor_get(cursor->context, key, value, 
                                            LIBRDF_HASH_CURSOR_NEXT);
 }
+
+
+int
+librdf_hash_cursor_set_range(librdf_hash_cursor *cursor,
+                             librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  if(!librdf_hash_is_ordered(cursor->hash))
+    return 1;
+
+  return cursor->hash->factory->cursor_get(cursor->context, key, value, 
+                                           LIBRDF_HASH_CURSOR_SET_RANGE);
+}
@@ -55,6 +55,10 @@ struct librdf_hash_s
   void* context;
   int   is_open;
   struct librdf_hash_factory_s* factory;
+  /* number of cursors created over this hash */
+  unsigned long cursors_count;
+  /* number of those cursors not yet freed */
+  int cursors_open;
 };
 
 
@@ -73,6 +77,10 @@ struct librdf_hash_factory_s {
   /* clone an existing storage */
   int (*clone)(librdf_hash* new_hash, void* new_context, char* new_name, void* old_context);
 
+  /* OPTIONAL: make new_context a read-only view of the contents of
+   * old_context as they are now, without copying them */
+  int (*snapshot)(librdf_hash* new_hash, void* new_context, void* old_context);
+
   /* create / destroy a hash implementation */
   int (*create)(librdf_hash* hash, void* context);
   int (*destroy)(void* context);
@@ -91,6 +99,13 @@ struct librdf_hash_factory_s {
   /* returns true if key exists in hash, without returning value */
   int (*exists)(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 
+  /* OPTIONAL: insert an array of count key/value pairs */
+  int (*put_batch)(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+
+  /* OPTIONAL: set results[i] to the exists result for each key/value
+   * pair; values may be NULL to check keys alone */
+  int (*exists_batch)(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+
   int (*delete_key)(void* context, librdf_hash_datum *key);
   int (*delete_key_value)(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 
@@ -100,6 +115,26 @@ struct librdf_hash_factory_s {
   /* get the file descriptor for the hash, if it is file based (for locking) */
   int (*get_fd)(void* context);
 
+  /* OPTIONAL: transactions */
+  int (*transaction_start)(void* context);
+  int (*transaction_commit)(void* context);
+  int (*transaction_rollback)(void* context);
+
+  /* OPTIONAL: returns non 0 if cursors return keys in byte order
+   * (shorter keys first) and support LIBRDF_HASH_CURSOR_SET_RANGE */
+  int (*is_ordered)(void* context);
+
+  /* OPTIONAL: add implementation statistics to the stats hash as
+   * string key/value pairs */
+  int (*get_stats)(void* context, librdf_hash* stats);
+
+  /* OPTIONAL: rewrite the hash in key order, reclaiming free space;
+   * never called while cursors are open */
+  int (*compact)(void* context);
+
+  /* OPTIONAL: approximate bytes of process memory held by the hash */
+  size_t (*get_memory_size)(void* context);
+
   /* create a cursor and operate on it */
   int (*cursor_init)(void *cursor_context, void* hash_context);
   int (*cursor_get)(void *cursor, librdf_hash_datum *key, librdf_hash_datum *value, unsigned int flags);
@@ -118,11 +153,98 @@ void librdf_init_hash(librdf_world *world);
 /* module terminate */
 void librdf_finish_hash(librdf_world *world);
 
-/* hash cursor_get method flags */
+/*
+ * perldelta 5.8.0 says under *Performance Enhancements*
+ *
+ *   Hashes now use Bob Jenkins "One-at-a-Time" hashing key algorithm
+ *   http://burtleburtle.net/bob/hash/doobs.html  This algorithm is
+ *   reasonably fast while producing a much better spread of values
+ *   than the old hashing algorithm ...
+ *
+ * Changed here to hash the string backwards to help do URIs better
+ *
+ */
+
+#define LIBRDF_ONE_AT_A_TIME_HASH(hash,str,len) \
+     do { \
+        register const unsigned char *c_oneat = (unsigned char*)str+len-1; \
+        register size_t i_oneat = len; \
+        register u32 hash_oneat = 0; \
+        while (i_oneat--) { \
+            hash_oneat += *c_oneat--; \
+            hash_oneat += (hash_oneat << 10); \
+            hash_oneat ^= (hash_oneat >> 6); \
+        } \
+        hash_oneat += (hash_oneat << 3); \
+        hash_oneat ^= (hash_oneat >> 11); \
+        (hash) = (hash_oneat + (hash_oneat << 15)); \
+    } while(0)
+
+
+/*
+ * Word at a time hash after Austin Appleby's public domain MurmurHash64A
+ * https://github.com/aappleby/smhasher
+ *
+ * Mixes 8 bytes per step so is several times faster than the
+ * one-at-a-time hash on the long encoded node keys used by the hashes
+ * storage.  The result depends on the machine byte order so must only
+ * be used for in-memory tables.
+ *
+ */
+
+#define LIBRDF_WORD_AT_A_TIME_HASH(hash,str,len) \
+     do { \
+        const unsigned char *c_word = (const unsigned char*)(str); \
+        size_t i_word = (len); \
+        const u64 m_word = ((u64)0xc6a4a793UL << 32) | (u64)0x5bd1e995UL; \
+        u64 hash_word = (((u64)0x9e3779b9UL << 32) | (u64)0x7f4a7c15UL) ^ \
+                        ((u64)i_word * m_word); \
+        u64 k_word; \
+        while (i_word >= 8) { \
+            memcpy(&k_word, c_word, 8); \
+            k_word *= m_word; \
+            k_word ^= (k_word >> 47); \
+            k_word *= m_word; \
+            hash_word ^= k_word; \
+            hash_word *= m_word; \
+            c_word += 8; \
+            i_word -= 8; \
+        } \
+        if (i_word) { \
+            k_word = 0; \
+            while (i_word--) \
+                k_word = (k_word << 8) | c_word[i_word]; \
+            hash_word ^= k_word; \
+            hash_word *= m_word; \
+        } \
+        hash_word ^= (hash_word >> 47); \
+        hash_word *= m_word; \
+        hash_word ^= (hash_word >> 47); \
+        (hash) = (u32)(hash_word ^ (hash_word >> 32)); \
+    } while(0)
+
+
+/* Key hash used by the memory hash factories; define
+ * LIBRDF_HASH_ONE_AT_A_TIME when building to use the older hash */
+#ifdef LIBRDF_HASH_ONE_AT_A_TIME
+#define LIBRDF_HASH_MEMORY_HASH(hash,str,len) LIBRDF_ONE_AT_A_TIME_HASH(hash,str,len)
+#else
+#define LIBRDF_HASH_MEMORY_HASH(hash,str,len) LIBRDF_WORD_AT_A_TIME_HASH(hash,str,len)
+#endif
+
+
+/* hash cursor_get method flags
+ *
+ * The key and value data returned by cursor_get are borrowed from the
+ * hash or cursor and are only valid until the next cursor_get or
+ * cursor_finish on that cursor; callers copy them if they need more.
+ */
 #define LIBRDF_HASH_CURSOR_SET 0
 #define LIBRDF_HASH_CURSOR_NEXT_VALUE 1
 #define LIBRDF_HASH_CURSOR_FIRST 2
 #define LIBRDF_HASH_CURSOR_NEXT 3
+/* move to the first key/value with key >= given key; ordered hashes only */
+#define LIBRDF_HASH_CURSOR_SET_RANGE 4
 
 
 /* constructors */
@@ -135,6 +257,9 @@ int librdf_hash_open(librdf_hash* hash, const char *identifier, int mode, int is
 /* end hash association */
 int librdf_hash_close(librdf_hash* hash);
 
+/* read-only view of a hash as it is now, if supported by the hash factory */
+librdf_hash* librdf_new_hash_snapshot(librdf_hash* old_hash);
+
 /* how many values */
 int librdf_hash_values_count(librdf_hash* hash);
 
@@ -150,15 +275,35 @@ int librdf_hash_put(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum
   /* returns true if key exists in hash, without returning value */
 int librdf_hash_exists(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 
+/* insert / test arrays of key/value pairs */
+int librdf_hash_put_batch(librdf_hash* hash, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
+int librdf_hash_exists_batch(librdf_hash* hash, librdf_hash_datum *keys, librdf_hash_datum *values, int count, int *results);
+
 int librdf_hash_delete(librdf_hash* hash, librdf_hash_datum *key, librdf_hash_datum *value);
 int librdf_hash_delete_all(librdf_hash* hash, librdf_hash_datum *key);
 librdf_iterator* librdf_hash_keys(librdf_hash* hash, librdf_hash_datum *key);
 
+/* retrieve all key/value pairs with keys starting with a prefix */
+librdf_iterator* librdf_hash_get_prefix(librdf_hash* hash, librdf_hash_datum *prefix);
+int librdf_hash_is_ordered(librdf_hash* hash);
+
 /* flush any cached information to disk */
 int librdf_hash_sync(librdf_hash* hash);
 /* get the file descriptor for the hash, if it is file based (for locking) */
 int librdf_hash_get_fd(librdf_hash* hash);
 
+/* transactions, if supported by the hash factory */
+int librdf_hash_transaction_start(librdf_hash* hash);
+int librdf_hash_transaction_commit(librdf_hash* hash);
+int librdf_hash_transaction_rollback(librdf_hash* hash);
+
+/* rewrite the hash in key order, if supported by the hash factory */
+int librdf_hash_compact(librdf_hash* hash);
+size_t librdf_hash_get_memory_size(librdf_hash* hash);
+
+/* add a counter to a hash of statistics */
+int librdf_hash_put_stat(librdf_hash* stats, const char *key, unsigned long value);
+
 /* init a hash from an array of strings */
 int librdf_hash_from_array_of_strings(librdf_hash* hash, const char *array[]);
 
@@ -171,11 +316,16 @@ int librdf_hash_cursor_set(librdf_hash_cursor *cursor, librdf_hash_datum *key,li
 int librdf_hash_cursor_get_next_value(librdf_hash_cursor *cursor, librdf_hash_datum *key,librdf_hash_datum *value);
 int librdf_hash_cursor_get_first(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
 int librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
+int librdf_hash_cursor_set_range(librdf_hash_cursor *cursor, librdf_hash_datum *key, librdf_hash_datum *value);
 
 #ifdef HAVE_BDB_HASH
 void librdf_init_hash_bdb(librdf_world *world);
 #endif
 void librdf_init_hash_memory(librdf_world *world);
+void librdf_init_hash_memory_flat(librdf_world *world);
+#ifdef HAVE_MMAP_HASH
+void librdf_init_hash_mmap(librdf_world *world);
+#endif
 
 
 #ifdef __cplusplus
@@ -50,6 +50,11 @@ struct librdf_hash_memory_node_value_s
   struct librdf_hash_memory_node_value_s* next;
   void *value;
   size_t value_len;
+  /* hash version when the value was added and removed; removed is 0
+   * while the value is live.  Removed values are only kept while
+   * snapshots might still see them */
+  unsigned long added;
+  unsigned long removed;
 };
 typedef struct librdf_hash_memory_node_value_s librdf_hash_memory_node_value;
 
@@ -66,7 +71,17 @@ struct librdf_hash_memory_node_s
 typedef struct librdf_hash_memory_node_s librdf_hash_memory_node;
 
 
-typedef struct
+/* arena block; allocations are carved from the bytes following it */
+struct librdf_hash_memory_arena_block_s
+{
+  struct librdf_hash_memory_arena_block_s* next;
+  size_t size;
+  size_t used;
+};
+typedef struct librdf_hash_memory_arena_block_s librdf_hash_memory_arena_block;
+
+
+typedef struct librdf_hash_memory_context_s
 {
   /* the hash object */
   librdf_hash* hash;
@@ -81,11 +96,47 @@ typedef struct
   /* total array size */
   int capacity;
 
+  /* While growing, the previous bucket array which is migrated into
+   * nodes a few buckets at a time by librdf_hash_memory_rehash_step().
+   * Buckets below rehash_bucket have been moved and are empty.
+   * NULL when no resize is in progress.
+   */
+  librdf_hash_memory_node** old_nodes;
+  int old_capacity;
+  int rehash_bucket;
+  /* number of times the bucket array has grown */
+  int resizes;
+
   /* array load factor expressed out of 1000.
    * Always true: (size/capacity * 1000) < load_factor,
    * or in the code: size * 1000 < load_factor * capacity
    */
   int load_factor;
+
+  /* non 0 if nodes, keys and values are allocated from the arena */
+  int use_arena;
+  /* list of arena blocks, most recent first */
+  librdf_hash_memory_arena_block* arena;
+  /* bytes allocated for arena blocks */
+  size_t arena_size;
+  /* bytes handed out from the arena */
+  size_t arena_used;
+  /* bytes of nodes, keys and values when not using the arena */
+  size_t allocated;
+
+  /* version of the hash, increased by every put and delete */
+  unsigned long version;
+  /* number of snapshots reading this hash.  While non 0 the bucket
+   * arrays are not resized and removed values are only marked */
+  int snapshots;
+  /* number of values marked removed */
+  int dead_values;
+
+  /* for a snapshot: the hash it reads, the version of that hash it
+   * sees and the number of values at that version */
+  struct librdf_hash_memory_context_s* source;
+  unsigned long snapshot_version;
+  int snapshot_values;
 } librdf_hash_memory_context;
 
 
@@ -96,11 +147,27 @@ static const int librdf_hash_default_load_factor=750;
 /* starting capacity - MUST BE POWER OF 2 */
 static const int librdf_hash_initial_capacity=8;
 
+/* number of old buckets migrated by each put or delete while resizing */
+static const int librdf_hash_memory_rehash_buckets=8;
+
+/* default arena block size in bytes */
+static const size_t librdf_hash_memory_arena_block_size=65536;
+
+/* all arena allocations are rounded up to a multiple of this */
+#define LIBRDF_HASH_MEMORY_ARENA_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
 
 /* prototypes for local functions */
-static librdf_hash_memory_node* librdf_hash_memory_find_node(librdf_hash_memory_context* hash, void *key, size_t key_len, int *bucket, librdf_hash_memory_node** prev);
-static void librdf_free_hash_memory_node(librdf_hash_memory_node* node);
-static int librdf_hash_memory_expand_size(librdf_hash_memory_context* hash);
+static librdf_hash_memory_node* librdf_hash_memory_find_node(librdf_hash_memory_context* hash, void *key, size_t key_len, librdf_hash_memory_node*** bucket, librdf_hash_memory_node** prev);
+static void librdf_free_hash_memory_node(librdf_hash_memory_context* hash, librdf_hash_memory_node* node);
+static void* librdf_hash_memory_alloc(librdf_hash_memory_context* hash, size_t size);
+static void librdf_hash_memory_free(librdf_hash_memory_context* hash, void* ptr, size_t size);
+static void librdf_hash_memory_free_arena(librdf_hash_memory_context* hash);
+static int librdf_hash_memory_expand_size(librdf_hash_memory_context* hash, int new_keys);
+static void librdf_hash_memory_rehash_step(librdf_hash_memory_context* hash, int buckets);
+static librdf_hash_memory_node* librdf_hash_memory_get_bucket(librdf_hash_memory_context* hash, int bucket);
+static librdf_hash_memory_node_value* librdf_hash_memory_visible_value(librdf_hash_memory_context* view, librdf_hash_memory_node_value* vnode);
+static void librdf_hash_memory_sweep(librdf_hash_memory_context* hash);
 
 /* Implementing the hash cursor */
 static int librdf_hash_memory_cursor_init(void *cursor_context, void *hash_context);
@@ -117,9 +184,11 @@ static int librdf_hash_memory_destroy(void* context);
 static int librdf_hash_memory_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
 static int librdf_hash_memory_close(void* context);
 static int librdf_hash_memory_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_memory_snapshot(librdf_hash* new_hash, void *new_context, void* old_context);
 static int librdf_hash_memory_values_count(void *context);
 static int librdf_hash_memory_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
 static int librdf_hash_memory_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory_put_batch(void* context, librdf_hash_datum *keys, librdf_hash_datum *values, int count);
 static int librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key);
 static int librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
 static int librdf_hash_memory_sync(void* context);
@@ -130,35 +199,6 @@ static void librdf_hash_memory_register_factory(librdf_hash_factory *factory);
 
 
 
-/*
- * perldelta 5.8.0 says under *Performance Enhancements*
- *
- *   Hashes now use Bob Jenkins "One-at-a-Time" hashing key algorithm
- *   http://burtleburtle.net/bob/hash/doobs.html  This algorithm is
- *   reasonably fast while producing a much better spread of values
- *   than the old hashing algorithm ...
- *
- * Changed here to hash the string backwards to help do URIs better
- *
- */
-
-#define ONE_AT_A_TIME_HASH(hash,str,len) \
-     do { \
-        register const unsigned char *c_oneat = (unsigned char*)str+len-1; \
-        register size_t i_oneat = len; \
-        register u32 hash_oneat = 0; \
-        while (i_oneat--) { \
-            hash_oneat += *c_oneat--; \
-            hash_oneat += (hash_oneat << 10); \
-            hash_oneat ^= (hash_oneat >> 6); \
-        } \
-        hash_oneat += (hash_oneat << 3); \
-        hash_oneat ^= (hash_oneat >> 11); \
-        (hash) = (hash_oneat + (hash_oneat << 15)); \
-    } while(0)
-
-
-
 /* helper functions */
 
 
@@ -175,40 +215,40 @@ static void librdf_hash_memory_register_factory(librdf_hash_factory *factory);
  * If value is not NULL and value_len is non 0, the value will also be
  * compared in the search.
  *
- * If user_bucket is not NULL, the bucket used will be returned.  if
- * prev is no NULL, the previous node in the list will be returned.
+ * If user_bucket is not NULL, the address of the bucket list head
+ * used will be returned; during a resize this may be in the old
+ * bucket array.  if prev is no NULL, the previous node in the list
+ * will be returned.
  * 
  * Return value: #librdf_hash_memory_node of content or NULL on failure
  **/
 static librdf_hash_memory_node*
 librdf_hash_memory_find_node(librdf_hash_memory_context* hash, 
 			     void *key, size_t key_len,
-			     int *user_bucket,
+			     librdf_hash_memory_node*** user_bucket,
 			     librdf_hash_memory_node** prev) 
 {
   librdf_hash_memory_node* node;
-  int bucket;
+  librdf_hash_memory_node** bucket;
   u32 hash_key;
 
   /* empty hash */
   if(!hash->capacity)
     return NULL;
   
-  ONE_AT_A_TIME_HASH(hash_key, key, key_len);
+  LIBRDF_HASH_MEMORY_HASH(hash_key, key, key_len);
 
   if(prev)
     *prev=NULL;
 
-  /* find slot in table */
-  bucket=hash_key & (hash->capacity - 1);
-  if(user_bucket)
-    *user_bucket=bucket;
-
-  /* check if there is a list present */ 
-  node=hash->nodes[bucket];
-  if(!node)
-    /* no list there */
-    return NULL;
+  /* find slot in table; during a resize, keys in buckets not yet
+   * migrated are still in the old table */
+  node=NULL;
+  bucket=NULL;
+  if(hash->old_nodes) {
+    bucket=&hash->old_nodes[hash_key & (hash->old_capacity - 1)];
+    node=*bucket;
+  }
     
   /* walk the list */
   while(node) {
@@ -219,15 +259,139 @@ librdf_hash_memory_find_node(librdf_hash_memory_context* hash,
     node=node->next;
   }
 
+  if(!node) {
+    if(prev)
+      *prev=NULL;
+
+    bucket=&hash->nodes[hash_key & (hash->capacity - 1)];
+
+    /* walk the list */
+    for(node=*bucket; node; node=node->next) {
+      if(key_len == node->key_len && !memcmp(key, node->key, key_len))
+        break;
+      if(prev)
+        *prev=node;
+    }
+  }
+
+  if(user_bucket)
+    *user_bucket=bucket;
+
   return node;
 }
 
 
+/**
+ * librdf_hash_memory_alloc:
+ * @hash: the memory hash context
+ * @size: bytes wanted
+ *
+ * Allocate memory for a node, key or value.
+ *
+ * In arena mode the memory is carved out of a large block and is only
+ * returned to the system when the hash is destroyed.
+ *
+ * Return value: pointer to memory or NULL on failure
+ **/
+static void*
+librdf_hash_memory_alloc(librdf_hash_memory_context* hash, size_t size)
+{
+  librdf_hash_memory_arena_block* block;
+  size_t header_size;
+  size_t block_size;
+  void *ptr;
+
+  if(!hash->use_arena) {
+    ptr=LIBRDF_MALLOC(void*, size);
+    if(ptr)
+      hash->allocated += size;
+    return ptr;
+  }
+
+  header_size=LIBRDF_HASH_MEMORY_ARENA_ALIGN(sizeof(librdf_hash_memory_arena_block));
+  size=LIBRDF_HASH_MEMORY_ARENA_ALIGN(size ? size : 1);
+
+  block=hash->arena;
+  if(!block || block->size - block->used < size) {
+    block_size=librdf_hash_memory_arena_block_size;
+    /* big items get a block of their own */
+    if(size > block_size - header_size)
+      block_size=header_size + size;
+
+    block = LIBRDF_MALLOC(librdf_hash_memory_arena_block*, block_size);
+    if(!block)
+      return NULL;
+
+    block->size=block_size;
+    block->used=header_size;
+
+    if(hash->arena && block_size > librdf_hash_memory_arena_block_size) {
+      /* keep filling the current block after a big item */
+      block->next=hash->arena->next;
+      hash->arena->next=block;
+    } else {
+      block->next=hash->arena;
+      hash->arena=block;
+    }
+
+    hash->arena_size += block_size;
+  }
+
+  ptr=(char*)block + block->used;
+  block->used += size;
+  hash->arena_used += size;
+
+  return ptr;
+}
+
+
+/**
+ * librdf_hash_memory_free:
+ * @hash: the memory hash context
+ * @ptr: memory from librdf_hash_memory_alloc()
+ * @size: size passed to librdf_hash_memory_alloc()
+ *
+ * Free memory for a node, key or value.
+ *
+ * A no-op in arena mode - space is reclaimed by librdf_hash_memory_destroy()
+ **/
+static void
+librdf_hash_memory_free(librdf_hash_memory_context* hash, void* ptr,
+                        size_t size)
+{
+  if(!hash->use_arena) {
+    LIBRDF_FREE(char*, ptr);
+    hash->allocated -= size;
+  }
+}
+
+
 static void
-librdf_free_hash_memory_node(librdf_hash_memory_node* node) 
+librdf_hash_memory_free_arena(librdf_hash_memory_context* hash)
+{
+  librdf_hash_memory_arena_block *block, *next;
+
+  LIBRDF_DEBUG3("Freeing arena of %lu bytes, %lu used\n",
+                (unsigned long)hash->arena_size,
+                (unsigned long)hash->arena_used);
+
+  for(block=hash->arena; block; block=next) {
+    next=block->next;
+    LIBRDF_FREE(librdf_hash_memory_arena_block, block);
+  }
+
+  hash->arena=NULL;
+  hash->arena_size=0;
+  hash->arena_used=0;
+}
+
+
+static void
+librdf_free_hash_memory_node(librdf_hash_memory_context* hash,
+                             librdf_hash_memory_node* node) 
 {
   if(node->key)
-    LIBRDF_FREE(char*, node->key);
+    librdf_hash_memory_free(hash, node->key, node->key_len);
   if(node->values) {
     librdf_hash_memory_node_value *vnode, *next;
 
@@ -235,23 +399,200 @@ librdf_free_hash_memory_node(librdf_hash_memory_node* node)
     for(vnode=node->values; vnode; vnode=next) {
       next=vnode->next;
       if(vnode->value)
-        LIBRDF_FREE(char*, vnode->value);
-      LIBRDF_FREE(librdf_hash_memory_node_value, vnode);
+        librdf_hash_memory_free(hash, vnode->value, vnode->value_len);
+      librdf_hash_memory_free(hash, vnode, sizeof(*vnode));
+    }
+  }
+  librdf_hash_memory_free(hash, node, sizeof(*node));
+}
+
+
+/**
+ * librdf_hash_memory_rehash_step:
+ * @hash: the memory hash context
+ * @buckets: number of old buckets to migrate
+ *
+ * Move nodes from the old bucket array into the current one.
+ *
+ * Once all old buckets are empty, the old array is freed and the
+ * resize is complete.
+ **/
+static void
+librdf_hash_memory_rehash_step(librdf_hash_memory_context* hash, int buckets)
+{
+  while(buckets-- > 0 && hash->rehash_bucket < hash->old_capacity) {
+    librdf_hash_memory_node *node=hash->old_nodes[hash->rehash_bucket];
+
+    if(node) {
+      /* old bucket becomes empty */
+      hash->size--;
+      hash->old_nodes[hash->rehash_bucket]=NULL;
+    }
+
+    /* walk all attached nodes */
+    while(node) {
+      librdf_hash_memory_node *next;
+      int bucket;
+
+      next=node->next;
+      /* find slot in new table */
+      bucket=node->hash_key & (hash->capacity - 1);
+      if(!hash->nodes[bucket])
+        hash->size++;
+      node->next=hash->nodes[bucket];
+      hash->nodes[bucket]=node;
+
+      node=next;
     }
+
+    hash->rehash_bucket++;
+  }
+
+  if(hash->rehash_bucket >= hash->old_capacity) {
+    /* now free old table */
+    LIBRDF_FREE(librdf_hash_memory_nodes, hash->old_nodes);
+    hash->old_nodes=NULL;
+    hash->old_capacity=0;
+    hash->rehash_bucket=0;
   }
-  LIBRDF_FREE(librdf_hash_memory_node, node);
 }
 
 
+/*
+ * librdf_hash_memory_get_bucket:
+ * @hash: the memory hash context
+ * @bucket: bucket index over old then current arrays
+ *
+ * INTERNAL - Get a bucket list for cursors, which walk the old bucket
+ * array first, if a resize is in progress, then the current one.
+ *
+ * Return value: bucket list or NULL if empty
+ */
+static librdf_hash_memory_node*
+librdf_hash_memory_get_bucket(librdf_hash_memory_context* hash, int bucket)
+{
+  if(bucket < hash->old_capacity)
+    return hash->old_nodes[bucket];
+  return hash->nodes[bucket - hash->old_capacity];
+}
+
+
+/*
+ * librdf_hash_memory_visible_value:
+ * @view: the hash or snapshot context reading the values
+ * @vnode: first value to check
+ *
+ * INTERNAL - Skip values that @view cannot see.
+ *
+ * A snapshot sees the values added up to its version and not removed
+ * by then; the hash itself sees the values that are not removed.
+ *
+ * Return value: first visible value from @vnode or NULL
+ */
+static librdf_hash_memory_node_value*
+librdf_hash_memory_visible_value(librdf_hash_memory_context* view,
+                                 librdf_hash_memory_node_value* vnode)
+{
+  for(; vnode; vnode=vnode->next) {
+    if(view->source) {
+      if(vnode->added <= view->snapshot_version &&
+         (!vnode->removed || vnode->removed > view->snapshot_version))
+        break;
+    } else if(!vnode->removed)
+      break;
+  }
+
+  return vnode;
+}
+
+
+/*
+ * librdf_hash_memory_sweep:
+ * @hash: the memory hash context
+ *
+ * INTERNAL - Free the values marked removed while snapshots were
+ * reading the hash, and any keys left with no values.
+ */
+static void
+librdf_hash_memory_sweep(librdf_hash_memory_context* hash)
+{
+  int i;
+
+  for(i=0; i < hash->old_capacity + hash->capacity; i++) {
+    librdf_hash_memory_node **bucket, **nodep;
+    int was_used;
+
+    if(i < hash->old_capacity)
+      bucket=&hash->old_nodes[i];
+    else
+      bucket=&hash->nodes[i - hash->old_capacity];
+    was_used=(*bucket != NULL);
+
+    nodep=bucket;
+    while(*nodep) {
+      librdf_hash_memory_node *node=*nodep;
+      librdf_hash_memory_node_value **vnodep=&node->values;
+
+      while(*vnodep) {
+        librdf_hash_memory_node_value *vnode=*vnodep;
+
+        if(vnode->removed) {
+          *vnodep=vnode->next;
+          if(vnode->value)
+            librdf_hash_memory_free(hash, vnode->value, vnode->value_len);
+          librdf_hash_memory_free(hash, vnode, sizeof(*vnode));
+        } else
+          vnodep=&vnode->next;
+      }
+
+      if(!node->values) {
+        *nodep=node->next;
+        librdf_free_hash_memory_node(hash, node);
+      } else
+        nodep=&node->next;
+    }
+
+    if(was_used && !*bucket)
+      hash->size--;
+  }
+
+  hash->dead_values=0;
+}
+
+
+/*
+ * librdf_hash_memory_expand_size:
+ * @hash: the memory hash context
+ * @new_keys: number of keys about to be added
+ *
+ * INTERNAL - Make room for new_keys more keys.
+ *
+ * Called before every put.  Rather than moving every node at once,
+ * the bucket array is grown and the old buckets are migrated a few
+ * at a time by this and later puts and deletes, so the cost of a
+ * resize is spread out.
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
+librdf_hash_memory_expand_size(librdf_hash_memory_context* hash,
+                               int new_keys) {
   int required_capacity=0;
   librdf_hash_memory_node **new_nodes;
-  int i;
+  /* keys already present when the last new key is added */
+  double keys=(double)hash->keys + new_keys - 1;
+
+  /* snapshots walk the bucket arrays so they stay as they are;
+   * chains get longer until the last snapshot goes */
+  if(hash->snapshots && hash->capacity)
+    return 0;
+
+  if(hash->old_nodes)
+    librdf_hash_memory_rehash_step(hash, librdf_hash_memory_rehash_buckets);
 
   if (hash->capacity) {
     /* big enough */
-    if((1000 * hash->keys) < (hash->load_factor * hash->capacity))
+    if((1000 * keys) < ((double)hash->load_factor * hash->capacity))
       return 0;
     /* grow hash (keeping it a power of two) */
     required_capacity=hash->capacity << 1;
@@ -259,6 +600,10 @@ librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
     required_capacity=librdf_hash_initial_capacity;
   }
 
+  while(required_capacity < (1 << 30) &&
+        (1000 * keys) >= ((double)hash->load_factor * required_capacity))
+    required_capacity <<= 1;
+
   /* allocate new table */
   new_nodes = LIBRDF_CALLOC(librdf_hash_memory_node**, 
                             required_capacity,
@@ -269,36 +614,29 @@ librdf_hash_memory_expand_size(librdf_hash_memory_context* hash) {
 
   /* it is a new hash empty hash - we are done */
   if(!hash->size) {
+    if(hash->nodes) {
+      LIBRDF_FREE(librdf_hash_memory_nodes, hash->nodes);
+      hash->resizes++;
+    }
     hash->capacity=required_capacity;
     hash->nodes=new_nodes;
     return 0;
   }
-  
 
-  for(i=0; i<hash->capacity; i++) {
-    librdf_hash_memory_node *node=hash->nodes[i];
-      
-    /* walk all attached nodes */
-    while(node) {
-      librdf_hash_memory_node *next;
-      int bucket;
-
-      next=node->next;
-      /* find slot in new table */
-      bucket=node->hash_key & (required_capacity - 1);
-      node->next=new_nodes[bucket];
-      new_nodes[bucket]=node;
-
-      node=next;
-    }
-  }
+  /* outgrew the table before the last resize finished - complete it */
+  if(hash->old_nodes)
+    librdf_hash_memory_rehash_step(hash, hash->old_capacity);
 
-  /* now free old table */
-  LIBRDF_FREE(librdf_hash_memory_nodes, hash->nodes);
+  /* keep the current table to migrate from and attach new one */
+  hash->old_nodes=hash->nodes;
+  hash->old_capacity=hash->capacity;
+  hash->rehash_bucket=0;
 
-  /* attach new one */
   hash->capacity=required_capacity;
   hash->nodes=new_nodes;
+  hash->resizes++;
+
+  librdf_hash_memory_rehash_step(hash, librdf_hash_memory_rehash_buckets);
 
   return 0;
 }
@@ -323,7 +661,7 @@ librdf_hash_memory_create(librdf_hash* hash, void* context)
 
   hcontext->hash=hash;
   hcontext->load_factor=librdf_hash_default_load_factor;
-  return librdf_hash_memory_expand_size(hcontext);
+  return librdf_hash_memory_expand_size(hcontext, 1);
 }
 
 
@@ -340,11 +678,30 @@ librdf_hash_memory_destroy(void* context)
 {
   librdf_hash_memory_context* hcontext=(librdf_hash_memory_context*)context;
 
-  if(hcontext->nodes) {
+  /* a snapshot owns nothing; when the last one goes, free what the
+   * snapshots kept alive */
+  if(hcontext->source) {
+    librdf_hash_memory_context* source=hcontext->source;
+
+    if(!--source->snapshots && source->dead_values)
+      librdf_hash_memory_sweep(source);
+    return 0;
+  }
+
+  if(hcontext->snapshots)
+    librdf_log(hcontext->hash->world,
+               0, LIBRDF_LOG_WARN, LIBRDF_FROM_HASH, NULL,
+               "Memory hash destroyed with %d snapshots still reading it",
+               hcontext->snapshots);
+
+  /* arena mode - free all nodes, keys and values in one go */
+  if(hcontext->use_arena)
+    librdf_hash_memory_free_arena(hcontext);
+  else if(hcontext->nodes) {
     int i;
   
-    for(i=0; i<hcontext->capacity; i++) {
-      librdf_hash_memory_node *node=hcontext->nodes[i];
+    for(i=0; i < hcontext->old_capacity + hcontext->capacity; i++) {
+      librdf_hash_memory_node *node=librdf_hash_memory_get_bucket(hcontext, i);
       
       /* this entry is used */
       if(node) {
@@ -352,14 +709,18 @@ librdf_hash_memory_destroy(void* context)
         /* free all attached nodes */
         while(node) {
           next=node->next;
-          librdf_free_hash_memory_node(node);
+          librdf_free_hash_memory_node(hcontext, node);
           node=next;
         }
       }
     }
-    LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->nodes);
   }
 
+  if(hcontext->old_nodes)
+    LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->old_nodes);
+  if(hcontext->nodes)
+    LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->nodes);
+
   return 0;
 }
 
@@ -371,9 +732,17 @@ librdf_hash_memory_destroy(void* context)
  * @mode: access mode - not used
  * @is_writable: is hash writable? - not used
  * @is_new: is hash new? - not used
- * @options: #librdf_hash of options - not used
+ * @options: #librdf_hash of options
  *
  * Open memory hash with given parameters.
+ *
+ * If option 'arena' is true, nodes, keys and values are packed into
+ * large blocks that are freed in one go when the hash is destroyed.
+ * Deleted entries are not reclaimed until then.  This can only be
+ * set while the hash is empty.
+ *
+ * If option 'capacity' is given, the bucket array of an empty hash is
+ * sized up front to hold that many keys without resizing.
  * 
  * Return value: non 0 on failure
  **/
@@ -382,7 +751,46 @@ librdf_hash_memory_open(void* context, const char *identifier,
                         int mode, int is_writable, int is_new,
                         librdf_hash* options) 
 {
-  /* NOP */
+  librdf_hash_memory_context* hcontext=(librdf_hash_memory_context*)context;
+  long keys;
+
+  if(!options || hcontext->keys)
+    return 0;
+
+  if(librdf_hash_get_as_boolean(options, "arena") > 0)
+    hcontext->use_arena=1;
+
+  keys=librdf_hash_get_as_long(options, "capacity");
+  if(keys > 0) {
+    int required_capacity=librdf_hash_initial_capacity;
+    librdf_hash_memory_node **new_nodes;
+
+    /* smallest power of 2 that keeps keys under the load factor */
+    while(required_capacity < (1 << 30) &&
+          (double)keys * 1000 >= (double)hcontext->load_factor * required_capacity)
+      required_capacity <<= 1;
+
+    if(required_capacity > hcontext->capacity) {
+      new_nodes = LIBRDF_CALLOC(librdf_hash_memory_node**,
+                                required_capacity,
+                                sizeof(librdf_hash_memory_node*));
+      if(!new_nodes)
+        return 1;
+
+      if(hcontext->old_nodes)
+        LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->old_nodes);
+      hcontext->old_nodes=NULL;
+      hcontext->old_capacity=0;
+      hcontext->rehash_bucket=0;
+
+      if(hcontext->nodes)
+        LIBRDF_FREE(librdf_hash_memory_nodes, hcontext->nodes);
+      hcontext->nodes=new_nodes;
+      hcontext->capacity=required_capacity;
+      hcontext->size=0;
+    }
+  }
+
   return 0;
 }
 
@@ -416,6 +824,7 @@ librdf_hash_memory_clone(librdf_hash *hash, void* context, char *new_identifer,
   /* copy data fields that might change */
   hcontext->hash=hash;
   hcontext->load_factor=old_hcontext->load_factor;
+  hcontext->use_arena=old_hcontext->use_arena;
 
   /* Don't need to deal with new_identifier - not used for memory hashes */
 
@@ -448,6 +857,50 @@ librdf_hash_memory_clone(librdf_hash *hash, void* context, char *new_identifer,
 }
 
 
+/**
+ * librdf_hash_memory_snapshot:
+ * @hash: new #librdf_hash
+ * @context: new memory hash context
+ * @old_context: memory hash context to take a snapshot of
+ *
+ * Make a read-only view of a memory hash as it is now.
+ *
+ * Nothing is copied.  Values carry the hash version they were added
+ * and removed at, and the snapshot only sees those present at its
+ * version.  While any snapshot exists, deletes on the hash only mark
+ * values removed and the bucket arrays are not resized; the removed
+ * values are freed when the last snapshot is destroyed.  The hash
+ * must outlive its snapshots.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_snapshot(librdf_hash *hash, void* context,
+                            void *old_context)
+{
+  librdf_hash_memory_context* hcontext=(librdf_hash_memory_context*)context;
+  librdf_hash_memory_context* old_hcontext=(librdf_hash_memory_context*)old_context;
+
+  hcontext->hash=hash;
+  hcontext->load_factor=old_hcontext->load_factor;
+
+  if(old_hcontext->source) {
+    /* a snapshot of a snapshot sees the same version of the same hash */
+    hcontext->source=old_hcontext->source;
+    hcontext->snapshot_version=old_hcontext->snapshot_version;
+    hcontext->snapshot_values=old_hcontext->snapshot_values;
+  } else {
+    hcontext->source=old_hcontext;
+    hcontext->snapshot_version=old_hcontext->version;
+    hcontext->snapshot_values=old_hcontext->values;
+  }
+
+  hcontext->source->snapshots++;
+
+  return 0;
+}
+
+
 /**
  * librdf_hash_memory_values_count:
  * @context: memory hash cursor context
@@ -461,13 +914,18 @@ librdf_hash_memory_values_count(void *context)
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
 
+  if(hash->source)
+    return hash->snapshot_values;
   return hash->values;
 }
 
 
 
 typedef struct {
+  /* the hash holding the nodes */
   librdf_hash_memory_context* hash;
+  /* the hash or snapshot being read, which decides what is visible */
+  librdf_hash_memory_context* view;
   int current_bucket;
   librdf_hash_memory_node* current_node;
   librdf_hash_memory_node_value *current_value;
@@ -489,11 +947,51 @@ librdf_hash_memory_cursor_init(void *cursor_context, void *hash_context)
 {
   librdf_hash_memory_cursor_context *cursor=(librdf_hash_memory_cursor_context*)cursor_context;
 
-  cursor->hash = (librdf_hash_memory_context*)hash_context;
+  cursor->view = (librdf_hash_memory_context*)hash_context;
+  cursor->hash = cursor->view->source ? cursor->view->source : cursor->view;
   return 0;
 }
 
 
+/*
+ * librdf_hash_memory_cursor_seek:
+ * @cursor: memory hash cursor context
+ * @node: node to start from or NULL
+ * @bucket: bucket index of @node
+ *
+ * INTERNAL - Move the cursor to the first node from @node, or else
+ * from the following buckets, that has a value the cursor can see.
+ * Leaves the cursor with no current node at the end of the hash.
+ */
+static void
+librdf_hash_memory_cursor_seek(librdf_hash_memory_cursor_context *cursor,
+                               librdf_hash_memory_node *node, int bucket)
+{
+  int buckets=cursor->hash->old_capacity + cursor->hash->capacity;
+
+  while(bucket < buckets) {
+    for(; node; node=node->next) {
+      librdf_hash_memory_node_value *vnode;
+
+      vnode=librdf_hash_memory_visible_value(cursor->view, node->values);
+      if(vnode) {
+        cursor->current_node=node;
+        cursor->current_value=vnode;
+        cursor->current_bucket=bucket;
+        return;
+      }
+    }
+
+    if(++bucket < buckets)
+      node=librdf_hash_memory_get_bucket(cursor->hash, bucket);
+  }
+
+  cursor->current_node=NULL;
+  cursor->current_value=NULL;
+  cursor->current_bucket=buckets;
+}
+
+
 /**
  * librdf_hash_memory_cursor_get:
  * @context: memory hash cursor context
@@ -521,20 +1019,12 @@ librdf_hash_memory_cursor_get(void* context,
 
   /* Move to start of hash if necessary  */
   if(flags == LIBRDF_HASH_CURSOR_FIRST) {
-    int i;
-    
-    cursor->current_node=NULL;
     /* find first used bucket (with keys) */
-    cursor->current_bucket=0;
-
-    for(i=0; i< cursor->hash->capacity; i++)
-      if((cursor->current_node=cursor->hash->nodes[i])) {
-        cursor->current_bucket=i;
-        break;
-      }
-
-    if(cursor->current_node)
-      cursor->current_value=cursor->current_node->values;
+    cursor->current_node=NULL;
+    if(cursor->hash->old_capacity + cursor->hash->capacity)
+      librdf_hash_memory_cursor_seek(cursor,
+                                     librdf_hash_memory_get_bucket(cursor->hash, 0),
+                                     0);
   }
 
   /* If still have no current node, try to find it from the key */
@@ -543,8 +1033,13 @@ librdf_hash_memory_cursor_get(void* context,
                                                       (char*)key->data,
                                                       key->size,
                                                       NULL, NULL);
-    if(cursor->current_node)
-      cursor->current_value=cursor->current_node->values;
+    if(cursor->current_node) {
+      cursor->current_value=librdf_hash_memory_visible_value(cursor->view,
+                                                             cursor->current_node->values);
+      /* only removed values left - the key is gone */
+      if(!cursor->current_value)
+        cursor->current_node=NULL;
+    }
   }
 
 
@@ -568,7 +1063,7 @@ librdf_hash_memory_cursor_get(void* context,
     case LIBRDF_HASH_CURSOR_FIRST:
     case LIBRDF_HASH_CURSOR_NEXT:
       /* If have reached last bucket, end */
-      if(cursor->current_bucket >= cursor->hash->capacity)
+      if(cursor->current_bucket >= cursor->hash->old_capacity + cursor->hash->capacity)
         return 1;
       
       break;
@@ -594,7 +1089,8 @@ librdf_hash_memory_cursor_get(void* context,
       value->size=vnode->value_len;
       
       /* move on */
-      cursor->current_value=vnode->next;
+      cursor->current_value=librdf_hash_memory_visible_value(cursor->view,
+                                                             vnode->next);
       break;
       
     case LIBRDF_HASH_CURSOR_FIRST:
@@ -614,7 +1110,8 @@ librdf_hash_memory_cursor_get(void* context,
         value->size=vnode->value_len;
 
         /* move on */
-        cursor->current_value=vnode->next;
+        cursor->current_value=librdf_hash_memory_visible_value(cursor->view,
+                                                               vnode->next);
         
         /* stop here if there are more values, otherwise need next
          * key & values so drop through and move to the next node
@@ -623,21 +1120,9 @@ librdf_hash_memory_cursor_get(void* context,
           break;
       }
       
-      /* move on to next node in current bucket */
-      if(!(node=cursor->current_node->next)) {
-        int i;
-        
-        /* end of list - move to next used bucket */
-        for(i=cursor->current_bucket+1; i< cursor->hash->capacity; i++)
-          if((node=cursor->hash->nodes[i])) {
-            cursor->current_bucket=i;
-            break;
-          }
-        
-      }
-      
-      if((cursor->current_node=node))
-        cursor->current_value=node->values;
+      /* move on to next node in current bucket, or the next used one */
+      librdf_hash_memory_cursor_seek(cursor, cursor->current_node->next,
+                                     cursor->current_bucket);
       
       break;
     default:
@@ -690,8 +1175,12 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   int bucket= (-1);
   int is_new_node;
 
+  /* snapshots are read-only */
+  if(hash->source)
+    return 1;
+
   /* ensure there is enough space in the hash */
-  if (librdf_hash_memory_expand_size(hash))
+  if (librdf_hash_memory_expand_size(hash, 1))
     return 1;
   
   /* find node for key */
@@ -703,21 +1192,22 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   
   /* not found - new key */
   if(is_new_node) {
-    ONE_AT_A_TIME_HASH(hash_key, key->data, key->size);
+    LIBRDF_HASH_MEMORY_HASH(hash_key, key->data, key->size);
 
     bucket=hash_key & (hash->capacity - 1);
 
     /* allocate new node */
-    node = LIBRDF_CALLOC(librdf_hash_memory_node*, 1, sizeof(*node));
+    node = (librdf_hash_memory_node*)librdf_hash_memory_alloc(hash, sizeof(*node));
     if(!node)
       return 1;
+    memset(node, 0, sizeof(*node));
 
     node->hash_key=hash_key;
     
     /* allocate key for new node */
-    new_key = LIBRDF_MALLOC(void*, key->size);
+    new_key = librdf_hash_memory_alloc(hash, key->size);
     if(!new_key) {
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      librdf_hash_memory_free(hash, node, sizeof(*node));
       return 1;
     }
 
@@ -729,25 +1219,26 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   
   
   /* always allocate new value */
-  new_value = LIBRDF_MALLOC(void*, value->size);
+  new_value = librdf_hash_memory_alloc(hash, value->size);
   if(!new_value) {
     if(is_new_node) {
-      LIBRDF_FREE(char*, new_key);
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      librdf_hash_memory_free(hash, new_key, key->size);
+      librdf_hash_memory_free(hash, node, sizeof(*node));
     }
     return 1;
   }
 
   /* always allocate new librdf_hash_memory_node_value */
-  vnode = LIBRDF_CALLOC(librdf_hash_memory_node_value*, 1, sizeof(*vnode));
+  vnode = (librdf_hash_memory_node_value*)librdf_hash_memory_alloc(hash, sizeof(*vnode));
   if(!vnode) {
-    LIBRDF_FREE(char*, new_value);
+    librdf_hash_memory_free(hash, new_value, value->size);
     if(is_new_node) {
-      LIBRDF_FREE(char*, new_key);
-      LIBRDF_FREE(librdf_hash_memory_node, node);
+      librdf_hash_memory_free(hash, new_key, key->size);
+      librdf_hash_memory_free(hash, node, sizeof(*node));
     }
     return 1;
   }
+  memset(vnode, 0, sizeof(*vnode));
 
   /* if we get here, all allocations succeeded */
 
@@ -756,8 +1247,13 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
   vnode->next=node->values;
   node->values=vnode;
 
+  /* key had only removed values kept for snapshots - it is back */
+  if(!is_new_node && !node->values_count)
+    hash->keys++;
+
   /* note that in counter */
   node->values_count++;
+  vnode->added=++hash->version;
  
   /* copy new value */
   memcpy(new_value, value->data, value->size);
@@ -784,6 +1280,42 @@ librdf_hash_memory_put(void* context, librdf_hash_datum *key,
 }
 
 
+/**
+ * librdf_hash_memory_put_batch:
+ * @context: memory hash context
+ * @keys: array of keys to store
+ * @values: array of values to store
+ * @count: number of key/value pairs
+ *
+ * - Store an array of key/value pairs in the hash.
+ *
+ * The bucket array is grown once for the whole batch rather than
+ * repeatedly as the keys arrive.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_put_batch(void* context, librdf_hash_datum *keys,
+                             librdf_hash_datum *values, int count)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  int i;
+
+  if(hash->source)
+    return 1;
+
+  if(count > 0 && librdf_hash_memory_expand_size(hash, count))
+    return 1;
+
+  for(i=0; i < count; i++) {
+    if(librdf_hash_memory_put(hash, &keys[i], &values[i]))
+      return 1;
+  }
+
+  return 0;
+}
+
+
 /**
  * librdf_hash_memory_exists:
  * @context: memory hash context
@@ -802,19 +1334,21 @@ librdf_hash_memory_exists(void* context,
   librdf_hash_memory_node* node;
   librdf_hash_memory_node_value *vnode;
   
-  node=librdf_hash_memory_find_node(hash,
+  node=librdf_hash_memory_find_node(hash->source ? hash->source : hash,
 				    (char*)key->data, key->size,
 				    NULL, NULL);
   /* key not found */
   if(!node)
     return 0;
   
+  vnode=librdf_hash_memory_visible_value(hash, node->values);
+
   /* no value wanted */
   if(!value)
-    return 1;
+    return (vnode != NULL);
 
   /* search for value in list of values */
-  for(vnode=node->values; vnode; vnode=vnode->next) {
+  for(; vnode; vnode=librdf_hash_memory_visible_value(hash, vnode->next)) {
     if(value->size == vnode->value_len && 
        !memcmp(value->data, vnode->value, value->size))
       break;
@@ -842,8 +1376,14 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
   librdf_hash_memory_node *node, *prev, *next;
   librdf_hash_memory_node_value *vnode, *vprev;
-  int bucket;
+  librdf_hash_memory_node **bucket;
   
+  if(hash->source)
+    return 1;
+
+  if(hash->old_nodes && !hash->snapshots)
+    librdf_hash_memory_rehash_step(hash, librdf_hash_memory_rehash_buckets);
+
   node=librdf_hash_memory_find_node(hash, 
 				    (char*)key->data, key->size,
 				    &bucket, &prev);
@@ -851,6 +1391,24 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
   if(!node)
     return 1;
 
+  if(hash->snapshots) {
+    /* snapshots may still see the value, so only mark it removed */
+    for(vnode=node->values; vnode; vnode=vnode->next) {
+      if(!vnode->removed && value->size == vnode->value_len && 
+         !memcmp(value->data, vnode->value, value->size))
+        break;
+    }
+    if(!vnode)
+      return 1;
+
+    vnode->removed=++hash->version;
+    hash->dead_values++;
+    hash->values--;
+    if(!--node->values_count)
+      hash->keys--;
+    return 0;
+  }
+
   /* search for value in list of values */
   vnode=node->values;
   vprev=NULL;
@@ -875,11 +1433,12 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
 
   /* free value and value node */
   if(vnode->value)
-    LIBRDF_FREE(librdf_hash_memory_node_value, vnode->value);
-  LIBRDF_FREE(librdf_hash_memory_node_value, vnode);
+    librdf_hash_memory_free(hash, vnode->value, vnode->value_len);
+  librdf_hash_memory_free(hash, vnode, sizeof(*vnode));
 
   /* update hash counts */
   hash->values--;
+  node->values_count--;
 
   /* check if last value was removed */
   if(node->values)
@@ -891,7 +1450,7 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
 
   if(!prev) {
     /* is at start of list, so delete from there */
-    if(!(hash->nodes[bucket]=node->next))
+    if(!(*bucket=node->next))
       /* hash bucket occupancy is one less if bucket is now empty */
       hash->size--;
     next=NULL;
@@ -899,7 +1458,7 @@ librdf_hash_memory_delete_key_value(void* context, librdf_hash_datum *key,
     next=prev->next=node->next;
   
   /* free node */
-  librdf_free_hash_memory_node(node);
+  librdf_free_hash_memory_node(hash, node);
   
   /* see if there are remaining values for this key */
   if(!next) {
@@ -940,8 +1499,14 @@ librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key)
 {
   librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
   librdf_hash_memory_node *node, *prev;
-  int bucket;
+  librdf_hash_memory_node **bucket;
   
+  if(hash->source)
+    return 1;
+
+  if(hash->old_nodes && !hash->snapshots)
+    librdf_hash_memory_rehash_step(hash, librdf_hash_memory_rehash_buckets);
+
   node=librdf_hash_memory_find_node(hash, 
 				    (char*)key->data, key->size,
 				    &bucket, &prev);
@@ -949,10 +1514,30 @@ librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key)
   if(!node)
     return 1;
 
+  if(hash->snapshots) {
+    librdf_hash_memory_node_value *vnode;
+
+    /* snapshots may still see the values, so only mark them removed */
+    if(!node->values_count)
+      return 1;
+
+    hash->version++;
+    for(vnode=node->values; vnode; vnode=vnode->next) {
+      if(!vnode->removed)
+        vnode->removed=hash->version;
+    }
+
+    hash->dead_values+= node->values_count;
+    hash->values-= node->values_count;
+    hash->keys--;
+    node->values_count=0;
+    return 0;
+  }
+
   /* search list from here */
   if(!prev) {
     /* is at start of list, so delete from there */
-    if(!(hash->nodes[bucket]=node->next))
+    if(!(*bucket=node->next))
       /* hash bucket occupancy is one less if bucket is now empty */
       hash->size--;
   } else
@@ -963,7 +1548,7 @@ librdf_hash_memory_delete_key(void* context, librdf_hash_datum *key)
   hash->values-= node->values_count;
   
   /* free node */
-  librdf_free_hash_memory_node(node);
+  librdf_free_hash_memory_node(hash, node);
   return 0;
 }
 
@@ -1004,6 +1589,115 @@ librdf_hash_memory_get_fd(void* context)
 }
 
 
+/* chain lengths counted separately by librdf_hash_memory_get_stats */
+#define LIBRDF_HASH_MEMORY_STATS_CHAINS 8
+
+/**
+ * librdf_hash_memory_get_stats:
+ * @context: memory hash context
+ * @stats: hash to add statistics to
+ *
+ * Add the bucket array statistics.  A snapshot reports those of the
+ * hash it reads.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_get_stats(void* context, librdf_hash* stats)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  unsigned long chains[LIBRDF_HASH_MEMORY_STATS_CHAINS];
+  int chain_max=0;
+  int buckets;
+  int bucket;
+  char buffer[LIBRDF_HASH_MEMORY_STATS_CHAINS * 21];
+  char *p;
+  int i;
+
+  if(hash->source)
+    hash=hash->source;
+
+  memset(chains, 0, sizeof(chains));
+  buckets=hash->old_capacity + hash->capacity;
+  for(bucket=0; bucket < buckets; bucket++) {
+    librdf_hash_memory_node* node;
+    int length=0;
+
+    for(node=librdf_hash_memory_get_bucket(hash, bucket); node;
+        node=node->next)
+      length++;
+    if(!length)
+      continue;
+    if(length > chain_max)
+      chain_max=length;
+    if(length > LIBRDF_HASH_MEMORY_STATS_CHAINS)
+      length=LIBRDF_HASH_MEMORY_STATS_CHAINS;
+    chains[length-1]++;
+  }
+
+  if(librdf_hash_put_stat(stats, "keys", (unsigned long)hash->keys) ||
+     librdf_hash_put_stat(stats, "buckets", (unsigned long)hash->capacity) ||
+     librdf_hash_put_stat(stats, "buckets-used", (unsigned long)hash->size) ||
+     librdf_hash_put_stat(stats, "chain-max", (unsigned long)chain_max) ||
+     librdf_hash_put_stat(stats, "resizes", (unsigned long)hash->resizes) ||
+     librdf_hash_put_stat(stats, "rehash-buckets",
+                          (unsigned long)(hash->old_capacity - hash->rehash_bucket)) ||
+     librdf_hash_put_stat(stats, "dead-values", (unsigned long)hash->dead_values) ||
+     librdf_hash_put_stat(stats, "snapshots", (unsigned long)hash->snapshots))
+    return 1;
+
+  if(hash->use_arena &&
+     (librdf_hash_put_stat(stats, "arena-bytes", (unsigned long)hash->arena_size) ||
+      librdf_hash_put_stat(stats, "arena-used", (unsigned long)hash->arena_used)))
+    return 1;
+
+  sprintf(buffer, "%.3f",
+          hash->capacity ? (double)hash->keys / hash->capacity : 0.0);
+  if(librdf_hash_put_strings(stats, "load-factor", buffer))
+    return 1;
+
+  sprintf(buffer, "%.2f",
+          hash->size ? (double)hash->keys / hash->size : 0.0);
+  if(librdf_hash_put_strings(stats, "chain-mean", buffer))
+    return 1;
+
+  p=buffer;
+  for(i=0; i < LIBRDF_HASH_MEMORY_STATS_CHAINS; i++)
+    p += sprintf(p, i ? ",%lu" : "%lu", chains[i]);
+  return librdf_hash_put_strings(stats, "chains", buffer);
+}
+
+
+
+/**
+ * librdf_hash_memory_get_memory_size:
+ * @context: memory hash context
+ *
+ * Get the bytes held by the hash.
+ *
+ * Counts the bucket arrays and the nodes, keys and values, or the
+ * arena blocks holding them.  A snapshot holds only its context.
+ * 
+ * Return value: size in bytes
+ **/
+static size_t
+librdf_hash_memory_get_memory_size(void* context)
+{
+  librdf_hash_memory_context* hash=(librdf_hash_memory_context*)context;
+  size_t size=sizeof(*hash);
+
+  if(hash->source)
+    return size;
+
+  size += ((size_t)hash->capacity + (size_t)hash->old_capacity) *
+          sizeof(librdf_hash_memory_node*);
+  size += hash->use_arena ? hash->arena_size : hash->allocated;
+
+  return size;
+}
+
+
+
 /* local function to register memory hash functions */
 
 /**
@@ -1025,16 +1719,21 @@ librdf_hash_memory_register_factory(librdf_hash_factory *factory)
   factory->open    = librdf_hash_memory_open;
   factory->close   = librdf_hash_memory_close;
   factory->clone   = librdf_hash_memory_clone;
+  factory->snapshot = librdf_hash_memory_snapshot;
 
   factory->values_count = librdf_hash_memory_values_count;
 
   factory->put     = librdf_hash_memory_put;
   factory->exists  = librdf_hash_memory_exists;
+  factory->put_batch = librdf_hash_memory_put_batch;
   factory->delete_key  = librdf_hash_memory_delete_key;
   factory->delete_key_value  = librdf_hash_memory_delete_key_value;
   factory->sync    = librdf_hash_memory_sync;
   factory->get_fd  = librdf_hash_memory_get_fd;
 
+  factory->get_stats = librdf_hash_memory_get_stats;
+  factory->get_memory_size = librdf_hash_memory_get_memory_size;
+
   factory->cursor_init   = librdf_hash_memory_cursor_init;
   factory->cursor_get    = librdf_hash_memory_cursor_get;
   factory->cursor_finish = librdf_hash_memory_cursor_finish;
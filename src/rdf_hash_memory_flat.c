@@ -0,0 +1,907 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_memory_flat.c - RDF Hash In Memory Open Addressing Implementation
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/*
+ * The "memory-flat" hash keeps all keys in one contiguous array of
+ * slots using open addressing with linear probing.  Each slot holds
+ * the full hash value and key length inline so that a probe only
+ * touches the slot array until a likely match is found.
+ *
+ * The key bytes and all the values of that key are packed into a
+ * single block owned by the slot:
+ *
+ *   [key bytes][value 1 length][value 1 bytes][value 2 length]...
+ *
+ * where each length is a size_t stored unaligned.  So a key with N
+ * values costs one allocation rather than 2N+1 in the "memory" hash.
+ */
+
+/* private structures */
+typedef struct
+{
+  /* key bytes followed by packed values; NULL if slot is empty */
+  unsigned char* data;
+  /* bytes used in data */
+  size_t data_len;
+  /* bytes allocated for data */
+  size_t data_size;
+  size_t key_len;
+  u32 hash_key;
+  int values_count;
+} librdf_hash_memory_flat_slot;
+
+
+typedef struct
+{
+  /* the hash object */
+  librdf_hash* hash;
+  /* array of slots of size capacity */
+  librdf_hash_memory_flat_slot* slots;
+  /* this many keys (used slots) */
+  int keys;
+  /* this many values */
+  int values;
+  /* total array size - always a power of 2 */
+  int capacity;
+
+  /* array load factor expressed out of 1000.
+   * Always true: keys * 1000 < load_factor * capacity
+   */
+  int load_factor;
+} librdf_hash_memory_flat_context;
+
+
+/* default load_factor out of 1000 - lower than the chained "memory"
+ * hash since probe sequences grow quickly with open addressing */
+static const int librdf_hash_memory_flat_default_load_factor=700;
+
+/* starting capacity - MUST BE POWER OF 2 */
+static const int librdf_hash_memory_flat_initial_capacity=16;
+
+
+/* prototypes for local functions */
+static int librdf_hash_memory_flat_find_slot(librdf_hash_memory_flat_context* hash, void *key, size_t key_len);
+static int librdf_hash_memory_flat_find_value(librdf_hash_memory_flat_slot* slot, void *value, size_t value_len, size_t *offset_p);
+static int librdf_hash_memory_flat_expand_size(librdf_hash_memory_flat_context* hash);
+static void librdf_hash_memory_flat_remove_slot(librdf_hash_memory_flat_context* hash, int index);
+
+/* Implementing the hash cursor */
+static int librdf_hash_memory_flat_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_memory_flat_cursor_get(void* context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_memory_flat_cursor_finish(void* context);
+
+
+/* functions implementing the API */
+
+static int librdf_hash_memory_flat_create(librdf_hash* new_hash, void* context);
+static int librdf_hash_memory_flat_destroy(void* context);
+static int librdf_hash_memory_flat_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_memory_flat_close(void* context);
+static int librdf_hash_memory_flat_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_memory_flat_values_count(void *context);
+static int librdf_hash_memory_flat_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_memory_flat_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory_flat_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_memory_flat_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory_flat_sync(void* context);
+static int librdf_hash_memory_flat_get_fd(void* context);
+
+static void librdf_hash_memory_flat_register_factory(librdf_hash_factory *factory);
+
+
+
+/* helper functions */
+
+
+/**
+ * librdf_hash_memory_flat_find_slot:
+ * @hash: the memory-flat hash context
+ * @key: key string
+ * @key_len: key string length
+ *
+ * Find the slot holding the given key.
+ *
+ * Return value: slot index or <0 if the key is not present
+ **/
+static int
+librdf_hash_memory_flat_find_slot(librdf_hash_memory_flat_context* hash,
+                                  void *key, size_t key_len)
+{
+  u32 hash_key;
+  int mask;
+  int i;
+
+  /* empty hash */
+  if(!hash->keys)
+    return -1;
+
+  LIBRDF_HASH_MEMORY_HASH(hash_key, key, key_len);
+
+  mask=hash->capacity - 1;
+  for(i=(int)(hash_key & (u32)mask); ; i=(i + 1) & mask) {
+    librdf_hash_memory_flat_slot* slot=&hash->slots[i];
+
+    /* reached an empty slot - key is not present */
+    if(!slot->data)
+      return -1;
+
+    if(slot->hash_key == hash_key && slot->key_len == key_len &&
+       !memcmp(slot->data, key, key_len))
+      return i;
+  }
+
+  /* NOTREACHED - load factor guarantees an empty slot exists */
+}
+
+
+/**
+ * librdf_hash_memory_flat_find_value:
+ * @slot: the slot
+ * @value: value bytes
+ * @value_len: value length
+ * @offset_p: pointer to store the offset of the value length field
+ *
+ * Find a value in the packed values of a slot.
+ *
+ * Return value: non 0 if found
+ **/
+static int
+librdf_hash_memory_flat_find_value(librdf_hash_memory_flat_slot* slot,
+                                   void *value, size_t value_len,
+                                   size_t *offset_p)
+{
+  size_t offset=slot->key_len;
+
+  while(offset < slot->data_len) {
+    size_t len;
+
+    memcpy(&len, slot->data + offset, sizeof(size_t));
+    if(len == value_len &&
+       !memcmp(slot->data + offset + sizeof(size_t), value, value_len)) {
+      if(offset_p)
+        *offset_p=offset;
+      return 1;
+    }
+    offset += sizeof(size_t) + len;
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_hash_memory_flat_expand_size(librdf_hash_memory_flat_context* hash)
+{
+  int required_capacity;
+  librdf_hash_memory_flat_slot *new_slots;
+  int i;
+
+  if(hash->capacity) {
+    /* big enough for one more key; in double since both sides
+     * overflow an int with millions of keys */
+    if(1000.0 * (hash->keys + 1) < (double)hash->load_factor * hash->capacity)
+      return 0;
+    /* grow hash (keeping it a power of two) */
+    required_capacity=hash->capacity << 1;
+  } else {
+    required_capacity=librdf_hash_memory_flat_initial_capacity;
+  }
+
+  /* allocate new table */
+  new_slots = LIBRDF_CALLOC(librdf_hash_memory_flat_slot*,
+                            LIBRDF_GOOD_CAST(size_t, required_capacity),
+                            sizeof(librdf_hash_memory_flat_slot));
+  if(!new_slots)
+    return 1;
+
+  /* move slots to new table; the key and value blocks are not copied */
+  for(i=0; i < hash->capacity; i++) {
+    librdf_hash_memory_flat_slot *slot=&hash->slots[i];
+    int j;
+
+    if(!slot->data)
+      continue;
+
+    for(j=(int)(slot->hash_key & (u32)(required_capacity - 1));
+        new_slots[j].data;
+        j=(j + 1) & (required_capacity - 1))
+      ;
+    new_slots[j]=*slot;
+  }
+
+  if(hash->slots)
+    LIBRDF_FREE(librdf_hash_memory_flat_slot, hash->slots);
+
+  hash->capacity=required_capacity;
+  hash->slots=new_slots;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_remove_slot:
+ * @hash: the memory-flat hash context
+ * @index: slot index
+ *
+ * Free a slot and close up the probe sequence behind it.
+ *
+ * Uses backward shift deletion so no tombstones are needed and
+ * lookups never have to skip over deleted entries.
+ **/
+static void
+librdf_hash_memory_flat_remove_slot(librdf_hash_memory_flat_context* hash,
+                                    int index)
+{
+  int mask=hash->capacity - 1;
+  int i=index;
+  int j=index;
+
+  LIBRDF_FREE(char*, hash->slots[index].data);
+  memset(&hash->slots[index], 0, sizeof(librdf_hash_memory_flat_slot));
+  hash->keys--;
+
+  while(1) {
+    int home;
+
+    j=(j + 1) & mask;
+    if(!hash->slots[j].data)
+      break;
+
+    home=(int)(hash->slots[j].hash_key & (u32)mask);
+    /* leave slot j alone if its home lies cyclically in (i, j] */
+    if(i <= j) {
+      if(i < home && home <= j)
+        continue;
+    } else {
+      if(i < home || home <= j)
+        continue;
+    }
+
+    hash->slots[i]=hash->slots[j];
+    memset(&hash->slots[j], 0, sizeof(librdf_hash_memory_flat_slot));
+    i=j;
+  }
+}
+
+
+
+/* functions implementing hash api */
+
+/**
+ * librdf_hash_memory_flat_create:
+ * @hash: #librdf_hash hash
+ * @context: memory-flat hash contxt
+ *
+ * Create a new memory-flat hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_memory_flat_context* hcontext=(librdf_hash_memory_flat_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->load_factor=librdf_hash_memory_flat_default_load_factor;
+  return librdf_hash_memory_flat_expand_size(hcontext);
+}
+
+
+/**
+ * librdf_hash_memory_flat_destroy:
+ * @context: memory-flat hash context
+ *
+ * Destroy a memory-flat hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_destroy(void* context)
+{
+  librdf_hash_memory_flat_context* hcontext=(librdf_hash_memory_flat_context*)context;
+
+  if(hcontext->slots) {
+    int i;
+
+    for(i=0; i < hcontext->capacity; i++) {
+      if(hcontext->slots[i].data)
+        LIBRDF_FREE(char*, hcontext->slots[i].data);
+    }
+    LIBRDF_FREE(librdf_hash_memory_flat_slot, hcontext->slots);
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_open:
+ * @context: memory-flat hash context
+ * @identifier: identifier - not used
+ * @mode: access mode - not used
+ * @is_writable: is hash writable? - not used
+ * @is_new: is hash new? - not used
+ * @options: #librdf_hash of options - not used
+ *
+ * Open memory-flat hash with given parameters.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_open(void* context, const char *identifier,
+                             int mode, int is_writable, int is_new,
+                             librdf_hash* options)
+{
+  /* NOP */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_close:
+ * @context: memory-flat hash context
+ *
+ * Close the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_close(void* context)
+{
+  /* NOP */
+  return 0;
+}
+
+
+static int
+librdf_hash_memory_flat_clone(librdf_hash *hash, void* context,
+                              char *new_identifer, void *old_context)
+{
+  librdf_hash_memory_flat_context* hcontext=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_context* old_hcontext=(librdf_hash_memory_flat_context*)old_context;
+  int i;
+
+  /* copy data fields that might change */
+  hcontext->hash=hash;
+  hcontext->load_factor=old_hcontext->load_factor;
+
+  /* Don't need to deal with new_identifier - not used for memory hashes */
+
+  /* Same layout so copy the slot array and blocks directly */
+  hcontext->slots = LIBRDF_CALLOC(librdf_hash_memory_flat_slot*,
+                                  LIBRDF_GOOD_CAST(size_t, old_hcontext->capacity),
+                                  sizeof(librdf_hash_memory_flat_slot));
+  if(!hcontext->slots)
+    return 1;
+  hcontext->capacity=old_hcontext->capacity;
+
+  for(i=0; i < old_hcontext->capacity; i++) {
+    librdf_hash_memory_flat_slot* old_slot=&old_hcontext->slots[i];
+    librdf_hash_memory_flat_slot* slot=&hcontext->slots[i];
+
+    if(!old_slot->data)
+      continue;
+
+    slot->data = LIBRDF_MALLOC(unsigned char*, old_slot->data_len);
+    if(!slot->data)
+      return 1;
+    memcpy(slot->data, old_slot->data, old_slot->data_len);
+    slot->data_len=old_slot->data_len;
+    slot->data_size=old_slot->data_len;
+    slot->key_len=old_slot->key_len;
+    slot->hash_key=old_slot->hash_key;
+    slot->values_count=old_slot->values_count;
+
+    hcontext->keys++;
+    hcontext->values += slot->values_count;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_values_count:
+ * @context: memory-flat hash cursor context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 on failure
+ **/
+static int
+librdf_hash_memory_flat_values_count(void *context)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+
+  return hash->values;
+}
+
+
+
+typedef struct {
+  librdf_hash_memory_flat_context* hash;
+  /* current slot index or <0 if none */
+  int current_slot;
+  /* offset of the next value length field in the current slot data */
+  size_t current_value;
+} librdf_hash_memory_flat_cursor_context;
+
+
+
+/**
+ * librdf_hash_memory_flat_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_memory_flat_cursor_context *cursor=(librdf_hash_memory_flat_cursor_context*)cursor_context;
+
+  cursor->hash = (librdf_hash_memory_flat_context*)hash_context;
+  cursor->current_slot= -1;
+  return 0;
+}
+
+
+/*
+ * librdf_hash_memory_flat_cursor_next_slot:
+ * @cursor: memory-flat hash cursor context
+ * @start: slot index to start searching from
+ *
+ * INTERNAL - Move cursor to the first used slot at or after start.
+ */
+static void
+librdf_hash_memory_flat_cursor_next_slot(librdf_hash_memory_flat_cursor_context *cursor,
+                                         int start)
+{
+  int i;
+
+  cursor->current_slot= -1;
+  for(i=start; i < cursor->hash->capacity; i++) {
+    if(cursor->hash->slots[i].data) {
+      cursor->current_slot=i;
+      cursor->current_value=cursor->hash->slots[i].key_len;
+      break;
+    }
+  }
+}
+
+
+/**
+ * librdf_hash_memory_flat_cursor_get:
+ * @context: memory-flat hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_cursor_get(void* context,
+                                   librdf_hash_datum *key,
+                                   librdf_hash_datum *value,
+                                   unsigned int flags)
+{
+  librdf_hash_memory_flat_cursor_context *cursor=(librdf_hash_memory_flat_cursor_context*)context;
+  librdf_hash_memory_flat_slot *slot;
+  size_t len;
+
+  /* Move to start of hash if necessary  */
+  if(flags == LIBRDF_HASH_CURSOR_FIRST)
+    librdf_hash_memory_flat_cursor_next_slot(cursor, 0);
+
+  /* If still have no current slot, try to find it from the key */
+  if(cursor->current_slot < 0 && key && key->data) {
+    cursor->current_slot=librdf_hash_memory_flat_find_slot(cursor->hash,
+                                                           key->data,
+                                                           key->size);
+    if(cursor->current_slot >= 0)
+      cursor->current_value=cursor->hash->slots[cursor->current_slot].key_len;
+  }
+
+  /* If still have no slot, failed */
+  if(cursor->current_slot < 0)
+    return 1;
+
+  slot=&cursor->hash->slots[cursor->current_slot];
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+
+      /* FALLTHROUGH */
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      /* If want values and have reached end of values, end */
+      if(cursor->current_value >= slot->data_len)
+        return 1;
+
+      memcpy(&len, slot->data + cursor->current_value, sizeof(size_t));
+      value->data=slot->data + cursor->current_value + sizeof(size_t);
+      value->size=len;
+
+      /* move on */
+      cursor->current_value += sizeof(size_t) + len;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+    case LIBRDF_HASH_CURSOR_NEXT:
+      /* get key */
+      key->data=slot->data;
+      key->size=slot->key_len;
+
+      /* if want values, walk through them */
+      if(value) {
+        memcpy(&len, slot->data + cursor->current_value, sizeof(size_t));
+        value->data=slot->data + cursor->current_value + sizeof(size_t);
+        value->size=len;
+
+        /* move on */
+        cursor->current_value += sizeof(size_t) + len;
+
+        /* stop here if there are more values, otherwise need next
+         * key & values so move to the next slot
+         */
+        if(cursor->current_value < slot->data_len)
+          break;
+      }
+
+      librdf_hash_memory_flat_cursor_next_slot(cursor,
+                                               cursor->current_slot + 1);
+      break;
+
+    default:
+      librdf_log(cursor->hash->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_cursor_finished:
+ * @context: hash memory-flat get iterator context
+ *
+ * Finish the serialisation of the hash memory-flat get.
+ *
+ **/
+static void
+librdf_hash_memory_flat_cursor_finish(void* context)
+{
+/* librdf_hash_memory_flat_cursor_context *cursor=(librdf_hash_memory_flat_cursor_context*)context; */
+
+}
+
+
+/**
+ * librdf_hash_memory_flat_put:
+ * @context: memory-flat hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * - Store a key/value pair in the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_put(void* context, librdf_hash_datum *key,
+                            librdf_hash_datum *value)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_slot *slot;
+  size_t required_size;
+  int index;
+
+  index=librdf_hash_memory_flat_find_slot(hash, key->data, key->size);
+
+  if(index < 0) {
+    /* not found - new key */
+    u32 hash_key;
+    int mask;
+
+    /* ensure there is enough space in the hash */
+    if(librdf_hash_memory_flat_expand_size(hash))
+      return 1;
+
+    LIBRDF_HASH_MEMORY_HASH(hash_key, key->data, key->size);
+
+    mask=hash->capacity - 1;
+    for(index=(int)(hash_key & (u32)mask);
+        hash->slots[index].data;
+        index=(index + 1) & mask)
+      ;
+    slot=&hash->slots[index];
+
+    slot->data_size=key->size + sizeof(size_t) + value->size;
+    slot->data = LIBRDF_MALLOC(unsigned char*, slot->data_size);
+    if(!slot->data) {
+      slot->data_size=0;
+      return 1;
+    }
+
+    memcpy(slot->data, key->data, key->size);
+    slot->data_len=key->size;
+    slot->key_len=key->size;
+    slot->hash_key=hash_key;
+    slot->values_count=0;
+
+    hash->keys++;
+  } else
+    slot=&hash->slots[index];
+
+
+  /* grow the slot block if needed, doubling to amortise appends */
+  required_size=slot->data_len + sizeof(size_t) + value->size;
+  if(required_size > slot->data_size) {
+    size_t new_size=slot->data_size << 1;
+    unsigned char *new_data;
+
+    if(new_size < required_size)
+      new_size=required_size;
+    new_data = LIBRDF_MALLOC(unsigned char*, new_size);
+    if(!new_data)
+      return 1;
+    memcpy(new_data, slot->data, slot->data_len);
+    LIBRDF_FREE(char*, slot->data);
+    slot->data=new_data;
+    slot->data_size=new_size;
+  }
+
+  /* append new value */
+  memcpy(slot->data + slot->data_len, &value->size, sizeof(size_t));
+  memcpy(slot->data + slot->data_len + sizeof(size_t), value->data,
+         value->size);
+  slot->data_len=required_size;
+  slot->values_count++;
+
+  hash->values++;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_exists:
+ * @context: memory-flat hash context
+ * @key: key
+ * @value: value
+ *
+ * Test the existence of a key in the hash.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_memory_flat_exists(void* context,
+                               librdf_hash_datum *key,
+                               librdf_hash_datum *value)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  int index;
+
+  index=librdf_hash_memory_flat_find_slot(hash, key->data, key->size);
+  /* key not found */
+  if(index < 0)
+    return 0;
+
+  /* no value wanted */
+  if(!value)
+    return 1;
+
+  return librdf_hash_memory_flat_find_value(&hash->slots[index],
+                                            value->data, value->size, NULL);
+}
+
+
+
+/**
+ * librdf_hash_memory_flat_delete_key_value:
+ * @context: memory-flat hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * - Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_delete_key_value(void* context,
+                                         librdf_hash_datum *key,
+                                         librdf_hash_datum *value)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_slot *slot;
+  size_t offset;
+  size_t len;
+  int index;
+
+  index=librdf_hash_memory_flat_find_slot(hash, key->data, key->size);
+  /* key not found anywhere */
+  if(index < 0)
+    return 1;
+
+  slot=&hash->slots[index];
+  if(!librdf_hash_memory_flat_find_value(slot, value->data, value->size,
+                                         &offset))
+    /* key/value combination not found */
+    return 1;
+
+  hash->values--;
+
+  if(slot->values_count == 1) {
+    /* last value was removed so delete the entire key */
+    librdf_hash_memory_flat_remove_slot(hash, index);
+    return 0;
+  }
+
+  /* close up the gap left by the value */
+  len=sizeof(size_t) + value->size;
+  memmove(slot->data + offset, slot->data + offset + len,
+          slot->data_len - offset - len);
+  slot->data_len -= len;
+  slot->values_count--;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_delete_key:
+ * @context: memory-flat hash context
+ * @key: pointer to key to delete
+ *
+ * - Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  int index;
+
+  index=librdf_hash_memory_flat_find_slot(hash, key->data, key->size);
+  /* not found anywhere */
+  if(index < 0)
+    return 1;
+
+  hash->values -= hash->slots[index].values_count;
+  librdf_hash_memory_flat_remove_slot(hash, index);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_sync:
+ * @context: memory-flat hash context
+ *
+ * Flush the hash to disk.
+ *
+ * Not used
+ *
+ * Return value: 0
+ **/
+static int
+librdf_hash_memory_flat_sync(void* context)
+{
+  /* Not applicable */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_get_fd:
+ * @context: memory-flat hash context
+ *
+ * Get the file descriptor representing the hash.
+ *
+ * Not used
+ *
+ * Return value: -1
+ **/
+static int
+librdf_hash_memory_flat_get_fd(void* context)
+{
+  /* Not applicable */
+  return -1;
+}
+
+
+/* local function to register memory-flat hash functions */
+
+/**
+ * librdf_hash_memory_flat_register_factory:
+ * @factory: hash factory prototype
+ *
+ * Register the memory-flat hash module with the hash factory.
+ *
+ **/
+static void
+librdf_hash_memory_flat_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_memory_flat_context);
+  factory->cursor_context_length = sizeof(librdf_hash_memory_flat_cursor_context);
+
+  factory->create  = librdf_hash_memory_flat_create;
+  factory->destroy = librdf_hash_memory_flat_destroy;
+
+  factory->open    = librdf_hash_memory_flat_open;
+  factory->close   = librdf_hash_memory_flat_close;
+  factory->clone   = librdf_hash_memory_flat_clone;
+
+  factory->values_count = librdf_hash_memory_flat_values_count;
+
+  factory->put     = librdf_hash_memory_flat_put;
+  factory->exists  = librdf_hash_memory_flat_exists;
+  factory->delete_key  = librdf_hash_memory_flat_delete_key;
+  factory->delete_key_value  = librdf_hash_memory_flat_delete_key_value;
+  factory->sync    = librdf_hash_memory_flat_sync;
+  factory->get_fd  = librdf_hash_memory_flat_get_fd;
+
+  factory->cursor_init   = librdf_hash_memory_flat_cursor_init;
+  factory->cursor_get    = librdf_hash_memory_flat_cursor_get;
+  factory->cursor_finish = librdf_hash_memory_flat_cursor_finish;
+}
+
+/**
+ * librdf_init_hash_memory_flat:
+ * @world: redland world object
+ *
+ * Initialise the memory-flat hash module.
+ *
+ **/
+void
+librdf_init_hash_memory_flat(librdf_world *world)
+{
+  librdf_hash_register_factory(world, "memory-flat",
+                               &librdf_hash_memory_flat_register_factory);
+}
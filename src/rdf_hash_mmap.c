@@ -0,0 +1,1236 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_mmap.c - RDF Hash Read-Only Memory-Mapped File Implementation
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/mman.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/*
+ * The "mmap" hash serves an immutable file of sorted keys straight
+ * from a read-only memory mapping, so opening a large store costs an
+ * mmap() and lookups return pointers into the mapping without copies.
+ *
+ * The file IDENTIFIER.mmap is laid out in native byte order as:
+ *
+ *   header            librdf_hash_mmap_header
+ *   key records       [key bytes][pad to 4]
+ *                     then per value: [u32 length][value bytes][pad to 4]
+ *   key index         key_count librdf_hash_mmap_index entries, sorted
+ *                     by key, at the 8 byte aligned index_offset
+ *
+ * Opening writable builds the contents in a "memory" hash and writes
+ * the file when the hash is synced or closed.  So a store is converted
+ * by copying it into a new writable mmap hash, or cloned from an
+ * existing mmap hash, and later opened read-only where it is served.
+ */
+
+#define LIBRDF_HASH_MMAP_MAGIC "RDFHMAP1"
+#define LIBRDF_HASH_MMAP_ALIGN4(n) (((n) + 3) & ~((size_t)3))
+#define LIBRDF_HASH_MMAP_ALIGN8(n) (((n) + 7) & ~((size_t)7))
+/* for checking lengths read from the file without overflow */
+#define LIBRDF_HASH_MMAP_ALIGN4_U64(n) (((u64)(n) + 3) & ~((u64)3))
+
+typedef struct
+{
+  char magic[8];
+  u32 key_count;
+  u32 values_count;
+  u64 index_offset;
+  /* total file size, to detect truncated files */
+  u64 size;
+} librdf_hash_mmap_header;
+
+typedef struct
+{
+  /* offset of the key record */
+  u64 offset;
+  u32 key_len;
+  u32 values_count;
+} librdf_hash_mmap_index;
+
+
+/* private structures */
+typedef struct
+{
+  /* the hash object */
+  librdf_hash* hash;
+  /* file name of the mapped file */
+  char* file_name;
+  int mode;
+  int is_writable;
+
+  /* read-only: mapping of the whole file */
+  int fd;
+  unsigned char* map;
+  size_t map_size;
+  const librdf_hash_mmap_header* header;
+  const librdf_hash_mmap_index* index;
+
+  /* writable: contents being built, written on sync and close */
+  librdf_hash* pending;
+  int is_dirty;
+} librdf_hash_mmap_context;
+
+
+typedef struct {
+  librdf_hash_mmap_context* hash;
+  /* writable: cursor over the pending hash */
+  librdf_hash_cursor* pending_cursor;
+  /* read-only: index of current key and its next value */
+  u32 current_key;
+  int has_current;
+  size_t value_offset;
+  u32 values_left;
+} librdf_hash_mmap_cursor_context;
+
+
+/* pair being written, used to sort the pending contents */
+typedef struct {
+  const unsigned char* key;
+  size_t key_len;
+  const unsigned char* value;
+  size_t value_len;
+} librdf_hash_mmap_pair;
+
+
+/* prototypes for local functions */
+static int librdf_hash_mmap_map_file(librdf_hash_mmap_context* hash);
+static void librdf_hash_mmap_unmap_file(librdf_hash_mmap_context* hash);
+static int librdf_hash_mmap_write_file(librdf_hash_mmap_context* hash);
+static u32 librdf_hash_mmap_find_range(librdf_hash_mmap_context* hash, const void *key, size_t key_len);
+static int librdf_hash_mmap_find_key(librdf_hash_mmap_context* hash, const void *key, size_t key_len);
+
+/* Implementing the hash cursor */
+static int librdf_hash_mmap_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_mmap_cursor_get(void* context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_mmap_cursor_finish(void* context);
+
+
+/* functions implementing the API */
+
+static int librdf_hash_mmap_create(librdf_hash* new_hash, void* context);
+static int librdf_hash_mmap_destroy(void* context);
+static int librdf_hash_mmap_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_mmap_close(void* context);
+static int librdf_hash_mmap_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_mmap_values_count(void *context);
+static int librdf_hash_mmap_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_mmap_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_mmap_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_mmap_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_mmap_sync(void* context);
+static int librdf_hash_mmap_get_fd(void* context);
+static int librdf_hash_mmap_is_ordered(void* context);
+
+static void librdf_hash_mmap_register_factory(librdf_hash_factory *factory);
+
+
+
+/* helper functions */
+
+
+/*
+ * librdf_hash_mmap_compare - compare two keys or values
+ *
+ * Orders by the bytes then by length so that a prefix sorts first.
+ */
+static int
+librdf_hash_mmap_compare(const void* a, size_t a_len,
+                         const void* b, size_t b_len)
+{
+  int c=memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+  if(c)
+    return c;
+  return (a_len < b_len) ? -1 : (a_len > b_len);
+}
+
+
+static int
+librdf_hash_mmap_compare_pairs(const void* a, const void* b)
+{
+  const librdf_hash_mmap_pair* pa=(const librdf_hash_mmap_pair*)a;
+  const librdf_hash_mmap_pair* pb=(const librdf_hash_mmap_pair*)b;
+  int c;
+
+  c=librdf_hash_mmap_compare(pa->key, pa->key_len, pb->key, pb->key_len);
+  if(c)
+    return c;
+  return librdf_hash_mmap_compare(pa->value, pa->value_len,
+                                  pb->value, pb->value_len);
+}
+
+
+/*
+ * librdf_hash_mmap_check_records:
+ * @hash: the mmap hash context with the header and index set
+ *
+ * INTERNAL - Check every key record and value lies before the index
+ *
+ * Lookups and cursors then read the mapping without further checks.
+ *
+ * Return value: non 0 if a record runs past its area or the counts differ
+ */
+static int
+librdf_hash_mmap_check_records(librdf_hash_mmap_context* hash)
+{
+  u64 end=hash->header->index_offset;
+  u64 values=0;
+  u32 i;
+
+  for(i=0; i < hash->header->key_count; i++) {
+    const librdf_hash_mmap_index* entry=&hash->index[i];
+    u64 offset;
+    u32 j;
+
+    if(entry->offset < sizeof(librdf_hash_mmap_header) ||
+       entry->offset > end ||
+       end - entry->offset < LIBRDF_HASH_MMAP_ALIGN4_U64(entry->key_len))
+      return 1;
+    offset=entry->offset + LIBRDF_HASH_MMAP_ALIGN4_U64(entry->key_len);
+
+    for(j=0; j < entry->values_count; j++) {
+      u32 len;
+
+      if(end - offset < sizeof(len))
+        return 1;
+      memcpy(&len, hash->map + offset, sizeof(len));
+      offset += sizeof(len);
+      if(end - offset < LIBRDF_HASH_MMAP_ALIGN4_U64(len))
+        return 1;
+      offset += LIBRDF_HASH_MMAP_ALIGN4_U64(len);
+    }
+    values += entry->values_count;
+  }
+
+  return values != hash->header->values_count;
+}
+
+
+/**
+ * librdf_hash_mmap_map_file:
+ * @hash: the mmap hash context
+ *
+ * Map the file and check the header, index and every record and
+ * value fit inside it.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_map_file(librdf_hash_mmap_context* hash)
+{
+  struct stat st;
+  const librdf_hash_mmap_header* header;
+  void* map;
+
+  hash->fd=open(hash->file_name, O_RDONLY);
+  if(hash->fd < 0) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to open mmap hash file '%s'", hash->file_name);
+    return 1;
+  }
+
+  if(fstat(hash->fd, &st) ||
+     (size_t)st.st_size < sizeof(librdf_hash_mmap_header))
+    goto bad_file;
+
+  map=mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, hash->fd, 0);
+  if(map == MAP_FAILED) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to map mmap hash file '%s'", hash->file_name);
+    close(hash->fd);
+    hash->fd= -1;
+    return 1;
+  }
+  hash->map=(unsigned char*)map;
+  hash->map_size=(size_t)st.st_size;
+
+  header=(const librdf_hash_mmap_header*)hash->map;
+  if(memcmp(header->magic, LIBRDF_HASH_MMAP_MAGIC, 8) ||
+     header->size != (u64)hash->map_size ||
+     header->index_offset & 7 ||
+     header->index_offset > header->size ||
+     (header->size - header->index_offset) / sizeof(librdf_hash_mmap_index) < header->key_count)
+    goto bad_file;
+
+  hash->header=header;
+  hash->index=(const librdf_hash_mmap_index*)(hash->map + header->index_offset);
+
+  if(librdf_hash_mmap_check_records(hash))
+    goto bad_file;
+
+  return 0;
+
+  bad_file:
+  librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+             "File '%s' is not a valid mmap hash", hash->file_name);
+  librdf_hash_mmap_unmap_file(hash);
+  return 1;
+}
+
+
+static void
+librdf_hash_mmap_unmap_file(librdf_hash_mmap_context* hash)
+{
+  if(hash->map) {
+    munmap((void*)hash->map, hash->map_size);
+    hash->map=NULL;
+    hash->map_size=0;
+  }
+  if(hash->fd >= 0) {
+    close(hash->fd);
+    hash->fd= -1;
+  }
+  hash->header=NULL;
+  hash->index=NULL;
+}
+
+
+/**
+ * librdf_hash_mmap_write_file:
+ * @hash: the mmap hash context
+ *
+ * Write the pending contents sorted to the file.
+ *
+ * The file is written under a temporary name and renamed into place
+ * so readers with the old file mapped are not disturbed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_write_file(librdf_hash_mmap_context* hash)
+{
+  librdf_hash_mmap_pair* pairs=NULL;
+  librdf_hash_mmap_index* index=NULL;
+  librdf_hash_mmap_header header;
+  librdf_hash_cursor* cursor=NULL;
+  librdf_hash_datum key, value;
+  char* tmp_name=NULL;
+  FILE* fh=NULL;
+  static const unsigned char zeros[8]={0, 0, 0, 0, 0, 0, 0, 0};
+  int count;
+  int i;
+  int key_count=0;
+  u64 offset;
+  int status=1;
+
+  count=librdf_hash_values_count(hash->pending);
+  if(count < 0)
+    return 1;
+
+  if(count) {
+    pairs = LIBRDF_CALLOC(librdf_hash_mmap_pair*, (size_t)count, sizeof(*pairs));
+    index = LIBRDF_CALLOC(librdf_hash_mmap_index*, (size_t)count, sizeof(*index));
+    cursor=librdf_new_hash_cursor(hash->pending);
+    if(!pairs || !index || !cursor)
+      goto tidy;
+
+    /* the pointers are into the pending hash, which is not changed here */
+    memset(&key, 0, sizeof(key));
+    memset(&value, 0, sizeof(value));
+    i=0;
+    if(!librdf_hash_cursor_get_first(cursor, &key, &value)) {
+      do {
+        if(i == count)
+          break;
+        pairs[i].key=(const unsigned char*)key.data;
+        pairs[i].key_len=key.size;
+        pairs[i].value=(const unsigned char*)value.data;
+        pairs[i].value_len=value.size;
+        i++;
+        /* a key makes the memory cursor look it up again */
+        key.data=NULL;
+      } while(!librdf_hash_cursor_get_next(cursor, &key, &value));
+    }
+    count=i;
+
+    qsort(pairs, (size_t)count, sizeof(*pairs),
+          librdf_hash_mmap_compare_pairs);
+  }
+
+  tmp_name = LIBRDF_MALLOC(char*, strlen(hash->file_name) + 5);
+  if(!tmp_name)
+    goto tidy;
+  sprintf(tmp_name, "%s.tmp", hash->file_name);
+
+  fh=fopen(tmp_name, "wb");
+  if(!fh) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to create mmap hash file '%s'", tmp_name);
+    goto tidy;
+  }
+
+  memset(&header, 0, sizeof(header));
+  if(fwrite(&header, sizeof(header), 1, fh) != 1)
+    goto write_failed;
+  offset=sizeof(header);
+
+  for(i=0; i < count; i++) {
+    librdf_hash_mmap_pair* pair=&pairs[i];
+    u32 len;
+
+    if(!i || librdf_hash_mmap_compare(pair->key, pair->key_len,
+                                      pairs[i-1].key, pairs[i-1].key_len)) {
+      /* new key record */
+      index[key_count].offset=offset;
+      index[key_count].key_len=(u32)pair->key_len;
+      key_count++;
+
+      if(fwrite(pair->key, 1, pair->key_len, fh) != pair->key_len ||
+         fwrite(zeros, 1, LIBRDF_HASH_MMAP_ALIGN4(pair->key_len) - pair->key_len,
+                fh) != LIBRDF_HASH_MMAP_ALIGN4(pair->key_len) - pair->key_len)
+        goto write_failed;
+      offset += LIBRDF_HASH_MMAP_ALIGN4(pair->key_len);
+    }
+    index[key_count-1].values_count++;
+
+    len=(u32)pair->value_len;
+    if(fwrite(&len, sizeof(len), 1, fh) != 1 ||
+       fwrite(pair->value, 1, pair->value_len, fh) != pair->value_len ||
+       fwrite(zeros, 1, LIBRDF_HASH_MMAP_ALIGN4(pair->value_len) - pair->value_len,
+              fh) != LIBRDF_HASH_MMAP_ALIGN4(pair->value_len) - pair->value_len)
+      goto write_failed;
+    offset += sizeof(len) + LIBRDF_HASH_MMAP_ALIGN4(pair->value_len);
+  }
+
+  if(fwrite(zeros, 1, (size_t)(LIBRDF_HASH_MMAP_ALIGN8(offset) - offset), fh) !=
+     (size_t)(LIBRDF_HASH_MMAP_ALIGN8(offset) - offset))
+    goto write_failed;
+  offset=LIBRDF_HASH_MMAP_ALIGN8(offset);
+
+  if(key_count &&
+     fwrite(index, sizeof(*index), (size_t)key_count, fh) != (size_t)key_count)
+    goto write_failed;
+
+  memcpy(header.magic, LIBRDF_HASH_MMAP_MAGIC, 8);
+  header.key_count=(u32)key_count;
+  header.values_count=(u32)count;
+  header.index_offset=offset;
+  header.size=offset + sizeof(*index) * (u64)key_count;
+
+  if(fseek(fh, 0L, SEEK_SET) ||
+     fwrite(&header, sizeof(header), 1, fh) != 1)
+    goto write_failed;
+
+  if(fclose(fh)) {
+    fh=NULL;
+    goto write_failed;
+  }
+  fh=NULL;
+
+  if(rename(tmp_name, hash->file_name)) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "Failed to rename mmap hash file to '%s'", hash->file_name);
+    remove(tmp_name);
+    goto tidy;
+  }
+
+  hash->is_dirty=0;
+  status=0;
+  goto tidy;
+
+  write_failed:
+  librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+             "Failed to write mmap hash file '%s'", tmp_name);
+  if(fh)
+    fclose(fh);
+  fh=NULL;
+  remove(tmp_name);
+
+  tidy:
+  if(fh)
+    fclose(fh);
+  if(tmp_name)
+    LIBRDF_FREE(char*, tmp_name);
+  if(cursor)
+    librdf_free_hash_cursor(cursor);
+  if(index)
+    LIBRDF_FREE(librdf_hash_mmap_index*, index);
+  if(pairs)
+    LIBRDF_FREE(librdf_hash_mmap_pair*, pairs);
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_mmap_find_range:
+ * @hash: the mmap hash context
+ * @key: key
+ * @key_len: key length
+ *
+ * Binary search the key index of the mapped file for the first key
+ * that is not less than @key.
+ *
+ * Return value: index of the key or the key count if there is none
+ **/
+static u32
+librdf_hash_mmap_find_range(librdf_hash_mmap_context* hash,
+                            const void *key, size_t key_len)
+{
+  u32 low=0;
+  u32 high=hash->header->key_count;
+
+  while(low < high) {
+    u32 mid=low + (high - low) / 2;
+    const librdf_hash_mmap_index* entry=&hash->index[mid];
+
+    if(librdf_hash_mmap_compare(hash->map + entry->offset, entry->key_len,
+                                key, key_len) < 0)
+      low=mid + 1;
+    else
+      high=mid;
+  }
+
+  return low;
+}
+
+
+/**
+ * librdf_hash_mmap_find_key:
+ * @hash: the mmap hash context
+ * @key: key
+ * @key_len: key length
+ *
+ * Binary search the key index of the mapped file.
+ *
+ * Return value: index of the key or <0 if not found
+ **/
+static int
+librdf_hash_mmap_find_key(librdf_hash_mmap_context* hash,
+                          const void *key, size_t key_len)
+{
+  u32 i=librdf_hash_mmap_find_range(hash, key, key_len);
+  const librdf_hash_mmap_index* entry;
+
+  if(i >= hash->header->key_count)
+    return -1;
+
+  entry=&hash->index[i];
+  if(librdf_hash_mmap_compare(hash->map + entry->offset, entry->key_len,
+                              key, key_len))
+    return -1;
+
+  return (int)i;
+}
+
+
+/* offset of the first value of a key in the mapped file */
+#define LIBRDF_HASH_MMAP_VALUES_OFFSET(entry) \
+  ((size_t)(entry)->offset + LIBRDF_HASH_MMAP_ALIGN4((size_t)(entry)->key_len))
+
+
+/*
+ * librdf_hash_mmap_read_value - get the value at an offset in the
+ * mapped file and return the offset of the next one
+ */
+static size_t
+librdf_hash_mmap_read_value(librdf_hash_mmap_context* hash, size_t offset,
+                            librdf_hash_datum* value)
+{
+  u32 len;
+
+  memcpy(&len, hash->map + offset, sizeof(len));
+  value->data=(void*)(hash->map + offset + sizeof(len));
+  value->size=len;
+
+  return offset + sizeof(len) + LIBRDF_HASH_MMAP_ALIGN4((size_t)len);
+}
+
+
+/* functions implementing the API */
+
+/**
+ * librdf_hash_mmap_create:
+ * @hash: #librdf_hash hash that this implements
+ * @context: mmap hash context
+ *
+ * Create a new mmap hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+
+  hcontext->hash=hash;
+  hcontext->fd= -1;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_destroy:
+ * @context: mmap hash context
+ *
+ * Destroy a mmap hash, writing the file if it was changed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_destroy(void* context)
+{
+  /* clones are freed without being closed */
+  return librdf_hash_mmap_close(context);
+}
+
+
+/**
+ * librdf_hash_mmap_open:
+ * @context: mmap hash context
+ * @identifier: identifier - used as the base of the file name
+ * @mode: access mode for the file
+ * @is_writable: is hash writable?
+ * @is_new: is hash new?
+ * @options: hash options (currently unused)
+ *
+ * Open the file IDENTIFIER.mmap.
+ *
+ * Read-only hashes are served from a mapping of the file.  Writable
+ * hashes load the existing file, if any and not @is_new, and write it
+ * back when synced or closed.
+ *
+ * Return value: non 0 on failure.
+ **/
+static int
+librdf_hash_mmap_open(void* context, const char *identifier,
+                      int mode, int is_writable, int is_new,
+                      librdf_hash* options)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  librdf_hash_datum key, value;
+  u32 i;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(identifier, cstring, 1);
+
+  hash->mode=mode;
+  hash->is_writable=is_writable;
+  hash->fd= -1;
+
+  hash->file_name = LIBRDF_MALLOC(char*, strlen(identifier) + 6);
+  if(!hash->file_name)
+    return 1;
+  sprintf(hash->file_name, "%s.mmap", identifier);
+
+  if(!is_writable) {
+    if(librdf_hash_mmap_map_file(hash))
+      goto failed;
+    return 0;
+  }
+
+  hash->pending=librdf_new_hash(hash->hash->world, "memory");
+  if(!hash->pending ||
+     librdf_hash_open(hash->pending, identifier, mode, 1, 1, NULL))
+    goto failed;
+  hash->is_dirty=1;
+
+  if(is_new || access(hash->file_name, F_OK))
+    return 0;
+
+  /* load the existing file to add to it */
+  if(librdf_hash_mmap_map_file(hash))
+    goto failed;
+
+  memset(&key, 0, sizeof(key));
+  memset(&value, 0, sizeof(value));
+  for(i=0; i < hash->header->key_count; i++) {
+    const librdf_hash_mmap_index* entry=&hash->index[i];
+    size_t offset=LIBRDF_HASH_MMAP_VALUES_OFFSET(entry);
+    u32 j;
+
+    key.data=(void*)(hash->map + entry->offset);
+    key.size=entry->key_len;
+    for(j=0; j < entry->values_count; j++) {
+      offset=librdf_hash_mmap_read_value(hash, offset, &value);
+      if(librdf_hash_put(hash->pending, &key, &value)) {
+        librdf_hash_mmap_unmap_file(hash);
+        goto failed;
+      }
+    }
+  }
+  librdf_hash_mmap_unmap_file(hash);
+
+  /* no need to write out the file unless it is changed */
+  hash->is_dirty=0;
+  return 0;
+
+  failed:
+  if(hash->pending) {
+    librdf_free_hash(hash->pending);
+    hash->pending=NULL;
+  }
+  LIBRDF_FREE(char*, hash->file_name);
+  hash->file_name=NULL;
+  return 1;
+}
+
+
+/**
+ * librdf_hash_mmap_close:
+ * @context: mmap hash context
+ *
+ * Close the hash, writing the file if it was changed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_close(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  int status=0;
+
+  if(hash->pending) {
+    if(hash->is_dirty)
+      status=librdf_hash_mmap_write_file(hash);
+    librdf_free_hash(hash->pending);
+    hash->pending=NULL;
+  }
+
+  librdf_hash_mmap_unmap_file(hash);
+
+  if(hash->file_name) {
+    LIBRDF_FREE(char*, hash->file_name);
+    hash->file_name=NULL;
+  }
+
+  return status;
+}
+
+
+/**
+ * librdf_hash_mmap_clone:
+ * @hash: new #librdf_hash that this implements
+ * @context: new mmap hash context
+ * @new_identifier: new identifier for this hash
+ * @old_context: old mmap hash context
+ *
+ * Clone a mmap hash, copying the contents to a new file.
+ *
+ * A clone of a read-only hash is written out and mapped read-only.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_clone(librdf_hash *hash, void* context, char *new_identifier,
+                       void *old_context)
+{
+  librdf_hash_mmap_context* hcontext=(librdf_hash_mmap_context*)context;
+  librdf_hash_mmap_context* old_hcontext=(librdf_hash_mmap_context*)old_context;
+  librdf_hash_datum key, value;
+  u32 i;
+
+  hcontext->hash=hash;
+
+  if(!new_identifier)
+    return 1;
+
+  if(librdf_hash_mmap_open(context, new_identifier, old_hcontext->mode,
+                           1, 1, NULL))
+    return 1;
+
+  if(old_hcontext->pending) {
+    librdf_free_hash(hcontext->pending);
+    hcontext->pending=librdf_new_hash_from_hash(old_hcontext->pending);
+    if(!hcontext->pending)
+      goto failed;
+    return 0;
+  }
+
+  memset(&key, 0, sizeof(key));
+  memset(&value, 0, sizeof(value));
+  for(i=0; i < old_hcontext->header->key_count; i++) {
+    const librdf_hash_mmap_index* entry=&old_hcontext->index[i];
+    size_t offset=LIBRDF_HASH_MMAP_VALUES_OFFSET(entry);
+    u32 j;
+
+    key.data=(void*)(old_hcontext->map + entry->offset);
+    key.size=entry->key_len;
+    for(j=0; j < entry->values_count; j++) {
+      offset=librdf_hash_mmap_read_value(old_hcontext, offset, &value);
+      if(librdf_hash_put(hcontext->pending, &key, &value))
+        goto failed;
+    }
+  }
+
+  /* write it out and serve it read-only like the original */
+  if(librdf_hash_mmap_write_file(hcontext))
+    goto failed;
+  librdf_free_hash(hcontext->pending);
+  hcontext->pending=NULL;
+  hcontext->is_writable=0;
+  if(librdf_hash_mmap_map_file(hcontext))
+    goto failed;
+
+  return 0;
+
+  failed:
+  hcontext->is_dirty=0;
+  librdf_hash_mmap_close(context);
+  return 1;
+}
+
+
+/**
+ * librdf_hash_mmap_values_count:
+ * @context: mmap hash context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 if not available
+ **/
+static int
+librdf_hash_mmap_values_count(void *context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  if(hash->pending)
+    return librdf_hash_values_count(hash->pending);
+
+  return (int)hash->header->values_count;
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_mmap_cursor_context* cursor=(librdf_hash_mmap_cursor_context*)cursor_context;
+
+  cursor->hash=(librdf_hash_mmap_context*)hash_context;
+
+  if(cursor->hash->pending) {
+    cursor->pending_cursor=librdf_new_hash_cursor(cursor->hash->pending);
+    if(!cursor->pending_cursor)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_hash_mmap_cursor_set_key - move the cursor to the first
+ * value of a key in the mapped file
+ */
+static void
+librdf_hash_mmap_cursor_set_key(librdf_hash_mmap_cursor_context* cursor,
+                                u32 key_index)
+{
+  const librdf_hash_mmap_index* entry=&cursor->hash->index[key_index];
+
+  cursor->current_key=key_index;
+  cursor->has_current=1;
+  cursor->value_offset=LIBRDF_HASH_MMAP_VALUES_OFFSET(entry);
+  cursor->values_left=entry->values_count;
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_get:
+ * @context: mmap hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * Keys and values returned point into the file mapping and remain
+ * valid until the hash is closed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_cursor_get(void* context,
+                            librdf_hash_datum *key,
+                            librdf_hash_datum *value,
+                            unsigned int flags)
+{
+  librdf_hash_mmap_cursor_context *cursor=(librdf_hash_mmap_cursor_context*)context;
+  librdf_hash_mmap_context* hash=cursor->hash;
+
+  if(cursor->pending_cursor) {
+    switch(flags) {
+      case LIBRDF_HASH_CURSOR_SET:
+        return librdf_hash_cursor_set(cursor->pending_cursor, key, value);
+      case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+        return librdf_hash_cursor_get_next_value(cursor->pending_cursor,
+                                                 key, value);
+      case LIBRDF_HASH_CURSOR_FIRST:
+        return librdf_hash_cursor_get_first(cursor->pending_cursor,
+                                            key, value);
+      case LIBRDF_HASH_CURSOR_NEXT:
+        return librdf_hash_cursor_get_next(cursor->pending_cursor,
+                                           key, value);
+      default:
+        break;
+    }
+  } else {
+    const librdf_hash_mmap_index* entry;
+    int i;
+
+    switch(flags) {
+      case LIBRDF_HASH_CURSOR_SET:
+        cursor->has_current=0;
+        /* FALLTHROUGH */
+      case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+        if(!cursor->has_current) {
+          if(!key || !key->data)
+            return 1;
+          if((i=librdf_hash_mmap_find_key(hash, key->data, key->size)) < 0)
+            return 1;
+          librdf_hash_mmap_cursor_set_key(cursor, (u32)i);
+        }
+
+        if(!cursor->values_left)
+          return 1;
+
+        cursor->value_offset=librdf_hash_mmap_read_value(hash,
+                                                         cursor->value_offset,
+                                                         value);
+        cursor->values_left--;
+        return 0;
+
+      case LIBRDF_HASH_CURSOR_SET_RANGE:
+        i=(int)librdf_hash_mmap_find_range(hash, key->data, key->size);
+        if((u32)i >= hash->header->key_count)
+          return 1;
+        librdf_hash_mmap_cursor_set_key(cursor, (u32)i);
+        goto get_next;
+
+      case LIBRDF_HASH_CURSOR_FIRST:
+        if(!hash->header->key_count)
+          return 1;
+        librdf_hash_mmap_cursor_set_key(cursor, 0);
+        /* FALLTHROUGH */
+      case LIBRDF_HASH_CURSOR_NEXT:
+        get_next:
+        if(!cursor->has_current ||
+           cursor->current_key >= hash->header->key_count)
+          return 1;
+
+        entry=&hash->index[cursor->current_key];
+        key->data=(void*)(hash->map + entry->offset);
+        key->size=entry->key_len;
+
+        /* if want values, walk through them */
+        if(value) {
+          cursor->value_offset=librdf_hash_mmap_read_value(hash,
+                                                           cursor->value_offset,
+                                                           value);
+          /* stay on this key while it has more values */
+          if(--cursor->values_left)
+            return 0;
+        }
+
+        /* move on to the next key */
+        if(++cursor->current_key < hash->header->key_count)
+          librdf_hash_mmap_cursor_set_key(cursor, cursor->current_key);
+        return 0;
+
+      default:
+        break;
+    }
+  }
+
+  librdf_log(hash->hash->world,
+             0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+             "Unknown hash method flag %d", flags);
+  return 1;
+}
+
+
+/**
+ * librdf_hash_mmap_cursor_finish:
+ * @context: mmap hash cursor context
+ *
+ * Finish the cursor.
+ *
+ **/
+static void
+librdf_hash_mmap_cursor_finish(void* context)
+{
+  librdf_hash_mmap_cursor_context *cursor=(librdf_hash_mmap_cursor_context*)context;
+
+  if(cursor->pending_cursor)
+    librdf_free_hash_cursor(cursor->pending_cursor);
+}
+
+
+/**
+ * librdf_hash_mmap_put:
+ * @context: mmap hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * Store a key/value pair in a writable hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_put(void* context, librdf_hash_datum *key,
+                     librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  if(!hash->pending) {
+    librdf_log(hash->hash->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+               "mmap hash '%s' is read-only", hash->file_name);
+    return 1;
+  }
+
+  hash->is_dirty=1;
+  return librdf_hash_put(hash->pending, key, value);
+}
+
+
+/**
+ * librdf_hash_mmap_exists:
+ * @context: mmap hash context
+ * @key: key
+ * @value: value or NULL
+ *
+ * Test the existence of a key or key/value in the hash.
+ *
+ * A NULL value means search for key only.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_mmap_exists(void* context, librdf_hash_datum *key,
+                        librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+  const librdf_hash_mmap_index* entry;
+  librdf_hash_datum v;
+  size_t offset;
+  u32 j;
+  int i;
+
+  if(hash->pending)
+    return librdf_hash_exists(hash->pending, key, value);
+
+  i=librdf_hash_mmap_find_key(hash, key->data, key->size);
+  if(i < 0)
+    return 0;
+  if(!value)
+    return 1;
+
+  entry=&hash->index[i];
+  offset=LIBRDF_HASH_MMAP_VALUES_OFFSET(entry);
+  for(j=0; j < entry->values_count; j++) {
+    offset=librdf_hash_mmap_read_value(hash, offset, &v);
+    if(v.size == value->size && !memcmp(v.data, value->data, v.size))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_delete_key:
+ * @context: mmap hash context
+ * @key: pointer to key to delete
+ *
+ * Delete all values for a key from a writable hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  if(!hash->pending)
+    return 1;
+
+  hash->is_dirty=1;
+  return librdf_hash_delete_all(hash->pending, key);
+}
+
+
+/**
+ * librdf_hash_mmap_delete_key_value:
+ * @context: mmap hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * Delete a key/value pair from a writable hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_delete_key_value(void* context,
+                                  librdf_hash_datum *key,
+                                  librdf_hash_datum *value)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  if(!hash->pending)
+    return 1;
+
+  hash->is_dirty=1;
+  return librdf_hash_delete(hash->pending, key, value);
+}
+
+
+/**
+ * librdf_hash_mmap_sync:
+ * @context: mmap hash context
+ *
+ * Write a changed writable hash to the file.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_mmap_sync(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  if(hash->pending && hash->is_dirty)
+    return librdf_hash_mmap_write_file(hash);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_mmap_get_fd:
+ * @context: mmap hash context
+ *
+ * Get the file descriptor of the mapped file.
+ *
+ * Return value: the file descriptor or <0 if the hash is writable
+ **/
+static int
+librdf_hash_mmap_get_fd(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  return hash->fd;
+}
+
+
+/**
+ * librdf_hash_mmap_is_ordered:
+ * @context: mmap hash context
+ *
+ * Check if cursors return keys in order, which is true of the mapped
+ * file but not of the contents of a writable hash.
+ *
+ * Return value: non 0 if the hash is read-only
+ **/
+static int
+librdf_hash_mmap_is_ordered(void* context)
+{
+  librdf_hash_mmap_context* hash=(librdf_hash_mmap_context*)context;
+
+  return (hash->pending == NULL);
+}
+
+
+/* local function to register mmap hash functions */
+
+/**
+ * librdf_hash_mmap_register_factory:
+ * @factory: hash factory prototype
+ *
+ * Register the mmap hash module with the hash factory.
+ *
+ **/
+static void
+librdf_hash_mmap_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_mmap_context);
+  factory->cursor_context_length = sizeof(librdf_hash_mmap_cursor_context);
+
+  factory->create  = librdf_hash_mmap_create;
+  factory->destroy = librdf_hash_mmap_destroy;
+
+  factory->open    = librdf_hash_mmap_open;
+  factory->close   = librdf_hash_mmap_close;
+  factory->clone   = librdf_hash_mmap_clone;
+
+  factory->values_count = librdf_hash_mmap_values_count;
+
+  factory->put     = librdf_hash_mmap_put;
+  factory->exists  = librdf_hash_mmap_exists;
+  factory->delete_key  = librdf_hash_mmap_delete_key;
+  factory->delete_key_value  = librdf_hash_mmap_delete_key_value;
+  factory->sync    = librdf_hash_mmap_sync;
+  factory->get_fd  = librdf_hash_mmap_get_fd;
+  factory->is_ordered = librdf_hash_mmap_is_ordered;
+
+  factory->cursor_init   = librdf_hash_mmap_cursor_init;
+  factory->cursor_get    = librdf_hash_mmap_cursor_get;
+  factory->cursor_finish = librdf_hash_mmap_cursor_finish;
+}
+
+/**
+ * librdf_init_hash_mmap:
+ * @world: redland world object
+ *
+ * Initialise the mmap hash module.
+ *
+ **/
+void
+librdf_init_hash_mmap(librdf_world *world)
+{
+  librdf_hash_register_factory(world, "mmap",
+                               &librdf_hash_mmap_register_factory);
+}
@@ -120,6 +120,189 @@ const unsigned int librdf_version_decimal = LIBRDF_VERSION_DECIMAL;
 
 
 
+/*
+ * Blank node identifiers are "r" base "r" pid "r" counter.  Counters
+ * are handed to each thread in blocks of LIBRDF_GENID_BLOCK_SIZE taken
+ * from world->genid_counter under the world mutex, so the counter is
+ * only locked once per block and threads never share a value.  The
+ * "r" base "r" pid "r" prefix is formatted once per thread and reused
+ * while the base and process ID stay the same.
+ */
+
+/* Counters reserved by a thread at a time */
+#define LIBRDF_GENID_BLOCK_SIZE 64
+
+/* "r" + 3 unsigned longs of up to 20 digits + 2 "r" + NUL */
+#define LIBRDF_GENID_MAX_LENGTH 64
+
+typedef struct {
+  /* world and genid_epoch the block was taken from */
+  librdf_world* world;
+  unsigned long epoch;
+  /* next counter to use and end of the block */
+  unsigned long next;
+  unsigned long end;
+  /* base and pid the prefix was formatted with */
+  unsigned long base;
+  unsigned long pid;
+  unsigned char prefix[LIBRDF_GENID_MAX_LENGTH];
+  size_t prefix_len;
+} librdf_genid_block;
+
+#ifdef WITH_THREADS
+static pthread_key_t librdf_genid_block_key;
+static pthread_once_t librdf_genid_block_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t librdf_genid_epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+#else
+static librdf_genid_block librdf_genid_static_block;
+#endif
+
+static unsigned long librdf_genid_epochs = 0;
+
+
+/*
+ * librdf_world_new_genid_epoch:
+ *
+ * INTERNAL - Get a process-wide unique genid epoch
+ *
+ * A world freed and a new one allocated at the same address still get
+ * different epochs, so a thread never uses a block from the old world.
+ *
+ * Return value: new epoch
+ */
+static unsigned long
+librdf_world_new_genid_epoch(void)
+{
+  unsigned long epoch;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&librdf_genid_epoch_mutex);
+#endif
+  epoch = ++librdf_genid_epochs;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&librdf_genid_epoch_mutex);
+#endif
+
+  return epoch;
+}
+
+
+#ifdef WITH_THREADS
+static void
+librdf_genid_block_free(void* data)
+{
+  LIBRDF_FREE(librdf_genid_block, data);
+}
+
+
+static void
+librdf_genid_block_make_key(void)
+{
+  pthread_key_create(&librdf_genid_block_key, librdf_genid_block_free);
+}
+#endif
+
+
+/* Get the genid block of the calling thread or NULL on failure */
+static librdf_genid_block*
+librdf_world_get_genid_block(void)
+{
+#ifdef WITH_THREADS
+  librdf_genid_block* block;
+
+  pthread_once(&librdf_genid_block_key_once, librdf_genid_block_make_key);
+  block = (librdf_genid_block*)pthread_getspecific(librdf_genid_block_key);
+  if(!block) {
+    block = LIBRDF_CALLOC(librdf_genid_block*, 1, sizeof(*block));
+    if(block && pthread_setspecific(librdf_genid_block_key, block)) {
+      LIBRDF_FREE(librdf_genid_block, block);
+      block = NULL;
+    }
+  }
+  return block;
+#else
+  return &librdf_genid_static_block;
+#endif
+}
+
+
+/*
+ * librdf_genid_format_ulong:
+ * @buffer: buffer of at least 21 bytes
+ * @value: value
+ *
+ * INTERNAL - Write an unsigned long in decimal without a NUL
+ *
+ * Return value: number of bytes written
+ */
+static size_t
+librdf_genid_format_ulong(unsigned char *buffer, unsigned long value)
+{
+  unsigned char digits[24];
+  size_t len = 0;
+  size_t i;
+
+  do {
+    digits[len++] = LIBRDF_GOOD_CAST(unsigned char, '0' + (value % 10));
+    value /= 10;
+  } while(value);
+
+  for(i = 0; i < len; i++)
+    buffer[i] = digits[len - 1 - i];
+
+  return len;
+}
+
+
+/*
+ * Reference counts of nodes, URIs, statements, storages and models
+ * are plain integers.  Once the #LIBRDF_WORLD_FEATURE_CONCURRENT
+ * feature is set, the changes librdf makes to them are serialised by
+ * one process-wide mutex, so readers in several threads can share the
+ * nodes of one model.  The mutex also covers making and freeing URIs,
+ * which raptor interns in a table of its world.  Locking is never
+ * turned off again since a thread may be between a lock and its unlock.
+ */
+#ifdef WITH_THREADS
+static pthread_mutex_t librdf_usage_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static int librdf_usage_locking = 0;
+
+
+/**
+ * librdf_usage_lock:
+ *
+ * INTERNAL - Lock around a change to the reference counts of shared objects
+ *
+ * Does nothing until the #LIBRDF_WORLD_FEATURE_CONCURRENT feature is
+ * set.  Nothing that takes the lock may be called while holding it.
+ */
+void
+librdf_usage_lock(void)
+{
+#ifdef WITH_THREADS
+  if(librdf_usage_locking)
+    pthread_mutex_lock(&librdf_usage_mutex);
+#endif
+}
+
+
+/**
+ * librdf_usage_unlock:
+ *
+ * INTERNAL - Unlock after librdf_usage_lock()
+ */
+void
+librdf_usage_unlock(void)
+{
+#ifdef WITH_THREADS
+  if(librdf_usage_locking)
+    pthread_mutex_unlock(&librdf_usage_mutex);
+#endif
+}
+
+
+
 /**
  * librdf_new_world:
  *
@@ -162,6 +345,7 @@ librdf_new_world(void)
   world->genid_base = 1;
 #endif
   world->genid_counter = 1;
+  world->genid_epoch = librdf_world_new_genid_epoch();
   
 #ifdef MODULAR_LIBRDF
   world->ltdl_opened = !(lt_dlinit());
@@ -190,6 +374,9 @@ librdf_free_world(librdf_world *world)
   if(!world)
     return;
   
+  /* a query run by librdf_query_execute_async() uses the world */
+  librdf_query_async_join(world);
+
   librdf_finish_serializer(world);
   librdf_finish_parser(world);
 
@@ -213,7 +400,9 @@ librdf_free_world(librdf_world *world)
 #ifdef WITH_THREADS
 
   if(world->hash_datums_mutex) {
-    pthread_mutex_destroy(world->hash_datums_mutex);
+    int i;
+    for(i=0; i < LIBRDF_HASH_DATUMS_STRIPES; i++)
+      pthread_mutex_destroy(&world->hash_datums_mutex[i]);
     SYSTEM_FREE(world->hash_datums_mutex);
     world->hash_datums_mutex = NULL;
   }
@@ -258,6 +447,8 @@ void
 librdf_world_init_mutex(librdf_world* world)
 {
 #ifdef WITH_THREADS
+  int i;
+
   world->mutex = (pthread_mutex_t *) SYSTEM_MALLOC(sizeof(pthread_mutex_t));
   pthread_mutex_init(world->mutex, NULL);
 
@@ -267,8 +458,9 @@ librdf_world_init_mutex(librdf_world* world)
   world->statements_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(sizeof(pthread_mutex_t));
   pthread_mutex_init(world->statements_mutex, NULL);
 
-  world->hash_datums_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(sizeof(pthread_mutex_t));
-  pthread_mutex_init(world->hash_datums_mutex, NULL);
+  world->hash_datums_mutex = (pthread_mutex_t *) SYSTEM_MALLOC(LIBRDF_HASH_DATUMS_STRIPES * sizeof(pthread_mutex_t));
+  for(i=0; i < LIBRDF_HASH_DATUMS_STRIPES; i++)
+    pthread_mutex_init(&world->hash_datums_mutex[i], NULL);
 
 #else
 #endif
@@ -284,8 +476,6 @@ librdf_world_init_mutex(librdf_world* world)
 void
 librdf_world_open(librdf_world *world)
 {
-  int rc = 0;
-  
   if(world->opened++)
     return;
   
@@ -307,20 +497,39 @@ librdf_world_open(librdf_world *world)
 
   librdf_init_statement(world);
   librdf_init_model(world);
-  librdf_init_storage(world);
 
-  librdf_init_parser(world);
-  librdf_init_serializer(world);
+  /* The storage, parser, serializer and query factories are
+   * registered by librdf_world_load_once() when first looked up */
+}
 
-  rc = librdf_init_query(world);
-  if(rc)
-    goto failed;
-  
-  return;
-  
-failed:
-  /* should return an error state */
-  return;
+
+/**
+ * librdf_world_load_once:
+ * @world: redland world object
+ * @loaded: flag in @world that is non 0 once @load has run
+ * @load: function registering factories or making shared objects
+ *
+ * INTERNAL - Run @load the first time it is needed in an open world.
+ *
+ * Used to defer the work of librdf_world_open() that most programs
+ * never need.  Threads looking up at the same time wait for the one
+ * doing the load.  @loaded is only read with the world mutex held,
+ * so the objects made by @load are seen by every thread finding it set.
+ */
+void
+librdf_world_load_once(librdf_world* world, int* loaded,
+                       void (*load)(librdf_world*))
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->mutex);
+#endif
+  if(!*loaded) {
+    load(world);
+    *loaded = 1;
+  }
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
 }
 
 
@@ -360,6 +569,11 @@ rasqal_world*
 librdf_world_get_rasqal(librdf_world* world)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
+
+  /* the rasqal world is made with the query factories */
+  if(!world->rasqal_world_ptr && world->opened)
+    librdf_world_load_once(world, &world->queries_loaded, librdf_init_query);
+
   return world->rasqal_world_ptr;
 }
 
@@ -457,7 +671,68 @@ librdf_world_set_digest(librdf_world* world, const char *name)
 librdf_node*
 librdf_world_get_feature(librdf_world* world, librdf_uri *feature) 
 {
-  return NULL; /* none retrievable */
+  char value[48];
+  const char* name = (const char*)librdf_uri_as_string(feature);
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_NODE_INTERNING)) {
+    sprintf(value, "%d", world->nodes_hash_max);
+    return librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                        NULL, 0);
+  }
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_STATEMENT_CACHE)) {
+    sprintf(value, "%d", librdf_statement_cache_get_size());
+    return librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                        NULL, 0);
+  }
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_CONCURRENT)) {
+    sprintf(value, "%d", librdf_usage_locking);
+    return librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                        NULL, 0);
+  }
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_LOG_LEVEL))
+    return librdf_new_node_from_literal(world,
+                                        (const unsigned char*)librdf_log_get_level(world),
+                                        NULL, 0);
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_LOG_QUIET_FACILITIES)) {
+    char* facilities = librdf_log_get_quiet_facilities(world);
+    librdf_node* node;
+
+    if(!facilities)
+      return NULL;
+    node = librdf_new_node_from_literal(world, (const unsigned char*)facilities,
+                                        NULL, 0);
+    LIBRDF_FREE(char*, facilities);
+    return node;
+  }
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_LOG_RATE_LIMIT)) {
+    sprintf(value, "%d", world->log_rate_limit);
+    return librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                        NULL, 0);
+  }
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_NODE_INTERNING_MEMORY)) {
+    sprintf(value, "%lu",
+            (unsigned long)librdf_node_get_interned_memory_size(world));
+    return librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                        NULL, 0);
+  }
+
+  if(!strcmp(name, LIBRDF_WORLD_FEATURE_STATEMENT_CACHE_COUNTS)) {
+    unsigned long reused;
+    unsigned long allocated;
+
+    librdf_statement_cache_get_counts(&reused, &allocated);
+    sprintf(value, "%lu %lu", reused, allocated);
+    return librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                        NULL, 0);
+  }
+
+  return NULL; /* others not retrievable */
 }
 
 
@@ -477,12 +752,30 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
 {
   librdf_uri* genid_base;
   librdf_uri* genid_counter;
+  librdf_uri* node_interning;
+  librdf_uri* statement_cache;
+  librdf_uri* concurrent;
+  librdf_uri* log_level;
+  librdf_uri* log_quiet_facilities;
+  librdf_uri* log_rate_limit;
   int rc= -1;
 
   genid_counter = librdf_new_uri(world,
                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_GENID_COUNTER);
   genid_base = librdf_new_uri(world,
                               (const unsigned char*)LIBRDF_WORLD_FEATURE_GENID_BASE);
+  node_interning = librdf_new_uri(world,
+                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_NODE_INTERNING);
+  statement_cache = librdf_new_uri(world,
+                                   (const unsigned char*)LIBRDF_WORLD_FEATURE_STATEMENT_CACHE);
+  concurrent = librdf_new_uri(world,
+                              (const unsigned char*)LIBRDF_WORLD_FEATURE_CONCURRENT);
+  log_level = librdf_new_uri(world,
+                             (const unsigned char*)LIBRDF_WORLD_FEATURE_LOG_LEVEL);
+  log_quiet_facilities = librdf_new_uri(world,
+                                        (const unsigned char*)LIBRDF_WORLD_FEATURE_LOG_QUIET_FACILITIES);
+  log_rate_limit = librdf_new_uri(world,
+                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_LOG_RATE_LIMIT);
 
   if(librdf_uri_equals(feature, genid_base)) {
     if(!librdf_node_is_resource(value))
@@ -513,15 +806,89 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
       pthread_mutex_lock(world->mutex);
 #endif
       world->genid_counter = LIBRDF_GOOD_CAST(unsigned long, lid);
+      world->genid_epoch = librdf_world_new_genid_epoch();
 #ifdef WITH_THREADS
       pthread_mutex_unlock(world->mutex);
 #endif
       rc = 0;
     }
+  } else if(librdf_uri_equals(feature, node_interning)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else {
+      int max = atoi((const char*)librdf_node_get_literal_value(value));
+      if(max < 0)
+        max = 0;
+
+#ifdef WITH_THREADS
+      pthread_mutex_lock(world->nodes_mutex);
+#endif
+      world->nodes_hash_max = max;
+#ifdef WITH_THREADS
+      pthread_mutex_unlock(world->nodes_mutex);
+#endif
+      if(!max)
+        librdf_node_clear_interned(world);
+      rc = 0;
+    }
+  } else if(librdf_uri_equals(feature, statement_cache)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else {
+      librdf_statement_cache_set_size(atoi((const char*)librdf_node_get_literal_value(value)));
+      if(!librdf_statement_cache_get_size())
+        librdf_statement_cache_clear();
+      rc = 0;
+    }
+  } else if(librdf_uri_equals(feature, concurrent)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else if(atoi((const char*)librdf_node_get_literal_value(value)) > 0) {
+#ifdef WITH_THREADS
+      librdf_usage_locking = 1;
+      rc = 0;
+#else
+      librdf_log(world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_INIT, NULL,
+                 "Ignoring concurrent feature without thread support");
+      rc = 1;
+#endif
+    } else
+      /* cannot be turned off once on */
+      rc = librdf_usage_locking;
+  } else if(librdf_uri_equals(feature, log_level)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else
+      rc = librdf_log_set_level(world,
+                                (const char*)librdf_node_get_literal_value(value));
+  } else if(librdf_uri_equals(feature, log_quiet_facilities)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else
+      rc = librdf_log_set_quiet_facilities(world,
+                                           (const char*)librdf_node_get_literal_value(value));
+  } else if(librdf_uri_equals(feature, log_rate_limit)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else {
+      int limit = atoi((const char*)librdf_node_get_literal_value(value));
+      if(limit < 0)
+        limit = 0;
+
+      world->log_rate_limit = limit;
+      world->log_rate_count = 0;
+      rc = 0;
+    }
   }
 
   librdf_free_uri(genid_base);
   librdf_free_uri(genid_counter);
+  librdf_free_uri(node_interning);
+  librdf_free_uri(statement_cache);
+  librdf_free_uri(concurrent);
+  librdf_free_uri(log_level);
+  librdf_free_uri(log_quiet_facilities);
+  librdf_free_uri(log_rate_limit);
 
   return rc;
 }
@@ -531,20 +898,17 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
 unsigned char*
 librdf_world_get_genid(librdf_world* world)
 {
-  unsigned long id, tmpid, counter, tmpcounter, pid, tmppid;
+  librdf_genid_block* block;
+  unsigned long base, counter, pid;
   size_t length;
   unsigned char *buffer;
 
-  /* This is read-only and thread safe */
-  tmpid = (id = world->genid_base);
+  block = librdf_world_get_genid_block();
+  if(!block)
+    return NULL;
 
-#ifdef WITH_THREADS
-  pthread_mutex_lock(world->mutex);
-#endif
-  tmpcounter = (counter = world->genid_counter++);
-#ifdef WITH_THREADS
-  pthread_mutex_unlock(world->mutex);
-#endif
+  /* This is read-only and thread safe */
+  base = world->genid_base;
 
   /* Add the process ID to the seed to differentiate between
    * simultaneously executed child processes.
@@ -552,24 +916,45 @@ librdf_world_get_genid(librdf_world* world)
   pid = LIBRDF_GOOD_CAST(unsigned long, getpid());
   if(!pid)
     pid = 1;
-  tmppid = pid;
 
+  if(block->world != world || block->epoch != world->genid_epoch ||
+     block->next == block->end) {
+#ifdef WITH_THREADS
+    pthread_mutex_lock(world->mutex);
+#endif
+    block->world = world;
+    block->epoch = world->genid_epoch;
+    block->next = world->genid_counter;
+    world->genid_counter += LIBRDF_GENID_BLOCK_SIZE;
+#ifdef WITH_THREADS
+    pthread_mutex_unlock(world->mutex);
+#endif
+    block->end = block->next + LIBRDF_GENID_BLOCK_SIZE;
+  }
+  counter = block->next++;
+
+  if(!block->prefix_len || block->base != base || block->pid != pid) {
+    unsigned char *p = block->prefix;
+
+    *p++ = 'r';
+    p += librdf_genid_format_ulong(p, base);
+    *p++ = 'r';
+    p += librdf_genid_format_ulong(p, pid);
+    *p++ = 'r';
+    block->prefix_len = LIBRDF_GOOD_CAST(size_t, p - block->prefix);
+    block->base = base;
+    block->pid = pid;
+  }
 
-  /* min length 1 + "r" + min length 1 + "r" + min length 1 + "r" \0 */
-  length = 7;
-
-  while(tmpid /= 10)
-    length++;
-  while(tmpcounter /= 10)
-    length++;
-  while(tmppid /= 10)
-    length++;
-  
-  buffer = LIBRDF_MALLOC(unsigned char*, length);
+  buffer = LIBRDF_MALLOC(unsigned char*, LIBRDF_GENID_MAX_LENGTH);
   if(!buffer)
     return NULL;
 
-  sprintf((char*)buffer, "r%lur%lur%lu", id, pid, counter);
+  memcpy(buffer, block->prefix, block->prefix_len);
+  length = block->prefix_len;
+  length += librdf_genid_format_ulong(buffer + length, counter);
+  buffer[length] = '\0';
+
   return buffer;
 }
 
@@ -726,6 +1111,7 @@ main(int argc, char *argv[])
   librdf_world *world;
   rasqal_world *rasqal_world;
   unsigned char* id;
+  int i;
   const char *program=librdf_basename((const char*)argv[0]);
 
   /* Minimal setup-cleanup test without opening the world */
@@ -777,6 +1163,18 @@ main(int argc, char *argv[])
     return 1;
   }
   fprintf(stdout, "%s: New identifier is: '%s'\n", program, id);
+
+  /* Identifiers stay distinct across counter blocks */
+  for(i = 0; i < 3 * 64; i++) {
+    unsigned char* next_id = librdf_world_get_genid(world);
+    if(!next_id || !strcmp((const char*)next_id, (const char*)id)) {
+      fprintf(stderr, "%s: librdf_world_get_genid returned '%s' after '%s'\n",
+              program, next_id, id);
+      return 1;
+    }
+    LIBRDF_FREE(char*, id);
+    id = next_id;
+  }
   LIBRDF_FREE(char*, id);
 
   fprintf(stdout, "%s: Deleting world\n", program);
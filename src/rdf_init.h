@@ -101,6 +101,98 @@ void* librdf_calloc_memory(size_t nmemb, size_t size);
  */
 #define LIBRDF_WORLD_FEATURE_GENID_COUNTER "http://feature.librdf.org/genid-counter"
 
+/**
+ * LIBRDF_WORLD_FEATURE_NODE_INTERNING:
+ *
+ * World feature to share one node object between equal nodes.
+ *
+ * The value is a literal with the most nodes to keep in the intern
+ * table, which is emptied when full; 0 (the default) disables it.
+ * Nodes decoded from storages and made by parsers are interned.
+ */
+#define LIBRDF_WORLD_FEATURE_NODE_INTERNING "http://feature.librdf.org/node-interning"
+
+/**
+ * LIBRDF_WORLD_FEATURE_NODE_INTERNING_MEMORY:
+ *
+ * Read-only world feature with the approximate bytes held by the
+ * nodes of the world and the tables sharing them, as a literal count.
+ */
+#define LIBRDF_WORLD_FEATURE_NODE_INTERNING_MEMORY "http://feature.librdf.org/node-interning-memory"
+
+/**
+ * LIBRDF_WORLD_FEATURE_STATEMENT_CACHE:
+ *
+ * World feature for the freed statements each thread keeps for reuse.
+ *
+ * The value is a literal count, 0 to keep none; the default is 64 and
+ * the most is 1024.  The setting is shared by all worlds.
+ */
+#define LIBRDF_WORLD_FEATURE_STATEMENT_CACHE "http://feature.librdf.org/statement-cache"
+
+/**
+ * LIBRDF_WORLD_FEATURE_STATEMENT_CACHE_COUNTS:
+ *
+ * Read-only world feature with the statement reuse counters of the
+ * calling thread.
+ *
+ * The value is a literal of the statements reused and the statements
+ * allocated, separated by a space.
+ */
+#define LIBRDF_WORLD_FEATURE_STATEMENT_CACHE_COUNTS "http://feature.librdf.org/statement-cache-counts"
+
+/**
+ * LIBRDF_WORLD_FEATURE_CONCURRENT:
+ *
+ * World feature to share nodes, statements, models and storages
+ * between threads.
+ *
+ * Set to literal "1" before other threads use Redland; it cannot be
+ * turned off and is shared by all worlds.  From then on, changes to
+ * the reference counts of shared objects are locked, so the read
+ * operations of a storage with the #LIBRDF_STORAGE_FEATURE_SHARED_READS
+ * feature may be called on one model from several threads at once.
+ * Each stream, iterator and query results object must still be used
+ * by one thread at a time, and parsing, serializing and queries run
+ * raptor and rasqal code that is not covered.
+ */
+#define LIBRDF_WORLD_FEATURE_CONCURRENT "http://feature.librdf.org/concurrent"
+
+/**
+ * LIBRDF_WORLD_FEATURE_LOG_LEVEL:
+ *
+ * World feature for the least level of log messages that are logged.
+ *
+ * The value is a literal level name: "none" (the default, log all),
+ * "debug", "info", "warning" or "error".  Messages below it are
+ * dropped before they are formatted.  Fatal messages are always
+ * logged.
+ */
+#define LIBRDF_WORLD_FEATURE_LOG_LEVEL "http://feature.librdf.org/log-level"
+
+/**
+ * LIBRDF_WORLD_FEATURE_LOG_QUIET_FACILITIES:
+ *
+ * World feature for the facilities whose log messages are dropped.
+ *
+ * The value is a literal of space separated facility names in lower
+ * case such as "storage parser", one for each #librdf_log_facility;
+ * empty (the default) logs all.  Fatal messages are always logged.
+ */
+#define LIBRDF_WORLD_FEATURE_LOG_QUIET_FACILITIES "http://feature.librdf.org/log-quiet-facilities"
+
+/**
+ * LIBRDF_WORLD_FEATURE_LOG_RATE_LIMIT:
+ *
+ * World feature for the most log messages logged each second.
+ *
+ * The value is a literal count, 0 (the default) for no limit.  Later
+ * messages in the same second are dropped before they are formatted
+ * and their number is logged as a warning in the next second that
+ * logs.  Fatal messages are always logged.
+ */
+#define LIBRDF_WORLD_FEATURE_LOG_RATE_LIMIT "http://feature.librdf.org/log-rate-limit"
+
 REDLAND_API
 librdf_node* librdf_world_get_feature(librdf_world* world, librdf_uri *feature);
 REDLAND_API
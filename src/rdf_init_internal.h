@@ -44,6 +44,11 @@ typedef struct rasqal_world_s rasqal_world;
 #endif
 #endif
 
+/* Number of free lists for librdf_hash_datum objects.  Threads pick a
+ * stripe from their thread id so that threads working on different
+ * hashes rarely wait on the same mutex. MUST BE POWER OF 2 */
+#define LIBRDF_HASH_DATUMS_STRIPES 16
+
 struct librdf_world_s
 {
   void *error_user_data;
@@ -58,6 +63,19 @@ struct librdf_world_s
   /* static (last) log message */
   librdf_log_message log;
 
+  /* Messages below log_level or from a facility with its bit set in
+   * log_quiet_facilities are dropped before they are formatted */
+  librdf_log_level log_level;
+  unsigned long log_quiet_facilities;
+
+  /* At most log_rate_limit messages are logged in each second
+   * log_rate_second, 0 for no limit.  The counts are not locked so
+   * are approximate when threads log at once */
+  int log_rate_limit;
+  long log_rate_second;
+  int log_rate_count;
+  unsigned long log_rate_dropped;
+
   char *digest_factory_name;
   librdf_digest_factory* digest_factory;
 
@@ -65,8 +83,14 @@ struct librdf_world_s
   librdf_hash* uris_hash;
   int uris_hash_allocated_here;
 
-  /* Node interning */
+  /* Node interning: encoded node => librdf_node*, holding a
+   * reference, created when first used.  The tables are emptied when
+   * they reach nodes_hash_max nodes; 0 disables interning */
   librdf_hash* nodes_hash[3]; /* resource, literal, blank */
+  int nodes_hash_max;
+  int nodes_hash_count;
+  /* approximate bytes of the nodes in the tables */
+  size_t nodes_hash_memory;
 
   /* Sequence of model factories */
   raptor_sequence* models;
@@ -83,24 +107,38 @@ struct librdf_world_s
   /* List of query factories */
   librdf_query_factory* query_factories;
 
+  /* non 0 once the built-in factories above are registered, done on
+   * the first look up rather than when the world is opened */
+  int storages_loaded;
+  int parsers_loaded;
+  int serializers_loaded;
+  int queries_loaded;
+
   /* List of digest factories */
   librdf_digest_factory *digests;
 
   /* list of hash factories */
   librdf_hash_factory* hashes;
 
-  /* list of free librdf_hash_datums is kept */
-  librdf_hash_datum* hash_datums_list;
+  /* lists of free librdf_hash_datums are kept, one per stripe */
+  librdf_hash_datum* hash_datums_list[LIBRDF_HASH_DATUMS_STRIPES];
 
    /* hash load_factor out of 1000 */
   int hash_load_factor;
 
+  /* shared Berkeley DB environments opened by the bdb hash */
+  struct librdf_hash_bdb_env_s* hash_bdb_envs;
+
   /* ID base from startup time */
   unsigned long genid_base;
 
   /* Unique counter from there */
   unsigned long genid_counter;
 
+  /* Process-wide unique value changed whenever genid_counter is set,
+   * so per-thread blocks of counters taken before are dropped */
+  unsigned long genid_epoch;
+
 #ifdef WITH_THREADS
   /* mutex so we can lock around this when we need to */
   pthread_mutex_t* mutex;
@@ -111,7 +149,8 @@ struct librdf_world_s
   /* mutex to lock the statements class */
   pthread_mutex_t* statements_mutex;
 
-  /* mutex to lock the hash_datums class */
+  /* array of LIBRDF_HASH_DATUMS_STRIPES mutexes, one per
+   * hash_datums_list stripe */
   pthread_mutex_t* hash_datums_mutex;
 #else
   /* !WITH_THREADS - pad structure to same size */
@@ -129,6 +168,12 @@ struct librdf_world_s
    */
   raptor_sequence* storage_modules;
 
+  /* non 0 once every installed storage module has been loaded, rather
+   * than only those asked for by name
+   * Used with --enable-modular / MODULAR_LIBRDF
+   */
+  int storage_modules_loaded;
+
   /* If libtdl has been opened with lt_dlinit()
    * Used with --enable-modular / MODULAR_LIBRDF
    */
@@ -138,9 +183,10 @@ struct librdf_world_s
   librdf_uri* concept_ms_namespace_uri;
   librdf_uri* concept_schema_namespace_uri;
 
-  /* librdf_concepts nodes and uris */
+  /* librdf_concepts nodes and uris, made on first use */
   librdf_uri** concept_uris;
   librdf_node** concept_resources;
+  int concepts_loaded;
 
   /* rasqal world object */
   rasqal_world* rasqal_world_ptr;
@@ -160,9 +206,23 @@ struct librdf_world_s
   void* rasqal_init_handler_user_data;
 
   librdf_uri* xsd_namespace_uri;
+
+#ifdef WITH_THREADS
+  /* thread of the last librdf_query_execute_async(), running the
+   * query async_query while async_running; non 0 async_started until
+   * the thread is joined.  Locked by mutex */
+  pthread_t async_thread;
+  librdf_query* async_query;
+  int async_started;
+  int async_running;
+#endif
 };
 
 unsigned char* librdf_world_get_genid(librdf_world* world);
+void librdf_world_load_once(librdf_world* world, int* loaded, void (*load)(librdf_world*));
+
+void librdf_usage_lock(void);
+void librdf_usage_unlock(void);
 
 
 #ifdef __cplusplus
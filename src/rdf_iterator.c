@@ -32,6 +32,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 
 #include <redland.h>
 
@@ -89,17 +90,6 @@ librdf_new_iterator(librdf_world *world,
 }
 
 
-/* helper function for deleting list map */
-static void
-librdf_iterator_free_iterator_map(void *list_data, void *user_data) 
-{
-  librdf_iterator_map* map=(librdf_iterator_map*)list_data;
-  if(map->free_context)
-    map->free_context(map->context);
-  LIBRDF_FREE(librdf_iterator_map, map);
-}
-
-  
 
 /**
  * librdf_free_iterator:
@@ -117,10 +107,14 @@ librdf_free_iterator(librdf_iterator* iterator)
   if(iterator->finished_method)
     iterator->finished_method(iterator->context);
 
-  if(iterator->map_list) {
-    librdf_list_foreach(iterator->map_list,
-                        librdf_iterator_free_iterator_map, NULL);
-    librdf_free_list(iterator->map_list);
+  if(iterator->maps) {
+    int i;
+
+    for(i=0; i < iterator->maps_count; i++) {
+      if(iterator->maps[i].free_context)
+        iterator->maps[i].free_context(iterator->maps[i].context);
+    }
+    LIBRDF_FREE(librdf_iterator_map*, iterator->maps);
   }
   
   LIBRDF_FREE(librdf_iterator, iterator);
@@ -150,32 +144,17 @@ librdf_iterator_update_current_element(librdf_iterator* iterator)
   
   /* find next element subject to map */
   while(!iterator->is_end_method(iterator->context)) {
-    librdf_iterator* map_iterator; /* Iterator over iterator->map_list librdf_list */
+    int i;
+
     element=iterator->get_method(iterator->context, 
                                  LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT);
     if(!element)
       break;
 
-    if(!iterator->map_list || !librdf_list_size(iterator->map_list))
-      break;
-    
-    map_iterator=librdf_list_get_iterator(iterator->map_list);
-    if(!map_iterator)
-      break;
-    
-    while(!librdf_iterator_end(map_iterator)) {
-      librdf_iterator_map *map=(librdf_iterator_map*)librdf_iterator_get_object(map_iterator);
-      if(!map)
-        break;
-      
-      /* apply the map to the element  */
-      element=map->fn(iterator, map->context, element);
-      if(!element)
-        break;
-
-      librdf_iterator_next(map_iterator);
-    }
-    librdf_free_iterator(map_iterator);
+    /* apply the maps to the element in order */
+    for(i=0; element && i < iterator->maps_count; i++)
+      element=iterator->maps[i].fn(iterator, iterator->maps[i].context,
+                                   element);
     
 
     /* found something, return it */
@@ -388,26 +367,24 @@ librdf_iterator_add_map(librdf_iterator* iterator,
                         librdf_iterator_map_free_context_handler free_context,
                         void *map_context)
 {
-  librdf_iterator_map *map;
+  librdf_iterator_map *maps;
   
-  if(!iterator->map_list) {
-    iterator->map_list=librdf_new_list(iterator->world);
-    if(!iterator->map_list)
-      return 1;
-  }
-
-  map = LIBRDF_CALLOC(librdf_iterator_map*, 1, sizeof(*map));
-  if(!map)
+  /* kept in one array so applying them is a single loop */
+  maps=LIBRDF_MALLOC(librdf_iterator_map*,
+                     (iterator->maps_count + 1) * sizeof(*maps));
+  if(!maps)
     return 1;
 
-  map->fn=map_function;
-  map->free_context=free_context;
-  map->context=map_context;
-
-  if(librdf_list_add(iterator->map_list, map)) {
-    LIBRDF_FREE(librdf_iterator_map, map);
-    return 1;
+  if(iterator->maps) {
+    memcpy(maps, iterator->maps, iterator->maps_count * sizeof(*maps));
+    LIBRDF_FREE(librdf_iterator_map*, iterator->maps);
   }
+  iterator->maps=maps;
+
+  maps[iterator->maps_count].fn=map_function;
+  maps[iterator->maps_count].free_context=free_context;
+  maps[iterator->maps_count].context=map_context;
+  iterator->maps_count++;
   
   return 0;
 }
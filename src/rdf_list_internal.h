@@ -58,6 +58,9 @@ struct librdf_list_iterator_context_s {
 
 typedef struct librdf_list_iterator_context_s librdf_list_iterator_context;
 
+librdf_list_node* librdf_list_add_node(librdf_list* list, void *data);
+void* librdf_list_remove_node(librdf_list* list, librdf_list_node* node);
+
 struct librdf_list_s
 {
   librdf_world *world;
@@ -59,25 +59,83 @@ static const char * const log_level_names[LIBRDF_LOG_LAST+1]={
   "none", "debug", "info", "warning", "error", "fatal"
 };
 
+static const char * const log_facility_names[LIBRDF_FROM_LAST+1]={
+  "none", "concepts", "digest", "files", "hash", "init", "iterator",
+  "list", "model", "node", "parser", "query", "serializer", "statement",
+  "storage", "stream", "uri", "utf8", "memory", "raptor"
+};
 
-/**
- * librdf_log_simple:
+
+static void librdf_log_emit(librdf_world* world, int code, librdf_log_level level, librdf_log_facility facility, void *locator, const char *message);
+
+
+/*
+ * librdf_log_dropped:
  * @world: redland world object or NULL
- * @code: error code
  * @level: #librdf_log_level log level
  * @facility: #librdf_log_facility log facility
- * @locator: raptor_locator if available or NULL
- * @message: message to record
  *
- * Log a message.
+ * INTERNAL - Decide if a message is discarded by the world log filters
  *
- * If world is NULL, the error ocurred in redland startup before
- * the world was created.
- **/
-void
-librdf_log_simple(librdf_world* world, int code, 
-                  librdf_log_level level, librdf_log_facility facility,
-                  void *locator, const char *message)
+ * Checked before a message is formatted.  Fatal messages are never
+ * dropped.  When a new second starts after messages were dropped by
+ * the rate limit, a warning with the count is logged first.
+ *
+ * Return value: non 0 if the message must not be logged
+ */
+static int
+librdf_log_dropped(librdf_world* world,
+                   librdf_log_level level, librdf_log_facility facility)
+{
+  long now;
+  unsigned long dropped;
+  
+  if(!world || level >= LIBRDF_LOG_FATAL)
+    return 0;
+
+  if(level < world->log_level)
+    return 1;
+
+  if(world->log_quiet_facilities &&
+     facility <= LIBRDF_FROM_LAST &&
+     (world->log_quiet_facilities & (1UL << facility)))
+    return 1;
+
+  if(!world->log_rate_limit)
+    return 0;
+
+  now = (long)time(NULL);
+  if(now != world->log_rate_second) {
+    world->log_rate_second = now;
+    world->log_rate_count = 0;
+
+    dropped = world->log_rate_dropped;
+    if(dropped) {
+      char buffer[64];
+
+      world->log_rate_dropped = 0;
+      world->log_rate_count++;
+      sprintf(buffer, "%lu log messages dropped by the rate limit", dropped);
+      librdf_log_emit(world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_NONE, NULL,
+                      buffer);
+    }
+  }
+
+  if(world->log_rate_count >= world->log_rate_limit) {
+    world->log_rate_dropped++;
+    return 1;
+  }
+
+  world->log_rate_count++;
+  return 0;
+}
+
+
+/* INTERNAL - Pass a message that was not dropped to the handlers or stderr */
+static void
+librdf_log_emit(librdf_world* world, int code, 
+                librdf_log_level level, librdf_log_facility facility,
+                void *locator, const char *message)
 {
   if(level > LIBRDF_LOG_LAST)
     level=LIBRDF_LOG_NONE;
@@ -87,13 +145,16 @@ librdf_log_simple(librdf_world* world, int code,
   
   if(world) {
     if(world->log_handler) {
-      world->log.code=code;
-      world->log.level=level;
-      world->log.facility=facility;
-      world->log.message=message;
-      world->log.locator=(raptor_locator*)locator;
+      /* made per call so threads logging at once do not share it */
+      librdf_log_message log;
 
-      if(world->log_handler(world->log_user_data, &world->log))
+      log.code=code;
+      log.level=level;
+      log.facility=facility;
+      log.message=message;
+      log.locator=(raptor_locator*)locator;
+
+      if(world->log_handler(world->log_user_data, &log))
         return;
 
     } else {
@@ -148,6 +209,35 @@ librdf_log_simple(librdf_world* world, int code,
 }
 
 
+/**
+ * librdf_log_simple:
+ * @world: redland world object or NULL
+ * @code: error code
+ * @level: #librdf_log_level log level
+ * @facility: #librdf_log_facility log facility
+ * @locator: raptor_locator if available or NULL
+ * @message: message to record
+ *
+ * Log a message.
+ *
+ * The message is dropped if the world log level, quiet facilities or
+ * rate limit features say so.
+ *
+ * If world is NULL, the error ocurred in redland startup before
+ * the world was created.
+ **/
+void
+librdf_log_simple(librdf_world* world, int code, 
+                  librdf_log_level level, librdf_log_facility facility,
+                  void *locator, const char *message)
+{
+  if(librdf_log_dropped(world, level, facility))
+    return;
+
+  librdf_log_emit(world, code, level, facility, locator, message);
+}
+
+
 /**
  * librdf_log:
  * @world: redland world object or NULL
@@ -160,6 +250,9 @@ librdf_log_simple(librdf_world* world, int code,
  *
  * Log a message.
  *
+ * The message is not formatted if it is dropped by the world log
+ * level, quiet facilities or rate limit features.
+ *
  * If world is NULL, the error ocurred in redland startup before
  * the world was created.
  **/
@@ -170,6 +263,9 @@ librdf_log(librdf_world* world, int code,
 {
   va_list arguments;
   char *buffer;
+
+  if(librdf_log_dropped(world, level, facility))
+    return;
   
   va_start(arguments, message);
 
@@ -180,7 +276,7 @@ librdf_log(librdf_world* world, int code,
 #else
   buffer = raptor_vsnprintf(message, arguments);
 #endif
-  librdf_log_simple(world, code, level, facility, locator, buffer);
+  librdf_log_emit(world, code, level, facility, locator, buffer);
   if(buffer)
     raptor_free_memory(buffer);
 
@@ -315,6 +411,138 @@ librdf_log_message_locator(librdf_log_message *message)
 }
 
 
+/**
+ * librdf_log_set_level:
+ * @world: redland world object
+ * @value: level name such as "warning" or number
+ *
+ * INTERNAL - Set the least level of messages that are logged
+ *
+ * Return value: non 0 if @value is not a log level
+ **/
+int
+librdf_log_set_level(librdf_world* world, const char *value)
+{
+  int level;
+
+  for(level = LIBRDF_LOG_NONE; level <= LIBRDF_LOG_LAST; level++) {
+    if(!strcmp(value, log_level_names[level]))
+      break;
+  }
+  if(level > LIBRDF_LOG_LAST) {
+    if(*value < '0' || *value > '9')
+      return 1;
+    level = atoi(value);
+  }
+
+  /* fatal messages cannot be dropped, nor can errors be, by the level */
+  if(level > LIBRDF_LOG_ERROR)
+    level = LIBRDF_LOG_ERROR;
+
+  world->log_level = (librdf_log_level)level;
+  return 0;
+}
+
+
+/**
+ * librdf_log_get_level:
+ * @world: redland world object
+ *
+ * INTERNAL - Get the name of the least level of messages that are logged
+ *
+ * Return value: shared level name
+ **/
+const char*
+librdf_log_get_level(librdf_world* world)
+{
+  return log_level_names[world->log_level];
+}
+
+
+/**
+ * librdf_log_set_quiet_facilities:
+ * @world: redland world object
+ * @value: space or comma separated facility names such as "storage parser"
+ *
+ * INTERNAL - Set the facilities whose messages are dropped apart from fatal ones
+ *
+ * An empty @value logs all facilities again.
+ *
+ * Return value: non 0 if a name is not a facility, leaving the setting alone
+ **/
+int
+librdf_log_set_quiet_facilities(librdf_world* world, const char *value)
+{
+  unsigned long mask = 0;
+  const char *p = value;
+
+  while(*p) {
+    size_t len;
+    int facility;
+
+    if(*p == ' ' || *p == ',') {
+      p++;
+      continue;
+    }
+
+    for(len = 0; p[len] && p[len] != ' ' && p[len] != ','; len++)
+      ;
+
+    for(facility = LIBRDF_FROM_NONE; facility <= LIBRDF_FROM_LAST; facility++) {
+      if(strlen(log_facility_names[facility]) == len &&
+         !strncmp(p, log_facility_names[facility], len))
+        break;
+    }
+    if(facility > LIBRDF_FROM_LAST)
+      return 1;
+
+    mask |= (1UL << facility);
+    p += len;
+  }
+
+  world->log_quiet_facilities = mask;
+  return 0;
+}
+
+
+/**
+ * librdf_log_get_quiet_facilities:
+ * @world: redland world object
+ *
+ * INTERNAL - Get the facilities whose messages are dropped
+ *
+ * Return value: new string of space separated facility names or NULL on failure
+ **/
+char*
+librdf_log_get_quiet_facilities(librdf_world* world)
+{
+  char *buffer;
+  char *p;
+  size_t length = 1;
+  int facility;
+
+  for(facility = LIBRDF_FROM_NONE; facility <= LIBRDF_FROM_LAST; facility++)
+    length += strlen(log_facility_names[facility]) + 1;
+
+  buffer = LIBRDF_MALLOC(char*, length);
+  if(!buffer)
+    return NULL;
+
+  p = buffer;
+  for(facility = LIBRDF_FROM_NONE; facility <= LIBRDF_FROM_LAST; facility++) {
+    if(!(world->log_quiet_facilities & (1UL << facility)))
+      continue;
+    if(p != buffer)
+      *p++ = ' ';
+    strcpy(p, log_facility_names[facility]);
+    p += strlen(p);
+  }
+  *p = '\0';
+
+  return buffer;
+}
+
+
 /* prototypes for testing errors only - NOT PART OF API */
 void
 librdf_test_error(librdf_world* world, const char *message) 
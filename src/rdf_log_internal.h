@@ -33,6 +33,11 @@ extern "C" {
 REDLAND_NORETURN
 void librdf_fatal(librdf_world* world, int facility, const char *file, int line, const char *function, const char *message);
 
+int librdf_log_set_level(librdf_world* world, const char *value);
+const char* librdf_log_get_level(librdf_world* world);
+int librdf_log_set_quiet_facilities(librdf_world* world, const char *value);
+char* librdf_log_get_quiet_facilities(librdf_world* world);
+
 void librdf_test_error(librdf_world* world, const char *message);
 void librdf_test_warning(librdf_world* world, const char *message);
 
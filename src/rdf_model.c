@@ -41,6 +41,10 @@
 
 #ifndef STANDALONE
 
+/* prototypes for local functions */
+static void librdf_model_free_query_cache(librdf_model *model);
+
+
 /**
  * librdf_init_model:
  * @world: redland world object
@@ -321,7 +325,7 @@ librdf_new_model_with_options(librdf_world *world,
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
 
-  if(!storage)
+  if(!storage || librdf_query_async_check_world(world))
     return NULL;
   
   model = LIBRDF_CALLOC(librdf_model*, 1, sizeof(*model));
@@ -400,15 +404,24 @@ librdf_free_model(librdf_model *model)
 {
   librdf_iterator* iterator;
   librdf_model* m;
+  int usage;
 
   if(!model)
     return;
   
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(model, librdf_model);
 
-  if(--model->usage)
+  librdf_usage_lock();
+  usage=--model->usage;
+  librdf_usage_unlock();
+  if(usage)
     return;
   
+  librdf_model_free_query_cache(model);
+
+  if(model->union_index)
+    librdf_free_model_union(model->union_index);
+
   if(model->sub_models) {
     iterator=librdf_list_get_iterator(model->sub_models);
     if(iterator) {
@@ -421,9 +434,8 @@ librdf_free_model(librdf_model *model)
       librdf_free_iterator(iterator);
     }
     librdf_free_list(model->sub_models);
-  } else {
-    model->factory->destroy(model);
   }
+  model->factory->destroy(model);
   LIBRDF_FREE(data, model->context);
 
   LIBRDF_FREE(librdf_model, model);
@@ -433,13 +445,17 @@ librdf_free_model(librdf_model *model)
 void
 librdf_model_add_reference(librdf_model *model)
 {
+  librdf_usage_lock();
   model->usage++;
+  librdf_usage_unlock();
 }
 
 void
 librdf_model_remove_reference(librdf_model *model)
 {
+  librdf_usage_lock();
   model->usage--;
+  librdf_usage_unlock();
 }
 
 
@@ -461,6 +477,9 @@ librdf_model_size(librdf_model* model)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, -1);
 
+  if(model->sub_models)
+    return librdf_model_union_size(model);
+
   return model->factory->size(model);
 }
 
@@ -740,6 +759,9 @@ librdf_model_contains_statement(librdf_model* model, librdf_statement* statement
   if(!librdf_statement_is_complete(statement))
     return 1;
 
+  if(model->sub_models)
+    return librdf_model_union_contains_statement(model, statement) ? -1 : 0;
+
   return model->factory->contains_statement(model, statement) ? -1 : 0;
 }
 
@@ -757,6 +779,9 @@ librdf_model_as_stream(librdf_model* model)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_find_statements(model, NULL, NULL, NULL);
+
   return model->factory->serialise(model);
 }
 
@@ -778,6 +803,9 @@ librdf_model_serialise(librdf_model* model)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_find_statements(model, NULL, NULL, NULL);
+
   return model->factory->serialise(model);
 }
 #endif
@@ -804,6 +832,9 @@ librdf_model_find_statements(librdf_model* model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_find_statements(model, statement, NULL, NULL);
+
   return model->factory->find_statements(model, statement);
 }
 
@@ -829,6 +860,10 @@ librdf_model_get_sources(librdf_model *model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(arc, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(target, librdf_node, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_get_nodes(model, NULL, arc, target,
+                                        LIBRDF_STATEMENT_SUBJECT);
+
   return model->factory->get_sources(model, arc, target);
 }
 
@@ -854,6 +889,10 @@ librdf_model_get_arcs(librdf_model *model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(source, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(target, librdf_node, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_get_nodes(model, source, NULL, target,
+                                        LIBRDF_STATEMENT_PREDICATE);
+
   return model->factory->get_arcs(model, source, target);
 }
 
@@ -879,6 +918,10 @@ librdf_model_get_targets(librdf_model *model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(source, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(arc, librdf_node, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_get_nodes(model, source, arc, NULL,
+                                        LIBRDF_STATEMENT_OBJECT);
+
   return model->factory->get_targets(model, source, arc);
 }
 
@@ -998,7 +1041,14 @@ librdf_model_get_target(librdf_model *model,
  *
  * Add a sub-model to the model.
  * 
- * FIXME: Not tested
+ * A model with sub-models is the union of its own statements and
+ * those of its sub-models: finds, iterators, size and contains
+ * return each matching statement once.  Statements are still added
+ * to and removed from the model's own storage.  The model keeps an
+ * index of the predicates and contexts of each sub-model so that a
+ * find only searches the sub-models that can match.
+ *
+ * The sub-model is owned by the model from now on and freed with it.
  * 
  * Return value: non 0 on failure
  **/
@@ -1019,6 +1069,11 @@ librdf_model_add_submodel(librdf_model* model, librdf_model* sub_model)
   
   if(librdf_list_add(l, sub_model))
     return 1;
+
+  if(model->union_index) {
+    librdf_free_model_union(model->union_index);
+    model->union_index=NULL;
+  }
   
   return 0;
 }
@@ -1032,7 +1087,8 @@ librdf_model_add_submodel(librdf_model* model, librdf_model* sub_model)
  *
  * Remove a sub-model from the model.
  * 
- * FIXME: Not tested
+ * The sub-model is no longer owned by the model and must be freed
+ * by the caller.
  * 
  * Return value: non 0 on failure
  **/
@@ -1048,6 +1104,16 @@ librdf_model_remove_submodel(librdf_model* model, librdf_model* sub_model)
     return 1;
   if(!librdf_list_remove(l, sub_model))
     return 1;
+
+  if(model->union_index) {
+    librdf_free_model_union(model->union_index);
+    model->union_index=NULL;
+  }
+
+  if(!librdf_list_size(l)) {
+    librdf_free_list(l);
+    model->sub_models=NULL;
+  }
   
   return 0;
 }
@@ -1069,6 +1135,10 @@ librdf_model_get_arcs_in(librdf_model *model, librdf_node *node)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_get_nodes(model, NULL, NULL, node,
+                                        LIBRDF_STATEMENT_PREDICATE);
+
   return model->factory->get_arcs_in(model, node);
 }
 
@@ -1088,6 +1158,10 @@ librdf_model_get_arcs_out(librdf_model *model, librdf_node *node)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
+  if(model->sub_models)
+    return librdf_model_union_get_nodes(model, node, NULL, NULL,
+                                        LIBRDF_STATEMENT_PREDICATE);
+
   return model->factory->get_arcs_out(model, node);
 }
 
@@ -1110,6 +1184,9 @@ librdf_model_has_arc_in(librdf_model *model, librdf_node *node,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(property, librdf_node, 0);
 
+  if(model->sub_models)
+    return librdf_model_union_has_arc(model, NULL, property, node);
+
   return model->factory->has_arc_in(model, node, property);
 }
 
@@ -1132,6 +1209,9 @@ librdf_model_has_arc_out(librdf_model *model, librdf_node *node,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(property, librdf_node, 0);
 
+  if(model->sub_models)
+    return librdf_model_union_has_arc(model, node, property, NULL);
+
   return model->factory->has_arc_out(model, node, property);
 }
 
@@ -1459,6 +1539,331 @@ librdf_model_query_execute(librdf_model* model, librdf_query* query)
 }
 
 
+/* Free the cached rows of a query cache entry */
+static void
+librdf_model_query_cache_entry_clear_rows(librdf_model_query_cache_entry *entry)
+{
+  int i;
+
+  if(!entry->rows)
+    return;
+
+  for(i=0; i < entry->rows_count * entry->bindings_count; i++) {
+    if(entry->rows[i])
+      librdf_free_node(entry->rows[i]);
+  }
+  LIBRDF_FREE(librdf_node**, entry->rows);
+  entry->rows=NULL;
+  entry->rows_count=0;
+}
+
+
+static void
+librdf_model_query_cache_entry_clear(librdf_model_query_cache_entry *entry)
+{
+  librdf_model_query_cache_entry_clear_rows(entry);
+  if(entry->query)
+    librdf_free_query(entry->query);
+  if(entry->key)
+    LIBRDF_FREE(char*, entry->key);
+  memset(entry, '\0', sizeof(*entry));
+}
+
+
+/*
+ * librdf_model_free_query_cache:
+ * @model: model
+ *
+ * INTERNAL - Free the queries kept by librdf_model_query_execute_cached()
+ */
+static void
+librdf_model_free_query_cache(librdf_model *model)
+{
+  int i;
+
+  if(!model->query_cache)
+    return;
+
+  for(i=0; i < LIBRDF_MODEL_QUERY_CACHE_SIZE; i++)
+    librdf_model_query_cache_entry_clear(&model->query_cache[i]);
+  LIBRDF_FREE(librdf_model_query_cache_entry*, model->query_cache);
+  model->query_cache=NULL;
+}
+
+
+/*
+ * librdf_model_query_cache_key:
+ * @name: query language name
+ * @uri: query language URI or NULL
+ * @query_string: query string
+ * @base_uri: base URI or NULL
+ * @length_p: pointer to store key length
+ *
+ * INTERNAL - Make the query cache key of a query
+ *
+ * Return value: new key or NULL on failure
+ */
+static unsigned char*
+librdf_model_query_cache_key(const char *name, librdf_uri *uri,
+                             const unsigned char *query_string,
+                             librdf_uri *base_uri, size_t *length_p)
+{
+  const unsigned char *parts[4];
+  size_t lengths[4];
+  unsigned char *key;
+  unsigned char *p;
+  int i;
+
+  parts[0]=(const unsigned char*)(name ? name : "");
+  parts[1]=uri ? librdf_uri_as_string(uri) : (const unsigned char*)"";
+  parts[2]=base_uri ? librdf_uri_as_string(base_uri) : (const unsigned char*)"";
+  parts[3]=query_string;
+
+  *length_p=0;
+  for(i=0; i < 4; i++) {
+    lengths[i]=strlen((const char*)parts[i]);
+    *length_p += lengths[i] + 1;
+  }
+
+  key=LIBRDF_MALLOC(unsigned char*, *length_p);
+  if(!key)
+    return NULL;
+
+  /* parts separated by NULs cannot run into each other */
+  p=key;
+  for(i=0; i < 4; i++) {
+    memcpy(p, parts[i], lengths[i] + 1);
+    p += lengths[i] + 1;
+  }
+
+  return key;
+}
+
+
+/*
+ * librdf_model_query_cache_add_rows:
+ * @entry: cache entry
+ * @results: bindings results to read to the end
+ *
+ * INTERNAL - Copy all the remaining rows of query results into a cache entry
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_model_query_cache_add_rows(librdf_model_query_cache_entry *entry,
+                                  librdf_query_results *results)
+{
+  int rows_size=0;
+  int i;
+
+  librdf_model_query_cache_entry_clear_rows(entry);
+  entry->bindings_count=librdf_query_results_get_bindings_count(results);
+  if(entry->bindings_count < 0)
+    return 1;
+
+  while(!librdf_query_results_finished(results)) {
+    librdf_node **row;
+
+    if(entry->rows_count == rows_size) {
+      int new_size=rows_size ? rows_size * 2 : 64;
+      librdf_node **new_rows;
+
+      new_rows=LIBRDF_CALLOC(librdf_node**,
+                             (size_t)new_size * entry->bindings_count + 1,
+                             sizeof(librdf_node*));
+      if(!new_rows)
+        return 1;
+      if(entry->rows) {
+        memcpy(new_rows, entry->rows,
+               sizeof(librdf_node*) * entry->rows_count * entry->bindings_count);
+        LIBRDF_FREE(librdf_node**, entry->rows);
+      }
+      entry->rows=new_rows;
+      rows_size=new_size;
+    }
+
+    row=entry->rows + entry->rows_count * entry->bindings_count;
+    entry->rows_count++;
+    for(i=0; i < entry->bindings_count; i++)
+      row[i]=librdf_query_results_get_binding_value(results, i);
+
+    librdf_query_results_next(results);
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_model_query_cache_replay:
+ * @entry: cache entry with rows
+ *
+ * INTERNAL - Make query results from the rows of a cache entry
+ *
+ * Return value: new results or NULL on failure
+ */
+static librdf_query_results*
+librdf_model_query_cache_replay(librdf_model_query_cache_entry *entry)
+{
+  librdf_query_results *results;
+  int i;
+
+  results=librdf_query_rasqal_new_sql_results(entry->query);
+  if(!results)
+    return NULL;
+
+  for(i=0; i < entry->rows_count; i++) {
+    if(librdf_query_rasqal_add_node_row(results,
+                                        entry->rows + i * entry->bindings_count)) {
+      librdf_free_query_results(results);
+      return NULL;
+    }
+  }
+  librdf_query_rasqal_end_sql_results(results);
+
+  return results;
+}
+
+
+/**
+ * librdf_model_query_execute_cached:
+ * @model: #librdf_model object
+ * @name: the query language name
+ * @uri: the query language URI (or NULL)
+ * @query_string: the query string
+ * @base_uri: #librdf_uri base URI of the query string (or NULL)
+ *
+ * Execute a query string against the model, reusing earlier work.
+ *
+ * The model keeps the most recently used queries prepared, and
+ * for queries returning variable bindings, their result rows.  The
+ * rows are returned again until the model storage is changed, when
+ * the query is run again.  Changes made to the stored statements
+ * other than through this storage object are not noticed.
+ *
+ * Results returned earlier for the same query string should be
+ * freed before calling this again, since they share one query.
+ *
+ * Return value: #librdf_query_results or NULL on failure
+ **/
+librdf_query_results*
+librdf_model_query_execute_cached(librdf_model* model, const char *name,
+                                  librdf_uri* uri,
+                                  const unsigned char *query_string,
+                                  librdf_uri* base_uri)
+{
+  librdf_storage *storage;
+  librdf_model_query_cache_entry *entry=NULL;
+  librdf_query *query;
+  librdf_query_results *results;
+  unsigned char *key;
+  size_t key_length;
+  unsigned int hash;
+  unsigned long modifications;
+  size_t j;
+  int i;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query_string, string, NULL);
+
+  storage=librdf_model_get_storage(model);
+  if(!storage || model->sub_models) {
+    /* nothing to tell when the results change: run it once */
+    query=librdf_new_query(model->world, name, uri, query_string, base_uri);
+    if(!query)
+      return NULL;
+    results=librdf_model_query_execute(model, query);
+    librdf_free_query(query);
+    return results;
+  }
+
+  if(!model->query_cache) {
+    model->query_cache=LIBRDF_CALLOC(librdf_model_query_cache_entry*,
+                                     LIBRDF_MODEL_QUERY_CACHE_SIZE,
+                                     sizeof(librdf_model_query_cache_entry));
+    if(!model->query_cache)
+      return NULL;
+  }
+
+  key=librdf_model_query_cache_key(name, uri, query_string, base_uri,
+                                   &key_length);
+  if(!key)
+    return NULL;
+
+  /* FNV-1a */
+  hash=2166136261U;
+  for(j=0; j < key_length; j++)
+    hash=(hash ^ key[j]) * 16777619U;
+
+  for(i=0; i < LIBRDF_MODEL_QUERY_CACHE_SIZE; i++) {
+    librdf_model_query_cache_entry *e=&model->query_cache[i];
+
+    if(e->query && e->hash == hash && e->key_length == key_length &&
+       !memcmp(e->key, key, key_length)) {
+      entry=e;
+      break;
+    }
+  }
+
+  if(entry) {
+    LIBRDF_FREE(char*, key);
+    entry->last_used= ++model->query_cache_clock;
+
+    if(entry->rows && entry->modifications == storage->modifications) {
+      results=librdf_model_query_cache_replay(entry);
+      if(results)
+        return results;
+    }
+    query=entry->query;
+  } else {
+    query=librdf_new_query(model->world, name, uri, query_string, base_uri);
+    if(!query) {
+      LIBRDF_FREE(char*, key);
+      return NULL;
+    }
+
+    /* replace the least recently used entry */
+    entry=&model->query_cache[0];
+    for(i=1; i < LIBRDF_MODEL_QUERY_CACHE_SIZE; i++) {
+      if(model->query_cache[i].last_used < entry->last_used)
+        entry=&model->query_cache[i];
+    }
+    librdf_model_query_cache_entry_clear(entry);
+    entry->key=key;
+    entry->key_length=key_length;
+    entry->hash=hash;
+    entry->query=query;
+    entry->last_used= ++model->query_cache_clock;
+  }
+
+  modifications=storage->modifications;
+  results=librdf_model_query_execute(model, query);
+  if(!results || !librdf_query_results_is_bindings(results)) {
+    /* other results are not kept and would hold on to the model */
+    librdf_model_query_cache_entry_clear(entry);
+    return results;
+  }
+
+  if(librdf_model_query_cache_add_rows(entry, results)) {
+    librdf_model_query_cache_entry_clear_rows(entry);
+    librdf_free_query_results(results);
+    results=librdf_model_query_execute(model, query);
+    librdf_model_query_cache_entry_clear(entry);
+    return results;
+  }
+  librdf_free_query_results(results);
+  entry->modifications=modifications;
+
+  results=librdf_model_query_cache_replay(entry);
+  if(!results) {
+    results=librdf_model_query_execute(model, query);
+    librdf_model_query_cache_entry_clear(entry);
+  }
+
+  return results;
+}
+
+
 /**
  * librdf_model_sync:
  * @model: #librdf_model object
@@ -1503,6 +1908,78 @@ librdf_model_get_storage(librdf_model *model)
 }
 
 
+/**
+ * librdf_model_add_change_handler:
+ * @model: #librdf_model object
+ * @handler: change handler
+ * @user_data: user data passed to the handler
+ * @queue_size: most changes passed to the handler at once, or 0 for
+ *   the default of 4096
+ *
+ * Register a handler for the statements added to and removed from the
+ * model.
+ *
+ * The changes made through the storage API of the model storage are
+ * queued and passed to the handler in one batch when each add or
+ * remove call returns, or when the transaction they were made in is
+ * committed.  Changes of a rolled back transaction are dropped.
+ * Each statement passed to a successful call is reported, including
+ * one already held or not held by the storage, so handlers should
+ * apply the changes as set operations.  Changes past @queue_size in
+ * one batch are counted in the lost argument of the handler.
+ *
+ * The model must have a storage, see librdf_model_get_storage().
+ * Parses into a model with change handlers do not use the storage
+ * writer thread of #LIBRDF_PARSER_FEATURE_PIPELINE, so a handler
+ * should not be added while such a parse is running.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_model_add_change_handler(librdf_model* model,
+                                librdf_model_change_handler handler,
+                                void* user_data, int queue_size)
+{
+  librdf_storage* storage;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
+
+  storage = librdf_model_get_storage(model);
+  if(!storage)
+    return 1;
+
+  return librdf_storage_add_change_handler(storage, model, handler,
+                                           user_data, queue_size);
+}
+
+
+/**
+ * librdf_model_remove_change_handler:
+ * @model: #librdf_model object
+ * @handler: change handler
+ * @user_data: user data the handler was added with
+ *
+ * Unregister a handler added with librdf_model_add_change_handler().
+ *
+ * Return value: non 0 on failure or if the handler was not added
+ **/
+int
+librdf_model_remove_change_handler(librdf_model* model,
+                                   librdf_model_change_handler handler,
+                                   void* user_data)
+{
+  librdf_storage* storage;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
+
+  storage = librdf_model_get_storage(model);
+  if(!storage)
+    return 1;
+
+  return librdf_storage_remove_change_handler(storage, handler, user_data);
+}
+
+
 /**
  * librdf_model_find_statements_in_context:
  * @model: #librdf_model object
@@ -1532,6 +2009,10 @@ librdf_model_find_statements_in_context(librdf_model* model, librdf_statement* s
     return NULL;
   }
 
+  if(model->sub_models)
+    return librdf_model_union_find_statements(model, statement, context_node,
+                                              NULL);
+
   if(model->factory->find_statements_in_context)
     return model->factory->find_statements_in_context(model, statement, context_node);
 
@@ -1659,6 +2140,10 @@ librdf_model_find_statements_with_options(librdf_model* model,
     return NULL;
   }
 
+  if(model->sub_models)
+    return librdf_model_union_find_statements(model, statement, context_node,
+                                              options);
+
   if(model->factory->find_statements_with_options)
     return model->factory->find_statements_with_options(model, statement, context_node, options);
   else
@@ -1901,6 +2386,10 @@ librdf_model_transaction_get_handle(librdf_model* model)
 
 #ifdef STANDALONE
 
+#ifdef STORAGE_TREES
+#include <rdf_types.h>
+#endif
+
 /* one more prototype */
 int main(int argc, char *argv[]);
 
@@ -1928,6 +2417,28 @@ int main(int argc, char *argv[]);
 "</rdf:RDF>"
 
 int test_model_cloning(char const *program, librdf_world *);
+int test_model_union(char const *program, librdf_world *);
+int test_model_peeked_stream(char const *program, librdf_world *);
+#ifdef STORAGE_TREES
+int test_model_trees_snapshot(char const *program, librdf_world *);
+#endif
+#ifdef STORAGE_HASHES
+int test_model_hashes_blocks(char const *program, librdf_world *);
+#endif
+
+static void
+test_model_change_handler(void *user_data, librdf_model* model,
+                          const librdf_model_change* changes, int count,
+                          int lost)
+{
+  int* counts = (int*)user_data;
+  int i;
+
+  for(i = 0; i < count; i++)
+    counts[changes[i].type]++;
+  counts[2] += lost;
+}
+
 int test_model(librdf_world *world, const char *program,
     const char *storage_type, const char *storage_name, const char* storage_options);
 
@@ -1951,6 +2462,30 @@ main(int argc, char *argv[])
     goto tidy;
   }
 
+  if(test_model_union(program, world)) {
+    status = 1;
+    goto tidy;
+  }
+
+  if(test_model_peeked_stream(program, world)) {
+    status = 1;
+    goto tidy;
+  }
+
+#ifdef STORAGE_TREES
+  if(test_model_trees_snapshot(program, world)) {
+    status = 1;
+    goto tidy;
+  }
+#endif
+
+#ifdef STORAGE_HASHES
+  if(test_model_hashes_blocks(program, world)) {
+    status = 1;
+    goto tidy;
+  }
+#endif
+
   /* Get storage configuration */
   storage_type=getenv("REDLAND_TEST_STORAGE_TYPE");
   storage_name=getenv("REDLAND_TEST_STORAGE_NAME");
@@ -1965,10 +2500,18 @@ main(int argc, char *argv[])
 #else
       "hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes'",
 #endif
+      "hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes',dictionary='yes',compress-values='yes'",
+      "hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes',key-encoding='2'",
 #endif
 #ifdef STORAGE_TREES
       "trees", "test", "contexts='yes'",
 #endif
+#if defined(STORAGE_CACHE) && defined(STORAGE_HASHES)
+      "cache", "test", "backend='hashes',hash-type='memory',write='yes',new='yes',contexts='yes'",
+#endif
+#if defined(STORAGE_SHARDED) && defined(STORAGE_HASHES)
+      "sharded", "test", "backend='hashes',shards='3',hash-type='memory',write='yes',new='yes',contexts='yes'",
+#endif
 #ifdef STORAGE_FILE
       "file", "test.rdf", NULL,
 #endif
@@ -2032,6 +2575,8 @@ test_model(librdf_world *world, const char *program,
   raptor_iostream* iostr;
   librdf_node* literal_node;
   char literal[6];
+  /* additions, removals and lost changes seen by the change handler */
+  int change_counts[3] = {0, 0, 0};
 
   iostr = raptor_new_iostream_to_file_handle(world->raptor_world_ptr, stderr);
 
@@ -2062,9 +2607,24 @@ test_model(librdf_world *world, const char *program,
 
   librdf_statement_set_object(statement, librdf_new_node_from_literal(world, (const unsigned char*)"Dave Beckett", NULL, 0));
 
+  if(librdf_model_add_change_handler(model, test_model_change_handler,
+                                     change_counts, 0)) {
+    fprintf(stderr, "%s: Failed to add model change handler\n", program);
+    return(1);
+  }
   librdf_model_add_statement(model, statement);
+  librdf_model_remove_change_handler(model, test_model_change_handler,
+                                     change_counts);
   librdf_free_statement(statement);
 
+  if(change_counts[LIBRDF_MODEL_CHANGE_ADD] != 1 ||
+     change_counts[LIBRDF_MODEL_CHANGE_REMOVE] || change_counts[2]) {
+    fprintf(stderr, "%s: Model change handler saw %d additions, %d removals and %d lost, expected 1, 0 and 0\n", program,
+            change_counts[LIBRDF_MODEL_CHANGE_ADD],
+            change_counts[LIBRDF_MODEL_CHANGE_REMOVE], change_counts[2]);
+    return(1);
+  }
+
   /* make it illegal */
   statement=librdf_new_statement(world);
   librdf_statement_set_subject(statement, librdf_new_node_from_literal(world, (const unsigned char*)"Bad Subject", NULL, 0));
@@ -2115,6 +2675,12 @@ test_model(librdf_world *world, const char *program,
     fputs("\n", stderr);
   }
   librdf_free_iterator(iterator);
+  /* a cache storage now holds these targets; the changes below must
+   * make it forget them */
+  if(count != TEST_SIMILAR_COUNT) {
+    fprintf(stderr, "%s: model has %d similar statements, expected %d\n", program, count, TEST_SIMILAR_COUNT);
+    status=1;
+  }
 
   /* delete first, last, and another statement */
   statement=librdf_new_statement(world);
@@ -2164,6 +2730,31 @@ test_model(librdf_world *world, const char *program,
     status=1;
   }
 
+  /* add one back after the targets were looked up again, then
+   * remove it to leave the model as it was */
+  literal[4]='0';
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_node(n1),
+                                            librdf_new_node_from_node(n2),
+                                            librdf_new_node_from_literal(world, (const unsigned char*)literal, NULL, 0));
+  if(!statement || librdf_model_add_statement(model, statement)) {
+    fprintf(stderr, "%s: Failed to add statement with literal '%s'\n", program, literal);
+    status=1;
+  }
+  iterator=librdf_model_get_targets(model, n1, n2);
+  for(count=0; !librdf_iterator_end(iterator); librdf_iterator_next(iterator), count++)
+    ;
+  librdf_free_iterator(iterator);
+  expected_count=TEST_SIMILAR_COUNT - 2;
+  if(count != expected_count) {
+    fprintf(stderr, "%s: model has %d similar statements after an add, expected %d\n", program, count, expected_count);
+    status=1;
+  }
+  if(statement) {
+    librdf_model_remove_statement(model, statement);
+    librdf_free_statement(statement);
+  }
+
   librdf_free_node(n1);
   librdf_free_node(n2);
 
@@ -2462,5 +3053,484 @@ test_model_cloning(char const *program, librdf_world *world)
   return status;
 }
 
+
+/* enough finds for a modified submodel to be indexed again twice */
+#define TEST_UNION_LOOKUPS 40
+
+static int
+test_model_union_count(librdf_model* model, const char *predicate)
+{
+  librdf_world* world = model->world;
+  librdf_statement* partial;
+  librdf_stream* stream;
+  int count = 0;
+
+  partial = librdf_new_statement_from_nodes(world, NULL,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)predicate),
+    NULL);
+  stream = librdf_model_find_statements(model, partial);
+  librdf_free_statement(partial);
+  if(!stream)
+    return -1;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+    count++;
+  librdf_free_stream(stream);
+
+  return count;
+}
+
+
+static int
+test_model_union_add(librdf_model* model, const char *predicate,
+                     const char *object, int remove)
+{
+  librdf_world* world = model->world;
+  librdf_statement* statement;
+  int rc;
+
+  statement = librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)predicate),
+    librdf_new_node_from_literal(world, (const unsigned char*)object, NULL, 0));
+  if(remove)
+    rc = librdf_model_remove_statement(model, statement);
+  else
+    rc = librdf_model_add_statement(model, statement);
+  librdf_free_statement(statement);
+
+  return rc;
+}
+
+
+/* Check finds give the expected counts for predicates p1 and p2 */
+static int
+test_model_union_check(char const *program, librdf_model* model,
+                       const char *when, int expected1, int expected2)
+{
+  int i;
+
+  for(i = 0; i < TEST_UNION_LOOKUPS; i++) {
+    int count1 = test_model_union_count(model, "http://example.org/p1");
+    int count2 = test_model_union_count(model, "http://example.org/p2");
+
+    if(count1 != expected1 || count2 != expected2) {
+      fprintf(stderr, "%s: Union model find %d %s returned %d and %d statements, expected %d and %d\n",
+              program, i, when, count1, count2, expected1, expected2);
+      return 1;
+    }
+  }
+
+  if(test_model_union_count(model, "http://example.org/p3")) {
+    fprintf(stderr, "%s: Union model find %s returned statements for an unused predicate\n",
+            program, when);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int
+test_model_union(char const *program, librdf_world *world)
+{
+  int status = 1;
+  librdf_storage *storage = NULL;
+  librdf_storage *storage1 = NULL;
+  librdf_storage *storage2 = NULL;
+  librdf_model *model = NULL;
+  librdf_model *sub_model1 = NULL;
+  librdf_model *sub_model2 = NULL;
+  int sub_models_added = 0;
+
+  fprintf(stderr, "%s: Testing union model pruning\n", program);
+
+  storage = librdf_new_storage(world, "memory", NULL, NULL);
+  storage1 = librdf_new_storage(world, "memory", NULL, NULL);
+  storage2 = librdf_new_storage(world, "memory", NULL, NULL);
+  if(!storage || !storage1 || !storage2) {
+    fprintf(stderr, "%s: Failed to create new memory storages\n", program);
+    goto tidy;
+  }
+
+  model = librdf_new_model(world, storage, NULL);
+  sub_model1 = librdf_new_model(world, storage1, NULL);
+  sub_model2 = librdf_new_model(world, storage2, NULL);
+  if(!model || !sub_model1 || !sub_model2) {
+    fprintf(stderr, "%s: Failed to create new models\n", program);
+    goto tidy;
+  }
+
+  test_model_union_add(sub_model1, "http://example.org/p1", "a", 0);
+  test_model_union_add(sub_model2, "http://example.org/p2", "b", 0);
+
+  /* the parent model now frees the submodels */
+  if(librdf_model_add_submodel(model, sub_model1)) {
+    fprintf(stderr, "%s: Failed to add submodel\n", program);
+    goto tidy;
+  }
+  sub_models_added = 1;
+  if(librdf_model_add_submodel(model, sub_model2)) {
+    fprintf(stderr, "%s: Failed to add submodel\n", program);
+    goto tidy;
+  }
+  sub_models_added = 2;
+
+  if(librdf_model_size(model) != 2) {
+    fprintf(stderr, "%s: Union model size is %d, expected 2\n", program,
+            librdf_model_size(model));
+    goto tidy;
+  }
+
+  if(test_model_union_check(program, model, "after indexing", 1, 1))
+    goto tidy;
+
+  /* a predicate added to an indexed submodel must still be found */
+  test_model_union_add(model, "http://example.org/p2", "parent", 0);
+  test_model_union_add(sub_model1, "http://example.org/p2", "c", 0);
+  if(test_model_union_check(program, model, "after adding", 1, 3))
+    goto tidy;
+
+  test_model_union_add(sub_model2, "http://example.org/p2", "b", 1);
+  if(test_model_union_check(program, model, "after removing", 1, 2))
+    goto tidy;
+
+  /* the submodel is the caller's again after removal */
+  if(librdf_model_remove_submodel(model, sub_model2)) {
+    fprintf(stderr, "%s: Failed to remove submodel\n", program);
+    goto tidy;
+  }
+  sub_models_added = 1;
+  test_model_union_add(sub_model2, "http://example.org/p1", "d", 0);
+  if(test_model_union_check(program, model, "after removing a submodel", 1, 2))
+    goto tidy;
+
+  status = 0;
+
+  tidy:
+  if(model)
+    librdf_free_model(model);
+  if(sub_model1 && sub_models_added < 1)
+    librdf_free_model(sub_model1);
+  if(sub_model2 && sub_models_added < 2)
+    librdf_free_model(sub_model2);
+  if(storage2)
+    librdf_free_storage(storage2);
+  if(storage1)
+    librdf_free_storage(storage1);
+  if(storage)
+    librdf_free_storage(storage);
+
+  return status;
+}
+
+
+#define TEST_PEEKED_COUNT 3
+
+/* Add a stream whose first statement was already got by the caller */
+int
+test_model_peeked_stream(char const *program, librdf_world *world)
+{
+  int status = 1;
+  librdf_storage *storage = NULL;
+  librdf_storage *source_storage = NULL;
+  librdf_model *model = NULL;
+  librdf_model *source = NULL;
+  librdf_stream *stream = NULL;
+  int change_counts[3] = {0, 0, 0};
+  int i;
+
+  fprintf(stderr, "%s: Testing adding a stream already read from\n", program);
+
+  storage = librdf_new_storage(world, "memory", NULL, "bloom-filter='yes'");
+  source_storage = librdf_new_storage(world, "memory", NULL, NULL);
+  if(!storage || !source_storage) {
+    fprintf(stderr, "%s: Failed to create new memory storages\n", program);
+    goto tidy;
+  }
+  model = librdf_new_model(world, storage, NULL);
+  source = librdf_new_model(world, source_storage, NULL);
+  if(!model || !source) {
+    fprintf(stderr, "%s: Failed to create new models\n", program);
+    goto tidy;
+  }
+
+  for(i = 0; i < TEST_PEEKED_COUNT; i++) {
+    char object[16];
+
+    sprintf(object, "%d", i);
+    test_model_union_add(source, "http://example.org/p1", object, 0);
+  }
+
+  if(librdf_model_add_change_handler(model, test_model_change_handler,
+                                     change_counts, 0)) {
+    fprintf(stderr, "%s: Failed to add change handler\n", program);
+    goto tidy;
+  }
+
+  stream = librdf_model_as_stream(source);
+  if(!stream || !librdf_stream_get_object(stream) ||
+     librdf_model_add_statements(model, stream)) {
+    fprintf(stderr, "%s: Failed to add a stream already read from\n",
+            program);
+    goto tidy;
+  }
+  librdf_free_stream(stream);
+  stream = NULL;
+
+  /* the change handler must be passed the statement got before the add */
+  if(change_counts[LIBRDF_MODEL_CHANGE_ADD] != TEST_PEEKED_COUNT ||
+     change_counts[2]) {
+    fprintf(stderr, "%s: Change handler got %d additions and %d lost, expected %d and 0\n",
+            program, change_counts[LIBRDF_MODEL_CHANGE_ADD], change_counts[2],
+            TEST_PEEKED_COUNT);
+    goto tidy;
+  }
+
+  /* the Bloom filter must hold the statement got before the add */
+  stream = librdf_model_as_stream(source);
+  for(i = 0; stream && !librdf_stream_end(stream); i++) {
+    if(!librdf_model_contains_statement(model,
+                                        librdf_stream_get_object(stream))) {
+      fprintf(stderr, "%s: Statement %d of a stream already read from is not found\n",
+              program, i);
+      goto tidy;
+    }
+    librdf_stream_next(stream);
+  }
+  if(i != TEST_PEEKED_COUNT) {
+    fprintf(stderr, "%s: Found %d statements, expected %d\n", program, i,
+            TEST_PEEKED_COUNT);
+    goto tidy;
+  }
+
+  status = 0;
+
+  tidy:
+  if(stream)
+    librdf_free_stream(stream);
+  if(source)
+    librdf_free_model(source);
+  if(model)
+    librdf_free_model(model);
+  if(source_storage)
+    librdf_free_storage(source_storage);
+  if(storage)
+    librdf_free_storage(storage);
+
+  return status;
+}
+
+
+#ifdef STORAGE_TREES
+#define TEST_SNAPSHOT_FILE "test-snapshot.trees"
+#define TEST_SNAPSHOT_OPTIONS "contexts='yes',snapshot='" TEST_SNAPSHOT_FILE "'"
+
+/* Save a trees store to a snapshot, load it again and reject a bad one */
+int
+test_model_trees_snapshot(char const *program, librdf_world *world)
+{
+  int status = 1;
+  librdf_storage *storage = NULL;
+  librdf_model *model = NULL;
+  librdf_node *context_node = NULL;
+  librdf_statement *statement = NULL;
+  /* a header claiming far more nodes than the file holds */
+  u32 header[3] = { 1, 0x01020304U, 0x7ffffff0U };
+  FILE *fh;
+  int i;
+
+  fprintf(stderr, "%s: Testing trees storage snapshots\n", program);
+  remove(TEST_SNAPSHOT_FILE);
+
+  context_node = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/graph");
+  statement = librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p2"),
+    librdf_new_node_from_literal(world, (const unsigned char*)"in graph", NULL, 0));
+
+  storage = librdf_new_storage(world, "trees", "test", TEST_SNAPSHOT_OPTIONS);
+  if(storage)
+    model = librdf_new_model(world, storage, NULL);
+  if(!model) {
+    fprintf(stderr, "%s: Failed to create trees model with a snapshot\n",
+            program);
+    goto tidy;
+  }
+  for(i = 0; i < 3; i++) {
+    char object[16];
+
+    sprintf(object, "%d", i);
+    test_model_union_add(model, "http://example.org/p1", object, 0);
+  }
+  librdf_model_context_add_statement(model, context_node, statement);
+
+  /* closing the storage saves the snapshot */
+  librdf_free_model(model); model = NULL;
+  librdf_free_storage(storage); storage = NULL;
+
+  storage = librdf_new_storage(world, "trees", "test", TEST_SNAPSHOT_OPTIONS);
+  if(storage)
+    model = librdf_new_model(world, storage, NULL);
+  if(!model) {
+    fprintf(stderr, "%s: Failed to load trees snapshot\n", program);
+    goto tidy;
+  }
+  if(librdf_model_size(model) != 4 ||
+     test_model_union_count(model, "http://example.org/p1") != 3 ||
+     !librdf_model_contains_context(model, context_node) ||
+     !librdf_model_context_contains_statement(model, context_node,
+                                              statement)) {
+    fprintf(stderr, "%s: Loaded trees snapshot has %d statements, expected 4\n",
+            program, librdf_model_size(model));
+    goto tidy;
+  }
+  librdf_free_model(model); model = NULL;
+  librdf_free_storage(storage); storage = NULL;
+
+  fh = fopen(TEST_SNAPSHOT_FILE, "wb");
+  if(!fh || fwrite("RDFTREES", 8, 1, fh) != 1 ||
+     fwrite(header, sizeof(header), 1, fh) != 1) {
+    fprintf(stderr, "%s: Failed to write trees snapshot\n", program);
+    if(fh)
+      fclose(fh);
+    goto tidy;
+  }
+  fclose(fh);
+
+  storage = librdf_new_storage(world, "trees", "test", TEST_SNAPSHOT_OPTIONS);
+  if(storage)
+    model = librdf_new_model(world, storage, NULL);
+  if(model) {
+    fprintf(stderr, "%s: Loaded a trees snapshot with a bad node count\n",
+            program);
+    goto tidy;
+  }
+
+  status = 0;
+
+  tidy:
+  if(model)
+    librdf_free_model(model);
+  if(storage)
+    librdf_free_storage(storage);
+  if(statement)
+    librdf_free_statement(statement);
+  if(context_node)
+    librdf_free_node(context_node);
+  remove(TEST_SNAPSHOT_FILE);
+
+  return status;
+}
+#endif
+
+
+#ifdef STORAGE_HASHES
+/* more than LIBRDF_STORAGE_HASHES_BLOCK_VALUES values under one key */
+#define TEST_BLOCK_VALUES 300
+#define TEST_BLOCK_REMOVED 5
+
+/* Pack one key of a hashes store into value blocks, remove from a
+ * block and find the rest; then commit and roll back transactions */
+int
+test_model_hashes_blocks(char const *program, librdf_world *world)
+{
+  int status = 1;
+  librdf_storage *storage;
+  librdf_model *model = NULL;
+  librdf_node *subject = NULL;
+  librdf_node *predicate = NULL;
+  librdf_iterator *iterator;
+  char removed[16];
+  int i;
+
+  fprintf(stderr, "%s: Testing hashes storage compressed value blocks\n",
+          program);
+
+  storage = librdf_new_storage(world, "hashes", "test",
+                               "hash-type='memory',write='yes',new='yes',dictionary='yes',compress-values='yes'");
+  if(storage)
+    model = librdf_new_model(world, storage, NULL);
+  if(!model) {
+    fprintf(stderr, "%s: Failed to create hashes model with compressed values\n",
+            program);
+    goto tidy;
+  }
+
+  for(i = 0; i < TEST_BLOCK_VALUES; i++) {
+    char object[16];
+
+    sprintf(object, "%d", i);
+    test_model_union_add(model, "http://example.org/p1", object, 0);
+  }
+
+  /* rewrites the block holding the value */
+  sprintf(removed, "%d", TEST_BLOCK_REMOVED);
+  if(test_model_union_add(model, "http://example.org/p1", removed, 1)) {
+    fprintf(stderr, "%s: Failed to remove a value in a block\n", program);
+    goto tidy;
+  }
+
+  if(librdf_model_size(model) != TEST_BLOCK_VALUES - 1 ||
+     test_model_union_count(model, "http://example.org/p1") != TEST_BLOCK_VALUES - 1) {
+    fprintf(stderr, "%s: Hashes model with value blocks has %d statements, expected %d\n",
+            program, librdf_model_size(model), TEST_BLOCK_VALUES - 1);
+    goto tidy;
+  }
+
+  /* every value but the removed one is found from the subject and predicate */
+  subject = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s");
+  predicate = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p1");
+  iterator = librdf_model_get_targets(model, subject, predicate);
+  for(i = 0; iterator && !librdf_iterator_end(iterator); i++) {
+    librdf_node* node = (librdf_node*)librdf_iterator_get_object(iterator);
+
+    if(atoi((const char*)librdf_node_get_literal_value(node)) == TEST_BLOCK_REMOVED) {
+      fprintf(stderr, "%s: Found the value removed from a block\n", program);
+      librdf_free_iterator(iterator);
+      goto tidy;
+    }
+    librdf_iterator_next(iterator);
+  }
+  if(iterator)
+    librdf_free_iterator(iterator);
+  if(i != TEST_BLOCK_VALUES - 1) {
+    fprintf(stderr, "%s: Found %d values in blocks, expected %d\n", program,
+            i, TEST_BLOCK_VALUES - 1);
+    goto tidy;
+  }
+
+  /* a rolled back add is dropped, a committed one kept */
+  if(librdf_model_transaction_start(model) ||
+     test_model_union_add(model, "http://example.org/p2", "rolled back", 0) ||
+     librdf_model_transaction_rollback(model) ||
+     test_model_union_count(model, "http://example.org/p2") != 0) {
+    fprintf(stderr, "%s: Hashes transaction rollback failed\n", program);
+    goto tidy;
+  }
+  if(librdf_model_transaction_start(model) ||
+     test_model_union_add(model, "http://example.org/p2", "committed", 0) ||
+     librdf_model_transaction_commit(model) ||
+     test_model_union_count(model, "http://example.org/p2") != 1) {
+    fprintf(stderr, "%s: Hashes transaction commit failed\n", program);
+    goto tidy;
+  }
+
+  status = 0;
+
+  tidy:
+  if(predicate)
+    librdf_free_node(predicate);
+  if(subject)
+    librdf_free_node(subject);
+  if(model)
+    librdf_free_model(model);
+  if(storage)
+    librdf_free_storage(storage);
+
+  return status;
+}
+#endif
+
 #endif
 
@@ -172,6 +172,8 @@ int librdf_model_supports_contexts(librdf_model* model);
 /* query language */
 REDLAND_API
 librdf_query_results* librdf_model_query_execute(librdf_model* model, librdf_query* query);
+REDLAND_API
+librdf_query_results* librdf_model_query_execute_cached(librdf_model* model, const char *name, librdf_uri* uri, const unsigned char *query_string, librdf_uri* base_uri);
 
 REDLAND_API
 int librdf_model_sync(librdf_model* model);
@@ -205,6 +207,57 @@ REDLAND_API
 void* librdf_model_transaction_get_handle(librdf_model* model);
 
 
+/**
+ * librdf_model_change_type:
+ * @LIBRDF_MODEL_CHANGE_ADD: statement added
+ * @LIBRDF_MODEL_CHANGE_REMOVE: statement removed
+ *
+ * Type of a #librdf_model_change.
+ */
+typedef enum {
+  LIBRDF_MODEL_CHANGE_ADD,
+  LIBRDF_MODEL_CHANGE_REMOVE
+} librdf_model_change_type;
+
+/**
+ * librdf_model_change:
+ * @type: addition or removal
+ * @statement: statement added or removed
+ * @context: context node or NULL
+ *
+ * One change passed to a #librdf_model_change_handler.
+ */
+typedef struct {
+  librdf_model_change_type type;
+  librdf_statement* statement;
+  librdf_node* context;
+} librdf_model_change;
+
+/**
+ * librdf_model_change_handler:
+ * @user_data: user data pointer
+ * @model: model the handler was added to
+ * @changes: array of changes in the order they were made
+ * @count: number of changes
+ * @lost: number of changes made but not passed in @changes, or that
+ *   may be missing after a failed bulk add or remove
+ *
+ * Handler for a batch of the changes made to a model.
+ *
+ * The changes and their statements and nodes are owned by the caller
+ * and only valid during the call.  When @lost is not 0 the handler
+ * should read the model again rather than rely on the changes.
+ *
+ * See librdf_model_add_change_handler().
+ */
+typedef void (*librdf_model_change_handler)(void *user_data, librdf_model* model, const librdf_model_change* changes, int count, int lost);
+
+REDLAND_API
+int librdf_model_add_change_handler(librdf_model* model, librdf_model_change_handler handler, void* user_data, int queue_size);
+REDLAND_API
+int librdf_model_remove_change_handler(librdf_model* model, librdf_model_change_handler handler, void* user_data);
+
+
 /**
  * LIBRDF_MODEL_FEATURE_CONTEXTS:
  *
@@ -31,6 +31,33 @@
 extern "C" {
 #endif
 
+/* Queries kept by librdf_model_query_execute_cached() */
+#define LIBRDF_MODEL_QUERY_CACHE_SIZE 16
+
+typedef struct
+{
+  /* query language name, language URI, base URI and query string */
+  unsigned char *key;
+  size_t key_length;
+  unsigned int hash;
+
+  librdf_query *query;
+
+  /* rows of binding values, NULL if unbound, and the storage
+   * modifications count they were computed at */
+  librdf_node **rows;
+  int rows_count;
+  int bindings_count;
+  unsigned long modifications;
+
+  unsigned long last_used;
+} librdf_model_query_cache_entry;
+
+
+/* Index of the submodels holding each predicate and context */
+typedef struct librdf_model_union_s librdf_model_union;
+
+
 struct librdf_model_s {
   librdf_world *world;
 
@@ -45,6 +72,9 @@ struct librdf_model_s {
   /* sub_models: list of sub librdf_model* */
   librdf_list*     sub_models;
 
+  /* union_index: submodels index made on first find or NULL */
+  librdf_model_union* union_index;
+
   /* supports_contexts : does the storage model support redland contexts? */
   int supports_contexts;
 
@@ -52,6 +82,10 @@ struct librdf_model_s {
   void *context;
 
   struct librdf_model_factory_s* factory;
+
+  /* prepared queries and their results or NULL */
+  librdf_model_query_cache_entry *query_cache;
+  unsigned long query_cache_clock;
 };
 
 /* A Model Factory */
@@ -190,6 +224,14 @@ void librdf_model_remove_reference(librdf_model *model);
 /* model storage factory initialise (the only model factory at present) */
 void librdf_init_model_storage(librdf_world *world);
 
+/* rdf_model_union.c */
+void librdf_free_model_union(librdf_model_union* model_union);
+librdf_stream* librdf_model_union_find_statements(librdf_model* model, librdf_statement* statement, librdf_node* context_node, librdf_hash* options);
+int librdf_model_union_contains_statement(librdf_model* model, librdf_statement* statement);
+int librdf_model_union_size(librdf_model* model);
+librdf_iterator* librdf_model_union_get_nodes(librdf_model* model, librdf_node* subject, librdf_node* predicate, librdf_node* object, librdf_statement_part want);
+int librdf_model_union_has_arc(librdf_model* model, librdf_node* subject, librdf_node* predicate, librdf_node* object);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,946 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_model_union.c - RDF Model union of a model and its submodels
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h> /* for exit()  */
+#endif
+
+#include <redland.h>
+
+
+/*
+ * A model with submodels answers finds from its own storage and
+ * from every submodel.  The union index records which submodels hold
+ * statements with each predicate and in each context so that a find
+ * only asks the submodels that can match.  A submodel is indexed
+ * from a scan of its statements and the index of it is trusted while
+ * its storage is not modified.  A modified submodel is searched
+ * without pruning until it has been looked up
+ * LIBRDF_MODEL_UNION_REINDEX_LOOKUPS times, when it is scanned again,
+ * so that a submodel being loaded is not rescanned on every lookup.
+ */
+
+#define LIBRDF_MODEL_UNION_REINDEX_LOOKUPS 16
+
+/* Initial size of the index table, a power of 2 */
+#define LIBRDF_MODEL_UNION_INITIAL_SIZE 64
+
+typedef struct {
+  librdf_node* node;         /* predicate or context node or NULL if free */
+  int is_context;
+  unsigned int hash;
+  unsigned char* members;    /* bit set of the submodels holding node */
+} librdf_model_union_entry;
+
+
+typedef struct {
+  librdf_model* model;
+  librdf_storage* storage;       /* NULL if the submodel is never pruned */
+  unsigned long modifications;   /* of storage when last indexed */
+  int indexed;                   /* non-0 if the entries are current */
+  int stale_lookups;             /* lookups since it was found modified */
+} librdf_model_union_source;
+
+
+struct librdf_model_union_s {
+  librdf_world* world;
+
+  librdf_model_union_source* sources;
+  int sources_count;
+  size_t members_size;           /* bytes of each entry bit set */
+
+  librdf_model_union_entry* entries;
+  int entries_size;
+  int entries_count;
+};
+
+
+#define LIBRDF_MODEL_UNION_HAS(members, i) ((members)[(i) >> 3] & (1 << ((i) & 7)))
+
+
+/* FNV-1a hash of the value of a node */
+static unsigned int
+librdf_model_union_hash_node(librdf_node* node, int is_context)
+{
+  unsigned int hash=2166136261U;
+  const unsigned char* string=NULL;
+  size_t len=0;
+  size_t i;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      string=librdf_uri_as_counted_string(node->value.uri, &len);
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      string=node->value.literal.string;
+      len=node->value.literal.string_len;
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      string=node->value.blank.string;
+      len=node->value.blank.string_len;
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  hash=(hash ^ (unsigned int)(node->type * 2 + is_context)) * 16777619U;
+  for(i=0; i < len; i++)
+    hash=(hash ^ string[i]) * 16777619U;
+
+  return hash;
+}
+
+
+/**
+ * librdf_free_model_union:
+ * @model_union: union index
+ *
+ * INTERNAL - Destructor - free the union index of a model
+ **/
+void
+librdf_free_model_union(librdf_model_union* model_union)
+{
+  int i;
+
+  if(!model_union)
+    return;
+
+  if(model_union->entries) {
+    for(i=0; i < model_union->entries_size; i++) {
+      if(model_union->entries[i].node) {
+        librdf_free_node(model_union->entries[i].node);
+        LIBRDF_FREE(char*, model_union->entries[i].members);
+      }
+    }
+    LIBRDF_FREE(librdf_model_union_entry*, model_union->entries);
+  }
+
+  if(model_union->sources)
+    LIBRDF_FREE(librdf_model_union_source*, model_union->sources);
+
+  LIBRDF_FREE(librdf_model_union, model_union);
+}
+
+
+/*
+ * librdf_new_model_union:
+ * @model: model with submodels
+ *
+ * INTERNAL - Constructor - make an empty union index for the submodels of a model
+ *
+ * Return value: new union index or NULL on failure
+ */
+static librdf_model_union*
+librdf_new_model_union(librdf_model* model)
+{
+  librdf_model_union* model_union;
+  librdf_iterator* iterator;
+  int i;
+
+  model_union=LIBRDF_CALLOC(librdf_model_union*, 1, sizeof(*model_union));
+  if(!model_union)
+    return NULL;
+
+  model_union->world=model->world;
+  model_union->sources_count=librdf_list_size(model->sub_models);
+  model_union->members_size=(size_t)(model_union->sources_count + 7) / 8;
+  model_union->entries_size=LIBRDF_MODEL_UNION_INITIAL_SIZE;
+
+  model_union->sources=LIBRDF_CALLOC(librdf_model_union_source*,
+                                     (size_t)model_union->sources_count + 1,
+                                     sizeof(librdf_model_union_source));
+  model_union->entries=LIBRDF_CALLOC(librdf_model_union_entry*,
+                                     (size_t)model_union->entries_size,
+                                     sizeof(librdf_model_union_entry));
+  iterator=librdf_list_get_iterator(model->sub_models);
+  if(!model_union->sources || !model_union->entries || !iterator) {
+    if(iterator)
+      librdf_free_iterator(iterator);
+    librdf_free_model_union(model_union);
+    return NULL;
+  }
+
+  for(i=0; i < model_union->sources_count && !librdf_iterator_end(iterator);
+      i++, librdf_iterator_next(iterator)) {
+    librdf_model_union_source* source=&model_union->sources[i];
+
+    source->model=(librdf_model*)librdf_iterator_get_object(iterator);
+    /* a submodel with submodels of its own changes with them too */
+    if(!source->model->sub_models)
+      source->storage=librdf_model_get_storage(source->model);
+    source->stale_lookups=LIBRDF_MODEL_UNION_REINDEX_LOOKUPS;
+  }
+  librdf_free_iterator(iterator);
+  model_union->sources_count=i;
+
+  return model_union;
+}
+
+
+/*
+ * librdf_model_union_lookup:
+ * @model_union: union index
+ * @node: predicate or context node
+ * @is_context: non-0 if @node is a context
+ * @create: non-0 to add a missing entry
+ *
+ * INTERNAL - Find the index entry of a node
+ *
+ * Return value: entry or NULL if absent or on failure
+ */
+static librdf_model_union_entry*
+librdf_model_union_lookup(librdf_model_union* model_union, librdf_node* node,
+                          int is_context, int create)
+{
+  librdf_model_union_entry* entry;
+  unsigned int hash;
+  int mask;
+  int i;
+
+  if(create &&
+     (model_union->entries_count + 1) * 4 > model_union->entries_size * 3) {
+    librdf_model_union_entry* old_entries=model_union->entries;
+    int old_size=model_union->entries_size;
+    librdf_model_union_entry* entries;
+
+    entries=LIBRDF_CALLOC(librdf_model_union_entry*, (size_t)old_size * 2,
+                          sizeof(librdf_model_union_entry));
+    if(!entries)
+      return NULL;
+
+    mask=old_size * 2 - 1;
+    for(i=0; i < old_size; i++) {
+      int j;
+
+      if(!old_entries[i].node)
+        continue;
+      for(j=(int)(old_entries[i].hash & (unsigned int)mask); entries[j].node;
+          j=(j + 1) & mask)
+        ;
+      entries[j]=old_entries[i];
+    }
+    LIBRDF_FREE(librdf_model_union_entry*, old_entries);
+    model_union->entries=entries;
+    model_union->entries_size=old_size * 2;
+  }
+
+  hash=librdf_model_union_hash_node(node, is_context);
+  mask=model_union->entries_size - 1;
+  for(i=(int)(hash & (unsigned int)mask); model_union->entries[i].node;
+      i=(i + 1) & mask) {
+    entry=&model_union->entries[i];
+    if(entry->hash == hash && entry->is_context == is_context &&
+       librdf_node_equals(entry->node, node))
+      return entry;
+  }
+
+  if(!create)
+    return NULL;
+
+  entry=&model_union->entries[i];
+  entry->members=LIBRDF_CALLOC(unsigned char*, model_union->members_size, 1);
+  if(!entry->members)
+    return NULL;
+  entry->node=librdf_new_node_from_node(node);
+  entry->is_context=is_context;
+  entry->hash=hash;
+  model_union->entries_count++;
+
+  return entry;
+}
+
+
+/*
+ * librdf_model_union_index_source:
+ * @model_union: union index
+ * @i: submodel index
+ *
+ * INTERNAL - Record the predicates and contexts of a submodel from a scan of it
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_model_union_index_source(librdf_model_union* model_union, int i)
+{
+  librdf_model_union_source* source=&model_union->sources[i];
+  librdf_model_union_entry* entry;
+  librdf_stream* stream;
+  librdf_iterator* iterator;
+  unsigned char bit=(unsigned char)(1 << (i & 7));
+  int status=0;
+  int j;
+
+  source->indexed=0;
+  source->stale_lookups=0;
+  for(j=0; j < model_union->entries_size; j++) {
+    if(model_union->entries[j].node)
+      model_union->entries[j].members[i >> 3] &= (unsigned char)~bit;
+  }
+
+  source->modifications=source->storage->modifications;
+
+  stream=librdf_model_as_stream(source->model);
+  if(!stream)
+    return 1;
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    librdf_statement* statement=librdf_stream_get_object(stream);
+    librdf_node* context_node=librdf_stream_get_context2(stream);
+
+    entry=librdf_model_union_lookup(model_union,
+                                    librdf_statement_get_predicate(statement),
+                                    0, 1);
+    if(entry && context_node) {
+      entry->members[i >> 3] |= bit;
+      entry=librdf_model_union_lookup(model_union, context_node, 1, 1);
+    }
+    if(!entry) {
+      status=1;
+      break;
+    }
+    entry->members[i >> 3] |= bit;
+  }
+  librdf_free_stream(stream);
+
+  if(!status && librdf_model_supports_contexts(source->model)) {
+    iterator=librdf_model_get_contexts(source->model);
+    if(iterator) {
+      for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+        entry=librdf_model_union_lookup(model_union,
+                                        (librdf_node*)librdf_iterator_get_object(iterator),
+                                        1, 1);
+        if(!entry) {
+          status=1;
+          break;
+        }
+        entry->members[i >> 3] |= bit;
+      }
+      librdf_free_iterator(iterator);
+    }
+  }
+
+  /* a scan changing the storage leaves it to be indexed again */
+  if(!status && source->modifications == source->storage->modifications)
+    source->indexed=1;
+
+  return status;
+}
+
+
+/*
+ * librdf_model_union_select:
+ * @model: model with submodels
+ * @statement: statement to match or NULL
+ * @context_node: context to match or NULL
+ * @sources_p: pointer to store the new array of submodels
+ *
+ * INTERNAL - Get the submodels of a model that may hold matches
+ *
+ * Return value: number of submodels in *@sources_p or <0 on failure
+ */
+static int
+librdf_model_union_select(librdf_model* model, librdf_statement* statement,
+                          librdf_node* context_node,
+                          librdf_model*** sources_p)
+{
+  librdf_model_union* model_union;
+  librdf_model** sources;
+  librdf_node* predicate;
+  int count=0;
+  int i;
+
+  if(!model->union_index) {
+    model->union_index=librdf_new_model_union(model);
+    if(!model->union_index)
+      return -1;
+  }
+  model_union=model->union_index;
+
+  sources=LIBRDF_MALLOC(librdf_model**,
+                        ((size_t)model_union->sources_count + 1) * sizeof(librdf_model*));
+  if(!sources)
+    return -1;
+
+  predicate=statement ? librdf_statement_get_predicate(statement) : NULL;
+
+  for(i=0; i < model_union->sources_count; i++) {
+    librdf_model_union_source* source=&model_union->sources[i];
+    librdf_model_union_entry* entry;
+
+    if(source->storage &&
+       source->modifications != source->storage->modifications)
+      source->indexed=0;
+
+    if(source->storage && !source->indexed &&
+       ++source->stale_lookups >= LIBRDF_MODEL_UNION_REINDEX_LOOKUPS)
+      librdf_model_union_index_source(model_union, i);
+
+    if(source->indexed) {
+      if(predicate) {
+        entry=librdf_model_union_lookup(model_union, predicate, 0, 0);
+        if(!entry || !LIBRDF_MODEL_UNION_HAS(entry->members, i))
+          continue;
+      }
+      if(context_node) {
+        entry=librdf_model_union_lookup(model_union, context_node, 1, 0);
+        if(!entry || !LIBRDF_MODEL_UNION_HAS(entry->members, i))
+          continue;
+      }
+    }
+
+    sources[count++]=source->model;
+  }
+
+  *sources_p=sources;
+  return count;
+}
+
+
+/*
+ * librdf_model_union_own_find:
+ * @model: model with submodels
+ * @statement: statement to match
+ * @context_node: context to match or NULL
+ * @options: find options or NULL
+ *
+ * INTERNAL - Find statements in the model itself, without its submodels
+ *
+ * Return value: #librdf_stream or NULL on failure
+ */
+static librdf_stream*
+librdf_model_union_own_find(librdf_model* model, librdf_statement* statement,
+                            librdf_node* context_node, librdf_hash* options)
+{
+  librdf_stream* stream;
+
+  if(options && model->factory->find_statements_with_options)
+    return model->factory->find_statements_with_options(model, statement,
+                                                        context_node, options);
+
+  if(!context_node)
+    return model->factory->find_statements(model, statement);
+
+  if(model->factory->find_statements_in_context)
+    return model->factory->find_statements_in_context(model, statement,
+                                                      context_node);
+
+  statement=librdf_new_statement_from_statement(statement);
+  if(!statement)
+    return NULL;
+
+  stream=model->factory->context_serialize(model, context_node);
+  if(!stream) {
+    librdf_free_statement(statement);
+    return NULL;
+  }
+
+  librdf_stream_add_map(stream,
+                        &librdf_stream_statement_find_map,
+                        (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
+
+  return stream;
+}
+
+
+/* Find statements in a member of the union: -1 for the model itself */
+static librdf_stream*
+librdf_model_union_member_find(librdf_model* model, librdf_model** sources,
+                               int member, librdf_statement* statement,
+                               librdf_node* context_node, librdf_hash* options)
+{
+  if(member < 0)
+    return librdf_model_union_own_find(model, statement, context_node, options);
+
+  if(options)
+    return librdf_model_find_statements_with_options(sources[member], statement,
+                                                     context_node, options);
+  if(context_node)
+    return librdf_model_find_statements_in_context(sources[member], statement,
+                                                   context_node);
+  return librdf_model_find_statements(sources[member], statement);
+}
+
+
+typedef struct {
+  librdf_model* model;        /* model with submodels */
+  librdf_model** sources;     /* submodels that may match */
+  int sources_count;
+  int member;                 /* -1 for the model itself or submodel index */
+  librdf_stream* stream;      /* of member */
+  librdf_statement* statement; /* to match */
+  librdf_node* context_node;  /* to match or NULL */
+  librdf_hash* options;       /* given to each member or NULL */
+} librdf_model_union_stream_context;
+
+
+/*
+ * librdf_model_union_seen:
+ * @usc: union stream context
+ * @statement: statement of the current member
+ * @context_node: its context or NULL
+ *
+ * INTERNAL - Check a statement was returned by an earlier member
+ *
+ * Return value: non-0 if an earlier member holds the statement
+ */
+static int
+librdf_model_union_seen(librdf_model_union_stream_context* usc,
+                        librdf_statement* statement, librdf_node* context_node)
+{
+  librdf_stream* stream;
+  int found;
+  int member;
+
+  for(member= -1; member < usc->member; member++) {
+    if(!usc->context_node) {
+      found=(member < 0) ?
+        usc->model->factory->contains_statement(usc->model, statement) :
+        librdf_model_contains_statement(usc->sources[member], statement);
+      if(found)
+        return 1;
+      continue;
+    }
+
+    stream=librdf_model_union_member_find(usc->model, usc->sources, member,
+                                          statement, context_node, NULL);
+    if(stream) {
+      found=!librdf_stream_end(stream);
+      librdf_free_stream(stream);
+      if(found)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* Move to the next member with a statement not in an earlier member */
+static int
+librdf_model_union_stream_skip(librdf_model_union_stream_context* usc)
+{
+  while(1) {
+    if(usc->stream) {
+      while(!librdf_stream_end(usc->stream)) {
+        if(usc->member < 0 ||
+           !librdf_model_union_seen(usc, librdf_stream_get_object(usc->stream),
+                                    librdf_stream_get_context2(usc->stream)))
+          return 0;
+        librdf_stream_next(usc->stream);
+      }
+      librdf_free_stream(usc->stream);
+      usc->stream=NULL;
+    }
+
+    if(usc->member + 1 >= usc->sources_count)
+      return 1;
+
+    usc->member++;
+    usc->stream=librdf_model_union_member_find(usc->model, usc->sources,
+                                               usc->member, usc->statement,
+                                               usc->context_node, usc->options);
+  }
+}
+
+
+static int
+librdf_model_union_stream_end_of_stream(void* context)
+{
+  librdf_model_union_stream_context* usc=(librdf_model_union_stream_context*)context;
+
+  return !usc->stream;
+}
+
+
+static int
+librdf_model_union_stream_next_statement(void* context)
+{
+  librdf_model_union_stream_context* usc=(librdf_model_union_stream_context*)context;
+
+  if(!usc->stream)
+    return 1;
+
+  librdf_stream_next(usc->stream);
+  return librdf_model_union_stream_skip(usc);
+}
+
+
+static void*
+librdf_model_union_stream_get_statement(void* context, int flags)
+{
+  librdf_model_union_stream_context* usc=(librdf_model_union_stream_context*)context;
+
+  if(!usc->stream)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(usc->stream);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(usc->stream);
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_model_union_stream_finished(void* context)
+{
+  librdf_model_union_stream_context* usc=(librdf_model_union_stream_context*)context;
+
+  if(usc->stream)
+    librdf_free_stream(usc->stream);
+  if(usc->sources)
+    LIBRDF_FREE(librdf_model**, usc->sources);
+  if(usc->statement)
+    librdf_free_statement(usc->statement);
+  if(usc->context_node)
+    librdf_free_node(usc->context_node);
+  if(usc->options)
+    librdf_free_hash(usc->options);
+
+  LIBRDF_FREE(librdf_model_union_stream_context, usc);
+}
+
+
+/**
+ * librdf_model_union_find_statements:
+ * @model: model with submodels
+ * @statement: statement to match or NULL for all
+ * @context_node: context to match or NULL
+ * @options: find options or NULL
+ *
+ * INTERNAL - Find statements in a model and in the submodels that may hold them
+ *
+ * Statements are returned once, from the first of the model and its
+ * submodels holding them.  With a limit or offset option, each member
+ * is asked for enough statements to fill the page, which is then
+ * taken from the union; an order option orders each member.
+ *
+ * Return value: #librdf_stream or NULL on failure
+ **/
+librdf_stream*
+librdf_model_union_find_statements(librdf_model* model,
+                                   librdf_statement* statement,
+                                   librdf_node* context_node,
+                                   librdf_hash* options)
+{
+  librdf_model_union_stream_context* usc;
+  librdf_storage* storage;
+  librdf_stream* stream;
+  int limit= -1;
+  int offset=0;
+  int order;
+
+  usc=LIBRDF_CALLOC(librdf_model_union_stream_context*, 1, sizeof(*usc));
+  if(!usc)
+    return NULL;
+
+  usc->model=model;
+  usc->member= -1;
+  usc->statement=statement ? librdf_new_statement_from_statement(statement) :
+                             librdf_new_statement(model->world);
+  if(context_node)
+    usc->context_node=librdf_new_node_from_node(context_node);
+  if(!usc->statement || (context_node && !usc->context_node))
+    goto failed;
+
+  usc->sources_count=librdf_model_union_select(model, statement, context_node,
+                                               &usc->sources);
+  if(usc->sources_count < 0)
+    goto failed;
+
+  if(options) {
+    usc->options=librdf_new_hash_from_hash(options);
+    if(!usc->options)
+      goto failed;
+
+    if(librdf_storage_get_find_options(options, &limit, &offset, &order) &&
+       usc->sources_count && (limit >= 0 || offset > 0)) {
+      librdf_hash_datum key;
+      char buffer[24];
+
+      key.data=(char*)"offset";
+      key.size=6;
+      librdf_hash_delete_all(usc->options, &key);
+      key.data=(char*)"limit";
+      key.size=5;
+      librdf_hash_delete_all(usc->options, &key);
+      if(limit >= 0) {
+        sprintf(buffer, "%d", limit + offset);
+        if(librdf_hash_put_strings(usc->options, "limit", buffer))
+          goto failed;
+      }
+    } else {
+      /* one member applies the paging itself */
+      limit= -1;
+      offset=0;
+    }
+  }
+
+  usc->stream=librdf_model_union_own_find(model, usc->statement,
+                                          usc->context_node, usc->options);
+  if(!usc->stream)
+    goto failed;
+  librdf_model_union_stream_skip(usc);
+
+  stream=librdf_new_stream(model->world, (void*)usc,
+                           &librdf_model_union_stream_end_of_stream,
+                           &librdf_model_union_stream_next_statement,
+                           &librdf_model_union_stream_get_statement,
+                           &librdf_model_union_stream_finished);
+  if(!stream) {
+    librdf_model_union_stream_finished(usc);
+    return NULL;
+  }
+
+  storage=librdf_model_get_storage(model);
+  if(storage && (limit >= 0 || offset > 0))
+    stream=librdf_storage_limit_stream(storage, stream, limit, offset);
+
+  return stream;
+
+  failed:
+  librdf_model_union_stream_finished(usc);
+  return NULL;
+}
+
+
+/**
+ * librdf_model_union_contains_statement:
+ * @model: model with submodels
+ * @statement: complete statement
+ *
+ * INTERNAL - Check for a statement in a model or in the submodels that may hold it
+ *
+ * Return value: non 0 if found
+ **/
+int
+librdf_model_union_contains_statement(librdf_model* model,
+                                      librdf_statement* statement)
+{
+  librdf_model** sources;
+  int count;
+  int found;
+  int i;
+
+  if(model->factory->contains_statement(model, statement))
+    return 1;
+
+  count=librdf_model_union_select(model, statement, NULL, &sources);
+  if(count < 0)
+    return 0;
+
+  found=0;
+  for(i=0; !found && i < count; i++)
+    found=librdf_model_contains_statement(sources[i], statement);
+  LIBRDF_FREE(librdf_model**, sources);
+
+  return found;
+}
+
+
+/**
+ * librdf_model_union_size:
+ * @model: model with submodels
+ *
+ * INTERNAL - Count the statements of a model and its submodels, each once
+ *
+ * Return value: number of statements or <0 on failure
+ **/
+int
+librdf_model_union_size(librdf_model* model)
+{
+  librdf_stream* stream;
+  int count=0;
+
+  stream=librdf_model_union_find_statements(model, NULL, NULL, NULL);
+  if(!stream)
+    return -1;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream))
+    count++;
+  librdf_free_stream(stream);
+
+  return count;
+}
+
+
+typedef struct {
+  librdf_stream* stream;
+  librdf_statement_part want;
+} librdf_model_union_node_iterator_context;
+
+
+static int
+librdf_model_union_node_iterator_is_end(void* iterator)
+{
+  librdf_model_union_node_iterator_context* context=(librdf_model_union_node_iterator_context*)iterator;
+
+  return librdf_stream_end(context->stream);
+}
+
+
+static int
+librdf_model_union_node_iterator_next_method(void* iterator)
+{
+  librdf_model_union_node_iterator_context* context=(librdf_model_union_node_iterator_context*)iterator;
+
+  return librdf_stream_next(context->stream);
+}
+
+
+static void*
+librdf_model_union_node_iterator_get_method(void* iterator, int flags)
+{
+  librdf_model_union_node_iterator_context* context=(librdf_model_union_node_iterator_context*)iterator;
+  librdf_statement* statement=librdf_stream_get_object(context->stream);
+
+  if(!statement)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      if(context->want == LIBRDF_STATEMENT_SUBJECT)
+        return librdf_statement_get_subject(statement);
+      if(context->want == LIBRDF_STATEMENT_PREDICATE)
+        return librdf_statement_get_predicate(statement);
+      return librdf_statement_get_object(statement);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(context->stream);
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_model_union_node_iterator_finished(void* iterator)
+{
+  librdf_model_union_node_iterator_context* context=(librdf_model_union_node_iterator_context*)iterator;
+
+  librdf_free_stream(context->stream);
+  LIBRDF_FREE(librdf_model_union_node_iterator_context, context);
+}
+
+
+/**
+ * librdf_model_union_get_nodes:
+ * @model: model with submodels
+ * @subject: subject to match or NULL
+ * @predicate: predicate to match or NULL
+ * @object: object to match or NULL
+ * @want: statement part to return
+ *
+ * INTERNAL - Get one part of the statements of a model and its submodels matching the others
+ *
+ * Return value: #librdf_iterator of #librdf_node or NULL on failure
+ **/
+librdf_iterator*
+librdf_model_union_get_nodes(librdf_model* model, librdf_node* subject,
+                             librdf_node* predicate, librdf_node* object,
+                             librdf_statement_part want)
+{
+  librdf_model_union_node_iterator_context* context;
+  librdf_statement statement;
+  librdf_stream* stream;
+  librdf_iterator* iterator;
+
+  librdf_statement_init(model->world, &statement);
+  statement.subject=subject;
+  statement.predicate=predicate;
+  statement.object=object;
+  stream=librdf_model_union_find_statements(model, &statement, NULL, NULL);
+  if(!stream)
+    return NULL;
+
+  context=LIBRDF_CALLOC(librdf_model_union_node_iterator_context*, 1,
+                        sizeof(*context));
+  if(!context) {
+    librdf_free_stream(stream);
+    return NULL;
+  }
+  context->stream=stream;
+  context->want=want;
+
+  iterator=librdf_new_iterator(model->world, (void*)context,
+                               &librdf_model_union_node_iterator_is_end,
+                               &librdf_model_union_node_iterator_next_method,
+                               &librdf_model_union_node_iterator_get_method,
+                               &librdf_model_union_node_iterator_finished);
+  if(!iterator)
+    librdf_model_union_node_iterator_finished(context);
+
+  return iterator;
+}
+
+
+/**
+ * librdf_model_union_has_arc:
+ * @model: model with submodels
+ * @subject: subject to match or NULL
+ * @predicate: predicate to match
+ * @object: object to match or NULL
+ *
+ * INTERNAL - Check for a statement matching the given parts in a model and its submodels
+ *
+ * Return value: non 0 if found
+ **/
+int
+librdf_model_union_has_arc(librdf_model* model, librdf_node* subject,
+                           librdf_node* predicate, librdf_node* object)
+{
+  librdf_statement statement;
+  librdf_stream* stream;
+  int found;
+
+  librdf_statement_init(model->world, &statement);
+  statement.subject=subject;
+  statement.predicate=predicate;
+  statement.object=object;
+  stream=librdf_model_union_find_statements(model, &statement, NULL, NULL);
+  if(!stream)
+    return 0;
+
+  found=!librdf_stream_end(stream);
+  librdf_free_stream(stream);
+
+  return found;
+}
@@ -35,6 +35,9 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 /* needed for utf8 functions and definition of 'byte' */
@@ -67,6 +70,271 @@ librdf_init_node(librdf_world* world)
 void
 librdf_finish_node(librdf_world* world)
 {
+  librdf_node_clear_interned(world);
+}
+
+
+/*
+ * librdf_node_intern_index - INTERNAL - Get the intern table for an encoded node type
+ * @type: first byte of a librdf_node_encode() encoding
+ *
+ * Return value: index into the world nodes_hash array or <0 if unknown
+ */
+static int
+librdf_node_intern_index(unsigned char type)
+{
+  switch(type) {
+    case 'R':
+      return 0;
+    case 'L':
+    case 'M':
+    case 'N':
+      return 1;
+    case 'B':
+      return 2;
+    default:
+      return -1;
+  }
+}
+
+
+/*
+ * librdf_node_clear_interned_locked - INTERNAL - Empty the node intern tables
+ * @world: redland world object
+ *
+ * The caller must hold the world nodes mutex.
+ */
+static void
+librdf_node_clear_interned_locked(librdf_world* world)
+{
+  librdf_hash_datum key, value; /* on stack - not allocated */
+  librdf_iterator* iterator;
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    if(!world->nodes_hash[i])
+      continue;
+
+    key.data = NULL;
+    key.size = 0;
+    iterator = librdf_hash_get_all(world->nodes_hash[i], &key, &value);
+    if(iterator) {
+      for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+        librdf_hash_datum* v = (librdf_hash_datum*)librdf_iterator_get_value(iterator);
+        librdf_node* node;
+
+        if(!v || v->size != sizeof(node))
+          continue;
+        memcpy(&node, v->data, sizeof(node));
+        librdf_free_node(node);
+      }
+      librdf_free_iterator(iterator);
+    }
+
+    librdf_free_hash(world->nodes_hash[i]);
+    world->nodes_hash[i] = NULL;
+  }
+
+  world->nodes_hash_count = 0;
+  world->nodes_hash_memory = 0;
+}
+
+
+/**
+ * librdf_node_clear_interned:
+ * @world: redland world object
+ *
+ * INTERNAL - Empty the node intern tables
+ *
+ * Nodes in use elsewhere stay valid; only the table references go.
+ **/
+void
+librdf_node_clear_interned(librdf_world* world)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->nodes_mutex);
+#endif
+  librdf_node_clear_interned_locked(world);
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->nodes_mutex);
+#endif
+}
+
+
+/**
+ * librdf_node_intern:
+ * @world: redland world object
+ * @node: new node owned by the caller
+ * @encoded: librdf_node_encode() encoding of @node or NULL
+ * @encoded_len: length of @encoded
+ *
+ * INTERNAL - Swap a node for the shared node equal to it
+ *
+ * With the #LIBRDF_WORLD_FEATURE_NODE_INTERNING world feature set,
+ * returns a new reference to the interned node equal to @node and
+ * frees @node, or interns @node if there is none.  Otherwise returns
+ * @node.  Passing the encoding when the caller has it saves making
+ * one.
+ *
+ * Return value: node owned by the caller
+ **/
+librdf_node*
+librdf_node_intern(librdf_world* world, librdf_node* node,
+                   const unsigned char* encoded, size_t encoded_len)
+{
+  librdf_hash_datum key, value; /* on stack - not allocated */
+  librdf_hash_datum* found;
+  librdf_hash* hash;
+  unsigned char* buffer = NULL;
+  librdf_node* interned = NULL;
+  int i;
+
+  if(!node || !world->nodes_hash_max)
+    return node;
+
+  if(!encoded) {
+    encoded_len = librdf_node_encode(node, NULL, 0);
+    buffer = LIBRDF_MALLOC(unsigned char*, encoded_len);
+    if(!buffer)
+      return node;
+    encoded_len = librdf_node_encode(node, buffer, encoded_len);
+    encoded = buffer;
+  }
+
+  i = librdf_node_intern_index(encoded[0]);
+  if(i < 0)
+    goto tidy;
+
+  key.data = (void*)encoded;
+  key.size = encoded_len;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->nodes_mutex);
+#endif
+
+  hash = world->nodes_hash[i];
+  if(hash && (found = librdf_hash_get_one(hash, &key))) {
+    if(found->size == sizeof(interned))
+      memcpy(&interned, found->data, sizeof(interned));
+    librdf_free_hash_datum(found);
+    if(interned)
+      interned = librdf_new_node_from_node(interned);
+  } else if(world->nodes_hash_max) {
+    if(world->nodes_hash_count >= world->nodes_hash_max)
+      librdf_node_clear_interned_locked(world);
+
+    if(!world->nodes_hash[i]) {
+      world->nodes_hash[i] = librdf_new_hash(world, NULL);
+      if(world->nodes_hash[i] &&
+         librdf_hash_open(world->nodes_hash[i], NULL, 0, 1, 1, NULL)) {
+        librdf_free_hash(world->nodes_hash[i]);
+        world->nodes_hash[i] = NULL;
+      }
+    }
+
+    /* the table keeps a reference */
+    if(world->nodes_hash[i]) {
+      librdf_node* table_node = librdf_new_node_from_node(node);
+
+      value.data = &table_node;
+      value.size = sizeof(table_node);
+      if(librdf_hash_put(world->nodes_hash[i], &key, &value))
+        librdf_free_node(table_node);
+      else {
+        world->nodes_hash_count++;
+        world->nodes_hash_memory += librdf_node_get_memory_size(table_node);
+      }
+    }
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->nodes_mutex);
+#endif
+
+  if(interned) {
+    librdf_free_node(node);
+    node = interned;
+  }
+
+  tidy:
+  if(buffer)
+    LIBRDF_FREE(char*, buffer);
+
+  return node;
+}
+
+
+/**
+ * librdf_node_get_interned_memory_size:
+ * @world: redland world object
+ *
+ * INTERNAL - Get the approximate bytes held by the node intern tables
+ *
+ * Return value: bytes of the tables and the nodes in them
+ **/
+size_t
+librdf_node_get_interned_memory_size(librdf_world* world)
+{
+  size_t size;
+  int i;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->nodes_mutex);
+#endif
+  size = world->nodes_hash_memory;
+  for(i = 0; i < 3; i++) {
+    if(world->nodes_hash[i])
+      size += librdf_hash_get_memory_size(world->nodes_hash[i]);
+  }
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->nodes_mutex);
+#endif
+
+  return size;
+}
+
+
+/**
+ * librdf_node_get_memory_size:
+ * @node: the node object
+ *
+ * INTERNAL - Get the approximate bytes held by a node
+ *
+ * Counts the node and its strings but not the allocator overhead.
+ * Shared parts such as the URI of a resource are counted for every
+ * node using them, so the sum over nodes is an upper bound.
+ *
+ * Return value: size in bytes
+ **/
+size_t
+librdf_node_get_memory_size(librdf_node* node)
+{
+  size_t size = sizeof(*node);
+  size_t len = 0;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      /* a raptor_uri is a few words plus the string */
+      raptor_uri_as_counted_string(node->value.uri, &len);
+      size += 4 * sizeof(void*) + len + 1;
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      size += node->value.literal.string_len + 1;
+      if(node->value.literal.language)
+        size += node->value.literal.language_len + 1;
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      size += node->value.blank.string_len + 1;
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  return size;
 }
 
 
@@ -108,11 +376,16 @@ librdf_node*
 librdf_new_node_from_uri_string(librdf_world *world,
                                 const unsigned char *uri_string)
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_uri_string(world->raptor_world_ptr, uri_string);
+  librdf_usage_lock();
+  node = raptor_new_term_from_uri_string(world->raptor_world_ptr, uri_string);
+  librdf_usage_unlock();
+  return node;
 }
 
 
@@ -131,12 +404,17 @@ librdf_new_node_from_counted_uri_string(librdf_world *world,
                                         const unsigned char *uri_string,
                                         size_t len) 
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_counted_uri_string(world->raptor_world_ptr, 
+  librdf_usage_lock();
+  node = raptor_new_term_from_counted_uri_string(world->raptor_world_ptr, 
                                                  uri_string, len);
+  librdf_usage_unlock();
+  return node;
 }
 
 
@@ -154,11 +432,16 @@ librdf_new_node_from_counted_uri_string(librdf_world *world,
 librdf_node*
 librdf_new_node_from_uri(librdf_world *world, librdf_uri *uri)
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_uri(world->raptor_world_ptr, uri);
+  librdf_usage_lock();
+  node = raptor_new_term_from_uri(world->raptor_world_ptr, uri);
+  librdf_usage_unlock();
+  return node;
 }
 
 
@@ -187,13 +470,15 @@ librdf_new_node_from_uri_local_name(librdf_world *world,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(uri, raptor_uri, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(local_name, string, NULL);
 
+  librdf_usage_lock();
   new_uri = raptor_new_uri_from_uri_local_name(world->raptor_world_ptr,
                                                uri, local_name);
-  if(!new_uri)
-    return NULL;
-
-  node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
-  raptor_free_uri(new_uri);
+  if(new_uri) {
+    node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
+    raptor_free_uri(new_uri);
+  } else
+    node = NULL;
+  librdf_usage_unlock();
   return node;
 }
 
@@ -227,8 +512,10 @@ librdf_new_node_from_normalised_uri_string(librdf_world *world,
   if(!new_uri)
     return NULL;
 
+  librdf_usage_lock();
   node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
   raptor_free_uri(new_uri);
+  librdf_usage_unlock();
   return node;
 }
 
@@ -312,11 +599,13 @@ librdf_node_normalize(librdf_world* world, librdf_node* node)
         /* Have to use Raptor constructor here since
          * librdf_new_node_from_typed_counted_literal() calls this
          */
+        librdf_usage_lock();
         node = raptor_new_term_from_counted_literal(world->raptor_world_ptr,
                                                     value, value_len,
                                                     dt_uri,
                                                     (const unsigned char*)NULL,
                                                     (unsigned char)0);
+        librdf_usage_unlock();
       }
     }
 
@@ -360,9 +649,11 @@ librdf_new_node_from_literal(librdf_world *world,
 
   datatype_uri = (is_wf_xml ?  LIBRDF_RS_XMLLiteral_URI(world) : NULL);
 
+  librdf_usage_lock();
   n = raptor_new_term_from_literal(world->raptor_world_ptr,
                                    string, datatype_uri,
                                    (const unsigned char*)xml_language);
+  librdf_usage_unlock();
   return librdf_node_normalize(world, n);
 }
 
@@ -394,9 +685,11 @@ librdf_new_node_from_typed_literal(librdf_world *world,
   
   librdf_world_open(world);
 
+  librdf_usage_lock();
   n = raptor_new_term_from_literal(world->raptor_world_ptr,
                                    value, datatype_uri,
                                    (const unsigned char*)xml_language);
+  librdf_usage_unlock();
   return librdf_node_normalize(world, n);
 }
 
@@ -434,11 +727,13 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
   
   librdf_world_open(world);
 
+  librdf_usage_lock();
   n = raptor_new_term_from_counted_literal(world->raptor_world_ptr,
                                            value, value_len,
                                            datatype_uri,
                                            (const unsigned char*)xml_language,
                                            (unsigned char)xml_language_len);
+  librdf_usage_unlock();
   return librdf_node_normalize(world, n);
 }
 
@@ -516,9 +811,14 @@ librdf_new_node_from_blank_identifier(librdf_world *world,
 librdf_node*
 librdf_new_node_from_node(librdf_node *node)
 {
+  librdf_node* copy;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
-  return raptor_term_copy(node);
+  librdf_usage_lock();
+  copy = raptor_term_copy(node);
+  librdf_usage_unlock();
+  return copy;
 }
 
 
@@ -535,7 +835,9 @@ librdf_free_node(librdf_node *node)
   if(!node)
     return;
 
+  librdf_usage_lock();
   raptor_free_term(node);
+  librdf_usage_unlock();
 }
 
 
@@ -713,11 +1015,13 @@ librdf_node_get_literal_value_is_wf_xml(librdf_node *node)
   if(!node->value.literal.datatype)
     return 0;
 
+  librdf_usage_lock();
   rdf_xml_literal_uri = raptor_new_uri_for_rdf_concept(node->world,
                                                        (const unsigned char *)"XMLLiteral");
   
   rc = librdf_uri_equals(node->value.literal.datatype, rdf_xml_literal_uri);
   raptor_free_uri(rdf_xml_literal_uri);
+  librdf_usage_unlock();
 
   return rc;
 }
@@ -1155,10 +1459,146 @@ librdf_node_decode(librdf_world *world, size_t *size_p,
   if(size_p)
     *size_p = total_length;
 
+  if(node && world->nodes_hash_max)
+    node = librdf_node_intern(world, node, buffer, total_length);
+
   return node;
 }
 
 
+/**
+ * librdf_node_decode_view:
+ * @view: node view to fill in
+ * @buffer: the buffer to use
+ * @length: buffer size
+ *
+ * INTERNAL - Read a node encoding without making a node
+ *
+ * Like librdf_node_decode() but @view points into @buffer, so nothing
+ * is allocated and @view is only valid while @buffer is.  The old 'L'
+ * literal encoding is not read.
+ *
+ * Return value: number of bytes used or 0 on failure
+ **/
+size_t
+librdf_node_decode_view(librdf_node_view* view,
+                        const unsigned char *buffer, size_t length)
+{
+  size_t total_length;
+  size_t header_length;
+
+  if(length < 3)
+    return 0;
+
+  memset(view, 0, sizeof(*view));
+
+  switch(buffer[0]) {
+    case 'R':
+    case 'B':
+      view->type = (buffer[0] == 'R') ? RAPTOR_TERM_TYPE_URI :
+                                        RAPTOR_TERM_TYPE_BLANK;
+      view->string_len = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
+      view->string = buffer + 3;
+      total_length = 3 + view->string_len + 1;
+      break;
+
+    case 'M':
+    case 'N':
+      view->type = RAPTOR_TERM_TYPE_LITERAL;
+      if(buffer[0] == 'M') {
+        if(length < 6)
+          return 0;
+        view->string_len = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]);
+        view->datatype_len = LIBRDF_GOOD_CAST(size_t, (buffer[3] << 8) | buffer[4]);
+        view->language_len = buffer[5];
+        header_length = 6;
+      } else {
+        if(length < 8)
+          return 0;
+        view->string_len = LIBRDF_GOOD_CAST(size_t, (buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]);
+        view->datatype_len = LIBRDF_GOOD_CAST(size_t, (buffer[5] << 8) | buffer[6]);
+        view->language_len = buffer[7];
+        header_length = 8;
+      }
+
+      view->string = buffer + header_length;
+      total_length = header_length + view->string_len + 1;
+      if(view->datatype_len) {
+        view->datatype = buffer + total_length;
+        total_length += view->datatype_len + 1;
+      }
+      if(view->language_len) {
+        view->language = buffer + total_length;
+        total_length += view->language_len + 1;
+      }
+      break;
+
+    default:
+      return 0;
+  }
+
+  if(total_length > length)
+    return 0;
+
+  return total_length;
+}
+
+
+/**
+ * librdf_node_view_equals:
+ * @view: node view
+ * @node: node
+ *
+ * INTERNAL - Compare a node view to a node, as librdf_node_equals() does
+ *
+ * Return value: non 0 if they are equal
+ **/
+int
+librdf_node_view_equals(const librdf_node_view* view, librdf_node* node)
+{
+  const unsigned char *string;
+  size_t string_len;
+
+  if(!node || view->type != node->type)
+    return 0;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      string = librdf_uri_as_counted_string(node->value.uri, &string_len);
+      return (view->string_len == string_len &&
+              !memcmp(view->string, string, string_len));
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      if(view->string_len != node->value.literal.string_len ||
+         memcmp(view->string, node->value.literal.string, view->string_len))
+        return 0;
+
+      string_len = node->value.literal.language ?
+        LIBRDF_GOOD_CAST(size_t, node->value.literal.language_len) : 0;
+      if(view->language_len != string_len ||
+         (string_len && memcmp(view->language, node->value.literal.language,
+                               string_len)))
+        return 0;
+
+      if(!node->value.literal.datatype)
+        return !view->datatype_len;
+      string = librdf_uri_as_counted_string(node->value.literal.datatype,
+                                            &string_len);
+      return (view->datatype_len == string_len &&
+              !memcmp(view->datatype, string, string_len));
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      return (view->string_len == node->value.blank.string_len &&
+              !memcmp(view->string, node->value.blank.string,
+                      view->string_len));
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return 0;
+  }
+}
+
+
 #ifndef REDLAND_DISABLE_DEPRECATED
 /**
  * librdf_node_to_string:
@@ -1290,6 +1730,10 @@ librdf_node_print(librdf_node *node, FILE *fh)
 int
 librdf_node_equals(librdf_node *first_node, librdf_node *second_node)
 {
+  /* the same object, as for interned nodes */
+  if(first_node && first_node == second_node)
+    return 1;
+
   return raptor_term_equals(first_node, second_node);
 }
 
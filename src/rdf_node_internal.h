@@ -80,6 +80,26 @@ struct librdf_node_s
 void librdf_init_node(librdf_world* world);
 void librdf_finish_node(librdf_world* world);
 
+librdf_node* librdf_node_intern(librdf_world* world, librdf_node* node, const unsigned char* encoded, size_t encoded_len);
+void librdf_node_clear_interned(librdf_world* world);
+size_t librdf_node_get_interned_memory_size(librdf_world* world);
+
+size_t librdf_node_get_memory_size(librdf_node* node);
+
+/* A node encoding read in place; the pointers borrow the buffer */
+typedef struct {
+  raptor_term_type type;
+  const unsigned char *string; /* URI, literal value or blank node id */
+  size_t string_len;
+  const unsigned char *datatype; /* literal datatype URI or NULL */
+  size_t datatype_len;
+  const unsigned char *language; /* literal language or NULL */
+  size_t language_len;
+} librdf_node_view;
+
+size_t librdf_node_decode_view(librdf_node_view* view, const unsigned char *buffer, size_t length);
+int librdf_node_view_equals(const librdf_node_view* view, librdf_node* node);
+
 /* exported public in error but never usable */
 librdf_digest* librdf_node_get_digest(librdf_node* node);
 
@@ -48,11 +48,14 @@
  *
  * INTERNAL - Initialise the parser module.
  *
+ * Registers the parsers.  Run once by the parser factory functions
+ * such as librdf_get_parser_factory() the first time one is called.
  **/
 void
 librdf_init_parser(librdf_world *world)
 {
   librdf_parser_raptor_constructor(world);
+  librdf_parser_binary_constructor(world);
 }
 
 
@@ -70,6 +73,7 @@ librdf_finish_parser(librdf_world *world)
     raptor_free_sequence(world->parsers);
     world->parsers=NULL;
   }
+  world->parsers_loaded=0;
 
   librdf_parser_raptor_destructor();
 }
@@ -198,6 +202,7 @@ librdf_get_parser_factory(librdf_world *world,
   librdf_parser_factory *factory;
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->parsers_loaded, librdf_init_parser);
 
   if(name && !*name)
     name=NULL;
@@ -275,6 +280,7 @@ librdf_parser_enumerate(librdf_world* world,
   int ioffset = LIBRDF_GOOD_CAST(int, counter);
   
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->parsers_loaded, librdf_init_parser);
 
   factory = (librdf_parser_factory*)raptor_sequence_get_at(world->parsers,
                                                            ioffset);
@@ -329,6 +335,7 @@ librdf_parser_check_name(librdf_world* world, const char *name)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(name, char*, 0);
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->parsers_loaded, librdf_init_parser);
 
   for(i = 0;
       (factory = (librdf_parser_factory*)raptor_sequence_get_at(world->parsers, i));
@@ -364,6 +371,9 @@ librdf_new_parser(librdf_world *world,
 
   librdf_world_open(world);
 
+  if(librdf_query_async_check_world(world))
+    return NULL;
+
   factory = librdf_get_parser_factory(world, name, mime_type, type_uri);
   if(!factory) {
     if(name)
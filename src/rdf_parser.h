@@ -101,6 +101,94 @@ librdf_uri_filter_func librdf_parser_get_uri_filter(librdf_parser* parser, void*
  */
 #define LIBRDF_PARSER_FEATURE_WARNING_COUNT "http://feature.librdf.org/parser-warning-count"
 
+/**
+ * LIBRDF_PARSER_FEATURE_BATCH_SIZE:
+ *
+ * Parser feature URI string for the number of statements buffered
+ * before they are added to the model when parsing into a model.
+ * Each batch is added with librdf_model_add_statements() inside a
+ * model transaction where the storage supports one.  A value of 0
+ * or 1 adds each statement as it is parsed.
+ */
+#define LIBRDF_PARSER_FEATURE_BATCH_SIZE "http://feature.librdf.org/parser-batch-size"
+
+/**
+ * LIBRDF_PARSER_FEATURE_THREADS:
+ *
+ * Parser feature URI string for the number of threads used to parse
+ * N-Triples or N-Quads from a file into a model.  The input is split
+ * on line boundaries and the chunks parsed at the same time; blank
+ * node identifiers keep the scope of the whole document.  The default
+ * of 1 parses in the calling thread.  Only used when Redland is built
+ * with threads.
+ */
+#define LIBRDF_PARSER_FEATURE_THREADS "http://feature.librdf.org/parser-threads"
+
+/**
+ * LIBRDF_PARSER_FEATURE_READ_BUFFER_SIZE:
+ *
+ * Parser feature URI string for the number of bytes passed to the
+ * parser at once when a file is parsed as a stream, 65536 by default.
+ * Regular files are memory mapped where supported and parsed from
+ * the mapping in chunks of this size.
+ */
+#define LIBRDF_PARSER_FEATURE_READ_BUFFER_SIZE "http://feature.librdf.org/parser-read-buffer-size"
+
+/**
+ * LIBRDF_PARSER_FEATURE_PIPELINE:
+ *
+ * Parser feature URI string to add statements to the model on a
+ * separate thread when parsing into a model, so parsing and storage
+ * writes overlap.  Statements are handed over in batches of
+ * #LIBRDF_PARSER_FEATURE_BATCH_SIZE, which must be above 1.  The
+ * writer thread adds the statements without keeping or freeing them;
+ * storages that keep references to added nodes, such as the memory
+ * storage, should not be pipelined.  Models with change handlers,
+ * registered before the parse starts, are never pipelined.  Only used
+ * when Redland is built with threads.
+ */
+#define LIBRDF_PARSER_FEATURE_PIPELINE "http://feature.librdf.org/parser-pipeline"
+
+/**
+ * LIBRDF_PARSER_FEATURE_DEDUPLICATE:
+ *
+ * Parser feature URI string to drop duplicate statements when parsing
+ * into a model, before they are added to the storage.  The value is
+ * the expected number of distinct statements, which sizes a Bloom
+ * filter of 10 bits per statement; statements the filter may have
+ * seen are checked exactly before being dropped.  0 (the default)
+ * turns the filter off.
+ */
+#define LIBRDF_PARSER_FEATURE_DEDUPLICATE "http://feature.librdf.org/parser-deduplicate"
+
+/**
+ * LIBRDF_PARSER_FEATURE_DUPLICATE_COUNT:
+ *
+ * Parser feature URI string for getting the number of duplicate
+ * statements dropped by the last parse into a model.
+ */
+#define LIBRDF_PARSER_FEATURE_DUPLICATE_COUNT "http://feature.librdf.org/parser-duplicate-count"
+
+/**
+ * LIBRDF_PARSER_FEATURE_COMPRESSION:
+ *
+ * Parser feature URI string for the compression of files parsed from
+ * file: URIs or file handles: "gzip", "zstd", "none" or the default
+ * "auto" to decompress file: URIs whose names end in .gz (gzip) or
+ * .zst (zstd).  The content is decompressed as it is parsed.
+ */
+#define LIBRDF_PARSER_FEATURE_COMPRESSION "http://feature.librdf.org/parser-compression"
+
+/**
+ * LIBRDF_PARSER_FEATURE_MEMORY_SIZE:
+ *
+ * Parser feature URI string for the approximate bytes held by the
+ * parse in progress: statements queued to be returned or waiting to
+ * be added to a model, the read buffer and the duplicate filter.
+ * 0 when not parsing.  This feature is read only.
+ */
+#define LIBRDF_PARSER_FEATURE_MEMORY_SIZE "http://feature.librdf.org/parser-memory-size"
+
 REDLAND_API
 librdf_node* librdf_parser_get_feature(librdf_parser* parser, librdf_uri *feature);
 REDLAND_API
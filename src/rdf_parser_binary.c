@@ -0,0 +1,770 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_parser_binary.c - librdf binary RDF parser
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include <redland.h>
+#include <rdf_binary_internal.h>
+
+
+/* bytes read from a file or iostream at once */
+#define LIBRDF_PARSER_BINARY_BUFFER_SIZE 65536
+
+
+typedef struct {
+  librdf_parser *parser;
+} librdf_parser_binary_context;
+
+
+typedef struct {
+  librdf_parser_binary_context* pcontext;
+  librdf_world* world;
+
+  /* input: one of a file handle, an iostream or a counted string */
+  FILE *fh;
+  int close_fh;
+  raptor_iostream *iostr;
+
+  /* input bytes from data_position to data_len, in buffer unless
+   * reading a counted string */
+  const unsigned char *data;
+  size_t data_len;
+  size_t data_position;
+  unsigned char *buffer;
+  int input_eof;
+
+  /* terms by id */
+  librdf_node** terms;
+  size_t terms_count;
+  size_t terms_size;
+
+  /* TERM record encoding */
+  unsigned char *encoding;
+  size_t encoding_size;
+
+  librdf_statement* current;
+  librdf_node* current_graph;
+  int finished;
+  int failed;
+} librdf_parser_binary_stream_context;
+
+
+static int
+librdf_parser_binary_init(librdf_parser *parser, void *context)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  pcontext->parser = parser;
+
+  return 0;
+}
+
+
+static void
+librdf_parser_binary_error(librdf_parser_binary_stream_context* scontext,
+                           const char *message)
+{
+  if(!scontext->failed)
+    librdf_log(scontext->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "librdf binary parse failed - %s", message);
+  scontext->failed = 1;
+  scontext->finished = 1;
+}
+
+
+/* Make more input available; non 0 at the end of the input */
+static int
+librdf_parser_binary_fill(librdf_parser_binary_stream_context* scontext)
+{
+  size_t len = 0;
+
+  if(scontext->data_position < scontext->data_len)
+    return 0;
+
+  if(scontext->input_eof)
+    return 1;
+
+  if(scontext->fh) {
+    len = fread(scontext->buffer, 1, LIBRDF_PARSER_BINARY_BUFFER_SIZE,
+                scontext->fh);
+    if(len < LIBRDF_PARSER_BINARY_BUFFER_SIZE)
+      scontext->input_eof = 1;
+  } else if(scontext->iostr) {
+    int nread;
+
+    nread = raptor_iostream_read_bytes(scontext->buffer, 1,
+                                       LIBRDF_PARSER_BINARY_BUFFER_SIZE,
+                                       scontext->iostr);
+    if(nread < 0) {
+      librdf_parser_binary_error(scontext, "read error");
+      return 1;
+    }
+    len = LIBRDF_GOOD_CAST(size_t, nread);
+    if(!len || raptor_iostream_read_eof(scontext->iostr))
+      scontext->input_eof = 1;
+  } else
+    scontext->input_eof = 1;
+
+  scontext->data = scontext->buffer;
+  scontext->data_len = len;
+  scontext->data_position = 0;
+
+  return !len;
+}
+
+
+static int
+librdf_parser_binary_read_bytes(librdf_parser_binary_stream_context* scontext,
+                                unsigned char *bytes, size_t len)
+{
+  while(len) {
+    size_t avail;
+
+    if(librdf_parser_binary_fill(scontext)) {
+      librdf_parser_binary_error(scontext, "unexpected end of input");
+      return 1;
+    }
+
+    avail = scontext->data_len - scontext->data_position;
+    if(avail > len)
+      avail = len;
+    memcpy(bytes, scontext->data + scontext->data_position, avail);
+    scontext->data_position += avail;
+    bytes += avail;
+    len -= avail;
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_parser_binary_read_varint(librdf_parser_binary_stream_context* scontext,
+                                 size_t *value_p)
+{
+  size_t value = 0;
+  unsigned int shift = 0;
+
+  while(1) {
+    unsigned char b;
+
+    if(librdf_parser_binary_read_bytes(scontext, &b, 1))
+      return 1;
+
+    if(shift >= sizeof(size_t) * 8) {
+      librdf_parser_binary_error(scontext, "bad integer");
+      return 1;
+    }
+    value |= LIBRDF_GOOD_CAST(size_t, b & 0x7f) << shift;
+    if(!(b & 0x80))
+      break;
+    shift += 7;
+  }
+
+  *value_p = value;
+  return 0;
+}
+
+
+static void
+librdf_parser_binary_reset_terms(librdf_parser_binary_stream_context* scontext)
+{
+  size_t i;
+
+  for(i = 0; i < scontext->terms_count; i++)
+    librdf_free_node(scontext->terms[i]);
+  scontext->terms_count = 0;
+}
+
+
+/*
+ * librdf_parser_binary_read_term:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Read a TERM record after the record type byte
+ *
+ * Blank node identifiers are mapped through the world bnode map as
+ * the raptor parsers do, so that they are scoped to the document.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_binary_read_term(librdf_parser_binary_stream_context* scontext)
+{
+  librdf_node* node;
+  size_t length;
+  size_t used = 0;
+
+  if(librdf_parser_binary_read_varint(scontext, &length))
+    return 1;
+
+  if(length > scontext->encoding_size) {
+    if(scontext->encoding)
+      LIBRDF_FREE(char*, scontext->encoding);
+    scontext->encoding = LIBRDF_MALLOC(unsigned char*, length);
+    if(!scontext->encoding) {
+      scontext->encoding_size = 0;
+      librdf_parser_binary_error(scontext, "out of memory");
+      return 1;
+    }
+    scontext->encoding_size = length;
+  }
+
+  if(librdf_parser_binary_read_bytes(scontext, scontext->encoding, length))
+    return 1;
+
+  node = librdf_node_decode(scontext->world, &used, scontext->encoding,
+                            length);
+  if(!node || used != length) {
+    if(node)
+      librdf_free_node(node);
+    librdf_parser_binary_error(scontext, "bad term");
+    return 1;
+  }
+
+  if(librdf_node_is_blank(node)) {
+    unsigned char *mapped_id;
+
+    mapped_id = librdf_raptor_map_bnodeid(scontext->world,
+                                          librdf_node_get_blank_identifier(node));
+    librdf_free_node(node);
+    node = NULL;
+    if(mapped_id) {
+      node = librdf_new_node_from_blank_identifier(scontext->world,
+                                                   mapped_id);
+      LIBRDF_FREE(char*, mapped_id);
+    }
+    if(!node) {
+      librdf_parser_binary_error(scontext, "out of memory");
+      return 1;
+    }
+  }
+
+  if(scontext->terms_count == scontext->terms_size) {
+    size_t size = scontext->terms_size ? scontext->terms_size * 2 : 1024;
+    librdf_node** terms;
+
+    terms = LIBRDF_MALLOC(librdf_node**, size * sizeof(librdf_node*));
+    if(!terms) {
+      librdf_free_node(node);
+      librdf_parser_binary_error(scontext, "out of memory");
+      return 1;
+    }
+    if(scontext->terms_count)
+      memcpy(terms, scontext->terms,
+             scontext->terms_count * sizeof(librdf_node*));
+    if(scontext->terms)
+      LIBRDF_FREE(librdf_node**, scontext->terms);
+    scontext->terms = terms;
+    scontext->terms_size = size;
+  }
+  scontext->terms[scontext->terms_count++] = node;
+
+  return 0;
+}
+
+
+/* Get a new reference to the term with the id read next */
+static librdf_node*
+librdf_parser_binary_read_term_id(librdf_parser_binary_stream_context* scontext)
+{
+  size_t id;
+
+  if(librdf_parser_binary_read_varint(scontext, &id))
+    return NULL;
+
+  if(id >= scontext->terms_count) {
+    librdf_parser_binary_error(scontext, "unknown term id");
+    return NULL;
+  }
+
+  return librdf_new_node_from_node(scontext->terms[id]);
+}
+
+
+/*
+ * librdf_parser_binary_next:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Read records up to the next statement
+ *
+ * Return value: non 0 at the end or on failure
+ */
+static int
+librdf_parser_binary_next(librdf_parser_binary_stream_context* scontext)
+{
+  if(scontext->current) {
+    librdf_free_statement(scontext->current);
+    scontext->current = NULL;
+  }
+  if(scontext->current_graph) {
+    librdf_free_node(scontext->current_graph);
+    scontext->current_graph = NULL;
+  }
+
+  while(!scontext->finished) {
+    unsigned char record;
+    librdf_node *nodes[4] = { NULL, NULL, NULL, NULL };
+    int count;
+    int i;
+
+    if(librdf_parser_binary_read_bytes(scontext, &record, 1))
+      break;
+
+    switch(record) {
+      case LIBRDF_BINARY_TERM:
+        librdf_parser_binary_read_term(scontext);
+        continue;
+
+      case LIBRDF_BINARY_RESET:
+        librdf_parser_binary_reset_terms(scontext);
+        continue;
+
+      case LIBRDF_BINARY_END:
+        scontext->finished = 1;
+        continue;
+
+      case LIBRDF_BINARY_TRIPLE:
+      case LIBRDF_BINARY_QUAD:
+        count = (record == LIBRDF_BINARY_QUAD) ? 4 : 3;
+        for(i = 0; i < count; i++) {
+          nodes[i] = librdf_parser_binary_read_term_id(scontext);
+          if(!nodes[i])
+            break;
+        }
+        if(i == count)
+          scontext->current = librdf_new_statement_from_nodes(scontext->world,
+                                                              nodes[0],
+                                                              nodes[1],
+                                                              nodes[2]);
+        else {
+          while(--i >= 0)
+            librdf_free_node(nodes[i]);
+          break;
+        }
+
+        /* the statement owns the nodes even on failure */
+        if(!scontext->current) {
+          if(nodes[3])
+            librdf_free_node(nodes[3]);
+          librdf_parser_binary_error(scontext, "out of memory");
+          break;
+        }
+        scontext->current_graph = nodes[3];
+        return 0;
+
+      default:
+        librdf_parser_binary_error(scontext, "unknown record");
+        break;
+    }
+  }
+
+  return 1;
+}
+
+
+static int
+librdf_parser_binary_stream_end_of_stream(void* context)
+{
+  librdf_parser_binary_stream_context* scontext=(librdf_parser_binary_stream_context*)context;
+
+  return !scontext->current;
+}
+
+
+static int
+librdf_parser_binary_stream_next_statement(void* context)
+{
+  librdf_parser_binary_stream_context* scontext=(librdf_parser_binary_stream_context*)context;
+
+  return librdf_parser_binary_next(scontext);
+}
+
+
+static void*
+librdf_parser_binary_stream_get_statement(void* context, int flags)
+{
+  librdf_parser_binary_stream_context* scontext=(librdf_parser_binary_stream_context*)context;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return scontext->current;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return scontext->current_graph;
+
+    default:
+      librdf_log(scontext->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_parser_binary_stream_finished(void* context)
+{
+  librdf_parser_binary_stream_context* scontext=(librdf_parser_binary_stream_context*)context;
+
+  if(scontext->current)
+    librdf_free_statement(scontext->current);
+  if(scontext->current_graph)
+    librdf_free_node(scontext->current_graph);
+
+  librdf_parser_binary_reset_terms(scontext);
+  if(scontext->terms)
+    LIBRDF_FREE(librdf_node**, scontext->terms);
+  if(scontext->encoding)
+    LIBRDF_FREE(char*, scontext->encoding);
+  if(scontext->buffer)
+    LIBRDF_FREE(char*, scontext->buffer);
+
+  if(scontext->fh && scontext->close_fh)
+    fclose(scontext->fh);
+
+  librdf_raptor_reset_bnode_hash(scontext->world);
+
+  LIBRDF_FREE(librdf_parser_binary_stream_context, scontext);
+}
+
+
+/*
+ * librdf_parser_binary_start:
+ * @pcontext: parser context
+ * @fh: file handle or NULL
+ * @close_fh: non 0 to close @fh when the parse is finished
+ * @iostr: iostream or NULL
+ * @string: counted string or NULL
+ * @length: length of @string
+ *
+ * INTERNAL - Start a parse of one of a file handle, iostream or counted string
+ *
+ * The header is checked and the first statement read.
+ *
+ * Return value: new parser stream context or NULL on failure
+ */
+static librdf_parser_binary_stream_context*
+librdf_parser_binary_start(librdf_parser_binary_context* pcontext,
+                           FILE *fh, int close_fh,
+                           raptor_iostream *iostr,
+                           const unsigned char *string, size_t length)
+{
+  librdf_parser_binary_stream_context* scontext;
+  unsigned char magic[LIBRDF_BINARY_MAGIC_LEN];
+
+  scontext = LIBRDF_CALLOC(librdf_parser_binary_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext) {
+    if(fh && close_fh)
+      fclose(fh);
+    return NULL;
+  }
+
+  scontext->pcontext = pcontext;
+  scontext->world = pcontext->parser->world;
+  scontext->fh = fh;
+  scontext->close_fh = close_fh;
+  scontext->iostr = iostr;
+
+  if(string) {
+    scontext->data = string;
+    scontext->data_len = length;
+    scontext->input_eof = 1;
+  } else {
+    scontext->buffer = LIBRDF_MALLOC(unsigned char*,
+                                     LIBRDF_PARSER_BINARY_BUFFER_SIZE);
+    if(!scontext->buffer) {
+      librdf_parser_binary_stream_finished(scontext);
+      return NULL;
+    }
+  }
+
+  librdf_raptor_reset_bnode_hash(scontext->world);
+
+  if(librdf_parser_binary_read_bytes(scontext, magic,
+                                     LIBRDF_BINARY_MAGIC_LEN)) {
+    librdf_parser_binary_stream_finished(scontext);
+    return NULL;
+  }
+  if(memcmp(magic, LIBRDF_BINARY_MAGIC, LIBRDF_BINARY_MAGIC_LEN)) {
+    librdf_parser_binary_error(scontext, "not librdf binary RDF version 1");
+    librdf_parser_binary_stream_finished(scontext);
+    return NULL;
+  }
+
+  librdf_parser_binary_next(scontext);
+  if(scontext->failed) {
+    librdf_parser_binary_stream_finished(scontext);
+    return NULL;
+  }
+
+  return scontext;
+}
+
+
+static librdf_stream*
+librdf_parser_binary_parse_as_stream(librdf_parser_binary_context* pcontext,
+                                     FILE *fh, int close_fh,
+                                     raptor_iostream *iostr,
+                                     const unsigned char *string,
+                                     size_t length)
+{
+  librdf_parser_binary_stream_context* scontext;
+  librdf_stream* stream;
+
+  scontext = librdf_parser_binary_start(pcontext, fh, close_fh, iostr,
+                                        string, length);
+  if(!scontext)
+    return NULL;
+
+  stream = librdf_new_stream(scontext->world, (void*)scontext,
+                             &librdf_parser_binary_stream_end_of_stream,
+                             &librdf_parser_binary_stream_next_statement,
+                             &librdf_parser_binary_stream_get_statement,
+                             &librdf_parser_binary_stream_finished);
+  if(!stream)
+    librdf_parser_binary_stream_finished(scontext);
+
+  return stream;
+}
+
+
+static int
+librdf_parser_binary_parse_into_model(librdf_parser_binary_context* pcontext,
+                                      FILE *fh, int close_fh,
+                                      raptor_iostream *iostr,
+                                      const unsigned char *string,
+                                      size_t length,
+                                      librdf_model* model)
+{
+  librdf_parser_binary_stream_context* scontext;
+  int rc = 0;
+
+  scontext = librdf_parser_binary_start(pcontext, fh, close_fh, iostr,
+                                        string, length);
+  if(!scontext)
+    return 1;
+
+  while(scontext->current) {
+    if(scontext->current_graph)
+      rc = librdf_model_context_add_statement(model, scontext->current_graph,
+                                              scontext->current);
+    else
+      rc = librdf_model_add_statement(model, scontext->current);
+    if(rc)
+      break;
+    librdf_parser_binary_next(scontext);
+  }
+  if(scontext->failed)
+    rc = 1;
+
+  librdf_parser_binary_stream_finished(scontext);
+
+  return rc;
+}
+
+
+/* Open a file: URI; other URIs are not supported */
+static FILE*
+librdf_parser_binary_open_uri(librdf_parser_binary_context* pcontext,
+                              librdf_uri *uri)
+{
+  librdf_world* world = pcontext->parser->world;
+  char *filename;
+  FILE *fh;
+
+  if(!librdf_uri_is_file_uri(uri)) {
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "librdf binary parser can only read file: URIs");
+    return NULL;
+  }
+
+  filename = (char*)librdf_uri_to_filename(uri);
+  if(!filename)
+    return NULL;
+
+  fh = fopen(filename, "rb");
+  if(!fh)
+    librdf_log(world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "failed to open file '%s' - %s", filename, strerror(errno));
+  SYSTEM_FREE(filename);
+
+  return fh;
+}
+
+
+static librdf_stream*
+librdf_parser_binary_parse_uri_as_stream(void *context, librdf_uri *uri,
+                                         librdf_uri *base_uri)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+  FILE *fh;
+
+  fh = librdf_parser_binary_open_uri(pcontext, uri);
+  if(!fh)
+    return NULL;
+
+  return librdf_parser_binary_parse_as_stream(pcontext, fh, 1, NULL, NULL, 0);
+}
+
+
+static int
+librdf_parser_binary_parse_uri_into_model(void *context, librdf_uri *uri,
+                                          librdf_uri *base_uri,
+                                          librdf_model *model)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+  FILE *fh;
+
+  fh = librdf_parser_binary_open_uri(pcontext, uri);
+  if(!fh)
+    return 1;
+
+  return librdf_parser_binary_parse_into_model(pcontext, fh, 1, NULL, NULL, 0,
+                                               model);
+}
+
+
+static librdf_stream*
+librdf_parser_binary_parse_counted_string_as_stream(void *context,
+                                                    const unsigned char *string,
+                                                    size_t length,
+                                                    librdf_uri *base_uri)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  return librdf_parser_binary_parse_as_stream(pcontext, NULL, 0, NULL,
+                                              string, length);
+}
+
+
+static int
+librdf_parser_binary_parse_counted_string_into_model(void *context,
+                                                     const unsigned char *string,
+                                                     size_t length,
+                                                     librdf_uri *base_uri,
+                                                     librdf_model *model)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  return librdf_parser_binary_parse_into_model(pcontext, NULL, 0, NULL,
+                                               string, length, model);
+}
+
+
+static librdf_stream*
+librdf_parser_binary_parse_iostream_as_stream(void *context,
+                                              raptor_iostream *iostream,
+                                              librdf_uri *base_uri)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  return librdf_parser_binary_parse_as_stream(pcontext, NULL, 0, iostream,
+                                              NULL, 0);
+}
+
+
+static int
+librdf_parser_binary_parse_iostream_into_model(void *context,
+                                               raptor_iostream *iostream,
+                                               librdf_uri *base_uri,
+                                               librdf_model *model)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  return librdf_parser_binary_parse_into_model(pcontext, NULL, 0, iostream,
+                                               NULL, 0, model);
+}
+
+
+static librdf_stream*
+librdf_parser_binary_parse_file_handle_as_stream(void *context, FILE *fh,
+                                                 int close_fh,
+                                                 librdf_uri *base_uri)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  return librdf_parser_binary_parse_as_stream(pcontext, fh, close_fh, NULL,
+                                              NULL, 0);
+}
+
+
+static int
+librdf_parser_binary_parse_file_handle_into_model(void *context, FILE *fh,
+                                                  int close_fh,
+                                                  librdf_uri *base_uri,
+                                                  librdf_model *model)
+{
+  librdf_parser_binary_context* pcontext=(librdf_parser_binary_context*)context;
+
+  return librdf_parser_binary_parse_into_model(pcontext, fh, close_fh, NULL,
+                                               NULL, 0, model);
+}
+
+
+static void
+librdf_parser_binary_register_factory(librdf_parser_factory *factory)
+{
+  factory->context_length = sizeof(librdf_parser_binary_context);
+
+  factory->init = librdf_parser_binary_init;
+  factory->parse_uri_as_stream = librdf_parser_binary_parse_uri_as_stream;
+  factory->parse_uri_into_model = librdf_parser_binary_parse_uri_into_model;
+  factory->parse_counted_string_as_stream = librdf_parser_binary_parse_counted_string_as_stream;
+  factory->parse_counted_string_into_model = librdf_parser_binary_parse_counted_string_into_model;
+  factory->parse_iostream_as_stream = librdf_parser_binary_parse_iostream_as_stream;
+  factory->parse_iostream_into_model = librdf_parser_binary_parse_iostream_into_model;
+  factory->parse_file_handle_as_stream = librdf_parser_binary_parse_file_handle_as_stream;
+  factory->parse_file_handle_into_model = librdf_parser_binary_parse_file_handle_into_model;
+}
+
+
+/**
+ * librdf_parser_binary_constructor:
+ * @world: redland world object
+ *
+ * INTERNAL - Initialise the binary parser module.
+ *
+ **/
+void
+librdf_parser_binary_constructor(librdf_world *world)
+{
+  librdf_parser_register_factory(world, "librdf-binary", "librdf binary RDF",
+                                 LIBRDF_BINARY_MIME_TYPE, NULL,
+                                 &librdf_parser_binary_register_factory);
+}
@@ -39,17 +39,60 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H) && defined(HAVE_SYS_STAT_H)
+#include <sys/mman.h>
+#define LIBRDF_PARSER_RAPTOR_MMAP 1
+#endif
+#ifdef HAVE_CURL
+#include <curl/curl.h>
+#endif
 
 #include <redland.h>
+#include <rdf_types.h>
 
 
 /* serialising implementing functions */
 static int librdf_parser_raptor_serialise_end_of_stream(void* context);
 static int librdf_parser_raptor_serialise_next_statement(void* context);
 static void* librdf_parser_raptor_serialise_get_statement(void* context, int flags);
+static int librdf_parser_raptor_serialise_next_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 static void librdf_parser_raptor_serialise_finished(void* context);
 
 
+/* Default number of statements added to a model at once */
+#define LIBRDF_PARSER_RAPTOR_BATCH_SIZE 10000
+
+/* Default bytes passed to raptor at once when parsing as a stream */
+#define LIBRDF_PARSER_RAPTOR_READ_BUFFER_SIZE 65536
+
+/* Bloom filter bits per expected statement and probes per statement,
+ * about 1% false positives at the expected number of statements */
+#define LIBRDF_PARSER_RAPTOR_DEDUP_BITS 10
+#define LIBRDF_PARSER_RAPTOR_DEDUP_PROBES 7
+
+/* Batches parsed ahead of the storage writer thread when pipelined */
+#define LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH 4
+
+/* Initial slots in the queue of statements waiting to be returned */
+#define LIBRDF_PARSER_RAPTOR_QUEUE_SIZE 64
+
+/* Queued statements above which smaller chunks are passed to raptor */
+#define LIBRDF_PARSER_RAPTOR_QUEUE_HIGH_WATER 4096
+
+/* Smallest number of bytes passed to raptor at once */
+#define LIBRDF_PARSER_RAPTOR_MIN_CHUNK_SIZE 1024
+
+/* Bytes of N-Triples or N-Quads lines given to one parser thread at once */
+#define LIBRDF_PARSER_RAPTOR_CHUNK_SIZE (4 * 1024 * 1024)
+
+
 typedef struct {
   librdf_parser *parser;        /* librdf parser object */
   raptor_parser *rdf_parser;    /* source URI string (for raptor) */
@@ -63,9 +106,58 @@ typedef struct {
 
   raptor_www *www;              /* raptor stream */
   void *stream_context;         /* librdf_parser_raptor_stream_context* */
+
+#ifdef HAVE_CURL
+  /* connection kept between URI parses so HTTP keep-alive is reused */
+  CURL *curl;
+#endif
+
+  /* statements added to a model at once when parsing into a model */
+  int batch_size;
+
+  /* threads parsing line based syntaxes into a model */
+  int threads;
+
+  /* bytes passed to raptor at once when parsing a file as a stream */
+  int read_buffer_size;
+
+  /* non 0 to add batches to the model on a writer thread */
+  int pipeline;
+
+  /* expected distinct statements when dropping duplicates, or 0 */
+  int dedup_expected;
+  /* duplicate statements dropped in the last parse into a model */
+  int duplicates;
+
+  /* compression of files parsed, or AUTO to use the file name */
+  librdf_compression compression;
 } librdf_parser_raptor_context;
 
 
+/* duplicate filter for parsing into a model */
+typedef struct {
+  /* Bloom filter of bits_mask + 1 bits of statements seen */
+  unsigned char *bits;
+  u64 bits_mask;
+
+  /* exact set of the statements in the current batch, by hash, in
+   * slots_mask + 1 open addressed slots */
+  u64 *slot_hashes;
+  librdf_statement** slots;
+  size_t slots_mask;
+
+  /* statement encoding buffer */
+  unsigned char *buffer;
+  size_t buffer_size;
+
+  /* hash of the statement last checked */
+  u64 hash;
+} librdf_parser_raptor_dedup;
+
+
+struct librdf_parser_raptor_pipeline_s;
+
+
 typedef struct {
   librdf_parser_raptor_context* pcontext; /* parser context */
 
@@ -74,22 +166,147 @@ typedef struct {
   /* when true, this FH is closed on finish */
   int close_fh;
 
+  /* when fh is compressed, the decompressed content read instead */
+  raptor_iostream *iostr;
+
   /* when finished */
   int finished;
 
+  /* read buffer of pcontext->read_buffer_size bytes for fh */
+  unsigned char *buffer;
+
+  /* when fh is a regular file it is mapped and chunks of the mapping
+   * are passed to raptor without copying, from map_position */
+  unsigned char *map;
+  size_t map_length;
+  size_t map_position;
+
   /* when storing into a model - librdf_parser_raptor_parse_uri_into_model */
   librdf_model *model;
 
   /* The set of statements pending is a sequence, with 'current'
-   * as the first entry and any remaining ones held in 'statements'.
+   * as the first entry and any remaining ones held in the queue.
    * The latter are filled by the parser
-   * sequence is empty := current=NULL and librdf_list_size(statements)=0
+   * sequence is empty := current=NULL and queue_count=0
    */
   librdf_statement* current; /* current statement */
-  librdf_list* statements;
+
+  /* ring of queue_size slots holding queue_count statements from
+   * queue_head */
+  librdf_statement** queue;
+  int queue_size;
+  int queue_head;
+  int queue_count;
+
+  /* bytes passed to raptor at once from fh, lowered while chunks
+   * queue more than LIBRDF_PARSER_RAPTOR_QUEUE_HIGH_WATER statements */
+  size_t chunk_size;
+
+  /* when storing into a model, statements waiting to be added in one
+   * librdf_model_add_statements() call, all with context batch_context */
+  librdf_statement** batch;
+  int batch_count;
+  librdf_node* batch_context;
+
+  /* writer thread adding the batches, or NULL */
+  struct librdf_parser_raptor_pipeline_s* pipeline;
+
+  /* duplicate filter, or NULL */
+  librdf_parser_raptor_dedup* dedup;
+
+  /* statements handed out by the last stream batch, freed by the next */
+  librdf_statement** pulled;
+  int pulled_count;
+  int pulled_size;
 } librdf_parser_raptor_stream_context;
 
 
+/* stream over the statements of a batch */
+typedef struct {
+  librdf_statement** statements;
+  int count;
+  int offset;
+} librdf_parser_raptor_batch_stream_context;
+
+
+/*
+ * librdf_parser_raptor_queue_push:
+ * @scontext: parser stream context
+ * @statement: statement
+ *
+ * INTERNAL - Add a statement to the end of the queue, growing it if full
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_queue_push(librdf_parser_raptor_stream_context* scontext,
+                                librdf_statement* statement)
+{
+  if(scontext->queue_count == scontext->queue_size) {
+    librdf_statement** queue;
+    int size;
+    int i;
+
+    size = scontext->queue_size ? scontext->queue_size * 2 :
+      LIBRDF_PARSER_RAPTOR_QUEUE_SIZE;
+    queue = LIBRDF_MALLOC(librdf_statement**,
+                          LIBRDF_GOOD_CAST(size_t, size) * sizeof(librdf_statement*));
+    if(!queue)
+      return 1;
+
+    /* unwrap the ring into the new slots */
+    for(i = 0; i < scontext->queue_count; i++)
+      queue[i] = scontext->queue[(scontext->queue_head + i) % scontext->queue_size];
+    if(scontext->queue)
+      LIBRDF_FREE(librdf_statement**, scontext->queue);
+
+    scontext->queue = queue;
+    scontext->queue_size = size;
+    scontext->queue_head = 0;
+  }
+
+  scontext->queue[(scontext->queue_head + scontext->queue_count) % scontext->queue_size] = statement;
+  scontext->queue_count++;
+
+  return 0;
+}
+
+
+/*
+ * librdf_parser_raptor_queue_pop:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Remove the statement at the start of the queue
+ *
+ * A queue grown by a burst of statements is freed once it is empty.
+ *
+ * Return value: statement or NULL if the queue is empty
+ */
+static librdf_statement*
+librdf_parser_raptor_queue_pop(librdf_parser_raptor_stream_context* scontext)
+{
+  librdf_statement* statement;
+
+  if(!scontext->queue_count)
+    return NULL;
+
+  statement = scontext->queue[scontext->queue_head];
+  scontext->queue_head = (scontext->queue_head + 1) % scontext->queue_size;
+  scontext->queue_count--;
+
+  if(!scontext->queue_count) {
+    scontext->queue_head = 0;
+    if(scontext->queue_size > LIBRDF_PARSER_RAPTOR_QUEUE_HIGH_WATER) {
+      LIBRDF_FREE(librdf_statement**, scontext->queue);
+      scontext->queue = NULL;
+      scontext->queue_size = 0;
+    }
+  }
+
+  return statement;
+}
+
+
 static int
 librdf_parser_raptor_relay_filter(void* user_data, raptor_uri* uri)
 {
@@ -126,6 +343,11 @@ librdf_parser_raptor_init(librdf_parser *parser, void *context)
   if(!pcontext->rdf_parser)
     return 1;
 
+  pcontext->batch_size = LIBRDF_PARSER_RAPTOR_BATCH_SIZE;
+  pcontext->threads = 1;
+  pcontext->read_buffer_size = LIBRDF_PARSER_RAPTOR_READ_BUFFER_SIZE;
+  pcontext->compression = LIBRDF_COMPRESSION_AUTO;
+
   librdf_raptor_reset_bnode_hash(parser->world);
 
   return 0;
@@ -152,6 +374,11 @@ librdf_parser_raptor_terminate(void *context)
   if(pcontext->www)
     raptor_free_www(pcontext->www);
 
+#ifdef HAVE_CURL
+  if(pcontext->curl)
+    curl_easy_cleanup(pcontext->curl);
+#endif
+
   if(pcontext->rdf_parser)
     raptor_free_parser(pcontext->rdf_parser);
 
@@ -162,133 +389,1608 @@ librdf_parser_raptor_terminate(void *context)
 }
 
 
+static int
+librdf_parser_raptor_batch_stream_end_of_stream(void* context)
+{
+  librdf_parser_raptor_batch_stream_context* bcontext=(librdf_parser_raptor_batch_stream_context*)context;
+
+  return (bcontext->offset >= bcontext->count);
+}
+
+
+static int
+librdf_parser_raptor_batch_stream_next_statement(void* context)
+{
+  librdf_parser_raptor_batch_stream_context* bcontext=(librdf_parser_raptor_batch_stream_context*)context;
+
+  bcontext->offset++;
+  return (bcontext->offset >= bcontext->count);
+}
+
+
+static void*
+librdf_parser_raptor_batch_stream_get_statement(void* context, int flags)
+{
+  librdf_parser_raptor_batch_stream_context* bcontext=(librdf_parser_raptor_batch_stream_context*)context;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return bcontext->statements[bcontext->offset];
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return NULL;
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_parser_raptor_batch_stream_finished(void* context)
+{
+  /* statements are owned by the parser stream context */
+}
+
+
 /*
- * librdf_parser_raptor_new_statement_handler - helper callback function for raptor RDF when a new triple is asserted
- * @context: context for callback
- * @statement: raptor_statement
+ * librdf_parser_raptor_add_batch:
+ * @world: world
+ * @model: model
+ * @statements: statements
+ * @count: number of @statements
+ * @context_node: context node or NULL
  *
- * Adds the statement to the list of statements.
+ * INTERNAL - Add statements to a model in one call
+ *
+ * The statements are added with one librdf_model_add_statements() or
+ * librdf_model_context_add_statements() call, inside a transaction
+ * when the model can start one.  Neither the statements nor the nodes
+ * are copied or freed, so this may run on the pipeline writer thread.
+ *
+ * Return value: non 0 on failure
  */
-static void
-librdf_parser_raptor_new_statement_handler(void *context,
-                                           raptor_statement *rstatement)
+static int
+librdf_parser_raptor_add_batch(librdf_world* world, librdf_model* model,
+                               librdf_statement** statements, int count,
+                               librdf_node* context_node)
 {
-  librdf_parser_raptor_stream_context* scontext=(librdf_parser_raptor_stream_context*)context;
-  librdf_node* node;
-  librdf_statement* statement;
-  librdf_world* world=scontext->pcontext->parser->world;
+  librdf_parser_raptor_batch_stream_context bcontext;
+  librdf_stream* stream;
+  int transaction;
   int rc;
 
-  statement=librdf_new_statement(world);
-  if(!statement)
-    return;
+  bcontext.statements=statements;
+  bcontext.count=count;
+  bcontext.offset=0;
 
-  if(rstatement->subject->type == RAPTOR_TERM_TYPE_BLANK) {
-    node = librdf_new_node_from_blank_identifier(world, (const unsigned char*)rstatement->subject->value.blank.string);
-  } else if (rstatement->subject->type == RAPTOR_TERM_TYPE_URI) {
-    node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->subject->value.uri);
-  } else {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
-               "Unknown Raptor subject identifier type %d",
-               rstatement->subject->type);
-    librdf_free_statement(statement);
-    return;
-  }
+  stream=librdf_new_stream(world, &bcontext,
+                           librdf_parser_raptor_batch_stream_end_of_stream,
+                           librdf_parser_raptor_batch_stream_next_statement,
+                           librdf_parser_raptor_batch_stream_get_statement,
+                           librdf_parser_raptor_batch_stream_finished);
+  if(!stream)
+    return 1;
 
-  if(!node) {
-    librdf_log(world,
-               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
-               "Cannot create subject node");
-    librdf_free_statement(statement);
-    return;
+  transaction=!librdf_model_transaction_start(model);
+
+  if(context_node)
+    rc=librdf_model_context_add_statements(model, context_node, stream);
+  else
+    rc=librdf_model_add_statements(model, stream);
+  librdf_free_stream(stream);
+
+  if(transaction) {
+    if(rc)
+      librdf_model_transaction_rollback(model);
+    else
+      rc=librdf_model_transaction_commit(model);
   }
 
-  librdf_statement_set_subject(statement, node);
+  return rc;
+}
 
 
-  if(rstatement->predicate->type == RAPTOR_TERM_TYPE_URI) {
-    node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->predicate->value.uri);
-  } else {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
-               "Unknown Raptor predicate identifier type %d",
-               rstatement->predicate->type);
-    librdf_free_statement(statement);
-    return;
-  }
+/* Free statements and the context node of a batch that was added */
+static void
+librdf_parser_raptor_free_batch(librdf_statement** statements, int count,
+                                librdf_node* context_node)
+{
+  int i;
 
-  if(!node) {
-    librdf_log(world,
-               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
-               "Cannot create predicate node");
-    librdf_free_statement(statement);
-    return;
-  }
+  for(i=0; i < count; i++)
+    librdf_free_statement(statements[i]);
 
-  librdf_statement_set_predicate(statement, node);
+  if(context_node)
+    librdf_free_node(context_node);
+}
 
-  if(rstatement->object->type == RAPTOR_TERM_TYPE_LITERAL) {
-    node = librdf_new_node_from_typed_literal(world,
-                                              rstatement->object->value.literal.string,
-                                              (const char *)rstatement->object->value.literal.language,
-                                              (librdf_uri*)rstatement->object->value.literal.datatype);
-  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_BLANK) {
-    node = librdf_new_node_from_blank_identifier(world, rstatement->object->value.blank.string);
-  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_URI) {
-    node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->object->value.uri);
-  } else {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
-               "Unknown Raptor object identifier type %d",
-               rstatement->object->type);
-    librdf_free_statement(statement);
-    return;
-  }
 
-  if(!node) {
-    librdf_log(world,
-               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
-               "Cannot create object node");
-    librdf_free_statement(statement);
-    return;
-  }
+#ifdef WITH_THREADS
 
-  librdf_statement_set_object(statement, node);
+/*
+ * Pipelined parse and store
+ *
+ * Full batches are handed to a writer thread which adds them to the
+ * model while the calling thread parses the next ones, through a ring
+ * of LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH batches.  The writer only
+ * adds statements; the batches come back to the calling thread to be
+ * freed, so node and URI reference counts and the raptor URI table
+ * are only changed by one thread.
+ */
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  if(1) {
-    raptor_iostream *iostr;
-    iostr = raptor_new_iostream_to_file_handle(world->raptor_world_ptr, stderr);
-    librdf_statement_write(statement, iostr);
-    raptor_free_iostream(iostr);
-  }
-#endif
+typedef struct {
+  librdf_statement** statements;
+  int count;
+  librdf_node* context;
+  /* set by the writer */
+  int status;
+} librdf_parser_raptor_pipeline_batch;
 
-  if(scontext->model) {
-    if(librdf_model_supports_contexts(scontext->model) &&
-       rstatement->graph &&
-       (rstatement->graph->type == RAPTOR_TERM_TYPE_URI ||
-        rstatement->graph->type == RAPTOR_TERM_TYPE_BLANK)) {
-      node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->graph->value.uri);
-      rc = librdf_model_context_add_statement(scontext->model, node, statement);
-      librdf_free_node(node);
-    } else {
-      rc = librdf_model_add_statement(scontext->model, statement);
+typedef struct librdf_parser_raptor_pipeline_s {
+  librdf_world* world;
+  librdf_model* model;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  /* signalled when a batch is submitted or added, or on shutdown */
+  pthread_cond_t cond;
+  int shutdown;
+
+  /* batches [released, added) are added and [added, submitted) wait */
+  librdf_parser_raptor_pipeline_batch batches[LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH];
+  unsigned long submitted;
+  unsigned long added;
+  unsigned long released;
+} librdf_parser_raptor_pipeline;
+
+
+static void*
+librdf_parser_raptor_pipeline_run(void* arg)
+{
+  librdf_parser_raptor_pipeline* pipeline=(librdf_parser_raptor_pipeline*)arg;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  while(1) {
+    librdf_parser_raptor_pipeline_batch* batch;
+
+    if(pipeline->added == pipeline->submitted) {
+      if(pipeline->shutdown)
+        break;
+      pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+      continue;
     }
-    librdf_free_statement(statement);
-  } else {
-    rc=librdf_list_add(scontext->statements, statement);
-    if(rc)
-      librdf_free_statement(statement);
+
+    batch=&pipeline->batches[pipeline->added % LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH];
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    batch->status=librdf_parser_raptor_add_batch(pipeline->world,
+                                                 pipeline->model,
+                                                 batch->statements,
+                                                 batch->count,
+                                                 batch->context);
+
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->added++;
+    pthread_cond_broadcast(&pipeline->cond);
   }
-  if(rc) {
-    librdf_log(world,
-               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
-               "Cannot add statement to model");
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  return NULL;
+}
+
+
+/*
+ * librdf_parser_raptor_pipeline_release:
+ * @pipeline: pipeline
+ * @wait: non 0 to wait for all submitted batches
+ *
+ * INTERNAL - Free the batches the writer has added
+ *
+ * Return value: non 0 if adding any of the released batches failed
+ */
+static int
+librdf_parser_raptor_pipeline_release(librdf_parser_raptor_pipeline* pipeline,
+                                      int wait)
+{
+  unsigned long added;
+  int rc=0;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  while(wait && pipeline->added != pipeline->submitted)
+    pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+  added=pipeline->added;
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  while(pipeline->released != added) {
+    librdf_parser_raptor_pipeline_batch* batch;
+
+    batch=&pipeline->batches[pipeline->released % LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH];
+    librdf_parser_raptor_free_batch(batch->statements, batch->count,
+                                    batch->context);
+    batch->count=0;
+    batch->context=NULL;
+    if(batch->status)
+      rc=1;
+    pipeline->released++;
   }
+
+  return rc;
+}
+
+
+/*
+ * librdf_parser_raptor_pipeline_submit:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Hand the buffered batch to the writer thread
+ *
+ * Waits for the writer when LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH
+ * batches are already waiting.  The batch buffer is swapped with the
+ * free slot's buffer so buffers are reused.
+ *
+ * Return value: non 0 if adding an earlier batch failed
+ */
+static int
+librdf_parser_raptor_pipeline_submit(librdf_parser_raptor_stream_context* scontext)
+{
+  librdf_parser_raptor_pipeline* pipeline=scontext->pipeline;
+  librdf_parser_raptor_pipeline_batch* batch;
+  librdf_statement** statements;
+  int rc;
+
+  rc=librdf_parser_raptor_pipeline_release(pipeline, 0);
+
+  if(pipeline->submitted - pipeline->released == LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH) {
+    pthread_mutex_lock(&pipeline->mutex);
+    while(pipeline->added == pipeline->released)
+      pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+    pthread_mutex_unlock(&pipeline->mutex);
+
+    if(librdf_parser_raptor_pipeline_release(pipeline, 0))
+      rc=1;
+  }
+
+  batch=&pipeline->batches[pipeline->submitted % LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH];
+  statements=batch->statements;
+  batch->statements=scontext->batch;
+  batch->count=scontext->batch_count;
+  batch->context=scontext->batch_context;
+  batch->status=0;
+
+  /* a slot buffer is NULL until first used; the batch buffer is then
+   * allocated again by librdf_parser_raptor_batch_statement() */
+  scontext->batch=statements;
+  scontext->batch_count=0;
+  scontext->batch_context=NULL;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->submitted++;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  return rc;
+}
+
+
+/*
+ * librdf_parser_raptor_pipeline_start:
+ * @scontext: parser stream context storing into a model
+ *
+ * INTERNAL - Start the writer thread
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_pipeline_start(librdf_parser_raptor_stream_context* scontext)
+{
+  librdf_parser_raptor_pipeline* pipeline;
+
+  pipeline = LIBRDF_CALLOC(librdf_parser_raptor_pipeline*, 1,
+                           sizeof(*pipeline));
+  if(!pipeline)
+    return 1;
+
+  pipeline->world=scontext->pcontext->parser->world;
+  pipeline->model=scontext->model;
+  pthread_mutex_init(&pipeline->mutex, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+
+  if(pthread_create(&pipeline->thread, NULL,
+                    librdf_parser_raptor_pipeline_run, pipeline)) {
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->mutex);
+    LIBRDF_FREE(librdf_parser_raptor_pipeline, pipeline);
+    return 1;
+  }
+
+  scontext->pipeline=pipeline;
+  return 0;
+}
+
+
+/*
+ * librdf_parser_raptor_pipeline_finish:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Wait for the writer thread to add all batches and stop it
+ *
+ * Return value: non 0 if adding any batch failed
+ */
+static int
+librdf_parser_raptor_pipeline_finish(librdf_parser_raptor_stream_context* scontext)
+{
+  librdf_parser_raptor_pipeline* pipeline=scontext->pipeline;
+  int rc;
+  int i;
+
+  if(!pipeline)
+    return 0;
+
+  rc=librdf_parser_raptor_pipeline_release(pipeline, 1);
+
+  pthread_mutex_lock(&pipeline->mutex);
+  pipeline->shutdown=1;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+  pthread_join(pipeline->thread, NULL);
+
+  for(i=0; i < LIBRDF_PARSER_RAPTOR_PIPELINE_DEPTH; i++) {
+    if(pipeline->batches[i].statements)
+      LIBRDF_FREE(librdf_statement**, pipeline->batches[i].statements);
+  }
+
+  pthread_cond_destroy(&pipeline->cond);
+  pthread_mutex_destroy(&pipeline->mutex);
+  LIBRDF_FREE(librdf_parser_raptor_pipeline, pipeline);
+  scontext->pipeline=NULL;
+
+  if(rc)
+    librdf_log(scontext->pcontext->parser->world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot add statements to model");
+
+  return rc;
+}
+
+#endif
+
+
+/*
+ * librdf_parser_raptor_flush_batch:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Add the buffered statements to the model
+ *
+ * The batch is added with librdf_parser_raptor_add_batch(), or handed
+ * to the writer thread when pipelined.  The batch is emptied either
+ * way.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_flush_batch(librdf_parser_raptor_stream_context* scontext)
+{
+  librdf_world* world=scontext->pcontext->parser->world;
+  int rc;
+
+  if(!scontext->batch_count)
+    return 0;
+
+  if(scontext->dedup)
+    librdf_parser_raptor_dedup_clear_batch(scontext->dedup);
+
+#ifdef WITH_THREADS
+  if(scontext->pipeline) {
+    rc=librdf_parser_raptor_pipeline_submit(scontext);
+    if(rc)
+      librdf_log(world,
+                 0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+                 "Cannot add statements to model");
+    return rc;
+  }
+#endif
+
+  rc=librdf_parser_raptor_add_batch(world, scontext->model, scontext->batch,
+                                    scontext->batch_count,
+                                    scontext->batch_context);
+
+  librdf_parser_raptor_free_batch(scontext->batch, scontext->batch_count,
+                                  scontext->batch_context);
+  scontext->batch_count=0;
+  scontext->batch_context=NULL;
+
+  if(rc)
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot add statements to model");
+
+  return rc;
+}
+
+
+/*
+ * librdf_parser_raptor_batch_statement:
+ * @scontext: parser stream context
+ * @context_node: context node or NULL (shared)
+ * @statement: statement (ownership taken)
+ *
+ * INTERNAL - Buffer a statement to add to the model
+ *
+ * The buffered statements are added when the batch is full or the
+ * context changes.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_batch_statement(librdf_parser_raptor_stream_context* scontext,
+                                     librdf_node* context_node,
+                                     librdf_statement* statement)
+{
+  int batch_size=scontext->pcontext->batch_size;
+
+  if(scontext->batch_count &&
+     !(context_node ? (scontext->batch_context &&
+                       librdf_node_equals(context_node,
+                                          scontext->batch_context))
+                    : !scontext->batch_context))
+    librdf_parser_raptor_flush_batch(scontext);
+
+  /* a flush may hand the buffer to the pipeline writer */
+  if(!scontext->batch) {
+    scontext->batch = LIBRDF_CALLOC(librdf_statement**,
+                                    LIBRDF_GOOD_CAST(size_t, batch_size),
+                                    sizeof(librdf_statement*));
+    if(!scontext->batch) {
+      librdf_free_statement(statement);
+      return 1;
+    }
+  }
+
+  if(!scontext->batch_count && context_node) {
+    scontext->batch_context=librdf_new_node_from_node(context_node);
+    if(!scontext->batch_context) {
+      librdf_free_statement(statement);
+      return 1;
+    }
+  }
+
+  scontext->batch[scontext->batch_count++]=statement;
+  if(scontext->dedup)
+    librdf_parser_raptor_dedup_remember(scontext->dedup, statement);
+
+  if(scontext->batch_count == batch_size)
+    return librdf_parser_raptor_flush_batch(scontext);
+
+  return 0;
+}
+
+
+/*
+ * Duplicate filter
+ *
+ * Each statement parsed into a model is hashed with its context and
+ * looked up in a Bloom filter.  A statement the filter has not seen
+ * is new.  Otherwise it is checked exactly against the statements in
+ * the current batch and then the model, and dropped if found, before
+ * any storage add is attempted.  The model is not checked while a
+ * pipeline writer thread is adding to it, or for statements in a
+ * context, so those duplicates still reach the storage as before.
+ */
+
+static librdf_parser_raptor_dedup*
+librdf_parser_raptor_new_dedup(int expected, int batch_size)
+{
+  librdf_parser_raptor_dedup* dedup;
+  u64 bits = 1024;
+  size_t slots = 16;
+
+  dedup = LIBRDF_CALLOC(librdf_parser_raptor_dedup*, 1, sizeof(*dedup));
+  if(!dedup)
+    return NULL;
+
+  while(bits < (u64)expected * LIBRDF_PARSER_RAPTOR_DEDUP_BITS)
+    bits <<= 1;
+  dedup->bits = LIBRDF_CALLOC(unsigned char*, LIBRDF_GOOD_CAST(size_t, bits / 8), 1);
+  dedup->bits_mask = bits - 1;
+
+  if(batch_size > 1) {
+    while(slots < LIBRDF_GOOD_CAST(size_t, batch_size) * 2)
+      slots <<= 1;
+    dedup->slot_hashes = LIBRDF_CALLOC(u64*, slots, sizeof(u64));
+    dedup->slots = LIBRDF_CALLOC(librdf_statement**, slots,
+                                 sizeof(librdf_statement*));
+    dedup->slots_mask = slots - 1;
+  }
+
+  if(!dedup->bits || (batch_size > 1 && (!dedup->slot_hashes || !dedup->slots))) {
+    if(dedup->bits)
+      LIBRDF_FREE(char*, dedup->bits);
+    if(dedup->slot_hashes)
+      LIBRDF_FREE(u64*, dedup->slot_hashes);
+    if(dedup->slots)
+      LIBRDF_FREE(librdf_statement**, dedup->slots);
+    LIBRDF_FREE(librdf_parser_raptor_dedup, dedup);
+    return NULL;
+  }
+
+  return dedup;
+}
+
+
+static void
+librdf_parser_raptor_free_dedup(librdf_parser_raptor_dedup* dedup)
+{
+  LIBRDF_FREE(char*, dedup->bits);
+  if(dedup->slot_hashes)
+    LIBRDF_FREE(u64*, dedup->slot_hashes);
+  if(dedup->slots)
+    LIBRDF_FREE(librdf_statement**, dedup->slots);
+  if(dedup->buffer)
+    LIBRDF_FREE(char*, dedup->buffer);
+  LIBRDF_FREE(librdf_parser_raptor_dedup, dedup);
+}
+
+
+/* Forget the statements of the batch that was added */
+static void
+librdf_parser_raptor_dedup_clear_batch(librdf_parser_raptor_dedup* dedup)
+{
+  if(dedup->slots)
+    memset(dedup->slots, 0, (dedup->slots_mask + 1) * sizeof(librdf_statement*));
+}
+
+
+/*
+ * librdf_parser_raptor_dedup_remember:
+ * @dedup: duplicate filter
+ * @statement: statement just added to the batch and last checked
+ *
+ * INTERNAL - Add a batched statement to the exact set of the batch
+ */
+static void
+librdf_parser_raptor_dedup_remember(librdf_parser_raptor_dedup* dedup,
+                                    librdf_statement* statement)
+{
+  size_t i;
+
+  if(!dedup->slots)
+    return;
+
+  for(i = (size_t)dedup->hash & dedup->slots_mask; dedup->slots[i];
+      i = (i + 1) & dedup->slots_mask)
+    ;
+  dedup->slots[i] = statement;
+  dedup->slot_hashes[i] = dedup->hash;
+}
+
+
+/*
+ * librdf_parser_raptor_is_duplicate:
+ * @scontext: parser stream context
+ * @context_node: context node or NULL
+ * @statement: statement
+ *
+ * INTERNAL - Check if a statement to add to the model was seen before
+ *
+ * Return value: non 0 if the statement is a duplicate to drop
+ */
+static int
+librdf_parser_raptor_is_duplicate(librdf_parser_raptor_stream_context* scontext,
+                                  librdf_node* context_node,
+                                  librdf_statement* statement)
+{
+  librdf_parser_raptor_dedup* dedup=scontext->dedup;
+  librdf_world* world=scontext->pcontext->parser->world;
+  size_t len;
+  size_t i;
+  u64 hash = 14695981039346656037ULL;
+  u64 h2;
+  int seen = 1;
+  int probe;
+
+  len = librdf_statement_encode_parts2(world, statement, context_node,
+                                       NULL, 0, LIBRDF_STATEMENT_ALL);
+  if(!len)
+    return 0;
+  if(len > dedup->buffer_size) {
+    if(dedup->buffer)
+      LIBRDF_FREE(char*, dedup->buffer);
+    dedup->buffer_size = len * 2;
+    dedup->buffer = LIBRDF_MALLOC(unsigned char*, dedup->buffer_size);
+    if(!dedup->buffer) {
+      dedup->buffer_size = 0;
+      return 0;
+    }
+  }
+  len = librdf_statement_encode_parts2(world, statement, context_node,
+                                       dedup->buffer, dedup->buffer_size,
+                                       LIBRDF_STATEMENT_ALL);
+
+  /* FNV-1a */
+  for(i = 0; i < len; i++) {
+    hash ^= dedup->buffer[i];
+    hash *= 1099511628211ULL;
+  }
+  dedup->hash = hash;
+
+  /* double hashing for the probes */
+  h2 = (hash >> 32) | 1;
+  for(probe = 0; probe < LIBRDF_PARSER_RAPTOR_DEDUP_PROBES; probe++) {
+    u64 bit = (hash + (u64)probe * h2) & dedup->bits_mask;
+    unsigned char mask = LIBRDF_GOOD_CAST(unsigned char, 1 << (bit & 7));
+
+    if(!(dedup->bits[bit >> 3] & mask)) {
+      seen = 0;
+      dedup->bits[bit >> 3] |= mask;
+    }
+  }
+  if(!seen)
+    return 0;
+
+  /* exact checks: the current batch, which has one context */
+  if(dedup->slots && scontext->batch_count &&
+     (context_node ? (scontext->batch_context &&
+                      librdf_node_equals(context_node, scontext->batch_context))
+                   : !scontext->batch_context)) {
+    for(i = (size_t)hash & dedup->slots_mask; dedup->slots[i];
+        i = (i + 1) & dedup->slots_mask) {
+      if(dedup->slot_hashes[i] == hash &&
+         librdf_statement_equals(dedup->slots[i], statement))
+        return 1;
+    }
+  }
+
+  /* then the model */
+  if(!context_node && !scontext->pipeline &&
+     librdf_model_contains_statement(scontext->model, statement) > 0)
+    return 1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_parser_raptor_add_to_model:
+ * @scontext: parser stream context
+ * @context_node: context node or NULL (shared)
+ * @statement: statement (ownership taken)
+ *
+ * INTERNAL - Add a parsed statement to the model, or to the batch
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_add_to_model(librdf_parser_raptor_stream_context* scontext,
+                                  librdf_node* context_node,
+                                  librdf_statement* statement)
+{
+  int rc;
+
+  if(scontext->dedup &&
+     librdf_parser_raptor_is_duplicate(scontext, context_node, statement)) {
+    scontext->pcontext->duplicates++;
+    librdf_free_statement(statement);
+    return 0;
+  }
+
+  if(scontext->pcontext->batch_size > 1) {
+    /* errors in adding a batch are logged by the flush */
+    librdf_parser_raptor_batch_statement(scontext, context_node, statement);
+    return 0;
+  }
+
+  if(context_node)
+    rc = librdf_model_context_add_statement(scontext->model, context_node,
+                                            statement);
+  else
+    rc = librdf_model_add_statement(scontext->model, statement);
+  librdf_free_statement(statement);
+
+  return rc;
+}
+
+
+/*
+ * librdf_parser_raptor_new_statement_handler - helper callback function for raptor RDF when a new triple is asserted
+ * @context: context for callback
+ * @statement: raptor_statement
+ *
+ * Adds the statement to the list of statements.
+ */
+static void
+librdf_parser_raptor_new_statement_handler(void *context,
+                                           raptor_statement *rstatement)
+{
+  librdf_parser_raptor_stream_context* scontext=(librdf_parser_raptor_stream_context*)context;
+  librdf_node* node;
+  librdf_statement* statement;
+  librdf_world* world=scontext->pcontext->parser->world;
+  int rc;
+
+  statement=librdf_new_statement(world);
+  if(!statement)
+    return;
+
+  if(rstatement->subject->type == RAPTOR_TERM_TYPE_BLANK) {
+    node = librdf_new_node_from_blank_identifier(world, (const unsigned char*)rstatement->subject->value.blank.string);
+  } else if (rstatement->subject->type == RAPTOR_TERM_TYPE_URI) {
+    node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->subject->value.uri);
+  } else {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "Unknown Raptor subject identifier type %d",
+               rstatement->subject->type);
+    librdf_free_statement(statement);
+    return;
+  }
+
+  if(!node) {
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot create subject node");
+    librdf_free_statement(statement);
+    return;
+  }
+
+  node = librdf_node_intern(world, node, NULL, 0);
+  librdf_statement_set_subject(statement, node);
+
+
+  if(rstatement->predicate->type == RAPTOR_TERM_TYPE_URI) {
+    node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->predicate->value.uri);
+  } else {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "Unknown Raptor predicate identifier type %d",
+               rstatement->predicate->type);
+    librdf_free_statement(statement);
+    return;
+  }
+
+  if(!node) {
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot create predicate node");
+    librdf_free_statement(statement);
+    return;
+  }
+
+  node = librdf_node_intern(world, node, NULL, 0);
+  librdf_statement_set_predicate(statement, node);
+
+  if(rstatement->object->type == RAPTOR_TERM_TYPE_LITERAL) {
+    node = librdf_new_node_from_typed_literal(world,
+                                              rstatement->object->value.literal.string,
+                                              (const char *)rstatement->object->value.literal.language,
+                                              (librdf_uri*)rstatement->object->value.literal.datatype);
+  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_BLANK) {
+    node = librdf_new_node_from_blank_identifier(world, rstatement->object->value.blank.string);
+  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_URI) {
+    node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->object->value.uri);
+  } else {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "Unknown Raptor object identifier type %d",
+               rstatement->object->type);
+    librdf_free_statement(statement);
+    return;
+  }
+
+  if(!node) {
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot create object node");
+    librdf_free_statement(statement);
+    return;
+  }
+
+  node = librdf_node_intern(world, node, NULL, 0);
+  librdf_statement_set_object(statement, node);
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  if(1) {
+    raptor_iostream *iostr;
+    iostr = raptor_new_iostream_to_file_handle(world->raptor_world_ptr, stderr);
+    librdf_statement_write(statement, iostr);
+    raptor_free_iostream(iostr);
+  }
+#endif
+
+  if(scontext->model) {
+    node = NULL;
+    if(librdf_model_supports_contexts(scontext->model) &&
+       rstatement->graph &&
+       (rstatement->graph->type == RAPTOR_TERM_TYPE_URI ||
+        rstatement->graph->type == RAPTOR_TERM_TYPE_BLANK))
+      node = librdf_new_node_from_uri(world, (librdf_uri*)rstatement->graph->value.uri);
+
+    rc = librdf_parser_raptor_add_to_model(scontext, node, statement);
+    if(node)
+      librdf_free_node(node);
+  } else {
+    rc=librdf_parser_raptor_queue_push(scontext, statement);
+    if(rc)
+      librdf_free_statement(statement);
+  }
+  if(rc) {
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot add statement to model");
+  }
+}
+
+
+#ifdef WITH_THREADS
+
+/*
+ * Parallel parsing of N-Triples and N-Quads into a model
+ *
+ * The input is read in chunks of LIBRDF_PARSER_RAPTOR_CHUNK_SIZE bytes
+ * cut after the last newline, and each chunk is parsed by one of a
+ * pool of threads.  raptor worlds are not shared between threads, so
+ * each thread has its own raptor world and parser and packs the terms
+ * of each statement as strings.  The calling thread takes the chunks
+ * back in input order and makes the nodes and statements in the
+ * librdf world, mapping blank node identifiers through the world
+ * bnode map so they keep the scope of the whole document.
+ */
+
+typedef enum {
+  LIBRDF_PARSER_RAPTOR_JOB_EMPTY,
+  LIBRDF_PARSER_RAPTOR_JOB_PENDING,
+  LIBRDF_PARSER_RAPTOR_JOB_RUNNING,
+  LIBRDF_PARSER_RAPTOR_JOB_DONE
+} librdf_parser_raptor_job_state;
+
+/* term types in packed statements */
+#define LIBRDF_PARSER_RAPTOR_TERM_NONE    0
+#define LIBRDF_PARSER_RAPTOR_TERM_URI     1
+#define LIBRDF_PARSER_RAPTOR_TERM_BLANK   2
+#define LIBRDF_PARSER_RAPTOR_TERM_LITERAL 3
+
+typedef struct {
+  librdf_parser_raptor_job_state state;
+
+  /* whole lines to parse */
+  unsigned char *input;
+  size_t input_len;
+  size_t input_size;
+
+  /* byte offset of the input in the document, for messages */
+  unsigned long offset;
+
+  /* packed statements: 4 terms of a type byte and strings of a
+   * size_t length, the bytes and a NUL */
+  unsigned char *output;
+  size_t output_len;
+  size_t output_size;
+
+  /* non 0 if the output could not be grown */
+  int failed;
+
+  int errors;
+  int warnings;
+  /* first error message or NULL */
+  char *error_message;
+} librdf_parser_raptor_job;
+
+struct librdf_parser_raptor_pool_s;
+
+typedef struct {
+  struct librdf_parser_raptor_pool_s* pool;
+  pthread_t thread;
+  int started;
+  raptor_world* rworld;
+  raptor_parser* rparser;
+  raptor_uri* base_uri;
+  /* job being parsed */
+  librdf_parser_raptor_job* job;
+} librdf_parser_raptor_worker;
+
+typedef struct librdf_parser_raptor_pool_s {
+  pthread_mutex_t mutex;
+  /* signalled when a job is pending or on shutdown */
+  pthread_cond_t work_cond;
+  /* signalled when a job is done */
+  pthread_cond_t done_cond;
+  int shutdown;
+
+  /* ring of jobs, taken by the workers in order */
+  librdf_parser_raptor_job* jobs;
+  int jobs_count;
+  unsigned long next_job;
+
+  librdf_parser_raptor_worker* workers;
+  int workers_count;
+} librdf_parser_raptor_pool;
+
+
+/* Grow a buffer to at least size bytes keeping the first len bytes */
+static int
+librdf_parser_raptor_grow_buffer(unsigned char **buffer_p, size_t *size_p,
+                                 size_t len, size_t size)
+{
+  unsigned char *buffer;
+  size_t new_size = *size_p ? *size_p : LIBRDF_PARSER_RAPTOR_CHUNK_SIZE;
+
+  while(new_size < size)
+    new_size <<= 1;
+  if(new_size == *size_p)
+    return 0;
+
+  buffer = LIBRDF_MALLOC(unsigned char*, new_size);
+  if(!buffer)
+    return 1;
+  if(*buffer_p) {
+    memcpy(buffer, *buffer_p, len);
+    LIBRDF_FREE(char*, *buffer_p);
+  }
+  *buffer_p = buffer;
+  *size_p = new_size;
+
+  return 0;
+}
+
+
+/* Make room for len more bytes of job output */
+static int
+librdf_parser_raptor_job_reserve(librdf_parser_raptor_job* job, size_t len)
+{
+  if(job->output_len + len <= job->output_size)
+    return 0;
+
+  return librdf_parser_raptor_grow_buffer(&job->output, &job->output_size,
+                                          job->output_len,
+                                          job->output_len + len);
+}
+
+
+static int
+librdf_parser_raptor_job_pack_string(librdf_parser_raptor_job* job,
+                                     const unsigned char *string, size_t len)
+{
+  if(librdf_parser_raptor_job_reserve(job, sizeof(size_t) + len + 1))
+    return 1;
+
+  memcpy(job->output + job->output_len, &len, sizeof(size_t));
+  job->output_len += sizeof(size_t);
+  if(len)
+    memcpy(job->output + job->output_len, string, len);
+  job->output_len += len;
+  job->output[job->output_len++] = '\0';
+
+  return 0;
+}
+
+
+static int
+librdf_parser_raptor_job_pack_term(librdf_parser_raptor_job* job,
+                                   raptor_term* term)
+{
+  const unsigned char *string;
+  size_t len;
+  int type;
+
+  if(!term)
+    type = LIBRDF_PARSER_RAPTOR_TERM_NONE;
+  else if(term->type == RAPTOR_TERM_TYPE_URI)
+    type = LIBRDF_PARSER_RAPTOR_TERM_URI;
+  else if(term->type == RAPTOR_TERM_TYPE_BLANK)
+    type = LIBRDF_PARSER_RAPTOR_TERM_BLANK;
+  else if(term->type == RAPTOR_TERM_TYPE_LITERAL)
+    type = LIBRDF_PARSER_RAPTOR_TERM_LITERAL;
+  else
+    type = LIBRDF_PARSER_RAPTOR_TERM_NONE;
+
+  if(librdf_parser_raptor_job_reserve(job, 1))
+    return 1;
+  job->output[job->output_len++] = LIBRDF_GOOD_CAST(unsigned char, type);
+
+  switch(type) {
+    case LIBRDF_PARSER_RAPTOR_TERM_URI:
+      string = raptor_uri_as_counted_string(term->value.uri, &len);
+      return librdf_parser_raptor_job_pack_string(job, string, len);
+
+    case LIBRDF_PARSER_RAPTOR_TERM_BLANK:
+      return librdf_parser_raptor_job_pack_string(job,
+                                                  term->value.blank.string,
+                                                  term->value.blank.string_len);
+
+    case LIBRDF_PARSER_RAPTOR_TERM_LITERAL:
+      if(librdf_parser_raptor_job_pack_string(job,
+                                              term->value.literal.string,
+                                              term->value.literal.string_len))
+        return 1;
+      if(librdf_parser_raptor_job_pack_string(job,
+                                              term->value.literal.language,
+                                              term->value.literal.language ? term->value.literal.language_len : 0))
+        return 1;
+      if(term->value.literal.datatype)
+        string = raptor_uri_as_counted_string(term->value.literal.datatype,
+                                              &len);
+      else {
+        string = NULL;
+        len = 0;
+      }
+      return librdf_parser_raptor_job_pack_string(job, string, len);
+
+    default:
+      return 0;
+  }
+}
+
+
+static void
+librdf_parser_raptor_worker_statement_handler(void *user_data,
+                                              raptor_statement *rstatement)
+{
+  librdf_parser_raptor_worker* worker=(librdf_parser_raptor_worker*)user_data;
+  librdf_parser_raptor_job* job=worker->job;
+  size_t output_len=job->output_len;
+
+  if(job->failed)
+    return;
+
+  if(librdf_parser_raptor_job_pack_term(job, rstatement->subject) ||
+     librdf_parser_raptor_job_pack_term(job, rstatement->predicate) ||
+     librdf_parser_raptor_job_pack_term(job, rstatement->object) ||
+     librdf_parser_raptor_job_pack_term(job, rstatement->graph)) {
+    /* drop the partly packed statement */
+    job->output_len = output_len;
+    job->failed = 1;
+  }
+}
+
+
+static void
+librdf_parser_raptor_worker_log_handler(void *user_data,
+                                        raptor_log_message *message)
+{
+  librdf_parser_raptor_worker* worker=(librdf_parser_raptor_worker*)user_data;
+  librdf_parser_raptor_job* job=worker->job;
+
+  if(!job)
+    return;
+
+  if(message->level >= RAPTOR_LOG_LEVEL_ERROR) {
+    if(!job->errors++ && message->text) {
+      size_t len = strlen(message->text);
+
+      job->error_message = LIBRDF_MALLOC(char*, len + 1);
+      if(job->error_message)
+        memcpy(job->error_message, message->text, len + 1);
+    }
+  } else if(message->level == RAPTOR_LOG_LEVEL_WARN)
+    job->warnings++;
+}
+
+
+static void*
+librdf_parser_raptor_worker_run(void* arg)
+{
+  librdf_parser_raptor_worker* worker=(librdf_parser_raptor_worker*)arg;
+  librdf_parser_raptor_pool* pool=worker->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  while(!pool->shutdown) {
+    librdf_parser_raptor_job* job;
+
+    job = &pool->jobs[pool->next_job % LIBRDF_GOOD_CAST(unsigned long, pool->jobs_count)];
+    if(job->state != LIBRDF_PARSER_RAPTOR_JOB_PENDING) {
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+      continue;
+    }
+
+    job->state = LIBRDF_PARSER_RAPTOR_JOB_RUNNING;
+    pool->next_job++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    worker->job = job;
+    if(raptor_parser_parse_start(worker->rparser, worker->base_uri) ||
+       raptor_parser_parse_chunk(worker->rparser, job->input, job->input_len,
+                                 1)) {
+      if(!job->errors)
+        job->errors = 1;
+    }
+    worker->job = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    job->state = LIBRDF_PARSER_RAPTOR_JOB_DONE;
+    pthread_cond_broadcast(&pool->done_cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+
+/* Get the next packed string from job output at *offset_p */
+static const unsigned char*
+librdf_parser_raptor_job_unpack_string(librdf_parser_raptor_job* job,
+                                       size_t *offset_p, size_t *len_p)
+{
+  const unsigned char *string;
+  size_t len;
+
+  memcpy(&len, job->output + *offset_p, sizeof(size_t));
+  string = job->output + *offset_p + sizeof(size_t);
+  *offset_p += sizeof(size_t) + len + 1;
+  if(len_p)
+    *len_p = len;
+
+  return string;
+}
+
+
+/* Make a node from the packed term at *offset_p; sets *type_p */
+static librdf_node*
+librdf_parser_raptor_job_unpack_term(librdf_world* world,
+                                     librdf_parser_raptor_job* job,
+                                     size_t *offset_p, int *type_p)
+{
+  const unsigned char *string;
+  const unsigned char *language;
+  const unsigned char *datatype;
+  size_t len;
+  librdf_node* node = NULL;
+  librdf_uri* datatype_uri = NULL;
+  unsigned char *mapped_id;
+
+  *type_p = job->output[(*offset_p)++];
+
+  switch(*type_p) {
+    case LIBRDF_PARSER_RAPTOR_TERM_URI:
+      string = librdf_parser_raptor_job_unpack_string(job, offset_p, NULL);
+      node = librdf_new_node_from_uri_string(world, string);
+      break;
+
+    case LIBRDF_PARSER_RAPTOR_TERM_BLANK:
+      string = librdf_parser_raptor_job_unpack_string(job, offset_p, NULL);
+      mapped_id = librdf_raptor_map_bnodeid(world, string);
+      if(mapped_id) {
+        node = librdf_new_node_from_blank_identifier(world, mapped_id);
+        LIBRDF_FREE(char*, mapped_id);
+      }
+      break;
+
+    case LIBRDF_PARSER_RAPTOR_TERM_LITERAL:
+      string = librdf_parser_raptor_job_unpack_string(job, offset_p, NULL);
+      language = librdf_parser_raptor_job_unpack_string(job, offset_p, &len);
+      if(!len)
+        language = NULL;
+      datatype = librdf_parser_raptor_job_unpack_string(job, offset_p, &len);
+      if(len) {
+        datatype_uri = librdf_new_uri(world, datatype);
+        if(!datatype_uri)
+          break;
+      }
+      node = librdf_new_node_from_typed_literal(world, string,
+                                                (const char*)language,
+                                                datatype_uri);
+      if(datatype_uri)
+        librdf_free_uri(datatype_uri);
+      break;
+
+    default:
+      return NULL;
+  }
+
+  if(node)
+    node = librdf_node_intern(world, node, NULL, 0);
+
+  return node;
+}
+
+
+/*
+ * librdf_parser_raptor_consume_job:
+ * @scontext: parser stream context
+ * @job: finished job
+ *
+ * INTERNAL - Add the statements parsed by a job to the model
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_consume_job(librdf_parser_raptor_stream_context* scontext,
+                                 librdf_parser_raptor_job* job)
+{
+  librdf_parser_raptor_context* pcontext=scontext->pcontext;
+  librdf_world* world=pcontext->parser->world;
+  int supports_contexts=librdf_model_supports_contexts(scontext->model);
+  size_t offset=0;
+  int rc=0;
+
+  while(offset < job->output_len) {
+    librdf_node* nodes[4];
+    int types[4];
+    librdf_statement* statement;
+    int i;
+
+    for(i=0; i < 4; i++)
+      nodes[i] = librdf_parser_raptor_job_unpack_term(world, job, &offset,
+                                                      &types[i]);
+
+    if(!nodes[0] || !nodes[1] || !nodes[2] ||
+       (types[3] != LIBRDF_PARSER_RAPTOR_TERM_NONE && !nodes[3])) {
+      for(i=0; i < 4; i++)
+        if(nodes[i])
+          librdf_free_node(nodes[i]);
+      rc=1;
+      continue;
+    }
+
+    if(nodes[3] && (!supports_contexts ||
+                    types[3] == LIBRDF_PARSER_RAPTOR_TERM_LITERAL)) {
+      librdf_free_node(nodes[3]);
+      nodes[3] = NULL;
+    }
+
+    statement=librdf_new_statement_from_nodes(world, nodes[0], nodes[1],
+                                              nodes[2]);
+    if(!statement)
+      rc=1;
+    else if(librdf_parser_raptor_add_to_model(scontext, nodes[3], statement))
+      rc=1;
+
+    if(nodes[3])
+      librdf_free_node(nodes[3]);
+  }
+
+  if(rc || job->failed)
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot add statement to model");
+
+  if(job->errors)
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "%s parser: %s in lines starting at byte %lu",
+               pcontext->parser_name,
+               job->error_message ? job->error_message : "parse error",
+               job->offset);
+
+  pcontext->errors += job->errors;
+  pcontext->warnings += job->warnings;
+
+  return (rc || job->failed);
+}
+
+
+/*
+ * librdf_parser_raptor_fill_job:
+ * @job: empty job
+ * @fh: input
+ * @carry_p: pointer to bytes after the last newline of the previous chunk
+ * @carry_size_p: pointer to size of the *@carry_p buffer
+ * @carry_len_p: pointer to length of the bytes in *@carry_p
+ *
+ * INTERNAL - Read whole lines into a job
+ *
+ * The job gets the carried bytes and the input read up to the last
+ * newline, or to the end of the input; the bytes after the last
+ * newline are carried to the next job.  A job with no input is only
+ * returned at the end of the input.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_fill_job(librdf_parser_raptor_job* job, FILE *fh,
+                              unsigned char **carry_p, size_t *carry_size_p,
+                              size_t *carry_len_p)
+{
+  size_t len = *carry_len_p;
+  size_t end;
+
+  /* room for the carried bytes and at least as much input again */
+  if(librdf_parser_raptor_grow_buffer(&job->input, &job->input_size, 0,
+                                      len * 2))
+    return 1;
+
+  if(len)
+    memcpy(job->input, *carry_p, len);
+
+  while(1) {
+    size_t want = job->input_size - len;
+    size_t nread = fread(job->input + len, 1, want, fh);
+
+    len += nread;
+    if(nread < want) {
+      end = len;
+      break;
+    }
+
+    /* cut after the last newline */
+    for(end = len; end > 0 && job->input[end - 1] != '\n'; end--)
+      ;
+    if(end)
+      break;
+
+    /* no newline in the whole buffer; read more of the line */
+    if(librdf_parser_raptor_grow_buffer(&job->input, &job->input_size, len,
+                                        job->input_size * 2))
+      return 1;
+  }
+
+  *carry_len_p = len - end;
+  if(*carry_len_p) {
+    if(librdf_parser_raptor_grow_buffer(carry_p, carry_size_p, 0,
+                                        *carry_len_p))
+      return 1;
+    memcpy(*carry_p, job->input + end, *carry_len_p);
+  }
+
+  job->input_len = end;
+  job->output_len = 0;
+  job->failed = 0;
+  job->errors = 0;
+  job->warnings = 0;
+  if(job->error_message) {
+    LIBRDF_FREE(char*, job->error_message);
+    job->error_message = NULL;
+  }
+
+  return 0;
+}
+
+
+static void
+librdf_parser_raptor_free_pool(librdf_parser_raptor_pool* pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for(i = 0; i < pool->workers_count; i++) {
+    librdf_parser_raptor_worker* worker = &pool->workers[i];
+
+    if(worker->started)
+      pthread_join(worker->thread, NULL);
+    if(worker->base_uri)
+      raptor_free_uri(worker->base_uri);
+    if(worker->rparser)
+      raptor_free_parser(worker->rparser);
+    if(worker->rworld)
+      raptor_free_world(worker->rworld);
+  }
+
+  for(i = 0; i < pool->jobs_count; i++) {
+    librdf_parser_raptor_job* job = &pool->jobs[i];
+
+    if(job->input)
+      LIBRDF_FREE(char*, job->input);
+    if(job->output)
+      LIBRDF_FREE(char*, job->output);
+    if(job->error_message)
+      LIBRDF_FREE(char*, job->error_message);
+  }
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->mutex);
+
+  if(pool->workers)
+    LIBRDF_FREE(librdf_parser_raptor_worker*, pool->workers);
+  if(pool->jobs)
+    LIBRDF_FREE(librdf_parser_raptor_job*, pool->jobs);
+  LIBRDF_FREE(librdf_parser_raptor_pool, pool);
+}
+
+
+static librdf_parser_raptor_pool*
+librdf_parser_raptor_new_pool(librdf_parser_raptor_context* pcontext,
+                              librdf_uri* base_uri)
+{
+  librdf_parser_raptor_pool* pool;
+  int threads = pcontext->threads;
+  int i;
+
+  pool = LIBRDF_CALLOC(librdf_parser_raptor_pool*, 1, sizeof(*pool));
+  if(!pool)
+    return NULL;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  /* let the reader run one chunk ahead of each thread */
+  pool->jobs_count = threads * 2;
+  pool->jobs = LIBRDF_CALLOC(librdf_parser_raptor_job*,
+                             LIBRDF_GOOD_CAST(size_t, pool->jobs_count),
+                             sizeof(librdf_parser_raptor_job));
+  pool->workers = LIBRDF_CALLOC(librdf_parser_raptor_worker*,
+                                LIBRDF_GOOD_CAST(size_t, threads),
+                                sizeof(librdf_parser_raptor_worker));
+  if(!pool->jobs || !pool->workers) {
+    librdf_parser_raptor_free_pool(pool);
+    return NULL;
+  }
+
+  /* raptor worlds and parsers are made here rather than in the threads
+   * since raptor world construction is not thread safe */
+  for(i = 0; i < threads; i++) {
+    librdf_parser_raptor_worker* worker = &pool->workers[i];
+
+    pool->workers_count++;
+    worker->pool = pool;
+
+    worker->rworld = raptor_new_world();
+    if(!worker->rworld || raptor_world_open(worker->rworld))
+      break;
+    raptor_world_set_log_handler(worker->rworld, worker,
+                                 librdf_parser_raptor_worker_log_handler);
+
+    worker->rparser = raptor_new_parser(worker->rworld, pcontext->parser_name);
+    if(!worker->rparser)
+      break;
+    raptor_parser_set_statement_handler(worker->rparser, worker,
+                                        librdf_parser_raptor_worker_statement_handler);
+
+    if(base_uri) {
+      worker->base_uri = raptor_new_uri(worker->rworld,
+                                        librdf_uri_as_string(base_uri));
+      if(!worker->base_uri)
+        break;
+    }
+
+    if(pthread_create(&worker->thread, NULL, librdf_parser_raptor_worker_run,
+                      worker))
+      break;
+    worker->started = 1;
+  }
+
+  if(i < threads) {
+    librdf_parser_raptor_free_pool(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+
+/*
+ * librdf_parser_raptor_parse_parallel:
+ * @scontext: parser stream context storing into a model
+ * @fh: input
+ * @base_uri: base URI or NULL
+ *
+ * INTERNAL - Parse N-Triples or N-Quads lines into a model with a thread pool
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_parse_parallel(librdf_parser_raptor_stream_context* scontext,
+                                    FILE *fh, librdf_uri* base_uri)
+{
+  librdf_parser_raptor_context* pcontext=scontext->pcontext;
+  librdf_parser_raptor_pool* pool;
+  unsigned char *carry = NULL;
+  size_t carry_size = 0;
+  size_t carry_len = 0;
+  unsigned long offset = 0;
+  unsigned long submitted = 0;
+  unsigned long consumed = 0;
+  unsigned long jobs_count;
+  int at_eof = 0;
+  int status = 0;
+
+  pool = librdf_parser_raptor_new_pool(pcontext, base_uri);
+  if(!pool) {
+    librdf_log(pcontext->parser->world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "Cannot start %d %s parser threads", pcontext->threads,
+               pcontext->parser_name);
+    return -1;
+  }
+  jobs_count = LIBRDF_GOOD_CAST(unsigned long, pool->jobs_count);
+
+  while(!at_eof || consumed < submitted) {
+    librdf_parser_raptor_job* job;
+
+    if(!at_eof && !status && submitted - consumed < jobs_count) {
+      job = &pool->jobs[submitted % jobs_count];
+      if(librdf_parser_raptor_fill_job(job, fh, &carry, &carry_size,
+                                       &carry_len)) {
+        status = -1;
+        at_eof = 1;
+        continue;
+      }
+      if(!job->input_len) {
+        at_eof = 1;
+        continue;
+      }
+
+      job->offset = offset;
+      offset += job->input_len;
+
+      pthread_mutex_lock(&pool->mutex);
+      job->state = LIBRDF_PARSER_RAPTOR_JOB_PENDING;
+      pthread_cond_signal(&pool->work_cond);
+      pthread_mutex_unlock(&pool->mutex);
+      submitted++;
+      continue;
+    }
+
+    if(status)
+      at_eof = 1;
+
+    job = &pool->jobs[consumed % jobs_count];
+    pthread_mutex_lock(&pool->mutex);
+    while(job->state != LIBRDF_PARSER_RAPTOR_JOB_DONE)
+      pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(librdf_parser_raptor_consume_job(scontext, job) && !status)
+      status = -1;
+    if(job->errors && !status)
+      status = 1;
+
+    pthread_mutex_lock(&pool->mutex);
+    job->state = LIBRDF_PARSER_RAPTOR_JOB_EMPTY;
+    pthread_mutex_unlock(&pool->mutex);
+    consumed++;
+  }
+
+  librdf_parser_raptor_free_pool(pool);
+  if(carry)
+    LIBRDF_FREE(char*, carry);
+
+  return status;
+}
+
+
+/*
+ * librdf_parser_raptor_open_parallel:
+ * @pcontext: parser context
+ * @uri: URI to parse or NULL
+ * @fh: file handle to parse or NULL
+ * @close_fh_p: set to non 0 if the returned file handle is to be closed
+ *
+ * INTERNAL - Get the input of a parse that can be done in parallel
+ *
+ * Return value: file handle or NULL if the parse is not parallel
+ */
+static FILE*
+librdf_parser_raptor_open_parallel(librdf_parser_raptor_context* pcontext,
+                                   librdf_uri* uri, FILE *fh,
+                                   int *close_fh_p)
+{
+  *close_fh_p = 0;
+
+  if(pcontext->threads < 2)
+    return NULL;
+
+  if(strcmp(pcontext->parser_name, "ntriples") &&
+     strcmp(pcontext->parser_name, "nquads"))
+    return NULL;
+
+  if(fh)
+    return fh;
+
+  if(uri && librdf_uri_is_file_uri(uri)) {
+    char* filename=(char*)librdf_uri_to_filename(uri);
+
+    if(!filename)
+      return NULL;
+    fh=fopen(filename, "r");
+    SYSTEM_FREE(filename);
+
+    /* failures are reported by the normal parse */
+    if(fh)
+      *close_fh_p = 1;
+    return fh;
+  }
+
+  return NULL;
 }
 
+#endif
+
+
 
 /*
  * librdf_parser_raptor_namespace_handler - helper callback function for raptor RDF when a namespace is seen
@@ -334,32 +2036,106 @@ librdf_parser_raptor_namespace_handler(void* user_data,
 }
 
 
-/* FIXME: Yeah?  What about it? */
-#define RAPTOR_IO_BUFFER_LEN 1024
-
-
+#ifdef LIBRDF_PARSER_RAPTOR_MMAP
 /*
- * librdf_parser_raptor_get_next_statement - helper function to get the next statement
- * @context: serialisation context
+ * librdf_parser_raptor_map_file_handle:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Map the rest of a regular file to parse it without reads
  *
- * Return value: >0 if a statement found, 0 at end of file, or <0 on error
+ * The stream is left reading with fread() if the file cannot be mapped.
  */
+static void
+librdf_parser_raptor_map_file_handle(librdf_parser_raptor_stream_context* scontext)
+{
+  struct stat st;
+  long offset;
+  void *map;
+  int fd;
+
+  fd = fileno(scontext->fh);
+  if(fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+    return;
+
+  /* start where the FILE* is, counting any data it buffered */
+  offset = ftell(scontext->fh);
+  if(offset < 0 || (off_t)offset >= st.st_size)
+    return;
+
+  map = mmap(NULL, LIBRDF_GOOD_CAST(size_t, st.st_size), PROT_READ,
+             MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED)
+    return;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, LIBRDF_GOOD_CAST(size_t, st.st_size), MADV_SEQUENTIAL);
+#endif
+
+  scontext->map = (unsigned char*)map;
+  scontext->map_length = LIBRDF_GOOD_CAST(size_t, st.st_size);
+  scontext->map_position = LIBRDF_GOOD_CAST(size_t, offset);
+}
+#endif
+
+
 static int
 librdf_parser_raptor_get_next_statement(librdf_parser_raptor_stream_context *context) {
-  unsigned char buffer[RAPTOR_IO_BUFFER_LEN];
+  size_t read_buffer_size;
+  size_t chunk_size;
+  int is_end = 0;
   int status=0;
 
   if(context->finished || !context->fh)
     return 0;
 
+  read_buffer_size = LIBRDF_GOOD_CAST(size_t, context->pcontext->read_buffer_size);
+  if(!context->chunk_size)
+    context->chunk_size = read_buffer_size;
+  chunk_size = context->chunk_size;
+
+  if(!context->map && !context->buffer) {
+    context->buffer = LIBRDF_MALLOC(unsigned char*, read_buffer_size);
+    if(!context->buffer) {
+      context->finished=1;
+      return -1;
+    }
+  }
+
   context->current=NULL;
-  while(!feof(context->fh)) {
+  while(1) {
+    const unsigned char *chunk;
     size_t len;
     int ret;
 
-    len = fread(buffer, 1, RAPTOR_IO_BUFFER_LEN, context->fh);
-    ret = raptor_parser_parse_chunk(context->pcontext->rdf_parser, buffer, len,
-                                    (len < RAPTOR_IO_BUFFER_LEN));
+#ifdef LIBRDF_PARSER_RAPTOR_MMAP
+    if(context->map) {
+      len = context->map_length - context->map_position;
+      if(len > chunk_size)
+        len = chunk_size;
+      chunk = context->map + context->map_position;
+      context->map_position += len;
+      is_end = (context->map_position == context->map_length);
+    } else
+#endif
+    if(context->iostr) {
+      int nread;
+
+      nread = raptor_iostream_read_bytes(context->buffer, 1, chunk_size,
+                                         context->iostr);
+      if(nread < 0) {
+        status=(-1);
+        break;
+      }
+      len = LIBRDF_GOOD_CAST(size_t, nread);
+      chunk = context->buffer;
+      is_end = (len < chunk_size);
+    } else {
+      len = fread(context->buffer, 1, chunk_size, context->fh);
+      chunk = context->buffer;
+      is_end = (len < chunk_size);
+    }
+
+    ret = raptor_parser_parse_chunk(context->pcontext->rdf_parser, chunk, len,
+                                    is_end);
 
     if(ret) {
       status=(-1);
@@ -367,17 +2143,30 @@ librdf_parser_raptor_get_next_statement(librdf_parser_raptor_stream_context *con
     }
 
     /* parsing found at least 1 statement, return */
-    if(librdf_list_size(context->statements)) {
-      context->current=(librdf_statement*)librdf_list_pop(context->statements);
+    if(context->queue_count) {
+      /* Statements are only queued by whole chunks, so pass less
+       * input at once after a burst over the high water mark and
+       * return to the full chunk size once bursts are small again */
+      if(context->queue_count > LIBRDF_PARSER_RAPTOR_QUEUE_HIGH_WATER) {
+        if(chunk_size / 2 >= LIBRDF_PARSER_RAPTOR_MIN_CHUNK_SIZE)
+          context->chunk_size = chunk_size / 2;
+      } else if(context->queue_count < LIBRDF_PARSER_RAPTOR_QUEUE_HIGH_WATER / 4 &&
+                chunk_size < read_buffer_size) {
+        context->chunk_size = chunk_size * 2;
+        if(context->chunk_size > read_buffer_size)
+          context->chunk_size = read_buffer_size;
+      }
+
+      context->current=librdf_parser_raptor_queue_pop(context);
       status=1;
       break;
     }
 
-    if(len < RAPTOR_IO_BUFFER_LEN)
+    if(is_end)
       break;
   }
 
-  if(feof(context->fh) || status <1)
+  if(is_end || status <1)
     context->finished=1;
 
   return status;
@@ -385,19 +2174,58 @@ librdf_parser_raptor_get_next_statement(librdf_parser_raptor_stream_context *con
 
 
 /*
- * librdf_parser_raptor_parse_file_handle_as_stream:
+ * librdf_parser_raptor_compression:
+ * @pcontext: parser context
+ * @uri: URI to parse or NULL
+ * @fh: file handle to parse or NULL
+ *
+ * INTERNAL - Get the compression of a parse input
+ *
+ * Only files are decompressed: file URIs and file handles as set by
+ * the compression feature, or by default file URIs with names ending
+ * in .gz or .zst.  HTTP content encodings are left to the WWW code.
+ *
+ * Return value: compression
+ */
+static librdf_compression
+librdf_parser_raptor_compression(librdf_parser_raptor_context* pcontext,
+                                 librdf_uri* uri, FILE *fh)
+{
+  librdf_compression compression;
+  char* filename;
+
+  if(!fh && !(uri && librdf_uri_is_file_uri(uri)))
+    return LIBRDF_COMPRESSION_NONE;
+
+  if(pcontext->compression != LIBRDF_COMPRESSION_AUTO || fh)
+    return librdf_compression_choose(pcontext->compression, NULL);
+
+  filename=(char*)librdf_uri_to_filename(uri);
+  if(!filename)
+    return LIBRDF_COMPRESSION_NONE;
+  compression = librdf_compression_from_filename(filename);
+  SYSTEM_FREE(filename);
+
+  return compression;
+}
+
+
+/*
+ * librdf_parser_raptor_parse_file_handle_as_stream_common:
  * @context: parser context
  * @fh: FILE* of content source
  * @close_fh: if true to fclose(fh) on finish
+ * @compression: compression of the content of @fh
  * @base_uri: #librdf_uri URI of the content location
  *
- * Retrieve content from FILE* @fh and parse it into a #librdf_stream.
+ * INTERNAL - Retrieve content from FILE* @fh and parse it into a #librdf_stream.
  *
  **/
 static librdf_stream*
-librdf_parser_raptor_parse_file_handle_as_stream(void *context,
-                                                 FILE *fh, int close_fh,
-                                                 librdf_uri *base_uri)
+librdf_parser_raptor_parse_file_handle_as_stream_common(void *context,
+                                                        FILE *fh, int close_fh,
+                                                        librdf_compression compression,
+                                                        librdf_uri *base_uri)
 {
   librdf_parser_raptor_context* pcontext=(librdf_parser_raptor_context*)context;
   librdf_parser_raptor_stream_context* scontext;
@@ -438,10 +2266,6 @@ librdf_parser_raptor_parse_file_handle_as_stream(void *context,
   scontext->pcontext=pcontext;
   pcontext->stream_context=scontext;
 
-  scontext->statements=librdf_new_list(pcontext->parser->world);
-  if(!scontext->statements)
-    goto oom;
-
   if(pcontext->nspace_prefixes)
     raptor_free_sequence(pcontext->nspace_prefixes);
   pcontext->nspace_prefixes=raptor_new_sequence(free, NULL);
@@ -463,6 +2287,18 @@ librdf_parser_raptor_parse_file_handle_as_stream(void *context,
 
   scontext->fh=fh;
   scontext->close_fh=close_fh;
+  if(compression != LIBRDF_COMPRESSION_NONE) {
+    scontext->iostr = librdf_new_decompressed_iostream_from_file_handle(pcontext->parser->world,
+                                                                        fh, compression);
+    if(!scontext->iostr) {
+      librdf_parser_raptor_serialise_finished((void*)scontext);
+      return NULL;
+    }
+  }
+#ifdef LIBRDF_PARSER_RAPTOR_MMAP
+  else
+    librdf_parser_raptor_map_file_handle(scontext);
+#endif
 
   if(pcontext->parser->uri_filter)
     raptor_parser_set_uri_filter(pcontext->rdf_parser,
@@ -474,7 +2310,7 @@ librdf_parser_raptor_parse_file_handle_as_stream(void *context,
 
   rc = raptor_parser_parse_start(pcontext->rdf_parser, (raptor_uri*)base_uri);
   if(!rc) {
-    /* start parsing; initialises scontext->statements, scontext->current */
+    /* start parsing; initialises the queue and scontext->current */
     librdf_parser_raptor_get_next_statement(scontext);
 
     stream=librdf_new_stream(pcontext->parser->world,
@@ -487,6 +2323,9 @@ librdf_parser_raptor_parse_file_handle_as_stream(void *context,
   if(!stream)
     goto oom;
 
+  librdf_stream_set_next_batch_method(stream,
+                                      &librdf_parser_raptor_serialise_next_batch);
+
   return stream;
 
   /* Clean up and report an error on OOM */
@@ -499,6 +2338,65 @@ librdf_parser_raptor_parse_file_handle_as_stream(void *context,
 }
 
 
+/*
+ * librdf_parser_raptor_parse_file_handle_as_stream:
+ * @context: parser context
+ * @fh: FILE* of content source
+ * @close_fh: if true to fclose(fh) on finish
+ * @base_uri: #librdf_uri URI of the content location
+ *
+ * Retrieve content from FILE* @fh and parse it into a #librdf_stream.
+ *
+ **/
+static librdf_stream*
+librdf_parser_raptor_parse_file_handle_as_stream(void *context,
+                                                 FILE *fh, int close_fh,
+                                                 librdf_uri *base_uri)
+{
+  librdf_parser_raptor_context* pcontext=(librdf_parser_raptor_context*)context;
+
+  return librdf_parser_raptor_parse_file_handle_as_stream_common(context,
+                                                                 fh, close_fh,
+                                                                 librdf_parser_raptor_compression(pcontext, NULL, fh),
+                                                                 base_uri);
+}
+
+
+/*
+ * librdf_parser_raptor_get_connection:
+ * @pcontext: parser context
+ *
+ * INTERNAL - Get the connection kept for URI parses
+ *
+ * With libcurl, one easy handle is kept per parser so later fetches
+ * from the same host reuse the open connection, and compressed
+ * responses are asked for and decoded by libcurl as they arrive.
+ * raptor only uses the handle when its WWW support is libcurl.
+ *
+ * Return value: connection or NULL to let raptor make one per fetch
+ */
+static void*
+librdf_parser_raptor_get_connection(librdf_parser_raptor_context* pcontext)
+{
+#ifdef HAVE_CURL
+  if(!pcontext->curl) {
+    pcontext->curl = curl_easy_init();
+    if(pcontext->curl) {
+      /* "" is every encoding libcurl can decode: gzip, deflate, ... */
+#if LIBCURL_VERSION_NUM >= 0x071506
+      curl_easy_setopt(pcontext->curl, CURLOPT_ACCEPT_ENCODING, "");
+#else
+      curl_easy_setopt(pcontext->curl, CURLOPT_ENCODING, "");
+#endif
+    }
+  }
+  return pcontext->curl;
+#else
+  return NULL;
+#endif
+}
+
+
 static void
 librdf_parser_raptor_parse_uri_as_stream_write_bytes_handler(raptor_www *www,
                                                              void *userdata,
@@ -589,8 +2487,10 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
     }
 
     /* stream will close FH */
-    stream=librdf_parser_raptor_parse_file_handle_as_stream(context, fh, 1,
-                                                            base_uri);
+    stream=librdf_parser_raptor_parse_file_handle_as_stream_common(context,
+                                                                   fh, 1,
+                                                                   librdf_parser_raptor_compression(pcontext, uri, NULL),
+                                                                   base_uri);
 
     SYSTEM_FREE(filename);
     return stream;
@@ -605,10 +2505,6 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
   scontext->pcontext=pcontext;
   pcontext->stream_context=scontext;
 
-  scontext->statements=librdf_new_list(pcontext->parser->world);
-  if(!scontext->statements)
-    goto oom;
-
   if(pcontext->nspace_prefixes)
     raptor_free_sequence(pcontext->nspace_prefixes);
   pcontext->nspace_prefixes=raptor_new_sequence(free, NULL);
@@ -634,11 +2530,17 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
 
   if(uri) {
     const char *accept_h;
+    void *connection;
 
     if(pcontext->www)
       raptor_free_www(pcontext->www);
 
-    pcontext->www = raptor_new_www(pcontext->parser->world->raptor_world_ptr);
+    connection = librdf_parser_raptor_get_connection(pcontext);
+    if(connection)
+      pcontext->www = raptor_new_www_with_connection(pcontext->parser->world->raptor_world_ptr,
+                                                     connection);
+    else
+      pcontext->www = raptor_new_www(pcontext->parser->world->raptor_world_ptr);
     if(!pcontext->www)
       goto oom;
 
@@ -701,7 +2603,7 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
 
 
   /* get first statement, else is empty */
-  scontext->current=(librdf_statement*)librdf_list_pop(scontext->statements);
+  scontext->current=librdf_parser_raptor_queue_pop(scontext);
 
   stream=librdf_new_stream(pcontext->parser->world,
                            (void*)scontext,
@@ -712,6 +2614,9 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
   if(!stream)
     goto oom;
 
+  librdf_stream_set_next_batch_method(stream,
+                                      &librdf_parser_raptor_serialise_next_batch);
+
   return stream;
 
   /* Clean up and report an error on OOM */
@@ -846,6 +2751,14 @@ librdf_parser_raptor_parse_into_model_common(void *context,
   librdf_parser_raptor_stream_context* scontext;
   int need_base_uri;
   const raptor_syntax_description *desc;
+  FILE *parallel_fh = NULL;
+#ifdef WITH_THREADS
+  int close_parallel_fh = 0;
+  librdf_storage* storage;
+#endif
+  librdf_compression compression;
+  FILE *compressed_fh = NULL;
+  raptor_iostream *compressed_iostr = NULL;
 
   if(!base_uri)
     base_uri=uri;
@@ -871,6 +2784,7 @@ librdf_parser_raptor_parse_into_model_common(void *context,
 
   pcontext->errors=0;
   pcontext->warnings=0;
+  pcontext->duplicates=0;
 
   scontext = LIBRDF_CALLOC(librdf_parser_raptor_stream_context*, 1,
                            sizeof(*scontext));
@@ -901,14 +2815,82 @@ librdf_parser_raptor_parse_into_model_common(void *context,
   /* direct into model */
   scontext->model=model;
 
+  if(pcontext->dedup_expected > 0) {
+    scontext->dedup=librdf_parser_raptor_new_dedup(pcontext->dedup_expected,
+                                                   pcontext->batch_size);
+    if(!scontext->dedup)
+      goto oom;
+  }
+
   if(pcontext->parser->uri_filter)
     raptor_parser_set_uri_filter(pcontext->rdf_parser,
                                  librdf_parser_raptor_relay_filter,
                                  pcontext->parser);
 
-  if(uri) {
-    status = raptor_parser_parse_uri(pcontext->rdf_parser, (raptor_uri*)uri,
-                                     (raptor_uri*)base_uri);
+  /* compressed files are parsed from a decompressing iostream */
+  compression = librdf_parser_raptor_compression(pcontext, uri, fh);
+  if(compression != LIBRDF_COMPRESSION_NONE) {
+    if(!fh) {
+      char* filename=(char*)librdf_uri_to_filename(uri);
+
+      if(!filename)
+        goto oom;
+      compressed_fh=fopen(filename, "rb");
+      if(!compressed_fh)
+        librdf_log(pcontext->parser->world, 0, LIBRDF_LOG_ERROR,
+                   LIBRDF_FROM_PARSER, NULL, "failed to open file '%s' - %s",
+                   filename, strerror(errno));
+      SYSTEM_FREE(filename);
+      if(!compressed_fh) {
+        librdf_parser_raptor_serialise_finished((void*)scontext);
+        return 1;
+      }
+    }
+
+    compressed_iostr = librdf_new_decompressed_iostream_from_file_handle(pcontext->parser->world,
+                                                                         fh ? fh : compressed_fh,
+                                                                         compression);
+    if(!compressed_iostr) {
+      if(compressed_fh)
+        fclose(compressed_fh);
+      librdf_parser_raptor_serialise_finished((void*)scontext);
+      return 1;
+    }
+    iostream = compressed_iostr;
+    uri = NULL;
+    fh = NULL;
+  }
+
+#ifdef WITH_THREADS
+  if(!compressed_iostr)
+    parallel_fh = librdf_parser_raptor_open_parallel(pcontext, uri, fh,
+                                                     &close_parallel_fh);
+
+  /* pipelining hands whole batches to the writer.  Recording changes
+   * copies the statements, changing node usage counts that the parser
+   * thread also changes, so models with change handlers are not
+   * pipelined */
+  storage = librdf_model_get_storage(model);
+  if(pcontext->pipeline && pcontext->batch_size > 1 &&
+     !(storage && librdf_storage_changes_active(storage)) &&
+     librdf_parser_raptor_pipeline_start(scontext))
+    librdf_log(pcontext->parser->world,
+               0, LIBRDF_LOG_WARN, LIBRDF_FROM_PARSER, NULL,
+               "Cannot start storage writer thread, adding statements in the parser thread");
+#endif
+
+  if(parallel_fh) {
+#ifdef WITH_THREADS
+    status = librdf_parser_raptor_parse_parallel(scontext, parallel_fh,
+                                                 base_uri);
+    if(close_parallel_fh)
+      fclose(parallel_fh);
+#endif
+  } else if(uri) {
+    status = raptor_parser_parse_uri_with_connection(pcontext->rdf_parser,
+                                                     (raptor_uri*)uri,
+                                                     (raptor_uri*)base_uri,
+                                                     librdf_parser_raptor_get_connection(pcontext));
   } else if (string != NULL) {
     status = raptor_parser_parse_start(pcontext->rdf_parser, (raptor_uri*)base_uri);
     if(!status) {
@@ -925,6 +2907,20 @@ librdf_parser_raptor_parse_into_model_common(void *context,
     status = -1;
   }
 
+  if(compressed_iostr) {
+    raptor_free_iostream(compressed_iostr);
+    if(compressed_fh)
+      fclose(compressed_fh);
+  }
+
+  /* add any statements still buffered */
+  if(librdf_parser_raptor_flush_batch(scontext) && !status)
+    status = 1;
+#ifdef WITH_THREADS
+  if(librdf_parser_raptor_pipeline_finish(scontext) && !status)
+    status = 1;
+#endif
+
   librdf_parser_raptor_serialise_finished((void*)scontext);
 
   return status;
@@ -1078,7 +3074,52 @@ librdf_parser_raptor_serialise_end_of_stream(void* context)
 {
   librdf_parser_raptor_stream_context* scontext=(librdf_parser_raptor_stream_context*)context;
 
-  return (!scontext->current && !librdf_list_size(scontext->statements));
+  return (!scontext->current && !scontext->queue_count);
+}
+
+
+/*
+ * librdf_parser_raptor_serialise_advance:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Make the next queued statement current, parsing more when the queue is empty
+ *
+ * Return value: non 0 at end of stream
+ */
+static int
+librdf_parser_raptor_serialise_advance(librdf_parser_raptor_stream_context* scontext)
+{
+  /* get another statement if there is one */
+  while(!scontext->current) {
+    scontext->current=librdf_parser_raptor_queue_pop(scontext);
+    if(scontext->current)
+      break;
+
+    /* else get a new one */
+
+    /* 0 is end, <0 is error.  Either way stop */
+    if(librdf_parser_raptor_get_next_statement(scontext) <=0)
+      break;
+  }
+
+  return (scontext->current == NULL);
+}
+
+
+/*
+ * librdf_parser_raptor_free_pulled:
+ * @scontext: parser stream context
+ *
+ * INTERNAL - Free the statements handed out by the last stream batch
+ */
+static void
+librdf_parser_raptor_free_pulled(librdf_parser_raptor_stream_context* scontext)
+{
+  int i;
+
+  for(i=0; i < scontext->pulled_count; i++)
+    librdf_free_statement(scontext->pulled[i]);
+  scontext->pulled_count=0;
 }
 
 
@@ -1098,20 +3139,59 @@ librdf_parser_raptor_serialise_next_statement(void* context)
   librdf_free_statement(scontext->current);
   scontext->current=NULL;
 
-  /* get another statement if there is one */
-  while(!scontext->current) {
-    scontext->current=(librdf_statement*)librdf_list_pop(scontext->statements);
-    if(scontext->current)
-      break;
+  return librdf_parser_raptor_serialise_advance(scontext);
+}
 
-    /* else get a new one */
 
-    /* 0 is end, <0 is error.  Either way stop */
-    if(librdf_parser_raptor_get_next_statement(scontext) <=0)
-      break;
+/*
+ * librdf_parser_raptor_serialise_next_batch:
+ * @context: the context passed in by #librdf_stream
+ * @statements: array to store the statements in
+ * @contexts: array to store the contexts in
+ * @size: size of the arrays
+ *
+ * INTERNAL - Get the statements parsed from the current one on
+ *
+ * The statements are handed over from the queue as they are, without
+ * a copy, and kept until the next batch or the stream is finished.
+ *
+ * Return value: number of statements, 0 at end or <0 on failure
+ */
+static int
+librdf_parser_raptor_serialise_next_batch(void* context,
+                                          librdf_statement** statements,
+                                          librdf_node** contexts, int size)
+{
+  librdf_parser_raptor_stream_context* scontext=(librdf_parser_raptor_stream_context*)context;
+  int count=0;
+
+  librdf_parser_raptor_free_pulled(scontext);
+
+  if(size > scontext->pulled_size) {
+    librdf_statement** pulled;
+
+    pulled = LIBRDF_MALLOC(librdf_statement**,
+                           LIBRDF_GOOD_CAST(size_t, size) * sizeof(librdf_statement*));
+    if(!pulled)
+      return -1;
+    if(scontext->pulled)
+      LIBRDF_FREE(librdf_statement**, scontext->pulled);
+    scontext->pulled = pulled;
+    scontext->pulled_size = size;
   }
 
-  return (scontext->current == NULL);
+  while(count < size && scontext->current) {
+    scontext->pulled[count] = scontext->current;
+    scontext->pulled_count = count + 1;
+    statements[count] = scontext->current;
+    contexts[count] = NULL;
+    count++;
+
+    scontext->current=NULL;
+    librdf_parser_raptor_serialise_advance(scontext);
+  }
+
+  return count;
 }
 
 
@@ -1165,12 +3245,38 @@ librdf_parser_raptor_serialise_finished(void* context)
     if(scontext->current)
       librdf_free_statement(scontext->current);
 
-    if(scontext->statements) {
-      while((statement=(librdf_statement*)librdf_list_pop(scontext->statements)))
-        librdf_free_statement(statement);
-      librdf_free_list(scontext->statements);
+    if(scontext->pulled) {
+      librdf_parser_raptor_free_pulled(scontext);
+      LIBRDF_FREE(librdf_statement**, scontext->pulled);
+    }
+
+    while((statement=librdf_parser_raptor_queue_pop(scontext)))
+      librdf_free_statement(statement);
+    if(scontext->queue)
+      LIBRDF_FREE(librdf_statement**, scontext->queue);
+
+    if(scontext->batch) {
+      int i;
+
+      for(i=0; i < scontext->batch_count; i++)
+        librdf_free_statement(scontext->batch[i]);
+      LIBRDF_FREE(librdf_statement**, scontext->batch);
     }
+    if(scontext->batch_context)
+      librdf_free_node(scontext->batch_context);
+
+    if(scontext->dedup)
+      librdf_parser_raptor_free_dedup(scontext->dedup);
+
+#ifdef LIBRDF_PARSER_RAPTOR_MMAP
+    if(scontext->map)
+      munmap(scontext->map, scontext->map_length);
+#endif
+    if(scontext->buffer)
+      LIBRDF_FREE(char*, scontext->buffer);
 
+    if(scontext->iostr)
+      raptor_free_iostream(scontext->iostr);
     if(scontext->fh && scontext->close_fh)
       fclose(scontext->fh);
 
@@ -1184,6 +3290,66 @@ librdf_parser_raptor_serialise_finished(void* context)
 }
 
 
+/*
+ * librdf_parser_raptor_get_memory_size:
+ * @pcontext: parser context
+ *
+ * INTERNAL - Get the approximate bytes held by the parse in progress
+ *
+ * Counts the statements queued to be returned or waiting in the batch
+ * for the model, the read buffer and the duplicate filter.  Batches
+ * handed to the pipeline writer thread are not counted.
+ *
+ * Return value: size in bytes, 0 when not parsing
+ */
+static size_t
+librdf_parser_raptor_get_memory_size(librdf_parser_raptor_context* pcontext)
+{
+  librdf_parser_raptor_stream_context* scontext;
+  size_t size;
+  int i;
+
+  scontext = (librdf_parser_raptor_stream_context*)pcontext->stream_context;
+  if(!scontext)
+    return 0;
+
+  size = sizeof(*scontext);
+
+  if(scontext->buffer)
+    size += LIBRDF_GOOD_CAST(size_t, pcontext->read_buffer_size);
+
+  if(scontext->current)
+    size += librdf_statement_get_memory_size(scontext->current);
+
+  size += LIBRDF_GOOD_CAST(size_t, scontext->queue_size) * sizeof(librdf_statement*);
+  for(i = 0; i < scontext->queue_count; i++)
+    size += librdf_statement_get_memory_size(scontext->queue[(scontext->queue_head + i) % scontext->queue_size]);
+
+  if(scontext->batch) {
+    size += LIBRDF_GOOD_CAST(size_t, pcontext->batch_size) * sizeof(librdf_statement*);
+    for(i = 0; i < scontext->batch_count; i++)
+      size += librdf_statement_get_memory_size(scontext->batch[i]);
+  }
+
+  if(scontext->pulled) {
+    size += LIBRDF_GOOD_CAST(size_t, scontext->pulled_size) * sizeof(librdf_statement*);
+    for(i = 0; i < scontext->pulled_count; i++)
+      size += librdf_statement_get_memory_size(scontext->pulled[i]);
+  }
+
+  if(scontext->dedup) {
+    librdf_parser_raptor_dedup* dedup = scontext->dedup;
+
+    size += sizeof(*dedup) + dedup->buffer_size;
+    size += LIBRDF_GOOD_CAST(size_t, (dedup->bits_mask + 1) / 8);
+    if(dedup->slots)
+      size += (dedup->slots_mask + 1) * (sizeof(u64) + sizeof(librdf_statement*));
+  }
+
+  return size;
+}
+
+
 static librdf_node*
 librdf_parser_raptor_get_feature(void* context, librdf_uri *feature)
 {
@@ -1206,6 +3372,39 @@ librdf_parser_raptor_get_feature(void* context, librdf_uri *feature)
     sprintf((char*)intbuffer, "%d", pcontext->warnings);
     return librdf_new_node_from_typed_literal(pcontext->parser->world,
                                               intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_BATCH_SIZE)) {
+    sprintf((char*)intbuffer, "%d", pcontext->batch_size);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_THREADS)) {
+    sprintf((char*)intbuffer, "%d", pcontext->threads);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_READ_BUFFER_SIZE)) {
+    sprintf((char*)intbuffer, "%d", pcontext->read_buffer_size);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_PIPELINE)) {
+    sprintf((char*)intbuffer, "%d", pcontext->pipeline);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_DEDUPLICATE)) {
+    sprintf((char*)intbuffer, "%d", pcontext->dedup_expected);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_DUPLICATE_COUNT)) {
+    sprintf((char*)intbuffer, "%d", pcontext->duplicates);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_COMPRESSION)) {
+    return librdf_new_node_from_literal(pcontext->parser->world,
+                                        (const unsigned char*)librdf_compression_to_string(pcontext->compression),
+                                        NULL, 0);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_MEMORY_SIZE)) {
+    sprintf((char*)intbuffer, "%lu",
+            (unsigned long)librdf_parser_raptor_get_memory_size(pcontext));
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
   } else {
     /* raptor2: try a raptor option */
     raptor_option feature_i;
@@ -1236,6 +3435,96 @@ librdf_parser_raptor_set_feature(void* context,
   if(!feature)
     return 1;
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_BATCH_SIZE)) {
+    int batch_size;
+
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    /* the batch buffer is sized when the first statement is added */
+    if(pcontext->stream_context)
+      return 1;
+
+    batch_size = atoi((const char*)librdf_node_get_literal_value(value));
+    if(batch_size < 0)
+      batch_size = 0;
+    pcontext->batch_size = batch_size;
+    return 0;
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_THREADS)) {
+    int threads;
+
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    threads = atoi((const char*)librdf_node_get_literal_value(value));
+#ifdef WITH_THREADS
+    if(threads < 1)
+      threads = 1;
+#else
+    threads = 1;
+#endif
+    pcontext->threads = threads;
+    return 0;
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_READ_BUFFER_SIZE)) {
+    int read_buffer_size;
+
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    /* the read buffer is allocated when the stream is first read */
+    if(pcontext->stream_context)
+      return 1;
+
+    read_buffer_size = atoi((const char*)librdf_node_get_literal_value(value));
+    if(read_buffer_size < 1)
+      return 1;
+    pcontext->read_buffer_size = read_buffer_size;
+    return 0;
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_PIPELINE)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+#ifdef WITH_THREADS
+    pcontext->pipeline = (atoi((const char*)librdf_node_get_literal_value(value)) != 0);
+#else
+    pcontext->pipeline = 0;
+#endif
+    return 0;
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_DEDUPLICATE)) {
+    int expected;
+
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    expected = atoi((const char*)librdf_node_get_literal_value(value));
+    if(expected < 0)
+      expected = 0;
+    pcontext->dedup_expected = expected;
+    return 0;
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_COMPRESSION)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    return librdf_compression_from_string((const char*)librdf_node_get_literal_value(value),
+                                          &pcontext->compression);
+  }
+
   /* try a raptor feature */
   feature_i = raptor_world_get_option_from_uri(pcontext->parser->world->raptor_world_ptr, (raptor_uri*)feature);
   if((int)feature_i < 0)
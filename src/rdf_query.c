@@ -38,6 +38,10 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef WITH_THREADS
+#include <errno.h>
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 #include <rdf_query.h>
@@ -55,19 +59,17 @@ static void librdf_delete_query_factories(librdf_world *world);
  *
  * INTERNAL - Initialise the query module.
  * 
- * Initialises and registers all
- * compiled query modules.  Must be called before using any of the query
- * factory functions such as librdf_get_query_factory()
+ * Initialises and registers all compiled query modules, making the
+ * rasqal world if none was set.  Run once by the query factory
+ * functions such as librdf_get_query_factory() the first time one
+ * is called.
  **/
-int
+void
 librdf_init_query(librdf_world *world) 
 {
-  int rc;
-  
   /* Always have rasqal implementation available */
-  rc = librdf_query_rasqal_constructor(world);
-  if(rc)
-    return rc;
+  if(librdf_query_rasqal_constructor(world))
+    return;
 
 #ifdef MODULAR_LIBRDF
 #else
@@ -75,8 +77,6 @@ librdf_init_query(librdf_world *world)
   librdf_init_query_virtuoso(world);
 #endif
 #endif
-
-  return 0;
 }
 
 
@@ -92,6 +92,7 @@ librdf_finish_query(librdf_world *world)
 {
   librdf_query_rasqal_destructor(world);
   librdf_delete_query_factories(world);
+  world->queries_loaded = 0;
 }
 
 
@@ -216,6 +217,7 @@ librdf_get_query_factory(librdf_world *world,
   librdf_query_factory *factory;
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->queries_loaded, librdf_init_query);
 
   /* return 1st query if no particular one wanted - why? */
   if(!name && !uri) {
@@ -275,6 +277,7 @@ librdf_query_languages_enumerate(librdf_world* world,
     return 1;
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->queries_loaded, librdf_init_query);
   
   factory = world->query_factories;
   if(!factory)
@@ -311,6 +314,7 @@ librdf_query_language_get_description(librdf_world* world,
                                       unsigned int counter)
 {
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->queries_loaded, librdf_init_query);
 
   return rasqal_world_get_query_language_description(world->rasqal_world_ptr,
                                                      counter);
@@ -385,6 +389,7 @@ librdf_new_query_from_query(librdf_query* old_query)
   }
 
   new_query->world=old_query->world;
+  new_query->threads=old_query->threads;
 
   /* do this now so librdf_free_query won't call new factory on
    * partially copied query
@@ -429,6 +434,9 @@ librdf_new_query_from_factory(librdf_world *world,
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(factory, librdf_query_factory, NULL);
 
+  if(librdf_query_async_check_world(world))
+    return NULL;
+
   if(!factory) {
     LIBRDF_DEBUG1("No query factory given\n");
     return NULL;
@@ -477,6 +485,9 @@ librdf_free_query(librdf_query* query)
   if(query->factory)
     query->factory->terminate(query);
 
+  if(query->storage)
+    librdf_storage_remove_reference(query->storage);
+
   if(query->context)
     LIBRDF_FREE(librdf_query_context, query->context);
 
@@ -540,6 +551,12 @@ librdf_query_execute(librdf_query* query, librdf_model* model)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
 
+  if(query->cancelled)
+    return NULL;
+
+  if(librdf_query_async_check_world(query->world))
+    return NULL;
+
   if(query->factory->execute) {
     if((results=query->factory->execute(query, model)))
       librdf_query_add_query_result(query, results);
@@ -549,6 +566,291 @@ librdf_query_execute(librdf_query* query, librdf_model* model)
 }
 
 
+typedef struct {
+  librdf_query* query;
+  librdf_model* model;
+  librdf_query_results_handler handler;
+  void* user_data;
+} librdf_query_async_context;
+
+
+/**
+ * librdf_query_async_check_world:
+ * @world: redland world object
+ *
+ * INTERNAL - Check a world is not in use by an asynchronous query
+ *
+ * The world is shared with the thread running the query, so
+ * constructors and query execution fail on other threads until
+ * the query thread has finished.  Nothing is logged since that
+ * too would use the world.
+ *
+ * Return value: non-0 if another thread is running a query on the world
+ */
+int
+librdf_query_async_check_world(librdf_world* world)
+{
+  int busy=0;
+
+#ifdef WITH_THREADS
+  /* not opened yet */
+  if(!world->mutex)
+    return 0;
+
+  pthread_mutex_lock(world->mutex);
+  busy=world->async_running &&
+       !pthread_equal(pthread_self(), world->async_thread);
+  pthread_mutex_unlock(world->mutex);
+#endif
+
+  return busy;
+}
+
+
+/**
+ * librdf_query_async_join:
+ * @world: redland world object
+ *
+ * INTERNAL - Wait for the thread of an asynchronous query on a world
+ */
+void
+librdf_query_async_join(librdf_world* world)
+{
+#ifdef WITH_THREADS
+  pthread_t thread;
+  int started;
+
+  if(!world->mutex)
+    return;
+
+  pthread_mutex_lock(world->mutex);
+  thread=world->async_thread;
+  started=world->async_started &&
+          !pthread_equal(pthread_self(), world->async_thread);
+  if(started)
+    world->async_started=0;
+  pthread_mutex_unlock(world->mutex);
+
+  if(started)
+    pthread_join(thread, NULL);
+#endif
+}
+
+
+static void*
+librdf_query_execute_async_run(void* arg)
+{
+  librdf_query_async_context* acontext=(librdf_query_async_context*)arg;
+  librdf_query_results* results;
+#ifdef WITH_THREADS
+  librdf_world* world=acontext->query->world;
+#endif
+
+  results=librdf_model_query_execute(acontext->model, acontext->query);
+  if(results && acontext->query->cancelled) {
+    librdf_free_query_results(results);
+    results=NULL;
+  }
+
+  acontext->handler(acontext->user_data, acontext->query, results);
+
+  librdf_free_model(acontext->model);
+  librdf_free_query(acontext->query);
+  LIBRDF_FREE(librdf_query_async_context, acontext);
+
+#ifdef WITH_THREADS
+  /* the world may be used again, the thread is joined later */
+  pthread_mutex_lock(world->mutex);
+  world->async_running=0;
+  world->async_query=NULL;
+  pthread_mutex_unlock(world->mutex);
+#endif
+
+  return NULL;
+}
+
+
+/**
+ * librdf_query_execute_async:
+ * @query: #librdf_query object
+ * @model: model to operate query on
+ * @handler: function called with the results
+ * @user_data: user data for @handler
+ *
+ * Run the query on a model without waiting for the results.
+ *
+ * The query is run as by librdf_model_query_execute() in a new
+ * thread and @handler is called from that thread with the
+ * #librdf_query_results, or NULL if the query failed or was stopped
+ * with librdf_query_cancel().  The handler owns the results and must
+ * free them with librdf_free_query_results().
+ *
+ * The thread uses the world of the query, which is not safe to share
+ * between threads, so until the thread has finished the whole world
+ * must not be used by other threads: no objects of the world may be
+ * used, made or freed, except for librdf_query_cancel() and
+ * librdf_query_wait() on this query.  Making queries, parsers,
+ * serializers, storages or models of the world and executing
+ * queries fail meanwhile, as does starting a second asynchronous
+ * query.  Call librdf_query_wait() to join the thread; the handler
+ * may be used to learn when to do so.  librdf_free_world() joins
+ * the thread if it was not joined.  When Redland is built without
+ * thread support the query is run before this function returns.
+ *
+ * Return value: non-0 if the query could not be started
+ **/
+int
+librdf_query_execute_async(librdf_query* query, librdf_model* model,
+                           librdf_query_results_handler handler,
+                           void* user_data)
+{
+  librdf_query_async_context* acontext;
+#ifdef WITH_THREADS
+  int rc;
+#endif
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, 1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(handler, librdf_query_results_handler, 1);
+
+  if(librdf_query_async_check_world(query->world))
+    return 1;
+
+  /* join the thread of an earlier query on this world */
+  librdf_query_async_join(query->world);
+
+  acontext=LIBRDF_CALLOC(librdf_query_async_context*, 1, sizeof(*acontext));
+  if(!acontext)
+    return 1;
+
+  acontext->query=query;
+  acontext->model=model;
+  acontext->handler=handler;
+  acontext->user_data=user_data;
+
+  /* keep both alive until the handler has run; the world is not
+   * used by another thread here so this needs no lock */
+  query->usage++;
+  librdf_model_add_reference(model);
+
+#ifdef WITH_THREADS
+  /* held until the thread is recorded, which the thread checks when
+   * it uses the world */
+  pthread_mutex_lock(query->world->mutex);
+  if(query->world->async_running)
+    rc=EBUSY;
+  else
+    rc=pthread_create(&query->world->async_thread, NULL,
+                      librdf_query_execute_async_run, acontext);
+  if(!rc) {
+    query->world->async_query=query;
+    query->world->async_started=1;
+    query->world->async_running=1;
+  }
+  pthread_mutex_unlock(query->world->mutex);
+
+  if(rc) {
+    librdf_log(query->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+               "Failed to start query thread - %s", strerror(rc));
+    librdf_free_model(model);
+    librdf_free_query(query);
+    LIBRDF_FREE(librdf_query_async_context, acontext);
+    return 1;
+  }
+#else
+  librdf_query_execute_async_run(acontext);
+#endif
+
+  return 0;
+}
+
+
+/**
+ * librdf_query_wait:
+ * @query: #librdf_query object
+ *
+ * Wait for a query started with librdf_query_execute_async() to finish.
+ *
+ * Joins the thread running the query, after its handler has
+ * returned, so that the world may be used again.  Returns at once if
+ * the query is not running.  Must not be called from the handler.
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_query_wait(librdf_query* query)
+{
+#ifdef WITH_THREADS
+  librdf_world* world;
+  int running;
+#endif
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, 1);
+
+#ifdef WITH_THREADS
+  world=query->world;
+  pthread_mutex_lock(world->mutex);
+  running=(world->async_query == query);
+  pthread_mutex_unlock(world->mutex);
+
+  if(running)
+    librdf_query_async_join(world);
+#endif
+
+  return 0;
+}
+
+
+/**
+ * librdf_query_cancel:
+ * @query: #librdf_query object
+ *
+ * Stop a running query.
+ *
+ * May be called from any thread, for example to enforce a deadline
+ * on a query started with librdf_query_execute_async().  The query
+ * engine and any storage running the query are told to interrupt
+ * work in progress; triple matching stops and results report that
+ * they are finished.  A cancelled query cannot be executed again.
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_query_cancel(librdf_query* query)
+{
+  int rc=0;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, 1);
+
+  query->cancelled=1;
+
+  if(query->factory->cancel)
+    rc=query->factory->cancel(query);
+
+  if(query->storage && librdf_storage_query_cancel(query->storage, query))
+    rc=1;
+
+  return rc;
+}
+
+
+/**
+ * librdf_query_is_cancelled:
+ * @query: #librdf_query object
+ *
+ * Check if librdf_query_cancel() was called on a query.
+ *
+ * Return value: non-0 if the query was cancelled
+ **/
+int
+librdf_query_is_cancelled(librdf_query* query)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, 0);
+
+  return query->cancelled;
+}
+
+
 /**
  * librdf_query_get_limit:
  * @query: #librdf_query query object
@@ -634,6 +936,47 @@ librdf_query_set_offset(librdf_query *query, int offset)
   return -1;
 }
 
+
+/**
+ * librdf_query_get_threads:
+ * @query: #librdf_query query object
+ *
+ * Get the number of threads the query may use when executed.
+ *
+ * Return value: number of threads, 1 or less to run on the calling thread only
+ **/
+int
+librdf_query_get_threads(librdf_query *query)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, 1);
+
+  return query->threads;
+}
+
+
+/**
+ * librdf_query_set_threads:
+ * @query: #librdf_query query object
+ * @threads: maximum number of threads, 1 or less to run on the calling thread only
+ *
+ * Set the number of threads the query may use when executed.
+ *
+ * Query engines may evaluate independent parts of a query in
+ * parallel, such as the branches of a UNION, when the model storage
+ * has the #LIBRDF_STORAGE_FEATURE_CONCURRENT_READS feature.  The
+ * default is to run only on the calling thread.
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_query_set_threads(librdf_query *query, int threads)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, 1);
+
+  query->threads=threads;
+  return 0;
+}
+
 #endif
 
 
@@ -650,12 +993,32 @@ int main(int argc, char *argv[]);
 #define DATA "@prefix ex: <http://example.org/> .\
 ex:fido a ex:Dog ;\
         ex:label \"Fido\" .\
+ex:b ex:knows ex:c .\
+ex:c ex:knows ex:d .\
+ex:d ex:knows ex:d .\
 "
 #define DATA_LANGUAGE "turtle"
 #define DATA_BASE_URI "http://example.org/"
 #define QUERY_STRING "SELECT ?x WHERE { ?x a ?y }"
 #define QUERY_LANGUAGE "sparql"
 #define VARIABLES_COUNT 1
+/* only the last statement matches, after the LIMIT statements */
+#define REPEATED_QUERY_STRING "SELECT ?x WHERE { ?x <http://example.org/knows> ?x } LIMIT 1"
+
+static void
+test_query_async_handler(void* user_data, librdf_query* query,
+                         librdf_query_results* results)
+{
+  int* count_p=(int*)user_data;
+
+  if(!results)
+    return;
+  while(!librdf_query_results_finished(results))
+    librdf_query_results_next(results);
+  *count_p=librdf_query_results_get_count(results);
+  librdf_free_query_results(results);
+}
+
 
 int
 main(int argc, char *argv[]) 
@@ -792,9 +1155,50 @@ main(int argc, char *argv[])
   librdf_free_query_results(results);
 
 
+  /* twice, so the second joins nothing left by the first */
+  for(i = 0; i < 2; i++) {
+    int async_count=-1;
+
+    fprintf(stdout, "%s: Executing asynchronously\n", program);
+    if(librdf_query_execute_async(query, model, test_query_async_handler,
+                                  &async_count) ||
+       librdf_query_wait(query)) {
+      fprintf(stderr, "%s: Asynchronous query of model with '%s' failed\n",
+              program, query_string);
+      return 1;
+    }
+    if(async_count != 1) {
+      fprintf(stderr, "%s: Asynchronous query returned %d results, expected 1\n",
+              program, async_count);
+      return 1;
+    }
+  }
+
+
   fprintf(stdout, "%s: Freeing query\n", program);
   librdf_free_query(query);
 
+
+  fprintf(stdout, "%s: Executing a LIMIT query repeating a variable\n",
+          program);
+  query=librdf_new_query(world, QUERY_LANGUAGE, NULL,
+                         (const unsigned char*)REPEATED_QUERY_STRING, NULL);
+  if(!query || !(results=librdf_model_query_execute(model, query))) {
+    fprintf(stderr, "%s: Query of model with '%s' failed\n", 
+            program, REPEATED_QUERY_STRING);
+    return 1;
+  }
+  while(!librdf_query_results_finished(results))
+    librdf_query_results_next(results);
+  if(librdf_query_results_get_count(results) != 1) {
+    fprintf(stderr, "%s: Query '%s' returned %d results, expected 1\n",
+            program, REPEATED_QUERY_STRING,
+            librdf_query_results_get_count(results));
+    return 1;
+  }
+  librdf_free_query_results(results);
+  librdf_free_query(query);
+
   librdf_free_model(model);
   librdf_free_storage(storage);
 
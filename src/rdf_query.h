@@ -55,10 +55,38 @@ REDLAND_API
 void librdf_free_query(librdf_query *query);
 
 
+/**
+ * librdf_query_results_handler:
+ * @user_data: user data passed to librdf_query_execute_async()
+ * @query: the query that was run
+ * @results: the results, owned by the handler, or NULL on failure or cancellation
+ *
+ * Handler called with the results of librdf_query_execute_async().
+ */
+typedef void (*librdf_query_results_handler)(void* user_data, librdf_query* query, librdf_query_results* results);
+
+/**
+ * librdf_query_results_flush_handler:
+ * @user_data: user data passed to librdf_query_results_write_stream()
+ *
+ * Handler called by librdf_query_results_write_stream() to send the output written so far.
+ *
+ * Return value: non-0 on failure
+ */
+typedef int (*librdf_query_results_flush_handler)(void* user_data);
+
 /* methods */
 REDLAND_API
 librdf_query_results* librdf_query_execute(librdf_query* query, librdf_model *model);
 REDLAND_API
+int librdf_query_execute_async(librdf_query* query, librdf_model* model, librdf_query_results_handler handler, void* user_data);
+REDLAND_API
+int librdf_query_wait(librdf_query* query);
+REDLAND_API
+int librdf_query_cancel(librdf_query* query);
+REDLAND_API
+int librdf_query_is_cancelled(librdf_query* query);
+REDLAND_API
 int librdf_query_get_limit(librdf_query *query);
 REDLAND_API
 int librdf_query_set_limit(librdf_query *query, int limit);
@@ -66,6 +94,10 @@ REDLAND_API
 int librdf_query_get_offset(librdf_query *query);
 REDLAND_API
 int librdf_query_set_offset(librdf_query *query, int offset);
+REDLAND_API
+int librdf_query_get_threads(librdf_query *query);
+REDLAND_API
+int librdf_query_set_threads(librdf_query *query, int threads);
 
 REDLAND_API
 librdf_stream* librdf_query_results_as_stream(librdf_query_results* query_results);
@@ -87,6 +119,10 @@ REDLAND_API
 librdf_node* librdf_query_results_get_binding_value_by_name(librdf_query_results* query_results, const char *name);
 REDLAND_API
 int librdf_query_results_get_bindings_count(librdf_query_results* query_results);
+REDLAND_API
+int librdf_query_results_get_binding_index(librdf_query_results* query_results, const char *name);
+REDLAND_API
+librdf_node** librdf_query_results_get_row_view(librdf_query_results* query_results);
 REDLAND_API REDLAND_DEPRECATED
 unsigned char* librdf_query_results_to_counted_string(librdf_query_results *query_results, librdf_uri *format_uri, librdf_uri *base_uri, size_t *length_p);
 REDLAND_API
@@ -103,6 +139,10 @@ REDLAND_API REDLAND_DEPRECATED
 int librdf_query_results_to_file(librdf_query_results *query_results, const char *name, librdf_uri *format_uri, librdf_uri *base_uri);
 REDLAND_API
 int librdf_query_results_to_file2(librdf_query_results *query_results, const char *name, const char *mime_type, librdf_uri *format_uri, librdf_uri *base_uri);
+REDLAND_API
+int librdf_query_results_write_stream(librdf_query_results *query_results, raptor_iostream *iostr, const char *name, int flush_rows, librdf_query_results_flush_handler flush, void *user_data);
+REDLAND_API
+int librdf_query_results_to_file_handle_stream(librdf_query_results *query_results, FILE *handle, const char *name, int flush_rows);
 
 REDLAND_API
 void librdf_free_query_results(librdf_query_results* query_results);
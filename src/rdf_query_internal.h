@@ -40,6 +40,15 @@ struct librdf_query_s
 
   /* list of all the results for this query */
   librdf_query_results* results;
+
+  /* set by librdf_query_cancel(), possibly from another thread */
+  volatile int cancelled;
+
+  /* storage running the query through its query_execute method or NULL */
+  librdf_storage* storage;
+
+  /* threads the query engine may use, set by librdf_query_set_threads() */
+  int threads;
 };
 
 
@@ -107,6 +116,9 @@ struct librdf_query_factory_s {
   /* perform the query on a model */
   librdf_query_results* (*execute)(librdf_query* query, librdf_model* model);
 
+  /* interrupt a running execute, called from any thread - OPTIONAL */
+  int (*cancel)(librdf_query* query);
+
   /* get/set query results limit (max results to return) */
   int (*get_limit)(librdf_query *query);
   int (*set_limit)(librdf_query *query, int limit);
@@ -141,6 +153,9 @@ struct librdf_query_factory_s {
   /* get number of bound variables in the result - OPTIONAL */
   int (*results_get_bindings_count)(librdf_query_results* query_results);
 
+  /* get shared values for current result, owned by the query - OPTIONAL */
+  librdf_node** (*results_get_row_view)(librdf_query_results* query_results);
+
   /* tidy up query results - OPTIONAL */
   void (*free_results)(librdf_query_results* query_results);
 
@@ -162,7 +177,7 @@ struct librdf_query_factory_s {
 
 
 /* module init */
-int librdf_init_query(librdf_world *world);
+void librdf_init_query(librdf_world *world);
 
 /* module terminate */
 void librdf_finish_query(librdf_world *world);
@@ -179,11 +194,33 @@ void librdf_init_query_virtuoso(librdf_world *world);
 void librdf_query_rasqal_destructor(librdf_world *world);
 
 void librdf_query_add_query_result(librdf_query *query, librdf_query_results* query_results);
+int librdf_query_async_check_world(librdf_world* world);
+void librdf_query_async_join(librdf_world* world);
 void librdf_query_remove_query_result(librdf_query *query, librdf_query_results* query_results);
 
 /* rdf_query_rasqal.c */
 rasqal_literal* redland_node_to_rasqal_literal(librdf_world* world, librdf_node *node);
 
+#include <rdf_types.h>
+
+/* statements table a query is translated to SQL for */
+typedef struct
+{
+  /* table holding the model statements */
+  const char* statements_table;
+  /* "Column=value" condition statements of the model meet or NULL */
+  const char* model_condition;
+  /* id of a node in the storage */
+  u64 (*node_id)(librdf_storage* storage, librdf_node* node);
+} librdf_query_sql_schema;
+
+int librdf_query_rasqal_sql_supported(librdf_query* query);
+char* librdf_query_rasqal_to_sql(librdf_query* query, librdf_storage* storage, const librdf_query_sql_schema* schema);
+librdf_query_results* librdf_query_rasqal_new_sql_results(librdf_query* query);
+int librdf_query_rasqal_add_sql_row(librdf_query_results* query_results, const char* const* values);
+int librdf_query_rasqal_add_node_row(librdf_query_results* query_results, librdf_node** values);
+void librdf_query_rasqal_end_sql_results(librdf_query_results* query_results);
+
 
 #ifdef __cplusplus
 }
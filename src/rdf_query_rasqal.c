@@ -43,8 +43,71 @@
 
 #include <redland.h>
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+
+
+
+/* Entries in each term conversion cache; power of 2 */
+#define LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE 4096
+
+typedef struct
+{
+  librdf_node *node;          /* node reference or NULL when empty */
+  rasqal_literal *literal;    /* literal reference */
+} librdf_query_rasqal_term_entry;
 
 
+/* Lookups of one triple pattern before all its matches are fetched */
+#define LIBRDF_QUERY_RASQAL_BATCH_PROBES 16
+
+/* Most statements fetched for one triple pattern */
+#define LIBRDF_QUERY_RASQAL_BATCH_MAX_STATEMENTS 65536
+
+typedef struct
+{
+  rasqal_triple *triple;      /* triple pattern */
+  int probes;                 /* lookups with bound variables so far */
+  int state;                  /* 0 counting, 1 fetched, -1 not batched */
+  int key_mask;               /* bound parts: 1 subject 2 predicate 4 object */
+
+  /* statements matching the constant terms, chained by hash of the
+   * bound parts; chain links are statement index + 1 */
+  librdf_statement **statements;
+  int statements_count;
+  int *buckets;
+  int *next;
+  unsigned int buckets_mask;
+} librdf_query_rasqal_batch;
+
+
+/* Statements unboxed and filtered at a time */
+#define LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE 256
+
+/* Unboxed value kinds of a filter condition or statement term */
+#define LIBRDF_QUERY_RASQAL_VALUE_NONE    0
+#define LIBRDF_QUERY_RASQAL_VALUE_TERM    1
+#define LIBRDF_QUERY_RASQAL_VALUE_INTEGER 2
+#define LIBRDF_QUERY_RASQAL_VALUE_DOUBLE  3
+#define LIBRDF_QUERY_RASQAL_VALUE_STRING  4
+#define LIBRDF_QUERY_RASQAL_VALUE_TEXT    5
+
+typedef struct
+{
+  rasqal_variable *variable;  /* compared variable */
+  rasqal_op op;               /* EQ, LT, GT, LE or GE with the variable first,
+                               * CONTAINS or STRSTARTS for TEXT */
+  int kind;                   /* LIBRDF_QUERY_RASQAL_VALUE_ kind of the constant */
+  librdf_node *node;          /* TERM: the term the variable must be,
+                               * TEXT: literal with the text to match */
+  long integer;               /* INTEGER */
+  double number;              /* INTEGER and DOUBLE */
+  const unsigned char *string; /* STRING, shared with the query */
+  size_t string_len;
+} librdf_query_rasqal_condition;
+
 
 typedef struct
 {
@@ -58,6 +121,31 @@ typedef struct
 
   int errors;
   int warnings;
+
+  /* term conversions, literal to node by literal and node to literal
+   * by node value, kept for the life of the query */
+  librdf_query_rasqal_term_entry *literal_cache;
+  librdf_query_rasqal_term_entry *node_cache;
+
+  /* non-0 once basic graph patterns have been ordered for execution */
+  int reordered;
+
+  /* triple patterns looked up repeatedly, for the current execution */
+  librdf_query_rasqal_batch **batches;
+  int batches_count;
+
+  /* nodes of the current result row lent by librdf_query_results_get_row_view() */
+  librdf_node **row_view;
+  int row_view_size;
+  int row_view_valid;
+
+  /* comparisons from the top-level FILTERs, once found */
+  librdf_query_rasqal_condition *conditions;
+  int conditions_count;
+  int conditions_found;
+
+  /* storage literal text index: 0 not yet asked, 1 present, -1 absent */
+  int text_index;
 } librdf_query_rasqal_context;
 
 
@@ -65,6 +153,13 @@ typedef struct
 static int rasqal_redland_init_triples_match(rasqal_triples_match* rtm, rasqal_triples_source *rts, void *user_data, rasqal_triple_meta *m, rasqal_triple *t);
 static int rasqal_redland_triple_present(rasqal_triples_source *rts, void *user_data, rasqal_triple *t);
 static void rasqal_redland_free_triples_source(void *user_data);
+static librdf_query_results* librdf_query_rasqal_execute(librdf_query* query, librdf_model* model);
+static void librdf_query_rasqal_free_term_caches(librdf_query_rasqal_context* context);
+static void librdf_query_rasqal_free_batches(librdf_query_rasqal_context* context);
+static void librdf_query_rasqal_free_row_view(librdf_query_rasqal_context* context);
+static void librdf_query_rasqal_free_conditions(librdf_query_rasqal_context* context);
+static int librdf_query_rasqal_text_index(librdf_query_rasqal_context* context);
+static int librdf_query_rasqal_new_row_results(librdf_query* query);
 
 
 static void
@@ -145,6 +240,11 @@ librdf_query_rasqal_terminate(librdf_query* query)
 {
   librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
 
+  librdf_query_rasqal_free_batches(context);
+  librdf_query_rasqal_free_row_view(context);
+  librdf_query_rasqal_free_conditions(context);
+  librdf_query_rasqal_free_term_caches(context);
+
   if(context->rq)
     rasqal_free_query(context->rq);
 
@@ -272,6 +372,239 @@ redland_node_to_rasqal_literal(librdf_world* world, librdf_node *node)
 }
 
 
+/*
+ * Term conversion caches
+ *
+ * Every binding crossing between rasqal and librdf would otherwise
+ * allocate a new node or literal with copies of its strings.  Each
+ * query keeps two direct mapped caches holding references: literal
+ * to node keyed by the literal pointer, since rasqal passes the same
+ * literal around as a variable value, and node to literal keyed by
+ * the node value, since storages return fresh nodes for each match.
+ * A node converted to a literal is also entered in the literal cache
+ * so a bound value used again in a later triple pattern converts
+ * back for free.  Hits return new references to the cached terms.
+ */
+
+static void
+librdf_query_rasqal_term_entry_clear(librdf_query_rasqal_term_entry* entry)
+{
+  if(entry->node) {
+    librdf_free_node(entry->node);
+    entry->node=NULL;
+  }
+  if(entry->literal) {
+    rasqal_free_literal(entry->literal);
+    entry->literal=NULL;
+  }
+}
+
+
+/* Replace an entry, taking new references to @node and @literal */
+static void
+librdf_query_rasqal_term_entry_set(librdf_query_rasqal_term_entry* entry,
+                                   librdf_node* node, rasqal_literal* literal)
+{
+  librdf_node* new_node;
+  rasqal_literal* new_literal;
+
+  new_node=librdf_new_node_from_node(node);
+  if(!new_node)
+    return;
+  new_literal=rasqal_new_literal_from_literal(literal);
+  if(!new_literal) {
+    librdf_free_node(new_node);
+    return;
+  }
+
+  librdf_query_rasqal_term_entry_clear(entry);
+  entry->node=new_node;
+  entry->literal=new_literal;
+}
+
+
+static void
+librdf_query_rasqal_free_term_caches(librdf_query_rasqal_context* context)
+{
+  int i;
+
+  if(context->literal_cache) {
+    for(i=0; i < LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE; i++)
+      librdf_query_rasqal_term_entry_clear(&context->literal_cache[i]);
+    LIBRDF_FREE(librdf_query_rasqal_term_entry*, context->literal_cache);
+    context->literal_cache=NULL;
+  }
+
+  if(context->node_cache) {
+    for(i=0; i < LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE; i++)
+      librdf_query_rasqal_term_entry_clear(&context->node_cache[i]);
+    LIBRDF_FREE(librdf_query_rasqal_term_entry*, context->node_cache);
+    context->node_cache=NULL;
+  }
+}
+
+
+/* Allocate the caches on first use; non-0 if they are not available */
+static int
+librdf_query_rasqal_init_term_caches(librdf_query_rasqal_context* context)
+{
+  if(context->literal_cache)
+    return 0;
+
+  context->literal_cache=LIBRDF_CALLOC(librdf_query_rasqal_term_entry*,
+                                       LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE,
+                                       sizeof(librdf_query_rasqal_term_entry));
+  context->node_cache=LIBRDF_CALLOC(librdf_query_rasqal_term_entry*,
+                                    LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE,
+                                    sizeof(librdf_query_rasqal_term_entry));
+  if(!context->literal_cache || !context->node_cache) {
+    librdf_query_rasqal_free_term_caches(context);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static librdf_query_rasqal_term_entry*
+librdf_query_rasqal_literal_cache_entry(librdf_query_rasqal_context* context,
+                                        rasqal_literal* l)
+{
+  size_t bucket=((size_t)l >> 4) & (LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE - 1);
+
+  return &context->literal_cache[bucket];
+}
+
+
+/* FNV-1a over @len bytes continuing from @h */
+static unsigned int
+librdf_query_rasqal_hash_bytes(unsigned int h, const unsigned char* p,
+                               size_t len)
+{
+  size_t i;
+
+  for(i=0; i < len; i++)
+    h=(h ^ p[i]) * 16777619U;
+
+  return h;
+}
+
+
+/* Hash a node by value */
+static unsigned int
+librdf_query_rasqal_hash_node(librdf_node* node)
+{
+  unsigned int h=2166136261U ^ (unsigned int)node->type;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      /* URIs are shared between equal strings */
+      h=(h ^ (unsigned int)((size_t)node->value.uri >> 4)) * 16777619U;
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      h=librdf_query_rasqal_hash_bytes(h, node->value.literal.string,
+                                       node->value.literal.string_len);
+      if(node->value.literal.language)
+        h=librdf_query_rasqal_hash_bytes(h, node->value.literal.language,
+                                         node->value.literal.language_len);
+      if(node->value.literal.datatype)
+        h=(h ^ (unsigned int)((size_t)node->value.literal.datatype >> 4)) * 16777619U;
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      h=librdf_query_rasqal_hash_bytes(h, node->value.blank.string,
+                                       node->value.blank.string_len);
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  return h;
+}
+
+
+static librdf_query_rasqal_term_entry*
+librdf_query_rasqal_node_cache_entry(librdf_query_rasqal_context* context,
+                                     librdf_node* node)
+{
+  size_t bucket;
+
+  bucket=librdf_query_rasqal_hash_node(node) & (LIBRDF_QUERY_RASQAL_TERM_CACHE_SIZE - 1);
+  return &context->node_cache[bucket];
+}
+
+
+/*
+ * librdf_query_rasqal_literal_to_node:
+ * @context: query context
+ * @l: rasqal literal or NULL
+ *
+ * INTERNAL - Convert a rasqal literal to a new librdf node using the cache
+ *
+ * Return value: new #librdf_node or NULL
+ */
+static librdf_node*
+librdf_query_rasqal_literal_to_node(librdf_query_rasqal_context* context,
+                                    rasqal_literal* l)
+{
+  librdf_query_rasqal_term_entry* entry;
+  librdf_node* node;
+
+  if(!l)
+    return NULL;
+
+  if(librdf_query_rasqal_init_term_caches(context))
+    return rasqal_literal_to_redland_node(context->query->world, l);
+
+  entry=librdf_query_rasqal_literal_cache_entry(context, l);
+  if(entry->node && entry->literal == l)
+    return librdf_new_node_from_node(entry->node);
+
+  node=rasqal_literal_to_redland_node(context->query->world, l);
+  if(node)
+    librdf_query_rasqal_term_entry_set(entry, node, l);
+
+  return node;
+}
+
+
+/*
+ * librdf_query_rasqal_node_to_literal:
+ * @context: query context
+ * @node: librdf node
+ *
+ * INTERNAL - Convert a librdf node to a new rasqal literal using the cache
+ *
+ * Return value: new rasqal literal or NULL
+ */
+static rasqal_literal*
+librdf_query_rasqal_node_to_literal(librdf_query_rasqal_context* context,
+                                    librdf_node* node)
+{
+  librdf_query_rasqal_term_entry* entry;
+  rasqal_literal* l;
+
+  if(librdf_query_rasqal_init_term_caches(context))
+    return redland_node_to_rasqal_literal(context->query->world, node);
+
+  entry=librdf_query_rasqal_node_cache_entry(context, node);
+  if(entry->node && librdf_node_equals(entry->node, node))
+    return rasqal_new_literal_from_literal(entry->literal);
+
+  l=redland_node_to_rasqal_literal(context->query->world, node);
+  if(l) {
+    librdf_query_rasqal_term_entry_set(entry, node, l);
+    librdf_query_rasqal_term_entry_set(librdf_query_rasqal_literal_cache_entry(context, l),
+                                       node, l);
+  }
+
+  return l;
+}
+
+
 typedef struct {
   librdf_world *world;
   librdf_query *query;
@@ -351,20 +684,31 @@ rasqal_redland_triple_present(rasqal_triples_source *rts, void *user_data,
                               rasqal_triple *t) 
 {
   rasqal_redland_triples_source_user_data* rtsc=(rasqal_redland_triples_source_user_data*)user_data;
-  librdf_node* nodes[3];
-  librdf_statement *s;
-  int rc;
+  librdf_query_rasqal_context *qcontext;
+  librdf_statement statement; /* on stack - not allocated */
+  int rc=0;
   
-  /* ASSUMPTION: all the parts of the triple are not variables */
-  /* FIXME: and no error checks */
-  nodes[0]=rasqal_literal_to_redland_node(rtsc->world, t->subject);
-  nodes[1]=rasqal_literal_to_redland_node(rtsc->world, t->predicate);
-  nodes[2]=rasqal_literal_to_redland_node(rtsc->world, t->object);
+  if(rtsc->query->cancelled)
+    return 0;
 
-  s=librdf_new_statement_from_nodes(rtsc->world, nodes[0], nodes[1], nodes[2]);
-  
-  rc=librdf_model_contains_statement(rtsc->model, s);
-  librdf_free_statement(s);
+  qcontext=(librdf_query_rasqal_context*)rtsc->query->context;
+
+  /* ASSUMPTION: all the parts of the triple are not variables
+   *
+   * Called for every row of an ASK or fully bound pattern, so the
+   * nodes come from the term cache, where a node already seen is
+   * only another reference, and the statement is not allocated.
+   */
+  librdf_statement_init(rtsc->world, &statement);
+  statement.subject=librdf_query_rasqal_literal_to_node(qcontext, t->subject);
+  statement.predicate=librdf_query_rasqal_literal_to_node(qcontext, t->predicate);
+  statement.object=librdf_query_rasqal_literal_to_node(qcontext, t->object);
+
+  /* a term that cannot be converted is in no statement */
+  if(statement.subject && statement.predicate && statement.object)
+    rc=librdf_model_contains_statement(rtsc->model, &statement);
+
+  librdf_statement_clear(&statement);
   return rc;
 }
 
@@ -404,6 +748,8 @@ typedef struct {
   /* query statement, made from the nodes above (even when exact) */
   librdf_statement *qstatement;
   librdf_stream *stream;
+  /* query being run, checked for cancellation */
+  librdf_query *query;
 } rasqal_redland_triples_match_context;
 
 
@@ -417,7 +763,7 @@ rasqal_redland_bind_match(struct rasqal_triples_match_s* rtm,
   rasqal_literal* l;
   librdf_statement* statement;
   rasqal_triple_parts result=(rasqal_triple_parts)0;
-  librdf_world *world = rtmc->stream->world;
+  librdf_query_rasqal_context *qcontext=(librdf_query_rasqal_context*)rtmc->query->context;
 
   statement=librdf_stream_get_object(rtmc->stream);
   if(!statement)
@@ -435,7 +781,7 @@ rasqal_redland_bind_match(struct rasqal_triples_match_s* rtm,
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
     LIBRDF_DEBUG1("binding subject to variable\n");
 #endif
-    l = redland_node_to_rasqal_literal(world,
+    l = librdf_query_rasqal_node_to_literal(qcontext,
                                        librdf_statement_get_subject(statement));
     rasqal_variable_set_value(bindings[0], l);
     result= RASQAL_TRIPLE_SUBJECT;
@@ -454,7 +800,7 @@ rasqal_redland_bind_match(struct rasqal_triples_match_s* rtm,
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
       LIBRDF_DEBUG1("binding predicate to variable\n");
 #endif
-      l = redland_node_to_rasqal_literal(world,
+      l = librdf_query_rasqal_node_to_literal(qcontext,
                                          librdf_statement_get_predicate(statement));
       rasqal_variable_set_value(bindings[1], l);
       result= (rasqal_triple_parts)(result | RASQAL_TRIPLE_PREDICATE);
@@ -493,7 +839,7 @@ rasqal_redland_bind_match(struct rasqal_triples_match_s* rtm,
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
       LIBRDF_DEBUG1("binding object to variable\n");
 #endif
-      l = redland_node_to_rasqal_literal(world,
+      l = librdf_query_rasqal_node_to_literal(qcontext,
                                          librdf_statement_get_object(statement));
       rasqal_variable_set_value(bindings[2], l);
       result= (rasqal_triple_parts)(result | RASQAL_TRIPLE_OBJECT);
@@ -543,7 +889,7 @@ rasqal_redland_bind_match(struct rasqal_triples_match_s* rtm,
       LIBRDF_DEBUG1("binding origin to variable\n");
 #endif
       if(context_node)
-        l = redland_node_to_rasqal_literal(world, context_node);
+        l = librdf_query_rasqal_node_to_literal(qcontext, context_node);
       else
         l=NULL;
       rasqal_variable_set_value(bindings[3], l);
@@ -570,6 +916,9 @@ rasqal_redland_is_end(struct rasqal_triples_match_s* rtm,
 {
   rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)rtm->user_data;
 
+  if(rtmc->query->cancelled)
+    return 1;
+
   return librdf_stream_end(rtmc->stream);
 }
 
@@ -592,642 +941,3763 @@ rasqal_redland_finish_triples_match(struct rasqal_triples_match_s* rtm,
 }
 
 
-static int
-rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
-                                  rasqal_triples_source *rts, void *user_data,
-                                  rasqal_triple_meta *m, rasqal_triple *t)
+/*
+ * Batched pattern lookups
+ *
+ * Rasqal runs a triple pattern once for every row of the patterns
+ * before it, each time with the variables bound so far, and each run
+ * is a storage lookup - a round trip for SQL and remote storages.
+ * Rasqal hands the triples source one binding at a time so the values
+ * cannot be collected into IN lists; instead, once a pattern has been
+ * looked up LIBRDF_QUERY_RASQAL_BATCH_PROBES times with the same
+ * parts bound, all statements matching its constant terms are fetched
+ * in one storage call and indexed by the bound parts, and later
+ * lookups are answered from memory.  Patterns matching more than
+ * LIBRDF_QUERY_RASQAL_BATCH_MAX_STATEMENTS statements, or in a named
+ * graph, keep using one lookup per binding.
+ */
+
+static void
+librdf_query_rasqal_batch_clear(librdf_query_rasqal_batch* batch)
 {
-  rasqal_redland_triples_source_user_data* rtsc=(rasqal_redland_triples_source_user_data*)user_data;
-  rasqal_redland_triples_match_context* rtmc;
-  rasqal_variable* var;
+  int i;
 
-  rtm->bind_match=rasqal_redland_bind_match;
-  rtm->next_match=rasqal_redland_next_match;
-  rtm->is_end=rasqal_redland_is_end;
-  rtm->finish=rasqal_redland_finish_triples_match;
+  if(batch->statements) {
+    for(i=0; i < batch->statements_count; i++)
+      librdf_free_statement(batch->statements[i]);
+    LIBRDF_FREE(librdf_statement**, batch->statements);
+    batch->statements=NULL;
+  }
+  batch->statements_count=0;
 
-  rtmc = LIBRDF_CALLOC(rasqal_redland_triples_match_context*, 1, sizeof(*rtmc));
-  if(!rtmc)
-    return 1;
+  if(batch->buckets) {
+    LIBRDF_FREE(int*, batch->buckets);
+    batch->buckets=NULL;
+  }
+  if(batch->next) {
+    LIBRDF_FREE(int*, batch->next);
+    batch->next=NULL;
+  }
+}
 
-  rtm->user_data=rtmc;
 
+static void
+librdf_query_rasqal_free_batches(librdf_query_rasqal_context* context)
+{
+  int i;
 
-  /* at least one of the triple terms is a variable and we need to
-   * do a triplesMatching() aka librdf_model_find_statements
-   *
-   * redland find_statements will do the right thing and internally
-   * pick the most efficient, indexed way to get the answer.
-   */
+  if(!context->batches)
+    return;
 
-  if((var=rasqal_literal_as_variable(t->subject))) {
-    if(var->value)
-      rtmc->nodes[0]=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    else
-      rtmc->nodes[0]=NULL;
-  } else
-    rtmc->nodes[0]=rasqal_literal_to_redland_node(rtsc->world, t->subject);
+  for(i=0; i < context->batches_count; i++) {
+    librdf_query_rasqal_batch_clear(context->batches[i]);
+    LIBRDF_FREE(librdf_query_rasqal_batch, context->batches[i]);
+  }
+  LIBRDF_FREE(librdf_query_rasqal_batch**, context->batches);
+  context->batches=NULL;
+  context->batches_count=0;
+}
 
-  m->bindings[0]=var;
-  
 
-  if((var=rasqal_literal_as_variable(t->predicate))) {
-    if(var->value)
-      rtmc->nodes[1]=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    else
-      rtmc->nodes[1]=NULL;
-  } else
-    rtmc->nodes[1]=rasqal_literal_to_redland_node(rtsc->world, t->predicate);
+/* Find or add the lookup state of a triple pattern */
+static librdf_query_rasqal_batch*
+librdf_query_rasqal_get_batch(librdf_query_rasqal_context* context,
+                              rasqal_triple* t)
+{
+  librdf_query_rasqal_batch** batches;
+  librdf_query_rasqal_batch* batch;
+  int i;
 
-  m->bindings[1]=var;
-  
+  for(i=0; i < context->batches_count; i++) {
+    if(context->batches[i]->triple == t)
+      return context->batches[i];
+  }
 
-  if((var=rasqal_literal_as_variable(t->object))) {
-    if(var->value)
-      rtmc->nodes[2]=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    else
-      rtmc->nodes[2]=NULL;
-  } else
-    rtmc->nodes[2]=rasqal_literal_to_redland_node(rtsc->world, t->object);
+  batch=LIBRDF_CALLOC(librdf_query_rasqal_batch*, 1, sizeof(*batch));
+  if(!batch)
+    return NULL;
+  batches=LIBRDF_MALLOC(librdf_query_rasqal_batch**,
+                        (context->batches_count + 1) * sizeof(librdf_query_rasqal_batch*));
+  if(!batches) {
+    LIBRDF_FREE(librdf_query_rasqal_batch, batch);
+    return NULL;
+  }
+  if(context->batches) {
+    memcpy(batches, context->batches,
+           context->batches_count * sizeof(librdf_query_rasqal_batch*));
+    LIBRDF_FREE(librdf_query_rasqal_batch**, context->batches);
+  }
+  context->batches=batches;
 
-  m->bindings[2]=var;
-  
+  batch->triple=t;
+  batches[context->batches_count++]=batch;
+  return batch;
+}
 
-  if(t->origin) {
-    if((var=rasqal_literal_as_variable(t->origin))) {
-      if(var->value)
-        rtmc->origin=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    } else
-      rtmc->origin=rasqal_literal_to_redland_node(rtsc->world, t->origin);
-    m->bindings[3]=var;
-  }
 
+/* Hash the parts of a statement selected by @mask */
+static unsigned int
+librdf_query_rasqal_batch_hash(librdf_statement* statement, int mask)
+{
+  unsigned int h=0;
 
-  rtmc->qstatement=librdf_new_statement_from_nodes(rtsc->world, 
-                                                   rtmc->nodes[0],
-                                                   rtmc->nodes[1], 
-                                                   rtmc->nodes[2]);
-  if(!rtmc->qstatement)
-    return 1;
+  if(mask & 1)
+    h=h * 31 + librdf_query_rasqal_hash_node(statement->subject);
+  if(mask & 2)
+    h=h * 31 + librdf_query_rasqal_hash_node(statement->predicate);
+  if(mask & 4)
+    h=h * 31 + librdf_query_rasqal_hash_node(statement->object);
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  LIBRDF_DEBUG1("query statement: ");
-  librdf_statement_print(rtmc->qstatement, stderr);
-  if(rtmc->origin) {
-    fput(" with context node: ", stderr);
-    librdf_node_print(rtmc->origin, stderr);
-  }
-  fputc('\n', stderr);
-#endif
-  
-  if(rtmc->origin)
-    rtmc->stream=librdf_model_find_statements_in_context(rtsc->model, 
-                                                         rtmc->qstatement,
-                                                         rtmc->origin);
-  else
-    rtmc->stream=librdf_model_find_statements(rtsc->model, rtmc->qstatement);
+  return h;
+}
 
-  if(!rtmc->stream)
-    return 1;
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  LIBRDF_DEBUG1("rasqal_init_triples_match done\n");
-#endif
+/* Check the parts of a statement selected by @mask equal those of @key */
+static int
+librdf_query_rasqal_batch_matches(librdf_statement* statement,
+                                  librdf_statement* key, int mask)
+{
+  if((mask & 1) && !librdf_node_equals(statement->subject, key->subject))
+    return 0;
+  if((mask & 2) && !librdf_node_equals(statement->predicate, key->predicate))
+    return 0;
+  if((mask & 4) && !librdf_node_equals(statement->object, key->object))
+    return 0;
 
-  return 0;
+  return 1;
 }
 
 
-static librdf_query_results*
-librdf_query_rasqal_execute(librdf_query* query, librdf_model* model)
+/*
+ * librdf_query_rasqal_batch_fetch:
+ * @context: query context
+ * @batch: pattern lookup state
+ * @model: model
+ * @partial: statement with the constant terms of the pattern
+ *
+ * INTERNAL - Fetch and index all statements matching the constant terms
+ *
+ * Return value: non-0 if the pattern should not be batched
+ */
+static int
+librdf_query_rasqal_batch_fetch(librdf_query_rasqal_context* context,
+                                librdf_query_rasqal_batch* batch,
+                                librdf_model* model,
+                                librdf_statement* partial)
 {
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  librdf_query_results* results;
+  librdf_stream* stream;
+  int size=0;
+  int i;
 
-  if (context->model)
-    librdf_free_model(context->model);
-  /* model is always non-NULL */
-  context->model = model;
-  librdf_model_add_reference(model);
+  stream=librdf_model_find_statements(model, partial);
+  if(!stream)
+    return 1;
 
-  /* This assumes raptor's URI implementation is librdf_uri */
-  if(rasqal_query_prepare(context->rq, context->query_string, 
-                          (raptor_uri*)context->uri))
-    return NULL;
+  while(!librdf_stream_end(stream)) {
+    librdf_statement* statement;
 
-  if(context->results)
-    rasqal_free_query_results(context->results);
-  
-  context->results=rasqal_query_execute(context->rq);
-  if(!context->results)
-    return NULL;
-  
-  results = LIBRDF_MALLOC(librdf_query_results*, sizeof(*results));
-  if(!results) {
-    rasqal_free_query_results(context->results);
-    context->results=NULL;
-  } else {
-    results->query=query;
+    if(context->query->cancelled ||
+       batch->statements_count == LIBRDF_QUERY_RASQAL_BATCH_MAX_STATEMENTS)
+      break;
+
+    if(batch->statements_count == size) {
+      librdf_statement** statements;
+
+      size=size ? size * 2 : 256;
+      statements=LIBRDF_MALLOC(librdf_statement**,
+                               size * sizeof(librdf_statement*));
+      if(!statements)
+        break;
+      if(batch->statements) {
+        memcpy(statements, batch->statements,
+               batch->statements_count * sizeof(librdf_statement*));
+        LIBRDF_FREE(librdf_statement**, batch->statements);
+      }
+      batch->statements=statements;
+    }
+
+    statement=librdf_new_statement_from_statement(librdf_stream_get_object(stream));
+    if(!statement)
+      break;
+    batch->statements[batch->statements_count++]=statement;
+
+    librdf_stream_next(stream);
   }
-  
-  return results;
-}
 
+  if(!librdf_stream_end(stream)) {
+    /* too many, cancelled or out of memory */
+    librdf_free_stream(stream);
+    librdf_query_rasqal_batch_clear(batch);
+    return 1;
+  }
+  librdf_free_stream(stream);
+
+  for(batch->buckets_mask=15;
+      batch->buckets_mask < (unsigned int)batch->statements_count;
+      batch->buckets_mask=(batch->buckets_mask << 1) | 1)
+    ;
+  batch->buckets=LIBRDF_CALLOC(int*, batch->buckets_mask + 1, sizeof(int));
+  batch->next=LIBRDF_CALLOC(int*, batch->statements_count + 1, sizeof(int));
+  if(!batch->buckets || !batch->next) {
+    librdf_query_rasqal_batch_clear(batch);
+    return 1;
+  }
 
-static int
-librdf_query_rasqal_get_limit(librdf_query* query)
-{
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  return rasqal_query_get_limit(context->rq);
-}
+  for(i=0; i < batch->statements_count; i++) {
+    unsigned int bucket;
 
+    bucket=librdf_query_rasqal_batch_hash(batch->statements[i],
+                                          batch->key_mask) & batch->buckets_mask;
+    batch->next[i]=batch->buckets[bucket];
+    batch->buckets[bucket]=i + 1;
+  }
 
-static int
-librdf_query_rasqal_set_limit(librdf_query* query, int limit)
-{
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  rasqal_query_set_limit(context->rq, limit);
   return 0;
 }
 
 
-static int
-librdf_query_rasqal_get_offset(librdf_query* query)
-{
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  return rasqal_query_get_offset(context->rq);
-}
+typedef struct {
+  librdf_query_rasqal_batch* batch;
+  librdf_statement* key;      /* shared; bound parts to match */
+  int current;                /* statement index + 1 or 0 at end */
+} librdf_query_rasqal_batch_stream_context;
 
 
 static int
-librdf_query_rasqal_set_offset(librdf_query* query, int offset)
+librdf_query_rasqal_batch_stream_end(void* context)
 {
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  rasqal_query_set_offset(context->rq, offset);
-  return 0;
-}
+  librdf_query_rasqal_batch_stream_context* bsc=(librdf_query_rasqal_batch_stream_context*)context;
 
-
-static int
-librdf_query_rasqal_results_get_count(librdf_query_results *query_results)
-{
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  return rasqal_query_results_get_count(context->results);
+  return !bsc->current;
 }
 
 
-static int
-librdf_query_rasqal_results_next(librdf_query_results *query_results)
+/* Move to the next indexed statement from @index + 1 that matches the key */
+static void
+librdf_query_rasqal_batch_stream_find(librdf_query_rasqal_batch_stream_context* bsc,
+                                      int index)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_query_rasqal_batch* batch=bsc->batch;
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_next(context->results);
+  while(index &&
+        !librdf_query_rasqal_batch_matches(batch->statements[index - 1],
+                                           bsc->key, batch->key_mask))
+    index=batch->next[index - 1];
+
+  bsc->current=index;
 }
 
 
 static int
-librdf_query_rasqal_results_finished(librdf_query_results *query_results)
+librdf_query_rasqal_batch_stream_next(void* context)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_query_rasqal_batch_stream_context* bsc=(librdf_query_rasqal_batch_stream_context*)context;
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_finished(context->results);
+  if(bsc->current)
+    librdf_query_rasqal_batch_stream_find(bsc,
+                                          bsc->batch->next[bsc->current - 1]);
+
+  return !bsc->current;
 }
 
 
-static int
-librdf_query_rasqal_results_get_bindings(librdf_query_results *query_results, 
-                                         const char ***names, 
-                                         librdf_node **values)
+static void*
+librdf_query_rasqal_batch_stream_get(void* context, int flags)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  rasqal_literal **literals;
-  int rc;
-  int i;
-
-  if(!context->results)
-    return 1;
-  
-  if(values) {
-    rc=rasqal_query_results_get_bindings(context->results, (const unsigned char ***)names, &literals);
-  } else
-    rc=rasqal_query_results_get_bindings(context->results, (const unsigned char ***)names, NULL);
+  librdf_query_rasqal_batch_stream_context* bsc=(librdf_query_rasqal_batch_stream_context*)context;
 
-  if(rc || !values)
-    return rc;
+  if(!bsc->current)
+    return NULL;
 
-  for(i=0; i<rasqal_query_results_get_bindings_count(context->results); i++)
-    values[i]=rasqal_literal_to_redland_node(query->world, literals[i]);
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return bsc->batch->statements[bsc->current - 1];
 
-  return 0;
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+    default:
+      return NULL;
+  }
 }
 
 
-static librdf_node*
-librdf_query_rasqal_results_get_binding_value(librdf_query_results *query_results, int offset)
+static void
+librdf_query_rasqal_batch_stream_finished(void* context)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  rasqal_literal* literal;
+  librdf_query_rasqal_batch_stream_context* bsc=(librdf_query_rasqal_batch_stream_context*)context;
 
-  literal=rasqal_query_results_get_binding_value(context->results, offset);
-
-  return rasqal_literal_to_redland_node(query->world, literal);
+  LIBRDF_FREE(librdf_query_rasqal_batch_stream_context, bsc);
 }
 
 
-static const char*
-librdf_query_rasqal_results_get_binding_name(librdf_query_results *query_results, int offset)
+/*
+ * librdf_query_rasqal_batch_find:
+ * @context: query context
+ * @model: model
+ * @t: triple pattern
+ * @qstatement: query statement with constant and bound parts
+ * @mask: bound parts of @qstatement
+ *
+ * INTERNAL - Find statements for a pattern with bound variables from a batch
+ *
+ * Return value: stream or NULL if the lookup must go to the model
+ */
+static librdf_stream*
+librdf_query_rasqal_batch_find(librdf_query_rasqal_context* context,
+                               librdf_model* model, rasqal_triple* t,
+                               librdf_statement* qstatement, int mask)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_query_rasqal_batch* batch;
+  librdf_query_rasqal_batch_stream_context* bsc;
+  librdf_stream* stream;
+  unsigned int bucket;
 
-  if(!context->results)
+  batch=librdf_query_rasqal_get_batch(context, t);
+  if(!batch || batch->state < 0)
     return NULL;
-  
-  return (const char*)rasqal_query_results_get_binding_name(context->results, offset);
-}
 
+  if(batch->state == 0) {
+    librdf_statement* partial;
 
-static librdf_node*
-librdf_query_rasqal_results_get_binding_value_by_name(librdf_query_results *query_results, const char *name)
-{
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  rasqal_literal* literal;
+    if(batch->key_mask != mask) {
+      /* counting starts again when different parts are bound */
+      batch->key_mask=mask;
+      batch->probes=0;
+    }
+    if(++batch->probes < LIBRDF_QUERY_RASQAL_BATCH_PROBES)
+      return NULL;
 
-  if(!context->results)
+    partial=librdf_new_statement_from_nodes(context->query->world,
+                                            (!(mask & 1) && qstatement->subject) ? librdf_new_node_from_node(qstatement->subject) : NULL,
+                                            (!(mask & 2) && qstatement->predicate) ? librdf_new_node_from_node(qstatement->predicate) : NULL,
+                                            (!(mask & 4) && qstatement->object) ? librdf_new_node_from_node(qstatement->object) : NULL);
+    if(!partial)
+      return NULL;
+
+    batch->state=librdf_query_rasqal_batch_fetch(context, batch, model,
+                                                 partial) ? -1 : 1;
+    librdf_free_statement(partial);
+    if(batch->state < 0)
+      return NULL;
+  }
+
+  if(batch->key_mask != mask)
     return NULL;
-  
-  literal=rasqal_query_results_get_binding_value_by_name(context->results, (const unsigned char*)name);
 
-  return rasqal_literal_to_redland_node(query->world, literal);
-}
+  bsc=LIBRDF_CALLOC(librdf_query_rasqal_batch_stream_context*, 1,
+                    sizeof(*bsc));
+  if(!bsc)
+    return NULL;
+  bsc->batch=batch;
+  bsc->key=qstatement;
 
+  bucket=librdf_query_rasqal_batch_hash(qstatement, mask) & batch->buckets_mask;
+  librdf_query_rasqal_batch_stream_find(bsc, batch->buckets[bucket]);
 
-static int
-librdf_query_rasqal_results_get_bindings_count(librdf_query_results *query_results)
-{
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  stream=librdf_new_stream(context->query->world, (void*)bsc,
+                           &librdf_query_rasqal_batch_stream_end,
+                           &librdf_query_rasqal_batch_stream_next,
+                           &librdf_query_rasqal_batch_stream_get,
+                           &librdf_query_rasqal_batch_stream_finished);
+  if(!stream)
+    librdf_query_rasqal_batch_stream_finished((void*)bsc);
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_get_bindings_count(context->results);
+  return stream;
 }
 
 
+/*
+ * Filter pushdown
+ *
+ * Rasqal evaluates FILTER expressions one row at a time on boxed
+ * rasqal_literal values.  Comparisons of a variable with a constant
+ * that are ANDed into the top-level FILTERs are found once per query
+ * and applied where a triple pattern first binds the variable:
+ * sameTerm() and = with a URI become a constant term of the storage
+ * pattern match, and numeric comparisons and string equality are run
+ * over batches of matched statements whose terms are unboxed into
+ * integer, double and string columns.  Rasqal still evaluates the
+ * whole FILTER on the rows left, so only statements that certainly
+ * fail a condition are dropped; values of other types are kept.
+ */
+
 static void
-librdf_query_rasqal_free_results(librdf_query_results* query_results)
+librdf_query_rasqal_free_conditions(librdf_query_rasqal_context* context)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  int i;
 
-  if(!context->results)
-    return;
-  
-  rasqal_free_query_results(context->results);
-  context->results=NULL;
+  if(context->conditions) {
+    for(i=0; i < context->conditions_count; i++) {
+      if(context->conditions[i].node)
+        librdf_free_node(context->conditions[i].node);
+    }
+    LIBRDF_FREE(librdf_query_rasqal_condition*, context->conditions);
+    context->conditions=NULL;
+  }
+  context->conditions_count=0;
 }
 
 
-static int
-librdf_query_rasqal_results_is_bindings(librdf_query_results* query_results)
+/* Get the variable of a variable expression or NULL */
+static rasqal_variable*
+librdf_query_rasqal_expression_variable(rasqal_expression* e)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  if(e->op != RASQAL_EXPR_LITERAL || !e->literal)
+    return NULL;
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_is_bindings(context->results);
+  return rasqal_literal_as_variable(e->literal);
 }
-  
 
-static int
-librdf_query_rasqal_results_is_boolean(librdf_query_results* query_results)
+
+/* Get the constant literal of an expression or NULL */
+static rasqal_literal*
+librdf_query_rasqal_expression_constant(rasqal_expression* e)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  if(e->op != RASQAL_EXPR_LITERAL || !e->literal ||
+     rasqal_literal_as_variable(e->literal))
+    return NULL;
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_is_boolean(context->results);
+  return e->literal;
 }
 
 
+/* Characters with a meaning in a REGEX pattern */
+static const char librdf_query_rasqal_regex_special[]=".[]()*+?{}|\\^$";
+
+
+/*
+ * librdf_query_rasqal_text_condition:
+ * @context: query context
+ * @e: CONTAINS, STRSTARTS or REGEX expression
+ * @condition: condition to fill
+ *
+ * INTERNAL - Get the text a literal variable must contain or start with
+ *
+ * A REGEX pattern is only used when it has no flags and is plain text,
+ * optionally anchored at the start.
+ *
+ * Return value: non-0 if @condition was filled
+ */
 static int
-librdf_query_rasqal_results_is_graph(librdf_query_results* query_results)
+librdf_query_rasqal_text_condition(librdf_query_rasqal_context* context,
+                                   rasqal_expression* e,
+                                   librdf_query_rasqal_condition* condition)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_literal* l;
+  const unsigned char* text;
+  size_t len;
+  int prefix;
+  size_t i;
+
+  condition->variable=librdf_query_rasqal_expression_variable(e->arg1);
+  l=librdf_query_rasqal_expression_constant(e->arg2);
+  if(!condition->variable || !l || !l->string ||
+     (l->type != RASQAL_LITERAL_STRING && l->type != RASQAL_LITERAL_XSD_STRING))
+    return 0;
+
+  text=l->string;
+  len=l->string_len;
+  prefix=(e->op == RASQAL_EXPR_STRSTARTS);
+
+  if(e->op == RASQAL_EXPR_REGEX) {
+    if(e->arg3)
+      return 0;
+    if(len && *text == '^') {
+      prefix=1;
+      text++;
+      len--;
+    }
+    for(i=0; i < len; i++) {
+      if(strchr(librdf_query_rasqal_regex_special, text[i]))
+        return 0;
+    }
+  }
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_is_graph(context->results);
-}
+  if(!len)
+    return 0;
 
+  condition->node=librdf_new_node_from_typed_counted_literal(context->query->world,
+                                                             text, len,
+                                                             NULL, 0, NULL);
+  if(!condition->node)
+    return 0;
 
-static int
-librdf_query_rasqal_results_is_syntax(librdf_query_results* query_results)
-{
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  condition->op=prefix ? RASQAL_EXPR_STRSTARTS : RASQAL_EXPR_CONTAINS;
+  condition->kind=LIBRDF_QUERY_RASQAL_VALUE_TEXT;
 
-  if(!context->results)
-    return 1;
-  
-  return rasqal_query_results_is_syntax(context->results);
+  return 1;
 }
 
 
+/*
+ * librdf_query_rasqal_add_conditions:
+ * @context: query context
+ * @e: FILTER expression
+ *
+ * INTERNAL - Add the variable and constant comparisons ANDed in a FILTER expression
+ *
+ * Return value: non-0 on failure
+ */
 static int
-librdf_query_rasqal_results_get_boolean(librdf_query_results* query_results)
+librdf_query_rasqal_add_conditions(librdf_query_rasqal_context* context,
+                                   rasqal_expression* e)
 {
-  librdf_query *query=query_results->query;
-  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_query_rasqal_condition condition;
+  librdf_query_rasqal_condition* conditions;
+  rasqal_expression* constant_e;
+  rasqal_literal* l;
+  rasqal_op op;
 
-  if(!context->results)
-    return -1;
-  
-  return rasqal_query_results_get_boolean(context->results);
-}
+  if(e->op == RASQAL_EXPR_AND) {
+    if(librdf_query_rasqal_add_conditions(context, e->arg1))
+      return 1;
+    return librdf_query_rasqal_add_conditions(context, e->arg2);
+  }
 
+  memset(&condition, '\0', sizeof(condition));
 
-typedef struct {
-  librdf_query *query;
-  
-  librdf_query_rasqal_context* qcontext; /* query context */
+  switch(e->op) {
+    case RASQAL_EXPR_EQ:
+    case RASQAL_EXPR_LT:
+    case RASQAL_EXPR_GT:
+    case RASQAL_EXPR_LE:
+    case RASQAL_EXPR_GE:
+    case RASQAL_EXPR_SAMETERM:
+      break;
 
-  librdf_statement* statement; /* current statement */
-  int finished;
-} librdf_query_rasqal_stream_context;
+    case RASQAL_EXPR_CONTAINS:
+    case RASQAL_EXPR_STRSTARTS:
+    case RASQAL_EXPR_REGEX:
+      if(!librdf_query_rasqal_text_condition(context, e, &condition))
+        return 0;
+      goto add;
 
+    default:
+      return 0;
+  }
 
-static int
-librdf_query_rasqal_query_results_end_of_stream(void* context)
-{
-  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+  op=e->op;
+  condition.variable=librdf_query_rasqal_expression_variable(e->arg1);
+  constant_e=e->arg2;
+  if(!condition.variable) {
+    /* constant first: swap the sides */
+    condition.variable=librdf_query_rasqal_expression_variable(e->arg2);
+    constant_e=e->arg1;
+    if(op == RASQAL_EXPR_LT)
+      op=RASQAL_EXPR_GT;
+    else if(op == RASQAL_EXPR_GT)
+      op=RASQAL_EXPR_LT;
+    else if(op == RASQAL_EXPR_LE)
+      op=RASQAL_EXPR_GE;
+    else if(op == RASQAL_EXPR_GE)
+      op=RASQAL_EXPR_LE;
+  }
+  l=librdf_query_rasqal_expression_constant(constant_e);
+  if(!condition.variable || !l)
+    return 0;
+  condition.op=op;
+
+  if(op == RASQAL_EXPR_SAMETERM ||
+     (op == RASQAL_EXPR_EQ && l->type == RASQAL_LITERAL_URI)) {
+    condition.node=librdf_query_rasqal_literal_to_node(context, l);
+    if(!condition.node)
+      return 0;
+    condition.kind=LIBRDF_QUERY_RASQAL_VALUE_TERM;
+  } else if(l->type == RASQAL_LITERAL_INTEGER) {
+    condition.integer=l->value.integer;
+    condition.number=(double)l->value.integer;
+    condition.kind=LIBRDF_QUERY_RASQAL_VALUE_INTEGER;
+  } else if(l->type == RASQAL_LITERAL_DOUBLE ||
+            l->type == RASQAL_LITERAL_FLOAT) {
+    condition.number=l->value.floating;
+    condition.kind=LIBRDF_QUERY_RASQAL_VALUE_DOUBLE;
+  } else if(l->type == RASQAL_LITERAL_DECIMAL && l->string) {
+    condition.number=strtod((const char*)l->string, NULL);
+    condition.kind=LIBRDF_QUERY_RASQAL_VALUE_DOUBLE;
+  } else if(op == RASQAL_EXPR_EQ && l->string && !l->language &&
+            (l->type == RASQAL_LITERAL_XSD_STRING ||
+             (l->type == RASQAL_LITERAL_STRING && !l->datatype))) {
+    condition.string=l->string;
+    condition.string_len=l->string_len;
+    condition.kind=LIBRDF_QUERY_RASQAL_VALUE_STRING;
+  } else
+    return 0;
+
+  add:
+  conditions=LIBRDF_MALLOC(librdf_query_rasqal_condition*,
+                           (context->conditions_count + 1) * sizeof(condition));
+  if(!conditions) {
+    if(condition.node)
+      librdf_free_node(condition.node);
+    return 1;
+  }
+  if(context->conditions) {
+    memcpy(conditions, context->conditions,
+           context->conditions_count * sizeof(condition));
+    LIBRDF_FREE(librdf_query_rasqal_condition*, context->conditions);
+  }
+  context->conditions=conditions;
+  conditions[context->conditions_count++]=condition;
 
-  return scontext->finished;
+  return 0;
 }
 
+
+/* Check every row of a graph pattern is in the scope of its outer FILTERs */
 static int
-librdf_query_rasqal_query_results_update_statement(void* context)
+librdf_query_rasqal_filter_scoped(rasqal_graph_pattern* gp)
+{
+  rasqal_graph_pattern* sgp;
+  int i;
+
+  switch(rasqal_graph_pattern_get_operator(gp)) {
+    case RASQAL_GRAPH_PATTERN_OPERATOR_BASIC:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_GROUP:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_OPTIONAL:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_UNION:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_FILTER:
+      break;
+
+    default:
+      /* MINUS, sub-SELECT, SERVICE, GRAPH... */
+      return 0;
+  }
+
+  for(i=0; (sgp=rasqal_graph_pattern_get_sub_graph_pattern(gp, i)); i++) {
+    if(!librdf_query_rasqal_filter_scoped(sgp))
+      return 0;
+  }
+
+  return 1;
+}
+
+
+/*
+ * librdf_query_rasqal_get_conditions:
+ * @context: query context
+ *
+ * INTERNAL - Find the comparisons of the top-level FILTERs of the query, once
+ */
+static void
+librdf_query_rasqal_get_conditions(librdf_query_rasqal_context* context)
+{
+  rasqal_graph_pattern* gp;
+  rasqal_graph_pattern* sgp;
+  rasqal_expression* e;
+  int i;
+
+  if(context->conditions_found)
+    return;
+  context->conditions_found=1;
+
+  gp=rasqal_query_get_query_graph_pattern(context->rq);
+  if(!gp || !librdf_query_rasqal_filter_scoped(gp))
+    return;
+
+  switch(rasqal_graph_pattern_get_operator(gp)) {
+    case RASQAL_GRAPH_PATTERN_OPERATOR_BASIC:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_GROUP:
+      break;
+
+    default:
+      return;
+  }
+
+  e=rasqal_graph_pattern_get_filter_expression(gp);
+  if(e && librdf_query_rasqal_add_conditions(context, e))
+    goto failed;
+
+  if(rasqal_graph_pattern_get_operator(gp) != RASQAL_GRAPH_PATTERN_OPERATOR_GROUP)
+    return;
+
+  for(i=0; (sgp=rasqal_graph_pattern_get_sub_graph_pattern(gp, i)); i++) {
+    if(rasqal_graph_pattern_get_operator(sgp) != RASQAL_GRAPH_PATTERN_OPERATOR_FILTER)
+      continue;
+    e=rasqal_graph_pattern_get_filter_expression(sgp);
+    if(e && librdf_query_rasqal_add_conditions(context, e))
+      goto failed;
+  }
+
+  return;
+
+  failed:
+  /* conditions are only an optimization */
+  librdf_query_rasqal_free_conditions(context);
+}
+
+
+typedef struct {
+  librdf_stream* stream;      /* statements to filter */
+  /* conditions and the statement position 0-2 each tests */
+  librdf_query_rasqal_condition** conditions;
+  int* positions;
+  int conditions_count;
+
+  /* current batch; statements are owned */
+  librdf_statement* statements[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+  int count;
+  int current;
+
+  /* unboxed terms at one position of the batch */
+  unsigned char kinds[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+  long integers[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+  double numbers[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+  const unsigned char* strings[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+  size_t strings_len[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+  unsigned char keep[LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE];
+} librdf_query_rasqal_filter_stream_context;
+
+
+/* Unbox the literal values of the terms at @position of the batch */
+static void
+librdf_query_rasqal_filter_unbox(librdf_query_rasqal_filter_stream_context* fsc,
+                                 int position)
+{
+  static const char xsd[]="http://www.w3.org/2001/XMLSchema#";
+  int i;
+
+  for(i=0; i < fsc->count; i++) {
+    librdf_statement* statement=fsc->statements[i];
+    librdf_node* node;
+    librdf_uri* datatype;
+    const char* type;
+    const unsigned char* value;
+    size_t value_len;
+    char* end;
+
+    node=(position == 0) ? statement->subject :
+         (position == 1) ? statement->predicate : statement->object;
+    fsc->kinds[i]=LIBRDF_QUERY_RASQAL_VALUE_NONE;
+    if(!node || !librdf_node_is_literal(node) ||
+       librdf_node_get_literal_value_language(node))
+      continue;
+
+    value=librdf_node_get_literal_value_as_counted_string(node, &value_len);
+    if(!value)
+      continue;
+
+    datatype=librdf_node_get_literal_value_datatype_uri(node);
+    if(!datatype) {
+      fsc->strings[i]=value;
+      fsc->strings_len[i]=value_len;
+      fsc->kinds[i]=LIBRDF_QUERY_RASQAL_VALUE_STRING;
+      continue;
+    }
+
+    type=(const char*)librdf_uri_as_string(datatype);
+    if(strncmp(type, xsd, sizeof(xsd) - 1))
+      continue;
+    type += sizeof(xsd) - 1;
+
+    if(!strcmp(type, "string")) {
+      fsc->strings[i]=value;
+      fsc->strings_len[i]=value_len;
+      fsc->kinds[i]=LIBRDF_QUERY_RASQAL_VALUE_STRING;
+    } else if(!strcmp(type, "integer") || !strcmp(type, "int") ||
+              !strcmp(type, "long") || !strcmp(type, "short") ||
+              !strcmp(type, "byte") || strstr(type, "Integer") ||
+              !strncmp(type, "unsigned", 8)) {
+      /* no more digits than a long holds */
+      if(!value_len || value_len > 18)
+        continue;
+      fsc->integers[i]=strtol((const char*)value, &end, 10);
+      if(*end)
+        continue;
+      fsc->numbers[i]=(double)fsc->integers[i];
+      fsc->kinds[i]=LIBRDF_QUERY_RASQAL_VALUE_INTEGER;
+    } else if(!strcmp(type, "double") || !strcmp(type, "float") ||
+              !strcmp(type, "decimal")) {
+      if(!value_len)
+        continue;
+      fsc->numbers[i]=strtod((const char*)value, &end);
+      if(*end)
+        continue;
+      fsc->kinds[i]=LIBRDF_QUERY_RASQAL_VALUE_DOUBLE;
+    }
+  }
+}
+
+
+/* Clear keep for rows of a kind whose column value fails the comparison */
+#define LIBRDF_QUERY_RASQAL_FILTER_COLUMN(fsc, kind, column, cmp, value) \
+  do { \
+    int i_; \
+    for(i_=0; i_ < (fsc)->count; i_++) { \
+      if((fsc)->kinds[i_] == (kind) && !((fsc)->column[i_] cmp (value))) \
+        (fsc)->keep[i_]=0; \
+    } \
+  } while(0)
+
+#define LIBRDF_QUERY_RASQAL_FILTER_NUMBERS(fsc, c, cmp) \
+  do { \
+    if((c)->kind == LIBRDF_QUERY_RASQAL_VALUE_INTEGER) \
+      LIBRDF_QUERY_RASQAL_FILTER_COLUMN(fsc, LIBRDF_QUERY_RASQAL_VALUE_INTEGER, integers, cmp, (c)->integer); \
+    else \
+      LIBRDF_QUERY_RASQAL_FILTER_COLUMN(fsc, LIBRDF_QUERY_RASQAL_VALUE_INTEGER, numbers, cmp, (c)->number); \
+    LIBRDF_QUERY_RASQAL_FILTER_COLUMN(fsc, LIBRDF_QUERY_RASQAL_VALUE_DOUBLE, numbers, cmp, (c)->number); \
+  } while(0)
+
+
+/* Apply one condition to the unboxed column of the batch */
+static void
+librdf_query_rasqal_filter_apply(librdf_query_rasqal_filter_stream_context* fsc,
+                                 librdf_query_rasqal_condition* c)
+{
+  int i;
+
+  if(c->kind == LIBRDF_QUERY_RASQAL_VALUE_STRING) {
+    for(i=0; i < fsc->count; i++) {
+      if(fsc->kinds[i] == LIBRDF_QUERY_RASQAL_VALUE_STRING &&
+         (fsc->strings_len[i] != c->string_len ||
+          memcmp(fsc->strings[i], c->string, c->string_len)))
+        fsc->keep[i]=0;
+    }
+    return;
+  }
+
+  switch(c->op) {
+    case RASQAL_EXPR_EQ:
+      LIBRDF_QUERY_RASQAL_FILTER_NUMBERS(fsc, c, ==);
+      break;
+    case RASQAL_EXPR_LT:
+      LIBRDF_QUERY_RASQAL_FILTER_NUMBERS(fsc, c, <);
+      break;
+    case RASQAL_EXPR_GT:
+      LIBRDF_QUERY_RASQAL_FILTER_NUMBERS(fsc, c, >);
+      break;
+    case RASQAL_EXPR_LE:
+      LIBRDF_QUERY_RASQAL_FILTER_NUMBERS(fsc, c, <=);
+      break;
+    case RASQAL_EXPR_GE:
+      LIBRDF_QUERY_RASQAL_FILTER_NUMBERS(fsc, c, >=);
+      break;
+    default:
+      break;
+  }
+}
+
+
+static void
+librdf_query_rasqal_filter_stream_clear(librdf_query_rasqal_filter_stream_context* fsc)
+{
+  int i;
+
+  for(i=0; i < fsc->count; i++) {
+    if(fsc->statements[i])
+      librdf_free_statement(fsc->statements[i]);
+  }
+  fsc->count=0;
+  fsc->current=0;
+}
+
+
+/* Move to the next kept statement, reading and filtering batches as needed */
+static void
+librdf_query_rasqal_filter_stream_find(librdf_query_rasqal_filter_stream_context* fsc)
+{
+  while(1) {
+    int position= -1;
+    int i;
+
+    for(; fsc->current < fsc->count; fsc->current++) {
+      if(fsc->keep[fsc->current])
+        return;
+    }
+
+    librdf_query_rasqal_filter_stream_clear(fsc);
+    while(fsc->count < LIBRDF_QUERY_RASQAL_FILTER_BATCH_SIZE &&
+          !librdf_stream_end(fsc->stream)) {
+      librdf_statement* statement;
+
+      statement=librdf_new_statement_from_statement(librdf_stream_get_object(fsc->stream));
+      librdf_stream_next(fsc->stream);
+      if(!statement)
+        continue;
+      fsc->keep[fsc->count]=1;
+      fsc->statements[fsc->count++]=statement;
+    }
+    if(!fsc->count)
+      return;
+
+    for(i=0; i < fsc->conditions_count; i++) {
+      if(fsc->positions[i] != position) {
+        position=fsc->positions[i];
+        librdf_query_rasqal_filter_unbox(fsc, position);
+      }
+      librdf_query_rasqal_filter_apply(fsc, fsc->conditions[i]);
+    }
+  }
+}
+
+
+static int
+librdf_query_rasqal_filter_stream_end(void* context)
+{
+  librdf_query_rasqal_filter_stream_context* fsc=(librdf_query_rasqal_filter_stream_context*)context;
+
+  return fsc->current >= fsc->count;
+}
+
+
+static int
+librdf_query_rasqal_filter_stream_next(void* context)
+{
+  librdf_query_rasqal_filter_stream_context* fsc=(librdf_query_rasqal_filter_stream_context*)context;
+
+  if(fsc->current < fsc->count) {
+    fsc->current++;
+    librdf_query_rasqal_filter_stream_find(fsc);
+  }
+
+  return fsc->current >= fsc->count;
+}
+
+
+static void*
+librdf_query_rasqal_filter_stream_get(void* context, int flags)
+{
+  librdf_query_rasqal_filter_stream_context* fsc=(librdf_query_rasqal_filter_stream_context*)context;
+
+  if(fsc->current >= fsc->count)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return fsc->statements[fsc->current];
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_query_rasqal_filter_stream_finished(void* context)
+{
+  librdf_query_rasqal_filter_stream_context* fsc=(librdf_query_rasqal_filter_stream_context*)context;
+
+  librdf_query_rasqal_filter_stream_clear(fsc);
+  if(fsc->stream)
+    librdf_free_stream(fsc->stream);
+  if(fsc->conditions)
+    LIBRDF_FREE(librdf_query_rasqal_condition**, fsc->conditions);
+  if(fsc->positions)
+    LIBRDF_FREE(int*, fsc->positions);
+  LIBRDF_FREE(librdf_query_rasqal_filter_stream_context, fsc);
+}
+
+
+/*
+ * librdf_query_rasqal_filter_stream:
+ * @context: query context
+ * @stream: statements matching a triple pattern
+ * @bindings: variables bound at the subject, predicate and object of the pattern
+ *
+ * INTERNAL - Filter a pattern's statements by the value conditions on the variables it binds
+ *
+ * @stream is always used and freed.
+ *
+ * Return value: new stream, @stream if there are no conditions, or NULL on failure
+ */
+static librdf_stream*
+librdf_query_rasqal_filter_stream(librdf_query_rasqal_context* context,
+                                  librdf_stream* stream,
+                                  rasqal_variable** bindings)
+{
+  librdf_query_rasqal_filter_stream_context* fsc;
+  librdf_stream* filter_stream;
+  int count=0;
+  int i;
+  int j;
+
+  for(i=0; i < 3; i++) {
+    for(j=0; bindings[i] && j < context->conditions_count; j++) {
+      if(context->conditions[j].variable == bindings[i] &&
+         context->conditions[j].kind != LIBRDF_QUERY_RASQAL_VALUE_TERM &&
+         context->conditions[j].kind != LIBRDF_QUERY_RASQAL_VALUE_TEXT)
+        count++;
+    }
+  }
+  if(!count)
+    return stream;
+
+  fsc=LIBRDF_CALLOC(librdf_query_rasqal_filter_stream_context*, 1,
+                    sizeof(*fsc));
+  if(!fsc) {
+    librdf_free_stream(stream);
+    return NULL;
+  }
+  fsc->stream=stream;
+  fsc->conditions=LIBRDF_CALLOC(librdf_query_rasqal_condition**, count,
+                                sizeof(librdf_query_rasqal_condition*));
+  fsc->positions=LIBRDF_CALLOC(int*, count, sizeof(int));
+  if(!fsc->conditions || !fsc->positions) {
+    librdf_query_rasqal_filter_stream_finished((void*)fsc);
+    return NULL;
+  }
+
+  /* grouped by position so each column is unboxed once per batch */
+  for(i=0; i < 3; i++) {
+    for(j=0; bindings[i] && j < context->conditions_count; j++) {
+      if(context->conditions[j].variable == bindings[i] &&
+         context->conditions[j].kind != LIBRDF_QUERY_RASQAL_VALUE_TERM &&
+         context->conditions[j].kind != LIBRDF_QUERY_RASQAL_VALUE_TEXT) {
+        fsc->conditions[fsc->conditions_count]=&context->conditions[j];
+        fsc->positions[fsc->conditions_count++]=i;
+      }
+    }
+  }
+
+  librdf_query_rasqal_filter_stream_find(fsc);
+
+  filter_stream=librdf_new_stream(context->query->world, (void*)fsc,
+                                  &librdf_query_rasqal_filter_stream_end,
+                                  &librdf_query_rasqal_filter_stream_next,
+                                  &librdf_query_rasqal_filter_stream_get,
+                                  &librdf_query_rasqal_filter_stream_finished);
+  if(!filter_stream)
+    librdf_query_rasqal_filter_stream_finished((void*)fsc);
+
+  return filter_stream;
+}
+
+
+/*
+ * librdf_query_rasqal_find_limit:
+ * @rq: rasqal query
+ *
+ * INTERNAL - Get the number of statements a query can need from its only triple pattern
+ *
+ * Only for SELECT queries of one triple pattern, with no variable
+ * repeated, whose rows are the statements in storage order, so the
+ * storage can stop after the LIMIT and OFFSET rows.
+ *
+ * Return value: the number of statements or <0 for all of them
+ */
+static int
+librdf_query_rasqal_find_limit(rasqal_query* rq)
+{
+  rasqal_graph_pattern* gp;
+  raptor_sequence* seq;
+  rasqal_variable* v;
+  rasqal_triple* t;
+  rasqal_variable* vars[3];
+  int limit;
+  int i;
+
+  limit=rasqal_query_get_limit(rq);
+  if(limit < 0)
+    return -1;
+
+  if(rasqal_query_get_verb(rq) != RASQAL_QUERY_VERB_SELECT ||
+     rasqal_query_get_distinct(rq) ||
+     rasqal_query_get_order_condition(rq, 0) ||
+     rasqal_query_get_group_condition(rq, 0) ||
+     rasqal_query_get_having_condition(rq, 0))
+    return -1;
+
+  /* aggregates and other projected expressions see every row */
+  seq=rasqal_query_get_bound_variable_sequence(rq);
+  for(i=0; seq && i < raptor_sequence_size(seq); i++) {
+    v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+    if(v && v->expression)
+      return -1;
+  }
+
+  gp=rasqal_query_get_query_graph_pattern(rq);
+  if(gp && rasqal_graph_pattern_get_operator(gp) == RASQAL_GRAPH_PATTERN_OPERATOR_GROUP) {
+    if(rasqal_graph_pattern_get_filter_expression(gp))
+      return -1;
+    seq=rasqal_graph_pattern_get_sub_graph_pattern_sequence(gp);
+    if(!seq || raptor_sequence_size(seq) != 1)
+      return -1;
+    gp=rasqal_graph_pattern_get_sub_graph_pattern(gp, 0);
+  }
+  if(!gp ||
+     rasqal_graph_pattern_get_operator(gp) != RASQAL_GRAPH_PATTERN_OPERATOR_BASIC ||
+     rasqal_graph_pattern_get_filter_expression(gp) ||
+     !rasqal_graph_pattern_get_triple(gp, 0) ||
+     rasqal_graph_pattern_get_triple(gp, 1))
+    return -1;
+
+  /* a variable used twice drops the statements whose parts differ
+   * after the storage has stopped */
+  t=rasqal_graph_pattern_get_triple(gp, 0);
+  vars[0]=rasqal_literal_as_variable(t->subject);
+  vars[1]=rasqal_literal_as_variable(t->predicate);
+  vars[2]=rasqal_literal_as_variable(t->object);
+  if((vars[0] && (vars[0] == vars[1] || vars[0] == vars[2])) ||
+     (vars[1] && vars[1] == vars[2]))
+    return -1;
+
+  /* rasqal still skips the OFFSET rows itself */
+  if(rasqal_query_get_offset(rq) > 0)
+    limit += rasqal_query_get_offset(rq);
+
+  return limit;
+}
+
+
+static int
+rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
+                                  rasqal_triples_source *rts, void *user_data,
+                                  rasqal_triple_meta *m, rasqal_triple *t)
+{
+  rasqal_redland_triples_source_user_data* rtsc=(rasqal_redland_triples_source_user_data*)user_data;
+  librdf_query_rasqal_context *qcontext=(librdf_query_rasqal_context*)rtsc->query->context;
+  rasqal_redland_triples_match_context* rtmc;
+  rasqal_variable* var;
+  rasqal_variable* filter_bindings[3]={NULL, NULL, NULL};
+  librdf_query_rasqal_condition* text=NULL;
+  int bound_mask=0;
+  int i;
+  int j;
+
+  rtm->bind_match=rasqal_redland_bind_match;
+  rtm->next_match=rasqal_redland_next_match;
+  rtm->is_end=rasqal_redland_is_end;
+  rtm->finish=rasqal_redland_finish_triples_match;
+
+  rtmc = LIBRDF_CALLOC(rasqal_redland_triples_match_context*, 1, sizeof(*rtmc));
+  if(!rtmc)
+    return 1;
+
+  rtm->user_data=rtmc;
+  rtmc->query=rtsc->query;
+
+
+  /* at least one of the triple terms is a variable and we need to
+   * do a triplesMatching() aka librdf_model_find_statements
+   *
+   * redland find_statements will do the right thing and internally
+   * pick the most efficient, indexed way to get the answer.
+   */
+
+  if((var=rasqal_literal_as_variable(t->subject))) {
+    if(var->value) {
+      rtmc->nodes[0]=librdf_query_rasqal_literal_to_node(qcontext, var->value);
+      bound_mask |= 1;
+    } else
+      rtmc->nodes[0]=NULL;
+  } else
+    rtmc->nodes[0]=librdf_query_rasqal_literal_to_node(qcontext, t->subject);
+
+  m->bindings[0]=var;
+  
+
+  if((var=rasqal_literal_as_variable(t->predicate))) {
+    if(var->value) {
+      rtmc->nodes[1]=librdf_query_rasqal_literal_to_node(qcontext, var->value);
+      bound_mask |= 2;
+    } else
+      rtmc->nodes[1]=NULL;
+  } else
+    rtmc->nodes[1]=librdf_query_rasqal_literal_to_node(qcontext, t->predicate);
+
+  m->bindings[1]=var;
+  
+
+  if((var=rasqal_literal_as_variable(t->object))) {
+    if(var->value) {
+      rtmc->nodes[2]=librdf_query_rasqal_literal_to_node(qcontext, var->value);
+      bound_mask |= 4;
+    } else
+      rtmc->nodes[2]=NULL;
+  } else
+    rtmc->nodes[2]=librdf_query_rasqal_literal_to_node(qcontext, t->object);
+
+  m->bindings[2]=var;
+  
+
+  if(t->origin) {
+    if((var=rasqal_literal_as_variable(t->origin))) {
+      if(var->value)
+        rtmc->origin=librdf_query_rasqal_literal_to_node(qcontext, var->value);
+    } else
+      rtmc->origin=librdf_query_rasqal_literal_to_node(qcontext, t->origin);
+    m->bindings[3]=var;
+
+    /* batches do not keep statement contexts */
+    bound_mask=0;
+  } else {
+    /* FILTER comparisons on the variables this pattern binds */
+    librdf_query_rasqal_get_conditions(qcontext);
+    for(i=0; i < 3; i++) {
+      if(rtmc->nodes[i] || !m->bindings[i])
+        continue;
+      filter_bindings[i]=m->bindings[i];
+      for(j=0; j < qcontext->conditions_count; j++) {
+        librdf_query_rasqal_condition* c=&qcontext->conditions[j];
+
+        if(c->variable == m->bindings[i] &&
+           c->kind == LIBRDF_QUERY_RASQAL_VALUE_TERM && !rtmc->nodes[i])
+          rtmc->nodes[i]=librdf_new_node_from_node(c->node);
+      }
+    }
+
+    /* a text match of the free object may use the storage text index */
+    for(j=0; !rtmc->nodes[2] && m->bindings[2] &&
+          j < qcontext->conditions_count; j++) {
+      if(qcontext->conditions[j].variable == m->bindings[2] &&
+         qcontext->conditions[j].kind == LIBRDF_QUERY_RASQAL_VALUE_TEXT) {
+        text=&qcontext->conditions[j];
+        break;
+      }
+    }
+  }
+
+
+  rtmc->qstatement=librdf_new_statement_from_nodes(rtsc->world, 
+                                                   rtmc->nodes[0],
+                                                   rtmc->nodes[1], 
+                                                   rtmc->nodes[2]);
+  if(!rtmc->qstatement)
+    return 1;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG1("query statement: ");
+  librdf_statement_print(rtmc->qstatement, stderr);
+  if(rtmc->origin) {
+    fput(" with context node: ", stderr);
+    librdf_node_print(rtmc->origin, stderr);
+  }
+  fputc('\n', stderr);
+#endif
+  
+  if(rtmc->origin)
+    rtmc->stream=librdf_model_find_statements_in_context(rtsc->model, 
+                                                         rtmc->qstatement,
+                                                         rtmc->origin);
+  else {
+    if(bound_mask)
+      rtmc->stream=librdf_query_rasqal_batch_find(qcontext, rtsc->model, t,
+                                                  rtmc->qstatement,
+                                                  bound_mask);
+    if(!rtmc->stream) {
+      int limit=librdf_query_rasqal_find_limit(qcontext->rq);
+
+      if(text && !librdf_query_rasqal_text_index(qcontext))
+        text=NULL;
+
+      if(limit >= 0 || text) {
+        librdf_hash* options;
+        char buffer[16];
+        int rc=0;
+
+        options=librdf_new_hash(rtsc->world, NULL);
+        if(options) {
+          if(limit >= 0) {
+            sprintf(buffer, "%d", limit);
+            rc=librdf_hash_put_strings(options, "limit", buffer);
+          }
+          if(!rc && text) {
+            rc=librdf_hash_put_strings(options,
+                                       text->op == RASQAL_EXPR_STRSTARTS ?
+                                       "match-prefix" : "match-substring",
+                                       "yes");
+            if(!rc)
+              librdf_statement_set_object(rtmc->qstatement,
+                                          librdf_new_node_from_node(text->node));
+          }
+          if(!rc)
+            rtmc->stream=librdf_model_find_statements_with_options(rtsc->model,
+                                                                   rtmc->qstatement,
+                                                                   NULL,
+                                                                   options);
+          librdf_free_hash(options);
+        }
+
+        if(!rtmc->stream && librdf_statement_get_object(rtmc->qstatement)) {
+          librdf_free_node(librdf_statement_get_object(rtmc->qstatement));
+          librdf_statement_set_object(rtmc->qstatement, NULL);
+        }
+      }
+    }
+    if(!rtmc->stream)
+      rtmc->stream=librdf_model_find_statements(rtsc->model,
+                                                rtmc->qstatement);
+    if(rtmc->stream)
+      rtmc->stream=librdf_query_rasqal_filter_stream(qcontext, rtmc->stream,
+                                                     filter_bindings);
+  }
+
+  if(!rtmc->stream)
+    return 1;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG1("rasqal_init_triples_match done\n");
+#endif
+
+  return 0;
+}
+
+
+/*
+ * Triple pattern ordering
+ *
+ * Rasqal joins the triple patterns of a basic graph pattern in the
+ * order they were written and the triples source interface gives it
+ * no way to ask the storage about cardinality.  When the storage
+ * keeps statistics (the storage-statements-count feature and friends)
+ * or counts statements natively, the patterns of each basic graph
+ * pattern are ordered greedily: cheapest first, then the cheapest
+ * pattern sharing a variable with those already chosen.  The prepared
+ * query is written out as SPARQL in that order and prepared again, so
+ * rasqal's own analysis of where each variable is bound stays right.
+ * Queries using features the SPARQL writer may not round-trip are
+ * left alone.
+ */
+
+typedef struct {
+  librdf_query_rasqal_context *context;
+  librdf_storage *storage;
+
+  /* statement count and distinct subjects, predicates and objects */
+  double total;
+  double distinct[3];
+
+  /* triples moved and their original contents, to undo the moves */
+  rasqal_triple **moved;
+  rasqal_triple *saved;
+  int moved_count;
+  int moved_size;
+} librdf_query_rasqal_order_context;
+
+
+/* Get a numeric storage feature or -1 if the storage does not provide it */
+static double
+librdf_query_rasqal_storage_number(librdf_storage* storage,
+                                   const unsigned char* feature_string)
+{
+  librdf_uri* feature;
+  librdf_node* value;
+  double number= -1;
+
+  feature=librdf_new_uri(storage->world, feature_string);
+  if(!feature)
+    return -1;
+
+  value=librdf_storage_get_feature(storage, feature);
+  librdf_free_uri(feature);
+  if(!value)
+    return -1;
+
+  if(librdf_node_is_literal(value))
+    number=strtod((const char*)librdf_node_get_literal_value(value), NULL);
+  librdf_free_node(value);
+
+  return number;
+}
+
+
+/*
+ * librdf_query_rasqal_text_index:
+ * @context: query context
+ *
+ * INTERNAL - Check the storage of the query model keeps a literal text index, asking once
+ *
+ * Return value: non-0 if text matches are served by the storage index
+ */
+static int
+librdf_query_rasqal_text_index(librdf_query_rasqal_context* context)
+{
+  librdf_storage* storage;
+
+  if(!context->text_index) {
+    storage=context->model ? librdf_model_get_storage(context->model) : NULL;
+    context->text_index=(storage &&
+                         librdf_query_rasqal_storage_number(storage,
+                                                            (const unsigned char*)LIBRDF_STORAGE_FEATURE_LITERAL_INDEX) > 0) ? 1 : -1;
+  }
+
+  return (context->text_index > 0);
+}
+
+
+/*
+ * librdf_query_rasqal_pattern_count:
+ * @oc: ordering context
+ * @t: triple pattern
+ *
+ * INTERNAL - Estimate the statements matching the constant terms of a pattern
+ *
+ * Return value: estimated count
+ */
+static double
+librdf_query_rasqal_pattern_count(librdf_query_rasqal_order_context* oc,
+                                  rasqal_triple* t)
+{
+  rasqal_literal* parts[3];
+  librdf_node* nodes[3];
+  double count;
+  int i;
+
+  parts[0]=t->subject;
+  parts[1]=t->predicate;
+  parts[2]=t->object;
+  for(i=0; i < 3; i++) {
+    nodes[i]=NULL;
+    if(parts[i] && !rasqal_literal_as_variable(parts[i]))
+      nodes[i]=librdf_query_rasqal_literal_to_node(oc->context, parts[i]);
+  }
+
+  count= -1;
+  if(oc->storage->factory->count_statements) {
+    librdf_statement* partial;
+
+    partial=librdf_new_statement_from_nodes(oc->storage->world,
+                                            nodes[0] ? librdf_new_node_from_node(nodes[0]) : NULL,
+                                            nodes[1] ? librdf_new_node_from_node(nodes[1]) : NULL,
+                                            nodes[2] ? librdf_new_node_from_node(nodes[2]) : NULL);
+    if(partial) {
+      count=librdf_storage_count_statements(oc->storage, partial);
+      librdf_free_statement(partial);
+    }
+  }
+
+  if(count < 0) {
+    count=oc->total;
+
+    if(nodes[1] && librdf_node_is_resource(nodes[1])) {
+      const unsigned char* uri_string;
+      unsigned char* feature_string;
+      size_t prefix_len=strlen(LIBRDF_STORAGE_FEATURE_PREDICATE_COUNT);
+      size_t len;
+
+      uri_string=librdf_uri_as_counted_string(librdf_node_get_uri(nodes[1]),
+                                              &len);
+      feature_string=LIBRDF_MALLOC(unsigned char*, prefix_len + len + 1);
+      if(feature_string) {
+        double predicate_count;
+
+        memcpy(feature_string, LIBRDF_STORAGE_FEATURE_PREDICATE_COUNT,
+               prefix_len);
+        memcpy(feature_string + prefix_len, uri_string, len + 1);
+        predicate_count=librdf_query_rasqal_storage_number(oc->storage,
+                                                           feature_string);
+        LIBRDF_FREE(char*, feature_string);
+        if(predicate_count >= 0)
+          count=predicate_count;
+        else
+          count /= oc->distinct[1];
+      }
+    }
+
+    /* assume values are spread evenly over the other constant terms */
+    if(nodes[0])
+      count /= oc->distinct[0];
+    if(nodes[2])
+      count /= oc->distinct[2];
+  }
+
+  for(i=0; i < 3; i++) {
+    if(nodes[i])
+      librdf_free_node(nodes[i]);
+  }
+
+  return count;
+}
+
+
+/* Remember the contents of a triple before it is overwritten */
+static int
+librdf_query_rasqal_order_save(librdf_query_rasqal_order_context* oc,
+                               rasqal_triple* t)
+{
+  if(oc->moved_count == oc->moved_size) {
+    int size=oc->moved_size ? oc->moved_size * 2 : 16;
+    rasqal_triple** moved;
+    rasqal_triple* saved;
+
+    moved=LIBRDF_MALLOC(rasqal_triple**, size * sizeof(rasqal_triple*));
+    saved=LIBRDF_MALLOC(rasqal_triple*, size * sizeof(rasqal_triple));
+    if(!moved || !saved) {
+      if(moved)
+        LIBRDF_FREE(rasqal_triple**, moved);
+      if(saved)
+        LIBRDF_FREE(rasqal_triple*, saved);
+      return 1;
+    }
+    if(oc->moved_count) {
+      memcpy(moved, oc->moved, oc->moved_count * sizeof(rasqal_triple*));
+      memcpy(saved, oc->saved, oc->moved_count * sizeof(rasqal_triple));
+      LIBRDF_FREE(rasqal_triple**, oc->moved);
+      LIBRDF_FREE(rasqal_triple*, oc->saved);
+    }
+    oc->moved=moved;
+    oc->saved=saved;
+    oc->moved_size=size;
+  }
+
+  oc->moved[oc->moved_count]=t;
+  oc->saved[oc->moved_count]=*t;
+  oc->moved_count++;
+
+  return 0;
+}
+
+
+/*
+ * librdf_query_rasqal_order_basic:
+ * @oc: ordering context
+ * @gp: basic graph pattern
+ *
+ * INTERNAL - Order the triples of a basic graph pattern by selectivity
+ *
+ * Return value: 1 if the order changed, 0 if not, <0 on failure
+ */
+static int
+librdf_query_rasqal_order_basic(librdf_query_rasqal_order_context* oc,
+                                rasqal_graph_pattern* gp)
+{
+  rasqal_triple** triples;
+  rasqal_triple* copies;
+  rasqal_variable** bound;
+  double* counts;
+  int* order;
+  int count;
+  int bound_count=0;
+  int changed=0;
+  int rc=0;
+  int i;
+  int n;
+
+  for(count=0; rasqal_graph_pattern_get_triple(gp, count); count++)
+    ;
+  if(count < 2)
+    return 0;
+
+  triples=LIBRDF_CALLOC(rasqal_triple**, count, sizeof(rasqal_triple*));
+  copies=LIBRDF_CALLOC(rasqal_triple*, count, sizeof(rasqal_triple));
+  bound=LIBRDF_CALLOC(rasqal_variable**, count * 4, sizeof(rasqal_variable*));
+  counts=LIBRDF_CALLOC(double*, count, sizeof(double));
+  order=LIBRDF_CALLOC(int*, count, sizeof(int));
+  if(!triples || !copies || !bound || !counts || !order) {
+    rc= -1;
+    goto tidy;
+  }
+
+  for(i=0; i < count; i++) {
+    triples[i]=rasqal_graph_pattern_get_triple(gp, i);
+    copies[i]=*triples[i];
+    counts[i]=librdf_query_rasqal_pattern_count(oc, triples[i]);
+    order[i]= -1;
+  }
+
+  for(n=0; n < count; n++) {
+    int best= -1;
+    double best_cost=0;
+
+    for(i=0; i < count; i++) {
+      rasqal_literal* parts[4];
+      double cost=counts[i];
+      int joined=0;
+      int j;
+      int k;
+
+      if(order[i] >= 0)
+        continue;
+
+      parts[0]=copies[i].subject;
+      parts[1]=copies[i].predicate;
+      parts[2]=copies[i].object;
+      parts[3]=copies[i].origin;
+      for(j=0; j < 4; j++) {
+        rasqal_variable* v=parts[j] ? rasqal_literal_as_variable(parts[j]) : NULL;
+
+        if(!v)
+          continue;
+        for(k=0; k < bound_count; k++) {
+          if(bound[k] == v) {
+            joined=1;
+            if(j < 3)
+              cost /= oc->distinct[j];
+            break;
+          }
+        }
+      }
+
+      /* a pattern sharing no variable makes a cross product */
+      if(bound_count && !joined)
+        cost *= oc->total + 1;
+
+      if(best < 0 || cost < best_cost) {
+        best=i;
+        best_cost=cost;
+      }
+    }
+
+    order[best]=n;
+    if(best != n)
+      changed=1;
+
+    {
+      rasqal_literal* parts[4];
+      int j;
+
+      parts[0]=copies[best].subject;
+      parts[1]=copies[best].predicate;
+      parts[2]=copies[best].object;
+      parts[3]=copies[best].origin;
+      for(j=0; j < 4; j++) {
+        if(parts[j] && rasqal_literal_as_variable(parts[j]))
+          bound[bound_count++]=rasqal_literal_as_variable(parts[j]);
+      }
+    }
+  }
+
+  if(changed) {
+    for(i=0; i < count; i++) {
+      if(librdf_query_rasqal_order_save(oc, triples[i])) {
+        rc= -1;
+        goto tidy;
+      }
+    }
+    for(i=0; i < count; i++)
+      *triples[order[i]]=copies[i];
+    rc=1;
+  }
+
+  tidy:
+  if(triples)
+    LIBRDF_FREE(rasqal_triple**, triples);
+  if(copies)
+    LIBRDF_FREE(rasqal_triple*, copies);
+  if(bound)
+    LIBRDF_FREE(rasqal_variable**, bound);
+  if(counts)
+    LIBRDF_FREE(double*, counts);
+  if(order)
+    LIBRDF_FREE(int*, order);
+
+  return rc;
+}
+
+
+/*
+ * librdf_query_rasqal_order_graph_pattern:
+ * @oc: ordering context
+ * @gp: graph pattern
+ *
+ * INTERNAL - Order the basic graph patterns in a graph pattern tree
+ *
+ * Return value: 1 if any order changed, 0 if not, <0 if the query
+ * cannot be ordered
+ */
+static int
+librdf_query_rasqal_order_graph_pattern(librdf_query_rasqal_order_context* oc,
+                                        rasqal_graph_pattern* gp)
+{
+  rasqal_graph_pattern* sgp;
+  int changed=0;
+  int i;
+
+  switch(rasqal_graph_pattern_get_operator(gp)) {
+    case RASQAL_GRAPH_PATTERN_OPERATOR_BASIC:
+      return librdf_query_rasqal_order_basic(oc, gp);
+
+    case RASQAL_GRAPH_PATTERN_OPERATOR_GROUP:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_OPTIONAL:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_UNION:
+    case RASQAL_GRAPH_PATTERN_OPERATOR_FILTER:
+      break;
+
+    default:
+      /* GRAPH, sub-SELECT, BIND, VALUES... */
+      return -1;
+  }
+
+  for(i=0; (sgp=rasqal_graph_pattern_get_sub_graph_pattern(gp, i)); i++) {
+    int rc=librdf_query_rasqal_order_graph_pattern(oc, sgp);
+
+    if(rc < 0)
+      return rc;
+    if(rc)
+      changed=1;
+  }
+
+  return changed;
+}
+
+
+/*
+ * librdf_query_rasqal_order_triples:
+ * @context: query context with a prepared query
+ *
+ * INTERNAL - Replace the prepared query with one with its triple patterns ordered
+ *
+ * The query is left as it is if it cannot be ordered or is already
+ * in the best order found.
+ */
+static void
+librdf_query_rasqal_order_triples(librdf_query_rasqal_context* context)
+{
+  librdf_query_rasqal_order_context oc;
+  librdf_world* world=context->query->world;
+  rasqal_query* rq=context->rq;
+  rasqal_query* new_rq=NULL;
+  rasqal_graph_pattern* gp;
+  raptor_sequence* seq;
+  raptor_iostream* iostr;
+  void* string=NULL;
+  size_t string_len;
+  int rc;
+  int i;
+
+  if(strncmp(context->language, "sparql", 6))
+    return;
+
+  memset(&oc, '\0', sizeof(oc));
+  oc.context=context;
+  oc.storage=librdf_model_get_storage(context->model);
+  if(!oc.storage)
+    return;
+
+  oc.total=librdf_query_rasqal_storage_number(oc.storage,
+                                              (const unsigned char*)LIBRDF_STORAGE_FEATURE_STATEMENTS_COUNT);
+  if(oc.total < 0) {
+    if(!oc.storage->factory->count_statements)
+      return;
+    oc.total=librdf_storage_size(oc.storage);
+    if(oc.total < 0)
+      oc.total=1000000;
+  }
+  oc.distinct[0]=librdf_query_rasqal_storage_number(oc.storage,
+                                                    (const unsigned char*)LIBRDF_STORAGE_FEATURE_DISTINCT_SUBJECTS);
+  oc.distinct[1]=librdf_query_rasqal_storage_number(oc.storage,
+                                                    (const unsigned char*)LIBRDF_STORAGE_FEATURE_DISTINCT_PREDICATES);
+  oc.distinct[2]=librdf_query_rasqal_storage_number(oc.storage,
+                                                    (const unsigned char*)LIBRDF_STORAGE_FEATURE_DISTINCT_OBJECTS);
+  /* guesses for storages that do not estimate distinct terms */
+  if(oc.distinct[0] < 1)
+    oc.distinct[0]=oc.total / 4;
+  if(oc.distinct[1] < 1)
+    oc.distinct[1]=100;
+  if(oc.distinct[2] < 1)
+    oc.distinct[2]=oc.total / 2;
+  for(i=0; i < 3; i++) {
+    if(oc.distinct[i] < 1)
+      oc.distinct[i]=1;
+  }
+
+  /* only queries the SPARQL writer reproduces faithfully */
+  if((rasqal_query_get_verb(rq) != RASQAL_QUERY_VERB_SELECT &&
+      rasqal_query_get_verb(rq) != RASQAL_QUERY_VERB_ASK) ||
+     rasqal_query_get_group_condition(rq, 0) ||
+     rasqal_query_get_having_condition(rq, 0))
+    return;
+
+  seq=rasqal_query_get_data_graph_sequence(rq);
+  if(seq && raptor_sequence_size(seq))
+    return;
+
+  seq=rasqal_query_get_anonymous_variable_sequence(rq);
+  if(seq && raptor_sequence_size(seq))
+    return;
+
+  seq=rasqal_query_get_bound_variable_sequence(rq);
+  for(i=0; seq && i < raptor_sequence_size(seq); i++) {
+    rasqal_variable* v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+    if(v->expression)
+      return;
+  }
+
+  gp=rasqal_query_get_query_graph_pattern(rq);
+  if(!gp)
+    return;
+
+  rc=librdf_query_rasqal_order_graph_pattern(&oc, gp);
+  if(rc > 0) {
+    iostr=raptor_new_iostream_to_string(world->raptor_world_ptr,
+                                        &string, &string_len, NULL);
+    if(iostr) {
+      rc=rasqal_query_write(iostr, rq, NULL, NULL);
+      raptor_free_iostream(iostr);
+      if(rc && string) {
+        raptor_free_memory(string);
+        string=NULL;
+      }
+    }
+  }
+
+  /* put the prepared query back as it was */
+  for(i=oc.moved_count - 1; i >= 0; i--)
+    *oc.moved[i]=oc.saved[i];
+  if(oc.moved)
+    LIBRDF_FREE(rasqal_triple**, oc.moved);
+  if(oc.saved)
+    LIBRDF_FREE(rasqal_triple*, oc.saved);
+
+  if(!string)
+    return;
+
+  new_rq=rasqal_new_query(world->rasqal_world_ptr, context->language, NULL);
+  if(new_rq) {
+    rasqal_query_set_user_data(new_rq, context->query);
+    rasqal_query_set_limit(new_rq, rasqal_query_get_limit(rq));
+    rasqal_query_set_offset(new_rq, rasqal_query_get_offset(rq));
+
+    /* This assumes raptor's URI implementation is librdf_uri */
+    if(rasqal_query_prepare(new_rq, (const unsigned char*)string,
+                            (raptor_uri*)context->uri)) {
+      LIBRDF_DEBUG2("Reordered query failed to prepare:\n%s\n", (char*)string);
+      rasqal_free_query(new_rq);
+    } else {
+      rasqal_free_query(context->rq);
+      context->rq=new_rq;
+    }
+  }
+
+  raptor_free_memory(string);
+}
+
+
+#ifdef WITH_THREADS
+
+/* Parallel evaluation of UNION branches
+ *
+ * raptor and rasqal worlds may only be used by one thread at a time,
+ * so each worker thread runs its branches in a world of its own,
+ * over the same storage opened again there, and passes back its
+ * rows encoded with librdf_node_encode().
+ */
+
+typedef struct
+{
+  unsigned char *query_string; /* the query with only this UNION branch */
+
+  /* rows as, for each variable, 0 if unbound or 1 and the encoded node */
+  unsigned char *rows;
+  size_t rows_length;
+  size_t rows_size;
+  int rows_count;
+
+  int failed;
+} librdf_query_rasqal_branch;
+
+
+typedef struct
+{
+  librdf_query_rasqal_context *context;
+  librdf_storage *storage;    /* storage to open again in each world */
+  const unsigned char *base_uri_string;
+
+  const char **names;         /* projected variable names */
+  int names_count;
+
+  librdf_query_rasqal_branch *branches;
+  int branches_count;
+
+  /* next branch to run, taken by the workers under the lock */
+  int next_branch;
+  pthread_mutex_t lock;
+} librdf_query_rasqal_parallel;
+
+
+typedef struct
+{
+  librdf_query_rasqal_parallel *parallel;
+  librdf_world *world;
+  pthread_t thread;
+  int started;
+} librdf_query_rasqal_worker;
+
+
+/* Append one binding value, NULL if unbound, to a branch's rows */
+static int
+librdf_query_rasqal_branch_add_value(librdf_query_rasqal_branch *branch,
+                                     librdf_node *node)
+{
+  size_t length=0;
+
+  if(node) {
+    length=librdf_node_encode(node, NULL, 0);
+    if(!length)
+      return 1;
+  }
+
+  if(branch->rows_length + 1 + length > branch->rows_size) {
+    size_t new_size=branch->rows_size ? branch->rows_size * 2 : 1024;
+    unsigned char *new_rows;
+
+    while(branch->rows_length + 1 + length > new_size)
+      new_size *= 2;
+    new_rows=LIBRDF_MALLOC(unsigned char*, new_size);
+    if(!new_rows)
+      return 1;
+    if(branch->rows) {
+      memcpy(new_rows, branch->rows, branch->rows_length);
+      LIBRDF_FREE(unsigned char*, branch->rows);
+    }
+    branch->rows=new_rows;
+    branch->rows_size=new_size;
+  }
+
+  branch->rows[branch->rows_length++]=(node ? 1 : 0);
+  if(node) {
+    if(librdf_node_encode(node, branch->rows + branch->rows_length,
+                          length) != length)
+      return 1;
+    branch->rows_length += length;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_query_rasqal_run_branch:
+ * @parallel: parallel execution
+ * @world: the worker's world
+ * @model: model in the worker's world
+ * @base_uri: base URI in the worker's world or NULL
+ * @branch: branch to run
+ *
+ * INTERNAL - Run one UNION branch query and record its rows
+ *
+ * Return value: non-0 on failure or cancellation
+ */
+static int
+librdf_query_rasqal_run_branch(librdf_query_rasqal_parallel *parallel,
+                               librdf_world *world, librdf_model *model,
+                               librdf_uri *base_uri,
+                               librdf_query_rasqal_branch *branch)
+{
+  librdf_query *user_query=parallel->context->query;
+  librdf_query *query;
+  librdf_query_results *results;
+  int rc=0;
+  int i;
+
+  query=librdf_new_query(world, "sparql", NULL,
+                         branch->query_string, base_uri);
+  if(!query)
+    return 1;
+
+  results=librdf_query_execute(query, model);
+  if(!results) {
+    librdf_free_query(query);
+    return 1;
+  }
+
+  while(!rc && !librdf_query_results_finished(results)) {
+    if(user_query->cancelled) {
+      rc=1;
+      break;
+    }
+
+    for(i=0; !rc && i < parallel->names_count; i++) {
+      librdf_node *node;
+
+      node=librdf_query_results_get_binding_value_by_name(results,
+                                                           parallel->names[i]);
+      rc=librdf_query_rasqal_branch_add_value(branch, node);
+      if(node)
+        librdf_free_node(node);
+    }
+    branch->rows_count++;
+
+    librdf_query_results_next(results);
+  }
+
+  librdf_free_query_results(results);
+  librdf_free_query(query);
+
+  return rc;
+}
+
+
+/* Worker thread: open the storage in the worker's world and run branches */
+static void*
+librdf_query_rasqal_parallel_run(void *arg)
+{
+  librdf_query_rasqal_worker *worker=(librdf_query_rasqal_worker*)arg;
+  librdf_query_rasqal_parallel *parallel=worker->parallel;
+  librdf_world *world=worker->world;
+  librdf_storage *storage;
+  librdf_model *model=NULL;
+  librdf_uri *base_uri=NULL;
+  int failed=0;
+
+  storage=librdf_new_storage(world, parallel->storage->factory->name,
+                             parallel->storage->name,
+                             parallel->storage->options_string);
+  if(storage)
+    model=librdf_new_model(world, storage, NULL);
+  if(!model)
+    failed=1;
+
+  if(parallel->base_uri_string) {
+    base_uri=librdf_new_uri(world, parallel->base_uri_string);
+    if(!base_uri)
+      failed=1;
+  }
+
+  while(1) {
+    librdf_query_rasqal_branch *branch;
+    int i;
+
+    pthread_mutex_lock(&parallel->lock);
+    i=parallel->next_branch;
+    if(i < parallel->branches_count)
+      parallel->next_branch++;
+    pthread_mutex_unlock(&parallel->lock);
+
+    if(i >= parallel->branches_count)
+      break;
+
+    branch=&parallel->branches[i];
+    if(failed)
+      branch->failed=1;
+    else
+      branch->failed=librdf_query_rasqal_run_branch(parallel, world, model,
+                                                    base_uri, branch);
+  }
+
+  if(base_uri)
+    librdf_free_uri(base_uri);
+  if(model)
+    librdf_free_model(model);
+  if(storage)
+    librdf_free_storage(storage);
+
+  return NULL;
+}
+
+
+/*
+ * librdf_query_rasqal_union_branches:
+ * @context: query context with a prepared query
+ * @parallel: parallel execution to add the branch queries to
+ *
+ * INTERNAL - Write a query for each branch of the top-level UNION
+ *
+ * Return value: non-0 if the query is not a UNION or on failure
+ */
+static int
+librdf_query_rasqal_union_branches(librdf_query_rasqal_context *context,
+                                   librdf_query_rasqal_parallel *parallel)
+{
+  librdf_world* world=context->query->world;
+  rasqal_graph_pattern* gp;
+  raptor_sequence* seq;
+  void** parts;
+  int count;
+  int rc=0;
+  int i;
+
+  gp=rasqal_query_get_query_graph_pattern(context->rq);
+  if(gp && rasqal_graph_pattern_get_operator(gp) == RASQAL_GRAPH_PATTERN_OPERATOR_GROUP) {
+    seq=rasqal_graph_pattern_get_sub_graph_pattern_sequence(gp);
+    if(!seq || raptor_sequence_size(seq) != 1)
+      return 1;
+    gp=rasqal_graph_pattern_get_sub_graph_pattern(gp, 0);
+  }
+  if(!gp || rasqal_graph_pattern_get_operator(gp) != RASQAL_GRAPH_PATTERN_OPERATOR_UNION)
+    return 1;
+
+  seq=rasqal_graph_pattern_get_sub_graph_pattern_sequence(gp);
+  count=seq ? raptor_sequence_size(seq) : 0;
+  if(count < 2)
+    return 1;
+
+  parts=LIBRDF_CALLOC(void**, count, sizeof(void*));
+  parallel->branches=LIBRDF_CALLOC(librdf_query_rasqal_branch*, count,
+                                   sizeof(librdf_query_rasqal_branch));
+  if(!parts || !parallel->branches) {
+    if(parts)
+      LIBRDF_FREE(void**, parts);
+    return 1;
+  }
+  parallel->branches_count=count;
+
+  /* write the query with the UNION holding one branch at a time */
+  for(i=count - 1; i >= 0; i--)
+    parts[i]=raptor_sequence_pop(seq);
+
+  for(i=0; i < count; i++) {
+    raptor_iostream* iostr;
+    void* string=NULL;
+    size_t string_len;
+
+    raptor_sequence_push(seq, parts[i]);
+    iostr=raptor_new_iostream_to_string(world->raptor_world_ptr,
+                                        &string, &string_len, NULL);
+    if(iostr) {
+      if(rasqal_query_write(iostr, context->rq, NULL, NULL))
+        rc=1;
+      raptor_free_iostream(iostr);
+    } else
+      rc=1;
+    raptor_sequence_pop(seq);
+
+    if(string) {
+      if(!rc)
+        parallel->branches[i].query_string=(unsigned char*)string;
+      else
+        raptor_free_memory(string);
+    }
+    if(rc)
+      break;
+  }
+
+  for(i=0; i < count; i++)
+    raptor_sequence_push(seq, parts[i]);
+  LIBRDF_FREE(void**, parts);
+
+  return rc;
+}
+
+
+static void
+librdf_query_rasqal_free_parallel(librdf_query_rasqal_parallel *parallel)
+{
+  int i;
+
+  for(i=0; i < parallel->branches_count; i++) {
+    librdf_query_rasqal_branch *branch=&parallel->branches[i];
+
+    if(branch->query_string)
+      raptor_free_memory(branch->query_string);
+    if(branch->rows)
+      LIBRDF_FREE(unsigned char*, branch->rows);
+  }
+  if(parallel->branches)
+    LIBRDF_FREE(librdf_query_rasqal_branch*, parallel->branches);
+  if(parallel->names)
+    LIBRDF_FREE(char**, parallel->names);
+}
+
+
+/*
+ * librdf_query_rasqal_add_branch_rows:
+ * @context: query context
+ * @parallel: finished parallel execution
+ *
+ * INTERNAL - Decode the rows of each branch, in order, into the query results
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_query_rasqal_add_branch_rows(librdf_query_rasqal_context *context,
+                                    librdf_query_rasqal_parallel *parallel)
+{
+  librdf_world *world=context->query->world;
+  int b;
+
+  for(b=0; b < parallel->branches_count; b++) {
+    librdf_query_rasqal_branch *branch=&parallel->branches[b];
+    unsigned char *p=branch->rows;
+    size_t length=branch->rows_length;
+    int r;
+
+    for(r=0; r < branch->rows_count; r++) {
+      rasqal_row* row;
+      int i;
+
+      row=rasqal_new_row_for_size(world->rasqal_world_ptr,
+                                  parallel->names_count);
+      if(!row)
+        return 1;
+
+      for(i=0; i < parallel->names_count; i++) {
+        librdf_node *node;
+        rasqal_literal *l;
+        size_t size;
+
+        if(!length)
+          break;
+        length--;
+        if(!*p++)
+          /* unbound */
+          continue;
+
+        node=librdf_node_decode(world, &size, p, length);
+        if(!node)
+          break;
+        p += size;
+        length -= size;
+
+        l=redland_node_to_rasqal_literal(world, node);
+        librdf_free_node(node);
+        if(!l)
+          break;
+        rasqal_row_set_value_at(row, i, l);
+        rasqal_free_literal(l);
+      }
+
+      if(i < parallel->names_count) {
+        rasqal_free_row(row);
+        return 1;
+      }
+
+      rasqal_query_results_add_row(context->results, row);
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_query_rasqal_execute_parallel:
+ * @context: query context with a prepared query
+ *
+ * INTERNAL - Run the branches of a top-level UNION on a pool of threads
+ *
+ * Used when librdf_query_set_threads() allows more than one thread
+ * and the model storage has the concurrent reads feature.  Rows are
+ * returned branch by branch, in the order serial execution gives.
+ *
+ * Return value: non-0 if the query was not run, to run it serially
+ */
+static int
+librdf_query_rasqal_execute_parallel(librdf_query_rasqal_context *context)
+{
+  librdf_query* query=context->query;
+  rasqal_query* rq=context->rq;
+  librdf_query_rasqal_parallel parallel;
+  librdf_query_rasqal_worker* workers;
+  raptor_sequence* seq;
+  int workers_count;
+  int started=0;
+  int rc=1;
+  int i;
+
+  if(strncmp(context->language, "sparql", 6))
+    return 1;
+
+  /* only SELECT queries whose rows are the UNION branches' rows, one
+   * branch after another */
+  if(rasqal_query_get_verb(rq) != RASQAL_QUERY_VERB_SELECT ||
+     rasqal_query_get_distinct(rq) ||
+     rasqal_query_get_order_condition(rq, 0) ||
+     rasqal_query_get_group_condition(rq, 0) ||
+     rasqal_query_get_having_condition(rq, 0) ||
+     rasqal_query_get_limit(rq) >= 0 ||
+     rasqal_query_get_offset(rq) > 0)
+    return 1;
+
+  seq=rasqal_query_get_data_graph_sequence(rq);
+  if(seq && raptor_sequence_size(seq))
+    return 1;
+
+  seq=rasqal_query_get_anonymous_variable_sequence(rq);
+  if(seq && raptor_sequence_size(seq))
+    return 1;
+
+  memset(&parallel, '\0', sizeof(parallel));
+  parallel.context=context;
+  parallel.storage=librdf_model_get_storage(context->model);
+  if(!parallel.storage || !parallel.storage->name ||
+     librdf_query_rasqal_storage_number(parallel.storage,
+                                        (const unsigned char*)LIBRDF_STORAGE_FEATURE_CONCURRENT_READS) != 1)
+    return 1;
+  if(context->uri)
+    parallel.base_uri_string=librdf_uri_as_string(context->uri);
+
+  seq=rasqal_query_get_bound_variable_sequence(rq);
+  parallel.names_count=seq ? raptor_sequence_size(seq) : 0;
+  if(!parallel.names_count)
+    return 1;
+  parallel.names=LIBRDF_CALLOC(const char**, parallel.names_count,
+                               sizeof(char*));
+  if(!parallel.names)
+    return 1;
+  for(i=0; i < parallel.names_count; i++) {
+    rasqal_variable* v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+    if(v->expression) {
+      librdf_query_rasqal_free_parallel(&parallel);
+      return 1;
+    }
+    parallel.names[i]=(const char*)v->name;
+  }
+
+  if(librdf_query_rasqal_union_branches(context, &parallel)) {
+    librdf_query_rasqal_free_parallel(&parallel);
+    return 1;
+  }
+
+  workers_count=query->threads;
+  if(workers_count > parallel.branches_count)
+    workers_count=parallel.branches_count;
+  workers=LIBRDF_CALLOC(librdf_query_rasqal_worker*, workers_count,
+                        sizeof(*workers));
+  if(!workers) {
+    librdf_query_rasqal_free_parallel(&parallel);
+    return 1;
+  }
+
+  pthread_mutex_init(&parallel.lock, NULL);
+
+  /* worlds are created here since world initialisation is not
+   * thread-safe; they are only used by their worker thread */
+  for(i=0; i < workers_count; i++) {
+    librdf_query_rasqal_worker* worker=&workers[i];
+
+    worker->parallel=&parallel;
+    worker->world=librdf_new_world();
+    if(!worker->world)
+      continue;
+    librdf_world_open(worker->world);
+
+    if(!pthread_create(&worker->thread, NULL,
+                       librdf_query_rasqal_parallel_run, worker)) {
+      worker->started=1;
+      started++;
+    }
+  }
+
+  for(i=0; i < workers_count; i++) {
+    if(workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+    if(workers[i].world)
+      librdf_free_world(workers[i].world);
+  }
+  LIBRDF_FREE(librdf_query_rasqal_worker*, workers);
+  pthread_mutex_destroy(&parallel.lock);
+
+  if(started && !query->cancelled) {
+    rc=0;
+    for(i=0; i < parallel.branches_count; i++) {
+      if(parallel.branches[i].failed) {
+        rc=1;
+        break;
+      }
+    }
+  }
+
+  if(!rc) {
+    rc=librdf_query_rasqal_new_row_results(query);
+    if(!rc) {
+      rc=librdf_query_rasqal_add_branch_rows(context, &parallel);
+      if(rc) {
+        rasqal_free_query_results(context->results);
+        context->results=NULL;
+      } else
+        rasqal_query_results_rewind(context->results);
+    }
+  }
+
+  librdf_query_rasqal_free_parallel(&parallel);
+
+  return rc;
+}
+
+#endif
+
+
+static librdf_query_results*
+librdf_query_rasqal_execute(librdf_query* query, librdf_model* model)
+{
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_query_results* results;
+
+  if (context->model)
+    librdf_free_model(context->model);
+  /* model is always non-NULL */
+  context->model = model;
+  librdf_model_add_reference(model);
+  context->text_index = 0;
+
+  /* This assumes raptor's URI implementation is librdf_uri */
+  if(rasqal_query_prepare(context->rq, context->query_string, 
+                          (raptor_uri*)context->uri))
+    return NULL;
+
+  if(!context->reordered) {
+    context->reordered=1;
+    librdf_query_rasqal_order_triples(context);
+  }
+
+  if(context->results)
+    rasqal_free_query_results(context->results);
+  context->results=NULL;
+  context->row_view_valid=0;
+
+  /* the model may have changed since an earlier execution */
+  librdf_query_rasqal_free_batches(context);
+  
+#ifdef WITH_THREADS
+  if(query->threads > 1) {
+    /* otherwise falls back to running on this thread */
+    librdf_query_rasqal_execute_parallel(context);
+    if(query->cancelled)
+      return NULL;
+  }
+#endif
+
+  if(!context->results)
+    context->results=rasqal_query_execute(context->rq);
+  if(!context->results)
+    return NULL;
+  
+  results = LIBRDF_MALLOC(librdf_query_results*, sizeof(*results));
+  if(!results) {
+    rasqal_free_query_results(context->results);
+    context->results=NULL;
+  } else {
+    results->query=query;
+  }
+  
+  return results;
+}
+
+
+static int
+librdf_query_rasqal_get_limit(librdf_query* query)
+{
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  return rasqal_query_get_limit(context->rq);
+}
+
+
+static int
+librdf_query_rasqal_set_limit(librdf_query* query, int limit)
+{
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_query_set_limit(context->rq, limit);
+  return 0;
+}
+
+
+static int
+librdf_query_rasqal_get_offset(librdf_query* query)
+{
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  return rasqal_query_get_offset(context->rq);
+}
+
+
+static int
+librdf_query_rasqal_set_offset(librdf_query* query, int offset)
+{
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_query_set_offset(context->rq, offset);
+  return 0;
+}
+
+
+static int
+librdf_query_rasqal_results_get_count(librdf_query_results *query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  return rasqal_query_results_get_count(context->results);
+}
+
+
+static int
+librdf_query_rasqal_results_next(librdf_query_results *query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results || query->cancelled)
+    return 1;
+  
+  context->row_view_valid=0;
+  return rasqal_query_results_next(context->results);
+}
+
+
+static int
+librdf_query_rasqal_results_finished(librdf_query_results *query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results || query->cancelled)
+    return 1;
+  
+  return rasqal_query_results_finished(context->results);
+}
+
+
+static int
+librdf_query_rasqal_results_get_bindings(librdf_query_results *query_results, 
+                                         const char ***names, 
+                                         librdf_node **values)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_literal **literals;
+  int rc;
+  int i;
+
+  if(!context->results)
+    return 1;
+  
+  if(values) {
+    rc=rasqal_query_results_get_bindings(context->results, (const unsigned char ***)names, &literals);
+  } else
+    rc=rasqal_query_results_get_bindings(context->results, (const unsigned char ***)names, NULL);
+
+  if(rc || !values)
+    return rc;
+
+  for(i=0; i<rasqal_query_results_get_bindings_count(context->results); i++)
+    values[i]=librdf_query_rasqal_literal_to_node(context, literals[i]);
+
+  return 0;
+}
+
+
+static librdf_node*
+librdf_query_rasqal_results_get_binding_value(librdf_query_results *query_results, int offset)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_literal* literal;
+
+  literal=rasqal_query_results_get_binding_value(context->results, offset);
+
+  return librdf_query_rasqal_literal_to_node(context, literal);
+}
+
+
+static const char*
+librdf_query_rasqal_results_get_binding_name(librdf_query_results *query_results, int offset)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return NULL;
+  
+  return (const char*)rasqal_query_results_get_binding_name(context->results, offset);
+}
+
+
+static librdf_node*
+librdf_query_rasqal_results_get_binding_value_by_name(librdf_query_results *query_results, const char *name)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_literal* literal;
+
+  if(!context->results)
+    return NULL;
+  
+  literal=rasqal_query_results_get_binding_value_by_name(context->results, (const unsigned char*)name);
+
+  return librdf_query_rasqal_literal_to_node(context, literal);
+}
+
+
+static void
+librdf_query_rasqal_free_row_view(librdf_query_rasqal_context* context)
+{
+  int i;
+
+  if(!context->row_view)
+    return;
+
+  for(i=0; i < context->row_view_size; i++) {
+    if(context->row_view[i])
+      librdf_free_node(context->row_view[i]);
+  }
+  LIBRDF_FREE(librdf_node**, context->row_view);
+  context->row_view=NULL;
+  context->row_view_size=0;
+  context->row_view_valid=0;
+}
+
+
+static librdf_node**
+librdf_query_rasqal_results_get_row_view(librdf_query_results *query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  int size;
+  int i;
+
+  if(!context->results)
+    return NULL;
+
+  if(context->row_view_valid)
+    return context->row_view;
+
+  if(rasqal_query_results_finished(context->results))
+    return NULL;
+
+  size=rasqal_query_results_get_bindings_count(context->results);
+  if(size < 0)
+    return NULL;
+
+  if(size > context->row_view_size) {
+    librdf_query_rasqal_free_row_view(context);
+    /* one more so an empty row is a non-NULL array */
+    context->row_view=LIBRDF_CALLOC(librdf_node**, size + 1,
+                                    sizeof(librdf_node*));
+    if(!context->row_view)
+      return NULL;
+    context->row_view_size=size;
+  }
+
+  /* the term cache makes most of these a reference count increment */
+  for(i=0; i < size; i++) {
+    rasqal_literal* literal;
+
+    if(context->row_view[i])
+      librdf_free_node(context->row_view[i]);
+    literal=rasqal_query_results_get_binding_value(context->results, i);
+    context->row_view[i]=librdf_query_rasqal_literal_to_node(context, literal);
+  }
+  context->row_view_valid=1;
+
+  return context->row_view;
+}
+
+
+static int
+librdf_query_rasqal_results_get_bindings_count(librdf_query_results *query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return 1;
+  
+  return rasqal_query_results_get_bindings_count(context->results);
+}
+
+
+static void
+librdf_query_rasqal_free_results(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return;
+  
+  rasqal_free_query_results(context->results);
+  context->results=NULL;
+}
+
+
+static int
+librdf_query_rasqal_results_is_bindings(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return 1;
+  
+  return rasqal_query_results_is_bindings(context->results);
+}
+  
+
+static int
+librdf_query_rasqal_results_is_boolean(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return 1;
+  
+  return rasqal_query_results_is_boolean(context->results);
+}
+
+
+static int
+librdf_query_rasqal_results_is_graph(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return 1;
+  
+  return rasqal_query_results_is_graph(context->results);
+}
+
+
+static int
+librdf_query_rasqal_results_is_syntax(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return 1;
+  
+  return rasqal_query_results_is_syntax(context->results);
+}
+
+
+static int
+librdf_query_rasqal_results_get_boolean(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+
+  if(!context->results)
+    return -1;
+  
+  return rasqal_query_results_get_boolean(context->results);
+}
+
+
+typedef struct {
+  librdf_query *query;
+  
+  librdf_query_rasqal_context* qcontext; /* query context */
+
+  librdf_statement* statement; /* current statement */
+  int finished;
+} librdf_query_rasqal_stream_context;
+
+
+static int
+librdf_query_rasqal_query_results_end_of_stream(void* context)
+{
+  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+
+  return scontext->finished;
+}
+
+static int
+librdf_query_rasqal_query_results_update_statement(void* context)
+{
+  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+  librdf_world* world=scontext->query->world;
+  librdf_node* node;
+  
+  raptor_statement *rstatement=rasqal_query_results_get_triple(scontext->qcontext->results);
+  if(!rstatement)
+    return 1;
+  
+  scontext->statement=librdf_new_statement(world);
+  if(!scontext->statement)
+    return 1;
+
+  /* subject */
+  
+  if(rstatement->subject->type == RAPTOR_TERM_TYPE_BLANK) {
+    node = librdf_new_node_from_blank_identifier(world, rstatement->subject->value.blank.string);
+  } else if(rstatement->subject->type == RAPTOR_TERM_TYPE_URI) {
+    node = librdf_new_node_from_uri_string(world,
+                                           librdf_uri_as_string((librdf_uri*)rstatement->subject->value.uri));
+  } else {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+               "Unknown Raptor subject identifier type %d",
+               rstatement->subject->type);
+    goto fail;
+  }
+
+  if(!node) {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+               "Could not create subject node");
+    goto fail;
+  }
+  
+  librdf_statement_set_subject(scontext->statement, node);
+
+  /* predicate */
+
+  if(rstatement->predicate->type == RAPTOR_TERM_TYPE_URI) {
+    node = librdf_new_node_from_uri_string(world,
+                                           librdf_uri_as_string((librdf_uri*)rstatement->predicate->value.uri));
+  } else {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+               "Unknown Raptor predicate identifier type %d",
+               rstatement->predicate->type);
+    goto fail;
+  }
+
+  if(!node) {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+               "Could not create predicate node");
+    goto fail;
+  }
+  
+  librdf_statement_set_predicate(scontext->statement, node);
+  
+  /* object */
+
+  if(rstatement->object->type == RAPTOR_TERM_TYPE_LITERAL) {
+    node = librdf_new_node_from_typed_literal(world,
+                                              rstatement->object->value.literal.string,
+                                              (const char*)rstatement->object->value.literal.language,
+                                              (librdf_uri*)rstatement->object->value.literal.datatype);
+  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_BLANK) {
+    node = librdf_new_node_from_blank_identifier(world, rstatement->object->value.blank.string);
+  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_URI) {
+    node = librdf_new_node_from_uri_string(world,
+                                           librdf_uri_as_string((librdf_uri*)rstatement->object->value.uri));
+  } else {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
+               "Unknown Raptor object identifier type %d",
+               rstatement->object->type);
+    goto fail;
+  }
+
+  if(!node) {
+    librdf_log(world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+               "Could not create object node");
+    goto fail;
+  }
+
+  librdf_statement_set_object(scontext->statement, node);
+
+  return 0; /* success */
+
+  fail:
+  librdf_free_statement(scontext->statement);
+  scontext->statement=NULL;
+  return 1;
+}
+
+
+static int
+librdf_query_rasqal_query_results_next_statement(void* context)
+{
+  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+
+  if(scontext->finished)
+    return 1;
+  
+  if(scontext->statement) {
+    librdf_free_statement(scontext->statement);
+    scontext->statement=NULL;
+  }
+
+  scontext->finished = !scontext->qcontext->results;
+  if(!scontext->finished)
+    scontext->finished=rasqal_query_results_next_triple(scontext->qcontext->results);
+  if(!scontext->finished)
+    librdf_query_rasqal_query_results_update_statement(scontext);
+  
+  return scontext->finished;
+}
+
+
+static void*
+librdf_query_rasqal_query_results_get_statement(void* context, int flags)
 {
   librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
-  librdf_world* world=scontext->query->world;
-  librdf_node* node;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return scontext->statement;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return NULL;
+      
+    default:
+      librdf_log(scontext->query->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+
+}
+
+
+static void
+librdf_query_rasqal_query_results_finished(void* context)
+{
+  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+
+  if(scontext) {
+    if(scontext->statement)
+      librdf_free_statement(scontext->statement);
+
+    LIBRDF_FREE(librdf_query_rasqal_context, scontext);
+  }
+}
+
+
+static librdf_stream*
+librdf_query_rasqal_results_as_stream(librdf_query_results* query_results)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_query_rasqal_stream_context* scontext;
+  librdf_stream *stream;
+
+  if(!context->results)
+    return NULL;
   
-  raptor_statement *rstatement=rasqal_query_results_get_triple(scontext->qcontext->results);
-  if(!rstatement)
+  scontext = LIBRDF_CALLOC(librdf_query_rasqal_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  scontext->query=query;
+  scontext->qcontext=context;
+
+  librdf_query_rasqal_query_results_update_statement(scontext);
+
+  stream=librdf_new_stream(query->world,
+                           (void*)scontext,
+                           &librdf_query_rasqal_query_results_end_of_stream,
+                           &librdf_query_rasqal_query_results_next_statement,
+                           &librdf_query_rasqal_query_results_get_statement,
+                           &librdf_query_rasqal_query_results_finished);
+  if(!stream) {
+    librdf_query_rasqal_query_results_finished((void*)scontext);
+    return NULL;
+  }
+
+  return stream;  
+}
+
+
+static librdf_query_results_formatter*
+librdf_query_rasqal_new_results_formatter(librdf_query_results* query_results,
+                                          const char *name,
+                                          const char *mime_type, 
+                                          librdf_uri* format_uri)
+{
+  rasqal_world* rasqal_world_ptr;
+  rasqal_query_results_formatter* formatter;
+  librdf_query_results_formatter* qrf;
+
+  rasqal_world_ptr = query_results->query->world->rasqal_world_ptr;
+
+  formatter = rasqal_new_query_results_formatter(rasqal_world_ptr,
+                                                 name,
+                                                 mime_type,
+                                                 (raptor_uri*)format_uri);
+  if(!formatter)
+    return NULL;
+
+  qrf = LIBRDF_MALLOC(librdf_query_results_formatter*, sizeof(*qrf));
+  if(!qrf) {
+    rasqal_free_query_results_formatter(formatter);
+    return NULL;
+  }
+
+  qrf->query_results = query_results;
+  qrf->formatter = formatter;
+  return qrf;
+}
+
+
+static void
+librdf_query_rasqal_free_results_formatter(librdf_query_results_formatter* qrf) 
+{
+  rasqal_free_query_results_formatter(qrf->formatter);
+  LIBRDF_FREE(librdf_query_results, qrf);
+}
+
+
+static int
+librdf_query_rasqal_results_formatter_write(raptor_iostream *iostr,
+                                            librdf_query_results_formatter* qrf,
+                                            librdf_query_results* query_results,
+                                            librdf_uri *base_uri)
+{
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  return rasqal_query_results_formatter_write(iostr, qrf->formatter,
+                                              context->results, 
+                                              (raptor_uri*)base_uri);
+}
+
+
+/*
+ * SPARQL basic graph patterns run as one SQL query by the MySQL and
+ * PostgreSQL storages.
+ *
+ * A SELECT of plain variables over a group of triple patterns becomes
+ * a self-join of the statements table, one alias per triple pattern,
+ * with the node tables left joined to read each projected variable.
+ * Only FILTERs that node id comparisons answer exactly are pushed
+ * down: && of sameTerm(), its negation, and = or != against a URI.
+ * Anything else is left to rasqal.
+ */
+
+typedef struct {
+  librdf_world *world;
+  /* storage and schema to write SQL for or NULL to only check */
+  librdf_storage* storage;
+  const librdf_query_sql_schema* schema;
+  raptor_stringbuffer* where;
+
+  /* sequences of rasqal_triple* and rasqal_expression* (shared) */
+  raptor_sequence* triples;
+  raptor_sequence* filters;
+
+  /* variables seen in the triple patterns and the first column each
+   * is in */
+  rasqal_variable** variables;
+  char (*columns)[24];
+  int variables_count;
+
+  int triples_count;
+} librdf_query_rasqal_sql_context;
+
+
+/*
+ * librdf_query_rasqal_get_prepared_query - Get the prepared rasqal query of a query
+ * @query: query
+ *
+ * Return value: rasqal query or NULL if @query is not a rasqal query or fails to prepare
+ **/
+static rasqal_query*
+librdf_query_rasqal_get_prepared_query(librdf_query* query)
+{
+  librdf_query_rasqal_context *context;
+
+  if(query->factory->execute != librdf_query_rasqal_execute)
+    return NULL;
+
+  context=(librdf_query_rasqal_context*)query->context;
+
+  /* This assumes raptor's URI implementation is librdf_uri */
+  if(rasqal_query_prepare(context->rq, context->query_string,
+                          (raptor_uri*)context->uri))
+    return NULL;
+
+  return context->rq;
+}
+
+
+/*
+ * librdf_query_rasqal_sql_collect - Collect the triple patterns and FILTERs of a query
+ * @sc: context
+ * @rq: prepared rasqal query
+ *
+ * Return value: non-0 if the query is not a SELECT of plain variables over a basic graph pattern
+ **/
+static int
+librdf_query_rasqal_sql_collect(librdf_query_rasqal_sql_context* sc,
+                                rasqal_query* rq)
+{
+  rasqal_graph_pattern* gp;
+  raptor_sequence* seq;
+  int i;
+
+  if(rasqal_query_get_verb(rq) != RASQAL_QUERY_VERB_SELECT ||
+     rasqal_query_get_order_condition(rq, 0) ||
+     rasqal_query_get_group_condition(rq, 0) ||
+     rasqal_query_get_having_condition(rq, 0))
     return 1;
-  
-  scontext->statement=librdf_new_statement(world);
-  if(!scontext->statement)
+
+  seq=rasqal_query_get_data_graph_sequence(rq);
+  if(seq && raptor_sequence_size(seq))
     return 1;
 
-  /* subject */
-  
-  if(rstatement->subject->type == RAPTOR_TERM_TYPE_BLANK) {
-    node = librdf_new_node_from_blank_identifier(world, rstatement->subject->value.blank.string);
-  } else if(rstatement->subject->type == RAPTOR_TERM_TYPE_URI) {
-    node = librdf_new_node_from_uri_string(world,
-                                           librdf_uri_as_string((librdf_uri*)rstatement->subject->value.uri));
-  } else {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
-               "Unknown Raptor subject identifier type %d",
-               rstatement->subject->type);
-    goto fail;
+  seq=rasqal_query_get_bound_variable_sequence(rq);
+  if(!seq || !raptor_sequence_size(seq))
+    return 1;
+  for(i=0; i < raptor_sequence_size(seq); i++) {
+    rasqal_variable* v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+    if(v->expression)
+      return 1;
   }
 
-  if(!node) {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
-               "Could not create subject node");
-    goto fail;
+  gp=rasqal_query_get_query_graph_pattern(rq);
+  if(!gp)
+    return 1;
+
+  if(rasqal_graph_pattern_get_operator(gp) == RASQAL_GRAPH_PATTERN_OPERATOR_BASIC) {
+    for(i=0; rasqal_graph_pattern_get_triple(gp, i); i++)
+      raptor_sequence_push(sc->triples, rasqal_graph_pattern_get_triple(gp, i));
+  } else if(rasqal_graph_pattern_get_operator(gp) == RASQAL_GRAPH_PATTERN_OPERATOR_GROUP) {
+    rasqal_graph_pattern* sgp;
+
+    for(i=0; (sgp=rasqal_graph_pattern_get_sub_graph_pattern(gp, i)); i++) {
+      int j;
+
+      switch(rasqal_graph_pattern_get_operator(sgp)) {
+        case RASQAL_GRAPH_PATTERN_OPERATOR_BASIC:
+          for(j=0; rasqal_graph_pattern_get_triple(sgp, j); j++)
+            raptor_sequence_push(sc->triples,
+                                 rasqal_graph_pattern_get_triple(sgp, j));
+          if(rasqal_graph_pattern_get_filter_expression(sgp))
+            raptor_sequence_push(sc->filters,
+                                 rasqal_graph_pattern_get_filter_expression(sgp));
+          break;
+
+        case RASQAL_GRAPH_PATTERN_OPERATOR_FILTER:
+          raptor_sequence_push(sc->filters,
+                               rasqal_graph_pattern_get_filter_expression(sgp));
+          break;
+
+        default:
+          /* OPTIONAL, UNION, GRAPH, nested groups... */
+          return 1;
+      }
+    }
+  } else
+    return 1;
+
+  if(rasqal_graph_pattern_get_filter_expression(gp))
+    raptor_sequence_push(sc->filters,
+                         rasqal_graph_pattern_get_filter_expression(gp));
+
+  return !raptor_sequence_size(sc->triples);
+}
+
+
+/* Append a condition to the WHERE clause being written */
+static void
+librdf_query_rasqal_sql_condition(librdf_query_rasqal_sql_context* sc,
+                                  const char* left, const char* op,
+                                  const char* right)
+{
+  if(!sc->where)
+    return;
+
+  if(raptor_stringbuffer_length(sc->where))
+    raptor_stringbuffer_append_string(sc->where, (const unsigned char*)" AND ", 1);
+  raptor_stringbuffer_append_string(sc->where, (const unsigned char*)left, 1);
+  raptor_stringbuffer_append_string(sc->where, (const unsigned char*)op, 1);
+  raptor_stringbuffer_append_string(sc->where, (const unsigned char*)right, 1);
+}
+
+
+/* Index of a variable seen in the triple patterns or <0 */
+static int
+librdf_query_rasqal_sql_variable(librdf_query_rasqal_sql_context* sc,
+                                 rasqal_variable* v)
+{
+  int i;
+
+  for(i=0; i < sc->variables_count; i++) {
+    if(sc->variables[i] == v)
+      return i;
   }
-  
-  librdf_statement_set_subject(scontext->statement, node);
+  return -1;
+}
+
+
+/*
+ * librdf_query_rasqal_sql_constant - Write the node id of a constant term
+ * @sc: context
+ * @l: URI, blank node or literal term
+ * @buffer: buffer for the id
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_query_rasqal_sql_constant(librdf_query_rasqal_sql_context* sc,
+                                 rasqal_literal* l, char* buffer)
+{
+  librdf_node* node;
+
+  node=rasqal_literal_to_redland_node(sc->world, l);
+  if(!node)
+    return 1;
+
+  if(sc->storage)
+    sprintf(buffer, UINT64_T_FMT, sc->schema->node_id(sc->storage, node));
+  else
+    *buffer='\0';
+  librdf_free_node(node);
+
+  return 0;
+}
+
+
+/*
+ * librdf_query_rasqal_sql_term - Match a triple pattern term
+ * @sc: context
+ * @l: term
+ * @column: statements table column it is matched against
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_query_rasqal_sql_term(librdf_query_rasqal_sql_context* sc,
+                             rasqal_literal* l, const char* column)
+{
+  char id[21];
+  int i;
+
+  if(l->type != RASQAL_LITERAL_VARIABLE) {
+    if(librdf_query_rasqal_sql_constant(sc, l, id))
+      return 1;
+    librdf_query_rasqal_sql_condition(sc, column, "=", id);
+    return 0;
+  }
+
+  i=librdf_query_rasqal_sql_variable(sc, l->value.variable);
+  if(i >= 0) {
+    /* a variable repeated in the pattern joins the columns */
+    librdf_query_rasqal_sql_condition(sc, column, "=", sc->columns[i]);
+    return 0;
+  }
+
+  i=sc->variables_count++;
+  sc->variables[i]=l->value.variable;
+  strcpy(sc->columns[i], column);
+
+  return 0;
+}
+
+
+/*
+ * librdf_query_rasqal_sql_compare - Push down a comparison of two terms
+ * @sc: context
+ * @e: comparison expression
+ * @op: SQL operator
+ * @any_term: non-0 if literal constants compare by id too (sameTerm)
+ *
+ * Return value: non-0 if the comparison cannot be pushed down
+ **/
+static int
+librdf_query_rasqal_sql_compare(librdf_query_rasqal_sql_context* sc,
+                                rasqal_expression* e, const char* op,
+                                int any_term)
+{
+  rasqal_expression* args[2];
+  char operands[2][24];
+  int variables=0;
+  int i;
+
+  args[0]=e->arg1;
+  args[1]=e->arg2;
+  for(i=0; i < 2; i++) {
+    rasqal_literal* l;
+
+    if(!args[i] || args[i]->op != RASQAL_EXPR_LITERAL)
+      return 1;
+    l=args[i]->literal;
+
+    if(l->type == RASQAL_LITERAL_VARIABLE) {
+      /* only variables bound by the pattern have a column */
+      int v=librdf_query_rasqal_sql_variable(sc, l->value.variable);
+      if(v < 0)
+        return 1;
+      strcpy(operands[i], sc->columns[v]);
+      variables++;
+    } else {
+      if(!any_term && l->type != RASQAL_LITERAL_URI)
+        return 1;
+      if(librdf_query_rasqal_sql_constant(sc, l, operands[i]))
+        return 1;
+    }
+  }
+
+  /* = of two variables compares values, not just terms */
+  if(!variables || (variables == 2 && !any_term))
+    return 1;
+
+  librdf_query_rasqal_sql_condition(sc, operands[0], op, operands[1]);
+  return 0;
+}
+
+
+/*
+ * librdf_query_rasqal_sql_filter - Push down a FILTER expression
+ * @sc: context
+ * @e: expression
+ * @negate: non-0 if under a !
+ *
+ * Return value: non-0 if the expression cannot be pushed down
+ **/
+static int
+librdf_query_rasqal_sql_filter(librdf_query_rasqal_sql_context* sc,
+                               rasqal_expression* e, int negate)
+{
+  switch(e->op) {
+    case RASQAL_EXPR_AND:
+      if(negate)
+        return 1;
+      return librdf_query_rasqal_sql_filter(sc, e->arg1, 0) ||
+             librdf_query_rasqal_sql_filter(sc, e->arg2, 0);
 
-  /* predicate */
+    case RASQAL_EXPR_BANG:
+      return librdf_query_rasqal_sql_filter(sc, e->arg1, !negate);
 
-  if(rstatement->predicate->type == RAPTOR_TERM_TYPE_URI) {
-    node = librdf_new_node_from_uri_string(world,
-                                           librdf_uri_as_string((librdf_uri*)rstatement->predicate->value.uri));
-  } else {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
-               "Unknown Raptor predicate identifier type %d",
-               rstatement->predicate->type);
-    goto fail;
+    case RASQAL_EXPR_SAMETERM:
+      return librdf_query_rasqal_sql_compare(sc, e, negate ? "<>" : "=", 1);
+
+    case RASQAL_EXPR_EQ:
+      return librdf_query_rasqal_sql_compare(sc, e, negate ? "<>" : "=", 0);
+
+    case RASQAL_EXPR_NEQ:
+      return librdf_query_rasqal_sql_compare(sc, e, negate ? "=" : "<>", 0);
+
+    default:
+      return 1;
   }
+}
 
-  if(!node) {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
-               "Could not create predicate node");
-    goto fail;
+
+/*
+ * librdf_query_rasqal_sql_translate - Check or write the WHERE clause for a query
+ * @sc: context
+ * @rq: prepared rasqal query
+ *
+ * Return value: non-0 if the query cannot be run as SQL
+ **/
+static int
+librdf_query_rasqal_sql_translate(librdf_query_rasqal_sql_context* sc,
+                                  rasqal_query* rq)
+{
+  static const char* const parts[3]={ "Subject", "Predicate", "Object" };
+  int triples_count;
+  int status=1;
+  int i;
+
+  sc->triples=raptor_new_sequence(NULL, NULL);
+  sc->filters=raptor_new_sequence(NULL, NULL);
+  if(!sc->triples || !sc->filters)
+    goto tidy;
+
+  if(librdf_query_rasqal_sql_collect(sc, rq))
+    goto tidy;
+
+  triples_count=raptor_sequence_size(sc->triples);
+  sc->triples_count=triples_count;
+  sc->variables=LIBRDF_CALLOC(rasqal_variable**,
+                              LIBRDF_GOOD_CAST(size_t, 3 * triples_count),
+                              sizeof(rasqal_variable*));
+  sc->columns=LIBRDF_CALLOC(char(*)[24],
+                            LIBRDF_GOOD_CAST(size_t, 3 * triples_count),
+                            sizeof(*sc->columns));
+  if(!sc->variables || !sc->columns)
+    goto tidy;
+
+  for(i=0; i < triples_count; i++) {
+    rasqal_triple* t=(rasqal_triple*)raptor_sequence_get_at(sc->triples, i);
+    rasqal_literal* terms[3];
+    char column[24];
+    int j;
+
+    /* GRAPH patterns are not basic graph patterns */
+    if(t->origin)
+      goto tidy;
+
+    terms[0]=t->subject;
+    terms[1]=t->predicate;
+    terms[2]=t->object;
+    for(j=0; j < 3; j++) {
+      sprintf(column, "T%d.%s", i, parts[j]);
+      if(librdf_query_rasqal_sql_term(sc, terms[j], column))
+        goto tidy;
+    }
+
+    if(sc->schema && sc->schema->model_condition) {
+      sprintf(column, "T%d.", i);
+      librdf_query_rasqal_sql_condition(sc, column, "",
+                                        sc->schema->model_condition);
+    }
   }
-  
-  librdf_statement_set_predicate(scontext->statement, node);
-  
-  /* object */
 
-  if(rstatement->object->type == RAPTOR_TERM_TYPE_LITERAL) {
-    node = librdf_new_node_from_typed_literal(world,
-                                              rstatement->object->value.literal.string,
-                                              (const char*)rstatement->object->value.literal.language,
-                                              (librdf_uri*)rstatement->object->value.literal.datatype);
-  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_BLANK) {
-    node = librdf_new_node_from_blank_identifier(world, rstatement->object->value.blank.string);
-  } else if(rstatement->object->type == RAPTOR_TERM_TYPE_URI) {
-    node = librdf_new_node_from_uri_string(world,
-                                           librdf_uri_as_string((librdf_uri*)rstatement->object->value.uri));
-  } else {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_PARSER, NULL,
-               "Unknown Raptor object identifier type %d",
-               rstatement->object->type);
-    goto fail;
+  for(i=0; i < raptor_sequence_size(sc->filters); i++) {
+    rasqal_expression* e=(rasqal_expression*)raptor_sequence_get_at(sc->filters, i);
+    if(librdf_query_rasqal_sql_filter(sc, e, 0))
+      goto tidy;
   }
 
-  if(!node) {
-    librdf_log(world,
-               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
-               "Could not create object node");
-    goto fail;
+  status=0;
+
+  tidy:
+  if(sc->triples) {
+    raptor_free_sequence(sc->triples);
+    sc->triples=NULL;
+  }
+  if(sc->filters) {
+    raptor_free_sequence(sc->filters);
+    sc->filters=NULL;
   }
 
-  librdf_statement_set_object(scontext->statement, node);
+  return status;
+}
 
-  return 0; /* success */
 
-  fail:
-  librdf_free_statement(scontext->statement);
-  scontext->statement=NULL;
-  return 1;
+static void
+librdf_query_rasqal_sql_context_clear(librdf_query_rasqal_sql_context* sc)
+{
+  if(sc->variables)
+    LIBRDF_FREE(rasqal_variable**, sc->variables);
+  if(sc->columns)
+    LIBRDF_FREE(char*, sc->columns);
+  if(sc->where)
+    raptor_free_stringbuffer(sc->where);
 }
 
 
-static int
-librdf_query_rasqal_query_results_next_statement(void* context)
+/**
+ * librdf_query_rasqal_sql_supported:
+ * @query: query
+ *
+ * INTERNAL - Check if a query can run as a single SQL query
+ *
+ * Return value: non-0 if librdf_query_rasqal_to_sql() can translate @query
+ **/
+int
+librdf_query_rasqal_sql_supported(librdf_query* query)
 {
-  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+  librdf_query_rasqal_sql_context sc;
+  rasqal_query* rq;
+  int status;
 
-  if(scontext->finished)
-    return 1;
-  
-  if(scontext->statement) {
-    librdf_free_statement(scontext->statement);
-    scontext->statement=NULL;
-  }
+  rq=librdf_query_rasqal_get_prepared_query(query);
+  if(!rq)
+    return 0;
 
-  scontext->finished = !scontext->qcontext->results;
-  if(!scontext->finished)
-    scontext->finished=rasqal_query_results_next_triple(scontext->qcontext->results);
-  if(!scontext->finished)
-    librdf_query_rasqal_query_results_update_statement(scontext);
-  
-  return scontext->finished;
+  memset(&sc, '\0', sizeof(sc));
+  sc.world=query->world;
+  status=librdf_query_rasqal_sql_translate(&sc, rq);
+  librdf_query_rasqal_sql_context_clear(&sc);
+
+  return !status;
 }
 
 
-static void*
-librdf_query_rasqal_query_results_get_statement(void* context, int flags)
+/**
+ * librdf_query_rasqal_to_sql:
+ * @query: query
+ * @storage: storage the query runs on
+ * @schema: statements table of @storage
+ *
+ * INTERNAL - Translate a query to SQL over the MySQL and PostgreSQL storages schema
+ *
+ * Each row of the result has five columns per projected variable:
+ * the URI, blank node name, and literal value, language and datatype,
+ * all NULL when the variable is unbound.
+ *
+ * Return value: new SQL string or NULL on failure
+ **/
+char*
+librdf_query_rasqal_to_sql(librdf_query* query, librdf_storage* storage,
+                           const librdf_query_sql_schema* schema)
 {
-  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+  librdf_query_rasqal_sql_context sc;
+  rasqal_query* rq;
+  raptor_stringbuffer* sb=NULL;
+  raptor_sequence* seq;
+  char buffer[160];
+  char* sql=NULL;
+  int limit;
+  int offset;
+  int i;
 
-  switch(flags) {
-    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
-      return scontext->statement;
+  rq=librdf_query_rasqal_get_prepared_query(query);
+  if(!rq)
+    return NULL;
 
-    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
-      return NULL;
-      
-    default:
-      librdf_log(scontext->query->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
-                 "Unknown iterator method flag %d", flags);
-      return NULL;
+  memset(&sc, '\0', sizeof(sc));
+  sc.world=query->world;
+  sc.storage=storage;
+  sc.schema=schema;
+  sc.where=raptor_new_stringbuffer();
+  if(!sc.where || librdf_query_rasqal_sql_translate(&sc, rq))
+    goto tidy;
+
+  sb=raptor_new_stringbuffer();
+  if(!sb)
+    goto tidy;
+
+  raptor_stringbuffer_append_string(sb, (const unsigned char*)
+                                    (rasqal_query_get_distinct(rq) ? "SELECT DISTINCT " : "SELECT "), 1);
+
+  seq=rasqal_query_get_bound_variable_sequence(rq);
+  for(i=0; i < raptor_sequence_size(seq); i++) {
+    rasqal_variable* v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+
+    if(i)
+      raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)", ", 2, 1);
+    if(librdf_query_rasqal_sql_variable(&sc, v) < 0)
+      strcpy(buffer, "NULL, NULL, NULL, NULL, NULL");
+    else
+      sprintf(buffer, "R%d.URI, B%d.Name, L%d.Value, L%d.Language, L%d.Datatype",
+              i, i, i, i, i);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
+  }
+
+  /* one statements table alias per triple pattern */
+  raptor_stringbuffer_append_string(sb, (const unsigned char*)" FROM ", 1);
+  for(i=0; i < sc.triples_count; i++) {
+    if(i)
+      raptor_stringbuffer_append_string(sb, (const unsigned char*)" CROSS JOIN ", 1);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)schema->statements_table, 1);
+    sprintf(buffer, " AS T%d", i);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
   }
 
+  /* node tables for the projected variables */
+  for(i=0; i < raptor_sequence_size(seq); i++) {
+    rasqal_variable* v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+    int j=librdf_query_rasqal_sql_variable(&sc, v);
+
+    if(j < 0)
+      continue;
+    sprintf(buffer, " LEFT JOIN Resources AS R%d ON R%d.ID=%s", i, i, sc.columns[j]);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
+    sprintf(buffer, " LEFT JOIN Bnodes AS B%d ON B%d.ID=%s", i, i, sc.columns[j]);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
+    sprintf(buffer, " LEFT JOIN Literals AS L%d ON L%d.ID=%s", i, i, sc.columns[j]);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
+  }
+
+  if(raptor_stringbuffer_length(sc.where)) {
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)" WHERE ", 1);
+    raptor_stringbuffer_append_stringbuffer(sb, sc.where);
+  }
+
+  limit=rasqal_query_get_limit(rq);
+  offset=rasqal_query_get_offset(rq);
+  if(limit >= 0) {
+    sprintf(buffer, " LIMIT %d", limit);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
+  } else if(offset > 0) {
+    /* MySQL has no OFFSET without LIMIT */
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)" LIMIT 9223372036854775807", 1);
+  }
+  if(offset > 0) {
+    sprintf(buffer, " OFFSET %d", offset);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)buffer, 1);
+  }
+
+  sql=LIBRDF_MALLOC(char*, raptor_stringbuffer_length(sb) + 1);
+  if(sql)
+    raptor_stringbuffer_copy_to_string(sb, (unsigned char*)sql,
+                                       raptor_stringbuffer_length(sb));
+
+  tidy:
+  if(sb)
+    raptor_free_stringbuffer(sb);
+  librdf_query_rasqal_sql_context_clear(&sc);
+
+  return sql;
 }
 
 
-static void
-librdf_query_rasqal_query_results_finished(void* context)
+/*
+ * librdf_query_rasqal_new_row_results:
+ * @query: prepared query
+ *
+ * INTERNAL - Replace the query results with empty bindings results for its variables
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_query_rasqal_new_row_results(librdf_query* query)
 {
-  librdf_query_rasqal_stream_context* scontext=(librdf_query_rasqal_stream_context*)context;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  rasqal_variables_table* vt;
+  raptor_sequence* seq;
+  int i;
 
-  if(scontext) {
-    if(scontext->statement)
-      librdf_free_statement(scontext->statement);
+  if(query->factory->execute != librdf_query_rasqal_execute)
+    return 1;
 
-    LIBRDF_FREE(librdf_query_rasqal_context, scontext);
+  vt=rasqal_new_variables_table(query->world->rasqal_world_ptr);
+  if(!vt)
+    return 1;
+
+  seq=rasqal_query_get_bound_variable_sequence(context->rq);
+  for(i=0; i < raptor_sequence_size(seq); i++) {
+    rasqal_variable* v=(rasqal_variable*)raptor_sequence_get_at(seq, i);
+    size_t name_len=strlen((const char*)v->name);
+    unsigned char *name_copy;
+
+    name_copy=LIBRDF_MALLOC(unsigned char*, name_len + 1);
+    if(!name_copy) {
+      rasqal_free_variables_table(vt);
+      return 1;
+    }
+    memcpy(name_copy, v->name, name_len + 1);
+    rasqal_variables_table_add(vt, RASQAL_VARIABLE_TYPE_NORMAL,
+                               name_copy, NULL);
   }
+
+  if(context->results)
+    rasqal_free_query_results(context->results);
+  context->row_view_valid=0;
+  context->results=rasqal_new_query_results(query->world->rasqal_world_ptr,
+                                            NULL,
+                                            RASQAL_QUERY_RESULTS_BINDINGS,
+                                            vt);
+  rasqal_free_variables_table(vt);
+  if(!context->results)
+    return 1;
+
+  return 0;
 }
 
 
-static librdf_stream*
-librdf_query_rasqal_results_as_stream(librdf_query_results* query_results)
+/**
+ * librdf_query_rasqal_new_sql_results:
+ * @query: query translated by librdf_query_rasqal_to_sql()
+ *
+ * INTERNAL - Create the empty results of a query run as SQL
+ *
+ * Rows are added with librdf_query_rasqal_add_sql_row() or
+ * librdf_query_rasqal_add_node_row() and
+ * librdf_query_rasqal_end_sql_results() is called after the last.
+ * Also used for results replayed from the model query cache.
+ *
+ * Return value: new results or NULL on failure
+ **/
+librdf_query_results*
+librdf_query_rasqal_new_sql_results(librdf_query* query)
 {
-  librdf_query *query=query_results->query;
   librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  librdf_query_rasqal_stream_context* scontext;
-  librdf_stream *stream;
+  librdf_query_results* results;
 
-  if(!context->results)
-    return NULL;
-  
-  scontext = LIBRDF_CALLOC(librdf_query_rasqal_stream_context*, 1,
-                           sizeof(*scontext));
-  if(!scontext)
+  if(librdf_query_rasqal_new_row_results(query))
     return NULL;
 
-  scontext->query=query;
-  scontext->qcontext=context;
-
-  librdf_query_rasqal_query_results_update_statement(scontext);
+  /* the rows are all added here so the model is no longer read */
+  librdf_query_rasqal_free_batches(context);
+  if(context->model) {
+    librdf_free_model(context->model);
+    context->model=NULL;
+  }
 
-  stream=librdf_new_stream(query->world,
-                           (void*)scontext,
-                           &librdf_query_rasqal_query_results_end_of_stream,
-                           &librdf_query_rasqal_query_results_next_statement,
-                           &librdf_query_rasqal_query_results_get_statement,
-                           &librdf_query_rasqal_query_results_finished);
-  if(!stream) {
-    librdf_query_rasqal_query_results_finished((void*)scontext);
+  results=LIBRDF_MALLOC(librdf_query_results*, sizeof(*results));
+  if(!results) {
+    rasqal_free_query_results(context->results);
+    context->results=NULL;
     return NULL;
   }
+  results->query=query;
+  librdf_query_add_query_result(query, results);
 
-  return stream;  
+  return results;
 }
 
 
-static librdf_query_results_formatter*
-librdf_query_rasqal_new_results_formatter(librdf_query_results* query_results,
-                                          const char *name,
-                                          const char *mime_type, 
-                                          librdf_uri* format_uri)
+/**
+ * librdf_query_rasqal_add_sql_row:
+ * @query_results: results from librdf_query_rasqal_new_sql_results()
+ * @values: five column values per variable, NULL for SQL NULL
+ *
+ * INTERNAL - Add a row of the SQL query result
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_query_rasqal_add_sql_row(librdf_query_results* query_results,
+                                const char* const* values)
 {
-  rasqal_world* rasqal_world_ptr;
-  rasqal_query_results_formatter* formatter;
-  librdf_query_results_formatter* qrf;
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_world* world=query->world;
+  rasqal_row* row;
+  int size;
+  int i;
 
-  rasqal_world_ptr = query_results->query->world->rasqal_world_ptr;
+  size=rasqal_query_results_get_bindings_count(context->results);
+  row=rasqal_new_row_for_size(world->rasqal_world_ptr, size);
+  if(!row)
+    return 1;
 
-  formatter = rasqal_new_query_results_formatter(rasqal_world_ptr,
-                                                 name,
-                                                 mime_type,
-                                                 (raptor_uri*)format_uri);
-  if(!formatter)
-    return NULL;
+  for(i=0; i < size; i++, values += 5) {
+    librdf_node* node=NULL;
+    rasqal_literal* l;
+
+    if(values[0])
+      node=librdf_new_node_from_uri_string(world, (const unsigned char*)values[0]);
+    else if(values[1])
+      node=librdf_new_node_from_blank_identifier(world, (const unsigned char*)values[1]);
+    else if(values[2]) {
+      librdf_uri* datatype=NULL;
+
+      if(values[4] && *values[4])
+        datatype=librdf_new_uri(world, (const unsigned char*)values[4]);
+      node=librdf_new_node_from_typed_literal(world,
+                                              (const unsigned char*)values[2],
+                                              (values[3] && *values[3]) ? values[3] : NULL,
+                                              datatype);
+      if(datatype)
+        librdf_free_uri(datatype);
+    } else
+      /* unbound */
+      continue;
 
-  qrf = LIBRDF_MALLOC(librdf_query_results_formatter*, sizeof(*qrf));
-  if(!qrf) {
-    rasqal_free_query_results_formatter(formatter);
-    return NULL;
+    if(!node)
+      break;
+    l=redland_node_to_rasqal_literal(world, node);
+    librdf_free_node(node);
+    if(!l)
+      break;
+    rasqal_row_set_value_at(row, i, l);
+    rasqal_free_literal(l);
   }
 
-  qrf->query_results = query_results;
-  qrf->formatter = formatter;
-  return qrf;
+  if(i < size) {
+    rasqal_free_row(row);
+    return 1;
+  }
+
+  rasqal_query_results_add_row(context->results, row);
+
+  return 0;
 }
 
 
-static void
-librdf_query_rasqal_free_results_formatter(librdf_query_results_formatter* qrf) 
+/**
+ * librdf_query_rasqal_add_node_row:
+ * @query_results: results from librdf_query_rasqal_new_sql_results()
+ * @values: one value per variable, NULL if unbound
+ *
+ * INTERNAL - Add a row of nodes
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_query_rasqal_add_node_row(librdf_query_results* query_results,
+                                 librdf_node** values)
 {
-  rasqal_free_query_results_formatter(qrf->formatter);
-  LIBRDF_FREE(librdf_query_results, qrf);
+  librdf_query *query=query_results->query;
+  librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
+  librdf_world* world=query->world;
+  rasqal_row* row;
+  int size;
+  int i;
+
+  size=rasqal_query_results_get_bindings_count(context->results);
+  row=rasqal_new_row_for_size(world->rasqal_world_ptr, size);
+  if(!row)
+    return 1;
+
+  for(i=0; i < size; i++) {
+    rasqal_literal* l;
+
+    if(!values[i])
+      continue;
+
+    l=redland_node_to_rasqal_literal(world, values[i]);
+    if(!l)
+      break;
+    rasqal_row_set_value_at(row, i, l);
+    rasqal_free_literal(l);
+  }
+
+  if(i < size) {
+    rasqal_free_row(row);
+    return 1;
+  }
+
+  rasqal_query_results_add_row(context->results, row);
+
+  return 0;
 }
 
 
-static int
-librdf_query_rasqal_results_formatter_write(raptor_iostream *iostr,
-                                            librdf_query_results_formatter* qrf,
-                                            librdf_query_results* query_results,
-                                            librdf_uri *base_uri)
+/**
+ * librdf_query_rasqal_end_sql_results:
+ * @query_results: results from librdf_query_rasqal_new_sql_results()
+ *
+ * INTERNAL - Finish adding SQL rows and go to the first result
+ **/
+void
+librdf_query_rasqal_end_sql_results(librdf_query_results* query_results)
 {
   librdf_query *query=query_results->query;
   librdf_query_rasqal_context *context=(librdf_query_rasqal_context*)query->context;
-  return rasqal_query_results_formatter_write(iostr, qrf->formatter,
-                                              context->results, 
-                                              (raptor_uri*)base_uri);
+
+  rasqal_query_results_rewind(context->results);
 }
 
 
@@ -1254,6 +4724,7 @@ librdf_query_rasqal_register_factory(librdf_query_factory *factory)
   factory->results_get_binding_name    = librdf_query_rasqal_results_get_binding_name;
   factory->results_get_binding_value_by_name = librdf_query_rasqal_results_get_binding_value_by_name;
   factory->results_get_bindings_count         = librdf_query_rasqal_results_get_bindings_count;
+  factory->results_get_row_view               = librdf_query_rasqal_results_get_row_view;
   factory->free_results                       = librdf_query_rasqal_free_results;
   factory->results_is_bindings                = librdf_query_rasqal_results_is_bindings;
   factory->results_is_boolean                 = librdf_query_rasqal_results_is_boolean;
@@ -240,6 +240,68 @@ librdf_query_results_get_bindings_count(librdf_query_results *query_results)
 }
 
 
+/**
+ * librdf_query_results_get_binding_index:
+ * @query_results: #librdf_query_results query results
+ * @name: variable name
+ *
+ * Get the offset of a variable in the bindings of the results.
+ *
+ * The offset is the same for every result so it can be looked up
+ * once and used with librdf_query_results_get_binding_value() or
+ * librdf_query_results_get_row_view() for each result.
+ *
+ * Return value: offset of the binding or <0 if there is no such variable
+ **/
+int
+librdf_query_results_get_binding_index(librdf_query_results *query_results,
+                                       const char *name)
+{
+  int count;
+  int i;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query_results, librdf_query_results, -1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(name, string, -1);
+
+  count=librdf_query_results_get_bindings_count(query_results);
+  for(i=0; i < count; i++) {
+    const char* binding_name;
+
+    binding_name=librdf_query_results_get_binding_name(query_results, i);
+    if(binding_name && !strcmp(binding_name, name))
+      return i;
+  }
+
+  return -1;
+}
+
+
+/**
+ * librdf_query_results_get_row_view:
+ * @query_results: #librdf_query_results query results
+ *
+ * Get all binding values for the current result without copying them.
+ *
+ * The array has librdf_query_results_get_bindings_count() values,
+ * NULL for unbound variables.  The array and the nodes are shared:
+ * they must not be freed by the caller and are only valid until
+ * librdf_query_results_next() is called or the results are freed.
+ * Use librdf_new_node_from_node() to keep a value longer.
+ *
+ * Return value: shared array of binding values or NULL on failure, if the results are exhausted or not supported
+ **/
+librdf_node**
+librdf_query_results_get_row_view(librdf_query_results *query_results)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query_results, librdf_query_results, NULL);
+
+  if(query_results->query->factory->results_get_row_view)
+    return query_results->query->factory->results_get_row_view(query_results);
+  else
+    return NULL;
+}
+
+
 /**
  * librdf_free_query_results:
  * @query_results: #librdf_query_results object
@@ -949,6 +1011,461 @@ librdf_query_results_formatter_write(raptor_iostream *iostr,
 }
 
 
+/* Streaming query results writer */
+
+typedef enum {
+  LIBRDF_QUERY_RESULTS_STREAM_XML,
+  LIBRDF_QUERY_RESULTS_STREAM_JSON,
+  LIBRDF_QUERY_RESULTS_STREAM_TSV,
+  LIBRDF_QUERY_RESULTS_STREAM_CSV
+} librdf_query_results_stream_format;
+
+
+/* Write a node's string value: URI, literal lexical form or blank node id */
+static void
+librdf_query_results_stream_node_value(librdf_node* node,
+                                       const unsigned char** string_p,
+                                       size_t* length_p)
+{
+  if(librdf_node_is_resource(node))
+    *string_p=librdf_uri_as_counted_string(librdf_node_get_uri(node),
+                                           length_p);
+  else if(librdf_node_is_blank(node))
+    *string_p=librdf_node_get_counted_blank_identifier(node, length_p);
+  else
+    *string_p=librdf_node_get_literal_value_as_counted_string(node, length_p);
+}
+
+
+static void
+librdf_query_results_stream_write_xml_node(librdf_node* node,
+                                           raptor_iostream* iostr)
+{
+  const unsigned char* string;
+  size_t length;
+
+  librdf_query_results_stream_node_value(node, &string, &length);
+
+  if(librdf_node_is_resource(node)) {
+    raptor_iostream_counted_string_write("<uri>", 5, iostr);
+    raptor_xml_escape_string_write(string, length, '\0', iostr);
+    raptor_iostream_counted_string_write("</uri>", 6, iostr);
+  } else if(librdf_node_is_blank(node)) {
+    raptor_iostream_counted_string_write("<bnode>", 7, iostr);
+    raptor_xml_escape_string_write(string, length, '\0', iostr);
+    raptor_iostream_counted_string_write("</bnode>", 8, iostr);
+  } else {
+    const char* language=librdf_node_get_literal_value_language(node);
+    librdf_uri* datatype=librdf_node_get_literal_value_datatype_uri(node);
+
+    raptor_iostream_counted_string_write("<literal", 8, iostr);
+    if(language) {
+      raptor_iostream_counted_string_write(" xml:lang=\"", 11, iostr);
+      raptor_xml_escape_string_write((const unsigned char*)language,
+                                     strlen(language), '"', iostr);
+      raptor_iostream_write_byte('"', iostr);
+    }
+    if(datatype) {
+      const unsigned char* uri_string;
+      size_t uri_length;
+
+      uri_string=librdf_uri_as_counted_string(datatype, &uri_length);
+      raptor_iostream_counted_string_write(" datatype=\"", 11, iostr);
+      raptor_xml_escape_string_write(uri_string, uri_length, '"', iostr);
+      raptor_iostream_write_byte('"', iostr);
+    }
+    raptor_iostream_write_byte('>', iostr);
+    raptor_xml_escape_string_write(string, length, '\0', iostr);
+    raptor_iostream_counted_string_write("</literal>", 10, iostr);
+  }
+}
+
+
+static void
+librdf_query_results_stream_write_json_string(const unsigned char* string,
+                                              size_t length,
+                                              raptor_iostream* iostr)
+{
+  raptor_iostream_write_byte('"', iostr);
+  raptor_string_escaped_write(string, length, '"',
+                              RAPTOR_ESCAPED_WRITE_JSON_LITERAL, iostr);
+  raptor_iostream_write_byte('"', iostr);
+}
+
+
+static void
+librdf_query_results_stream_write_json_node(librdf_node* node,
+                                            raptor_iostream* iostr)
+{
+  const unsigned char* string;
+  size_t length;
+
+  librdf_query_results_stream_node_value(node, &string, &length);
+
+  if(librdf_node_is_resource(node))
+    raptor_iostream_string_write("{ \"type\": \"uri\", \"value\": ", iostr);
+  else if(librdf_node_is_blank(node))
+    raptor_iostream_string_write("{ \"type\": \"bnode\", \"value\": ", iostr);
+  else {
+    const char* language=librdf_node_get_literal_value_language(node);
+    librdf_uri* datatype=librdf_node_get_literal_value_datatype_uri(node);
+
+    raptor_iostream_string_write("{ \"type\": \"literal\", ", iostr);
+    if(language) {
+      raptor_iostream_string_write("\"xml:lang\": ", iostr);
+      librdf_query_results_stream_write_json_string((const unsigned char*)language,
+                                                    strlen(language), iostr);
+      raptor_iostream_counted_string_write(", ", 2, iostr);
+    }
+    if(datatype) {
+      const unsigned char* uri_string;
+      size_t uri_length;
+
+      uri_string=librdf_uri_as_counted_string(datatype, &uri_length);
+      raptor_iostream_string_write("\"datatype\": ", iostr);
+      librdf_query_results_stream_write_json_string(uri_string, uri_length,
+                                                    iostr);
+      raptor_iostream_counted_string_write(", ", 2, iostr);
+    }
+    raptor_iostream_string_write("\"value\": ", iostr);
+  }
+  librdf_query_results_stream_write_json_string(string, length, iostr);
+  raptor_iostream_counted_string_write(" }", 2, iostr);
+}
+
+
+static void
+librdf_query_results_stream_write_csv_node(librdf_node* node,
+                                           raptor_iostream* iostr)
+{
+  const unsigned char* string;
+  size_t length;
+  size_t i;
+
+  librdf_query_results_stream_node_value(node, &string, &length);
+
+  if(librdf_node_is_blank(node))
+    raptor_iostream_counted_string_write("_:", 2, iostr);
+
+  for(i=0; i < length; i++) {
+    if(string[i] == '"' || string[i] == ',' ||
+       string[i] == '\n' || string[i] == '\r')
+      break;
+  }
+  if(i == length) {
+    raptor_iostream_counted_string_write(string, length, iostr);
+    return;
+  }
+
+  /* quoted with inner quotes doubled */
+  raptor_iostream_write_byte('"', iostr);
+  for(i=0; i < length; i++) {
+    if(string[i] == '"')
+      raptor_iostream_write_byte('"', iostr);
+    raptor_iostream_write_byte(string[i], iostr);
+  }
+  raptor_iostream_write_byte('"', iostr);
+}
+
+
+/**
+ * librdf_query_results_write_stream:
+ * @query_results: #librdf_query_results object
+ * @iostr: #raptor_iostream to write to
+ * @name: format name "xml", "json", "tsv" or "csv" (or NULL for "xml")
+ * @flush_rows: call @flush after this many rows, 0 to only call it at the end
+ * @flush: function to push written bytes to their destination (or NULL)
+ * @user_data: user data for @flush
+ *
+ * Write query results in a SPARQL results format, one result at a time.
+ *
+ * Unlike librdf_query_results_formatter_write(), every result is
+ * written as soon as it is read from the results, so memory use does
+ * not grow with the number of results.  @flush is called after the
+ * header, every @flush_rows results and at the end, so that a
+ * buffering destination such as a socket or FILE* can send the
+ * output so far; see librdf_query_results_to_file_handle_stream().
+ *
+ * Variable binding results can be written in all the formats and
+ * boolean results in "xml" and "json".
+ *
+ * Return value: non-0 on failure, unsupported results or format, or if @flush fails
+ **/
+int
+librdf_query_results_write_stream(librdf_query_results *query_results,
+                                  raptor_iostream *iostr,
+                                  const char *name,
+                                  int flush_rows,
+                                  librdf_query_results_flush_handler flush,
+                                  void *user_data)
+{
+  librdf_query_results_stream_format format;
+  int count;
+  int rows=0;
+  int i;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query_results, librdf_query_results, 1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(iostr, raptor_iostream, 1);
+
+  if(!name || !strcmp(name, "xml"))
+    format=LIBRDF_QUERY_RESULTS_STREAM_XML;
+  else if(!strcmp(name, "json"))
+    format=LIBRDF_QUERY_RESULTS_STREAM_JSON;
+  else if(!strcmp(name, "tsv"))
+    format=LIBRDF_QUERY_RESULTS_STREAM_TSV;
+  else if(!strcmp(name, "csv"))
+    format=LIBRDF_QUERY_RESULTS_STREAM_CSV;
+  else
+    return 1;
+
+  if(librdf_query_results_is_boolean(query_results)) {
+    int value=librdf_query_results_get_boolean(query_results);
+
+    if(value < 0)
+      return 1;
+    if(format == LIBRDF_QUERY_RESULTS_STREAM_XML)
+      raptor_iostream_string_write("<?xml version=\"1.0\"?>\n"
+                                   "<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n"
+                                   "  <head/>\n"
+                                   "  <boolean>", iostr);
+    else if(format == LIBRDF_QUERY_RESULTS_STREAM_JSON)
+      raptor_iostream_string_write("{\n  \"head\": { },\n  \"boolean\": ", iostr);
+    else
+      return 1;
+
+    raptor_iostream_string_write(value ? "true" : "false", iostr);
+
+    if(format == LIBRDF_QUERY_RESULTS_STREAM_XML)
+      raptor_iostream_string_write("</boolean>\n</sparql>\n", iostr);
+    else
+      raptor_iostream_string_write("\n}\n", iostr);
+
+    return flush ? flush(user_data) : 0;
+  }
+
+  if(!librdf_query_results_is_bindings(query_results))
+    return 1;
+
+  count=librdf_query_results_get_bindings_count(query_results);
+  if(count < 0)
+    return 1;
+
+  /* header */
+  switch(format) {
+    case LIBRDF_QUERY_RESULTS_STREAM_XML:
+      raptor_iostream_string_write("<?xml version=\"1.0\"?>\n"
+                                   "<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n"
+                                   "  <head>\n", iostr);
+      break;
+    case LIBRDF_QUERY_RESULTS_STREAM_JSON:
+      raptor_iostream_string_write("{\n  \"head\": {\n    \"vars\": [", iostr);
+      break;
+    case LIBRDF_QUERY_RESULTS_STREAM_TSV:
+    case LIBRDF_QUERY_RESULTS_STREAM_CSV:
+    default:
+      break;
+  }
+
+  for(i=0; i < count; i++) {
+    const char* binding_name;
+
+    binding_name=librdf_query_results_get_binding_name(query_results, i);
+    if(!binding_name)
+      return 1;
+
+    switch(format) {
+      case LIBRDF_QUERY_RESULTS_STREAM_XML:
+        raptor_iostream_string_write("    <variable name=\"", iostr);
+        raptor_xml_escape_string_write((const unsigned char*)binding_name,
+                                       strlen(binding_name), '"', iostr);
+        raptor_iostream_counted_string_write("\"/>\n", 4, iostr);
+        break;
+      case LIBRDF_QUERY_RESULTS_STREAM_JSON:
+        raptor_iostream_string_write(i ? ", " : " ", iostr);
+        librdf_query_results_stream_write_json_string((const unsigned char*)binding_name,
+                                                      strlen(binding_name),
+                                                      iostr);
+        break;
+      case LIBRDF_QUERY_RESULTS_STREAM_TSV:
+        if(i)
+          raptor_iostream_write_byte('\t', iostr);
+        raptor_iostream_write_byte('?', iostr);
+        raptor_iostream_string_write(binding_name, iostr);
+        break;
+      case LIBRDF_QUERY_RESULTS_STREAM_CSV:
+      default:
+        if(i)
+          raptor_iostream_write_byte(',', iostr);
+        raptor_iostream_string_write(binding_name, iostr);
+        break;
+    }
+  }
+
+  switch(format) {
+    case LIBRDF_QUERY_RESULTS_STREAM_XML:
+      raptor_iostream_string_write("  </head>\n  <results>\n", iostr);
+      break;
+    case LIBRDF_QUERY_RESULTS_STREAM_JSON:
+      raptor_iostream_string_write(" ]\n  },\n  \"results\": {\n    \"bindings\": [\n", iostr);
+      break;
+    case LIBRDF_QUERY_RESULTS_STREAM_TSV:
+      raptor_iostream_write_byte('\n', iostr);
+      break;
+    case LIBRDF_QUERY_RESULTS_STREAM_CSV:
+    default:
+      raptor_iostream_counted_string_write("\r\n", 2, iostr);
+      break;
+  }
+
+  /* the first bytes go out before the first result is computed */
+  if(flush && flush(user_data))
+    return 1;
+
+  while(!librdf_query_results_finished(query_results)) {
+    librdf_node** view;
+    int bound=0;
+
+    /* borrowed values if the query engine provides them */
+    view=librdf_query_results_get_row_view(query_results);
+
+    if(format == LIBRDF_QUERY_RESULTS_STREAM_XML)
+      raptor_iostream_string_write("    <result>\n", iostr);
+    else if(format == LIBRDF_QUERY_RESULTS_STREAM_JSON)
+      raptor_iostream_string_write(rows ? ",\n      {" : "      {", iostr);
+
+    for(i=0; i < count; i++) {
+      librdf_node* node;
+
+      if(view)
+        node=view[i];
+      else
+        node=librdf_query_results_get_binding_value(query_results, i);
+
+      if(i) {
+        if(format == LIBRDF_QUERY_RESULTS_STREAM_TSV)
+          raptor_iostream_write_byte('\t', iostr);
+        else if(format == LIBRDF_QUERY_RESULTS_STREAM_CSV)
+          raptor_iostream_write_byte(',', iostr);
+      }
+
+      if(node) {
+        const char* binding_name;
+
+        binding_name=librdf_query_results_get_binding_name(query_results, i);
+        switch(format) {
+          case LIBRDF_QUERY_RESULTS_STREAM_XML:
+            raptor_iostream_string_write("      <binding name=\"", iostr);
+            raptor_xml_escape_string_write((const unsigned char*)binding_name,
+                                           strlen(binding_name), '"', iostr);
+            raptor_iostream_counted_string_write("\">", 2, iostr);
+            librdf_query_results_stream_write_xml_node(node, iostr);
+            raptor_iostream_counted_string_write("</binding>\n", 11, iostr);
+            break;
+          case LIBRDF_QUERY_RESULTS_STREAM_JSON:
+            /* unbound variables are left out of the object */
+            raptor_iostream_write_byte(bound ? ',' : ' ', iostr);
+            librdf_query_results_stream_write_json_string((const unsigned char*)binding_name,
+                                                          strlen(binding_name),
+                                                          iostr);
+            raptor_iostream_counted_string_write(": ", 2, iostr);
+            librdf_query_results_stream_write_json_node(node, iostr);
+            break;
+          case LIBRDF_QUERY_RESULTS_STREAM_TSV:
+            librdf_node_write(node, iostr);
+            break;
+          case LIBRDF_QUERY_RESULTS_STREAM_CSV:
+          default:
+            librdf_query_results_stream_write_csv_node(node, iostr);
+            break;
+        }
+
+        if(!view)
+          librdf_free_node(node);
+        bound++;
+      }
+    }
+
+    switch(format) {
+      case LIBRDF_QUERY_RESULTS_STREAM_XML:
+        raptor_iostream_string_write("    </result>\n", iostr);
+        break;
+      case LIBRDF_QUERY_RESULTS_STREAM_JSON:
+        raptor_iostream_counted_string_write(" }", 2, iostr);
+        break;
+      case LIBRDF_QUERY_RESULTS_STREAM_TSV:
+        raptor_iostream_write_byte('\n', iostr);
+        break;
+      case LIBRDF_QUERY_RESULTS_STREAM_CSV:
+      default:
+        raptor_iostream_counted_string_write("\r\n", 2, iostr);
+        break;
+    }
+
+    rows++;
+    if(flush && flush_rows > 0 && !(rows % flush_rows) && flush(user_data))
+      return 1;
+
+    librdf_query_results_next(query_results);
+  }
+
+  if(format == LIBRDF_QUERY_RESULTS_STREAM_XML)
+    raptor_iostream_string_write("  </results>\n</sparql>\n", iostr);
+  else if(format == LIBRDF_QUERY_RESULTS_STREAM_JSON)
+    raptor_iostream_string_write("\n    ]\n  }\n}\n", iostr);
+
+  return flush ? flush(user_data) : 0;
+}
+
+
+/* flush handler of librdf_query_results_to_file_handle_stream() */
+static int
+librdf_query_results_flush_file_handle(void *user_data)
+{
+  return fflush((FILE*)user_data) ? 1 : 0;
+}
+
+
+/**
+ * librdf_query_results_to_file_handle_stream:
+ * @query_results: #librdf_query_results object
+ * @handle: file handle to write to
+ * @name: format name "xml", "json", "tsv" or "csv" (or NULL for "xml")
+ * @flush_rows: flush @handle after this many rows, 0 to only flush at the end
+ *
+ * Write query results to a FILE* one result at a time.
+ *
+ * See librdf_query_results_write_stream().
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_query_results_to_file_handle_stream(librdf_query_results *query_results,
+                                           FILE *handle,
+                                           const char *name,
+                                           int flush_rows)
+{
+  raptor_iostream *iostr;
+  int status;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query_results, librdf_query_results, 1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(handle, FILE*, 1);
+
+  iostr=raptor_new_iostream_to_file_handle(query_results->query->world->raptor_world_ptr,
+                                           handle);
+  if(!iostr)
+    return 1;
+
+  status=librdf_query_results_write_stream(query_results, iostr, name,
+                                           flush_rows,
+                                           librdf_query_results_flush_file_handle,
+                                           handle);
+
+  raptor_free_iostream(iostr);
+
+  return status;
+}
+
+
 /**
  * librdf_query_results_formats_check:
  * @world: #librdf_world
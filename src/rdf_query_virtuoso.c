@@ -140,6 +140,9 @@ virtuoso_free_result(librdf_query* query)
 #ifdef VIRTUOSO_STORAGE_DEBUG
   fprintf(stderr, "virtuoso_free_result \n");
 #endif
+  if(context->vc)
+    context->vc->v_BlockUnbind(context->vc);
+
   if(context->colNames) {
     for(i = 0; i < context->numCols; i++) {
       if(context->colNames[i])
@@ -249,6 +252,37 @@ librdf_query_virtuoso_terminate(librdf_query* query)
 }
 
 
+/*
+ * librdf_query_virtuoso_cancel - INTERNAL - interrupt a running query
+ * @query: #librdf_query object
+ *
+ * May be called from another thread; SQLCancel is the one ODBC call
+ * allowed on a statement handle that is busy in another thread.
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_query_virtuoso_cancel(librdf_query* query)
+{
+  librdf_query_virtuoso_context *context;
+  int rc;
+
+  context = (librdf_query_virtuoso_context*)query->context;
+
+  if(!context->vc)
+    return 0;
+
+  rc = SQLCancel(context->vc->hstmt);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors((char *)"SQLCancel", context->storage->world,
+                             context->vc);
+    return 1;
+  }
+
+  return 0;
+}
+
+
 static librdf_query_results*
 librdf_query_virtuoso_execute(librdf_query* query, librdf_model* model)
 {
@@ -342,6 +376,10 @@ librdf_query_virtuoso_execute(librdf_query* query, librdf_model* model)
     context->colNames[context->numCols] = NULL;
     context->result_type |= VQUERY_RESULTS_BINDINGS;
     context->eof = 0;
+
+    /* Fetch the result in blocks of rows */
+    context->vc->v_BlockBind(context->storage->world, context->vc,
+                             context->numCols);
   }
 
   results = LIBRDF_MALLOC(librdf_query_results*, sizeof(*results));
@@ -465,7 +503,6 @@ librdf_query_virtuoso_results_next(librdf_query_results *query_results)
   short col;
   short numCols;
   librdf_node *node;
-  char *data;
   int is_null;
 
   context = (librdf_query_virtuoso_context*)query->context;
@@ -478,13 +515,18 @@ librdf_query_virtuoso_results_next(librdf_query_results *query_results)
   if(context->failed || context->eof)
     return 1;
 
+  if(query->cancelled) {
+    context->eof = 1;
+    return 1;
+  }
+
   for(col = 0; col < numCols; col++)
     if(context->colValues[col]) {
       librdf_free_node(context->colValues[col]);
       context->colValues[col] = NULL;
     }
 
-  rc = SQLFetch(context->vc->hstmt);
+  rc = context->vc->v_Fetch(context->storage->world, context->vc);
   if(rc == SQL_NO_DATA_FOUND) {
     context->eof = 1;
     return 1;
@@ -495,19 +537,11 @@ librdf_query_virtuoso_results_next(librdf_query_results *query_results)
   }
 
   for(col = 1; col <= context->numCols; col++) {
-    data = context->vc->v_GetDataCHAR(context->storage->world, context->vc,
-                                    col, &is_null);
-    if(!data && !is_null)
+    node = context->vc->v_GetNode(context->storage, context->vc, col,
+                                  &is_null);
+    if(!node && !is_null)
       return 2;
 
-    if(!data || is_null) {
-      node = NULL;
-    } else {
-      node = context->vc->v_rdf2node(context->storage, context->vc, col, data);
-      LIBRDF_FREE(char*, (char*) data);
-      if(!node)
-	return 2;
-    }
     context->colValues[col-1]=node;
   }
 
@@ -901,7 +935,7 @@ librdf_query_virtuoso_results_get_boolean(librdf_query_results* query_results)
   if(context->failed || context->numCols <= 0)
     return -1;
 
-  rc = SQLFetch(context->vc->hstmt);
+  rc = context->vc->v_Fetch(context->storage->world, context->vc);
   if(rc == SQL_NO_DATA_FOUND) {
     context->eof = 1;
     return 0;
@@ -952,7 +986,6 @@ librdf_query_virtuoso_query_results_update_statement(void* context)
   librdf_world* world;
   librdf_node* node;
   short colNum;
-  char *data;
   int is_null;
 
   scontext = (librdf_query_virtuoso_stream_context*)context;
@@ -979,22 +1012,16 @@ librdf_query_virtuoso_query_results_update_statement(void* context)
     goto fail;
 
   if(scontext->numCols > 3) {
-    data = qcontext->vc->v_GetDataCHAR(world, qcontext->vc, colNum, &is_null);
-    if(!data || is_null)
-      goto fail;
-    node = qcontext->vc->v_rdf2node(qcontext->storage, qcontext->vc, colNum, data);
-    LIBRDF_FREE(char*, (char*)data);
+    node = qcontext->vc->v_GetNode(qcontext->storage, qcontext->vc, colNum,
+                                   &is_null);
     if(!node)
       goto fail;
     scontext->graph=node;
     colNum++;
   }
 
-  data = qcontext->vc->v_GetDataCHAR(world, qcontext->vc, colNum, &is_null);
-  if(!data || is_null)
-    goto fail;
-  node = qcontext->vc->v_rdf2node(qcontext->storage, qcontext->vc, colNum, data);
-  LIBRDF_FREE(char*, (char*)data);
+  node = qcontext->vc->v_GetNode(qcontext->storage, qcontext->vc, colNum,
+                                 &is_null);
   if(!node)
     goto fail;
 
@@ -1004,11 +1031,8 @@ librdf_query_virtuoso_query_results_update_statement(void* context)
   if(colNum > scontext->numCols)
     goto fail;
 
-  data = qcontext->vc->v_GetDataCHAR(world, qcontext->vc, colNum, &is_null);
-  if(!data || is_null)
-    goto fail;
-  node = qcontext->vc->v_rdf2node(qcontext->storage, qcontext->vc, colNum, data);
-  LIBRDF_FREE(char*, (char*)data);
+  node = qcontext->vc->v_GetNode(qcontext->storage, qcontext->vc, colNum,
+                                 &is_null);
   if(!node)
     goto fail;
 
@@ -1018,11 +1042,8 @@ librdf_query_virtuoso_query_results_update_statement(void* context)
   if(colNum > scontext->numCols)
     goto fail;
 
-  data = qcontext->vc->v_GetDataCHAR(world, qcontext->vc, colNum, &is_null);
-  if(!data || is_null)
-    goto fail;
-  node = qcontext->vc->v_rdf2node(qcontext->storage, qcontext->vc, colNum, data);
-  LIBRDF_FREE(char*, (char*)data);
+  node = qcontext->vc->v_GetNode(qcontext->storage, qcontext->vc, colNum,
+                                 &is_null);
   if(!node)
     goto fail;
 
@@ -1059,7 +1080,7 @@ librdf_query_virtuoso_query_results_next_statement(void* context)
     scontext->statement = NULL;
   }
 
-  rc = SQLFetch(qcontext->vc->hstmt);
+  rc = qcontext->vc->v_Fetch(world, qcontext->vc);
   if(rc == SQL_NO_DATA_FOUND) {
     scontext->finished = 1;
   } else if(rc != SQL_SUCCESS && rc != SQL_SUCCESS_WITH_INFO) {
@@ -1367,6 +1388,7 @@ librdf_query_virtuoso_register_factory(librdf_query_factory *factory)
   factory->init					= librdf_query_virtuoso_init;
   factory->terminate				= librdf_query_virtuoso_terminate;
   factory->execute				= librdf_query_virtuoso_execute;
+  factory->cancel				= librdf_query_virtuoso_cancel;
   factory->get_limit				= librdf_query_virtuoso_get_limit;
   factory->set_limit				= librdf_query_virtuoso_set_limit;
   factory->get_offset				= librdf_query_virtuoso_get_offset;
@@ -135,28 +135,55 @@ librdf_raptor_reset_bnode_hash(librdf_world* world)
   return 0;
 }
 
+/**
+ * librdf_raptor_map_bnodeid:
+ * @world: librdf_world object
+ * @user_bnodeid: blank node identifier from the document
+ *
+ * INTERNAL - Map a document blank node identifier to a generated one
+ *
+ * The same @user_bnodeid gets the same identifier until the bnode
+ * map is reset at the end of the parse.
+ *
+ * Return value: new identifier or NULL on failure
+ **/
+unsigned char*
+librdf_raptor_map_bnodeid(librdf_world* world,
+                          const unsigned char *user_bnodeid)
+{
+  unsigned char *mapped_id;
+
+  if(!world->bnode_hash)
+    return librdf_world_get_genid(world);
+
+  mapped_id = (unsigned char*)librdf_hash_get(world->bnode_hash,
+                                              (const char*)user_bnodeid);
+  if(!mapped_id) {
+    mapped_id = librdf_world_get_genid(world);
+
+    if(mapped_id &&
+       librdf_hash_put_strings(world->bnode_hash,
+                               (const char*)user_bnodeid, (char*)mapped_id)) {
+      /* error -> free mapped_id and return NULL */
+      LIBRDF_FREE(char*, mapped_id);
+      mapped_id = NULL;
+    }
+  }
+
+  return mapped_id;
+}
+
+
 static unsigned char*
 librdf_raptor_generate_id_handler(void *user_data,
                                   unsigned char *user_bnodeid)
 {
   librdf_world* world = (librdf_world*)user_data;
 
-  if(user_bnodeid && world->bnode_hash) {
+  if(user_bnodeid) {
     unsigned char *mapped_id;
 
-    mapped_id = (unsigned char*)librdf_hash_get(world->bnode_hash,
-                                                (const char*)user_bnodeid);
-    if(!mapped_id) {
-      mapped_id = librdf_world_get_genid(world);
-
-      if(mapped_id &&
-         librdf_hash_put_strings(world->bnode_hash,
-                                 (char*)user_bnodeid, (char*)mapped_id)) {
-        /* error -> free mapped_id and return NULL */
-        LIBRDF_FREE(char*, mapped_id);
-        mapped_id = NULL;
-      }
-    }
+    mapped_id = librdf_raptor_map_bnodeid(world, user_bnodeid);
     /* always free passed in bnodeid */
     raptor_free_memory(user_bnodeid);
 
@@ -28,6 +28,7 @@
 
 #ifdef LIBRDF_INTERNAL
 #include <rdf_raptor_internal.h>
+#include <rdf_compress_internal.h>
 #endif
 
 #ifdef __cplusplus
@@ -51,11 +51,15 @@
  *
  * INTERNAL - Initialise the serializer module.
  *
+ * Registers the serializers.  Run once by the serializer factory
+ * functions such as librdf_get_serializer_factory() the first time
+ * one is called.
  **/
 void
 librdf_init_serializer(librdf_world *world) 
 {
   librdf_serializer_raptor_constructor(world);
+  librdf_serializer_binary_constructor(world);
 }
 
 
@@ -73,6 +77,7 @@ librdf_finish_serializer(librdf_world *world)
     raptor_free_sequence(world->serializers);
     world->serializers=NULL;
   }
+  world->serializers_loaded=0;
 #ifdef HAVE_RAPTOR_RDF_SERIALIZER
   librdf_serializer_raptor_destructor();
 #endif
@@ -202,6 +207,7 @@ librdf_get_serializer_factory(librdf_world *world,
   librdf_serializer_factory *factory;
   
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->serializers_loaded, librdf_init_serializer);
 
   if(name && !*name)
     name=NULL;
@@ -280,6 +286,7 @@ librdf_serializer_enumerate(librdf_world* world,
   int ioffset = LIBRDF_GOOD_CAST(int, counter);
   
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->serializers_loaded, librdf_init_serializer);
 
   factory = (librdf_serializer_factory*)raptor_sequence_get_at(world->serializers,
                                                                ioffset);
@@ -334,6 +341,7 @@ librdf_serializer_check_name(librdf_world* world, const char *name)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(name, char*, 0);
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->serializers_loaded, librdf_init_serializer);
 
   for(i = 0;
       (factory = (librdf_serializer_factory*)raptor_sequence_get_at(world->serializers, i));
@@ -366,6 +374,9 @@ librdf_new_serializer(librdf_world *world,
 
   librdf_world_open(world);
 
+  if(librdf_query_async_check_world(world))
+    return NULL;
+
   factory = librdf_get_serializer_factory(world, name, mime_type, type_uri);
   if(!factory) {
     if(name)
@@ -421,6 +432,8 @@ librdf_new_serializer_from_factory(librdf_world *world,
   
   d->factory=factory;
 
+  d->compression=LIBRDF_COMPRESSION_AUTO;
+
   if(factory->init)
     if(factory->init(d, d->context)) {
       librdf_free_serializer(d);
@@ -543,6 +556,9 @@ librdf_serializer_serialize_model_to_file_handle(librdf_serializer* serializer,
  * @stream: the #librdf_stream stream to use
  *
  * Write a #librdf_stream to a file.
+ *
+ * The file is compressed with gzip or zstd when its name ends in
+ * .gz or .zst, or as set with #LIBRDF_SERIALIZER_FEATURE_COMPRESSION.
  * 
  * Return value: non 0 on failure
  **/
@@ -554,6 +570,7 @@ librdf_serializer_serialize_stream_to_file(librdf_serializer* serializer,
 {
   FILE* fh;
   int status;
+  librdf_compression compression;
   
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(serializer, librdf_serializer, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(name, string, 1);
@@ -567,6 +584,24 @@ librdf_serializer_serialize_stream_to_file(librdf_serializer* serializer,
     return 1;
   }
   
+  compression = librdf_compression_choose(serializer->compression, name);
+  if(compression != LIBRDF_COMPRESSION_NONE) {
+    raptor_iostream* iostr;
+
+    iostr = librdf_new_compressed_iostream_to_file_handle(serializer->world,
+                                                          fh, compression);
+    if(!iostr) {
+      fclose(fh);
+      return 1;
+    }
+    /* takes ownership of iostr and ends the compressed data */
+    status=librdf_serializer_serialize_stream_to_iostream(serializer, base_uri,
+                                                          stream, iostr);
+    if(fclose(fh))
+      status=1;
+    return status;
+  }
+
   status=librdf_serializer_serialize_stream_to_file_handle(serializer, fh, 
                                                            base_uri, stream);
   fclose(fh);
@@ -582,6 +617,9 @@ librdf_serializer_serialize_stream_to_file(librdf_serializer* serializer,
  * @model: the #librdf_model model to use
  *
  * Write a serialized #librdf_model to a file.
+ *
+ * The file is compressed with gzip or zstd when its name ends in
+ * .gz or .zst, or as set with #LIBRDF_SERIALIZER_FEATURE_COMPRESSION.
  * 
  * Return value: non 0 on failure
  **/
@@ -593,6 +631,7 @@ librdf_serializer_serialize_model_to_file(librdf_serializer* serializer,
 {
   FILE* fh;
   int status;
+  librdf_compression compression;
   
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(serializer, librdf_serializer, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(name, string, 1);
@@ -606,6 +645,24 @@ librdf_serializer_serialize_model_to_file(librdf_serializer* serializer,
     return 1;
   }
   
+  compression = librdf_compression_choose(serializer->compression, name);
+  if(compression != LIBRDF_COMPRESSION_NONE) {
+    raptor_iostream* iostr;
+
+    iostr = librdf_new_compressed_iostream_to_file_handle(serializer->world,
+                                                          fh, compression);
+    if(!iostr) {
+      fclose(fh);
+      return 1;
+    }
+    /* takes ownership of iostr and ends the compressed data */
+    status=librdf_serializer_serialize_model_to_iostream(serializer, base_uri,
+                                                         model, iostr);
+    if(fclose(fh))
+      status=1;
+    return status;
+  }
+
   status=librdf_serializer_serialize_model_to_file_handle(serializer, fh, 
                                                           base_uri, model);
   fclose(fh);
@@ -837,6 +894,12 @@ librdf_serializer_get_feature(librdf_serializer* serializer, librdf_uri *feature
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(serializer, librdf_serializer, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(feature, librdf_uri, NULL);
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_SERIALIZER_FEATURE_COMPRESSION))
+    return librdf_new_node_from_literal(serializer->world,
+                                        (const unsigned char*)librdf_compression_to_string(serializer->compression),
+                                        NULL, 0);
+
   if(serializer->factory->get_feature)
     return serializer->factory->get_feature(serializer->context, feature);
 
@@ -862,6 +925,15 @@ librdf_serializer_set_feature(librdf_serializer* serializer,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(feature, librdf_uri, -1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(value, librdf_node, -1);
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_SERIALIZER_FEATURE_COMPRESSION)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    return librdf_compression_from_string((const char*)librdf_node_get_literal_value(value),
+                                          &serializer->compression);
+  }
+
   if(serializer->factory->set_feature)
     return serializer->factory->set_feature(serializer->context, feature, value);
 
@@ -910,6 +982,8 @@ librdf_serializer_set_namespace(librdf_serializer* serializer,
 #include <unistd.h>
 #endif
 
+#include <rdf_binary_internal.h>
+
 /* one more prototype */
 int main(int argc, char *argv[]);
 
@@ -945,6 +1019,40 @@ log_handler(void *user_data, librdf_log_message *message)
 }
 
 
+/* Append a binary TERM record for a node with a short encoding */
+static size_t
+test_binary_add_term(unsigned char *buffer, size_t offset, librdf_node* node)
+{
+  size_t len = librdf_node_encode(node, NULL, 0);
+
+  if(!len || len > 0x7f)
+    return 0;
+
+  buffer[offset++] = LIBRDF_BINARY_TERM;
+  buffer[offset++] = LIBRDF_BAD_CAST(unsigned char, len);
+  librdf_node_encode(node, buffer + offset, len);
+  librdf_free_node(node);
+
+  return offset + len;
+}
+
+
+#define TEST_COMPRESS_STATEMENTS 1000
+
+static const struct {
+  const char *name;
+  const char *magic;
+} test_compress_files[] = {
+#ifdef HAVE_ZLIB
+  { "test.nt.gz", "\x1f\x8b\x08\x00" },
+#endif
+#ifdef HAVE_ZSTD
+  { "test.nt.zst", "\x28\xb5\x2f\xfd" },
+#endif
+  { NULL, NULL }
+};
+
+
 #define EXPECTED_ERRORS1 3
 /* Extra error is another UTF-8 encoding error */
 #define EXPECTED_ERRORS2 4
@@ -976,6 +1084,11 @@ main(int argc, char *argv[])
   librdf_stream* stream;
   FILE *fh;
   struct stat st_buf;
+  librdf_storage *storage2;
+  librdf_model* model2;
+  librdf_node* context_node;
+  unsigned char binary[1024];
+  size_t reset_length;
 
   world=librdf_new_world();
   librdf_world_open(world);
@@ -1134,6 +1247,235 @@ main(int argc, char *argv[])
   librdf_free_storage(storage); storage=NULL;
 
 
+  /* librdf binary round trip with a triple and quads */
+  fprintf(stderr, "%s: Serializing quads to librdf binary\n", program);
+  storage=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  model=librdf_new_model(world, storage, NULL);
+  context_node=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/graph");
+
+  statement=librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/foo"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/bar"),
+    librdf_new_node_from_literal(world, (const unsigned char*)"triple", NULL, 0));
+  librdf_model_add_statement(model, statement);
+  librdf_free_statement(statement);
+
+  statement=librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_blank_identifier(world, (const unsigned char*)"b1"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/bar"),
+    librdf_new_node_from_literal(world, (const unsigned char*)"blank", NULL, 0));
+  librdf_model_context_add_statement(model, context_node, statement);
+  librdf_free_statement(statement);
+
+  statement=librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/foo"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/bar"),
+    librdf_new_node_from_literal(world, (const unsigned char*)"quad", "en", 0));
+  librdf_model_context_add_statement(model, context_node, statement);
+  librdf_free_statement(statement);
+
+  serializer=librdf_new_serializer(world, "librdf-binary", NULL, NULL);
+  parser=librdf_new_parser(world, "librdf-binary", NULL, NULL);
+  if(!serializer || !parser) {
+    fprintf(stderr, "%s: Failed to create librdf binary serializer or parser\n",
+            program);
+    return 1;
+  }
+
+  string_length=0;
+  string=librdf_serializer_serialize_model_to_counted_string(serializer,
+                                                             NULL, model,
+                                                             &string_length);
+  if(!string || string_length <= LIBRDF_BINARY_MAGIC_LEN + 1 ||
+     memcmp(string, LIBRDF_BINARY_MAGIC, LIBRDF_BINARY_MAGIC_LEN) ||
+     string[string_length - 1] != LIBRDF_BINARY_END) {
+    fprintf(stderr, "%s: Serializing to librdf binary returned a bad string of size %d\n",
+            program, (int)string_length);
+    return 1;
+  }
+
+  storage2=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  model2=librdf_new_model(world, storage2, NULL);
+  if(librdf_parser_parse_counted_string_into_model(parser, string,
+                                                   string_length, NULL,
+                                                   model2)) {
+    fprintf(stderr, "%s: Failed to parse librdf binary string\n", program);
+    return 1;
+  }
+  if(librdf_model_size(model2) != 3) {
+    fprintf(stderr, "%s: Parsing librdf binary returned %d statements, expected 3\n",
+            program, librdf_model_size(model2));
+    return 1;
+  }
+
+  stream=librdf_model_context_as_stream(model2, context_node);
+  for(i=0; !librdf_stream_end(stream); i++) {
+    statement=librdf_stream_get_object(stream);
+    if(!librdf_model_context_contains_statement(model, context_node,
+                                                statement) &&
+       !librdf_node_is_blank(librdf_statement_get_subject(statement))) {
+      fprintf(stderr, "%s: Parsed librdf binary quad is not in the original model\n",
+              program);
+      return 1;
+    }
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+  if(i != 2) {
+    fprintf(stderr, "%s: Parsed librdf binary graph has %d statements, expected 2\n",
+            program, i);
+    return 1;
+  }
+  librdf_free_model(model2); model2=NULL;
+  librdf_free_storage(storage2); storage2=NULL;
+
+  /* every truncation of the string must fail, including a missing END */
+  fprintf(stderr, "%s: Parsing truncated librdf binary\n", program);
+  for(string_length--; string_length > 0; string_length--) {
+    storage2=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+    model2=librdf_new_model(world, storage2, NULL);
+    if(!librdf_parser_parse_counted_string_into_model(parser, string,
+                                                      string_length, NULL,
+                                                      model2)) {
+      fprintf(stderr, "%s: Parsing librdf binary truncated to %d bytes succeeded\n",
+              program, (int)string_length);
+      return 1;
+    }
+    librdf_free_model(model2); model2=NULL;
+    librdf_free_storage(storage2); storage2=NULL;
+  }
+  librdf_free_memory(string);
+
+  /* RESET record: term ids restart at 0 */
+  fprintf(stderr, "%s: Parsing librdf binary with a RESET record\n", program);
+  memcpy(binary, LIBRDF_BINARY_MAGIC, LIBRDF_BINARY_MAGIC_LEN);
+  string_length=LIBRDF_BINARY_MAGIC_LEN;
+  for(i=0; i < 2; i++) {
+    if(i)
+      binary[string_length++]=LIBRDF_BINARY_RESET;
+    string_length=test_binary_add_term(binary, string_length,
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/foo"));
+    if(string_length)
+      string_length=test_binary_add_term(binary, string_length,
+        librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/bar"));
+    if(string_length)
+      string_length=test_binary_add_term(binary, string_length,
+        librdf_new_node_from_literal(world, (const unsigned char*)(i ? "after" : "before"), NULL, 0));
+    if(!string_length) {
+      fprintf(stderr, "%s: Failed to encode librdf binary terms\n", program);
+      return 1;
+    }
+    binary[string_length++]=LIBRDF_BINARY_QUAD;
+    binary[string_length++]=0;
+    binary[string_length++]=1;
+    binary[string_length++]=2;
+    binary[string_length++]=0;
+  }
+  reset_length=string_length;
+  binary[string_length++]=LIBRDF_BINARY_END;
+
+  storage2=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  model2=librdf_new_model(world, storage2, NULL);
+  if(librdf_parser_parse_counted_string_into_model(parser, binary,
+                                                   string_length, NULL,
+                                                   model2) ||
+     librdf_model_size(model2) != 2) {
+    fprintf(stderr, "%s: Parsing librdf binary with a RESET record returned %d statements, expected 2\n",
+            program, librdf_model_size(model2));
+    return 1;
+  }
+  librdf_free_model(model2); model2=NULL;
+  librdf_free_storage(storage2); storage2=NULL;
+
+  /* the 4th term id is only valid before the RESET */
+  binary[reset_length++]=LIBRDF_BINARY_TRIPLE;
+  binary[reset_length++]=0;
+  binary[reset_length++]=1;
+  binary[reset_length++]=3;
+  binary[reset_length++]=LIBRDF_BINARY_END;
+  storage2=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  model2=librdf_new_model(world, storage2, NULL);
+  if(!librdf_parser_parse_counted_string_into_model(parser, binary,
+                                                    reset_length, NULL,
+                                                    model2)) {
+    fprintf(stderr, "%s: Parsing librdf binary using a term id from before a RESET succeeded\n",
+            program);
+    return 1;
+  }
+  librdf_free_model(model2); model2=NULL;
+  librdf_free_storage(storage2); storage2=NULL;
+
+  librdf_free_node(context_node);
+  librdf_free_parser(parser); parser=NULL;
+  librdf_free_serializer(serializer); serializer=NULL;
+  librdf_free_model(model); model=NULL;
+  librdf_free_storage(storage); storage=NULL;
+
+
+  /* compressed file round trips, chosen by the file name suffix */
+  storage=librdf_new_storage(world, NULL, NULL, NULL);
+  model=librdf_new_model(world, storage, NULL);
+  for(i=0; i < TEST_COMPRESS_STATEMENTS; i++) {
+    char literal[32];
+
+    sprintf(literal, "literal %d", i);
+    statement=librdf_new_statement_from_nodes(world,
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/foo"),
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/bar"),
+      librdf_new_node_from_literal(world, (const unsigned char*)literal, NULL, 0));
+    librdf_model_add_statement(model, statement);
+    librdf_free_statement(statement);
+  }
+
+  serializer=librdf_new_serializer(world, "ntriples", NULL, NULL);
+  parser=librdf_new_parser(world, "ntriples", NULL, NULL);
+
+  for(i=0; test_compress_files[i].name; i++) {
+    const char *name=test_compress_files[i].name;
+    unsigned char magic[4];
+    librdf_uri* uri;
+
+    fprintf(stderr, "%s: Serializing and parsing compressed file %s\n",
+            program, name);
+    if(librdf_serializer_serialize_model_to_file(serializer, name, NULL,
+                                                 model)) {
+      fprintf(stderr, "%s: Failed to serialize to compressed file %s\n",
+              program, name);
+      return 1;
+    }
+
+    fh=fopen(name, "rb");
+    if(!fh || fread(magic, 1, 4, fh) != 4 ||
+       memcmp(magic, test_compress_files[i].magic, 4)) {
+      fprintf(stderr, "%s: Compressed file %s does not start with the expected magic\n",
+              program, name);
+      return 1;
+    }
+    fclose(fh);
+
+    storage2=librdf_new_storage(world, NULL, NULL, NULL);
+    model2=librdf_new_model(world, storage2, NULL);
+    uri=librdf_new_uri_from_filename(world, name);
+    if(librdf_parser_parse_into_model(parser, uri, NULL, model2) ||
+       librdf_model_size(model2) != TEST_COMPRESS_STATEMENTS) {
+      fprintf(stderr, "%s: Parsing compressed file %s returned %d statements, expected %d\n",
+              program, name, librdf_model_size(model2),
+              TEST_COMPRESS_STATEMENTS);
+      return 1;
+    }
+    librdf_free_uri(uri);
+    librdf_free_model(model2); model2=NULL;
+    librdf_free_storage(storage2); storage2=NULL;
+
+    unlink(name);
+  }
+
+  librdf_free_parser(parser); parser=NULL;
+  librdf_free_serializer(serializer); serializer=NULL;
+  librdf_free_model(model); model=NULL;
+  librdf_free_storage(storage); storage=NULL;
+
+
   librdf_free_world(world);
   
   /* keep gcc -Wall happy */
@@ -88,6 +88,40 @@ void librdf_serializer_set_error(librdf_serializer* serializer, void *user_data,
 REDLAND_API
 void librdf_serializer_set_warning(librdf_serializer* serializer, void *user_data, void (*warning_fn)(void *user_data, const char *msg, ...));
 
+/**
+ * LIBRDF_SERIALIZER_FEATURE_STREAMING:
+ *
+ * Serializer feature URI string to write Turtle as the statements
+ * arrive, holding only the previous subject and predicate, instead of
+ * collecting the graph first.  Statements with the same subject are
+ * grouped when they are next to each other, so a stream sorted by
+ * subject gives grouped output in bounded memory.  Only the turtle
+ * serializer supports it.
+ */
+#define LIBRDF_SERIALIZER_FEATURE_STREAMING "http://feature.librdf.org/serializer-streaming"
+
+/**
+ * LIBRDF_SERIALIZER_FEATURE_THREADS:
+ *
+ * Serializer feature URI string for the number of threads formatting
+ * N-Triples or N-Quads lines.  The statements are still read from the
+ * stream on the calling thread, in blocks that the threads format in
+ * parallel and that are written out in stream order.  0 or 1 formats
+ * on the calling thread; more needs librdf built with threads.
+ */
+#define LIBRDF_SERIALIZER_FEATURE_THREADS "http://feature.librdf.org/serializer-threads"
+
+/**
+ * LIBRDF_SERIALIZER_FEATURE_COMPRESSION:
+ *
+ * Serializer feature URI string for the compression of files written
+ * by librdf_serializer_serialize_model_to_file() and
+ * librdf_serializer_serialize_stream_to_file(): "gzip", "zstd",
+ * "none" or the default "auto" to use gzip for names ending in .gz
+ * and zstd for names ending in .zst.
+ */
+#define LIBRDF_SERIALIZER_FEATURE_COMPRESSION "http://feature.librdf.org/serializer-compression"
+
 REDLAND_API
 librdf_node* librdf_serializer_get_feature(librdf_serializer* serializer, librdf_uri *feature);
 REDLAND_API
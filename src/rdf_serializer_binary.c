@@ -0,0 +1,589 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_serializer_binary.c - librdf binary RDF serializer
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+#include <rdf_binary_internal.h>
+
+
+/* bytes of records collected before a write to the iostream */
+#define LIBRDF_SERIALIZER_BINARY_BUFFER_SIZE 65536
+
+/* initial slots in the term table, a power of 2 */
+#define LIBRDF_SERIALIZER_BINARY_TABLE_SIZE 4096
+
+
+/* a term written, as its encoding in the arena */
+typedef struct {
+  size_t offset;
+  size_t length;
+  u32 hash;
+  u32 id;
+} librdf_serializer_binary_term;
+
+typedef struct {
+  librdf_serializer *serializer;
+
+  /* term table: open addressing over slots_mask + 1 slots, each 0
+   * when empty or the index + 1 of a term */
+  u32 *slots;
+  u32 slots_mask;
+  librdf_serializer_binary_term *terms;
+  u32 terms_count;
+  u32 terms_size;
+
+  /* term encodings */
+  unsigned char *arena;
+  size_t arena_len;
+  size_t arena_size;
+
+  /* records not yet written */
+  unsigned char *buffer;
+  size_t buffer_len;
+  raptor_iostream *iostr;
+
+  int failed;
+} librdf_serializer_binary_context;
+
+
+static int
+librdf_serializer_binary_init(librdf_serializer *serializer, void *context)
+{
+  librdf_serializer_binary_context* scontext=(librdf_serializer_binary_context*)context;
+
+  scontext->serializer = serializer;
+
+  return 0;
+}
+
+
+static void
+librdf_serializer_binary_clear(librdf_serializer_binary_context* scontext)
+{
+  if(scontext->slots)
+    LIBRDF_FREE(u32*, scontext->slots);
+  if(scontext->terms)
+    LIBRDF_FREE(librdf_serializer_binary_term*, scontext->terms);
+  if(scontext->arena)
+    LIBRDF_FREE(char*, scontext->arena);
+  if(scontext->buffer)
+    LIBRDF_FREE(char*, scontext->buffer);
+
+  scontext->slots = NULL;
+  scontext->terms = NULL;
+  scontext->arena = NULL;
+  scontext->buffer = NULL;
+  scontext->terms_count = scontext->terms_size = 0;
+  scontext->arena_len = scontext->arena_size = 0;
+  scontext->buffer_len = 0;
+}
+
+
+static void
+librdf_serializer_binary_terminate(void *context)
+{
+  librdf_serializer_binary_context* scontext=(librdf_serializer_binary_context*)context;
+
+  librdf_serializer_binary_clear(scontext);
+}
+
+
+static int
+librdf_serializer_binary_flush(librdf_serializer_binary_context* scontext)
+{
+  if(scontext->failed)
+    return 1;
+
+  if(scontext->buffer_len &&
+     raptor_iostream_write_bytes(scontext->buffer, 1, scontext->buffer_len,
+                                 scontext->iostr) != LIBRDF_BAD_CAST(int, scontext->buffer_len))
+    scontext->failed = 1;
+  scontext->buffer_len = 0;
+
+  return scontext->failed;
+}
+
+
+static void
+librdf_serializer_binary_write(librdf_serializer_binary_context* scontext,
+                               const unsigned char *bytes, size_t len)
+{
+  if(scontext->buffer_len + len > LIBRDF_SERIALIZER_BINARY_BUFFER_SIZE) {
+    if(librdf_serializer_binary_flush(scontext))
+      return;
+
+    if(len > LIBRDF_SERIALIZER_BINARY_BUFFER_SIZE) {
+      if(raptor_iostream_write_bytes(bytes, 1, len, scontext->iostr) != LIBRDF_BAD_CAST(int, len))
+        scontext->failed = 1;
+      return;
+    }
+  }
+
+  memcpy(scontext->buffer + scontext->buffer_len, bytes, len);
+  scontext->buffer_len += len;
+}
+
+
+static void
+librdf_serializer_binary_write_varint(librdf_serializer_binary_context* scontext,
+                                      size_t value)
+{
+  unsigned char bytes[10];
+  size_t len = 0;
+
+  do {
+    unsigned char b = LIBRDF_BAD_CAST(unsigned char, value & 0x7f);
+
+    value >>= 7;
+    if(value)
+      b |= 0x80;
+    bytes[len++] = b;
+  } while(value);
+
+  librdf_serializer_binary_write(scontext, bytes, len);
+}
+
+
+/* Forget all terms, on both sides when reset_record is non 0 */
+static void
+librdf_serializer_binary_reset(librdf_serializer_binary_context* scontext,
+                               int reset_record)
+{
+  if(scontext->slots)
+    memset(scontext->slots, 0, (scontext->slots_mask + 1) * sizeof(u32));
+  scontext->terms_count = 0;
+  scontext->arena_len = 0;
+
+  if(reset_record) {
+    unsigned char record = LIBRDF_BINARY_RESET;
+
+    librdf_serializer_binary_write(scontext, &record, 1);
+  }
+}
+
+
+/* Double the term slots, rehashing the terms */
+static int
+librdf_serializer_binary_grow_slots(librdf_serializer_binary_context* scontext)
+{
+  u32 size = scontext->slots_mask ? (scontext->slots_mask + 1) * 2 :
+                                    LIBRDF_SERIALIZER_BINARY_TABLE_SIZE;
+  u32 *slots;
+  u32 i;
+
+  slots = LIBRDF_CALLOC(u32*, size, sizeof(u32));
+  if(!slots)
+    return 1;
+
+  for(i = 0; i < scontext->terms_count; i++) {
+    u32 slot = scontext->terms[i].hash & (size - 1);
+
+    while(slots[slot])
+      slot = (slot + 1) & (size - 1);
+    slots[slot] = i + 1;
+  }
+
+  if(scontext->slots)
+    LIBRDF_FREE(u32*, scontext->slots);
+  scontext->slots = slots;
+  scontext->slots_mask = size - 1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_serializer_binary_term_id:
+ * @scontext: serializer context
+ * @node: term
+ * @id_p: pointer to store term id
+ *
+ * INTERNAL - Get the id of a term, writing a TERM record if it is new
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_serializer_binary_term_id(librdf_serializer_binary_context* scontext,
+                                 librdf_node* node, u32 *id_p)
+{
+  librdf_serializer_binary_term* term;
+  unsigned char *encoding;
+  unsigned char record;
+  size_t length;
+  u32 hash = 2166136261U;
+  u32 slot;
+  size_t i;
+
+  length = librdf_node_encode(node, NULL, 0);
+  if(!length)
+    return 1;
+
+  if(scontext->arena_len + length > scontext->arena_size) {
+    size_t size = scontext->arena_size ? scontext->arena_size * 2 : 65536;
+    unsigned char *arena;
+
+    while(size < scontext->arena_len + length)
+      size *= 2;
+    arena = LIBRDF_MALLOC(unsigned char*, size);
+    if(!arena)
+      return 1;
+    if(scontext->arena_len)
+      memcpy(arena, scontext->arena, scontext->arena_len);
+    if(scontext->arena)
+      LIBRDF_FREE(char*, scontext->arena);
+    scontext->arena = arena;
+    scontext->arena_size = size;
+  }
+
+  /* encode at the end of the arena; kept there if it is new */
+  encoding = scontext->arena + scontext->arena_len;
+  if(librdf_node_encode(node, encoding, length) != length)
+    return 1;
+
+  /* FNV-1a */
+  for(i = 0; i < length; i++) {
+    hash ^= encoding[i];
+    hash *= 16777619U;
+  }
+
+  if(!scontext->slots && librdf_serializer_binary_grow_slots(scontext))
+    return 1;
+
+  slot = hash & scontext->slots_mask;
+  while(scontext->slots[slot]) {
+    term = &scontext->terms[scontext->slots[slot] - 1];
+    if(term->hash == hash && term->length == length &&
+       !memcmp(scontext->arena + term->offset, encoding, length)) {
+      *id_p = term->id;
+      return 0;
+    }
+    slot = (slot + 1) & scontext->slots_mask;
+  }
+
+  /* a new term */
+  if(scontext->terms_count == scontext->terms_size) {
+    u32 size = scontext->terms_size ? scontext->terms_size * 2 : 1024;
+    librdf_serializer_binary_term* terms;
+
+    terms = LIBRDF_MALLOC(librdf_serializer_binary_term*,
+                          size * sizeof(librdf_serializer_binary_term));
+    if(!terms)
+      return 1;
+    if(scontext->terms_count)
+      memcpy(terms, scontext->terms,
+             scontext->terms_count * sizeof(librdf_serializer_binary_term));
+    if(scontext->terms)
+      LIBRDF_FREE(librdf_serializer_binary_term*, scontext->terms);
+    scontext->terms = terms;
+    scontext->terms_size = size;
+  }
+
+  /* keep the table at most half full */
+  if((scontext->terms_count + 1) * 2 > scontext->slots_mask + 1) {
+    if(librdf_serializer_binary_grow_slots(scontext))
+      return 1;
+  }
+  slot = hash & scontext->slots_mask;
+  while(scontext->slots[slot])
+    slot = (slot + 1) & scontext->slots_mask;
+
+  term = &scontext->terms[scontext->terms_count];
+  term->offset = scontext->arena_len;
+  term->length = length;
+  term->hash = hash;
+  term->id = scontext->terms_count;
+  scontext->slots[slot] = ++scontext->terms_count;
+  scontext->arena_len += length;
+
+  record = LIBRDF_BINARY_TERM;
+  librdf_serializer_binary_write(scontext, &record, 1);
+  librdf_serializer_binary_write_varint(scontext, length);
+  librdf_serializer_binary_write(scontext, encoding, length);
+
+  *id_p = term->id;
+  return scontext->failed;
+}
+
+
+/*
+ * librdf_serializer_binary_serialize_stream:
+ * @scontext: serializer context
+ * @stream: statements
+ * @iostr: output
+ *
+ * INTERNAL - Write a stream in the binary syntax
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_serializer_binary_serialize_stream(librdf_serializer_binary_context* scontext,
+                                          librdf_stream *stream,
+                                          raptor_iostream* iostr)
+{
+  unsigned char record;
+  int rc = 0;
+
+  scontext->iostr = iostr;
+  scontext->failed = 0;
+  librdf_serializer_binary_reset(scontext, 0);
+
+  if(!scontext->buffer) {
+    scontext->buffer = LIBRDF_MALLOC(unsigned char*,
+                                     LIBRDF_SERIALIZER_BINARY_BUFFER_SIZE);
+    if(!scontext->buffer)
+      return 1;
+  }
+  scontext->buffer_len = 0;
+
+  librdf_serializer_binary_write(scontext,
+                                 (const unsigned char*)LIBRDF_BINARY_MAGIC,
+                                 LIBRDF_BINARY_MAGIC_LEN);
+
+  while(!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_node *graph = librdf_stream_get_context2(stream);
+    u32 ids[4];
+
+    /* reset between statements so the terms of one are all known */
+    if(scontext->terms_count > LIBRDF_BINARY_MAX_TERMS - 4)
+      librdf_serializer_binary_reset(scontext, 1);
+
+    if(librdf_serializer_binary_term_id(scontext, statement->subject, &ids[0]) ||
+       librdf_serializer_binary_term_id(scontext, statement->predicate, &ids[1]) ||
+       librdf_serializer_binary_term_id(scontext, statement->object, &ids[2]) ||
+       (graph && librdf_serializer_binary_term_id(scontext, graph, &ids[3]))) {
+      rc = 1;
+      break;
+    }
+
+    record = graph ? LIBRDF_BINARY_QUAD : LIBRDF_BINARY_TRIPLE;
+    librdf_serializer_binary_write(scontext, &record, 1);
+    librdf_serializer_binary_write_varint(scontext, ids[0]);
+    librdf_serializer_binary_write_varint(scontext, ids[1]);
+    librdf_serializer_binary_write_varint(scontext, ids[2]);
+    if(graph)
+      librdf_serializer_binary_write_varint(scontext, ids[3]);
+
+    librdf_stream_next(stream);
+  }
+
+  record = LIBRDF_BINARY_END;
+  librdf_serializer_binary_write(scontext, &record, 1);
+  if(librdf_serializer_binary_flush(scontext))
+    rc = 1;
+
+  scontext->iostr = NULL;
+  return rc;
+}
+
+
+static int
+librdf_serializer_binary_serialize_stream_to_iostream(void *context,
+                                                      librdf_uri* base_uri,
+                                                      librdf_stream *stream,
+                                                      raptor_iostream* iostr)
+{
+  librdf_serializer_binary_context* scontext=(librdf_serializer_binary_context*)context;
+  int rc;
+
+  if(!iostr)
+    return 1;
+
+  if(!stream) {
+    raptor_free_iostream(iostr);
+    return 1;
+  }
+
+  rc = librdf_serializer_binary_serialize_stream(scontext, stream, iostr);
+
+  /* takes ownership of iostr like the raptor serializers */
+  raptor_free_iostream(iostr);
+
+  return rc;
+}
+
+
+static int
+librdf_serializer_binary_serialize_model_to_iostream(void *context,
+                                                     librdf_uri* base_uri,
+                                                     librdf_model *model,
+                                                     raptor_iostream* iostr)
+{
+  librdf_stream *stream;
+  int rc;
+
+  if(!iostr)
+    return 1;
+
+  stream = librdf_model_as_stream(model);
+  if(!stream) {
+    raptor_free_iostream(iostr);
+    return 1;
+  }
+  rc = librdf_serializer_binary_serialize_stream_to_iostream(context, base_uri,
+                                                             stream, iostr);
+  librdf_free_stream(stream);
+
+  return rc;
+}
+
+
+static int
+librdf_serializer_binary_serialize_stream_to_file_handle(void *context,
+                                                         FILE *handle,
+                                                         librdf_uri* base_uri,
+                                                         librdf_stream *stream)
+{
+  librdf_serializer_binary_context* scontext=(librdf_serializer_binary_context*)context;
+  raptor_iostream *iostr;
+
+  iostr = raptor_new_iostream_to_file_handle(scontext->serializer->world->raptor_world_ptr,
+                                             handle);
+  if(!iostr)
+    return 1;
+
+  return librdf_serializer_binary_serialize_stream_to_iostream(context,
+                                                               base_uri,
+                                                               stream, iostr);
+}
+
+
+static int
+librdf_serializer_binary_serialize_model_to_file_handle(void *context,
+                                                        FILE *handle,
+                                                        librdf_uri* base_uri,
+                                                        librdf_model *model)
+{
+  librdf_stream *stream;
+  int rc;
+
+  stream = librdf_model_as_stream(model);
+  if(!stream)
+    return 1;
+  rc = librdf_serializer_binary_serialize_stream_to_file_handle(context,
+                                                                handle,
+                                                                base_uri,
+                                                                stream);
+  librdf_free_stream(stream);
+
+  return rc;
+}
+
+
+static unsigned char*
+librdf_serializer_binary_serialize_stream_to_counted_string(void *context,
+                                                            librdf_uri* base_uri,
+                                                            librdf_stream *stream,
+                                                            size_t* length_p)
+{
+  librdf_serializer_binary_context* scontext=(librdf_serializer_binary_context*)context;
+  raptor_iostream *iostr;
+  void *string = NULL;
+  size_t string_length = 0;
+
+  iostr = raptor_new_iostream_to_string(scontext->serializer->world->raptor_world_ptr,
+                                        &string, &string_length, malloc);
+  if(!iostr)
+    return NULL;
+
+  /* the string is complete once the iostream is freed */
+  if(librdf_serializer_binary_serialize_stream_to_iostream(context, base_uri,
+                                                           stream, iostr)) {
+    if(string)
+      raptor_free_memory(string);
+    return NULL;
+  }
+
+  if(length_p)
+    *length_p = string_length;
+
+  return (unsigned char*)string;
+}
+
+
+static unsigned char*
+librdf_serializer_binary_serialize_model_to_counted_string(void *context,
+                                                           librdf_uri* base_uri,
+                                                           librdf_model *model,
+                                                           size_t* length_p)
+{
+  librdf_stream *stream;
+  unsigned char *string;
+
+  stream = librdf_model_as_stream(model);
+  if(!stream)
+    return NULL;
+  string = librdf_serializer_binary_serialize_stream_to_counted_string(context,
+                                                                      base_uri,
+                                                                      stream,
+                                                                      length_p);
+  librdf_free_stream(stream);
+
+  return string;
+}
+
+
+static void
+librdf_serializer_binary_register_factory(librdf_serializer_factory *factory)
+{
+  factory->context_length = sizeof(librdf_serializer_binary_context);
+
+  factory->init  = librdf_serializer_binary_init;
+  factory->terminate = librdf_serializer_binary_terminate;
+
+  factory->serialize_stream_to_file_handle = librdf_serializer_binary_serialize_stream_to_file_handle;
+  factory->serialize_model_to_file_handle = librdf_serializer_binary_serialize_model_to_file_handle;
+  factory->serialize_stream_to_counted_string = librdf_serializer_binary_serialize_stream_to_counted_string;
+  factory->serialize_model_to_counted_string = librdf_serializer_binary_serialize_model_to_counted_string;
+  factory->serialize_stream_to_iostream = librdf_serializer_binary_serialize_stream_to_iostream;
+  factory->serialize_model_to_iostream = librdf_serializer_binary_serialize_model_to_iostream;
+}
+
+
+/**
+ * librdf_serializer_binary_constructor:
+ * @world: redland world object
+ *
+ * INTERNAL - Initialise the binary serializer module.
+ *
+ **/
+void
+librdf_serializer_binary_constructor(librdf_world *world)
+{
+  librdf_serializer_register_factory(world, "librdf-binary",
+                                     "librdf binary RDF",
+                                     LIBRDF_BINARY_MIME_TYPE, NULL,
+                                     &librdf_serializer_binary_register_factory);
+}
@@ -91,6 +91,9 @@ struct librdf_serializer_s {
   void (*warning_fn)(void *user_data, const char *msg, ...);
 
   librdf_serializer_factory* factory;
+
+  /* compression of files written, or AUTO to use the file name */
+  librdf_compression compression;
 };
 
 /* class methods */
@@ -103,6 +106,7 @@ void librdf_init_serializer(librdf_world *world);
 void librdf_finish_serializer(librdf_world *world);
                     
 void librdf_serializer_raptor_constructor(librdf_world* world);
+void librdf_serializer_binary_constructor(librdf_world* world);
 void librdf_serializer_rdfxml_constructor(librdf_world* world);
 
 
@@ -33,10 +33,26 @@
 
 #include <stdio.h>
 #include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 
 
+/* Entries in the prefix cache; power of 2 */
+#define LIBRDF_SERIALIZER_RAPTOR_PREFIX_CACHE_SIZE 1024
+
+typedef struct {
+  librdf_uri *uri;              /* shared URI reference or NULL */
+  int nspace;                   /* namespace index or -1 for none */
+  size_t local_offset;          /* start of the local name in the URI */
+} librdf_serializer_raptor_prefix_entry;
+
+
 typedef struct {
   librdf_serializer *serializer;        /* librdf serializer object */
   raptor_serializer *rdf_serializer;    /* raptor serializer object */
@@ -44,9 +60,232 @@ typedef struct {
 
   int errors;
   int warnings;
+
+  /* non 0 to write Turtle as the statements arrive */
+  int streaming;
+
+  /* namespaces set, for prefixed names when streaming */
+  char **nspace_prefixes;
+  librdf_uri **nspace_uris;
+  int nspace_count;
+
+  /* namespace URI hash table of namespace index + 1, 0 for empty */
+  int *nspace_table;
+  size_t nspace_table_size;
+
+  /* URI to prefixed name cache kept across serializations */
+  librdf_serializer_raptor_prefix_entry *prefix_cache;
+
+  /* 1 for N-Triples, 2 for N-Quads lines written without raptor */
+  int line_format;
+
+  /* threads formatting N-Triples or N-Quads lines */
+  int threads;
 } librdf_serializer_raptor_context;
 
 
+/*
+ * Namespace prefix lookup
+ *
+ * Namespaces are kept in an open addressing hash table keyed by the
+ * namespace URI string.  A URI is split at each position where the
+ * rest is a Turtle local name that needs no escapes and the part
+ * before is looked up, hashing incrementally, so the cost depends on
+ * the URI length rather than on the number of namespaces.  Results
+ * are then remembered per URI, which raptor shares between equal URI
+ * strings, in a direct mapped cache that lasts until the namespaces
+ * change so re-serializing the same graph repeats no work.
+ */
+
+#define LIBRDF_SERIALIZER_RAPTOR_IS_NAME_START(c) \
+  (((c) >= 'A' && (c) <= 'Z') || ((c) >= 'a' && (c) <= 'z') || (c) == '_')
+
+#define LIBRDF_SERIALIZER_RAPTOR_IS_NAME_CHAR(c) \
+  (LIBRDF_SERIALIZER_RAPTOR_IS_NAME_START(c) || \
+   ((c) >= '0' && (c) <= '9') || (c) == '-')
+
+/* FNV-1a, one byte at a time so prefixes can be hashed incrementally */
+#define LIBRDF_SERIALIZER_RAPTOR_HASH_INIT 2166136261U
+#define LIBRDF_SERIALIZER_RAPTOR_HASH_STEP(h, c) \
+  (((h) ^ (unsigned int)(c)) * 16777619U)
+
+
+static unsigned int
+librdf_serializer_raptor_hash_string(const unsigned char *string, size_t len)
+{
+  unsigned int h = LIBRDF_SERIALIZER_RAPTOR_HASH_INIT;
+  size_t i;
+
+  for(i = 0; i < len; i++)
+    h = LIBRDF_SERIALIZER_RAPTOR_HASH_STEP(h, string[i]);
+
+  return h;
+}
+
+
+/* Drop all cached URI lookups */
+static void
+librdf_serializer_raptor_clear_prefix_cache(librdf_serializer_raptor_context* scontext)
+{
+  int i;
+
+  if(!scontext->prefix_cache)
+    return;
+
+  for(i = 0; i < LIBRDF_SERIALIZER_RAPTOR_PREFIX_CACHE_SIZE; i++) {
+    if(scontext->prefix_cache[i].uri) {
+      librdf_free_uri(scontext->prefix_cache[i].uri);
+      scontext->prefix_cache[i].uri = NULL;
+    }
+  }
+}
+
+
+/*
+ * librdf_serializer_raptor_build_nspace_table:
+ * @scontext: serializer context
+ *
+ * INTERNAL - Rebuild the namespace hash table after a namespace is added
+ *
+ * When a namespace URI is set more than once the first prefix wins.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_serializer_raptor_build_nspace_table(librdf_serializer_raptor_context* scontext)
+{
+  size_t size = 16;
+  size_t mask;
+  int *table;
+  int i;
+
+  while(size < LIBRDF_GOOD_CAST(size_t, scontext->nspace_count) * 2)
+    size <<= 1;
+  mask = size - 1;
+
+  table = LIBRDF_CALLOC(int*, size, sizeof(int));
+  if(!table)
+    return 1;
+
+  for(i = 0; i < scontext->nspace_count; i++) {
+    const unsigned char *ns_string;
+    size_t ns_len;
+    size_t slot;
+
+    ns_string = librdf_uri_as_counted_string(scontext->nspace_uris[i], &ns_len);
+    slot = librdf_serializer_raptor_hash_string(ns_string, ns_len) & mask;
+    while(table[slot]) {
+      const unsigned char *other;
+      size_t other_len;
+
+      other = librdf_uri_as_counted_string(scontext->nspace_uris[table[slot] - 1],
+                                           &other_len);
+      if(other_len == ns_len && !memcmp(other, ns_string, ns_len))
+        break;
+      slot = (slot + 1) & mask;
+    }
+    if(!table[slot])
+      table[slot] = i + 1;
+  }
+
+  if(scontext->nspace_table)
+    LIBRDF_FREE(int*, scontext->nspace_table);
+  scontext->nspace_table = table;
+  scontext->nspace_table_size = size;
+
+  return 0;
+}
+
+
+/*
+ * librdf_serializer_raptor_find_nspace:
+ * @scontext: serializer context
+ * @uri: URI
+ * @local_offset_p: pointer to store the start of the local name
+ *
+ * INTERNAL - Find a namespace giving a prefixed name for a URI
+ *
+ * Return value: namespace index or -1 if there is none
+ */
+static int
+librdf_serializer_raptor_find_nspace(librdf_serializer_raptor_context* scontext,
+                                     librdf_uri* uri, size_t* local_offset_p)
+{
+  librdf_serializer_raptor_prefix_entry* entry = NULL;
+  const unsigned char *uri_string;
+  size_t uri_len;
+  size_t mask;
+  size_t start;
+  size_t k;
+  unsigned int h;
+  int nspace = -1;
+
+  if(!scontext->nspace_table)
+    return -1;
+
+  if(!scontext->prefix_cache)
+    scontext->prefix_cache = LIBRDF_CALLOC(librdf_serializer_raptor_prefix_entry*,
+                                           LIBRDF_SERIALIZER_RAPTOR_PREFIX_CACHE_SIZE,
+                                           sizeof(librdf_serializer_raptor_prefix_entry));
+  if(scontext->prefix_cache) {
+    size_t bucket = ((size_t)uri >> 4) & (LIBRDF_SERIALIZER_RAPTOR_PREFIX_CACHE_SIZE - 1);
+
+    entry = &scontext->prefix_cache[bucket];
+    if(entry->uri == uri) {
+      *local_offset_p = entry->local_offset;
+      return entry->nspace;
+    }
+  }
+
+  uri_string = librdf_uri_as_counted_string(uri, &uri_len);
+  mask = scontext->nspace_table_size - 1;
+
+  /* the longest tail made of name characters */
+  start = uri_len;
+  while(start > 0 && LIBRDF_SERIALIZER_RAPTOR_IS_NAME_CHAR(uri_string[start - 1]))
+    start--;
+
+  h = librdf_serializer_raptor_hash_string(uri_string, start);
+  for(k = start; k <= uri_len && nspace < 0; k++) {
+    if(k == uri_len || LIBRDF_SERIALIZER_RAPTOR_IS_NAME_START(uri_string[k])) {
+      size_t slot = h & mask;
+
+      while(scontext->nspace_table[slot]) {
+        int i = scontext->nspace_table[slot] - 1;
+        const unsigned char *ns_string;
+        size_t ns_len;
+
+        ns_string = librdf_uri_as_counted_string(scontext->nspace_uris[i],
+                                                 &ns_len);
+        if(ns_len == k && !memcmp(ns_string, uri_string, k)) {
+          nspace = i;
+          *local_offset_p = k;
+          break;
+        }
+        slot = (slot + 1) & mask;
+      }
+    }
+
+    if(k < uri_len)
+      h = LIBRDF_SERIALIZER_RAPTOR_HASH_STEP(h, uri_string[k]);
+  }
+
+  if(entry) {
+    librdf_uri* copy = librdf_new_uri_from_uri(uri);
+
+    if(copy) {
+      if(entry->uri)
+        librdf_free_uri(entry->uri);
+      entry->uri = copy;
+      entry->nspace = nspace;
+      entry->local_offset = (nspace < 0) ? 0 : *local_offset_p;
+    }
+  }
+
+  return nspace;
+}
+
+
 /**
  * librdf_serializer_raptor_init:
  * @serializer: the serializer
@@ -68,6 +307,11 @@ librdf_serializer_raptor_init(librdf_serializer *serializer, void *context)
   if(!scontext->rdf_serializer)
     return 1;
 
+  if(!strcmp(scontext->serializer_name, "ntriples"))
+    scontext->line_format = 1;
+  else if(!strcmp(scontext->serializer_name, "nquads"))
+    scontext->line_format = 2;
+
   return 0;
 }
 
@@ -84,8 +328,27 @@ librdf_serializer_raptor_terminate(void *context)
 {
   librdf_serializer_raptor_context* scontext=(librdf_serializer_raptor_context*)context;
   
+  int i;
+
   if(scontext->rdf_serializer)
     raptor_free_serializer(scontext->rdf_serializer);
+
+  for(i = 0; i < scontext->nspace_count; i++) {
+    if(scontext->nspace_prefixes[i])
+      LIBRDF_FREE(char*, scontext->nspace_prefixes[i]);
+    librdf_free_uri(scontext->nspace_uris[i]);
+  }
+  if(scontext->nspace_prefixes)
+    LIBRDF_FREE(char**, scontext->nspace_prefixes);
+  if(scontext->nspace_uris)
+    LIBRDF_FREE(librdf_uri**, scontext->nspace_uris);
+  if(scontext->nspace_table)
+    LIBRDF_FREE(int*, scontext->nspace_table);
+
+  librdf_serializer_raptor_clear_prefix_cache(scontext);
+  if(scontext->prefix_cache)
+    LIBRDF_FREE(librdf_serializer_raptor_prefix_entry*,
+                scontext->prefix_cache);
 }
 
 
@@ -111,6 +374,18 @@ librdf_serializer_raptor_get_feature(void *context, librdf_uri* feature) {
   uri_string=librdf_uri_as_string(feature);
   if(!uri_string)
     return NULL;
+
+  if(!strcmp((const char*)uri_string, LIBRDF_SERIALIZER_FEATURE_STREAMING)) {
+    sprintf((char*)intbuffer, "%d", scontext->streaming);
+    return librdf_new_node_from_typed_literal(scontext->serializer->world,
+                                              intbuffer, NULL, NULL);
+  }
+
+  if(!strcmp((const char*)uri_string, LIBRDF_SERIALIZER_FEATURE_THREADS)) {
+    sprintf((char*)intbuffer, "%d", scontext->threads);
+    return librdf_new_node_from_typed_literal(scontext->serializer->world,
+                                              intbuffer, NULL, NULL);
+  }
   
   feature_i = raptor_world_get_option_from_uri(scontext->serializer->world->raptor_world_ptr, (raptor_uri*)feature);
 
@@ -139,6 +414,34 @@ librdf_serializer_raptor_set_feature(void *context,
   if(!feature)
     return 1;
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_SERIALIZER_FEATURE_STREAMING)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    /* only the turtle serializer streams */
+    if(strcmp(scontext->serializer_name, "turtle"))
+      return 1;
+
+    scontext->streaming = (atoi((const char*)librdf_node_get_literal_value(value)) != 0);
+    return 0;
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_SERIALIZER_FEATURE_THREADS)) {
+    int threads;
+
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    threads = atoi((const char*)librdf_node_get_literal_value(value));
+    if(threads < 0)
+      return 1;
+
+    scontext->threads = threads;
+    return 0;
+  }
+
   /* try a raptor feature */
   feature_i = raptor_world_get_option_from_uri(scontext->serializer->world->raptor_world_ptr, (raptor_uri*)feature);
 
@@ -160,10 +463,206 @@ librdf_serializer_raptor_set_namespace(void* context,
                                        librdf_uri *uri, const char *prefix) 
 {
   librdf_serializer_raptor_context* scontext = (librdf_serializer_raptor_context*)context;
+  char **prefixes;
+  librdf_uri **uris;
+  size_t size;
+  int rc;
 
-  return raptor_serializer_set_namespace(scontext->rdf_serializer,
-                                         (raptor_uri*)uri,
-                                         (const unsigned char*)prefix);
+  rc = raptor_serializer_set_namespace(scontext->rdf_serializer,
+                                       (raptor_uri*)uri,
+                                       (const unsigned char*)prefix);
+  if(rc)
+    return rc;
+
+  /* remember it for streaming */
+  size = LIBRDF_GOOD_CAST(size_t, scontext->nspace_count + 1);
+  prefixes = LIBRDF_MALLOC(char**, size * sizeof(char*));
+  uris = LIBRDF_MALLOC(librdf_uri**, size * sizeof(librdf_uri*));
+  if(!prefixes || !uris) {
+    if(prefixes)
+      LIBRDF_FREE(char**, prefixes);
+    if(uris)
+      LIBRDF_FREE(librdf_uri**, uris);
+    return 1;
+  }
+  if(scontext->nspace_count) {
+    memcpy(prefixes, scontext->nspace_prefixes, (size - 1) * sizeof(char*));
+    memcpy(uris, scontext->nspace_uris, (size - 1) * sizeof(librdf_uri*));
+    LIBRDF_FREE(char**, scontext->nspace_prefixes);
+    LIBRDF_FREE(librdf_uri**, scontext->nspace_uris);
+  }
+  scontext->nspace_prefixes = prefixes;
+  scontext->nspace_uris = uris;
+
+  prefixes[size - 1] = NULL;
+  if(prefix) {
+    size_t len = strlen(prefix);
+
+    prefixes[size - 1] = LIBRDF_MALLOC(char*, len + 1);
+    if(!prefixes[size - 1])
+      return 1;
+    memcpy(prefixes[size - 1], prefix, len + 1);
+  }
+  uris[size - 1] = librdf_new_uri_from_uri(uri);
+  if(!uris[size - 1]) {
+    if(prefixes[size - 1])
+      LIBRDF_FREE(char*, prefixes[size - 1]);
+    return 1;
+  }
+  scontext->nspace_count++;
+
+  librdf_serializer_raptor_clear_prefix_cache(scontext);
+
+  return librdf_serializer_raptor_build_nspace_table(scontext);
+}
+
+
+/*
+ * Streaming Turtle
+ *
+ * Statements are written as they come from the stream, holding only
+ * the previous subject and predicate: a statement with the same
+ * subject continues the previous one with ';' and one with the same
+ * subject and predicate with ','.  A stream sorted by subject, such
+ * as a hashes or trees storage in subject order, so gives grouped
+ * Turtle without the graph being held in memory; any other order is
+ * still correct Turtle with subjects repeated.  Contexts are ignored
+ * as in the raptor Turtle serializer.
+ */
+
+static void
+librdf_serializer_raptor_turtle_write_node(librdf_serializer_raptor_context* scontext,
+                                           librdf_node* node,
+                                           raptor_iostream* iostr)
+{
+  if(librdf_node_is_resource(node)) {
+    librdf_uri* uri = librdf_node_get_uri(node);
+    size_t local_offset = 0;
+    int i;
+
+    i = librdf_serializer_raptor_find_nspace(scontext, uri, &local_offset);
+    if(i >= 0) {
+      const unsigned char *uri_string;
+      size_t uri_len;
+
+      uri_string = librdf_uri_as_counted_string(uri, &uri_len);
+      if(scontext->nspace_prefixes[i])
+        raptor_iostream_string_write(scontext->nspace_prefixes[i], iostr);
+      raptor_iostream_write_byte(':', iostr);
+      raptor_iostream_counted_string_write(uri_string + local_offset,
+                                           uri_len - local_offset, iostr);
+      return;
+    }
+  }
+
+  /* N-Triples terms are Turtle terms */
+  librdf_node_write(node, iostr);
+}
+
+
+/*
+ * librdf_serializer_raptor_serialize_turtle_stream:
+ * @scontext: serializer context
+ * @base_uri: base URI or NULL
+ * @stream: statements
+ * @iostr: output
+ *
+ * INTERNAL - Write a stream as Turtle incrementally
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_serializer_raptor_serialize_turtle_stream(librdf_serializer_raptor_context* scontext,
+                                                 librdf_uri* base_uri,
+                                                 librdf_stream *stream,
+                                                 raptor_iostream* iostr)
+{
+  librdf_world* world = scontext->serializer->world;
+  librdf_node* subject = NULL;
+  librdf_node* predicate = NULL;
+  librdf_uri* rdf_type;
+  int rc = 0;
+  int i;
+
+  scontext->errors=0;
+  scontext->warnings=0;
+
+  rdf_type = librdf_new_uri(world, (const unsigned char*)"http://www.w3.org/1999/02/22-rdf-syntax-ns#type");
+  if(!rdf_type)
+    return 1;
+
+  if(base_uri) {
+    raptor_iostream_counted_string_write("@base <", 7, iostr);
+    raptor_iostream_string_write(librdf_uri_as_string(base_uri), iostr);
+    raptor_iostream_counted_string_write("> .\n", 4, iostr);
+  }
+  for(i = 0; i < scontext->nspace_count; i++) {
+    raptor_iostream_counted_string_write("@prefix ", 8, iostr);
+    if(scontext->nspace_prefixes[i])
+      raptor_iostream_string_write(scontext->nspace_prefixes[i], iostr);
+    raptor_iostream_counted_string_write(": <", 3, iostr);
+    raptor_iostream_string_write(librdf_uri_as_string(scontext->nspace_uris[i]),
+                                 iostr);
+    raptor_iostream_counted_string_write("> .\n", 4, iostr);
+  }
+  if(base_uri || scontext->nspace_count)
+    raptor_iostream_write_byte('\n', iostr);
+
+  while(!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_node* s = librdf_statement_get_subject(statement);
+    librdf_node* p = librdf_statement_get_predicate(statement);
+    librdf_node* o = librdf_statement_get_object(statement);
+
+    if(subject && librdf_node_equals(subject, s)) {
+      if(librdf_node_equals(predicate, p)) {
+        raptor_iostream_counted_string_write(" ,\n        ", 10, iostr);
+        librdf_serializer_raptor_turtle_write_node(scontext, o, iostr);
+        librdf_stream_next(stream);
+        continue;
+      }
+      raptor_iostream_counted_string_write(" ;\n    ", 7, iostr);
+    } else {
+      if(subject) {
+        raptor_iostream_counted_string_write(" .\n\n", 4, iostr);
+        librdf_free_node(subject);
+      }
+      subject = librdf_new_node_from_node(s);
+      if(!subject) {
+        rc = 1;
+        break;
+      }
+      librdf_serializer_raptor_turtle_write_node(scontext, s, iostr);
+      raptor_iostream_write_byte(' ', iostr);
+    }
+
+    if(predicate)
+      librdf_free_node(predicate);
+    predicate = librdf_new_node_from_node(p);
+    if(!predicate) {
+      rc = 1;
+      break;
+    }
+
+    if(librdf_uri_equals(librdf_node_get_uri(p), rdf_type))
+      raptor_iostream_write_byte('a', iostr);
+    else
+      librdf_serializer_raptor_turtle_write_node(scontext, p, iostr);
+    raptor_iostream_write_byte(' ', iostr);
+    librdf_serializer_raptor_turtle_write_node(scontext, o, iostr);
+
+    librdf_stream_next(stream);
+  }
+
+  if(subject) {
+    raptor_iostream_counted_string_write(" .\n", 3, iostr);
+    librdf_free_node(subject);
+  }
+  if(predicate)
+    librdf_free_node(predicate);
+  librdf_free_uri(rdf_type);
+
+  return rc;
 }
   
 
@@ -175,6 +674,648 @@ librdf_serializer_raptor_serialize_statement(raptor_serializer *rserializer,
 }
 
 
+/*
+ * N-Triples and N-Quads line writer
+ *
+ * Lines are formatted from the term structures directly into a large
+ * buffer that is written out when full, instead of a raptor iostream
+ * write per term.  Runs of printable ASCII are copied as they are;
+ * other characters are escaped as the raptor N-Triples serializer
+ * does, so the output is the same ASCII N-Triples.
+ */
+
+/* size of the line writer buffer */
+#define LIBRDF_SERIALIZER_RAPTOR_LINE_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+  unsigned char *buffer;
+  size_t len;
+  size_t size;
+
+  /* output; with neither the buffer just grows */
+  FILE *fh;
+  raptor_iostream *iostr;
+
+  /* non 0 after a write or allocation failure */
+  int failed;
+} librdf_serializer_raptor_line_writer;
+
+
+static int
+librdf_serializer_raptor_line_writer_init(librdf_serializer_raptor_line_writer* writer,
+                                          FILE *fh, raptor_iostream *iostr)
+{
+  memset(writer, 0, sizeof(*writer));
+  writer->fh = fh;
+  writer->iostr = iostr;
+  writer->size = LIBRDF_SERIALIZER_RAPTOR_LINE_BUFFER_SIZE;
+  writer->buffer = LIBRDF_MALLOC(unsigned char*, writer->size);
+  if(!writer->buffer) {
+    writer->failed = 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_serializer_raptor_line_writer_flush(librdf_serializer_raptor_line_writer* writer)
+{
+  if(!writer->len || writer->failed)
+    return writer->failed;
+
+  if(writer->fh) {
+    if(fwrite(writer->buffer, 1, writer->len, writer->fh) != writer->len)
+      writer->failed = 1;
+  } else if(writer->iostr) {
+    if(raptor_iostream_write_bytes(writer->buffer, 1, writer->len,
+                                   writer->iostr) != LIBRDF_BAD_CAST(int, writer->len))
+      writer->failed = 1;
+  } else
+    return 0;
+
+  writer->len = 0;
+  return writer->failed;
+}
+
+
+static void
+librdf_serializer_raptor_line_writer_clear(librdf_serializer_raptor_line_writer* writer)
+{
+  if(writer->buffer)
+    LIBRDF_FREE(char*, writer->buffer);
+  writer->buffer = NULL;
+}
+
+
+/* Make room for len more bytes, flushing or growing the buffer */
+static int
+librdf_serializer_raptor_line_writer_reserve(librdf_serializer_raptor_line_writer* writer,
+                                             size_t len)
+{
+  unsigned char *buffer;
+  size_t size;
+
+  if(writer->failed)
+    return 1;
+
+  if(writer->len + len <= writer->size)
+    return 0;
+
+  if(librdf_serializer_raptor_line_writer_flush(writer))
+    return 1;
+
+  if(writer->len + len <= writer->size)
+    return 0;
+
+  size = writer->size;
+  while(size < writer->len + len)
+    size <<= 1;
+
+  buffer = LIBRDF_MALLOC(unsigned char*, size);
+  if(!buffer) {
+    writer->failed = 1;
+    return 1;
+  }
+  if(writer->len)
+    memcpy(buffer, writer->buffer, writer->len);
+  LIBRDF_FREE(char*, writer->buffer);
+  writer->buffer = buffer;
+  writer->size = size;
+
+  return 0;
+}
+
+
+static void
+librdf_serializer_raptor_line_write(librdf_serializer_raptor_line_writer* writer,
+                                    const unsigned char *string, size_t len)
+{
+  if(librdf_serializer_raptor_line_writer_reserve(writer, len))
+    return;
+  memcpy(writer->buffer + writer->len, string, len);
+  writer->len += len;
+}
+
+
+/* Write a \u or \U escape of unichar c */
+static void
+librdf_serializer_raptor_line_write_unichar(librdf_serializer_raptor_line_writer* writer,
+                                            raptor_unichar c)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  unsigned char *p;
+  int digits = (c > 0xFFFF) ? 8 : 4;
+  int i;
+
+  if(librdf_serializer_raptor_line_writer_reserve(writer, 10))
+    return;
+
+  p = writer->buffer + writer->len;
+  *p++ = '\\';
+  *p++ = (digits == 8) ? 'U' : 'u';
+  for(i = digits - 1; i >= 0; i--)
+    *p++ = LIBRDF_GOOD_CAST(unsigned char, hex[(c >> (i * 4)) & 0xF]);
+  writer->len += LIBRDF_GOOD_CAST(size_t, digits + 2);
+}
+
+
+/*
+ * librdf_serializer_raptor_line_write_escaped:
+ * @writer: line writer
+ * @string: UTF-8 string
+ * @len: length of @string
+ * @is_uri: non 0 for the inside of an IRI, 0 for a literal
+ *
+ * INTERNAL - Write a string with N-Triples escapes
+ */
+static void
+librdf_serializer_raptor_line_write_escaped(librdf_serializer_raptor_line_writer* writer,
+                                            const unsigned char *string,
+                                            size_t len, int is_uri)
+{
+  size_t i = 0;
+
+  while(i < len) {
+    size_t start = i;
+    unsigned char c;
+
+    /* copy the run that needs no escapes in one go */
+    for(; i < len; i++) {
+      c = string[i];
+      if(c < 0x20 || c >= 0x7F || c == '\\' || c == '"')
+        break;
+      if(is_uri && (c == '<' || c == '>' || c == '{' || c == '}' ||
+                    c == '|' || c == '^' || c == '`' || c == ' '))
+        break;
+    }
+    if(i > start)
+      librdf_serializer_raptor_line_write(writer, string + start, i - start);
+    if(i == len)
+      break;
+
+    c = string[i];
+    if(c < 0x80) {
+      if(!is_uri && c == '\\')
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\\\\", 2);
+      else if(!is_uri && c == '"')
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\\\"", 2);
+      else if(!is_uri && c == '\n')
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\\n", 2);
+      else if(!is_uri && c == '\r')
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\\r", 2);
+      else if(!is_uri && c == '\t')
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\\t", 2);
+      else
+        librdf_serializer_raptor_line_write_unichar(writer, c);
+      i++;
+    } else {
+      raptor_unichar unichar;
+      int size;
+
+      size = raptor_unicode_utf8_string_get_char(string + i, len - i,
+                                                 &unichar);
+      if(size <= 0) {
+        writer->failed = 1;
+        return;
+      }
+      librdf_serializer_raptor_line_write_unichar(writer, unichar);
+      i += LIBRDF_GOOD_CAST(size_t, size);
+    }
+  }
+}
+
+
+static void
+librdf_serializer_raptor_line_write_uri(librdf_serializer_raptor_line_writer* writer,
+                                        raptor_uri* uri)
+{
+  const unsigned char *uri_string;
+  size_t uri_len;
+
+  uri_string = raptor_uri_as_counted_string(uri, &uri_len);
+  librdf_serializer_raptor_line_write(writer, (const unsigned char*)"<", 1);
+  librdf_serializer_raptor_line_write_escaped(writer, uri_string, uri_len, 1);
+  librdf_serializer_raptor_line_write(writer, (const unsigned char*)">", 1);
+}
+
+
+static void
+librdf_serializer_raptor_line_write_term(librdf_serializer_raptor_line_writer* writer,
+                                         raptor_term* term)
+{
+  switch(term->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      librdf_serializer_raptor_line_write_uri(writer, term->value.uri);
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      librdf_serializer_raptor_line_write(writer, (const unsigned char*)"_:", 2);
+      librdf_serializer_raptor_line_write(writer, term->value.blank.string,
+                                          term->value.blank.string_len);
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\"", 1);
+      librdf_serializer_raptor_line_write_escaped(writer,
+                                                  term->value.literal.string,
+                                                  term->value.literal.string_len,
+                                                  0);
+      librdf_serializer_raptor_line_write(writer, (const unsigned char*)"\"", 1);
+      if(term->value.literal.language) {
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"@", 1);
+        librdf_serializer_raptor_line_write(writer,
+                                            term->value.literal.language,
+                                            term->value.literal.language_len);
+      } else if(term->value.literal.datatype) {
+        librdf_serializer_raptor_line_write(writer, (const unsigned char*)"^^", 2);
+        librdf_serializer_raptor_line_write_uri(writer,
+                                                term->value.literal.datatype);
+      }
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      writer->failed = 1;
+      break;
+  }
+}
+
+
+/* Write one statement line, with graph if it is not NULL */
+static int
+librdf_serializer_raptor_line_write_statement(librdf_serializer_raptor_line_writer* writer,
+                                              librdf_statement* statement,
+                                              librdf_node* graph)
+{
+  librdf_serializer_raptor_line_write_term(writer, statement->subject);
+  librdf_serializer_raptor_line_write(writer, (const unsigned char*)" ", 1);
+  librdf_serializer_raptor_line_write_term(writer, statement->predicate);
+  librdf_serializer_raptor_line_write(writer, (const unsigned char*)" ", 1);
+  librdf_serializer_raptor_line_write_term(writer, statement->object);
+  if(graph) {
+    librdf_serializer_raptor_line_write(writer, (const unsigned char*)" ", 1);
+    librdf_serializer_raptor_line_write_term(writer, graph);
+  }
+  librdf_serializer_raptor_line_write(writer, (const unsigned char*)" .\n", 3);
+
+  return writer->failed;
+}
+
+
+#ifdef WITH_THREADS
+
+/*
+ * Parallel N-Triples and N-Quads writing
+ *
+ * Stores and streams are read on the calling thread, which cuts the
+ * stream into jobs of LIBRDF_SERIALIZER_RAPTOR_JOB_SIZE statement
+ * copies.  A pool of threads formats the jobs into their own buffers,
+ * only reading the terms, and the calling thread writes the buffers
+ * out in stream order and frees the copies so that term reference
+ * counts are only changed on one thread.
+ */
+
+/* statements per job */
+#define LIBRDF_SERIALIZER_RAPTOR_JOB_SIZE 10000
+
+typedef enum {
+  LIBRDF_SERIALIZER_RAPTOR_JOB_EMPTY,
+  LIBRDF_SERIALIZER_RAPTOR_JOB_PENDING,
+  LIBRDF_SERIALIZER_RAPTOR_JOB_RUNNING,
+  LIBRDF_SERIALIZER_RAPTOR_JOB_DONE
+} librdf_serializer_raptor_job_state;
+
+typedef struct {
+  librdf_serializer_raptor_job_state state;
+
+  /* statement copies with the graph set for N-Quads */
+  librdf_statement** statements;
+  int count;
+
+  /* formatted lines */
+  librdf_serializer_raptor_line_writer writer;
+} librdf_serializer_raptor_job;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  /* signalled when a job is pending or on shutdown */
+  pthread_cond_t work_cond;
+  /* signalled when a job is done */
+  pthread_cond_t done_cond;
+  int shutdown;
+
+  /* ring of jobs, taken by the threads in order */
+  librdf_serializer_raptor_job* jobs;
+  int jobs_count;
+  unsigned long next_job;
+
+  pthread_t* threads;
+  int threads_count;
+} librdf_serializer_raptor_pool;
+
+
+static void*
+librdf_serializer_raptor_pool_run(void* arg)
+{
+  librdf_serializer_raptor_pool* pool=(librdf_serializer_raptor_pool*)arg;
+
+  pthread_mutex_lock(&pool->mutex);
+  while(!pool->shutdown) {
+    librdf_serializer_raptor_job* job;
+    int i;
+
+    job = &pool->jobs[pool->next_job % LIBRDF_GOOD_CAST(unsigned long, pool->jobs_count)];
+    if(job->state != LIBRDF_SERIALIZER_RAPTOR_JOB_PENDING) {
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+      continue;
+    }
+
+    job->state = LIBRDF_SERIALIZER_RAPTOR_JOB_RUNNING;
+    pool->next_job++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    job->writer.len = 0;
+    for(i = 0; i < job->count; i++) {
+      librdf_statement* statement = job->statements[i];
+
+      if(librdf_serializer_raptor_line_write_statement(&job->writer,
+                                                        statement,
+                                                        statement->graph))
+        break;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    job->state = LIBRDF_SERIALIZER_RAPTOR_JOB_DONE;
+    pthread_cond_broadcast(&pool->done_cond);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+
+static void
+librdf_serializer_raptor_free_pool(librdf_serializer_raptor_pool* pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for(i = 0; i < pool->threads_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  for(i = 0; i < pool->jobs_count; i++) {
+    librdf_serializer_raptor_job* job = &pool->jobs[i];
+    int j;
+
+    if(job->statements) {
+      for(j = 0; j < job->count; j++)
+        librdf_free_statement(job->statements[j]);
+      LIBRDF_FREE(librdf_statement**, job->statements);
+    }
+    librdf_serializer_raptor_line_writer_clear(&job->writer);
+  }
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->mutex);
+
+  if(pool->threads)
+    LIBRDF_FREE(pthread_t*, pool->threads);
+  if(pool->jobs)
+    LIBRDF_FREE(librdf_serializer_raptor_job*, pool->jobs);
+  LIBRDF_FREE(librdf_serializer_raptor_pool, pool);
+}
+
+
+static librdf_serializer_raptor_pool*
+librdf_serializer_raptor_new_pool(int threads)
+{
+  librdf_serializer_raptor_pool* pool;
+  int i;
+
+  pool = LIBRDF_CALLOC(librdf_serializer_raptor_pool*, 1, sizeof(*pool));
+  if(!pool)
+    return NULL;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  /* let the reader run one job ahead of each thread */
+  pool->jobs_count = threads * 2;
+  pool->jobs = LIBRDF_CALLOC(librdf_serializer_raptor_job*,
+                             LIBRDF_GOOD_CAST(size_t, pool->jobs_count),
+                             sizeof(librdf_serializer_raptor_job));
+  pool->threads = LIBRDF_CALLOC(pthread_t*, LIBRDF_GOOD_CAST(size_t, threads),
+                                sizeof(pthread_t));
+  if(!pool->jobs || !pool->threads) {
+    librdf_serializer_raptor_free_pool(pool);
+    return NULL;
+  }
+
+  for(i = 0; i < pool->jobs_count; i++) {
+    librdf_serializer_raptor_job* job = &pool->jobs[i];
+
+    job->statements = LIBRDF_CALLOC(librdf_statement**,
+                                    LIBRDF_SERIALIZER_RAPTOR_JOB_SIZE,
+                                    sizeof(librdf_statement*));
+    if(!job->statements ||
+       librdf_serializer_raptor_line_writer_init(&job->writer, NULL, NULL)) {
+      librdf_serializer_raptor_free_pool(pool);
+      return NULL;
+    }
+  }
+
+  for(i = 0; i < threads; i++) {
+    if(pthread_create(&pool->threads[i], NULL,
+                      librdf_serializer_raptor_pool_run, pool))
+      break;
+    pool->threads_count++;
+  }
+
+  if(i < threads) {
+    librdf_serializer_raptor_free_pool(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+
+/* Fill a job with copies of the next statements of the stream */
+static int
+librdf_serializer_raptor_fill_job(librdf_serializer_raptor_context* scontext,
+                                  librdf_serializer_raptor_job* job,
+                                  librdf_stream* stream)
+{
+  for(job->count = 0;
+      job->count < LIBRDF_SERIALIZER_RAPTOR_JOB_SIZE && !librdf_stream_end(stream);
+      librdf_stream_next(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_statement *copy;
+
+    copy = librdf_new_statement_from_statement(statement);
+    if(!copy)
+      return 1;
+    job->statements[job->count++] = copy;
+
+    if(scontext->line_format == 2) {
+      librdf_node *graph = librdf_stream_get_context2(stream);
+
+      if(graph) {
+        copy->graph = librdf_new_node_from_node(graph);
+        if(!copy->graph)
+          return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_serializer_raptor_serialize_lines_parallel:
+ * @scontext: serializer context
+ * @stream: statements
+ * @writer: output line writer
+ *
+ * INTERNAL - Write a stream as N-Triples or N-Quads lines with a thread pool
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_serializer_raptor_serialize_lines_parallel(librdf_serializer_raptor_context* scontext,
+                                                  librdf_stream *stream,
+                                                  librdf_serializer_raptor_line_writer* writer)
+{
+  librdf_serializer_raptor_pool* pool;
+  unsigned long submitted = 0;
+  unsigned long consumed = 0;
+  unsigned long jobs_count;
+  int at_end = 0;
+  int rc = 0;
+
+  pool = librdf_serializer_raptor_new_pool(scontext->threads);
+  if(!pool) {
+    librdf_log(scontext->serializer->world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_SERIALIZER, NULL,
+               "Cannot start %d %s serializer threads", scontext->threads,
+               scontext->serializer_name);
+    return 1;
+  }
+  jobs_count = LIBRDF_GOOD_CAST(unsigned long, pool->jobs_count);
+
+  while(!at_end || consumed < submitted) {
+    librdf_serializer_raptor_job* job;
+    int i;
+
+    if(!at_end && submitted - consumed < jobs_count) {
+      job = &pool->jobs[submitted % jobs_count];
+      if(librdf_serializer_raptor_fill_job(scontext, job, stream))
+        rc = 1;
+      if(rc || librdf_stream_end(stream))
+        at_end = 1;
+      if(rc || !job->count)
+        continue;
+
+      pthread_mutex_lock(&pool->mutex);
+      job->state = LIBRDF_SERIALIZER_RAPTOR_JOB_PENDING;
+      pthread_cond_signal(&pool->work_cond);
+      pthread_mutex_unlock(&pool->mutex);
+      submitted++;
+      continue;
+    }
+
+    job = &pool->jobs[consumed % jobs_count];
+    pthread_mutex_lock(&pool->mutex);
+    while(job->state != LIBRDF_SERIALIZER_RAPTOR_JOB_DONE)
+      pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(job->writer.failed)
+      rc = 1;
+    else if(!rc)
+      librdf_serializer_raptor_line_write(writer, job->writer.buffer,
+                                          job->writer.len);
+
+    for(i = 0; i < job->count; i++)
+      librdf_free_statement(job->statements[i]);
+    job->count = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    job->state = LIBRDF_SERIALIZER_RAPTOR_JOB_EMPTY;
+    pthread_mutex_unlock(&pool->mutex);
+    consumed++;
+  }
+
+  librdf_serializer_raptor_free_pool(pool);
+
+  return rc;
+}
+
+#endif
+
+
+/*
+ * librdf_serializer_raptor_serialize_lines:
+ * @scontext: serializer context
+ * @stream: statements
+ * @fh: output file handle or NULL
+ * @iostr: output iostream if @fh is NULL
+ *
+ * INTERNAL - Write a stream as N-Triples or N-Quads lines
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_serializer_raptor_serialize_lines(librdf_serializer_raptor_context* scontext,
+                                         librdf_stream *stream,
+                                         FILE *fh, raptor_iostream* iostr)
+{
+  librdf_serializer_raptor_line_writer writer;
+  int rc = 0;
+
+  scontext->errors=0;
+  scontext->warnings=0;
+
+  if(librdf_serializer_raptor_line_writer_init(&writer, fh, iostr))
+    return 1;
+
+#ifdef WITH_THREADS
+  if(scontext->threads > 1)
+    rc = librdf_serializer_raptor_serialize_lines_parallel(scontext, stream,
+                                                           &writer);
+  else
+#endif
+  while(!librdf_stream_end(stream)) {
+    librdf_statement *statement = librdf_stream_get_object(stream);
+    librdf_node *graph = NULL;
+
+    if(scontext->line_format == 2)
+      graph = librdf_stream_get_context2(stream);
+
+    rc = librdf_serializer_raptor_line_write_statement(&writer, statement,
+                                                       graph);
+    if(rc)
+      break;
+    librdf_stream_next(stream);
+  }
+
+  if(librdf_serializer_raptor_line_writer_flush(&writer))
+    rc = 1;
+  librdf_serializer_raptor_line_writer_clear(&writer);
+
+  return rc;
+}
+
+
 static int
 librdf_serializer_raptor_serialize_stream_to_file_handle(void *context,
                                                          FILE *handle, 
@@ -187,6 +1328,23 @@ librdf_serializer_raptor_serialize_stream_to_file_handle(void *context,
   if(!stream)
     return 1;
 
+  if(scontext->streaming) {
+    raptor_iostream *iostr;
+
+    iostr = raptor_new_iostream_to_file_handle(scontext->serializer->world->raptor_world_ptr,
+                                               handle);
+    if(!iostr)
+      return 1;
+    rc = librdf_serializer_raptor_serialize_turtle_stream(scontext, base_uri,
+                                                          stream, iostr);
+    raptor_free_iostream(iostr);
+    return rc;
+  }
+
+  if(scontext->line_format)
+    return librdf_serializer_raptor_serialize_lines(scontext, stream, handle,
+                                                    NULL);
+
   /* start the serialize */
   rc = raptor_serializer_start_to_file_handle(scontext->rdf_serializer,
                                               (raptor_uri*)base_uri, handle);
@@ -264,6 +1422,24 @@ librdf_serializer_raptor_serialize_stream_to_counted_string(void *context,
     return NULL;
   }
 
+  if(scontext->streaming || scontext->line_format) {
+    if(scontext->line_format)
+      rc = librdf_serializer_raptor_serialize_lines(scontext, stream, NULL,
+                                                    iostr);
+    else
+      rc = librdf_serializer_raptor_serialize_turtle_stream(scontext, base_uri,
+                                                            stream, iostr);
+    /* the string is complete once the iostream is freed */
+    raptor_free_iostream(iostr);
+    if(rc) {
+      raptor_free_memory(string);
+      return NULL;
+    }
+    if(length_p)
+      *length_p=string_length;
+    return (unsigned char *)string;
+  }
+
   rc = raptor_serializer_start_to_iostream(scontext->rdf_serializer,
                                            (raptor_uri*)base_uri, iostr);
 
@@ -345,6 +1521,18 @@ librdf_serializer_raptor_serialize_stream_to_iostream(void *context,
   if(!stream)
     return 1;
 
+  if(scontext->streaming || scontext->line_format) {
+    if(scontext->line_format)
+      rc = librdf_serializer_raptor_serialize_lines(scontext, stream, NULL,
+                                                    iostr);
+    else
+      rc = librdf_serializer_raptor_serialize_turtle_stream(scontext, base_uri,
+                                                            stream, iostr);
+    /* as below, the iostream is freed here */
+    raptor_free_iostream(iostr);
+    return rc;
+  }
+
   /* start the serialize */
   rc = raptor_serializer_start_to_iostream(scontext->rdf_serializer,
                                            (raptor_uri*)base_uri, iostr);
@@ -36,6 +36,10 @@
 #include <stdlib.h>
 #endif
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
 #include <redland.h>
 
 #ifndef STANDALONE
@@ -47,6 +51,190 @@ librdf_statement_encode_parts_internal(librdf_statement* statement,
                                        unsigned char *buffer, size_t length,
                                        librdf_statement_part fields);
 
+
+/*
+ * Freed statements are kept on a per-thread free list and reused by
+ * the constructors, saving a malloc and free per statement for
+ * streams and parsers that make and drop one statement per triple.
+ * Statements are still allocated one at a time by raptor so
+ * raptor_free_statement() can free any of them.  Nodes are not kept,
+ * raptor allocates and frees those itself.
+ */
+
+/* Most statements a thread can keep */
+#define LIBRDF_STATEMENT_CACHE_MAX 1024
+
+/* Default statements a thread keeps */
+#define LIBRDF_STATEMENT_CACHE_SIZE 64
+
+typedef struct {
+  librdf_statement* statements[LIBRDF_STATEMENT_CACHE_MAX];
+  int count;
+  unsigned long reused; /* statements taken from the free list */
+  unsigned long allocated; /* statements raptor had to allocate */
+} librdf_statement_cache;
+
+/* statements each thread keeps, from 0 (off) to LIBRDF_STATEMENT_CACHE_MAX */
+static int librdf_statement_cache_size = LIBRDF_STATEMENT_CACHE_SIZE;
+
+#ifdef WITH_THREADS
+static pthread_key_t librdf_statement_cache_key;
+static pthread_once_t librdf_statement_cache_key_once = PTHREAD_ONCE_INIT;
+#else
+static librdf_statement_cache librdf_statement_static_cache;
+#endif
+
+
+/* Free the statements on a free list */
+static void
+librdf_statement_cache_empty(librdf_statement_cache* cache)
+{
+  while(cache->count > 0)
+    raptor_free_statement(cache->statements[--cache->count]);
+}
+
+
+#ifdef WITH_THREADS
+static void
+librdf_statement_cache_free(void* data)
+{
+  librdf_statement_cache* cache = (librdf_statement_cache*)data;
+
+  librdf_statement_cache_empty(cache);
+  LIBRDF_FREE(librdf_statement_cache, cache);
+}
+
+
+static void
+librdf_statement_cache_make_key(void)
+{
+  pthread_key_create(&librdf_statement_cache_key,
+                     librdf_statement_cache_free);
+}
+#endif
+
+
+/* Get the free list of the calling thread, making it if create is set */
+static librdf_statement_cache*
+librdf_statement_get_cache(int create)
+{
+#ifdef WITH_THREADS
+  librdf_statement_cache* cache;
+
+  pthread_once(&librdf_statement_cache_key_once,
+               librdf_statement_cache_make_key);
+  cache = (librdf_statement_cache*)pthread_getspecific(librdf_statement_cache_key);
+  if(!cache && create) {
+    cache = LIBRDF_CALLOC(librdf_statement_cache*, 1, sizeof(*cache));
+    if(cache && pthread_setspecific(librdf_statement_cache_key, cache)) {
+      LIBRDF_FREE(librdf_statement_cache, cache);
+      cache = NULL;
+    }
+  }
+  return cache;
+#else
+  return &librdf_statement_static_cache;
+#endif
+}
+
+
+/* Make an empty statement, reusing a freed one if the thread has one */
+static librdf_statement*
+librdf_statement_alloc(raptor_world* raptor_world_ptr)
+{
+  librdf_statement_cache* cache;
+  librdf_statement* statement;
+
+  cache = librdf_statement_get_cache(librdf_statement_cache_size > 0);
+  if(!cache)
+    return raptor_new_statement(raptor_world_ptr);
+
+  if(!cache->count) {
+    cache->allocated++;
+    return raptor_new_statement(raptor_world_ptr);
+  }
+
+  statement = cache->statements[--cache->count];
+  cache->reused++;
+
+  raptor_statement_init(statement, raptor_world_ptr);
+  /* allocated statements have a usage count, static ones -1 */
+  statement->usage = 1;
+
+  return statement;
+}
+
+
+/**
+ * librdf_statement_cache_set_size:
+ * @size: statements each thread keeps, 0 to keep none
+ *
+ * INTERNAL - Set how many freed statements each thread keeps for reuse
+ *
+ * Statements already kept beyond the new size are freed as they
+ * are reused.
+ **/
+void
+librdf_statement_cache_set_size(int size)
+{
+  if(size < 0)
+    size = 0;
+  if(size > LIBRDF_STATEMENT_CACHE_MAX)
+    size = LIBRDF_STATEMENT_CACHE_MAX;
+  librdf_statement_cache_size = size;
+}
+
+
+/**
+ * librdf_statement_cache_get_size:
+ *
+ * INTERNAL - Get how many freed statements each thread keeps for reuse
+ *
+ * Return value: statements kept per thread
+ **/
+int
+librdf_statement_cache_get_size(void)
+{
+  return librdf_statement_cache_size;
+}
+
+
+/**
+ * librdf_statement_cache_get_counts:
+ * @reused_p: pointer to store the statements reused by this thread
+ * @allocated_p: pointer to store the statements allocated by this thread
+ *
+ * INTERNAL - Get the statement free list counters of the calling thread
+ *
+ * A low share of reused statements with the free list enabled means it
+ * is too small for the statements a thread holds at once.
+ **/
+void
+librdf_statement_cache_get_counts(unsigned long* reused_p,
+                                  unsigned long* allocated_p)
+{
+  librdf_statement_cache* cache = librdf_statement_get_cache(0);
+
+  *reused_p = cache ? cache->reused : 0;
+  *allocated_p = cache ? cache->allocated : 0;
+}
+
+
+/**
+ * librdf_statement_cache_clear:
+ *
+ * INTERNAL - Free the statements kept for reuse by the calling thread
+ **/
+void
+librdf_statement_cache_clear(void)
+{
+  librdf_statement_cache* cache = librdf_statement_get_cache(0);
+
+  if(cache)
+    librdf_statement_cache_empty(cache);
+}
+
+
 /* class methods */
 
 
@@ -63,7 +251,7 @@ librdf_new_statement(librdf_world *world)
 {
   librdf_world_open(world);
 
-  return raptor_new_statement(world->raptor_world_ptr);
+  return librdf_statement_alloc(world->raptor_world_ptr);
 }
 
 
@@ -83,12 +271,14 @@ librdf_new_statement_from_statement(librdf_statement* statement)
   raptor_term *predicate = NULL;
   raptor_term *object = NULL;
   raptor_term *graph = NULL;
+  librdf_statement* new_statement;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
 
   if(!statement)
     return NULL;
 
+  librdf_usage_lock();
   subject = raptor_term_copy(statement->subject);
   if(statement->subject && !subject)
     goto err;
@@ -104,8 +294,20 @@ librdf_new_statement_from_statement(librdf_statement* statement)
   graph = raptor_term_copy(statement->graph);
   if(statement->graph && !graph)
     goto err;
+  librdf_usage_unlock();
+
+  new_statement = librdf_statement_alloc(statement->world);
+  if(!new_statement) {
+    librdf_usage_lock();
+    goto err;
+  }
+
+  new_statement->subject = subject;
+  new_statement->predicate = predicate;
+  new_statement->object = object;
+  new_statement->graph = graph;
 
-  return raptor_new_statement_from_nodes(statement->world, subject, predicate, object, graph);
+  return new_statement;
 
  err:
   if(graph)
@@ -116,6 +318,7 @@ librdf_new_statement_from_statement(librdf_statement* statement)
     raptor_free_term(predicate);
   if(subject)
     raptor_free_term(subject);
+  librdf_usage_unlock();
   return NULL;
 }
 
@@ -132,12 +335,17 @@ librdf_new_statement_from_statement(librdf_statement* statement)
 librdf_statement*
 librdf_new_statement_from_statement2(librdf_statement* statement)
 {
+  librdf_statement* copy;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
 
   if(!statement)
     return NULL;
   
-  return raptor_statement_copy(statement);
+  librdf_usage_lock();
+  copy = raptor_statement_copy(statement);
+  librdf_usage_unlock();
+  return copy;
 }
 
 
@@ -160,10 +368,26 @@ librdf_new_statement_from_nodes(librdf_world *world,
                                 librdf_node* predicate,
                                 librdf_node* object)
 {
+  librdf_statement* statement;
+
   librdf_world_open(world);
 
-  return raptor_new_statement_from_nodes(world->raptor_world_ptr,
-                                         subject, predicate, object, NULL);
+  statement = librdf_statement_alloc(world->raptor_world_ptr);
+  if(!statement) {
+    if(subject)
+      librdf_free_node(subject);
+    if(predicate)
+      librdf_free_node(predicate);
+    if(object)
+      librdf_free_node(object);
+    return NULL;
+  }
+
+  statement->subject = subject;
+  statement->predicate = predicate;
+  statement->object = object;
+
+  return statement;
 }
 
 
@@ -202,7 +426,9 @@ librdf_statement_clear(librdf_statement *statement)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(statement, librdf_statement);
 
+  librdf_usage_lock();
   raptor_statement_clear(statement);
+  librdf_usage_unlock();
 }
 
 
@@ -219,7 +445,22 @@ librdf_free_statement(librdf_statement* statement)
   if(!statement)
     return;
   
+  librdf_usage_lock();
+
+  /* keep the last reference for reuse */
+  if(statement->usage == 1 && librdf_statement_cache_size > 0) {
+    librdf_statement_cache* cache = librdf_statement_get_cache(1);
+
+    if(cache && cache->count < librdf_statement_cache_size) {
+      raptor_statement_clear(statement);
+      librdf_usage_unlock();
+      cache->statements[cache->count++] = statement;
+      return;
+    }
+  }
+
   raptor_free_statement(statement);
+  librdf_usage_unlock();
 }
 
 
@@ -891,6 +1132,137 @@ librdf_statement_decode2(librdf_world* world,
   return total_length;
 }
 
+
+/**
+ * librdf_statement_get_memory_size:
+ * @statement: the statement
+ *
+ * INTERNAL - Get the approximate bytes held by a statement and its nodes
+ *
+ * Nodes shared with other statements are counted again, see
+ * librdf_node_get_memory_size().
+ *
+ * Return value: size in bytes
+ **/
+size_t
+librdf_statement_get_memory_size(librdf_statement* statement)
+{
+  size_t size = sizeof(*statement);
+
+  if(statement->subject)
+    size += librdf_node_get_memory_size(statement->subject);
+  if(statement->predicate)
+    size += librdf_node_get_memory_size(statement->predicate);
+  if(statement->object)
+    size += librdf_node_get_memory_size(statement->object);
+  if(statement->graph)
+    size += librdf_node_get_memory_size(statement->graph);
+
+  return size;
+}
+
+
+/**
+ * librdf_statement_decode_view:
+ * @view: statement view to add the parts read to
+ * @buffer: the buffer to use
+ * @length: buffer size
+ *
+ * INTERNAL - Read a statement encoding without making nodes
+ *
+ * Like librdf_statement_decode2() but the parts of @view point into
+ * @buffer as librdf_node_decode_view() does.  Parts already in @view
+ * are kept so a hash key and value can be read into one view, which
+ * the caller clears first.
+ *
+ * Return value: number of bytes used or 0 on failure
+ **/
+size_t
+librdf_statement_decode_view(librdf_statement_view* view,
+                             const unsigned char *buffer, size_t length)
+{
+  const unsigned char *p = buffer;
+
+  if(length < 1 || *p++ != 'x')
+    return 0;
+  length--;
+
+  while(length > 0) {
+    librdf_node_view* node_view;
+    size_t node_len;
+    unsigned char type = *p++;
+
+    length--;
+    switch(type) {
+      case 's':
+        node_view = &view->subject;
+        view->parts |= LIBRDF_STATEMENT_SUBJECT;
+        break;
+
+      case 'p':
+        node_view = &view->predicate;
+        view->parts |= LIBRDF_STATEMENT_PREDICATE;
+        break;
+
+      case 'o':
+        node_view = &view->object;
+        view->parts |= LIBRDF_STATEMENT_OBJECT;
+        break;
+
+      case 'c':
+        node_view = &view->context;
+        view->has_context = 1;
+        break;
+
+      default:
+        return 0;
+    }
+
+    node_len = librdf_node_decode_view(node_view, p, length);
+    if(!node_len)
+      return 0;
+    p += node_len;
+    length -= node_len;
+  }
+
+  return LIBRDF_GOOD_CAST(size_t, p - buffer);
+}
+
+
+/**
+ * librdf_statement_view_match:
+ * @view: statement view
+ * @partial_statement: statement with possible empty parts
+ *
+ * INTERNAL - Match a statement view against a partial statement
+ *
+ * As librdf_statement_match() but for a view; a part given in
+ * @partial_statement that is not in @view does not match.
+ *
+ * Return value: non 0 on match
+ **/
+int
+librdf_statement_view_match(const librdf_statement_view* view,
+                            librdf_statement* partial_statement)
+{
+  if(partial_statement->subject &&
+     (!(view->parts & LIBRDF_STATEMENT_SUBJECT) ||
+      !librdf_node_view_equals(&view->subject, partial_statement->subject)))
+    return 0;
+
+  if(partial_statement->predicate &&
+     (!(view->parts & LIBRDF_STATEMENT_PREDICATE) ||
+      !librdf_node_view_equals(&view->predicate, partial_statement->predicate)))
+    return 0;
+
+  if(partial_statement->object &&
+     (!(view->parts & LIBRDF_STATEMENT_OBJECT) ||
+      !librdf_node_view_equals(&view->object, partial_statement->object)))
+    return 0;
+
+  return 1;
+}
+
 #endif
 
 
@@ -912,6 +1284,7 @@ main(int argc, char *argv[])
   char *s, *buffer;
   librdf_world *world;
   raptor_iostream *iostr;
+  unsigned long reused, allocated, reused2, allocated2;
 
   world=librdf_new_world();
   librdf_world_open(world);
@@ -966,6 +1339,45 @@ main(int argc, char *argv[])
   librdf_free_statement(statement2);
   librdf_free_statement(statement);
 
+
+  fprintf(stdout, "%s: Checking freed statements are reused\n", program);
+  librdf_statement_cache_clear();
+  librdf_statement_cache_get_counts(&reused, &allocated);
+
+  statement=librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/subject"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/predicate"),
+    librdf_new_node_from_literal(world, (const unsigned char*)"object", NULL, 0));
+  librdf_free_statement(statement);
+  statement2=librdf_new_statement(world);
+  librdf_statement_cache_get_counts(&reused2, &allocated2);
+  if(statement2 != statement || reused2 != reused + 1 ||
+     allocated2 != allocated + 1) {
+    fprintf(stderr, "%s: Freed statement was not reused, %lu reused and %lu allocated, expected %lu and %lu\n",
+            program, reused2, allocated2, reused + 1, allocated + 1);
+    return(1);
+  }
+  if(librdf_statement_get_subject(statement2) ||
+     librdf_statement_get_predicate(statement2) ||
+     librdf_statement_get_object(statement2)) {
+    fprintf(stderr, "%s: Reused statement is not empty\n", program);
+    return(1);
+  }
+
+  /* with no free list, freed statements are not kept */
+  size=librdf_statement_cache_get_size();
+  librdf_statement_cache_set_size(0);
+  librdf_free_statement(statement2);
+  statement2=librdf_new_statement(world);
+  librdf_statement_cache_get_counts(&reused, &allocated);
+  librdf_free_statement(statement2);
+  librdf_statement_cache_set_size(size);
+  if(reused != reused2) {
+    fprintf(stderr, "%s: Statement was reused with the free list disabled\n",
+            program);
+    return(1);
+  }
+
   raptor_free_iostream(iostr);
 
   librdf_free_world(world);
@@ -67,6 +67,7 @@ librdf_init_statement(librdf_world *world)
 void
 librdf_finish_statement(librdf_world *world) 
 {
+  librdf_statement_cache_clear();
 }
 
 
@@ -36,6 +36,26 @@ extern "C" {
 void librdf_init_statement(librdf_world *world);
 void librdf_finish_statement(librdf_world *world);
 
+void librdf_statement_cache_set_size(int size);
+int librdf_statement_cache_get_size(void);
+void librdf_statement_cache_get_counts(unsigned long* reused_p, unsigned long* allocated_p);
+void librdf_statement_cache_clear(void);
+
+/* A statement encoding read in place, see librdf_statement_decode_view() */
+typedef struct {
+  librdf_node_view subject;
+  librdf_node_view predicate;
+  librdf_node_view object;
+  librdf_node_view context;
+  int parts; /* OR of the LIBRDF_STATEMENT_* parts read */
+  int has_context;
+} librdf_statement_view;
+
+size_t librdf_statement_decode_view(librdf_statement_view* view, const unsigned char *buffer, size_t length);
+int librdf_statement_view_match(const librdf_statement_view* view, librdf_statement* partial_statement);
+
+size_t librdf_statement_get_memory_size(librdf_statement* statement);
+
 #ifdef __cplusplus
 }
 #endif
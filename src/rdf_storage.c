@@ -49,6 +49,9 @@
 
 #ifndef STANDALONE
 
+/* changes after which the size is measured again for the memory limit */
+#define LIBRDF_STORAGE_MEMORY_MEASURE_INTERVAL 256
+
 /* prototypes for functions implementing get_sources, arcs, targets
  * librdf_iterator via conversion from a librdf_stream of librdf_statement
  */
@@ -57,8 +60,6 @@ static int librdf_storage_stream_to_node_iterator_next_method(void* iterator);
 static void* librdf_storage_stream_to_node_iterator_get_method(void* iterator, int flags);
 static void librdf_storage_stream_to_node_iterator_finished(void* iterator);
 
-/* helper function for creating iterators for get sources, targets, arcs */
-static librdf_iterator* librdf_storage_node_stream_to_node_create(librdf_storage* storage, librdf_node* node1, librdf_node *node2, librdf_statement_part want);
 
 /* helper functions for dynamically loading storage modules */
 #ifdef MODULAR_LIBRDF
@@ -69,6 +70,9 @@ static lt_dlhandle
 librdf_storage_load_module(librdf_world *world,
                            const char* lib_name,
                            const char* init_func_name);
+
+static void
+librdf_storage_load_named_module(librdf_world *world, const char* name);
 #endif
 
 
@@ -78,9 +82,13 @@ librdf_storage_load_module(librdf_world *world,
  *
  * INTERNAL - Initialise the storage module.
  * 
- * Initialises and registers all
- * compiled storage modules.  Must be called before using any of the storage
- * factory functions such as librdf_get_storage_factory()
+ * Initialises and registers all compiled storage modules.  Run once
+ * by the storage factory functions such as librdf_get_storage_factory()
+ * the first time one is called.
+ *
+ * Storage modules built as loadable modules are not loaded here but by
+ * librdf_get_storage_factory() when a storage of that name is first
+ * asked for, or all at once by librdf_storage_enumerate().
  **/
 void
 librdf_init_storage(librdf_world *world)
@@ -99,6 +107,12 @@ librdf_init_storage(librdf_world *world)
   #ifdef STORAGE_FILE
     librdf_init_storage_file(world);
   #endif
+  #ifdef STORAGE_CACHE
+    librdf_init_storage_cache(world);
+  #endif
+  #ifdef STORAGE_SHARDED
+    librdf_init_storage_sharded(world);
+  #endif
 
 #ifdef MODULAR_LIBRDF
 
@@ -106,8 +120,6 @@ librdf_init_storage(librdf_world *world)
     world->storage_modules = raptor_new_sequence(
         (raptor_data_free_handler)lt_dlclose, NULL);
 
-  librdf_storage_load_all_modules(world);
-
 #else /* monolithic */
   
   #ifdef STORAGE_MYSQL
@@ -144,12 +156,14 @@ librdf_finish_storage(librdf_world *world)
     raptor_free_sequence(world->storages);
     world->storages=NULL;
   }
+  world->storages_loaded=0;
 
 #ifdef MODULAR_LIBRDF
   if(world->storage_modules) {
     raptor_free_sequence(world->storage_modules);
     world->storage_modules=NULL;
   }
+  world->storage_modules_loaded=0;
 #endif
   
 }
@@ -262,6 +276,81 @@ librdf_storage_load_all_modules(librdf_world *world)
 }
 
 
+/* the storage name looked for by ltdl_named_module_callback */
+typedef struct {
+  librdf_world* world;
+  const char* name;
+  int loaded;
+} librdf_storage_named_module;
+
+
+static int
+ltdl_named_module_callback(const char* filename, void* data)
+{
+  librdf_storage_named_module* nm = (librdf_storage_named_module*)data;
+  const char* name = librdf_basename(filename);
+  size_t name_len = strlen(nm->name);
+  lt_dlhandle module;
+
+  /* librdf_storage_NAME optionally followed by a suffix such as .so */
+  if(strncmp(name, "librdf_storage_", 15) ||
+     strncmp(name + 15, nm->name, name_len) ||
+     (name[15 + name_len] && name[15 + name_len] != '.'))
+    return 0;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG3("LOADING storage module file %s (%s)\n", name, filename);
+#endif
+
+  module = librdf_storage_load_module(nm->world, filename,
+                                      "librdf_storage_module_register_factory");
+  if(!module)
+    return 0;
+
+  raptor_sequence_push(nm->world->storage_modules, module);
+  nm->loaded = 1;
+  return 1;
+}
+
+
+/**
+ * librdf_storage_load_named_module:
+ * @world: redland world object
+ * @name: storage factory name
+ *
+ * INTERNAL - Load and register the storage module for one storage name
+ *
+ * Looks for a module file librdf_storage_NAME in the same places as
+ * librdf_storage_load_all_modules() so that only the backend libraries
+ * a program uses are loaded.  Called with the world mutex held.
+ **/
+static void
+librdf_storage_load_named_module(librdf_world *world, const char* name)
+{
+  librdf_storage_named_module nm;
+  char const *path;
+
+  if(!world->ltdl_opened || !world->storage_modules ||
+     world->storage_modules_loaded)
+    return;
+
+  nm.world = world;
+  nm.name = name;
+  nm.loaded = 0;
+
+  path = getenv("REDLAND_MODULE_PATH");
+  if (path && !*path)
+    path = NULL;
+  else if (!path)
+    path = lt_dlgetsearchpath();
+
+  lt_dlforeachfile(path, ltdl_named_module_callback, &nm);
+
+  if(!nm.loaded)
+    LIBRDF_DEBUG2("No storage module for %s found\n", name);
+}
+
+
 /**
  * librdf_storage_load_module:
  * @world: redland world object
@@ -417,6 +506,24 @@ librdf_storage_register_factory(librdf_world* world,
 }
 
 
+/* Find a registered storage factory; called with the world mutex held */
+static librdf_storage_factory*
+librdf_storage_find_factory(librdf_world* world, const char *name)
+{
+  librdf_storage_factory *factory;
+  int i;
+
+  for(i=0;
+      (factory=(librdf_storage_factory*)raptor_sequence_get_at(world->storages, i));
+      i++) {
+    if(!strcmp(factory->name, name))
+      break;
+  }
+
+  return factory;
+}
+
+
 /**
  * librdf_get_storage_factory:
  * @world: redland world object
@@ -429,23 +536,31 @@ librdf_storage_register_factory(librdf_world* world,
 librdf_storage_factory*
 librdf_get_storage_factory(librdf_world* world, const char *name) 
 {
-  int i;
-
   librdf_storage_factory *factory;
 
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->storages_loaded, librdf_init_storage);
 
   /* use "memory" if nothing is specified (FIXME: probably not the best choice) */
   if (!name)
     name = "memory";
 
-  /* search for factory */
-  for(i=0;
-      (factory=(librdf_storage_factory*)raptor_sequence_get_at(world->storages, i));
-      i++) {
-    if(!strcmp(factory->name, name))
-      break;
+  /* modules loaded by other threads add to the factories */
+#ifdef WITH_THREADS
+  pthread_mutex_lock(world->mutex);
+#endif
+  factory=librdf_storage_find_factory(world, name);
+
+#ifdef MODULAR_LIBRDF
+  /* not built in or loaded yet: try the module of that name */
+  if(!factory) {
+    librdf_storage_load_named_module(world, name);
+    factory=librdf_storage_find_factory(world, name);
   }
+#endif
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(world->mutex);
+#endif
 
   if(!factory) {
     LIBRDF_DEBUG2("No storage with name %s found\n", name);
@@ -476,6 +591,13 @@ librdf_storage_enumerate(librdf_world* world,
   int ioffset = LIBRDF_GOOD_CAST(int, counter);
   
   librdf_world_open(world);
+  librdf_world_load_once(world, &world->storages_loaded, librdf_init_storage);
+#ifdef MODULAR_LIBRDF
+  /* listing needs every installed module */
+  if(world->ltdl_opened)
+    librdf_world_load_once(world, &world->storage_modules_loaded,
+                           librdf_storage_load_all_modules);
+#endif
 
   factory = (librdf_storage_factory*)raptor_sequence_get_at(world->storages,
                                                             ioffset);
@@ -675,7 +797,7 @@ librdf_new_storage_from_factory(librdf_world *world,
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(factory, librdf_storage_factory, NULL);
 
-  if(!factory) {
+  if(!factory || librdf_query_async_check_world(world)) {
     librdf_free_hash(options);
     return NULL;
   }
@@ -694,6 +816,39 @@ librdf_new_storage_from_factory(librdf_world *world,
   storage->instance=NULL;
   storage->factory=factory;
 
+  if(name) {
+    size_t name_len=strlen(name);
+    storage->name=LIBRDF_MALLOC(char*, name_len + 1);
+    if(storage->name)
+      memcpy(storage->name, name, name_len + 1);
+  }
+  if(options) {
+    /* the 'new' option must not be repeated when opening again */
+    const char* filter[2]={ "new", NULL };
+    storage->options_string=librdf_hash_to_string(options, filter);
+  }
+
+  /* read before init, which owns the options */
+  if(options && librdf_hash_get_as_boolean(options, "instrument") > 0 &&
+     librdf_storage_stats_set_enabled(storage, 1)) {
+    librdf_free_storage(storage);
+    librdf_free_hash(options);
+    return NULL;
+  }
+
+  if(options && librdf_hash_get_as_boolean(options, "bloom-filter") > 0 &&
+     librdf_storage_bloom_set_enabled(storage, 1)) {
+    librdf_free_storage(storage);
+    librdf_free_hash(options);
+    return NULL;
+  }
+
+  if(options) {
+    long limit=librdf_hash_get_as_long(options, "memory-limit");
+    if(limit > 0)
+      storage->memory_limit=(size_t)limit;
+  }
+
   if(factory->init(storage, name, options)) {
     librdf_free_storage(storage);
     return NULL;
@@ -712,15 +867,31 @@ librdf_new_storage_from_factory(librdf_world *world,
 void
 librdf_free_storage(librdf_storage* storage) 
 {
+  int usage;
+
   if(!storage)
     return;
   
-  if(--storage->usage)
+  librdf_usage_lock();
+  usage = --storage->usage;
+  librdf_usage_unlock();
+  if(usage)
     return;
 
   if(storage->factory)
     storage->factory->terminate(storage);
 
+  if(storage->name)
+    LIBRDF_FREE(char*, storage->name);
+  if(storage->options_string)
+    librdf_free_memory(storage->options_string);
+  if(storage->stats)
+    librdf_free_storage_stats(storage->stats);
+  if(storage->bloom)
+    librdf_free_storage_bloom(storage->bloom);
+  if(storage->changes)
+    librdf_free_storage_changes(storage->changes);
+
   LIBRDF_FREE(librdf_storage, storage);
 }
 
@@ -736,7 +907,9 @@ librdf_free_storage(librdf_storage* storage)
 void
 librdf_storage_add_reference(librdf_storage *storage)
 {
+  librdf_usage_lock();
   storage->usage++;
+  librdf_usage_unlock();
 }
 
 
@@ -858,9 +1031,68 @@ librdf_storage_close(librdf_storage* storage)
 int
 librdf_storage_size(librdf_storage* storage) 
 {
+  u64 start;
+  int size;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, -1);
 
-  return storage->factory->size(storage);
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_SIZE);
+  size=storage->factory->size(storage);
+  librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_SIZE, start, size < 0);
+
+  return size;
+}
+
+
+/**
+ * librdf_storage_get_memory_size:
+ * @storage: #librdf_storage object
+ *
+ * INTERNAL - Get the approximate bytes of process memory held by a storage
+ *
+ * Return value: size in bytes, 0 for stores not kept in memory
+ **/
+size_t
+librdf_storage_get_memory_size(librdf_storage* storage)
+{
+  if(!storage->factory->get_memory_size)
+    return 0;
+  return storage->factory->get_memory_size(storage);
+}
+
+
+/*
+ * librdf_storage_memory_full:
+ * @storage: #librdf_storage object
+ *
+ * INTERNAL - Check the memory limit before adding statements
+ *
+ * Measuring walks some of the storage structures so it is only done
+ * again after LIBRDF_STORAGE_MEMORY_MEASURE_INTERVAL changes, or on
+ * every call once over the limit so removals are noticed.
+ *
+ * Return value: non 0 if the storage is at its memory limit
+ */
+static int
+librdf_storage_memory_full(librdf_storage* storage)
+{
+  if(!storage->memory_limit)
+    return 0;
+
+  if(storage->memory_size < storage->memory_limit &&
+     storage->modifications - storage->memory_measured < LIBRDF_STORAGE_MEMORY_MEASURE_INTERVAL)
+    return 0;
+
+  storage->memory_size=librdf_storage_get_memory_size(storage);
+  storage->memory_measured=storage->modifications;
+  if(storage->memory_size < storage->memory_limit)
+    return 0;
+
+  librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+             "Storage memory size %lu bytes is at the memory limit of %lu bytes",
+             (unsigned long)storage->memory_size,
+             (unsigned long)storage->memory_limit);
+  return 1;
 }
 
 
@@ -880,12 +1112,18 @@ librdf_storage_size(librdf_storage* storage)
  * Enforces that the statement is legal for RDF - URI or blank subject,
  * URI predicate and URI or blank or literal object (i.e. anything).
  *
+ * Fails with an error if the storage is at its
+ * #LIBRDF_STORAGE_FEATURE_MEMORY_LIMIT.
+ *
  * Return value: non 0 on failure, <0 on error, >0 if statement was illegal
  **/
 int
 librdf_storage_add_statement(librdf_storage* storage,
                              librdf_statement* statement) 
 {
+  u64 start;
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
@@ -900,8 +1138,23 @@ librdf_storage_add_statement(librdf_storage* storage,
 
   /* object can be any node - no check needed */
 
-  if(storage->factory->add_statement)
-    return storage->factory->add_statement(storage, statement);
+  if(storage->factory->add_statement) {
+    if(librdf_storage_memory_full(storage))
+      return -1;
+
+    storage->modifications++;
+    librdf_storage_bloom_add(storage, statement);
+    librdf_storage_changes_start(storage);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_ADD_STATEMENT);
+    status=storage->factory->add_statement(storage, statement);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_ADD_STATEMENT, start,
+                             status);
+    if(!status)
+      librdf_storage_changes_record(storage, LIBRDF_MODEL_CHANGE_ADD,
+                                    statement, NULL);
+    librdf_storage_changes_end(storage);
+    return status;
+  }
 
   return -1;
 }
@@ -928,9 +1181,30 @@ librdf_storage_add_statements(librdf_storage* storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement_stream, librdf_stream, 1);
 
-  if(storage->factory->add_statements)
-    return storage->factory->add_statements(storage, statement_stream);
+  if(storage->factory->add_statements) {
+    u64 start;
+
+    if(librdf_storage_memory_full(storage))
+      return 1;
+
+    storage->modifications++;
+    if(librdf_storage_bloom_add_stream(storage, statement_stream) ||
+       librdf_storage_changes_add_stream(storage, statement_stream, NULL))
+      return 1;
+    librdf_storage_changes_start(storage);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_ADD_STATEMENTS);
+    status=storage->factory->add_statements(storage, statement_stream);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_ADD_STATEMENTS, start,
+                             status);
+    /* statements are queued as they are read, not as they are added */
+    if(status)
+      librdf_storage_changes_lost(storage);
+    librdf_storage_changes_end(storage);
+    return status;
+  }
 
+  /* the changes of each add are delivered together */
+  librdf_storage_changes_start(storage);
   while(!librdf_stream_end(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
 
@@ -948,6 +1222,7 @@ librdf_storage_add_statements(librdf_storage* storage,
 
     librdf_stream_next(statement_stream);
   }
+  librdf_storage_changes_end(storage);
   
   return status;
 }
@@ -969,8 +1244,22 @@ librdf_storage_remove_statement(librdf_storage* storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
-  if(storage->factory->remove_statement)
-    return storage->factory->remove_statement(storage, statement);
+  if(storage->factory->remove_statement) {
+    u64 start;
+    int status;
+
+    storage->modifications++;
+    librdf_storage_changes_start(storage);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_REMOVE_STATEMENT);
+    status=storage->factory->remove_statement(storage, statement);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_REMOVE_STATEMENT,
+                             start, status);
+    if(!status)
+      librdf_storage_changes_record(storage, LIBRDF_MODEL_CHANGE_REMOVE,
+                                    statement, NULL);
+    librdf_storage_changes_end(storage);
+    return status;
+  }
   return 1;
 }
 
@@ -988,13 +1277,72 @@ int
 librdf_storage_contains_statement(librdf_storage* storage,
                                   librdf_statement* statement) 
 {
+  u64 start;
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
   if(!librdf_statement_is_complete(statement))
     return 1;
 
-  return storage->factory->contains_statement(storage, statement) ? -1 : 0;
+  /* a definite miss needs no storage lookup */
+  if(!librdf_storage_bloom_check(storage, statement))
+    return 0;
+
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_CONTAINS_STATEMENT);
+  status=storage->factory->contains_statement(storage, statement);
+  librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_CONTAINS_STATEMENT,
+                           start, 0);
+
+  return status ? -1 : 0;
+}
+
+
+/**
+ * librdf_storage_count_statements:
+ * @storage: #librdf_storage object
+ * @statement: #librdf_statement partial statement to match
+ *
+ * Count the statements in the storage matching a partial statement.
+ *
+ * Statements match as for librdf_storage_find_statements().  Storages
+ * that can count matches without walking them do so, otherwise the
+ * matching statements are streamed and counted.
+ *
+ * Return value: number of matching statements or <0 on failure
+ **/
+int
+librdf_storage_count_statements(librdf_storage* storage,
+                                librdf_statement* statement)
+{
+  librdf_stream* stream;
+  int count=0;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, -1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, -1);
+
+  if(storage->factory->count_statements) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_COUNT_STATEMENTS);
+    count=storage->factory->count_statements(storage, statement);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_COUNT_STATEMENTS,
+                             start, count < 0);
+    return count;
+  }
+
+  stream=librdf_storage_find_statements(storage, statement);
+  if(!stream)
+    return -1;
+
+  while(!librdf_stream_end(stream)) {
+    count++;
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+
+  return count;
 }
 
 
@@ -1009,7 +1357,12 @@ librdf_storage_contains_statement(librdf_storage* storage,
 librdf_stream*
 librdf_storage_serialise(librdf_storage* storage) 
 {
-  return storage->factory->serialise(storage);
+  u64 start;
+
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_SERIALISE);
+  return librdf_storage_stats_stream(storage, LIBRDF_STORAGE_OP_SERIALISE,
+                                     start,
+                                     storage->factory->serialise(storage));
 }
 
 
@@ -1032,6 +1385,7 @@ librdf_storage_find_statements(librdf_storage* storage,
 {
   librdf_node *subject, *predicate, *object;
   librdf_iterator *iterator;
+  u64 start;
   
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
@@ -1044,7 +1398,10 @@ librdf_storage_find_statements(librdf_storage* storage,
 
   /* only subject/source field blank -> use find_sources */
   if(storage->factory->find_sources && !subject && predicate && object) {
-    iterator=storage->factory->find_sources(storage, predicate, object);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_SOURCES);
+    iterator=librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_FIND_SOURCES,
+                                           start,
+                                           storage->factory->find_sources(storage, predicate, object));
     if(iterator)
       return librdf_new_stream_from_node_iterator(iterator, statement,
                                                   LIBRDF_STATEMENT_SUBJECT);
@@ -1053,7 +1410,10 @@ librdf_storage_find_statements(librdf_storage* storage,
   
   /* only predicate/arc field blank -> use find_arcs */
   if(storage->factory->find_arcs && subject && !predicate && object) {
-    iterator=storage->factory->find_arcs(storage, subject, object);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_ARCS);
+    iterator=librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_FIND_ARCS,
+                                           start,
+                                           storage->factory->find_arcs(storage, subject, object));
     if(iterator)
       return librdf_new_stream_from_node_iterator(iterator, statement,
                                                   LIBRDF_STATEMENT_PREDICATE);
@@ -1062,14 +1422,20 @@ librdf_storage_find_statements(librdf_storage* storage,
   
   /* only object/target field blank -> use find_targets */
   if(storage->factory->find_targets && subject && predicate && !object) {
-    iterator=storage->factory->find_targets(storage, subject, predicate);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_TARGETS);
+    iterator=librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_FIND_TARGETS,
+                                           start,
+                                           storage->factory->find_targets(storage, subject, predicate));
     if(iterator)
       return librdf_new_stream_from_node_iterator(iterator, statement,
                                                   LIBRDF_STATEMENT_OBJECT);
     return NULL;
   }
   
-  return storage->factory->find_statements(storage, statement);
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_STATEMENTS);
+  return librdf_storage_stats_stream(storage, LIBRDF_STORAGE_OP_FIND_STATEMENTS,
+                                     start,
+                                     storage->factory->find_statements(storage, statement));
 }
 
 
@@ -1206,7 +1572,7 @@ librdf_storage_stream_to_node_iterator_finished(void* iterator)
  * 
  * Return value: a new #librdf_iterator or NULL on failure
  **/
-static librdf_iterator*
+librdf_iterator*
 librdf_storage_node_stream_to_node_create(librdf_storage* storage,
                                           librdf_node *node1,
                                           librdf_node *node2,
@@ -1309,8 +1675,13 @@ librdf_storage_get_sources(librdf_storage *storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(arc, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(target, librdf_node, NULL);
 
-  if (storage->factory->find_sources)
-    return storage->factory->find_sources(storage, arc, target);
+  if (storage->factory->find_sources) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_SOURCES);
+    return librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_FIND_SOURCES, start,
+                                         storage->factory->find_sources(storage, arc, target));
+  }
 
   return librdf_storage_node_stream_to_node_create(storage, arc, target,
                                                    LIBRDF_STATEMENT_SUBJECT);
@@ -1338,8 +1709,13 @@ librdf_storage_get_arcs(librdf_storage *storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(source, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(target, librdf_node, NULL);
 
-  if (storage->factory->find_arcs)
-    return storage->factory->find_arcs(storage, source, target);
+  if (storage->factory->find_arcs) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_ARCS);
+    return librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_FIND_ARCS, start,
+                                         storage->factory->find_arcs(storage, source, target));
+  }
 
   return librdf_storage_node_stream_to_node_create(storage, source, target,
                                                    LIBRDF_STATEMENT_PREDICATE);
@@ -1367,8 +1743,13 @@ librdf_storage_get_targets(librdf_storage *storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(source, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(arc, librdf_node, NULL);
 
-  if (storage->factory->find_targets)
-    return storage->factory->find_targets(storage, source, arc);
+  if (storage->factory->find_targets) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_TARGETS);
+    return librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_FIND_TARGETS, start,
+                                         storage->factory->find_targets(storage, source, arc));
+  }
 
   return librdf_storage_node_stream_to_node_create(storage, source, arc,
                                                    LIBRDF_STATEMENT_OBJECT);
@@ -1390,8 +1771,13 @@ librdf_storage_get_arcs_in(librdf_storage *storage, librdf_node *node)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
-  if (storage->factory->get_arcs_in)
-    return storage->factory->get_arcs_in(storage, node);
+  if (storage->factory->get_arcs_in) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_GET_ARCS_IN);
+    return librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_GET_ARCS_IN, start,
+                                         storage->factory->get_arcs_in(storage, node));
+  }
 
   return librdf_storage_node_stream_to_node_create(storage, NULL, node,
                                                    LIBRDF_STATEMENT_PREDICATE);
@@ -1410,8 +1796,13 @@ librdf_storage_get_arcs_in(librdf_storage *storage, librdf_node *node)
 librdf_iterator*
 librdf_storage_get_arcs_out(librdf_storage *storage, librdf_node *node) 
 {
-  if (storage->factory->get_arcs_out)
-    return storage->factory->get_arcs_out(storage, node);
+  if (storage->factory->get_arcs_out) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_GET_ARCS_OUT);
+    return librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_GET_ARCS_OUT, start,
+                                         storage->factory->get_arcs_out(storage, node));
+  }
   return librdf_storage_node_stream_to_node_create(storage, node, NULL,
                                                    LIBRDF_STATEMENT_PREDICATE);
 }
@@ -1438,8 +1829,14 @@ librdf_storage_has_arc_in(librdf_storage *storage, librdf_node *node,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(property, librdf_node, 0);
 
-  if (storage->factory->has_arc_in)
-    return storage->factory->has_arc_in(storage, node, property);
+  if (storage->factory->has_arc_in) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_HAS_ARC_IN);
+    status=storage->factory->has_arc_in(storage, node, property);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_HAS_ARC_IN, start, 0);
+    return status;
+  }
   
   iterator=librdf_storage_get_sources(storage, property, node);
   if(!iterator)
@@ -1474,8 +1871,14 @@ librdf_storage_has_arc_out(librdf_storage *storage, librdf_node *node,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(property, librdf_node, 0);
 
-  if (storage->factory->has_arc_out)
-    return storage->factory->has_arc_out(storage, node, property);
+  if (storage->factory->has_arc_out) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_HAS_ARC_OUT);
+    status=storage->factory->has_arc_out(storage, node, property);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_HAS_ARC_OUT, start, 0);
+    return status;
+  }
   
   iterator=librdf_storage_get_targets(storage, node, property);
   if(!iterator)
@@ -1513,8 +1916,26 @@ librdf_storage_context_add_statement(librdf_storage* storage,
   if(!context)
     return librdf_storage_add_statement(storage, statement);
 
-  if(storage->factory->context_add_statement)
-    return storage->factory->context_add_statement(storage, context, statement);
+  if(storage->factory->context_add_statement) {
+    u64 start;
+    int status;
+
+    if(librdf_storage_memory_full(storage))
+      return 1;
+
+    storage->modifications++;
+    librdf_storage_bloom_add(storage, statement);
+    librdf_storage_changes_start(storage);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_CONTEXT_ADD_STATEMENT);
+    status=storage->factory->context_add_statement(storage, context, statement);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_CONTEXT_ADD_STATEMENT,
+                             start, status);
+    if(!status)
+      librdf_storage_changes_record(storage, LIBRDF_MODEL_CHANGE_ADD,
+                                    statement, context);
+    librdf_storage_changes_end(storage);
+    return status;
+  }
   return 1;
 }
 
@@ -1544,8 +1965,26 @@ librdf_storage_context_add_statements(librdf_storage* storage,
   if(!context)
     return librdf_storage_add_statements(storage, stream);
 
-  if(storage->factory->context_add_statements)
-    return storage->factory->context_add_statements(storage, context, stream);
+  if(storage->factory->context_add_statements) {
+    u64 start;
+
+    if(librdf_storage_memory_full(storage))
+      return 1;
+
+    storage->modifications++;
+    if(librdf_storage_bloom_add_stream(storage, stream) ||
+       librdf_storage_changes_add_stream(storage, stream, context))
+      return 1;
+    librdf_storage_changes_start(storage);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_CONTEXT_ADD_STATEMENTS);
+    status=storage->factory->context_add_statements(storage, context, stream);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_CONTEXT_ADD_STATEMENTS,
+                             start, status);
+    if(status)
+      librdf_storage_changes_lost(storage);
+    librdf_storage_changes_end(storage);
+    return status;
+  }
 
   if(!storage->factory->context_add_statement)
     return 1;
@@ -1553,6 +1992,7 @@ librdf_storage_context_add_statements(librdf_storage* storage,
   if(!stream)
     return 1;
 
+  librdf_storage_changes_start(storage);
   while(!librdf_stream_end(stream)) {
     librdf_statement* statement=librdf_stream_get_object(stream);
     if(!statement)
@@ -1562,6 +2002,7 @@ librdf_storage_context_add_statements(librdf_storage* storage,
       break;
     librdf_stream_next(stream);
   }
+  librdf_storage_changes_end(storage);
 
   return status;
 }
@@ -1585,13 +2026,59 @@ librdf_storage_context_remove_statement(librdf_storage* storage,
                                         librdf_node* context,
                                         librdf_statement* statement) 
 {
+  u64 start;
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
   if(!storage->factory->context_remove_statement)
     return 1;
   
-  return storage->factory->context_remove_statement(storage, context, statement);
+  storage->modifications++;
+  librdf_storage_changes_start(storage);
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_CONTEXT_REMOVE_STATEMENT);
+  status=storage->factory->context_remove_statement(storage, context, statement);
+  librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_CONTEXT_REMOVE_STATEMENT,
+                           start, status);
+  if(!status)
+    librdf_storage_changes_record(storage, LIBRDF_MODEL_CHANGE_REMOVE,
+                                  statement, context);
+  librdf_storage_changes_end(storage);
+  return status;
+}
+
+
+/*
+ * librdf_storage_context_remove_statements_changes:
+ * @storage: #librdf_storage object
+ * @context: #librdf_node context
+ *
+ * INTERNAL - Queue the statements of a context as removals before it
+ * is emptied
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_context_remove_statements_changes(librdf_storage* storage,
+                                                 librdf_node* context)
+{
+  librdf_stream *stream;
+
+  stream=librdf_storage_context_as_stream(storage, context);
+  if(!stream)
+    return 1;
+
+  while(!librdf_stream_end(stream)) {
+    librdf_statement *statement=librdf_stream_get_object(stream);
+    if(!statement)
+      break;
+    librdf_storage_changes_record(storage, LIBRDF_MODEL_CHANGE_REMOVE,
+                                  statement, context);
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+  return 0;
 }
 
 
@@ -1612,8 +2099,25 @@ librdf_storage_context_remove_statements(librdf_storage* storage,
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
 
-  if(storage->factory->context_remove_statements)
-    return storage->factory->context_remove_statements(storage, context);
+  if(storage->factory->context_remove_statements) {
+    u64 start;
+    int status;
+
+    storage->modifications++;
+    librdf_storage_changes_start(storage);
+    /* the factory removes them all at once so they are read first */
+    if(librdf_storage_changes_active(storage) &&
+       librdf_storage_context_remove_statements_changes(storage, context))
+      librdf_storage_changes_lost(storage);
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_CONTEXT_REMOVE_STATEMENTS);
+    status=storage->factory->context_remove_statements(storage, context);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_CONTEXT_REMOVE_STATEMENTS,
+                             start, status);
+    if(status)
+      librdf_storage_changes_lost(storage);
+    librdf_storage_changes_end(storage);
+    return status;
+  }
   
   if(!storage->factory->context_remove_statement)
     return 1;
@@ -1622,6 +2126,7 @@ librdf_storage_context_remove_statements(librdf_storage* storage,
   if(!stream)
     return 1;
 
+  librdf_storage_changes_start(storage);
   while(!librdf_stream_end(stream)) {
     librdf_statement *statement=librdf_stream_get_object(stream);
     if(!statement)
@@ -1630,6 +2135,7 @@ librdf_storage_context_remove_statements(librdf_storage* storage,
     librdf_stream_next(stream);
   }
   librdf_free_stream(stream);  
+  librdf_storage_changes_end(storage);
   return 0;
 }
 
@@ -1646,9 +2152,14 @@ librdf_storage_context_remove_statements(librdf_storage* storage,
 librdf_stream*
 librdf_storage_context_as_stream(librdf_storage* storage, librdf_node* context)
 {
+  u64 start;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
 
-  return storage->factory->context_serialise(storage, context);
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_CONTEXT_SERIALISE);
+  return librdf_storage_stats_stream(storage, LIBRDF_STORAGE_OP_CONTEXT_SERIALISE,
+                                     start,
+                                     storage->factory->context_serialise(storage, context));
 }
 
 
@@ -1710,13 +2221,49 @@ librdf_storage_supports_query(librdf_storage* storage, librdf_query *query)
 librdf_query_results*
 librdf_storage_query_execute(librdf_storage* storage, librdf_query *query) 
 {
+  u64 start;
+  librdf_query_results* results;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(query, librdf_query, NULL);
 
-  if(storage->factory->supports_query)
-    return storage->factory->query_execute(storage, query);
-  else
+  if(!storage->factory->supports_query || query->cancelled)
     return NULL;
+
+  /* remember the storage so librdf_query_cancel() can reach it */
+  if(query->storage != storage) {
+    if(query->storage)
+      librdf_storage_remove_reference(query->storage);
+    librdf_storage_add_reference(storage);
+    query->storage = storage;
+  }
+
+  start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_QUERY_EXECUTE);
+  results=storage->factory->query_execute(storage, query);
+  librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_QUERY_EXECUTE, start,
+                           !results);
+  return results;
+}
+
+
+/**
+ * librdf_storage_query_cancel:
+ * @storage: #librdf_storage object
+ * @query: #librdf_query query object
+ *
+ * INTERNAL - Interrupt a query running in librdf_storage_query_execute()
+ *
+ * May be called from a different thread to the one running the query.
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_storage_query_cancel(librdf_storage* storage, librdf_query *query)
+{
+  if(storage->factory->query_cancel)
+    return storage->factory->query_cancel(storage, query);
+
+  return 0;
 }
 
 
@@ -1733,8 +2280,15 @@ librdf_storage_sync(librdf_storage* storage)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
 
-  if(storage->factory->sync)
-    return storage->factory->sync(storage);
+  if(storage->factory->sync) {
+    u64 start;
+    int status;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_SYNC);
+    status=storage->factory->sync(storage);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_SYNC, start, status);
+    return status;
+  }
   return 0;
 }
 
@@ -1762,8 +2316,14 @@ librdf_storage_find_statements_in_context(librdf_storage* storage, librdf_statem
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
 
-  if(storage->factory->find_statements_in_context)
-    return storage->factory->find_statements_in_context(storage, statement, context_node);
+  if(storage->factory->find_statements_in_context) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_IN_CONTEXT);
+    return librdf_storage_stats_stream(storage, LIBRDF_STORAGE_OP_FIND_IN_CONTEXT,
+                                       start,
+                                       storage->factory->find_statements_in_context(storage, statement, context_node));
+  }
 
   statement=librdf_new_statement_from_statement(statement);
   if(!statement)
@@ -1799,8 +2359,14 @@ librdf_storage_get_contexts(librdf_storage* storage)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
 
-  if(storage->factory->get_contexts)
-    return storage->factory->get_contexts(storage);
+  if(storage->factory->get_contexts) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_GET_CONTEXTS);
+    return librdf_storage_stats_iterator(storage, LIBRDF_STORAGE_OP_GET_CONTEXTS,
+                                         start,
+                                         storage->factory->get_contexts(storage));
+  }
   else
     return NULL;
 }
@@ -1820,9 +2386,39 @@ librdf_storage_get_contexts(librdf_storage* storage)
 librdf_node*
 librdf_storage_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
+  const char* uri_string;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(feature, librdf_uri, NULL);
 
+  /* the instrumentation features are the same for every storage */
+  uri_string=(const char*)librdf_uri_as_string(feature);
+  if(!strcmp(uri_string, LIBRDF_STORAGE_FEATURE_INSTRUMENT) ||
+     !strncmp(uri_string, LIBRDF_STORAGE_FEATURE_OPERATION_STATS,
+              strlen(LIBRDF_STORAGE_FEATURE_OPERATION_STATS)))
+    return librdf_storage_stats_get_feature(storage, uri_string);
+
+  if(!strcmp(uri_string, LIBRDF_STORAGE_FEATURE_BLOOM_FILTER))
+    return librdf_storage_bloom_get_feature(storage);
+
+  if(!strcmp(uri_string, LIBRDF_STORAGE_FEATURE_MEMORY_SIZE) ||
+     !strcmp(uri_string, LIBRDF_STORAGE_FEATURE_MEMORY_LIMIT)) {
+    char value[24];
+    size_t size;
+
+    if(!strcmp(uri_string, LIBRDF_STORAGE_FEATURE_MEMORY_LIMIT))
+      size=storage->memory_limit;
+    else if(storage->factory->get_memory_size)
+      size=librdf_storage_get_memory_size(storage);
+    else
+      return NULL;
+
+    sprintf(value, "%lu", (unsigned long)size);
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)value,
+                                              NULL, NULL);
+  }
+
   if(storage->factory->get_feature)
     return storage->factory->get_feature(storage, feature);
   return NULL;
@@ -1847,12 +2443,370 @@ librdf_storage_set_feature(librdf_storage* storage, librdf_uri* feature,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(feature, librdf_uri, -1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(value, librdf_node, -1);
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_STORAGE_FEATURE_INSTRUMENT)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+    return librdf_storage_stats_set_enabled(storage,
+                                            atoi((const char*)librdf_node_get_literal_value(value)) > 0);
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_STORAGE_FEATURE_BLOOM_FILTER)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+    return librdf_storage_bloom_set_enabled(storage,
+                                            atoi((const char*)librdf_node_get_literal_value(value)) > 0);
+  }
+
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_STORAGE_FEATURE_MEMORY_LIMIT)) {
+    long limit;
+
+    if(!librdf_node_is_literal(value))
+      return 1;
+    limit=atol((const char*)librdf_node_get_literal_value(value));
+    storage->memory_limit=(limit > 0) ? (size_t)limit : 0;
+    /* measure again on the next add */
+    storage->memory_size=storage->memory_limit;
+    return 0;
+  }
+
   if(storage->factory->set_feature)
     return storage->factory->set_feature(storage, feature, value);
   return -1;
 }
 
 
+/**
+ * librdf_storage_get_find_options:
+ * @options: #librdf_hash of matching options or NULL
+ * @limit_p: pointer to store the limit, <0 for none
+ * @offset_p: pointer to store the offset, 0 for none
+ * @order_p: pointer to store the ordered position: 1 subject, 2 predicate, 3 object or 0 for none
+ *
+ * INTERNAL - Get the paging options of librdf_storage_find_statements_with_options()
+ *
+ * For storage modules implementing find_statements_with_options,
+ * which must apply the limit and offset.
+ *
+ * Return value: non-0 if any of the options is set
+ **/
+int
+librdf_storage_get_find_options(librdf_hash* options,
+                                int* limit_p, int* offset_p, int* order_p)
+{
+  char* order;
+
+  *limit_p= -1;
+  *offset_p=0;
+  *order_p=0;
+
+  if(!options)
+    return 0;
+
+  *limit_p=(int)librdf_hash_get_as_long(options, "limit");
+  if(*limit_p < 0)
+    *limit_p= -1;
+  *offset_p=(int)librdf_hash_get_as_long(options, "offset");
+  if(*offset_p < 0)
+    *offset_p=0;
+
+  order=librdf_hash_get(options, "order");
+  if(order) {
+    if(!strcmp(order, "subject"))
+      *order_p=1;
+    else if(!strcmp(order, "predicate"))
+      *order_p=2;
+    else if(!strcmp(order, "object"))
+      *order_p=3;
+    LIBRDF_FREE(char*, order);
+  }
+
+  return (*limit_p >= 0 || *offset_p > 0 || *order_p);
+}
+
+
+typedef struct {
+  librdf_stream* stream;
+  int remaining;
+} librdf_storage_limit_stream_context;
+
+
+static int
+librdf_storage_limit_stream_end_of_stream(void* context)
+{
+  librdf_storage_limit_stream_context* lsc=(librdf_storage_limit_stream_context*)context;
+
+  return !lsc->remaining || librdf_stream_end(lsc->stream);
+}
+
+
+static int
+librdf_storage_limit_stream_next_statement(void* context)
+{
+  librdf_storage_limit_stream_context* lsc=(librdf_storage_limit_stream_context*)context;
+
+  if(lsc->remaining > 0)
+    lsc->remaining--;
+  if(!lsc->remaining)
+    return 1;
+
+  return librdf_stream_next(lsc->stream);
+}
+
+
+static void*
+librdf_storage_limit_stream_get_statement(void* context, int flags)
+{
+  librdf_storage_limit_stream_context* lsc=(librdf_storage_limit_stream_context*)context;
+
+  if(!lsc->remaining)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(lsc->stream);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(lsc->stream);
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_limit_stream_finished(void* context)
+{
+  librdf_storage_limit_stream_context* lsc=(librdf_storage_limit_stream_context*)context;
+
+  /* stops the underlying iteration before its end */
+  librdf_free_stream(lsc->stream);
+  LIBRDF_FREE(librdf_storage_limit_stream_context, lsc);
+}
+
+
+/*
+ * librdf_storage_limit_stream:
+ * @storage: storage
+ * @stream: stream to limit, freed by this function
+ * @limit: most statements to return or <0 for all
+ * @offset: statements to skip first
+ *
+ * INTERNAL - Apply the limit and offset find options to a stream of a storage
+ *
+ * Return value: new stream or NULL on failure
+ */
+librdf_stream*
+librdf_storage_limit_stream(librdf_storage* storage, librdf_stream* stream,
+                            int limit, int offset)
+{
+  librdf_storage_limit_stream_context* lsc;
+  librdf_stream* limited;
+
+  while(offset-- > 0 && !librdf_stream_end(stream))
+    librdf_stream_next(stream);
+
+  if(limit < 0)
+    return stream;
+
+  lsc=LIBRDF_CALLOC(librdf_storage_limit_stream_context*, 1, sizeof(*lsc));
+  if(!lsc) {
+    librdf_free_stream(stream);
+    return NULL;
+  }
+  lsc->stream=stream;
+  lsc->remaining=limit;
+
+  limited=librdf_new_stream(storage->world, (void*)lsc,
+                            &librdf_storage_limit_stream_end_of_stream,
+                            &librdf_storage_limit_stream_next_statement,
+                            &librdf_storage_limit_stream_get_statement,
+                            &librdf_storage_limit_stream_finished);
+  if(!limited)
+    librdf_storage_limit_stream_finished(lsc);
+
+  return limited;
+}
+
+
+/*
+ * librdf_storage_get_text_match:
+ * @options: #librdf_hash of matching options or NULL
+ * @statement: statement to find or NULL
+ * @prefix_p: pointer to store non-0 for a prefix match, 0 for a substring match
+ *
+ * INTERNAL - Check if a find matches the object literal value as text
+ *
+ * Return value: non-0 if the "match-substring" or "match-prefix" option is set and the object is a literal
+ */
+int
+librdf_storage_get_text_match(librdf_hash* options,
+                              librdf_statement* statement, int* prefix_p)
+{
+  librdf_node* object;
+
+  *prefix_p=0;
+
+  if(!options || !statement)
+    return 0;
+
+  object=librdf_statement_get_object(statement);
+  if(!object || !librdf_node_is_literal(object))
+    return 0;
+
+  if(librdf_hash_get_as_boolean(options, "match-prefix") > 0) {
+    *prefix_p=1;
+    return 1;
+  }
+
+  return (librdf_hash_get_as_boolean(options, "match-substring") > 0);
+}
+
+
+typedef struct {
+  librdf_stream* stream;
+  librdf_statement* partial;  /* statement found, without the object */
+  librdf_node* text;          /* literal with the text to match */
+  int prefix;
+} librdf_storage_text_match_stream_context;
+
+
+/* Skip statements whose object does not match the text */
+static void
+librdf_storage_text_match_stream_seek(librdf_storage_text_match_stream_context* tsc)
+{
+  const unsigned char* text;
+  size_t text_len;
+
+  text=librdf_node_get_literal_value_as_counted_string(tsc->text, &text_len);
+
+  while(!librdf_stream_end(tsc->stream)) {
+    librdf_statement* statement=librdf_stream_get_object(tsc->stream);
+
+    if(statement &&
+       librdf_literal_index_matches(librdf_statement_get_object(statement),
+                                    text, text_len, tsc->prefix))
+      break;
+    librdf_stream_next(tsc->stream);
+  }
+}
+
+
+static int
+librdf_storage_text_match_stream_end_of_stream(void* context)
+{
+  librdf_storage_text_match_stream_context* tsc=(librdf_storage_text_match_stream_context*)context;
+
+  return librdf_stream_end(tsc->stream);
+}
+
+
+static int
+librdf_storage_text_match_stream_next_statement(void* context)
+{
+  librdf_storage_text_match_stream_context* tsc=(librdf_storage_text_match_stream_context*)context;
+
+  librdf_stream_next(tsc->stream);
+  librdf_storage_text_match_stream_seek(tsc);
+
+  return librdf_stream_end(tsc->stream);
+}
+
+
+static void*
+librdf_storage_text_match_stream_get_statement(void* context, int flags)
+{
+  librdf_storage_text_match_stream_context* tsc=(librdf_storage_text_match_stream_context*)context;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(tsc->stream);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(tsc->stream);
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_text_match_stream_finished(void* context)
+{
+  librdf_storage_text_match_stream_context* tsc=(librdf_storage_text_match_stream_context*)context;
+
+  if(tsc->stream)
+    librdf_free_stream(tsc->stream);
+  if(tsc->partial)
+    librdf_free_statement(tsc->partial);
+  if(tsc->text)
+    librdf_free_node(tsc->text);
+  LIBRDF_FREE(librdf_storage_text_match_stream_context, tsc);
+}
+
+
+/*
+ * librdf_storage_find_text_match:
+ * @storage: storage
+ * @statement: statement to find, with a literal object
+ * @context_node: context node or NULL
+ * @prefix: non-0 to match a prefix of the object literal values, 0 for a substring
+ *
+ * INTERNAL - Find statements whose object literal value contains some text by a scan
+ *
+ * Finds the statement without its object and keeps the statements
+ * whose object is a literal with a value containing, or starting
+ * with, the value of the object of @statement.
+ *
+ * Return value: #librdf_stream of matching statements (may be empty) or NULL on failure
+ */
+librdf_stream*
+librdf_storage_find_text_match(librdf_storage* storage,
+                               librdf_statement* statement,
+                               librdf_node* context_node, int prefix)
+{
+  librdf_storage_text_match_stream_context* tsc;
+  librdf_stream* stream;
+
+  tsc=LIBRDF_CALLOC(librdf_storage_text_match_stream_context*, 1,
+                    sizeof(*tsc));
+  if(!tsc)
+    return NULL;
+
+  tsc->prefix=prefix;
+  tsc->text=librdf_new_node_from_node(librdf_statement_get_object(statement));
+  tsc->partial=librdf_new_statement_from_statement(statement);
+  if(!tsc->text || !tsc->partial) {
+    librdf_storage_text_match_stream_finished((void*)tsc);
+    return NULL;
+  }
+  librdf_free_node(librdf_statement_get_object(tsc->partial));
+  librdf_statement_set_object(tsc->partial, NULL);
+
+  tsc->stream=librdf_storage_find_statements_in_context(storage, tsc->partial,
+                                                        context_node);
+  if(!tsc->stream) {
+    librdf_storage_text_match_stream_finished((void*)tsc);
+    return NULL;
+  }
+  librdf_storage_text_match_stream_seek(tsc);
+
+  stream=librdf_new_stream(storage->world, (void*)tsc,
+                           &librdf_storage_text_match_stream_end_of_stream,
+                           &librdf_storage_text_match_stream_next_statement,
+                           &librdf_storage_text_match_stream_get_statement,
+                           &librdf_storage_text_match_stream_finished);
+  if(!stream)
+    librdf_storage_text_match_stream_finished((void*)tsc);
+
+  return stream;
+}
+
+
 /**
  * librdf_storage_find_statements_with_options:
  * @storage: #librdf_storage object
@@ -1869,6 +2823,20 @@ librdf_storage_set_feature(librdf_storage* storage, librdf_uri* feature,
  * If options is given then the match is made according to
  * the given options.  If options is NULL, this is equivalent
  * to librdf_storage_find_statements_in_context.
+ *
+ * The options "limit" and "offset" return at most limit statements
+ * after skipping offset of them; SQL storages do this in the
+ * database and others stop reading once the limit is reached.  The
+ * option "order" with value "subject", "predicate" or "object" asks
+ * for a stable order of that position, so that pages do not
+ * overlap.  Storages that cannot order return statements in their
+ * own order, which is stable while the storage is not changed.
+ *
+ * The options "match-substring" and "match-prefix" match statements
+ * whose object is a literal with a value containing, or starting
+ * with, the value of the literal object of @statement.  The hashes,
+ * trees and sqlite storages answer these from a text index of their
+ * literals; storages without their own way scan the statements.
  * 
  * Return value:  #librdf_stream of matching statements (may be empty) or NULL on failure
  **/
@@ -1878,10 +2846,29 @@ librdf_storage_find_statements_with_options(librdf_storage* storage,
                                             librdf_node* context_node,
                                             librdf_hash* options) 
 {
-  if(storage->factory->find_statements_with_options)
-    return storage->factory->find_statements_with_options(storage, statement, context_node, options);
+  librdf_stream* stream;
+  int limit, offset, order;
+  int prefix;
+
+  if(storage->factory->find_statements_with_options) {
+    u64 start;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_FIND_WITH_OPTIONS);
+    return librdf_storage_stats_stream(storage, LIBRDF_STORAGE_OP_FIND_WITH_OPTIONS,
+                                       start,
+                                       storage->factory->find_statements_with_options(storage, statement, context_node, options));
+  }
+
+  if(librdf_storage_get_text_match(options, statement, &prefix))
+    stream=librdf_storage_find_text_match(storage, statement, context_node,
+                                          prefix);
   else
-    return librdf_storage_find_statements_in_context(storage, statement, context_node);
+    stream=librdf_storage_find_statements_in_context(storage, statement, context_node);
+  if(stream &&
+     librdf_storage_get_find_options(options, &limit, &offset, &order))
+    stream=librdf_storage_limit_stream(storage, stream, limit, offset);
+
+  return stream;
 }
 
 
@@ -1897,8 +2884,17 @@ librdf_storage_find_statements_with_options(librdf_storage* storage,
 int
 librdf_storage_transaction_start(librdf_storage* storage) 
 {
-  if(storage->factory->transaction_start)
-    return storage->factory->transaction_start(storage);
+  if(storage->factory->transaction_start) {
+    u64 start;
+    int status;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_TRANSACTION_START);
+    status=storage->factory->transaction_start(storage);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_TRANSACTION_START, start, status);
+    if(!status)
+      librdf_storage_changes_transaction(storage, 1);
+    return status;
+  }
   else
     return 1;
 }
@@ -1916,8 +2912,18 @@ librdf_storage_transaction_start(librdf_storage* storage)
 int
 librdf_storage_transaction_start_with_handle(librdf_storage* storage, void* handle)
 {
-  if(storage->factory->transaction_start_with_handle)
-    return storage->factory->transaction_start_with_handle(storage, handle);
+  if(storage->factory->transaction_start_with_handle) {
+    u64 start;
+    int status;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_TRANSACTION_START);
+    status=storage->factory->transaction_start_with_handle(storage, handle);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_TRANSACTION_START,
+                             start, status);
+    if(!status)
+      librdf_storage_changes_transaction(storage, 1);
+    return status;
+  }
   else
     return 1;
 }
@@ -1934,8 +2940,17 @@ librdf_storage_transaction_start_with_handle(librdf_storage* storage, void* hand
 int
 librdf_storage_transaction_commit(librdf_storage* storage) 
 {
-  if(storage->factory->transaction_commit)
-    return storage->factory->transaction_commit(storage);
+  if(storage->factory->transaction_commit) {
+    u64 start;
+    int status;
+
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_TRANSACTION_COMMIT);
+    status=storage->factory->transaction_commit(storage);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_TRANSACTION_COMMIT, start, status);
+    /* the changes are delivered only once they are committed */
+    librdf_storage_changes_transaction(storage, status ? -1 : 0);
+    return status;
+  }
   else
     return 1;
 }
@@ -1952,8 +2967,19 @@ librdf_storage_transaction_commit(librdf_storage* storage)
 int
 librdf_storage_transaction_rollback(librdf_storage* storage) 
 {
-  if(storage->factory->transaction_rollback)
-    return storage->factory->transaction_rollback(storage);
+  if(storage->factory->transaction_rollback) {
+    /* statements added or removed in the transaction are undone */
+    u64 start;
+    int status;
+
+    storage->modifications++;
+    start=librdf_storage_stats_start(storage, LIBRDF_STORAGE_OP_TRANSACTION_ROLLBACK);
+    status=storage->factory->transaction_rollback(storage);
+    librdf_storage_stats_end(storage, LIBRDF_STORAGE_OP_TRANSACTION_ROLLBACK,
+                             start, status);
+    librdf_storage_changes_transaction(storage, -1);
+    return status;
+  }
   else
     return 1;
 }
@@ -90,6 +90,8 @@ int librdf_storage_remove_statement(librdf_storage* storage, librdf_statement* s
 REDLAND_API
 int librdf_storage_contains_statement(librdf_storage* storage, librdf_statement* statement);
 REDLAND_API
+int librdf_storage_count_statements(librdf_storage* storage, librdf_statement* statement);
+REDLAND_API
 librdf_stream* librdf_storage_serialise(librdf_storage* storage);
 REDLAND_API
 librdf_stream* librdf_storage_find_statements(librdf_storage* storage, librdf_statement* statement);
@@ -147,6 +149,198 @@ librdf_stream* librdf_storage_find_statements_in_context(librdf_storage* storage
 REDLAND_API
 librdf_iterator* librdf_storage_get_contexts(librdf_storage* storage);
 
+/**
+ * LIBRDF_STORAGE_FEATURE_STATEMENTS_COUNT:
+ *
+ * Storage feature statements count.
+ *
+ * The number of statements in the storage, when kept.
+ */
+#define LIBRDF_STORAGE_FEATURE_STATEMENTS_COUNT "http://feature.librdf.org/storage-statements-count"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_DISTINCT_SUBJECTS:
+ *
+ * Storage feature distinct subjects.
+ *
+ * An estimate of the number of different subject nodes.
+ */
+#define LIBRDF_STORAGE_FEATURE_DISTINCT_SUBJECTS "http://feature.librdf.org/storage-distinct-subjects"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_DISTINCT_PREDICATES:
+ *
+ * Storage feature distinct predicates.
+ *
+ * An estimate of the number of different predicate nodes.
+ */
+#define LIBRDF_STORAGE_FEATURE_DISTINCT_PREDICATES "http://feature.librdf.org/storage-distinct-predicates"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_DISTINCT_OBJECTS:
+ *
+ * Storage feature distinct objects.
+ *
+ * An estimate of the number of different object nodes.
+ */
+#define LIBRDF_STORAGE_FEATURE_DISTINCT_OBJECTS "http://feature.librdf.org/storage-distinct-objects"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_PREDICATE_COUNT:
+ *
+ * Storage feature predicate count prefix.
+ *
+ * Followed by a predicate URI, the number of statements with that
+ * predicate.
+ */
+#define LIBRDF_STORAGE_FEATURE_PREDICATE_COUNT "http://feature.librdf.org/storage-predicate-count/"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_CONCURRENT_READS:
+ *
+ * Storage feature concurrent reads.
+ *
+ * "1" if the same storage opened again by name and options, in
+ * another world, sees the same statements and may be read from
+ * other threads at the same time.
+ */
+#define LIBRDF_STORAGE_FEATURE_CONCURRENT_READS "http://feature.librdf.org/storage-concurrent-reads"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_LITERAL_INDEX:
+ *
+ * Storage feature literal index.
+ *
+ * "1" if finds with the "match-substring" and "match-prefix" options
+ * are answered from a text index of the literals rather than by
+ * scanning statements.
+ */
+#define LIBRDF_STORAGE_FEATURE_LITERAL_INDEX "http://feature.librdf.org/storage-literal-index"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_SHARED_READS:
+ *
+ * Storage feature shared reads.
+ *
+ * "1" if finds, contains, size and the streams and iterators they
+ * return may be used from several threads at once on this one
+ * storage object, as long as each stream or iterator stays with one
+ * thread.  Requires the #LIBRDF_WORLD_FEATURE_CONCURRENT world
+ * feature to be set.  Queries, parsers, serializers and union models
+ * are not covered.
+ */
+#define LIBRDF_STORAGE_FEATURE_SHARED_READS "http://feature.librdf.org/storage-shared-reads"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_SHARED_WRITES:
+ *
+ * Storage feature shared writes.
+ *
+ * "1" if adds and removes may also run on this storage object while
+ * other threads read it as allowed by
+ * #LIBRDF_STORAGE_FEATURE_SHARED_READS.
+ */
+#define LIBRDF_STORAGE_FEATURE_SHARED_WRITES "http://feature.librdf.org/storage-shared-writes"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_INSTRUMENT:
+ *
+ * Storage feature instrument.
+ *
+ * "1" while the calls made to the storage are counted and timed, as
+ * started by this feature or the boolean storage option
+ * <literal>instrument</literal>.  Setting it to "1" starts counting
+ * again from zero and "0" stops, keeping the counts.
+ */
+#define LIBRDF_STORAGE_FEATURE_INSTRUMENT "http://feature.librdf.org/storage-instrument"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_OPERATION_STATS:
+ *
+ * Storage feature operation stats prefix.
+ *
+ * Followed by an operation name such as <literal>add</literal>,
+ * <literal>find</literal>, <literal>contains</literal> or
+ * <literal>sync</literal>, the counts of an instrumented storage
+ * for that operation:
+ * <literal>calls=N active=N open=N errors=N rows=N total-us=N
+ * max-us=N buckets=N,N,...</literal> where active counts calls not yet
+ * returned, open counts returned streams and iterators not yet freed,
+ * rows counts the statements or nodes read from them and bucket i
+ * counts calls taking under 2^i microseconds, the last bucket any
+ * longer.  Given alone, one line per operation used, each starting
+ * with the operation name.
+ */
+#define LIBRDF_STORAGE_FEATURE_OPERATION_STATS "http://feature.librdf.org/storage-operation-stats/"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_HASH_STATS:
+ *
+ * Storage feature hash stats.
+ *
+ * For a store kept in Redland hashes, one line per hash, each the hash
+ * name followed by the statistics from librdf_hash_get_stats() in the
+ * form read by librdf_hash_from_string().
+ */
+#define LIBRDF_STORAGE_FEATURE_HASH_STATS "http://feature.librdf.org/storage-hash-stats"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_COMPACT:
+ *
+ * Storage feature compact.
+ *
+ * "1" if the store files can be rewritten in key order to reclaim the
+ * space left by removed statements.  Setting it to "1" does so while
+ * the storage stays open; it fails if a transaction is active or, for
+ * some stores, while streams or iterators over the storage are in use.
+ */
+#define LIBRDF_STORAGE_FEATURE_COMPACT "http://feature.librdf.org/storage-compact"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_BLOOM_FILTER:
+ *
+ * Storage feature Bloom filter.
+ *
+ * "1" while contains checks are first tested against a Bloom filter
+ * of the statements in the storage, as started by this feature or
+ * the boolean storage option <literal>bloom-filter</literal>, followed
+ * by the filter <literal>bits capacity statements checks misses
+ * builds</literal> as <literal>name=N</literal> pairs, where misses
+ * are the checks answered without the storage.  The filter is only
+ * correct while the store is changed through this storage object
+ * alone.  Setting it to "0" stops using the filter.
+ */
+#define LIBRDF_STORAGE_FEATURE_BLOOM_FILTER "http://feature.librdf.org/storage-bloom-filter"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_MEMORY_SIZE:
+ *
+ * Storage feature memory size.
+ *
+ * The approximate bytes of process memory held by the storage, for
+ * the stores that keep their content in memory: "memory", "trees",
+ * "hashes" with hash-type <literal>memory</literal> and the
+ * "sharded" and "cache" stores over them.  Nodes shared between
+ * statements are counted for each statement and allocator overhead
+ * is not counted.  Read only.
+ */
+#define LIBRDF_STORAGE_FEATURE_MEMORY_SIZE "http://feature.librdf.org/storage-memory-size"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_MEMORY_LIMIT:
+ *
+ * Storage feature memory limit.
+ *
+ * Soft limit in bytes on the #LIBRDF_STORAGE_FEATURE_MEMORY_SIZE of
+ * the storage, as set by this feature or the storage option
+ * <literal>memory-limit</literal>; "0" (the default) for no limit.
+ * Once the size reaches the limit, adding statements fails with an
+ * error until statements are removed.  The size is measured before
+ * each add call but only again after a number of changes, and one
+ * call adding a stream of statements can go over the limit.
+ */
+#define LIBRDF_STORAGE_FEATURE_MEMORY_LIMIT "http://feature.librdf.org/storage-memory-limit"
+
 /* features */
 REDLAND_API
 librdf_node* librdf_storage_get_feature(librdf_storage* storage, librdf_uri* feature);
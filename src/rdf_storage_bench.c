@@ -0,0 +1,257 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_bench.c - RDF in-memory storage micro-benchmark
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+
+
+/* one prototype needed */
+int main(int argc, char *argv[]);
+
+
+#define BENCH_SUBJECTS_PER_OBJECT 7
+#define BENCH_PREDICATES 5
+
+
+static const char * const bench_predicates[BENCH_PREDICATES]={
+  "http://www.w3.org/1999/02/22-rdf-syntax-ns#type",
+  "http://www.w3.org/2000/01/rdf-schema#label",
+  "http://purl.org/dc/elements/1.1/title",
+  "http://xmlns.com/foaf/0.1/knows",
+  "http://example.org/vocabulary/2008/properties#hasVeryLongPropertyName"
+};
+
+
+static librdf_node*
+bench_subject(librdf_world* world, int i)
+{
+  char uri_string[256];
+
+  sprintf(uri_string, "http://data.example.org/dataset/%d/resource/item-%d",
+          (i / BENCH_PREDICATES) % 97, i / BENCH_PREDICATES);
+  return librdf_new_node_from_uri_string(world,
+                                         (const unsigned char*)uri_string);
+}
+
+
+static librdf_node*
+bench_object(librdf_world* world, int i)
+{
+  char uri_string[256];
+
+  sprintf(uri_string, "http://data.example.org/dataset/target-%d",
+          i / BENCH_SUBJECTS_PER_OBJECT);
+  return librdf_new_node_from_uri_string(world,
+                                         (const unsigned char*)uri_string);
+}
+
+
+/*
+ * Statement i has one of a few predicates, subjects with several
+ * arcs each and objects shared by a handful of subjects.
+ */
+static librdf_statement*
+bench_statement(librdf_world* world, int i)
+{
+  return librdf_new_statement_from_nodes(world,
+    bench_subject(world, i),
+    librdf_new_node_from_uri_string(world,
+      (const unsigned char*)bench_predicates[i % BENCH_PREDICATES]),
+    bench_object(world, i));
+}
+
+
+static void
+bench_report(const char* program, const char* name, int operations,
+             long results, clock_t ticks)
+{
+  double seconds=(double)ticks / CLOCKS_PER_SEC;
+
+  fprintf(stdout, "%s: %-22s %10.1f ns/op %12ld results\n",
+          program, name,
+          operations > 0 ? seconds * 1e9 / (double)operations : 0.0,
+          results);
+}
+
+
+static long
+bench_count_stream(librdf_stream* stream)
+{
+  long count=0;
+
+  if(!stream)
+    return -1;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    if(librdf_stream_get_object(stream))
+      count++;
+  }
+  librdf_free_stream(stream);
+
+  return count;
+}
+
+
+/* Time find_statements for count patterns with some parts bound */
+static void
+bench_find(const char* program, const char* name, librdf_world* world,
+           librdf_storage* storage, int count, int step, int parts)
+{
+  librdf_statement* pattern;
+  clock_t start;
+  long results=0;
+  int i;
+
+  pattern=librdf_new_statement(world);
+
+  start=clock();
+  for(i=0; i < count; i += step) {
+    librdf_statement_clear(pattern);
+    if(parts & LIBRDF_STATEMENT_SUBJECT)
+      librdf_statement_set_subject(pattern, bench_subject(world, i));
+    if(parts & LIBRDF_STATEMENT_PREDICATE)
+      librdf_statement_set_predicate(pattern,
+        librdf_new_node_from_uri_string(world,
+          (const unsigned char*)bench_predicates[i % BENCH_PREDICATES]));
+    if(parts & LIBRDF_STATEMENT_OBJECT)
+      librdf_statement_set_object(pattern, bench_object(world, i));
+
+    results += bench_count_stream(librdf_storage_find_statements(storage,
+                                                                 pattern));
+  }
+  bench_report(program, name, (count + step - 1) / step, results,
+               clock() - start);
+
+  librdf_free_statement(pattern);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  librdf_world* world;
+  librdf_storage* storage;
+  const char *program=librdf_basename((const char*)argv[0]);
+  const char *storage_name="trees";
+  const char *storage_options=NULL;
+  int count=100000;
+  librdf_statement** statements;
+  clock_t start;
+  long results;
+  int i;
+
+  if(argc > 1)
+    count=atoi(argv[1]);
+  if(argc > 2)
+    storage_name=argv[2];
+  if(argc > 3)
+    storage_options=argv[3];
+  if(count < 1) {
+    fprintf(stderr, "USAGE: %s [STATEMENT-COUNT [STORAGE-NAME [OPTIONS]]]\n",
+            program);
+    return 1;
+  }
+
+  world=librdf_new_world();
+  librdf_world_open(world);
+
+  storage=librdf_new_storage(world, storage_name, NULL, storage_options);
+  if(!storage) {
+    fprintf(stderr, "%s: Failed to create a '%s' storage\n", program,
+            storage_name);
+    return 1;
+  }
+
+  statements = LIBRDF_CALLOC(librdf_statement**, count,
+                             sizeof(librdf_statement*));
+  if(!statements) {
+    fprintf(stderr, "%s: Failed to create statements\n", program);
+    return 1;
+  }
+  for(i=0; i < count; i++) {
+    statements[i]=bench_statement(world, i);
+    if(!statements[i]) {
+      fprintf(stderr, "%s: Failed to create statements\n", program);
+      return 1;
+    }
+  }
+
+  fprintf(stdout, "%s: %d statements in a '%s' storage with options '%s'\n",
+          program, count, storage_name,
+          storage_options ? storage_options : "");
+
+  start=clock();
+  for(i=0; i < count; i++)
+    librdf_storage_add_statement(storage, statements[i]);
+  bench_report(program, "add", count, librdf_storage_size(storage),
+               clock() - start);
+
+  start=clock();
+  results=0;
+  for(i=0; i < count; i++)
+    results += librdf_storage_contains_statement(storage, statements[i]);
+  bench_report(program, "contains", count, results, clock() - start);
+
+  start=clock();
+  results=bench_count_stream(librdf_storage_serialise(storage));
+  bench_report(program, "serialise", count, results, clock() - start);
+
+  bench_find(program, "find (s ?p ?o)", world, storage, count,
+             BENCH_PREDICATES, LIBRDF_STATEMENT_SUBJECT);
+  bench_find(program, "find (s p ?o)", world, storage, count, 1,
+             LIBRDF_STATEMENT_SUBJECT | LIBRDF_STATEMENT_PREDICATE);
+  bench_find(program, "find (?s p o)", world, storage, count, 1,
+             LIBRDF_STATEMENT_PREDICATE | LIBRDF_STATEMENT_OBJECT);
+  bench_find(program, "find (?s ?p o)", world, storage, count,
+             BENCH_SUBJECTS_PER_OBJECT, LIBRDF_STATEMENT_OBJECT);
+  bench_find(program, "find (?s p ?o)", world, storage, BENCH_PREDICATES, 1,
+             LIBRDF_STATEMENT_PREDICATE);
+
+  start=clock();
+  for(i=0; i < count; i++)
+    librdf_storage_remove_statement(storage, statements[i]);
+  bench_report(program, "remove", count, librdf_storage_size(storage),
+               clock() - start);
+
+  for(i=0; i < count; i++)
+    librdf_free_statement(statements[i]);
+  LIBRDF_FREE(librdf_statement**, statements);
+
+  librdf_free_storage(storage);
+  librdf_free_world(world);
+
+  return 0;
+}
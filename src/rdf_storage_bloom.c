@@ -0,0 +1,442 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_bloom.c - RDF Storage Bloom filter of statements
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include <redland.h>
+
+
+/*
+ * A storage with the filter on answers contains checks for statements
+ * it has never seen without calling the storage factory.  The filter
+ * is built from the whole storage by the first check and every
+ * statement added through the storage API is set in it before the
+ * factory adds it, so it has no false negatives as long as nothing
+ * else writes to the store.  Removed statements stay set until the
+ * filter is rebuilt, which happens when more statements have been
+ * added than it was sized for.
+ */
+
+/* bits per statement and probes per statement, about 1% false
+ * positives when full */
+#define LIBRDF_STORAGE_BLOOM_BITS 10
+#define LIBRDF_STORAGE_BLOOM_PROBES 7
+
+/* smallest number of statements a filter is sized for */
+#define LIBRDF_STORAGE_BLOOM_MIN_STATEMENTS 1024
+
+
+struct librdf_storage_bloom_s
+{
+  int enabled;
+#ifdef WITH_THREADS
+  pthread_mutex_t mutex;
+#endif
+  /* bits_mask + 1 bits or NULL until built by the next check */
+  unsigned char* bits;
+  u64 bits_mask;
+
+  /* statements the filter is sized for and set in it */
+  unsigned long capacity;
+  unsigned long statements;
+
+  /* checks made, those answered without the storage and builds */
+  unsigned long checks;
+  unsigned long misses;
+  unsigned long builds;
+
+  /* statement encoding buffer */
+  unsigned char* buffer;
+  size_t buffer_size;
+};
+
+
+static void
+librdf_storage_bloom_lock(librdf_storage_bloom* bloom)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&bloom->mutex);
+#endif
+}
+
+
+static void
+librdf_storage_bloom_unlock(librdf_storage_bloom* bloom)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&bloom->mutex);
+#endif
+}
+
+
+/**
+ * librdf_free_storage_bloom:
+ * @bloom: storage Bloom filter
+ *
+ * INTERNAL - Destructor - free the Bloom filter of a storage
+ */
+void
+librdf_free_storage_bloom(librdf_storage_bloom* bloom)
+{
+  if(!bloom)
+    return;
+
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&bloom->mutex);
+#endif
+  if(bloom->bits)
+    LIBRDF_FREE(char*, bloom->bits);
+  if(bloom->buffer)
+    LIBRDF_FREE(char*, bloom->buffer);
+  LIBRDF_FREE(librdf_storage_bloom, bloom);
+}
+
+
+/**
+ * librdf_storage_bloom_set_enabled:
+ * @storage: storage
+ * @enabled: non 0 to use the filter, 0 to stop
+ *
+ * INTERNAL - Start or stop answering contains checks from a Bloom filter
+ *
+ * Starting builds the filter again on the next check since statements
+ * may have been added while it was off.
+ *
+ * Return value: non 0 on failure
+ */
+int
+librdf_storage_bloom_set_enabled(librdf_storage* storage, int enabled)
+{
+  librdf_storage_bloom* bloom = storage->bloom;
+
+  if(!bloom) {
+    if(!enabled)
+      return 0;
+
+    bloom = LIBRDF_CALLOC(librdf_storage_bloom*, 1, sizeof(*bloom));
+    if(!bloom)
+      return 1;
+#ifdef WITH_THREADS
+    pthread_mutex_init(&bloom->mutex, NULL);
+#endif
+    storage->bloom = bloom;
+  }
+
+  librdf_storage_bloom_lock(bloom);
+  if(bloom->bits) {
+    LIBRDF_FREE(char*, bloom->bits);
+    bloom->bits = NULL;
+  }
+  bloom->enabled = enabled;
+  librdf_storage_bloom_unlock(bloom);
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_bloom_hash:
+ * @world: world
+ * @bloom: storage Bloom filter, locked
+ * @statement: statement
+ * @hash_p: pointer to store the hash
+ *
+ * INTERNAL - Hash the encoding of a statement without its context
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_bloom_hash(librdf_world* world, librdf_storage_bloom* bloom,
+                          librdf_statement* statement, u64* hash_p)
+{
+  u64 hash = 14695981039346656037ULL;
+  size_t len;
+  size_t i;
+
+  len = librdf_statement_encode_parts2(world, statement, NULL,
+                                       NULL, 0, LIBRDF_STATEMENT_ALL);
+  if(!len)
+    return 1;
+  if(len > bloom->buffer_size) {
+    if(bloom->buffer)
+      LIBRDF_FREE(char*, bloom->buffer);
+    bloom->buffer_size = len * 2;
+    bloom->buffer = LIBRDF_MALLOC(unsigned char*, bloom->buffer_size);
+    if(!bloom->buffer) {
+      bloom->buffer_size = 0;
+      return 1;
+    }
+  }
+  len = librdf_statement_encode_parts2(world, statement, NULL,
+                                       bloom->buffer, bloom->buffer_size,
+                                       LIBRDF_STATEMENT_ALL);
+
+  /* FNV-1a */
+  for(i = 0; i < len; i++) {
+    hash ^= bloom->buffer[i];
+    hash *= 1099511628211ULL;
+  }
+
+  *hash_p = hash;
+  return 0;
+}
+
+
+/* Test the bits of a hash, setting them if set is non 0; returns
+ * non 0 if they were all set before */
+static int
+librdf_storage_bloom_probe(librdf_storage_bloom* bloom, u64 hash, int set)
+{
+  u64 h2 = (hash >> 32) | 1;
+  int seen = 1;
+  int probe;
+
+  /* double hashing for the probes */
+  for(probe = 0; probe < LIBRDF_STORAGE_BLOOM_PROBES; probe++) {
+    u64 bit = (hash + (u64)probe * h2) & bloom->bits_mask;
+    unsigned char mask = LIBRDF_GOOD_CAST(unsigned char, 1 << (bit & 7));
+
+    if(!(bloom->bits[bit >> 3] & mask)) {
+      if(!set)
+        return 0;
+      seen = 0;
+      bloom->bits[bit >> 3] |= mask;
+    }
+  }
+
+  return seen;
+}
+
+
+/*
+ * librdf_storage_bloom_build:
+ * @storage: storage
+ * @bloom: storage Bloom filter, locked
+ *
+ * INTERNAL - Build the filter from every statement in the storage
+ *
+ * Sized for twice the statements in the storage so that it is not
+ * built again soon after.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_bloom_build(librdf_storage* storage, librdf_storage_bloom* bloom)
+{
+  librdf_stream* stream;
+  unsigned long capacity = LIBRDF_STORAGE_BLOOM_MIN_STATEMENTS;
+  unsigned long statements = 0;
+  u64 bits = 1024;
+  int size;
+  int status = 0;
+
+  size = librdf_storage_size(storage);
+  while(size > 0 && capacity < (unsigned long)size * 2)
+    capacity <<= 1;
+  while(bits < (u64)capacity * LIBRDF_STORAGE_BLOOM_BITS)
+    bits <<= 1;
+
+  bloom->bits = LIBRDF_CALLOC(unsigned char*, LIBRDF_GOOD_CAST(size_t, bits / 8), 1);
+  if(!bloom->bits)
+    return 1;
+  bloom->bits_mask = bits - 1;
+
+  stream = librdf_storage_serialise(storage);
+  if(!stream)
+    status = 1;
+  else {
+    while(!librdf_stream_end(stream)) {
+      librdf_statement* statement = librdf_stream_get_object(stream);
+      u64 hash;
+
+      if(!statement ||
+         librdf_storage_bloom_hash(storage->world, bloom, statement, &hash)) {
+        status = 1;
+        break;
+      }
+      librdf_storage_bloom_probe(bloom, hash, 1);
+      statements++;
+      librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+  }
+
+  if(status) {
+    LIBRDF_FREE(char*, bloom->bits);
+    bloom->bits = NULL;
+    return 1;
+  }
+
+  if(capacity < statements * 2)
+    capacity = statements * 2;
+  bloom->capacity = capacity;
+  bloom->statements = statements;
+  bloom->builds++;
+  return 0;
+}
+
+
+/**
+ * librdf_storage_bloom_check:
+ * @storage: storage
+ * @statement: complete statement
+ *
+ * INTERNAL - Check if a statement may be in the storage
+ *
+ * Return value: 0 if the statement is certainly not in the storage
+ */
+int
+librdf_storage_bloom_check(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_bloom* bloom = storage->bloom;
+  u64 hash;
+  int maybe = 1;
+
+  if(!bloom || !bloom->enabled)
+    return 1;
+
+  librdf_storage_bloom_lock(bloom);
+  if(bloom->bits || !librdf_storage_bloom_build(storage, bloom)) {
+    if(!librdf_storage_bloom_hash(storage->world, bloom, statement, &hash)) {
+      bloom->checks++;
+      maybe = librdf_storage_bloom_probe(bloom, hash, 0);
+      if(!maybe)
+        bloom->misses++;
+    }
+  }
+  librdf_storage_bloom_unlock(bloom);
+
+  return maybe;
+}
+
+
+/**
+ * librdf_storage_bloom_add:
+ * @storage: storage
+ * @statement: statement about to be added
+ *
+ * INTERNAL - Set a statement in the filter before it is added
+ */
+void
+librdf_storage_bloom_add(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_bloom* bloom = storage->bloom;
+  u64 hash;
+
+  if(!bloom || !bloom->enabled)
+    return;
+
+  librdf_storage_bloom_lock(bloom);
+  /* not built yet, the build reads it from the storage */
+  if(bloom->bits) {
+    if(librdf_storage_bloom_hash(storage->world, bloom, statement, &hash) ||
+       ++bloom->statements > bloom->capacity) {
+      /* cannot be set or full: build again on the next check */
+      LIBRDF_FREE(char*, bloom->bits);
+      bloom->bits = NULL;
+    } else
+      librdf_storage_bloom_probe(bloom, hash, 1);
+  }
+  librdf_storage_bloom_unlock(bloom);
+}
+
+
+static librdf_statement*
+librdf_storage_bloom_add_map(librdf_stream* stream, void* map_context,
+                             librdf_statement* statement)
+{
+  librdf_storage_bloom_add((librdf_storage*)map_context, statement);
+  return statement;
+}
+
+
+/**
+ * librdf_storage_bloom_add_stream:
+ * @storage: storage
+ * @stream: stream of statements about to be added
+ *
+ * INTERNAL - Set each statement in the filter as it is read from a stream
+ *
+ * Return value: non 0 on failure
+ */
+int
+librdf_storage_bloom_add_stream(librdf_storage* storage, librdf_stream* stream)
+{
+  librdf_storage_bloom* bloom = storage->bloom;
+
+  if(!bloom || !bloom->enabled)
+    return 0;
+
+  /* a current statement already got has been past the maps */
+  if(stream->is_updated && stream->current)
+    librdf_storage_bloom_add(storage, stream->current);
+
+  return librdf_stream_add_map(stream, librdf_storage_bloom_add_map, NULL,
+                               storage);
+}
+
+
+/**
+ * librdf_storage_bloom_get_feature:
+ * @storage: storage
+ *
+ * INTERNAL - Get the value of the Bloom filter storage feature
+ *
+ * Return value: new literal node or NULL on failure
+ */
+librdf_node*
+librdf_storage_bloom_get_feature(librdf_storage* storage)
+{
+  librdf_storage_bloom* bloom = storage->bloom;
+  char buffer[160];
+
+  if(!bloom || !bloom->enabled)
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)"0",
+                                              NULL, NULL);
+
+  librdf_storage_bloom_lock(bloom);
+  sprintf(buffer, "1 bits=%lu capacity=%lu statements=%lu checks=%lu misses=%lu builds=%lu",
+          bloom->bits ? (unsigned long)(bloom->bits_mask + 1) : 0UL,
+          bloom->capacity, bloom->statements,
+          bloom->checks, bloom->misses, bloom->builds);
+  librdf_storage_bloom_unlock(bloom);
+
+  return librdf_new_node_from_typed_literal(storage->world,
+                                            (const unsigned char*)buffer,
+                                            NULL, NULL);
+}
@@ -0,0 +1,1123 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_cache.c - RDF Storage caching the lookups of another storage
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+
+#include <redland.h>
+
+
+/* Default number of lookups remembered */
+#define LIBRDF_STORAGE_CACHE_SIZE 1024
+
+/* Default largest number of nodes in a remembered lookup */
+#define LIBRDF_STORAGE_CACHE_MAX_RESULTS 1000
+
+
+/*
+ * The 'cache' storage passes every call on to a backend storage made
+ * from the remaining options, remembering the answers of lookups with
+ * bound nodes: get sources, arcs, targets, arcs in and arcs out,
+ * has arc in and out, and contains.  Any change made through this
+ * storage forgets every answer, so changes made to the backend by
+ * other programs are not seen until then.
+ *
+ * Lookups are kept in a fixed size table of entries evicted with the
+ * CLOCK algorithm as in the SQL node cache: each hit sets the entry's
+ * referenced flag and the hand clears flags as it passes, taking the
+ * first entry that was not used since the last sweep.
+ */
+
+typedef enum {
+  LIBRDF_STORAGE_CACHE_SOURCES,
+  LIBRDF_STORAGE_CACHE_ARCS,
+  LIBRDF_STORAGE_CACHE_TARGETS,
+  LIBRDF_STORAGE_CACHE_ARCS_IN,
+  LIBRDF_STORAGE_CACHE_ARCS_OUT,
+  LIBRDF_STORAGE_CACHE_HAS_ARC_IN,
+  LIBRDF_STORAGE_CACHE_HAS_ARC_OUT,
+  LIBRDF_STORAGE_CACHE_CONTAINS
+} librdf_storage_cache_kind;
+
+
+/* The nodes answering a lookup, shared by the cache entry and each
+ * iterator reading them */
+typedef struct
+{
+  int usage;
+  int count;
+  /* count pairs of node and context node or NULL */
+  librdf_node** nodes;
+} librdf_storage_cache_nodes;
+
+typedef struct
+{
+  librdf_storage_cache_kind kind;
+  /* bound nodes of the lookup, NULL past the last one */
+  librdf_node* key[3];
+  unsigned long hash;
+
+  /* answer of a lookup returning nodes */
+  librdf_storage_cache_nodes* nodes;
+  /* answer of a lookup returning a boolean */
+  int found;
+
+  int referenced;
+  /* next entry index in the bucket chain or -1 */
+  int next;
+} librdf_storage_cache_entry;
+
+typedef struct
+{
+  librdf_storage* backend;
+
+  int size;
+  int count;
+  int hand;
+  /* lookups with more nodes than this are not remembered */
+  int max_results;
+
+  /* size entries */
+  librdf_storage_cache_entry* entries;
+
+  /* buckets_mask+1 bucket chain heads or -1 */
+  int* buckets;
+  unsigned long buckets_mask;
+} librdf_storage_cache_instance;
+
+
+typedef struct
+{
+  librdf_storage* storage;
+  librdf_storage_cache_nodes* nodes;
+  int index;
+} librdf_storage_cache_iterator_context;
+
+
+/* prototypes for local functions */
+static int librdf_storage_cache_init(librdf_storage* storage, const char *name, librdf_hash* options);
+static void librdf_storage_cache_terminate(librdf_storage* storage);
+static void librdf_storage_cache_clear(librdf_storage_cache_instance* context);
+
+static void librdf_storage_cache_register_factory(librdf_storage_factory *factory);
+
+
+static unsigned long
+librdf_storage_cache_hash_node(unsigned long hash, librdf_node* node)
+{
+  const unsigned char *s=NULL;
+  size_t len=0;
+
+  if(!node)
+    return hash * 16777619UL;
+
+  switch(librdf_node_get_type(node)) {
+    case LIBRDF_NODE_TYPE_RESOURCE:
+      s=librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+      break;
+
+    case LIBRDF_NODE_TYPE_LITERAL:
+      s=librdf_node_get_literal_value_as_counted_string(node, &len);
+      break;
+
+    case LIBRDF_NODE_TYPE_BLANK:
+      s=librdf_node_get_blank_identifier(node);
+      len=strlen((const char*)s);
+      break;
+
+    case LIBRDF_NODE_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  /* FNV-1a */
+  hash ^= (unsigned long)librdf_node_get_type(node);
+  hash *= 16777619UL;
+  while(len--) {
+    hash ^= *s++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+
+static unsigned long
+librdf_storage_cache_hash_key(librdf_storage_cache_kind kind,
+                              librdf_node** key)
+{
+  unsigned long hash=2166136261UL;
+  int i;
+
+  hash ^= (unsigned long)kind;
+  for(i=0; i<3; i++)
+    hash=librdf_storage_cache_hash_node(hash, key[i]);
+  return hash;
+}
+
+
+static void
+librdf_storage_cache_release_nodes(librdf_storage_cache_nodes* nodes)
+{
+  int i;
+
+  if(--nodes->usage)
+    return;
+
+  for(i=0; i < nodes->count * 2; i++) {
+    if(nodes->nodes[i])
+      librdf_free_node(nodes->nodes[i]);
+  }
+  if(nodes->nodes)
+    LIBRDF_FREE(librdf_node**, nodes->nodes);
+  LIBRDF_FREE(librdf_storage_cache_nodes, nodes);
+}
+
+
+static void
+librdf_storage_cache_entry_clear(librdf_storage_cache_entry* entry)
+{
+  int i;
+
+  for(i=0; i<3; i++) {
+    if(entry->key[i]) {
+      librdf_free_node(entry->key[i]);
+      entry->key[i]=NULL;
+    }
+  }
+
+  if(entry->nodes) {
+    librdf_storage_cache_release_nodes(entry->nodes);
+    entry->nodes=NULL;
+  }
+}
+
+
+/*
+ * librdf_storage_cache_clear - INTERNAL - Forget every remembered lookup
+ * @context: cache storage instance
+ */
+static void
+librdf_storage_cache_clear(librdf_storage_cache_instance* context)
+{
+  unsigned long i;
+
+  for(i=0; i < (unsigned long)context->count; i++)
+    librdf_storage_cache_entry_clear(&context->entries[i]);
+
+  for(i=0; i <= context->buckets_mask; i++)
+    context->buckets[i]=-1;
+
+  context->count=0;
+  context->hand=0;
+}
+
+
+/*
+ * librdf_storage_cache_get - INTERNAL - Find a remembered lookup
+ * @context: cache storage instance
+ * @kind: lookup
+ * @key: array of 3 bound nodes of the lookup, NULL past the last one
+ *
+ * Return value: the entry or NULL if the lookup is not remembered
+ */
+static librdf_storage_cache_entry*
+librdf_storage_cache_get(librdf_storage_cache_instance* context,
+                         librdf_storage_cache_kind kind, librdf_node** key)
+{
+  unsigned long hash;
+  int i;
+
+  hash=librdf_storage_cache_hash_key(kind, key);
+
+  for(i=context->buckets[hash & context->buckets_mask]; i >= 0;
+      i=context->entries[i].next) {
+    librdf_storage_cache_entry* entry=&context->entries[i];
+    int j;
+
+    if(entry->hash != hash || entry->kind != kind)
+      continue;
+
+    for(j=0; j<3; j++) {
+      if(!entry->key[j] != !key[j] ||
+         (key[j] && !librdf_node_equals(entry->key[j], key[j])))
+        break;
+    }
+
+    if(j == 3) {
+      entry->referenced=1;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+
+/*
+ * librdf_storage_cache_put - INTERNAL - Make an entry for a lookup
+ * @context: cache storage instance
+ * @kind: lookup
+ * @key: array of 3 bound nodes of the lookup, NULL past the last one
+ *
+ * Evicts an entry not used recently if the cache is full.  The key
+ * nodes are copied; the caller sets the answer in the entry.
+ *
+ * Return value: the entry or NULL on failure
+ */
+static librdf_storage_cache_entry*
+librdf_storage_cache_put(librdf_storage_cache_instance* context,
+                         librdf_storage_cache_kind kind, librdf_node** key)
+{
+  librdf_storage_cache_entry* entry;
+  unsigned long hash;
+  int i;
+  int j;
+  int* link;
+
+  hash=librdf_storage_cache_hash_key(kind, key);
+
+  if(context->count < context->size)
+    i=context->count++;
+  else {
+    /* sweep for an entry not referenced since the last pass */
+    while(context->entries[context->hand].referenced) {
+      context->entries[context->hand].referenced=0;
+      context->hand=(context->hand + 1) % context->size;
+    }
+    i=context->hand;
+    context->hand=(context->hand + 1) % context->size;
+
+    entry=&context->entries[i];
+    for(link=&context->buckets[entry->hash & context->buckets_mask];
+        *link != i; link=&context->entries[*link].next)
+      ;
+    *link=entry->next;
+    librdf_storage_cache_entry_clear(entry);
+  }
+
+  entry=&context->entries[i];
+  entry->kind=kind;
+  entry->hash=hash;
+  entry->found=0;
+  entry->referenced=0;
+  for(j=0; j<3; j++)
+    entry->key[j]=key[j] ? librdf_new_node_from_node(key[j]) : NULL;
+  entry->next=context->buckets[hash & context->buckets_mask];
+  context->buckets[hash & context->buckets_mask]=i;
+
+  return entry;
+}
+
+
+/* functions implementing storage api */
+static int
+librdf_storage_cache_init(librdf_storage* storage, const char *name,
+                          librdf_hash* options)
+{
+  librdf_storage_cache_instance* context;
+  char *backend=NULL;
+  long lvalue;
+  unsigned long buckets=1;
+  unsigned long i;
+  int rc=1;
+
+  context=LIBRDF_CALLOC(librdf_storage_cache_instance*, 1, sizeof(*context));
+  if(!context)
+    goto done;
+
+  librdf_storage_set_instance(storage, context);
+
+  backend=librdf_hash_get_del(options, "backend");
+  if(!backend || !strcmp(backend, storage->factory->name)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Storage %s needs a backend storage option",
+               storage->factory->name);
+    goto done;
+  }
+
+  lvalue=librdf_hash_get_as_long(options, "size");
+  context->size=(lvalue > 0) ? (int)lvalue : LIBRDF_STORAGE_CACHE_SIZE;
+  lvalue=librdf_hash_get_as_long(options, "max-results");
+  context->max_results=(lvalue >= 0) ? (int)lvalue : LIBRDF_STORAGE_CACHE_MAX_RESULTS;
+
+  while(buckets < (unsigned long)context->size * 2)
+    buckets <<= 1;
+  context->buckets_mask=buckets - 1;
+
+  context->entries=LIBRDF_CALLOC(librdf_storage_cache_entry*, context->size,
+                                 sizeof(librdf_storage_cache_entry));
+  context->buckets=LIBRDF_MALLOC(int*, buckets * sizeof(int));
+  if(!context->entries || !context->buckets)
+    goto done;
+
+  for(i=0; i < buckets; i++)
+    context->buckets[i]=-1;
+
+  /* everything else is for the backend */
+  context->backend=librdf_new_storage_with_options(storage->world,
+                                                   backend, name, options);
+  if(!context->backend)
+    goto done;
+
+  rc=0;
+
+  done:
+  if(backend)
+    LIBRDF_FREE(char*, backend);
+
+  /* no more options, might as well free them now */
+  if(options)
+    librdf_free_hash(options);
+
+  return rc;
+}
+
+
+static void
+librdf_storage_cache_terminate(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  if(context == NULL)
+    return;
+
+  if(context->entries) {
+    if(context->buckets)
+      librdf_storage_cache_clear(context);
+    LIBRDF_FREE(librdf_storage_cache_entry*, context->entries);
+  }
+
+  if(context->buckets)
+    LIBRDF_FREE(int*, context->buckets);
+
+  if(context->backend)
+    librdf_free_storage(context->backend);
+
+  LIBRDF_FREE(librdf_storage_cache_instance, context);
+}
+
+
+static int
+librdf_storage_cache_open(librdf_storage* storage, librdf_model* model)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_open(context->backend, model);
+}
+
+
+static int
+librdf_storage_cache_close(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_close(context->backend);
+}
+
+
+static int
+librdf_storage_cache_size(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_size(context->backend);
+}
+
+
+static int
+librdf_storage_cache_add_statement(librdf_storage* storage,
+                                   librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_add_statement(context->backend, statement);
+}
+
+
+static int
+librdf_storage_cache_add_statements(librdf_storage* storage,
+                                    librdf_stream* statement_stream)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_add_statements(context->backend, statement_stream);
+}
+
+
+static int
+librdf_storage_cache_remove_statement(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_remove_statement(context->backend, statement);
+}
+
+
+static int
+librdf_storage_cache_contains_statement(librdf_storage* storage,
+                                        librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+  librdf_storage_cache_entry* entry;
+  librdf_node* key[3];
+  int found;
+
+  key[0]=librdf_statement_get_subject(statement);
+  key[1]=librdf_statement_get_predicate(statement);
+  key[2]=librdf_statement_get_object(statement);
+  if(!key[0] || !key[1] || !key[2])
+    return librdf_storage_contains_statement(context->backend, statement);
+
+  entry=librdf_storage_cache_get(context, LIBRDF_STORAGE_CACHE_CONTAINS, key);
+  if(entry)
+    return entry->found;
+
+  found=librdf_storage_contains_statement(context->backend, statement);
+
+  entry=librdf_storage_cache_put(context, LIBRDF_STORAGE_CACHE_CONTAINS, key);
+  if(entry)
+    entry->found=found;
+
+  return found;
+}
+
+
+static librdf_stream*
+librdf_storage_cache_serialise(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_serialise(context->backend);
+}
+
+
+static librdf_stream*
+librdf_storage_cache_find_statements(librdf_storage* storage,
+                                     librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_find_statements(context->backend, statement);
+}
+
+
+static librdf_stream*
+librdf_storage_cache_find_statements_with_options(librdf_storage* storage,
+                                                  librdf_statement* statement,
+                                                  librdf_node* context_node,
+                                                  librdf_hash* options)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_find_statements_with_options(context->backend,
+                                                     statement, context_node,
+                                                     options);
+}
+
+
+static int
+librdf_storage_cache_iterator_is_end(void* iterator)
+{
+  librdf_storage_cache_iterator_context* icontext=(librdf_storage_cache_iterator_context*)iterator;
+
+  return icontext->index >= icontext->nodes->count;
+}
+
+
+static int
+librdf_storage_cache_iterator_next_method(void* iterator)
+{
+  librdf_storage_cache_iterator_context* icontext=(librdf_storage_cache_iterator_context*)iterator;
+
+  if(icontext->index >= icontext->nodes->count)
+    return 1;
+
+  icontext->index++;
+  return icontext->index >= icontext->nodes->count;
+}
+
+
+static void*
+librdf_storage_cache_iterator_get_method(void* iterator, int flags)
+{
+  librdf_storage_cache_iterator_context* icontext=(librdf_storage_cache_iterator_context*)iterator;
+
+  if(icontext->index >= icontext->nodes->count)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return (void*)icontext->nodes->nodes[icontext->index * 2];
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return (void*)icontext->nodes->nodes[icontext->index * 2 + 1];
+
+    default:
+      librdf_log(icontext->storage->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_cache_iterator_finished(void* iterator)
+{
+  librdf_storage_cache_iterator_context* icontext=(librdf_storage_cache_iterator_context*)iterator;
+
+  librdf_storage_cache_release_nodes(icontext->nodes);
+  librdf_storage_remove_reference(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_cache_iterator_context, icontext);
+}
+
+
+/*
+ * librdf_storage_cache_read_nodes - INTERNAL - Read the nodes of an iterator
+ * @iterator: iterator of nodes from the backend, freed here
+ *
+ * Return value: the nodes with a usage of 1 or NULL on failure
+ */
+static librdf_storage_cache_nodes*
+librdf_storage_cache_read_nodes(librdf_iterator* iterator)
+{
+  librdf_storage_cache_nodes* nodes;
+  int size=0;
+
+  nodes=LIBRDF_CALLOC(librdf_storage_cache_nodes*, 1, sizeof(*nodes));
+  if(!nodes) {
+    librdf_free_iterator(iterator);
+    return NULL;
+  }
+  nodes->usage=1;
+
+  while(!librdf_iterator_end(iterator)) {
+    librdf_node* node=(librdf_node*)librdf_iterator_get_object(iterator);
+    librdf_node* context_node=(librdf_node*)librdf_iterator_get_context(iterator);
+
+    if(!node)
+      break;
+
+    if(nodes->count == size) {
+      librdf_node** new_nodes;
+
+      size=size ? size * 2 : 8;
+      new_nodes=LIBRDF_CALLOC(librdf_node**, size * 2, sizeof(librdf_node*));
+      if(!new_nodes) {
+        librdf_storage_cache_release_nodes(nodes);
+        nodes=NULL;
+        break;
+      }
+      if(nodes->nodes) {
+        memcpy(new_nodes, nodes->nodes,
+               nodes->count * 2 * sizeof(librdf_node*));
+        LIBRDF_FREE(librdf_node**, nodes->nodes);
+      }
+      nodes->nodes=new_nodes;
+    }
+
+    nodes->nodes[nodes->count * 2]=librdf_new_node_from_node(node);
+    if(context_node)
+      nodes->nodes[nodes->count * 2 + 1]=librdf_new_node_from_node(context_node);
+    nodes->count++;
+
+    librdf_iterator_next(iterator);
+  }
+
+  librdf_free_iterator(iterator);
+  return nodes;
+}
+
+
+/*
+ * librdf_storage_cache_find_nodes - INTERNAL - Answer a lookup returning nodes
+ * @storage: cache storage
+ * @kind: lookup
+ * @node1: first bound node
+ * @node2: second bound node or NULL for arcs in and out
+ *
+ * Return value: new iterator or NULL on failure
+ */
+static librdf_iterator*
+librdf_storage_cache_find_nodes(librdf_storage* storage,
+                                librdf_storage_cache_kind kind,
+                                librdf_node* node1, librdf_node* node2)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+  librdf_storage_cache_iterator_context* icontext;
+  librdf_storage_cache_entry* entry;
+  librdf_storage_cache_nodes* nodes;
+  librdf_iterator* iterator;
+  librdf_node* key[3];
+
+  key[0]=node1;
+  key[1]=node2;
+  key[2]=NULL;
+
+  entry=librdf_storage_cache_get(context, kind, key);
+  if(entry) {
+    nodes=entry->nodes;
+    nodes->usage++;
+  } else {
+    switch(kind) {
+      case LIBRDF_STORAGE_CACHE_SOURCES:
+        iterator=librdf_storage_get_sources(context->backend, node1, node2);
+        break;
+      case LIBRDF_STORAGE_CACHE_ARCS:
+        iterator=librdf_storage_get_arcs(context->backend, node1, node2);
+        break;
+      case LIBRDF_STORAGE_CACHE_TARGETS:
+        iterator=librdf_storage_get_targets(context->backend, node1, node2);
+        break;
+      case LIBRDF_STORAGE_CACHE_ARCS_IN:
+        iterator=librdf_storage_get_arcs_in(context->backend, node1);
+        break;
+      case LIBRDF_STORAGE_CACHE_ARCS_OUT:
+        iterator=librdf_storage_get_arcs_out(context->backend, node1);
+        break;
+
+      case LIBRDF_STORAGE_CACHE_HAS_ARC_IN:
+      case LIBRDF_STORAGE_CACHE_HAS_ARC_OUT:
+      case LIBRDF_STORAGE_CACHE_CONTAINS:
+      default:
+        iterator=NULL;
+        break;
+    }
+    if(!iterator)
+      return NULL;
+
+    nodes=librdf_storage_cache_read_nodes(iterator);
+    if(!nodes)
+      return NULL;
+
+    if(nodes->count <= context->max_results) {
+      entry=librdf_storage_cache_put(context, kind, key);
+      if(entry) {
+        entry->nodes=nodes;
+        nodes->usage++;
+      }
+    }
+  }
+
+  icontext=LIBRDF_CALLOC(librdf_storage_cache_iterator_context*, 1,
+                         sizeof(*icontext));
+  if(!icontext) {
+    librdf_storage_cache_release_nodes(nodes);
+    return NULL;
+  }
+
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
+  icontext->nodes=nodes;
+
+  iterator=librdf_new_iterator(storage->world, (void*)icontext,
+                               librdf_storage_cache_iterator_is_end,
+                               librdf_storage_cache_iterator_next_method,
+                               librdf_storage_cache_iterator_get_method,
+                               librdf_storage_cache_iterator_finished);
+  if(!iterator)
+    librdf_storage_cache_iterator_finished(icontext);
+  return iterator;
+}
+
+
+static librdf_iterator*
+librdf_storage_cache_find_sources(librdf_storage* storage,
+                                  librdf_node* arc, librdf_node *target)
+{
+  return librdf_storage_cache_find_nodes(storage, LIBRDF_STORAGE_CACHE_SOURCES,
+                                         arc, target);
+}
+
+
+static librdf_iterator*
+librdf_storage_cache_find_arcs(librdf_storage* storage,
+                               librdf_node* source, librdf_node *target)
+{
+  return librdf_storage_cache_find_nodes(storage, LIBRDF_STORAGE_CACHE_ARCS,
+                                         source, target);
+}
+
+
+static librdf_iterator*
+librdf_storage_cache_find_targets(librdf_storage* storage,
+                                  librdf_node* source, librdf_node *arc)
+{
+  return librdf_storage_cache_find_nodes(storage, LIBRDF_STORAGE_CACHE_TARGETS,
+                                         source, arc);
+}
+
+
+static librdf_iterator*
+librdf_storage_cache_get_arcs_in(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_cache_find_nodes(storage, LIBRDF_STORAGE_CACHE_ARCS_IN,
+                                         node, NULL);
+}
+
+
+static librdf_iterator*
+librdf_storage_cache_get_arcs_out(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_cache_find_nodes(storage, LIBRDF_STORAGE_CACHE_ARCS_OUT,
+                                         node, NULL);
+}
+
+
+static int
+librdf_storage_cache_has_arc(librdf_storage* storage,
+                             librdf_storage_cache_kind kind,
+                             librdf_node* node, librdf_node* property)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+  librdf_storage_cache_entry* entry;
+  librdf_node* key[3];
+  int found;
+
+  key[0]=node;
+  key[1]=property;
+  key[2]=NULL;
+
+  entry=librdf_storage_cache_get(context, kind, key);
+  if(entry)
+    return entry->found;
+
+  if(kind == LIBRDF_STORAGE_CACHE_HAS_ARC_IN)
+    found=librdf_storage_has_arc_in(context->backend, node, property);
+  else
+    found=librdf_storage_has_arc_out(context->backend, node, property);
+
+  entry=librdf_storage_cache_put(context, kind, key);
+  if(entry)
+    entry->found=found;
+
+  return found;
+}
+
+
+static int
+librdf_storage_cache_has_arc_in(librdf_storage* storage, librdf_node* node,
+                                librdf_node* property)
+{
+  return librdf_storage_cache_has_arc(storage, LIBRDF_STORAGE_CACHE_HAS_ARC_IN,
+                                      node, property);
+}
+
+
+static int
+librdf_storage_cache_has_arc_out(librdf_storage* storage, librdf_node* node,
+                                 librdf_node* property)
+{
+  return librdf_storage_cache_has_arc(storage, LIBRDF_STORAGE_CACHE_HAS_ARC_OUT,
+                                      node, property);
+}
+
+
+static int
+librdf_storage_cache_context_add_statement(librdf_storage* storage,
+                                           librdf_node* context_node,
+                                           librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_context_add_statement(context->backend, context_node,
+                                              statement);
+}
+
+
+static int
+librdf_storage_cache_context_add_statements(librdf_storage* storage,
+                                            librdf_node* context_node,
+                                            librdf_stream* stream)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_context_add_statements(context->backend, context_node,
+                                               stream);
+}
+
+
+static int
+librdf_storage_cache_context_remove_statement(librdf_storage* storage,
+                                              librdf_node* context_node,
+                                              librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_context_remove_statement(context->backend,
+                                                 context_node, statement);
+}
+
+
+static int
+librdf_storage_cache_context_remove_statements(librdf_storage* storage,
+                                               librdf_node* context_node)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  librdf_storage_cache_clear(context);
+  return librdf_storage_context_remove_statements(context->backend,
+                                                  context_node);
+}
+
+
+static librdf_stream*
+librdf_storage_cache_context_serialise(librdf_storage* storage,
+                                       librdf_node* context_node)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_context_as_stream(context->backend, context_node);
+}
+
+
+static librdf_stream*
+librdf_storage_cache_find_statements_in_context(librdf_storage* storage,
+                                                librdf_statement* statement,
+                                                librdf_node* context_node)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_find_statements_in_context(context->backend,
+                                                   statement, context_node);
+}
+
+
+static librdf_iterator*
+librdf_storage_cache_get_contexts(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_get_contexts(context->backend);
+}
+
+
+static int
+librdf_storage_cache_sync(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_sync(context->backend);
+}
+
+
+static librdf_node*
+librdf_storage_cache_get_feature(librdf_storage* storage, librdf_uri* feature)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_get_feature(context->backend, feature);
+}
+
+
+static int
+librdf_storage_cache_set_feature(librdf_storage* storage, librdf_uri* feature,
+                                 librdf_node* value)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_set_feature(context->backend, feature, value);
+}
+
+
+static int
+librdf_storage_cache_transaction_start(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_transaction_start(context->backend);
+}
+
+
+static int
+librdf_storage_cache_transaction_start_with_handle(librdf_storage* storage,
+                                                   void* handle)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_transaction_start_with_handle(context->backend, handle);
+}
+
+
+static int
+librdf_storage_cache_transaction_commit(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_transaction_commit(context->backend);
+}
+
+
+static int
+librdf_storage_cache_transaction_rollback(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  /* lookups made in the transaction may have seen its changes */
+  librdf_storage_cache_clear(context);
+  return librdf_storage_transaction_rollback(context->backend);
+}
+
+
+static void*
+librdf_storage_cache_transaction_get_handle(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_transaction_get_handle(context->backend);
+}
+
+
+static int
+librdf_storage_cache_supports_query(librdf_storage* storage,
+                                    librdf_query* query)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_supports_query(context->backend, query);
+}
+
+
+static librdf_query_results*
+librdf_storage_cache_query_execute(librdf_storage* storage,
+                                   librdf_query* query)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_query_execute(context->backend, query);
+}
+
+
+static int
+librdf_storage_cache_count_statements(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+
+  return librdf_storage_count_statements(context->backend, statement);
+}
+
+
+/* The cache tables and node arrays, which share the nodes with the
+ * backend, and the backend */
+static size_t
+librdf_storage_cache_get_memory_size(librdf_storage* storage)
+{
+  librdf_storage_cache_instance* context=(librdf_storage_cache_instance*)storage->instance;
+  size_t size;
+  int i;
+
+  size=sizeof(*context) +
+       (size_t)context->size * sizeof(librdf_storage_cache_entry) +
+       (size_t)(context->buckets_mask + 1) * sizeof(int);
+
+  for(i=0; i < context->size; i++) {
+    librdf_storage_cache_nodes* nodes=context->entries[i].nodes;
+
+    if(nodes)
+      size += sizeof(*nodes) + (size_t)nodes->count * 2 * sizeof(librdf_node*);
+  }
+
+  return size + librdf_storage_get_memory_size(context->backend);
+}
+
+
+/* local function to register cache storage functions */
+static void
+librdf_storage_cache_register_factory(librdf_storage_factory *factory)
+{
+  factory->version            = LIBRDF_STORAGE_INTERFACE_VERSION;
+  factory->init               = librdf_storage_cache_init;
+  factory->terminate          = librdf_storage_cache_terminate;
+  factory->open               = librdf_storage_cache_open;
+  factory->close              = librdf_storage_cache_close;
+  factory->size               = librdf_storage_cache_size;
+  factory->add_statement      = librdf_storage_cache_add_statement;
+  factory->add_statements     = librdf_storage_cache_add_statements;
+  factory->remove_statement   = librdf_storage_cache_remove_statement;
+  factory->contains_statement = librdf_storage_cache_contains_statement;
+  factory->serialise          = librdf_storage_cache_serialise;
+  factory->find_statements    = librdf_storage_cache_find_statements;
+  factory->find_sources       = librdf_storage_cache_find_sources;
+  factory->find_arcs          = librdf_storage_cache_find_arcs;
+  factory->find_targets       = librdf_storage_cache_find_targets;
+  factory->get_arcs_in        = librdf_storage_cache_get_arcs_in;
+  factory->get_arcs_out       = librdf_storage_cache_get_arcs_out;
+  factory->has_arc_in         = librdf_storage_cache_has_arc_in;
+  factory->has_arc_out        = librdf_storage_cache_has_arc_out;
+  factory->context_add_statement     = librdf_storage_cache_context_add_statement;
+  factory->context_add_statements    = librdf_storage_cache_context_add_statements;
+  factory->context_remove_statement  = librdf_storage_cache_context_remove_statement;
+  factory->context_remove_statements = librdf_storage_cache_context_remove_statements;
+  factory->context_serialise         = librdf_storage_cache_context_serialise;
+  factory->find_statements_in_context = librdf_storage_cache_find_statements_in_context;
+  factory->get_contexts              = librdf_storage_cache_get_contexts;
+  factory->sync                      = librdf_storage_cache_sync;
+  factory->get_feature               = librdf_storage_cache_get_feature;
+  factory->set_feature               = librdf_storage_cache_set_feature;
+  factory->transaction_start         = librdf_storage_cache_transaction_start;
+  factory->transaction_start_with_handle = librdf_storage_cache_transaction_start_with_handle;
+  factory->transaction_commit        = librdf_storage_cache_transaction_commit;
+  factory->transaction_rollback      = librdf_storage_cache_transaction_rollback;
+  factory->transaction_get_handle    = librdf_storage_cache_transaction_get_handle;
+  factory->supports_query            = librdf_storage_cache_supports_query;
+  factory->query_execute             = librdf_storage_cache_query_execute;
+  factory->count_statements          = librdf_storage_cache_count_statements;
+  factory->find_statements_with_options = librdf_storage_cache_find_statements_with_options;
+  factory->get_memory_size    = librdf_storage_cache_get_memory_size;
+}
+
+
+/**
+ * librdf_init_storage_cache:
+ * @world: world object
+ *
+ * INTERNAL - Initialise the built-in storage_cache module.
+ */
+void
+librdf_init_storage_cache(librdf_world *world)
+{
+  librdf_storage_register_factory(world, "cache",
+                                  "Cache of lookups in another store",
+                                  &librdf_storage_cache_register_factory);
+}
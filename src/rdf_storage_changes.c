@@ -0,0 +1,584 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_changes.c - RDF Storage change feed to model handlers
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include <redland.h>
+
+
+/*
+ * The storage API calls that add or remove statements record a copy
+ * of each statement, with its context, in one queue per storage while
+ * change handlers are registered.  Calls made inside other calls, such
+ * as the adds made for each statement of a stream, are recorded into
+ * the same batch.  The batch is handed to the handlers when the
+ * outermost call returns, or when the transaction it was made in is
+ * committed; a rolled back transaction discards it.
+ *
+ * The queue holds at most as many changes as the largest handler
+ * queue size.  Changes past that are not kept but counted as lost, as
+ * are those of bulk calls that failed part way, so that a handler
+ * knows to read the store again.
+ */
+
+/* changes queued for a handler registered with a queue size of 0 */
+#define LIBRDF_STORAGE_CHANGES_QUEUE_SIZE 4096
+
+
+typedef struct
+{
+  librdf_model* model;
+  librdf_model_change_handler handler;
+  void* user_data;
+  int queue_size;
+} librdf_storage_change_handler;
+
+
+struct librdf_storage_changes_s
+{
+#ifdef WITH_THREADS
+  pthread_mutex_t mutex;
+#endif
+  /* handlers_count registered handlers in handlers_size slots */
+  librdf_storage_change_handler* handlers;
+  int handlers_count;
+  int handlers_size;
+
+  /* queue_count changes in queue_size slots, at most queue_limit */
+  librdf_model_change* queue;
+  int queue_count;
+  int queue_size;
+  int queue_limit;
+
+  /* changes not kept in the queue since it was last delivered */
+  int lost;
+
+  /* storage API calls running, delivered when back to 0 */
+  int depth;
+
+  /* non 0 between a successful transaction start and its end */
+  int in_transaction;
+};
+
+
+/* context of a stream of statements being added */
+typedef struct
+{
+  librdf_storage* storage;
+  librdf_node* context;
+} librdf_storage_changes_stream_context;
+
+
+static void
+librdf_storage_changes_lock(librdf_storage_changes* changes)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&changes->mutex);
+#endif
+}
+
+
+static void
+librdf_storage_changes_unlock(librdf_storage_changes* changes)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&changes->mutex);
+#endif
+}
+
+
+static void
+librdf_storage_changes_free_queue(librdf_model_change* queue, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++) {
+    librdf_free_statement(queue[i].statement);
+    if(queue[i].context)
+      librdf_free_node(queue[i].context);
+  }
+  if(queue)
+    LIBRDF_FREE(librdf_model_change*, queue);
+}
+
+
+/**
+ * librdf_free_storage_changes:
+ * @changes: storage change feed
+ *
+ * INTERNAL - Destructor - free the change feed of a storage
+ *
+ * Changes not yet delivered are discarded.
+ */
+void
+librdf_free_storage_changes(librdf_storage_changes* changes)
+{
+  if(!changes)
+    return;
+
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&changes->mutex);
+#endif
+  librdf_storage_changes_free_queue(changes->queue, changes->queue_count);
+  if(changes->handlers)
+    LIBRDF_FREE(librdf_storage_change_handler*, changes->handlers);
+  LIBRDF_FREE(librdf_storage_changes, changes);
+}
+
+
+/* Set the queue limit to the largest handler queue size; locked */
+static void
+librdf_storage_changes_set_limit(librdf_storage_changes* changes)
+{
+  int i;
+
+  changes->queue_limit = 0;
+  for(i = 0; i < changes->handlers_count; i++) {
+    if(changes->handlers[i].queue_size > changes->queue_limit)
+      changes->queue_limit = changes->handlers[i].queue_size;
+  }
+}
+
+
+/**
+ * librdf_storage_add_change_handler:
+ * @storage: storage
+ * @model: model passed to the handler
+ * @handler: change handler
+ * @user_data: user data passed to the handler
+ * @queue_size: most changes passed to the handler at once, or 0 for
+ *   the default
+ *
+ * INTERNAL - Register a handler for the changes made to a storage
+ *
+ * Return value: non 0 on failure
+ */
+int
+librdf_storage_add_change_handler(librdf_storage* storage,
+                                  librdf_model* model,
+                                  librdf_model_change_handler handler,
+                                  void* user_data, int queue_size)
+{
+  librdf_storage_changes* changes = storage->changes;
+  int status = 0;
+
+  if(!handler || queue_size < 0)
+    return 1;
+  if(!queue_size)
+    queue_size = LIBRDF_STORAGE_CHANGES_QUEUE_SIZE;
+
+  if(!changes) {
+    changes = LIBRDF_CALLOC(librdf_storage_changes*, 1, sizeof(*changes));
+    if(!changes)
+      return 1;
+#ifdef WITH_THREADS
+    pthread_mutex_init(&changes->mutex, NULL);
+#endif
+    storage->changes = changes;
+  }
+
+  librdf_storage_changes_lock(changes);
+  if(changes->handlers_count == changes->handlers_size) {
+    librdf_storage_change_handler* handlers;
+    int size = changes->handlers_size ? changes->handlers_size * 2 : 4;
+
+    handlers = LIBRDF_MALLOC(librdf_storage_change_handler*,
+                             LIBRDF_GOOD_CAST(size_t, size) * sizeof(*handlers));
+    if(!handlers)
+      status = 1;
+    else {
+      if(changes->handlers) {
+        memcpy(handlers, changes->handlers,
+               LIBRDF_GOOD_CAST(size_t, changes->handlers_count) * sizeof(*handlers));
+        LIBRDF_FREE(librdf_storage_change_handler*, changes->handlers);
+      }
+      changes->handlers = handlers;
+      changes->handlers_size = size;
+    }
+  }
+
+  if(!status) {
+    librdf_storage_change_handler* h;
+
+    h = &changes->handlers[changes->handlers_count++];
+    h->model = model;
+    h->handler = handler;
+    h->user_data = user_data;
+    h->queue_size = queue_size;
+    librdf_storage_changes_set_limit(changes);
+  }
+  librdf_storage_changes_unlock(changes);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_remove_change_handler:
+ * @storage: storage
+ * @handler: change handler
+ * @user_data: user data the handler was registered with
+ *
+ * INTERNAL - Unregister a handler for the changes made to a storage
+ *
+ * Return value: non 0 if the handler was not registered
+ */
+int
+librdf_storage_remove_change_handler(librdf_storage* storage,
+                                     librdf_model_change_handler handler,
+                                     void* user_data)
+{
+  librdf_storage_changes* changes = storage->changes;
+  int status = 1;
+  int i;
+
+  if(!changes)
+    return 1;
+
+  librdf_storage_changes_lock(changes);
+  for(i = 0; i < changes->handlers_count; i++) {
+    if(changes->handlers[i].handler == handler &&
+       changes->handlers[i].user_data == user_data) {
+      memmove(&changes->handlers[i], &changes->handlers[i + 1],
+              LIBRDF_GOOD_CAST(size_t, changes->handlers_count - i - 1) * sizeof(*changes->handlers));
+      changes->handlers_count--;
+      librdf_storage_changes_set_limit(changes);
+      status = 0;
+      break;
+    }
+  }
+  librdf_storage_changes_unlock(changes);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_changes_record:
+ * @storage: storage
+ * @type: addition or removal
+ * @statement: statement added or removed
+ * @context: context node or NULL
+ *
+ * INTERNAL - Queue a copy of a change for the change handlers
+ */
+void
+librdf_storage_changes_record(librdf_storage* storage,
+                              librdf_model_change_type type,
+                              librdf_statement* statement,
+                              librdf_node* context)
+{
+  librdf_storage_changes* changes = storage->changes;
+  librdf_model_change* change;
+
+  if(!changes || !changes->handlers_count)
+    return;
+
+  librdf_storage_changes_lock(changes);
+  if(changes->queue_count == changes->queue_size) {
+    librdf_model_change* queue = NULL;
+    int size = changes->queue_size ? changes->queue_size * 2 : 64;
+
+    if(size > changes->queue_limit)
+      size = changes->queue_limit;
+    if(size > changes->queue_size)
+      queue = LIBRDF_MALLOC(librdf_model_change*,
+                            LIBRDF_GOOD_CAST(size_t, size) * sizeof(*queue));
+    if(!queue) {
+      /* full or out of memory */
+      changes->lost++;
+      librdf_storage_changes_unlock(changes);
+      return;
+    }
+    if(changes->queue) {
+      memcpy(queue, changes->queue,
+             LIBRDF_GOOD_CAST(size_t, changes->queue_count) * sizeof(*queue));
+      LIBRDF_FREE(librdf_model_change*, changes->queue);
+    }
+    changes->queue = queue;
+    changes->queue_size = size;
+  }
+
+  change = &changes->queue[changes->queue_count];
+  change->type = type;
+  change->statement = librdf_new_statement_from_statement(statement);
+  change->context = context ? librdf_new_node_from_node(context) : NULL;
+  if(!change->statement || (context && !change->context)) {
+    if(change->statement)
+      librdf_free_statement(change->statement);
+    changes->lost++;
+  } else
+    changes->queue_count++;
+  librdf_storage_changes_unlock(changes);
+}
+
+
+static librdf_statement*
+librdf_storage_changes_add_map(librdf_stream* stream, void* map_context,
+                               librdf_statement* statement)
+{
+  librdf_storage_changes_stream_context* scontext;
+
+  scontext = (librdf_storage_changes_stream_context*)map_context;
+  librdf_storage_changes_record(scontext->storage, LIBRDF_MODEL_CHANGE_ADD,
+                                statement, scontext->context);
+  return statement;
+}
+
+
+static void
+librdf_storage_changes_add_map_free(void* map_context)
+{
+  librdf_storage_changes_stream_context* scontext;
+
+  scontext = (librdf_storage_changes_stream_context*)map_context;
+  if(scontext->context)
+    librdf_free_node(scontext->context);
+  LIBRDF_FREE(librdf_storage_changes_stream_context, scontext);
+}
+
+
+/**
+ * librdf_storage_changes_add_stream:
+ * @storage: storage
+ * @stream: stream of statements about to be added
+ * @context: context node or NULL
+ *
+ * INTERNAL - Queue each statement as an addition as it is read from a stream
+ *
+ * Return value: non 0 on failure
+ */
+int
+librdf_storage_changes_add_stream(librdf_storage* storage,
+                                  librdf_stream* stream, librdf_node* context)
+{
+  librdf_storage_changes_stream_context* scontext;
+
+  if(!librdf_storage_changes_active(storage))
+    return 0;
+
+  /* a current statement already got has been past the maps */
+  if(stream->is_updated && stream->current)
+    librdf_storage_changes_record(storage, LIBRDF_MODEL_CHANGE_ADD,
+                                  stream->current, context);
+
+  scontext = LIBRDF_CALLOC(librdf_storage_changes_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return 1;
+  scontext->storage = storage;
+  if(context) {
+    scontext->context = librdf_new_node_from_node(context);
+    if(!scontext->context) {
+      LIBRDF_FREE(librdf_storage_changes_stream_context, scontext);
+      return 1;
+    }
+  }
+
+  return librdf_stream_add_map(stream, librdf_storage_changes_add_map,
+                               librdf_storage_changes_add_map_free, scontext);
+}
+
+
+/**
+ * librdf_storage_changes_active:
+ * @storage: storage
+ *
+ * INTERNAL - Check if any change handlers are registered
+ *
+ * Return value: non 0 if changes are being recorded
+ */
+int
+librdf_storage_changes_active(librdf_storage* storage)
+{
+  librdf_storage_changes* changes = storage->changes;
+
+  return changes && changes->handlers_count;
+}
+
+
+/**
+ * librdf_storage_changes_lost:
+ * @storage: storage
+ *
+ * INTERNAL - Mark the queued changes as incomplete after a failed call
+ */
+void
+librdf_storage_changes_lost(librdf_storage* storage)
+{
+  librdf_storage_changes* changes = storage->changes;
+
+  if(!changes || !changes->handlers_count)
+    return;
+
+  librdf_storage_changes_lock(changes);
+  changes->lost++;
+  librdf_storage_changes_unlock(changes);
+}
+
+
+/*
+ * librdf_storage_changes_deliver:
+ * @storage: storage
+ * @discard: non 0 to free the changes without calling the handlers
+ *
+ * INTERNAL - Hand the queued changes to the handlers
+ *
+ * The handlers are called without the lock held so they may use the
+ * model, including changing it, which starts a new batch.
+ */
+static void
+librdf_storage_changes_deliver(librdf_storage* storage, int discard)
+{
+  librdf_storage_changes* changes = storage->changes;
+  librdf_storage_change_handler* handlers = NULL;
+  librdf_model_change* queue;
+  int handlers_count = 0;
+  int count;
+  int lost;
+  int i;
+
+  librdf_storage_changes_lock(changes);
+  queue = changes->queue;
+  count = changes->queue_count;
+  lost = changes->lost;
+  changes->queue = NULL;
+  changes->queue_count = 0;
+  changes->queue_size = 0;
+  changes->lost = 0;
+
+  if(!discard && (count || lost) && changes->handlers_count) {
+    /* a copy, as handlers may be removed by a handler */
+    handlers = LIBRDF_MALLOC(librdf_storage_change_handler*,
+                             LIBRDF_GOOD_CAST(size_t, changes->handlers_count) * sizeof(*handlers));
+    if(handlers) {
+      handlers_count = changes->handlers_count;
+      memcpy(handlers, changes->handlers,
+             LIBRDF_GOOD_CAST(size_t, handlers_count) * sizeof(*handlers));
+    }
+  }
+  librdf_storage_changes_unlock(changes);
+
+  for(i = 0; i < handlers_count; i++) {
+    librdf_storage_change_handler* h = &handlers[i];
+    int h_count = count;
+
+    /* a handler sees at most its queue size of the changes */
+    if(h_count > h->queue_size)
+      h_count = h->queue_size;
+    h->handler(h->user_data, h->model, queue, h_count,
+               lost + count - h_count);
+  }
+
+  if(handlers)
+    LIBRDF_FREE(librdf_storage_change_handler*, handlers);
+  librdf_storage_changes_free_queue(queue, count);
+}
+
+
+/**
+ * librdf_storage_changes_start:
+ * @storage: storage
+ *
+ * INTERNAL - Start a storage API call that may change the storage
+ */
+void
+librdf_storage_changes_start(librdf_storage* storage)
+{
+  librdf_storage_changes* changes = storage->changes;
+
+  if(!changes)
+    return;
+
+  librdf_storage_changes_lock(changes);
+  changes->depth++;
+  librdf_storage_changes_unlock(changes);
+}
+
+
+/**
+ * librdf_storage_changes_end:
+ * @storage: storage
+ *
+ * INTERNAL - End a storage API call, delivering the changes queued by
+ * the outermost call made outside a transaction
+ */
+void
+librdf_storage_changes_end(librdf_storage* storage)
+{
+  librdf_storage_changes* changes = storage->changes;
+  int deliver;
+
+  if(!changes)
+    return;
+
+  librdf_storage_changes_lock(changes);
+  /* the handlers may have been registered inside the call */
+  if(changes->depth > 0)
+    changes->depth--;
+  deliver = !changes->depth && !changes->in_transaction &&
+            (changes->queue_count || changes->lost);
+  librdf_storage_changes_unlock(changes);
+
+  if(deliver)
+    librdf_storage_changes_deliver(storage, 0);
+}
+
+
+/**
+ * librdf_storage_changes_transaction:
+ * @storage: storage
+ * @state: 1 when a transaction started, 0 when it was committed or
+ *   -1 when it was rolled back or failed to commit
+ *
+ * INTERNAL - Hold the changes while a transaction is open
+ */
+void
+librdf_storage_changes_transaction(librdf_storage* storage, int state)
+{
+  librdf_storage_changes* changes = storage->changes;
+
+  if(!changes)
+    return;
+
+  librdf_storage_changes_lock(changes);
+  changes->in_transaction = (state > 0);
+  librdf_storage_changes_unlock(changes);
+
+  if(state <= 0)
+    librdf_storage_changes_deliver(storage, state < 0);
+}
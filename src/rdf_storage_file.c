@@ -47,12 +47,22 @@
 #include <redland.h>
 
 
+/* In append mode the file is rewritten in full at sync when the
+ * tombstones are more than 1/LIBRDF_STORAGE_FILE_COMPACT_RATIO of
+ * the statements */
+#define LIBRDF_STORAGE_FILE_COMPACT_RATIO 4
+
+
 typedef struct
 {
   librdf_model* model;
   librdf_storage* storage;
   int changed;
 
+  /* if the file has been read into the model; with the lazy option
+   * that is done on first use */
+  int loaded;
+
   /* 'uri' factory only */
   librdf_uri* uri;
   /* 'file' factory only */
@@ -61,6 +71,19 @@ typedef struct
 
   /* serializing format ('file' factory only) */
   char *format_name;
+
+  /* append-log mode for line-oriented formats ('file' factory only):
+   * statements added since the last sync, to append to the file, and
+   * statements still in the file but removed, kept in the tombstones
+   * file name".removed" */
+  int append;
+  librdf_model* added;
+  librdf_model* removed;
+  char *tombstones_name;
+  /* if the tombstones file is out of date */
+  int tombstones_changed;
+  /* if the next sync must write the whole file */
+  int rewrite;
 } librdf_storage_file_instance;
 
 
@@ -77,6 +100,9 @@ static librdf_stream* librdf_storage_file_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_file_find_statements(librdf_storage* storage, librdf_statement* statement);
 
 static int librdf_storage_file_sync(librdf_storage *storage);
+static librdf_model* librdf_storage_file_new_log_model(librdf_world* world);
+static int librdf_storage_file_load_tombstones(librdf_storage* storage);
+static int librdf_storage_file_load(librdf_storage* storage);
 
 static void librdf_storage_file_register_factory(librdf_storage_factory *factory);
 
@@ -88,6 +114,7 @@ librdf_storage_file_init(librdf_storage* storage, const char *name,
 {
   char *name_copy;
   char *contexts;
+  int lazy;
   int rc = 1;
   int is_uri = !strcmp(storage->factory->name, "uri");
   const char *format_name = (is_uri ? "guess" : "rdfxml");
@@ -121,6 +148,17 @@ librdf_storage_file_init(librdf_storage* storage, const char *name,
     if(context->format_name)
       format_name = context->format_name;
   }
+
+  lazy = (librdf_hash_get_as_boolean(options, "lazy") > 0);
+
+  if(!is_uri && librdf_hash_get_as_boolean(options, "append") > 0) {
+    if(strcmp(format_name, "ntriples") && strcmp(format_name, "nquads"))
+      librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+                 "Ignoring storage %s append option - format '%s' is not line-oriented",
+                 storage->factory->name, format_name);
+    else
+      context->append = 1;
+  }
   
 
   if(is_uri)
@@ -133,6 +171,20 @@ librdf_storage_file_init(librdf_storage* storage, const char *name,
     strcpy(name_copy,name);
     context->name = name_copy;
     context->uri = librdf_new_uri_from_filename(storage->world, context->name);
+
+    if(context->append) {
+      /* name".removed\0" */
+      context->tombstones_name = LIBRDF_MALLOC(char*, context->name_len + 9);
+      if(!context->tombstones_name)
+        goto done;
+      strcpy(context->tombstones_name, context->name);
+      strcpy(context->tombstones_name + context->name_len, ".removed");
+
+      context->added = librdf_storage_file_new_log_model(storage->world);
+      context->removed = librdf_storage_file_new_log_model(storage->world);
+      if(!context->added || !context->removed)
+        goto done;
+    }
   }
   
   context->storage = librdf_new_storage_with_options(storage->world, 
@@ -145,17 +197,8 @@ librdf_storage_file_init(librdf_storage* storage, const char *name,
   if(!context->model)
     goto done;
 
-  if(is_uri || !access((const char*)context->name, F_OK)) {
-    librdf_parser *parser;
-
-    parser = librdf_new_parser(storage->world, format_name, NULL, NULL);
-    if(!parser) {
-      rc = 1;
-      goto done;
-    }
-    librdf_parser_parse_into_model(parser, context->uri, NULL, context->model);
-    librdf_free_parser(parser);
-  }
+  if(!lazy && librdf_storage_file_load(storage))
+    goto done;
 
   context->changed = 0;
 
@@ -171,6 +214,58 @@ librdf_storage_file_init(librdf_storage* storage, const char *name,
 }
 
 
+/*
+ * librdf_storage_file_parser_name - INTERNAL - Get the syntax name to read the file with
+ * @storage: storage
+ *
+ * Return value: parser name
+ */
+static const char*
+librdf_storage_file_parser_name(librdf_storage* storage)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+
+  if(context->format_name)
+    return context->format_name;
+
+  return context->name ? "rdfxml" : "guess";
+}
+
+
+/*
+ * librdf_storage_file_load - INTERNAL - Read the file into the model if not done yet
+ * @storage: storage
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_file_load(librdf_storage* storage)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  librdf_parser *parser;
+
+  if(context->loaded)
+    return 0;
+
+  if(!context->name || !access((const char*)context->name, F_OK)) {
+    parser = librdf_new_parser(storage->world,
+                               librdf_storage_file_parser_name(storage),
+                               NULL, NULL);
+    if(!parser)
+      return 1;
+    librdf_parser_parse_into_model(parser, context->uri, NULL, context->model);
+    librdf_free_parser(parser);
+
+    if(context->append && librdf_storage_file_load_tombstones(storage))
+      return 1;
+  }
+
+  context->loaded = 1;
+
+  return 0;
+}
+
+
 static void
 librdf_storage_file_terminate(librdf_storage* storage)
 {
@@ -187,6 +282,15 @@ librdf_storage_file_terminate(librdf_storage* storage)
   if(context->name)
     LIBRDF_FREE(char*, context->name);
 
+  if(context->tombstones_name)
+    LIBRDF_FREE(char*, context->tombstones_name);
+
+  if(context->added)
+    librdf_free_model(context->added);
+
+  if(context->removed)
+    librdf_free_model(context->removed);
+
   if(context->uri)
     librdf_free_uri(context->uri);
 
@@ -218,16 +322,171 @@ static int
 librdf_storage_file_size(librdf_storage* storage)
 {
   librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+
+  if(librdf_storage_file_load(storage))
+    return -1;
+
   return librdf_model_size(context->model);
 }
 
 
+/*
+ * librdf_storage_file_new_log_model - INTERNAL - Make an empty in-memory model for append mode
+ * @world: world object
+ *
+ * Return value: new model or NULL on failure
+ */
+static librdf_model*
+librdf_storage_file_new_log_model(librdf_world* world)
+{
+  librdf_storage* storage;
+  librdf_model* model;
+
+  storage = librdf_new_storage(world, NULL, NULL, NULL);
+  if(!storage)
+    return NULL;
+
+  /* the model keeps a reference to the storage */
+  model = librdf_new_model(world, storage, NULL);
+  librdf_free_storage(storage);
+
+  return model;
+}
+
+
+/*
+ * librdf_storage_file_has_blank - INTERNAL - Check if a statement has a blank node
+ * @statement: statement
+ *
+ * Blank node identifiers are not kept between parses so such
+ * statements cannot be appended or tombstoned.
+ *
+ * Return value: non-0 if the subject or object is a blank node
+ */
+static int
+librdf_storage_file_has_blank(librdf_statement* statement)
+{
+  return librdf_node_is_blank(librdf_statement_get_subject(statement)) ||
+         librdf_node_is_blank(librdf_statement_get_object(statement));
+}
+
+
+/*
+ * librdf_storage_file_load_tombstones - INTERNAL - Remove the statements in the tombstones file
+ * @storage: storage
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_file_load_tombstones(librdf_storage* storage)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  librdf_parser *parser;
+  librdf_uri *uri;
+  librdf_stream *stream;
+  int rc = 0;
+
+  if(access((const char*)context->tombstones_name, F_OK))
+    return 0;
+
+  uri = librdf_new_uri_from_filename(storage->world, context->tombstones_name);
+  if(!uri)
+    return 1;
+
+  parser = librdf_new_parser(storage->world, "ntriples", NULL, NULL);
+  if(!parser) {
+    librdf_free_uri(uri);
+    return 1;
+  }
+
+  stream = librdf_parser_parse_as_stream(parser, uri, NULL);
+  if(!stream)
+    rc = 1;
+  else {
+    for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+      librdf_statement* statement = librdf_stream_get_object(stream);
+
+      librdf_model_remove_statement(context->model, statement);
+      if(librdf_model_add_statement(context->removed, statement)) {
+        rc = 1;
+        break;
+      }
+    }
+    librdf_free_stream(stream);
+  }
+
+  librdf_free_parser(parser);
+  librdf_free_uri(uri);
+
+  return rc;
+}
+
+
+/*
+ * librdf_storage_file_reset_log - INTERNAL - Forget the append mode changes after a full write
+ * @storage: storage
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_file_reset_log(librdf_storage* storage)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+
+  if(!access((const char*)context->tombstones_name, F_OK) &&
+     unlink(context->tombstones_name) < 0) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "delete of '%s' failed - %s",
+               context->tombstones_name, strerror(errno));
+    return 1;
+  }
+
+  librdf_free_model(context->added);
+  librdf_free_model(context->removed);
+  context->added = librdf_storage_file_new_log_model(storage->world);
+  context->removed = librdf_storage_file_new_log_model(storage->world);
+  if(!context->added || !context->removed)
+    return 1;
+
+  context->tombstones_changed = 0;
+  context->rewrite = 0;
+
+  return 0;
+}
+
+
 static int
 librdf_storage_file_add_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  int rc;
+
+  if(librdf_storage_file_load(storage))
+    return 1;
+
+  /* only real changes need a sync */
+  if(librdf_model_contains_statement(context->model, statement))
+    return 0;
+
+  rc = librdf_model_add_statement(context->model, statement);
+  if(rc)
+    return rc;
+
   context->changed=1;
-  return librdf_model_add_statement(context->model, statement);
+
+  if(!context->append || context->rewrite)
+    return 0;
+
+  if(librdf_storage_file_has_blank(statement))
+    context->rewrite=1;
+  else if(librdf_model_contains_statement(context->removed, statement)) {
+    /* still in the file, only the tombstone goes */
+    librdf_model_remove_statement(context->removed, statement);
+    context->tombstones_changed=1;
+  } else if(librdf_model_add_statement(context->added, statement))
+    context->rewrite=1;
+
+  return 0;
 }
 
 
@@ -235,9 +494,19 @@ static int
 librdf_storage_file_add_statements(librdf_storage* storage,
                                    librdf_stream* statement_stream)
 {
-  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
-  context->changed=1;
-  return librdf_model_add_statements(context->model, statement_stream);
+  int rc = 0;
+
+  for(; !librdf_stream_end(statement_stream);
+      librdf_stream_next(statement_stream)) {
+    librdf_statement* statement = librdf_stream_get_object(statement_stream);
+
+    if(!statement || librdf_storage_file_add_statement(storage, statement)) {
+      rc = 1;
+      break;
+    }
+  }
+
+  return rc;
 }
 
 
@@ -245,8 +514,34 @@ static int
 librdf_storage_file_remove_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  int rc;
+
+  if(librdf_storage_file_load(storage))
+    return 1;
+
+  if(!librdf_model_contains_statement(context->model, statement))
+    return 0;
+
+  rc = librdf_model_remove_statement(context->model, statement);
+  if(rc)
+    return rc;
+
   context->changed=1;
-  return librdf_model_remove_statement(context->model, statement);
+
+  if(!context->append || context->rewrite)
+    return 0;
+
+  if(librdf_storage_file_has_blank(statement))
+    context->rewrite=1;
+  else if(librdf_model_contains_statement(context->added, statement))
+    /* not in the file yet */
+    librdf_model_remove_statement(context->added, statement);
+  else if(librdf_model_add_statement(context->removed, statement))
+    context->rewrite=1;
+  else
+    context->tombstones_changed=1;
+
+  return 0;
 }
 
 
@@ -254,14 +549,134 @@ static int
 librdf_storage_file_contains_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+
+  if(librdf_storage_file_load(storage))
+    return 0;
+
   return librdf_model_contains_statement(context->model, statement);
 }
 
 
+typedef struct {
+  librdf_parser *parser;
+  librdf_stream *stream;
+} librdf_storage_file_parse_stream_context;
+
+
+static int
+librdf_storage_file_parse_stream_end(void* context)
+{
+  librdf_storage_file_parse_stream_context* scontext=(librdf_storage_file_parse_stream_context*)context;
+
+  return librdf_stream_end(scontext->stream);
+}
+
+
+static int
+librdf_storage_file_parse_stream_next(void* context)
+{
+  librdf_storage_file_parse_stream_context* scontext=(librdf_storage_file_parse_stream_context*)context;
+
+  return librdf_stream_next(scontext->stream);
+}
+
+
+static void*
+librdf_storage_file_parse_stream_get(void* context, int flags)
+{
+  librdf_storage_file_parse_stream_context* scontext=(librdf_storage_file_parse_stream_context*)context;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(scontext->stream);
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return NULL;
+    default:
+      librdf_log(scontext->parser->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_file_parse_stream_finished(void* context)
+{
+  librdf_storage_file_parse_stream_context* scontext=(librdf_storage_file_parse_stream_context*)context;
+
+  if(scontext->stream)
+    librdf_free_stream(scontext->stream);
+  if(scontext->parser)
+    librdf_free_parser(scontext->parser);
+  LIBRDF_FREE(librdf_storage_file_parse_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_file_parse_stream - INTERNAL - Stream the statements straight from the file
+ * @storage: storage
+ *
+ * Used to serialise a lazy store that has not been read, so the
+ * statements are not indexed or held in memory.
+ *
+ * Return value: new stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_file_parse_stream(librdf_storage* storage)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  librdf_storage_file_parse_stream_context* scontext;
+  librdf_stream* stream;
+
+  scontext = LIBRDF_CALLOC(librdf_storage_file_parse_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  scontext->parser = librdf_new_parser(storage->world,
+                                       librdf_storage_file_parser_name(storage),
+                                       NULL, NULL);
+  if(scontext->parser)
+    scontext->stream = librdf_parser_parse_as_stream(scontext->parser,
+                                                     context->uri, NULL);
+  if(!scontext->stream) {
+    librdf_storage_file_parse_stream_finished(scontext);
+    return NULL;
+  }
+
+  stream = librdf_new_stream(storage->world,
+                             (void*)scontext,
+                             &librdf_storage_file_parse_stream_end,
+                             &librdf_storage_file_parse_stream_next,
+                             &librdf_storage_file_parse_stream_get,
+                             &librdf_storage_file_parse_stream_finished);
+  if(!stream) {
+    librdf_storage_file_parse_stream_finished(scontext);
+    return NULL;
+  }
+
+  return stream;
+}
+
+
 static librdf_stream*
 librdf_storage_file_serialise(librdf_storage* storage)
 {
   librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+
+  /* Stream an unread file from the parser unless it has tombstones
+   * to apply or does not exist yet */
+  if(!context->loaded &&
+     (!context->name ||
+      (!access((const char*)context->name, F_OK) &&
+       (!context->append ||
+        access((const char*)context->tombstones_name, F_OK)))))
+    return librdf_storage_file_parse_stream(storage);
+
+  if(librdf_storage_file_load(storage))
+    return NULL;
+
   return librdf_model_as_stream(context->model);
 }
 
@@ -270,10 +685,162 @@ static librdf_stream*
 librdf_storage_file_find_statements(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+
+  if(librdf_storage_file_load(storage))
+    return NULL;
+
   return librdf_model_find_statements(context->model, statement);
 }
 
 
+/*
+ * librdf_storage_file_serialize_model - INTERNAL - Serialize a model to a file handle
+ * @storage: storage
+ * @serializer: serializer
+ * @fh: file handle
+ * @model: model to write
+ * @name: name of the file, for the compression
+ *
+ * The model is written gzip or zstd compressed when @name ends in .gz
+ * or .zst, which the parser also decompresses when the file is read.
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_file_serialize_model(librdf_storage* storage,
+                                    librdf_serializer* serializer,
+                                    FILE *fh, librdf_model* model,
+                                    const char* name)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  librdf_compression compression;
+  raptor_iostream* iostr;
+
+  compression = librdf_compression_from_filename(name);
+  if(compression == LIBRDF_COMPRESSION_NONE)
+    return librdf_serializer_serialize_model_to_file_handle(serializer, fh,
+                                                            context->uri,
+                                                            model);
+
+  iostr = librdf_new_compressed_iostream_to_file_handle(storage->world, fh,
+                                                        compression);
+  if(!iostr)
+    return 1;
+
+  /* takes ownership of iostr and ends the compressed data */
+  return librdf_serializer_serialize_model_to_iostream(serializer,
+                                                       context->uri, model,
+                                                       iostr);
+}
+
+
+/*
+ * librdf_storage_file_write_model - INTERNAL - Write a model to a file with the storage format
+ * @storage: storage
+ * @model: model to write
+ * @name: file name
+ * @mode: fopen() mode, "a" to append to the file
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_file_write_model(librdf_storage* storage, librdf_model* model,
+                                const char* name, const char* mode)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  librdf_serializer* serializer;
+  FILE *fh;
+  int rc;
+
+  serializer = librdf_new_serializer(storage->world, context->format_name,
+                                     NULL, NULL);
+  if(!serializer)
+    return 1;
+
+  fh=fopen(name, mode);
+  if(!fh) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "failed to open file '%s' for writing - %s",
+               name, strerror(errno));
+    librdf_free_serializer(serializer);
+    return 1;
+  }
+
+  rc = librdf_storage_file_serialize_model(storage, serializer, fh, model,
+                                           name);
+  if(fclose(fh))
+    rc = 1;
+  librdf_free_serializer(serializer);
+
+  return rc;
+}
+
+
+/*
+ * librdf_storage_file_sync_append - INTERNAL - Write append mode changes
+ * @storage: storage
+ *
+ * Appends the statements added since the last sync to the file and
+ * replaces the tombstones file if removals changed it.
+ *
+ * Return value: non-0 on failure
+ */
+static int
+librdf_storage_file_sync_append(librdf_storage* storage)
+{
+  librdf_storage_file_instance* context=(librdf_storage_file_instance*)storage->instance;
+  char *new_name;
+  int rc = 0;
+
+  if(librdf_model_size(context->added) > 0) {
+    if(librdf_storage_file_write_model(storage, context->added,
+                                       context->name, "a"))
+      return 1;
+
+    librdf_free_model(context->added);
+    context->added = librdf_storage_file_new_log_model(storage->world);
+    if(!context->added)
+      return 1;
+  }
+
+  if(!context->tombstones_changed)
+    return 0;
+
+  if(!librdf_model_size(context->removed)) {
+    if(!access((const char*)context->tombstones_name, F_OK) &&
+       unlink(context->tombstones_name) < 0) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "delete of '%s' failed - %s",
+                 context->tombstones_name, strerror(errno));
+      return 1;
+    }
+    context->tombstones_changed = 0;
+    return 0;
+  }
+
+  /* tombstones_name".new\0" */
+  new_name = LIBRDF_MALLOC(char*, strlen(context->tombstones_name) + 5);
+  if(!new_name)
+    return 1;
+  strcpy(new_name, context->tombstones_name);
+  strcat(new_name, ".new");
+
+  if(librdf_storage_file_write_model(storage, context->removed, new_name, "w"))
+    rc = 1;
+  else if(rename(new_name, context->tombstones_name) < 0) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "rename of '%s' to '%s' failed - %s",
+               new_name, context->tombstones_name, strerror(errno));
+    rc = 1;
+  } else
+    context->tombstones_changed = 0;
+
+  LIBRDF_FREE(char*, new_name);
+
+  return rc;
+}
+
+
 static int
 librdf_storage_file_sync(librdf_storage *storage)
 {
@@ -292,6 +859,19 @@ librdf_storage_file_sync(librdf_storage *storage)
     context->changed=0;
     return 0;
   }
+
+  if(context->append && !context->rewrite &&
+     !access((const char*)context->name, F_OK) &&
+     librdf_model_size(context->removed) * LIBRDF_STORAGE_FILE_COMPACT_RATIO <=
+       librdf_model_size(context->model)) {
+    rc = librdf_storage_file_sync_append(storage);
+    if(rc)
+      /* the file may be part written; write it all next time */
+      context->rewrite=1;
+    else
+      context->changed=0;
+    return rc;
+  }
   
   backup_name=NULL;
 
@@ -339,9 +919,8 @@ librdf_storage_file_sync(librdf_storage *storage)
                new_name, strerror(errno));
     rc=1;
   } else {
-    librdf_serializer_serialize_model_to_file_handle(serializer, fh,
-                                                     context->uri,
-                                                     context->model);
+    librdf_storage_file_serialize_model(storage, serializer, fh,
+                                        context->model, context->name);
     fclose(fh);
   }
   librdf_free_serializer(serializer);
@@ -367,6 +946,10 @@ librdf_storage_file_sync(librdf_storage *storage)
   if(backup_name)
     LIBRDF_FREE(char*, backup_name);
 
+  /* the file now has everything; tombstones are no longer needed */
+  if(!rc && context->append && librdf_storage_file_reset_log(storage))
+    rc=1;
+
   context->changed=0;
 
   return rc;
@@ -40,8 +40,13 @@
 #endif
 
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
 #include <redland.h>
 #include <rdf_storage.h>
+#include <rdf_types.h>
 
 
 typedef struct 
@@ -65,6 +70,24 @@ static const librdf_hash_descriptor librdf_storage_hashes_descriptions[]= {
   {"p2so", 
    LIBRDF_STATEMENT_PREDICATE,
    LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT},  /* For '(?, p, ?)' */
+  {"s2po", 
+   LIBRDF_STATEMENT_SUBJECT,
+   LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT},  /* For '(s, ?, ?)' */
+  {"o2sp", 
+   LIBRDF_STATEMENT_OBJECT,
+   LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE},  /* For '(?, ?, o)' */
+  {"node2id",
+   0L, /* node dictionary - not statements */
+   0L},
+  {"id2node",
+   0L, /* node dictionary - not statements */
+   0L},
+  {"prefixes",
+   0L, /* URI prefix dictionary - not statements */
+   0L},
+  {"stats",
+   0L, /* statistics - not statements */
+   0L},
   {"contexts",
    0L, /* for contexts - do not touch when storing statements! */
    0L},
@@ -89,6 +112,78 @@ librdf_storage_get_hash_description_by_name(const char *name)
 }
 
 
+/* Node ids are big endian so that they compare as numbers */
+#define LIBRDF_STORAGE_HASHES_NODE_ID_SIZE 8
+
+/* The id2node key holding the next node id to assign */
+static const unsigned char librdf_storage_hashes_next_node_id_key[LIBRDF_STORAGE_HASHES_NODE_ID_SIZE]={0, 0, 0, 0, 0, 0, 0, 0};
+
+#define LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE 8
+
+/* Prefix ids are big endian keys of the prefixes hash */
+#define LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE 4
+
+/* Shortest URI prefix worth a prefixes hash entry */
+#define LIBRDF_STORAGE_HASHES_PREFIX_MIN 8
+
+/* Default bytes of encoded statements sorted per bulk load batch */
+#define LIBRDF_STORAGE_HASHES_BULK_LOAD_BUFFER (64*1024*1024)
+
+/* Number of smallest node hashes kept to estimate distinct nodes */
+#define LIBRDF_STORAGE_HASHES_DISTINCT_K 256
+
+#define LIBRDF_STORAGE_HASHES_PREDICATE_BUCKETS 256
+
+/* Values per compressed value block, and plain values added to a key
+ * before it is packed into blocks */
+#define LIBRDF_STORAGE_HASHES_BLOCK_VALUES 128
+
+/* Counters of plain values added, shared by keys hashing alike */
+#define LIBRDF_STORAGE_HASHES_PACK_BUCKETS 4096
+
+/* Node ids of a value: up to three statement parts and a context */
+#define LIBRDF_STORAGE_HASHES_TUPLE_SIZE 4
+
+typedef struct {
+  u64 ids[LIBRDF_STORAGE_HASHES_TUPLE_SIZE]; /* unused ids are 0 */
+} librdf_storage_hashes_tuple;
+
+typedef struct {
+  u64 minimums[LIBRDF_STORAGE_HASHES_DISTINCT_K]; /* ascending */
+  int count;
+} librdf_storage_hashes_distinct;
+
+typedef struct librdf_storage_hashes_predicate_count_s librdf_storage_hashes_predicate_count;
+struct librdf_storage_hashes_predicate_count_s {
+  librdf_storage_hashes_predicate_count* next;
+  unsigned char *key; /* 'p' + predicate node encoding */
+  size_t key_len;
+  long count;
+  int dirty; /* changed since the last save */
+};
+
+/* The encoded key and value of a statement for one hash */
+typedef struct {
+  unsigned char *key_buffer;
+  size_t key_buffer_len;
+  size_t key_len; /* 0 if nothing is written to this hash */
+  unsigned char *value_buffer;
+  size_t value_buffer_len;
+  size_t value_len;
+  /* for a compressed hash, plain values added per counter since the
+   * last pack, else NULL */
+  int *pack_counts;
+} librdf_storage_hashes_index_write;
+
+/* A unit of work on one hash; returns non 0 on failure */
+typedef int (*librdf_storage_hashes_task)(librdf_storage* storage, int hash_index, void* task_data);
+
+#ifdef WITH_THREADS
+typedef struct librdf_storage_hashes_pool_s librdf_storage_hashes_pool;
+#endif
+
+typedef struct librdf_storage_hashes_bulk_s librdf_storage_hashes_bulk;
+
 typedef struct
 {
   /* from init() argument */
@@ -114,6 +209,8 @@ typedef struct
   int targets_index;
 
   int p2so_index;
+  int s2po_index;
+  int o2sp_index;
 
   /* If this is non-0, contexts are being used */
   int index_contexts;
@@ -121,11 +218,84 @@ typedef struct
 
   int all_statements_hash_index;
 
+  /* If this is non-0, statements are stored as node ids from the
+   * node2id and id2node hashes */
+  int dictionary;
+  int node2id_index;
+  int id2node_index;
+  u64 next_node_id;
+  /* If this is non-0, index values are packed into compressed blocks */
+  int compress_values;
+  /* recently used nodes and their ids */
+  librdf_node* node_id_cache_nodes[LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE];
+  unsigned char node_id_cache_ids[LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE][LIBRDF_STORAGE_HASHES_NODE_ID_SIZE];
+  int node_id_cache_next;
+
+  /* If this is 2, statements are encoded with varint lengths and URIs
+   * as a prefix id from the prefixes hash plus the rest of the URI */
+  int key_encoding;
+  int prefixes_index;
+  /* prefixes by id (id 0 is no prefix) and prefix to id bytes */
+  unsigned char** prefixes;
+  size_t* prefix_lens;
+  int prefixes_count;
+  int prefixes_size;
+  librdf_hash* prefix_ids;
+
+  /* If this is non-0, add_statements sorts batches of statements
+   * before writing them to the hashes */
+  int bulk_load;
+  size_t bulk_load_buffer;
+
   /* growing buffers used to en/decode keys/values */
   unsigned char *key_buffer;
   size_t key_buffer_len;
   unsigned char *value_buffer;
   size_t value_buffer_len;
+  unsigned char *node_buffer;
+  size_t node_buffer_len;
+
+  /* array of size hash_count of statement writes for each hash */
+  librdf_storage_hashes_index_write* writes;
+
+#ifdef WITH_THREADS
+  /* workers for writing the hashes in parallel or NULL */
+  librdf_storage_hashes_pool* pool;
+#endif
+  /* non 0 between transaction start and commit or rollback */
+  int in_transaction;
+  /* non 0 if every hash runs a transaction of its own for it */
+  int hash_transactions;
+  /* statements added in the transaction, written sorted at commit */
+  librdf_storage_hashes_bulk* transaction_bulk;
+  /* non 0 once the buffer above was written before the commit */
+  int transaction_flushed;
+
+  /* If this is non-0, statistics are kept and saved in the stats hash */
+  int statistics;
+  int stats_index;
+  long statements_count;
+  /* for subjects, predicates and objects */
+  librdf_storage_hashes_distinct distinct[3];
+  librdf_storage_hashes_predicate_count* predicate_counts[LIBRDF_STORAGE_HASHES_PREDICATE_BUCKETS];
+  int stats_dirty;
+  unsigned char *stats_buffer;
+  size_t stats_buffer_len;
+
+  /* If this is non-0, clones are read-only snapshots of this storage */
+  int snapshot_clones;
+  /* for a snapshot clone: the storage read, or NULL */
+  librdf_storage* snapshot_of;
+
+  /* text index of the object literals, made by the first text find */
+  librdf_literal_index* literal_index;
+
+  /* If this is non-0, reads from several threads share this storage
+   * and the lock below guards the shared buffers and caches */
+  int concurrent;
+#ifdef WITH_THREADS
+  pthread_mutex_t lock;
+#endif
 } librdf_storage_hashes_instance;
 
 
@@ -146,16 +316,37 @@ static int librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_s
 static int librdf_storage_hashes_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_hashes_contains_statement_locked(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_hashes_transaction_add_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_hashes_transaction_flush(librdf_storage* storage);
+static void librdf_storage_hashes_free_bulk(librdf_storage* storage, librdf_storage_hashes_bulk* bulk);
 static librdf_stream* librdf_storage_hashes_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_hashes_find_statements(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_hashes_find_statements_with_options(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, librdf_hash* options);
 static librdf_iterator* librdf_storage_hashes_find_sources(librdf_storage* storage, librdf_node* arc, librdf_node *target);
 static librdf_iterator* librdf_storage_hashes_find_arcs(librdf_storage* storage, librdf_node* source, librdf_node *target);
 static librdf_iterator* librdf_storage_hashes_find_targets(librdf_storage* storage, librdf_node* source, librdf_node *arc);
+static librdf_iterator* librdf_storage_hashes_get_arcs_in(librdf_storage* storage, librdf_node* node);
+static librdf_iterator* librdf_storage_hashes_get_arcs_out(librdf_storage* storage, librdf_node* node);
+static int librdf_storage_hashes_has_arc_in(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static int librdf_storage_hashes_has_arc_out(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static int librdf_storage_hashes_load_next_node_id(librdf_storage* storage);
+static int librdf_storage_hashes_stats_load(librdf_storage* storage);
+static int librdf_storage_hashes_stats_save(librdf_storage* storage);
+static int librdf_storage_hashes_stats_update(librdf_storage* storage, librdf_statement* statement, int delta);
+static void librdf_storage_hashes_stats_free(librdf_storage_hashes_instance* context);
+static size_t librdf_storage_hashes_encode(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, unsigned char **buffer_p, size_t *buffer_len_p, librdf_statement_part fields, int create, int *missing_p);
+static size_t librdf_storage_hashes_decode(librdf_storage* storage, librdf_statement* statement, librdf_node** context_node, unsigned char *buffer, size_t length);
+static int librdf_storage_hashes_load_prefixes(librdf_storage* storage);
+static void librdf_storage_hashes_free_prefixes(librdf_storage_hashes_instance* context);
+static size_t librdf_storage_hashes_put_varint(unsigned char *p, u64 v);
+static int librdf_storage_hashes_get_varint(const unsigned char **p_p, const unsigned char *end, u64 *v_p);
 
 /* serialising implementing functions */
 static int librdf_storage_hashes_serialise_end_of_stream(void* context);
 static int librdf_storage_hashes_serialise_next_statement(void* context);
 static void* librdf_storage_hashes_serialise_get_statement(void* context, int flags);
+static int librdf_storage_hashes_serialise_next_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 static void librdf_storage_hashes_serialise_finished(void* context);
 
 /* context functions */
@@ -229,6 +420,237 @@ librdf_storage_hashes_register(librdf_storage *storage,
   return (context->hashes[hash_index] == NULL);
 }
 
+/*
+ * librdf_storage_hashes_index_wanted - Check if the indexes option names an index
+ * @storage: the storage
+ * @indexes: indexes option value or NULL
+ * @name: index description name
+ *
+ * The indexes option is a list of index description names separated by
+ * commas or spaces such as "s2po,o2sp".  "c2spo" names the contexts
+ * index.  Unknown names are warned about when @name is NULL.
+ *
+ * Return value: non 0 if the index is wanted
+ **/
+static int
+librdf_storage_hashes_index_wanted(librdf_storage* storage,
+                                   const char *indexes, const char *name)
+{
+  const char *p=indexes;
+
+  if(!p)
+    return 0;
+
+  while(*p) {
+    size_t len;
+
+    while(*p == ',' || *p == ' ')
+      p++;
+    len=strcspn(p, ", ");
+    if(!len)
+      break;
+
+    if(name) {
+      if(len == strlen(name) && !strncmp(p, name, len))
+        return 1;
+    } else {
+      const librdf_hash_descriptor *d;
+      int known=(len == 5 && !strncmp(p, "c2spo", len));
+
+      for(d=librdf_storage_hashes_descriptions; !known && d->name; d++)
+        known=(len == strlen(d->name) && !strncmp(p, d->name, len));
+      if(!known)
+        librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE,
+                   NULL, "Ignoring unknown hashes storage index %.*s",
+                   (int)len, p);
+    }
+    p += len;
+  }
+
+  return 0;
+}
+
+
+#ifdef WITH_THREADS
+/*
+ * A pool of threads that run one task per hash.  The thread calling
+ * librdf_storage_hashes_run_tasks() also runs tasks and returns when
+ * all of them are done, so every storage method still sees the hashes
+ * fully written when the call returns.
+ */
+struct librdf_storage_hashes_pool_s {
+  librdf_storage* storage;
+  pthread_t* threads;
+  int threads_count;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  librdf_storage_hashes_task task;
+  void* task_data;
+  int next_task;
+  int tasks_count;
+  int pending;
+  int status;
+  int stop;
+};
+
+
+/* Run tasks until there are none left; called with pool->lock held */
+static void
+librdf_storage_hashes_pool_work(librdf_storage_hashes_pool* pool)
+{
+  while(pool->next_task < pool->tasks_count) {
+    int index=pool->next_task++;
+    int rc;
+
+    pthread_mutex_unlock(&pool->lock);
+    rc=pool->task(pool->storage, index, pool->task_data);
+    pthread_mutex_lock(&pool->lock);
+
+    if(rc)
+      pool->status=1;
+    if(!--pool->pending)
+      pthread_cond_signal(&pool->done_cond);
+  }
+}
+
+
+static void*
+librdf_storage_hashes_pool_thread(void* arg)
+{
+  librdf_storage_hashes_pool* pool=(librdf_storage_hashes_pool*)arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while(1) {
+    while(!pool->stop && pool->next_task >= pool->tasks_count)
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    if(pool->stop)
+      break;
+    librdf_storage_hashes_pool_work(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+
+static void
+librdf_storage_hashes_free_pool(librdf_storage_hashes_pool* pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop=1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for(i=0; i<pool->threads_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+  if(pool->threads)
+    LIBRDF_FREE(pthread_t, pool->threads);
+  LIBRDF_FREE(librdf_storage_hashes_pool, pool);
+}
+
+
+/*
+ * librdf_storage_hashes_new_pool:
+ * @storage: storage object
+ * @threads_count: number of worker threads
+ *
+ * INTERNAL - Start worker threads for index writes
+ *
+ * Return value: new pool or NULL on failure
+ **/
+static librdf_storage_hashes_pool*
+librdf_storage_hashes_new_pool(librdf_storage* storage, int threads_count)
+{
+  librdf_storage_hashes_pool* pool;
+
+  pool=LIBRDF_CALLOC(librdf_storage_hashes_pool*, 1, sizeof(*pool));
+  if(!pool)
+    return NULL;
+
+  pool->storage=storage;
+  pool->threads=LIBRDF_CALLOC(pthread_t*, threads_count, sizeof(pthread_t));
+  if(!pool->threads) {
+    LIBRDF_FREE(librdf_storage_hashes_pool, pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  for(; pool->threads_count < threads_count; pool->threads_count++) {
+    if(pthread_create(&pool->threads[pool->threads_count], NULL,
+                      librdf_storage_hashes_pool_thread, pool)) {
+      librdf_storage_hashes_free_pool(pool);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+#endif
+
+
+/*
+ * librdf_storage_hashes_run_tasks:
+ * @storage: storage object
+ * @task: function to run for each hash
+ * @task_data: data for @task
+ *
+ * INTERNAL - Run a task for every hash index and wait for them all
+ *
+ * The tasks are shared with the index-threads worker pool when there is
+ * one.  Inside a transaction they run in turn on this thread since the
+ * hashes share one transaction handle.
+ *
+ * Return value: non 0 if any task failed
+ **/
+static int
+librdf_storage_hashes_run_tasks(librdf_storage* storage,
+                                librdf_storage_hashes_task task,
+                                void* task_data)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+
+#ifdef WITH_THREADS
+  if(context->pool && !context->in_transaction) {
+    librdf_storage_hashes_pool* pool=context->pool;
+    int status;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task=task;
+    pool->task_data=task_data;
+    pool->next_task=0;
+    pool->tasks_count=context->hash_count;
+    pool->pending=context->hash_count;
+    pool->status=0;
+    pthread_cond_broadcast(&pool->work_cond);
+
+    librdf_storage_hashes_pool_work(pool);
+    while(pool->pending)
+      pthread_cond_wait(&pool->done_cond, &pool->lock);
+    status=pool->status;
+    pthread_mutex_unlock(&pool->lock);
+
+    return status;
+  }
+#endif
+
+  for(i=0; i<context->hash_count; i++) {
+    if(task(storage, i, task_data))
+      return 1;
+  }
+  return 0;
+}
+
+
 /* helper function for implementing init and clone methods */
 
 static int
@@ -242,7 +664,11 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   int i;
   int status=0;
   int index_predicates=0;
+  int index_subjects=0;
+  int index_objects=0;
   int index_contexts=0;
+  int dictionary=0;
+  long lvalue;
   int hash_count=0;
   
   context = LIBRDF_CALLOC(librdf_storage_hashes_instance*, 1, sizeof(*context));
@@ -265,8 +691,14 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   /* Work out the number of hashes for allocating stuff below */
   hash_count=3;
 
+  /* warn about names in the indexes option that will not be used */
+  librdf_storage_hashes_index_wanted(storage, indexes, NULL);
+
   if((index_contexts=librdf_hash_get_as_boolean(options, "contexts"))<0)
     index_contexts=0; /* default is no contexts */
+  if(librdf_storage_hashes_index_wanted(storage, indexes, "contexts") ||
+     librdf_storage_hashes_index_wanted(storage, indexes, "c2spo"))
+    index_contexts=1;
   context->index_contexts=index_contexts;
 
   if(index_contexts)
@@ -274,10 +706,89 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
 
   if((index_predicates=librdf_hash_get_as_boolean(options, "index-predicates"))<0)
     index_predicates=0; /* default is NO index on properties */
+  if(librdf_storage_hashes_index_wanted(storage, indexes, "p2so"))
+    index_predicates=1;
   
   if(index_predicates)
     hash_count++;
 
+  if((index_subjects=librdf_hash_get_as_boolean(options, "index-subjects"))<0)
+    index_subjects=0; /* default is NO index on subjects alone */
+  if(librdf_storage_hashes_index_wanted(storage, indexes, "s2po"))
+    index_subjects=1;
+  
+  if(index_subjects)
+    hash_count++;
+
+  if((index_objects=librdf_hash_get_as_boolean(options, "index-objects"))<0)
+    index_objects=0; /* default is NO index on objects alone */
+  if(librdf_storage_hashes_index_wanted(storage, indexes, "o2sp"))
+    index_objects=1;
+  
+  if(index_objects)
+    hash_count++;
+
+  if((dictionary=librdf_hash_get_as_boolean(options, "dictionary"))<0)
+    dictionary=0; /* default is to store whole nodes in every index */
+  context->dictionary=dictionary;
+  
+  if(dictionary)
+    hash_count += 2;
+
+  lvalue=librdf_hash_get_as_long(options, "key-encoding");
+  context->key_encoding=(lvalue == 2) ? 2 : 1; /* default is the node encoding */
+  if(context->key_encoding == 2 && dictionary) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Ignoring key-encoding option with dictionary option");
+    context->key_encoding=1;
+  }
+
+  if(context->key_encoding == 2)
+    hash_count++;
+
+  if((context->compress_values=librdf_hash_get_as_boolean(options, "compress-values"))<0)
+    context->compress_values=0; /* default is one hash value per statement */
+  if(context->compress_values && !dictionary) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Ignoring compress-values option without dictionary option");
+    context->compress_values=0;
+  }
+
+  if((context->statistics=librdf_hash_get_as_boolean(options, "statistics"))<0)
+    context->statistics=0; /* default is no statistics */
+
+  if(context->statistics)
+    hash_count++;
+
+  if((context->bulk_load=librdf_hash_get_as_boolean(options, "bulk-load"))<0)
+    context->bulk_load=0; /* default is to add statements one at a time */
+  lvalue=librdf_hash_get_as_long(options, "bulk-load-buffer");
+  context->bulk_load_buffer=(lvalue > 0) ? (size_t)lvalue : LIBRDF_STORAGE_HASHES_BULK_LOAD_BUFFER;
+
+  if((context->snapshot_clones=librdf_hash_get_as_boolean(options, "snapshot-clones"))<0)
+    context->snapshot_clones=0; /* default is clones are new storages */
+
+  if(librdf_hash_get_as_boolean(options, "concurrent") > 0) {
+#ifdef WITH_THREADS
+    pthread_mutexattr_t attr;
+
+    /* recursive since contains encodes nodes through node_to_id */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    status=pthread_mutex_init(&context->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if(status) {
+      if(context->name)
+        LIBRDF_FREE(char*, context->name);
+      return 1;
+    }
+    context->concurrent=1;
+#else
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Ignoring concurrent option without thread support");
+#endif
+  }
+
 
   /* Start allocating the arrays */
   context->hashes = LIBRDF_CALLOC(librdf_hash**,
@@ -321,6 +832,30 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     status=librdf_storage_hashes_register(storage, name,
                                           librdf_storage_get_hash_description_by_name("p2so"));
 
+  if(index_subjects && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("s2po"));
+
+  if(index_objects && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("o2sp"));
+
+  if(dictionary && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("node2id"));
+
+  if(dictionary && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("id2node"));
+
+  if(context->key_encoding == 2 && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("prefixes"));
+
+  if(context->statistics && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("stats"));
+
   if(index_contexts && !status)
     librdf_storage_hashes_register(storage, name,
                                    librdf_storage_get_hash_description_by_name("contexts"));
@@ -331,6 +866,12 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   context->arcs_index= -1;
   context->targets_index= -1;
   context->p2so_index= -1;
+  context->s2po_index= -1;
+  context->o2sp_index= -1;
+  context->node2id_index= -1;
+  context->id2node_index= -1;
+  context->prefixes_index= -1;
+  context->stats_index= -1;
   /* and index for contexts (no key or value fields) */
   context->contexts_index= -1;
 
@@ -346,6 +887,20 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     key_fields = context->hash_descriptions[i]->key_fields;
     value_fields = context->hash_descriptions[i]->value_fields;
 
+    if(!strcmp(context->hash_descriptions[i]->name, "node2id")) {
+      context->node2id_index=i;
+      continue;
+    } else if(!strcmp(context->hash_descriptions[i]->name, "id2node")) {
+      context->id2node_index=i;
+      continue;
+    } else if(!strcmp(context->hash_descriptions[i]->name, "prefixes")) {
+      context->prefixes_index=i;
+      continue;
+    } else if(!strcmp(context->hash_descriptions[i]->name, "stats")) {
+      context->stats_index=i;
+      continue;
+    }
+
     if(context->all_statements_hash_index <0 &&
        ((key_fields|value_fields)==(LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT))) {
       context->all_statements_hash_index=i;
@@ -363,11 +918,54 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     } else if(key_fields == LIBRDF_STATEMENT_PREDICATE &&
               value_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT)) {
       context->p2so_index=i;
+    } else if(key_fields == LIBRDF_STATEMENT_SUBJECT &&
+              value_fields == (LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT)) {
+      context->s2po_index=i;
+    } else if(key_fields == LIBRDF_STATEMENT_OBJECT &&
+              value_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE)) {
+      context->o2sp_index=i;
     } else if(!key_fields || !value_fields) {
        context->contexts_index=i;
     }
   }
 
+  if(!status) {
+    context->writes=LIBRDF_CALLOC(librdf_storage_hashes_index_write*,
+                                  LIBRDF_GOOD_CAST(size_t, context->hash_count),
+                                  sizeof(librdf_storage_hashes_index_write));
+    if(!context->writes)
+      status=1;
+  }
+
+  /* every index but the one used for contains is compressed */
+  for(i=0; i<context->hash_count && !status && context->compress_values; i++) {
+    if(i == context->all_statements_hash_index ||
+       i == context->node2id_index || i == context->id2node_index ||
+       i == context->stats_index || i == context->contexts_index)
+      continue;
+    context->writes[i].pack_counts=LIBRDF_CALLOC(int*,
+                                                 LIBRDF_STORAGE_HASHES_PACK_BUCKETS,
+                                                 sizeof(int));
+    if(!context->writes[i].pack_counts)
+      status=1;
+  }
+
+  /* The calling thread also runs tasks, so index-threads N starts N-1
+   * workers; more workers than hashes would have nothing to do */
+  lvalue=librdf_hash_get_as_long(options, "index-threads");
+  if(lvalue > context->hash_count)
+    lvalue=context->hash_count;
+  if(!status && lvalue > 1) {
+#ifdef WITH_THREADS
+    context->pool=librdf_storage_hashes_new_pool(storage, (int)lvalue-1);
+    if(!context->pool)
+      status=1;
+#else
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Ignoring index-threads option without thread support");
+#endif
+  }
+
   return status;
 }
 
@@ -426,8 +1024,30 @@ librdf_storage_hashes_terminate(librdf_storage* storage)
   
   if (context == NULL)
     return;
+
+#ifdef WITH_THREADS
+  if(context->pool)
+    librdf_storage_hashes_free_pool(context->pool);
+  if(context->concurrent)
+    pthread_mutex_destroy(&context->lock);
+#endif
+
+  if(context->literal_index)
+    librdf_free_literal_index(context->literal_index);
+
+  /* statements of a transaction never committed are dropped */
+  if(context->transaction_bulk)
+    librdf_storage_hashes_free_bulk(storage, context->transaction_bulk);
   
   for(i=0; i<context->hash_count; i++) {
+    if(context->writes) {
+      if(context->writes[i].key_buffer)
+        LIBRDF_FREE(data, context->writes[i].key_buffer);
+      if(context->writes[i].value_buffer)
+        LIBRDF_FREE(data, context->writes[i].value_buffer);
+      if(context->writes[i].pack_counts)
+        LIBRDF_FREE(int, context->writes[i].pack_counts);
+    }
     if(context->hash_descriptions && context->hash_descriptions[i])
       LIBRDF_FREE(librdf_hash_descriptor, context->hash_descriptions[i]);
     if(context->hashes && context->hashes[i])
@@ -461,6 +1081,25 @@ librdf_storage_hashes_terminate(librdf_storage* storage)
     LIBRDF_FREE(data, context->key_buffer);
   if(context->value_buffer)
     LIBRDF_FREE(data, context->value_buffer);
+  if(context->node_buffer)
+    LIBRDF_FREE(data, context->node_buffer);
+  if(context->writes)
+    LIBRDF_FREE(librdf_storage_hashes_index_write, context->writes);
+
+  librdf_storage_hashes_stats_free(context);
+  if(context->stats_buffer)
+    LIBRDF_FREE(data, context->stats_buffer);
+
+  for(i=0; i<LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE; i++) {
+    if(context->node_id_cache_nodes[i])
+      librdf_free_node(context->node_id_cache_nodes[i]);
+  }
+
+  librdf_storage_hashes_free_prefixes(context);
+
+  /* the snapshot hashes are gone so the storage they read can go too */
+  if(context->snapshot_of)
+    librdf_storage_remove_reference(context->snapshot_of);
 
   if(context->name)
     LIBRDF_FREE(char*, context->name);
@@ -469,6 +1108,93 @@ librdf_storage_hashes_terminate(librdf_storage* storage)
 }
 
 
+/*
+ * Locking for the concurrent option.  Finds and contains share the
+ * instance key, value and node buffers, the node id cache and the
+ * statistics buffer, so they take the lock while using them; walking
+ * the hashes with a cursor afterwards needs no lock.  Without the
+ * option these do nothing.
+ */
+static void
+librdf_storage_hashes_lock(librdf_storage_hashes_instance* context)
+{
+#ifdef WITH_THREADS
+  if(context->concurrent)
+    pthread_mutex_lock(&context->lock);
+#endif
+}
+
+
+static void
+librdf_storage_hashes_unlock(librdf_storage_hashes_instance* context)
+{
+#ifdef WITH_THREADS
+  if(context->concurrent)
+    pthread_mutex_unlock(&context->lock);
+#endif
+}
+
+
+/*
+ * librdf_storage_hashes_snapshot:
+ * @new_storage: cloned storage with its hashes not yet open
+ * @old_storage: open storage to take a snapshot of
+ *
+ * INTERNAL - Replace the hashes of a clone with snapshots of the old
+ * storage's hashes, so that the clone is a read-only view of the old
+ * storage as it is now, made without copying any statements.  The
+ * old storage is kept alive until the clone is freed.
+ *
+ * Return value: non 0 if a hash type does not support snapshots, in
+ * which case the clone is left unchanged
+ */
+static int
+librdf_storage_hashes_snapshot(librdf_storage* new_storage,
+                               librdf_storage* old_storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)new_storage->instance;
+  librdf_storage_hashes_instance* old_context=(librdf_storage_hashes_instance*)old_storage->instance;
+  librdf_hash** snapshots;
+  int i;
+
+  if(context->hash_count != old_context->hash_count)
+    return 1;
+
+  snapshots=LIBRDF_CALLOC(librdf_hash**, 
+                          LIBRDF_GOOD_CAST(size_t, context->hash_count),
+                          sizeof(librdf_hash*));
+  if(!snapshots)
+    return 1;
+
+  /* the counts are only saved now and then */
+  if(old_context->statistics)
+    librdf_storage_hashes_stats_save(old_storage);
+
+  for(i=0; i<context->hash_count; i++) {
+    if(!old_context->hashes[i] ||
+       !(snapshots[i]=librdf_new_hash_snapshot(old_context->hashes[i]))) {
+      while(--i >= 0)
+        librdf_free_hash(snapshots[i]);
+      LIBRDF_FREE(librdf_hash, snapshots);
+      return 1;
+    }
+  }
+
+  for(i=0; i<context->hash_count; i++) {
+    if(context->hashes[i])
+      librdf_free_hash(context->hashes[i]);
+    context->hashes[i]=snapshots[i];
+  }
+  LIBRDF_FREE(librdf_hash, snapshots);
+
+  context->is_writable=0;
+  context->snapshot_of=old_storage;
+  librdf_storage_add_reference(old_storage);
+
+  return 0;
+}
+
+
 static int
 librdf_storage_hashes_clone(librdf_storage* new_storage, librdf_storage* old_storage)
 {
@@ -522,6 +1248,13 @@ librdf_storage_hashes_clone(librdf_storage* new_storage, librdf_storage* old_sto
     goto failed;
   }
 
+  if(old_context->snapshot_clones &&
+     librdf_storage_hashes_snapshot(new_storage, old_storage))
+    librdf_log(old_storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE,
+               NULL,
+               "Hash type '%s' does not support snapshots, clone is a new storage",
+               old_context->hash_type);
+
   return 0;
 
   failed:
@@ -546,7 +1279,8 @@ librdf_storage_hashes_open(librdf_storage* storage, librdf_model* model)
   int i;
   int result=0;
   
-  for(i=0; i<context->hash_count; i++) {
+  /* snapshot hashes are open from the start */
+  for(i=0; i<context->hash_count && !context->snapshot_of; i++) {
     librdf_hash *hash=context->hashes[i];
 
     if(!hash ||
@@ -567,6 +1301,15 @@ librdf_storage_hashes_open(librdf_storage* storage, librdf_model* model)
       break;
   }
 
+  if(!result && context->dictionary)
+    result=librdf_storage_hashes_load_next_node_id(storage);
+
+  if(!result && context->key_encoding == 2)
+    result=librdf_storage_hashes_load_prefixes(storage);
+
+  if(!result && context->statistics)
+    result=librdf_storage_hashes_stats_load(storage);
+
   return result;
 }
 
@@ -584,6 +1327,13 @@ librdf_storage_hashes_close(librdf_storage* storage)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int i;
+
+  /* snapshot hashes stay open until the storage is freed */
+  if(context->snapshot_of)
+    return 0;
+
+  if(context->statistics)
+    librdf_storage_hashes_stats_save(storage);
   
   for(i=0; i<context->hash_count; i++) {
     if(context->hashes[i])
@@ -603,6 +1353,12 @@ librdf_storage_hashes_size(librdf_storage* storage)
   if(!any_hash)
     return -1;
 
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return -1;
+
+  if(context->statistics)
+    return (int)context->statements_count;
+
   return librdf_hash_values_count(any_hash);
 }
 
@@ -624,16 +1380,1958 @@ librdf_storage_hashes_grow_buffer(unsigned char **buffer, size_t *len,
 }
 
 
-static int
-librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
-                                           librdf_statement* statement,
-                                           librdf_node* context_node,
-                                           int is_addition)
+static void
+librdf_storage_hashes_id_to_bytes(u64 id, unsigned char *p)
 {
-  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int i;
-  int status=0;
-  librdf_world* world = storage->world;
+  
+  for(i=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE-1; i>=0; i--) {
+    p[i]=(unsigned char)(id & 0xff);
+    id >>= 8;
+  }
+}
+
+
+static u64
+librdf_storage_hashes_bytes_to_id(const unsigned char *p)
+{
+  u64 id=0;
+  int i;
+  
+  for(i=0; i<LIBRDF_STORAGE_HASHES_NODE_ID_SIZE; i++)
+    id=(id << 8) | p[i];
+  return id;
+}
+
+
+/*
+ * librdf_storage_hashes_load_next_node_id:
+ * @storage: storage object
+ *
+ * INTERNAL - Read the next node id to assign from the id2node hash,
+ * starting at 1 for a new store, and forget any cached node ids.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_load_next_node_id(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum key, value; /* on stack */
+  int i;
+
+  for(i=0; i<LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE; i++) {
+    if(context->node_id_cache_nodes[i]) {
+      librdf_free_node(context->node_id_cache_nodes[i]);
+      context->node_id_cache_nodes[i]=NULL;
+    }
+  }
+  context->node_id_cache_next=0;
+
+  context->next_node_id=1;
+
+  cursor=librdf_new_hash_cursor(context->hashes[context->id2node_index]);
+  if(!cursor)
+    return 1;
+
+  key.data=(void*)librdf_storage_hashes_next_node_id_key;
+  key.size=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  value.data=NULL;
+  if(!librdf_hash_cursor_set(cursor, &key, &value) &&
+     value.size == LIBRDF_STORAGE_HASHES_NODE_ID_SIZE)
+    context->next_node_id=librdf_storage_hashes_bytes_to_id((unsigned char*)value.data);
+
+  librdf_free_hash_cursor(cursor);
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_node_to_id:
+ * @storage: storage object
+ * @node: node to look up
+ * @create: non 0 to assign a new id if @node is not in the dictionary
+ * @id: buffer of LIBRDF_STORAGE_HASHES_NODE_ID_SIZE bytes to write the id
+ *
+ * INTERNAL - Find the dictionary id for a node
+ *
+ * Return value: 0 if found, >0 if not in the dictionary, <0 on failure
+ **/
+static int librdf_storage_hashes_node_to_id_locked(librdf_storage* storage, librdf_node* node, int create, unsigned char *id);
+
+static int
+librdf_storage_hashes_node_to_id(librdf_storage* storage, librdf_node* node,
+                                 int create, unsigned char *id)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int rc;
+
+  librdf_storage_hashes_lock(context);
+  rc=librdf_storage_hashes_node_to_id_locked(storage, node, create, id);
+  librdf_storage_hashes_unlock(context);
+  return rc;
+}
+
+
+/* INTERNAL - node_to_id with the concurrent lock held */
+static int
+librdf_storage_hashes_node_to_id_locked(librdf_storage* storage,
+                                        librdf_node* node,
+                                        int create, unsigned char *id)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash* node2id=context->hashes[context->node2id_index];
+  librdf_hash* id2node=context->hashes[context->id2node_index];
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum key, value; /* on stack */
+  size_t node_len;
+  int found;
+  int i;
+
+  for(i=0; i<LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE; i++) {
+    if(context->node_id_cache_nodes[i] &&
+       librdf_node_equals(context->node_id_cache_nodes[i], node)) {
+      memcpy(id, context->node_id_cache_ids[i],
+             LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+      return 0;
+    }
+  }
+
+  node_len=librdf_node_encode(node, NULL, 0);
+  if(!node_len)
+    return -1;
+  if(librdf_storage_hashes_grow_buffer(&context->node_buffer,
+                                       &context->node_buffer_len, node_len))
+    return -1;
+  if(!librdf_node_encode(node, context->node_buffer, node_len))
+    return -1;
+
+  cursor=librdf_new_hash_cursor(node2id);
+  if(!cursor)
+    return -1;
+  
+  key.data=context->node_buffer; key.size=node_len;
+  value.data=NULL;
+  found=(!librdf_hash_cursor_set(cursor, &key, &value) &&
+         value.size == LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+  if(found)
+    memcpy(id, value.data, LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+  librdf_free_hash_cursor(cursor);
+
+  if(!found) {
+    if(!create)
+      return 1;
+
+    librdf_storage_hashes_id_to_bytes(context->next_node_id, id);
+
+    key.data=context->node_buffer; key.size=node_len;
+    value.data=id; value.size=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+    if(librdf_hash_put(node2id, &key, &value))
+      return -1;
+
+    key.data=id; key.size=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+    value.data=context->node_buffer; value.size=node_len;
+    if(librdf_hash_put(id2node, &key, &value))
+      return -1;
+
+    context->next_node_id++;
+    
+    /* the hashes allow duplicate values so replace the stored counter */
+    {
+      unsigned char next_id[LIBRDF_STORAGE_HASHES_NODE_ID_SIZE];
+
+      librdf_storage_hashes_id_to_bytes(context->next_node_id, next_id);
+      key.data=(void*)librdf_storage_hashes_next_node_id_key;
+      key.size=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+      librdf_hash_delete_all(id2node, &key);
+      value.data=next_id; value.size=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+      if(librdf_hash_put(id2node, &key, &value))
+        return -1;
+    }
+  }
+
+  /* remember it, replacing the oldest entry */
+  i=context->node_id_cache_next;
+  if(context->node_id_cache_nodes[i])
+    librdf_free_node(context->node_id_cache_nodes[i]);
+  context->node_id_cache_nodes[i]=librdf_new_node_from_node(node);
+  memcpy(context->node_id_cache_ids[i], id, LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+  context->node_id_cache_next=(i+1) % LIBRDF_STORAGE_HASHES_NODE_ID_CACHE_SIZE;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_id_to_node:
+ * @storage: storage object
+ * @id: LIBRDF_STORAGE_HASHES_NODE_ID_SIZE bytes of node id
+ *
+ * INTERNAL - Find the node for a dictionary id
+ *
+ * Return value: new #librdf_node or NULL on failure
+ **/
+static librdf_node*
+librdf_storage_hashes_id_to_node(librdf_storage* storage,
+                                 const unsigned char *id)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_node* node=NULL;
+  size_t node_len;
+  
+  cursor=librdf_new_hash_cursor(context->hashes[context->id2node_index]);
+  if(!cursor)
+    return NULL;
+  
+  key.data=(void*)id; key.size=LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  value.data=NULL;
+  if(!librdf_hash_cursor_set(cursor, &key, &value))
+    node=librdf_node_decode(storage->world, &node_len,
+                            (unsigned char*)value.data, value.size);
+  librdf_free_hash_cursor(cursor);
+
+  return node;
+}
+
+
+/*
+ * Key encoding 2
+ *
+ * With the key-encoding option set to 2 (and no dictionary), statement
+ * parts are written after a 'v' as the part letter and then a node as
+ *   'u' varint prefix id, varint length, rest of the URI
+ *   'l' varint length, string, varint language length, language,
+ *       varint datatype prefix id + 1 (0 for none), and for a datatype
+ *       varint length and rest of the datatype URI
+ *   'b' varint length, blank node id
+ * Prefixes are URIs up to their last '#' or '/', numbered in the
+ * prefixes hash, so namespaces are not repeated in every key.  A given
+ * node always encodes the same so encoded leading key fields are still
+ * prefixes.  Keys in the node encoding are still read.
+ */
+
+/* Free the in-memory copy of the prefixes hash */
+static void
+librdf_storage_hashes_free_prefixes(librdf_storage_hashes_instance* context)
+{
+  int i;
+
+  if(context->prefixes) {
+    for(i=1; i < context->prefixes_count; i++) {
+      if(context->prefixes[i])
+        LIBRDF_FREE(char*, context->prefixes[i]);
+    }
+    LIBRDF_FREE(char**, context->prefixes);
+    context->prefixes=NULL;
+  }
+  if(context->prefix_lens) {
+    LIBRDF_FREE(size_t*, context->prefix_lens);
+    context->prefix_lens=NULL;
+  }
+  context->prefixes_count=1;
+  context->prefixes_size=0;
+
+  if(context->prefix_ids) {
+    librdf_free_hash(context->prefix_ids);
+    context->prefix_ids=NULL;
+  }
+}
+
+
+/* Remember prefix id in memory; returns non 0 on failure */
+static int
+librdf_storage_hashes_add_prefix(librdf_storage* storage, int id,
+                                 const unsigned char *prefix, size_t len)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  unsigned char *copy;
+
+  if(id >= context->prefixes_size) {
+    int new_size=context->prefixes_size ? context->prefixes_size * 2 : 64;
+    unsigned char** new_prefixes;
+    size_t* new_lens;
+
+    while(new_size <= id)
+      new_size *= 2;
+
+    new_prefixes = LIBRDF_CALLOC(unsigned char**, LIBRDF_GOOD_CAST(size_t, new_size),
+                                 sizeof(unsigned char*));
+    if(!new_prefixes)
+      return 1;
+    new_lens = LIBRDF_CALLOC(size_t*, LIBRDF_GOOD_CAST(size_t, new_size),
+                             sizeof(size_t));
+    if(!new_lens) {
+      LIBRDF_FREE(char**, new_prefixes);
+      return 1;
+    }
+    if(context->prefixes) {
+      memcpy(new_prefixes, context->prefixes,
+             LIBRDF_GOOD_CAST(size_t, context->prefixes_size) * sizeof(unsigned char*));
+      memcpy(new_lens, context->prefix_lens,
+             LIBRDF_GOOD_CAST(size_t, context->prefixes_size) * sizeof(size_t));
+      LIBRDF_FREE(char**, context->prefixes);
+      LIBRDF_FREE(size_t*, context->prefix_lens);
+    }
+    context->prefixes=new_prefixes;
+    context->prefix_lens=new_lens;
+    context->prefixes_size=new_size;
+  }
+
+  if(context->prefixes[id])
+    return 1;
+
+  copy = LIBRDF_MALLOC(unsigned char*, len + 1);
+  if(!copy)
+    return 1;
+  memcpy(copy, prefix, len);
+  copy[len]='\0';
+  context->prefixes[id]=copy;
+  context->prefix_lens[id]=len;
+  if(id >= context->prefixes_count)
+    context->prefixes_count=id + 1;
+
+  key.data=copy; key.size=len;
+  value.data=&id; value.size=sizeof(id);
+  return librdf_hash_put(context->prefix_ids, &key, &value);
+}
+
+
+/*
+ * librdf_storage_hashes_load_prefixes:
+ * @storage: storage object
+ *
+ * INTERNAL - Read the prefixes hash into memory, replacing any
+ * prefixes already read.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_load_prefixes(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_iterator* iterator;
+  int status=0;
+
+  librdf_storage_hashes_free_prefixes(context);
+
+  context->prefix_ids=librdf_new_hash(storage->world, NULL);
+  if(!context->prefix_ids)
+    return 1;
+  if(librdf_hash_open(context->prefix_ids, NULL, 0, 1, 1, NULL)) {
+    librdf_free_hash(context->prefix_ids);
+    context->prefix_ids=NULL;
+    return 1;
+  }
+
+  key.data=NULL;
+  iterator=librdf_hash_get_all(context->hashes[context->prefixes_index],
+                               &key, &value);
+  if(!iterator)
+    return 1;
+
+  for(; !librdf_iterator_end(iterator) && !status;
+      librdf_iterator_next(iterator)) {
+    librdf_hash_datum* k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    librdf_hash_datum* v=(librdf_hash_datum*)librdf_iterator_get_value(iterator);
+    const unsigned char *p;
+    int id=0;
+    int i;
+
+    if(!k || !v || k->size != LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE)
+      continue;
+    p=(const unsigned char*)k->data;
+    for(i=0; i<LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE; i++)
+      id=(id << 8) | p[i];
+    if(id <= 0)
+      continue;
+
+    status=librdf_storage_hashes_add_prefix(storage, id,
+                                            (const unsigned char*)v->data,
+                                            v->size);
+  }
+  librdf_free_iterator(iterator);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_prefix_id:
+ * @storage: storage object
+ * @uri: URI string
+ * @uri_len: length of @uri
+ * @create: non 0 to add the prefix of @uri if it is new
+ * @prefix_len_p: pointer to set to the length of the prefix used
+ *
+ * INTERNAL - Find the prefix id to encode a URI with
+ *
+ * Return value: prefix id, 0 for no prefix, <0 if the prefix is not
+ * in the prefixes hash (and not created) or on failure
+ **/
+static int
+librdf_storage_hashes_prefix_id(librdf_storage* storage,
+                                const unsigned char *uri, size_t uri_len,
+                                int create, size_t *prefix_len_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_datum* found;
+  unsigned char id_bytes[LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE];
+  size_t len;
+  int id;
+  int i;
+
+  *prefix_len_p=0;
+
+  for(len=uri_len; len > 0; len--) {
+    if(uri[len-1] == '#' || uri[len-1] == '/')
+      break;
+  }
+  if(len < LIBRDF_STORAGE_HASHES_PREFIX_MIN)
+    return 0;
+
+  key.data=(void*)uri; key.size=len;
+  found=librdf_hash_get_one(context->prefix_ids, &key);
+  if(found) {
+    memcpy(&id, found->data, sizeof(id));
+    librdf_free_hash_datum(found);
+    *prefix_len_p=len;
+    return id;
+  }
+
+  if(!create)
+    return -1;
+
+  id=context->prefixes_count;
+  for(i=LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE-1; i>=0; i--)
+    id_bytes[i]=(unsigned char)((id >> (8 * (LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE-1-i))) & 0xff);
+
+  key.data=id_bytes; key.size=LIBRDF_STORAGE_HASHES_PREFIX_ID_SIZE;
+  value.data=(void*)uri; value.size=len;
+  if(librdf_hash_put(context->hashes[context->prefixes_index], &key, &value) ||
+     librdf_storage_hashes_add_prefix(storage, id, uri, len))
+    return -1;
+
+  *prefix_len_p=len;
+  return id;
+}
+
+
+/* Write a URI as varint prefix id, varint length and the rest of it to
+ * p, returning the bytes used or 0 on failure or a missing prefix */
+static size_t
+librdf_storage_hashes_encode_uri_v2(librdf_storage* storage, librdf_uri* uri,
+                                    int create, unsigned char *p,
+                                    int id_offset, int *missing_p)
+{
+  const unsigned char *string;
+  size_t string_len;
+  size_t prefix_len;
+  unsigned char *start=p;
+  int id;
+
+  string=librdf_uri_as_counted_string(uri, &string_len);
+  id=librdf_storage_hashes_prefix_id(storage, string, string_len, create,
+                                     &prefix_len);
+  if(id < 0) {
+    if(!create)
+      *missing_p=1;
+    return 0;
+  }
+
+  p += librdf_storage_hashes_put_varint(p, (u64)(id + id_offset));
+  p += librdf_storage_hashes_put_varint(p, (u64)(string_len - prefix_len));
+  memcpy(p, string + prefix_len, string_len - prefix_len);
+  p += string_len - prefix_len;
+
+  return LIBRDF_GOOD_CAST(size_t, p - start);
+}
+
+
+/* Largest key encoding 2 size of a node */
+static size_t
+librdf_storage_hashes_node_v2_size(librdf_node* node)
+{
+  size_t len=0;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      librdf_uri_as_counted_string(node->value.uri, &len);
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      len=node->value.literal.string_len + node->value.literal.language_len;
+      if(node->value.literal.datatype) {
+        size_t dt_len;
+
+        librdf_uri_as_counted_string(node->value.literal.datatype, &dt_len);
+        len += dt_len;
+      }
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      len=node->value.blank.string_len;
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  /* type, up to 5 varints of 10 bytes */
+  return 1 + 50 + len;
+}
+
+
+/* Write a node in key encoding 2 to p, returning the bytes used or 0 on
+ * failure or a missing prefix */
+static size_t
+librdf_storage_hashes_encode_node_v2(librdf_storage* storage,
+                                     librdf_node* node, int create,
+                                     unsigned char *p, int *missing_p)
+{
+  unsigned char *start=p;
+  size_t len;
+
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      *p++='u';
+      len=librdf_storage_hashes_encode_uri_v2(storage, node->value.uri,
+                                              create, p, 0, missing_p);
+      if(!len)
+        return 0;
+      p += len;
+      break;
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      *p++='l';
+      len=node->value.literal.string_len;
+      p += librdf_storage_hashes_put_varint(p, (u64)len);
+      memcpy(p, node->value.literal.string, len);
+      p += len;
+
+      len=node->value.literal.language ? node->value.literal.language_len : 0;
+      p += librdf_storage_hashes_put_varint(p, (u64)len);
+      if(len) {
+        memcpy(p, node->value.literal.language, len);
+        p += len;
+      }
+
+      if(node->value.literal.datatype) {
+        len=librdf_storage_hashes_encode_uri_v2(storage,
+                                                node->value.literal.datatype,
+                                                create, p, 1, missing_p);
+        if(!len)
+          return 0;
+        p += len;
+      } else
+        *p++='\0';
+      break;
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      *p++='b';
+      len=node->value.blank.string_len;
+      p += librdf_storage_hashes_put_varint(p, (u64)len);
+      memcpy(p, node->value.blank.string, len);
+      p += len;
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return 0;
+  }
+
+  return LIBRDF_GOOD_CAST(size_t, p - start);
+}
+
+
+/* Read a counted string at *p_p, moving it on; returns non 0 if bad */
+static int
+librdf_storage_hashes_get_counted(const unsigned char **p_p,
+                                  const unsigned char *end,
+                                  const unsigned char **string_p,
+                                  size_t *len_p)
+{
+  u64 len;
+
+  if(librdf_storage_hashes_get_varint(p_p, end, &len) ||
+     len > (u64)(end - *p_p))
+    return 1;
+  *string_p=*p_p;
+  *len_p=(size_t)len;
+  *p_p += len;
+  return 0;
+}
+
+
+/* Read a URI written by librdf_storage_hashes_encode_uri_v2() with
+ * prefix id already read as id, returning a new URI or NULL */
+static librdf_uri*
+librdf_storage_hashes_decode_uri_v2(librdf_storage* storage, u64 id,
+                                    const unsigned char **p_p,
+                                    const unsigned char *end)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  const unsigned char *rest;
+  size_t rest_len;
+  size_t prefix_len;
+  unsigned char *string;
+  librdf_uri* uri;
+
+  if(librdf_storage_hashes_get_counted(p_p, end, &rest, &rest_len))
+    return NULL;
+
+  if(!id)
+    return librdf_new_uri2(storage->world, rest, rest_len);
+
+  if(id >= (u64)context->prefixes_count || !context->prefixes[id])
+    return NULL;
+  prefix_len=context->prefix_lens[id];
+
+  string = LIBRDF_MALLOC(unsigned char*, prefix_len + rest_len + 1);
+  if(!string)
+    return NULL;
+  memcpy(string, context->prefixes[id], prefix_len);
+  memcpy(string + prefix_len, rest, rest_len);
+  string[prefix_len + rest_len]='\0';
+
+  uri=librdf_new_uri2(storage->world, string, prefix_len + rest_len);
+  LIBRDF_FREE(char*, string);
+
+  return uri;
+}
+
+
+/* Read a node written by librdf_storage_hashes_encode_node_v2() at *p_p,
+ * moving it on; returns a new node or NULL */
+static librdf_node*
+librdf_storage_hashes_decode_node_v2(librdf_storage* storage,
+                                     const unsigned char **p_p,
+                                     const unsigned char *end)
+{
+  const unsigned char *string;
+  size_t string_len;
+  const unsigned char *language;
+  size_t language_len;
+  librdf_uri* uri=NULL;
+  librdf_node* node=NULL;
+  u64 id;
+
+  if(*p_p >= end)
+    return NULL;
+
+  switch(*(*p_p)++) {
+    case 'u':
+      if(librdf_storage_hashes_get_varint(p_p, end, &id))
+        return NULL;
+      uri=librdf_storage_hashes_decode_uri_v2(storage, id, p_p, end);
+      if(!uri)
+        return NULL;
+      node=librdf_new_node_from_uri(storage->world, uri);
+      librdf_free_uri(uri);
+      break;
+
+    case 'l':
+      if(librdf_storage_hashes_get_counted(p_p, end, &string, &string_len) ||
+         librdf_storage_hashes_get_counted(p_p, end, &language, &language_len) ||
+         librdf_storage_hashes_get_varint(p_p, end, &id))
+        return NULL;
+      if(id) {
+        uri=librdf_storage_hashes_decode_uri_v2(storage, id - 1, p_p, end);
+        if(!uri)
+          return NULL;
+      }
+      node=librdf_new_node_from_typed_counted_literal(storage->world,
+                                                      string, string_len,
+                                                      language_len ? (const char*)language : NULL,
+                                                      language_len,
+                                                      uri);
+      if(uri)
+        librdf_free_uri(uri);
+      break;
+
+    case 'b':
+      if(librdf_storage_hashes_get_counted(p_p, end, &string, &string_len))
+        return NULL;
+      node=librdf_new_node_from_counted_blank_identifier(storage->world,
+                                                         string, string_len);
+      break;
+
+    default:
+      break;
+  }
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_encode:
+ * @storage: storage object
+ * @statement: statement to encode
+ * @context_node: context node to encode (or NULL)
+ * @buffer_p: pointer to growing buffer
+ * @buffer_len_p: pointer to size of growing buffer
+ * @fields: statement fields to encode
+ * @create: non 0 to add nodes missing from the dictionary
+ * @missing_p: pointer to flag set when a node is not in the dictionary
+ *
+ * INTERNAL - Encode parts of a statement for use as a hash key or value
+ *
+ * Like librdf_statement_encode_parts2() but with dictionary ids in place
+ * of the node encodings when the dictionary option is set, or in key
+ * encoding 2 when that is set.  The field order is the same so encoded
+ * leading key fields are still prefixes.
+ *
+ * Return value: number of bytes encoded or 0 on failure or missing node
+ **/
+static size_t
+librdf_storage_hashes_encode(librdf_storage* storage,
+                             librdf_statement* statement,
+                             librdf_node* context_node,
+                             unsigned char **buffer_p, size_t *buffer_len_p,
+                             librdf_statement_part fields,
+                             int create, int *missing_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_node* nodes[4];
+  const char types[4]={'s', 'p', 'o', 'c'};
+  size_t len;
+  unsigned char *p;
+  int i;
+
+  *missing_p=0;
+  
+  nodes[0]=(fields & LIBRDF_STATEMENT_SUBJECT) ? statement->subject : NULL;
+  nodes[1]=(fields & LIBRDF_STATEMENT_PREDICATE) ? statement->predicate : NULL;
+  nodes[2]=(fields & LIBRDF_STATEMENT_OBJECT) ? statement->object : NULL;
+  nodes[3]=context_node;
+
+  if(context->key_encoding == 2) {
+    len=1;
+    for(i=0; i<4; i++) {
+      if(nodes[i])
+        len += 1 + librdf_storage_hashes_node_v2_size(nodes[i]);
+    }
+    if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p, len))
+      return 0;
+
+    p=*buffer_p;
+    *p++='v';
+    for(i=0; i<4; i++) {
+      size_t node_len;
+
+      if(!nodes[i])
+        continue;
+      *p++=types[i];
+      node_len=librdf_storage_hashes_encode_node_v2(storage, nodes[i], create,
+                                                    p, missing_p);
+      if(!node_len)
+        return 0;
+      p += node_len;
+    }
+
+    return LIBRDF_GOOD_CAST(size_t, p - *buffer_p);
+  }
+
+  if(!context->dictionary) {
+    len=librdf_statement_encode_parts2(storage->world, statement, context_node,
+                                       NULL, 0, fields);
+    if(!len)
+      return 0;
+    if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p, len))
+      return 0;
+    return librdf_statement_encode_parts2(storage->world, statement,
+                                          context_node,
+                                          *buffer_p, *buffer_len_p, fields);
+  }
+
+  len=1;
+  for(i=0; i<4; i++) {
+    if(nodes[i])
+      len += 1 + LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  }
+  if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p, len))
+    return 0;
+
+  p=*buffer_p;
+  *p++='x';
+  for(i=0; i<4; i++) {
+    int rc;
+    
+    if(!nodes[i])
+      continue;
+    *p++=types[i];
+    rc=librdf_storage_hashes_node_to_id(storage, nodes[i], create, p);
+    if(rc) {
+      if(rc > 0)
+        *missing_p=1;
+      return 0;
+    }
+    p += LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  }
+
+  return len;
+}
+
+
+/*
+ * librdf_storage_hashes_decode:
+ * @storage: storage object
+ * @statement: the statement to decode into
+ * @context_node: pointer to context node to decode into (or NULL)
+ * @buffer: the buffer to use
+ * @length: buffer size
+ *
+ * INTERNAL - Decode parts of a statement from a hash key or value
+ *
+ * Return value: number of bytes used or 0 on failure
+ **/
+static size_t
+librdf_storage_hashes_decode(librdf_storage* storage,
+                             librdf_statement* statement,
+                             librdf_node** context_node,
+                             unsigned char *buffer, size_t length)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char *p=buffer;
+  
+  if(length >= 1 && *p == 'v') {
+    const unsigned char *q=buffer + 1;
+    const unsigned char *end=buffer + length;
+
+    while(q < end) {
+      unsigned char type=*q++;
+      librdf_node* node;
+
+      node=librdf_storage_hashes_decode_node_v2(storage, &q, end);
+      if(!node)
+        return 0;
+
+      switch(type) {
+        case 's':
+          statement->subject=node;
+          break;
+
+        case 'p':
+          statement->predicate=node;
+          break;
+
+        case 'o':
+          statement->object=node;
+          break;
+
+        case 'c':
+          if(context_node)
+            *context_node=node;
+          else
+            librdf_free_node(node);
+          break;
+
+        default:
+          librdf_free_node(node);
+          return 0;
+      }
+    }
+
+    return LIBRDF_GOOD_CAST(size_t, q - buffer);
+  }
+
+  if(!context->dictionary)
+    return librdf_statement_decode2(storage->world, statement, context_node,
+                                    buffer, length);
+
+  if(length < 1 || *p != 'x')
+    return 0;
+  p++;
+  length--;
+
+  while(length > 0) {
+    librdf_node* node;
+    unsigned char type=*p++;
+
+    length--;
+    if(length < LIBRDF_STORAGE_HASHES_NODE_ID_SIZE)
+      return 0;
+
+    node=librdf_storage_hashes_id_to_node(storage, p);
+    if(!node)
+      return 0;
+    p += LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+    length -= LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+
+    switch(type) {
+      case 's':
+        statement->subject=node;
+        break;
+
+      case 'p':
+        statement->predicate=node;
+        break;
+
+      case 'o':
+        statement->object=node;
+        break;
+
+      case 'c':
+        if(context_node)
+          *context_node=node;
+        else
+          librdf_free_node(node);
+        break;
+
+      default:
+        librdf_free_node(node);
+        return 0;
+    }
+  }
+
+  return p-buffer;
+}
+
+
+/* Stats hash keys; per-predicate counts use 'p' + the predicate encoding */
+#define LIBRDF_STORAGE_HASHES_STATS_COUNT_KEY "n"
+static const char* const librdf_storage_hashes_stats_distinct_keys[3]={"ds", "dp", "do"};
+
+
+/* 64 bit FNV-1a with a final mix so that the low and high bits are
+ * both usable as uniformly distributed values */
+static u64
+librdf_storage_hashes_stats_hash(const unsigned char *p, size_t len)
+{
+  u64 h=(u64)0xcbf29ce484222325ULL;
+
+  while(len--) {
+    h ^= *p++;
+    h *= (u64)0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= (u64)0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+
+/* Remember a hash value if it is one of the smallest seen */
+static void
+librdf_storage_hashes_distinct_add(librdf_storage_hashes_distinct* distinct,
+                                   u64 h)
+{
+  int low=0, high=distinct->count;
+
+  if(distinct->count == LIBRDF_STORAGE_HASHES_DISTINCT_K &&
+     h >= distinct->minimums[distinct->count-1])
+    return;
+
+  while(low < high) {
+    int mid=(low+high)/2;
+    if(distinct->minimums[mid] < h)
+      low=mid+1;
+    else
+      high=mid;
+  }
+  if(low < distinct->count && distinct->minimums[low] == h)
+    return;
+
+  if(distinct->count < LIBRDF_STORAGE_HASHES_DISTINCT_K)
+    distinct->count++;
+  memmove(&distinct->minimums[low+1], &distinct->minimums[low],
+          (distinct->count-low-1)*sizeof(u64));
+  distinct->minimums[low]=h;
+}
+
+
+/*
+ * Estimate the number of distinct values from the k smallest hashes:
+ * exact below k values, otherwise (k-1) over the kth smallest hash as a
+ * fraction of the hash range.
+ */
+static long
+librdf_storage_hashes_distinct_estimate(librdf_storage_hashes_distinct* distinct)
+{
+  double fraction;
+
+  if(distinct->count < LIBRDF_STORAGE_HASHES_DISTINCT_K)
+    return distinct->count;
+
+  fraction=(double)distinct->minimums[distinct->count-1] / 18446744073709551616.0;
+  if(fraction <= 0.0)
+    return distinct->count;
+  return (long)((LIBRDF_STORAGE_HASHES_DISTINCT_K-1) / fraction);
+}
+
+
+static librdf_storage_hashes_predicate_count*
+librdf_storage_hashes_get_predicate_count(librdf_storage_hashes_instance* context,
+                                          const unsigned char *key,
+                                          size_t key_len, u64 h, int create)
+{
+  librdf_storage_hashes_predicate_count* pc;
+  int bucket=(int)(h % LIBRDF_STORAGE_HASHES_PREDICATE_BUCKETS);
+
+  for(pc=context->predicate_counts[bucket]; pc; pc=pc->next) {
+    if(pc->key_len == key_len && !memcmp(pc->key, key, key_len))
+      return pc;
+  }
+
+  if(!create)
+    return NULL;
+
+  pc=LIBRDF_CALLOC(librdf_storage_hashes_predicate_count*, 1, sizeof(*pc));
+  if(!pc)
+    return NULL;
+  pc->key=LIBRDF_MALLOC(unsigned char*, key_len);
+  if(!pc->key) {
+    LIBRDF_FREE(librdf_storage_hashes_predicate_count, pc);
+    return NULL;
+  }
+  memcpy(pc->key, key, key_len);
+  pc->key_len=key_len;
+  pc->next=context->predicate_counts[bucket];
+  context->predicate_counts[bucket]=pc;
+
+  return pc;
+}
+
+
+/*
+ * librdf_storage_hashes_stats_update:
+ * @storage: storage object
+ * @statement: statement added or removed
+ * @delta: +1 for an add, -1 for a remove
+ *
+ * INTERNAL - Update the statistics for a statement
+ *
+ * Distinct counts only ever grow; they are estimates of the nodes
+ * ever used rather than of those still in the store.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_stats_update(librdf_storage* storage,
+                                   librdf_statement* statement, int delta)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_node* nodes[3];
+  int i;
+
+  nodes[0]=librdf_statement_get_subject(statement);
+  nodes[1]=librdf_statement_get_predicate(statement);
+  nodes[2]=librdf_statement_get_object(statement);
+
+  context->statements_count += delta;
+  if(context->statements_count < 0)
+    context->statements_count=0;
+  context->stats_dirty=1;
+
+  for(i=0; i<3; i++) {
+    size_t len;
+    u64 h;
+
+    if(!nodes[i])
+      continue;
+
+    /* 'p' prefix so the buffer is also the predicate's stats key */
+    len=librdf_node_encode(nodes[i], NULL, 0);
+    if(!len)
+      return 1;
+    if(librdf_storage_hashes_grow_buffer(&context->stats_buffer,
+                                         &context->stats_buffer_len, len+1))
+      return 1;
+    context->stats_buffer[0]='p';
+    if(!librdf_node_encode(nodes[i], context->stats_buffer+1, len))
+      return 1;
+
+    h=librdf_storage_hashes_stats_hash(context->stats_buffer+1, len);
+    if(delta > 0)
+      librdf_storage_hashes_distinct_add(&context->distinct[i], h);
+
+    if(i == 1) {
+      librdf_storage_hashes_predicate_count* pc;
+
+      pc=librdf_storage_hashes_get_predicate_count(context,
+                                                   context->stats_buffer,
+                                                   len+1, h, (delta > 0));
+      if(pc) {
+        pc->count += delta;
+        if(pc->count < 0)
+          pc->count=0;
+        pc->dirty=1;
+      } else if(delta > 0)
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static void
+librdf_storage_hashes_stats_free(librdf_storage_hashes_instance* context)
+{
+  int i;
+
+  for(i=0; i<LIBRDF_STORAGE_HASHES_PREDICATE_BUCKETS; i++) {
+    librdf_storage_hashes_predicate_count* pc=context->predicate_counts[i];
+
+    while(pc) {
+      librdf_storage_hashes_predicate_count* next=pc->next;
+      LIBRDF_FREE(data, pc->key);
+      LIBRDF_FREE(librdf_storage_hashes_predicate_count, pc);
+      pc=next;
+    }
+    context->predicate_counts[i]=NULL;
+  }
+
+  context->statements_count=0;
+  for(i=0; i<3; i++)
+    context->distinct[i].count=0;
+}
+
+
+/*
+ * librdf_storage_hashes_stats_load:
+ * @storage: storage object
+ *
+ * INTERNAL - Read the statistics saved in the stats hash
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_stats_load(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum key, value; /* on stack */
+  int status=0;
+  int rc;
+
+  librdf_storage_hashes_stats_free(context);
+  context->stats_dirty=0;
+
+  cursor=librdf_new_hash_cursor(context->hashes[context->stats_index]);
+  if(!cursor)
+    return 1;
+
+  key.data=NULL; value.data=NULL;
+  rc=librdf_hash_cursor_get_first(cursor, &key, &value);
+  while(!rc) {
+    const unsigned char *k=(const unsigned char*)key.data;
+    int i;
+
+    if(key.size == 1 && *k == 'n' &&
+       value.size == LIBRDF_STORAGE_HASHES_NODE_ID_SIZE) {
+      context->statements_count=(long)librdf_storage_hashes_bytes_to_id((unsigned char*)value.data);
+    } else if(key.size > 1 && *k == 'p' &&
+              value.size == LIBRDF_STORAGE_HASHES_NODE_ID_SIZE) {
+      librdf_storage_hashes_predicate_count* pc;
+      u64 h=librdf_storage_hashes_stats_hash(k+1, key.size-1);
+
+      pc=librdf_storage_hashes_get_predicate_count(context, k, key.size, h, 1);
+      if(!pc) {
+        status=1;
+        break;
+      }
+      pc->count=(long)librdf_storage_hashes_bytes_to_id((unsigned char*)value.data);
+    } else {
+      for(i=0; i<3; i++) {
+        if(key.size == 2 &&
+           !memcmp(k, librdf_storage_hashes_stats_distinct_keys[i], 2)) {
+          librdf_storage_hashes_distinct* distinct=&context->distinct[i];
+          const unsigned char *v=(const unsigned char*)value.data;
+          int j;
+
+          distinct->count=(int)(value.size / LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+          if(distinct->count > LIBRDF_STORAGE_HASHES_DISTINCT_K)
+            distinct->count=LIBRDF_STORAGE_HASHES_DISTINCT_K;
+          for(j=0; j<distinct->count; j++)
+            distinct->minimums[j]=librdf_storage_hashes_bytes_to_id(v+j*LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+        }
+      }
+    }
+
+    key.data=NULL; value.data=NULL;
+    rc=librdf_hash_cursor_get_next(cursor, &key, &value);
+  }
+  librdf_free_hash_cursor(cursor);
+
+  return status;
+}
+
+
+/* Replace the single value stored for a key in the stats hash */
+static int
+librdf_storage_hashes_stats_put(librdf_hash* hash,
+                                const unsigned char *key, size_t key_len,
+                                const unsigned char *value, size_t value_len)
+{
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+
+  hd_key.data=(void*)key; hd_key.size=key_len;
+  hd_value.data=(void*)value; hd_value.size=value_len;
+  librdf_hash_delete_all(hash, &hd_key);
+  return librdf_hash_put(hash, &hd_key, &hd_value);
+}
+
+
+/*
+ * librdf_storage_hashes_stats_save:
+ * @storage: storage object
+ *
+ * INTERNAL - Write changed statistics to the stats hash
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_stats_save(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash* hash=context->hashes[context->stats_index];
+  unsigned char number[LIBRDF_STORAGE_HASHES_NODE_ID_SIZE];
+  unsigned char* minimums;
+  int i, j;
+
+  if(!context->stats_dirty)
+    return 0;
+
+  librdf_storage_hashes_id_to_bytes((u64)context->statements_count, number);
+  if(librdf_storage_hashes_stats_put(hash,
+                                     (const unsigned char*)LIBRDF_STORAGE_HASHES_STATS_COUNT_KEY, 1,
+                                     number, sizeof(number)))
+    return 1;
+
+  minimums=LIBRDF_MALLOC(unsigned char*, LIBRDF_STORAGE_HASHES_DISTINCT_K*LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+  if(!minimums)
+    return 1;
+  for(i=0; i<3; i++) {
+    librdf_storage_hashes_distinct* distinct=&context->distinct[i];
+
+    for(j=0; j<distinct->count; j++)
+      librdf_storage_hashes_id_to_bytes(distinct->minimums[j],
+                                        minimums+j*LIBRDF_STORAGE_HASHES_NODE_ID_SIZE);
+    if(librdf_storage_hashes_stats_put(hash,
+                                       (const unsigned char*)librdf_storage_hashes_stats_distinct_keys[i], 2,
+                                       minimums,
+                                       distinct->count*LIBRDF_STORAGE_HASHES_NODE_ID_SIZE)) {
+      LIBRDF_FREE(data, minimums);
+      return 1;
+    }
+  }
+  LIBRDF_FREE(data, minimums);
+
+  for(i=0; i<LIBRDF_STORAGE_HASHES_PREDICATE_BUCKETS; i++) {
+    librdf_storage_hashes_predicate_count* pc;
+
+    for(pc=context->predicate_counts[i]; pc; pc=pc->next) {
+      if(!pc->dirty)
+        continue;
+      librdf_storage_hashes_id_to_bytes((u64)pc->count, number);
+      if(librdf_storage_hashes_stats_put(hash, pc->key, pc->key_len,
+                                         number, sizeof(number)))
+        return 1;
+      pc->dirty=0;
+    }
+  }
+
+  context->stats_dirty=0;
+  return 0;
+}
+
+
+/*
+ * Compressed value blocks
+ *
+ * With the compress-values option, the plain values under a key of an
+ * index hash are packed into blocks once LIBRDF_STORAGE_HASHES_BLOCK_VALUES
+ * of them have been added, so that keys such as the rdf:type predicate
+ * in p2so are not stored as millions of separate values.  A block is
+ * 'z', the varint count of values and then each value as the node ids
+ * of its parts (and context id or 0 with contexts), sorted, with the
+ * first id delta encoded from the previous value.  Blocks are stored
+ * as ordinary values under the key beside any plain ones and are
+ * expanded back into plain values by librdf_storage_hashes_new_values_iterator().
+ */
+
+/* Write v as a varint to p, returning the number of bytes used (max 10) */
+static size_t
+librdf_storage_hashes_put_varint(unsigned char *p, u64 v)
+{
+  size_t len=0;
+
+  while(v >= 0x80) {
+    p[len++]=(unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[len++]=(unsigned char)v;
+  return len;
+}
+
+
+/* Read a varint at *p_p, moving it on; returns non 0 on a bad varint */
+static int
+librdf_storage_hashes_get_varint(const unsigned char **p_p,
+                                 const unsigned char *end, u64 *v_p)
+{
+  const unsigned char *p=*p_p;
+  u64 v=0;
+  int shift=0;
+
+  while(p < end && shift < 64) {
+    unsigned char c=*p++;
+
+    v |= ((u64)(c & 0x7f)) << shift;
+    if(!(c & 0x80)) {
+      *p_p=p;
+      *v_p=v;
+      return 0;
+    }
+    shift += 7;
+  }
+  return 1;
+}
+
+
+/* Number of ids in a value of a compressed index */
+static int
+librdf_storage_hashes_tuple_width(librdf_storage_hashes_instance* context,
+                                  int hash_index)
+{
+  int value_fields=context->hash_descriptions[hash_index]->value_fields;
+  int width=context->index_contexts ? 1 : 0;
+
+  if(value_fields & LIBRDF_STATEMENT_SUBJECT)
+    width++;
+  if(value_fields & LIBRDF_STATEMENT_PREDICATE)
+    width++;
+  if(value_fields & LIBRDF_STATEMENT_OBJECT)
+    width++;
+  return width;
+}
+
+
+/* Get the ids of a plain dictionary value; returns non 0 if it is not one */
+static int
+librdf_storage_hashes_value_to_tuple(librdf_storage_hashes_instance* context,
+                                     int hash_index,
+                                     const unsigned char *p, size_t len,
+                                     librdf_storage_hashes_tuple *tuple)
+{
+  int width=librdf_storage_hashes_tuple_width(context, hash_index);
+  int i=0;
+
+  memset(tuple, 0, sizeof(*tuple));
+
+  if(len < 1 || *p != 'x')
+    return 1;
+  p++;
+  len--;
+
+  while(len >= 1 + LIBRDF_STORAGE_HASHES_NODE_ID_SIZE) {
+    int slot;
+
+    if(*p == 'c') {
+      if(!context->index_contexts)
+        return 1;
+      slot=width-1;
+    } else
+      slot=i++;
+    if(slot >= width)
+      return 1;
+
+    tuple->ids[slot]=librdf_storage_hashes_bytes_to_id(p+1);
+    p += 1 + LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+    len -= 1 + LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  }
+
+  return (len != 0);
+}
+
+
+/* Write the plain dictionary value for tuple ids to p, which must have
+ * room for LIBRDF_STORAGE_HASHES_TUPLE_SIZE ids; returns the length */
+static size_t
+librdf_storage_hashes_tuple_to_value(librdf_storage_hashes_instance* context,
+                                     int hash_index,
+                                     const librdf_storage_hashes_tuple *tuple,
+                                     unsigned char *p)
+{
+  int value_fields=context->hash_descriptions[hash_index]->value_fields;
+  const unsigned char types[3]={'s', 'p', 'o'};
+  const int parts[3]={LIBRDF_STATEMENT_SUBJECT, LIBRDF_STATEMENT_PREDICATE,
+                      LIBRDF_STATEMENT_OBJECT};
+  unsigned char *start=p;
+  int slot=0;
+  int i;
+
+  *p++='x';
+  for(i=0; i<3; i++) {
+    if(!(value_fields & parts[i]))
+      continue;
+    *p++=types[i];
+    librdf_storage_hashes_id_to_bytes(tuple->ids[slot++], p);
+    p += LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  }
+  if(context->index_contexts && tuple->ids[slot]) {
+    *p++='c';
+    librdf_storage_hashes_id_to_bytes(tuple->ids[slot], p);
+    p += LIBRDF_STORAGE_HASHES_NODE_ID_SIZE;
+  }
+
+  return p-start;
+}
+
+
+static int
+librdf_storage_hashes_compare_tuples(const void* a, const void* b)
+{
+  const librdf_storage_hashes_tuple* ta=(const librdf_storage_hashes_tuple*)a;
+  const librdf_storage_hashes_tuple* tb=(const librdf_storage_hashes_tuple*)b;
+  int i;
+
+  for(i=0; i<LIBRDF_STORAGE_HASHES_TUPLE_SIZE; i++) {
+    if(ta->ids[i] != tb->ids[i])
+      return (ta->ids[i] < tb->ids[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+
+/* Encode sorted tuples as a block into the growing buffer; returns
+ * the block length or 0 on failure */
+static size_t
+librdf_storage_hashes_encode_block(librdf_storage_hashes_tuple *tuples,
+                                   int count, int width,
+                                   unsigned char **buffer_p,
+                                   size_t *buffer_len_p)
+{
+  unsigned char *p;
+  u64 previous=0;
+  int i, j;
+
+  if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p,
+                                       11 + (size_t)count*width*10))
+    return 0;
+
+  p=*buffer_p;
+  *p++='z';
+  p += librdf_storage_hashes_put_varint(p, (u64)count);
+  for(i=0; i<count; i++) {
+    p += librdf_storage_hashes_put_varint(p, tuples[i].ids[0]-previous);
+    previous=tuples[i].ids[0];
+    for(j=1; j<width; j++)
+      p += librdf_storage_hashes_put_varint(p, tuples[i].ids[j]);
+  }
+
+  return p-*buffer_p;
+}
+
+
+/* Start reading a block, getting its count; returns non 0 if not a block */
+static int
+librdf_storage_hashes_block_start(const unsigned char **p_p,
+                                  const unsigned char *end, int *count_p)
+{
+  u64 count;
+
+  if(*p_p >= end || **p_p != 'z')
+    return 1;
+  (*p_p)++;
+  if(librdf_storage_hashes_get_varint(p_p, end, &count) || !count ||
+     count > (u64)(end-*p_p))
+    return 1;
+  *count_p=(int)count;
+  return 0;
+}
+
+
+/* Decode the next tuple of a block; tuple holds the previous one on
+ * input.  Returns non 0 on a bad block */
+static int
+librdf_storage_hashes_block_next(const unsigned char **p_p,
+                                 const unsigned char *end, int width,
+                                 librdf_storage_hashes_tuple *tuple)
+{
+  u64 v;
+  int j;
+
+  if(librdf_storage_hashes_get_varint(p_p, end, &v))
+    return 1;
+  tuple->ids[0] += v;
+  for(j=1; j<width; j++) {
+    if(librdf_storage_hashes_get_varint(p_p, end, &tuple->ids[j]))
+      return 1;
+  }
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_pack_key:
+ * @storage: storage object
+ * @hash_index: index of a compressed hash
+ * @key: key to pack the plain values of
+ *
+ * INTERNAL - Replace the plain values of a key with compressed blocks
+ *
+ * Keys with fewer than LIBRDF_STORAGE_HASHES_BLOCK_VALUES plain values
+ * are left alone.  The blocks are written before the plain values are
+ * deleted, so a failure leaves values twice rather than not at all.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_pack_key(librdf_storage* storage, int hash_index,
+                               librdf_hash_datum *key)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash* hash=context->hashes[hash_index];
+  int width=librdf_storage_hashes_tuple_width(context, hash_index);
+  librdf_storage_hashes_tuple *tuples=NULL;
+  int count=0, size=0;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum value, next_key; /* on stack */
+  unsigned char *block=NULL;
+  size_t block_len=0;
+  int status=0;
+  int i;
+
+  cursor=librdf_new_hash_cursor(hash);
+  if(!cursor)
+    return 1;
+
+  value.data=NULL;
+  next_key.data=NULL;
+  for(i=librdf_hash_cursor_set(cursor, key, &value); !i;
+      i=librdf_hash_cursor_get_next_value(cursor, &next_key, &value)) {
+    if(count == size) {
+      int new_size=size ? size*2 : LIBRDF_STORAGE_HASHES_BLOCK_VALUES*2;
+      librdf_storage_hashes_tuple *new_tuples;
+
+      new_tuples=LIBRDF_MALLOC(librdf_storage_hashes_tuple*,
+                               new_size*sizeof(*new_tuples));
+      if(!new_tuples) {
+        status=1;
+        break;
+      }
+      if(tuples) {
+        memcpy(new_tuples, tuples, count*sizeof(*tuples));
+        LIBRDF_FREE(librdf_storage_hashes_tuple, tuples);
+      }
+      tuples=new_tuples;
+      size=new_size;
+    }
+
+    /* blocks are skipped here */
+    if(!librdf_storage_hashes_value_to_tuple(context, hash_index,
+                                             (unsigned char*)value.data,
+                                             value.size, &tuples[count]))
+      count++;
+  }
+  librdf_free_hash_cursor(cursor);
+
+  if(status || count < LIBRDF_STORAGE_HASHES_BLOCK_VALUES)
+    goto tidy;
+
+  qsort(tuples, count, sizeof(*tuples), librdf_storage_hashes_compare_tuples);
+
+  for(i=0; i<count && !status; i+=LIBRDF_STORAGE_HASHES_BLOCK_VALUES) {
+    int n=count-i;
+
+    if(n > LIBRDF_STORAGE_HASHES_BLOCK_VALUES)
+      n=LIBRDF_STORAGE_HASHES_BLOCK_VALUES;
+    value.size=librdf_storage_hashes_encode_block(&tuples[i], n, width,
+                                                  &block, &block_len);
+    value.data=block;
+    if(!value.size || librdf_hash_put(hash, key, &value))
+      status=1;
+  }
+
+  for(i=0; i<count && !status; i++) {
+    unsigned char plain[1+LIBRDF_STORAGE_HASHES_TUPLE_SIZE*(1+LIBRDF_STORAGE_HASHES_NODE_ID_SIZE)];
+
+    value.size=librdf_storage_hashes_tuple_to_value(context, hash_index,
+                                                    &tuples[i], plain);
+    value.data=plain;
+    if(librdf_hash_delete(hash, key, &value))
+      status=1;
+  }
+
+  tidy:
+  if(tuples)
+    LIBRDF_FREE(librdf_storage_hashes_tuple, tuples);
+  if(block)
+    LIBRDF_FREE(data, block);
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_count_plain:
+ * @storage: storage object
+ * @hash_index: index of a compressed hash
+ * @key: key plain values were added to
+ * @count: number of values added
+ *
+ * INTERNAL - Note plain values added to a key, packing it when enough
+ * have been added.  Keys share counters, so a key may be looked at
+ * before it has a block worth of plain values.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_count_plain(librdf_storage* storage, int hash_index,
+                                  librdf_hash_datum *key, int count)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int* counter;
+
+  counter=&context->writes[hash_index].pack_counts[librdf_storage_hashes_stats_hash((unsigned char*)key->data, key->size) & (LIBRDF_STORAGE_HASHES_PACK_BUCKETS-1)];
+  *counter += count;
+  if(*counter < LIBRDF_STORAGE_HASHES_BLOCK_VALUES)
+    return 0;
+
+  *counter=0;
+  return librdf_storage_hashes_pack_key(storage, hash_index, key);
+}
+
+
+/*
+ * librdf_storage_hashes_block_delete:
+ * @storage: storage object
+ * @hash_index: index of a compressed hash
+ * @key: key
+ * @value: plain value to delete
+ *
+ * INTERNAL - Delete a value packed into a block, rewriting the block
+ *
+ * Return value: non 0 on failure or if the value is in no block
+ **/
+static int
+librdf_storage_hashes_block_delete(librdf_storage* storage, int hash_index,
+                                   librdf_hash_datum *key,
+                                   librdf_hash_datum *value)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash* hash=context->hashes[hash_index];
+  int width=librdf_storage_hashes_tuple_width(context, hash_index);
+  librdf_storage_hashes_tuple wanted;
+  librdf_storage_hashes_tuple tuples[LIBRDF_STORAGE_HASHES_BLOCK_VALUES];
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum hd_value, next_key; /* on stack */
+  unsigned char *old_block=NULL;
+  size_t old_block_size=0;
+  size_t old_block_len=0;
+  unsigned char *block=NULL;
+  size_t block_len=0;
+  int found= -1;
+  int count=0;
+  int status;
+
+  if(librdf_storage_hashes_value_to_tuple(context, hash_index,
+                                          (unsigned char*)value->data,
+                                          value->size, &wanted))
+    return 1;
+
+  cursor=librdf_new_hash_cursor(hash);
+  if(!cursor)
+    return 1;
+
+  hd_value.data=NULL;
+  next_key.data=NULL;
+  for(status=librdf_hash_cursor_set(cursor, key, &hd_value); !status;
+      status=librdf_hash_cursor_get_next_value(cursor, &next_key, &hd_value)) {
+    const unsigned char *p=(const unsigned char*)hd_value.data;
+    const unsigned char *end=p+hd_value.size;
+    librdf_storage_hashes_tuple tuple;
+    int i;
+
+    if(librdf_storage_hashes_block_start(&p, end, &count) ||
+       count > LIBRDF_STORAGE_HASHES_BLOCK_VALUES)
+      continue;
+
+    memset(&tuple, 0, sizeof(tuple));
+    found= -1;
+    for(i=0; i<count; i++) {
+      if(librdf_storage_hashes_block_next(&p, end, width, &tuple))
+        break;
+      tuples[i]=tuple;
+      if(found < 0 && !librdf_storage_hashes_compare_tuples(&tuple, &wanted))
+        found=i;
+    }
+
+    if(found >= 0 && i == count) {
+      /* the cursor owns the value so copy it before deleting */
+      if(librdf_storage_hashes_grow_buffer(&old_block, &old_block_size,
+                                           hd_value.size))
+        found= -1;
+      else {
+        memcpy(old_block, hd_value.data, hd_value.size);
+        old_block_len=hd_value.size;
+      }
+      break;
+    }
+    found= -1;
+  }
+  librdf_free_hash_cursor(cursor);
+
+  if(found < 0) {
+    status=1;
+    goto tidy;
+  }
+
+  hd_value.data=old_block;
+  hd_value.size=old_block_len;
+  status=librdf_hash_delete(hash, key, &hd_value);
+
+  /* write back the rest of the block */
+  if(!status && --count > 0) {
+    memmove(&tuples[found], &tuples[found+1],
+            (count-found)*sizeof(*tuples));
+    hd_value.size=librdf_storage_hashes_encode_block(tuples, count, width,
+                                                     &block, &block_len);
+    hd_value.data=block;
+    if(!hd_value.size || librdf_hash_put(hash, key, &hd_value))
+      status=1;
+  }
+
+  tidy:
+  if(old_block)
+    LIBRDF_FREE(data, old_block);
+  if(block)
+    LIBRDF_FREE(data, block);
+  return status;
+}
+
+
+typedef struct {
+  librdf_storage* storage;
+  int hash_index;
+  librdf_iterator* iterator; /* owned iterator over the hash */
+  /* the current block, owned by the hash iterator, or NULL */
+  const unsigned char *block_p;
+  const unsigned char *block_end;
+  int block_remaining;
+  librdf_storage_hashes_tuple tuple;
+  /* the current value, either the hash iterator's or plain */
+  librdf_hash_datum* current;
+  librdf_hash_datum plain;
+  unsigned char plain_buffer[1+LIBRDF_STORAGE_HASHES_TUPLE_SIZE*(1+LIBRDF_STORAGE_HASHES_NODE_ID_SIZE)];
+} librdf_storage_hashes_values_iterator_context;
+
+
+/* Set the current value from the tuple; returns non 0 on a bad block */
+static int
+librdf_storage_hashes_values_iterator_decode(librdf_storage_hashes_values_iterator_context* context)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)context->storage->instance;
+  int width=librdf_storage_hashes_tuple_width(scontext, context->hash_index);
+
+  if(librdf_storage_hashes_block_next(&context->block_p, context->block_end,
+                                      width, &context->tuple))
+    return 1;
+  context->block_remaining--;
+
+  context->plain.data=context->plain_buffer;
+  context->plain.size=librdf_storage_hashes_tuple_to_value(scontext,
+                                                           context->hash_index,
+                                                           &context->tuple,
+                                                           context->plain_buffer);
+  context->current=&context->plain;
+  return 0;
+}
+
+
+/* Take the value at the hash iterator, starting on it if it is a block */
+static void
+librdf_storage_hashes_values_iterator_load(librdf_storage_hashes_values_iterator_context* context)
+{
+  librdf_hash_datum* value;
+
+  context->block_p=NULL;
+  context->block_remaining=0;
+  context->current=NULL;
+
+  if(librdf_iterator_end(context->iterator))
+    return;
+
+  value=(librdf_hash_datum*)librdf_iterator_get_value(context->iterator);
+  context->current=value;
+  if(!value || !value->size || *(unsigned char*)value->data != 'z')
+    return;
+
+  context->block_p=(const unsigned char*)value->data;
+  context->block_end=context->block_p+value->size;
+  memset(&context->tuple, 0, sizeof(context->tuple));
+  if(librdf_storage_hashes_block_start(&context->block_p, context->block_end,
+                                       &context->block_remaining) ||
+     librdf_storage_hashes_values_iterator_decode(context)) {
+    librdf_log(context->storage->world, 0, LIBRDF_LOG_ERROR,
+               LIBRDF_FROM_STORAGE, NULL, "Bad compressed value block");
+    /* decoding the block itself then fails */
+    context->block_remaining=0;
+    context->current=value;
+  }
+}
+
+
+static int
+librdf_storage_hashes_values_iterator_is_end(void* iterator)
+{
+  librdf_storage_hashes_values_iterator_context* context=(librdf_storage_hashes_values_iterator_context*)iterator;
+
+  return librdf_iterator_end(context->iterator);
+}
+
+
+static int
+librdf_storage_hashes_values_iterator_next_method(void* iterator) 
+{
+  librdf_storage_hashes_values_iterator_context* context=(librdf_storage_hashes_values_iterator_context*)iterator;
+  int status;
+
+  if(context->block_remaining > 0 &&
+     !librdf_storage_hashes_values_iterator_decode(context))
+    return 0;
+
+  status=librdf_iterator_next(context->iterator);
+  librdf_storage_hashes_values_iterator_load(context);
+  return status;
+}
+
+
+static void*
+librdf_storage_hashes_values_iterator_get_method(void* iterator, int flags) 
+{
+  librdf_storage_hashes_values_iterator_context* context=(librdf_storage_hashes_values_iterator_context*)iterator;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_VALUE:
+      return context->current;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_KEY:
+      return librdf_iterator_get_key(context->iterator);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_iterator_get_object(context->iterator);
+
+    default:
+      librdf_log(context->storage->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_hashes_values_iterator_finished(void* iterator) 
+{
+  librdf_storage_hashes_values_iterator_context* context=(librdf_storage_hashes_values_iterator_context*)iterator;
+
+  if(context->iterator)
+    librdf_free_iterator(context->iterator);
+  LIBRDF_FREE(librdf_storage_hashes_values_iterator_context, context);
+}
+
+
+/*
+ * librdf_storage_hashes_new_values_iterator:
+ * @storage: storage object
+ * @hash_index: index of the hash iterated
+ * @iterator: key/value iterator over the hash
+ *
+ * INTERNAL - Wrap a hash iterator so compressed blocks read as plain values
+ *
+ * Return value: the iterator itself if the hash is not compressed, a new
+ * iterator taking ownership of it or NULL on failure
+ **/
+static librdf_iterator*
+librdf_storage_hashes_new_values_iterator(librdf_storage* storage,
+                                          int hash_index,
+                                          librdf_iterator* iterator)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_values_iterator_context* context;
+
+  if(!iterator || !scontext->writes[hash_index].pack_counts)
+    return iterator;
+
+  context=LIBRDF_CALLOC(librdf_storage_hashes_values_iterator_context*, 1,
+                        sizeof(*context));
+  if(!context) {
+    librdf_free_iterator(iterator);
+    return NULL;
+  }
+
+  context->storage=storage;
+  context->hash_index=hash_index;
+  context->iterator=iterator;
+  librdf_storage_hashes_values_iterator_load(context);
+
+  iterator=librdf_new_iterator(storage->world, (void*)context,
+                               librdf_storage_hashes_values_iterator_is_end,
+                               librdf_storage_hashes_values_iterator_next_method,
+                               librdf_storage_hashes_values_iterator_get_method,
+                               librdf_storage_hashes_values_iterator_finished);
+  if(!iterator)
+    librdf_storage_hashes_values_iterator_finished(context);
+  return iterator;
+}
+
+
+static int
+librdf_storage_hashes_write_task(librdf_storage* storage, int hash_index,
+                                 void* task_data)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_index_write* write=&context->writes[hash_index];
+  int is_addition=*(int*)task_data;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+
+  if(!write->key_len)
+    return 0;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, write->key_len, write->value_len);
+#endif
+
+  /* Finally, store / remove the sucker */
+  hd_key.data=write->key_buffer; hd_key.size=write->key_len;
+  hd_value.data=write->value_buffer; hd_value.size=write->value_len;
+    
+  if(is_addition) {
+    if(librdf_hash_put(context->hashes[hash_index], &hd_key, &hd_value))
+      return 1;
+    if(write->pack_counts)
+      return librdf_storage_hashes_count_plain(storage, hash_index, &hd_key, 1);
+    return 0;
+  }
+
+  if(!librdf_hash_delete(context->hashes[hash_index], &hd_key, &hd_value))
+    return 0;
+  /* not a plain value - try the compressed blocks */
+  if(write->pack_counts)
+    return librdf_storage_hashes_block_delete(storage, hash_index,
+                                              &hd_key, &hd_value);
+  return 1;
+}
+
+
+static int
+librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
+                                           librdf_statement* statement,
+                                           librdf_node* context_node,
+                                           int is_addition)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+  int missing;
 
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
   if(is_addition)
@@ -644,90 +3342,563 @@ librdf_storage_hashes_add_remove_statement(librdf_storage* storage,
   fputc('\n', stderr);
 #endif  
 
+  if(context->snapshot_of) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Storage is a read-only snapshot");
+    return 1;
+  }
+
+  /* Encode everything first; only the writes are shared out to the
+   * index threads */
   for(i=0; i<context->hash_count; i++) {
-    librdf_hash_datum hd_key, hd_value; /* on stack */
-    size_t key_len, value_len;
+    librdf_storage_hashes_index_write* write=&context->writes[i];
+    librdf_statement_part fields;
+
+    write->key_len=0;
 
     /* ENCODE KEY */
 
-    librdf_statement_part fields=(librdf_statement_part)context->hash_descriptions[i]->key_fields;
-    if(!fields)
-      continue;
-    
-    key_len = librdf_statement_encode_parts2(world, statement, NULL, NULL, 0,
-                                             fields);
-    if(!key_len)
-      return 1;
-    if(librdf_storage_hashes_grow_buffer(&context->key_buffer, 
-                                         &context->key_buffer_len, key_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                       context->key_buffer,
-                                       context->key_buffer_len, fields)) {
+    fields=(librdf_statement_part)context->hash_descriptions[i]->key_fields;
+    if(!fields)
+      continue;
+    
+    write->key_len=librdf_storage_hashes_encode(storage, statement, NULL,
+                                                &write->key_buffer,
+                                                &write->key_buffer_len,
+                                                fields, is_addition, &missing);
+    if(!write->key_len)
+      return 1;
+
+    
+    /* ENCODE VALUE */
+    
+    fields=(librdf_statement_part)context->hash_descriptions[i]->value_fields;
+    if(!fields) {
+      write->key_len=0;
+      continue;
+    }
+    
+    write->value_len=librdf_storage_hashes_encode(storage, statement,
+                                                  context_node,
+                                                  &write->value_buffer,
+                                                  &write->value_buffer_len,
+                                                  fields, is_addition,
+                                                  &missing);
+    if(!write->value_len)
+      return 1;
+  }
+
+  if(librdf_storage_hashes_run_tasks(storage,
+                                     librdf_storage_hashes_write_task,
+                                     &is_addition))
+    return 1;
+
+  librdf_literal_index_update(&context->literal_index, statement,
+                              is_addition);
+
+  if(context->statistics)
+    return librdf_storage_hashes_stats_update(storage, statement,
+                                              is_addition ? 1 : -1);
+  return 0;
+}
+
+
+static int
+librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(context->transaction_bulk)
+    return librdf_storage_hashes_transaction_add_statement(storage, statement);
+
+  /* Do not add duplicate statements */
+  if(librdf_storage_hashes_contains_statement(storage, statement))
+    return 0;
+
+  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+}
+
+
+/* A key/value pair buffered by the bulk load; the key and value
+ * share one allocation starting at key.data */
+typedef struct {
+  librdf_hash_datum key;
+  librdf_hash_datum value;
+  int statement; /* position of the statement in the buffer */
+} librdf_storage_hashes_bulk_pair;
+
+typedef struct {
+  librdf_storage_hashes_bulk_pair* pairs;
+  int count;
+  int size;
+} librdf_storage_hashes_bulk_index;
+
+struct librdf_storage_hashes_bulk_s {
+  librdf_storage_hashes_bulk_index* indexes; /* one per hash */
+  int statements;
+  size_t bytes;
+  char* skip; /* statements not to write, during a flush */
+};
+
+
+/* Orders as the bdb btree and mmap hashes do: by the bytes then by
+ * length, then by value */
+static int
+librdf_storage_hashes_bulk_compare_datums(const librdf_hash_datum* a,
+                                          const librdf_hash_datum* b)
+{
+  int c=memcmp(a->data, b->data, (a->size < b->size) ? a->size : b->size);
+  if(c)
+    return c;
+  return (a->size < b->size) ? -1 : (a->size > b->size);
+}
+
+
+static int
+librdf_storage_hashes_bulk_compare_pairs(const void* a, const void* b)
+{
+  const librdf_storage_hashes_bulk_pair* pa=(const librdf_storage_hashes_bulk_pair*)a;
+  const librdf_storage_hashes_bulk_pair* pb=(const librdf_storage_hashes_bulk_pair*)b;
+  int c;
+
+  c=librdf_storage_hashes_bulk_compare_datums(&pa->key, &pb->key);
+  if(c)
+    return c;
+  return librdf_storage_hashes_bulk_compare_datums(&pa->value, &pb->value);
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_add:
+ * @storage: storage object
+ * @bulk: bulk load buffer
+ * @statement: statement to add
+ *
+ * INTERNAL - Encode a statement for every index into the bulk load buffer
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_bulk_add(librdf_storage* storage,
+                               librdf_storage_hashes_bulk* bulk,
+                               librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+  int missing;
+
+  for(i=0; i<context->hash_count; i++) {
+    librdf_storage_hashes_bulk_index* index=&bulk->indexes[i];
+    librdf_storage_hashes_bulk_pair* pair;
+    librdf_statement_part key_fields;
+    librdf_statement_part value_fields;
+    size_t key_len, value_len;
+    unsigned char* data;
+
+    key_fields=(librdf_statement_part)context->hash_descriptions[i]->key_fields;
+    value_fields=(librdf_statement_part)context->hash_descriptions[i]->value_fields;
+    if(!key_fields || !value_fields)
+      continue;
+
+    key_len=librdf_storage_hashes_encode(storage, statement, NULL,
+                                         &context->key_buffer,
+                                         &context->key_buffer_len,
+                                         key_fields, 1, &missing);
+    if(!key_len)
+      return 1;
+    value_len=librdf_storage_hashes_encode(storage, statement, NULL,
+                                           &context->value_buffer,
+                                           &context->value_buffer_len,
+                                           value_fields, 1, &missing);
+    if(!value_len)
+      return 1;
+
+    if(index->count == index->size) {
+      int new_size=index->size ? index->size*2 : 1024;
+      librdf_storage_hashes_bulk_pair* new_pairs;
+
+      new_pairs=LIBRDF_MALLOC(librdf_storage_hashes_bulk_pair*,
+                              new_size*sizeof(*new_pairs));
+      if(!new_pairs)
+        return 1;
+      if(index->pairs) {
+        memcpy(new_pairs, index->pairs, index->count*sizeof(*new_pairs));
+        LIBRDF_FREE(librdf_storage_hashes_bulk_pair, index->pairs);
+      }
+      index->pairs=new_pairs;
+      index->size=new_size;
+    }
+
+    data=LIBRDF_MALLOC(unsigned char*, key_len+value_len);
+    if(!data)
+      return 1;
+    memcpy(data, context->key_buffer, key_len);
+    memcpy(data+key_len, context->value_buffer, value_len);
+
+    pair=&index->pairs[index->count++];
+    pair->key.data=data; pair->key.size=key_len;
+    pair->value.data=data+key_len; pair->value.size=value_len;
+    pair->statement=bulk->statements;
+
+    bulk->bytes += key_len+value_len+sizeof(*pair);
+  }
+
+  bulk->statements++;
+  return 0;
+}
+
+
+static void
+librdf_storage_hashes_bulk_clear(librdf_storage* storage,
+                                 librdf_storage_hashes_bulk* bulk)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i, j;
+
+  for(i=0; i<context->hash_count; i++) {
+    librdf_storage_hashes_bulk_index* index=&bulk->indexes[i];
+
+    for(j=0; j<index->count; j++)
+      LIBRDF_FREE(data, index->pairs[j].key.data);
+    index->count=0;
+  }
+  bulk->statements=0;
+  bulk->bytes=0;
+}
+
+
+/* Sort the buffered pairs of one hash and write those not skipped */
+static int
+librdf_storage_hashes_bulk_write_task(librdf_storage* storage, int hash_index,
+                                      void* task_data)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_bulk* bulk=(librdf_storage_hashes_bulk*)task_data;
+  librdf_storage_hashes_bulk_index* index=&bulk->indexes[hash_index];
+  librdf_hash_datum* keys;
+  librdf_hash_datum* values;
+  int count=0;
+  int status=0;
+  int j;
+
+  if(!index->count)
+    return 0;
+
+  /* the all statements index was sorted when finding duplicates */
+  if(hash_index != context->all_statements_hash_index)
+    qsort(index->pairs, index->count, sizeof(*index->pairs),
+          librdf_storage_hashes_bulk_compare_pairs);
+
+  keys=LIBRDF_MALLOC(librdf_hash_datum*, index->count*sizeof(*keys));
+  values=LIBRDF_MALLOC(librdf_hash_datum*, index->count*sizeof(*values));
+  if(!keys || !values) {
+    status=1;
+    goto tidy;
+  }
+
+  for(j=0; j<index->count; j++) {
+    if(bulk->skip[index->pairs[j].statement])
+      continue;
+    keys[count]=index->pairs[j].key;
+    values[count]=index->pairs[j].value;
+    count++;
+  }
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  LIBRDF_DEBUG3("Writing %d sorted pairs to %s hash\n", count, context->hash_descriptions[hash_index]->name);
+#endif
+
+  if(count)
+    status=librdf_hash_put_batch(context->hashes[hash_index], keys, values,
+                                 count);
+
+  /* the pairs are sorted so each key's values are together */
+  for(j=0; j<count && !status && context->writes[hash_index].pack_counts; ) {
+    int run=1;
+
+    while(j+run < count &&
+          !librdf_storage_hashes_bulk_compare_datums(&keys[j], &keys[j+run]))
+      run++;
+    status=librdf_storage_hashes_count_plain(storage, hash_index, &keys[j],
+                                             run);
+    j += run;
+  }
+
+  tidy:
+  if(keys)
+    LIBRDF_FREE(librdf_hash_datum, keys);
+  if(values)
+    LIBRDF_FREE(librdf_hash_datum, values);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_flush:
+ * @storage: storage object
+ * @bulk: bulk load buffer
+ *
+ * INTERNAL - Sort the buffered pairs of each index and write them in key order
+ *
+ * Statements already in the store or repeated in the buffer are found
+ * from the sorted all statements index and are not written to any index.
+ * The buffer is empty afterwards, even on failure.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_bulk_flush(librdf_storage* storage,
+                                 librdf_storage_hashes_bulk* bulk)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int all_index=context->all_statements_hash_index;
+  librdf_hash_datum* keys=NULL;
+  librdf_hash_datum* values=NULL;
+  int* results=NULL;
+  char* skip=NULL;
+  int status=0;
+  int count;
+  int j;
+
+  if(!bulk->statements)
+    return 0;
+
+  count=bulk->indexes[all_index].count;
+  keys=LIBRDF_MALLOC(librdf_hash_datum*, count*sizeof(*keys));
+  values=LIBRDF_MALLOC(librdf_hash_datum*, count*sizeof(*values));
+  results=LIBRDF_MALLOC(int*, count*sizeof(*results));
+  skip=LIBRDF_CALLOC(char*, bulk->statements, 1);
+  if(!keys || !values || !results || !skip) {
+    status=1;
+    goto tidy;
+  }
+
+  /* find duplicates from the index holding whole statements */
+  if(bulk->indexes[all_index].count) {
+    librdf_storage_hashes_bulk_index* index=&bulk->indexes[all_index];
+    
+    qsort(index->pairs, index->count, sizeof(*index->pairs),
+          librdf_storage_hashes_bulk_compare_pairs);
+
+    for(j=0; j<index->count; j++) {
+      keys[j]=index->pairs[j].key;
+      values[j]=index->pairs[j].value;
+    }
+    if(librdf_hash_exists_batch(context->hashes[all_index], keys, values,
+                                index->count, results)) {
+      status=1;
+      goto tidy;
+    }
+
+    for(j=0; j<index->count; j++) {
+      if(results[j] > 0 ||
+         (j && !librdf_storage_hashes_bulk_compare_pairs(&index->pairs[j-1],
+                                                         &index->pairs[j])))
+        skip[index->pairs[j].statement]=1;
+    }
+  }
+
+  bulk->skip=skip;
+  status=librdf_storage_hashes_run_tasks(storage,
+                                         librdf_storage_hashes_bulk_write_task,
+                                         bulk);
+  bulk->skip=NULL;
+
+  if(!status && context->statistics) {
+    librdf_storage_hashes_bulk_index* index=&bulk->indexes[all_index];
+    librdf_statement statement; /* on stack */
+
+    librdf_statement_init(storage->world, &statement);
+    for(j=0; j<index->count && !status; j++) {
+      librdf_storage_hashes_bulk_pair* pair=&index->pairs[j];
+
+      if(skip[pair->statement])
+        continue;
+      if(!librdf_storage_hashes_decode(storage, &statement, NULL,
+                                       (unsigned char*)pair->key.data,
+                                       pair->key.size) ||
+         !librdf_storage_hashes_decode(storage, &statement, NULL,
+                                       (unsigned char*)pair->value.data,
+                                       pair->value.size) ||
+         librdf_storage_hashes_stats_update(storage, &statement, 1))
+        status=1;
+      librdf_statement_clear(&statement);
+    }
+  }
+
+  tidy:
+  librdf_storage_hashes_bulk_clear(storage, bulk);
+
+  if(keys)
+    LIBRDF_FREE(librdf_hash_datum, keys);
+  if(values)
+    LIBRDF_FREE(librdf_hash_datum, values);
+  if(results)
+    LIBRDF_FREE(int, results);
+  if(skip)
+    LIBRDF_FREE(char, skip);
+
+  return status;
+}
+
+
+/* INTERNAL - Make an empty bulk load buffer for every hash */
+static librdf_storage_hashes_bulk*
+librdf_storage_hashes_new_bulk(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_bulk* bulk;
+
+  bulk=LIBRDF_CALLOC(librdf_storage_hashes_bulk*, 1, sizeof(*bulk));
+  if(!bulk)
+    return NULL;
+
+  bulk->indexes=LIBRDF_CALLOC(librdf_storage_hashes_bulk_index*,
+                              context->hash_count, sizeof(*bulk->indexes));
+  if(!bulk->indexes) {
+    LIBRDF_FREE(librdf_storage_hashes_bulk, bulk);
+    return NULL;
+  }
+
+  return bulk;
+}
+
+
+/* INTERNAL - Free a bulk load buffer, dropping any pairs still in it */
+static void
+librdf_storage_hashes_free_bulk(librdf_storage* storage,
+                                librdf_storage_hashes_bulk* bulk)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+
+  librdf_storage_hashes_bulk_clear(storage, bulk);
+
+  for(i=0; i<context->hash_count; i++) {
+    if(bulk->indexes[i].pairs)
+      LIBRDF_FREE(librdf_storage_hashes_bulk_pair, bulk->indexes[i].pairs);
+  }
+  LIBRDF_FREE(librdf_storage_hashes_bulk_index, bulk->indexes);
+  LIBRDF_FREE(librdf_storage_hashes_bulk, bulk);
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_add_statements:
+ * @storage: storage object
+ * @statement_stream: stream of statements to add
+ *
+ * INTERNAL - Add statements by buffering, sorting and appending them per index
+ *
+ * Used for add_statements when the bulk-load option is set.  Each time
+ * the buffer passes bulk-load-buffer bytes it is sorted and written, so
+ * every hash sees runs of inserts in key order instead of one random
+ * insert per statement.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_hashes_bulk_add_statements(librdf_storage* storage,
+                                          librdf_stream* statement_stream)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_bulk* bulk;
+  int status=0;
+
+  bulk=librdf_storage_hashes_new_bulk(storage);
+  if(!bulk)
+    return 1;
+
+  while(!librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(!statement) {
       status=1;
       break;
     }
 
-    
-    /* ENCODE VALUE */
-    
-    fields=(librdf_statement_part)context->hash_descriptions[i]->value_fields;
-    if(!fields)
-      continue;
-    
-    value_len=librdf_statement_encode_parts2(world, statement, context_node,
-                                             NULL, 0, fields);
-    if(!value_len) {
-      status=1;
-      break;
-    }
-    
-    if(librdf_storage_hashes_grow_buffer(&context->value_buffer, 
-                                         &context->value_buffer_len, value_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, context_node,
-                                       context->value_buffer,
-                                       context->value_buffer_len, fields)) {
-      status=1;
-      break;
+    /* a statement stored with a context is not found by the exact
+     * pair check in the flush, so look for it the slow way */
+    if(!context->index_contexts ||
+       !librdf_storage_hashes_contains_statement(storage, statement)) {
+      status=librdf_storage_hashes_bulk_add(storage, bulk, statement);
+      if(!status)
+        librdf_literal_index_update(&context->literal_index, statement, 1);
+      if(!status && bulk->bytes >= context->bulk_load_buffer)
+        status=librdf_storage_hashes_bulk_flush(storage, bulk);
     }
 
-
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[i]->name, key_len, value_len);
-#endif
-
-    /* Finally, store / remove the sucker */
-    hd_key.data=context->key_buffer; hd_key.size=key_len;
-    hd_value.data=context->value_buffer; hd_value.size=value_len;
-    
-    if(is_addition)
-      status=librdf_hash_put(context->hashes[i], &hd_key, &hd_value);
-    else
-      status=librdf_hash_delete(context->hashes[i], &hd_key, &hd_value);
-    
     if(status)
       break;
+
+    librdf_stream_next(statement_stream);
   }
 
+  if(!status)
+    status=librdf_storage_hashes_bulk_flush(storage, bulk);
+
+  librdf_storage_hashes_free_bulk(storage, bulk);
+
   return status;
 }
 
 
+/*
+ * librdf_storage_hashes_transaction_flush:
+ * @storage: storage object
+ *
+ * INTERNAL - Write the statements added so far in a transaction
+ *
+ * Called before anything that reads or removes statements inside a
+ * transaction so that it sees the statements added earlier in it.
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_transaction_flush(librdf_storage* storage)
 {
-  /* Do not add duplicate statements */
-  if(librdf_storage_hashes_contains_statement(storage, statement))
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(!context->transaction_bulk || !context->transaction_bulk->statements)
     return 0;
 
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+  context->transaction_flushed=1;
+  return librdf_storage_hashes_bulk_flush(storage, context->transaction_bulk);
+}
+
+
+/* INTERNAL - add_statement inside a transaction: buffer the index
+ * writes, writing them sorted when the buffer is full or at commit */
+static int
+librdf_storage_hashes_transaction_add_statement(librdf_storage* storage,
+                                                librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_bulk* bulk=context->transaction_bulk;
+
+  /* as for the bulk load, a statement stored with a context is not
+   * found by the flush so look for it now, without the flush that
+   * contains_statement does */
+  if(context->index_contexts) {
+    int found;
+
+    librdf_storage_hashes_lock(context);
+    found=librdf_storage_hashes_contains_statement_locked(storage, statement);
+    librdf_storage_hashes_unlock(context);
+    if(found)
+      return 0;
+  }
+
+  if(librdf_storage_hashes_bulk_add(storage, bulk, statement))
+    return 1;
+
+  librdf_literal_index_update(&context->literal_index, statement, 1);
+
+  if(bulk->bytes >= context->bulk_load_buffer)
+    return librdf_storage_hashes_transaction_flush(storage);
+
+  return 0;
 }
 
 
@@ -735,8 +3906,13 @@ static int
 librdf_storage_hashes_add_statements(librdf_storage* storage,
                                      librdf_stream* statement_stream)
 {
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int status=0;
 
+  /* a transaction buffers the statements itself */
+  if(context->bulk_load && !context->snapshot_of && !context->transaction_bulk)
+    return librdf_storage_hashes_bulk_add_statements(storage, statement_stream);
+
   while(!librdf_stream_end(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
 
@@ -758,91 +3934,97 @@ librdf_storage_hashes_add_statements(librdf_storage* storage,
 static int
 librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
 {
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return 1;
+
   return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
 }
 
 
 static int
 librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int status;
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return 0;
+
+  librdf_storage_hashes_lock(context);
+  status=librdf_storage_hashes_contains_statement_locked(storage, statement);
+  librdf_storage_hashes_unlock(context);
+  return status;
+}
+
+
+/* INTERNAL - contains_statement with the concurrent lock held */
+static int
+librdf_storage_hashes_contains_statement_locked(librdf_storage* storage,
+                                                librdf_statement* statement)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_hash_datum hd_key, hd_value; /* on stack */
-  unsigned char *key_buffer, *value_buffer;
   size_t key_len, value_len;
   int hash_index=context->all_statements_hash_index;
   librdf_statement_part fields;
   int status;
-  librdf_world* world = storage->world;
+  int missing;
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum next_key; /* on stack */
   
-  if(context->index_contexts) {
-    /* When we have contexts, we have to use find_statements for contains
-     * since a statement is encoded in KEY/VALUE and the VALUE may
-     * contain some context node.
-     */
-    librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
-    
-    if(!stream)
-      return 0;
-    /* librdf_stream_end returns 0 if have more, non-0 at end */
-    status=!librdf_stream_end(stream);
-    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
-    librdf_free_stream(stream);
-    return status;
-  }
+  /* The encodings use the instance buffers so this must not be
+   * called while they hold a statement being written */
 
   /* ENCODE KEY */
   fields=(librdf_statement_part)context->hash_descriptions[hash_index]->key_fields;
-  key_len = librdf_statement_encode_parts2(world, statement, NULL,
-                                           NULL, 0, fields);
+  key_len=librdf_storage_hashes_encode(storage, statement, NULL,
+                                       &context->key_buffer,
+                                       &context->key_buffer_len, fields,
+                                       0, &missing);
   if(!key_len)
-    return 1;
-  key_buffer = LIBRDF_MALLOC(unsigned char*, key_len);
-  if(!key_buffer)
-    return 1;
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     key_buffer, key_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
+    /* a node that was never added cannot be in any statement */
+    return missing ? 0 : 1;
 
   /* ENCODE VALUE */
   fields=(librdf_statement_part)context->hash_descriptions[hash_index]->value_fields;
-  value_len = librdf_statement_encode_parts2(world, statement, NULL,
-                                             NULL, 0, fields);
-  if(!value_len) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
-    
-  value_buffer = LIBRDF_MALLOC(unsigned char*, value_len);
-  if(!value_buffer) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
-
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     value_buffer, value_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    LIBRDF_FREE(data, value_buffer);
-    return 1;
-  }
+  value_len=librdf_storage_hashes_encode(storage, statement, NULL,
+                                         &context->value_buffer,
+                                         &context->value_buffer_len,
+                                         fields, 0, &missing);
+  if(!value_len)
+    return missing ? 0 : 1;
 
 
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
   LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, key_len, value_len);
 #endif
 
-  hd_key.data=key_buffer; hd_key.size=key_len;
-  hd_value.data=value_buffer; hd_value.size=value_len;
+  hd_key.data=context->key_buffer; hd_key.size=key_len;
+  hd_value.data=context->value_buffer; hd_value.size=value_len;
   status=librdf_hash_exists(context->hashes[hash_index], &hd_key, &hd_value);
-  
-  LIBRDF_FREE(data, key_buffer);
-  LIBRDF_FREE(data, value_buffer);
+  if(status || !context->index_contexts)
+    /* DO NOT free statement, ownership was not passed in */
+    return status;
 
-  /* DO NOT free statement, ownership was not passed in */
-  return status;
+  /* With contexts, the VALUE may also have a 'c' context node after
+   * the encoded parts, so look for a value starting with them */
+  cursor=librdf_new_hash_cursor(context->hashes[hash_index]);
+  if(!cursor)
+    return 0;
+
+  hd_value.data=NULL;
+  next_key.data=NULL;
+  status=librdf_hash_cursor_set(cursor, &hd_key, &hd_value);
+  while(!status) {
+    if(hd_value.size > value_len &&
+       ((unsigned char*)hd_value.data)[value_len] == 'c' &&
+       !memcmp(hd_value.data, context->value_buffer, value_len))
+      break;
+    status=librdf_hash_cursor_get_next_value(cursor, &next_key, &hd_value);
+  }
+  librdf_free_hash_cursor(cursor);
+
+  return !status;
 }
 
 
@@ -859,12 +4041,19 @@ typedef struct {
   int index_contexts; /* true if this storage indexes contexts */
   librdf_node *context_node;
   int current_is_ok; /* true when current statement and context_node fresh */
+  unsigned char *key_buffer; /* owned key for librdf_storage_hashes_serialise_key */
+  librdf_statement *filter; /* owned pattern statements must match or NULL */
+  int filter_ok; /* true when the current entry is known to match */
+  librdf_statement *batch; /* statements returned by a batch */
+  librdf_node **batch_contexts; /* and their owned contexts */
+  int batch_size;
 } librdf_storage_hashes_serialise_stream_context;
 
 
 static librdf_stream*
 librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
-                                       librdf_node* search_node, int want)
+                                       librdf_node* search_node, int want,
+                                       librdf_statement* filter)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_storage_hashes_serialise_stream_context *scontext;
@@ -873,10 +4062,14 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
   
   scontext = LIBRDF_CALLOC(librdf_storage_hashes_serialise_stream_context*,
                            1, sizeof(*scontext));
-  if(!scontext)
+  if(!scontext) {
+    if(filter)
+      librdf_free_statement(filter);
     return NULL;
+  }
 
   scontext->hash_context=context;
+  scontext->filter=filter;
 
   librdf_statement_init(storage->world, &scontext->current);
 
@@ -924,6 +4117,11 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
     librdf_storage_hashes_serialise_finished((void*)scontext);
     return NULL;
   }
+
+  /* node iterator results are not decoded here */
+  if(!search_node)
+    librdf_stream_set_next_batch_method(stream,
+                                        &librdf_storage_hashes_serialise_next_batch);
   
   return stream;  
 
@@ -934,9 +4132,54 @@ static librdf_stream*
 librdf_storage_hashes_serialise(librdf_storage* storage)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
   return librdf_storage_hashes_serialise_common(storage, 
                                                 context->all_statements_hash_index,
-                                                NULL, 0);
+                                                NULL, 0, NULL);
+}
+
+
+/*
+ * librdf_storage_hashes_serialise_skip - Move a filtered stream to the next matching entry
+ * @scontext: serialise stream context with a filter
+ *
+ * The key and value are first matched as statement views, read in
+ * place, so no nodes are made for entries that do not match.  Entries
+ * in an encoding views cannot read are decoded and matched as
+ * statements.
+ **/
+static void
+librdf_storage_hashes_serialise_skip(librdf_storage_hashes_serialise_stream_context* scontext)
+{
+  while(!librdf_iterator_end(scontext->iterator)) {
+    librdf_hash_datum* key=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
+    librdf_hash_datum* value=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
+    librdf_statement_view view;
+
+    memset(&view, 0, sizeof(view));
+    if(key && value &&
+       librdf_statement_decode_view(&view, (unsigned char*)key->data,
+                                    key->size) &&
+       librdf_statement_decode_view(&view, (unsigned char*)value->data,
+                                    value->size)) {
+      if(librdf_statement_view_match(&view, scontext->filter))
+        break;
+    } else {
+      librdf_statement* statement;
+
+      statement=(librdf_statement*)librdf_storage_hashes_serialise_get_statement(scontext, LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT);
+      if(!statement || librdf_statement_match(statement, scontext->filter))
+        break;
+    }
+
+    scontext->current_is_ok=0;
+    librdf_iterator_next(scontext->iterator);
+  }
+
+  scontext->filter_ok=1;
 }
 
 
@@ -945,6 +4188,9 @@ librdf_storage_hashes_serialise_end_of_stream(void* context)
 {
   librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
 
+  if(scontext->filter && !scontext->filter_ok)
+    librdf_storage_hashes_serialise_skip(scontext);
+
   return librdf_iterator_end(scontext->iterator);
 }
 
@@ -953,9 +4199,15 @@ static int
 librdf_storage_hashes_serialise_next_statement(void* context)
 {
   librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
+  int rc;
 
   scontext->current_is_ok=0;
-  return librdf_iterator_next(scontext->iterator);
+  rc=librdf_iterator_next(scontext->iterator);
+  if(scontext->filter) {
+    librdf_storage_hashes_serialise_skip(scontext);
+    rc=librdf_iterator_end(scontext->iterator);
+  }
+  return rc;
 }
 
 
@@ -965,9 +4217,6 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
   librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
   librdf_hash_datum* hd;
   librdf_node** cnp=NULL;
-  librdf_world* world;
-  
-  world = scontext->storage->world;
   
   if(scontext->search_node) {
     switch(flags) {
@@ -1007,16 +4256,18 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
       hd=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
       
       /* decode key content */
-      if(!librdf_statement_decode2(world, &scontext->current, NULL,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(!librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                       NULL,
+                                       (unsigned char*)hd->data, hd->size)) {
         return NULL;
       }
       
       hd=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
       
       /* decode value content and optional context */
-      if(!librdf_statement_decode2(world, &scontext->current, cnp,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(!librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                       cnp,
+                                       (unsigned char*)hd->data, hd->size)) {
         return NULL;
       }
 
@@ -1036,32 +4287,285 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
 }
 
 
-static void
-librdf_storage_hashes_serialise_finished(void* context)
+/* Release the statements and contexts of the last batch */
+static void
+librdf_storage_hashes_serialise_clear_batch(librdf_storage_hashes_serialise_stream_context* scontext)
+{
+  int i;
+
+  for(i=0; i < scontext->batch_size; i++) {
+    librdf_statement_clear(&scontext->batch[i]);
+    if(scontext->batch_contexts[i]) {
+      librdf_free_node(scontext->batch_contexts[i]);
+      scontext->batch_contexts[i]=NULL;
+    }
+  }
+}
+
+
+/*
+ * librdf_storage_hashes_serialise_next_batch - Get the statements from the current one on
+ *
+ * Each entry is decoded into the current statement as for
+ * librdf_storage_hashes_serialise_get_statement() and its nodes are
+ * then moved into the batch, so no nodes are copied.
+ */
+static int
+librdf_storage_hashes_serialise_next_batch(void* context,
+                                           librdf_statement** statements,
+                                           librdf_node** contexts, int size)
+{
+  librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
+  int count=0;
+
+  if(scontext->batch)
+    librdf_storage_hashes_serialise_clear_batch(scontext);
+
+  if(size > scontext->batch_size) {
+    librdf_statement* batch;
+    librdf_node** batch_contexts;
+    int i;
+
+    batch=LIBRDF_CALLOC(librdf_statement*, size, sizeof(*batch));
+    batch_contexts=LIBRDF_CALLOC(librdf_node**, size, sizeof(*batch_contexts));
+    if(!batch || !batch_contexts) {
+      if(batch)
+        LIBRDF_FREE(librdf_statement*, batch);
+      if(batch_contexts)
+        LIBRDF_FREE(librdf_node**, batch_contexts);
+      return -1;
+    }
+    for(i=0; i < size; i++)
+      librdf_statement_init(scontext->storage->world, &batch[i]);
+
+    if(scontext->batch) {
+      LIBRDF_FREE(librdf_statement*, scontext->batch);
+      LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
+    }
+    scontext->batch=batch;
+    scontext->batch_contexts=batch_contexts;
+    scontext->batch_size=size;
+  }
+
+  while(count < size &&
+        !librdf_storage_hashes_serialise_end_of_stream(scontext)) {
+    librdf_statement slot;
+
+    if(!librdf_storage_hashes_serialise_get_statement(scontext, LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT))
+      return count ? count : -1;
+
+    /* the batch slot is empty so the current statement can swap with it */
+    slot=scontext->batch[count];
+    scontext->batch[count]=scontext->current;
+    scontext->current=slot;
+    scontext->batch_contexts[count]=scontext->context_node;
+    scontext->context_node=NULL;
+
+    statements[count]=&scontext->batch[count];
+    contexts[count]=scontext->batch_contexts[count];
+    count++;
+
+    librdf_storage_hashes_serialise_next_statement(scontext);
+  }
+
+  return count;
+}
+
+
+static void
+librdf_storage_hashes_serialise_finished(void* context)
+{
+  librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
+
+  if(scontext->batch) {
+    librdf_storage_hashes_serialise_clear_batch(scontext);
+    LIBRDF_FREE(librdf_statement*, scontext->batch);
+    LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
+  }
+
+  if(scontext->iterator)
+    librdf_free_iterator(scontext->iterator);
+
+  if(scontext->context_node)
+    librdf_free_node(scontext->context_node);
+      
+  if(scontext->key) {
+    scontext->key->data=NULL;
+    librdf_free_hash_datum(scontext->key);
+  }
+  if(scontext->value) {
+    scontext->value->data=NULL;
+    librdf_free_hash_datum(scontext->value);
+  }
+
+  librdf_statement_clear(&scontext->current);
+
+  if(scontext->key_buffer)
+    LIBRDF_FREE(data, scontext->key_buffer);
+
+  if(scontext->filter)
+    librdf_free_statement(scontext->filter);
+
+  if(scontext->storage)
+    librdf_storage_remove_reference(scontext->storage);
+
+  LIBRDF_FREE(librdf_storage_hashes_serialise_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_hashes_serialise_key - Create a stream of the statements in one hash for a key
+ * @storage: the storage hashes object to iterate
+ * @hash_index: the index of the hash to iterate over
+ * @key_buffer: encoded key, ownership is passed in
+ * @key_len: length of @key_buffer
+ * @is_prefix: non 0 to return all keys starting with the key
+ * @filter: statement to match, ownership is passed in, or NULL
+ * 
+ * Return value: a new #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_hashes_serialise_key(librdf_storage* storage, int hash_index,
+                                    unsigned char *key_buffer, size_t key_len,
+                                    int is_prefix, librdf_statement* filter)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_serialise_stream_context *scontext;
+  librdf_hash *hash;
+  librdf_stream *stream;
+  
+  scontext = LIBRDF_CALLOC(librdf_storage_hashes_serialise_stream_context*,
+                           1, sizeof(*scontext));
+  if(!scontext) {
+    LIBRDF_FREE(data, key_buffer);
+    if(filter)
+      librdf_free_statement(filter);
+    return NULL;
+  }
+
+  scontext->hash_context=context;
+  scontext->index=hash_index;
+  scontext->key_buffer=key_buffer;
+  scontext->filter=filter;
+  scontext->index_contexts=context->index_contexts;
+
+  librdf_statement_init(storage->world, &scontext->current);
+
+  scontext->storage=storage;
+  librdf_storage_add_reference(scontext->storage);
+
+  hash=context->hashes[hash_index];
+
+  scontext->key=librdf_new_hash_datum(storage->world, key_buffer, key_len);
+  scontext->value=librdf_new_hash_datum(storage->world, NULL, 0);
+  if(!scontext->key || !scontext->value) {
+    librdf_storage_hashes_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
+  if(is_prefix)
+    scontext->iterator=librdf_hash_get_prefix(hash, scontext->key);
+  else
+    scontext->iterator=librdf_hash_get_all(hash,
+                                           scontext->key, scontext->value);
+  scontext->iterator=librdf_storage_hashes_new_values_iterator(storage,
+                                                               hash_index,
+                                                               scontext->iterator);
+  if(!scontext->iterator) {
+    librdf_storage_hashes_serialise_finished((void*)scontext);
+    return librdf_new_empty_stream(storage->world);
+  }
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_hashes_serialise_end_of_stream,
+                           &librdf_storage_hashes_serialise_next_statement,
+                           &librdf_storage_hashes_serialise_get_statement,
+                           &librdf_storage_hashes_serialise_finished);
+  if(!stream) {
+    librdf_storage_hashes_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
+  librdf_stream_set_next_batch_method(stream,
+                                      &librdf_storage_hashes_serialise_next_batch);
+  
+  return stream;  
+}
+
+
+/*
+ * librdf_storage_hashes_find_plan - Choose the hash to answer a statement pattern
+ * @context: storage hashes instance
+ * @bound: OR of the LIBRDF_STATEMENT_* fields given in the pattern
+ * @key_fields_p: pointer to store the fields to encode in the key
+ * @is_prefix_p: pointer to store non 0 if the key is a prefix of the hash keys
+ *
+ * A hash can be used if the pattern gives all of its key fields, or if
+ * the hash is ordered and the pattern gives the leading key fields, as
+ * those encode as a prefix of the keys.  The hash with the most key
+ * fields given wins, preferring whole keys to prefixes.
+ * 
+ * Return value: index of the hash or <0 if all statements must be scanned
+ **/
+static int
+librdf_storage_hashes_find_plan(librdf_storage_hashes_instance* context,
+                                int bound, int *key_fields_p,
+                                int *is_prefix_p)
 {
-  librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
-
-  if(scontext->iterator)
-    librdf_free_iterator(scontext->iterator);
+  /* order fields are encoded in keys by librdf_statement_encode_parts2 */
+  static const int parts[3]={LIBRDF_STATEMENT_SUBJECT,
+                             LIBRDF_STATEMENT_PREDICATE,
+                             LIBRDF_STATEMENT_OBJECT};
+  int best_index= -1;
+  int best_score=0;
+  int i;
 
-  if(scontext->context_node)
-    librdf_free_node(scontext->context_node);
-      
-  if(scontext->key) {
-    scontext->key->data=NULL;
-    librdf_free_hash_datum(scontext->key);
-  }
-  if(scontext->value) {
-    scontext->value->data=NULL;
-    librdf_free_hash_datum(scontext->value);
-  }
+  for(i=0; i<context->hash_count; i++) {
+    int key_fields=context->hash_descriptions[i]->key_fields;
+    int used=0;
+    int is_prefix=0;
+    int score=0;
+    int j;
+
+    /* skip the contexts hash */
+    if(!key_fields || !context->hash_descriptions[i]->value_fields)
+      continue;
 
-  librdf_statement_clear(&scontext->current);
+    if(!(key_fields & ~bound))
+      used=key_fields;
+    else {
+      if(!librdf_hash_is_ordered(context->hashes[i]))
+        continue;
+
+      for(j=0; j < 3; j++) {
+        if(!(key_fields & parts[j]))
+          continue;
+        if(!(bound & parts[j]))
+          break;
+        used |= parts[j];
+      }
+      if(!used)
+        continue;
+      is_prefix=1;
+    }
 
-  if(scontext->storage)
-    librdf_storage_remove_reference(scontext->storage);
+    for(j=0; j < 3; j++) {
+      if(used & parts[j])
+        score += 2;
+    }
+    if(!is_prefix)
+      score++;
+
+    if(score > best_score) {
+      best_index=i;
+      best_score=score;
+      *key_fields_p=used;
+      *is_prefix_p=is_prefix;
+    }
+  }
 
-  LIBRDF_FREE(librdf_storage_hashes_serialise_stream_context, scontext);
+  return best_index;
 }
 
 
@@ -1075,7 +4579,10 @@ librdf_storage_hashes_serialise_finished(void* context)
  * Return a stream of statements matching the given statement (or
  * all statements if NULL).  Parts (subject, predicate, object) of the
  * statement can be empty in which case any statement part will match that.
- * Uses #librdf_statement_match to do the matching.
+ * The hash chosen by librdf_storage_hashes_find_plan() is read for
+ * the given parts, falling back to all statements, and any given parts
+ * not in its key are matched on the encoded statements before decoding
+ * them, or with #librdf_statement_match for other encodings.
  * 
  * Return value: a #librdf_stream or NULL on failure
  **/
@@ -1084,32 +4591,119 @@ librdf_storage_hashes_find_statements(librdf_storage* storage, librdf_statement*
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_stream* stream;
+  int bound=0;
+  int key_fields=0;
+  int is_prefix=0;
+  int hash_index;
+  librdf_statement* filter=NULL;
 
-  if(!librdf_statement_get_subject(statement) &&
-     librdf_statement_get_predicate(statement) &&
-     !librdf_statement_get_object(statement) &&
-     context->p2so_index >= 0) {
-    /* (? p ?) -> (s p o) wanted */
-    stream=librdf_storage_hashes_serialise_common(storage,
-                                                  context->p2so_index,
-                                                  librdf_statement_get_predicate(statement),
-                                                  LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT);
-  } else {
-    statement=librdf_new_statement_from_statement(statement);
-    if(!statement)
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  if(librdf_statement_get_subject(statement))
+    bound |= LIBRDF_STATEMENT_SUBJECT;
+  if(librdf_statement_get_predicate(statement))
+    bound |= LIBRDF_STATEMENT_PREDICATE;
+  if(librdf_statement_get_object(statement))
+    bound |= LIBRDF_STATEMENT_OBJECT;
+
+  hash_index=librdf_storage_hashes_find_plan(context, bound, &key_fields,
+                                             &is_prefix);
+
+  /* Statements in the node encoding can be matched in place before
+   * any nodes are made for them */
+  if((hash_index < 0 || (bound & ~key_fields)) &&
+     !context->dictionary && context->key_encoding != 2) {
+    filter=librdf_new_statement_from_statement(statement);
+    if(!filter)
       return NULL;
+  }
+
+  if(hash_index >= 0) {
+    unsigned char *key_buffer=NULL;
+    size_t key_buffer_len=0;
+    size_t key_len;
+    int missing;
+
+    /* ENCODE KEY */
+    key_len=librdf_storage_hashes_encode(storage, statement, NULL,
+                                         &key_buffer, &key_buffer_len,
+                                         (librdf_statement_part)key_fields,
+                                         0, &missing);
+    if(!key_len) {
+      if(key_buffer)
+        LIBRDF_FREE(data, key_buffer);
+      if(filter)
+        librdf_free_statement(filter);
+      /* no statement can use a node that was never added */
+      return missing ? librdf_new_empty_stream(storage->world) : NULL;
+    }
+
+    stream=librdf_storage_hashes_serialise_key(storage, hash_index,
+                                               key_buffer, key_len,
+                                               is_prefix, filter);
+    /* the key gives all the parts so every statement matches */
+    if(!stream || filter || !(bound & ~key_fields))
+      return stream;
+  } else {
+    stream=librdf_storage_hashes_serialise_common(storage,
+                                                  context->all_statements_hash_index,
+                                                  NULL, 0, filter);
+    if(!stream || filter)
+      return stream;
+  }
 
-    stream=librdf_storage_hashes_serialise(storage);
-    if(stream)
-      librdf_stream_add_map(stream, 
-                            &librdf_stream_statement_find_map,
-                            (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
+  statement=librdf_new_statement_from_statement(statement);
+  if(!statement) {
+    librdf_free_stream(stream);
+    return NULL;
   }
+
+  librdf_stream_add_map(stream, 
+                        &librdf_stream_statement_find_map,
+                        (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
   
   return stream;
 }
 
 
+/**
+ * librdf_storage_hashes_find_statements_with_options:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: the context to search or NULL
+ * @options: #librdf_hash of match options or NULL
+ *
+ * Find statements with options.  Substring and prefix matches of
+ * object literals use a text index of the literals, made by the
+ * first of them and then kept up to date.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_hashes_find_statements_with_options(librdf_storage* storage,
+                                                   librdf_statement* statement,
+                                                   librdf_node* context_node,
+                                                   librdf_hash* options)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int prefix;
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  if(librdf_storage_get_text_match(options, statement, &prefix)) {
+    librdf_storage_hashes_lock(context);
+    librdf_literal_index_make(&context->literal_index, storage);
+    librdf_storage_hashes_unlock(context);
+  }
+
+  return librdf_literal_index_find_statements(context->literal_index, storage,
+                                              statement, context_node,
+                                              options);
+}
+
+
 typedef struct {
   librdf_storage* storage;   /* (shared) pointer to storage */
   int hash_index;            /* index of hash in storage list of hashes */
@@ -1150,11 +4744,12 @@ static void*
 librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags) 
 {
   librdf_storage_hashes_node_iterator_context* context=(librdf_storage_hashes_node_iterator_context*)iterator;
+  librdf_storage_hashes_instance* scontext;
   librdf_node* node;
   librdf_hash_datum* value;
-  librdf_world* world;
+  int value_fields;
   
-  world = context->storage->world;
+  scontext = (librdf_storage_hashes_instance*)context->storage->instance;
   
   if(librdf_iterator_end(context->iterator))
     return NULL;
@@ -1171,9 +4766,9 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
     context->context_node=NULL;
       
     /* decode value content and optional context */
-    if(!librdf_statement_decode2(world, &context->statement,
-                                 &context->context_node,
-                                 (unsigned char*)value->data, value->size))
+    if(!librdf_storage_hashes_decode(context->storage, &context->statement,
+                                     &context->context_node,
+                                     (unsigned char*)value->data, value->size))
       return NULL;
     librdf_statement_clear(&context->statement);
     
@@ -1190,34 +4785,24 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
 
 
   /* get object */
-  switch(context->want) {
-    case LIBRDF_STATEMENT_SUBJECT: /* SOURCES (subjects) */
-      if((node=librdf_statement_get_subject(&context->statement)))
-         librdf_free_node(node);
-      break;
-      
-    case LIBRDF_STATEMENT_PREDICATE: /* ARCS (predicates) */
-      if((node=librdf_statement_get_predicate(&context->statement)))
-         librdf_free_node(node);
-      break;
-      
-    case LIBRDF_STATEMENT_OBJECT: /* TARGETS (objects) */
-      if((node=librdf_statement_get_object(&context->statement)))
-         librdf_free_node(node);
-      break;
-      
-    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT): /* p2so */
-      if((node=librdf_statement_get_subject(&context->statement)))
-         librdf_free_node(node);
-      if((node=librdf_statement_get_object(&context->statement)))
-         librdf_free_node(node);
-      break;
-      
-    default: /* error */
-      librdf_log(context->iterator->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                 "Illegal statement part %d seen", context->want);
-      return NULL;
+
+  /* free the nodes decoded from the last value, which may be more
+   * than the wanted part such as the objects in s2po values */
+  value_fields=scontext->hash_descriptions[context->hash_index]->value_fields;
+  if((value_fields & LIBRDF_STATEMENT_SUBJECT) &&
+     (node=librdf_statement_get_subject(&context->statement))) {
+    librdf_free_node(node);
+    librdf_statement_set_subject(&context->statement, NULL);
+  }
+  if((value_fields & LIBRDF_STATEMENT_PREDICATE) &&
+     (node=librdf_statement_get_predicate(&context->statement))) {
+    librdf_free_node(node);
+    librdf_statement_set_predicate(&context->statement, NULL);
+  }
+  if((value_fields & LIBRDF_STATEMENT_OBJECT) &&
+     (node=librdf_statement_get_object(&context->statement))) {
+    librdf_free_node(node);
+    librdf_statement_set_object(&context->statement, NULL);
   }
 
 
@@ -1225,9 +4810,9 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
   if(!value)
     return NULL;
 
-  if(!librdf_statement_decode2(world, &context->statement, NULL,
-                               (unsigned char*)value->data,
-                               value->size))
+  if(!librdf_storage_hashes_decode(context->storage, &context->statement,
+                                   NULL,
+                                   (unsigned char*)value->data, value->size))
     return NULL;
 
   switch(context->want) {
@@ -1293,8 +4878,8 @@ librdf_storage_hashes_node_iterator_finished(void* iterator)
 /*
  * librdf_storage_hashes_node_iterator_create - Create a node iterator for get sources, targets or arcs methods
  * @storage: the storage hashes object to iterate
- * @node1: the first node to encode in the key
- * @node2: the second node to encode in the key
+ * @node1: the first node to encode in the key (or NULL if not needed)
+ * @node2: the second node to encode in the key (or NULL if not needed)
  * @hash_index: the index of the hash to iterate over
  * @want: the field required from the hash value
  * 
@@ -1311,9 +4896,10 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   librdf_storage_hashes_node_iterator_context* icontext;
   librdf_hash *hash;
   librdf_statement_part fields;
-  unsigned char *key_buffer;
+  unsigned char *key_buffer=NULL;
+  size_t key_buffer_len=0;
+  int missing;
   librdf_iterator* iterator;
-  librdf_world* world = storage->world;
   
   icontext = LIBRDF_CALLOC(librdf_storage_hashes_node_iterator_context*, 1,
                            sizeof(*icontext));
@@ -1327,15 +4913,18 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
 
   icontext->index_contexts=scontext->index_contexts;
 
-  node1=librdf_new_node_from_node(node1);
-  if(!node1) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
+  if(node1) {
+    node1=librdf_new_node_from_node(node1);
+    if(!node1) {
+      LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
+      return NULL;
+    }
   }
   if(node2) {
     node2=librdf_new_node_from_node(node2);
     if(!node2) {
-      librdf_free_node(node2);
+      if(node1)
+        librdf_free_node(node1);
       LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
       return NULL;
     }
@@ -1379,83 +4968,411 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
 
   /* ENCODE KEY */
   fields=(librdf_statement_part)scontext->hash_descriptions[hash_index]->key_fields;
-  icontext->key.size=librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                                    NULL, 0, fields);
-  if(!icontext->key.size) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-  key_buffer = LIBRDF_MALLOC(unsigned char*, icontext->key.size);
-  if(!key_buffer) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
        
   /* after this point the finished method is called on errors
    * so must bump the reference count
    */
   librdf_storage_add_reference(icontext->storage);
 
-  if(!librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                     key_buffer, icontext->key.size, fields)) {
+  icontext->key.size=librdf_storage_hashes_encode(storage, &icontext->statement,
+                                                  NULL, &key_buffer,
+                                                  &key_buffer_len, fields,
+                                                  0, &missing);
+  if(!icontext->key.size) {
+    if(key_buffer)
+      LIBRDF_FREE(data, key_buffer);
+    librdf_storage_hashes_node_iterator_finished(icontext);
+    /* no arcs can use a node that was never added */
+    return missing ? librdf_new_empty_iterator(storage->world) : NULL;
+  }
+
+    
+  icontext->key.data=key_buffer;
+
+  icontext->iterator=librdf_hash_get_all(hash, &icontext->key, &icontext->value);
+  icontext->iterator=librdf_storage_hashes_new_values_iterator(storage,
+                                                               hash_index,
+                                                               icontext->iterator);
+  if(!icontext->iterator) {
     LIBRDF_FREE(data, key_buffer);
     librdf_storage_hashes_node_iterator_finished(icontext);
+    return librdf_new_empty_iterator(storage->world);
+  }
+
+  LIBRDF_FREE(data, key_buffer);
+
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               librdf_storage_hashes_node_iterator_is_end,
+                               librdf_storage_hashes_node_iterator_next_method,
+                               librdf_storage_hashes_node_iterator_get_method,
+                               librdf_storage_hashes_node_iterator_finished);
+  if(!iterator)
+    librdf_storage_hashes_node_iterator_finished(icontext);
+  return iterator;
+}
+
+
+static librdf_iterator*
+librdf_storage_hashes_find_sources(librdf_storage* storage, 
+                                   librdf_node* arc, librdf_node *target) 
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  return librdf_storage_hashes_node_iterator_create(storage, arc, target,
+                                                    scontext->sources_index,
+                                                    LIBRDF_STATEMENT_SUBJECT);
+}
+
+
+static librdf_iterator*
+librdf_storage_hashes_find_arcs(librdf_storage* storage,
+                                librdf_node* source, librdf_node *target) 
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  return librdf_storage_hashes_node_iterator_create(storage, source, target,
+                                                    scontext->arcs_index,
+                                                    LIBRDF_STATEMENT_PREDICATE);
+}
+
+static librdf_iterator*
+librdf_storage_hashes_find_targets(librdf_storage* storage,
+                                   librdf_node* source, librdf_node *arc) 
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  return librdf_storage_hashes_node_iterator_create(storage, source, arc,
+                                                    scontext->targets_index,
+                                                    LIBRDF_STATEMENT_OBJECT);
+}
+
+
+typedef struct {
+  librdf_storage* storage;   /* (shared) pointer to storage */
+  librdf_iterator* iterator; /* owned prefix iterator over the hash */
+  librdf_statement statement; /* NOTE: stored here, never allocated */
+  int want;                  /* part of decoded key to return */
+  unsigned char *last_key;   /* copy of the current key */
+  size_t last_key_size;
+  size_t last_key_len;
+} librdf_storage_hashes_key_iterator_context;
+
+
+static int
+librdf_storage_hashes_key_iterator_is_end(void* iterator)
+{
+  librdf_storage_hashes_key_iterator_context* context=(librdf_storage_hashes_key_iterator_context*)iterator;
+
+  return librdf_iterator_end(context->iterator);
+}
+
+
+/* Remember the current key so that its other values can be skipped */
+static int
+librdf_storage_hashes_key_iterator_mark(librdf_storage_hashes_key_iterator_context* context)
+{
+  librdf_hash_datum* key;
+
+  context->last_key_len=0;
+  if(librdf_iterator_end(context->iterator))
+    return 0;
+
+  key=(librdf_hash_datum*)librdf_iterator_get_key(context->iterator);
+  if(librdf_storage_hashes_grow_buffer(&context->last_key,
+                                       &context->last_key_size, key->size))
+    return 1;
+  memcpy(context->last_key, key->data, key->size);
+  context->last_key_len=key->size;
+  return 0;
+}
+
+
+static int
+librdf_storage_hashes_key_iterator_next_method(void* iterator) 
+{
+  librdf_storage_hashes_key_iterator_context* context=(librdf_storage_hashes_key_iterator_context*)iterator;
+
+  /* one answer per key, not per value */
+  while(!librdf_iterator_next(context->iterator)) {
+    librdf_hash_datum* key=(librdf_hash_datum*)librdf_iterator_get_key(context->iterator);
+
+    if(key->size != context->last_key_len ||
+       memcmp(key->data, context->last_key, key->size))
+      return librdf_storage_hashes_key_iterator_mark(context);
+  }
+
+  return 1;
+}
+
+
+static void*
+librdf_storage_hashes_key_iterator_get_method(void* iterator, int flags) 
+{
+  librdf_storage_hashes_key_iterator_context* context=(librdf_storage_hashes_key_iterator_context*)iterator;
+  librdf_hash_datum* key;
+
+  if(librdf_iterator_end(context->iterator))
+    return NULL;
+
+  if(flags == LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT)
+    return NULL;
+
+  if(flags != LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT) {
+    librdf_log(context->storage->world,
+               0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Unimplemented iterator method %d", flags);
+    return NULL;
+  }
+
+  librdf_statement_clear(&context->statement);
+
+  key=(librdf_hash_datum*)librdf_iterator_get_key(context->iterator);
+  if(!librdf_storage_hashes_decode(context->storage, &context->statement,
+                                   NULL,
+                                   (unsigned char*)key->data, key->size))
+    return NULL;
+
+  switch(context->want) {
+    case LIBRDF_STATEMENT_SUBJECT:
+      return librdf_statement_get_subject(&context->statement);
+    case LIBRDF_STATEMENT_PREDICATE:
+      return librdf_statement_get_predicate(&context->statement);
+    case LIBRDF_STATEMENT_OBJECT:
+      return librdf_statement_get_object(&context->statement);
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_hashes_key_iterator_finished(void* iterator) 
+{
+  librdf_storage_hashes_key_iterator_context* context=(librdf_storage_hashes_key_iterator_context*)iterator;
+
+  if(context->iterator)
+    librdf_free_iterator(context->iterator);
+
+  librdf_statement_clear(&context->statement);
+
+  if(context->last_key)
+    LIBRDF_FREE(data, context->last_key);
+
+  if(context->storage)
+    librdf_storage_remove_reference(context->storage);
+
+  LIBRDF_FREE(librdf_storage_hashes_key_iterator_context, context);
+}
+
+
+/*
+ * librdf_storage_hashes_key_iterator_create - Create an iterator over the keys of an ordered hash with a given leading node
+ * @storage: the storage hashes object to iterate
+ * @node: the node of the leading key field
+ * @hash_index: the index of the hash to iterate over
+ * @want: the key field to return
+ * 
+ * Each matching key is returned once, however many values it has.
+ *
+ * Return value: a new #librdf_iterator or NULL on failure
+ **/
+static librdf_iterator*
+librdf_storage_hashes_key_iterator_create(librdf_storage* storage,
+                                          librdf_node* node,
+                                          int hash_index, int want)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_key_iterator_context* icontext;
+  librdf_statement partial; /* on stack, nodes not owned */
+  librdf_hash_datum prefix; /* on stack */
+  int key_fields=scontext->hash_descriptions[hash_index]->key_fields;
+  int missing;
+  librdf_iterator* iterator;
+  librdf_statement_part lead;
+
+  librdf_statement_init(storage->world, &partial);
+  /* keys are encoded subject, predicate, object so lead with the first */
+  if(key_fields & LIBRDF_STATEMENT_SUBJECT) {
+    partial.subject=node;
+    lead=LIBRDF_STATEMENT_SUBJECT;
+  } else if(key_fields & LIBRDF_STATEMENT_PREDICATE) {
+    partial.predicate=node;
+    lead=LIBRDF_STATEMENT_PREDICATE;
+  } else {
+    partial.object=node;
+    lead=LIBRDF_STATEMENT_OBJECT;
+  }
+
+  /* the key buffer is held until the hash iterator has copied it */
+  librdf_storage_hashes_lock(scontext);
+  prefix.size=librdf_storage_hashes_encode(storage, &partial, NULL,
+                                           &scontext->key_buffer,
+                                           &scontext->key_buffer_len,
+                                           lead, 0, &missing);
+  if(!prefix.size) {
+    librdf_storage_hashes_unlock(scontext);
+    /* no arcs can use a node that was never added */
+    return missing ? librdf_new_empty_iterator(storage->world) : NULL;
+  }
+  prefix.data=scontext->key_buffer;
+
+  icontext = LIBRDF_CALLOC(librdf_storage_hashes_key_iterator_context*, 1,
+                           sizeof(*icontext));
+  if(!icontext) {
+    librdf_storage_hashes_unlock(scontext);
     return NULL;
   }
 
-    
-  icontext->key.data=key_buffer;
+  icontext->want=want;
+  librdf_statement_init(storage->world, &icontext->statement);
 
-  icontext->iterator=librdf_hash_get_all(hash, &icontext->key, &icontext->value);
-  if(!icontext->iterator) {
-    LIBRDF_FREE(data, key_buffer);
-    librdf_storage_hashes_node_iterator_finished(icontext);
-    return librdf_new_empty_iterator(storage->world);
-  }
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
 
-  LIBRDF_FREE(data, key_buffer);
+  /* the prefix is copied by the hash iterator */
+  icontext->iterator=librdf_hash_get_prefix(scontext->hashes[hash_index],
+                                            &prefix);
+  librdf_storage_hashes_unlock(scontext);
+  if(!icontext->iterator ||
+     librdf_storage_hashes_key_iterator_mark(icontext)) {
+    librdf_storage_hashes_key_iterator_finished(icontext);
+    return NULL;
+  }
 
   iterator=librdf_new_iterator(storage->world,
                                (void*)icontext,
-                               librdf_storage_hashes_node_iterator_is_end,
-                               librdf_storage_hashes_node_iterator_next_method,
-                               librdf_storage_hashes_node_iterator_get_method,
-                               librdf_storage_hashes_node_iterator_finished);
+                               librdf_storage_hashes_key_iterator_is_end,
+                               librdf_storage_hashes_key_iterator_next_method,
+                               librdf_storage_hashes_key_iterator_get_method,
+                               librdf_storage_hashes_key_iterator_finished);
   if(!iterator)
-    librdf_storage_hashes_node_iterator_finished(icontext);
+    librdf_storage_hashes_key_iterator_finished(icontext);
   return iterator;
 }
 
 
-static librdf_iterator*
-librdf_storage_hashes_find_sources(librdf_storage* storage, 
-                                   librdf_node* arc, librdf_node *target) 
+/*
+ * librdf_storage_hashes_has_key - Check if a hash has a key
+ * @storage: the storage hashes object
+ * @hash_index: the index of the hash to check
+ * @partial: statement with the key fields of the hash
+ *
+ * Return value: non 0 if the key is present
+ **/
+static int
+librdf_storage_hashes_has_key(librdf_storage* storage, int hash_index,
+                              librdf_statement* partial)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum hd_key; /* on stack */
+  int missing;
+  int rc=0;
+
+  librdf_storage_hashes_lock(context);
+  hd_key.size=librdf_storage_hashes_encode(storage, partial, NULL,
+                                           &context->key_buffer,
+                                           &context->key_buffer_len,
+                                           (librdf_statement_part)context->hash_descriptions[hash_index]->key_fields,
+                                           0, &missing);
+  /* a node that was never added has no arcs */
+  if(hd_key.size) {
+    hd_key.data=context->key_buffer;
+    rc=(librdf_hash_exists(context->hashes[hash_index], &hd_key, NULL) > 0);
+  }
+  librdf_storage_hashes_unlock(context);
+
+  return rc;
+}
+
+
+static int
+librdf_storage_hashes_has_arc_in(librdf_storage* storage, librdf_node* node,
+                                 librdf_node* property) 
 {
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
-  return librdf_storage_hashes_node_iterator_create(storage, arc, target,
-                                                    scontext->sources_index,
-                                                    LIBRDF_STATEMENT_SUBJECT);
+  librdf_statement partial; /* on stack, nodes not owned */
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return 0;
+
+  librdf_statement_init(storage->world, &partial);
+  partial.predicate=property;
+  partial.object=node;
+
+  return librdf_storage_hashes_has_key(storage, scontext->sources_index,
+                                       &partial);
+}
+
+
+static int
+librdf_storage_hashes_has_arc_out(librdf_storage* storage, librdf_node* node,
+                                  librdf_node* property) 
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_statement partial; /* on stack, nodes not owned */
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return 0;
+
+  librdf_statement_init(storage->world, &partial);
+  partial.subject=node;
+  partial.predicate=property;
+
+  return librdf_storage_hashes_has_key(storage, scontext->targets_index,
+                                       &partial);
 }
 
 
 static librdf_iterator*
-librdf_storage_hashes_find_arcs(librdf_storage* storage,
-                                librdf_node* source, librdf_node *target) 
+librdf_storage_hashes_get_arcs_in(librdf_storage* storage, librdf_node* node) 
 {
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
-  return librdf_storage_hashes_node_iterator_create(storage, source, target,
-                                                    scontext->arcs_index,
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  if(scontext->o2sp_index < 0)
+    return librdf_storage_node_stream_to_node_create(storage, NULL, node,
+                                                     LIBRDF_STATEMENT_PREDICATE);
+
+  return librdf_storage_hashes_node_iterator_create(storage, NULL, node,
+                                                    scontext->o2sp_index,
                                                     LIBRDF_STATEMENT_PREDICATE);
 }
 
+
 static librdf_iterator*
-librdf_storage_hashes_find_targets(librdf_storage* storage,
-                                   librdf_node* source, librdf_node *arc) 
+librdf_storage_hashes_get_arcs_out(librdf_storage* storage, librdf_node* node) 
 {
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
-  return librdf_storage_hashes_node_iterator_create(storage, source, arc,
-                                                    scontext->targets_index,
-                                                    LIBRDF_STATEMENT_OBJECT);
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
+
+  /* sp2o keys of an ordered hash start with the subject */
+  if(scontext->s2po_index < 0 &&
+     librdf_hash_is_ordered(scontext->hashes[scontext->targets_index]))
+    return librdf_storage_hashes_key_iterator_create(storage, node,
+                                                     scontext->targets_index,
+                                                     LIBRDF_STATEMENT_PREDICATE);
+
+  if(scontext->s2po_index < 0)
+    return librdf_storage_node_stream_to_node_create(storage, node, NULL,
+                                                     LIBRDF_STATEMENT_PREDICATE);
+
+  return librdf_storage_hashes_node_iterator_create(storage, node, NULL,
+                                                    scontext->s2po_index,
+                                                    LIBRDF_STATEMENT_PREDICATE);
 }
 
 /**
@@ -1484,6 +5401,9 @@ librdf_storage_hashes_context_add_statement(librdf_storage* storage,
                "Storage was created without context support");
     return 1;
   }
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return 1;
   
   if(librdf_storage_hashes_add_remove_statement(storage, 
                                                 statement, context_node, 1))
@@ -1532,6 +5452,9 @@ librdf_storage_hashes_context_remove_statement(librdf_storage* storage,
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
                "Storage was created without context support");
   }
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return 1;
   
   if(librdf_storage_hashes_add_remove_statement(storage, 
                                                 statement, context_node, 0))
@@ -1591,6 +5514,9 @@ librdf_storage_hashes_context_serialise(librdf_storage* storage,
                "Storage was created without context support");
     return NULL;
   }
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
   
   scontext = LIBRDF_CALLOC(librdf_storage_hashes_context_serialise_stream_context*,
                            1, sizeof(*scontext));
@@ -1741,18 +5667,169 @@ librdf_storage_hashes_context_serialise_finished(void* context)
 }
 
 
+static int
+librdf_storage_hashes_sync_task(librdf_storage* storage, int hash_index,
+                                void* task_data)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+
+  librdf_hash_sync(context->hashes[hash_index]);
+  return 0;
+}
+
+
 static int
 librdf_storage_hashes_sync(librdf_storage *storage)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  int i;
+
+  if(context->statistics && !context->snapshot_of)
+    librdf_storage_hashes_stats_save(storage);
   
-  for(i=0; i<context->hash_count; i++)
-    librdf_hash_sync(context->hashes[i]);
+  librdf_storage_hashes_run_tasks(storage, librdf_storage_hashes_sync_task,
+                                  NULL);
+  return 0;
+}
+
+
+/* Statements added in a transaction are buffered and written sorted
+ * per index at commit, or when the buffer passes bulk-load-buffer
+ * bytes or something reads the store.  The writes are atomic when
+ * every hash supports transactions, such as bdb hashes opened with the
+ * bdb-env-dir and bdb-txn options; otherwise only the buffered
+ * statements are undone by a rollback. */
+static int
+librdf_storage_hashes_transaction_start(librdf_storage *storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+
+  if(context->in_transaction || context->snapshot_of || !context->is_writable)
+    return 1;
+
+  context->hash_transactions=1;
+  for(i=0; i<context->hash_count; i++) {
+    if(librdf_hash_transaction_start(context->hashes[i])) {
+      while(--i >= 0)
+        librdf_hash_transaction_rollback(context->hashes[i]);
+      context->hash_transactions=0;
+      break;
+    }
+  }
+
+  context->transaction_bulk=librdf_storage_hashes_new_bulk(storage);
+  if(!context->transaction_bulk) {
+    if(context->hash_transactions) {
+      for(i=0; i<context->hash_count; i++)
+        librdf_hash_transaction_rollback(context->hashes[i]);
+      context->hash_transactions=0;
+    }
+    return 1;
+  }
+
+  context->transaction_flushed=0;
+  context->in_transaction=1;
   return 0;
 }
 
 
+/* INTERNAL - Drop the transaction buffer and leave the transaction */
+static void
+librdf_storage_hashes_transaction_end(librdf_storage *storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(context->transaction_bulk) {
+    librdf_storage_hashes_free_bulk(storage, context->transaction_bulk);
+    context->transaction_bulk=NULL;
+  }
+  context->transaction_flushed=0;
+  context->in_transaction=0;
+}
+
+
+static int librdf_storage_hashes_transaction_rollback(librdf_storage *storage);
+
+static int
+librdf_storage_hashes_transaction_commit(librdf_storage *storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+  int status=0;
+
+  if(!context->in_transaction)
+    return 1;
+
+  if(librdf_storage_hashes_transaction_flush(storage)) {
+    /* nothing is committed if the statements could not be written */
+    if(context->hash_transactions) {
+      librdf_storage_hashes_transaction_rollback(storage);
+      return 1;
+    }
+    status=1;
+  }
+
+  if(context->hash_transactions) {
+    for(i=0; i<context->hash_count; i++) {
+      if(librdf_hash_transaction_commit(context->hashes[i]))
+        status=1;
+    }
+  }
+
+  librdf_storage_hashes_transaction_end(storage);
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_transaction_rollback(librdf_storage *storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+  int status=0;
+
+  if(!context->in_transaction)
+    return 1;
+
+  /* the text index may hold literals of statements undone here */
+  if(context->literal_index) {
+    librdf_free_literal_index(context->literal_index);
+    context->literal_index=NULL;
+  }
+
+  if(!context->hash_transactions) {
+    /* only statements still in the buffer can be undone */
+    if(context->transaction_flushed) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+                 "Statements already written in the transaction were not rolled back");
+      status=1;
+    }
+    librdf_storage_hashes_transaction_end(storage);
+    return status;
+  }
+
+  for(i=0; i<context->hash_count; i++) {
+    if(librdf_hash_transaction_rollback(context->hashes[i]))
+      status=1;
+  }
+  librdf_storage_hashes_transaction_end(storage);
+
+  /* ids handed out in the transaction are gone too */
+  if(context->dictionary && librdf_storage_hashes_load_next_node_id(storage))
+    status=1;
+
+  /* and so are the prefix ids */
+  if(context->key_encoding == 2 && librdf_storage_hashes_load_prefixes(storage))
+    status=1;
+
+  /* and so are the counts of the statements added */
+  if(context->statistics && librdf_storage_hashes_stats_load(storage))
+    status=1;
+
+  return status;
+}
+
+
 typedef struct {
   librdf_storage *storage;
   librdf_iterator *iterator;
@@ -1858,6 +5935,9 @@ librdf_storage_hashes_get_contexts(librdf_storage* storage)
                "Storage was created without context support");
     return NULL;
   }
+
+  if(librdf_storage_hashes_transaction_flush(storage))
+    return NULL;
   
   icontext = LIBRDF_CALLOC(librdf_storage_hashes_get_contexts_iterator_context*,
                            1, sizeof(*icontext));
@@ -1894,6 +5974,137 @@ librdf_storage_hashes_get_contexts(librdf_storage* storage)
 
 
 
+/*
+ * librdf_storage_hashes_get_hash_stats:
+ * @storage: #librdf_storage object
+ *
+ * INTERNAL - Get the statistics of every hash as lines of the hash
+ * name and its librdf_hash_get_stats() values.
+ *
+ * Return value: new #librdf_node literal or NULL on failure
+ */
+static librdf_node*
+librdf_storage_hashes_get_hash_stats(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  raptor_stringbuffer* sb;
+  librdf_node* node=NULL;
+  int i;
+
+  sb=raptor_new_stringbuffer();
+  if(!sb)
+    return NULL;
+
+  librdf_storage_hashes_lock(scontext);
+  for(i=0; i<scontext->hash_count; i++) {
+    librdf_hash* stats;
+    char* string;
+
+    stats=librdf_hash_get_stats(scontext->hashes[i]);
+    if(!stats)
+      break;
+    string=librdf_hash_to_string(stats, NULL);
+    librdf_free_hash(stats);
+    if(!string)
+      break;
+
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)scontext->hash_descriptions[i]->name, 1);
+    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)" ", 1, 1);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)string, 1);
+    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"\n", 1, 1);
+    librdf_free_memory(string);
+  }
+  librdf_storage_hashes_unlock(scontext);
+
+  if(i == scontext->hash_count)
+    node=librdf_new_node_from_typed_literal(storage->world,
+                                            raptor_stringbuffer_as_string(sb),
+                                            NULL, NULL);
+  raptor_free_stringbuffer(sb);
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_compact:
+ * @storage: #librdf_storage object
+ *
+ * INTERNAL - Rewrite each hash in key order, one after another, for
+ * the hash types that support it.
+ *
+ * Finds may run between the hashes; a hash with an open stream or
+ * iterator over it is not compacted and fails the call.
+ *
+ * Return value: non 0 on failure, <0 if no hash can be compacted
+ */
+static int
+librdf_storage_hashes_compact(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  int compacted=0;
+  int status=0;
+  int i;
+
+  if(scontext->snapshot_of || !scontext->is_writable ||
+     scontext->in_transaction)
+    return 1;
+
+  if(scontext->statistics)
+    librdf_storage_hashes_stats_save(storage);
+
+  for(i=0; i<scontext->hash_count && !status; i++) {
+    int rc;
+
+    librdf_storage_hashes_lock(scontext);
+    rc=librdf_hash_compact(scontext->hashes[i]);
+    librdf_storage_hashes_unlock(scontext);
+
+    if(rc < 0)
+      continue;
+    if(rc)
+      status=1;
+    else
+      compacted++;
+  }
+
+  if(!status && !compacted)
+    return -1;
+  return status;
+}
+
+
+/**
+ * librdf_storage_hashes_set_feature:
+ * @storage: #librdf_storage object
+ * @feature: #librdf_uri feature property
+ * @value: #librdf_node feature property value
+ *
+ * Set the value of a storage feature.
+ * 
+ * Return value: non 0 on failure (negative if no such feature)
+ **/
+static int
+librdf_storage_hashes_set_feature(librdf_storage* storage,
+                                  librdf_uri* feature, librdf_node* value)
+{
+  unsigned char *uri_string;
+
+  uri_string=librdf_uri_as_string(feature);
+  if(!uri_string)
+    return -1;
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_COMPACT)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+    if(atoi((const char*)librdf_node_get_literal_value(value)) <= 0)
+      return 0;
+    return librdf_storage_hashes_compact(storage);
+  }
+
+  return -1;
+}
+
+
 /**
  * librdf_storage_hashes_get_feature:
  * @storage: #librdf_storage object
@@ -1925,10 +6136,120 @@ librdf_storage_hashes_get_feature(librdf_storage* storage, librdf_uri* feature)
                                               value, NULL, NULL);
   }
 
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_LITERAL_INDEX))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)"1",
+                                              NULL, NULL);
+
+  /* bdb cursors are not opened for use from several threads */
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_SHARED_READS))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)((scontext->concurrent && strcmp(scontext->hash_type, "bdb")) ? "1" : "0"),
+                                              NULL, NULL);
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_SHARED_WRITES))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)"0",
+                                              NULL, NULL);
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_HASH_STATS))
+    return librdf_storage_hashes_get_hash_stats(storage);
+
+  /* bdb is the hash type with a compact method */
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_COMPACT))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)((scontext->is_writable && !scontext->snapshot_of && !strcmp(scontext->hash_type, "bdb")) ? "1" : "0"),
+                                              NULL, NULL);
+
+  if(scontext->statistics) {
+    long count= -1;
+    size_t prefix_len=strlen(LIBRDF_STORAGE_FEATURE_PREDICATE_COUNT);
+    int i;
+
+    if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_STATEMENTS_COUNT))
+      count=scontext->statements_count;
+    else if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_DISTINCT_SUBJECTS))
+      count=librdf_storage_hashes_distinct_estimate(&scontext->distinct[0]);
+    else if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_DISTINCT_PREDICATES))
+      count=librdf_storage_hashes_distinct_estimate(&scontext->distinct[1]);
+    else if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_DISTINCT_OBJECTS))
+      count=librdf_storage_hashes_distinct_estimate(&scontext->distinct[2]);
+    else if(!strncmp((const char*)uri_string,
+                     LIBRDF_STORAGE_FEATURE_PREDICATE_COUNT, prefix_len) &&
+            uri_string[prefix_len]) {
+      librdf_node* predicate;
+      size_t len;
+
+      predicate=librdf_new_node_from_uri_string(storage->world,
+                                                uri_string+prefix_len);
+      if(!predicate)
+        return NULL;
+      len=librdf_node_encode(predicate, NULL, 0);
+      librdf_storage_hashes_lock(scontext);
+      if(len &&
+         !librdf_storage_hashes_grow_buffer(&scontext->stats_buffer,
+                                            &scontext->stats_buffer_len,
+                                            len+1) &&
+         librdf_node_encode(predicate, scontext->stats_buffer+1, len)) {
+        librdf_storage_hashes_predicate_count* pc;
+
+        scontext->stats_buffer[0]='p';
+        pc=librdf_storage_hashes_get_predicate_count(scontext,
+                                                     scontext->stats_buffer,
+                                                     len+1,
+                                                     librdf_storage_hashes_stats_hash(scontext->stats_buffer+1, len),
+                                                     0);
+        count=pc ? pc->count : 0;
+      }
+      librdf_storage_hashes_unlock(scontext);
+      librdf_free_node(predicate);
+    }
+
+    if(count >= 0) {
+      unsigned char value[32];
+
+      i=sprintf((char*)value, "%ld", count);
+      if(i > 0)
+        return librdf_new_node_from_typed_literal(storage->world,
+                                                  value, NULL, NULL);
+    }
+  }
+
   return NULL;
 }
 
 
+/**
+ * librdf_storage_hashes_get_memory_size:
+ * @storage: #librdf_storage object
+ *
+ * Get the approximate bytes of process memory held by the hashes.
+ *
+ * Only hashes kept in memory count, so this is 0 for BerkeleyDB
+ * hashes apart from the prefixes table.
+ * 
+ * Return value: size in bytes
+ **/
+static size_t
+librdf_storage_hashes_get_memory_size(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  size_t size=0;
+  int i;
+
+  librdf_storage_hashes_lock(context);
+  for(i=0; i < context->hash_count; i++) {
+    if(context->hashes[i])
+      size += librdf_hash_get_memory_size(context->hashes[i]);
+  }
+  if(context->prefix_ids)
+    size += librdf_hash_get_memory_size(context->prefix_ids);
+  librdf_storage_hashes_unlock(context);
+
+  return size;
+}
+
+
 /** Local entry point for dynamically loaded storage module */
 static void
 librdf_storage_hashes_register_factory(librdf_storage_factory *factory) 
@@ -1952,13 +6273,23 @@ librdf_storage_hashes_register_factory(librdf_storage_factory *factory)
   factory->find_sources       = librdf_storage_hashes_find_sources;
   factory->find_arcs          = librdf_storage_hashes_find_arcs;
   factory->find_targets       = librdf_storage_hashes_find_targets;
+  factory->get_arcs_in        = librdf_storage_hashes_get_arcs_in;
+  factory->get_arcs_out       = librdf_storage_hashes_get_arcs_out;
+  factory->has_arc_in         = librdf_storage_hashes_has_arc_in;
+  factory->has_arc_out        = librdf_storage_hashes_has_arc_out;
 
   factory->context_add_statement    = librdf_storage_hashes_context_add_statement;
   factory->context_remove_statement = librdf_storage_hashes_context_remove_statement;
   factory->context_serialise        = librdf_storage_hashes_context_serialise;
   factory->sync                     = librdf_storage_hashes_sync;
+  factory->transaction_start        = librdf_storage_hashes_transaction_start;
+  factory->transaction_commit       = librdf_storage_hashes_transaction_commit;
+  factory->transaction_rollback     = librdf_storage_hashes_transaction_rollback;
   factory->get_contexts             = librdf_storage_hashes_get_contexts;
   factory->get_feature              = librdf_storage_hashes_get_feature;
+  factory->set_feature              = librdf_storage_hashes_set_feature;
+  factory->find_statements_with_options = librdf_storage_hashes_find_statements_with_options;
+  factory->get_memory_size          = librdf_storage_hashes_get_memory_size;
 }
 
 
@@ -33,6 +33,48 @@ extern "C" {
 #endif
 
 /** A storage object */
+/* rdf_storage_stats.c */
+typedef struct librdf_storage_stats_s librdf_storage_stats;
+
+/* rdf_storage_bloom.c */
+typedef struct librdf_storage_bloom_s librdf_storage_bloom;
+
+/* rdf_storage_changes.c */
+typedef struct librdf_storage_changes_s librdf_storage_changes;
+
+/* storage factory calls that are instrumented */
+typedef enum {
+  LIBRDF_STORAGE_OP_SIZE,
+  LIBRDF_STORAGE_OP_ADD_STATEMENT,
+  LIBRDF_STORAGE_OP_ADD_STATEMENTS,
+  LIBRDF_STORAGE_OP_REMOVE_STATEMENT,
+  LIBRDF_STORAGE_OP_CONTAINS_STATEMENT,
+  LIBRDF_STORAGE_OP_COUNT_STATEMENTS,
+  LIBRDF_STORAGE_OP_SERIALISE,
+  LIBRDF_STORAGE_OP_FIND_STATEMENTS,
+  LIBRDF_STORAGE_OP_FIND_SOURCES,
+  LIBRDF_STORAGE_OP_FIND_ARCS,
+  LIBRDF_STORAGE_OP_FIND_TARGETS,
+  LIBRDF_STORAGE_OP_GET_ARCS_IN,
+  LIBRDF_STORAGE_OP_GET_ARCS_OUT,
+  LIBRDF_STORAGE_OP_HAS_ARC_IN,
+  LIBRDF_STORAGE_OP_HAS_ARC_OUT,
+  LIBRDF_STORAGE_OP_CONTEXT_ADD_STATEMENT,
+  LIBRDF_STORAGE_OP_CONTEXT_ADD_STATEMENTS,
+  LIBRDF_STORAGE_OP_CONTEXT_REMOVE_STATEMENT,
+  LIBRDF_STORAGE_OP_CONTEXT_REMOVE_STATEMENTS,
+  LIBRDF_STORAGE_OP_CONTEXT_SERIALISE,
+  LIBRDF_STORAGE_OP_FIND_IN_CONTEXT,
+  LIBRDF_STORAGE_OP_FIND_WITH_OPTIONS,
+  LIBRDF_STORAGE_OP_GET_CONTEXTS,
+  LIBRDF_STORAGE_OP_QUERY_EXECUTE,
+  LIBRDF_STORAGE_OP_SYNC,
+  LIBRDF_STORAGE_OP_TRANSACTION_START,
+  LIBRDF_STORAGE_OP_TRANSACTION_COMMIT,
+  LIBRDF_STORAGE_OP_TRANSACTION_ROLLBACK,
+  LIBRDF_STORAGE_OP_LAST = LIBRDF_STORAGE_OP_TRANSACTION_ROLLBACK
+} librdf_storage_op;
+
 struct librdf_storage_s
 {
   librdf_world *world;
@@ -48,8 +90,41 @@ struct librdf_storage_s
   void *instance;
   int index_contexts;
   struct librdf_storage_factory_s* factory;
+
+  /* name and options the storage was created with, used to open
+   * the same storage again in another world */
+  char *name;
+  char *options_string;
+
+  /* incremented by every change made through the storage API */
+  unsigned long modifications;
+
+  /* operation counts and latencies or NULL if never instrumented */
+  librdf_storage_stats* stats;
+
+  /* filter answering contains checks or NULL if never turned on */
+  librdf_storage_bloom* bloom;
+
+  /* change handlers and the changes queued for them or NULL if no
+   * handler was ever registered */
+  librdf_storage_changes* changes;
+
+  /* adds fail while memory_size is at least memory_limit bytes, 0 for
+   * no limit.  memory_size is measured again at least every
+   * LIBRDF_STORAGE_MEMORY_MEASURE_INTERVAL modifications, counted from
+   * memory_measured */
+  size_t memory_limit;
+  size_t memory_size;
+  unsigned long memory_measured;
 };
 
+size_t librdf_storage_get_memory_size(librdf_storage* storage);
+
+int librdf_storage_get_find_options(librdf_hash* options, int* limit_p, int* offset_p, int* order_p);
+librdf_stream* librdf_storage_limit_stream(librdf_storage* storage, librdf_stream* stream, int limit, int offset);
+int librdf_storage_get_text_match(librdf_hash* options, librdf_statement* statement, int* prefix_p);
+librdf_stream* librdf_storage_find_text_match(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, int prefix);
+
 void librdf_init_storage_list(librdf_world *world);
 
 void librdf_init_storage_hashes(librdf_world *world);
@@ -58,6 +133,10 @@ void librdf_init_storage_trees(librdf_world *world);
 
 void librdf_init_storage_file(librdf_world *world);
 
+void librdf_init_storage_cache(librdf_world *world);
+
+void librdf_init_storage_sharded(librdf_world *world);
+
 #ifdef STORAGE_MYSQL
 void librdf_init_storage_mysql(librdf_world *world);
 #endif
@@ -88,6 +167,13 @@ void librdf_finish_storage(librdf_world *world);
 /* class methods */
 librdf_storage_factory* librdf_get_storage_factory(librdf_world* world, const char *name);
 
+/* interrupt a query running in librdf_storage_query_execute() */
+int librdf_storage_query_cancel(librdf_storage* storage, librdf_query *query);
+
+/* helper function for creating iterators for get sources, targets, arcs
+ * from the find_statements method */
+librdf_iterator* librdf_storage_node_stream_to_node_create(librdf_storage* storage, librdf_node* node1, librdf_node *node2, librdf_statement_part want);
+
 
 /* rdf_storage_sql.c */
 typedef struct  
@@ -105,6 +191,41 @@ librdf_sql_config* librdf_new_sql_config(librdf_world* world, const char *storag
 librdf_sql_config* librdf_new_sql_config_for_storage(librdf_storage* storage, const char* layout, const char* dir);
 void librdf_free_sql_config(librdf_sql_config* config);
 
+#include <rdf_types.h>
+
+typedef struct librdf_sql_node_cache_s librdf_sql_node_cache;
+
+librdf_sql_node_cache* librdf_new_sql_node_cache(int size);
+void librdf_free_sql_node_cache(librdf_sql_node_cache* cache);
+void librdf_sql_node_cache_clear(librdf_sql_node_cache* cache);
+int librdf_sql_node_cache_get(librdf_sql_node_cache* cache, librdf_node* node, u64* id_p);
+int librdf_sql_node_cache_put(librdf_sql_node_cache* cache, librdf_node* node, u64 id);
+
+/* default number of nodes in the SQL storages node id cache */
+#define LIBRDF_SQL_NODE_CACHE_SIZE 1024
+
+/* node id hash functions of the MySQL and PostgreSQL storages */
+typedef enum {
+  LIBRDF_SQL_NODE_HASH_MD5,
+  LIBRDF_SQL_NODE_HASH_XXH64,
+  LIBRDF_SQL_NODE_HASH_LAST = LIBRDF_SQL_NODE_HASH_XXH64
+} librdf_sql_node_hash;
+
+int librdf_sql_node_hash_from_name(const char* name);
+const char* librdf_sql_node_hash_name(librdf_sql_node_hash node_hash);
+u64 librdf_sql_xxh64(const unsigned char* data, size_t len, u64 seed);
+
+/* read-only replica server of the MySQL and PostgreSQL storages */
+typedef struct
+{
+  char* host;
+  /* port or NULL for the primary server port */
+  char* port;
+} librdf_sql_replica;
+
+librdf_sql_replica* librdf_new_sql_replicas(const char* list, int* count_p);
+void librdf_free_sql_replicas(librdf_sql_replica* replicas, int count);
+
 typedef enum {
   DBCONFIG_CREATE_TABLE_STATEMENTS,
   DBCONFIG_CREATE_TABLE_LITERALS,
@@ -117,6 +238,50 @@ typedef enum {
 extern const char* librdf_storage_sql_dbconfig_predicates[DBCONFIG_CREATE_TABLE_LAST+2];
 
 
+/* rdf_storage_literal_index.c */
+typedef struct librdf_literal_index_s librdf_literal_index;
+
+librdf_literal_index* librdf_new_literal_index(librdf_world* world);
+void librdf_free_literal_index(librdf_literal_index* index);
+int librdf_literal_index_add(librdf_literal_index* index, librdf_node* node);
+int librdf_literal_index_add_stream(librdf_literal_index* index, librdf_stream* stream);
+void librdf_literal_index_removed(librdf_literal_index* index);
+int librdf_literal_index_is_stale(librdf_literal_index* index);
+void librdf_literal_index_update(librdf_literal_index** index_p, librdf_statement* statement, int is_addition);
+librdf_literal_index* librdf_literal_index_make(librdf_literal_index** index_p, librdf_storage* storage);
+int librdf_literal_index_matches(librdf_node* node, const unsigned char* text, size_t text_len, int prefix);
+librdf_stream* librdf_literal_index_find_statements(librdf_literal_index* index, librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, librdf_hash* options);
+
+/* rdf_storage_stats.c */
+void librdf_free_storage_stats(librdf_storage_stats* stats);
+int librdf_storage_stats_set_enabled(librdf_storage* storage, int enabled);
+u64 librdf_storage_stats_start(librdf_storage* storage, librdf_storage_op op);
+void librdf_storage_stats_end(librdf_storage* storage, librdf_storage_op op, u64 start, int failed);
+librdf_stream* librdf_storage_stats_stream(librdf_storage* storage, librdf_storage_op op, u64 start, librdf_stream* stream);
+librdf_iterator* librdf_storage_stats_iterator(librdf_storage* storage, librdf_storage_op op, u64 start, librdf_iterator* iterator);
+librdf_node* librdf_storage_stats_get_feature(librdf_storage* storage, const char* uri_string);
+
+/* rdf_storage_bloom.c */
+void librdf_free_storage_bloom(librdf_storage_bloom* bloom);
+int librdf_storage_bloom_set_enabled(librdf_storage* storage, int enabled);
+int librdf_storage_bloom_check(librdf_storage* storage, librdf_statement* statement);
+void librdf_storage_bloom_add(librdf_storage* storage, librdf_statement* statement);
+int librdf_storage_bloom_add_stream(librdf_storage* storage, librdf_stream* stream);
+librdf_node* librdf_storage_bloom_get_feature(librdf_storage* storage);
+
+/* rdf_storage_changes.c */
+void librdf_free_storage_changes(librdf_storage_changes* changes);
+int librdf_storage_add_change_handler(librdf_storage* storage, librdf_model* model, librdf_model_change_handler handler, void* user_data, int queue_size);
+int librdf_storage_remove_change_handler(librdf_storage* storage, librdf_model_change_handler handler, void* user_data);
+int librdf_storage_changes_active(librdf_storage* storage);
+void librdf_storage_changes_record(librdf_storage* storage, librdf_model_change_type type, librdf_statement* statement, librdf_node* context);
+int librdf_storage_changes_add_stream(librdf_storage* storage, librdf_stream* stream, librdf_node* context);
+void librdf_storage_changes_lost(librdf_storage* storage);
+void librdf_storage_changes_start(librdf_storage* storage);
+void librdf_storage_changes_end(librdf_storage* storage);
+void librdf_storage_changes_transaction(librdf_storage* storage, int state);
+
+
 
 #ifdef __cplusplus
 }
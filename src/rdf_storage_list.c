@@ -39,15 +39,34 @@
 #include <sys/types.h>
 
 #include <redland.h>
+#include <rdf_list_internal.h>
 
 
+/* Largest statement index key checked from a stack buffer */
+#define LIBRDF_STORAGE_LIST_KEY_BUFFER_SIZE 512
+
 typedef struct
 {
   librdf_list* list;
 
+  /* statement index: encoded statement => librdf_storage_list_node*
+   * for each copy of the statement in the list (one per context) */
+  librdf_hash* index;
+
   /* If this is non-0, contexts are being used */
   int index_contexts;
   librdf_hash* contexts;
+
+  /* If this is non-0, finds with a subject or predicate use pattern
+   * indexes: encoded node => librdf_storage_list_node* for each list
+   * node with that subject or predicate.  They are NULL until built
+   * by the first such find */
+  int index_patterns;
+  librdf_hash* subjects;
+  librdf_hash* predicates;
+
+  /* approximate bytes of the list nodes and the statements in them */
+  size_t statements_memory;
   
 } librdf_storage_list_instance;
 
@@ -57,6 +76,8 @@ typedef struct
 {
   librdf_statement *statement;
   librdf_node *context;
+  /* node holding this in the list */
+  librdf_list_node *list_node;
 } librdf_storage_list_node;
 
 
@@ -93,6 +114,7 @@ static void librdf_storage_list_context_serialise_finished(void* context);
 static int librdf_storage_list_node_equals(librdf_storage_list_node *first, librdf_storage_list_node *second);
 
 static librdf_iterator* librdf_storage_list_get_contexts(librdf_storage* storage);
+static size_t librdf_storage_list_get_memory_size(librdf_storage* storage);
 
 /* get_context iterator functions */
 static int librdf_storage_list_get_contexts_is_end(void* iterator);
@@ -109,6 +131,7 @@ librdf_storage_list_init(librdf_storage* storage, const char *name,
                          librdf_hash* options)
 {
   int index_contexts=0;
+  int index_patterns;
   librdf_storage_list_instance* context;
 
   context = LIBRDF_CALLOC(librdf_storage_list_instance*, 1, sizeof(*context));
@@ -124,6 +147,11 @@ librdf_storage_list_init(librdf_storage* storage, const char *name,
     index_contexts=0; /* default is no contexts */
 
   context->index_contexts=index_contexts;
+
+  if((index_patterns=librdf_hash_get_as_boolean(options, "index-patterns"))<0)
+    index_patterns=1; /* default is to index on first use */
+
+  context->index_patterns=index_patterns;
   
   /* no more options, might as well free them now */
   if(options)
@@ -172,10 +200,25 @@ librdf_storage_list_open(librdf_storage* storage, librdf_model* model)
   if(!context->list)
     return 1;
 
+  /* create a new memory hash */
+  context->index=librdf_new_hash(storage->world, NULL);
+  if(!context->index ||
+     librdf_hash_open(context->index, NULL, 0, 1, 1, NULL)) {
+    if(context->index) {
+      librdf_free_hash(context->index);
+      context->index=NULL;
+    }
+    librdf_free_list(context->list);
+    context->list=NULL;
+    return 1;
+  }
+
   if(context->index_contexts) {
     /* create a new memory hash */
     context->contexts=librdf_new_hash(storage->world, NULL);
     if(librdf_hash_open(context->contexts, NULL, 0, 1, 1, NULL)) {
+      librdf_free_hash(context->index);
+      context->index=NULL;
       librdf_free_list(context->list);
       context->list=NULL;
       return 1;
@@ -216,6 +259,22 @@ librdf_storage_list_close(librdf_storage* storage)
     librdf_free_list(context->list);
     context->list=NULL;
   }
+  context->statements_memory=0;
+
+  if(context->index) {
+    librdf_free_hash(context->index);
+    context->index=NULL;
+  }
+
+  if(context->subjects) {
+    librdf_free_hash(context->subjects);
+    context->subjects=NULL;
+  }
+
+  if(context->predicates) {
+    librdf_free_hash(context->predicates);
+    context->predicates=NULL;
+  }
 
   if(context->index_contexts) {
     if(context->contexts) {
@@ -237,6 +296,261 @@ librdf_storage_list_size(librdf_storage* storage)
 }
 
 
+/*
+ * librdf_storage_list_node_memory - INTERNAL - Get the approximate bytes held by a list entry
+ * @sln: the list entry
+ *
+ * Return value: size in bytes
+ */
+static size_t
+librdf_storage_list_node_memory(librdf_storage_list_node* sln)
+{
+  size_t size=sizeof(librdf_list_node) + sizeof(*sln) +
+              librdf_statement_get_memory_size(sln->statement);
+
+  if(sln->context)
+    size += librdf_node_get_memory_size(sln->context);
+  return size;
+}
+
+
+/*
+ * librdf_storage_list_index_key - INTERNAL - Make the statement index key for a statement
+ * @storage: the storage
+ * @statement: the statement
+ * @key: datum to set to the encoded statement, freed by the caller
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_list_index_key(librdf_storage* storage,
+                              librdf_statement* statement,
+                              librdf_hash_datum* key)
+{
+  size_t size;
+
+  size=librdf_statement_encode2(storage->world, statement, NULL, 0);
+  if(!size)
+    return 1;
+  key->data = LIBRDF_MALLOC(char*, size);
+  if(!key->data)
+    return 1;
+  key->size=librdf_statement_encode2(storage->world, statement,
+                                     (unsigned char*)key->data, size);
+  return 0;
+}
+
+
+/*
+ * librdf_storage_list_index_find - INTERNAL - Find a list node for a statement in a context with the index
+ * @storage: the storage
+ * @key: statement index key
+ * @context_node: context node or NULL for none
+ *
+ * Return value: list node or NULL if not found
+ */
+static librdf_storage_list_node*
+librdf_storage_list_index_find(librdf_storage* storage, librdf_hash_datum* key,
+                               librdf_node* context_node)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  librdf_hash_datum value; /* on stack - not allocated */
+  librdf_iterator* iterator;
+  librdf_storage_list_node* sln=NULL;
+
+  value.data=NULL;
+  value.size=0;
+  iterator=librdf_hash_get_all(context->index, key, &value);
+  if(!iterator)
+    return NULL;
+
+  for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+    librdf_hash_datum* v=(librdf_hash_datum*)librdf_iterator_get_value(iterator);
+    librdf_storage_list_node* candidate;
+
+    if(!v || v->size != sizeof(candidate))
+      continue;
+    memcpy(&candidate, v->data, sizeof(candidate));
+
+    if(!candidate->context && !context_node) {
+      sln=candidate;
+      break;
+    }
+    if(candidate->context && context_node &&
+       librdf_node_equals(candidate->context, context_node)) {
+      sln=candidate;
+      break;
+    }
+  }
+  librdf_free_iterator(iterator);
+
+  return sln;
+}
+
+
+/*
+ * librdf_storage_list_pattern_update - INTERNAL - Add or remove a list node in a pattern index
+ * @storage: the storage
+ * @hash: pattern index
+ * @node: subject or predicate of the list node
+ * @sln: list node
+ * @add: non 0 to add, 0 to remove
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_list_pattern_update(librdf_storage* storage, librdf_hash* hash,
+                                   librdf_node* node,
+                                   librdf_storage_list_node* sln, int add)
+{
+  librdf_hash_datum key, value; /* on stack - not allocated */
+  size_t size;
+  int status;
+
+  size=librdf_node_encode(node, NULL, 0);
+  key.data = LIBRDF_MALLOC(char*, size);
+  if(!key.data)
+    return 1;
+  key.size=librdf_node_encode(node, (unsigned char*)key.data, size);
+
+  value.data=&sln;
+  value.size=sizeof(sln);
+
+  if(add)
+    status=librdf_hash_put(hash, &key, &value);
+  else
+    status=librdf_hash_delete(hash, &key, &value);
+  LIBRDF_FREE(data, key.data);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_list_patterns_update - INTERNAL - Add or remove a list node in the pattern indexes if built
+ * @storage: the storage
+ * @sln: list node
+ * @add: non 0 to add, 0 to remove
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_list_patterns_update(librdf_storage* storage,
+                                    librdf_storage_list_node* sln, int add)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+
+  if(!context->subjects)
+    return 0;
+
+  if(librdf_storage_list_pattern_update(storage, context->subjects,
+                                        librdf_statement_get_subject(sln->statement),
+                                        sln, add))
+    return 1;
+
+  return librdf_storage_list_pattern_update(storage, context->predicates,
+                                            librdf_statement_get_predicate(sln->statement),
+                                            sln, add);
+}
+
+
+/*
+ * librdf_storage_list_build_patterns - INTERNAL - Build the pattern indexes from the list
+ * @storage: the storage
+ *
+ * Return value: non 0 on failure, when the indexes are not built
+ */
+static int
+librdf_storage_list_build_patterns(librdf_storage* storage)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  librdf_iterator* iterator;
+  int status=0;
+
+  context->subjects=librdf_new_hash(storage->world, NULL);
+  context->predicates=librdf_new_hash(storage->world, NULL);
+  if(!context->subjects || !context->predicates ||
+     librdf_hash_open(context->subjects, NULL, 0, 1, 1, NULL) ||
+     librdf_hash_open(context->predicates, NULL, 0, 1, 1, NULL))
+    status=1;
+
+  if(!status) {
+    iterator=librdf_list_get_iterator(context->list);
+    if(!iterator)
+      status=1;
+    else {
+      for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+        librdf_storage_list_node* sln=(librdf_storage_list_node*)librdf_iterator_get_object(iterator);
+
+        if(librdf_storage_list_patterns_update(storage, sln, 1)) {
+          status=1;
+          break;
+        }
+      }
+      librdf_free_iterator(iterator);
+    }
+  }
+
+  if(status) {
+    if(context->subjects) {
+      librdf_free_hash(context->subjects);
+      context->subjects=NULL;
+    }
+    if(context->predicates) {
+      librdf_free_hash(context->predicates);
+      context->predicates=NULL;
+    }
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_list_add_node - INTERNAL - Add a statement node to the list and the index
+ * @storage: the storage
+ * @sln: node with a statement and optional context
+ *
+ * Return value: non 0 on failure, when @sln is not added
+ */
+static int
+librdf_storage_list_add_node(librdf_storage* storage,
+                             librdf_storage_list_node* sln)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack - not allocated */
+  int status;
+
+  if(librdf_storage_list_index_key(storage, sln->statement, &key))
+    return 1;
+
+  sln->list_node=librdf_list_add_node(context->list, sln);
+  if(!sln->list_node) {
+    LIBRDF_FREE(data, key.data);
+    return 1;
+  }
+
+  value.data=&sln;
+  value.size=sizeof(sln);
+  status=librdf_hash_put(context->index, &key, &value);
+
+  if(!status && librdf_storage_list_patterns_update(storage, sln, 1)) {
+    librdf_hash_delete(context->index, &key, &value);
+    status=1;
+  }
+  LIBRDF_FREE(data, key.data);
+
+  if(status) {
+    librdf_list_remove_node(context->list, sln->list_node);
+    return 1;
+  }
+
+  context->statements_memory += librdf_storage_list_node_memory(sln);
+
+  return 0;
+}
+
+
 static int
 librdf_storage_list_add_statement(librdf_storage* storage, librdf_statement* statement)
 {
@@ -252,7 +566,6 @@ static int
 librdf_storage_list_add_statements(librdf_storage* storage,
                                    librdf_stream* statement_stream)
 {
-  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
   int status=0;
 
   for(; !librdf_stream_end(statement_stream);
@@ -283,7 +596,12 @@ librdf_storage_list_add_statements(librdf_storage* storage,
       break;
     }
     sln->context=NULL;
-    librdf_list_add(context->list, sln);
+    if(librdf_storage_list_add_node(storage, sln)) {
+      librdf_free_statement(sln->statement);
+      LIBRDF_FREE(librdf_storage_list_node, sln);
+      status=1;
+      break;
+    }
   }
   
   return status;
@@ -301,28 +619,29 @@ static int
 librdf_storage_list_contains_statement(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
-  librdf_storage_list_node sln; /* STATIC */
-  sln.statement=statement;
-  sln.context=NULL;
-
-  if(context->index_contexts) {
-    /* When we have contexts, we have to use find_statements for contains
-     * since we do not know what context node may be stored for a statement
-     */
-    librdf_stream *stream=librdf_storage_list_find_statements(storage, statement);
-    int status;
+  librdf_hash_datum key; /* on stack - not allocated */
+  unsigned char buffer[LIBRDF_STORAGE_LIST_KEY_BUFFER_SIZE];
+  size_t size;
+  int status;
 
-    if(!stream)
-      return 0;
-    /* librdf_stream_end returns 0 if have more, non-0 at end */
-    status=!librdf_stream_end(stream);
-    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
-    librdf_free_stream(stream);
-    return status;
+  /* Most statements encode small enough to check without allocating */
+  size=librdf_statement_encode2(storage->world, statement, NULL, 0);
+  if(!size)
+    return 0;
+  if(size <= sizeof(buffer)) {
+    key.data=buffer;
+    key.size=librdf_statement_encode2(storage->world, statement, buffer, size);
+    /* The index has the statement in any context */
+    return (librdf_hash_exists(context->index, &key, NULL) > 0);
   }
-  
 
-  return librdf_list_contains(context->list, &sln);
+  if(librdf_storage_list_index_key(storage, statement, &key))
+    return 0;
+
+  status=(librdf_hash_exists(context->index, &key, NULL) > 0);
+  LIBRDF_FREE(data, key.data);
+
+  return status;
 }
 
 
@@ -427,6 +746,177 @@ librdf_storage_list_serialise_finished(void* context)
 }
 
 
+typedef struct {
+  librdf_world* world;
+  int index_contexts;
+  /* copies of the statements and contexts found */
+  librdf_storage_list_node* nodes;
+  int count;
+  int current;
+} librdf_storage_list_pattern_stream_context;
+
+
+static int
+librdf_storage_list_pattern_stream_end(void* context)
+{
+  librdf_storage_list_pattern_stream_context* scontext=(librdf_storage_list_pattern_stream_context*)context;
+
+  return (scontext->current >= scontext->count);
+}
+
+
+static int
+librdf_storage_list_pattern_stream_next(void* context)
+{
+  librdf_storage_list_pattern_stream_context* scontext=(librdf_storage_list_pattern_stream_context*)context;
+
+  if(scontext->current < scontext->count)
+    scontext->current++;
+
+  return (scontext->current >= scontext->count);
+}
+
+
+static void*
+librdf_storage_list_pattern_stream_get(void* context, int flags)
+{
+  librdf_storage_list_pattern_stream_context* scontext=(librdf_storage_list_pattern_stream_context*)context;
+  librdf_storage_list_node* sln=&scontext->nodes[scontext->current];
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return sln->statement;
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      if(scontext->index_contexts)
+        return sln->context;
+      else
+        return NULL;
+    default:
+      librdf_log(scontext->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_list_pattern_stream_finished(void* context)
+{
+  librdf_storage_list_pattern_stream_context* scontext=(librdf_storage_list_pattern_stream_context*)context;
+  int i;
+
+  if(scontext->nodes) {
+    for(i=0; i < scontext->count; i++) {
+      if(scontext->nodes[i].statement)
+        librdf_free_statement(scontext->nodes[i].statement);
+      if(scontext->nodes[i].context)
+        librdf_free_node(scontext->nodes[i].context);
+    }
+    LIBRDF_FREE(librdf_storage_list_node*, scontext->nodes);
+  }
+
+  LIBRDF_FREE(librdf_storage_list_pattern_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_list_pattern_stream - INTERNAL - Stream the statements with a node from a pattern index
+ * @storage: the storage
+ * @hash: subject or predicate pattern index
+ * @node: subject or predicate
+ *
+ * The statements are copied when the stream is made so it is not
+ * changed by later adds and removes.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_list_pattern_stream(librdf_storage* storage, librdf_hash* hash,
+                                   librdf_node* node)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  librdf_storage_list_pattern_stream_context* scontext;
+  librdf_hash_datum key, value; /* on stack - not allocated */
+  librdf_iterator* iterator;
+  librdf_stream* stream;
+  size_t size;
+  int count;
+  int pass;
+
+  scontext = LIBRDF_CALLOC(librdf_storage_list_pattern_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+  scontext->world=storage->world;
+  scontext->index_contexts=context->index_contexts;
+
+  size=librdf_node_encode(node, NULL, 0);
+  key.data = LIBRDF_MALLOC(char*, size);
+  if(!key.data) {
+    librdf_storage_list_pattern_stream_finished(scontext);
+    return NULL;
+  }
+  key.size=librdf_node_encode(node, (unsigned char*)key.data, size);
+
+  /* count the list nodes then copy their statements */
+  for(pass=0; pass < 2; pass++) {
+    value.data=NULL;
+    value.size=0;
+    iterator=librdf_hash_get_all(hash, &key, &value);
+    if(!iterator)
+      break;
+
+    count=0;
+    for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator)) {
+      librdf_hash_datum* v=(librdf_hash_datum*)librdf_iterator_get_value(iterator);
+      librdf_storage_list_node* sln;
+
+      if(!v || v->size != sizeof(sln))
+        continue;
+
+      if(pass && count < scontext->count) {
+        memcpy(&sln, v->data, sizeof(sln));
+        scontext->nodes[count].statement=librdf_new_statement_from_statement(sln->statement);
+        if(sln->context)
+          scontext->nodes[count].context=librdf_new_node_from_node(sln->context);
+      }
+      count++;
+    }
+    librdf_free_iterator(iterator);
+
+    if(!pass) {
+      scontext->count=count;
+      if(!count)
+        break;
+      scontext->nodes = LIBRDF_CALLOC(librdf_storage_list_node*,
+                                      LIBRDF_GOOD_CAST(size_t, count),
+                                      sizeof(librdf_storage_list_node));
+      if(!scontext->nodes) {
+        scontext->count=0;
+        LIBRDF_FREE(data, key.data);
+        librdf_storage_list_pattern_stream_finished(scontext);
+        return NULL;
+      }
+    }
+  }
+  LIBRDF_FREE(data, key.data);
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_list_pattern_stream_end,
+                           &librdf_storage_list_pattern_stream_next,
+                           &librdf_storage_list_pattern_stream_get,
+                           &librdf_storage_list_pattern_stream_finished);
+  if(!stream) {
+    librdf_storage_list_pattern_stream_finished((void*)scontext);
+    return NULL;
+  }
+
+  return stream;
+}
+
+
 /**
  * librdf_storage_list_find_statements:
  * @storage: the storage
@@ -444,13 +934,33 @@ librdf_storage_list_serialise_finished(void* context)
 static librdf_stream*
 librdf_storage_list_find_statements(librdf_storage* storage, librdf_statement* statement)
 {
-  librdf_stream* stream;
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  librdf_stream* stream=NULL;
+  librdf_node* node;
+  librdf_hash* hash;
 
   statement=librdf_new_statement_from_statement(statement);
   if(!statement)
     return NULL;
-  
-  stream=librdf_storage_list_serialise(storage);
+
+  /* Use a pattern index for a subject or predicate, building them
+   * on the first such find */
+  node=librdf_statement_get_subject(statement);
+  if(!node)
+    node=librdf_statement_get_predicate(statement);
+
+  if(node && context->index_patterns &&
+     (context->subjects || !librdf_storage_list_build_patterns(storage))) {
+    if(librdf_statement_get_subject(statement))
+      hash=context->subjects;
+    else
+      hash=context->predicates;
+
+    stream=librdf_storage_list_pattern_stream(storage, hash, node);
+  }
+
+  if(!stream)
+    stream=librdf_storage_list_serialise(storage);
   if(stream) {
     if(librdf_stream_add_map(stream, &librdf_stream_statement_find_map,
                              (librdf_stream_map_free_context_handler)&librdf_free_statement,
@@ -517,7 +1027,7 @@ librdf_storage_list_context_add_statement(librdf_storage* storage,
   } else
     sln->context=NULL;
   
-  status=librdf_list_add(context->list, sln);
+  status=librdf_storage_list_add_node(storage, sln);
   if(status) {
     if(context_node)
       librdf_free_node(sln->context);
@@ -564,7 +1074,6 @@ librdf_storage_list_context_remove_statement(librdf_storage* storage,
   librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
   librdf_storage_list_node* sln;
-  librdf_storage_list_node search_sln; /* on stack - not allocated */
   size_t size;
   int status;
   librdf_world* world;
@@ -577,13 +1086,25 @@ librdf_storage_list_context_remove_statement(librdf_storage* storage,
     return 1;
   }
   
-  search_sln.statement=statement;
-  search_sln.context=context_node;
+  /* Find stored statement+context with the index and remove it */
+  if(librdf_storage_list_index_key(storage, statement, &key))
+    return 1;
 
-  /* Remove stored statement+context */
-  sln=(librdf_storage_list_node*)librdf_list_remove(context->list, &search_sln);
-  if(!sln)
+  sln=librdf_storage_list_index_find(storage, &key, context_node);
+  if(!sln) {
+    LIBRDF_FREE(data, key.data);
     return 1;
+  }
+
+  value.data=&sln;
+  value.size=sizeof(sln);
+  librdf_hash_delete(context->index, &key, &value);
+  LIBRDF_FREE(data, key.data);
+
+  librdf_storage_list_patterns_update(storage, sln, 0);
+
+  librdf_list_remove_node(context->list, sln->list_node);
+  context->statements_memory -= librdf_storage_list_node_memory(sln);
 
   librdf_free_statement(sln->statement);
   if(sln->context)
@@ -956,6 +1477,33 @@ librdf_storage_list_get_feature(librdf_storage* storage, librdf_uri* feature)
 }
 
 
+/**
+ * librdf_storage_list_get_memory_size:
+ * @storage: #librdf_storage object
+ *
+ * Get the approximate bytes held by the storage.
+ * 
+ * Return value: size in bytes
+ **/
+static size_t
+librdf_storage_list_get_memory_size(librdf_storage* storage)
+{
+  librdf_storage_list_instance* context=(librdf_storage_list_instance*)storage->instance;
+  size_t size=sizeof(*context) + context->statements_memory;
+
+  if(context->index)
+    size += librdf_hash_get_memory_size(context->index);
+  if(context->contexts)
+    size += librdf_hash_get_memory_size(context->contexts);
+  if(context->subjects)
+    size += librdf_hash_get_memory_size(context->subjects);
+  if(context->predicates)
+    size += librdf_hash_get_memory_size(context->predicates);
+
+  return size;
+}
+
+
 /** Local entry point for dynamically loaded storage module */
 static void
 librdf_storage_list_register_factory(librdf_storage_factory *factory) 
@@ -979,6 +1527,7 @@ librdf_storage_list_register_factory(librdf_storage_factory *factory)
   factory->context_serialise        = librdf_storage_list_context_serialise;
   factory->get_contexts             = librdf_storage_list_get_contexts;
   factory->get_feature              = librdf_storage_list_get_feature;
+  factory->get_memory_size          = librdf_storage_list_get_memory_size;
 }
 
 
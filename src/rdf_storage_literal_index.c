@@ -0,0 +1,829 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_literal_index.c - RDF Storage literal text index
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+
+
+/*
+ * The index keeps each different literal once, by id, and a postings
+ * list of literal ids for every 3 byte sequence (trigram) in the
+ * literal values.  A substring or prefix of 3 or more bytes can only
+ * be in the literals of the shortest postings list of its trigrams,
+ * so only those are compared; shorter ones are compared with every
+ * literal, which is still fewer than every statement.
+ *
+ * Storages own an index, add the objects of the statements they add,
+ * and note removals; removed literals stay in the index, which
+ * matches a superset of the literals in the storage and so only
+ * costs finds that return nothing.
+ */
+
+/* bytes in an indexed sequence */
+#define LIBRDF_LITERAL_INDEX_GRAM 3
+
+/* first postings slot of a trigram key; the high product bits mix all key bytes */
+#define LIBRDF_LITERAL_INDEX_GRAM_SLOT(key, mask) \
+  ((int)((((key) * 2654435761U) >> 7) & (u32)(mask)))
+
+typedef struct
+{
+  u32 key;                    /* trigram + 1 or 0 for an empty slot */
+  int* ids;                   /* literal ids in increasing order */
+  int count;
+  int size;
+} librdf_literal_index_postings;
+
+
+struct librdf_literal_index_s
+{
+  librdf_world* world;
+
+  /* literal nodes by id */
+  librdf_node** literals;
+  u32* literal_hashes;
+  int literals_count;
+  int literals_size;
+
+  /* open addressed table of literal ids + 1, 0 for empty */
+  int* literal_slots;
+  int literal_slots_size;     /* power of 2 */
+
+  /* open addressed table of postings by trigram */
+  librdf_literal_index_postings* postings;
+  int postings_count;
+  int postings_size;          /* power of 2 */
+
+  /* statements removed since the index was made */
+  int removals;
+};
+
+
+/**
+ * librdf_new_literal_index:
+ * @world: redland world
+ *
+ * INTERNAL - Constructor - create an empty literal text index
+ *
+ * Return value: new #librdf_literal_index or NULL on failure
+ **/
+librdf_literal_index*
+librdf_new_literal_index(librdf_world* world)
+{
+  librdf_literal_index* index;
+
+  index=LIBRDF_CALLOC(librdf_literal_index*, 1, sizeof(*index));
+  if(!index)
+    return NULL;
+
+  index->world=world;
+
+  return index;
+}
+
+
+/**
+ * librdf_free_literal_index:
+ * @index: literal index
+ *
+ * INTERNAL - Destructor - destroy a literal text index
+ **/
+void
+librdf_free_literal_index(librdf_literal_index* index)
+{
+  int i;
+
+  if(!index)
+    return;
+
+  if(index->literals) {
+    for(i=0; i < index->literals_count; i++)
+      librdf_free_node(index->literals[i]);
+    LIBRDF_FREE(librdf_node**, index->literals);
+  }
+  if(index->literal_hashes)
+    LIBRDF_FREE(u32*, index->literal_hashes);
+  if(index->literal_slots)
+    LIBRDF_FREE(int*, index->literal_slots);
+
+  if(index->postings) {
+    for(i=0; i < index->postings_size; i++) {
+      if(index->postings[i].ids)
+        LIBRDF_FREE(int*, index->postings[i].ids);
+    }
+    LIBRDF_FREE(librdf_literal_index_postings*, index->postings);
+  }
+
+  LIBRDF_FREE(librdf_literal_index, index);
+}
+
+
+/* FNV-1a hash of bytes continuing from @hash */
+static u32
+librdf_literal_index_hash_bytes(u32 hash, const unsigned char* p, size_t len)
+{
+  while(len--) {
+    hash ^= *p++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+
+static u32
+librdf_literal_index_hash_literal(librdf_node* node)
+{
+  const unsigned char* value;
+  const char* language;
+  librdf_uri* datatype;
+  size_t len;
+  u32 hash=2166136261U;
+
+  value=librdf_node_get_literal_value_as_counted_string(node, &len);
+  if(value)
+    hash=librdf_literal_index_hash_bytes(hash, value, len);
+
+  language=librdf_node_get_literal_value_language(node);
+  if(language)
+    hash=librdf_literal_index_hash_bytes(hash, (const unsigned char*)language,
+                                         strlen(language));
+
+  datatype=librdf_node_get_literal_value_datatype_uri(node);
+  if(datatype) {
+    value=librdf_uri_as_counted_string(datatype, &len);
+    hash=librdf_literal_index_hash_bytes(hash, value, len);
+  }
+
+  return hash;
+}
+
+
+/* Re-insert all literal ids into a literal slots table of @size */
+static int
+librdf_literal_index_resize_literal_slots(librdf_literal_index* index, int size)
+{
+  int* slots;
+  int mask=size - 1;
+  int i;
+
+  slots=LIBRDF_CALLOC(int*, size, sizeof(int));
+  if(!slots)
+    return 1;
+
+  for(i=0; i < index->literals_count; i++) {
+    int slot=(int)(index->literal_hashes[i] & (u32)mask);
+
+    while(slots[slot])
+      slot=(slot + 1) & mask;
+    slots[slot]=i + 1;
+  }
+
+  if(index->literal_slots)
+    LIBRDF_FREE(int*, index->literal_slots);
+  index->literal_slots=slots;
+  index->literal_slots_size=size;
+
+  return 0;
+}
+
+
+/* Re-insert all postings into a postings table of @size */
+static int
+librdf_literal_index_resize_postings(librdf_literal_index* index, int size)
+{
+  librdf_literal_index_postings* postings;
+  int mask=size - 1;
+  int i;
+
+  postings=LIBRDF_CALLOC(librdf_literal_index_postings*, size,
+                         sizeof(librdf_literal_index_postings));
+  if(!postings)
+    return 1;
+
+  for(i=0; i < index->postings_size; i++) {
+    int slot;
+
+    if(!index->postings[i].key)
+      continue;
+    slot=LIBRDF_LITERAL_INDEX_GRAM_SLOT(index->postings[i].key, mask);
+    while(postings[slot].key)
+      slot=(slot + 1) & mask;
+    postings[slot]=index->postings[i];
+  }
+
+  if(index->postings)
+    LIBRDF_FREE(librdf_literal_index_postings*, index->postings);
+  index->postings=postings;
+  index->postings_size=size;
+
+  return 0;
+}
+
+
+/*
+ * librdf_literal_index_get_postings:
+ * @index: literal index
+ * @gram: bytes of the trigram
+ * @add: non-0 to add a missing postings list
+ *
+ * INTERNAL - Get the postings list of a trigram
+ *
+ * Return value: postings or NULL if missing or on failure
+ */
+static librdf_literal_index_postings*
+librdf_literal_index_get_postings(librdf_literal_index* index,
+                                  const unsigned char* gram, int add)
+{
+  u32 key;
+  int mask;
+  int slot;
+
+  key=((u32)gram[0] << 16 | (u32)gram[1] << 8 | (u32)gram[2]) + 1;
+
+  if(index->postings_size) {
+    mask=index->postings_size - 1;
+    for(slot=LIBRDF_LITERAL_INDEX_GRAM_SLOT(key, mask);
+        index->postings[slot].key;
+        slot=(slot + 1) & mask) {
+      if(index->postings[slot].key == key)
+        return &index->postings[slot];
+    }
+  }
+
+  if(!add)
+    return NULL;
+
+  /* keep the table at most half full */
+  if((index->postings_count + 1) * 2 > index->postings_size) {
+    if(librdf_literal_index_resize_postings(index, index->postings_size ?
+                                            index->postings_size * 2 : 1024))
+      return NULL;
+  }
+
+  mask=index->postings_size - 1;
+  for(slot=LIBRDF_LITERAL_INDEX_GRAM_SLOT(key, mask);
+      index->postings[slot].key;
+      slot=(slot + 1) & mask)
+    ;
+  index->postings[slot].key=key;
+  index->postings_count++;
+
+  return &index->postings[slot];
+}
+
+
+/**
+ * librdf_literal_index_add:
+ * @index: literal index
+ * @node: node, ignored unless a literal
+ *
+ * INTERNAL - Add a literal to the index if it is not already there
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_literal_index_add(librdf_literal_index* index, librdf_node* node)
+{
+  const unsigned char* value;
+  size_t len;
+  u32 hash;
+  int mask;
+  int slot;
+  int id;
+  size_t i;
+
+  if(!node || !librdf_node_is_literal(node))
+    return 0;
+
+  hash=librdf_literal_index_hash_literal(node);
+
+  if(index->literal_slots_size) {
+    mask=index->literal_slots_size - 1;
+    for(slot=(int)(hash & (u32)mask); index->literal_slots[slot];
+        slot=(slot + 1) & mask) {
+      id=index->literal_slots[slot] - 1;
+      if(index->literal_hashes[id] == hash &&
+         librdf_node_equals(index->literals[id], node))
+        return 0;
+    }
+  }
+
+  if(index->literals_count == index->literals_size) {
+    int size=index->literals_size ? index->literals_size * 2 : 256;
+    librdf_node** literals;
+    u32* hashes;
+
+    literals=LIBRDF_MALLOC(librdf_node**, size * sizeof(librdf_node*));
+    hashes=LIBRDF_MALLOC(u32*, size * sizeof(u32));
+    if(!literals || !hashes) {
+      if(literals)
+        LIBRDF_FREE(librdf_node**, literals);
+      if(hashes)
+        LIBRDF_FREE(u32*, hashes);
+      return 1;
+    }
+    if(index->literals) {
+      memcpy(literals, index->literals,
+             index->literals_count * sizeof(librdf_node*));
+      memcpy(hashes, index->literal_hashes,
+             index->literals_count * sizeof(u32));
+      LIBRDF_FREE(librdf_node**, index->literals);
+      LIBRDF_FREE(u32*, index->literal_hashes);
+    }
+    index->literals=literals;
+    index->literal_hashes=hashes;
+    index->literals_size=size;
+  }
+
+  if((index->literals_count + 1) * 2 > index->literal_slots_size) {
+    if(librdf_literal_index_resize_literal_slots(index,
+                                                 index->literal_slots_size ?
+                                                 index->literal_slots_size * 2 : 512))
+      return 1;
+  }
+
+  node=librdf_new_node_from_node(node);
+  if(!node)
+    return 1;
+
+  id=index->literals_count++;
+  index->literals[id]=node;
+  index->literal_hashes[id]=hash;
+
+  mask=index->literal_slots_size - 1;
+  for(slot=(int)(hash & (u32)mask); index->literal_slots[slot];
+      slot=(slot + 1) & mask)
+    ;
+  index->literal_slots[slot]=id + 1;
+
+  value=librdf_node_get_literal_value_as_counted_string(node, &len);
+  for(i=0; value && i + LIBRDF_LITERAL_INDEX_GRAM <= len; i++) {
+    librdf_literal_index_postings* postings;
+
+    postings=librdf_literal_index_get_postings(index, value + i, 1);
+    if(!postings)
+      return 1;
+
+    /* the same trigram again in this literal */
+    if(postings->count && postings->ids[postings->count - 1] == id)
+      continue;
+
+    if(postings->count == postings->size) {
+      int size=postings->size ? postings->size * 2 : 4;
+      int* ids;
+
+      ids=LIBRDF_MALLOC(int*, size * sizeof(int));
+      if(!ids)
+        return 1;
+      if(postings->ids) {
+        memcpy(ids, postings->ids, postings->count * sizeof(int));
+        LIBRDF_FREE(int*, postings->ids);
+      }
+      postings->ids=ids;
+      postings->size=size;
+    }
+    postings->ids[postings->count++]=id;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_literal_index_add_stream:
+ * @index: literal index
+ * @stream: statements to add the object literals of, freed by this function
+ *
+ * INTERNAL - Add the object literals of a stream of statements
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_literal_index_add_stream(librdf_literal_index* index,
+                                librdf_stream* stream)
+{
+  int status=0;
+
+  if(!stream)
+    return 1;
+
+  while(!librdf_stream_end(stream)) {
+    librdf_statement* statement=librdf_stream_get_object(stream);
+
+    if(statement &&
+       librdf_literal_index_add(index, librdf_statement_get_object(statement))) {
+      status=1;
+      break;
+    }
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+
+  return status;
+}
+
+
+/**
+ * librdf_literal_index_removed:
+ * @index: literal index or NULL
+ *
+ * INTERNAL - Note a statement was removed from the storage of the index
+ **/
+void
+librdf_literal_index_removed(librdf_literal_index* index)
+{
+  if(index)
+    index->removals++;
+}
+
+
+/**
+ * librdf_literal_index_is_stale:
+ * @index: literal index
+ *
+ * INTERNAL - Check if an index holds so many removed literals it should be made again
+ *
+ * Return value: non-0 if stale
+ **/
+int
+librdf_literal_index_is_stale(librdf_literal_index* index)
+{
+  return index->removals > 1024 && index->removals > index->literals_count;
+}
+
+
+/**
+ * librdf_literal_index_update:
+ * @index_p: pointer to the literal index of a storage or NULL
+ * @statement: statement added or removed
+ * @is_addition: non-0 if @statement was added
+ *
+ * INTERNAL - Update the literal index of a storage for a change, if it has one
+ *
+ * If the index cannot be updated it is freed, to be made again by
+ * librdf_literal_index_make().
+ **/
+void
+librdf_literal_index_update(librdf_literal_index** index_p,
+                            librdf_statement* statement, int is_addition)
+{
+  if(!*index_p)
+    return;
+
+  if(!is_addition)
+    librdf_literal_index_removed(*index_p);
+  else if(librdf_literal_index_add(*index_p,
+                                   librdf_statement_get_object(statement))) {
+    librdf_free_literal_index(*index_p);
+    *index_p=NULL;
+  }
+}
+
+
+/**
+ * librdf_literal_index_make:
+ * @index_p: pointer to the literal index of a storage or NULL
+ * @storage: storage
+ *
+ * INTERNAL - Get the literal index of a storage, making it from all statements if needed
+ *
+ * An index holding many removed literals is made again.
+ *
+ * Return value: the index or NULL on failure
+ **/
+librdf_literal_index*
+librdf_literal_index_make(librdf_literal_index** index_p,
+                          librdf_storage* storage)
+{
+  if(*index_p && librdf_literal_index_is_stale(*index_p)) {
+    librdf_free_literal_index(*index_p);
+    *index_p=NULL;
+  }
+
+  if(!*index_p) {
+    *index_p=librdf_new_literal_index(storage->world);
+    if(*index_p &&
+       librdf_literal_index_add_stream(*index_p,
+                                       librdf_storage_serialise(storage))) {
+      librdf_free_literal_index(*index_p);
+      *index_p=NULL;
+    }
+  }
+
+  return *index_p;
+}
+
+
+/**
+ * librdf_literal_index_matches:
+ * @node: node
+ * @text: substring or prefix
+ * @text_len: length of @text
+ * @prefix: non-0 to match a prefix of the literal value, 0 for a substring
+ *
+ * INTERNAL - Check a node is a literal whose value contains or starts with some text
+ *
+ * Return value: non-0 if the node matches
+ **/
+int
+librdf_literal_index_matches(librdf_node* node,
+                             const unsigned char* text, size_t text_len,
+                             int prefix)
+{
+  const unsigned char* value;
+  size_t len;
+  size_t i;
+
+  if(!node || !librdf_node_is_literal(node))
+    return 0;
+
+  value=librdf_node_get_literal_value_as_counted_string(node, &len);
+  if(!value || len < text_len)
+    return 0;
+
+  if(prefix || !text_len)
+    return !memcmp(value, text, text_len);
+
+  for(i=0; i + text_len <= len; i++) {
+    if(value[i] == text[0] && !memcmp(value + i, text, text_len))
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_literal_index_find:
+ * @index: literal index
+ * @text: substring or prefix
+ * @text_len: length of @text
+ * @prefix: non-0 to match prefixes
+ * @count_p: pointer to store the number of literals
+ *
+ * INTERNAL - Find the literals of the index matching some text
+ *
+ * Return value: new array of new literal node references (may be empty) or NULL on failure
+ */
+static librdf_node**
+librdf_literal_index_find(librdf_literal_index* index,
+                          const unsigned char* text, size_t text_len,
+                          int prefix, int* count_p)
+{
+  librdf_literal_index_postings* shortest=NULL;
+  librdf_node** nodes;
+  int candidates;
+  int count=0;
+  int i;
+
+  *count_p=0;
+
+  if(text_len >= LIBRDF_LITERAL_INDEX_GRAM) {
+    size_t j;
+
+    for(j=0; j + LIBRDF_LITERAL_INDEX_GRAM <= text_len; j++) {
+      librdf_literal_index_postings* postings;
+
+      postings=librdf_literal_index_get_postings(index, text + j, 0);
+      if(!postings)
+        /* no literal has this trigram */
+        return LIBRDF_CALLOC(librdf_node**, 1, sizeof(librdf_node*));
+      if(!shortest || postings->count < shortest->count)
+        shortest=postings;
+    }
+    candidates=shortest->count;
+  } else
+    candidates=index->literals_count;
+
+  nodes=LIBRDF_CALLOC(librdf_node**, candidates + 1, sizeof(librdf_node*));
+  if(!nodes)
+    return NULL;
+
+  for(i=0; i < candidates; i++) {
+    librdf_node* node;
+
+    node=index->literals[shortest ? shortest->ids[i] : i];
+    if(librdf_literal_index_matches(node, text, text_len, prefix))
+      nodes[count++]=librdf_new_node_from_node(node);
+  }
+
+  *count_p=count;
+
+  return nodes;
+}
+
+
+typedef struct {
+  librdf_storage* storage;
+  librdf_statement* statement; /* pattern, object set to each literal in turn */
+  librdf_node* context_node;
+  librdf_node** literals;
+  int literals_count;
+  int next_literal;
+  librdf_stream* stream;       /* statements with the current literal */
+} librdf_literal_index_stream_context;
+
+
+/* Move to a statement, going on to the next literals as needed */
+static void
+librdf_literal_index_stream_seek(librdf_literal_index_stream_context* lsc)
+{
+  while(!lsc->stream || librdf_stream_end(lsc->stream)) {
+    if(lsc->stream) {
+      librdf_free_stream(lsc->stream);
+      lsc->stream=NULL;
+    }
+    if(lsc->next_literal == lsc->literals_count)
+      return;
+
+    /* setting does not free the previous object */
+    librdf_free_node(librdf_statement_get_object(lsc->statement));
+    librdf_statement_set_object(lsc->statement,
+                                librdf_new_node_from_node(lsc->literals[lsc->next_literal++]));
+    lsc->stream=librdf_storage_find_statements_in_context(lsc->storage,
+                                                          lsc->statement,
+                                                          lsc->context_node);
+  }
+}
+
+
+static int
+librdf_literal_index_stream_end(void* context)
+{
+  librdf_literal_index_stream_context* lsc=(librdf_literal_index_stream_context*)context;
+
+  return !lsc->stream;
+}
+
+
+static int
+librdf_literal_index_stream_next(void* context)
+{
+  librdf_literal_index_stream_context* lsc=(librdf_literal_index_stream_context*)context;
+
+  if(!lsc->stream)
+    return 1;
+
+  librdf_stream_next(lsc->stream);
+  librdf_literal_index_stream_seek(lsc);
+
+  return !lsc->stream;
+}
+
+
+static void*
+librdf_literal_index_stream_get(void* context, int flags)
+{
+  librdf_literal_index_stream_context* lsc=(librdf_literal_index_stream_context*)context;
+
+  if(!lsc->stream)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(lsc->stream);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(lsc->stream);
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_literal_index_stream_finished(void* context)
+{
+  librdf_literal_index_stream_context* lsc=(librdf_literal_index_stream_context*)context;
+  int i;
+
+  if(lsc->stream)
+    librdf_free_stream(lsc->stream);
+  if(lsc->literals) {
+    for(i=0; i < lsc->literals_count; i++)
+      librdf_free_node(lsc->literals[i]);
+    LIBRDF_FREE(librdf_node**, lsc->literals);
+  }
+  if(lsc->statement)
+    librdf_free_statement(lsc->statement);
+  if(lsc->context_node)
+    librdf_free_node(lsc->context_node);
+  if(lsc->storage)
+    librdf_storage_remove_reference(lsc->storage);
+
+  LIBRDF_FREE(librdf_literal_index_stream_context, lsc);
+}
+
+
+/**
+ * librdf_literal_index_find_statements:
+ * @index: literal index of the storage or NULL if there is none
+ * @storage: storage
+ * @statement: statement to find
+ * @context_node: context node or NULL
+ * @options: find options or NULL
+ *
+ * INTERNAL - Find statements with options using a literal index
+ *
+ * For the find_statements_with_options method of storages keeping a
+ * #librdf_literal_index.  The "match-substring" and "match-prefix"
+ * options are answered by finding the statements of each matching
+ * literal in the index, or by a scan when @index is NULL; other
+ * finds are passed to the storage's find_statements_in_context.  The
+ * "limit" and "offset" options are then applied.
+ *
+ * Return value: #librdf_stream of matching statements (may be empty) or NULL on failure
+ **/
+librdf_stream*
+librdf_literal_index_find_statements(librdf_literal_index* index,
+                                     librdf_storage* storage,
+                                     librdf_statement* statement,
+                                     librdf_node* context_node,
+                                     librdf_hash* options)
+{
+  librdf_literal_index_stream_context* lsc;
+  librdf_stream* stream;
+  const unsigned char* text;
+  size_t text_len;
+  int prefix;
+  int limit, offset, order;
+
+  if(!librdf_storage_get_text_match(options, statement, &prefix))
+    stream=librdf_storage_find_statements_in_context(storage, statement,
+                                                     context_node);
+  else if(!index)
+    stream=librdf_storage_find_text_match(storage, statement, context_node,
+                                          prefix);
+  else {
+    lsc=LIBRDF_CALLOC(librdf_literal_index_stream_context*, 1, sizeof(*lsc));
+    if(!lsc)
+      return NULL;
+
+    lsc->storage=storage;
+    librdf_storage_add_reference(storage);
+    lsc->statement=librdf_new_statement_from_statement(statement);
+    if(context_node)
+      lsc->context_node=librdf_new_node_from_node(context_node);
+
+    text=librdf_node_get_literal_value_as_counted_string(librdf_statement_get_object(statement),
+                                                         &text_len);
+    lsc->literals=librdf_literal_index_find(index, text, text_len, prefix,
+                                            &lsc->literals_count);
+    if(!lsc->statement || !lsc->literals) {
+      librdf_literal_index_stream_finished((void*)lsc);
+      return NULL;
+    }
+
+    librdf_literal_index_stream_seek(lsc);
+
+    stream=librdf_new_stream(storage->world, (void*)lsc,
+                             &librdf_literal_index_stream_end,
+                             &librdf_literal_index_stream_next,
+                             &librdf_literal_index_stream_get,
+                             &librdf_literal_index_stream_finished);
+    if(!stream) {
+      librdf_literal_index_stream_finished((void*)lsc);
+      return NULL;
+    }
+  }
+
+  if(stream &&
+     librdf_storage_get_find_options(options, &limit, &offset, &order))
+    stream=librdf_storage_limit_stream(storage, stream, limit, offset);
+
+  return stream;
+}
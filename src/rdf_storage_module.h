@@ -112,6 +112,8 @@ typedef void* librdf_storage_instance;
  * @transaction_commit: Commit a transaction. OPTIONAL
  * @transaction_rollback: Rollback a transaction. OPTIONAL
  * @transaction_get_handle: Get opaque data handle passed to transaction_start_with_handle. OPTIONAL
+ * @count_statements: Count statements matching a partial statement. storage core will do this using find_statements if missing. OPTIONAL
+ * @get_memory_size: Return the approximate bytes of process memory held by the storage. OPTIONAL
  * 
  * A Storage Factory
  */
@@ -240,6 +242,16 @@ struct librdf_storage_factory_s {
 
   /** Storage engine returns query results - OPTIONAL */
   librdf_query_results* (*query_execute)(librdf_storage* storage, librdf_query *query);
+
+  /** Count statements matching a partial statement - OPTIONAL */
+  int (*count_statements)(librdf_storage* storage, librdf_statement* statement);
+
+  /** Interrupt a query running in query_execute, called from any
+   * thread - OPTIONAL */
+  int (*query_cancel)(librdf_storage* storage, librdf_query *query);
+
+  /** Approximate bytes of process memory held by the storage - OPTIONAL */
+  size_t (*get_memory_size)(librdf_storage* storage);
 };
 
 
@@ -43,6 +43,11 @@
 #endif
 #include <sys/types.h>
 #include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 #include <rdf_types.h>
@@ -56,6 +61,35 @@
 #define LIBRDF_DEBUG_SQL 1
 */
 
+/* Query length used if the server max_allowed_packet cannot be read */
+#define LIBRDF_STORAGE_MYSQL_DEFAULT_MAX_PACKET (1024 * 1024)
+
+/* Room left in max_allowed_packet for the packet header */
+#define LIBRDF_STORAGE_MYSQL_PACKET_RESERVE 1024
+
+/* Size of a buffer for the start of a multi-row insert query */
+#define LIBRDF_STORAGE_MYSQL_PREFIX_SIZE 128
+
+/* Statements collected in bulk mode before they are sent */
+#define LIBRDF_STORAGE_MYSQL_BULK_STATEMENTS 100000
+
+/* Find query shapes: which of subject, predicate, object and context
+ * are given */
+#define LIBRDF_STORAGE_MYSQL_FIND_SHAPES 16
+
+/* Default seconds a pool connection may be idle before it is pinged */
+#define LIBRDF_STORAGE_MYSQL_PING_INTERVAL 60
+
+/* Initial size of a prepared find statement result column buffer */
+#define LIBRDF_STORAGE_MYSQL_COLUMN_SIZE 256
+
+/* Schema layout keeping all models in one Statements table partitioned
+ * by a Model column */
+#define LIBRDF_STORAGE_MYSQL_PARTITIONED_LAYOUT "v3"
+
+/* Default seconds statements may wait in the write-behind queue */
+#define LIBRDF_STORAGE_MYSQL_WRITE_BEHIND_INTERVAL 1
+
 typedef enum {
   TABLE_RESOURCES,
   TABLE_BNODES,
@@ -86,7 +120,8 @@ typedef struct
   /* how many ints form the primary key for this row. e.g. for statements=4 */
   short key_len;
 
-  u64 uints[4];           /* 4 is for Statements S,P,O,C, rest 1=ID, 2... */
+  u64 uints[5];           /* 4 is for Statements S,P,O,C, 5 with Model
+                           * first in the partitioned layout, rest 1=ID */
   char *strings[3];       /* 3 is for Literals longtext, text, text */
   size_t strings_len[3];
   int strings_count;
@@ -132,7 +167,25 @@ typedef enum {
 typedef struct {
   /* A MySQL connection */
   librdf_storage_mysql_connection_status status;
+  /* &mysql when connected or NULL */
   MYSQL *handle;
+  /* connection structure; inside this one so a handle finds its
+   * connection without searching the pool */
+  MYSQL mysql;
+
+  librdf_storage* storage;
+  /* index in the pool connections */
+  int index;
+  /* time the connection was last released */
+  time_t last_used;
+  /* non-0 if kept by a thread with the thread-handles option */
+  int owned;
+  /* 0 for the primary server or the replica number from 1; replica
+   * connections are not in the free slots */
+  int replica;
+
+  /* prepared find statements by query shape or NULL */
+  MYSQL_STMT *find_statements[LIBRDF_STORAGE_MYSQL_FIND_SHAPES];
 } librdf_storage_mysql_connection;
 
 typedef struct {
@@ -143,30 +196,85 @@ typedef struct {
   char *user;
   char *password;
 
-  /* Array of virtual MySQL connections */
-  librdf_storage_mysql_connection *connections;
+  /* Pool of MySQL connections, allocated for connections_size */
+  librdf_storage_mysql_connection **connections;
   int connections_count;
+  int connections_size;
+  /* stack of indexes of the connections not in use */
+  int *free_slots;
+  int free_count;
+  /* non-0 once the pool is initialized */
+  int pool_ready;
+  /* connections opened at init and most kept (0 no limit) */
+  int pool_min;
+  int pool_max;
+  /* seconds a connection may be idle before it is pinged (0 never) */
+  int ping_interval;
+  /* if each thread keeps its own connection */
+  int thread_handles;
+  /* read-only replica servers that reads outside a transaction may
+   * use, the replica number last used and the pool connections to
+   * them, not counted against pool-max */
+  librdf_sql_replica* replicas;
+  int replicas_count;
+  int replica_last;
+  int replica_connections;
+#ifdef WITH_THREADS
+  pthread_mutex_t pool_mutex;
+  pthread_cond_t pool_cond;
+  pthread_key_t thread_key;
+#endif
 
   /* hash of model name in the database (table Models, column ID) */
   u64 model;
 
+  /* if all models share one Statements table partitioned by Model */
+  int partitioned;
+  /* table holding the model statements */
+  char statements_table[32];
+  /* " WHERE Model=ID" and "Model=ID AND " restricting queries on the
+   * statements table to the model; empty when not partitioned */
+  char model_where[40];
+  char model_and[40];
+
   /* if inserts should be optimized by locking and index optimizations */
   int bulk;
 
+  /* most statements queued before they are sent (0 no write-behind)
+   * and seconds they may wait */
+  int write_behind;
+  int write_behind_interval;
+  /* non-0 if the queue is open, using the transaction pending rows,
+   * and when it was opened */
+  int write_behind_open;
+  time_t write_behind_time;
+
   /* if a table with merged models should be maintained */
   int merge;
 
+  /* if SPARQL basic graph patterns are run as one SQL query */
+  int sql_query;
+
   /* if mysql MYSQL_OPT_RECONNECT should be set on new connections */
   int reconnect;
 
   /* digest object for node hashes */
   librdf_digest *digest;
 
+  /* node hash function recorded in the database Settings table */
+  librdf_sql_node_hash node_hash;
+
   MYSQL* transaction_handle;
   
   raptor_sequence* pending_inserts[4];
   librdf_hash* pending_insert_hash_nodes;
   raptor_sequence* pending_statements;
+
+  /* server max_allowed_packet or 0 if not yet asked */
+  size_t max_packet;
+
+  /* node to hash cache of nodes known to be stored or NULL if disabled */
+  librdf_sql_node_cache* node_cache;
   
   /* SQL config */
   librdf_sql_config* config;
@@ -181,6 +289,13 @@ typedef struct {
    * librdf_new_sql_config_for_storage
    */
   char *config_dir;
+
+  /* query run by query_execute, or NULL, with the server thread id
+   * and replica number (0 primary) of its connection; guarded by
+   * the pool mutex */
+  librdf_query* running_query;
+  unsigned long running_thread_id;
+  int running_replica;
 } librdf_storage_mysql_instance;
 
 /* prototypes for local functions */
@@ -201,6 +316,14 @@ static int librdf_storage_mysql_remove_statement(librdf_storage* storage,
                                                  librdf_statement* statement);
 static int librdf_storage_mysql_contains_statement(librdf_storage* storage,
                                                    librdf_statement* statement);
+static int librdf_storage_mysql_count_statements(librdf_storage* storage,
+                                                 librdf_statement* statement);
+static int librdf_storage_mysql_has_arc_in(librdf_storage* storage,
+                                           librdf_node* node,
+                                           librdf_node* property);
+static int librdf_storage_mysql_has_arc_out(librdf_storage* storage,
+                                            librdf_node* node,
+                                            librdf_node* property);
 static librdf_stream*
        librdf_storage_mysql_serialise(librdf_storage* storage);
 static librdf_stream*
@@ -242,6 +365,15 @@ typedef struct {
   MYSQL *handle;
   MYSQL_RES *results;
   int is_literal_match;
+
+  /* prepared statement results, streamed with the binary protocol */
+  MYSQL_STMT *stmt;
+  unsigned int columns;
+  MYSQL_BIND *binds;
+  unsigned long *lengths;
+  my_bool *is_nulls;
+  /* column values of the current row, NULL for SQL NULL */
+  char **row;
 } librdf_storage_mysql_sos_context;
 
 typedef struct {
@@ -280,7 +412,11 @@ static int librdf_storage_mysql_get_contexts_next_context(void* context);
 static void* librdf_storage_mysql_get_contexts_get_context(void* context, int flags);
 static void librdf_storage_mysql_get_contexts_finished(void* context);
 
+static void librdf_storage_mysql_release_handle(librdf_storage* storage, MYSQL *handle);
+static int librdf_storage_mysql_transaction_start(librdf_storage* storage);
 static int librdf_storage_mysql_transaction_rollback(librdf_storage* storage);
+static void librdf_storage_mysql_transaction_terminate(librdf_storage *storage);
+static int librdf_storage_mysql_write_behind_flush(librdf_storage* storage);
 
 static void librdf_storage_mysql_register_factory(librdf_storage_factory *factory);
 #ifdef MODULAR_LIBRDF
@@ -310,6 +446,11 @@ librdf_storage_mysql_hash(librdf_storage* storage, const char *type,
   byte* digest;
   uint i;
 
+  /* Node hashes are seeded with the node type; model names always use MD5 */
+  if(type && context->node_hash == LIBRDF_SQL_NODE_HASH_XXH64)
+    return librdf_sql_xxh64((const unsigned char*)string, length,
+                            (u64)(unsigned char)*type);
+
   /* (Re)initialize digest object */
   librdf_digest_init(context->digest);
   
@@ -333,20 +474,251 @@ librdf_storage_mysql_hash(librdf_storage* storage, const char *type,
 }
 
 
+/*
+ * librdf_storage_mysql_handle_connection - Get the pool connection of a handle
+ * @handle: MySQL connection handle from the pool
+ *
+ * Each handle is the MYSQL structure inside its connection.
+ *
+ * Return value: connection
+ **/
+static librdf_storage_mysql_connection*
+librdf_storage_mysql_handle_connection(MYSQL *handle)
+{
+  return (librdf_storage_mysql_connection*)((char*)handle - offsetof(librdf_storage_mysql_connection, mysql));
+}
+
+
+/*
+ * librdf_storage_mysql_connect - Open a pool connection to the MySQL server
+ * @storage: the storage
+ * @connection: closed connection
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_mysql_connect(librdf_storage* storage,
+                             librdf_storage_mysql_connection* connection)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  const char* host=context->host;
+  unsigned int port=context->port;
+
+  if(connection->replica) {
+    host=context->replicas[connection->replica - 1].host;
+    if(context->replicas[connection->replica - 1].port)
+      port=LIBRDF_GOOD_CAST(unsigned int, atoi(context->replicas[connection->replica - 1].port));
+  }
+
+  /* Initialize closed MySQL connection handle */
+  if(!mysql_init(&connection->mysql))
+    return 1;
+
+#ifdef HAVE_MYSQL_OPT_RECONNECT
+  if(1) {
+    my_bool value=(context->reconnect) ? 1 : 0;
+    mysql_options(&connection->mysql, MYSQL_OPT_RECONNECT, &value);
+  }
+#endif
+
+  /* Create connection to database for handle */
+  if(!mysql_real_connect(&connection->mysql,
+                         host, context->user, context->password,
+                         context->database, port, NULL, 0)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Connection to MySQL database %s:%d name %s as user %s failed: %s",
+               host, port, context->database,
+               context->user, mysql_error(&connection->mysql));
+    mysql_close(&connection->mysql);
+    return 1;
+  }
+
+  connection->handle=&connection->mysql;
+  connection->last_used=time(NULL);
+  return 0;
+}
+
+
+/*
+ * librdf_storage_mysql_disconnect - Close a pool connection and its prepared statements
+ * @connection: connection
+ **/
+static void
+librdf_storage_mysql_disconnect(librdf_storage_mysql_connection* connection)
+{
+  int i;
+
+  for(i=0; i < LIBRDF_STORAGE_MYSQL_FIND_SHAPES; i++) {
+    if(connection->find_statements[i]) {
+      mysql_stmt_close(connection->find_statements[i]);
+      connection->find_statements[i]=NULL;
+    }
+  }
+
+  if(connection->handle) {
+#ifdef LIBRDF_DEBUG_SQL
+    LIBRDF_DEBUG2("mysql_close connection handle %p\n", connection->handle);
+#endif
+    mysql_close(connection->handle);
+    connection->handle=NULL;
+  }
+}
+
+
+/*
+ * librdf_storage_mysql_check_connection - Make sure a reserved connection is usable
+ * @storage: the storage
+ * @connection: connection reserved by the caller
+ *
+ * Connects a closed connection and pings one that has been idle for
+ * longer than the ping interval, reconnecting if the server went away.
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_mysql_check_connection(librdf_storage* storage,
+                                      librdf_storage_mysql_connection* connection)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+
+  if(connection->handle && context->ping_interval > 0 &&
+     time(NULL) - connection->last_used >= context->ping_interval &&
+     mysql_ping(connection->handle)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Idle MySQL connection lost (%s), reconnecting",
+               mysql_error(connection->handle));
+    librdf_storage_mysql_disconnect(connection);
+  }
+
+  if(!connection->handle)
+    return librdf_storage_mysql_connect(storage, connection);
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_mysql_new_connection - Add a closed connection to the pool
+ * @storage: the storage
+ *
+ * Must be called with the pool locked.
+ *
+ * Return value: connection or NULL on failure
+ **/
+static librdf_storage_mysql_connection*
+librdf_storage_mysql_new_connection(librdf_storage* storage)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  librdf_storage_mysql_connection* connection;
+
+  if(context->connections_count == context->connections_size) {
+    /* Double the connection and free slot arrays */
+    int size=context->connections_size ? context->connections_size * 2 : 4;
+    librdf_storage_mysql_connection** connections;
+    int* free_slots;
+
+    connections=LIBRDF_CALLOC(librdf_storage_mysql_connection**,
+                              LIBRDF_GOOD_CAST(size_t, size),
+                              sizeof(librdf_storage_mysql_connection*));
+    free_slots=LIBRDF_CALLOC(int*, LIBRDF_GOOD_CAST(size_t, size), sizeof(int));
+    if(!connections || !free_slots) {
+      if(connections)
+        LIBRDF_FREE(librdf_storage_mysql_connection**, connections);
+      if(free_slots)
+        LIBRDF_FREE(int*, free_slots);
+      return NULL;
+    }
+
+    if(context->connections_count) {
+      memcpy(connections, context->connections,
+             sizeof(librdf_storage_mysql_connection*) * LIBRDF_GOOD_CAST(size_t, context->connections_count));
+      memcpy(free_slots, context->free_slots,
+             sizeof(int) * LIBRDF_GOOD_CAST(size_t, context->free_count));
+      LIBRDF_FREE(librdf_storage_mysql_connection**, context->connections);
+      LIBRDF_FREE(int*, context->free_slots);
+    }
+
+    context->connections=connections;
+    context->free_slots=free_slots;
+    context->connections_size=size;
+  }
+
+  connection=LIBRDF_CALLOC(librdf_storage_mysql_connection*, 1,
+                           sizeof(*connection));
+  if(!connection)
+    return NULL;
+
+  connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
+  connection->storage=storage;
+  connection->index=context->connections_count;
+  context->connections[context->connections_count++]=connection;
+
+  return connection;
+}
+
+
+#ifdef WITH_THREADS
+static void
+librdf_storage_mysql_thread_finished(void* data)
+{
+  librdf_storage_mysql_connection* connection=(librdf_storage_mysql_connection*)data;
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)connection->storage->instance;
+
+  /* Give the exiting thread's connection back to the pool */
+  pthread_mutex_lock(&context->pool_mutex);
+  connection->owned=0;
+  connection->status=connection->handle ? LIBRDF_STORAGE_MYSQL_CONNECTION_OPEN : LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
+  context->free_slots[context->free_count++]=connection->index;
+  pthread_cond_signal(&context->pool_cond);
+  pthread_mutex_unlock(&context->pool_mutex);
+}
+#endif
+
+
 /*
  * librdf_storage_mysql_init_connections - Initialize MySQL connection pool.
  * @storage: the storage
  *
- * Return value: Non-zero on success.
+ * Opens the pool-min connections up front.
+ *
+ * Return value: Non-zero on failure.
  **/
 static int
 librdf_storage_mysql_init_connections(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  int i;
 
   /* Reset connection pool */
   context->connections=NULL;
   context->connections_count=0;
+  context->connections_size=0;
+  context->replica_connections=0;
+  context->free_slots=NULL;
+  context->free_count=0;
+
+#ifdef WITH_THREADS
+  pthread_mutex_init(&context->pool_mutex, NULL);
+  pthread_cond_init(&context->pool_cond, NULL);
+  if(context->thread_handles &&
+     pthread_key_create(&context->thread_key,
+                        librdf_storage_mysql_thread_finished))
+    context->thread_handles=0;
+#else
+  context->thread_handles=0;
+#endif
+  context->pool_ready=1;
+
+  for(i=0; i < context->pool_min; i++) {
+    librdf_storage_mysql_connection* connection;
+
+    connection=librdf_storage_mysql_new_connection(storage);
+    if(!connection || librdf_storage_mysql_connect(storage, connection))
+      return 1;
+    connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_OPEN;
+    context->free_slots[context->free_count++]=connection->index;
+  }
+
   return 0;
 }
 
@@ -363,29 +735,48 @@ librdf_storage_mysql_finish_connections(librdf_storage* storage)
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
   int i;
 
+  if(!context->pool_ready)
+    return;
+
+#ifdef WITH_THREADS
+  if(context->thread_handles)
+    pthread_key_delete(context->thread_key);
+#endif
+
   /* Loop through connections and close */
   for(i=0; i < context->connections_count; i++) {
-    if(LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED != context->connections[i].status)
-#ifdef LIBRDF_DEBUG_SQL
-      LIBRDF_DEBUG2("mysql_close connection handle %p\n",
-                    context->connections[i].handle);
-#endif
-      mysql_close(context->connections[i].handle);
+    librdf_storage_mysql_disconnect(context->connections[i]);
+    LIBRDF_FREE(librdf_storage_mysql_connection*, context->connections[i]);
   }
   /* Free structure and reset */
-  if (context->connections_count) {
-    LIBRDF_FREE(librdf_storage_mysql_connection*, context->connections);
+  if(context->connections) {
+    LIBRDF_FREE(librdf_storage_mysql_connection**, context->connections);
     context->connections=NULL;
-    context->connections_count=0;
   }
+  if(context->free_slots) {
+    LIBRDF_FREE(int*, context->free_slots);
+    context->free_slots=NULL;
+  }
+  context->connections_count=0;
+  context->connections_size=0;
+  context->free_count=0;
+  context->replica_connections=0;
+
+#ifdef WITH_THREADS
+  pthread_cond_destroy(&context->pool_cond);
+  pthread_mutex_destroy(&context->pool_mutex);
+#endif
+  context->pool_ready=0;
 }
 
 /*
  * librdf_storage_mysql_get_handle - get a connection handle to the MySQL server
  * @storage: the storage
  *
- * This attempts to reuses any existing available pooled connection
- * otherwise creates a new connection to the server.
+ * This attempts to reuse any existing available pooled connection
+ * otherwise creates a new connection to the server, up to pool-max.
+ * With thread-handles each thread keeps one connection of its own
+ * that it takes without locking the pool.
  *
  * Return value: Non-zero on succes.
  **/
@@ -393,77 +784,75 @@ static MYSQL*
 librdf_storage_mysql_get_handle(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  librdf_storage_mysql_connection* connection= NULL;
-  int i;
+  librdf_storage_mysql_connection* connection=NULL;
+#ifdef WITH_THREADS
+  int own=0;
+#endif
 
   if(context->transaction_handle)
     return context->transaction_handle;
 
-  /* Look for an open connection handle to return */
-  for(i=0; i < context->connections_count; i++) {
-    if(LIBRDF_STORAGE_MYSQL_CONNECTION_OPEN == context->connections[i].status) {
-      context->connections[i].status=LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY;
-      return context->connections[i].handle;
+#ifdef WITH_THREADS
+  if(context->thread_handles) {
+    connection=(librdf_storage_mysql_connection*)pthread_getspecific(context->thread_key);
+    if(connection &&
+       connection->status != LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY) {
+      connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY;
+      if(librdf_storage_mysql_check_connection(storage, connection)) {
+        connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
+        return NULL;
+      }
+      return connection->handle;
     }
+    /* no connection yet or it is in use by this thread already */
+    own=!connection;
+    connection=NULL;
   }
 
-  /* Look for a closed connection */
-  for(i=0; i < context->connections_count && !connection; i++) {
-    if(LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED == context->connections[i].status) {
-      connection=&context->connections[i];
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+
+  while(!context->free_count) {
+    if(!context->pool_max ||
+       context->connections_count - context->replica_connections < context->pool_max) {
+      connection=librdf_storage_mysql_new_connection(storage);
       break;
     }
+#ifdef WITH_THREADS
+    pthread_cond_wait(&context->pool_cond, &context->pool_mutex);
+#else
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "All %d MySQL connections are in use", context->pool_max);
+    break;
+#endif
   }
-  /* Expand connection pool if no closed connection was found */
-  if (!connection) {
-    /* Allocate new buffer with two extra slots */
-    librdf_storage_mysql_connection* connections;
-    connections = LIBRDF_CALLOC(librdf_storage_mysql_connection*,
-                                LIBRDF_GOOD_CAST(size_t, context->connections_count + 2),
-                                sizeof(librdf_storage_mysql_connection));
-    if(!connections)
-      return NULL;
 
-    if (context->connections_count) {
-      /* Copy old buffer to new */
-      memcpy(connections, context->connections, 
-             sizeof(librdf_storage_mysql_connection) * LIBRDF_GOOD_CAST(size_t, context->connections_count));
-      /* Free old buffer */
-      LIBRDF_FREE(librdf_storage_mysql_connection*, context->connections);
-    }
+  if(!connection && context->free_count)
+    connection=context->connections[context->free_slots[--context->free_count]];
 
-    /* Update buffer size and reset new connections */
-    context->connections_count+=2;
-    connection=&connections[context->connections_count-2];
-    connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
-    connection->handle=NULL;
-    connections[context->connections_count-1].status=LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
-    connections[context->connections_count-1].handle=NULL;
-    context->connections=connections;
+  if(connection) {
+    connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY;
+#ifdef WITH_THREADS
+    if(own) {
+      connection->owned=1;
+      pthread_setspecific(context->thread_key, connection);
+    }
+#endif
   }
 
-  /* Initialize closed MySQL connection handle */
-  connection->handle=mysql_init(connection->handle);
-
-#ifdef HAVE_MYSQL_OPT_RECONNECT
-  if(1) {
-    my_bool value=(context->reconnect) ? 1 : 0;
-    mysql_options(connection->handle, MYSQL_OPT_RECONNECT, &value);
-  }
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&context->pool_mutex);
 #endif
 
-  /* Create connection to database for handle */
-  if(!mysql_real_connect(connection->handle,
-                         context->host, context->user, context->password,
-                         context->database, context->port, NULL, 0)) {
-    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "Connection to MySQL database %s:%d name %s as user %s failed: %s",
-               context->host, context->port, context->database,
-               context->user, mysql_error(connection->handle));
+  if(!connection)
+    return NULL;
+
+  /* Connect or check the connection outside the pool lock */
+  if(librdf_storage_mysql_check_connection(storage, connection)) {
+    librdf_storage_mysql_release_handle(storage, &connection->mysql);
     return NULL;
   }
-  /* Update status and return */
-  connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY;
+
   return connection->handle;
 }
 
@@ -479,22 +868,237 @@ static void
 librdf_storage_mysql_release_handle(librdf_storage* storage, MYSQL *handle)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  int i;
+  librdf_storage_mysql_connection* connection;
 
   if(handle == context->transaction_handle)
     return;
   
-  /* Look for busy connection handle to drop */
-  for(i=0; i < context->connections_count; i++) {
-    if(LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY == context->connections[i].status &&
-       context->connections[i].handle == handle) {
-      context->connections[i].status=LIBRDF_STORAGE_MYSQL_CONNECTION_OPEN;
-      return;
+  connection=librdf_storage_mysql_handle_connection(handle);
+  if(connection->status != LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Unable to find busy connection (in pool of %i connections) to drop for MySQL server thread: %lu",
+               context->connections_count, mysql_thread_id(handle));
+    return;
+  }
+
+  connection->last_used=time(NULL);
+
+#ifdef WITH_THREADS
+  if(connection->owned) {
+    /* only its thread uses it so no locking is needed */
+    connection->status=connection->handle ? LIBRDF_STORAGE_MYSQL_CONNECTION_OPEN : LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
+    return;
+  }
+
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+
+  connection->status=connection->handle ? LIBRDF_STORAGE_MYSQL_CONNECTION_OPEN : LIBRDF_STORAGE_MYSQL_CONNECTION_CLOSED;
+  if(!connection->replica)
+    context->free_slots[context->free_count++]=connection->index;
+
+#ifdef WITH_THREADS
+  pthread_cond_signal(&context->pool_cond);
+  pthread_mutex_unlock(&context->pool_mutex);
+#endif
+}
+
+
+/*
+ * librdf_storage_mysql_get_replica_handle - get a connection handle for a replica server
+ * @storage: the storage
+ * @replica: replica number from 1
+ *
+ * Return value: handle or NULL on failure
+ **/
+static MYSQL*
+librdf_storage_mysql_get_replica_handle(librdf_storage* storage, int replica)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  librdf_storage_mysql_connection* connection=NULL;
+  int i;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+
+  for(i=0; i < context->connections_count && !connection; i++) {
+    if(context->connections[i]->replica == replica &&
+       context->connections[i]->status != LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY)
+      connection=context->connections[i];
+  }
+  if(!connection) {
+    connection=librdf_storage_mysql_new_connection(storage);
+    if(connection) {
+      connection->replica=replica;
+      context->replica_connections++;
     }
   }
-  librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-             "Unable to find busy connection (in pool of %i connections) to drop for MySQL server thread: %lu",
-             context->connections_count, mysql_thread_id(handle));
+  if(connection)
+    connection->status=LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY;
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&context->pool_mutex);
+#endif
+
+  /* Connect or check the connection outside the pool lock */
+  if(connection && librdf_storage_mysql_check_connection(storage, connection)) {
+    librdf_storage_mysql_release_handle(storage, &connection->mysql);
+    connection=NULL;
+  }
+
+  return connection ? connection->handle : NULL;
+}
+
+
+/*
+ * librdf_storage_mysql_get_read_handle - get a connection handle for a read-only query
+ * @storage: the storage
+ *
+ * Outside a transaction or write-behind queue this is a connection to
+ * the replica with the fewest connections in use, taking them in turn
+ * when equal, so replicas that are behind the primary may not show
+ * recent changes.  Without replicas, or if none can be reached, it is
+ * a primary server connection.
+ *
+ * Return value: handle or NULL on failure
+ **/
+static MYSQL*
+librdf_storage_mysql_get_read_handle(librdf_storage* storage)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  MYSQL* handle;
+  int best=0;
+  int best_busy=0;
+  int r;
+  int i;
+
+  if(!context->replicas_count || context->transaction_handle)
+    return librdf_storage_mysql_get_handle(storage);
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+
+  for(r=1; r <= context->replicas_count; r++) {
+    /* start after the replica used last */
+    int replica=(context->replica_last + r - 1) % context->replicas_count + 1;
+    int busy=0;
+
+    for(i=0; i < context->connections_count; i++) {
+      if(context->connections[i]->replica == replica &&
+         context->connections[i]->status == LIBRDF_STORAGE_MYSQL_CONNECTION_BUSY)
+        busy++;
+    }
+    if(!best || busy < best_busy) {
+      best=replica;
+      best_busy=busy;
+    }
+  }
+  context->replica_last=best;
+
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&context->pool_mutex);
+#endif
+
+  handle=librdf_storage_mysql_get_replica_handle(storage, best);
+  if(!handle) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL replica %s unavailable, reading from the primary",
+               context->replicas[best - 1].host);
+    return librdf_storage_mysql_get_handle(storage);
+  }
+
+  return handle;
+}
+
+
+/*
+ * librdf_storage_mysql_init_node_hash - Choose the node hash function
+ * @storage: the storage
+ * @handle: MySQL connection handle
+ * @name: node-hash option value or NULL
+ * @is_new: non-0 if the new option was given
+ *
+ * The function is recorded in the Settings table when the database is
+ * first created, before any model.  A database without the setting
+ * was made before node hashes could be chosen and keeps using MD5.
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_mysql_init_node_hash(librdf_storage* storage, MYSQL *handle,
+                                    const char* name, int is_new)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  const char get_setting[]="SELECT Value FROM Settings WHERE Name='node-hash'";
+  const char any_model[]="SELECT 1 FROM Models LIMIT 1";
+  const char create_settings[]="CREATE TABLE IF NOT EXISTS Settings (Name varchar(64) NOT NULL, Value text NOT NULL, PRIMARY KEY (Name))";
+  const char set_setting[]="INSERT INTO Settings (Name, Value) VALUES ('node-hash', '%s')";
+  char query[128];
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+  int wanted=LIBRDF_SQL_NODE_HASH_MD5;
+  int stored=-1;
+  int has_models=1;
+
+  if(name) {
+    wanted=librdf_sql_node_hash_from_name(name);
+    if(wanted < 0) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown MySQL node-hash %s", name);
+      return 1;
+    }
+  }
+
+  /* The Settings table does not exist in older databases */
+  if(!mysql_real_query(handle, get_setting, strlen(get_setting)) &&
+     (res=mysql_store_result(handle))) {
+    if((row=mysql_fetch_row(res)) && row[0]) {
+      stored=librdf_sql_node_hash_from_name(row[0]);
+      if(stored < 0) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                   NULL, "Unknown MySQL database node-hash %s", row[0]);
+        mysql_free_result(res);
+        return 1;
+      }
+    }
+    mysql_free_result(res);
+  }
+
+  if(stored < 0 && is_new &&
+     !mysql_real_query(handle, any_model, strlen(any_model)) &&
+     (res=mysql_store_result(handle))) {
+    has_models=(mysql_fetch_row(res) != NULL);
+    mysql_free_result(res);
+  }
+
+  if(stored < 0 && !has_models) {
+    /* A new database: record the requested function */
+    sprintf(query, set_setting,
+            librdf_sql_node_hash_name((librdf_sql_node_hash)wanted));
+#ifdef LIBRDF_DEBUG_SQL
+    LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
+#endif
+    if(mysql_real_query(handle, create_settings, strlen(create_settings)) ||
+       mysql_real_query(handle, query, strlen(query))) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "MySQL insert into Settings table failed: %s",
+                 mysql_error(handle));
+      return 1;
+    }
+    stored=wanted;
+  } else if(stored < 0)
+    stored=LIBRDF_SQL_NODE_HASH_MD5;
+
+  if(stored != wanted && name)
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL database uses node-hash %s, ignoring node-hash %s",
+               librdf_sql_node_hash_name((librdf_sql_node_hash)stored), name);
+
+  context->node_hash=(librdf_sql_node_hash)stored;
+
+  return 0;
 }
 
 
@@ -502,7 +1106,7 @@ librdf_storage_mysql_release_handle(librdf_storage* storage, MYSQL *handle)
  * librdf_storage_mysql_init:
  * @storage: the storage
  * @name: model name
- * @options: host, port, database, user, password [, new] [, bulk] [, merge].
+ * @options: host, port, database, user, password [, new] [, bulk] [, merge] [, node-hash] [, pool-min] [, pool-max] [, ping-interval] [, thread-handles].
  *
  * .
  *
@@ -515,6 +1119,15 @@ librdf_storage_mysql_release_handle(librdf_storage* storage, MYSQL *handle)
  * The boolean merge option can be set to true if a merged "view" of all
  * models should be maintained. This "view" will be a table with TYPE=MERGE.
  *
+ * The node-hash option names the function used for node ids, md5
+ * (default) or xxh64.  It is only used when a new database is created.
+ *
+ * The integer pool-min and pool-max options set the number of
+ * connections opened at init and the most kept (default no limit);
+ * ping-interval is the idle seconds after which a connection is
+ * checked before reuse (default 60, 0 never).  The boolean
+ * thread-handles option gives each thread a connection of its own.
+ *
  * Return value: Non-zero on failure.
  **/
 static int
@@ -531,6 +1144,9 @@ librdf_storage_mysql_init(librdf_storage* storage, const char *name,
   MYSQL *handle;
   const char* default_layout="v1";
   long lport;
+  long node_cache_size;
+  long pool_value;
+  char *replicas;
 
   /* Must have connection parameters passed as options */
   if(!options)
@@ -587,16 +1203,59 @@ librdf_storage_mysql_init(librdf_storage* storage, const char *name,
   /* Reconnect? */
   context->reconnect = (librdf_hash_get_as_boolean(options, "reconnect")>0);
 
+  /* Run basic graph pattern queries as SQL? */
+  context->sql_query = (librdf_hash_get_as_boolean(options, "sql-query")!=0);
+
   context->layout = librdf_hash_get_del(options, "layout");
   if(!context->layout) {
     context->layout = LIBRDF_MALLOC(char*, strlen(default_layout) + 1);
     strcpy(context->layout, default_layout);
   }
 
+  /* Statements table and model condition for the layout */
+  context->partitioned = !strcmp(context->layout,
+                                 LIBRDF_STORAGE_MYSQL_PARTITIONED_LAYOUT);
+  if(context->partitioned) {
+    /* the partitioned table already holds every model */
+    context->merge = 0;
+    strcpy(context->statements_table, "Statements");
+    sprintf(context->model_where, " WHERE Model=" UINT64_T_FMT,
+            context->model);
+    sprintf(context->model_and, "Model=" UINT64_T_FMT " AND ",
+            context->model);
+  } else {
+    sprintf(context->statements_table, "Statements" UINT64_T_FMT,
+            context->model);
+    context->model_where[0] = '\0';
+    context->model_and[0] = '\0';
+  }
+
   context->config_dir = librdf_hash_get_del(options, "config-dir");
 
+  /* Connection pool sizing and checks */
+  pool_value = librdf_hash_get_as_long(options, "pool-min");
+  context->pool_min = (pool_value > 0 && pool_value <= INT_MAX) ? (int)pool_value : 0;
+  pool_value = librdf_hash_get_as_long(options, "pool-max");
+  context->pool_max = (pool_value > 0 && pool_value <= INT_MAX) ? (int)pool_value : 0;
+  if(context->pool_max && context->pool_max < context->pool_min)
+    context->pool_max = context->pool_min;
+  pool_value = librdf_hash_get_as_long(options, "ping-interval");
+  context->ping_interval = (pool_value >= 0 && pool_value <= INT_MAX) ? (int)pool_value : LIBRDF_STORAGE_MYSQL_PING_INTERVAL;
+  context->thread_handles = (librdf_hash_get_as_boolean(options, "thread-handles")>0);
+
+  /* Read from replicas? */
+  replicas = librdf_hash_get(options, "replicas");
+  if(replicas) {
+    context->replicas = librdf_new_sql_replicas(replicas,
+                                                &context->replicas_count);
+    LIBRDF_FREE(char*, replicas);
+  }
+
   /* Initialize MySQL connections */
-  librdf_storage_mysql_init_connections(storage);
+  if(librdf_storage_mysql_init_connections(storage)) {
+    librdf_free_hash(options);
+    return 1;
+  }
 
   /* Get MySQL connection handle */
   handle = librdf_storage_mysql_get_handle(storage);
@@ -615,8 +1274,7 @@ librdf_storage_mysql_init(librdf_storage* storage, const char *name,
     char vars_str[50];
     context->vars = librdf_new_hash(storage->world, NULL);
       
-    sprintf(vars_str, "STATEMENTS_NAME='Statements" UINT64_T_FMT "'", 
-            context->model);
+    sprintf(vars_str, "STATEMENTS_NAME='%s'", context->statements_table);
     librdf_hash_from_string(context->vars, vars_str);
   }
   
@@ -651,6 +1309,15 @@ librdf_storage_mysql_init(librdf_storage* storage, const char *name,
     
   }
 
+  /* Choose node hash function before any node is hashed */
+  if(!status) {
+    char* node_hash=librdf_hash_get_del(options, "node-hash");
+    status=librdf_storage_mysql_init_node_hash(storage, handle, node_hash,
+                                               (librdf_hash_get_as_boolean(options, "new")>0));
+    if(node_hash)
+      LIBRDF_FREE(char*, node_hash);
+  }
+
   /* Create model if new and not existing, or check for existence */
   if(!status) {
     escaped_name = LIBRDF_MALLOC(char*, strlen(name) * 2 + 1);
@@ -715,6 +1382,22 @@ librdf_storage_mysql_init(librdf_storage* storage, const char *name,
   /* Optimize loads? */
   context->bulk = (librdf_hash_get_as_boolean(options, "bulk")>0);
 
+  /* Queue added statements? */
+  pool_value = librdf_hash_get_as_long(options, "write-behind");
+  context->write_behind = (pool_value > 0 && pool_value <= INT_MAX) ? (int)pool_value : 0;
+  pool_value = librdf_hash_get_as_long(options, "write-behind-interval");
+  context->write_behind_interval = (pool_value >= 0 && pool_value <= INT_MAX) ? (int)pool_value : LIBRDF_STORAGE_MYSQL_WRITE_BEHIND_INTERVAL;
+
+  /* Cache stored nodes? */
+  node_cache_size = librdf_hash_get_as_long(options, "node-cache-size");
+  if(node_cache_size < 0)
+    node_cache_size = LIBRDF_SQL_NODE_CACHE_SIZE;
+  if(!status && node_cache_size > 0) {
+    context->node_cache = librdf_new_sql_node_cache((int)node_cache_size);
+    if(!context->node_cache)
+      status = 1;
+  }
+
   /* Truncate model? */
   if(!status && (librdf_hash_get_as_boolean(options, "new")>0))
     status = librdf_storage_mysql_context_remove_statements(storage, NULL);
@@ -827,6 +1510,8 @@ librdf_storage_mysql_terminate(librdf_storage* storage)
   if (context == NULL)
     return;
 
+  librdf_storage_mysql_write_behind_flush(storage);
+
   librdf_storage_mysql_finish_connections(storage);
 
   if(context->config_dir)
@@ -844,6 +1529,9 @@ librdf_storage_mysql_terminate(librdf_storage* storage)
   if(context->password)
     LIBRDF_FREE(char*, context->password);
 
+  if(context->replicas)
+    librdf_free_sql_replicas(context->replicas, context->replicas_count);
+
   if(context->user)
     LIBRDF_FREE(char*, context->user);
 
@@ -859,6 +1547,9 @@ librdf_storage_mysql_terminate(librdf_storage* storage)
   if(context->transaction_handle)
     librdf_storage_mysql_transaction_rollback(storage);
   
+  if(context->node_cache)
+    librdf_free_sql_node_cache(context->node_cache);
+
   LIBRDF_FREE(librdf_storage_mysql_instance, storage->instance);
 }
 
@@ -909,12 +1600,16 @@ static int
 librdf_storage_mysql_sync(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  int status;
+
+  /* Send queued statements */
+  status=librdf_storage_mysql_write_behind_flush(storage);
 
   /* Make sure optimizing for bulk operations is stopped? */
   if(context->bulk)
     librdf_storage_mysql_stop_bulk(storage);
 
-  return 0;
+  return status;
 }
 
 /**
@@ -931,25 +1626,31 @@ static int
 librdf_storage_mysql_size(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char model_size[]="SELECT COUNT(*) FROM Statements" UINT64_T_FMT;
+  char model_size[]="SELECT COUNT(*) FROM %s%s";
   char *query;
   MYSQL_RES *res;
   MYSQL_ROW row;
   int count;
   MYSQL *handle;
 
+  /* Count queued statements too */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return -1;
+
   /* Get MySQL connection handle */
-  handle=librdf_storage_mysql_get_handle(storage);
+  handle=librdf_storage_mysql_get_read_handle(storage);
   if(!handle)
     return -1;
 
   /* Query for number of statements */
-  query = LIBRDF_MALLOC(char*, strlen(model_size) + 21);
+  query = LIBRDF_MALLOC(char*, strlen(model_size) +
+                        strlen(context->statements_table) +
+                        strlen(context->model_where) + 1);
   if(!query) {
     librdf_storage_mysql_release_handle(storage, handle);
     return -1;
   }
-  sprintf(query, model_size, context->model);
+  sprintf(query, model_size, context->statements_table, context->model_where);
 
 #ifdef LIBRDF_DEBUG_SQL
   LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
@@ -1030,87 +1731,380 @@ compare_pending_rows(const void *a, const void *b)
     else if(prow_b->uints[i] < prow_a->uints[i])
       return 1;
   }
-  return 0;
-}
+  return 0;
+}
+
+
+
+static void
+free_pending_row(pending_row* prow)
+{
+  int i;
+  
+  for(i=0; i < prow->strings_count; i++)
+    LIBRDF_FREE(char*, prow->strings[i]);
+
+  LIBRDF_FREE(pending_row, prow);
+}
+
+
+/*
+ * format_pending_row_sequence - Format pending rows as one multi-row insert
+ * @prefix: start of the query up to and including VALUES
+ * @seq: sequence of #pending_row
+ * @offset_p: pointer to index of the first row to format; updated past the last row formatted
+ * @max_len: maximum query length (at least one row is always formatted)
+ *
+ * Each row is formatted as its key_len integer keys (ID for node tables,
+ * Subject, Predicate, Object, Context for statements) followed by its
+ * escaped strings.
+ *
+ * Return value: query or NULL if there are no rows
+ **/
+static raptor_stringbuffer*
+format_pending_row_sequence(const char *prefix, raptor_sequence* seq,
+                            int *offset_p, size_t max_len)
+{
+  int i;
+  raptor_stringbuffer* sb;
+  int size=raptor_sequence_size(seq);
+  
+  if(*offset_p >= size)
+    return NULL;
+
+  sb=raptor_new_stringbuffer();
+  if(!sb)
+    return NULL;
+
+  raptor_stringbuffer_append_string(sb, (const unsigned char*)prefix, 1);
+
+  for(i=*offset_p; i < size; i++) {
+    pending_row* prow;
+    char uint64_buffer[64];
+    size_t row_len;
+    int j;
+    
+    prow=(pending_row*)raptor_sequence_get_at(seq, i);
+
+    /* keys are at most 20 digits; strings are quoted */
+    row_len=4 + 22 * prow->key_len;
+    for(j=0; j < prow->strings_count; j++)
+      row_len+=prow->strings_len[j] + 4;
+
+    if(i > *offset_p) {
+      if(raptor_stringbuffer_length(sb) + row_len > max_len)
+        break;
+      raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)", ", 2, 1);
+    }
+    
+    raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)"(", 1, 1);
+    for(j=0; j < prow->key_len; j++) {
+      if(j > 0)
+        raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)", ", 2, 1);
+      sprintf(uint64_buffer, UINT64_T_FMT, prow->uints[j]);
+      raptor_stringbuffer_append_string(sb,
+                                    (const unsigned char*)uint64_buffer, 1);
+    }
+
+    for(j=0; j < prow->strings_count; j++) {
+      raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)", '", 3, 1);
+      raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)prow->strings[j],
+                                    prow->strings_len[j], 1);
+      raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)"'", 1, 1);
+    }
+
+    raptor_stringbuffer_append_counted_string(sb,
+                                    (const unsigned char*)")", 1, 1);
+  }
+
+#ifdef LIBRDF_DEBUG_SQL
+  LIBRDF_DEBUG4("Formatted pending rows %d to %d into query size %d\n",
+                *offset_p, i, raptor_stringbuffer_length(sb));
+#endif
+  *offset_p=i;
+  
+  return sb;
+}
+
+
+/*
+ * librdf_storage_mysql_max_packet - Get the largest query the server accepts
+ * @storage: the storage
+ * @handle: MySQL connection handle
+ *
+ * Asks the server for max_allowed_packet once and leaves some room
+ * for the packet header.
+ *
+ * Return value: maximum query length
+ **/
+static size_t
+librdf_storage_mysql_max_packet(librdf_storage* storage, MYSQL *handle)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  const char query[]="SELECT @@max_allowed_packet";
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  if(context->max_packet)
+    return context->max_packet;
+
+  context->max_packet=LIBRDF_STORAGE_MYSQL_DEFAULT_MAX_PACKET;
+
+  if(!mysql_real_query(handle, query, strlen(query)) &&
+     (res=mysql_store_result(handle))) {
+    if((row=mysql_fetch_row(res)) && row[0]) {
+      long packet=atol(row[0]);
+      if(packet > 2 * LIBRDF_STORAGE_MYSQL_PACKET_RESERVE)
+        context->max_packet=(size_t)(packet - LIBRDF_STORAGE_MYSQL_PACKET_RESERVE);
+    }
+    mysql_free_result(res);
+  }
+
+  return context->max_packet;
+}
+
+
+/*
+ * librdf_storage_mysql_insert_pending_rows - Insert pending rows into a table
+ * @storage: the storage
+ * @handle: MySQL connection handle
+ * @table_name: table name for error messages
+ * @prefix: start of the query up to and including VALUES
+ * @seq: sequence of #pending_row
+ *
+ * Sends the rows as multi-row inserts each as large as the server
+ * max_allowed_packet permits.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_mysql_insert_pending_rows(librdf_storage* storage,
+                                         MYSQL *handle,
+                                         const char *table_name,
+                                         const char *prefix,
+                                         raptor_sequence* seq)
+{
+  size_t max_len=librdf_storage_mysql_max_packet(storage, handle);
+  int offset=0;
+  raptor_stringbuffer* sb;
+
+  while((sb=format_pending_row_sequence(prefix, seq, &offset, max_len))) {
+    const char *query=(const char*)raptor_stringbuffer_as_string(sb);
+
+#ifdef LIBRDF_DEBUG_SQL
+    LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
+#endif
+    if(mysql_real_query(handle, query, raptor_stringbuffer_length(sb)) &&
+       mysql_errno(handle) != ER_DUP_ENTRY) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                 NULL, "MySQL insert into %s failed with error %s",
+                 table_name, mysql_error(handle));
+      raptor_free_stringbuffer(sb);
+      return 1;
+    }
+    raptor_free_stringbuffer(sb);
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_mysql_node_insert_prefix - Write the multi-row insert prefix for a node table
+ * @table: node table
+ * @buffer: buffer of at least LIBRDF_STORAGE_MYSQL_PREFIX_SIZE bytes
+ *
+ * Return value: @buffer
+ **/
+static const char*
+librdf_storage_mysql_node_insert_prefix(const table_info *table, char *buffer)
+{
+  sprintf(buffer, "REPLACE INTO %s (ID, %s) VALUES ", table->name,
+          table->columns);
+  return buffer;
+}
+
+
+/*
+ * librdf_storage_mysql_flush_pending - Insert all pending nodes and statements
+ * @storage: the storage
+ * @handle: MySQL connection handle
+ *
+ * Nodes are inserted before the statements that use them and both are
+ * sorted so that they are always inserted in the same order.  The
+ * pending rows are emptied; the set of seen nodes is kept.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_mysql_flush_pending(librdf_storage* storage, MYSQL *handle)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  char prefix[LIBRDF_STORAGE_MYSQL_PREFIX_SIZE];
+  raptor_sequence* seq;
+  void* prow;
+  int i;
+
+  /* INSERT node values */
+  for(i=0; i< TABLE_STATEMENTS; i++) {
+    const table_info *table=&mysql_tables[i];
+
+    seq=context->pending_inserts[i];
+    raptor_sequence_sort(seq, compare_pending_rows);
+
+    if(librdf_storage_mysql_insert_pending_rows(storage, handle, table->name,
+                                                librdf_storage_mysql_node_insert_prefix(table, prefix),
+                                                seq))
+      return 1;
+  }
+
+  /* INSERT STATEMENT* */
+  seq=context->pending_statements;
+  raptor_sequence_sort(seq, compare_pending_rows);
+
+  sprintf(prefix, "REPLACE INTO %s (%s%s) VALUES ",
+          context->statements_table, (context->partitioned ? "Model, " : ""),
+          mysql_tables[TABLE_STATEMENTS].columns);
+  if(librdf_storage_mysql_insert_pending_rows(storage, handle, "Statements",
+                                              prefix, seq))
+    return 1;
+
+  for(i=0; i< TABLE_STATEMENTS; i++) {
+    while((prow=raptor_sequence_pop(context->pending_inserts[i])))
+      free_pending_row((pending_row*)prow);
+  }
+  while((prow=raptor_sequence_pop(context->pending_statements)))
+    free_pending_row((pending_row*)prow);
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_mysql_write_behind_begin - Open the write-behind queue
+ * @storage: the storage
+ *
+ * The queue collects rows as a transaction does, without START
+ * TRANSACTION, and is not opened inside a transaction or when the
+ * write-behind option is not given.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_mysql_write_behind_begin(librdf_storage* storage)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+
+  if(!context->write_behind || context->transaction_handle)
+    return 0;
+
+  if(librdf_storage_mysql_transaction_start(storage))
+    return 1;
+
+  context->write_behind_open=1;
+  context->write_behind_time=time(NULL);
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_mysql_write_behind_flush - Send and close the write-behind queue
+ * @storage: the storage
+ *
+ * Called before anything that must see the queued statements.  On
+ * failure the queued statements are dropped and the error is logged,
+ * so it reaches the world log handler, as well as returned.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_mysql_write_behind_flush(librdf_storage* storage)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  int count;
+  int status;
+
+  if(!context->write_behind_open)
+    return 0;
+
+  count=raptor_sequence_size(context->pending_statements);
+  status=librdf_storage_mysql_flush_pending(storage,
+                                            context->transaction_handle);
+  context->write_behind_open=0;
+  librdf_storage_mysql_transaction_terminate(storage);
+
+  if(status) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL write-behind insert failed, %d queued statements were not stored",
+               count);
+    /* nodes cached while queued may not have been stored */
+    if(context->node_cache)
+      librdf_sql_node_cache_clear(context->node_cache);
+  }
 
+  return status;
+}
 
 
-static void
-free_pending_row(pending_row* prow)
+/*
+ * librdf_storage_mysql_write_behind_check - Flush the write-behind queue if full or old
+ * @storage: the storage
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_mysql_write_behind_check(librdf_storage* storage)
 {
-  int i;
-  
-  for(i=0; i < prow->strings_count; i++)
-    LIBRDF_FREE(char*, prow->strings[i]);
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
 
-  LIBRDF_FREE(pending_row, prow);
+  if(!context->write_behind_open)
+    return 0;
+
+  if(raptor_sequence_size(context->pending_statements) >= context->write_behind ||
+     time(NULL) - context->write_behind_time >= context->write_behind_interval)
+    return librdf_storage_mysql_write_behind_flush(storage);
+
+  return 0;
 }
 
 
-static raptor_stringbuffer*
-format_pending_row_sequence(const table_info *table, raptor_sequence* seq)
+/*
+ * librdf_storage_mysql_write_behind_contains - Check the write-behind queue for a statement
+ * @storage: the storage
+ * @subject: subject hash
+ * @predicate: predicate hash
+ * @object: object hash
+ *
+ * Return value: non-0 if the statement is queued in any context
+ **/
+static int
+librdf_storage_mysql_write_behind_contains(librdf_storage* storage,
+                                           u64 subject, u64 predicate,
+                                           u64 object)
 {
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  int offset=context->partitioned ? 1 : 0;
   int i;
-  raptor_stringbuffer* sb;
-  
-  if(!raptor_sequence_size(seq))
-    return NULL;
 
-#ifdef LIBRDF_DEBUG_SQL
-  LIBRDF_DEBUG3("Format pending row for table %s with %d entries\n",
-                table->name, raptor_sequence_size(seq));
-#endif
-  
-  sb=raptor_new_stringbuffer();
-
-  raptor_stringbuffer_append_string(sb,
-                                    (const unsigned char*)"REPLACE INTO ", 1);
-  raptor_stringbuffer_append_string(sb,
-                                    (const unsigned char*)table->name, 1);
-  raptor_stringbuffer_append_string(sb,
-                                    (const unsigned char*)" (ID, ", 1);
-  raptor_stringbuffer_append_string(sb,
-                                    (const unsigned char*)table->columns, 1);
-  raptor_stringbuffer_append_counted_string(sb,
-                                    (const unsigned char*)") VALUES ", 9, 1);
-
-  for(i=0; i< raptor_sequence_size(seq); i++) {
-    pending_row* prow;
-    char uint64_buffer[64];
-    int j;
-    
-    if(i > 0)
-      raptor_stringbuffer_append_counted_string(sb,
-                                    (const unsigned char*)", ", 2, 1);
-    
-    prow=(pending_row*)raptor_sequence_get_at(seq, i);
-    
-    raptor_stringbuffer_append_counted_string(sb,
-                                    (const unsigned char*)"(", 1, 1);
-    /* First column is always the ID */
-    sprintf(uint64_buffer, UINT64_T_FMT, prow->uints[0]);
-    raptor_stringbuffer_append_string(sb,
-                                    (const unsigned char*)uint64_buffer, 1);
+  if(!context->write_behind_open)
+    return 0;
 
-    for(j=0; j < prow->strings_count; j++) {
-      raptor_stringbuffer_append_counted_string(sb,
-                                    (const unsigned char*)", '", 3, 1);
-      raptor_stringbuffer_append_string(sb,
-                                    (const unsigned char*)prow->strings[j], 1);
-      raptor_stringbuffer_append_counted_string(sb,
-                                    (const unsigned char*)"'", 1, 1);
-    }
+  for(i=0; i < raptor_sequence_size(context->pending_statements); i++) {
+    pending_row* prow=(pending_row*)raptor_sequence_get_at(context->pending_statements, i);
+    u64* uints=prow->uints + offset;
 
-    raptor_stringbuffer_append_counted_string(sb,
-                                    (const unsigned char*)")", 1, 1);
+    if(uints[0] == subject && uints[1] == predicate && uints[2] == object)
+      return 1;
   }
 
-#ifdef LIBRDF_DEBUG_SQL
-  LIBRDF_DEBUG3("Format pending row for table %s returning query size %d\n",
-                table->name, raptor_stringbuffer_length(sb));
-#endif
-  
-  return sb;
+  return 0;
 }
 
 
@@ -1131,7 +2125,6 @@ librdf_storage_mysql_node_hash_common(librdf_storage* storage,
   librdf_node_type type=librdf_node_get_type(node);
   u64 hash;
   size_t nodelen;
-  char *query;
   triple_node_type node_type;
   const table_info *table;
   MYSQL *handle;
@@ -1152,6 +2145,11 @@ librdf_storage_mysql_node_hash_common(librdf_storage* storage,
   librdf_hash_datum* old_value;
   pending_row* prow;
   
+  /* Nodes in the cache are already stored (or pending in the transaction) */
+  if(context->node_cache &&
+     librdf_sql_node_cache_get(context->node_cache, node, &hash))
+    return hash;
+
   /* Get MySQL connection handle */
   handle=librdf_storage_mysql_get_handle(storage);
   if(!handle)
@@ -1333,29 +2331,14 @@ librdf_storage_mysql_node_hash_common(librdf_storage* storage,
     /* in a transaction */
   } else {
     /* not in a transaction so run it now */
-    raptor_stringbuffer *sb=NULL;
-    size_t query_len;
+    char prefix[LIBRDF_STORAGE_MYSQL_PREFIX_SIZE];
 
-    sb=format_pending_row_sequence(table, seq);
-    
-    query_len=raptor_stringbuffer_length(sb);
-    query=(char*)raptor_stringbuffer_as_string(sb);
-    if(query) {
-#ifdef LIBRDF_DEBUG_SQL
-      LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
-#endif
-      if(mysql_real_query(handle, query, query_len) &&
-         mysql_errno(handle) != ER_DUP_ENTRY) {
-        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
-                   NULL, "MySQL insert into %s failed with error %s",
-                   table->name, mysql_error(handle));
-        raptor_free_stringbuffer(sb);
-        hash=0;
-        goto tidy;
-      }
+    if(librdf_storage_mysql_insert_pending_rows(storage, handle, table->name,
+                                                librdf_storage_mysql_node_insert_prefix(table, prefix),
+                                                seq)) {
+      hash=0;
+      goto tidy;
     }
-
-    raptor_free_stringbuffer(sb);
   }
   
   tidy:
@@ -1365,6 +2348,9 @@ librdf_storage_mysql_node_hash_common(librdf_storage* storage,
       raptor_free_sequence(seq);
   }
 
+  if(hash && mode == NODE_HASH_MODE_STORE_NODE && context->node_cache)
+    librdf_sql_node_cache_put(context->node_cache, node, hash);
+
   if(handle) {
     librdf_storage_mysql_release_handle(storage, handle);
   }
@@ -1400,9 +2386,9 @@ static int
 librdf_storage_mysql_start_bulk(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char disable_statement_keys[]="ALTER TABLE Statements" UINT64_T_FMT " DISABLE KEYS";
+  char disable_statement_keys[]="ALTER TABLE %s DISABLE KEYS";
   char disable_literal_keys[]="ALTER TABLE Literals DISABLE KEYS";
-  char lock_tables[]="LOCK TABLES Statements" UINT64_T_FMT " WRITE, Resources WRITE, Bnodes WRITE, Literals WRITE";
+  char lock_tables[]="LOCK TABLES %s WRITE, Resources WRITE, Bnodes WRITE, Literals WRITE";
   char lock_tables_extra[]=", Statements WRITE";
   char *query=NULL;
   MYSQL *handle;
@@ -1412,12 +2398,13 @@ librdf_storage_mysql_start_bulk(librdf_storage* storage)
   if(!handle)
     return 1;
 
-  query = LIBRDF_MALLOC(char*, strlen(disable_statement_keys) + 21);
+  query = LIBRDF_MALLOC(char*, strlen(disable_statement_keys) +
+                        strlen(context->statements_table) + 1);
   if(!query) {
     librdf_storage_mysql_release_handle(storage, handle);
     return 1;
   }
-  sprintf(query, disable_statement_keys, context->model);
+  sprintf(query, disable_statement_keys, context->statements_table);
 
 #ifdef LIBRDF_DEBUG_SQL
   LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
@@ -1444,12 +2431,13 @@ librdf_storage_mysql_start_bulk(librdf_storage* storage)
   }
 
   query = LIBRDF_MALLOC(char*, strlen(lock_tables) + 
-                        strlen(lock_tables_extra) + 21);
+                        strlen(lock_tables_extra) +
+                        strlen(context->statements_table) + 1);
   if(!query) {
     librdf_storage_mysql_release_handle(storage, handle);
     return 1;
   }
-  sprintf(query, lock_tables, context->model);
+  sprintf(query, lock_tables, context->statements_table);
   if(context->merge)
     strcat(query, lock_tables_extra);
 
@@ -1482,7 +2470,7 @@ static int
 librdf_storage_mysql_stop_bulk(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char enable_statement_keys[]="ALTER TABLE Statements" UINT64_T_FMT " ENABLE KEYS";
+  char enable_statement_keys[]="ALTER TABLE %s ENABLE KEYS";
   char enable_literal_keys[]="ALTER TABLE Literals ENABLE KEYS";
   char unlock_tables[]="UNLOCK TABLES";
   char flush_statements[]="FLUSH TABLE Statements";
@@ -1506,12 +2494,13 @@ librdf_storage_mysql_stop_bulk(librdf_storage* storage)
     return 1;
   }
 
-  query = LIBRDF_MALLOC(char*, strlen(enable_statement_keys) + 21);
+  query = LIBRDF_MALLOC(char*, strlen(enable_statement_keys) +
+                        strlen(context->statements_table) + 1);
   if(!query) {
     librdf_storage_mysql_release_handle(storage, handle);
     return 1;
   }
-  sprintf(query, enable_statement_keys, context->model);
+  sprintf(query, enable_statement_keys, context->statements_table);
 
 #ifdef LIBRDF_DEBUG_SQL
   LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
@@ -1574,27 +2563,54 @@ librdf_storage_mysql_context_add_statements(librdf_storage* storage,
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
   u64 ctxt=0;
   int helper=0;
+  int batch=0;
 
   /* Optimize for bulk loads? */
   if(context->bulk) {
-    if(librdf_storage_mysql_start_bulk(storage))
+    /* bulk loads are batched by themselves */
+    if(librdf_storage_mysql_write_behind_flush(storage) ||
+       librdf_storage_mysql_start_bulk(storage))
       return 1;
-  }
+
+    /* Collect the rows as a transaction does and send them in
+     * batches of multi-row inserts, without START TRANSACTION */
+    if(!context->transaction_handle) {
+      if(librdf_storage_mysql_transaction_start(storage))
+        return 1;
+      batch=1;
+    }
+  } else if(librdf_storage_mysql_write_behind_begin(storage))
+    return 1;
   
   /* Find hash for context, creating if necessary */
   if(context_node) {
     ctxt=librdf_storage_mysql_store_node(storage,context_node);
     if(!ctxt)
-      return 1;
+      helper=1;
   }
 
   while(!helper && !librdf_stream_end(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
     helper=librdf_storage_mysql_context_add_statement_helper(storage, ctxt,
                                                              statement);
+    if(!helper && batch &&
+       raptor_sequence_size(context->pending_statements) >= LIBRDF_STORAGE_MYSQL_BULK_STATEMENTS)
+      helper=librdf_storage_mysql_flush_pending(storage,
+                                                context->transaction_handle);
     librdf_stream_next(statement_stream);
   }
 
+  if(batch) {
+    if(!helper)
+      helper=librdf_storage_mysql_flush_pending(storage,
+                                                context->transaction_handle);
+    librdf_storage_mysql_transaction_terminate(storage);
+
+    /* nodes cached in an unsent batch were never stored */
+    if(helper && context->node_cache)
+      librdf_sql_node_cache_clear(context->node_cache);
+  }
+
   return helper;
 }
 
@@ -1616,6 +2632,10 @@ librdf_storage_mysql_context_add_statement(librdf_storage* storage,
 {
   u64 ctxt=0;
 
+  /* Queue the context node with the statement */
+  if(librdf_storage_mysql_write_behind_begin(storage))
+    return 1;
+
   /* Find hash for context, creating if necessary */
   if(context_node) {
     ctxt=librdf_storage_mysql_store_node(storage,context_node);
@@ -1641,12 +2661,17 @@ librdf_storage_mysql_context_add_statement_helper(librdf_storage* storage,
                                           u64 ctxt, librdf_statement* statement)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char insert_statement[]="INSERT INTO Statements" UINT64_T_FMT " (Subject,Predicate,Object,Context) VALUES (" UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT ")";
+  char insert_statement[]="INSERT INTO %s (Subject,Predicate,Object,Context) VALUES (" UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT ")";
+  char insert_model_statement[]="INSERT INTO %s (Model,Subject,Predicate,Object,Context) VALUES (" UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT ")";
   u64 subject, predicate, object;
   char *query=NULL;
   MYSQL *handle=NULL;
   int rc=0;
   
+  /* Queue the statement? */
+  if(librdf_storage_mysql_write_behind_begin(storage))
+    return 1;
+
   /* Get MySQL connection handle */
   handle=librdf_storage_mysql_get_handle(storage);
   if(!handle)
@@ -1668,22 +2693,39 @@ librdf_storage_mysql_context_add_statement_helper(librdf_storage* storage,
     /* in a transaction */
     pending_row* prow;
     
+    u64* uints;
+    
     prow = LIBRDF_CALLOC(pending_row*, 1, sizeof(*prow));
+    if(!prow) {
+      rc=1;
+      goto tidy;
+    }
+    uints=prow->uints;
     prow->key_len=4;
-    prow->uints[0]=subject;
-    prow->uints[1]=predicate;
-    prow->uints[2]=object;
-    prow->uints[3]=ctxt;
+    if(context->partitioned) {
+      *uints++=context->model;
+      prow->key_len++;
+    }
+    uints[0]=subject;
+    uints[1]=predicate;
+    uints[2]=object;
+    uints[3]=ctxt;
     raptor_sequence_push(context->pending_statements, prow);
     
   } else {
     /* not a transaction - add statement to storage */
-    query = LIBRDF_MALLOC(char*, strlen(insert_statement) + 101);
+    query = LIBRDF_MALLOC(char*, strlen(insert_model_statement) +
+                          strlen(context->statements_table) + 101);
     if(!query) {
       rc=1;
       goto tidy;
     }
-    sprintf(query, insert_statement, context->model, subject, predicate, object, ctxt);
+    if(context->partitioned)
+      sprintf(query, insert_model_statement, context->statements_table,
+              context->model, subject, predicate, object, ctxt);
+    else
+      sprintf(query, insert_statement, context->statements_table,
+              subject, predicate, object, ctxt);
     
 #ifdef LIBRDF_DEBUG_SQL
     LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
@@ -1704,6 +2746,10 @@ librdf_storage_mysql_context_add_statement_helper(librdf_storage* storage,
     librdf_storage_mysql_release_handle(storage, handle);
   }
 
+  /* Send the queue when full or old */
+  if(!rc)
+    rc=librdf_storage_mysql_write_behind_check(storage);
+
   return rc;
 }
 
@@ -1722,7 +2768,7 @@ librdf_storage_mysql_contains_statement(librdf_storage* storage,
                                         librdf_statement* statement)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char find_statement[]="SELECT 1 FROM Statements" UINT64_T_FMT " WHERE Subject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT " limit 1";
+  char find_statement[]="SELECT 1 FROM %s WHERE %sSubject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT " limit 1";
   u64 subject, predicate, object;
   char *query;
   MYSQL_RES *res;
@@ -1745,13 +2791,24 @@ librdf_storage_mysql_contains_statement(librdf_storage* storage,
     return 0;
   }
 
+  /* Queued statements are checked without sending them, so adding
+   * statements without duplicates does not flush the queue */
+  if(librdf_storage_mysql_write_behind_contains(storage, subject, predicate,
+                                                object)) {
+    librdf_storage_mysql_release_handle(storage, handle);
+    return 1;
+  }
+
   /* Check for statement */
-  query = LIBRDF_MALLOC(char*, strlen(find_statement) + 81);
+  query = LIBRDF_MALLOC(char*, strlen(find_statement) +
+                        strlen(context->statements_table) +
+                        strlen(context->model_and) + 61);
   if(!query) {
     librdf_storage_mysql_release_handle(storage, handle);
     return 0;
   }
-  sprintf(query, find_statement, context->model, subject, predicate, object);
+  sprintf(query, find_statement, context->statements_table,
+          context->model_and, subject, predicate, object);
 
 #ifdef LIBRDF_DEBUG_SQL
   LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
@@ -1783,6 +2840,148 @@ librdf_storage_mysql_contains_statement(librdf_storage* storage,
 }
 
 
+/*
+ * librdf_storage_mysql_count_pattern - Count or check statements matching a pattern in the database
+ * @storage: the storage
+ * @subject: subject node or NULL to match any
+ * @predicate: predicate node or NULL to match any
+ * @object: object node or NULL to match any
+ * @exists: non-0 to only check whether there is a match
+ *
+ * Return value: number of matches (at most 1 if @exists) or <0 on failure
+ **/
+static int
+librdf_storage_mysql_count_pattern(librdf_storage* storage,
+                                   librdf_node* subject,
+                                   librdf_node* predicate,
+                                   librdf_node* object,
+                                   int exists)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  static const char* const columns[3]={ "Subject", "Predicate", "Object" };
+  librdf_node* nodes[3];
+  char uint64_buffer[64];
+  raptor_stringbuffer *sb;
+  const char *query;
+  MYSQL_RES *res=NULL;
+  MYSQL_ROW row;
+  MYSQL *handle;
+  int count=-1;
+  int i;
+  int need_and=0;
+
+  nodes[0]=subject;
+  nodes[1]=predicate;
+  nodes[2]=object;
+
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return -1;
+
+  sb=raptor_new_stringbuffer();
+  if(!sb)
+    return -1;
+
+  raptor_stringbuffer_append_string(sb, (const unsigned char*)(exists ? "SELECT 1 FROM " : "SELECT COUNT(*) FROM "), 1);
+  raptor_stringbuffer_append_string(sb, (const unsigned char*)context->statements_table, 1);
+  raptor_stringbuffer_append_string(sb, (const unsigned char*)context->model_where, 1);
+  need_and=context->partitioned;
+
+  for(i=0; i < 3; i++) {
+    u64 hash;
+
+    if(!nodes[i])
+      continue;
+
+    hash=librdf_storage_mysql_get_node_hash(storage, nodes[i]);
+    if(!hash) {
+      raptor_free_stringbuffer(sb);
+      return -1;
+    }
+
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)(need_and ? " AND " : " WHERE "), 1);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)columns[i], 1);
+    sprintf(uint64_buffer, "=" UINT64_T_FMT, hash);
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)uint64_buffer, 1);
+    need_and=1;
+  }
+
+  if(exists)
+    raptor_stringbuffer_append_string(sb, (const unsigned char*)" LIMIT 1", 1);
+
+  /* Get MySQL connection handle */
+  handle=librdf_storage_mysql_get_handle(storage);
+  if(!handle) {
+    raptor_free_stringbuffer(sb);
+    return -1;
+  }
+
+  query=(const char*)raptor_stringbuffer_as_string(sb);
+#ifdef LIBRDF_DEBUG_SQL
+  LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
+#endif
+  if(mysql_real_query(handle, query, raptor_stringbuffer_length(sb)) ||
+     !(res=mysql_store_result(handle))) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL query for statement count failed: %s",
+               mysql_error(handle));
+  } else {
+    row=mysql_fetch_row(res);
+    if(exists)
+      count=(row != NULL);
+    else
+      count=(row && row[0]) ? atoi(row[0]) : 0;
+  }
+
+  if(res)
+    mysql_free_result(res);
+  raptor_free_stringbuffer(sb);
+  librdf_storage_mysql_release_handle(storage, handle);
+
+  return count;
+}
+
+
+/*
+ * librdf_storage_mysql_count_statements:
+ * @storage: the storage
+ * @statement: partial statement to match
+ *
+ * Count the statements matching a partial statement with SELECT COUNT(*).
+ *
+ * Return value: number of matching statements or <0 on failure
+ **/
+static int
+librdf_storage_mysql_count_statements(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  return librdf_storage_mysql_count_pattern(storage,
+                                            librdf_statement_get_subject(statement),
+                                            librdf_statement_get_predicate(statement),
+                                            librdf_statement_get_object(statement),
+                                            0);
+}
+
+
+static int
+librdf_storage_mysql_has_arc_in(librdf_storage* storage,
+                                librdf_node* node,
+                                librdf_node* property)
+{
+  return librdf_storage_mysql_count_pattern(storage, NULL, property, node,
+                                            1) > 0;
+}
+
+
+static int
+librdf_storage_mysql_has_arc_out(librdf_storage* storage,
+                                 librdf_node* node,
+                                 librdf_node* property)
+{
+  return librdf_storage_mysql_count_pattern(storage, node, property, NULL,
+                                            1) > 0;
+}
+
+
 /**
  * librdf_storage_mysql_remove_statement:
  * @storage: #librdf_storage object
@@ -1815,12 +3014,16 @@ librdf_storage_mysql_context_remove_statement(librdf_storage* storage,
                                              librdf_statement* statement)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char delete_statement[]="DELETE FROM Statements" UINT64_T_FMT " WHERE Subject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT;
-  char delete_statement_with_context[]="DELETE FROM Statements" UINT64_T_FMT " WHERE Subject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT " AND Context=" UINT64_T_FMT;
+  char delete_statement[]="DELETE FROM %s WHERE %sSubject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT;
+  char delete_statement_with_context[]="DELETE FROM %s WHERE %sSubject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT " AND Context=" UINT64_T_FMT;
   u64 subject, predicate, object, ctxt=0;
   char *query;
   MYSQL *handle;
 
+  /* Queued statements are deleted too */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return 1;
+
   /* Get MySQL connection handle */
   handle=librdf_storage_mysql_get_handle(storage);
   if(!handle)
@@ -1847,21 +3050,25 @@ librdf_storage_mysql_context_remove_statement(librdf_storage* storage,
 
   /* Remove statement(s) from storage */
   if(context_node) {
-    query = LIBRDF_MALLOC(char*, strlen(delete_statement_with_context) + 101);
+    query = LIBRDF_MALLOC(char*, strlen(delete_statement_with_context) +
+                          strlen(context->statements_table) +
+                          strlen(context->model_and) + 81);
     if(!query) {
       librdf_storage_mysql_release_handle(storage, handle);
       return 1;
     }
-    sprintf(query, delete_statement_with_context, context->model, subject,
-            predicate, object, ctxt);
+    sprintf(query, delete_statement_with_context, context->statements_table,
+            context->model_and, subject, predicate, object, ctxt);
   } else {
-    query = LIBRDF_MALLOC(char*, strlen(delete_statement) + 81);
+    query = LIBRDF_MALLOC(char*, strlen(delete_statement) +
+                          strlen(context->statements_table) +
+                          strlen(context->model_and) + 61);
     if(!query) {
       librdf_storage_mysql_release_handle(storage, handle);
       return 1;
     }
-    sprintf(query, delete_statement, context->model, subject, predicate,
-            object);
+    sprintf(query, delete_statement, context->statements_table,
+            context->model_and, subject, predicate, object);
   }
 
 #ifdef LIBRDF_DEBUG_SQL
@@ -1898,13 +3105,17 @@ librdf_storage_mysql_context_remove_statements(librdf_storage* storage,
                                                librdf_node* context_node)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
-  char delete_context[]="DELETE FROM Statements" UINT64_T_FMT " WHERE Context=" UINT64_T_FMT;
-  char delete_model[]="DELETE FROM Statements" UINT64_T_FMT;
+  char delete_context[]="DELETE FROM %s WHERE %sContext=" UINT64_T_FMT;
+  char delete_model[]="DELETE FROM %s%s";
   char flush_statements[]="FLUSH TABLE Statements";
   u64 ctxt=0;
   char *query;
   MYSQL *handle;
 
+  /* Queued statements are deleted too */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return 1;
+
   /* Get MySQL connection handle */
   handle=librdf_storage_mysql_get_handle(storage);
   if(!handle)
@@ -1921,19 +3132,25 @@ librdf_storage_mysql_context_remove_statements(librdf_storage* storage,
 
   /* Remove statement(s) from storage */
   if(context_node) {
-    query = LIBRDF_MALLOC(char*, strlen(delete_context) + 61);
+    query = LIBRDF_MALLOC(char*, strlen(delete_context) +
+                          strlen(context->statements_table) +
+                          strlen(context->model_and) + 21);
     if(!query) {
       librdf_storage_mysql_release_handle(storage, handle);
       return 1;
     }
-    sprintf(query, delete_context, context->model, ctxt);
+    sprintf(query, delete_context, context->statements_table,
+            context->model_and, ctxt);
   } else {
-    query = LIBRDF_MALLOC(char*, strlen(delete_model) + 21);
+    query = LIBRDF_MALLOC(char*, strlen(delete_model) +
+                          strlen(context->statements_table) +
+                          strlen(context->model_where) + 1);
     if(!query) {
       librdf_storage_mysql_release_handle(storage, handle);
       return 1;
     }
-    sprintf(query, delete_model, context->model);
+    sprintf(query, delete_model, context->statements_table,
+            context->model_where);
   }
 
 #ifdef LIBRDF_DEBUG_SQL
@@ -2000,50 +3217,268 @@ librdf_storage_mysql_serialise(librdf_storage* storage)
  *
  * Return value: a #librdf_stream or NULL on failure
  **/
-static librdf_stream*
-librdf_storage_mysql_find_statements(librdf_storage* storage,
-                                     librdf_statement* statement)
+static librdf_stream*
+librdf_storage_mysql_find_statements(librdf_storage* storage,
+                                     librdf_statement* statement)
+{
+  return librdf_storage_mysql_find_statements_in_context(storage,statement,NULL);
+}
+
+
+/**
+ * librdf_storage_mysql_context_serialise:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * List all statements in a storage context.
+ *
+ * Return value: #librdf_stream of statements or NULL on failure or context is empty
+ **/
+static librdf_stream*
+librdf_storage_mysql_context_serialise(librdf_storage* storage,
+                                       librdf_node* context_node)
+{
+  return librdf_storage_mysql_find_statements_in_context(storage,NULL,context_node);
+}
+
+
+/**
+ * librdf_storage_mysql_find_statements_in_context:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: the context to search
+ *
+ * Find a graph of statements in a storage context.
+ *
+ * Return a stream of statements matching the given statement (or
+ * all statements if NULL).  Parts (subject, predicate, object) of the
+ * statement can be empty in which case any statement part will match that.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_mysql_find_statements_in_context(librdf_storage* storage, librdf_statement* statement,
+                         librdf_node* context_node)
+{
+  return librdf_storage_mysql_find_statements_with_options(storage, statement, context_node, NULL);
+}
+
+
+/*
+ * librdf_storage_mysql_find_statements_in_context_where - Append a node condition to a find query WHERE clause
+ * @where: WHERE clause buffer
+ * @column: column name
+ * @hash: node hash
+ * @placeholder: non-0 to write a ? parameter instead of @hash
+ **/
+static void
+librdf_storage_mysql_find_statements_in_context_where(char *where,
+                                                      const char *column,
+                                                      u64 hash,
+                                                      int placeholder)
+{
+  strcat(where, strlen(where) ? " AND " : " WHERE ");
+  strcat(where, column);
+  if(placeholder)
+    strcat(where, "=?");
+  else
+    sprintf(where + strlen(where), "=" UINT64_T_FMT, hash);
+}
+
+
+/*
+ * librdf_storage_mysql_find_statements_in_context_prepare - Get the kept prepared statement for a find query shape
+ * @sos: find statements context
+ * @shape: query shape
+ * @query: query text
+ *
+ * Statements are kept by the pool connection they were prepared on.
+ *
+ * Return value: statement or NULL on failure
+ **/
+static MYSQL_STMT*
+librdf_storage_mysql_find_statements_in_context_prepare(librdf_storage_mysql_sos_context* sos,
+                                                        int shape,
+                                                        const char *query)
+{
+  librdf_storage_mysql_connection* connection;
+  MYSQL_STMT *stmt;
+
+  connection=librdf_storage_mysql_handle_connection(sos->handle);
+  if(connection->find_statements[shape])
+    return connection->find_statements[shape];
+
+  stmt=mysql_stmt_init(sos->handle);
+  if(!stmt)
+    return NULL;
+
+  if(mysql_stmt_prepare(stmt, query, strlen(query))) {
+    librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL statement prepare failed: %s", mysql_stmt_error(stmt));
+    mysql_stmt_close(stmt);
+    return NULL;
+  }
+
+  connection->find_statements[shape]=stmt;
+
+  return stmt;
+}
+
+
+/*
+ * librdf_storage_mysql_find_statements_in_context_forget - Drop a kept prepared statement
+ * @sos: find statements context
+ * @shape: query shape
+ **/
+static void
+librdf_storage_mysql_find_statements_in_context_forget(librdf_storage_mysql_sos_context* sos,
+                                                       int shape)
 {
-  return librdf_storage_mysql_find_statements_in_context(storage,statement,NULL);
+  librdf_storage_mysql_connection* connection;
+
+  connection=librdf_storage_mysql_handle_connection(sos->handle);
+  connection->find_statements[shape]=NULL;
+  mysql_stmt_close(sos->stmt);
+  sos->stmt=NULL;
 }
 
 
-/**
- * librdf_storage_mysql_context_serialise:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
+/*
+ * librdf_storage_mysql_find_statements_in_context_execute - Run a find query as a prepared statement
+ * @sos: find statements context
+ * @shape: query shape
+ * @query: query text with a ? for each node hash
+ * @params: node hashes
+ * @params_count: number of node hashes
  *
- * List all statements in a storage context.
+ * The result is not stored by the client but fetched a row at a time
+ * in the binary protocol as the stream advances.
  *
- * Return value: #librdf_stream of statements or NULL on failure or context is empty
+ * Return value: non-0 on failure
  **/
-static librdf_stream*
-librdf_storage_mysql_context_serialise(librdf_storage* storage,
-                                       librdf_node* context_node)
+static int
+librdf_storage_mysql_find_statements_in_context_execute(librdf_storage_mysql_sos_context* sos,
+                                                        int shape,
+                                                        const char *query,
+                                                        u64 *params,
+                                                        int params_count)
 {
-  return librdf_storage_mysql_find_statements_in_context(storage,NULL,context_node);
+  MYSQL_BIND param_binds[4];
+  unsigned long long values[4];
+  unsigned int i;
+  int attempt;
+
+  memset(param_binds, 0, sizeof(param_binds));
+  for(i=0; i < (unsigned int)params_count; i++) {
+    values[i]=params[i];
+    param_binds[i].buffer_type=MYSQL_TYPE_LONGLONG;
+    param_binds[i].buffer=&values[i];
+    param_binds[i].is_unsigned=1;
+  }
+
+  /* A kept statement is lost if the connection reconnected; prepare
+   * it again once */
+  for(attempt=0; attempt < 2; attempt++) {
+    sos->stmt=librdf_storage_mysql_find_statements_in_context_prepare(sos, shape,
+                                                                      query);
+    if(!sos->stmt)
+      return 1;
+
+    if(!mysql_stmt_bind_param(sos->stmt, param_binds) &&
+       !mysql_stmt_execute(sos->stmt))
+      break;
+
+    librdf_log(sos->storage->world, 0,
+               attempt ? LIBRDF_LOG_ERROR : LIBRDF_LOG_WARN,
+               LIBRDF_FROM_STORAGE, NULL,
+               "MySQL query failed: %s", mysql_stmt_error(sos->stmt));
+    librdf_storage_mysql_find_statements_in_context_forget(sos, shape);
+  }
+  if(!sos->stmt)
+    return 1;
+
+  sos->columns=mysql_stmt_field_count(sos->stmt);
+  sos->binds=LIBRDF_CALLOC(MYSQL_BIND*, sos->columns, sizeof(MYSQL_BIND));
+  sos->lengths=LIBRDF_CALLOC(unsigned long*, sos->columns, sizeof(unsigned long));
+  sos->is_nulls=LIBRDF_CALLOC(my_bool*, sos->columns, sizeof(my_bool));
+  sos->row=LIBRDF_CALLOC(char**, sos->columns, sizeof(char*));
+  if(!sos->binds || !sos->lengths || !sos->is_nulls || !sos->row)
+    return 1;
+
+  for(i=0; i < sos->columns; i++) {
+    sos->binds[i].buffer_type=MYSQL_TYPE_STRING;
+    sos->binds[i].buffer=LIBRDF_MALLOC(char*, LIBRDF_STORAGE_MYSQL_COLUMN_SIZE);
+    if(!sos->binds[i].buffer)
+      return 1;
+    sos->binds[i].buffer_length=LIBRDF_STORAGE_MYSQL_COLUMN_SIZE;
+    sos->binds[i].length=&sos->lengths[i];
+    sos->binds[i].is_null=&sos->is_nulls[i];
+  }
+
+  if(mysql_stmt_bind_result(sos->stmt, sos->binds)) {
+    librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL result binding failed: %s", mysql_stmt_error(sos->stmt));
+    return 1;
+  }
+
+  return 0;
 }
 
 
-/**
- * librdf_storage_mysql_find_statements_in_context:
- * @storage: the storage
- * @statement: the statement to match
- * @context_node: the context to search
- *
- * Find a graph of statements in a storage context.
- *
- * Return a stream of statements matching the given statement (or
- * all statements if NULL).  Parts (subject, predicate, object) of the
- * statement can be empty in which case any statement part will match that.
+/*
+ * librdf_storage_mysql_find_statements_in_context_fetch_row - Get the next row of a find query
+ * @sos: find statements context
  *
- * Return value: a #librdf_stream or NULL on failure
+ * Return value: column values (NULL for SQL NULL) or NULL at the end of the results or on failure
  **/
-static librdf_stream*
-librdf_storage_mysql_find_statements_in_context(librdf_storage* storage, librdf_statement* statement,
-                         librdf_node* context_node)
+static char**
+librdf_storage_mysql_find_statements_in_context_fetch_row(librdf_storage_mysql_sos_context* sos)
 {
-  return librdf_storage_mysql_find_statements_with_options(storage, statement, context_node, NULL);
+  unsigned int i;
+  int status;
+  int rebind=0;
+
+  if(!sos->stmt)
+    return mysql_fetch_row(sos->results);
+
+  status=mysql_stmt_fetch(sos->stmt);
+  if(status == MYSQL_NO_DATA)
+    return NULL;
+  if(status == 1) {
+    librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL fetch failed: %s", mysql_stmt_error(sos->stmt));
+    return NULL;
+  }
+
+  for(i=0; i < sos->columns; i++) {
+    MYSQL_BIND* bind=&sos->binds[i];
+
+    if(sos->is_nulls[i]) {
+      sos->row[i]=NULL;
+      continue;
+    }
+
+    if(sos->lengths[i] >= bind->buffer_length) {
+      /* Column was truncated: grow the buffer and fetch it again */
+      char *buffer=LIBRDF_MALLOC(char*, sos->lengths[i] + 1);
+      if(!buffer)
+        return NULL;
+      LIBRDF_FREE(char*, bind->buffer);
+      bind->buffer=buffer;
+      bind->buffer_length=sos->lengths[i] + 1;
+      if(mysql_stmt_fetch_column(sos->stmt, bind, i, 0))
+        return NULL;
+      rebind=1;
+    }
+
+    ((char*)bind->buffer)[sos->lengths[i]]='\0';
+    sos->row[i]=(char*)bind->buffer;
+  }
+
+  if(rebind && mysql_stmt_bind_result(sos->stmt, sos->binds))
+    return NULL;
+
+  return sos->row;
 }
 
 
@@ -2076,6 +3511,17 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
   char where[256];
   char joins[640];
   librdf_stream *stream;
+  /* node hashes bound to the prepared statement parameters */
+  u64 params[4];
+  int params_count=0;
+  int shape=0;
+  int limit, offset, order;
+  /* values are in the query text instead of bound parameters */
+  int direct;
+
+  /* Find queued statements too */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return NULL;
 
   /* Initialize sos context */
   sos = LIBRDF_CALLOC(librdf_storage_mysql_sos_context*, 1, sizeof(*sos));
@@ -2096,8 +3542,12 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
     sos->is_literal_match=librdf_hash_get_as_boolean(options, "match-substring");
   }
 
+  /* paged queries are not kept prepared since the paging varies */
+  direct=(librdf_storage_get_find_options(options, &limit, &offset, &order) ||
+          sos->is_literal_match);
+
   /* Get MySQL connection handle */
-  sos->handle=librdf_storage_mysql_get_handle(storage);
+  sos->handle=librdf_storage_mysql_get_read_handle(storage);
   if(!sos->handle) {
     librdf_storage_mysql_find_statements_in_context_finished((void*)sos);
     return NULL;
@@ -2111,11 +3561,14 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
   }
   strcpy(query, "SELECT");
   *where='\0';
+  if(context->partitioned)
+    /* constant for the storage so the kept statement stays per shape */
+    sprintf(where, " WHERE S.Model=" UINT64_T_FMT, context->model);
   if(sos->is_literal_match)
-    sprintf(joins, " FROM Literals AS L LEFT JOIN Statements" UINT64_T_FMT " as S ON L.ID=S.Object",
-            context->model);
+    sprintf(joins, " FROM Literals AS L LEFT JOIN %s as S ON L.ID=S.Object",
+            context->statements_table);
   else
-    sprintf(joins, " FROM Statements" UINT64_T_FMT " AS S", context->model);
+    sprintf(joins, " FROM %s AS S", context->statements_table);
 
   if(statement) {
     subject=librdf_statement_get_subject(statement);
@@ -2125,13 +3578,11 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
 
   /* Subject */
   if(statement && subject) {
-    sprintf(tmp, "S.Subject=" UINT64_T_FMT "",
-            librdf_storage_mysql_get_node_hash(storage,subject));
-    if(!strlen(where))
-      strcat(where, " WHERE ");
-    else
-      strcat(where, " AND ");
-    strcat(where, tmp);
+    params[params_count]=librdf_storage_mysql_get_node_hash(storage,subject);
+    shape|=1;
+    librdf_storage_mysql_find_statements_in_context_where(where, "S.Subject",
+                                                          params[params_count++],
+                                                          !direct);
   } else {
     if(librdf_storage_mysql_find_statements_in_context_augment_query(&query, " SubjectR.URI AS SuR, SubjectB.Name AS SuB")) {
       librdf_storage_mysql_find_statements_in_context_finished((void*)sos);
@@ -2143,13 +3594,11 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
 
   /* Predicate */
   if(statement && predicate) {
-    sprintf(tmp, "S.Predicate=" UINT64_T_FMT "",
-            librdf_storage_mysql_get_node_hash(storage, predicate));
-    if(!strlen(where))
-      strcat(where, " WHERE ");
-    else
-      strcat(where, " AND ");
-    strcat(where, tmp);
+    params[params_count]=librdf_storage_mysql_get_node_hash(storage, predicate);
+    shape|=2;
+    librdf_storage_mysql_find_statements_in_context_where(where, "S.Predicate",
+                                                          params[params_count++],
+                                                          !direct);
   } else {
     if(!statement || !subject) {
       if(librdf_storage_mysql_find_statements_in_context_augment_query(&query, ",")) {
@@ -2167,13 +3616,11 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
   /* Object */
   if(statement && object) {
     if(!sos->is_literal_match) {
-      sprintf(tmp,"S.Object=" UINT64_T_FMT "",
-              librdf_storage_mysql_get_node_hash(storage, object));
-      if(!strlen(where))
-        strcat(where, " WHERE ");
-      else
-        strcat(where, " AND ");
-      strcat(where, tmp);
+      params[params_count]=librdf_storage_mysql_get_node_hash(storage, object);
+      shape|=4;
+      librdf_storage_mysql_find_statements_in_context_where(where, "S.Object",
+                                                            params[params_count++],
+                                                            !direct);
     } else {
       /* MATCH literal, not hash_id */
       if(!statement || !subject || !predicate) {
@@ -2222,13 +3669,11 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
 
   /* Context */
   if(context_node) {
-    sprintf(tmp,"S.Context=" UINT64_T_FMT "",
-            librdf_storage_mysql_get_node_hash(storage,context_node));
-    if(!strlen(where))
-      strcat(where, " WHERE ");
-    else
-      strcat(where, " AND ");
-    strcat(where, tmp);
+    params[params_count]=librdf_storage_mysql_get_node_hash(storage,context_node);
+    shape|=8;
+    librdf_storage_mysql_find_statements_in_context_where(where, "S.Context",
+                                                          params[params_count++],
+                                                          !direct);
   } else {
     if(!statement || !subject || !predicate || !object) {
       if(librdf_storage_mysql_find_statements_in_context_augment_query(&query, ",")) {
@@ -2260,15 +3705,47 @@ librdf_storage_mysql_find_statements_with_options(librdf_storage* storage,
     return NULL;
   }
 
+  if(limit >= 0 || offset > 0 || order) {
+    static const char* const order_columns[4]={ NULL, "S.Subject", "S.Predicate", "S.Object" };
+    char paging[96];
+
+    /* ordered by node id: stable, which is what paging needs */
+    *paging='\0';
+    if(order)
+      sprintf(paging, " ORDER BY %s", order_columns[order]);
+    if(limit >= 0)
+      sprintf(paging + strlen(paging), " LIMIT %d", limit);
+    else if(offset > 0)
+      /* MySQL has no OFFSET without LIMIT */
+      strcat(paging, " LIMIT 18446744073709551615");
+    if(offset > 0)
+      sprintf(paging + strlen(paging), " OFFSET %d", offset);
+
+    if(librdf_storage_mysql_find_statements_in_context_augment_query(&query, paging)) {
+      librdf_storage_mysql_find_statements_in_context_finished((void*)sos);
+      return NULL;
+    }
+  }
+
   /* Start query... */
 #ifdef LIBRDF_DEBUG_SQL
   LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
 #endif
-  if(mysql_real_query(sos->handle, query, strlen(query)) ||
-     !(sos->results=mysql_use_result(sos->handle))) {
-    librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "MySQL query failed: %s",
-               mysql_error(sos->handle));
+  if(direct) {
+    /* the text search has the matched string in the query so it
+     * is not kept prepared, nor are paged queries */
+    if(mysql_real_query(sos->handle, query, strlen(query)) ||
+       !(sos->results=mysql_use_result(sos->handle))) {
+      librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "MySQL query failed: %s",
+                 mysql_error(sos->handle));
+      LIBRDF_FREE(char*, query);
+      librdf_storage_mysql_find_statements_in_context_finished((void*)sos);
+      return NULL;
+    }
+  } else if(librdf_storage_mysql_find_statements_in_context_execute(sos, shape, query,
+                                                                    params, params_count)) {
+    LIBRDF_FREE(char*, query);
     librdf_storage_mysql_find_statements_in_context_finished((void*)sos);
     return NULL;
   }
@@ -2332,7 +3809,7 @@ librdf_storage_mysql_find_statements_in_context_next_statement(void* context)
   librdf_node *node;
 
   /* Get next statement */
-  row=mysql_fetch_row(sos->results);
+  row=librdf_storage_mysql_find_statements_in_context_fetch_row(sos);
   if(row) {
     /* Get ready for context */
     if(sos->current_context)
@@ -2495,6 +3972,28 @@ librdf_storage_mysql_find_statements_in_context_finished(void* context)
   if(sos->results)
     mysql_free_result(sos->results);
 
+  if(sos->stmt) {
+    /* Discard any unread rows; the statement is kept for reuse */
+    mysql_stmt_free_result(sos->stmt);
+    mysql_stmt_reset(sos->stmt);
+  }
+
+  if(sos->binds) {
+    unsigned int i;
+
+    for(i=0; i < sos->columns; i++) {
+      if(sos->binds[i].buffer)
+        LIBRDF_FREE(char*, sos->binds[i].buffer);
+    }
+    LIBRDF_FREE(MYSQL_BIND*, sos->binds);
+  }
+  if(sos->lengths)
+    LIBRDF_FREE(unsigned long*, sos->lengths);
+  if(sos->is_nulls)
+    LIBRDF_FREE(my_bool*, sos->is_nulls);
+  if(sos->row)
+    LIBRDF_FREE(char**, sos->row);
+
   if(sos->handle) {
     librdf_storage_mysql_release_handle(sos->storage, sos->handle);
   }
@@ -2534,13 +4033,17 @@ librdf_storage_mysql_get_contexts(librdf_storage* storage)
   const char select_contexts[]="\
 SELECT DISTINCT R.URI AS CoR, B.Name AS CoB, \
 L.Value AS CoV, L.Language AS CoL, L.Datatype AS CoD \
-FROM Statements" UINT64_T_FMT " as S \
+FROM %s as S \
 LEFT JOIN Resources AS R ON S.Context=R.ID \
 LEFT JOIN Bnodes AS B ON S.Context=B.ID \
-LEFT JOIN Literals AS L ON S.Context=L.ID";
+LEFT JOIN Literals AS L ON S.Context=L.ID%s";
   char *query;
   librdf_iterator* iterator;
 
+  /* Find contexts of queued statements too */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return NULL;
+
   /* Initialize get_contexts context */
   gccontext = LIBRDF_CALLOC(librdf_storage_mysql_get_contexts_context*, 1,
                             sizeof(*gccontext));
@@ -2553,19 +4056,22 @@ LEFT JOIN Literals AS L ON S.Context=L.ID";
   gccontext->results=NULL;
 
   /* Get MySQL connection handle */
-  gccontext->handle=librdf_storage_mysql_get_handle(storage);
+  gccontext->handle=librdf_storage_mysql_get_read_handle(storage);
   if(!gccontext->handle) {
     librdf_storage_mysql_get_contexts_finished((void*)gccontext);
     return NULL;
   }
 
   /* Construct query */
-  query = LIBRDF_MALLOC(char*, strlen(select_contexts) + 21);
+  query = LIBRDF_MALLOC(char*, strlen(select_contexts) +
+                        strlen(context->statements_table) +
+                        strlen(context->model_where) + 1);
   if(!query) {
     librdf_storage_mysql_get_contexts_finished((void*)gccontext);
     return NULL;
   }
-  sprintf(query, select_contexts, context->model);
+  sprintf(query, select_contexts, context->statements_table,
+          context->model_where);
 
   /* Start query... */
 #ifdef LIBRDF_DEBUG_SQL
@@ -2700,6 +4206,7 @@ librdf_storage_mysql_get_contexts_finished(void* context)
 static librdf_node*
 librdf_storage_mysql_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
   unsigned char *uri_string;
 
   if(!feature)
@@ -2718,6 +4225,19 @@ librdf_storage_mysql_get_feature(librdf_storage* storage, librdf_uri* feature)
                                               NULL, NULL);
   }
 
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_CONCURRENT_READS)) {
+    /* other connections do not see an open transaction's changes */
+    int shared=!context->transaction_handle;
+
+    /* nor statements still queued for writing */
+    if(shared && librdf_storage_mysql_write_behind_flush(storage))
+      shared=0;
+
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)(shared ? "1" : "0"),
+                                              NULL, NULL);
+  }
+
   return NULL;
 }
 
@@ -2737,6 +4257,10 @@ librdf_storage_mysql_transaction_start(librdf_storage* storage)
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance* )storage->instance;
   int i;
   
+  /* Statements queued before the transaction are not part of it */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return 1;
+
   if(context->transaction_handle) {
     librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                "MySQL transaction already started");
@@ -2841,10 +4365,12 @@ librdf_storage_mysql_transaction_commit(librdf_storage* storage)
   int i;
   size_t query_len;
   const char start_query[]="START TRANSACTION";
-  const table_info *table;
-  raptor_stringbuffer* sb=NULL;
   int count=0;
 
+  /* No transaction, only queued statements */
+  if(context->write_behind_open)
+    return librdf_storage_mysql_write_behind_flush(storage);
+
   handle=context->transaction_handle;
 
   if(!handle)
@@ -2883,103 +4409,13 @@ librdf_storage_mysql_transaction_commit(librdf_storage* storage)
     return 1;
   }
 
-  /* INSERT node values */
-  for(i=0; i< TABLE_STATEMENTS; i++) {
-    raptor_sequence* seq;
-    raptor_stringbuffer* tsb;
-
-    seq=context->pending_inserts[i];
-    table=&mysql_tables[i];
-
-    /* sort pending nodes to always be inserted in same order */
-    raptor_sequence_sort(seq, compare_pending_rows);
-
-    tsb=format_pending_row_sequence(table, seq);
-    if(!tsb)
-      continue;
-
-    query_len=raptor_stringbuffer_length(tsb);
-    query=(char*)raptor_stringbuffer_as_string(tsb);
-    
-#ifdef LIBRDF_DEBUG_SQL
-    LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
-#endif
-    if(mysql_real_query(context->transaction_handle, query, query_len)) {
-      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                 "MySQL query to table %s failed: %s", table->name,
-                 mysql_error(context->transaction_handle));
-      raptor_free_stringbuffer(tsb);
-      librdf_storage_mysql_transaction_rollback(storage);    
-      return 1;
-    }
-    
-    raptor_free_stringbuffer(tsb);
+  /* INSERT nodes and statements */
+  if(librdf_storage_mysql_flush_pending(storage, handle)) {
+    librdf_storage_mysql_transaction_rollback(storage);
+    return 1;
   }
 
 
-  /* INSERT STATEMENT* */
-  if(raptor_sequence_size(context->pending_statements)) {
-    char uint64_buffer[64];
-    raptor_sequence* seq;
-    
-    table=&mysql_tables[TABLE_STATEMENTS];
-
-    /* sort pending statements to always be inserted in same order */
-    raptor_sequence_sort(context->pending_statements, 
-                         compare_pending_rows);
-    
-    sb=raptor_new_stringbuffer();
-    
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"REPLACE INTO Statements", 1);
-    sprintf(uint64_buffer, UINT64_T_FMT, context->model);
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)uint64_buffer, 1);
-    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)" (", 2, 1);
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)table->columns, 1);
-    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)") VALUES ", 9, 1);
-
-    seq=context->pending_statements;
-    for(i=0; i< raptor_sequence_size(seq); i++) {
-      pending_row* prow=(pending_row*)raptor_sequence_get_at(seq, i);
-      int j;
-
-      if(i > 0)
-        raptor_stringbuffer_append_counted_string(sb,
-                                             (const unsigned char*)", ", 2, 1);
-      
-      raptor_stringbuffer_append_counted_string(sb,
-                                             (const unsigned char*)"(", 1, 1);
-
-      for(j=0; j < 4; j++) {
-        if(j > 0)
-          raptor_stringbuffer_append_counted_string(sb,
-                                             (const unsigned char*)", ", 2, 1);
-        sprintf(uint64_buffer, UINT64_T_FMT, prow->uints[j]);
-        raptor_stringbuffer_append_string(sb,
-                                       (const unsigned char*)uint64_buffer, 1);
-      }
-
-      raptor_stringbuffer_append_counted_string(sb,
-                                             (const unsigned char*)")", 1, 1);
-    }
-    
-    query=(char*)raptor_stringbuffer_as_string(sb);
-    if(query) {
-#ifdef LIBRDF_DEBUG_SQL
-      LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
-#endif
-      if(mysql_real_query(handle, query, strlen(query)) &&
-         mysql_errno(handle) != ER_DUP_ENTRY) {
-        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                   "MySQL insert into %s failed with error %s",
-                   table->name, mysql_error(handle));
-        raptor_free_stringbuffer(sb);
-        librdf_storage_mysql_transaction_rollback(storage);    
-        return 1;
-      }
-    }
-  }
-  
-
   /* COMMIT */
 #ifdef LIBRDF_DEBUG_SQL
   LIBRDF_DEBUG1("SQL: mysql_commit()\n");
@@ -2988,8 +4424,8 @@ librdf_storage_mysql_transaction_commit(librdf_storage* storage)
 
   librdf_storage_mysql_transaction_terminate(storage);
 
-  if(sb)
-    raptor_free_stringbuffer(sb);
+  if(status && context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
 
   return (status != 0);
 }
@@ -3010,6 +4446,10 @@ librdf_storage_mysql_transaction_rollback(librdf_storage* storage)
   MYSQL* handle;
   int status;
   
+  /* Queued statements are not in a transaction and are kept */
+  if(context->write_behind_open)
+    return 1;
+
   handle=context->transaction_handle;
   if(!handle)
     return 1;
@@ -3020,6 +4460,10 @@ librdf_storage_mysql_transaction_rollback(librdf_storage* storage)
   status=mysql_rollback(handle);
 
   librdf_storage_mysql_transaction_terminate(storage);
+
+  /* nodes cached during the transaction were never stored */
+  if(context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
   
   return (status != 0);
 }
@@ -3038,10 +4482,184 @@ librdf_storage_mysql_transaction_get_handle(librdf_storage* storage)
 {
   librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance* )storage->instance;
 
+  if(context->write_behind_open)
+    return NULL;
+
   return context->transaction_handle;
 }
 
 
+/*
+ * librdf_storage_mysql_supports_query - Check if a query runs as a single SQL query
+ * @storage: the storage
+ * @query: the query
+ *
+ * Return value: non-0 if the query is supported.
+ **/
+static int
+librdf_storage_mysql_supports_query(librdf_storage* storage,
+                                    librdf_query *query)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+
+  if(!context->sql_query)
+    return 0;
+
+  return librdf_query_rasqal_sql_supported(query);
+}
+
+
+/*
+ * librdf_storage_mysql_query_execute - Run a SPARQL basic graph pattern query as one SQL join
+ * @storage: the storage
+ * @query: the query
+ *
+ * Return value: #librdf_query_results or NULL on failure
+ **/
+static librdf_query_results*
+librdf_storage_mysql_query_execute(librdf_storage* storage,
+                                   librdf_query *query)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  librdf_query_sql_schema schema;
+  char model_condition[40];
+  librdf_query_results* results=NULL;
+  char *sql;
+  MYSQL *handle;
+  MYSQL_RES *res;
+  MYSQL_ROW row;
+
+  /* Query queued statements too */
+  if(librdf_storage_mysql_write_behind_flush(storage))
+    return NULL;
+
+  schema.statements_table=context->statements_table;
+  schema.model_condition=NULL;
+  if(context->partitioned) {
+    sprintf(model_condition, "Model=" UINT64_T_FMT, context->model);
+    schema.model_condition=model_condition;
+  }
+  schema.node_id=librdf_storage_mysql_get_node_hash;
+
+  sql=librdf_query_rasqal_to_sql(query, storage, &schema);
+  if(!sql)
+    return NULL;
+
+  handle=librdf_storage_mysql_get_read_handle(storage);
+  if(!handle) {
+    LIBRDF_FREE(char*, sql);
+    return NULL;
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+  context->running_query=query;
+  context->running_thread_id=mysql_thread_id(handle);
+  context->running_replica=librdf_storage_mysql_handle_connection(handle)->replica;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&context->pool_mutex);
+#endif
+
+#ifdef LIBRDF_DEBUG_SQL
+  LIBRDF_DEBUG2("SQL: >>%s<<\n", sql);
+#endif
+  if(query->cancelled) {
+    /* cancelled before it started */
+  } else if(mysql_real_query(handle, sql, strlen(sql)) ||
+     !(res=mysql_use_result(handle))) {
+    if(!query->cancelled)
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "MySQL query %s failed: %s", sql, mysql_error(handle));
+  } else {
+    results=librdf_query_rasqal_new_sql_results(query);
+    /* rows have five columns per variable like the results want */
+    while(results && (row=mysql_fetch_row(res))) {
+      if(query->cancelled ||
+         librdf_query_rasqal_add_sql_row(results, (const char* const*)row)) {
+        librdf_free_query_results(results);
+        results=NULL;
+      }
+    }
+    if(results && !query->cancelled)
+      librdf_query_rasqal_end_sql_results(results);
+    else if(results) {
+      librdf_free_query_results(results);
+      results=NULL;
+    }
+    mysql_free_result(res);
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+  context->running_query=NULL;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&context->pool_mutex);
+#endif
+
+  librdf_storage_mysql_release_handle(storage, handle);
+  LIBRDF_FREE(char*, sql);
+
+  return results;
+}
+
+
+/*
+ * librdf_storage_mysql_query_cancel - Stop the SQL query run for a query, if any
+ * @storage: the storage object
+ * @query: the query
+ *
+ * The running statement is killed with KILL QUERY sent on another
+ * connection to the same server.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_mysql_query_cancel(librdf_storage* storage,
+                                  librdf_query *query)
+{
+  librdf_storage_mysql_instance* context=(librdf_storage_mysql_instance*)storage->instance;
+  unsigned long thread_id=0;
+  int replica=0;
+  char kill_query[40];
+  MYSQL *handle;
+  int rc=0;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&context->pool_mutex);
+#endif
+  if(context->running_query == query) {
+    thread_id=context->running_thread_id;
+    replica=context->running_replica;
+  }
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&context->pool_mutex);
+#endif
+
+  if(!thread_id)
+    return 0;
+
+  if(replica)
+    handle=librdf_storage_mysql_get_replica_handle(storage, replica);
+  else
+    handle=librdf_storage_mysql_get_handle(storage);
+  if(!handle)
+    return 1;
+
+  sprintf(kill_query, "KILL QUERY %lu", thread_id);
+  if(mysql_real_query(handle, kill_query, strlen(kill_query))) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "MySQL query cancel failed: %s", mysql_error(handle));
+    rc=1;
+  }
+
+  librdf_storage_mysql_release_handle(storage, handle);
+
+  return rc;
+}
+
+
 /** Local entry point for dynamically loaded storage module */
 static void
 librdf_storage_mysql_register_factory(librdf_storage_factory *factory)
@@ -3059,6 +4677,8 @@ librdf_storage_mysql_register_factory(librdf_storage_factory *factory)
   factory->add_statements     = librdf_storage_mysql_add_statements;
   factory->remove_statement   = librdf_storage_mysql_remove_statement;
   factory->contains_statement = librdf_storage_mysql_contains_statement;
+  factory->has_arc_in         = librdf_storage_mysql_has_arc_in;
+  factory->has_arc_out        = librdf_storage_mysql_has_arc_out;
   factory->serialise          = librdf_storage_mysql_serialise;
   factory->find_statements    = librdf_storage_mysql_find_statements;
   factory->find_statements_with_options    = librdf_storage_mysql_find_statements_with_options;
@@ -3076,6 +4696,10 @@ librdf_storage_mysql_register_factory(librdf_storage_factory *factory)
   factory->transaction_commit            = librdf_storage_mysql_transaction_commit;
   factory->transaction_rollback          = librdf_storage_mysql_transaction_rollback;
   factory->transaction_get_handle        = librdf_storage_mysql_transaction_get_handle;
+  factory->count_statements              = librdf_storage_mysql_count_statements;
+  factory->supports_query                = librdf_storage_mysql_supports_query;
+  factory->query_execute                 = librdf_storage_mysql_query_execute;
+  factory->query_cancel                  = librdf_storage_mysql_query_cancel;
 }
 
 #ifdef MODULAR_LIBRDF
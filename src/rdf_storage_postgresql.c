@@ -35,16 +35,54 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
 #include <sys/types.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 #include <rdf_types.h>
 
 #include <libpq-fe.h>
 
+/* Statements collected in bulk mode before they are sent with COPY */
+#define LIBRDF_STORAGE_POSTGRESQL_BULK_STATEMENTS 100000
+
+/* Prepared statements kept by each connection: find query shapes
+ * (which of subject, predicate, object and context are given) then
+ * the contains and insert statements */
+#define LIBRDF_STORAGE_POSTGRESQL_FIND_SHAPES 16
+#define LIBRDF_STORAGE_POSTGRESQL_PREPARED_CONTAINS LIBRDF_STORAGE_POSTGRESQL_FIND_SHAPES
+#define LIBRDF_STORAGE_POSTGRESQL_PREPARED_INSERT (LIBRDF_STORAGE_POSTGRESQL_FIND_SHAPES + 1)
+
+/* Type of node id parameters, numeric */
+#define LIBRDF_STORAGE_POSTGRESQL_NUMERIC_OID 1700
+
+/* Default rows fetched at a time from a find query cursor */
+#define LIBRDF_STORAGE_POSTGRESQL_FETCH_SIZE 1000
+
+/* Most queries sent in pipeline mode before their results are read */
+#define LIBRDF_STORAGE_POSTGRESQL_PIPELINE_DEPTH 1000
+
+/* Tables loaded with COPY in bulk mode; nodes go through a staging table */
+typedef enum {
+  COPY_RESOURCES,
+  COPY_BNODES,
+  COPY_LITERALS,
+  COPY_STATEMENTS,
+  COPY_LAST = COPY_STATEMENTS
+} librdf_storage_postgresql_copy_table;
+
+static const char* const postgresql_copy_tables[COPY_LAST]={
+  "Resources",
+  "Bnodes",
+  "Literals"
+};
+
 typedef enum {
   /* Status of individual postgresql connections */
   LIBRDF_STORAGE_POSTGRESQL_CONNECTION_CLOSED = 0,
@@ -56,6 +94,10 @@ typedef struct {
   /* A postgresql connection */
   librdf_storage_postgresql_connection_status status;
   PGconn *handle;
+  /* bit set of the prepared statements made on this connection */
+  unsigned long prepared;
+  /* 0 for the primary server or the replica number from 1 */
+  int replica;
 } librdf_storage_postgresql_connection;
 
 typedef struct {
@@ -70,6 +112,12 @@ typedef struct {
   librdf_storage_postgresql_connection *connections;
   int connections_count;
 
+  /* read-only replica servers that reads outside a transaction may
+   * use and the replica number last used */
+  librdf_sql_replica* replicas;
+  int replicas_count;
+  int replica_last;
+
   /* hash of model name in the database (table Models, column ID) */
   u64 model;
 
@@ -82,8 +130,39 @@ typedef struct {
   /* digest object for node hashes */
   librdf_digest *digest;
 
+  /* node hash function recorded in the database Settings table */
+  librdf_sql_node_hash node_hash;
+
   PGconn* transaction_handle;
 
+  /* connection kept while a bulk load is in progress or NULL */
+  PGconn* bulk_handle;
+  /* COPY text format rows waiting for each table in bulk mode */
+  raptor_stringbuffer* copy_rows[COPY_LAST+1];
+  int copy_statements;
+
+  /* if inserts are sent in pipeline mode, the connection in pipeline
+   * mode or NULL and the number of queries sent on it */
+  int pipeline;
+  PGconn* pipeline_handle;
+  int pipeline_count;
+
+  /* if SPARQL basic graph patterns are run as one SQL query */
+  int sql_query;
+
+  /* rows fetched at a time by find queries read through a cursor
+   * (0 never) and the number of cursors opened, for their names */
+  int fetch_size;
+  int cursors;
+
+  /* node to hash cache of nodes known to be stored or NULL if disabled */
+  librdf_sql_node_cache* node_cache;
+
+  /* query run by query_execute and the libpq cancel object for its
+   * connection, or NULL; guarded by the world mutex */
+  librdf_query* running_query;
+  PGcancel* running_cancel;
+
 } librdf_storage_postgresql_instance;
 
 /* prototypes for local functions */
@@ -104,6 +183,14 @@ static int librdf_storage_postgresql_remove_statement(librdf_storage* storage,
                                                  librdf_statement* statement);
 static int librdf_storage_postgresql_contains_statement(librdf_storage* storage,
                                                    librdf_statement* statement);
+static int librdf_storage_postgresql_count_statements(librdf_storage* storage,
+                                                      librdf_statement* statement);
+static int librdf_storage_postgresql_has_arc_in(librdf_storage* storage,
+                                                librdf_node* node,
+                                                librdf_node* property);
+static int librdf_storage_postgresql_has_arc_out(librdf_storage* storage,
+                                                 librdf_node* node,
+                                                 librdf_node* property);
 
 
 librdf_stream* librdf_storage_postgresql_serialise(librdf_storage* storage);
@@ -152,6 +239,13 @@ typedef struct {
   int current_rowno;
   char **row;
   int is_literal_match;
+
+  /* cursor the rows are fetched from or empty if all rows are in
+   * results, if a transaction was started for it and if it has no
+   * more rows */
+  char cursor[32];
+  int cursor_transaction;
+  int cursor_done;
 } librdf_storage_postgresql_sos_context;
 
 typedef struct {
@@ -170,6 +264,8 @@ static u64 librdf_storage_postgresql_node_hash(librdf_storage* storage,
                                                librdf_node* node, int add);
 static int librdf_storage_postgresql_start_bulk(librdf_storage* storage);
 static int librdf_storage_postgresql_stop_bulk(librdf_storage* storage);
+static int librdf_storage_postgresql_flush_bulk(librdf_storage* storage);
+static int librdf_storage_postgresql_pipeline_flush(librdf_storage* storage);
 static int librdf_storage_postgresql_context_add_statement_helper(librdf_storage* storage,
                                                                   u64 ctxt,
                                                                   librdf_statement* statement);
@@ -221,6 +317,11 @@ librdf_storage_postgresql_hash(librdf_storage* storage, const char *type,
 
   context = (librdf_storage_postgresql_instance*)storage->instance;
 
+  /* Node hashes are seeded with the node type; model names always use MD5 */
+  if(type && context->node_hash == LIBRDF_SQL_NODE_HASH_XXH64)
+    return librdf_sql_xxh64((const unsigned char*)string, length,
+                            (u64)(unsigned char)*type);
+
   /* (Re)initialize digest object */
   librdf_digest_init(context->digest);
 
@@ -293,18 +394,19 @@ librdf_storage_postgresql_finish_connections(librdf_storage* storage)
 
 
 /*
- * librdf_storage_postgresql_get_handle:
+ * librdf_storage_postgresql_pool_handle:
  * @storage: the storage
+ * @replica: 0 for the primary server or the replica number
  *
- * INTERNAL - get a connection handle to the postgresql server
+ * INTERNAL - get a pooled connection handle to a server
  *
  * This attempts to reuses any existing available pooled connection
- * otherwise creates a new connection to the server.
+ * to the server otherwise creates a new connection to it.
  *
- * Return value: Non-zero on succes.
+ * Return value: handle or NULL on failure
  **/
 static PGconn*
-librdf_storage_postgresql_get_handle(librdf_storage* storage)
+librdf_storage_postgresql_pool_handle(librdf_storage* storage, int replica)
 {
   librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
   librdf_storage_postgresql_connection* connection= NULL;
@@ -313,15 +415,19 @@ librdf_storage_postgresql_get_handle(librdf_storage* storage)
   char coninfo_template[] = "host=%s port=%s dbname=%s user=%s password=%s";
   size_t coninfo_size;
   char *conninfo;
+  const char *host=context->host;
+  const char *port=context->port;
 
-  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
-
-  if(context->transaction_handle)
-    return context->transaction_handle;
+  if(replica) {
+    host=context->replicas[replica - 1].host;
+    if(context->replicas[replica - 1].port)
+      port=context->replicas[replica - 1].port;
+  }
 
   /* Look for an open connection handle to return */
   for(i=0; i < context->connections_count; i++) {
-    if(LIBRDF_STORAGE_POSTGRESQL_CONNECTION_OPEN == context->connections[i].status) {
+    if(LIBRDF_STORAGE_POSTGRESQL_CONNECTION_OPEN == context->connections[i].status &&
+       context->connections[i].replica == replica) {
       context->connections[i].status=LIBRDF_STORAGE_POSTGRESQL_CONNECTION_BUSY;
       return context->connections[i].handle;
     }
@@ -365,22 +471,24 @@ librdf_storage_postgresql_get_handle(librdf_storage* storage)
 
   /* Initialize closed postgresql connection handle */
   coninfo_size = strlen(coninfo_template)
-    + strlen(context->host)
-    + strlen(context->port)
+    + strlen(host)
+    + strlen(port)
     + strlen(context->dbname)
     + strlen(context->user)
     + strlen(context->password);
   conninfo = LIBRDF_MALLOC(char*,coninfo_size);
   if(conninfo) {
-    sprintf(conninfo,coninfo_template,context->host,context->port,context->dbname,context->user,context->password);
+    sprintf(conninfo,coninfo_template,host,port,context->dbname,context->user,context->password);
     connection->handle=PQconnectdb(conninfo);
+    connection->prepared=0;
+    connection->replica=replica;
     if(connection->handle) {
     	if( PQstatus(connection->handle) == CONNECTION_OK ) {
         connection->status=LIBRDF_STORAGE_POSTGRESQL_CONNECTION_BUSY;
       } else {
         librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
                    "Connection to postgresql database %s:%s name %s as user %s failed: %s",
-                   context->host, context->port, context->dbname,
+                   host, port, context->dbname,
                    context->user, PQerrorMessage(connection->handle));
         PQfinish(connection->handle);
         connection->handle=NULL;
@@ -393,6 +501,91 @@ librdf_storage_postgresql_get_handle(librdf_storage* storage)
 }
 
 
+/*
+ * librdf_storage_postgresql_get_handle:
+ * @storage: the storage
+ *
+ * INTERNAL - get a connection handle to the postgresql server
+ *
+ * Return value: Non-zero on succes.
+ **/
+static PGconn*
+librdf_storage_postgresql_get_handle(librdf_storage* storage)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
+
+  /* Anything else done sees the pipelined inserts */
+  if(context->pipeline_handle)
+    librdf_storage_postgresql_pipeline_flush(storage);
+
+  if(context->transaction_handle)
+    return context->transaction_handle;
+
+  return librdf_storage_postgresql_pool_handle(storage, 0);
+}
+
+
+/*
+ * librdf_storage_postgresql_get_read_handle:
+ * @storage: the storage
+ *
+ * INTERNAL - get a connection handle for a read-only query
+ *
+ * Outside a transaction this is a connection to the replica with the
+ * fewest connections in use, taking them in turn when equal, so
+ * replicas that are behind the primary may not show recent changes.
+ * Without replicas, or if none can be reached, it is a primary
+ * server connection.
+ *
+ * Return value: handle or NULL on failure
+ **/
+static PGconn*
+librdf_storage_postgresql_get_read_handle(librdf_storage* storage)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  PGconn *handle;
+  int best=0;
+  int best_busy=0;
+  int r;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
+
+  if(!context->replicas_count || context->transaction_handle ||
+     context->pipeline_handle || context->bulk_handle)
+    return librdf_storage_postgresql_get_handle(storage);
+
+  for(r=1; r <= context->replicas_count; r++) {
+    /* start after the replica used last */
+    int replica=(context->replica_last + r - 1) % context->replicas_count + 1;
+    int busy=0;
+    int i;
+
+    for(i=0; i < context->connections_count; i++) {
+      if(context->connections[i].replica == replica &&
+         LIBRDF_STORAGE_POSTGRESQL_CONNECTION_BUSY == context->connections[i].status)
+        busy++;
+    }
+    if(!best || busy < best_busy) {
+      best=replica;
+      best_busy=busy;
+    }
+  }
+
+  context->replica_last=best;
+  handle=librdf_storage_postgresql_pool_handle(storage, best);
+  if(!handle) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql replica %s unavailable, reading from the primary",
+               context->replicas[best - 1].host);
+    handle=librdf_storage_postgresql_get_handle(storage);
+  }
+
+  return handle;
+}
+
+
 /*
  * librdf_storage_postgresql_release_handle:
  * @storage: the storage
@@ -411,6 +604,10 @@ librdf_storage_postgresql_release_handle(librdf_storage* storage, PGconn *handle
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(storage, librdf_storage);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(handle, PGconn*);
 
+  /* Kept until the pipeline is flushed */
+  if(handle == context->pipeline_handle)
+    return;
+
   /* Look for busy connection handle to drop */
   for(i=0; i < context->connections_count; i++) {
     if(LIBRDF_STORAGE_POSTGRESQL_CONNECTION_BUSY == context->connections[i].status &&
@@ -425,11 +622,451 @@ librdf_storage_postgresql_release_handle(librdf_storage* storage, PGconn *handle
 }
 
 
+/*
+ * librdf_storage_postgresql_exec_params:
+ * @handle: the postgresql handle
+ * @query: query text with $1... parameters
+ * @nparams: number of parameters, at most 4
+ * @params: node id parameters
+ *
+ * INTERNAL - Run a query with node id parameters
+ *
+ * Return value: result (to be freed with PQclear) or NULL on failure
+ **/
+static PGresult*
+librdf_storage_postgresql_exec_params(PGconn *handle, const char *query,
+                                      int nparams, const u64* params)
+{
+  Oid types[4];
+  char values[4][21];
+  const char* value_pointers[4];
+  int i;
+
+  for(i=0; i < nparams; i++) {
+    types[i]=LIBRDF_STORAGE_POSTGRESQL_NUMERIC_OID;
+    sprintf(values[i], UINT64_T_FMT, params[i]);
+    value_pointers[i]=values[i];
+  }
+
+  return PQexecParams(handle, query, nparams, types, value_pointers,
+                      NULL, NULL, 0);
+}
+
+
+/*
+ * librdf_storage_postgresql_exec_prepared:
+ * @storage: the storage
+ * @handle: the postgresql handle
+ * @id: prepared statement number
+ * @query: query text with $1... parameters
+ * @nparams: number of parameters, at most 4
+ * @params: node id parameters
+ *
+ * INTERNAL - Run a query as a prepared statement kept by the connection
+ *
+ * The statement is prepared the first time it is used on a connection
+ * so the server parses and plans it once.  Node ids are sent as
+ * parameters, not in the query text.
+ *
+ * Return value: result (to be freed with PQclear) or NULL on failure
+ **/
+static PGresult*
+librdf_storage_postgresql_exec_prepared(librdf_storage* storage,
+                                        PGconn *handle, int id,
+                                        const char *query, int nparams,
+                                        const u64* params)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  librdf_storage_postgresql_connection* connection=NULL;
+  Oid types[4];
+  char values[4][21];
+  const char* value_pointers[4];
+  char name[32];
+  int i;
+
+  for(i=0; i < context->connections_count; i++) {
+    if(context->connections[i].handle == handle) {
+      connection=&context->connections[i];
+      break;
+    }
+  }
+
+  /* Not a pool connection: parameters without keeping a statement */
+  if(!connection)
+    return librdf_storage_postgresql_exec_params(handle, query, nparams,
+                                                 params);
+
+  for(i=0; i < nparams; i++) {
+    types[i]=LIBRDF_STORAGE_POSTGRESQL_NUMERIC_OID;
+    sprintf(values[i], UINT64_T_FMT, params[i]);
+    value_pointers[i]=values[i];
+  }
+
+  sprintf(name, "librdf_%d", id);
+
+  if(!(connection->prepared & (1UL << id))) {
+    PGresult *res;
+
+    res=PQprepare(handle, name, query, nparams, types);
+    if(!res || PQresultStatus(res) != PGRES_COMMAND_OK) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql prepare failed: %s",
+                 res ? PQresultErrorMessage(res) : PQerrorMessage(handle));
+      if(res)
+        PQclear(res);
+      return NULL;
+    }
+    PQclear(res);
+    connection->prepared |= (1UL << id);
+  }
+
+  return PQexecPrepared(handle, name, nparams, value_pointers, NULL, NULL, 0);
+}
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * librdf_storage_postgresql_pipeline_get:
+ * @storage: the storage
+ *
+ * INTERNAL - Get the connection inserts are pipelined on
+ *
+ * The transaction connection is used in a transaction, otherwise a
+ * pool connection that is kept until the pipeline is flushed.
+ *
+ * Return value: handle or NULL on failure
+ **/
+static PGconn*
+librdf_storage_postgresql_pipeline_get(librdf_storage* storage)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  PGconn *handle;
+
+  if(context->pipeline_handle)
+    return context->pipeline_handle;
+
+  handle=librdf_storage_postgresql_get_handle(storage);
+  if(!handle)
+    return NULL;
+
+  if(!PQenterPipelineMode(handle)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql pipeline mode failed: %s", PQerrorMessage(handle));
+    if(handle != context->transaction_handle)
+      librdf_storage_postgresql_release_handle(storage, handle);
+    return NULL;
+  }
+
+  context->pipeline_handle=handle;
+  context->pipeline_count=0;
+
+  return handle;
+}
+
+
+/*
+ * librdf_storage_postgresql_pipeline_send:
+ * @storage: the storage
+ * @query: query text with $1... parameters
+ * @nparams: number of parameters
+ * @types: parameter types or NULL to let the server choose
+ * @values: parameter values
+ *
+ * INTERNAL - Send a query on the pipeline without waiting for its result
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_postgresql_pipeline_send(librdf_storage* storage,
+                                        const char *query, int nparams,
+                                        const Oid* types,
+                                        const char* const* values)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+
+  if(!PQsendQueryParams(context->pipeline_handle, query, nparams, types,
+                        values, NULL, NULL, 0)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql pipelined query failed: %s",
+               PQerrorMessage(context->pipeline_handle));
+    return 1;
+  }
+  context->pipeline_count++;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_postgresql_pipeline_flush:
+ * @storage: the storage
+ *
+ * INTERNAL - Read the results of the pipelined queries and leave pipeline mode
+ *
+ * Outside a transaction the queries since the last flush are one
+ * implicit transaction, so after an error none of them are stored.
+ * In a transaction an error aborts it as a synchronous query would.
+ *
+ * Return value: Non-zero if any query failed.
+ **/
+static int
+librdf_storage_postgresql_pipeline_flush(librdf_storage* storage)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  PGconn *handle=context->pipeline_handle;
+  PGresult *res;
+  int results_ended=0;
+  int status=0;
+
+  if(!handle)
+    return 0;
+
+  if(!PQpipelineSync(handle)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql pipeline sync failed: %s", PQerrorMessage(handle));
+    status=1;
+  }
+
+  /* Each query's results end with NULL and the sync result follows
+   * them all; stop after the last query if the sync was not sent */
+  while(1) {
+    res=PQgetResult(handle);
+    if(!res) {
+      if(++results_ended > context->pipeline_count)
+        break;
+      continue;
+    }
+
+    if(PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+      PQclear(res);
+      break;
+    }
+
+    if(PQresultStatus(res) == PGRES_FATAL_ERROR) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql pipelined query failed: %s",
+                 PQresultErrorMessage(res));
+      status=1;
+    } else if(PQresultStatus(res) == PGRES_PIPELINE_ABORTED)
+      status=1;
+    PQclear(res);
+  }
+
+  PQexitPipelineMode(handle);
+
+  context->pipeline_handle=NULL;
+  context->pipeline_count=0;
+  if(handle != context->transaction_handle)
+    librdf_storage_postgresql_release_handle(storage, handle);
+
+  /* nodes cached while pipelined may not have been stored */
+  if(status && context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_pipeline_add_statement:
+ * @storage: the storage
+ * @ctxt: u64 context hash
+ * @statement: statement to add
+ * @unique: non-0 to not add the statement if already stored
+ *
+ * INTERNAL - Add a statement and its nodes on the pipeline
+ *
+ * Without waiting for the server a stored statement cannot be checked
+ * first, so @unique makes the insert itself skip it.
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_postgresql_pipeline_add_statement(librdf_storage* storage,
+                                                 u64 ctxt,
+                                                 librdf_statement* statement,
+                                                 int unique)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  const char insert_statement[]="INSERT INTO Statements" UINT64_T_FMT " (Subject,Predicate,Object,Context) VALUES ($1,$2,$3,$4)";
+  const char insert_unique_statement[]="INSERT INTO Statements" UINT64_T_FMT " (Subject,Predicate,Object,Context) SELECT $1,$2,$3,$4 WHERE NOT EXISTS (SELECT 1 FROM Statements" UINT64_T_FMT " WHERE Subject=$1 AND Predicate=$2 AND Object=$3)";
+  char query[sizeof(insert_unique_statement) + 40];
+  Oid types[4];
+  char values[4][21];
+  const char* value_pointers[4];
+  u64 nodes[4];
+  int i;
+
+  if(!librdf_storage_postgresql_pipeline_get(storage))
+    return 1;
+
+  nodes[0]=librdf_storage_postgresql_node_hash(storage,
+                                               librdf_statement_get_subject(statement),1);
+  nodes[1]=librdf_storage_postgresql_node_hash(storage,
+                                               librdf_statement_get_predicate(statement),1);
+  nodes[2]=librdf_storage_postgresql_node_hash(storage,
+                                               librdf_statement_get_object(statement),1);
+  nodes[3]=ctxt;
+  if(!nodes[0] || !nodes[1] || !nodes[2])
+    return 1;
+
+  for(i=0; i < 4; i++) {
+    types[i]=LIBRDF_STORAGE_POSTGRESQL_NUMERIC_OID;
+    sprintf(values[i], UINT64_T_FMT, nodes[i]);
+    value_pointers[i]=values[i];
+  }
+
+  if(unique)
+    sprintf(query, insert_unique_statement, context->model, context->model);
+  else
+    sprintf(query, insert_statement, context->model);
+
+  if(librdf_storage_postgresql_pipeline_send(storage, query, 4, types,
+                                             value_pointers))
+    return 1;
+
+  if(context->pipeline_count >= LIBRDF_STORAGE_POSTGRESQL_PIPELINE_DEPTH)
+    return librdf_storage_postgresql_pipeline_flush(storage);
+
+  return 0;
+}
+#else
+/* libpq without pipeline mode: the pipeline option is ignored */
+static PGconn*
+librdf_storage_postgresql_pipeline_get(librdf_storage* storage)
+{
+  return NULL;
+}
+
+static int
+librdf_storage_postgresql_pipeline_send(librdf_storage* storage,
+                                        const char *query, int nparams,
+                                        const Oid* types,
+                                        const char* const* values)
+{
+  return 1;
+}
+
+static int
+librdf_storage_postgresql_pipeline_flush(librdf_storage* storage)
+{
+  return 0;
+}
+
+static int
+librdf_storage_postgresql_pipeline_add_statement(librdf_storage* storage,
+                                                 u64 ctxt,
+                                                 librdf_statement* statement,
+                                                 int unique)
+{
+  return 1;
+}
+#endif
+
+
+/*
+ * librdf_storage_postgresql_init_node_hash - Choose the node hash function
+ * @storage: the storage
+ * @handle: postgresql connection handle
+ * @name: node-hash option value or NULL
+ * @is_new: non-0 if the new option was given
+ *
+ * The function is recorded in the Settings table when the database is
+ * first created, before any model.  A database without the setting
+ * was made before node hashes could be chosen and keeps using MD5.
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_postgresql_init_node_hash(librdf_storage* storage,
+                                         PGconn *handle,
+                                         const char* name, int is_new)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  const char get_setting[]="SELECT Value FROM Settings WHERE Name='node-hash'";
+  const char any_model[]="SELECT 1 FROM Models LIMIT 1";
+  const char create_settings[]="CREATE TABLE IF NOT EXISTS Settings (Name varchar(64) NOT NULL, Value text NOT NULL, PRIMARY KEY (Name))";
+  const char set_setting[]="INSERT INTO Settings (Name, Value) VALUES ('node-hash', '%s')";
+  char query[128];
+  PGresult *res;
+  int wanted=LIBRDF_SQL_NODE_HASH_MD5;
+  int stored=-1;
+  int has_models=1;
+  int status=0;
+
+  if(name) {
+    wanted=librdf_sql_node_hash_from_name(name);
+    if(wanted < 0) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown postgresql node-hash %s", name);
+      return 1;
+    }
+  }
+
+  /* The Settings table does not exist in older databases */
+  if((res=PQexec(handle, get_setting))) {
+    if(PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res)) {
+      stored=librdf_sql_node_hash_from_name(PQgetvalue(res, 0, 0));
+      if(stored < 0) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE,
+                   NULL, "Unknown postgresql database node-hash %s",
+                   PQgetvalue(res, 0, 0));
+        status=1;
+      }
+    }
+    PQclear(res);
+  }
+  if(status)
+    return status;
+
+  if(stored < 0 && is_new && (res=PQexec(handle, any_model))) {
+    if(PQresultStatus(res) == PGRES_TUPLES_OK)
+      has_models=(PQntuples(res) > 0);
+    PQclear(res);
+  }
+
+  if(stored < 0 && !has_models) {
+    /* A new database: record the requested function */
+    sprintf(query, set_setting,
+            librdf_sql_node_hash_name((librdf_sql_node_hash)wanted));
+    if((res=PQexec(handle, create_settings))) {
+      if(PQresultStatus(res) != PGRES_COMMAND_OK)
+        status=1;
+      PQclear(res);
+    } else
+      status=1;
+    if(!status && (res=PQexec(handle, query))) {
+      if(PQresultStatus(res) != PGRES_COMMAND_OK)
+        status=1;
+      PQclear(res);
+    } else
+      status=1;
+    if(status) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql insert into Settings table failed: %s",
+                 PQerrorMessage(handle));
+      return 1;
+    }
+    stored=wanted;
+  } else if(stored < 0)
+    stored=LIBRDF_SQL_NODE_HASH_MD5;
+
+  if(stored != wanted && name)
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql database uses node-hash %s, ignoring node-hash %s",
+               librdf_sql_node_hash_name((librdf_sql_node_hash)stored), name);
+
+  context->node_hash=(librdf_sql_node_hash)stored;
+
+  return 0;
+}
+
+
 /*
  * librdf_storage_postgresql_init:
  * @storage: the storage
  * @name: model name
- * @options: host, port, database, user, password [, new] [, bulk] [, merge].
+ * @options: host, port, database, user, password [, new] [, bulk] [, merge] [, node-hash].
  *
  * INTERNAL - Create connection to database.  Defaults to port 5432 if not given.
  *
@@ -440,6 +1077,9 @@ librdf_storage_postgresql_release_handle(librdf_storage* storage, PGconn *handle
  * The boolean merge option can be set to true if a merged "view" of all
  * models should be maintained. This "view" will be a table with TYPE=MERGE.
  *
+ * The node-hash option names the function used for node ids, md5
+ * (default) or xxh64.  It is only used when a new database is created.
+ *
  * Return value: Non-zero on failure.
  **/
 static int
@@ -498,6 +1138,9 @@ librdf_storage_postgresql_init(librdf_storage* storage, const char *name,
   char *query=NULL;
   PGresult *res=NULL;
   PGconn *handle;
+  long node_cache_size;
+  long fetch_size;
+  char *replicas;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(name, char*, 1);
@@ -563,6 +1206,13 @@ librdf_storage_postgresql_init(librdf_storage* storage, const char *name,
   /* Maintain merge table? */
   context->merge=(librdf_hash_get_as_boolean(options, "merge")>0);
 
+  /* Read from replicas? */
+  replicas=librdf_hash_get(options, "replicas");
+  if(replicas) {
+    context->replicas=librdf_new_sql_replicas(replicas, &context->replicas_count);
+    LIBRDF_FREE(char*, replicas);
+  }
+
   /* Initialize postgresql connections */
   librdf_storage_postgresql_init_connections(storage);
 
@@ -607,6 +1257,15 @@ librdf_storage_postgresql_init(librdf_storage* storage, const char *name,
     }
   }
 
+  /* Choose node hash function before any node is hashed */
+  if(!status) {
+    char* node_hash=librdf_hash_get(options, "node-hash");
+    status=librdf_storage_postgresql_init_node_hash(storage, handle, node_hash,
+                                                    (librdf_hash_get_as_boolean(options, "new")>0));
+    if(node_hash)
+      LIBRDF_FREE(char*, node_hash);
+  }
+
   /* Create model if new and not existing, or check for existence */
   if(!status) {
     escaped_name = LIBRDF_MALLOC(char*, strlen(name) * 2 + 1);
@@ -693,6 +1352,33 @@ librdf_storage_postgresql_init(librdf_storage* storage, const char *name,
   /* Optimize loads? */
   context->bulk=(librdf_hash_get_as_boolean(options, "bulk")>0);
 
+  /* Read large find results through cursors? */
+  fetch_size=librdf_hash_get_as_long(options, "fetch-size");
+  context->fetch_size=(fetch_size >= 0 && fetch_size <= INT_MAX) ? (int)fetch_size : LIBRDF_STORAGE_POSTGRESQL_FETCH_SIZE;
+
+  /* Run basic graph pattern queries as SQL? */
+  context->sql_query=(librdf_hash_get_as_boolean(options, "sql-query")!=0);
+
+  /* Send inserts without waiting for each result? */
+  context->pipeline=(librdf_hash_get_as_boolean(options, "pipeline")>0);
+#ifndef LIBPQ_HAS_PIPELINING
+  if(context->pipeline) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql pipeline option needs libpq 14 or newer, ignored");
+    context->pipeline=0;
+  }
+#endif
+
+  /* Cache stored nodes? */
+  node_cache_size=librdf_hash_get_as_long(options, "node-cache-size");
+  if(node_cache_size < 0)
+    node_cache_size=LIBRDF_SQL_NODE_CACHE_SIZE;
+  if(!status && node_cache_size > 0) {
+    context->node_cache=librdf_new_sql_node_cache((int)node_cache_size);
+    if(!context->node_cache)
+      status=1;
+  }
+
   /* Truncate model? */
    if(!status && (librdf_hash_get_as_boolean(options, "new")>0))
     status=librdf_storage_postgresql_context_remove_statements(storage, NULL);
@@ -805,11 +1491,16 @@ librdf_storage_postgresql_terminate(librdf_storage* storage)
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(storage, librdf_storage);
 
+  librdf_storage_postgresql_pipeline_flush(storage);
+
   librdf_storage_postgresql_finish_connections(storage);
 
   if(context->password)
     LIBRDF_FREE(char*, (char*)context->password);
 
+  if(context->replicas)
+    librdf_free_sql_replicas(context->replicas, context->replicas_count);
+
   if(context->user)
     LIBRDF_FREE(char*, (char*)context->user);
 
@@ -828,6 +1519,9 @@ librdf_storage_postgresql_terminate(librdf_storage* storage)
   if(context->transaction_handle)
     librdf_storage_postgresql_transaction_rollback(storage);
 
+  if(context->node_cache)
+    librdf_free_sql_node_cache(context->node_cache);
+
   LIBRDF_FREE(librdf_storage_postgresql_instance, storage->instance);
 }
 
@@ -884,7 +1578,8 @@ librdf_storage_postgresql_sync(librdf_storage* storage)
   if(context->bulk)
     librdf_storage_postgresql_stop_bulk(storage);
 
-  return 0;
+  /* Wait for pipelined inserts */
+  return librdf_storage_postgresql_pipeline_flush(storage);
 }
 
 
@@ -909,7 +1604,7 @@ librdf_storage_postgresql_size(librdf_storage* storage)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, -1);
 
   /* Get postgresql connection handle */
-  handle=librdf_storage_postgresql_get_handle(storage);
+  handle=librdf_storage_postgresql_get_read_handle(storage);
   if(!handle)
     return -1;
 
@@ -949,6 +1644,13 @@ static int
 librdf_storage_postgresql_add_statement(librdf_storage* storage,
                                    librdf_statement* statement)
 {
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+
+  /* Pipelined inserts skip duplicates themselves */
+  if(context->pipeline)
+    return librdf_storage_postgresql_pipeline_add_statement(storage, 0,
+                                                            statement, 1);
+
   /* Do not add duplicate statements */
   if(librdf_storage_postgresql_contains_statement(storage, statement))
     return 0;
@@ -968,13 +1670,94 @@ librdf_storage_postgresql_add_statement(librdf_storage* storage,
  * Return value: Non-zero on failure.
  **/
 static int
-librdf_storage_postgresql_add_statements(librdf_storage* storage,
-                                    librdf_stream* statement_stream)
+librdf_storage_postgresql_add_statements(librdf_storage* storage,
+                                    librdf_stream* statement_stream)
+{
+  return librdf_storage_postgresql_context_add_statements(storage, NULL,
+                                                     statement_stream);
+}
+
+/*
+ * librdf_storage_postgresql_copy_append - Append a COPY text format value
+ * @sb: string buffer
+ * @str: value
+ * @len: value length
+ *
+ * Backslash, newline, carriage return and tab are escaped.
+ **/
+static void
+librdf_storage_postgresql_copy_append(raptor_stringbuffer* sb,
+                                      const unsigned char* str, size_t len)
+{
+  size_t start=0;
+  size_t i;
+
+  for(i=0; i < len; i++) {
+    const char* escape;
+
+    switch(str[i]) {
+      case '\\':
+        escape="\\\\";
+        break;
+      case '\n':
+        escape="\\n";
+        break;
+      case '\r':
+        escape="\\r";
+        break;
+      case '\t':
+        escape="\\t";
+        break;
+      default:
+        continue;
+    }
+
+    if(i > start)
+      raptor_stringbuffer_append_counted_string(sb, str+start, i-start, 1);
+    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)escape, 2, 1);
+    start=i+1;
+  }
+
+  if(len > start)
+    raptor_stringbuffer_append_counted_string(sb, str+start, len-start, 1);
+}
+
+
+/*
+ * librdf_storage_postgresql_copy_node - Queue a node row for COPY
+ * @storage: the storage
+ * @table: node table
+ * @hash: node ID
+ * @values: column values after ID
+ * @lengths: lengths of @values
+ * @count: number of values
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_postgresql_copy_node(librdf_storage* storage,
+                                    librdf_storage_postgresql_copy_table table,
+                                    u64 hash, const unsigned char** values,
+                                    size_t* lengths, int count)
 {
-  return librdf_storage_postgresql_context_add_statements(storage, NULL,
-                                                     statement_stream);
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  raptor_stringbuffer* sb=context->copy_rows[table];
+  char uint64_buffer[64];
+  int i;
+
+  sprintf(uint64_buffer, UINT64_T_FMT, hash);
+  if(raptor_stringbuffer_append_string(sb, (const unsigned char*)uint64_buffer, 1))
+    return 1;
+
+  for(i=0; i < count; i++) {
+    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"\t", 1, 1);
+    librdf_storage_postgresql_copy_append(sb, values[i], lengths[i]);
+  }
+
+  return raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"\n", 1, 1);
 }
 
+
 /*
  * librdf_storage_postgresql_node_hash - Create hash value for node
  * @storage: the storage
@@ -988,6 +1771,7 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
                                librdf_node* node,
                                int add)
 {
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
   librdf_node_type type=librdf_node_get_type(node);
   u64 hash;
   size_t nodelen;
@@ -998,8 +1782,16 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
 
-  /* Get postgresql connection handle */
-  handle=librdf_storage_postgresql_get_handle(storage);
+  /* Nodes in the cache are already stored */
+  if(context->node_cache &&
+     librdf_sql_node_cache_get(context->node_cache, node, &hash))
+    return hash;
+
+  /* Get postgresql connection handle; pipelined inserts use their own */
+  if(add && context->pipeline_handle && !context->bulk_handle)
+    handle=context->pipeline_handle;
+  else
+    handle=librdf_storage_postgresql_get_handle(storage);
   if(!handle)
     return 0;
 
@@ -1008,7 +1800,27 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
     unsigned char *uri=librdf_uri_as_counted_string(librdf_node_get_uri(node), &nodelen);
     hash = librdf_storage_postgresql_hash(storage, "R", (char*)uri, nodelen);
 
-    if(add) {
+    if(add && context->bulk_handle) {
+      const unsigned char* values[1];
+      size_t lengths[1];
+
+      values[0]=uri;
+      lengths[0]=nodelen;
+      if(librdf_storage_postgresql_copy_node(storage, COPY_RESOURCES, hash,
+                                             values, lengths, 1)) {
+        librdf_storage_postgresql_release_handle(storage, handle);
+        return 0;
+      }
+    } else if(add && handle == context->pipeline_handle) {
+      char id[21];
+      const char* values[2];
+
+      sprintf(id, UINT64_T_FMT, hash);
+      values[0]=id;
+      values[1]=(const char*)uri;
+      if(librdf_storage_postgresql_pipeline_send(storage, "INSERT INTO Resources (ID,URI) VALUES ($1,$2) ON CONFLICT (ID) DO NOTHING", 2, NULL, values))
+        return 0;
+    } else if(add) {
       char create_resource[]="INSERT INTO Resources (ID,URI) VALUES (" UINT64_T_FMT ",'%s')";
       int add_status = 0;
       char *escaped_uri;
@@ -1090,7 +1902,33 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
     hash = librdf_storage_postgresql_hash(storage, "L", nodestring, nodelen);
     LIBRDF_FREE(char*, nodestring);
 
-    if(add) {
+    if(add && context->bulk_handle) {
+      const unsigned char* values[3];
+      size_t lengths[3];
+
+      values[0]=value;
+      lengths[0]=valuelen;
+      values[1]=lang ? (const unsigned char*)lang : (const unsigned char*)"";
+      lengths[1]=langlen;
+      values[2]=datatype ? datatype : (const unsigned char*)"";
+      lengths[2]=datatypelen;
+      if(librdf_storage_postgresql_copy_node(storage, COPY_LITERALS, hash,
+                                             values, lengths, 3)) {
+        librdf_storage_postgresql_release_handle(storage, handle);
+        return 0;
+      }
+    } else if(add && handle == context->pipeline_handle) {
+      char id[21];
+      const char* values[4];
+
+      sprintf(id, UINT64_T_FMT, hash);
+      values[0]=id;
+      values[1]=(const char*)value;
+      values[2]=lang ? lang : "";
+      values[3]=datatype ? (const char*)datatype : "";
+      if(librdf_storage_postgresql_pipeline_send(storage, "INSERT INTO Literals (ID,Value,Language,Datatype) VALUES ($1,$2,$3,$4) ON CONFLICT (ID) DO NOTHING", 4, NULL, values))
+        return 0;
+    } else if(add) {
       char create_literal[]="INSERT INTO Literals (ID,Value,Language,Datatype) VALUES (" UINT64_T_FMT ",'%s','%s','%s')";
       int add_status = 0;
       char *escaped_value, *escaped_lang, *escaped_datatype;
@@ -1180,7 +2018,27 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
     nodelen = strlen((const char*)name);
     hash = librdf_storage_postgresql_hash(storage, "B", (char*)name, nodelen);
 
-    if(add) {
+    if(add && context->bulk_handle) {
+      const unsigned char* values[1];
+      size_t lengths[1];
+
+      values[0]=name;
+      lengths[0]=nodelen;
+      if(librdf_storage_postgresql_copy_node(storage, COPY_BNODES, hash,
+                                             values, lengths, 1)) {
+        librdf_storage_postgresql_release_handle(storage, handle);
+        return 0;
+      }
+    } else if(add && handle == context->pipeline_handle) {
+      char id[21];
+      const char* values[2];
+
+      sprintf(id, UINT64_T_FMT, hash);
+      values[0]=id;
+      values[1]=(const char*)name;
+      if(librdf_storage_postgresql_pipeline_send(storage, "INSERT INTO Bnodes (ID,Name) VALUES ($1,$2) ON CONFLICT (ID) DO NOTHING", 2, NULL, values))
+        return 0;
+    } else if(add) {
       char create_bnode[]="INSERT INTO Bnodes (ID,Name) VALUES (" UINT64_T_FMT ",'%s')";
       int add_status = 0;
       char *escaped_name;
@@ -1235,23 +2093,211 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
 
   librdf_storage_postgresql_release_handle(storage, handle);
 
+  if(add && context->node_cache)
+    librdf_sql_node_cache_put(context->node_cache, node, hash);
+
   return hash;
 }
 
 
+/*
+ * librdf_storage_postgresql_command:
+ * @storage: the storage
+ * @handle: postgresql connection handle
+ * @query: SQL command
+ *
+ * INTERNAL - Run an SQL command returning no rows
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_command(librdf_storage* storage, PGconn *handle,
+                                  const char *query)
+{
+  PGresult *res;
+  int status=1;
+
+  if((res=PQexec(handle, query))) {
+    if(PQresultStatus(res) == PGRES_COMMAND_OK)
+      status=0;
+    else
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql query %s failed: %s", query,
+                 PQresultErrorMessage(res));
+    PQclear(res);
+  } else
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql query %s failed: %s", query,
+               PQerrorMessage(handle));
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_copy_rows:
+ * @storage: the storage
+ * @handle: postgresql connection handle
+ * @table: table name
+ * @rows: COPY text format rows
+ *
+ * INTERNAL - Send rows to a table with COPY FROM STDIN
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_copy_rows(librdf_storage* storage, PGconn *handle,
+                                    const char *table,
+                                    raptor_stringbuffer* rows)
+{
+  char query[64];
+  PGresult *res;
+  int status=1;
+
+  sprintf(query, "COPY %s FROM STDIN", table);
+  if(!(res=PQexec(handle, query)) || PQresultStatus(res) != PGRES_COPY_IN) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql copy into %s failed: %s", table,
+               res ? PQresultErrorMessage(res) : PQerrorMessage(handle));
+    if(res)
+      PQclear(res);
+    return 1;
+  }
+  PQclear(res);
+
+  if(PQputCopyData(handle,
+                   (const char*)raptor_stringbuffer_as_string(rows),
+                   (int)raptor_stringbuffer_length(rows)) == 1 &&
+     PQputCopyEnd(handle, NULL) == 1) {
+    /* the result of the COPY itself */
+    while((res=PQgetResult(handle))) {
+      if(PQresultStatus(res) == PGRES_COMMAND_OK)
+        status=0;
+      else
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                   "postgresql copy into %s failed: %s", table,
+                   PQresultErrorMessage(res));
+      PQclear(res);
+    }
+  } else {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql copy into %s failed: %s", table,
+               PQerrorMessage(handle));
+    PQputCopyEnd(handle, "copy failed");
+    while((res=PQgetResult(handle)))
+      PQclear(res);
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_flush_bulk:
+ * @storage: the storage
+ *
+ * INTERNAL - Send the bulk rows collected so far
+ *
+ * Node rows are copied into a staging table and merged into the node
+ * table ignoring nodes already stored.  Statement rows are copied
+ * straight into the model table.
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_flush_bulk(librdf_storage* storage)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  PGconn *handle=context->bulk_handle;
+  char query[128];
+  int status=0;
+  int i;
+
+  for(i=0; !status && i <= COPY_LAST; i++) {
+    raptor_stringbuffer* rows=context->copy_rows[i];
+
+    if(!raptor_stringbuffer_length(rows))
+      continue;
+
+    if(i == COPY_STATEMENTS) {
+      sprintf(query, "Statements" UINT64_T_FMT, context->model);
+      status=librdf_storage_postgresql_copy_rows(storage, handle, query, rows);
+    } else {
+      const char* table=postgresql_copy_tables[i];
+
+      sprintf(query, "%sStage", table);
+      status=librdf_storage_postgresql_copy_rows(storage, handle, query, rows);
+      if(!status) {
+        sprintf(query, "INSERT INTO %s SELECT * FROM %sStage ON CONFLICT (ID) DO NOTHING",
+                table, table);
+        status=librdf_storage_postgresql_command(storage, handle, query);
+      }
+      if(!status) {
+        sprintf(query, "TRUNCATE %sStage", table);
+        status=librdf_storage_postgresql_command(storage, handle, query);
+      }
+    }
+
+    raptor_free_stringbuffer(rows);
+    context->copy_rows[i]=raptor_new_stringbuffer();
+    if(!context->copy_rows[i])
+      status=1;
+  }
+  context->copy_statements=0;
+
+  /* nodes cached in an unsent batch were never stored */
+  if(status && context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
+
+  return status;
+}
+
+
 /*
  * librdf_storage_postgresql_start_bulk:
  * @storage: the storage
  *
  * INTERNAL - Prepare for bulk insert operation
  *
+ * Nodes and statements added until librdf_storage_postgresql_stop_bulk()
+ * are collected and sent with COPY over one connection, which also
+ * holds the session staging tables for the nodes.
+ *
  * Return value: Non-zero on failure.
  */
 static int
 librdf_storage_postgresql_start_bulk(librdf_storage* storage)
 {
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  char query[128];
+  int status=0;
+  int i;
 
-  return 1;
+  if(context->bulk_handle)
+    return 0;
+
+  context->bulk_handle=librdf_storage_postgresql_get_handle(storage);
+  if(!context->bulk_handle)
+    return 1;
+
+  for(i=0; !status && i < COPY_LAST; i++) {
+    sprintf(query, "CREATE TEMPORARY TABLE IF NOT EXISTS %sStage (LIKE %s)",
+            postgresql_copy_tables[i], postgresql_copy_tables[i]);
+    status=librdf_storage_postgresql_command(storage, context->bulk_handle,
+                                             query);
+  }
+
+  for(i=0; !status && i <= COPY_LAST; i++) {
+    context->copy_rows[i]=raptor_new_stringbuffer();
+    if(!context->copy_rows[i])
+      status=1;
+  }
+  context->copy_statements=0;
+
+  if(status)
+    librdf_storage_postgresql_stop_bulk(storage);
+
+  return status;
 }
 
 
@@ -1266,7 +2312,28 @@ librdf_storage_postgresql_start_bulk(librdf_storage* storage)
 static int
 librdf_storage_postgresql_stop_bulk(librdf_storage* storage)
 {
-  return 1;
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  PGconn *handle=context->bulk_handle;
+  int status=0;
+  int i;
+
+  if(!handle)
+    return 0;
+
+  if(context->copy_rows[COPY_STATEMENTS])
+    status=librdf_storage_postgresql_flush_bulk(storage);
+
+  context->bulk_handle=NULL;
+  for(i=0; i <= COPY_LAST; i++) {
+    if(context->copy_rows[i]) {
+      raptor_free_stringbuffer(context->copy_rows[i]);
+      context->copy_rows[i]=NULL;
+    }
+  }
+
+  librdf_storage_postgresql_release_handle(storage, handle);
+
+  return status;
 }
 
 
@@ -1296,17 +2363,27 @@ librdf_storage_postgresql_context_add_statements(librdf_storage* storage,
   if(context->bulk) {
     if(librdf_storage_postgresql_start_bulk(storage))
       return 1;
+  } else if(context->pipeline) {
+    if(!librdf_storage_postgresql_pipeline_get(storage))
+      return 1;
   }
 
   /* Find hash for context, creating if necessary */
   if(context_node) {
     ctxt=librdf_storage_postgresql_node_hash(storage,context_node,1);
     if(!ctxt)
-      return 1;
+      helper=1;
   }
 
   while(!helper && !librdf_stream_end(statement_stream)) {
     librdf_statement* statement=librdf_stream_get_object(statement_stream);
+    if(context->pipeline && !context->bulk) {
+      /* Pipelined inserts skip duplicates themselves */
+      helper=librdf_storage_postgresql_pipeline_add_statement(storage, ctxt,
+                                                              statement, 1);
+      librdf_stream_next(statement_stream);
+      continue;
+    }
     if(!context->bulk) {
       /* Do not add duplicate statements
        * but do not check for this when in bulk mode.
@@ -1322,6 +2399,12 @@ librdf_storage_postgresql_context_add_statements(librdf_storage* storage,
     librdf_stream_next(statement_stream);
   }
 
+  /* Send the rows collected in bulk mode */
+  if(context->bulk) {
+    if(librdf_storage_postgresql_stop_bulk(storage))
+      helper=1;
+  }
+
   return helper;
 }
 
@@ -1341,11 +2424,16 @@ librdf_storage_postgresql_context_add_statement(librdf_storage* storage,
                                           librdf_node* context_node,
                                           librdf_statement* statement)
 {
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
   u64 ctxt=0;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
+  /* Send the context node on the pipeline too */
+  if(context->pipeline && !librdf_storage_postgresql_pipeline_get(storage))
+    return 1;
+
   /* Find hash for context, creating if necessary */
   if(context_node) {
     ctxt=librdf_storage_postgresql_node_hash(storage,context_node,1);
@@ -1373,7 +2461,8 @@ librdf_storage_postgresql_context_add_statement_helper(librdf_storage* storage,
                                           u64 ctxt, librdf_statement* statement)
 {
   librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
-  char insert_statement[]="INSERT INTO Statements" UINT64_T_FMT " (Subject,Predicate,Object,Context) VALUES (" UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT "," UINT64_T_FMT ")";
+  char insert_statement[]="INSERT INTO Statements" UINT64_T_FMT " (Subject,Predicate,Object,Context) VALUES ($1,$2,$3,$4)";
+  char query[sizeof(insert_statement) + 20];
   u64 subject, predicate, object;
   PGconn *handle;
   int status = 1;
@@ -1381,6 +2470,35 @@ librdf_storage_postgresql_context_add_statement_helper(librdf_storage* storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
+  /* In bulk mode collect a COPY row */
+  if(context->bulk_handle) {
+    char row[4 * 21 + 1];
+
+    subject=librdf_storage_postgresql_node_hash(storage,
+                                                librdf_statement_get_subject(statement),1);
+    predicate=librdf_storage_postgresql_node_hash(storage,
+                                                  librdf_statement_get_predicate(statement),1);
+    object=librdf_storage_postgresql_node_hash(storage,
+                                               librdf_statement_get_object(statement),1);
+    if(!subject || !predicate || !object)
+      return 1;
+
+    sprintf(row, UINT64_T_FMT "\t" UINT64_T_FMT "\t" UINT64_T_FMT "\t" UINT64_T_FMT "\n",
+            subject, predicate, object, ctxt);
+    if(raptor_stringbuffer_append_string(context->copy_rows[COPY_STATEMENTS],
+                                         (const unsigned char*)row, 1))
+      return 1;
+
+    if(++context->copy_statements >= LIBRDF_STORAGE_POSTGRESQL_BULK_STATEMENTS)
+      return librdf_storage_postgresql_flush_bulk(storage);
+    return 0;
+  }
+
+  /* Pipelined, keeping duplicates as below */
+  if(context->pipeline)
+    return librdf_storage_postgresql_pipeline_add_statement(storage, ctxt,
+                                                            statement, 0);
+
   /* Get postgresql connection handle */
   if ((handle=librdf_storage_postgresql_get_handle(storage))) {
 
@@ -1392,96 +2510,220 @@ librdf_storage_postgresql_context_add_statement_helper(librdf_storage* storage,
     object=librdf_storage_postgresql_node_hash(storage,
                                           librdf_statement_get_object(statement),1);
     if(subject && predicate && object) {
-      char *query;
       PGresult *res;
+      u64 params[4];
+
+      params[0]=subject;
+      params[1]=predicate;
+      params[2]=object;
+      params[3]=ctxt;
+      sprintf(query, insert_statement, context->model);
+      if((res=librdf_storage_postgresql_exec_prepared(storage, handle,
+                                                      LIBRDF_STORAGE_POSTGRESQL_PREPARED_INSERT,
+                                                      query, 4, params))) {
+        if(PQresultStatus(res) == PGRES_COMMAND_OK) {
+          status = 0;
+        } else {
+          librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                     "postgresql insert into Statements failed: %s",
+                     PQresultErrorMessage(res));
+        }
+        PQclear(res);
+      } else {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                   "postgresql insert into Statements failed: %s",
+                   PQerrorMessage(handle));
+      }
+    }
+    librdf_storage_postgresql_release_handle(storage, handle);
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_contains_statement:
+ * @storage: the storage
+ * @statement: a complete statement
+ *
+ * INTERNAL - Test if a given complete statement is present in the model
+ *
+ * Return value: Non-zero if the model contains the statement.
+ **/
+static int
+librdf_storage_postgresql_contains_statement(librdf_storage* storage,
+                                             librdf_statement* statement)
+{
+  librdf_storage_postgresql_instance* context = (librdf_storage_postgresql_instance*)storage->instance;
+  char find_statement[]="SELECT 1 FROM Statements" UINT64_T_FMT " WHERE Subject=$1 AND Predicate=$2 AND Object=$3 limit 1";
+  char query[sizeof(find_statement) + 20];
+  u64 subject, predicate, object;
+  PGconn *handle;
+  int status = 0;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 0);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 0);
+
+  /* Get postgresql connection handle */
+  if ((handle=librdf_storage_postgresql_get_handle(storage))) {
+
+    /* Find hashes for nodes */
+    subject=librdf_storage_postgresql_node_hash(storage,
+                                           librdf_statement_get_subject(statement),0);
+    predicate=librdf_storage_postgresql_node_hash(storage,
+                                             librdf_statement_get_predicate(statement),0);
+    object=librdf_storage_postgresql_node_hash(storage,
+                                          librdf_statement_get_object(statement),0);
+
+    if(subject && predicate && object) {
+      PGresult *res;
+      u64 params[3];
+
+      params[0]=subject;
+      params[1]=predicate;
+      params[2]=object;
+      sprintf(query, find_statement, context->model);
+      if((res=librdf_storage_postgresql_exec_prepared(storage, handle,
+                                                      LIBRDF_STORAGE_POSTGRESQL_PREPARED_CONTAINS,
+                                                      query, 3, params))) {
+        if(PQresultStatus(res) == PGRES_TUPLES_OK) {
+          if(PQntuples(res)) {
+            status = 1;
+          }
+        } else {
+          librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                     "postgresql insert into Statements failed: %s",
+                     PQresultErrorMessage(res));
+        }
+        PQclear(res);
+      }
+    }
+    librdf_storage_postgresql_release_handle(storage, handle);
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_count_pattern - Count or check statements matching a pattern in the database
+ * @storage: the storage
+ * @subject: subject node or NULL to match any
+ * @predicate: predicate node or NULL to match any
+ * @object: object node or NULL to match any
+ * @exists: non-0 to only check whether there is a match
+ *
+ * Return value: number of matches (at most 1 if @exists) or <0 on failure
+ **/
+static int
+librdf_storage_postgresql_count_pattern(librdf_storage* storage,
+                                        librdf_node* subject,
+                                        librdf_node* predicate,
+                                        librdf_node* object,
+                                        int exists)
+{
+  librdf_storage_postgresql_instance* context = (librdf_storage_postgresql_instance*)storage->instance;
+  static const char* const columns[3]={ "Subject", "Predicate", "Object" };
+  librdf_node* nodes[3];
+  /* "SELECT COUNT(*) FROM Statements" + 3 * " AND Predicate=" + 4 u64s */
+  char query[256];
+  size_t len;
+  PGconn *handle;
+  PGresult *res;
+  int count = -1;
+  int i;
+  int need_and = 0;
+
+  nodes[0]=subject;
+  nodes[1]=predicate;
+  nodes[2]=object;
+
+  len=sprintf(query, "%s" UINT64_T_FMT,
+              exists ? "SELECT 1 FROM Statements" : "SELECT COUNT(*) FROM Statements",
+              context->model);
+
+  for(i=0; i < 3; i++) {
+    u64 hash;
+
+    if(!nodes[i])
+      continue;
+
+    hash=librdf_storage_postgresql_node_hash(storage, nodes[i], 0);
+    if(!hash)
+      return -1;
+
+    len+=sprintf(query+len, "%s%s=" UINT64_T_FMT,
+                 (need_and ? " AND " : " WHERE "), columns[i], hash);
+    need_and = 1;
+  }
+
+  if(exists)
+    strcpy(query+len, " LIMIT 1");
+
+  /* Get postgresql connection handle */
+  handle=librdf_storage_postgresql_get_handle(storage);
+  if(!handle)
+    return -1;
 
-      query = LIBRDF_MALLOC(char*, strlen(insert_statement) + (20 * 5) + 1);
-      if(query) {
-        sprintf(query, insert_statement, context->model, subject, predicate, object, ctxt);
-        if((res=PQexec(handle, query))) {
-          if(PQresultStatus(res) == PGRES_COMMAND_OK) {
-            status = 0;
-          } else {
-            librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                       "postgresql insert into Statements failed: %s",
-                       PQresultErrorMessage(res));
-          }
-          PQclear(res);
-        } else {
-          librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                     "postgresql insert into Statements failed: %s",
-                     PQerrorMessage(handle));
-        }
-        LIBRDF_FREE(char*, query);
-      }
+  if((res=PQexec(handle, query))) {
+    if(PQresultStatus(res) == PGRES_TUPLES_OK) {
+      if(exists)
+        count = (PQntuples(res) > 0);
+      else
+        count = PQntuples(res) ? atoi(PQgetvalue(res, 0, 0)) : 0;
+    } else {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql query for statement count failed: %s",
+                 PQresultErrorMessage(res));
     }
-    librdf_storage_postgresql_release_handle(storage, handle);
+    PQclear(res);
   }
 
-  return status;
+  librdf_storage_postgresql_release_handle(storage, handle);
+
+  return count;
 }
 
 
 /*
- * librdf_storage_postgresql_contains_statement:
+ * librdf_storage_postgresql_count_statements:
  * @storage: the storage
- * @statement: a complete statement
+ * @statement: partial statement to match
  *
- * INTERNAL - Test if a given complete statement is present in the model
+ * Count the statements matching a partial statement with SELECT COUNT(*).
  *
- * Return value: Non-zero if the model contains the statement.
+ * Return value: number of matching statements or <0 on failure
  **/
 static int
-librdf_storage_postgresql_contains_statement(librdf_storage* storage,
-                                             librdf_statement* statement)
+librdf_storage_postgresql_count_statements(librdf_storage* storage,
+                                           librdf_statement* statement)
 {
-  librdf_storage_postgresql_instance* context = (librdf_storage_postgresql_instance*)storage->instance;
-  char find_statement[]="SELECT 1 FROM Statements" UINT64_T_FMT " WHERE Subject=" UINT64_T_FMT " AND Predicate=" UINT64_T_FMT " AND Object=" UINT64_T_FMT " limit 1";
-  u64 subject, predicate, object;
-  PGconn *handle;
-  int status = 0;
-
-  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 0);
-  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 0);
+  return librdf_storage_postgresql_count_pattern(storage,
+                                                 librdf_statement_get_subject(statement),
+                                                 librdf_statement_get_predicate(statement),
+                                                 librdf_statement_get_object(statement),
+                                                 0);
+}
 
-  /* Get postgresql connection handle */
-  if ((handle=librdf_storage_postgresql_get_handle(storage))) {
 
-    /* Find hashes for nodes */
-    subject=librdf_storage_postgresql_node_hash(storage,
-                                           librdf_statement_get_subject(statement),0);
-    predicate=librdf_storage_postgresql_node_hash(storage,
-                                             librdf_statement_get_predicate(statement),0);
-    object=librdf_storage_postgresql_node_hash(storage,
-                                          librdf_statement_get_object(statement),0);
+static int
+librdf_storage_postgresql_has_arc_in(librdf_storage* storage,
+                                     librdf_node* node,
+                                     librdf_node* property)
+{
+  return librdf_storage_postgresql_count_pattern(storage, NULL, property, node,
+                                                 1) > 0;
+}
 
-    if(subject && predicate && object) {
-      char *query;
-      size_t len = strlen(find_statement)+(20*4)+1;
-      query = LIBRDF_MALLOC(char*, len);
-      if(query) {
-        PGresult *res;
-        snprintf(query, len, find_statement, context->model,
-                 subject, predicate, object);
-        if((res=PQexec(handle, query))) {
-          if(PQresultStatus(res) == PGRES_TUPLES_OK) {
-            if(PQntuples(res)) {
-              status = 1;
-            }
-          } else {
-            librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                       "postgresql insert into Statements failed: %s",
-                       PQresultErrorMessage(res));
-          }
-          PQclear(res);
-        }
-        LIBRDF_FREE(char*, query);
-      }
-    }
-    librdf_storage_postgresql_release_handle(storage, handle);
-  }
 
-  return status;
+static int
+librdf_storage_postgresql_has_arc_out(librdf_storage* storage,
+                                      librdf_node* node,
+                                      librdf_node* property)
+{
+  return librdf_storage_postgresql_count_pattern(storage, node, property, NULL,
+                                                 1) > 0;
 }
 
 
@@ -1717,6 +2959,124 @@ librdf_storage_postgresql_find_statements_in_context(librdf_storage* storage, li
 }
 
 
+/*
+ * librdf_storage_postgresql_find_statements_in_context_where:
+ * @where: WHERE clause being built
+ * @column: column to match
+ * @hash: node id
+ * @param: parameter number for the id or 0 to put it in the query
+ *
+ * INTERNAL - Add a column condition to a find query
+ **/
+static void
+librdf_storage_postgresql_find_statements_in_context_where(char *where,
+                                                           const char *column,
+                                                           u64 hash,
+                                                           int param)
+{
+  strcat(where, strlen(where) ? " AND " : " WHERE ");
+  strcat(where, column);
+  if(param)
+    sprintf(where + strlen(where), "=$%d", param);
+  else
+    sprintf(where + strlen(where), "=" UINT64_T_FMT, hash);
+}
+
+
+/*
+ * librdf_storage_postgresql_find_statements_in_context_fetch:
+ * @sos: find statements context
+ *
+ * INTERNAL - Fetch the next rows of a find query cursor into results
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_postgresql_find_statements_in_context_fetch(librdf_storage_postgresql_sos_context* sos)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)sos->storage->instance;
+  char query[64];
+
+  if(sos->results)
+    PQclear(sos->results);
+  sos->current_rowno=0;
+
+  sprintf(query, "FETCH %d FROM %s", context->fetch_size, sos->cursor);
+  sos->results=PQexec(sos->handle, query);
+  if(!sos->results || PQresultStatus(sos->results) != PGRES_TUPLES_OK) {
+    librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql fetch failed: %s",
+               sos->results ? PQresultErrorMessage(sos->results) : PQerrorMessage(sos->handle));
+    sos->cursor_done=1;
+    return 1;
+  }
+
+  if(PQntuples(sos->results) < context->fetch_size)
+    sos->cursor_done=1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_postgresql_find_statements_in_context_declare:
+ * @sos: find statements context
+ * @query: find query
+ * @nparams: number of parameters
+ * @params: node id parameters
+ *
+ * INTERNAL - Open a cursor for a find query and fetch the first rows
+ *
+ * Outside a transaction the cursor gets one of its own, on the
+ * connection kept by the stream.
+ *
+ * Return value: Non-zero on failure.
+ **/
+static int
+librdf_storage_postgresql_find_statements_in_context_declare(librdf_storage_postgresql_sos_context* sos,
+                                                             const char *query,
+                                                             int nparams,
+                                                             const u64* params)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)sos->storage->instance;
+  char *declare;
+  PGresult *res;
+  int status=1;
+
+  if(sos->handle != context->transaction_handle) {
+    if(librdf_storage_postgresql_command(sos->storage, sos->handle, "BEGIN"))
+      return 1;
+    sos->cursor_transaction=1;
+  }
+
+  declare=LIBRDF_MALLOC(char*, strlen(query) + 64);
+  if(!declare)
+    return 1;
+  sprintf(sos->cursor, "librdf_cursor%d", ++context->cursors);
+  sprintf(declare, "DECLARE %s NO SCROLL CURSOR FOR %s", sos->cursor, query);
+
+  res=librdf_storage_postgresql_exec_params(sos->handle, declare, nparams,
+                                            params);
+  if(res && PQresultStatus(res) == PGRES_COMMAND_OK)
+    status=0;
+  else {
+    librdf_log(sos->storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql cursor declaration failed: %s",
+               res ? PQresultErrorMessage(res) : PQerrorMessage(sos->handle));
+    /* nothing to close */
+    *sos->cursor='\0';
+  }
+  if(res)
+    PQclear(res);
+  LIBRDF_FREE(char*, declare);
+
+  if(!status)
+    status=librdf_storage_postgresql_find_statements_in_context_fetch(sos);
+
+  return status;
+}
+
+
 /*
  * librdf_storage_postgresql_find_statements_with_options:
  * @storage: the storage
@@ -1746,6 +3106,13 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
   char where[256];
   char joins[640];
   librdf_stream *stream;
+  /* node ids bound to the prepared statement parameters */
+  u64 params[4];
+  int params_count=0;
+  int shape=0;
+  int limit, offset, order;
+  /* values are in the query text instead of bound parameters */
+  int direct;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
 
@@ -1769,8 +3136,12 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
     sos->is_literal_match=librdf_hash_get_as_boolean(options, "match-substring");
   }
 
+  /* paged queries are not kept prepared since the paging varies */
+  direct=(librdf_storage_get_find_options(options, &limit, &offset, &order) ||
+          sos->is_literal_match);
+
   /* Get postgresql connection handle */
-  sos->handle=librdf_storage_postgresql_get_handle(storage);
+  sos->handle=librdf_storage_postgresql_get_read_handle(storage);
   if(!sos->handle) {
     librdf_storage_postgresql_find_statements_in_context_finished((void*)sos);
     return NULL;
@@ -1798,13 +3169,11 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
 
   /* Subject */
   if(statement && subject) {
-    sprintf(tmp, "S.Subject=" UINT64_T_FMT "",
-            librdf_storage_postgresql_node_hash(storage,subject,0));
-    if(!strlen(where))
-      strcat(where, " WHERE ");
-    else
-      strcat(where, " AND ");
-    strcat(where, tmp);
+    params[params_count++]=librdf_storage_postgresql_node_hash(storage,subject,0);
+    shape|=1;
+    librdf_storage_postgresql_find_statements_in_context_where(where, "S.Subject",
+                                                               params[params_count-1],
+                                                               direct ? 0 : params_count);
   } else {
     if(librdf_storage_postgresql_find_statements_in_context_augment_query(&query, " SubjectR.URI AS SuR, SubjectB.Name AS SuB")) {
       librdf_storage_postgresql_find_statements_in_context_finished((void*)sos);
@@ -1816,13 +3185,11 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
 
   /* Predicate */
   if(statement && predicate) {
-    sprintf(tmp, "S.Predicate=" UINT64_T_FMT "",
-            librdf_storage_postgresql_node_hash(storage, predicate, 0));
-    if(!strlen(where))
-      strcat(where, " WHERE ");
-    else
-      strcat(where, " AND ");
-    strcat(where, tmp);
+    params[params_count++]=librdf_storage_postgresql_node_hash(storage, predicate, 0);
+    shape|=2;
+    librdf_storage_postgresql_find_statements_in_context_where(where, "S.Predicate",
+                                                               params[params_count-1],
+                                                               direct ? 0 : params_count);
   } else {
     if(!statement || !subject) {
       if(librdf_storage_postgresql_find_statements_in_context_augment_query(&query, ",")) {
@@ -1840,13 +3207,11 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
   /* Object */
   if(statement && object) {
     if(!sos->is_literal_match) {
-      sprintf(tmp,"S.Object=" UINT64_T_FMT "",
-              librdf_storage_postgresql_node_hash(storage, object, 0));
-      if(!strlen(where))
-        strcat(where, " WHERE ");
-      else
-        strcat(where, " AND ");
-      strcat(where, tmp);
+      params[params_count++]=librdf_storage_postgresql_node_hash(storage, object, 0);
+      shape|=4;
+      librdf_storage_postgresql_find_statements_in_context_where(where, "S.Object",
+                                                                 params[params_count-1],
+                                                                 direct ? 0 : params_count);
     } else {
       /* MATCH literal, not hash_id */
       if(!statement || !subject || !predicate) {
@@ -1895,13 +3260,11 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
 
   /* Context */
   if(context_node) {
-    sprintf(tmp,"S.Context=" UINT64_T_FMT "",
-            librdf_storage_postgresql_node_hash(storage,context_node,0));
-    if(!strlen(where))
-      strcat(where, " WHERE ");
-    else
-      strcat(where, " AND ");
-    strcat(where, tmp);
+    params[params_count++]=librdf_storage_postgresql_node_hash(storage,context_node,0);
+    shape|=8;
+    librdf_storage_postgresql_find_statements_in_context_where(where, "S.Context",
+                                                               params[params_count-1],
+                                                               direct ? 0 : params_count);
   } else {
     if(!statement || !subject || !predicate || !object) {
       if(librdf_storage_postgresql_find_statements_in_context_augment_query(&query, ",")) {
@@ -1934,9 +3297,45 @@ librdf_storage_postgresql_find_statements_with_options(librdf_storage* storage,
     return NULL;
   }
 
+  if(limit >= 0 || offset > 0 || order) {
+    static const char* const order_columns[4]={ NULL, "S.Subject", "S.Predicate", "S.Object" };
+    char paging[96];
+
+    /* ordered by node id: stable, which is what paging needs */
+    *paging='\0';
+    if(order)
+      sprintf(paging, " ORDER BY %s", order_columns[order]);
+    if(limit >= 0)
+      sprintf(paging + strlen(paging), " LIMIT %d", limit);
+    if(offset > 0)
+      sprintf(paging + strlen(paging), " OFFSET %d", offset);
+
+    if(librdf_storage_postgresql_find_statements_in_context_augment_query(&query, paging)) {
+      librdf_storage_postgresql_find_statements_in_context_finished((void*)sos);
+      return NULL;
+    }
+  }
+
 
   /* Start query... */
-  sos->results=PQexec(sos->handle, query);
+  if(direct)
+    /* the text search has the matched string in the query so it
+     * is not kept prepared, nor are paged queries */
+    sos->results=PQexec(sos->handle, query);
+  else if(!(shape & 5) && context->fetch_size > 0) {
+    /* neither subject nor object given, such as serialising: read
+     * the rows a batch at a time through a cursor */
+    if(librdf_storage_postgresql_find_statements_in_context_declare(sos, query,
+                                                                     params_count,
+                                                                     params)) {
+      LIBRDF_FREE(char*, query);
+      librdf_storage_postgresql_find_statements_in_context_finished((void*)sos);
+      return NULL;
+    }
+  } else
+    sos->results=librdf_storage_postgresql_exec_prepared(storage, sos->handle,
+                                                         shape, query,
+                                                         params_count, params);
   LIBRDF_FREE(char*, query);
   if (sos->results) {
     if (PQresultStatus(sos->results) != PGRES_TUPLES_OK) {
@@ -2024,6 +3423,13 @@ librdf_storage_postgresql_find_statements_in_context_next_statement(void* contex
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, void, 1);
 
+  /* Next rows from the cursor? */
+  if(sos->current_rowno >= PQntuples(sos->results) &&
+     *sos->cursor && !sos->cursor_done) {
+    if(librdf_storage_postgresql_find_statements_in_context_fetch(sos))
+      return 1;
+  }
+
   if( sos->current_rowno < PQntuples(sos->results) ) {
      for(i=0;i<PQnfields(sos->results);i++) {
        if(PQgetlength(sos->results,sos->current_rowno,i) > 0 ) {
@@ -2216,6 +3622,16 @@ librdf_storage_postgresql_find_statements_in_context_finished(void* context)
   if(sos->results)
     PQclear(sos->results);
 
+  /* Close the cursor, with its transaction if it has one */
+  if(sos->cursor_transaction)
+    librdf_storage_postgresql_command(sos->storage, sos->handle, "COMMIT");
+  else if(*sos->cursor) {
+    char query[48];
+
+    sprintf(query, "CLOSE %s", sos->cursor);
+    librdf_storage_postgresql_command(sos->storage, sos->handle, query);
+  }
+
   if(sos->handle)
     librdf_storage_postgresql_release_handle(sos->storage, sos->handle);
 
@@ -2276,7 +3692,7 @@ LEFT JOIN Literals AS L ON S.Context=L.ID";
   gccontext->results=NULL;
 
   /* Get postgresql connection handle */
-  gccontext->handle=librdf_storage_postgresql_get_handle(storage);
+  gccontext->handle=librdf_storage_postgresql_get_read_handle(storage);
   if(!gccontext->handle) {
     librdf_storage_postgresql_get_contexts_finished((void*)gccontext);
     return NULL;
@@ -2476,6 +3892,7 @@ librdf_storage_postgresql_get_contexts_finished(void* context)
 static librdf_node*
 librdf_storage_postgresql_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
   unsigned char *uri_string;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
@@ -2497,6 +3914,15 @@ librdf_storage_postgresql_get_feature(librdf_storage* storage, librdf_uri* featu
                                               NULL, NULL);
   }
 
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_CONCURRENT_READS)) {
+    /* other connections do not see an open transaction's changes */
+    int shared=!context->transaction_handle;
+
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)(shared ? "1" : "0"),
+                                              NULL, NULL);
+  }
+
   return NULL;
 }
 
@@ -2597,6 +4023,12 @@ librdf_storage_postgresql_transaction_commit(librdf_storage* storage)
   if(!context->transaction_handle)
     return status;
 
+  /* A failed pipelined insert aborted the transaction */
+  if(librdf_storage_postgresql_pipeline_flush(storage)) {
+    librdf_storage_postgresql_transaction_rollback(storage);
+    return status;
+  }
+
   res = PQexec(context->transaction_handle, query);
   if (res) {
     if (PQresultStatus(res) == PGRES_COMMAND_OK) {
@@ -2616,6 +4048,9 @@ librdf_storage_postgresql_transaction_commit(librdf_storage* storage)
   librdf_storage_postgresql_release_handle(storage, context->transaction_handle);
   context->transaction_handle=NULL;
 
+  if(status && context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
+
   return status;
 }
 
@@ -2641,6 +4076,9 @@ librdf_storage_postgresql_transaction_rollback(librdf_storage* storage)
   if(!context->transaction_handle)
     return status;
 
+  /* Pipelined inserts are rolled back with the rest */
+  librdf_storage_postgresql_pipeline_flush(storage);
+
   res = PQexec(context->transaction_handle, query);
   if (res) {
     if (PQresultStatus(res) == PGRES_COMMAND_OK) {
@@ -2660,6 +4098,10 @@ librdf_storage_postgresql_transaction_rollback(librdf_storage* storage)
   librdf_storage_postgresql_release_handle(storage, context->transaction_handle);
   context->transaction_handle=NULL;
 
+  /* nodes cached during the transaction were never stored */
+  if(context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
+
   return status;
 }
 
@@ -2684,6 +4126,201 @@ librdf_storage_postgresql_transaction_get_handle(librdf_storage* storage)
 
 
 /* local function to register postgresql storage functions */
+/*
+ * librdf_storage_postgresql_node_id:
+ * @storage: the storage
+ * @node: the node
+ *
+ * INTERNAL - Get the id of a node without storing it
+ *
+ * Return value: node id
+ **/
+static u64
+librdf_storage_postgresql_node_id(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_postgresql_node_hash(storage, node, 0);
+}
+
+
+/*
+ * librdf_storage_postgresql_supports_query:
+ * @storage: the storage object
+ * @query: the query
+ *
+ * INTERNAL - Check if a query runs as a single SQL query
+ *
+ * Return value: non-0 if the query is supported.
+ **/
+static int
+librdf_storage_postgresql_supports_query(librdf_storage* storage,
+                                         librdf_query *query)
+{
+  librdf_storage_postgresql_instance *context=(librdf_storage_postgresql_instance*)storage->instance;
+
+  if(!context->sql_query)
+    return 0;
+
+  return librdf_query_rasqal_sql_supported(query);
+}
+
+
+/*
+ * librdf_storage_postgresql_set_running - INTERNAL - Record the query being run by query_execute
+ * @storage: the storage object
+ * @query: the query or NULL when it is done
+ * @cancel: libpq cancel object for the connection running it or NULL
+ *
+ * Any cancel object recorded before is freed.
+ */
+static void
+librdf_storage_postgresql_set_running(librdf_storage* storage,
+                                      librdf_query* query, PGcancel* cancel)
+{
+  librdf_storage_postgresql_instance *context=(librdf_storage_postgresql_instance*)storage->instance;
+  PGcancel* old_cancel;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(storage->world->mutex);
+#endif
+  old_cancel=context->running_cancel;
+  context->running_query=query;
+  context->running_cancel=cancel;
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(storage->world->mutex);
+#endif
+
+  if(old_cancel)
+    PQfreeCancel(old_cancel);
+}
+
+
+/*
+ * librdf_storage_postgresql_query_cancel:
+ * @storage: the storage object
+ * @query: the query
+ *
+ * INTERNAL - Ask the server to stop the SQL query run for a query, if any
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_postgresql_query_cancel(librdf_storage* storage,
+                                       librdf_query *query)
+{
+  librdf_storage_postgresql_instance *context=(librdf_storage_postgresql_instance*)storage->instance;
+  char errbuf[256];
+  int rc=0;
+
+#ifdef WITH_THREADS
+  pthread_mutex_lock(storage->world->mutex);
+#endif
+  if(context->running_query == query && context->running_cancel &&
+     !PQcancel(context->running_cancel, errbuf, sizeof(errbuf))) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql cancel failed: %s", errbuf);
+    rc=1;
+  }
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(storage->world->mutex);
+#endif
+
+  return rc;
+}
+
+
+/*
+ * librdf_storage_postgresql_query_execute:
+ * @storage: the storage object
+ * @query: the query
+ *
+ * INTERNAL - Run a SPARQL basic graph pattern query as one SQL join
+ *
+ * Return value: #librdf_query_results or NULL on failure
+ **/
+static librdf_query_results*
+librdf_storage_postgresql_query_execute(librdf_storage* storage,
+                                        librdf_query *query)
+{
+  librdf_storage_postgresql_instance *context=(librdf_storage_postgresql_instance*)storage->instance;
+  librdf_query_sql_schema schema;
+  char statements_table[31];
+  librdf_query_results* results=NULL;
+  const char** values=NULL;
+  char *sql;
+  PGconn *handle;
+  PGresult *res;
+  int columns;
+  int row;
+  int i;
+
+  sprintf(statements_table, "Statements" UINT64_T_FMT, context->model);
+  schema.statements_table=statements_table;
+  schema.model_condition=NULL;
+  schema.node_id=librdf_storage_postgresql_node_id;
+
+  sql=librdf_query_rasqal_to_sql(query, storage, &schema);
+  if(!sql)
+    return NULL;
+
+  handle=librdf_storage_postgresql_get_read_handle(storage);
+  if(!handle) {
+    LIBRDF_FREE(char*, sql);
+    return NULL;
+  }
+
+  librdf_storage_postgresql_set_running(storage, query, PQgetCancel(handle));
+  if(query->cancelled)
+    res=NULL;
+  else
+    res=PQexec(handle, sql);
+  librdf_storage_postgresql_set_running(storage, NULL, NULL);
+
+  if(query->cancelled)
+    goto tidy;
+
+  if(!res || PQresultStatus(res) != PGRES_TUPLES_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql query %s failed: %s", sql,
+               res ? PQresultErrorMessage(res) : PQerrorMessage(handle));
+    goto tidy;
+  }
+
+  columns=PQnfields(res);
+  values=LIBRDF_CALLOC(const char**, LIBRDF_GOOD_CAST(size_t, columns + 1),
+                       sizeof(char*));
+  results=librdf_query_rasqal_new_sql_results(query);
+  if(!values || !results)
+    goto tidy;
+
+  for(row=0; row < PQntuples(res); row++) {
+    if(query->cancelled) {
+      librdf_free_query_results(results);
+      results=NULL;
+      break;
+    }
+    for(i=0; i < columns; i++)
+      values[i]=PQgetisnull(res, row, i) ? NULL : PQgetvalue(res, row, i);
+    if(librdf_query_rasqal_add_sql_row(results, values)) {
+      librdf_free_query_results(results);
+      results=NULL;
+      break;
+    }
+  }
+  if(results)
+    librdf_query_rasqal_end_sql_results(results);
+
+  tidy:
+  if(values)
+    LIBRDF_FREE(char**, values);
+  if(res)
+    PQclear(res);
+  librdf_storage_postgresql_release_handle(storage, handle);
+  LIBRDF_FREE(char*, sql);
+
+  return results;
+}
+
+
 static void
 librdf_storage_postgresql_register_factory(librdf_storage_factory *factory)
 {
@@ -2700,6 +4337,8 @@ librdf_storage_postgresql_register_factory(librdf_storage_factory *factory)
   factory->add_statements     = librdf_storage_postgresql_add_statements;
   factory->remove_statement   = librdf_storage_postgresql_remove_statement;
   factory->contains_statement = librdf_storage_postgresql_contains_statement;
+  factory->has_arc_in         = librdf_storage_postgresql_has_arc_in;
+  factory->has_arc_out        = librdf_storage_postgresql_has_arc_out;
   factory->serialise          = librdf_storage_postgresql_serialise;
   factory->find_statements    = librdf_storage_postgresql_find_statements;
   factory->find_statements_with_options    = librdf_storage_postgresql_find_statements_with_options;
@@ -2717,6 +4356,10 @@ librdf_storage_postgresql_register_factory(librdf_storage_factory *factory)
   factory->transaction_commit            = librdf_storage_postgresql_transaction_commit;
   factory->transaction_rollback          = librdf_storage_postgresql_transaction_rollback;
   factory->transaction_get_handle        = librdf_storage_postgresql_transaction_get_handle;
+  factory->count_statements              = librdf_storage_postgresql_count_statements;
+  factory->supports_query                = librdf_storage_postgresql_supports_query;
+  factory->query_execute                 = librdf_storage_postgresql_query_execute;
+  factory->query_cancel                  = librdf_storage_postgresql_query_cancel;
 }
 
 #ifdef MODULAR_LIBRDF
@@ -0,0 +1,1072 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_sharded.c - RDF Storage partitioned by subject over several stores
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+
+#include <redland.h>
+
+
+/* Statements buffered per shard by add_statements before they are
+ * handed to the shard's own add_statements */
+#define LIBRDF_STORAGE_SHARDED_BATCH 4096
+
+
+/*
+ * The 'sharded' storage keeps each statement in one of several
+ * backend stores, chosen by a hash of the subject.  Adds, removes,
+ * contains checks and finds with a bound subject go to that one
+ * shard; other finds read every shard in turn.  The hash only depends
+ * on the subject so the store must always be opened with the same
+ * number of shards.
+ */
+
+typedef struct
+{
+  /* shards backend stores */
+  librdf_storage** shards;
+  int count;
+} librdf_storage_sharded_instance;
+
+
+/* A stream reading the streams of several shards one after another */
+typedef struct
+{
+  librdf_stream** streams;
+  int count;
+  int current;
+} librdf_storage_sharded_stream_context;
+
+
+/* A stream of statements buffered for one shard */
+typedef struct
+{
+  librdf_statement** statements;
+  int count;
+  int current;
+} librdf_storage_sharded_batch;
+
+
+/* prototypes for local functions */
+static int librdf_storage_sharded_init(librdf_storage* storage, const char *name, librdf_hash* options);
+static void librdf_storage_sharded_terminate(librdf_storage* storage);
+
+static void librdf_storage_sharded_register_factory(librdf_storage_factory *factory);
+
+
+/*
+ * librdf_storage_sharded_shard - INTERNAL - Get the shard holding statements of a subject
+ * @storage: sharded storage
+ * @subject: subject node
+ *
+ * Return value: shard index
+ */
+static int
+librdf_storage_sharded_shard(librdf_storage* storage, librdf_node* subject)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  unsigned long hash=2166136261UL;
+  const unsigned char *s=NULL;
+  size_t len=0;
+
+  switch(librdf_node_get_type(subject)) {
+    case LIBRDF_NODE_TYPE_RESOURCE:
+      s=librdf_uri_as_counted_string(librdf_node_get_uri(subject), &len);
+      break;
+
+    case LIBRDF_NODE_TYPE_BLANK:
+      s=librdf_node_get_blank_identifier(subject);
+      len=strlen((const char*)s);
+      break;
+
+    case LIBRDF_NODE_TYPE_LITERAL:
+    case LIBRDF_NODE_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  /* FNV-1a; must not change or stored statements are not found */
+  while(len--) {
+    hash ^= *s++;
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+
+  return (int)(hash % (unsigned long)context->count);
+}
+
+
+/* functions implementing storage api */
+static int
+librdf_storage_sharded_init(librdf_storage* storage, const char *name,
+                            librdf_hash* options)
+{
+  librdf_storage_sharded_instance* context;
+  char *backend=NULL;
+  char *dirs=NULL;
+  char *shard_name=NULL;
+  char *dir=NULL;
+  const char *d;
+  long count;
+  int i;
+  int rc=1;
+
+  context=LIBRDF_CALLOC(librdf_storage_sharded_instance*, 1, sizeof(*context));
+  if(!context)
+    goto done;
+
+  librdf_storage_set_instance(storage, context);
+
+  backend=librdf_hash_get_del(options, "backend");
+  count=librdf_hash_get_as_long(options, "shards");
+  if(!backend || !strcmp(backend, storage->factory->name) || count < 1) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Storage %s needs backend and shards storage options",
+               storage->factory->name);
+    goto done;
+  }
+
+  /* shard i is made in the i-th of the comma separated dirs, cycling */
+  dirs=librdf_hash_get_del(options, "dirs");
+  if(dirs) {
+    dir=LIBRDF_MALLOC(char*, strlen(dirs) + 1);
+    if(!dir)
+      goto done;
+  }
+
+  if(name) {
+    /* name"-"shard index */
+    shard_name=LIBRDF_MALLOC(char*, strlen(name) + 12);
+    if(!shard_name)
+      goto done;
+  }
+
+  context->shards=LIBRDF_CALLOC(librdf_storage**, (size_t)count,
+                                sizeof(librdf_storage*));
+  if(!context->shards)
+    goto done;
+  context->count=(int)count;
+
+  d=dirs;
+  for(i=0; i < context->count; i++) {
+    if(dirs) {
+      size_t len=strcspn(d, ",");
+      char *old_dir;
+
+      memcpy(dir, d, len);
+      dir[len]='\0';
+      d += len;
+      d=*d ? d + 1 : dirs;
+
+      old_dir=librdf_hash_get_del(options, "dir");
+      if(old_dir)
+        LIBRDF_FREE(char*, old_dir);
+      if(librdf_hash_put_strings(options, "dir", dir))
+        goto done;
+    }
+
+    if(shard_name)
+      sprintf(shard_name, "%s-%d", name, i);
+
+    context->shards[i]=librdf_new_storage_with_options(storage->world,
+                                                       backend, shard_name,
+                                                       options);
+    if(!context->shards[i])
+      goto done;
+  }
+
+  rc=0;
+
+  done:
+  if(backend)
+    LIBRDF_FREE(char*, backend);
+  if(dirs)
+    LIBRDF_FREE(char*, dirs);
+  if(dir)
+    LIBRDF_FREE(char*, dir);
+  if(shard_name)
+    LIBRDF_FREE(char*, shard_name);
+
+  /* no more options, might as well free them now */
+  if(options)
+    librdf_free_hash(options);
+
+  return rc;
+}
+
+
+static void
+librdf_storage_sharded_terminate(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int i;
+
+  if(context == NULL)
+    return;
+
+  if(context->shards) {
+    for(i=0; i < context->count; i++) {
+      if(context->shards[i])
+        librdf_free_storage(context->shards[i]);
+    }
+    LIBRDF_FREE(librdf_storage**, context->shards);
+  }
+
+  LIBRDF_FREE(librdf_storage_sharded_instance, context);
+}
+
+
+static int
+librdf_storage_sharded_open(librdf_storage* storage, librdf_model* model)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_open(context->shards[i], model)) {
+      while(--i >= 0)
+        librdf_storage_close(context->shards[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_storage_sharded_close(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_close(context->shards[i]))
+      status=1;
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_sharded_size(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int size=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    int shard_size=librdf_storage_size(context->shards[i]);
+
+    if(shard_size < 0)
+      return -1;
+    size += shard_size;
+  }
+
+  return size;
+}
+
+
+static int
+librdf_storage_sharded_add_statement(librdf_storage* storage,
+                                     librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard;
+
+  shard=librdf_storage_sharded_shard(storage,
+                                     librdf_statement_get_subject(statement));
+  return librdf_storage_add_statement(context->shards[shard], statement);
+}
+
+
+static int
+librdf_storage_sharded_batch_end_of_stream(void* context)
+{
+  librdf_storage_sharded_batch* batch=(librdf_storage_sharded_batch*)context;
+
+  return batch->current >= batch->count;
+}
+
+
+static int
+librdf_storage_sharded_batch_next_statement(void* context)
+{
+  librdf_storage_sharded_batch* batch=(librdf_storage_sharded_batch*)context;
+
+  if(batch->current < batch->count)
+    batch->current++;
+  return batch->current >= batch->count;
+}
+
+
+static void*
+librdf_storage_sharded_batch_get_statement(void* context, int flags)
+{
+  librdf_storage_sharded_batch* batch=(librdf_storage_sharded_batch*)context;
+
+  if(batch->current >= batch->count ||
+     flags != LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+    return NULL;
+
+  return batch->statements[batch->current];
+}
+
+
+static void
+librdf_storage_sharded_batch_finished(void* context)
+{
+  /* the batch belongs to add_statements */
+}
+
+
+/*
+ * librdf_storage_sharded_add_batch - INTERNAL - Add and empty the statements buffered for one shard
+ * @storage: sharded storage
+ * @shard: shard index
+ * @batch: statements buffered for the shard
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_sharded_add_batch(librdf_storage* storage, int shard,
+                                 librdf_storage_sharded_batch* batch)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_stream* stream;
+  int status=1;
+  int i;
+
+  if(!batch->count)
+    return 0;
+
+  batch->current=0;
+  stream=librdf_new_stream(storage->world, (void*)batch,
+                           &librdf_storage_sharded_batch_end_of_stream,
+                           &librdf_storage_sharded_batch_next_statement,
+                           &librdf_storage_sharded_batch_get_statement,
+                           &librdf_storage_sharded_batch_finished);
+  if(stream) {
+    status=librdf_storage_add_statements(context->shards[shard], stream);
+    librdf_free_stream(stream);
+  }
+
+  for(i=0; i < batch->count; i++)
+    librdf_free_statement(batch->statements[i]);
+  batch->count=0;
+
+  return status;
+}
+
+
+/* Statements are sorted into a batch per shard so each shard gets
+ * them in large add_statements calls, such as for its bulk load */
+static int
+librdf_storage_sharded_add_statements(librdf_storage* storage,
+                                      librdf_stream* statement_stream)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_storage_sharded_batch* batches;
+  int status=0;
+  int i;
+
+  batches=LIBRDF_CALLOC(librdf_storage_sharded_batch*, (size_t)context->count,
+                        sizeof(*batches));
+  if(!batches)
+    return 1;
+
+  for(i=0; i < context->count; i++) {
+    batches[i].statements=LIBRDF_MALLOC(librdf_statement**,
+                                        LIBRDF_STORAGE_SHARDED_BATCH * sizeof(librdf_statement*));
+    if(!batches[i].statements) {
+      status=1;
+      goto tidy;
+    }
+  }
+
+  while(!status && !librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+    librdf_storage_sharded_batch* batch;
+    int shard;
+
+    if(!statement) {
+      status=1;
+      break;
+    }
+
+    shard=librdf_storage_sharded_shard(storage,
+                                       librdf_statement_get_subject(statement));
+    batch=&batches[shard];
+    batch->statements[batch->count]=librdf_new_statement_from_statement(statement);
+    if(!batch->statements[batch->count]) {
+      status=1;
+      break;
+    }
+    batch->count++;
+
+    if(batch->count == LIBRDF_STORAGE_SHARDED_BATCH)
+      status=librdf_storage_sharded_add_batch(storage, shard, batch);
+
+    librdf_stream_next(statement_stream);
+  }
+
+  for(i=0; i < context->count && !status; i++)
+    status=librdf_storage_sharded_add_batch(storage, i, &batches[i]);
+
+  tidy:
+  for(i=0; i < context->count; i++) {
+    if(batches[i].statements) {
+      int j;
+
+      for(j=0; j < batches[i].count; j++)
+        librdf_free_statement(batches[i].statements[j]);
+      LIBRDF_FREE(librdf_statement**, batches[i].statements);
+    }
+  }
+  LIBRDF_FREE(librdf_storage_sharded_batch, batches);
+
+  return status;
+}
+
+
+static int
+librdf_storage_sharded_remove_statement(librdf_storage* storage,
+                                        librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard;
+
+  shard=librdf_storage_sharded_shard(storage,
+                                     librdf_statement_get_subject(statement));
+  return librdf_storage_remove_statement(context->shards[shard], statement);
+}
+
+
+static int
+librdf_storage_sharded_contains_statement(librdf_storage* storage,
+                                          librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard;
+
+  shard=librdf_storage_sharded_shard(storage,
+                                     librdf_statement_get_subject(statement));
+  return librdf_storage_contains_statement(context->shards[shard], statement);
+}
+
+
+static int
+librdf_storage_sharded_stream_end_of_stream(void* context)
+{
+  librdf_storage_sharded_stream_context* scontext=(librdf_storage_sharded_stream_context*)context;
+
+  return scontext->current >= scontext->count;
+}
+
+
+/* move to the first statement at or after the current shard stream */
+static void
+librdf_storage_sharded_stream_skip(librdf_storage_sharded_stream_context* scontext)
+{
+  while(scontext->current < scontext->count &&
+        librdf_stream_end(scontext->streams[scontext->current]))
+    scontext->current++;
+}
+
+
+static int
+librdf_storage_sharded_stream_next_statement(void* context)
+{
+  librdf_storage_sharded_stream_context* scontext=(librdf_storage_sharded_stream_context*)context;
+
+  if(scontext->current >= scontext->count)
+    return 1;
+
+  librdf_stream_next(scontext->streams[scontext->current]);
+  librdf_storage_sharded_stream_skip(scontext);
+
+  return scontext->current >= scontext->count;
+}
+
+
+static void*
+librdf_storage_sharded_stream_get_statement(void* context, int flags)
+{
+  librdf_storage_sharded_stream_context* scontext=(librdf_storage_sharded_stream_context*)context;
+  librdf_stream* stream;
+
+  if(scontext->current >= scontext->count)
+    return NULL;
+
+  stream=scontext->streams[scontext->current];
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(stream);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(stream);
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_sharded_stream_finished(void* context)
+{
+  librdf_storage_sharded_stream_context* scontext=(librdf_storage_sharded_stream_context*)context;
+  int i;
+
+  for(i=0; i < scontext->count; i++) {
+    if(scontext->streams[i])
+      librdf_free_stream(scontext->streams[i]);
+  }
+  LIBRDF_FREE(librdf_stream**, scontext->streams);
+  LIBRDF_FREE(librdf_storage_sharded_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_sharded_find_all - INTERNAL - Read a find from every shard
+ * @storage: sharded storage
+ * @statement: statement to find or NULL for all statements
+ * @context_node: context node or NULL
+ *
+ * The finds are started in every shard before the first statement is
+ * read, so a database backend runs its query for each up front.
+ *
+ * Return value: new stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_sharded_find_all(librdf_storage* storage,
+                                librdf_statement* statement,
+                                librdf_node* context_node)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_storage_sharded_stream_context* scontext;
+  librdf_stream* stream;
+  int i;
+
+  scontext=LIBRDF_CALLOC(librdf_storage_sharded_stream_context*, 1,
+                         sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  scontext->streams=LIBRDF_CALLOC(librdf_stream**, (size_t)context->count,
+                                  sizeof(librdf_stream*));
+  if(!scontext->streams) {
+    LIBRDF_FREE(librdf_storage_sharded_stream_context, scontext);
+    return NULL;
+  }
+  scontext->count=context->count;
+
+  for(i=0; i < context->count; i++) {
+    librdf_storage* shard=context->shards[i];
+
+    if(context_node && statement)
+      stream=librdf_storage_find_statements_in_context(shard, statement,
+                                                       context_node);
+    else if(context_node)
+      stream=librdf_storage_context_as_stream(shard, context_node);
+    else if(statement)
+      stream=librdf_storage_find_statements(shard, statement);
+    else
+      stream=librdf_storage_serialise(shard);
+
+    if(!stream) {
+      librdf_storage_sharded_stream_finished(scontext);
+      return NULL;
+    }
+    scontext->streams[i]=stream;
+  }
+
+  librdf_storage_sharded_stream_skip(scontext);
+
+  stream=librdf_new_stream(storage->world, (void*)scontext,
+                           &librdf_storage_sharded_stream_end_of_stream,
+                           &librdf_storage_sharded_stream_next_statement,
+                           &librdf_storage_sharded_stream_get_statement,
+                           &librdf_storage_sharded_stream_finished);
+  if(!stream)
+    librdf_storage_sharded_stream_finished(scontext);
+
+  return stream;
+}
+
+
+static librdf_stream*
+librdf_storage_sharded_serialise(librdf_storage* storage)
+{
+  return librdf_storage_sharded_find_all(storage, NULL, NULL);
+}
+
+
+static librdf_stream*
+librdf_storage_sharded_find_statements(librdf_storage* storage,
+                                       librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_node* subject=librdf_statement_get_subject(statement);
+
+  if(subject) {
+    int shard=librdf_storage_sharded_shard(storage, subject);
+
+    return librdf_storage_find_statements(context->shards[shard], statement);
+  }
+
+  return librdf_storage_sharded_find_all(storage, statement, NULL);
+}
+
+
+static librdf_iterator*
+librdf_storage_sharded_find_targets(librdf_storage* storage,
+                                    librdf_node* source, librdf_node *arc)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard=librdf_storage_sharded_shard(storage, source);
+
+  return librdf_storage_get_targets(context->shards[shard], source, arc);
+}
+
+
+static librdf_iterator*
+librdf_storage_sharded_get_arcs_out(librdf_storage* storage, librdf_node* node)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard=librdf_storage_sharded_shard(storage, node);
+
+  return librdf_storage_get_arcs_out(context->shards[shard], node);
+}
+
+
+static int
+librdf_storage_sharded_has_arc_out(librdf_storage* storage, librdf_node* node,
+                                   librdf_node* property)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard=librdf_storage_sharded_shard(storage, node);
+
+  return librdf_storage_has_arc_out(context->shards[shard], node, property);
+}
+
+
+static int
+librdf_storage_sharded_context_add_statement(librdf_storage* storage,
+                                             librdf_node* context_node,
+                                             librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard;
+
+  shard=librdf_storage_sharded_shard(storage,
+                                     librdf_statement_get_subject(statement));
+  return librdf_storage_context_add_statement(context->shards[shard],
+                                              context_node, statement);
+}
+
+
+static int
+librdf_storage_sharded_context_remove_statement(librdf_storage* storage,
+                                                librdf_node* context_node,
+                                                librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int shard;
+
+  shard=librdf_storage_sharded_shard(storage,
+                                     librdf_statement_get_subject(statement));
+  return librdf_storage_context_remove_statement(context->shards[shard],
+                                                 context_node, statement);
+}
+
+
+static int
+librdf_storage_sharded_context_remove_statements(librdf_storage* storage,
+                                                 librdf_node* context_node)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_context_remove_statements(context->shards[i],
+                                                context_node))
+      status=1;
+  }
+
+  return status;
+}
+
+
+static librdf_stream*
+librdf_storage_sharded_context_serialise(librdf_storage* storage,
+                                         librdf_node* context_node)
+{
+  return librdf_storage_sharded_find_all(storage, NULL, context_node);
+}
+
+
+static librdf_stream*
+librdf_storage_sharded_find_statements_in_context(librdf_storage* storage,
+                                                  librdf_statement* statement,
+                                                  librdf_node* context_node)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_node* subject=librdf_statement_get_subject(statement);
+
+  if(subject) {
+    int shard=librdf_storage_sharded_shard(storage, subject);
+
+    return librdf_storage_find_statements_in_context(context->shards[shard],
+                                                     statement, context_node);
+  }
+
+  return librdf_storage_sharded_find_all(storage, statement, context_node);
+}
+
+
+typedef struct
+{
+  librdf_node** nodes;
+  int count;
+  int current;
+} librdf_storage_sharded_contexts_iterator_context;
+
+
+static int
+librdf_storage_sharded_contexts_is_end(void* iterator)
+{
+  librdf_storage_sharded_contexts_iterator_context* icontext=(librdf_storage_sharded_contexts_iterator_context*)iterator;
+
+  return icontext->current >= icontext->count;
+}
+
+
+static int
+librdf_storage_sharded_contexts_next_method(void* iterator)
+{
+  librdf_storage_sharded_contexts_iterator_context* icontext=(librdf_storage_sharded_contexts_iterator_context*)iterator;
+
+  if(icontext->current < icontext->count)
+    icontext->current++;
+  return icontext->current >= icontext->count;
+}
+
+
+static void*
+librdf_storage_sharded_contexts_get_method(void* iterator, int flags)
+{
+  librdf_storage_sharded_contexts_iterator_context* icontext=(librdf_storage_sharded_contexts_iterator_context*)iterator;
+
+  if(icontext->current >= icontext->count ||
+     flags != LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT)
+    return NULL;
+
+  return icontext->nodes[icontext->current];
+}
+
+
+static void
+librdf_storage_sharded_contexts_finished(void* iterator)
+{
+  librdf_storage_sharded_contexts_iterator_context* icontext=(librdf_storage_sharded_contexts_iterator_context*)iterator;
+  int i;
+
+  for(i=0; i < icontext->count; i++)
+    librdf_free_node(icontext->nodes[i]);
+  if(icontext->nodes)
+    LIBRDF_FREE(librdf_node**, icontext->nodes);
+  LIBRDF_FREE(librdf_storage_sharded_contexts_iterator_context, icontext);
+}
+
+
+/* A context is usually in several shards so the contexts are read
+ * from every shard first and each is returned once */
+static librdf_iterator*
+librdf_storage_sharded_get_contexts(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_storage_sharded_contexts_iterator_context* icontext;
+  librdf_iterator* iterator;
+  int size=0;
+  int i;
+
+  icontext=LIBRDF_CALLOC(librdf_storage_sharded_contexts_iterator_context*, 1,
+                         sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  for(i=0; i < context->count; i++) {
+    iterator=librdf_storage_get_contexts(context->shards[i]);
+    if(!iterator) {
+      librdf_storage_sharded_contexts_finished(icontext);
+      return NULL;
+    }
+
+    while(!librdf_iterator_end(iterator)) {
+      librdf_node* node=(librdf_node*)librdf_iterator_get_object(iterator);
+      int j;
+
+      for(j=0; node && j < icontext->count; j++) {
+        if(librdf_node_equals(icontext->nodes[j], node))
+          break;
+      }
+
+      if(node && j == icontext->count) {
+        if(icontext->count == size) {
+          librdf_node** new_nodes;
+
+          size=size ? size * 2 : 16;
+          new_nodes=LIBRDF_MALLOC(librdf_node**, size * sizeof(librdf_node*));
+          if(!new_nodes) {
+            librdf_free_iterator(iterator);
+            librdf_storage_sharded_contexts_finished(icontext);
+            return NULL;
+          }
+          if(icontext->nodes) {
+            memcpy(new_nodes, icontext->nodes,
+                   icontext->count * sizeof(librdf_node*));
+            LIBRDF_FREE(librdf_node**, icontext->nodes);
+          }
+          icontext->nodes=new_nodes;
+        }
+        icontext->nodes[icontext->count++]=librdf_new_node_from_node(node);
+      }
+
+      librdf_iterator_next(iterator);
+    }
+    librdf_free_iterator(iterator);
+  }
+
+  iterator=librdf_new_iterator(storage->world, (void*)icontext,
+                               librdf_storage_sharded_contexts_is_end,
+                               librdf_storage_sharded_contexts_next_method,
+                               librdf_storage_sharded_contexts_get_method,
+                               librdf_storage_sharded_contexts_finished);
+  if(!iterator)
+    librdf_storage_sharded_contexts_finished(icontext);
+  return iterator;
+}
+
+
+static int
+librdf_storage_sharded_sync(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_sync(context->shards[i]))
+      status=1;
+  }
+
+  return status;
+}
+
+
+/* all shards are the same kind of store, so ask the first */
+static librdf_node*
+librdf_storage_sharded_get_feature(librdf_storage* storage, librdf_uri* feature)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+
+  return librdf_storage_get_feature(context->shards[0], feature);
+}
+
+
+static int
+librdf_storage_sharded_set_feature(librdf_storage* storage, librdf_uri* feature,
+                                   librdf_node* value)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    int rc=librdf_storage_set_feature(context->shards[i], feature, value);
+
+    if(rc)
+      status=rc;
+  }
+
+  return status;
+}
+
+
+/* Each shard runs a transaction of its own; the commit is not atomic
+ * across shards */
+static int
+librdf_storage_sharded_transaction_start(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_transaction_start(context->shards[i])) {
+      while(--i >= 0)
+        librdf_storage_transaction_rollback(context->shards[i]);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_storage_sharded_transaction_commit(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_transaction_commit(context->shards[i]))
+      status=1;
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_sharded_transaction_rollback(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  int status=0;
+  int i;
+
+  for(i=0; i < context->count; i++) {
+    if(librdf_storage_transaction_rollback(context->shards[i]))
+      status=1;
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_sharded_count_statements(librdf_storage* storage,
+                                        librdf_statement* statement)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  librdf_node* subject=librdf_statement_get_subject(statement);
+  int count=0;
+  int i;
+
+  if(subject) {
+    int shard=librdf_storage_sharded_shard(storage, subject);
+
+    return librdf_storage_count_statements(context->shards[shard], statement);
+  }
+
+  for(i=0; i < context->count; i++) {
+    int shard_count=librdf_storage_count_statements(context->shards[i],
+                                                    statement);
+
+    if(shard_count < 0)
+      return -1;
+    count += shard_count;
+  }
+
+  return count;
+}
+
+
+static size_t
+librdf_storage_sharded_get_memory_size(librdf_storage* storage)
+{
+  librdf_storage_sharded_instance* context=(librdf_storage_sharded_instance*)storage->instance;
+  size_t size=sizeof(*context);
+  int i;
+
+  for(i=0; i < context->count; i++)
+    size += librdf_storage_get_memory_size(context->shards[i]);
+
+  return size;
+}
+
+
+/* local function to register sharded storage functions */
+static void
+librdf_storage_sharded_register_factory(librdf_storage_factory *factory)
+{
+  factory->version            = LIBRDF_STORAGE_INTERFACE_VERSION;
+  factory->init               = librdf_storage_sharded_init;
+  factory->terminate          = librdf_storage_sharded_terminate;
+  factory->open               = librdf_storage_sharded_open;
+  factory->close              = librdf_storage_sharded_close;
+  factory->size               = librdf_storage_sharded_size;
+  factory->add_statement      = librdf_storage_sharded_add_statement;
+  factory->add_statements     = librdf_storage_sharded_add_statements;
+  factory->remove_statement   = librdf_storage_sharded_remove_statement;
+  factory->contains_statement = librdf_storage_sharded_contains_statement;
+  factory->serialise          = librdf_storage_sharded_serialise;
+  factory->find_statements    = librdf_storage_sharded_find_statements;
+  factory->find_targets       = librdf_storage_sharded_find_targets;
+  factory->get_arcs_out       = librdf_storage_sharded_get_arcs_out;
+  factory->has_arc_out        = librdf_storage_sharded_has_arc_out;
+  factory->context_add_statement     = librdf_storage_sharded_context_add_statement;
+  factory->context_remove_statement  = librdf_storage_sharded_context_remove_statement;
+  factory->context_remove_statements = librdf_storage_sharded_context_remove_statements;
+  factory->context_serialise         = librdf_storage_sharded_context_serialise;
+  factory->find_statements_in_context = librdf_storage_sharded_find_statements_in_context;
+  factory->get_contexts              = librdf_storage_sharded_get_contexts;
+  factory->sync                      = librdf_storage_sharded_sync;
+  factory->get_feature               = librdf_storage_sharded_get_feature;
+  factory->set_feature               = librdf_storage_sharded_set_feature;
+  factory->transaction_start         = librdf_storage_sharded_transaction_start;
+  factory->transaction_commit        = librdf_storage_sharded_transaction_commit;
+  factory->transaction_rollback      = librdf_storage_sharded_transaction_rollback;
+  factory->count_statements          = librdf_storage_sharded_count_statements;
+  factory->get_memory_size           = librdf_storage_sharded_get_memory_size;
+}
+
+
+/**
+ * librdf_init_storage_sharded:
+ * @world: world object
+ *
+ * INTERNAL - Initialise the built-in storage_sharded module.
+ */
+void
+librdf_init_storage_sharded(librdf_world *world)
+{
+  librdf_storage_register_factory(world, "sharded",
+                                  "Statements partitioned by subject over several stores",
+                                  &librdf_storage_sharded_register_factory);
+}
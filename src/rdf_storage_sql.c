@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 /* for access() and R_OK */
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
@@ -230,3 +231,540 @@ librdf_free_sql_config(librdf_sql_config* config)
 
   LIBRDF_FREE(char*, config);
 }
+
+
+/*
+ * Node to database id cache for the SQL storages.
+ *
+ * A fixed number of entries reached through a chained hash table and
+ * evicted with the CLOCK algorithm: each hit sets the entry's
+ * referenced flag and the hand clears flags as it passes, taking the
+ * first entry that was not used since the last sweep.
+ */
+
+typedef struct
+{
+  librdf_node* node;
+  unsigned long hash;
+  u64 id;
+  int referenced;
+  /* next entry index in the bucket chain or -1 */
+  int next;
+} librdf_sql_node_cache_entry;
+
+struct librdf_sql_node_cache_s
+{
+  int size;
+  int count;
+  int hand;
+
+  /* size entries */
+  librdf_sql_node_cache_entry* entries;
+
+  /* buckets_mask+1 bucket chain heads or -1 */
+  int* buckets;
+  unsigned long buckets_mask;
+};
+
+
+static unsigned long
+librdf_sql_node_cache_hash_bytes(unsigned long hash,
+                                 const unsigned char* p, size_t len)
+{
+  /* FNV-1a */
+  while(len--) {
+    hash ^= *p++;
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+
+static unsigned long
+librdf_sql_node_cache_node_hash(librdf_node* node)
+{
+  unsigned long hash = 2166136261UL;
+  const unsigned char *s;
+  size_t len;
+  librdf_uri* dt;
+
+  hash ^= (unsigned long)librdf_node_get_type(node);
+
+  switch(librdf_node_get_type(node)) {
+    case LIBRDF_NODE_TYPE_RESOURCE:
+      s = librdf_uri_as_counted_string(librdf_node_get_uri(node), &len);
+      hash = librdf_sql_node_cache_hash_bytes(hash, s, len);
+      break;
+
+    case LIBRDF_NODE_TYPE_LITERAL:
+      s = librdf_node_get_literal_value_as_counted_string(node, &len);
+      hash = librdf_sql_node_cache_hash_bytes(hash, s, len);
+      s = (const unsigned char*)librdf_node_get_literal_value_language(node);
+      if(s)
+        hash = librdf_sql_node_cache_hash_bytes(hash, s, strlen((const char*)s));
+      dt = librdf_node_get_literal_value_datatype_uri(node);
+      if(dt) {
+        s = librdf_uri_as_counted_string(dt, &len);
+        hash = librdf_sql_node_cache_hash_bytes(hash, s, len);
+      }
+      break;
+
+    case LIBRDF_NODE_TYPE_BLANK:
+      s = librdf_node_get_blank_identifier(node);
+      hash = librdf_sql_node_cache_hash_bytes(hash, s, strlen((const char*)s));
+      break;
+
+    case LIBRDF_NODE_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  return hash;
+}
+
+
+/**
+ * librdf_new_sql_node_cache:
+ * @size: maximum number of nodes to keep
+ * 
+ * Constructor - Create a cache of node database ids for a SQL storage.
+ * 
+ * Return value: new cache or NULL on failure or if @size is not positive
+ **/
+librdf_sql_node_cache*
+librdf_new_sql_node_cache(int size)
+{
+  librdf_sql_node_cache* cache;
+  unsigned long buckets = 1;
+  unsigned long i;
+
+  if(size <= 0)
+    return NULL;
+
+  while(buckets < (unsigned long)size * 2)
+    buckets <<= 1;
+
+  cache = LIBRDF_CALLOC(librdf_sql_node_cache*, 1, sizeof(*cache));
+  if(!cache)
+    return NULL;
+
+  cache->size = size;
+  cache->buckets_mask = buckets - 1;
+
+  cache->entries = LIBRDF_CALLOC(librdf_sql_node_cache_entry*, size,
+                                 sizeof(librdf_sql_node_cache_entry));
+  cache->buckets = LIBRDF_MALLOC(int*, buckets * sizeof(int));
+  if(!cache->entries || !cache->buckets) {
+    librdf_free_sql_node_cache(cache);
+    return NULL;
+  }
+
+  for(i = 0; i < buckets; i++)
+    cache->buckets[i] = -1;
+
+  return cache;
+}
+
+
+/**
+ * librdf_free_sql_node_cache:
+ * @cache: node cache
+ * 
+ * Destructor - free a node cache.
+ **/
+void
+librdf_free_sql_node_cache(librdf_sql_node_cache* cache)
+{
+  if(cache->entries) {
+    librdf_sql_node_cache_clear(cache);
+    LIBRDF_FREE(librdf_sql_node_cache_entry*, cache->entries);
+  }
+
+  if(cache->buckets)
+    LIBRDF_FREE(int*, cache->buckets);
+
+  LIBRDF_FREE(librdf_sql_node_cache, cache);
+}
+
+
+/**
+ * librdf_sql_node_cache_clear:
+ * @cache: node cache
+ * 
+ * Forget all cached nodes, such as after a rolled back transaction.
+ **/
+void
+librdf_sql_node_cache_clear(librdf_sql_node_cache* cache)
+{
+  unsigned long i;
+
+  for(i = 0; i < (unsigned long)cache->count; i++) {
+    librdf_free_node(cache->entries[i].node);
+    cache->entries[i].node = NULL;
+  }
+
+  for(i = 0; i <= cache->buckets_mask; i++)
+    cache->buckets[i] = -1;
+
+  cache->count = 0;
+  cache->hand = 0;
+}
+
+
+/**
+ * librdf_sql_node_cache_get:
+ * @cache: node cache
+ * @node: node to look up
+ * @id_p: pointer to store the node id
+ * 
+ * Look up the database id of a node.
+ * 
+ * Return value: non 0 if the node was found
+ **/
+int
+librdf_sql_node_cache_get(librdf_sql_node_cache* cache, librdf_node* node,
+                          u64* id_p)
+{
+  unsigned long hash;
+  int i;
+
+  hash = librdf_sql_node_cache_node_hash(node);
+
+  for(i = cache->buckets[hash & cache->buckets_mask]; i >= 0;
+      i = cache->entries[i].next) {
+    librdf_sql_node_cache_entry* entry = &cache->entries[i];
+
+    if(entry->hash == hash && librdf_node_equals(entry->node, node)) {
+      entry->referenced = 1;
+      *id_p = entry->id;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_sql_node_cache_put:
+ * @cache: node cache
+ * @node: node
+ * @id: database id of the node
+ * 
+ * Remember the database id of a node, evicting a node not used
+ * recently if the cache is full.  The node is copied.
+ * 
+ * Return value: non 0 on failure
+ **/
+int
+librdf_sql_node_cache_put(librdf_sql_node_cache* cache, librdf_node* node,
+                          u64 id)
+{
+  librdf_sql_node_cache_entry* entry;
+  unsigned long hash;
+  int i;
+  int* link;
+
+  node = librdf_new_node_from_node(node);
+  if(!node)
+    return 1;
+
+  hash = librdf_sql_node_cache_node_hash(node);
+
+  if(cache->count < cache->size)
+    i = cache->count++;
+  else {
+    /* sweep for an entry not referenced since the last pass */
+    while(cache->entries[cache->hand].referenced) {
+      cache->entries[cache->hand].referenced = 0;
+      cache->hand = (cache->hand + 1) % cache->size;
+    }
+    i = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->size;
+
+    entry = &cache->entries[i];
+    for(link = &cache->buckets[entry->hash & cache->buckets_mask];
+        *link != i; link = &cache->entries[*link].next)
+      ;
+    *link = entry->next;
+    librdf_free_node(entry->node);
+  }
+
+  entry = &cache->entries[i];
+  entry->node = node;
+  entry->hash = hash;
+  entry->id = id;
+  entry->referenced = 0;
+  entry->next = cache->buckets[hash & cache->buckets_mask];
+  cache->buckets[hash & cache->buckets_mask] = i;
+
+  return 0;
+}
+
+
+/**
+ * librdf_new_sql_replicas:
+ * @list: comma separated host or host:port list
+ * @count_p: pointer to store the number of replicas
+ *
+ * INTERNAL - Parse the replicas storage option
+ *
+ * Return value: array of *@count_p replicas or NULL on failure or if
+ * @list has none
+ **/
+librdf_sql_replica*
+librdf_new_sql_replicas(const char* list, int* count_p)
+{
+  librdf_sql_replica* replicas;
+  const char* p;
+  int size = 1;
+  int count = 0;
+
+  *count_p = 0;
+
+  for(p = list; *p; p++) {
+    if(*p == ',')
+      size++;
+  }
+
+  replicas = LIBRDF_CALLOC(librdf_sql_replica*, LIBRDF_GOOD_CAST(size_t, size),
+                           sizeof(*replicas));
+  if(!replicas)
+    return NULL;
+
+  for(p = list; ; ) {
+    const char* end = strchr(p, ',');
+    const char* colon;
+    size_t len;
+
+    if(!end)
+      end = p + strlen(p);
+
+    while(p < end && isspace((int)*p))
+      p++;
+    len = LIBRDF_GOOD_CAST(size_t, end - p);
+    while(len && isspace((int)p[len - 1]))
+      len--;
+
+    if(len) {
+      colon = (const char*)memchr(p, ':', len);
+      if(!colon)
+        colon = p + len;
+
+      replicas[count].host = LIBRDF_MALLOC(char*, LIBRDF_GOOD_CAST(size_t, colon - p) + 1);
+      if(!replicas[count].host)
+        goto failed;
+      memcpy(replicas[count].host, p, LIBRDF_GOOD_CAST(size_t, colon - p));
+      replicas[count].host[colon - p] = '\0';
+
+      if(colon < p + len) {
+        size_t port_len = len - LIBRDF_GOOD_CAST(size_t, colon - p) - 1;
+
+        replicas[count].port = LIBRDF_MALLOC(char*, port_len + 1);
+        if(!replicas[count].port) {
+          count++;
+          goto failed;
+        }
+        memcpy(replicas[count].port, colon + 1, port_len);
+        replicas[count].port[port_len] = '\0';
+      }
+      count++;
+    }
+
+    if(!*end)
+      break;
+    p = end + 1;
+  }
+
+  if(!count) {
+    LIBRDF_FREE(librdf_sql_replica*, replicas);
+    return NULL;
+  }
+
+  *count_p = count;
+  return replicas;
+
+  failed:
+  librdf_free_sql_replicas(replicas, count);
+  return NULL;
+}
+
+
+/**
+ * librdf_free_sql_replicas:
+ * @replicas: replicas array
+ * @count: number of replicas
+ *
+ * INTERNAL - Destructor - destroy a replicas array
+ **/
+void
+librdf_free_sql_replicas(librdf_sql_replica* replicas, int count)
+{
+  int i;
+
+  if(!replicas)
+    return;
+
+  for(i = 0; i < count; i++) {
+    if(replicas[i].host)
+      LIBRDF_FREE(char*, replicas[i].host);
+    if(replicas[i].port)
+      LIBRDF_FREE(char*, replicas[i].port);
+  }
+  LIBRDF_FREE(librdf_sql_replica*, replicas);
+}
+
+
+/*
+ * Node hash functions for the MySQL and PostgreSQL storages.
+ *
+ * Node ids are 64 bit hashes of the node type and value.  Databases
+ * made before the hash could be chosen use the first 8 bytes of MD5
+ * and have no node-hash setting; new databases record the function
+ * used so that it is never changed under existing ids.
+ */
+
+static const char* const librdf_sql_node_hash_names[LIBRDF_SQL_NODE_HASH_LAST+1]={
+  "md5",
+  "xxh64"
+};
+
+
+/**
+ * librdf_sql_node_hash_from_name:
+ * @name: node hash function name
+ *
+ * INTERNAL - Get a node hash function by name
+ *
+ * Return value: node hash function or <0 if unknown
+ **/
+int
+librdf_sql_node_hash_from_name(const char* name)
+{
+  int i;
+
+  for(i = 0; i <= LIBRDF_SQL_NODE_HASH_LAST; i++) {
+    if(!strcmp(name, librdf_sql_node_hash_names[i]))
+      return i;
+  }
+  return -1;
+}
+
+
+/**
+ * librdf_sql_node_hash_name:
+ * @node_hash: node hash function
+ *
+ * INTERNAL - Get the name of a node hash function
+ *
+ * Return value: name
+ **/
+const char*
+librdf_sql_node_hash_name(librdf_sql_node_hash node_hash)
+{
+  return librdf_sql_node_hash_names[node_hash];
+}
+
+
+#define XXH64_PRIME_1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME_3 0x165667B19E3779F9ULL
+#define XXH64_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME_5 0x27D4EB2F165667C5ULL
+
+#define XXH64_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static u64
+librdf_sql_xxh64_read64(const unsigned char* p)
+{
+  /* little endian regardless of the host so ids are portable */
+  return (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) |
+    ((u64)p[3] << 24) | ((u64)p[4] << 32) | ((u64)p[5] << 40) |
+    ((u64)p[6] << 48) | ((u64)p[7] << 56);
+}
+
+static u64
+librdf_sql_xxh64_round(u64 acc, u64 input)
+{
+  acc += input * XXH64_PRIME_2;
+  acc = XXH64_ROTL(acc, 31);
+  return acc * XXH64_PRIME_1;
+}
+
+static u64
+librdf_sql_xxh64_merge(u64 acc, u64 value)
+{
+  acc ^= librdf_sql_xxh64_round(0, value);
+  return acc * XXH64_PRIME_1 + XXH64_PRIME_4;
+}
+
+
+/**
+ * librdf_sql_xxh64:
+ * @data: bytes to hash
+ * @len: length of @data
+ * @seed: seed
+ *
+ * INTERNAL - XXH64 hash of bytes
+ *
+ * Return value: hash
+ **/
+u64
+librdf_sql_xxh64(const unsigned char* data, size_t len, u64 seed)
+{
+  const unsigned char* p = data;
+  const unsigned char* end = data + len;
+  u64 h;
+
+  if(len >= 32) {
+    u64 v1 = seed + XXH64_PRIME_1 + XXH64_PRIME_2;
+    u64 v2 = seed + XXH64_PRIME_2;
+    u64 v3 = seed;
+    u64 v4 = seed - XXH64_PRIME_1;
+
+    do {
+      v1 = librdf_sql_xxh64_round(v1, librdf_sql_xxh64_read64(p));
+      v2 = librdf_sql_xxh64_round(v2, librdf_sql_xxh64_read64(p + 8));
+      v3 = librdf_sql_xxh64_round(v3, librdf_sql_xxh64_read64(p + 16));
+      v4 = librdf_sql_xxh64_round(v4, librdf_sql_xxh64_read64(p + 24));
+      p += 32;
+    } while(p + 32 <= end);
+
+    h = XXH64_ROTL(v1, 1) + XXH64_ROTL(v2, 7) + XXH64_ROTL(v3, 12) +
+      XXH64_ROTL(v4, 18);
+    h = librdf_sql_xxh64_merge(h, v1);
+    h = librdf_sql_xxh64_merge(h, v2);
+    h = librdf_sql_xxh64_merge(h, v3);
+    h = librdf_sql_xxh64_merge(h, v4);
+  } else
+    h = seed + XXH64_PRIME_5;
+
+  h += (u64)len;
+
+  while(p + 8 <= end) {
+    h ^= librdf_sql_xxh64_round(0, librdf_sql_xxh64_read64(p));
+    h = XXH64_ROTL(h, 27) * XXH64_PRIME_1 + XXH64_PRIME_4;
+    p += 8;
+  }
+
+  if(p + 4 <= end) {
+    u64 k = (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) |
+      ((u64)p[3] << 24);
+    h ^= k * XXH64_PRIME_1;
+    h = XXH64_ROTL(h, 23) * XXH64_PRIME_2 + XXH64_PRIME_3;
+    p += 4;
+  }
+
+  while(p < end) {
+    h ^= (u64)(*p++) * XXH64_PRIME_5;
+    h = XXH64_ROTL(h, 11) * XXH64_PRIME_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH64_PRIME_2;
+  h ^= h >> 29;
+  h *= XXH64_PRIME_3;
+  h ^= h >> 32;
+
+  return h;
+}
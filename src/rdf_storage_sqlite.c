@@ -45,12 +45,53 @@
 
 #include <redland.h>
 #include <rdf_storage.h>
+#include <rdf_types.h>
 
 
 static const char* const sqlite_synchronous_flags[4] = {
   "off", "normal", "full", NULL
 };
 
+#define SQLITE_SPINDEX_SQL \
+  "CREATE INDEX IF NOT EXISTS spindex ON triples (subjectUri, subjectBlank, predicateUri);"
+
+/* Indexes always made for a new store */
+static const char* const sqlite_new_indexes[] = {
+  SQLITE_SPINDEX_SQL,
+  "CREATE INDEX uriindex ON uris (uri);",
+  "CREATE INDEX blankindex ON blanks (blank);",
+  "CREATE INDEX literalindex ON literals (text);",
+  NULL
+};
+
+/*
+ * Optional triples indexes chosen with boolean storage options.  Each
+ * covers every triples column so that matching rows can be read from
+ * the index alone.
+ */
+static const struct {
+  const char *option;
+  const char *name;
+  const char *sql;
+} sqlite_optional_indexes[] = {
+  { "index-po", "poindex",
+    "CREATE INDEX IF NOT EXISTS poindex ON triples (predicateUri, objectUri, objectBlank, objectLiteral, subjectUri, subjectBlank, contextUri);" },
+  { "index-os", "osindex",
+    "CREATE INDEX IF NOT EXISTS osindex ON triples (objectUri, objectBlank, objectLiteral, subjectUri, subjectBlank, predicateUri, contextUri);" },
+  { "index-context", "contextindex",
+    "CREATE INDEX IF NOT EXISTS contextindex ON triples (contextUri, subjectUri, subjectBlank, predicateUri, objectUri, objectBlank, objectLiteral);" },
+  { NULL, NULL, NULL }
+};
+
+/* Run ANALYZE after adding at least this many statements in one call */
+#define SQLITE_ANALYZE_MIN_STATEMENTS 10000
+
+/* Rows per multi-row insert into the bulk load staging table */
+#define SQLITE_STAGING_ROWS 64
+
+/* Read-only connections for streams in WAL mode if not given */
+#define SQLITE_DEFAULT_READERS 4
+
 typedef struct librdf_storage_sqlite_query librdf_storage_sqlite_query;
 
 struct librdf_storage_sqlite_query
@@ -59,6 +100,26 @@ struct librdf_storage_sqlite_query
   librdf_storage_sqlite_query *next;
 };
 
+/* Prepared statements kept for node lookups and inserts */
+#define SQLITE_NODE_STATEMENTS 9
+
+/* Operations on the triples table with kept prepared statements */
+#define SQLITE_TRIPLE_OPERATIONS 5
+
+/* Triple shapes: the field used (or none) for each of the 4 parts */
+#define SQLITE_TRIPLE_SHAPES 256
+
+/* A read-only connection used by streams in WAL mode */
+typedef struct
+{
+  sqlite3 *db;
+
+  int in_use;
+
+  /* kept find statements by triple shape */
+  sqlite3_stmt *find_statements[SQLITE_TRIPLE_SHAPES];
+} librdf_storage_sqlite_reader;
+
 typedef struct
 {
   librdf_storage *storage;
@@ -72,10 +133,40 @@ typedef struct
 
   int synchronous; /* -1 (not set), 0+ index into sqlite_synchronous_flags */
 
+  /* bit i set if sqlite_optional_indexes[i] is wanted */
+  int indexes;
+
+  /* statements added since the last ANALYZE */
+  int added_since_analyze;
+
+  /* if add_statements should load through a staging table */
+  int bulk;
+
+  /* if the database uses write-ahead logging */
+  int wal;
+
+  /* read-only connections for streams, in WAL mode only */
+  librdf_storage_sqlite_reader *readers;
+  int readers_count;
+
   int in_stream;
   librdf_storage_sqlite_query *in_stream_queries;
 
   int in_transaction;
+
+  /* prepared when first used and reset for reuse, by statement kind
+   * and by operation and triple shape */
+  sqlite3_stmt *node_statements[SQLITE_NODE_STATEMENTS];
+  sqlite3_stmt *triple_statements[SQLITE_TRIPLE_OPERATIONS][SQLITE_TRIPLE_SHAPES];
+
+  /* node to id cache or NULL if disabled */
+  librdf_sql_node_cache *node_cache;
+
+  /* staging table inserts of SQLITE_STAGING_ROWS rows and of 1 row */
+  sqlite3_stmt *staging_statements[2];
+
+  /* text index of object literals or NULL until first needed */
+  librdf_literal_index* literal_index;
 } librdf_storage_sqlite_instance;
 
 
@@ -87,10 +178,15 @@ static int librdf_storage_sqlite_close(librdf_storage* storage);
 static int librdf_storage_sqlite_size(librdf_storage* storage);
 static int librdf_storage_sqlite_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_sqlite_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
+static int librdf_storage_sqlite_bulk_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_sqlite_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_sqlite_contains_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_sqlite_count_statements(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_sqlite_has_arc_in(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static int librdf_storage_sqlite_has_arc_out(librdf_storage* storage, librdf_node* node, librdf_node* property);
 static librdf_stream* librdf_storage_sqlite_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_sqlite_find_statements(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_sqlite_find_statements_with_options(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, librdf_hash* options);
 
 /* serialising implementing functions */
 static int librdf_storage_sqlite_serialise_end_of_stream(void* context);
@@ -102,6 +198,7 @@ static void librdf_storage_sqlite_serialise_finished(void* context);
 static int librdf_storage_sqlite_find_statements_end_of_stream(void* context);
 static int librdf_storage_sqlite_find_statements_next_statement(void* context);
 static void* librdf_storage_sqlite_find_statements_get_statement(void* context, int flags);
+static int librdf_storage_sqlite_find_statements_next_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 static void librdf_storage_sqlite_find_statements_finished(void* context);
 
 /* context functions */
@@ -146,7 +243,9 @@ librdf_storage_sqlite_init(librdf_storage* storage, const char *name,
 {
   char *name_copy;
   char* synchronous;
+  long node_cache_size;
   librdf_storage_sqlite_instance* context;
+  int i;
   
   if(!name) {
     if(options)
@@ -179,6 +278,35 @@ librdf_storage_sqlite_init(librdf_storage* storage, const char *name,
   if(librdf_hash_get_as_boolean(options, "new")>0)
     context->is_new = 1; /* default is NOT NEW */
 
+  for(i = 0; sqlite_optional_indexes[i].option; i++) {
+    if(librdf_hash_get_as_boolean(options, sqlite_optional_indexes[i].option)>0)
+      context->indexes |= (1 << i);
+  }
+
+  if(librdf_hash_get_as_boolean(options, "bulk")>0)
+    context->bulk = 1;
+
+  if(librdf_hash_get_as_boolean(options, "wal")>0) {
+    long readers;
+
+    context->wal = 1;
+
+    readers = librdf_hash_get_as_long(options, "readers");
+    if(readers < 0)
+      readers = SQLITE_DEFAULT_READERS;
+    if(readers > 0) {
+      context->readers = LIBRDF_CALLOC(librdf_storage_sqlite_reader*,
+                                       LIBRDF_GOOD_CAST(size_t, readers),
+                                       sizeof(librdf_storage_sqlite_reader));
+      if(!context->readers) {
+        if(options)
+          librdf_free_hash(options);
+        return 1;
+      }
+      context->readers_count = (int)readers;
+    }
+  }
+
   /* Redland default is "PRAGMA synchronous normal" */
   context->synchronous = 1;
 
@@ -196,6 +324,18 @@ librdf_storage_sqlite_init(librdf_storage* storage, const char *name,
 
   }
   
+  node_cache_size = librdf_hash_get_as_long(options, "node-cache-size");
+  if(node_cache_size < 0)
+    node_cache_size = LIBRDF_SQL_NODE_CACHE_SIZE;
+  if(node_cache_size > 0) {
+    context->node_cache = librdf_new_sql_node_cache((int)node_cache_size);
+    if(!context->node_cache) {
+      if(options)
+        librdf_free_hash(options);
+      return 1;
+    }
+  }
+
 
   /* no more options, might as well free them now */
   if(options)
@@ -218,6 +358,12 @@ librdf_storage_sqlite_terminate(librdf_storage* storage)
   if(context->name)
     LIBRDF_FREE(char*, context->name);
   
+  if(context->node_cache)
+    librdf_free_sql_node_cache(context->node_cache);
+
+  if(context->readers)
+    LIBRDF_FREE(librdf_storage_sqlite_reader*, context->readers);
+
   LIBRDF_FREE(librdf_storage_sqlite_terminate, storage->instance);
 }
 
@@ -282,6 +428,40 @@ static const char * const triples_fields[4][3] = {
 };
 
 
+typedef enum {
+  SQLITE_URI_SELECT,
+  SQLITE_URI_INSERT,
+  SQLITE_BLANK_SELECT,
+  SQLITE_BLANK_INSERT,
+  /* + 2 with a language, + 1 with a datatype */
+  SQLITE_LITERAL_SELECT,
+  SQLITE_LITERAL_SELECT_DATATYPE,
+  SQLITE_LITERAL_SELECT_LANGUAGE,
+  SQLITE_LITERAL_SELECT_LANGUAGE_DATATYPE,
+  SQLITE_LITERAL_INSERT
+} sqlite_node_statement;
+
+static const char * const sqlite_node_statements_sql[SQLITE_NODE_STATEMENTS] = {
+  "SELECT id FROM uris WHERE uri = ?;",
+  "INSERT INTO uris (id, uri) VALUES(NULL, ?);",
+  "SELECT id FROM blanks WHERE blank = ?;",
+  "INSERT INTO blanks (id, blank) VALUES(NULL, ?);",
+  "SELECT id FROM literals WHERE text = ? AND language IS NULL AND datatype IS NULL;",
+  "SELECT id FROM literals WHERE text = ? AND language IS NULL AND datatype = ?;",
+  "SELECT id FROM literals WHERE text = ? AND language = ? AND datatype IS NULL;",
+  "SELECT id FROM literals WHERE text = ? AND language = ? AND datatype = ?;",
+  "INSERT INTO literals (id, text, language, datatype) VALUES(NULL, ?, ?, ?);"
+};
+
+typedef enum {
+  SQLITE_TRIPLE_INSERT,
+  SQLITE_TRIPLE_DELETE,
+  SQLITE_TRIPLE_CONTAINS,
+  SQLITE_TRIPLE_FIND,
+  SQLITE_TRIPLE_COUNT
+} sqlite_triple_operation;
+
+
 static int
 librdf_storage_sqlite_get_1int_callback(void *arg,
                                         int argc, char **argv,
@@ -296,40 +476,19 @@ librdf_storage_sqlite_get_1int_callback(void *arg,
 }
 
 
-static unsigned char *
-sqlite_string_escape(const unsigned char *raw, size_t raw_len, size_t *len_p) 
+/* Copy a single short string result into a 16 byte buffer */
+static int
+librdf_storage_sqlite_get_1string_callback(void *arg,
+                                           int argc, char **argv,
+                                           char **columnNames)
 {
-  size_t escapes = 0;
-  unsigned char *p;
-  unsigned char *escaped;
-  size_t len;
-
-  for(p = (unsigned char*)raw, len = raw_len; len > 0; p++, len--) {
-    if(*p == '\'')
-      escapes++;
-  }
-
-  len = raw_len + escapes + 2; /* for '' */
-  escaped = LIBRDF_MALLOC(unsigned char*, len + 1);
-  if(!escaped)
-    return NULL;
-
-  p = escaped;
-  *p++ = '\'';
-  while(raw_len > 0) {
-    if(*raw == '\'') {
-      *p++ = '\'';
-    }
-    *p++ = *raw++;
-    raw_len--;
-  }
-  *p++ = '\'';
-  *p = '\0';
-
-  if(len_p)
-    *len_p = len;
+  char* buffer = (char*)arg;
   
-  return escaped;
+  if(argc == 1 && argv[0]) {
+    strncpy(buffer, argv[0], 15);
+    buffer[15] = '\0';
+  }
+  return 0;
 }
 
 
@@ -405,91 +564,109 @@ librdf_storage_sqlite_exec(librdf_storage* storage,
 }
 
 
-static int
-librdf_storage_sqlite_set_helper(librdf_storage *storage,
-                                 int table, 
-                                 const unsigned char *values,
-                                 size_t values_len) 
+/*
+ * librdf_storage_sqlite_prepared - Get a kept prepared statement
+ * @storage: the storage
+ * @db: connection to prepare on
+ * @vm_p: where the statement is kept
+ * @request: SQL to prepare if there is no statement yet
+ *
+ * Return value: statement or NULL on failure
+ **/
+static sqlite3_stmt*
+librdf_storage_sqlite_prepared(librdf_storage* storage,
+                               sqlite3 *db,
+                               sqlite3_stmt **vm_p,
+                               const unsigned char *request)
 {
   librdf_storage_sqlite_instance* context;
-  int rc;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
+  int status;
+
+  if(*vm_p)
+    return *vm_p;
 
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
+  LIBRDF_DEBUG2("SQLite prepare '%s'\n", request);
+#endif
 
-  raptor_stringbuffer_append_string(sb, 
-                                    (const unsigned char*)"INSERT INTO ", 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[table].name, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                    (const unsigned char*)" (id, ", 6, 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[table].columns, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (const unsigned char*) ") VALUES(NULL, ", 15, 1);
-  raptor_stringbuffer_append_counted_string(sb, values, values_len, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)");", 2, 1);
-  request=raptor_stringbuffer_as_string(sb);
-
-  rc=librdf_storage_sqlite_exec(storage,
-                                request,
-                                NULL, /* no callback */
-                                NULL, /* arg */
-                                0);
+  status = sqlite3_prepare_v2(db, (const char*)request, -1, vm_p, NULL);
+  if(status != SQLITE_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s SQL compile '%s' failed - %s (%d)",
+               context->name, request, sqlite3_errmsg(db), status);
+    *vm_p = NULL;
+  }
 
-  raptor_free_stringbuffer(sb);
+  return *vm_p;
+}
 
-  if(rc)
-    return -1;
 
-  return LIBRDF_BAD_CAST(int, sqlite3_last_insert_rowid(context->db));
+/*
+ * librdf_storage_sqlite_run - Step a kept prepared statement once
+ * @storage: the storage
+ * @vm: bound statement
+ * @id_p: pointer to store the integer in the first column of a row or NULL
+ *
+ * The statement is reset and its bindings cleared for the next use.
+ *
+ * Return value: sqlite3_step() status
+ **/
+static int
+librdf_storage_sqlite_run(librdf_storage* storage, sqlite3_stmt *vm,
+                          int *id_p)
+{
+  librdf_storage_sqlite_instance* context;
+  int status;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  status = sqlite3_step(vm);
+  if(status == SQLITE_ROW) {
+    if(id_p)
+      *id_p = sqlite3_column_int(vm, 0);
+  } else if(status != SQLITE_DONE &&
+            !(status == SQLITE_LOCKED && context->in_stream)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s SQL exec '%s' failed - %s (%d)",
+               context->name, sqlite3_sql(vm), sqlite3_errmsg(context->db),
+               status);
+  }
+
+  sqlite3_reset(vm);
+  sqlite3_clear_bindings(vm);
+
+  return status;
 }
 
 
-static int
-librdf_storage_sqlite_get_helper(librdf_storage *storage,
-                                 int table, 
-                                 const unsigned char *expression) 
+static sqlite3_stmt*
+librdf_storage_sqlite_node_statement(librdf_storage* storage,
+                                     sqlite_node_statement which)
 {
-  int id = -1;
-  int rc;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
+  librdf_storage_sqlite_instance* context;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
+  context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)"SELECT id FROM ", 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[table].name, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)" WHERE ", 7, 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)expression, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)";", 1, 1);
-  request=raptor_stringbuffer_as_string(sb);
+  return librdf_storage_sqlite_prepared(storage, context->db,
+                                        &context->node_statements[which],
+                                        (const unsigned char*)sqlite_node_statements_sql[which]);
+}
 
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  librdf_storage_sqlite_get_1int_callback,
-                                  &id,
-                                  0);
 
-  raptor_free_stringbuffer(sb);
+/* Run a bound node insert; returns the new id or -1 on failure */
+static int
+librdf_storage_sqlite_node_insert(librdf_storage* storage, sqlite3_stmt *vm)
+{
+  librdf_storage_sqlite_instance* context;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  if(rc)
+  if(librdf_storage_sqlite_run(storage, vm, NULL) != SQLITE_DONE)
     return -1;
 
-  return id;
+  return LIBRDF_BAD_CAST(int, sqlite3_last_insert_rowid(context->db));
 }
 
 
@@ -500,37 +677,28 @@ librdf_storage_sqlite_uri_helper(librdf_storage* storage,
 {
   const unsigned char *uri_string;
   size_t uri_len;
-  unsigned char *expression = NULL;
-  unsigned char *uri_e;
-  size_t uri_e_len;
+  sqlite3_stmt *vm;
   int id = -1;
-  static const char * const field="uri";
 
   uri_string = librdf_uri_as_counted_string(uri, &uri_len);
-  uri_e = sqlite_string_escape(uri_string, uri_len, &uri_e_len);
-  if(!uri_e)
-    goto tidy;
-  
-  expression = LIBRDF_MALLOC(unsigned char*, strlen(field) + 3 + uri_e_len + 1);
-  if(!expression)
-    goto tidy;
 
-  sprintf((char*)expression, "%s = %s", field, uri_e);
-  id = librdf_storage_sqlite_get_helper(storage, TABLE_URIS, expression);
-  if(id >= 0)
-    goto tidy;
+  vm = librdf_storage_sqlite_node_statement(storage, SQLITE_URI_SELECT);
+  if(!vm)
+    return -1;
+  sqlite3_bind_text(vm, 1, (const char*)uri_string,
+                    LIBRDF_GOOD_CAST(int, uri_len), SQLITE_STATIC);
+  librdf_storage_sqlite_run(storage, vm, &id);
 
-  if(add_new)  
-    id = librdf_storage_sqlite_set_helper(storage, TABLE_URIS, uri_e,
-                                          uri_e_len);
+  if(id >= 0 || !add_new)
+    return id;
 
-  tidy:
-  if(expression)
-    LIBRDF_FREE(char*, expression);
-  if(uri_e)
-    LIBRDF_FREE(char*, uri_e);
+  vm = librdf_storage_sqlite_node_statement(storage, SQLITE_URI_INSERT);
+  if(!vm)
+    return -1;
+  sqlite3_bind_text(vm, 1, (const char*)uri_string,
+                    LIBRDF_GOOD_CAST(int, uri_len), SQLITE_STATIC);
 
-  return id;
+  return librdf_storage_sqlite_node_insert(storage, vm);
 }
 
 
@@ -539,39 +707,24 @@ librdf_storage_sqlite_blank_helper(librdf_storage* storage,
                                    const unsigned char *blank,
                                    int add_new)
 {
-  size_t blank_len;
-  unsigned char *expression = NULL;
-  unsigned char *blank_e;
-  size_t blank_e_len;
+  sqlite3_stmt *vm;
   int id = -1;
-  static const char * const field="blank";
 
-  blank_len = strlen((const char*)blank);
-  blank_e = sqlite_string_escape(blank, blank_len, &blank_e_len);
-  if(!blank_e)
-    goto tidy;
-  
-  expression = LIBRDF_MALLOC(unsigned char*,
-                             strlen(field) + 3 + blank_e_len + 1);
-  if(!expression)
-    goto tidy;
-
-  sprintf((char*)expression, "%s = %s", field, blank_e);
-  id = librdf_storage_sqlite_get_helper(storage, TABLE_BLANKS, expression);
-  if(id >= 0)
-    goto tidy;
+  vm = librdf_storage_sqlite_node_statement(storage, SQLITE_BLANK_SELECT);
+  if(!vm)
+    return -1;
+  sqlite3_bind_text(vm, 1, (const char*)blank, -1, SQLITE_STATIC);
+  librdf_storage_sqlite_run(storage, vm, &id);
 
-  if(add_new)
-    id = librdf_storage_sqlite_set_helper(storage, TABLE_BLANKS, blank_e, 
-                                          blank_e_len);
+  if(id >= 0 || !add_new)
+    return id;
 
-  tidy:
-  if(expression)
-    LIBRDF_FREE(char*, expression);
-  if(blank_e)
-    LIBRDF_FREE(char*, blank_e);
+  vm = librdf_storage_sqlite_node_statement(storage, SQLITE_BLANK_INSERT);
+  if(!vm)
+    return -1;
+  sqlite3_bind_text(vm, 1, (const char*)blank, -1, SQLITE_STATIC);
 
-  return id;
+  return librdf_storage_sqlite_node_insert(storage, vm);
 }
 
 
@@ -583,89 +736,50 @@ librdf_storage_sqlite_literal_helper(librdf_storage* storage,
                                      librdf_uri *datatype,
                                      int add_new) 
 {
+  sqlite3_stmt *vm;
+  int which = SQLITE_LITERAL_SELECT;
+  int column = 1;
   int id = -1;
-  size_t len;
-  unsigned char *value_e;
-  size_t value_e_len;
-  unsigned char *language_e = NULL;
-  size_t language_e_len = 0;
   int datatype_id = -1;
-  raptor_stringbuffer *sb = NULL;
-  unsigned char *expression;
 
-  value_e = sqlite_string_escape(value, value_len, &value_e_len);
-  if(!value_e)
-    goto tidy;
+  if(datatype)
+    datatype_id = librdf_storage_sqlite_uri_helper(storage, datatype, add_new);
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    goto tidy;
-
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)"text = ",
-                                            7, 1);
-  raptor_stringbuffer_append_counted_string(sb, value_e, value_e_len, 1);
-  raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)" ", 1, 1);
-
-  if(language) {
-    len = strlen(language);
-    language_e = sqlite_string_escape((unsigned const char*)language, len,
-                                      &language_e_len);
-    if(!language_e)
-      goto tidy;
-
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND language = ", 1);
-    raptor_stringbuffer_append_counted_string(sb, language_e, language_e_len, 1);
-  } else
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND language IS NULL ", 1);
+  if(language)
+    which += 2;
+  if(datatype)
+    which++;
 
-  if(datatype) {
-    datatype_id = librdf_storage_sqlite_uri_helper(storage, datatype, add_new);
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND datatype = ", 1);
-    raptor_stringbuffer_append_decimal(sb, datatype_id);
-  } else
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND datatype IS NULL ", 1);
-  
-  expression = raptor_stringbuffer_as_string(sb);
-  id = librdf_storage_sqlite_get_helper(storage, TABLE_LITERALS, expression);
-  
-  if(id >= 0 || !add_new)
-    goto tidy;
-  
-  raptor_free_stringbuffer(sb);
-  sb = raptor_new_stringbuffer();
-  if(!sb) {
-    id = -1;
-    goto tidy;
-  }
+  vm = librdf_storage_sqlite_node_statement(storage,
+                                            (sqlite_node_statement)which);
+  if(!vm)
+    return -1;
+  sqlite3_bind_text(vm, column++, (const char*)value,
+                    LIBRDF_GOOD_CAST(int, value_len), SQLITE_STATIC);
+  if(language)
+    sqlite3_bind_text(vm, column++, language, -1, SQLITE_STATIC);
+  if(datatype)
+    sqlite3_bind_int(vm, column++, datatype_id);
+  librdf_storage_sqlite_run(storage, vm, &id);
 
-  raptor_stringbuffer_append_counted_string(sb, value_e, value_e_len, 1);
+  if(id >= 0 || !add_new)
+    return id;
 
-  raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)", ", 2, 1);
-  if(language_e)
-    raptor_stringbuffer_append_counted_string(sb,language_e, language_e_len, 1);
+  vm = librdf_storage_sqlite_node_statement(storage, SQLITE_LITERAL_INSERT);
+  if(!vm)
+    return -1;
+  sqlite3_bind_text(vm, 1, (const char*)value,
+                    LIBRDF_GOOD_CAST(int, value_len), SQLITE_STATIC);
+  if(language)
+    sqlite3_bind_text(vm, 2, language, -1, SQLITE_STATIC);
   else
-    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"NULL", 4, 1);
-
-  raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)", ", 2, 1);
+    sqlite3_bind_null(vm, 2);
   if(datatype)
-    raptor_stringbuffer_append_decimal(sb, datatype_id);
+    sqlite3_bind_int(vm, 3, datatype_id);
   else
-    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"NULL", 4, 1);
-
-  expression = raptor_stringbuffer_as_string(sb);
-  id = librdf_storage_sqlite_set_helper(storage, TABLE_LITERALS, expression,
-                                      raptor_stringbuffer_length(sb));
+    sqlite3_bind_null(vm, 3);
 
-  tidy:
-  if(sb)
-    raptor_free_stringbuffer(sb);
-  if(value_e)
-    LIBRDF_FREE(char*, value_e);
-  if(language_e)
-    LIBRDF_FREE(char*, language_e);
-  
-  return id;
+  return librdf_storage_sqlite_node_insert(storage, vm);
 }
 
 
@@ -676,7 +790,9 @@ librdf_storage_sqlite_node_helper(librdf_storage* storage,
                                   triple_node_type *node_type_p,
                                   int add_new) 
 {
+  librdf_storage_sqlite_instance* context;
   int id;
+  u64 cached_id;
   triple_node_type node_type;
   unsigned char *value;
   size_t value_len;
@@ -684,37 +800,18 @@ librdf_storage_sqlite_node_helper(librdf_storage* storage,
   if(!node)
     return 1;
   
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
   switch(librdf_node_get_type(node)) {
     case LIBRDF_NODE_TYPE_RESOURCE:
-      id = librdf_storage_sqlite_uri_helper(storage,
-                                            librdf_node_get_uri(node),
-                                            add_new);
-      if(id < 0 && add_new)
-        return 1;
-
       node_type = TRIPLE_URI;
       break;
 
     case LIBRDF_NODE_TYPE_LITERAL:
-      value = librdf_node_get_literal_value_as_counted_string(node, &value_len);
-      id = librdf_storage_sqlite_literal_helper(storage,
-                                                value, value_len,
-                                                librdf_node_get_literal_value_language(node),
-                                                librdf_node_get_literal_value_datatype_uri(node),
-                                                add_new);
-      if(id < 0 && add_new)
-        return 1;
-
       node_type = TRIPLE_LITERAL;
       break;
 
     case LIBRDF_NODE_TYPE_BLANK:
-      id = librdf_storage_sqlite_blank_helper(storage,
-                                              librdf_node_get_blank_identifier(node),
-                                              add_new);
-      if(id < 0 && add_new)
-        return 1;
-
       node_type = TRIPLE_BLANK;
       break;
 
@@ -726,6 +823,42 @@ librdf_storage_sqlite_node_helper(librdf_storage* storage,
     return 1;
   }
 
+  if(context->node_cache &&
+     librdf_sql_node_cache_get(context->node_cache, node, &cached_id)) {
+    id = LIBRDF_BAD_CAST(int, cached_id);
+  } else {
+    switch(node_type) {
+      case TRIPLE_URI:
+        id = librdf_storage_sqlite_uri_helper(storage,
+                                              librdf_node_get_uri(node),
+                                              add_new);
+        break;
+
+      case TRIPLE_LITERAL:
+        value = librdf_node_get_literal_value_as_counted_string(node, &value_len);
+        id = librdf_storage_sqlite_literal_helper(storage,
+                                                  value, value_len,
+                                                  librdf_node_get_literal_value_language(node),
+                                                  librdf_node_get_literal_value_datatype_uri(node),
+                                                  add_new);
+        break;
+
+      case TRIPLE_BLANK:
+      case TRIPLE_NONE:
+      default:
+        id = librdf_storage_sqlite_blank_helper(storage,
+                                                librdf_node_get_blank_identifier(node),
+                                                add_new);
+        break;
+    }
+
+    if(id < 0 && add_new)
+      return 1;
+
+    if(id >= 0 && context->node_cache)
+      librdf_sql_node_cache_put(context->node_cache, node, (u64)id);
+  }
+
   if(id_p)
     *id_p = id;
   if(node_type_p)
@@ -737,22 +870,15 @@ librdf_storage_sqlite_node_helper(librdf_storage* storage,
                                         
 
 static int
-librdf_storage_sqlite_statement_helper(librdf_storage* storage,
-                                       librdf_statement* statement,
-                                       librdf_node* context_node,
-                                       triple_node_type node_types[4],
-                                       int node_ids[4],
-                                       const unsigned char* fields[4],
-                                       int add_new) 
+librdf_storage_sqlite_nodes_helper(librdf_storage* storage,
+                                   librdf_node* nodes[4],
+                                   triple_node_type node_types[4],
+                                   int node_ids[4],
+                                   const unsigned char* fields[4],
+                                   int add_new) 
 {
-  librdf_node* nodes[4];
   int i;
   
-  nodes[0] = statement ? librdf_statement_get_subject(statement) : NULL;
-  nodes[1] = statement ? librdf_statement_get_predicate(statement) : NULL;
-  nodes[2] = statement ? librdf_statement_get_object(statement) : NULL;
-  nodes[3] = context_node;
-    
   for(i = 0; i < 4; i++) {
     if(!nodes[i]) {
       fields[i] = NULL;
@@ -776,48 +902,551 @@ librdf_storage_sqlite_statement_helper(librdf_storage* storage,
 
 
 static int
-librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
+librdf_storage_sqlite_statement_helper(librdf_storage* storage,
+                                       librdf_statement* statement,
+                                       librdf_node* context_node,
+                                       triple_node_type node_types[4],
+                                       int node_ids[4],
+                                       const unsigned char* fields[4],
+                                       int add_new) 
 {
-  librdf_storage_sqlite_instance* context;
-  int rc = SQLITE_OK;
-  char *errmsg = NULL;
-  int db_file_exists = 0;
+  librdf_node* nodes[4];
   
-  context = (librdf_storage_sqlite_instance*)storage->instance;
-
-  if(!access((const char*)context->name, F_OK))
-    db_file_exists = 1;
-
-  if(context->is_new && db_file_exists)
-    unlink(context->name);
-
-  context->db = NULL;
-  rc = sqlite3_open(context->name, &context->db);
-  if(rc != SQLITE_OK)
-    errmsg = (char*)sqlite3_errmsg(context->db);
+  nodes[0] = statement ? librdf_statement_get_subject(statement) : NULL;
+  nodes[1] = statement ? librdf_statement_get_predicate(statement) : NULL;
+  nodes[2] = statement ? librdf_statement_get_object(statement) : NULL;
+  nodes[3] = context_node;
 
-  if(rc != SQLITE_OK) {
-    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "SQLite database %s open failed - %s", 
-               context->name, errmsg);
-    librdf_storage_sqlite_close(storage);
-    return 1;
-  }
+  return librdf_storage_sqlite_nodes_helper(storage, nodes, node_types,
+                                            node_ids, fields, add_new);
+}
 
-  
-  if(context->synchronous >= 0) {
-    raptor_stringbuffer *sb;
-    unsigned char *request;
 
-    sb = raptor_new_stringbuffer();
-    if(!sb) {
-      librdf_storage_sqlite_close(storage);
-      return 1;
-    }
+static void
+sqlite_construct_select_helper(raptor_stringbuffer* sb) 
+{
+  raptor_stringbuffer_append_counted_string(sb, 
+                                            (unsigned char*)"SELECT\n", 7, 1);
 
-    raptor_stringbuffer_append_string(sb, 
-                                      (const unsigned char*)"PRAGMA synchronous=", 1);
-    raptor_stringbuffer_append_string(sb, 
+  /* If this order is changed MUST CHANGE order in 
+   * librdf_storage_sqlite_get_next_common 
+   */
+  raptor_stringbuffer_append_string(sb, (unsigned char*)
+"  SubjectURIs.uri     AS subjectUri,\n\
+  SubjectBlanks.blank AS subjectBlank,\n\
+  PredicateURIs.uri   AS predicateUri,\n\
+  ObjectURIs.uri      AS objectUri,\n\
+  ObjectBlanks.blank  AS objectBlank,\n\
+  ObjectLiterals.text AS objectLiteralText,\n\
+  ObjectLiterals.language AS objectLiteralLanguage,\n\
+  ObjectLiterals.datatype AS objectLiteralDatatype,\n\
+  ObjectDatatypeURIs.uri  AS objectLiteralDatatypeUri,\n\
+  ContextURIs.uri         AS contextUri\n",
+                                    1);
+  
+  raptor_stringbuffer_append_counted_string(sb, 
+                                            (unsigned char*)"FROM ", 5, 1);
+  raptor_stringbuffer_append_string(sb, 
+                                    (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
+  raptor_stringbuffer_append_counted_string(sb, 
+                                            (unsigned char*)" AS T\n", 6, 1);
+  
+  raptor_stringbuffer_append_string(sb, (unsigned char*)
+"  LEFT JOIN uris     AS SubjectURIs    ON SubjectURIs.id    = T.subjectUri\n\
+  LEFT JOIN blanks   AS SubjectBlanks  ON SubjectBlanks.id  = T.subjectBlank\n\
+  LEFT JOIN uris     AS PredicateURIs  ON PredicateURIs.id  = T.predicateUri\n\
+  LEFT JOIN uris     AS ObjectURIs     ON ObjectURIs.id     = T.objectUri\n\
+  LEFT JOIN blanks   AS ObjectBlanks   ON ObjectBlanks.id   = T.objectBlank\n\
+  LEFT JOIN literals AS ObjectLiterals ON ObjectLiterals.id = T.objectLiteral\n\
+  LEFT JOIN uris     AS ObjectDatatypeURIs ON ObjectDatatypeURIs.id = objectLiteralDatatype\n\
+  LEFT JOIN uris     AS ContextURIs    ON ContextURIs.id     = T.contextUri\n",
+                                    1);
+}
+
+
+static int
+librdf_storage_sqlite_triple_shape(const triple_node_type node_types[4])
+{
+  return ((node_types[0] * 4 + node_types[1]) * 4 + node_types[2]) * 4 +
+    node_types[3];
+}
+
+
+/*
+ * librdf_storage_sqlite_triple_sql - Write SQL for an operation on triples
+ * @sb: string buffer to append to
+ * @op: operation
+ * @node_types: node types of the triple parts; TRIPLE_NONE parts are unused
+ * @node_ids: node ids to write as values or NULL to write parameters
+ **/
+static void
+librdf_storage_sqlite_triple_sql(raptor_stringbuffer* sb,
+                                 sqlite_triple_operation op,
+                                 const triple_node_type node_types[4],
+                                 const int* node_ids)
+{
+  int i;
+  int count = 0;
+
+  switch(op) {
+    case SQLITE_TRIPLE_INSERT:
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"INSERT INTO ", 12, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)" ( ", 3, 1);
+      for(i = 0; i < 4; i++) {
+        if(node_types[i] == TRIPLE_NONE)
+          continue;
+        if(count++)
+          raptor_stringbuffer_append_counted_string(sb,
+                                                    (unsigned char*)", ", 2, 1);
+        raptor_stringbuffer_append_string(sb,
+                                          (unsigned char*)triples_fields[i][node_types[i]], 1);
+      }
+
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)") VALUES(", 9, 1);
+      count = 0;
+      for(i = 0; i < 4; i++) {
+        if(node_types[i] == TRIPLE_NONE)
+          continue;
+        if(count++)
+          raptor_stringbuffer_append_counted_string(sb,
+                                                    (unsigned char*)", ", 2, 1);
+        if(node_ids)
+          raptor_stringbuffer_append_decimal(sb, node_ids[i]);
+        else
+          raptor_stringbuffer_append_counted_string(sb,
+                                                    (unsigned char*)"?", 1, 1);
+      }
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)");", 2, 1);
+      return;
+
+    case SQLITE_TRIPLE_DELETE:
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"DELETE FROM ", 12, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
+      break;
+
+    case SQLITE_TRIPLE_CONTAINS:
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"SELECT 1 FROM ", 14, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
+      break;
+
+    case SQLITE_TRIPLE_COUNT:
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"SELECT COUNT(*) FROM ", 21, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
+      break;
+
+    case SQLITE_TRIPLE_FIND:
+    default:
+      sqlite_construct_select_helper(sb);
+      break;
+  }
+
+  for(i = 0; i < 4; i++) {
+    if(node_types[i] == TRIPLE_NONE)
+      continue;
+
+    if(count++)
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)" AND ", 5, 1);
+    else
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)" WHERE ", 7, 1);
+    if(op == SQLITE_TRIPLE_FIND)
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"T.", 2, 1);
+    raptor_stringbuffer_append_string(sb,
+                                      (unsigned char*)triples_fields[i][node_types[i]], 1);
+    raptor_stringbuffer_append_counted_string(sb,
+                                              (unsigned char*)"=", 1, 1);
+    if(node_ids)
+      raptor_stringbuffer_append_decimal(sb, node_ids[i]);
+    else
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"?", 1, 1);
+    if(op == SQLITE_TRIPLE_FIND)
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)"\n", 1, 1);
+  }
+
+  if(op == SQLITE_TRIPLE_CONTAINS)
+    raptor_stringbuffer_append_counted_string(sb,
+                                              (unsigned char*)" LIMIT 1", 8, 1);
+  raptor_stringbuffer_append_counted_string(sb,
+                                            (unsigned char*)";", 1, 1);
+}
+
+
+/*
+ * librdf_storage_sqlite_triple_bind - Bind a kept statement for a triples operation
+ * @storage: the storage
+ * @db: connection the statement is kept for
+ * @vm_p: where the statement is kept
+ * @op: operation
+ * @node_types: node types of the triple parts
+ * @node_ids: node ids of the triple parts
+ *
+ * Return value: statement or NULL on failure
+ **/
+static sqlite3_stmt*
+librdf_storage_sqlite_triple_bind(librdf_storage* storage,
+                                  sqlite3 *db,
+                                  sqlite3_stmt **vm_p,
+                                  sqlite_triple_operation op,
+                                  const triple_node_type node_types[4],
+                                  const int node_ids[4])
+{
+  sqlite3_stmt *vm;
+  int i;
+  int column = 1;
+
+  if(!*vm_p) {
+    raptor_stringbuffer *sb;
+
+    sb = raptor_new_stringbuffer();
+    if(!sb)
+      return NULL;
+
+    librdf_storage_sqlite_triple_sql(sb, op, node_types, NULL);
+    librdf_storage_sqlite_prepared(storage, db, vm_p,
+                                   raptor_stringbuffer_as_string(sb));
+    raptor_free_stringbuffer(sb);
+  }
+
+  vm = *vm_p;
+  if(!vm)
+    return NULL;
+
+  for(i = 0; i < 4; i++) {
+    if(node_types[i] != TRIPLE_NONE)
+      sqlite3_bind_int(vm, column++, node_ids[i]);
+  }
+
+  return vm;
+}
+
+
+/*
+ * librdf_storage_sqlite_triple_statement - Get a bound statement for a triples operation
+ * @storage: the storage
+ * @op: operation
+ * @node_types: node types of the triple parts
+ * @node_ids: node ids of the triple parts
+ *
+ * The statement is kept per operation and triple shape (the field
+ * used for each part) so the SQL is compiled once and afterwards only
+ * rebound.
+ *
+ * Return value: statement or NULL on failure
+ **/
+static sqlite3_stmt*
+librdf_storage_sqlite_triple_statement(librdf_storage* storage,
+                                       sqlite_triple_operation op,
+                                       const triple_node_type node_types[4],
+                                       const int node_ids[4])
+{
+  librdf_storage_sqlite_instance* context;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  return librdf_storage_sqlite_triple_bind(storage, context->db,
+                                           &context->triple_statements[op][librdf_storage_sqlite_triple_shape(node_types)],
+                                           op, node_types, node_ids);
+}
+
+
+/*
+ * librdf_storage_sqlite_triple_exec - Run an operation on triples
+ * @storage: the storage
+ * @op: operation
+ * @node_types: node types of the triple parts
+ * @node_ids: node ids of the triple parts
+ * @found_p: pointer to set to non-0 if a row was returned or NULL
+ *
+ * Changes refused with SQLITE_LOCKED while a stream is reading are
+ * queued as SQL text and run when the last stream finishes.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_sqlite_triple_exec(librdf_storage* storage,
+                                  sqlite_triple_operation op,
+                                  const triple_node_type node_types[4],
+                                  const int node_ids[4],
+                                  int *found_p)
+{
+  librdf_storage_sqlite_instance* context;
+  sqlite3_stmt *vm;
+  int status;
+  int found = 0;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  vm = librdf_storage_sqlite_triple_statement(storage, op, node_types,
+                                              node_ids);
+  if(!vm)
+    return 1;
+
+  status = librdf_storage_sqlite_run(storage, vm, &found);
+  if(found_p)
+    *found_p = (status == SQLITE_ROW);
+
+  if(status == SQLITE_LOCKED && context->in_stream &&
+     (op == SQLITE_TRIPLE_INSERT || op == SQLITE_TRIPLE_DELETE)) {
+    raptor_stringbuffer *sb;
+    int rc;
+
+    sb = raptor_new_stringbuffer();
+    if(!sb)
+      return 1;
+
+    librdf_storage_sqlite_triple_sql(sb, op, node_types, node_ids);
+    rc = librdf_storage_sqlite_exec(storage, raptor_stringbuffer_as_string(sb),
+                                    NULL, NULL, 0);
+    raptor_free_stringbuffer(sb);
+    return rc;
+  }
+
+  return (status != SQLITE_ROW && status != SQLITE_DONE);
+}
+
+
+/*
+ * librdf_storage_sqlite_get_reader - Get an unused read-only connection
+ * @storage: the storage
+ *
+ * Readers are only used in WAL mode, where each reads from its own
+ * snapshot without blocking or being blocked by the writer, and not
+ * inside a transaction, which must see its own uncommitted changes.
+ *
+ * Return value: reader or NULL if streams should use the main connection
+ **/
+static librdf_storage_sqlite_reader*
+librdf_storage_sqlite_get_reader(librdf_storage* storage)
+{
+  librdf_storage_sqlite_instance* context;
+  int i;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(!context->readers || context->in_transaction)
+    return NULL;
+
+  for(i = 0; i < context->readers_count; i++) {
+    librdf_storage_sqlite_reader* reader = &context->readers[i];
+
+    if(reader->in_use)
+      continue;
+
+    if(!reader->db) {
+      int status;
+
+      status = sqlite3_open_v2(context->name, &reader->db,
+                               SQLITE_OPEN_READONLY, NULL);
+      if(status != SQLITE_OK) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE,
+                   NULL, "SQLite database %s reader open failed - %s",
+                   context->name, sqlite3_errmsg(reader->db));
+        sqlite3_close(reader->db);
+        reader->db = NULL;
+        return NULL;
+      }
+    }
+
+    reader->in_use = 1;
+    return reader;
+  }
+
+  return NULL;
+}
+
+
+static void
+librdf_storage_sqlite_close_reader(librdf_storage_sqlite_reader* reader)
+{
+  int i;
+
+  if(!reader->db)
+    return;
+
+  for(i = 0; i < SQLITE_TRIPLE_SHAPES; i++) {
+    if(reader->find_statements[i]) {
+      sqlite3_finalize(reader->find_statements[i]);
+      reader->find_statements[i] = NULL;
+    }
+  }
+
+  sqlite3_close(reader->db);
+  reader->db = NULL;
+}
+
+
+/*
+ * librdf_storage_sqlite_triple_statement_done - Give back a statement taken by a stream
+ * @storage: the storage
+ * @reader: reader connection the statement was taken from or NULL
+ * @shape: triple shape the statement was kept under
+ * @vm: statement or NULL if it was already finalized
+ **/
+static void
+librdf_storage_sqlite_triple_statement_done(librdf_storage* storage,
+                                            librdf_storage_sqlite_reader* reader,
+                                            int shape,
+                                            sqlite3_stmt *vm)
+{
+  librdf_storage_sqlite_instance* context;
+  sqlite3 *db;
+  sqlite3_stmt **vm_p;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(reader) {
+    db = reader->db;
+    vm_p = &reader->find_statements[shape];
+    reader->in_use = 0;
+  } else {
+    db = context->db;
+    vm_p = &context->triple_statements[SQLITE_TRIPLE_FIND][shape];
+  }
+
+  if(!vm)
+    return;
+
+  /* ends the read transaction so a reader sees newer commits next time */
+  sqlite3_reset(vm);
+  sqlite3_clear_bindings(vm);
+
+  /* another stream of the same shape may have compiled a new one */
+  if(*vm_p || !db) {
+    int status;
+
+    status = sqlite3_finalize(vm);
+    if(status != SQLITE_OK)
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "SQLite database %s finalize failed - %s (%d)",
+                 context->name, sqlite3_errmsg(db), status);
+  } else
+    *vm_p = vm;
+}
+
+
+/*
+ * librdf_storage_sqlite_triple_statement_take - Take a bound find statement for a stream
+ * @storage: the storage
+ * @reader_p: pointer to store the reader connection used or NULL
+ * @node_types: node types of the triple parts
+ * @node_ids: node ids of the triple parts
+ *
+ * The statement is removed from the kept set while the stream steps
+ * it, so that nested streams of the same shape compile their own.
+ *
+ * Return value: statement or NULL on failure
+ **/
+static sqlite3_stmt*
+librdf_storage_sqlite_triple_statement_take(librdf_storage* storage,
+                                            librdf_storage_sqlite_reader** reader_p,
+                                            const triple_node_type node_types[4],
+                                            const int node_ids[4])
+{
+  librdf_storage_sqlite_instance* context;
+  librdf_storage_sqlite_reader* reader;
+  sqlite3_stmt **vm_p;
+  sqlite3_stmt *vm;
+  int shape;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  shape = librdf_storage_sqlite_triple_shape(node_types);
+
+  reader = librdf_storage_sqlite_get_reader(storage);
+  if(reader)
+    vm_p = &reader->find_statements[shape];
+  else
+    vm_p = &context->triple_statements[SQLITE_TRIPLE_FIND][shape];
+
+  vm = librdf_storage_sqlite_triple_bind(storage,
+                                         reader ? reader->db : context->db,
+                                         vm_p, SQLITE_TRIPLE_FIND,
+                                         node_types, node_ids);
+  if(!vm) {
+    if(reader)
+      reader->in_use = 0;
+    return NULL;
+  }
+
+  *vm_p = NULL;
+  *reader_p = reader;
+
+  return vm;
+}
+
+
+static int
+librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
+{
+  librdf_storage_sqlite_instance* context;
+  int rc = SQLITE_OK;
+  char *errmsg = NULL;
+  int db_file_exists = 0;
+  
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(!access((const char*)context->name, F_OK))
+    db_file_exists = 1;
+
+  if(context->is_new && db_file_exists) {
+    char *path;
+
+    unlink(context->name);
+
+    /* do not let an old write-ahead log be replayed into the new file */
+    path = LIBRDF_MALLOC(char*, context->name_len + 5);
+    if(path) {
+      sprintf(path, "%s-wal", context->name);
+      unlink(path);
+      sprintf(path, "%s-shm", context->name);
+      unlink(path);
+      LIBRDF_FREE(char*, path);
+    }
+  }
+
+  context->db = NULL;
+  rc = sqlite3_open(context->name, &context->db);
+  if(rc != SQLITE_OK)
+    errmsg = (char*)sqlite3_errmsg(context->db);
+
+  if(rc != SQLITE_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s open failed - %s", 
+               context->name, errmsg);
+    librdf_storage_sqlite_close(storage);
+    return 1;
+  }
+
+  
+  if(context->synchronous >= 0) {
+    raptor_stringbuffer *sb;
+    unsigned char *request;
+
+    sb = raptor_new_stringbuffer();
+    if(!sb) {
+      librdf_storage_sqlite_close(storage);
+      return 1;
+    }
+
+    raptor_stringbuffer_append_string(sb, 
+                                      (const unsigned char*)"PRAGMA synchronous=", 1);
+    raptor_stringbuffer_append_string(sb, 
                                       (const unsigned char*)sqlite_synchronous_flags[context->synchronous], 1);
     raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)";", 1, 1);
     
@@ -833,6 +1462,16 @@ librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
     }
   }
 
+  if(context->wal) {
+    rc = librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)"PRAGMA journal_mode=WAL;",
+                                    NULL, NULL, 0);
+    if(rc) {
+      librdf_storage_sqlite_close(storage);
+      return 1;
+    }
+  }
+
   
   if(context->is_new) {
     int i;
@@ -868,36 +1507,41 @@ librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
 
     } /* end drop/create table loop */
 
-    strcpy((char*)request, 
-           "CREATE INDEX spindex ON triples (subjectUri, subjectBlank, predicateUri);");
-    if(librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL, /* no callback */
-                                  NULL, /* arg */
-                                  0)) {
-      if(!begin)
-        librdf_storage_sqlite_transaction_rollback(storage);
-      librdf_storage_sqlite_close(storage);
-      return 1;
-    }
-    
-    strcpy((char*)request, 
-           "CREATE INDEX uriindex ON uris (uri);");
-    if(librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL, /* no callback */
-                                  NULL, /* arg */
-                                  0)) {
-      if(!begin)
-        librdf_storage_sqlite_transaction_rollback(storage);
-      librdf_storage_sqlite_close(storage);
-      return 1;
+    for(i = 0; sqlite_new_indexes[i]; i++) {
+      if(librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)sqlite_new_indexes[i],
+                                    NULL, /* no callback */
+                                    NULL, /* arg */
+                                    0)) {
+        if(!begin)
+          librdf_storage_sqlite_transaction_rollback(storage);
+        librdf_storage_sqlite_close(storage);
+        return 1;
+      }
     }
     
     if(!begin)
       librdf_storage_sqlite_transaction_commit(storage);    
   } /* end if is new */
 
+  if(context->indexes) {
+    int i;
+
+    for(i = 0; sqlite_optional_indexes[i].option; i++) {
+      if(!(context->indexes & (1 << i)))
+        continue;
+
+      if(librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)sqlite_optional_indexes[i].sql,
+                                    NULL, /* no callback */
+                                    NULL, /* arg */
+                                    0)) {
+        librdf_storage_sqlite_close(storage);
+        return 1;
+      }
+    }
+  }
+
   return 0;
 }
 
@@ -918,11 +1562,48 @@ librdf_storage_sqlite_close(librdf_storage* storage)
   
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
+  if(context->readers) {
+    int i;
+
+    for(i = 0; i < context->readers_count; i++)
+      librdf_storage_sqlite_close_reader(&context->readers[i]);
+  }
+
   if(context->db) {
+    int i, j;
+
+    for(i = 0; i < SQLITE_NODE_STATEMENTS; i++) {
+      if(context->node_statements[i]) {
+        sqlite3_finalize(context->node_statements[i]);
+        context->node_statements[i] = NULL;
+      }
+    }
+
+    for(i = 0; i < 2; i++) {
+      if(context->staging_statements[i]) {
+        sqlite3_finalize(context->staging_statements[i]);
+        context->staging_statements[i] = NULL;
+      }
+    }
+
+    for(i = 0; i < SQLITE_TRIPLE_OPERATIONS; i++) {
+      for(j = 0; j < SQLITE_TRIPLE_SHAPES; j++) {
+        if(context->triple_statements[i][j]) {
+          sqlite3_finalize(context->triple_statements[i][j]);
+          context->triple_statements[i][j] = NULL;
+        }
+      }
+    }
+
     sqlite3_close(context->db);
     context->db = NULL;
   }
 
+  if(context->literal_index) {
+    librdf_free_literal_index(context->literal_index);
+    context->literal_index = NULL;
+  }
+
   return status;
 }
 
@@ -951,15 +1632,317 @@ librdf_storage_sqlite_add_statement(librdf_storage* storage,
 }
 
 
+/* staging table column for each triple part and node type or -1 */
+static const int sqlite_staging_columns[4][3] = {
+  { 0,  1, -1 },
+  { 2, -1, -1 },
+  { 3,  4,  5 },
+  { 6, -1, -1 }
+};
+
+
+static sqlite3_stmt*
+librdf_storage_sqlite_staging_statement(librdf_storage* storage, int rows)
+{
+  librdf_storage_sqlite_instance* context;
+  sqlite3_stmt **vm_p;
+  raptor_stringbuffer *sb;
+  int i;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  vm_p = &context->staging_statements[rows == 1 ? 1 : 0];
+  if(*vm_p)
+    return *vm_p;
+
+  sb = raptor_new_stringbuffer();
+  if(!sb)
+    return NULL;
+
+  raptor_stringbuffer_append_string(sb,
+                                    (unsigned char*)"INSERT INTO temp.staging (", 1);
+  raptor_stringbuffer_append_string(sb,
+                                    (unsigned char*)sqlite_tables[TABLE_TRIPLES].columns, 1);
+  raptor_stringbuffer_append_counted_string(sb,
+                                            (unsigned char*)") VALUES ", 9, 1);
+  for(i = 0; i < rows; i++) {
+    if(i)
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)", ", 2, 1);
+    raptor_stringbuffer_append_string(sb,
+                                      (unsigned char*)"(?, ?, ?, ?, ?, ?, ?)", 1);
+  }
+  raptor_stringbuffer_append_counted_string(sb,
+                                            (unsigned char*)";", 1, 1);
+
+  librdf_storage_sqlite_prepared(storage, context->db, vm_p,
+                                 raptor_stringbuffer_as_string(sb));
+  raptor_free_stringbuffer(sb);
+
+  return *vm_p;
+}
+
+
+/*
+ * librdf_storage_sqlite_staging_flush - Insert staged rows into the staging table
+ * @storage: the storage
+ * @rows: rows of 7 triples column values, -1 for NULL
+ * @count: number of rows, SQLITE_STAGING_ROWS or fewer
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_sqlite_staging_flush(librdf_storage* storage,
+                                    int rows[][7], int count)
+{
+  sqlite3_stmt *vm = NULL;
+  int per_statement;
+  int row, i;
+  int column = 1;
+
+  per_statement = (count == SQLITE_STAGING_ROWS) ? SQLITE_STAGING_ROWS : 1;
+
+  for(row = 0; row < count; row++) {
+    if(!vm) {
+      vm = librdf_storage_sqlite_staging_statement(storage, per_statement);
+      if(!vm)
+        return 1;
+      column = 1;
+    }
+
+    for(i = 0; i < 7; i++) {
+      if(rows[row][i] < 0)
+        sqlite3_bind_null(vm, column++);
+      else
+        sqlite3_bind_int(vm, column++, rows[row][i]);
+    }
+
+    if(column > per_statement * 7) {
+      if(librdf_storage_sqlite_run(storage, vm, NULL) != SQLITE_DONE)
+        return 1;
+      vm = NULL;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_sqlite_bulk_add_statements - Add a stream of statements through a staging table
+ * @storage: the storage
+ * @statement_stream: stream of statements
+ *
+ * With the journal and syncing off, nodes are stored as usual and the
+ * triples collected in a temporary table with multi-row inserts.  The
+ * triples indexes are then dropped, the new distinct triples copied
+ * in, the indexes rebuilt and the journal and synchronous settings
+ * restored.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_sqlite_bulk_add_statements(librdf_storage* storage,
+                                          librdf_stream* statement_stream)
+{
+  librdf_storage_sqlite_instance* context;
+  char journal_mode[16];
+  int synchronous = -1;
+  int rows[SQLITE_STAGING_ROWS][7];
+  int count = 0;
+  int staged = 0;
+  int status = 0;
+  raptor_stringbuffer *sb;
+  int i;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  /* the staged rows are not seen here so remake the text index later */
+  if(context->literal_index) {
+    librdf_free_literal_index(context->literal_index);
+    context->literal_index = NULL;
+  }
+
+  strcpy(journal_mode, "delete");
+  librdf_storage_sqlite_exec(storage, (unsigned char*)"PRAGMA journal_mode;",
+                             librdf_storage_sqlite_get_1string_callback,
+                             journal_mode, 0);
+  librdf_storage_sqlite_exec(storage, (unsigned char*)"PRAGMA synchronous;",
+                             librdf_storage_sqlite_get_1int_callback,
+                             &synchronous, 0);
+
+  /* leaving WAL mode needs exclusive access so keep the log there */
+  if((!context->wal &&
+      librdf_storage_sqlite_exec(storage,
+                                 (unsigned char*)"PRAGMA journal_mode=OFF;",
+                                 NULL, NULL, 0)) ||
+     librdf_storage_sqlite_exec(storage,
+                                (unsigned char*)"PRAGMA synchronous=OFF;",
+                                NULL, NULL, 0))
+    status = 1;
+
+  if(!status && librdf_storage_sqlite_transaction_start(storage))
+    status = 1;
+
+  if(!status) {
+    sb = raptor_new_stringbuffer();
+    if(!sb)
+      status = 1;
+    else {
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)"CREATE TEMP TABLE IF NOT EXISTS staging (", 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].schema, 1);
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)");", 2, 1);
+      status = librdf_storage_sqlite_exec(storage,
+                                          raptor_stringbuffer_as_string(sb),
+                                          NULL, NULL, 0);
+      raptor_free_stringbuffer(sb);
+    }
+  }
+
+  for(; !status && !librdf_stream_end(statement_stream);
+      librdf_stream_next(statement_stream)) {
+    librdf_statement* statement;
+    triple_node_type node_types[4];
+    int node_ids[4];
+    const unsigned char* fields[4];
+
+    statement = librdf_stream_get_object(statement_stream);
+    if(!statement ||
+       librdf_storage_sqlite_statement_helper(storage,
+                                              statement,
+                                              librdf_stream_get_context2(statement_stream),
+                                              node_types, node_ids, fields,
+                                              1)) {
+      status = 1;
+      break;
+    }
+
+    for(i = 0; i < 7; i++)
+      rows[count][i] = -1;
+    for(i = 0; i < 4; i++) {
+      if(node_types[i] != TRIPLE_NONE)
+        rows[count][sqlite_staging_columns[i][node_types[i]]] = node_ids[i];
+    }
+
+    staged++;
+    if(++count == SQLITE_STAGING_ROWS) {
+      status = librdf_storage_sqlite_staging_flush(storage, rows, count);
+      count = 0;
+    }
+  }
+
+  if(!status && count)
+    status = librdf_storage_sqlite_staging_flush(storage, rows, count);
+
+  if(!status && staged) {
+    librdf_storage_sqlite_exec(storage,
+                               (unsigned char*)"DROP INDEX IF EXISTS spindex;",
+                               NULL, NULL, 0);
+    for(i = 0; sqlite_optional_indexes[i].option; i++) {
+      if(context->indexes & (1 << i)) {
+        char request[64];
+
+        sprintf(request, "DROP INDEX IF EXISTS %s;",
+                sqlite_optional_indexes[i].name);
+        librdf_storage_sqlite_exec(storage, (unsigned char*)request,
+                                   NULL, NULL, 0);
+      }
+    }
+
+    /* EXCEPT removes duplicates and triples already stored without
+     * needing an index */
+    sb = raptor_new_stringbuffer();
+    if(!sb)
+      status = 1;
+    else {
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)"INSERT INTO triples (", 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].columns, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)") SELECT ", 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].columns, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)" FROM temp.staging EXCEPT SELECT ", 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)sqlite_tables[TABLE_TRIPLES].columns, 1);
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)" FROM triples;", 1);
+      status = librdf_storage_sqlite_exec(storage,
+                                          raptor_stringbuffer_as_string(sb),
+                                          NULL, NULL, 0);
+      raptor_free_stringbuffer(sb);
+    }
+  }
+
+  /* always put back the indexes, even after a failure */
+  if(librdf_storage_sqlite_exec(storage, (unsigned char*)SQLITE_SPINDEX_SQL,
+                                NULL, NULL, 0))
+    status = 1;
+  for(i = 0; sqlite_optional_indexes[i].option; i++) {
+    if((context->indexes & (1 << i)) &&
+       librdf_storage_sqlite_exec(storage,
+                                  (unsigned char*)sqlite_optional_indexes[i].sql,
+                                  NULL, NULL, 0))
+      status = 1;
+  }
+
+  librdf_storage_sqlite_exec(storage,
+                             (unsigned char*)"DELETE FROM temp.staging;",
+                             NULL, NULL, 1);
+
+  if(context->in_transaction) {
+    if(status)
+      librdf_storage_sqlite_transaction_rollback(storage);
+    else
+      librdf_storage_sqlite_transaction_commit(storage);
+  }
+
+  sb = raptor_new_stringbuffer();
+  if(sb) {
+    raptor_stringbuffer_append_string(sb,
+                                      (unsigned char*)"PRAGMA journal_mode=", 1);
+    raptor_stringbuffer_append_string(sb, (unsigned char*)journal_mode, 1);
+    raptor_stringbuffer_append_counted_string(sb,
+                                              (unsigned char*)";", 1, 1);
+    if(synchronous >= 0) {
+      raptor_stringbuffer_append_string(sb,
+                                        (unsigned char*)" PRAGMA synchronous=", 1);
+      raptor_stringbuffer_append_decimal(sb, synchronous);
+      raptor_stringbuffer_append_counted_string(sb,
+                                                (unsigned char*)";", 1, 1);
+    }
+    librdf_storage_sqlite_exec(storage, raptor_stringbuffer_as_string(sb),
+                               NULL, NULL, 0);
+    raptor_free_stringbuffer(sb);
+  }
+
+  if(!status && staged) {
+    librdf_storage_sqlite_exec(storage, (unsigned char*)"ANALYZE;",
+                               NULL, NULL, 0);
+    context->added_since_analyze = 0;
+  }
+
+  return status;
+}
+
+
 static int
 librdf_storage_sqlite_add_statements(librdf_storage* storage,
                                      librdf_stream* statement_stream)
 {
-  /*librdf_storage_sqlite_instance* context;*/
+  librdf_storage_sqlite_instance* context;
   int status = 0;
   int begin;
 
-  /*context = (librdf_storage_sqlite_instance*)storage->instance;*/
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(context->bulk && !context->in_transaction && !context->in_stream)
+    return librdf_storage_sqlite_bulk_add_statements(storage, statement_stream);
 
   /* returns non-0 if a transaction is already active */
   begin = librdf_storage_sqlite_transaction_start(storage);
@@ -971,11 +1954,6 @@ librdf_storage_sqlite_add_statements(librdf_storage* storage,
     triple_node_type node_types[4];
     int node_ids[4];
     const unsigned char* fields[4];
-    raptor_stringbuffer *sb;
-    int i;
-    unsigned char* request;
-    int rc;
-    int max = 3;
     
     statement = librdf_stream_get_object(statement_stream);
     context_node = librdf_stream_get_context2(statement_stream);
@@ -989,72 +1967,40 @@ librdf_storage_sqlite_add_statements(librdf_storage* storage,
     if(librdf_storage_sqlite_context_contains_statement(storage, context_node, statement))
       continue;
 
-    if(librdf_storage_sqlite_statement_helper(storage,
-                                              statement,
-                                              context_node,
-                                              node_types, node_ids, fields,
-                                              1)) {
-      if(!begin)
-        librdf_storage_sqlite_transaction_rollback(storage);
-      return -1;
-    }
-    
-    if(context_node)
-      max++;
-    
-    /* FIXME no context field used */
-    sb = raptor_new_stringbuffer();
-    if(!sb) {
+    if(librdf_storage_sqlite_statement_helper(storage,
+                                              statement,
+                                              context_node,
+                                              node_types, node_ids, fields,
+                                              1)) {
       if(!begin)
         librdf_storage_sqlite_transaction_rollback(storage);
       return -1;
     }
-
-    raptor_stringbuffer_append_string(sb,
-                                      (unsigned char*)"INSERT INTO ", 1);
-    raptor_stringbuffer_append_string(sb, 
-                                      (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)" ( ", 3, 1);
-    for(i = 0; i < max; i++) {
-      raptor_stringbuffer_append_string(sb, fields[i], 1);
-      if(i < (max-1))
-        raptor_stringbuffer_append_counted_string(sb, 
-                                                  (unsigned char*)", ", 2, 1);
-    }
-    
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)") VALUES(", 9, 1);
-    for(i = 0; i < max; i++) {
-      raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-      if(i < (max-1))
-        raptor_stringbuffer_append_counted_string(sb, 
-                                                  (unsigned char*)", ", 2, 1);
-    }
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)");", 2, 1);
     
-    request = raptor_stringbuffer_as_string(sb);
-
-    rc = librdf_storage_sqlite_exec(storage,
-                                    request,
-                                    NULL, /* no callback */
-                                    NULL, /* arg */
-                                    0);
-
-    raptor_free_stringbuffer(sb);
-
-    if(rc) {
+    if(librdf_storage_sqlite_triple_exec(storage, SQLITE_TRIPLE_INSERT,
+                                         node_types, node_ids, NULL)) {
       if(!begin)
         librdf_storage_sqlite_transaction_rollback(storage);
       return 1;
     }
 
+    librdf_literal_index_update(&context->literal_index, statement, 1);
+
+    context->added_since_analyze++;
   }
 
   if(!begin)
     librdf_storage_sqlite_transaction_commit(storage);
   
+  /* Refresh the planner statistics after a bulk load, outside any
+   * transaction of the caller */
+  if(!context->in_transaction &&
+     context->added_since_analyze >= SQLITE_ANALYZE_MIN_STATEMENTS) {
+    librdf_storage_sqlite_exec(storage, (unsigned char*)"ANALYZE;",
+                               NULL, NULL, 0);
+    context->added_since_analyze = 0;
+  }
+
   return status;
 }
 
@@ -1068,56 +2014,6 @@ librdf_storage_sqlite_remove_statement(librdf_storage* storage,
 }
 
 
-static int
-librdf_storage_sqlite_statement_operator_helper(librdf_storage* storage, 
-                                                librdf_statement* statement,
-                                                librdf_node* context_node,
-                                                raptor_stringbuffer* sb,
-                                                int add_new)
-{
-  /* librdf_storage_sqlite_instance* context; */
-  triple_node_type node_types[4];
-  int node_ids[4];
-  const unsigned char* fields[4];
-  int i;
-  int need_and = 0;
-  int max=3;
-  
-  /* context = (librdf_storage_sqlite_instance*)storage->instance; */
-
-  if(context_node)
-    max++;
-  
-  if(librdf_storage_sqlite_statement_helper(storage,
-                                            statement,
-                                            context_node, 
-                                            node_types, node_ids, fields,
-                                            add_new))
-    return 1;
-  
-  raptor_stringbuffer_append_counted_string(sb,
-                                            (const unsigned char*)" FROM ", 6, 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)" WHERE ", 7, 1);
-  
-  for(i = 0; i < max; i++) {
-    if(need_and)
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)" AND ", 5, 1);
-    raptor_stringbuffer_append_string(sb, fields[i], 1);
-    raptor_stringbuffer_append_counted_string(sb,  
-                                              (const unsigned char*)"=", 1, 1);
-    raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-    
-    need_and = 1;
-  }
-    
-  return 0;
-}
-
-
 static int
 librdf_storage_sqlite_contains_statement(librdf_storage* storage, 
                                          librdf_statement* statement)
@@ -1131,40 +2027,27 @@ librdf_storage_sqlite_context_contains_statement(librdf_storage* storage,
                                                  librdf_node* context_node,
                                                  librdf_statement* statement)
 {
-  raptor_stringbuffer *sb;
-  unsigned char *request;
-  int count = 0;
+  triple_node_type node_types[4];
+  int node_ids[4];
+  const unsigned char* fields[4];
+  int found = 0;
   int rc, begin;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
-
   /* returns non-0 if a transaction is already active */
   begin = librdf_storage_sqlite_transaction_start(storage);
 
-  raptor_stringbuffer_append_string(sb, 
-                                    (const unsigned char*)"SELECT 1",
-                                    1);
-
-  if(librdf_storage_sqlite_statement_operator_helper(storage, statement, 
-                                                     context_node, sb, 0)) {
+  if(librdf_storage_sqlite_statement_helper(storage,
+                                            statement,
+                                            context_node,
+                                            node_types, node_ids, fields,
+                                            0)) {
     if(!begin)
       librdf_storage_sqlite_transaction_rollback(storage);
-    raptor_free_stringbuffer(sb);
     return -1;
   }
 
-  raptor_stringbuffer_append_string(sb, (const unsigned char*)" LIMIT 1;", 1);
-  request = raptor_stringbuffer_as_string(sb);
-  
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  librdf_storage_sqlite_get_1int_callback,
-                                  &count,
-                                  0);
-  
-  raptor_free_stringbuffer(sb);
+  rc = librdf_storage_sqlite_triple_exec(storage, SQLITE_TRIPLE_CONTAINS,
+                                         node_types, node_ids, &found);
 
   if(!begin)
     librdf_storage_transaction_commit(storage);
@@ -1172,49 +2055,104 @@ librdf_storage_sqlite_context_contains_statement(librdf_storage* storage,
   if(rc)  
     return -1;
 
-  return (count > 0);
+  return found;
 }
 
 
-static void
-sqlite_construct_select_helper(raptor_stringbuffer* sb) 
+/*
+ * librdf_storage_sqlite_count_nodes - Count or check triples matching a pattern
+ * @storage: the storage
+ * @nodes: subject, predicate, object and context nodes or NULL to match any
+ * @op: SQLITE_TRIPLE_COUNT or SQLITE_TRIPLE_CONTAINS
+ *
+ * Return value: number of matches (at most 1 for SQLITE_TRIPLE_CONTAINS)
+ * or <0 on failure
+ **/
+static int
+librdf_storage_sqlite_count_nodes(librdf_storage* storage,
+                                  librdf_node* nodes[4],
+                                  sqlite_triple_operation op)
 {
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"SELECT\n", 7, 1);
+  triple_node_type node_types[4];
+  int node_ids[4];
+  const unsigned char* fields[4];
+  sqlite3_stmt *vm;
+  int count = 0;
+  int status;
+  int i;
 
-  /* If this order is changed MUST CHANGE order in 
-   * librdf_storage_sqlite_get_next_common 
-   */
-  raptor_stringbuffer_append_string(sb, (unsigned char*)
-"  SubjectURIs.uri     AS subjectUri,\n\
-  SubjectBlanks.blank AS subjectBlank,\n\
-  PredicateURIs.uri   AS predicateUri,\n\
-  ObjectURIs.uri      AS objectUri,\n\
-  ObjectBlanks.blank  AS objectBlank,\n\
-  ObjectLiterals.text AS objectLiteralText,\n\
-  ObjectLiterals.language AS objectLiteralLanguage,\n\
-  ObjectLiterals.datatype AS objectLiteralDatatype,\n\
-  ObjectDatatypeURIs.uri  AS objectLiteralDatatypeUri,\n\
-  ContextURIs.uri         AS contextUri\n",
-                                    1);
-  
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"FROM ", 5, 1);
-  raptor_stringbuffer_append_string(sb, 
-                                    (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)" AS T\n", 6, 1);
-  
-  raptor_stringbuffer_append_string(sb, (unsigned char*)
-"  LEFT JOIN uris     AS SubjectURIs    ON SubjectURIs.id    = T.subjectUri\n\
-  LEFT JOIN blanks   AS SubjectBlanks  ON SubjectBlanks.id  = T.subjectBlank\n\
-  LEFT JOIN uris     AS PredicateURIs  ON PredicateURIs.id  = T.predicateUri\n\
-  LEFT JOIN uris     AS ObjectURIs     ON ObjectURIs.id     = T.objectUri\n\
-  LEFT JOIN blanks   AS ObjectBlanks   ON ObjectBlanks.id   = T.objectBlank\n\
-  LEFT JOIN literals AS ObjectLiterals ON ObjectLiterals.id = T.objectLiteral\n\
-  LEFT JOIN uris     AS ObjectDatatypeURIs ON ObjectDatatypeURIs.id = objectLiteralDatatype\n\
-  LEFT JOIN uris     AS ContextURIs    ON ContextURIs.id     = T.contextUri\n",
-                                    1);
+  if(librdf_storage_sqlite_nodes_helper(storage, nodes, node_types,
+                                        node_ids, fields, 0))
+    return -1;
+
+  /* A node that is not stored cannot match anything */
+  for(i = 0; i < 4; i++) {
+    if(nodes[i] && node_ids[i] < 0)
+      return 0;
+  }
+
+  vm = librdf_storage_sqlite_triple_statement(storage, op, node_types,
+                                              node_ids);
+  if(!vm)
+    return -1;
+
+  status = librdf_storage_sqlite_run(storage, vm, &count);
+  if(status == SQLITE_DONE)
+    return 0;
+  if(status != SQLITE_ROW)
+    return -1;
+
+  return (op == SQLITE_TRIPLE_CONTAINS) ? 1 : count;
+}
+
+
+static int
+librdf_storage_sqlite_count_statements(librdf_storage* storage,
+                                       librdf_statement* statement)
+{
+  librdf_node* nodes[4];
+
+  nodes[0] = librdf_statement_get_subject(statement);
+  nodes[1] = librdf_statement_get_predicate(statement);
+  nodes[2] = librdf_statement_get_object(statement);
+  nodes[3] = NULL;
+
+  return librdf_storage_sqlite_count_nodes(storage, nodes,
+                                           SQLITE_TRIPLE_COUNT);
+}
+
+
+static int
+librdf_storage_sqlite_has_arc_in(librdf_storage* storage,
+                                 librdf_node* node,
+                                 librdf_node* property)
+{
+  librdf_node* nodes[4];
+
+  nodes[0] = NULL;
+  nodes[1] = property;
+  nodes[2] = node;
+  nodes[3] = NULL;
+
+  return librdf_storage_sqlite_count_nodes(storage, nodes,
+                                           SQLITE_TRIPLE_CONTAINS) > 0;
+}
+
+
+static int
+librdf_storage_sqlite_has_arc_out(librdf_storage* storage,
+                                  librdf_node* node,
+                                  librdf_node* property)
+{
+  librdf_node* nodes[4];
+
+  nodes[0] = node;
+  nodes[1] = property;
+  nodes[2] = NULL;
+  nodes[3] = NULL;
+
+  return librdf_storage_sqlite_count_nodes(storage, nodes,
+                                           SQLITE_TRIPLE_CONTAINS) > 0;
 }
 
 
@@ -1227,9 +2165,12 @@ typedef struct {
   librdf_statement *statement;
   librdf_node* context;
 
-  /* OUT from sqlite3_prepare (V3) or sqlite_compile (V2) */
+  /* taken from the kept find statements and given back when finished */
   sqlite3_stmt *vm;
-  const char *zTail;
+  int shape;
+
+  /* reader connection the statement is from or NULL for the main one */
+  librdf_storage_sqlite_reader *reader;
 } librdf_storage_sqlite_serialise_stream_context;
 
 
@@ -1239,10 +2180,9 @@ librdf_storage_sqlite_serialise(librdf_storage* storage)
   librdf_storage_sqlite_instance* context;
   librdf_storage_sqlite_serialise_stream_context* scontext;
   librdf_stream* stream;
-  int status;
-  char *errmsg = NULL;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
+  triple_node_type node_types[4];
+  int node_ids[4];
+  int i;
   
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
@@ -1257,45 +2197,24 @@ librdf_storage_sqlite_serialise(librdf_storage* storage)
   scontext->sqlite_context = context;
   context->in_stream++;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb) {
-    librdf_storage_sqlite_serialise_finished((void*)scontext);
-    return NULL;
+  for(i = 0; i < 4; i++) {
+    node_types[i] = TRIPLE_NONE;
+    node_ids[i] = -1;
   }
+  scontext->shape = librdf_storage_sqlite_triple_shape(node_types);
 
-  sqlite_construct_select_helper(sb);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)";", 1, 1);
-
-  request = raptor_stringbuffer_as_string(sb);
-  if(!request) {
-    raptor_free_stringbuffer(sb);
+  scontext->vm = librdf_storage_sqlite_triple_statement_take(storage,
+                                                             &scontext->reader,
+                                                             node_types,
+                                                             node_ids);
+  if(!scontext->vm) {
     librdf_storage_sqlite_serialise_finished((void*)scontext);
     return NULL;
   }
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
-  LIBRDF_DEBUG2("SQLite prepare '%s'\n", request);
-#endif
-
-  status = sqlite3_prepare(context->db,
-                           (const char*)request,
-                           LIBRDF_GOOD_CAST(int, raptor_stringbuffer_length(sb)),
-                           &scontext->vm,
-                           &scontext->zTail);
-  if(status != SQLITE_OK)
-    errmsg = (char*)sqlite3_errmsg(context->db);
-
-  raptor_free_stringbuffer(sb);
-
-  if(status != SQLITE_OK) {
-    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "SQLite database %s SQL compile failed - %s (%d)", 
-               context->name, errmsg, status);
-
-    librdf_storage_sqlite_serialise_finished((void*)scontext);
-    return NULL;
-  }
+  /* a reader does not hold up writes on the main connection */
+  if(scontext->reader)
+    context->in_stream--;
   
   stream = librdf_new_stream(storage->world,
                              (void*)scontext,
@@ -1565,21 +2484,9 @@ librdf_storage_sqlite_serialise_finished(void* context)
 
   scontext = (librdf_storage_sqlite_serialise_stream_context*)context;
 
-  if(scontext->vm) {
-    char *errmsg = NULL;
-    int status;
-    
-    status = sqlite3_finalize(scontext->vm);
-    if(status != SQLITE_OK)
-      errmsg = (char*)sqlite3_errmsg(scontext->sqlite_context->db);
-
-    if(status != SQLITE_OK) {
-      librdf_log(scontext->storage->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                 "SQLite database %s finalize failed - %s (%d)", 
-                 scontext->sqlite_context->name, errmsg, status);
-    }
-  }
+  librdf_storage_sqlite_triple_statement_done(scontext->storage,
+                                              scontext->reader,
+                                              scontext->shape, scontext->vm);
 
   if(scontext->storage)
     librdf_storage_remove_reference(scontext->storage);
@@ -1590,9 +2497,11 @@ librdf_storage_sqlite_serialise_finished(void* context)
   if(scontext->context)
     librdf_free_node(scontext->context);
 
-  scontext->sqlite_context->in_stream--;
-  if(!scontext->sqlite_context->in_stream)
-    librdf_storage_sqlite_query_flush(scontext->storage);
+  if(!scontext->reader) {
+    scontext->sqlite_context->in_stream--;
+    if(!scontext->sqlite_context->in_stream)
+      librdf_storage_sqlite_query_flush(scontext->storage);
+  }
 
   LIBRDF_FREE(librdf_storage_sqlite_serialise_stream_context, scontext);
 }
@@ -1609,9 +2518,17 @@ typedef struct {
   librdf_statement *statement;
   librdf_node* context;
 
-  /* OUT from sqlite3_prepare (V3) or sqlite_compile (V2) */
+  /* taken from the kept find statements and given back when finished */
   sqlite3_stmt *vm;
-  const char *zTail;
+  int shape;
+
+  /* reader connection the statement is from or NULL for the main one */
+  librdf_storage_sqlite_reader *reader;
+
+  /* statements and contexts returned by a batch, reused by the next */
+  librdf_statement **batch;
+  librdf_node **batch_contexts;
+  int batch_size;
 } librdf_storage_sqlite_find_statements_stream_context;
 
 
@@ -1636,16 +2553,9 @@ librdf_storage_sqlite_find_statements(librdf_storage* storage,
   librdf_storage_sqlite_instance* context;
   librdf_storage_sqlite_find_statements_stream_context* scontext;
   librdf_stream* stream;
-  unsigned char* request;
-  int status;
   triple_node_type node_types[4];
   int node_ids[4];
   const unsigned char* fields[4];
-  char *errmsg = NULL;
-  raptor_stringbuffer *sb;
-  int need_where = 1;
-  int need_and = 0;
-  int i;
   
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
@@ -1661,81 +2571,34 @@ librdf_storage_sqlite_find_statements(librdf_storage* storage,
   context->in_stream++;
 
   scontext->query_statement = librdf_new_statement_from_statement(statement);
-  if(!scontext->query_statement) {
-    librdf_storage_sqlite_find_statements_finished((void*)scontext);
-    return NULL;
-  }
-
-  if(librdf_storage_sqlite_statement_helper(storage,
-                                            statement,
-                                            NULL, 
-                                            node_types, node_ids, fields,
-                                            0)) {
-    librdf_storage_sqlite_find_statements_finished((void*)scontext);
-    return NULL;
-  }
-
-  sb = raptor_new_stringbuffer();
-  if(!sb) {
-    librdf_storage_sqlite_find_statements_finished((void*)scontext);
-    return NULL;
-  }
-
-  sqlite_construct_select_helper(sb);
-
-  for(i = 0; i < 3; i++) {
-    if(node_types[i] == TRIPLE_NONE)
-      continue;
-    
-    if(need_where) {
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)" WHERE ", 7, 1);
-      need_where = 0;
-      need_and = 1;
-    } else if(need_and)
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)" AND ", 5, 1);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)"T.", 2, 1);
-    raptor_stringbuffer_append_string(sb, fields[i], 1);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)"=", 1, 1);
-    raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)"\n", 1, 1);
-  }
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)";", 1, 1);
-  
-  request = raptor_stringbuffer_as_string(sb);
-  if(!request) {
-    raptor_free_stringbuffer(sb);
+  if(!scontext->query_statement) {
     librdf_storage_sqlite_find_statements_finished((void*)scontext);
     return NULL;
   }
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
-  LIBRDF_DEBUG2("SQLite prepare '%s'\n", request);
-#endif
-
-  status = sqlite3_prepare(context->db,
-                           (const char*)request,
-                           LIBRDF_GOOD_CAST(int, raptor_stringbuffer_length(sb)),
-                           &scontext->vm,
-                           &scontext->zTail);
-  if(status != SQLITE_OK)
-    errmsg = (char*)sqlite3_errmsg(context->db);
-
-  raptor_free_stringbuffer(sb);
+  if(librdf_storage_sqlite_statement_helper(storage,
+                                            statement,
+                                            NULL, 
+                                            node_types, node_ids, fields,
+                                            0)) {
+    librdf_storage_sqlite_find_statements_finished((void*)scontext);
+    return NULL;
+  }
 
-  if(status != SQLITE_OK) {
-    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "SQLite database %s SQL compile '%s' failed - %s (%d)", 
-               context->name, request, errmsg, status);
+  scontext->shape = librdf_storage_sqlite_triple_shape(node_types);
 
+  scontext->vm = librdf_storage_sqlite_triple_statement_take(storage,
+                                                             &scontext->reader,
+                                                             node_types,
+                                                             node_ids);
+  if(!scontext->vm) {
     librdf_storage_sqlite_find_statements_finished((void*)scontext);
     return NULL;
   }
+
+  /* a reader does not hold up writes on the main connection */
+  if(scontext->reader)
+    context->in_stream--;
   
   stream = librdf_new_stream(storage->world,
                              (void*)scontext,
@@ -1747,6 +2610,9 @@ librdf_storage_sqlite_find_statements(librdf_storage* storage,
     librdf_storage_sqlite_find_statements_finished((void*)scontext);
     return NULL;
   }
+
+  librdf_stream_set_next_batch_method(stream,
+                                      &librdf_storage_sqlite_find_statements_next_batch);
   
   return stream;  
 }
@@ -1830,6 +2696,76 @@ librdf_storage_sqlite_find_statements_get_statement(void* context, int flags)
 }
 
 
+/*
+ * librdf_storage_sqlite_find_statements_next_batch - Get the rows from the current one on
+ *
+ * Each row is stepped into the stream statement as usual, which is
+ * then swapped with a statement of the batch, so the statements are
+ * reused rather than made per row.
+ */
+static int
+librdf_storage_sqlite_find_statements_next_batch(void* context,
+                                                 librdf_statement** statements,
+                                                 librdf_node** contexts,
+                                                 int size)
+{
+  librdf_storage_sqlite_find_statements_stream_context* scontext;
+  int count = 0;
+
+  scontext = (librdf_storage_sqlite_find_statements_stream_context*)context;
+
+  if(size > scontext->batch_size) {
+    librdf_statement** batch;
+    librdf_node** batch_contexts;
+
+    batch = LIBRDF_CALLOC(librdf_statement**, size, sizeof(*batch));
+    batch_contexts = LIBRDF_CALLOC(librdf_node**, size,
+                                   sizeof(*batch_contexts));
+    if(!batch || !batch_contexts) {
+      if(batch)
+        LIBRDF_FREE(librdf_statement**, batch);
+      if(batch_contexts)
+        LIBRDF_FREE(librdf_node**, batch_contexts);
+      return -1;
+    }
+
+    if(scontext->batch) {
+      memcpy(batch, scontext->batch, scontext->batch_size * sizeof(*batch));
+      memcpy(batch_contexts, scontext->batch_contexts,
+             scontext->batch_size * sizeof(*batch_contexts));
+      LIBRDF_FREE(librdf_statement**, scontext->batch);
+      LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
+    }
+    scontext->batch = batch;
+    scontext->batch_contexts = batch_contexts;
+    scontext->batch_size = size;
+  }
+
+  while(count < size &&
+        !librdf_storage_sqlite_find_statements_end_of_stream(scontext)) {
+    librdf_statement* statement = scontext->batch[count];
+
+    scontext->batch[count] = scontext->statement;
+    scontext->statement = statement;
+
+    /* rows without a context must not keep the last row's one */
+    if(scontext->batch_contexts[count])
+      librdf_free_node(scontext->batch_contexts[count]);
+    scontext->batch_contexts[count] = scontext->context;
+    scontext->context = NULL;
+
+    statements[count] = scontext->batch[count];
+    contexts[count] = scontext->batch_contexts[count];
+    count++;
+
+    if(librdf_storage_sqlite_find_statements_next_statement(scontext) < 0)
+      return -1;
+  }
+
+  return count;
+}
+
+
 static void
 librdf_storage_sqlite_find_statements_finished(void* context)
 {
@@ -1837,22 +2773,23 @@ librdf_storage_sqlite_find_statements_finished(void* context)
 
   scontext  = (librdf_storage_sqlite_find_statements_stream_context*)context;
 
-  if(scontext->vm) {
-    char *errmsg = NULL;
-    int status;
-    
-    status = sqlite3_finalize(scontext->vm);
-    if(status != SQLITE_OK)
-      errmsg = (char*)sqlite3_errmsg(scontext->sqlite_context->db);
+  if(scontext->batch) {
+    int i;
 
-    if(status != SQLITE_OK) {
-      librdf_log(scontext->storage->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                 "SQLite database %s finalize failed - %s (%d)", 
-                 scontext->sqlite_context->name, errmsg, status);
+    for(i = 0; i < scontext->batch_size; i++) {
+      if(scontext->batch[i])
+        librdf_free_statement(scontext->batch[i]);
+      if(scontext->batch_contexts[i])
+        librdf_free_node(scontext->batch_contexts[i]);
     }
+    LIBRDF_FREE(librdf_statement**, scontext->batch);
+    LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
   }
 
+  librdf_storage_sqlite_triple_statement_done(scontext->storage,
+                                              scontext->reader,
+                                              scontext->shape, scontext->vm);
+
   if(scontext->storage)
     librdf_storage_remove_reference(scontext->storage);
 
@@ -1865,14 +2802,49 @@ librdf_storage_sqlite_find_statements_finished(void* context)
   if(scontext->context)
     librdf_free_node(scontext->context);
 
-  scontext->sqlite_context->in_stream--;
-  if(!scontext->sqlite_context->in_stream)
-    librdf_storage_sqlite_query_flush(scontext->storage);
+  if(!scontext->reader) {
+    scontext->sqlite_context->in_stream--;
+    if(!scontext->sqlite_context->in_stream)
+      librdf_storage_sqlite_query_flush(scontext->storage);
+  }
 
   LIBRDF_FREE(librdf_storage_sqlite_find_statements_stream_context, scontext);
 }
 
 
+/**
+ * librdf_storage_sqlite_find_statements_with_options:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: the context to search or NULL
+ * @options: #librdf_hash of match options or NULL
+ *
+ * Find statements with options.  Substring and prefix matches of
+ * object literals use an in-memory text index of the literals, made
+ * by the first of them and then kept up to date by this connection.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_sqlite_find_statements_with_options(librdf_storage* storage,
+                                                   librdf_statement* statement,
+                                                   librdf_node* context_node,
+                                                   librdf_hash* options)
+{
+  librdf_storage_sqlite_instance* context;
+  int prefix;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(librdf_storage_get_text_match(options, statement, &prefix))
+    librdf_literal_index_make(&context->literal_index, storage);
+
+  return librdf_literal_index_find_statements(context->literal_index, storage,
+                                              statement, context_node,
+                                              options);
+}
+
+
 /**
  * librdf_storage_sqlite_context_add_statement:
  * @storage: #librdf_storage object
@@ -1888,27 +2860,19 @@ librdf_storage_sqlite_context_add_statement(librdf_storage* storage,
                                             librdf_node* context_node,
                                             librdf_statement* statement) 
 {
-  /* librdf_storage_sqlite_instance* context; */
+  librdf_storage_sqlite_instance* context;
   triple_node_type node_types[4];
   int node_ids[4];
   const unsigned char* fields[4];
-  raptor_stringbuffer *sb;
-  unsigned char* request;
-  int i;
   int rc, begin;
-  int max=3;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
 
   /* Do not add duplicate statements */
   rc = librdf_storage_sqlite_context_contains_statement(storage, context_node, statement);
   if(rc != 0)
     return rc < 0 ? rc : 0; /* return error or 'found' */
 
-  /* context = (librdf_storage_sqlite_instance*)storage->instance; */
-
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
-
   /* returns non-0 if transaction is already active */
   begin = librdf_storage_sqlite_transaction_start(storage);
 
@@ -1920,47 +2884,11 @@ librdf_storage_sqlite_context_add_statement(librdf_storage* storage,
 
     if(!begin)
       librdf_storage_sqlite_transaction_rollback(storage);
-    raptor_free_stringbuffer(sb);
     return -1;
   }
   
-  if(context_node)
-    max++;
-
-  raptor_stringbuffer_append_string(sb, 
-                                    (unsigned char*)"INSERT INTO ", 1);
-  raptor_stringbuffer_append_string(sb, 
-                                    (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)" ( ", 3, 1);
-  for(i = 0; i < max; i++) {
-    raptor_stringbuffer_append_string(sb, fields[i], 1);
-    if(i < (max-1))
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)", ", 2, 1);
-  }
-  
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)") VALUES(", 9, 1);
-  for(i = 0; i < max; i++) {
-    raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-    if(i < (max-1))
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)", ", 2, 1);
-  }
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)");", 2, 1);
-  
-  request = raptor_stringbuffer_as_string(sb);
-  
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL, /* no callback */
-                                  NULL, /* arg */
-                                  0);
-  
-  raptor_free_stringbuffer(sb);
-  
+  rc = librdf_storage_sqlite_triple_exec(storage, SQLITE_TRIPLE_INSERT,
+                                         node_types, node_ids, NULL);
   if(rc) {
     if(!begin)
       librdf_storage_transaction_rollback(storage);
@@ -1970,6 +2898,8 @@ librdf_storage_sqlite_context_add_statement(librdf_storage* storage,
   if(!begin)
     librdf_storage_transaction_commit(storage);
 
+  librdf_literal_index_update(&context->literal_index, statement, 1);
+
   return 0;
 }
 
@@ -1989,36 +2919,25 @@ librdf_storage_sqlite_context_remove_statement(librdf_storage* storage,
                                                librdf_node* context_node,
                                                librdf_statement* statement) 
 {
-  /* librdf_storage_sqlite_instance* context; */
+  librdf_storage_sqlite_instance* context;
+  triple_node_type node_types[4];
+  int node_ids[4];
+  const unsigned char* fields[4];
   int rc;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
 
-  /* context = (librdf_storage_sqlite_instance*)storage->instance; */
-
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
+  context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  raptor_stringbuffer_append_string(sb, (const unsigned char*)"DELETE", 1);
-  if(librdf_storage_sqlite_statement_operator_helper(storage, statement,
-                                                     context_node, sb, 0)) {
-    raptor_free_stringbuffer(sb);
+  if(librdf_storage_sqlite_statement_helper(storage,
+                                            statement,
+                                            context_node,
+                                            node_types, node_ids, fields,
+                                            0))
     return -1;
-  }
 
-  raptor_stringbuffer_append_counted_string(sb,
-                                            (const unsigned char*)";", 1, 1);
- 
-  request = raptor_stringbuffer_as_string(sb);
-  
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL,
-                                  NULL,
-                                  0);
-  
-  raptor_free_stringbuffer(sb);
+  rc = librdf_storage_sqlite_triple_exec(storage, SQLITE_TRIPLE_DELETE,
+                                         node_types, node_ids, NULL);
+  if(!rc)
+    librdf_literal_index_update(&context->literal_index, statement, 0);
 
   return rc;
 }
@@ -2028,13 +2947,13 @@ static  int
 librdf_storage_sqlite_context_remove_statements(librdf_storage* storage, 
                                                 librdf_node* context_node)
 {
+  librdf_storage_sqlite_instance* context;
   triple_node_type node_types[4];
   int node_ids[4];
   const unsigned char* fields[4];
-  raptor_stringbuffer *sb;
-  unsigned char *request;
-  int rc = 0;
   
+  if(!context_node)
+    return -1;
   
   if(librdf_storage_sqlite_statement_helper(storage,
                                             NULL,
@@ -2042,39 +2961,12 @@ librdf_storage_sqlite_context_remove_statements(librdf_storage* storage,
                                             node_types, node_ids, fields, 0))
     return -1;
     
-  sb = raptor_new_stringbuffer();
-  if(!sb)
+  if(librdf_storage_sqlite_triple_exec(storage, SQLITE_TRIPLE_DELETE,
+                                       node_types, node_ids, NULL))
     return -1;
 
-  raptor_stringbuffer_append_counted_string(sb,
-                                    (unsigned char*)"DELETE FROM ", 12, 1);
-  raptor_stringbuffer_append_string(sb, 
-                                    (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)" WHERE ", 7, 1);
-
-  raptor_stringbuffer_append_string(sb, fields[TRIPLE_CONTEXT], 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"=", 1, 1);
-  raptor_stringbuffer_append_decimal(sb, node_ids[TRIPLE_CONTEXT]);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"\n", 1, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)";", 1, 1);
-  
-  request = raptor_stringbuffer_as_string(sb);
-
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL, /* no callback */
-                                  NULL, /* arg */
-                                  0);
-
-  raptor_free_stringbuffer(sb);
-
-  if(rc)
-    return -1;
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+  librdf_literal_index_removed(context->literal_index);
 
   return 0;
 }
@@ -2091,9 +2983,12 @@ typedef struct {
   librdf_statement *statement;
   librdf_node* context;
 
-  /* OUT from sqlite3_prepare (V3) or sqlite_compile (V2) */
+  /* taken from the kept find statements and given back when finished */
   sqlite3_stmt *vm;
-  const char *zTail;
+  int shape;
+
+  /* reader connection the statement is from or NULL for the main one */
+  librdf_storage_sqlite_reader *reader;
 } librdf_storage_sqlite_context_serialise_stream_context;
 
 
@@ -2113,13 +3008,9 @@ librdf_storage_sqlite_context_serialise(librdf_storage* storage,
   librdf_storage_sqlite_instance* context;
   librdf_storage_sqlite_context_serialise_stream_context* scontext;
   librdf_stream* stream;
-  int status;
-  char *errmsg = NULL;
   triple_node_type node_types[4];
   int node_ids[4];
   const unsigned char* fields[4];
-  raptor_stringbuffer *sb;
-  unsigned char *request;
 
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
@@ -2145,55 +3036,20 @@ librdf_storage_sqlite_context_serialise(librdf_storage* storage,
     return NULL;
   }
 
-  sb = raptor_new_stringbuffer();
-  if(!sb) {
-    librdf_storage_sqlite_context_serialise_finished((void*)scontext);
-    return NULL;
-  }
+  scontext->shape = librdf_storage_sqlite_triple_shape(node_types);
 
-  sqlite_construct_select_helper(sb);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)" WHERE ", 7, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"T.", 2, 1);
-  raptor_stringbuffer_append_string(sb, fields[TRIPLE_CONTEXT], 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"=", 1, 1);
-  raptor_stringbuffer_append_decimal(sb, node_ids[TRIPLE_CONTEXT]);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)"\n", 1, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)";", 1, 1);
-  
-  request = raptor_stringbuffer_as_string(sb);
-  if(!request) {
-    raptor_free_stringbuffer(sb);
+  scontext->vm = librdf_storage_sqlite_triple_statement_take(storage,
+                                                             &scontext->reader,
+                                                             node_types,
+                                                             node_ids);
+  if(!scontext->vm) {
     librdf_storage_sqlite_context_serialise_finished((void*)scontext);
     return NULL;
   }
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
-  LIBRDF_DEBUG2("SQLite prepare '%s'\n", request);
-#endif
-
-  status = sqlite3_prepare(context->db,
-                           (const char*)request,
-                           LIBRDF_GOOD_CAST(int, raptor_stringbuffer_length(sb)),
-                           &scontext->vm,
-                           &scontext->zTail);
-  if(status != SQLITE_OK)
-    errmsg = (char*)sqlite3_errmsg(context->db);
-
-  raptor_free_stringbuffer(sb);
-
-  if(status != SQLITE_OK) {
-    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "SQLite database %s SQL compile failed - %s (%d)", 
-               context->name, errmsg, status);
-
-    librdf_storage_sqlite_context_serialise_finished((void*)scontext);
-    return NULL;
-  }
+  /* a reader does not hold up writes on the main connection */
+  if(scontext->reader)
+    context->in_stream--;
 
   stream = librdf_new_stream(storage->world,
                              (void*)scontext,
@@ -2296,21 +3152,9 @@ librdf_storage_sqlite_context_serialise_finished(void* context)
 
   scontext = (librdf_storage_sqlite_context_serialise_stream_context*)context;
 
-  if(scontext->vm) {
-    char *errmsg = NULL;
-    int status;
-    
-    status = sqlite3_finalize(scontext->vm);
-    if(status != SQLITE_OK)
-      errmsg = (char*)sqlite3_errmsg(scontext->sqlite_context->db);
-
-    if(status != SQLITE_OK) {
-      librdf_log(scontext->storage->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                 "SQLite database %s finalize failed - %s (%d)", 
-                 scontext->sqlite_context->name, errmsg, status);
-    }
-  }
+  librdf_storage_sqlite_triple_statement_done(scontext->storage,
+                                              scontext->reader,
+                                              scontext->shape, scontext->vm);
 
   if(scontext->storage)
     librdf_storage_remove_reference(scontext->storage);
@@ -2324,9 +3168,11 @@ librdf_storage_sqlite_context_serialise_finished(void* context)
   if(scontext->context_node)
     librdf_free_node(scontext->context_node);
 
-  scontext->sqlite_context->in_stream--;
-  if(!scontext->sqlite_context->in_stream)
-    librdf_storage_sqlite_query_flush(scontext->storage);
+  if(!scontext->reader) {
+    scontext->sqlite_context->in_stream--;
+    if(!scontext->sqlite_context->in_stream)
+      librdf_storage_sqlite_query_flush(scontext->storage);
+  }
 
   LIBRDF_FREE(librdf_storage_sqlite_context_serialise_stream_context, scontext);
 }
@@ -2650,10 +3496,10 @@ librdf_storage_sqlite_get_contexts(librdf_storage* storage)
 static librdf_node*
 librdf_storage_sqlite_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
-  /* librdf_storage_sqlite_instance* scontext; */
+  librdf_storage_sqlite_instance* scontext;
   unsigned char *uri_string;
 
-  /* scontext = (librdf_storage_sqlite_instance*)storage->instance; */
+  scontext = (librdf_storage_sqlite_instance*)storage->instance;
 
   if(!feature)
     return NULL;
@@ -2668,10 +3514,90 @@ librdf_storage_sqlite_get_feature(librdf_storage* storage, librdf_uri* feature)
                                               NULL, NULL);
   }
 
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_CONCURRENT_READS)) {
+    /* an in-memory database is private to its connection and
+     * uncommitted changes are not seen by other connections */
+    int shared = (strcmp(scontext->name, ":memory:") &&
+                  !scontext->in_transaction);
+
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)(shared ? "1" : "0"),
+                                              NULL, NULL);
+  }
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_LITERAL_INDEX)) {
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)"1",
+                                              NULL, NULL);
+  }
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_COMPACT)) {
+    int compact = strcmp(scontext->name, ":memory:");
+
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)(compact ? "1" : "0"),
+                                              NULL, NULL);
+  }
+
   return NULL;
 }
 
 
+/**
+ * librdf_storage_sqlite_set_feature:
+ * @storage: #librdf_storage object
+ * @feature: #librdf_uri feature property
+ * @value: #librdf_node feature property value
+ *
+ * Set the value of a storage feature.
+ *
+ * Compacting rebuilds the indexes then VACUUMs, which copies the
+ * database in table and index order into a temporary file and writes
+ * it back in one transaction, so other connections keep reading the
+ * old pages until it commits.
+ * 
+ * Return value: non 0 on failure (negative if no such feature)
+ **/
+static int
+librdf_storage_sqlite_set_feature(librdf_storage* storage, librdf_uri* feature,
+                                  librdf_node* value)
+{
+  librdf_storage_sqlite_instance* scontext;
+  unsigned char *uri_string;
+
+  scontext = (librdf_storage_sqlite_instance*)storage->instance;
+
+  uri_string = librdf_uri_as_string(feature);
+  if(!uri_string)
+    return -1;
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_COMPACT)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+    if(atoi((const char*)librdf_node_get_literal_value(value)) <= 0)
+      return 0;
+
+    /* VACUUM cannot run inside a transaction or under a statement */
+    if(scontext->in_transaction || scontext->in_stream ||
+       !strcmp(scontext->name, ":memory:"))
+      return 1;
+
+    if(librdf_storage_sqlite_exec(storage, (unsigned char*)"REINDEX;",
+                                  NULL, NULL, 0) ||
+       librdf_storage_sqlite_exec(storage, (unsigned char*)"VACUUM;",
+                                  NULL, NULL, 0))
+      return 1;
+
+    librdf_storage_sqlite_exec(storage, (unsigned char*)"ANALYZE;",
+                               NULL, NULL, 0);
+    scontext->added_since_analyze = 0;
+    return 0;
+  }
+
+  return -1;
+}
+
+
 /**
  * librdf_storage_sqlite_transaction_start:
  * @storage: #librdf_storage object
@@ -2758,6 +3684,10 @@ librdf_storage_sqlite_transaction_rollback(librdf_storage *storage)
   if(!rc)
     context->in_transaction = 0;
 
+  /* ids of nodes added in the transaction are gone and may be reused */
+  if(context->node_cache)
+    librdf_sql_node_cache_clear(context->node_cache);
+
   return rc;
 }
 
@@ -2811,6 +3741,8 @@ librdf_storage_sqlite_register_factory(librdf_storage_factory *factory)
   factory->add_statements     = librdf_storage_sqlite_add_statements;
   factory->remove_statement   = librdf_storage_sqlite_remove_statement;
   factory->contains_statement = librdf_storage_sqlite_contains_statement;
+  factory->has_arc_in         = librdf_storage_sqlite_has_arc_in;
+  factory->has_arc_out        = librdf_storage_sqlite_has_arc_out;
   factory->serialise          = librdf_storage_sqlite_serialise;
   factory->find_statements    = librdf_storage_sqlite_find_statements;
   factory->context_add_statement    = librdf_storage_sqlite_context_add_statement;
@@ -2819,9 +3751,12 @@ librdf_storage_sqlite_register_factory(librdf_storage_factory *factory)
   factory->context_serialise        = librdf_storage_sqlite_context_serialise;
   factory->get_contexts             = librdf_storage_sqlite_get_contexts;
   factory->get_feature              = librdf_storage_sqlite_get_feature;
+  factory->set_feature              = librdf_storage_sqlite_set_feature;
   factory->transaction_start        = librdf_storage_sqlite_transaction_start;
   factory->transaction_commit       = librdf_storage_sqlite_transaction_commit;
   factory->transaction_rollback     = librdf_storage_sqlite_transaction_rollback;
+  factory->count_statements         = librdf_storage_sqlite_count_statements;
+  factory->find_statements_with_options = librdf_storage_sqlite_find_statements_with_options;
 }
 
 #ifdef MODULAR_LIBRDF
@@ -0,0 +1,522 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_stats.c - RDF Storage operation counts and latencies
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+/* for gettimeofday */
+#if TIME_WITH_SYS_TIME
+#include <sys/time.h>
+#include <time.h>
+#else
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+#endif
+
+#include <redland.h>
+
+
+/*
+ * Every call the storage API passes to the storage factory is timed
+ * while instrumentation is on, and the time taken counted in one of
+ * the latency buckets of the operation.  Calls still inside the
+ * factory are counted as active, so a call that never returns shows
+ * up as one that stays active, and streams and iterators returned
+ * are counted as open until freed, with the statements or nodes
+ * read from them added to the rows of the operation.
+ */
+
+/* bucket i counts calls of under 2^i microseconds, the last the rest */
+#define LIBRDF_STORAGE_STATS_BUCKETS 24
+
+typedef struct
+{
+  unsigned long calls;
+  unsigned long errors;
+  unsigned long rows;
+  u64 total_us;
+  u64 max_us;
+  long active;
+  long open;
+  unsigned long buckets[LIBRDF_STORAGE_STATS_BUCKETS];
+} librdf_storage_op_stats;
+
+
+struct librdf_storage_stats_s
+{
+  int enabled;
+#ifdef WITH_THREADS
+  pthread_mutex_t mutex;
+#endif
+  librdf_storage_op_stats ops[LIBRDF_STORAGE_OP_LAST + 1];
+};
+
+
+/* names of the operations in the operation stats feature URIs */
+static const char * const librdf_storage_op_names[LIBRDF_STORAGE_OP_LAST + 1] = {
+  "size",
+  "add",
+  "add-stream",
+  "remove",
+  "contains",
+  "count",
+  "serialise",
+  "find",
+  "sources",
+  "arcs",
+  "targets",
+  "arcs-in",
+  "arcs-out",
+  "has-arc-in",
+  "has-arc-out",
+  "context-add",
+  "context-add-stream",
+  "context-remove",
+  "context-remove-all",
+  "context-serialise",
+  "find-in-context",
+  "find-with-options",
+  "contexts",
+  "query",
+  "sync",
+  "transaction-start",
+  "transaction-commit",
+  "transaction-rollback"
+};
+
+
+/* A stream or iterator whose rows are being counted */
+typedef struct
+{
+  librdf_storage* storage;
+  librdf_storage_op op;
+  unsigned long rows;
+} librdf_storage_stats_rows;
+
+
+static void
+librdf_storage_stats_lock(librdf_storage_stats* stats)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&stats->mutex);
+#endif
+}
+
+
+static void
+librdf_storage_stats_unlock(librdf_storage_stats* stats)
+{
+#ifdef WITH_THREADS
+  pthread_mutex_unlock(&stats->mutex);
+#endif
+}
+
+
+/* microseconds now, never 0 so that 0 can mean not timed */
+static u64
+librdf_storage_stats_now(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+
+  if(!gettimeofday(&tv, NULL))
+    return (u64)tv.tv_sec * 1000000 + (u64)tv.tv_usec + 1;
+#endif
+  return (u64)time(NULL) * 1000000 + 1;
+}
+
+
+/**
+ * librdf_free_storage_stats:
+ * @stats: storage stats
+ *
+ * INTERNAL - Destructor - free the operation stats of a storage
+ */
+void
+librdf_free_storage_stats(librdf_storage_stats* stats)
+{
+  if(!stats)
+    return;
+
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&stats->mutex);
+#endif
+  LIBRDF_FREE(librdf_storage_stats, stats);
+}
+
+
+/**
+ * librdf_storage_stats_set_enabled:
+ * @storage: storage
+ * @enabled: non 0 to collect stats, 0 to stop
+ *
+ * INTERNAL - Start or stop collecting operation stats for a storage
+ *
+ * Starting again clears the counts of the calls made before; the
+ * active and open counts are kept as they describe calls still
+ * running.  Stopping keeps the counts for reading.
+ *
+ * Return value: non 0 on failure
+ */
+int
+librdf_storage_stats_set_enabled(librdf_storage* storage, int enabled)
+{
+  librdf_storage_stats* stats = storage->stats;
+  int i;
+
+  if(!stats) {
+    if(!enabled)
+      return 0;
+
+    stats = LIBRDF_CALLOC(librdf_storage_stats*, 1, sizeof(*stats));
+    if(!stats)
+      return 1;
+#ifdef WITH_THREADS
+    pthread_mutex_init(&stats->mutex, NULL);
+#endif
+    storage->stats = stats;
+  }
+
+  librdf_storage_stats_lock(stats);
+  if(enabled && !stats->enabled) {
+    for(i = 0; i <= LIBRDF_STORAGE_OP_LAST; i++) {
+      librdf_storage_op_stats* op = &stats->ops[i];
+      long active = op->active;
+      long open = op->open;
+
+      memset(op, 0, sizeof(*op));
+      op->active = active;
+      op->open = open;
+    }
+  }
+  stats->enabled = enabled;
+  librdf_storage_stats_unlock(stats);
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_stats_start:
+ * @storage: storage
+ * @op: operation about to be called
+ *
+ * INTERNAL - Note the start of a storage factory call
+ *
+ * Return value: start time to pass to librdf_storage_stats_end() or 0 if not collecting
+ */
+u64
+librdf_storage_stats_start(librdf_storage* storage, librdf_storage_op op)
+{
+  librdf_storage_stats* stats = storage->stats;
+
+  if(!stats || !stats->enabled)
+    return 0;
+
+  librdf_storage_stats_lock(stats);
+  stats->ops[op].active++;
+  librdf_storage_stats_unlock(stats);
+
+  return librdf_storage_stats_now();
+}
+
+
+/**
+ * librdf_storage_stats_end:
+ * @storage: storage
+ * @op: operation called
+ * @start: time returned by librdf_storage_stats_start()
+ * @failed: non 0 if the call failed
+ *
+ * INTERNAL - Note the end of a storage factory call
+ */
+void
+librdf_storage_stats_end(librdf_storage* storage, librdf_storage_op op,
+                         u64 start, int failed)
+{
+  librdf_storage_stats* stats = storage->stats;
+  librdf_storage_op_stats* op_stats;
+  u64 took;
+  int bucket;
+
+  if(!start)
+    return;
+
+  took = librdf_storage_stats_now();
+  took = (took > start) ? took - start : 0;
+  for(bucket = 0;
+      bucket < LIBRDF_STORAGE_STATS_BUCKETS - 1 && (took >> bucket);
+      bucket++)
+    ;
+
+  librdf_storage_stats_lock(stats);
+  op_stats = &stats->ops[op];
+  op_stats->active--;
+  op_stats->calls++;
+  if(failed)
+    op_stats->errors++;
+  op_stats->total_us += took;
+  if(took > op_stats->max_us)
+    op_stats->max_us = took;
+  op_stats->buckets[bucket]++;
+  librdf_storage_stats_unlock(stats);
+}
+
+
+static librdf_storage_stats_rows*
+librdf_storage_stats_new_rows(librdf_storage* storage, librdf_storage_op op)
+{
+  librdf_storage_stats_rows* rows;
+
+  rows = LIBRDF_CALLOC(librdf_storage_stats_rows*, 1, sizeof(*rows));
+  if(!rows)
+    return NULL;
+
+  /* the stats are freed with the storage */
+  rows->storage = storage;
+  librdf_storage_add_reference(storage);
+  rows->op = op;
+
+  librdf_storage_stats_lock(storage->stats);
+  storage->stats->ops[op].open++;
+  librdf_storage_stats_unlock(storage->stats);
+
+  return rows;
+}
+
+
+static void
+librdf_storage_stats_free_rows(void* context)
+{
+  librdf_storage_stats_rows* rows = (librdf_storage_stats_rows*)context;
+  librdf_storage_stats* stats = rows->storage->stats;
+
+  librdf_storage_stats_lock(stats);
+  stats->ops[rows->op].open--;
+  stats->ops[rows->op].rows += rows->rows;
+  librdf_storage_stats_unlock(stats);
+
+  librdf_storage_remove_reference(rows->storage);
+  LIBRDF_FREE(librdf_storage_stats_rows, rows);
+}
+
+
+static librdf_statement*
+librdf_storage_stats_stream_map(librdf_stream* stream, void* context,
+                                librdf_statement* statement)
+{
+  ((librdf_storage_stats_rows*)context)->rows++;
+  return statement;
+}
+
+
+static void*
+librdf_storage_stats_iterator_map(librdf_iterator* iterator, void* context,
+                                  void* item)
+{
+  ((librdf_storage_stats_rows*)context)->rows++;
+  return item;
+}
+
+
+/**
+ * librdf_storage_stats_stream:
+ * @storage: storage
+ * @op: operation called
+ * @start: time returned by librdf_storage_stats_start()
+ * @stream: stream returned by the call or NULL on failure
+ *
+ * INTERNAL - Note the end of a storage factory call returning a stream
+ *
+ * The statements read from the stream are counted as the rows of the
+ * operation when the stream is freed.
+ *
+ * Return value: @stream
+ */
+librdf_stream*
+librdf_storage_stats_stream(librdf_storage* storage, librdf_storage_op op,
+                            u64 start, librdf_stream* stream)
+{
+  librdf_storage_stats_rows* rows;
+
+  if(!start)
+    return stream;
+
+  librdf_storage_stats_end(storage, op, start, !stream);
+  if(!stream)
+    return NULL;
+
+  /* the map context is freed if it cannot be added */
+  rows = librdf_storage_stats_new_rows(storage, op);
+  if(rows)
+    librdf_stream_add_map(stream, &librdf_storage_stats_stream_map,
+                          &librdf_storage_stats_free_rows, rows);
+
+  return stream;
+}
+
+
+/**
+ * librdf_storage_stats_iterator:
+ * @storage: storage
+ * @op: operation called
+ * @start: time returned by librdf_storage_stats_start()
+ * @iterator: iterator returned by the call or NULL on failure
+ *
+ * INTERNAL - Note the end of a storage factory call returning an iterator
+ *
+ * Return value: @iterator
+ */
+librdf_iterator*
+librdf_storage_stats_iterator(librdf_storage* storage, librdf_storage_op op,
+                              u64 start, librdf_iterator* iterator)
+{
+  librdf_storage_stats_rows* rows;
+
+  if(!start)
+    return iterator;
+
+  librdf_storage_stats_end(storage, op, start, !iterator);
+  if(!iterator)
+    return NULL;
+
+  rows = librdf_storage_stats_new_rows(storage, op);
+  if(rows &&
+     librdf_iterator_add_map(iterator, &librdf_storage_stats_iterator_map,
+                             &librdf_storage_stats_free_rows, rows))
+    librdf_storage_stats_free_rows(rows);
+
+  return iterator;
+}
+
+
+/* Format the stats of one operation, returning the length written */
+static size_t
+librdf_storage_stats_format(librdf_storage_op_stats* op_stats,
+                            char* buffer)
+{
+  char* p = buffer;
+  int i;
+
+  p += sprintf(p, "calls=%lu active=%ld open=%ld errors=%lu rows=%lu total-us=%lu max-us=%lu buckets=",
+               op_stats->calls, op_stats->active, op_stats->open,
+               op_stats->errors, op_stats->rows,
+               (unsigned long)op_stats->total_us,
+               (unsigned long)op_stats->max_us);
+  for(i = 0; i < LIBRDF_STORAGE_STATS_BUCKETS; i++)
+    p += sprintf(p, i ? ",%lu" : "%lu", op_stats->buckets[i]);
+
+  return LIBRDF_GOOD_CAST(size_t, p - buffer);
+}
+
+
+/* longest formatted operation: the names, 7 counts and the buckets */
+#define LIBRDF_STORAGE_STATS_LINE_SIZE \
+  (32 + 100 + 7 * 21 + LIBRDF_STORAGE_STATS_BUCKETS * 21)
+
+/**
+ * librdf_storage_stats_get_feature:
+ * @storage: storage
+ * @uri_string: feature URI string
+ *
+ * INTERNAL - Get the instrument or operation stats storage features
+ *
+ * Return value: new #librdf_node value or NULL if @uri_string is not
+ * one of these features, or no stats were collected
+ */
+librdf_node*
+librdf_storage_stats_get_feature(librdf_storage* storage,
+                                 const char* uri_string)
+{
+  librdf_storage_stats* stats = storage->stats;
+  size_t prefix_len = strlen(LIBRDF_STORAGE_FEATURE_OPERATION_STATS);
+  const char* name;
+  char* buffer;
+  size_t len = 0;
+  librdf_node* node;
+  int i;
+
+  if(!strcmp(uri_string, LIBRDF_STORAGE_FEATURE_INSTRUMENT))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)((stats && stats->enabled) ? "1" : "0"),
+                                              NULL, NULL);
+
+  if(strncmp(uri_string, LIBRDF_STORAGE_FEATURE_OPERATION_STATS, prefix_len) ||
+     !stats)
+    return NULL;
+
+  /* one operation by name or else a line for each operation used */
+  name = uri_string + prefix_len;
+  if(*name) {
+    for(i = 0; i <= LIBRDF_STORAGE_OP_LAST; i++)
+      if(!strcmp(librdf_storage_op_names[i], name))
+        break;
+    if(i > LIBRDF_STORAGE_OP_LAST)
+      return NULL;
+  }
+
+  buffer = LIBRDF_MALLOC(char*, (LIBRDF_STORAGE_OP_LAST + 1) *
+                         LIBRDF_STORAGE_STATS_LINE_SIZE);
+  if(!buffer)
+    return NULL;
+
+  librdf_storage_stats_lock(stats);
+  if(*name)
+    len = librdf_storage_stats_format(&stats->ops[i], buffer);
+  else {
+    for(i = 0; i <= LIBRDF_STORAGE_OP_LAST; i++) {
+      librdf_storage_op_stats* op_stats = &stats->ops[i];
+
+      if(!op_stats->calls && !op_stats->active && !op_stats->open)
+        continue;
+      len += LIBRDF_GOOD_CAST(size_t, sprintf(buffer + len, "%s ",
+                                              librdf_storage_op_names[i]));
+      len += librdf_storage_stats_format(op_stats, buffer + len);
+      buffer[len++] = '\n';
+    }
+    buffer[len] = '\0';
+  }
+  librdf_storage_stats_unlock(stats);
+
+  node = librdf_new_node_from_typed_counted_literal(storage->world,
+                                                    (const unsigned char*)buffer,
+                                                    len, NULL, 0, NULL);
+  LIBRDF_FREE(char*, buffer);
+  return node;
+}
@@ -4,22 +4,22 @@
  *
  * Copyright (C) 2000-2008, David Beckett http://www.dajobe.org/
  * Copyright (C) 2000-2004, University of Bristol, UK http://www.bristol.ac.uk/
- * 
+ *
  * This package is Free Software and part of Redland http://librdf.org/
- * 
+ *
  * It is licensed under the following three licenses as alternatives:
  *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
  *   2. GNU General Public License (GPL) V2 or any newer version
  *   3. Apache License, V2.0 or any newer version
- * 
+ *
  * You may not use this file except in compliance with at least one of
  * the above three licenses.
- * 
+ *
  * See LICENSE.html or LICENSE.txt at the top of this package for the
  * complete terms and further detail along with the license texts for
  * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
- * 
- * 
+ *
+ *
  */
 
 
@@ -36,37 +36,128 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
-/* for ptrdiff_t */
-#ifdef HAVE_STDDEF_H
-#include <stddef.h>
-#endif
 #include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
+#include <rdf_types.h>
+
+
+/*
+ * Every node is interned in a dictionary and statements are kept as
+ * triples of node ids in B+trees.  Each tree holds the triples in one
+ * ordering of (subject, predicate, object) so that a range scan is a
+ * walk along the linked leaves, comparing integers only.
+ */
+
+/* Tuples per leaf and children per branch */
+#define LIBRDF_STORAGE_TREES_LEAF_SIZE 64
+#define LIBRDF_STORAGE_TREES_BRANCH_SIZE 64
+
+/* Deepest tree; every branch but the root has at least 2 children */
+#define LIBRDF_STORAGE_TREES_MAX_DEPTH 32
+
+/* Tree orderings */
+#define LIBRDF_STORAGE_TREES_SPO 0
+#define LIBRDF_STORAGE_TREES_SOP 1
+#define LIBRDF_STORAGE_TREES_OPS 2
+#define LIBRDF_STORAGE_TREES_PSO 3
+#define LIBRDF_STORAGE_TREES_COUNT 4
+
+/* Statement part stored at each tuple position, by tree ordering
+ * (0 subject, 1 predicate, 2 object) */
+static const int librdf_storage_trees_orders[LIBRDF_STORAGE_TREES_COUNT][3]={
+  { 0, 1, 2 }, /* spo */
+  { 0, 2, 1 }, /* sop */
+  { 2, 1, 0 }, /* ops */
+  { 1, 0, 2 }  /* pso */
+};
+
+static const char* const librdf_storage_trees_order_names[LIBRDF_STORAGE_TREES_COUNT]={
+  "spo", "sop", "ops", "pso"
+};
+
+typedef struct {
+  u32 ids[3]; /* node ids in tree order; id 0 is below every node */
+} librdf_storage_trees_tuple;
 
-/* Not yet fully implemented (namely iteration) */
-/*#define RDF_STORAGE_TREES_WITH_CONTEXTS 1*/
+typedef struct librdf_storage_trees_page_s librdf_storage_trees_page;
+
+struct librdf_storage_trees_page_s {
+  int is_leaf;
+  int count; /* tuples in a leaf, children in a branch */
+  librdf_storage_trees_page* next; /* next leaf in order (leaves only) */
+};
+
+typedef struct {
+  librdf_storage_trees_page page;
+  librdf_storage_trees_tuple tuples[LIBRDF_STORAGE_TREES_LEAF_SIZE];
+} librdf_storage_trees_leaf;
+
+typedef struct {
+  librdf_storage_trees_page page;
+  /* keys[i] is not above any tuple under children[i] and is above
+   * every tuple under children[i-1]; keys[0] is unused */
+  librdf_storage_trees_tuple keys[LIBRDF_STORAGE_TREES_BRANCH_SIZE];
+  librdf_storage_trees_page* children[LIBRDF_STORAGE_TREES_BRANCH_SIZE];
+  int counts[LIBRDF_STORAGE_TREES_BRANCH_SIZE]; /* tuples under each child */
+} librdf_storage_trees_branch;
+
+typedef struct {
+  librdf_storage_trees_page* root;
+  int size;
+  const int* order;
+} librdf_storage_trees_btree;
 
 typedef struct
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node* context;
-#endif
-  raptor_avltree* spo_tree; /* Always present */
-  raptor_avltree* sop_tree; /* Optional */
-  raptor_avltree* ops_tree; /* Optional */
-  raptor_avltree* pso_tree; /* Optional */
+  librdf_node* context; /* NULL for statements without a context */
+  /* spo is always present, the others are optional */
+  librdf_storage_trees_btree* trees[LIBRDF_STORAGE_TREES_COUNT];
 } librdf_storage_trees_graph;
 
 typedef struct
 {
   librdf_storage_trees_graph* graph; /* Statements without a context */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  raptor_avltree* contexts; /* Tree of librdf_storage_trees_graph */
+  int contexts; /* non 0 if contexts are supported */
+  librdf_storage_trees_graph** context_graphs; /* by context node id */
+  u32 context_graphs_size;
+  int indexes[LIBRDF_STORAGE_TREES_COUNT]; /* trees kept for each graph */
+  int lazy_indexes; /* non 0 to add the other trees when first useful */
+  char* snapshot; /* file the content is loaded from and saved to or NULL */
+  int changed; /* non 0 if changed since loaded or saved */
+
+  int concurrent; /* non 0 if the locks below are used */
+#ifdef WITH_THREADS
+  /* held to read by every stream and reader, to write by writers */
+  pthread_rwlock_t lock;
+  pthread_mutex_t gate; /* taken by writers waiting for the lock */
+  pthread_key_t reads_key; /* read locks held by the thread */
+  /* guards what readers change: reference counts and lazy trees */
+  pthread_mutex_t mutex;
 #endif
-  int index_sop;
-  int index_ops;
-  int index_pso;
+
+  /* node dictionary */
+  librdf_node** nodes; /* by id; id 0 is never used */
+  u32* node_hashes; /* by id; hash of each node, kept so it is not redone */
+  u32 nodes_count; /* next id */
+  u32 nodes_size;
+  u32* node_slots; /* open addressed table of ids, 0 for empty */
+  u32 node_slots_size; /* power of 2 */
+  size_t nodes_memory; /* approximate bytes of the nodes */
+
+  /* text index of the literals in the node dictionary, made by the
+   * first text find and then kept with the dictionary */
+  librdf_literal_index* literal_index;
 } librdf_storage_trees_instance;
 
 /* prototypes for local functions */
@@ -77,37 +168,49 @@ static int librdf_storage_trees_size(librdf_storage* storage);
 static int librdf_storage_trees_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_trees_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_trees_remove_statement(librdf_storage* storage, librdf_statement* statement);
-static int librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph, librdf_statement* statement);
+static int librdf_storage_trees_remove_statement_internal(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_statement* statement);
 static int librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_trees_count_statements(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_trees_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement);
 
 /* graph functions */
 static librdf_storage_trees_graph* librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context);
-static void librdf_storage_trees_graph_free(void* data);
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-static int librdf_storage_trees_graph_compare(const void* data1, const void* data2);
-#endif
+static void librdf_storage_trees_graph_free(librdf_storage_trees_graph* graph);
+static int librdf_storage_trees_graph_add_tree(librdf_storage_trees_graph* graph, int tree);
+static int librdf_storage_trees_graph_build(librdf_storage_trees_graph* graph, const u32* triples, int count);
+
+/* snapshot functions */
+static int librdf_storage_trees_snapshot_load(librdf_storage* storage);
+static int librdf_storage_trees_snapshot_save(librdf_storage* storage);
 
 /* serialising implementing functions */
 static int librdf_storage_trees_serialise_end_of_stream(void* context);
 static int librdf_storage_trees_serialise_next_statement(void* context);
 static void* librdf_storage_trees_serialise_get_statement(void* context, int flags);
+static int librdf_storage_trees_serialise_next_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 static void librdf_storage_trees_serialise_finished(void* context);
 
 /* context functions */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 static int librdf_storage_trees_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
 static int librdf_storage_trees_context_remove_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_trees_context_remove_statements(librdf_storage* storage, librdf_node* context_node);
 static librdf_stream* librdf_storage_trees_context_serialise(librdf_storage* storage, librdf_node* context_node);
-#endif
-
-/* statement tree functions */
-static int librdf_statement_compare_spo(const void* data1, const void* data2);
-static int librdf_statement_compare_sop(const void* data1, const void* data2);
-static int librdf_statement_compare_ops(const void* data1, const void* data2);
-static int librdf_statement_compare_pso(const void* data1, const void* data2);
-static void librdf_storage_trees_avl_free(void* data);
+static librdf_stream* librdf_storage_trees_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
+static librdf_stream* librdf_storage_trees_find_statements_with_options(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, librdf_hash* options);
+static librdf_iterator* librdf_storage_trees_get_contexts(librdf_storage* storage);
+
+/* B+tree functions */
+static librdf_storage_trees_btree* librdf_storage_trees_btree_new(const int* order);
+static void librdf_storage_trees_btree_free(librdf_storage_trees_btree* tree);
+static int librdf_storage_trees_btree_insert(librdf_storage_trees_btree* tree, const u32* triple);
+static int librdf_storage_trees_btree_delete(librdf_storage_trees_btree* tree, const u32* triple);
+static int librdf_storage_trees_btree_contains(librdf_storage_trees_btree* tree, const u32* triple);
+static int librdf_storage_trees_btree_count_prefix(librdf_storage_trees_btree* tree, const librdf_storage_trees_tuple* prefix, int prefix_len);
+static librdf_storage_trees_leaf* librdf_storage_trees_btree_lower_bound(librdf_storage_trees_btree* tree, const librdf_storage_trees_tuple* tuple, int* position_p);
+static int librdf_storage_trees_btree_build(librdf_storage_trees_btree* tree, const u32* triples, int count, librdf_storage_trees_tuple* tuples, librdf_storage_trees_page** root_p, int* size_p);
+static void librdf_storage_trees_page_free(librdf_storage_trees_page* page);
+static size_t librdf_storage_trees_page_memory(librdf_storage_trees_page* page);
 
 
 static void librdf_storage_trees_register_factory(librdf_storage_factory *factory);
@@ -122,6 +225,7 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
   const int index_sop_option = librdf_hash_get_as_boolean(options, "index-sop") > 0;
   const int index_ops_option = librdf_hash_get_as_boolean(options, "index-ops") > 0;
   const int index_pso_option = librdf_hash_get_as_boolean(options, "index-pso") > 0;
+  const int index_lazy_option = librdf_hash_get_as_boolean(options, "index-lazy") > 0;
 
   librdf_storage_trees_instance* context;
 
@@ -134,810 +238,3126 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
 
   librdf_storage_set_instance(storage, context);
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   /* Support contexts if option given */
-  if (librdf_hash_get_as_boolean(options, "contexts") > 0) {
-    context->contexts=librdf_new_avltree(librdf_storage_trees_graph_compare,
-      librdf_storage_trees_graph_free);
-  } else {
-    context->contexts=NULL;
-  }
+  context->contexts=(librdf_hash_get_as_boolean(options, "contexts") > 0);
+
+  /* spo is always indexed, option just exists so user can
+   * specifically /only/ index spo */
+  context->indexes[LIBRDF_STORAGE_TREES_SPO]=1;
+
+  /* Trees not selected here are built by the first query they help */
+  context->lazy_indexes=index_lazy_option;
+
+  /* Content is loaded from this file on open and saved on sync and close */
+  context->snapshot=librdf_hash_get(options, "snapshot");
+
+  if(librdf_hash_get_as_boolean(options, "concurrent") > 0) {
+#ifdef WITH_THREADS
+    if(pthread_rwlock_init(&context->lock, NULL)) {
+      if(options)
+        librdf_free_hash(options);
+      return 1;
+    }
+    pthread_mutex_init(&context->gate, NULL);
+    pthread_mutex_init(&context->mutex, NULL);
+    if(pthread_key_create(&context->reads_key, NULL)) {
+      pthread_mutex_destroy(&context->mutex);
+      pthread_mutex_destroy(&context->gate);
+      pthread_rwlock_destroy(&context->lock);
+      if(options)
+        librdf_free_hash(options);
+      return 1;
+    }
+    context->concurrent=1;
+#else
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Ignoring concurrent option without thread support");
 #endif
+  }
 
   /* No indexing options given, index all by default */
-  if (!index_spo_option && !index_sop_option && !index_ops_option && !index_pso_option) {
-    context->index_sop=1;
-    context->index_ops=1;
-    context->index_pso=1;
+  if (!index_spo_option && !index_sop_option && !index_ops_option && !index_pso_option &&
+      !index_lazy_option) {
+    context->indexes[LIBRDF_STORAGE_TREES_SOP]=1;
+    context->indexes[LIBRDF_STORAGE_TREES_OPS]=1;
+    context->indexes[LIBRDF_STORAGE_TREES_PSO]=1;
   } else {
-    /* spo is always indexed, option just exists so user can
-     * specifically /only/ index spo */
-    context->index_sop=index_sop_option;
-    context->index_ops=index_ops_option;
-    context->index_pso=index_pso_option;
+    context->indexes[LIBRDF_STORAGE_TREES_SOP]=index_sop_option;
+    context->indexes[LIBRDF_STORAGE_TREES_OPS]=index_ops_option;
+    context->indexes[LIBRDF_STORAGE_TREES_PSO]=index_pso_option;
   }
-  
+
+  /* ids start at 1 */
+  context->nodes_count=1;
+
   context->graph = librdf_storage_trees_graph_new(storage, NULL);
-  
+
   /* no more options, might as well free them now */
   if(options)
     librdf_free_hash(options);
 
-  return 0;
+  return (context->graph == NULL);
 }
 
 
 static void
 librdf_storage_trees_terminate(librdf_storage* storage)
 {
-  if (storage->instance != NULL)
-    LIBRDF_FREE(librdf_storage_trees_instance, storage->instance);
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if (context == NULL)
+    return;
+
+#ifdef WITH_THREADS
+  if(context->concurrent) {
+    pthread_key_delete(context->reads_key);
+    pthread_mutex_destroy(&context->mutex);
+    pthread_mutex_destroy(&context->gate);
+    pthread_rwlock_destroy(&context->lock);
+  }
+#endif
+
+  if(context->snapshot)
+    LIBRDF_FREE(char*, context->snapshot);
+
+  LIBRDF_FREE(librdf_storage_trees_instance, context);
 }
 
 
-static int
-librdf_storage_trees_open(librdf_storage* storage, librdf_model* model)
+/*
+ * Locking for the concurrent option.  Readers and open streams or
+ * iterators hold the lock shared and writers hold it exclusively, so
+ * a thread must finish its own streams before changing the storage.
+ * A thread already reading only counts further read locks, so nested
+ * streams never wait, and new readers queue behind a waiting writer
+ * at the gate so writers are not starved.  Without the option these
+ * do nothing.
+ */
+#ifdef WITH_THREADS
+static long
+librdf_storage_trees_reads_held(librdf_storage_trees_instance* context)
 {
-  /* nop */
-  return 0;
+  return (long)pthread_getspecific(context->reads_key);
 }
+#endif
 
 
-/**
- * librdf_storage_trees_close:
- * @storage: the storage
- *
- * .
- * 
- * Close the storage, and free all content since there is no persistance.
- * 
- * Return value: non 0 on failure
- **/
-static int
-librdf_storage_trees_close(librdf_storage* storage)
+static void
+librdf_storage_trees_read_lock(librdf_storage_trees_instance* context)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  
-  librdf_storage_trees_graph_free(context->graph);
-  context->graph=NULL;
-  
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_free_avltree(context->contexts);
-  context->contexts=NULL;
+#ifdef WITH_THREADS
+  long held;
+
+  if(!context->concurrent)
+    return;
+
+  held=librdf_storage_trees_reads_held(context);
+  if(!held) {
+    pthread_mutex_lock(&context->gate);
+    pthread_rwlock_rdlock(&context->lock);
+    pthread_mutex_unlock(&context->gate);
+  }
+  pthread_setspecific(context->reads_key, (void*)(held + 1));
 #endif
-  
-  return 0;
 }
 
 
-static int
-librdf_storage_trees_size(librdf_storage* storage)
+static void
+librdf_storage_trees_read_unlock(librdf_storage_trees_instance* context)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+#ifdef WITH_THREADS
+  long held;
+
+  if(!context->concurrent)
+    return;
 
-  return raptor_avltree_size(context->graph->spo_tree);
+  held=librdf_storage_trees_reads_held(context) - 1;
+  pthread_setspecific(context->reads_key, (void*)held);
+  if(!held)
+    pthread_rwlock_unlock(&context->lock);
+#endif
 }
 
 
-static int
-librdf_storage_trees_add_statement_internal(librdf_storage* storage,
-                                            librdf_storage_trees_graph* graph,
-                                            librdf_statement* statement) 
+static void
+librdf_storage_trees_write_lock(librdf_storage_trees_instance* context)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  int status = 0;
-  
-  /* copy statement (store single copy in all trees) */
-  statement = librdf_new_statement_from_statement(statement);
-    
-  /* spo_tree owns statement */
-  status = raptor_avltree_add(graph->spo_tree, statement);
-  if (status > 0) /* item already exists; old item remains in tree */
-    return 0;
-  else if (status < 0) /* failure */
-    return status;
-    
-  /* others have null deleters */
-  /* (XXX: corrupt model if insertions fail) */
+#ifdef WITH_THREADS
+  if(!context->concurrent)
+    return;
 
-  if (context->index_sop)
-    raptor_avltree_add(graph->sop_tree, statement);
-    
-  if (context->index_ops)
-    raptor_avltree_add(graph->ops_tree, statement);
-    
-  if (context->index_pso)
-    raptor_avltree_add(graph->pso_tree, statement);
-    
-  return status;
+  pthread_mutex_lock(&context->gate);
+  pthread_rwlock_wrlock(&context->lock);
+  pthread_mutex_unlock(&context->gate);
+#endif
 }
 
 
-/**
- * librdf_storage_trees_add_statement:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- * @statement: #librdf_statement statement to add
- *
- * Add a statement (with no context) to the storage.
- * 
- * Return value: non 0 on failure (negative if error, positive if statement
- * already exists).
- **/
-static int
-librdf_storage_trees_add_statement(librdf_storage* storage,
-                                   librdf_statement* statement) 
+static void
+librdf_storage_trees_write_unlock(librdf_storage_trees_instance* context)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  return librdf_storage_trees_add_statement_internal(storage, context->graph, statement);
+#ifdef WITH_THREADS
+  if(context->concurrent)
+    pthread_rwlock_unlock(&context->lock);
+#endif
 }
 
 
-static int
-librdf_storage_trees_add_statements(librdf_storage* storage,
-                                    librdf_stream* statement_stream)
+/* Serialise changes readers make to shared state */
+static void
+librdf_storage_trees_mutex_lock(librdf_storage_trees_instance* context)
 {
-  int status=0;
+#ifdef WITH_THREADS
+  if(context->concurrent)
+    pthread_mutex_lock(&context->mutex);
+#endif
+}
 
-  for(; !librdf_stream_end(statement_stream); librdf_stream_next(statement_stream)) {
-    librdf_statement* statement=librdf_stream_get_object(statement_stream);
 
-    if (statement) {
-      status=librdf_storage_trees_add_statement(storage, statement);
-      if (status)
-        break;
-    } else {
-      status=1;
-      break;
-    }
-  }
-  
-  return status;
+static void
+librdf_storage_trees_mutex_unlock(librdf_storage_trees_instance* context)
+{
+#ifdef WITH_THREADS
+  if(context->concurrent)
+    pthread_mutex_unlock(&context->mutex);
+#endif
 }
 
-static int
-librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph,
-                                               librdf_statement* statement) 
-{
-  if (graph->sop_tree)
-    raptor_avltree_delete(graph->sop_tree, statement);
 
-  if (graph->ops_tree)
-    raptor_avltree_delete(graph->ops_tree, statement);
+/* Add a reference to the storage for a stream or iterator */
+static void
+librdf_storage_trees_retain(librdf_storage* storage)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
 
-  if (graph->pso_tree)
-    raptor_avltree_delete(graph->pso_tree, statement);
-  
-  raptor_avltree_delete(graph->spo_tree, statement);
-  
-  return 0;
+  librdf_storage_trees_mutex_lock(context);
+  librdf_storage_add_reference(storage);
+  librdf_storage_trees_mutex_unlock(context);
 }
 
 
-/**
- * librdf_storage_trees_remove_statement:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- * @statement: #librdf_statement statement to remove
- *
- * Remove a statement (without context) from the storage.
- * 
- * Return value: non 0 on failure
- **/
-static int
-librdf_storage_trees_remove_statement(librdf_storage* storage, 
-                                      librdf_statement* statement) 
+/* Remove a reference added by librdf_storage_trees_retain() */
+static void
+librdf_storage_trees_release(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int last;
 
-  return librdf_storage_trees_remove_statement_internal(context->graph, statement);
+  librdf_storage_trees_mutex_lock(context);
+  last=(storage->usage == 1);
+  if(!last)
+    librdf_storage_remove_reference(storage);
+  librdf_storage_trees_mutex_unlock(context);
+
+  /* the storage and its locks go away with the last reference */
+  if(last)
+    librdf_storage_remove_reference(storage);
 }
 
+
 static int
-librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_trees_open(librdf_storage* storage, librdf_model* model)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int status;
 
-  return (raptor_avltree_search(context->graph->spo_tree, statement) != NULL);
-}
+  if(!context->snapshot)
+    return 0;
 
+  librdf_storage_trees_write_lock(context);
+  status=librdf_storage_trees_snapshot_load(storage);
+  librdf_storage_trees_write_unlock(context);
 
-typedef struct {
-  librdf_storage *storage;
-  raptor_avltree_iterator *avltree_iterator;
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node *context_node;
-#endif
-} librdf_storage_trees_serialise_stream_context;
+  return status;
+}
 
 
-static librdf_stream*
-librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement* range)
+/**
+ * librdf_storage_trees_close:
+ * @storage: the storage
+ *
+ * .
+ *
+ * Close the storage, and free all content.  With the snapshot option
+ * the content is saved first if it changed.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_close(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_serialise_stream_context* scontext;
-  librdf_stream* stream;
-  int filter = 0;
-  
-  scontext = LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context*, 1,
-                           sizeof(*scontext));
-  if(!scontext)
-    return NULL;
-    
-  scontext->avltree_iterator = NULL;
-
-  /* ?s ?p ?o */
-  if (!range || (!range->subject && !range->predicate && !range->object)) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                             /* range */ NULL,
-                                                             /* range free */ NULL,
-                                                             1);
-    if (range) {
-      librdf_free_statement(range);
-      range=NULL;
+  int status=0;
+  u32 i;
+
+  librdf_storage_trees_write_lock(context);
+
+  if(context->snapshot && context->changed && context->graph)
+    status=librdf_storage_trees_snapshot_save(storage);
+
+  if(context->graph) {
+    librdf_storage_trees_graph_free(context->graph);
+    context->graph=NULL;
+  }
+
+  if(context->context_graphs) {
+    for(i=0; i < context->context_graphs_size; i++) {
+      if(context->context_graphs[i])
+        librdf_storage_trees_graph_free(context->context_graphs[i]);
     }
-  /* s ?p o */
-  } else if (range->subject && !range->predicate && range->object) {
-    if (context->index_sop)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->sop_tree,
-                                                               range, 
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  /* s _ _ */
-  } else if (range->subject) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                             range,
-                                                             librdf_storage_trees_avl_free,
-                                                             1);
-  /* ?s _ o */
-  } else if (range->object) {
-    if (context->index_ops)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->ops_tree,
-                                                               range,
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  /* ?s p ?o */
-  } else { /* range->predicate != NULL */
-    if (context->index_pso)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->pso_tree,
-                                                               range,
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  }
-    
-  /* If filter is set, we're missing the required index.
-   * Iterate over the entire model and filter the stream.
-   * (With a fully indexed store, this will never happen) */
-  if (filter) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                     range,
-                                                     librdf_storage_trees_avl_free,
-                                                     1);
-  }
-
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  scontext->context_node=NULL;
-#endif
+    LIBRDF_FREE(librdf_storage_trees_graph**, context->context_graphs);
+    context->context_graphs=NULL;
+    context->context_graphs_size=0;
+  }
 
-  if(!scontext->avltree_iterator) {
-    LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
-    return librdf_new_empty_stream(storage->world);
+  if(context->nodes) {
+    for(i=1; i < context->nodes_count; i++)
+      librdf_free_node(context->nodes[i]);
+    LIBRDF_FREE(librdf_node**, context->nodes);
+    context->nodes=NULL;
+    context->nodes_size=0;
   }
-  
-  scontext->storage=storage;
-  librdf_storage_add_reference(scontext->storage);
+  if(context->node_hashes) {
+    LIBRDF_FREE(u32*, context->node_hashes);
+    context->node_hashes=NULL;
+  }
+  context->nodes_count=1;
+  context->nodes_memory=0;
 
-  stream=librdf_new_stream(storage->world,
-                           (void*)scontext,
-                           &librdf_storage_trees_serialise_end_of_stream,
-                           &librdf_storage_trees_serialise_next_statement,
-                           &librdf_storage_trees_serialise_get_statement,
-                           &librdf_storage_trees_serialise_finished);
-  
-  if(!stream) {
-    librdf_storage_trees_serialise_finished((void*)scontext);
-    return NULL;
+  if(context->node_slots) {
+    LIBRDF_FREE(u32*, context->node_slots);
+    context->node_slots=NULL;
+    context->node_slots_size=0;
   }
 
-  if(filter) {
-    if(librdf_stream_add_map(stream, &librdf_stream_statement_find_map, NULL, (void*)range)) {
-      /* error - stream_add_map failed */
-      librdf_free_stream(stream);
-      stream=NULL;
-    }
+  if(context->literal_index) {
+    librdf_free_literal_index(context->literal_index);
+    context->literal_index=NULL;
   }
-  
-  return stream;  
-}
 
+  librdf_storage_trees_write_unlock(context);
 
-static librdf_stream*
-librdf_storage_trees_serialise(librdf_storage* storage)
-{
-  return librdf_storage_trees_serialise_range(storage, NULL);
+  return status;
 }
 
 
+/**
+ * librdf_storage_trees_sync:
+ * @storage: the storage
+ *
+ * Save the content to the snapshot file if it changed.
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_storage_trees_serialise_end_of_stream(void* context)
+librdf_storage_trees_sync(librdf_storage* storage)
 {
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int status=0;
+
+  if(!context->snapshot)
+    return 0;
+
+  /* readers may go on; the mutex keeps saves one at a time */
+  librdf_storage_trees_read_lock(context);
+  librdf_storage_trees_mutex_lock(context);
+
+  if(context->changed)
+    status=librdf_storage_trees_snapshot_save(storage);
 
-  return raptor_avltree_iterator_is_end(scontext->avltree_iterator);
+  librdf_storage_trees_mutex_unlock(context);
+  librdf_storage_trees_read_unlock(context);
+
+  return status;
 }
 
+
 static int
-librdf_storage_trees_serialise_next_statement(void* context)
+librdf_storage_trees_size(librdf_storage* storage)
 {
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int size;
+  u32 i;
 
-  return raptor_avltree_iterator_next(scontext->avltree_iterator);
-}
+  librdf_storage_trees_read_lock(context);
 
+  size=context->graph->trees[LIBRDF_STORAGE_TREES_SPO]->size;
 
-static void*
-librdf_storage_trees_serialise_get_statement(void* context, int flags)
-{
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  for(i=0; i < context->context_graphs_size; i++) {
+    librdf_storage_trees_graph* graph=context->context_graphs[i];
 
-  if(!scontext->avltree_iterator)
-    return NULL;
+    if(graph)
+      size+=graph->trees[LIBRDF_STORAGE_TREES_SPO]->size;
+  }
 
-  switch(flags) {
-    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
-      return (librdf_statement*)raptor_avltree_iterator_get(scontext->avltree_iterator);
+  librdf_storage_trees_read_unlock(context);
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
-      return scontext->context_node;
-#endif
+  return size;
+}
 
-    default:
-      return NULL;
+
+/* node dictionary functions */
+
+static u32
+librdf_storage_trees_hash_bytes(u32 hash, const unsigned char* p, size_t len)
+{
+  /* FNV-1a */
+  while(len--) {
+    hash ^= *p++;
+    hash *= 16777619U;
   }
+  return hash;
 }
 
 
-static void
-librdf_storage_trees_serialise_finished(void* context)
+static u32
+librdf_storage_trees_node_hash(librdf_node* node)
 {
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  u32 hash=2166136261U;
+  const unsigned char* string;
+  size_t len;
 
-  if(scontext->avltree_iterator)
-    raptor_free_avltree_iterator(scontext->avltree_iterator);
+  hash=librdf_storage_trees_hash_bytes(hash, (const unsigned char*)&node->type,
+                                       sizeof(node->type));
 
-  if(scontext->storage)
-    librdf_storage_remove_reference(scontext->storage);
-  
-  LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
-}
+  switch(node->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      string=librdf_uri_as_counted_string(node->value.uri, &len);
+      hash=librdf_storage_trees_hash_bytes(hash, string, len);
+      break;
 
+    case RAPTOR_TERM_TYPE_LITERAL:
+      hash=librdf_storage_trees_hash_bytes(hash, node->value.literal.string,
+                                           node->value.literal.string_len);
+      if(node->value.literal.language)
+        hash=librdf_storage_trees_hash_bytes(hash,
+                                             node->value.literal.language,
+                                             node->value.literal.language_len);
+      if(node->value.literal.datatype) {
+        string=librdf_uri_as_counted_string(node->value.literal.datatype, &len);
+        hash=librdf_storage_trees_hash_bytes(hash, string, len);
+      }
+      break;
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-/**
- * librdf_storage_trees_context_add_statement:
+    case RAPTOR_TERM_TYPE_BLANK:
+      hash=librdf_storage_trees_hash_bytes(hash, node->value.blank.string,
+                                           node->value.blank.string_len);
+      break;
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      break;
+  }
+
+  return hash;
+}
+
+
+/* Rebuild the dictionary slot table with new_size slots, a power of 2 */
+static int
+librdf_storage_trees_resize_node_slots(librdf_storage_trees_instance* context,
+                                       u32 new_size)
+{
+  u32 mask=new_size - 1;
+  u32* new_slots;
+  u32 id;
+
+  new_slots = LIBRDF_CALLOC(u32*, new_size, sizeof(u32));
+  if(!new_slots)
+    return 1;
+
+  for(id=1; id < context->nodes_count; id++) {
+    u32 i=context->node_hashes[id] & mask;
+
+    while(new_slots[i])
+      i=(i + 1) & mask;
+    new_slots[i]=id;
+  }
+
+  if(context->node_slots)
+    LIBRDF_FREE(u32*, context->node_slots);
+  context->node_slots=new_slots;
+  context->node_slots_size=new_size;
+
+  return 0;
+}
+
+
+/* Double the size of the dictionary slot table */
+static int
+librdf_storage_trees_grow_node_slots(librdf_storage_trees_instance* context)
+{
+  return librdf_storage_trees_resize_node_slots(context,
+    context->node_slots_size ? context->node_slots_size * 2 : 1024);
+}
+
+
+/*
+ * librdf_storage_trees_node_id - Get the dictionary id of a node
+ * @storage: #librdf_storage object
+ * @node: node or NULL
+ * @create: non 0 to add the node if it is not in the dictionary
+ *
+ * Nodes stay in the dictionary until the storage is closed.
+ *
+ * Return value: id or 0 if node is NULL, not present or on failure
+ **/
+static u32
+librdf_storage_trees_node_id(librdf_storage* storage, librdf_node* node,
+                             int create)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  u32 hash;
+  u32 mask;
+  u32 i;
+  u32 id;
+
+  if(!node)
+    return 0;
+
+  hash=librdf_storage_trees_node_hash(node);
+
+  if(context->node_slots) {
+    mask=context->node_slots_size - 1;
+    for(i=hash & mask; (id=context->node_slots[i]); i=(i + 1) & mask) {
+      /* only compare node strings when the hashes agree */
+      if(context->node_hashes[id] == hash &&
+         librdf_node_equals(context->nodes[id], node))
+        return id;
+    }
+  }
+
+  if(!create)
+    return 0;
+
+  /* keep the slot table at most half full */
+  if(context->nodes_count * 2 >= context->node_slots_size &&
+     librdf_storage_trees_grow_node_slots(context))
+    return 0;
+
+  if(context->nodes_count >= context->nodes_size) {
+    u32 new_size=context->nodes_size ? context->nodes_size * 2 : 1024;
+    librdf_node** new_nodes;
+    u32* new_hashes;
+
+    new_nodes = LIBRDF_CALLOC(librdf_node**, new_size, sizeof(librdf_node*));
+    if(!new_nodes)
+      return 0;
+    new_hashes = LIBRDF_CALLOC(u32*, new_size, sizeof(u32));
+    if(!new_hashes) {
+      LIBRDF_FREE(librdf_node**, new_nodes);
+      return 0;
+    }
+    if(context->nodes) {
+      memcpy(new_nodes, context->nodes,
+             context->nodes_count * sizeof(librdf_node*));
+      LIBRDF_FREE(librdf_node**, context->nodes);
+    }
+    if(context->node_hashes) {
+      memcpy(new_hashes, context->node_hashes,
+             context->nodes_count * sizeof(u32));
+      LIBRDF_FREE(u32*, context->node_hashes);
+    }
+    context->nodes=new_nodes;
+    context->node_hashes=new_hashes;
+    context->nodes_size=new_size;
+  }
+
+  id=context->nodes_count;
+  context->nodes[id]=librdf_new_node_from_node(node);
+  if(!context->nodes[id])
+    return 0;
+  context->node_hashes[id]=hash;
+  context->nodes_count++;
+  context->nodes_memory += librdf_node_get_memory_size(node);
+
+  mask=context->node_slots_size - 1;
+  for(i=hash & mask; context->node_slots[i]; i=(i + 1) & mask)
+    ;
+  context->node_slots[i]=id;
+
+  if(context->literal_index &&
+     librdf_literal_index_add(context->literal_index, node)) {
+    /* made again by the next text find */
+    librdf_free_literal_index(context->literal_index);
+    context->literal_index=NULL;
+  }
+
+  return id;
+}
+
+
+/*
+ * librdf_storage_trees_statement_ids - Get the node ids of a statement
+ * @storage: #librdf_storage object
+ * @statement: statement or NULL
+ * @create: non 0 to add nodes that are not in the dictionary
+ * @triple: array to store (subject, predicate, object) ids, 0 for empty parts
+ *
+ * Return value: non 0 if a node is not in the dictionary or on failure
+ **/
+static int
+librdf_storage_trees_statement_ids(librdf_storage* storage,
+                                   librdf_statement* statement,
+                                   int create, u32* triple)
+{
+  librdf_node* parts[3];
+  int i;
+
+  parts[0]=statement ? librdf_statement_get_subject(statement) : NULL;
+  parts[1]=statement ? librdf_statement_get_predicate(statement) : NULL;
+  parts[2]=statement ? librdf_statement_get_object(statement) : NULL;
+
+  for(i=0; i < 3; i++) {
+    triple[i]=librdf_storage_trees_node_id(storage, parts[i], create);
+    if(parts[i] && !triple[i])
+      return 1;
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_storage_trees_add_statement_internal(librdf_storage* storage,
+                                            librdf_storage_trees_graph* graph,
+                                            librdf_statement* statement)
+{
+  u32 triple[3];
+  int status = 0;
+  int i;
+
+  if(!librdf_statement_is_complete(statement))
+    return -1;
+
+  if(librdf_storage_trees_statement_ids(storage, statement, 1, triple))
+    return -1;
+
+  status = librdf_storage_trees_btree_insert(graph->trees[LIBRDF_STORAGE_TREES_SPO],
+                                             triple);
+  if (status > 0) /* item already exists */
+    return 0;
+  else if (status < 0) /* failure */
+    return status;
+
+  /* (XXX: corrupt model if insertions fail) */
+  for(i=LIBRDF_STORAGE_TREES_SPO + 1; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    if(graph->trees[i])
+      librdf_storage_trees_btree_insert(graph->trees[i], triple);
+  }
+
+  ((librdf_storage_trees_instance*)storage->instance)->changed=1;
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_trees_add_statement:
  * @storage: #librdf_storage object
  * @context_node: #librdf_node object
  * @statement: #librdf_statement statement to add
  *
- * Add a statement to a storage context.
- * 
- * Return value: non 0 on failure
+ * Add a statement (with no context) to the storage.
+ *
+ * Return value: non 0 on failure (negative if error, positive if statement
+ * already exists).
+ **/
+static int
+librdf_storage_trees_add_statement(librdf_storage* storage,
+                                   librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int status;
+
+  librdf_storage_trees_write_lock(context);
+  status=librdf_storage_trees_add_statement_internal(storage, context->graph,
+                                                     statement);
+  librdf_storage_trees_write_unlock(context);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_trees_bulk_add_statements - Add a stream of statements to an empty graph
+ * @storage: #librdf_storage object
+ * @graph: graph with no statements
+ * @statement_stream: stream of statements
+ *
+ * The ids of all the statements are collected first and every tree
+ * is then built bottom-up from one sorted run, rather than by one
+ * insert per statement and tree.  As with single adds, the statements
+ * before a failing one are kept.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_bulk_add_statements(librdf_storage* storage,
+                                         librdf_storage_trees_graph* graph,
+                                         librdf_stream* statement_stream)
+{
+  u32* triples=NULL;
+  int count=0;
+  int size=0;
+  int status=0;
+
+  for(; !librdf_stream_end(statement_stream); librdf_stream_next(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(!statement) {
+      status=1;
+      break;
+    }
+
+    if(!librdf_statement_is_complete(statement)) {
+      status=-1;
+      break;
+    }
+
+    if(count == size) {
+      int new_size=size ? size * 2 : 1024;
+      u32* new_triples;
+
+      new_triples = LIBRDF_MALLOC(u32*, new_size * 3 * sizeof(u32));
+      if(!new_triples) {
+        status=-1;
+        break;
+      }
+      if(triples) {
+        memcpy(new_triples, triples, count * 3 * sizeof(u32));
+        LIBRDF_FREE(u32*, triples);
+      }
+      triples=new_triples;
+      size=new_size;
+    }
+
+    if(librdf_storage_trees_statement_ids(storage, statement, 1,
+                                          &triples[count * 3])) {
+      status=-1;
+      break;
+    }
+    count++;
+  }
+
+  if(count) {
+    if(librdf_storage_trees_graph_build(graph, triples, count))
+      status=-1;
+    else
+      ((librdf_storage_trees_instance*)storage->instance)->changed=1;
+  }
+
+  if(triples)
+    LIBRDF_FREE(u32*, triples);
+
+  return status;
+}
+
+
+static int
+librdf_storage_trees_add_statements(librdf_storage* storage,
+                                    librdf_stream* statement_stream)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int status=0;
+
+  librdf_storage_trees_write_lock(context);
+
+  if(!context->graph->trees[LIBRDF_STORAGE_TREES_SPO]->size) {
+    status=librdf_storage_trees_bulk_add_statements(storage, context->graph,
+                                                    statement_stream);
+    librdf_storage_trees_write_unlock(context);
+    return status;
+  }
+
+  for(; !librdf_stream_end(statement_stream); librdf_stream_next(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if (statement) {
+      status=librdf_storage_trees_add_statement_internal(storage,
+                                                         context->graph,
+                                                         statement);
+      if (status)
+        break;
+    } else {
+      status=1;
+      break;
+    }
+  }
+
+  librdf_storage_trees_write_unlock(context);
+
+  return status;
+}
+
+static int
+librdf_storage_trees_remove_statement_internal(librdf_storage* storage,
+                                               librdf_storage_trees_graph* graph,
+                                               librdf_statement* statement)
+{
+  u32 triple[3];
+  int i;
+
+  /* a statement with a node that was never added is not present */
+  if(librdf_storage_trees_statement_ids(storage, statement, 0, triple))
+    return 0;
+
+  if(librdf_storage_trees_btree_delete(graph->trees[LIBRDF_STORAGE_TREES_SPO],
+                                       triple))
+    return 0;
+
+  for(i=LIBRDF_STORAGE_TREES_SPO + 1; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    if(graph->trees[i])
+      librdf_storage_trees_btree_delete(graph->trees[i], triple);
+  }
+
+  ((librdf_storage_trees_instance*)storage->instance)->changed=1;
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_trees_remove_statement:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement: #librdf_statement statement to remove
+ *
+ * Remove a statement (without context) from the storage.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_remove_statement(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int status;
+
+  librdf_storage_trees_write_lock(context);
+  status=librdf_storage_trees_remove_statement_internal(storage, context->graph,
+                                                        statement);
+  librdf_storage_trees_write_unlock(context);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_trees_find_graph - Find the graph holding a context
+ * @storage: #librdf_storage object
+ * @context_node: context node or NULL for statements without a context
+ * @create: non 0 to add the graph if it is missing
+ *
+ * Return value: graph or NULL if there is no such context or on failure
+ **/
+static librdf_storage_trees_graph*
+librdf_storage_trees_find_graph(librdf_storage* storage,
+                                librdf_node* context_node, int create)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  u32 id;
+
+  if(!context_node)
+    return context->graph;
+
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return NULL;
+  }
+
+  id=librdf_storage_trees_node_id(storage, context_node, create);
+  if(!id)
+    return NULL;
+
+  if(id < context->context_graphs_size && context->context_graphs[id])
+    return context->context_graphs[id];
+
+  if(!create)
+    return NULL;
+
+  if(id >= context->context_graphs_size) {
+    u32 new_size=context->context_graphs_size ? context->context_graphs_size : 16;
+    librdf_storage_trees_graph** new_graphs;
+
+    while(new_size <= id)
+      new_size *= 2;
+
+    new_graphs = LIBRDF_CALLOC(librdf_storage_trees_graph**, new_size,
+                               sizeof(librdf_storage_trees_graph*));
+    if(!new_graphs)
+      return NULL;
+    if(context->context_graphs) {
+      memcpy(new_graphs, context->context_graphs,
+             context->context_graphs_size * sizeof(librdf_storage_trees_graph*));
+      LIBRDF_FREE(librdf_storage_trees_graph**, context->context_graphs);
+    }
+    context->context_graphs=new_graphs;
+    context->context_graphs_size=new_size;
+  }
+
+  graph=librdf_storage_trees_graph_new(storage, context_node);
+  if(!graph)
+    return NULL;
+
+  context->context_graphs[id]=graph;
+  return graph;
+}
+
+
+/* Free the graph of a context and forget it */
+static void
+librdf_storage_trees_drop_graph(librdf_storage* storage,
+                                librdf_storage_trees_graph* graph)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  u32 id=librdf_storage_trees_node_id(storage, graph->context, 0);
+
+  if(id && id < context->context_graphs_size &&
+     context->context_graphs[id] == graph)
+    context->context_graphs[id]=NULL;
+
+  librdf_storage_trees_graph_free(graph);
+  context->changed=1;
+}
+
+
+static int
+librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  u32 triple[3];
+  int found=0;
+  u32 i;
+
+  librdf_storage_trees_read_lock(context);
+
+  if(librdf_storage_trees_statement_ids(storage, statement, 0, triple))
+    goto done;
+
+  found=librdf_storage_trees_btree_contains(context->graph->trees[LIBRDF_STORAGE_TREES_SPO],
+                                            triple);
+
+  /* the statement may only be present in some context */
+  for(i=0; !found && i < context->context_graphs_size; i++) {
+    librdf_storage_trees_graph* graph=context->context_graphs[i];
+
+    if(graph)
+      found=librdf_storage_trees_btree_contains(graph->trees[LIBRDF_STORAGE_TREES_SPO],
+                                                triple);
+  }
+
+  done:
+  librdf_storage_trees_read_unlock(context);
+
+  return found;
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_storage_trees_graph* graph; /* graph being walked */
+  int all_graphs; /* non 0 to continue with every context graph */
+  u32 next_context_id; /* next context graph to visit */
+  u32 pattern[3]; /* ids to match by statement part, 0 matches any */
+  int tree; /* ordering of the tree walked in each graph */
+  librdf_storage_trees_tuple prefix; /* bound leading ids, then 0s */
+  int prefix_len;
+  librdf_storage_trees_leaf* leaf; /* current leaf or NULL at end */
+  int position; /* current tuple in leaf */
+  librdf_statement* statement; /* returned statement */
+  int statement_is_current;
+  librdf_statement* batch; /* statements returned by a batch */
+  int batch_size;
+  int locked; /* non 0 while holding the storage read lock */
+} librdf_storage_trees_serialise_stream_context;
+
+
+/* Number of leading ids of a tree ordering bound by a pattern */
+static int
+librdf_storage_trees_prefix_length(int tree, const u32* pattern)
+{
+  const int* order=librdf_storage_trees_orders[tree];
+  int len;
+
+  for(len=0; len < 3 && pattern[order[len]]; len++)
+    ;
+
+  return len;
+}
+
+
+/*
+ * librdf_storage_trees_add_index - Add a tree ordering to every graph
+ * @storage: #librdf_storage object
+ * @tree: the tree ordering
+ *
+ * Each new tree is built from the spo tree of its graph.  Later adds
+ * and removes keep it up to date.
+ *
+ * Return value: non 0 on failure, leaving no graph with the tree
+ **/
+static int
+librdf_storage_trees_add_index(librdf_storage* storage, int tree)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  u32 i;
+
+  if(librdf_storage_trees_graph_add_tree(context->graph, tree))
+    return 1;
+
+  for(i=0; i < context->context_graphs_size; i++) {
+    librdf_storage_trees_graph* graph=context->context_graphs[i];
+
+    if(graph && librdf_storage_trees_graph_add_tree(graph, tree))
+      break;
+  }
+
+  if(i < context->context_graphs_size) {
+    while(i-- > 0) {
+      librdf_storage_trees_graph* graph=context->context_graphs[i];
+
+      if(graph) {
+        librdf_storage_trees_btree_free(graph->trees[tree]);
+        graph->trees[tree]=NULL;
+      }
+    }
+    librdf_storage_trees_btree_free(context->graph->trees[tree]);
+    context->graph->trees[tree]=NULL;
+    return 1;
+  }
+
+  context->indexes[tree]=1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_pick_tree - Pick the tree ordering to answer a pattern
+ * @storage: #librdf_storage object
+ * @pattern: (subject, predicate, object) ids, 0 for any
+ * @prefix_len_p: pointer to store the number of leading ids bound
+ *
+ * Picks the available ordering with the longest bound prefix; any
+ * other bound ids are checked while walking.  With lazy indexes, an
+ * ordering with a longer prefix is added first when there is one.
+ *
+ * Return value: the tree ordering
+ **/
+static int
+librdf_storage_trees_pick_tree(librdf_storage* storage,
+                               const u32* pattern, int* prefix_len_p)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int best=LIBRDF_STORAGE_TREES_SPO;
+  int best_len=-1;
+  int wanted=-1;
+  int wanted_len=-1;
+  int i;
+
+  /* readers may add trees so the choice is made one at a time */
+  if(context->lazy_indexes)
+    librdf_storage_trees_mutex_lock(context);
+
+  for(i=0; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    int len=librdf_storage_trees_prefix_length(i, pattern);
+
+    if(context->indexes[i]) {
+      if(len > best_len) {
+        best=i;
+        best_len=len;
+      }
+    } else if(len > wanted_len) {
+      wanted=i;
+      wanted_len=len;
+    }
+  }
+
+  /* on failure carry on with the trees there are */
+  if(context->lazy_indexes && wanted_len > best_len &&
+     !librdf_storage_trees_add_index(storage, wanted)) {
+    LIBRDF_DEBUG2("Added %s tree\n", librdf_storage_trees_order_names[wanted]);
+    best=wanted;
+    best_len=wanted_len;
+  }
+
+  if(context->lazy_indexes)
+    librdf_storage_trees_mutex_unlock(context);
+
+#ifdef LIBRDF_DEBUG
+  {
+    char shape[4];
+
+    for(i=0; i < 3; i++)
+      shape[i]=pattern[i] ? "spo"[i] : '?';
+    shape[3]='\0';
+    LIBRDF_DEBUG4("Pattern (%s) walks %s tree with %d bound leading ids\n",
+                  shape, librdf_storage_trees_order_names[best], best_len);
+  }
+#endif
+
+  *prefix_len_p=best_len;
+  return best;
+}
+
+
+static void
+librdf_storage_trees_serialise_open_graph(librdf_storage_trees_serialise_stream_context* scontext,
+                                          librdf_storage_trees_graph* graph)
+{
+  scontext->graph=graph;
+  scontext->leaf=librdf_storage_trees_btree_lower_bound(graph->trees[scontext->tree],
+                                                        &scontext->prefix,
+                                                        &scontext->position);
+}
+
+
+/* Move to the first matching tuple at or after the current one, going
+ * on to the following graphs when needed.
+ * Return non 0 when there are no more matches */
+static int
+librdf_storage_trees_serialise_seek(librdf_storage_trees_serialise_stream_context* scontext)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)scontext->storage->instance;
+  const int* order=librdf_storage_trees_orders[scontext->tree];
+
+  scontext->statement_is_current=0;
+
+  while(1) {
+    while(scontext->leaf) {
+      librdf_storage_trees_tuple* tuple;
+      int i;
+
+      if(scontext->position >= scontext->leaf->page.count) {
+        scontext->leaf=(librdf_storage_trees_leaf*)scontext->leaf->page.next;
+        scontext->position=0;
+        continue;
+      }
+
+      tuple=&scontext->leaf->tuples[scontext->position];
+
+      for(i=0; i < scontext->prefix_len; i++) {
+        if(tuple->ids[i] != scontext->prefix.ids[i])
+          break;
+      }
+      if(i < scontext->prefix_len) {
+        /* past the range in this graph */
+        scontext->leaf=NULL;
+        break;
+      }
+
+      for(; i < 3; i++) {
+        u32 want=scontext->pattern[order[i]];
+        if(want && tuple->ids[i] != want)
+          break;
+      }
+      if(i == 3)
+        return 0;
+
+      scontext->position++;
+    }
+
+    if(!scontext->all_graphs)
+      return 1;
+
+    while(scontext->next_context_id < context->context_graphs_size &&
+          !context->context_graphs[scontext->next_context_id])
+      scontext->next_context_id++;
+
+    if(scontext->next_context_id >= context->context_graphs_size)
+      return 1;
+
+    librdf_storage_trees_serialise_open_graph(scontext,
+      context->context_graphs[scontext->next_context_id++]);
+  }
+}
+
+
+/*
+ * librdf_storage_trees_serialise_range - Stream the statements of graphs matching a statement
+ * @storage: #librdf_storage object
+ * @context_node: context of the graph to start with or NULL for the
+ * statements without a context
+ * @all_graphs: non 0 to continue with the graph of every context
+ * @statement: statement to match or NULL for all statements
+ *
+ * The stream holds the storage read lock until it is finished.
+ *
+ * Return value: #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_serialise_range(librdf_storage* storage,
+                                     librdf_node* context_node,
+                                     int all_graphs,
+                                     librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_serialise_stream_context* scontext;
+  librdf_storage_trees_graph* graph;
+  librdf_stream* stream;
+  const int* order;
+  int i;
+
+  scontext = LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  scontext->storage=storage;
+  librdf_storage_trees_retain(scontext->storage);
+
+  librdf_storage_trees_read_lock(context);
+  scontext->locked=1;
+
+  graph=librdf_storage_trees_find_graph(storage, context_node, 0);
+
+  /* a node that was never added matches nothing */
+  if(!graph ||
+     librdf_storage_trees_statement_ids(storage, statement, 0,
+                                        scontext->pattern)) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return librdf_new_empty_stream(storage->world);
+  }
+
+  scontext->statement=librdf_new_statement(storage->world);
+  if(!scontext->statement) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
+  scontext->tree=librdf_storage_trees_pick_tree(storage, scontext->pattern,
+                                                &scontext->prefix_len);
+  order=librdf_storage_trees_orders[scontext->tree];
+  for(i=0; i < scontext->prefix_len; i++)
+    scontext->prefix.ids[i]=scontext->pattern[order[i]];
+
+  scontext->all_graphs=all_graphs;
+  librdf_storage_trees_serialise_open_graph(scontext, graph);
+
+  if(librdf_storage_trees_serialise_seek(scontext)) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return librdf_new_empty_stream(storage->world);
+  }
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_trees_serialise_end_of_stream,
+                           &librdf_storage_trees_serialise_next_statement,
+                           &librdf_storage_trees_serialise_get_statement,
+                           &librdf_storage_trees_serialise_finished);
+
+  if(!stream) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
+  librdf_stream_set_next_batch_method(stream,
+                                      &librdf_storage_trees_serialise_next_batch);
+
+  return stream;
+}
+
+
+/**
+ * librdf_storage_trees_count_statements:
+ * @storage: #librdf_storage object
+ * @statement: statement to match
+ *
+ * Count the statements matching a statement in every graph.
+ *
+ * When the tree walked has all the bound parts leading, each graph
+ * is counted from the subtree counts of two walks down its tree.
+ * Otherwise the range of the bound leading parts is walked and the
+ * other bound parts checked, as find_statements would.
+ *
+ * Return value: number of matching statements
+ **/
+static int
+librdf_storage_trees_count_statements(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_serialise_stream_context scontext;
+  const int* order;
+  int bound=0;
+  int count=0;
+  int i;
+  u32 c;
+
+  librdf_storage_trees_read_lock(context);
+
+  memset(&scontext, 0, sizeof(scontext));
+  scontext.storage=storage;
+
+  /* a node that was never added matches nothing */
+  if(librdf_storage_trees_statement_ids(storage, statement, 0,
+                                        scontext.pattern))
+    goto done;
+
+  for(i=0; i < 3; i++) {
+    if(scontext.pattern[i])
+      bound++;
+  }
+
+  scontext.tree=librdf_storage_trees_pick_tree(storage, scontext.pattern,
+                                               &scontext.prefix_len);
+  order=librdf_storage_trees_orders[scontext.tree];
+  for(i=0; i < scontext.prefix_len; i++)
+    scontext.prefix.ids[i]=scontext.pattern[order[i]];
+
+  if(scontext.prefix_len == bound) {
+    count=librdf_storage_trees_btree_count_prefix(context->graph->trees[scontext.tree],
+                                                  &scontext.prefix,
+                                                  scontext.prefix_len);
+    for(c=0; c < context->context_graphs_size; c++) {
+      librdf_storage_trees_graph* graph=context->context_graphs[c];
+
+      if(graph)
+        count += librdf_storage_trees_btree_count_prefix(graph->trees[scontext.tree],
+                                                         &scontext.prefix,
+                                                         scontext.prefix_len);
+    }
+    goto done;
+  }
+
+  scontext.all_graphs=1;
+  librdf_storage_trees_serialise_open_graph(&scontext, context->graph);
+  while(!librdf_storage_trees_serialise_seek(&scontext)) {
+    count++;
+    scontext.position++;
+  }
+
+  done:
+  librdf_storage_trees_read_unlock(context);
+
+  return count;
+}
+
+
+static librdf_stream*
+librdf_storage_trees_serialise(librdf_storage* storage)
+{
+  return librdf_storage_trees_serialise_range(storage, NULL, 1, NULL);
+}
+
+
+static int
+librdf_storage_trees_serialise_end_of_stream(void* context)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+
+  return (scontext->leaf == NULL);
+}
+
+static int
+librdf_storage_trees_serialise_next_statement(void* context)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+
+  if(!scontext->leaf)
+    return 1;
+
+  scontext->position++;
+  return librdf_storage_trees_serialise_seek(scontext);
+}
+
+
+/* Set a statement to the current tuple; called with the mutex held */
+static void
+librdf_storage_trees_serialise_fill(librdf_storage_trees_serialise_stream_context* scontext,
+                                    librdf_statement* statement)
+{
+  librdf_storage_trees_instance* instance=(librdf_storage_trees_instance*)scontext->storage->instance;
+  librdf_storage_trees_tuple* tuple;
+  const int* order;
+  u32 triple[3];
+  int i;
+
+  tuple=&scontext->leaf->tuples[scontext->position];
+  order=librdf_storage_trees_orders[scontext->tree];
+  for(i=0; i < 3; i++)
+    triple[order[i]]=tuple->ids[i];
+
+  librdf_statement_clear(statement);
+  librdf_statement_set_subject(statement,
+                               librdf_new_node_from_node(instance->nodes[triple[0]]));
+  librdf_statement_set_predicate(statement,
+                                 librdf_new_node_from_node(instance->nodes[triple[1]]));
+  librdf_statement_set_object(statement,
+                              librdf_new_node_from_node(instance->nodes[triple[2]]));
+}
+
+
+static void*
+librdf_storage_trees_serialise_get_statement(void* context, int flags)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* instance;
+
+  if(!scontext->leaf)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      if(scontext->statement_is_current)
+        return scontext->statement;
+
+      instance=(librdf_storage_trees_instance*)scontext->storage->instance;
+
+      /* node reference counts are shared with other readers */
+      librdf_storage_trees_mutex_lock(instance);
+      librdf_storage_trees_serialise_fill(scontext, scontext->statement);
+      librdf_storage_trees_mutex_unlock(instance);
+      scontext->statement_is_current=1;
+      return scontext->statement;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return scontext->graph->context;
+
+    default:
+      return NULL;
+  }
+}
+
+
+/*
+ * librdf_storage_trees_serialise_next_batch - Get the statements from the current one on
+ *
+ * The node reference counts are taken under one lock of the mutex for
+ * the whole batch rather than once per statement.
+ */
+static int
+librdf_storage_trees_serialise_next_batch(void* context,
+                                          librdf_statement** statements,
+                                          librdf_node** contexts, int size)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* instance=(librdf_storage_trees_instance*)scontext->storage->instance;
+  int count=0;
+  int i;
+
+  if(!scontext->leaf)
+    return 0;
+
+  if(size > scontext->batch_size) {
+    librdf_statement* batch;
+
+    batch=LIBRDF_CALLOC(librdf_statement*, size, sizeof(*batch));
+    if(!batch)
+      return -1;
+    for(i=0; i < size; i++)
+      librdf_statement_init(scontext->storage->world, &batch[i]);
+
+    if(scontext->batch) {
+      librdf_storage_trees_mutex_lock(instance);
+      for(i=0; i < scontext->batch_size; i++)
+        librdf_statement_clear(&scontext->batch[i]);
+      librdf_storage_trees_mutex_unlock(instance);
+      LIBRDF_FREE(librdf_statement*, scontext->batch);
+    }
+    scontext->batch=batch;
+    scontext->batch_size=size;
+  }
+
+  librdf_storage_trees_mutex_lock(instance);
+  while(count < size && scontext->leaf) {
+    librdf_storage_trees_serialise_fill(scontext, &scontext->batch[count]);
+    statements[count]=&scontext->batch[count];
+    contexts[count]=scontext->graph->context;
+    count++;
+
+    scontext->position++;
+    if(librdf_storage_trees_serialise_seek(scontext))
+      break;
+  }
+  librdf_storage_trees_mutex_unlock(instance);
+
+  return count;
+}
+
+
+static void
+librdf_storage_trees_serialise_finished(void* context)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* instance=(librdf_storage_trees_instance*)scontext->storage->instance;
+
+  if(scontext->statement) {
+    librdf_storage_trees_mutex_lock(instance);
+    librdf_free_statement(scontext->statement);
+    librdf_storage_trees_mutex_unlock(instance);
+  }
+
+  if(scontext->batch) {
+    int i;
+
+    librdf_storage_trees_mutex_lock(instance);
+    for(i=0; i < scontext->batch_size; i++)
+      librdf_statement_clear(&scontext->batch[i]);
+    librdf_storage_trees_mutex_unlock(instance);
+    LIBRDF_FREE(librdf_statement*, scontext->batch);
+  }
+
+  if(scontext->locked)
+    librdf_storage_trees_read_unlock(instance);
+
+  librdf_storage_trees_release(scontext->storage);
+
+  LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
+}
+
+
+/**
+ * librdf_storage_trees_context_add_statement:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement: #librdf_statement statement to add
+ *
+ * Add a statement to a storage context.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_add_statement(librdf_storage* storage,
+                                           librdf_node* context_node,
+                                           librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  int status=1;
+
+  librdf_storage_trees_write_lock(context);
+
+  graph=librdf_storage_trees_find_graph(storage, context_node, 1);
+  if(graph)
+    status=librdf_storage_trees_add_statement_internal(storage, graph,
+                                                       statement);
+
+  librdf_storage_trees_write_unlock(context);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statement:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement: #librdf_statement statement to remove
+ *
+ * Remove a statement from a storage context.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statement(librdf_storage* storage,
+                                              librdf_node* context_node,
+                                              librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  int status=-1;
+
+  librdf_storage_trees_write_lock(context);
+
+  graph=librdf_storage_trees_find_graph(storage, context_node, 0);
+  if(graph) {
+    status=librdf_storage_trees_remove_statement_internal(storage, graph,
+                                                          statement);
+
+    /* drop the graph of a context once it is empty */
+    if(!status && context_node &&
+       !graph->trees[LIBRDF_STORAGE_TREES_SPO]->size)
+      librdf_storage_trees_drop_graph(storage, graph);
+  }
+
+  librdf_storage_trees_write_unlock(context);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * Remove all statements from a storage context.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statements(librdf_storage* storage,
+                                               librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  int status=0;
+
+  librdf_storage_trees_write_lock(context);
+
+  if(!context_node) {
+    /* statements without a context have a graph that is always present */
+    graph=librdf_storage_trees_graph_new(storage, NULL);
+    if(graph) {
+      librdf_storage_trees_graph_free(context->graph);
+      context->graph=graph;
+      context->changed=1;
+    } else
+      status=1;
+  } else {
+    graph=librdf_storage_trees_find_graph(storage, context_node, 0);
+    if(graph)
+      /* frees the trees and all the statements of the context */
+      librdf_storage_trees_drop_graph(storage, graph);
+    else
+      status=!context->contexts;
+  }
+
+  librdf_storage_trees_write_unlock(context);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_trees_context_serialise:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * List all statements in a storage context.
+ *
+ * Return value: #librdf_stream of statements or NULL on failure or context is empty
+ **/
+static librdf_stream*
+librdf_storage_trees_context_serialise(librdf_storage* storage,
+                                        librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if(context_node && !context->contexts)
+    return NULL;
+
+  return librdf_storage_trees_serialise_range(storage, context_node, 0, NULL);
+}
+
+
+/**
+ * librdf_storage_trees_find_statements_in_context:
+ * @storage: #librdf_storage object
+ * @statement: the statement to match
+ * @context_node: #librdf_node object
+ *
+ * Find statements matching a statement in a storage context.
+ * Only the trees of the graph for the context are searched.
+ *
+ * Return value: #librdf_stream of statements or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements_in_context(librdf_storage* storage,
+                                                librdf_statement* statement,
+                                                librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if(context_node && !context->contexts)
+    return NULL;
+
+  return librdf_storage_trees_serialise_range(storage, context_node, 0,
+                                              statement);
+}
+
+
+/**
+ * librdf_storage_trees_find_statements_with_options:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: the context to search or NULL
+ * @options: #librdf_hash of match options or NULL
+ *
+ * Find statements with options.  Substring and prefix matches of
+ * object literals use a text index of the literals in the node
+ * dictionary, made by the first of them; nodes are never removed
+ * from the dictionary so the index only grows with it.
+ *
+ * Return value: #librdf_stream of statements or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements_with_options(librdf_storage* storage,
+                                                  librdf_statement* statement,
+                                                  librdf_node* context_node,
+                                                  librdf_hash* options)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_stream* stream;
+  int prefix;
+  u32 id;
+
+  if(!librdf_storage_get_text_match(options, statement, &prefix))
+    return librdf_literal_index_find_statements(NULL, storage, statement,
+                                                context_node, options);
+
+  /* writers add to the index; readers only make it */
+  librdf_storage_trees_read_lock(context);
+  librdf_storage_trees_mutex_lock(context);
+  if(!context->literal_index) {
+    context->literal_index=librdf_new_literal_index(storage->world);
+    for(id=1; context->literal_index && id < context->nodes_count; id++) {
+      if(librdf_literal_index_add(context->literal_index, context->nodes[id])) {
+        librdf_free_literal_index(context->literal_index);
+        context->literal_index=NULL;
+      }
+    }
+  }
+  librdf_storage_trees_mutex_unlock(context);
+
+  stream=librdf_literal_index_find_statements(context->literal_index, storage,
+                                              statement, context_node,
+                                              options);
+  librdf_storage_trees_read_unlock(context);
+
+  return stream;
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  u32 id; /* id of the current context node */
+} librdf_storage_trees_get_contexts_iterator_context;
+
+
+/* Move to the first context graph at or after the current id */
+static void
+librdf_storage_trees_get_contexts_seek(librdf_storage_trees_get_contexts_iterator_context* icontext)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)icontext->storage->instance;
+
+  while(icontext->id < context->context_graphs_size &&
+        !context->context_graphs[icontext->id])
+    icontext->id++;
+}
+
+
+static int
+librdf_storage_trees_get_contexts_is_end(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)icontext->storage->instance;
+
+  return (icontext->id >= context->context_graphs_size);
+}
+
+
+static int
+librdf_storage_trees_get_contexts_next_method(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  if(librdf_storage_trees_get_contexts_is_end(iterator))
+    return 1;
+
+  icontext->id++;
+  librdf_storage_trees_get_contexts_seek(icontext);
+  return librdf_storage_trees_get_contexts_is_end(iterator);
+}
+
+
+static void*
+librdf_storage_trees_get_contexts_get_method(void* iterator, int flags)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)icontext->storage->instance;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      if(librdf_storage_trees_get_contexts_is_end(iterator))
+        return NULL;
+      return context->context_graphs[icontext->id]->context;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_KEY:
+    case LIBRDF_ITERATOR_GET_METHOD_GET_VALUE:
+      return NULL;
+
+    default:
+      librdf_log(icontext->storage->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_trees_get_contexts_finished(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  librdf_storage_trees_read_unlock((librdf_storage_trees_instance*)icontext->storage->instance);
+  librdf_storage_trees_release(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_trees_get_contexts_iterator_context, icontext);
+}
+
+
+/**
+ * librdf_storage_trees_context_get_contexts:
+ * @storage: #librdf_storage object
+ *
+ * List all context nodes in a storage.
+ *
+ * Return value: #librdf_iterator of context_nodes or NULL on failure or no contexts
+ **/
+static librdf_iterator*
+librdf_storage_trees_get_contexts(librdf_storage* storage)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_get_contexts_iterator_context* icontext;
+  librdf_iterator* iterator;
+
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return NULL;
+  }
+
+  icontext = LIBRDF_CALLOC(librdf_storage_trees_get_contexts_iterator_context*,
+                           1, sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  icontext->storage=storage;
+  librdf_storage_trees_retain(icontext->storage);
+
+  /* held until the iterator is finished */
+  librdf_storage_trees_read_lock(context);
+
+  librdf_storage_trees_get_contexts_seek(icontext);
+
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               &librdf_storage_trees_get_contexts_is_end,
+                               &librdf_storage_trees_get_contexts_next_method,
+                               &librdf_storage_trees_get_contexts_get_method,
+                               &librdf_storage_trees_get_contexts_finished);
+  if(!iterator)
+    librdf_storage_trees_get_contexts_finished(icontext);
+  return iterator;
+}
+
+
+/**
+ * librdf_storage_trees_find_statements:
+ * @storage: the storage
+ * @statement: the statement to match
+ *
+ * .
+ *
+ * Return a stream of statements matching the given statement (or
+ * all statements if NULL).  Parts (subject, predicate, object) of the
+ * statement can be empty in which case any statement part will match that.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement)
+{
+  return librdf_storage_trees_serialise_range(storage, NULL, 1, statement);
+}
+
+
+/* B+tree functions */
+
+static int
+librdf_storage_trees_tuple_compare(const librdf_storage_trees_tuple* a,
+                                   const librdf_storage_trees_tuple* b)
+{
+  int i;
+
+  for(i=0; i < 3; i++) {
+    if(a->ids[i] != b->ids[i])
+      return (a->ids[i] < b->ids[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+
+/* Index of the first tuple in a leaf not below tuple */
+static int
+librdf_storage_trees_leaf_search(librdf_storage_trees_leaf* leaf,
+                                 const librdf_storage_trees_tuple* tuple)
+{
+  int low=0;
+  int high=leaf->page.count;
+
+  while(low < high) {
+    int middle=(low + high) / 2;
+
+    if(librdf_storage_trees_tuple_compare(&leaf->tuples[middle], tuple) < 0)
+      low=middle + 1;
+    else
+      high=middle;
+  }
+  return low;
+}
+
+
+/* Index of the child of a branch that may hold tuple */
+static int
+librdf_storage_trees_branch_search(librdf_storage_trees_branch* branch,
+                                   const librdf_storage_trees_tuple* tuple)
+{
+  int low=1;
+  int high=branch->page.count;
+
+  while(low < high) {
+    int middle=(low + high) / 2;
+
+    if(librdf_storage_trees_tuple_compare(&branch->keys[middle], tuple) <= 0)
+      low=middle + 1;
+    else
+      high=middle;
+  }
+  return low - 1;
+}
+
+
+static int
+librdf_storage_trees_page_is_full(librdf_storage_trees_page* page)
+{
+  return page->count == (page->is_leaf ? LIBRDF_STORAGE_TREES_LEAF_SIZE :
+                                         LIBRDF_STORAGE_TREES_BRANCH_SIZE);
+}
+
+
+/* Number of tuples under a page */
+static int
+librdf_storage_trees_page_size(librdf_storage_trees_page* page)
+{
+  librdf_storage_trees_branch* branch;
+  int size=0;
+  int i;
+
+  if(page->is_leaf)
+    return page->count;
+
+  branch=(librdf_storage_trees_branch*)page;
+  for(i=0; i < page->count; i++)
+    size += branch->counts[i];
+  return size;
+}
+
+
+static void
+librdf_storage_trees_page_free(librdf_storage_trees_page* page)
+{
+  if(!page->is_leaf) {
+    librdf_storage_trees_branch* branch=(librdf_storage_trees_branch*)page;
+    int i;
+
+    for(i=0; i < branch->page.count; i++)
+      librdf_storage_trees_page_free(branch->children[i]);
+    LIBRDF_FREE(librdf_storage_trees_branch, branch);
+  } else
+    LIBRDF_FREE(librdf_storage_trees_leaf, page);
+}
+
+
+/* Bytes of a page and the pages under it; the leaves under a branch
+ * of leaves are counted without visiting them */
+static size_t
+librdf_storage_trees_page_memory(librdf_storage_trees_page* page)
+{
+  librdf_storage_trees_branch* branch;
+  size_t size;
+  int i;
+
+  if(page->is_leaf)
+    return sizeof(librdf_storage_trees_leaf);
+
+  branch=(librdf_storage_trees_branch*)page;
+  size=sizeof(*branch);
+  if(page->count && branch->children[0]->is_leaf)
+    return size + (size_t)page->count * sizeof(librdf_storage_trees_leaf);
+
+  for(i=0; i < page->count; i++)
+    size += librdf_storage_trees_page_memory(branch->children[i]);
+  return size;
+}
+
+
+static librdf_storage_trees_btree*
+librdf_storage_trees_btree_new(const int* order)
+{
+  librdf_storage_trees_btree* tree;
+
+  tree = LIBRDF_CALLOC(librdf_storage_trees_btree*, 1, sizeof(*tree));
+  if(!tree)
+    return NULL;
+
+  tree->order=order;
+  return tree;
+}
+
+
+static void
+librdf_storage_trees_btree_free(librdf_storage_trees_btree* tree)
+{
+  if(tree->root)
+    librdf_storage_trees_page_free(tree->root);
+  LIBRDF_FREE(librdf_storage_trees_btree, tree);
+}
+
+
+static void
+librdf_storage_trees_btree_tuple(librdf_storage_trees_btree* tree,
+                                 const u32* triple,
+                                 librdf_storage_trees_tuple* tuple)
+{
+  int i;
+
+  for(i=0; i < 3; i++)
+    tuple->ids[i]=triple[tree->order[i]];
+}
+
+
+/*
+ * Split the full child at index of a branch that is not full, moving
+ * the upper half of the child to a new page after it.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_split_child(librdf_storage_trees_branch* parent,
+                                 int index)
+{
+  librdf_storage_trees_page* child=parent->children[index];
+  librdf_storage_trees_page* right;
+  librdf_storage_trees_tuple key;
+  int half;
+
+  if(child->is_leaf) {
+    librdf_storage_trees_leaf* left_leaf=(librdf_storage_trees_leaf*)child;
+    librdf_storage_trees_leaf* right_leaf;
+
+    right_leaf = LIBRDF_CALLOC(librdf_storage_trees_leaf*, 1,
+                               sizeof(*right_leaf));
+    if(!right_leaf)
+      return 1;
+
+    half=LIBRDF_STORAGE_TREES_LEAF_SIZE / 2;
+    right_leaf->page.is_leaf=1;
+    right_leaf->page.count=child->count - half;
+    memcpy(right_leaf->tuples, &left_leaf->tuples[half],
+           right_leaf->page.count * sizeof(librdf_storage_trees_tuple));
+    right_leaf->page.next=child->next;
+    child->next=&right_leaf->page;
+    child->count=half;
+
+    key=right_leaf->tuples[0];
+    right=&right_leaf->page;
+  } else {
+    librdf_storage_trees_branch* left_branch=(librdf_storage_trees_branch*)child;
+    librdf_storage_trees_branch* right_branch;
+
+    right_branch = LIBRDF_CALLOC(librdf_storage_trees_branch*, 1,
+                                 sizeof(*right_branch));
+    if(!right_branch)
+      return 1;
+
+    half=LIBRDF_STORAGE_TREES_BRANCH_SIZE / 2;
+    right_branch->page.count=child->count - half;
+    memcpy(right_branch->keys, &left_branch->keys[half],
+           right_branch->page.count * sizeof(librdf_storage_trees_tuple));
+    memcpy(right_branch->children, &left_branch->children[half],
+           right_branch->page.count * sizeof(librdf_storage_trees_page*));
+    memcpy(right_branch->counts, &left_branch->counts[half],
+           right_branch->page.count * sizeof(int));
+    child->count=half;
+
+    key=right_branch->keys[0];
+    right=&right_branch->page;
+  }
+
+  memmove(&parent->keys[index + 2], &parent->keys[index + 1],
+          (parent->page.count - index - 1) * sizeof(librdf_storage_trees_tuple));
+  memmove(&parent->children[index + 2], &parent->children[index + 1],
+          (parent->page.count - index - 1) * sizeof(librdf_storage_trees_page*));
+  memmove(&parent->counts[index + 2], &parent->counts[index + 1],
+          (parent->page.count - index - 1) * sizeof(int));
+  parent->keys[index + 1]=key;
+  parent->children[index + 1]=right;
+  parent->counts[index]=librdf_storage_trees_page_size(child);
+  parent->counts[index + 1]=librdf_storage_trees_page_size(right);
+  parent->page.count++;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_btree_insert - Add a triple to a tree
+ * @tree: the tree
+ * @triple: (subject, predicate, object) ids
+ *
+ * Full pages are split on the way down so a failure leaves the
+ * tree unchanged.  The counts of the branches passed are raised once
+ * the triple is known to be new.
+ *
+ * Return value: 0 if added, >0 if already present, <0 on failure
+ **/
+static int
+librdf_storage_trees_btree_insert(librdf_storage_trees_btree* tree,
+                                  const u32* triple)
+{
+  librdf_storage_trees_tuple tuple;
+  librdf_storage_trees_page* page;
+  librdf_storage_trees_leaf* leaf;
+  librdf_storage_trees_branch* path[LIBRDF_STORAGE_TREES_MAX_DEPTH];
+  int path_index[LIBRDF_STORAGE_TREES_MAX_DEPTH];
+  int depth=0;
+  int index;
+
+  librdf_storage_trees_btree_tuple(tree, triple, &tuple);
+
+  if(!tree->root) {
+    leaf = LIBRDF_CALLOC(librdf_storage_trees_leaf*, 1, sizeof(*leaf));
+    if(!leaf)
+      return -1;
+    leaf->page.is_leaf=1;
+    tree->root=&leaf->page;
+  }
+
+  if(librdf_storage_trees_page_is_full(tree->root)) {
+    librdf_storage_trees_branch* root;
+
+    root = LIBRDF_CALLOC(librdf_storage_trees_branch*, 1, sizeof(*root));
+    if(!root)
+      return -1;
+    root->page.count=1;
+    root->children[0]=tree->root;
+    if(librdf_storage_trees_split_child(root, 0)) {
+      LIBRDF_FREE(librdf_storage_trees_branch, root);
+      return -1;
+    }
+    tree->root=&root->page;
+  }
+
+  page=tree->root;
+  while(!page->is_leaf) {
+    librdf_storage_trees_branch* branch=(librdf_storage_trees_branch*)page;
+
+    index=librdf_storage_trees_branch_search(branch, &tuple);
+    if(librdf_storage_trees_page_is_full(branch->children[index])) {
+      if(librdf_storage_trees_split_child(branch, index))
+        return -1;
+      if(librdf_storage_trees_tuple_compare(&tuple,
+                                            &branch->keys[index + 1]) >= 0)
+        index++;
+    }
+    path[depth]=branch;
+    path_index[depth++]=index;
+    page=branch->children[index];
+  }
+
+  leaf=(librdf_storage_trees_leaf*)page;
+  index=librdf_storage_trees_leaf_search(leaf, &tuple);
+  if(index < page->count &&
+     !librdf_storage_trees_tuple_compare(&leaf->tuples[index], &tuple))
+    return 1;
+
+  memmove(&leaf->tuples[index + 1], &leaf->tuples[index],
+          (page->count - index) * sizeof(librdf_storage_trees_tuple));
+  leaf->tuples[index]=tuple;
+  page->count++;
+  tree->size++;
+
+  while(depth-- > 0)
+    path[depth]->counts[path_index[depth]]++;
+
+  return 0;
+}
+
+
+/* Refill the underfull child at index of a branch from a neighbour,
+ * merging the two when they fit in one page */
+static void
+librdf_storage_trees_rebalance_child(librdf_storage_trees_branch* parent,
+                                     int index)
+{
+  int l=(index > 0) ? index - 1 : index;
+  int r=l + 1;
+  librdf_storage_trees_page* left;
+  librdf_storage_trees_page* right;
+  int total;
+  int want;
+  int n;
+
+  if(r >= parent->page.count)
+    return;
+
+  left=parent->children[l];
+  right=parent->children[r];
+  total=left->count + right->count;
+
+  if(left->is_leaf) {
+    librdf_storage_trees_leaf* left_leaf=(librdf_storage_trees_leaf*)left;
+    librdf_storage_trees_leaf* right_leaf=(librdf_storage_trees_leaf*)right;
+
+    if(total <= LIBRDF_STORAGE_TREES_LEAF_SIZE) {
+      memcpy(&left_leaf->tuples[left->count], right_leaf->tuples,
+             right->count * sizeof(librdf_storage_trees_tuple));
+      left->count=total;
+      left->next=right->next;
+      LIBRDF_FREE(librdf_storage_trees_leaf, right_leaf);
+      parent->counts[l]=total;
+      goto remove_right;
+    }
+
+    want=total / 2;
+    if(left->count < want) {
+      n=want - left->count;
+      memcpy(&left_leaf->tuples[left->count], right_leaf->tuples,
+             n * sizeof(librdf_storage_trees_tuple));
+      memmove(right_leaf->tuples, &right_leaf->tuples[n],
+              (right->count - n) * sizeof(librdf_storage_trees_tuple));
+    } else {
+      n=left->count - want;
+      memmove(&right_leaf->tuples[n], right_leaf->tuples,
+              right->count * sizeof(librdf_storage_trees_tuple));
+      memcpy(right_leaf->tuples, &left_leaf->tuples[want],
+             n * sizeof(librdf_storage_trees_tuple));
+    }
+    left->count=want;
+    right->count=total - want;
+    parent->keys[r]=right_leaf->tuples[0];
+    parent->counts[l]=want;
+    parent->counts[r]=total - want;
+  } else {
+    librdf_storage_trees_branch* left_branch=(librdf_storage_trees_branch*)left;
+    librdf_storage_trees_branch* right_branch=(librdf_storage_trees_branch*)right;
+
+    /* the separator in the parent bounds the first child of right */
+    if(total <= LIBRDF_STORAGE_TREES_BRANCH_SIZE) {
+      right_branch->keys[0]=parent->keys[r];
+      memcpy(&left_branch->keys[left->count], right_branch->keys,
+             right->count * sizeof(librdf_storage_trees_tuple));
+      memcpy(&left_branch->children[left->count], right_branch->children,
+             right->count * sizeof(librdf_storage_trees_page*));
+      memcpy(&left_branch->counts[left->count], right_branch->counts,
+             right->count * sizeof(int));
+      left->count=total;
+      LIBRDF_FREE(librdf_storage_trees_branch, right_branch);
+      parent->counts[l] += parent->counts[r];
+      goto remove_right;
+    }
+
+    want=total / 2;
+    if(left->count < want) {
+      n=want - left->count;
+      right_branch->keys[0]=parent->keys[r];
+      memcpy(&left_branch->keys[left->count], right_branch->keys,
+             n * sizeof(librdf_storage_trees_tuple));
+      memcpy(&left_branch->children[left->count], right_branch->children,
+             n * sizeof(librdf_storage_trees_page*));
+      memcpy(&left_branch->counts[left->count], right_branch->counts,
+             n * sizeof(int));
+      parent->keys[r]=right_branch->keys[n];
+      memmove(right_branch->keys, &right_branch->keys[n],
+              (right->count - n) * sizeof(librdf_storage_trees_tuple));
+      memmove(right_branch->children, &right_branch->children[n],
+              (right->count - n) * sizeof(librdf_storage_trees_page*));
+      memmove(right_branch->counts, &right_branch->counts[n],
+              (right->count - n) * sizeof(int));
+    } else {
+      n=left->count - want;
+      memmove(&right_branch->keys[n], right_branch->keys,
+              right->count * sizeof(librdf_storage_trees_tuple));
+      memmove(&right_branch->children[n], right_branch->children,
+              right->count * sizeof(librdf_storage_trees_page*));
+      memmove(&right_branch->counts[n], right_branch->counts,
+              right->count * sizeof(int));
+      right_branch->keys[n]=parent->keys[r];
+      memcpy(right_branch->keys, &left_branch->keys[want],
+             n * sizeof(librdf_storage_trees_tuple));
+      memcpy(right_branch->children, &left_branch->children[want],
+             n * sizeof(librdf_storage_trees_page*));
+      memcpy(right_branch->counts, &left_branch->counts[want],
+             n * sizeof(int));
+      parent->keys[r]=right_branch->keys[0];
+    }
+    left->count=want;
+    right->count=total - want;
+    parent->counts[l]=librdf_storage_trees_page_size(left);
+    parent->counts[r]=librdf_storage_trees_page_size(right);
+  }
+  return;
+
+  remove_right:
+  memmove(&parent->keys[r], &parent->keys[r + 1],
+          (parent->page.count - r - 1) * sizeof(librdf_storage_trees_tuple));
+  memmove(&parent->children[r], &parent->children[r + 1],
+          (parent->page.count - r - 1) * sizeof(librdf_storage_trees_page*));
+  memmove(&parent->counts[r], &parent->counts[r + 1],
+          (parent->page.count - r - 1) * sizeof(int));
+  parent->page.count--;
+}
+
+
+static int
+librdf_storage_trees_page_delete(librdf_storage_trees_page* page,
+                                 const librdf_storage_trees_tuple* tuple)
+{
+  int index;
+
+  if(page->is_leaf) {
+    librdf_storage_trees_leaf* leaf=(librdf_storage_trees_leaf*)page;
+
+    index=librdf_storage_trees_leaf_search(leaf, tuple);
+    if(index >= page->count ||
+       librdf_storage_trees_tuple_compare(&leaf->tuples[index], tuple))
+      return 1;
+
+    memmove(&leaf->tuples[index], &leaf->tuples[index + 1],
+            (page->count - index - 1) * sizeof(librdf_storage_trees_tuple));
+    page->count--;
+  } else {
+    librdf_storage_trees_branch* branch=(librdf_storage_trees_branch*)page;
+    librdf_storage_trees_page* child;
+
+    index=librdf_storage_trees_branch_search(branch, tuple);
+    child=branch->children[index];
+    if(librdf_storage_trees_page_delete(child, tuple))
+      return 1;
+    branch->counts[index]--;
+
+    if(child->count < (child->is_leaf ? LIBRDF_STORAGE_TREES_LEAF_SIZE :
+                                        LIBRDF_STORAGE_TREES_BRANCH_SIZE) / 4)
+      librdf_storage_trees_rebalance_child(branch, index);
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_btree_delete - Remove a triple from a tree
+ * @tree: the tree
+ * @triple: (subject, predicate, object) ids
+ *
+ * Return value: 0 if removed, >0 if not present
+ **/
+static int
+librdf_storage_trees_btree_delete(librdf_storage_trees_btree* tree,
+                                  const u32* triple)
+{
+  librdf_storage_trees_tuple tuple;
+
+  if(!tree->root)
+    return 1;
+
+  librdf_storage_trees_btree_tuple(tree, triple, &tuple);
+  if(librdf_storage_trees_page_delete(tree->root, &tuple))
+    return 1;
+
+  tree->size--;
+
+  /* shorten the tree while the root has a single child */
+  while(!tree->root->is_leaf && tree->root->count == 1) {
+    librdf_storage_trees_branch* root=(librdf_storage_trees_branch*)tree->root;
+
+    tree->root=root->children[0];
+    LIBRDF_FREE(librdf_storage_trees_branch, root);
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_trees_btree_lower_bound - Find the first tuple not below a tuple
+ * @tree: the tree
+ * @tuple: tuple in tree order
+ * @position_p: pointer to store the index of the tuple in the leaf
+ *
+ * Return value: leaf holding the tuple or NULL if there is none
+ **/
+static librdf_storage_trees_leaf*
+librdf_storage_trees_btree_lower_bound(librdf_storage_trees_btree* tree,
+                                       const librdf_storage_trees_tuple* tuple,
+                                       int* position_p)
+{
+  librdf_storage_trees_page* page=tree->root;
+  int position;
+
+  if(!page)
+    return NULL;
+
+  while(!page->is_leaf) {
+    librdf_storage_trees_branch* branch=(librdf_storage_trees_branch*)page;
+
+    page=branch->children[librdf_storage_trees_branch_search(branch, tuple)];
+  }
+
+  position=librdf_storage_trees_leaf_search((librdf_storage_trees_leaf*)page,
+                                            tuple);
+  while(page && position >= page->count) {
+    page=page->next;
+    position=0;
+  }
+
+  *position_p=position;
+  return (librdf_storage_trees_leaf*)page;
+}
+
+
+static int
+librdf_storage_trees_btree_contains(librdf_storage_trees_btree* tree,
+                                    const u32* triple)
+{
+  librdf_storage_trees_tuple tuple;
+  librdf_storage_trees_leaf* leaf;
+  int position;
+
+  librdf_storage_trees_btree_tuple(tree, triple, &tuple);
+  leaf=librdf_storage_trees_btree_lower_bound(tree, &tuple, &position);
+
+  return (leaf &&
+          !librdf_storage_trees_tuple_compare(&leaf->tuples[position], &tuple));
+}
+
+
+/*
+ * librdf_storage_trees_btree_rank - Count the tuples of a tree below a tuple
+ * @tree: the tree
+ * @tuple: tuple in tree order
+ * @inclusive: non 0 to count a tuple equal to tuple too
+ *
+ * Adds up the counts of the children left of the path to tuple, so
+ * it takes one walk down the tree.
+ *
+ * Return value: number of tuples
  **/
 static int
-librdf_storage_trees_context_add_statement(librdf_storage* storage,
-                                           librdf_node* context_node,
-                                           librdf_statement* statement) 
+librdf_storage_trees_btree_rank(librdf_storage_trees_btree* tree,
+                                const librdf_storage_trees_tuple* tuple,
+                                int inclusive)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    raptor_avltree_search(context->contexts, key);
-  
-  if(graph) {
-    librdf_storage_trees_graph_free(key);
-  } else {
-    raptor_avltree_add(context->contexts, key);
-    graph=key;
+  librdf_storage_trees_page* page=tree->root;
+  librdf_storage_trees_leaf* leaf;
+  int rank=0;
+  int low, high;
+
+  if(!page)
+    return 0;
+
+  while(!page->is_leaf) {
+    librdf_storage_trees_branch* branch=(librdf_storage_trees_branch*)page;
+    int index=librdf_storage_trees_branch_search(branch, tuple);
+    int i;
+
+    for(i=0; i < index; i++)
+      rank += branch->counts[i];
+    page=branch->children[index];
+  }
+
+  leaf=(librdf_storage_trees_leaf*)page;
+  low=0;
+  high=page->count;
+  while(low < high) {
+    int middle=(low + high) / 2;
+    int c=librdf_storage_trees_tuple_compare(&leaf->tuples[middle], tuple);
+
+    if(c < 0 || (inclusive && !c))
+      low=middle + 1;
+    else
+      high=middle;
   }
-    
-  return librdf_storage_trees_add_statement_internal(storage, graph, statement);
+
+  return rank + low;
 }
 
 
-/**
- * librdf_storage_trees_context_remove_statement:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- * @statement: #librdf_statement statement to remove
- *
- * Remove a statement from a storage context.
- * 
- * Return value: non 0 on failure
- **/
+/* Number of tuples of a tree starting with the first prefix_len ids
+ * of prefix */
 static int
-librdf_storage_trees_context_remove_statement(librdf_storage* storage, 
-                                              librdf_node* context_node,
-                                              librdf_statement* statement) 
+librdf_storage_trees_btree_count_prefix(librdf_storage_trees_btree* tree,
+                                        const librdf_storage_trees_tuple* prefix,
+                                        int prefix_len)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    raptor_avltree_search(context->contexts, &key);
-  librdf_storage_trees_graph_free(key);
-  if (graph) {
-    return librdf_storage_trees_remove_statement_internal(graph, statement);
-  } else {
-    return -1;
+  librdf_storage_trees_tuple lower;
+  librdf_storage_trees_tuple upper;
+  int i;
+
+  if(!prefix_len)
+    return tree->size;
+
+  for(i=0; i < 3; i++) {
+    lower.ids[i]=(i < prefix_len) ? prefix->ids[i] : 0;
+    upper.ids[i]=(i < prefix_len) ? prefix->ids[i] : (u32)0xffffffffU;
   }
+
+  return librdf_storage_trees_btree_rank(tree, &upper, 1) -
+         librdf_storage_trees_btree_rank(tree, &lower, 0);
 }
 
 
-/**
- * librdf_storage_trees_context_serialise:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- *
- * List all statements in a storage context.
- * 
- * Return value: #librdf_stream of statements or NULL on failure or context is empty
- **/
-static librdf_stream*
-librdf_storage_trees_context_serialise(librdf_storage* storage,
-                                        librdf_node* context_node) 
+static int
+librdf_storage_trees_tuple_sort_compare(const void* a, const void* b)
 {
-  return NULL;
+  return librdf_storage_trees_tuple_compare((const librdf_storage_trees_tuple*)a,
+                                            (const librdf_storage_trees_tuple*)b);
 }
 
 
-/**
- * librdf_storage_trees_context_get_contexts:
- * @storage: #librdf_storage object
- *
- * List all context nodes in a storage.
- * 
- * Return value: #librdf_iterator of context_nodes or NULL on failure or no contexts
- **/
-static librdf_iterator*
-librdf_storage_trees_get_contexts(librdf_storage* storage) 
+/* The lowest tuple under a page */
+static const librdf_storage_trees_tuple*
+librdf_storage_trees_page_first(librdf_storage_trees_page* page)
 {
-  return NULL;
+  while(!page->is_leaf)
+    page=((librdf_storage_trees_branch*)page)->children[0];
+
+  return &((librdf_storage_trees_leaf*)page)->tuples[0];
 }
-#endif
 
 
-/**
- * librdf_storage_trees_find_statements:
- * @storage: the storage
- * @statement: the statement to match
+/*
+ * librdf_storage_trees_btree_build - Build the pages of a tree from a run of triples
+ * @tree: the tree giving the ordering
+ * @triples: count (subject, predicate, object) ids, in any order
+ * @count: number of triples, above 0
+ * @tuples: work array of count tuples
+ * @root_p: pointer to store the root page
+ * @size_p: pointer to store the number of distinct triples
  *
- * .
- * 
- * Return a stream of statements matching the given statement (or
- * all statements if NULL).  Parts (subject, predicate, object) of the
- * statement can be empty in which case any statement part will match that.
- * Uses #librdf_statement_match to do the matching.
- * 
- * Return value: a #librdf_stream or NULL on failure
+ * The triples are sorted once in tree order and duplicates dropped.
+ * Leaves and then each level of branches are filled left to right
+ * with the entries spread evenly, so every page is at least half
+ * full and later inserts and deletes keep working as usual.
+ *
+ * Return value: non 0 on failure
  **/
-static librdf_stream*
-librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement)
+static int
+librdf_storage_trees_btree_build(librdf_storage_trees_btree* tree,
+                                 const u32* triples, int count,
+                                 librdf_storage_trees_tuple* tuples,
+                                 librdf_storage_trees_page** root_p,
+                                 int* size_p)
 {
-  librdf_stream* stream;
+  librdf_storage_trees_page** pages;
+  int pages_count;
+  int unique;
+  int done;
+  int next;
+  int i;
+
+  for(i=0; i < count; i++)
+    librdf_storage_trees_btree_tuple(tree, &triples[i * 3], &tuples[i]);
+
+  /* a run already in order, such as a saved spo tree, is not sorted */
+  for(i=1; i < count; i++) {
+    if(librdf_storage_trees_tuple_compare(&tuples[i - 1], &tuples[i]) > 0)
+      break;
+  }
+  if(i < count)
+    qsort(tuples, (size_t)count, sizeof(*tuples),
+          librdf_storage_trees_tuple_sort_compare);
+
+  unique=1;
+  for(i=1; i < count; i++) {
+    if(librdf_storage_trees_tuple_compare(&tuples[i], &tuples[unique - 1]))
+      tuples[unique++]=tuples[i];
+  }
 
-  librdf_statement* range=librdf_new_statement_from_statement(statement);
-  if(!range)
-    return NULL;
+  pages_count=(unique + LIBRDF_STORAGE_TREES_LEAF_SIZE - 1) /
+              LIBRDF_STORAGE_TREES_LEAF_SIZE;
+  pages = LIBRDF_CALLOC(librdf_storage_trees_page**, pages_count,
+                        sizeof(librdf_storage_trees_page*));
+  if(!pages)
+    return 1;
 
-  stream=librdf_storage_trees_serialise_range(storage, range);
+  /* pages[0..done) are built and own their children; the entries
+   * from pages[next] on are not yet in a page */
+  next=0;
+  for(done=0; done < pages_count; done++) {
+    librdf_storage_trees_leaf* leaf;
+    int n=unique / pages_count + (done < unique % pages_count);
+
+    leaf = LIBRDF_CALLOC(librdf_storage_trees_leaf*, 1, sizeof(*leaf));
+    if(!leaf) {
+      next=pages_count;
+      goto failed;
+    }
+    leaf->page.is_leaf=1;
+    leaf->page.count=n;
+    memcpy(leaf->tuples, &tuples[next],
+           n * sizeof(librdf_storage_trees_tuple));
+    next += n;
+
+    if(done)
+      pages[done - 1]->next=&leaf->page;
+    pages[done]=&leaf->page;
+  }
 
-  return stream;
+  while(pages_count > 1) {
+    int parents_count=(pages_count + LIBRDF_STORAGE_TREES_BRANCH_SIZE - 1) /
+                      LIBRDF_STORAGE_TREES_BRANCH_SIZE;
+
+    /* parents replace their children at the front of pages */
+    next=0;
+    for(done=0; done < parents_count; done++) {
+      librdf_storage_trees_branch* branch;
+      int n=pages_count / parents_count + (done < pages_count % parents_count);
+
+      branch = LIBRDF_CALLOC(librdf_storage_trees_branch*, 1, sizeof(*branch));
+      if(!branch)
+        goto failed;
+      branch->page.count=n;
+      for(i=0; i < n; i++) {
+        branch->children[i]=pages[next + i];
+        branch->keys[i]=*librdf_storage_trees_page_first(pages[next + i]);
+        branch->counts[i]=librdf_storage_trees_page_size(pages[next + i]);
+      }
+      next += n;
+
+      pages[done]=&branch->page;
+    }
+    pages_count=parents_count;
+  }
+
+  *root_p=pages[0];
+  *size_p=unique;
+  LIBRDF_FREE(librdf_storage_trees_page**, pages);
+
+  return 0;
+
+  failed:
+  for(i=0; i < done; i++)
+    librdf_storage_trees_page_free(pages[i]);
+  for(i=next; i < pages_count; i++)
+    librdf_storage_trees_page_free(pages[i]);
+  LIBRDF_FREE(librdf_storage_trees_page**, pages);
+
+  return 1;
 }
 
-/* statement tree functions */
 
-static int
-librdf_storage_trees_node_compare(librdf_node* n1, librdf_node* n2)
+/* graph functions */
+
+static librdf_storage_trees_graph*
+librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context_node)
 {
-  if (n1 == n2) {
-    return 0;
-  } else if (n1->type != n2->type) {
-    return LIBRDF_GOOD_CAST(int, n2->type) - LIBRDF_GOOD_CAST(int, n1->type);
-  } else {
-    switch (n1->type) {
-      case RAPTOR_TERM_TYPE_URI:
-        return librdf_uri_compare(n1->value.uri, n2->value.uri);
-
-      case RAPTOR_TERM_TYPE_LITERAL:
-        if(1) {
-          const unsigned char l1 = n1->value.literal.language_len;
-          const unsigned char l2 = n2->value.literal.language_len;
-          const unsigned char l  = (l1 < l2) ? l1 : l2;
-
-          /* compare first by data type */
-          int r = raptor_uri_compare(n1->value.literal.datatype,
-                                     n2->value.literal.datatype);
-          if(r)
-            return r;
-
-          /* if data type is equal, compare by value */
-          r = strcmp((const char*)n1->value.literal.string,
-                     (const char*)n2->value.literal.string);
-          if(r)
-            return r;
-
-          /* if both data type and value are equal, compare by language */
-          if(l) {
-            return strncmp((const char*)n1->value.literal.language,
-                           (const char*)n2->value.literal.language, (size_t)l);
-          } else {
-            /* if l == 0 strncmp will always return 0; in that case
-             * consider the node with no language to be lesser. */
-            return l1 - l2;
-          }
-        }
-      case RAPTOR_TERM_TYPE_BLANK:
-        return strcmp((char*)n1->value.blank.string,
-                      (char*)n2->value.blank.string);
-
-      case RAPTOR_TERM_TYPE_UNKNOWN:
-      default:
-        if(1) {
-          ptrdiff_t d;
-          d = LIBRDF_GOOD_CAST(char*, n2) - LIBRDF_GOOD_CAST(char*, n1);
-          return (d > 0) - (d < 0);
-        }
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  int i;
+
+  graph = LIBRDF_CALLOC(librdf_storage_trees_graph*, 1, sizeof(*graph));
+  if(!graph)
+    return NULL;
+
+  if(context_node) {
+    graph->context=librdf_new_node_from_node(context_node);
+    if(!graph->context) {
+      librdf_storage_trees_graph_free(graph);
+      return NULL;
+    }
+  }
+
+  /* SPO index is always created */
+  for(i=0; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    if(!context->indexes[i])
+      continue;
+
+    graph->trees[i]=librdf_storage_trees_btree_new(librdf_storage_trees_orders[i]);
+    if(!graph->trees[i]) {
+      librdf_storage_trees_graph_free(graph);
+      return NULL;
     }
   }
-}
 
+  return graph;
+}
 
 
-/* Compare two statements in (s, p, o) order.
- * NULL fields act as wildcards. */
+/* Add a tree ordering to a graph, built from its spo tree */
 static int
-librdf_statement_compare_spo(const void* data1, const void* data2)
+librdf_storage_trees_graph_add_tree(librdf_storage_trees_graph* graph,
+                                    int tree)
 {
-  librdf_statement* a = (librdf_statement*)data1;
-  librdf_statement* b = (librdf_statement*)data2;
-  int cmp = 0;
+  librdf_storage_trees_btree* spo=graph->trees[LIBRDF_STORAGE_TREES_SPO];
+  librdf_storage_trees_btree* btree;
+  librdf_storage_trees_tuple first;
+  librdf_storage_trees_tuple* tuples;
+  librdf_storage_trees_page* page;
+  u32* triples;
+  int position;
+  int count;
+  int status;
+
+  btree=librdf_storage_trees_btree_new(librdf_storage_trees_orders[tree]);
+  if(!btree)
+    return 1;
 
-  /* Subject */
-  if (a->subject == NULL || b->subject == NULL)
-    return 0; /* wildcard subject match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->subject, b->subject);
+  if(!spo->size) {
+    graph->trees[tree]=btree;
+    return 0;
+  }
 
-  if (cmp != 0)
-    return cmp;
+  triples = LIBRDF_MALLOC(u32*, spo->size * 3 * sizeof(u32));
+  tuples = LIBRDF_MALLOC(librdf_storage_trees_tuple*,
+                         spo->size * sizeof(librdf_storage_trees_tuple));
+  if(!triples || !tuples) {
+    status=1;
+    goto tidy;
+  }
 
-  /* Predicate */
-  if (a->predicate == NULL || b->predicate == NULL)
-    return 0; /* wildcard predicate match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->predicate, b->predicate);
+  /* spo tuples are in (subject, predicate, object) order already */
+  memset(&first, 0, sizeof(first));
+  page=&librdf_storage_trees_btree_lower_bound(spo, &first, &position)->page;
+  for(count=0; page; page=page->next) {
+    memcpy(&triples[count * 3], ((librdf_storage_trees_leaf*)page)->tuples,
+           page->count * sizeof(librdf_storage_trees_tuple));
+    count += page->count;
+  }
+
+  status=librdf_storage_trees_btree_build(btree, triples, count, tuples,
+                                          &btree->root, &btree->size);
 
-  if (cmp != 0)
-    return cmp;
+  tidy:
+  if(tuples)
+    LIBRDF_FREE(librdf_storage_trees_tuple*, tuples);
+  if(triples)
+    LIBRDF_FREE(u32*, triples);
 
-  /* Object */
-  if (a->object == NULL || b->object == NULL)
-    return 0; /* wildcard object match */
+  if(status)
+    librdf_storage_trees_btree_free(btree);
   else
-    cmp = librdf_storage_trees_node_compare(a->object, b->object);
+    graph->trees[tree]=btree;
+
+  return status;
+}
+
+
+static void
+librdf_storage_trees_graph_free(librdf_storage_trees_graph* graph)
+{
+  int i;
+
+  if(graph->context)
+    librdf_free_node(graph->context);
 
-  return cmp;
+  for(i=0; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    if(graph->trees[i])
+      librdf_storage_trees_btree_free(graph->trees[i]);
+  }
+
+  LIBRDF_FREE(librdf_storage_trees_graph, graph);
 }
 
 
-/* Compare two statements in (o, s, p) order.
- * NULL fields act as wildcards. */
+/*
+ * librdf_storage_trees_graph_build - Replace the trees of a graph with ones built from triples
+ * @graph: the graph
+ * @triples: count (subject, predicate, object) ids, in any order
+ * @count: number of triples, above 0
+ *
+ * Every tree is built before any is replaced so a failure changes
+ * nothing.
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_statement_compare_sop(const void* data1, const void* data2)
+librdf_storage_trees_graph_build(librdf_storage_trees_graph* graph,
+                                 const u32* triples, int count)
 {
-  librdf_statement* a = (librdf_statement*)data1;
-  librdf_statement* b = (librdf_statement*)data2;
-  int cmp = 0;
+  librdf_storage_trees_page* roots[LIBRDF_STORAGE_TREES_COUNT];
+  int sizes[LIBRDF_STORAGE_TREES_COUNT];
+  librdf_storage_trees_tuple* tuples;
+  int i;
+
+  tuples = LIBRDF_MALLOC(librdf_storage_trees_tuple*,
+                         count * sizeof(librdf_storage_trees_tuple));
+  if(!tuples)
+    return 1;
 
-  /* Subject */
-  if (a->subject == NULL || b->subject == NULL)
-    return 0; /* wildcard subject match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->subject, b->subject);
+  for(i=0; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    roots[i]=NULL;
+    if(graph->trees[i] &&
+       librdf_storage_trees_btree_build(graph->trees[i], triples, count,
+                                        tuples, &roots[i], &sizes[i]))
+      break;
+  }
 
-  if (cmp != 0)
-    return cmp;
+  LIBRDF_FREE(librdf_storage_trees_tuple*, tuples);
 
-  /* Object */
-  if (a->object == NULL || b->object == NULL)
-    return 0; /* wildcard object match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->object, b->object);
+  if(i < LIBRDF_STORAGE_TREES_COUNT) {
+    while(i-- > 0) {
+      if(roots[i])
+        librdf_storage_trees_page_free(roots[i]);
+    }
+    return 1;
+  }
 
-  if (cmp != 0)
-    return cmp;
+  for(i=0; i < LIBRDF_STORAGE_TREES_COUNT; i++) {
+    if(!graph->trees[i])
+      continue;
 
-  /* Predicate */
-  if (a->predicate == NULL || b->predicate == NULL)
-    return 0; /* wildcard predicate match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->predicate, b->predicate);
+    /* an emptied tree may still have its root leaf */
+    if(graph->trees[i]->root)
+      librdf_storage_trees_page_free(graph->trees[i]->root);
+    graph->trees[i]->root=roots[i];
+    graph->trees[i]->size=sizes[i];
+  }
 
-  return cmp;
+  return 0;
 }
 
 
-/* Compare two statements in (o, p, s) order.
- * NULL fields act as wildcards. */
+/*
+ * Snapshot files hold the node dictionary and the spo tree of every
+ * graph, all as native 32 bit words:
+ *   magic, version, byte order mark
+ *   node count, then per node: encoded length, librdf_node_encode() bytes
+ *   graph count, then per graph: context node id (0 for no context),
+ *     triple count, (subject, predicate, object) ids in spo order
+ * The triples of a graph are read in one run and its trees built
+ * bottom-up, the spo tree without sorting.
+ */
+#define LIBRDF_STORAGE_TREES_SNAPSHOT_MAGIC "RDFTREES"
+#define LIBRDF_STORAGE_TREES_SNAPSHOT_VERSION 1
+#define LIBRDF_STORAGE_TREES_SNAPSHOT_BYTE_ORDER 0x01020304U
+
+/* Read buffer size for loading snapshots */
+#define LIBRDF_STORAGE_TREES_SNAPSHOT_BUFFER_SIZE (1 << 20)
+
+/* Bytes of the magic, version, byte order mark and node count */
+#define LIBRDF_STORAGE_TREES_SNAPSHOT_HEADER_SIZE (8 + 3 * 4)
+
+
 static int
-librdf_statement_compare_ops(const void* data1, const void* data2)
+librdf_storage_trees_snapshot_write_u32(FILE* fh, u32 value)
 {
-  librdf_statement* a = (librdf_statement*)data1;
-  librdf_statement* b = (librdf_statement*)data2;
-  int cmp = 0;
+  return fwrite(&value, sizeof(value), 1, fh) != 1;
+}
 
-  /* Object */
-  if (a->object == NULL || b->object == NULL)
-    return 0; /* wildcard object match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->object, b->object);
-  
-  if (cmp != 0)
-    return cmp;
-
-  /* Predicate */
-  if (a->predicate == NULL || b->predicate == NULL)
-    return 0; /* wildcard predicate match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->predicate, b->predicate);
-
-  if (cmp != 0)
-    return cmp;
-  
-  /* Subject */
-  if (a->subject == NULL || b->subject == NULL)
-    return 0; /* wildcard subject match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->subject, b->subject);
 
-  return cmp;
+static int
+librdf_storage_trees_snapshot_read_u32(FILE* fh, u32* value_p)
+{
+  return fread(value_p, sizeof(*value_p), 1, fh) != 1;
 }
 
 
-/* Compare two statements in (p, s, o) order.
- * NULL fields act as wildcards. */
+/* Write the context id, size and spo tuples of a graph */
 static int
-librdf_statement_compare_pso(const void* data1, const void* data2)
+librdf_storage_trees_snapshot_write_graph(FILE* fh, u32 id,
+                                          librdf_storage_trees_graph* graph)
 {
-  librdf_statement* a = (librdf_statement*)data1;
-  librdf_statement* b = (librdf_statement*)data2;
-  int cmp = 0;
+  librdf_storage_trees_btree* spo=graph->trees[LIBRDF_STORAGE_TREES_SPO];
+  librdf_storage_trees_page* page=spo->root;
 
-  /* Predicate */
-  if (a->predicate == NULL || b->predicate == NULL)
-    return 0; /* wildcard predicate match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->predicate, b->predicate);
-
-  if (cmp != 0)
-    return cmp;
-  
-  /* Subject */
-  if (a->subject == NULL || b->subject == NULL)
-    return 0; /* wildcard subject match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->subject, b->subject);
-
-  if (cmp != 0)
-    return cmp;
-  
-  /* Object */
-  if (a->object == NULL || b->object == NULL)
-    return 0; /* wildcard object match */
-  else
-    cmp = librdf_storage_trees_node_compare(a->object, b->object);
-  
-  return cmp;
-}
+  if(librdf_storage_trees_snapshot_write_u32(fh, id) ||
+     librdf_storage_trees_snapshot_write_u32(fh, (u32)spo->size))
+    return 1;
 
+  if(!page)
+    return 0;
 
-static void
-librdf_storage_trees_avl_free(void* data)
-{
-  librdf_statement* stmnt=(librdf_statement*)data;
-  librdf_free_statement(stmnt);
-}
+  while(!page->is_leaf)
+    page=((librdf_storage_trees_branch*)page)->children[0];
 
+  /* spo tuples are (subject, predicate, object) ids already */
+  for(; page; page=page->next) {
+    if(page->count &&
+       fwrite(((librdf_storage_trees_leaf*)page)->tuples,
+              sizeof(librdf_storage_trees_tuple), (size_t)page->count,
+              fh) != (size_t)page->count)
+      return 1;
+  }
 
-/* graph functions */
+  return 0;
+}
 
-static librdf_storage_trees_graph*
-librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context_node)
+
+/*
+ * librdf_storage_trees_snapshot_save - Save the content to the snapshot file
+ * @storage: #librdf_storage object
+ *
+ * The file is written beside the snapshot and renamed over it once
+ * complete, so a failed save leaves the last snapshot in place.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_snapshot_save(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_graph* graph;
+  unsigned char* buffer=NULL;
+  size_t buffer_size=0;
+  char* new_name;
+  FILE* fh;
+  u32 graphs_count;
+  u32 id;
+  int status=1;
+
+  new_name = LIBRDF_MALLOC(char*, strlen(context->snapshot) + 5);
+  if(!new_name)
+    return 1;
+  sprintf(new_name, "%s.new", context->snapshot);
+
+  fh=fopen(new_name, "wb");
+  if(!fh) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to create trees snapshot %s - %s", new_name,
+               strerror(errno));
+    LIBRDF_FREE(char*, new_name);
+    return 1;
+  }
 
-  graph = LIBRDF_MALLOC(librdf_storage_trees_graph*, sizeof(*graph));
-  
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  graph->context=(context_node ? librdf_new_node_from_node(context_node) : NULL);
-#endif
+  if(fwrite(LIBRDF_STORAGE_TREES_SNAPSHOT_MAGIC, 8, 1, fh) != 1 ||
+     librdf_storage_trees_snapshot_write_u32(fh, LIBRDF_STORAGE_TREES_SNAPSHOT_VERSION) ||
+     librdf_storage_trees_snapshot_write_u32(fh, LIBRDF_STORAGE_TREES_SNAPSHOT_BYTE_ORDER) ||
+     librdf_storage_trees_snapshot_write_u32(fh, context->nodes_count - 1))
+    goto tidy;
+
+  for(id=1; id < context->nodes_count; id++) {
+    size_t len=librdf_node_encode(context->nodes[id], NULL, 0);
+
+    if(!len)
+      goto tidy;
+
+    if(len > buffer_size) {
+      if(buffer)
+        LIBRDF_FREE(char*, buffer);
+      buffer_size=len * 2;
+      buffer = LIBRDF_MALLOC(unsigned char*, buffer_size);
+      if(!buffer)
+        goto tidy;
+    }
 
-  /* Always create SPO index */
-  graph->spo_tree = raptor_new_avltree(librdf_statement_compare_spo,
-                                       librdf_storage_trees_avl_free,
-                                       /* flags */ 0);
-  if(!graph->spo_tree) {
-    LIBRDF_FREE(librdf_storage_trees_graph, graph);
-    return NULL;
+    if(!librdf_node_encode(context->nodes[id], buffer, len) ||
+       librdf_storage_trees_snapshot_write_u32(fh, (u32)len) ||
+       fwrite(buffer, len, 1, fh) != 1)
+      goto tidy;
   }
-  
-  if(context->index_sop)
-    graph->sop_tree = raptor_new_avltree(librdf_statement_compare_sop, NULL,
-                                         /* flags */ 0);
-  else
-    graph->sop_tree=NULL;
 
-  if(context->index_ops)
-    graph->ops_tree = raptor_new_avltree(librdf_statement_compare_ops, NULL,
-                                         /* flags */ 0);
-  else
-    graph->ops_tree=NULL;
-  
-  if(context->index_pso)
-    graph->pso_tree = raptor_new_avltree(librdf_statement_compare_pso, NULL,
-                                         /* flags */ 0);
-  else
-    graph->pso_tree=NULL;
+  graphs_count=1;
+  for(id=0; id < context->context_graphs_size; id++) {
+    if(context->context_graphs[id])
+      graphs_count++;
+  }
 
-  return graph;
+  if(librdf_storage_trees_snapshot_write_u32(fh, graphs_count) ||
+     librdf_storage_trees_snapshot_write_graph(fh, 0, context->graph))
+    goto tidy;
+
+  for(id=0; id < context->context_graphs_size; id++) {
+    if(context->context_graphs[id] &&
+       librdf_storage_trees_snapshot_write_graph(fh, id,
+                                                 context->context_graphs[id]))
+      goto tidy;
+  }
+
+  status=0;
+
+  tidy:
+  if(buffer)
+    LIBRDF_FREE(char*, buffer);
+
+  if(fclose(fh))
+    status=1;
+
+  if(!status && rename(new_name, context->snapshot))
+    status=1;
+
+  if(status) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to save trees snapshot %s", context->snapshot);
+    remove(new_name);
+  } else
+    context->changed=0;
+
+  LIBRDF_FREE(char*, new_name);
+
+  return status;
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+/*
+ * librdf_storage_trees_snapshot_load - Load the content of the snapshot file
+ * @storage: #librdf_storage object with no statements
+ *
+ * A missing file is an empty store.
+ *
+ * Return value: non 0 on failure
+ **/
 static int
-librdf_storage_trees_graph_compare(const void* data1, const void* data2)
+librdf_storage_trees_snapshot_load(librdf_storage* storage)
 {
-  librdf_storage_trees_graph* a = (librdf_storage_trees_graph*)data1;
-  librdf_storage_trees_graph* b = (librdf_storage_trees_graph*)data2;
-  return librdf_storage_trees_node_compare(a->context, b->context);
-}
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  unsigned char* buffer=NULL;
+  size_t buffer_size=0;
+  u32* triples=NULL;
+  u32 triples_size=0;
+  char magic[8];
+  u32 value;
+  u32 nodes_count;
+  u32 graphs_count;
+  u32 slots_size;
+  u32 i;
+  FILE* fh;
+  u64 file_size=~(u64)0;
+#ifdef HAVE_SYS_STAT_H
+  struct stat st;
 #endif
+  int status=1;
+
+  fh=fopen(context->snapshot, "rb");
+  if(!fh) {
+    if(errno == ENOENT)
+      return 0;
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to open trees snapshot %s - %s", context->snapshot,
+               strerror(errno));
+    return 1;
+  }
 
+  setvbuf(fh, NULL, _IOFBF, LIBRDF_STORAGE_TREES_SNAPSHOT_BUFFER_SIZE);
 
-static void
-librdf_storage_trees_graph_free(void* data)
-{
-  librdf_storage_trees_graph* graph = (librdf_storage_trees_graph*)data;
-  
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_free_node(graph->context);
+  /* counts and lengths are checked against the file size before any
+   * allocation is sized by them */
+#ifdef HAVE_SYS_STAT_H
+  if(fstat(fileno(fh), &st))
+    goto tidy;
+  file_size=(u64)st.st_size;
 #endif
-  
-  /* Extra index trees have null deleters (statements are shared) */
-  if (graph->sop_tree)
-    raptor_free_avltree(graph->sop_tree);
-  if (graph->ops_tree)
-    raptor_free_avltree(graph->ops_tree);
-  if (graph->pso_tree)
-    raptor_free_avltree(graph->pso_tree);
-
-  /* Free spo tree and statements */
-  raptor_free_avltree(graph->spo_tree);
-
-  graph->spo_tree = NULL;
-  graph->sop_tree = NULL;
-  graph->ops_tree = NULL;
-  graph->pso_tree = NULL;
 
-  LIBRDF_FREE(librdf_storage_trees_graph, graph);
+  if(file_size < LIBRDF_STORAGE_TREES_SNAPSHOT_HEADER_SIZE ||
+     fread(magic, 8, 1, fh) != 1 ||
+     memcmp(magic, LIBRDF_STORAGE_TREES_SNAPSHOT_MAGIC, 8) ||
+     librdf_storage_trees_snapshot_read_u32(fh, &value) ||
+     value != LIBRDF_STORAGE_TREES_SNAPSHOT_VERSION ||
+     librdf_storage_trees_snapshot_read_u32(fh, &value) ||
+     value != LIBRDF_STORAGE_TREES_SNAPSHOT_BYTE_ORDER ||
+     librdf_storage_trees_snapshot_read_u32(fh, &nodes_count) ||
+     nodes_count >= 0x7fffffffU)
+    goto tidy;
+
+  /* each node is a length and at least one byte, then the graph count */
+  if((u64)nodes_count * 5 + 4 >
+     file_size - LIBRDF_STORAGE_TREES_SNAPSHOT_HEADER_SIZE)
+    goto tidy;
+
+  /* the dictionary is filled in id order */
+  context->nodes = LIBRDF_CALLOC(librdf_node**, nodes_count + 1,
+                                 sizeof(librdf_node*));
+  if(!context->nodes)
+    goto tidy;
+  context->node_hashes = LIBRDF_CALLOC(u32*, nodes_count + 1, sizeof(u32));
+  if(!context->node_hashes)
+    goto tidy;
+  context->nodes_size=nodes_count + 1;
+
+  for(i=0; i < nodes_count; i++) {
+    librdf_node* node;
+
+    if(librdf_storage_trees_snapshot_read_u32(fh, &value) || !value ||
+       value > file_size)
+      goto tidy;
+
+    if(value > buffer_size) {
+      if(buffer)
+        LIBRDF_FREE(char*, buffer);
+      buffer_size=value * 2;
+      buffer = LIBRDF_MALLOC(unsigned char*, buffer_size);
+      if(!buffer)
+        goto tidy;
+    }
+
+    if(fread(buffer, value, 1, fh) != 1)
+      goto tidy;
+
+    node=librdf_node_decode(storage->world, NULL, buffer, value);
+    if(!node)
+      goto tidy;
+    context->node_hashes[context->nodes_count]=librdf_storage_trees_node_hash(node);
+    context->nodes[context->nodes_count++]=node;
+    context->nodes_memory += librdf_node_get_memory_size(node);
+  }
+
+  /* keep the slot table at most half full */
+  for(slots_size=1024; slots_size <= context->nodes_count * 2; slots_size *= 2)
+    ;
+  if(librdf_storage_trees_resize_node_slots(context, slots_size))
+    goto tidy;
+
+  if(librdf_storage_trees_snapshot_read_u32(fh, &graphs_count))
+    goto tidy;
+
+  for(; graphs_count; graphs_count--) {
+    librdf_storage_trees_graph* graph;
+    u32 id;
+    u32 count;
+
+    if(librdf_storage_trees_snapshot_read_u32(fh, &id) ||
+       id >= context->nodes_count ||
+       librdf_storage_trees_snapshot_read_u32(fh, &count) ||
+       count >= 0x7fffffffU / sizeof(librdf_storage_trees_tuple) ||
+       (u64)count * 3 * sizeof(u32) > file_size)
+      goto tidy;
+
+    if(!id)
+      graph=context->graph;
+    else if(!context->contexts) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Trees snapshot %s has contexts but the storage was created without context support",
+                 context->snapshot);
+      goto tidy;
+    } else
+      graph=librdf_storage_trees_find_graph(storage, context->nodes[id], 1);
+    if(!graph)
+      goto tidy;
+
+    if(!count)
+      continue;
+
+    if(count > triples_size) {
+      if(triples)
+        LIBRDF_FREE(u32*, triples);
+      triples_size=count;
+      triples = LIBRDF_MALLOC(u32*, triples_size * 3 * sizeof(u32));
+      if(!triples)
+        goto tidy;
+    }
+
+    if(fread(triples, 3 * sizeof(u32), count, fh) != count)
+      goto tidy;
+
+    for(i=0; i < count * 3; i++) {
+      if(!triples[i] || triples[i] >= context->nodes_count)
+        goto tidy;
+    }
+
+    if(librdf_storage_trees_graph_build(graph, triples, (int)count))
+      goto tidy;
+  }
+
+  status=0;
+
+  tidy:
+  if(status)
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to load trees snapshot %s", context->snapshot);
+
+  if(triples)
+    LIBRDF_FREE(u32*, triples);
+  if(buffer)
+    LIBRDF_FREE(char*, buffer);
+  fclose(fh);
+
+  return status;
 }
 
 
@@ -947,14 +3367,13 @@ librdf_storage_trees_graph_free(void* data)
  * @feature: #librdf_uri feature property
  *
  * Get the value of a storage feature.
- * 
+ *
  * Return value: #librdf_node feature value or NULL if no such feature
  * exists or the value is empty.
  **/
 static librdf_node*
 librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   librdf_storage_trees_instance* scontext=(librdf_storage_trees_instance*)storage->instance;
   unsigned char *uri_string;
 
@@ -964,23 +3383,83 @@ librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
   uri_string=librdf_uri_as_string(feature);
   if(!uri_string)
     return NULL;
-  
+
   if(!strcmp((const char*)uri_string, LIBRDF_MODEL_FEATURE_CONTEXTS)) {
     unsigned char value[2];
 
-    sprintf((char*)value, "%d", (scontext->contexts != NULL));
-    return librdf_new_node_from_typed_literal(storage->world, 
+    sprintf((char*)value, "%d", (scontext->contexts != 0));
+    return librdf_new_node_from_typed_literal(storage->world,
                                               value, NULL, NULL);
   }
-#endif
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_LITERAL_INDEX))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)"1",
+                                              NULL, NULL);
+
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_SHARED_READS) ||
+     !strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_SHARED_WRITES))
+    return librdf_new_node_from_typed_literal(storage->world,
+                                              (const unsigned char*)(scontext->concurrent ? "1" : "0"),
+                                              NULL, NULL);
 
   return NULL;
 }
 
 
+/**
+ * librdf_storage_trees_get_memory_size:
+ * @storage: #librdf_storage object
+ *
+ * Get the approximate bytes held by the storage.
+ *
+ * Counts the node dictionary and the tree pages, visiting the branch
+ * pages but not the leaves.  The text index is not counted.
+ * 
+ * Return value: size in bytes
+ **/
+static size_t
+librdf_storage_trees_get_memory_size(librdf_storage* storage)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  size_t size;
+  u32 i;
+  int j;
+
+  librdf_storage_trees_read_lock(context);
+
+  size=sizeof(*context) + context->nodes_memory;
+  size += (size_t)context->nodes_size * (sizeof(librdf_node*) + sizeof(u32));
+  size += (size_t)context->node_slots_size * sizeof(u32);
+  size += (size_t)context->context_graphs_size * sizeof(librdf_storage_trees_graph*);
+
+  for(i=0; i <= context->context_graphs_size; i++) {
+    librdf_storage_trees_graph* graph;
+
+    graph=(i < context->context_graphs_size) ? context->context_graphs[i] :
+                                               context->graph;
+    if(!graph)
+      continue;
+
+    size += sizeof(*graph);
+    for(j=0; j < LIBRDF_STORAGE_TREES_COUNT; j++) {
+      if(!graph->trees[j])
+        continue;
+      size += sizeof(librdf_storage_trees_btree);
+      if(graph->trees[j]->root)
+        size += librdf_storage_trees_page_memory(graph->trees[j]->root);
+    }
+  }
+
+  librdf_storage_trees_read_unlock(context);
+
+  return size;
+}
+
+
 /** Local entry point for dynamically loaded storage module */
 static void
-librdf_storage_trees_register_factory(librdf_storage_factory *factory) 
+librdf_storage_trees_register_factory(librdf_storage_factory *factory)
 {
   LIBRDF_ASSERT_CONDITION(!strncmp(factory->name, "trees", 5));
 
@@ -1008,20 +3487,19 @@ librdf_storage_trees_register_factory(librdf_storage_factory *factory)
   factory->find_arcs                = NULL;
   factory->find_targets             = NULL;
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  factory->context_add_statement    = librdf_storage_trees_context_add_statement;
-  factory->context_remove_statement = librdf_storage_trees_context_remove_statement;
-  factory->context_serialise        = librdf_storage_trees_context_serialise;
-  factory->get_contexts             = librdf_storage_trees_get_contexts;
-#else
-  factory->context_add_statement    = NULL;
-  factory->context_remove_statement = NULL;
-  factory->context_serialise        = NULL;
-  factory->get_contexts             = NULL;
-#endif
+  factory->context_add_statement      = librdf_storage_trees_context_add_statement;
+  factory->context_remove_statement   = librdf_storage_trees_context_remove_statement;
+  factory->context_remove_statements  = librdf_storage_trees_context_remove_statements;
+  factory->context_serialise          = librdf_storage_trees_context_serialise;
+  factory->find_statements_in_context = librdf_storage_trees_find_statements_in_context;
+  factory->find_statements_with_options = librdf_storage_trees_find_statements_with_options;
+  factory->get_contexts               = librdf_storage_trees_get_contexts;
 
-  factory->sync                     = NULL;
+  factory->sync                     = librdf_storage_trees_sync;
   factory->get_feature              = librdf_storage_trees_get_feature;
+
+  factory->count_statements         = librdf_storage_trees_count_statements;
+  factory->get_memory_size          = librdf_storage_trees_get_memory_size;
 }
 
 
@@ -62,6 +62,7 @@ static int librdf_storage_tstore_open(librdf_storage* storage, librdf_model* mod
 static int librdf_storage_tstore_close(librdf_storage* storage);
 static int librdf_storage_tstore_size(librdf_storage* storage);
 static int librdf_storage_tstore_add_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_tstore_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_tstore_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_tstore_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_tstore_serialise(librdf_storage* storage);
@@ -82,6 +83,7 @@ static void librdf_storage_tstore_find_finished(void* context);
 
 /* context functions */
 static int librdf_storage_tstore_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_tstore_context_add_statements(librdf_storage* storage, librdf_node* context_node, librdf_stream* statement_stream);
 static int librdf_storage_tstore_context_remove_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
 static librdf_stream* librdf_storage_tstore_context_serialise(librdf_storage* storage, librdf_node* context_node);
 
@@ -204,6 +206,15 @@ librdf_storage_tstore_add_statement(librdf_storage* storage, librdf_statement* s
 
 
 
+static int
+librdf_storage_tstore_add_statements(librdf_storage* storage,
+                                     librdf_stream* statement_stream)
+{
+  return librdf_storage_tstore_context_add_statements(storage, NULL,
+                                                      statement_stream);
+}
+
+
 static int
 librdf_storage_tstore_remove_statement(librdf_storage* storage, librdf_statement* statement)
 {
@@ -597,29 +608,55 @@ librdf_storage_tstore_find_finished(void* context)
  * 
  * Return value: non 0 on failure
  **/
+/* Node strings of the last statement asserted, reused by the next
+ * statement when the subject or predicate is the same */
+typedef struct {
+  librdf_node *subject_node;
+  char *subject;
+  librdf_node *predicate_node;
+  char *predicate;
+} librdf_storage_tstore_assert_cache;
+
+
+/*
+ * librdf_storage_tstore_assert_statement - INTERNAL - Convert a statement to 3store strings and assert it
+ * @storage: #librdf_storage object
+ * @statement: #librdf_statement statement to add
+ * @cache: strings of the previous statement
+ *
+ * The strings are shared with the statement nodes; @cache holds the
+ * nodes and so must not outlive them.
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_storage_tstore_context_add_statement(librdf_storage* storage,
-                                            librdf_node* context_node,
-                                            librdf_statement* statement) 
+librdf_storage_tstore_assert_statement(librdf_storage* storage,
+                                       librdf_statement* statement,
+                                       librdf_storage_tstore_assert_cache* cache)
 {
   librdf_storage_tstore_instance* context;
   librdf_node *subject_node=statement->subject;
   librdf_node *predicate_node=statement->predicate;
   librdf_node *object_node=statement->object;
-  char *subject;
-  char *predicate;
   char *object;
   rs_obj_type type;
 
   context = (librdf_storage_tstore_instance*)storage->instance;
 
-  if(librdf_node_is_blank(subject_node)) {
-    subject=(char*)librdf_node_get_blank_identifier(subject_node);
-  } else
-    subject=(char*)librdf_uri_as_string(librdf_node_get_uri(subject_node));
-  
+  if(!cache->subject_node ||
+     !librdf_node_equals(cache->subject_node, subject_node)) {
+    if(librdf_node_is_blank(subject_node)) {
+      cache->subject=(char*)librdf_node_get_blank_identifier(subject_node);
+    } else
+      cache->subject=(char*)librdf_uri_as_string(librdf_node_get_uri(subject_node));
+    cache->subject_node=subject_node;
+  }
 
-  predicate=(char*)librdf_uri_as_string(librdf_node_get_uri(predicate_node));
+  if(!cache->predicate_node ||
+     !librdf_node_equals(cache->predicate_node, predicate_node)) {
+    cache->predicate=(char*)librdf_uri_as_string(librdf_node_get_uri(predicate_node));
+    cache->predicate_node=predicate_node;
+  }
   
   /* Assumptions - FIXME */
   if(librdf_node_is_literal(object_node)) {
@@ -634,13 +671,91 @@ librdf_storage_tstore_context_add_statement(librdf_storage* storage,
   }
   
 
-  if(rs_assert_triple(context->rdfsql, subject, predicate, object, type))
+  if(rs_assert_triple(context->rdfsql, cache->subject, cache->predicate,
+                      object, type))
     return 1;
 
   return 0;
 }
 
 
+static int
+librdf_storage_tstore_context_add_statement(librdf_storage* storage,
+                                            librdf_node* context_node,
+                                            librdf_statement* statement) 
+{
+  librdf_storage_tstore_assert_cache cache; /* on stack */
+
+  memset(&cache, 0, sizeof(cache));
+
+  return librdf_storage_tstore_assert_statement(storage, statement, &cache);
+}
+
+
+/**
+ * librdf_storage_tstore_context_add_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement_stream: #librdf_stream of statements to add
+ *
+ * Add a stream of statements to a storage context.
+ *
+ * The subject and predicate strings are converted once for a run of
+ * statements sharing them, as from a parser.  The stream statement
+ * is copied only when its subject or predicate is new, so the cached
+ * strings stay valid while the stream moves on.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_tstore_context_add_statements(librdf_storage* storage,
+                                             librdf_node* context_node,
+                                             librdf_stream* statement_stream) 
+{
+  librdf_storage_tstore_assert_cache cache; /* on stack */
+  librdf_statement* held=NULL;
+  int status=0;
+
+  memset(&cache, 0, sizeof(cache));
+
+  for(; !librdf_stream_end(statement_stream);
+      librdf_stream_next(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(!statement) {
+      status=1;
+      break;
+    }
+
+    if(!held ||
+       !librdf_node_equals(held->subject, statement->subject) ||
+       !librdf_node_equals(held->predicate, statement->predicate)) {
+      /* new subject or predicate: convert them from a copy that
+       * keeps the nodes behind the cached strings alive */
+      if(held)
+        librdf_free_statement(held);
+      memset(&cache, 0, sizeof(cache));
+      held=librdf_new_statement_from_statement(statement);
+      if(!held) {
+        status=1;
+        break;
+      }
+      statement=held;
+    }
+
+    if(librdf_storage_tstore_assert_statement(storage, statement, &cache)) {
+      status=1;
+      break;
+    }
+  }
+
+  if(held)
+    librdf_free_statement(held);
+
+  return status;
+}
+
+
 /**
  * librdf_storage_tstore_context_remove_statement:
  * @storage: #librdf_storage object
@@ -742,11 +857,13 @@ librdf_storage_register_factory(librdf_storage_factory *factory)
   factory->close              = librdf_storage_tstore_close;
   factory->size               = librdf_storage_tstore_size;
   factory->add_statement      = librdf_storage_tstore_add_statement;
+  factory->add_statements     = librdf_storage_tstore_add_statements;
   factory->remove_statement   = librdf_storage_tstore_remove_statement;
   factory->contains_statement = librdf_storage_tstore_contains_statement;
   factory->serialise          = librdf_storage_tstore_serialise;
   factory->find_statements    = librdf_storage_tstore_find_statements;
   factory->context_add_statement    = librdf_storage_tstore_context_add_statement;
+  factory->context_add_statements   = librdf_storage_tstore_context_add_statements;
   factory->context_remove_statement = librdf_storage_tstore_context_remove_statement;
   factory->context_serialise        = librdf_storage_tstore_context_serialise;
 }
@@ -104,6 +104,12 @@ static void* librdf_storage_virtuoso_transaction_get_handle(librdf_storage* stor
 static int rdf_virtuoso_ODBC_Errors(const char *where, librdf_world *world, librdf_storage_virtuoso_connection *handle);
 static int librdf_storage_virtuoso_context_add_statement_helper(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
 static void librdf_storage_virtuoso_release_handle(librdf_storage* storage, librdf_storage_virtuoso_connection *handle);
+static int librdf_storage_virtuoso_batch_flush(librdf_storage* storage);
+static int BindCtxt(librdf_storage* storage, librdf_storage_virtuoso_connection *handle, SQLUSMALLINT col, char *data, SQLLEN *ind);
+
+
+static const char* const librdf_storage_virtuoso_insert_sql = "sparql define output:format '_JAVA_' insert into graph iri(\?\?) { `iri(\?\?)` `iri(\?\?)` `bif:__rdf_long_from_batch_params(\?\?,\?\?,\?\?)` }";
+static const char* const librdf_storage_virtuoso_delete_sql = "sparql define output:format '_JAVA_' delete from graph iri(\?\?) {`iri(\?\?)` `iri(\?\?)` `bif:__rdf_long_from_batch_params(\?\?,\?\?,\?\?)`}";
 
 #ifdef MODULAR_LIBRDF
 void librdf_storage_module_register_factory(librdf_world *world);
@@ -612,6 +618,200 @@ rdf2node(librdf_storage *storage, librdf_storage_virtuoso_connection *handle,
 }
 
 
+/*
+ * vBlockUnbind:
+ * @handle: virtoso storage connection handle
+ *
+ * INTERNAL - Stop using a block cursor on the statement and free its buffers
+ */
+static void
+vBlockUnbind(librdf_storage_virtuoso_connection *handle)
+{
+  if(!handle->block_cols)
+    return;
+
+  SQLFreeStmt(handle->hstmt, SQL_UNBIND);
+  SQLSetStmtAttr(handle->hstmt, SQL_ATTR_ROW_ARRAY_SIZE, (SQLPOINTER)1, 0);
+  SQLSetStmtAttr(handle->hstmt, SQL_ATTR_ROWS_FETCHED_PTR, NULL, 0);
+
+  if(handle->block_data)
+    LIBRDF_FREE(char*, handle->block_data);
+  if(handle->block_ind)
+    LIBRDF_FREE(SQLLEN*, handle->block_ind);
+
+  handle->block_data = NULL;
+  handle->block_ind = NULL;
+  handle->block_cols = 0;
+  handle->block_rows = 0;
+  handle->block_row = 0;
+}
+
+
+/*
+ * vBlockBind:
+ * @world: redland world
+ * @handle: virtoso storage connection handle
+ * @numCols: number of result columns
+ *
+ * INTERNAL - Bind the result columns of the executed statement for block fetches
+ *
+ * vFetch() then reads LIBRDF_VIRTUOSO_BLOCK_SIZE rows per SQLFetch()
+ * into column buffers that are reused for the whole result, and
+ * vGetNode() builds nodes straight from them.  Values longer than
+ * LIBRDF_VIRTUOSO_BLOCK_WIDTH are read with SQLGetData(), so this is
+ * only done when the driver allows that on bound block cursors;
+ * otherwise rows are fetched one at a time as before.
+ */
+static void
+vBlockBind(librdf_world *world, librdf_storage_virtuoso_connection *handle,
+           short numCols)
+{
+  size_t cells;
+  SQLUSMALLINT col;
+  int rc;
+
+  vBlockUnbind(handle);
+
+  if(numCols <= 0)
+    return;
+
+  if(!handle->getdata_block) {
+    SQLUINTEGER ext = 0;
+
+    rc = SQLGetInfo(handle->hdbc, SQL_GETDATA_EXTENSIONS, &ext, sizeof(ext),
+                    NULL);
+    handle->getdata_block = (SQL_SUCCEEDED(rc) && (ext & SQL_GD_BLOCK) &&
+                             (ext & SQL_GD_BOUND)) ? 1 : -1;
+  }
+  if(handle->getdata_block < 0)
+    return;
+
+  cells = LIBRDF_GOOD_CAST(size_t, numCols) * LIBRDF_VIRTUOSO_BLOCK_SIZE;
+  handle->block_data = LIBRDF_MALLOC(char*, cells * LIBRDF_VIRTUOSO_BLOCK_WIDTH);
+  handle->block_ind = LIBRDF_CALLOC(SQLLEN*, cells, sizeof(SQLLEN));
+  handle->block_cols = numCols;
+  if(!handle->block_data || !handle->block_ind)
+    goto fail;
+
+  rc = SQLSetStmtAttr(handle->hstmt, SQL_ATTR_ROW_BIND_TYPE,
+                      (SQLPOINTER)SQL_BIND_BY_COLUMN, 0);
+  if(SQL_SUCCEEDED(rc))
+    rc = SQLSetStmtAttr(handle->hstmt, SQL_ATTR_ROW_ARRAY_SIZE,
+                        (SQLPOINTER)LIBRDF_VIRTUOSO_BLOCK_SIZE, 0);
+  if(SQL_SUCCEEDED(rc))
+    rc = SQLSetStmtAttr(handle->hstmt, SQL_ATTR_ROWS_FETCHED_PTR,
+                        &handle->block_rows, 0);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors("SQLSetStmtAttr()", world, handle);
+    goto fail;
+  }
+
+  for(col = 1; col <= (SQLUSMALLINT)numCols; col++) {
+    size_t offset = (size_t)(col - 1) * LIBRDF_VIRTUOSO_BLOCK_SIZE;
+
+    rc = SQLBindCol(handle->hstmt, col, SQL_C_CHAR,
+                    handle->block_data + offset * LIBRDF_VIRTUOSO_BLOCK_WIDTH,
+                    LIBRDF_VIRTUOSO_BLOCK_WIDTH, handle->block_ind + offset);
+    if(!SQL_SUCCEEDED(rc)) {
+      rdf_virtuoso_ODBC_Errors("SQLBindCol()", world, handle);
+      goto fail;
+    }
+  }
+
+  return;
+
+fail:
+  vBlockUnbind(handle);
+}
+
+
+/*
+ * vFetch:
+ * @world: redland world
+ * @handle: virtoso storage connection handle
+ *
+ * INTERNAL - Move to the next result row
+ *
+ * With a block cursor a new block is only fetched once the rows of
+ * the current one are used up.  The row is made current with
+ * SQLSetPos() so SQLGetData() and the column descriptor fields read
+ * by rdf2node() refer to it.
+ *
+ * Return value: ODBC return code, SQL_NO_DATA_FOUND at the end
+ */
+static SQLRETURN
+vFetch(librdf_world *world, librdf_storage_virtuoso_connection *handle)
+{
+  SQLRETURN rc;
+
+  if(!handle->block_cols)
+    return SQLFetch(handle->hstmt);
+
+  if(handle->block_row < handle->block_rows) {
+    handle->block_row++;
+  } else {
+    handle->block_rows = 0;
+    rc = SQLFetch(handle->hstmt);
+    if(!SQL_SUCCEEDED(rc))
+      return rc;
+    if(!handle->block_rows)
+      return SQL_NO_DATA_FOUND;
+    handle->block_row = 1;
+  }
+
+  return SQLSetPos(handle->hstmt, (SQLSETPOSIROW)handle->block_row,
+                   SQL_POSITION, SQL_LOCK_NO_CHANGE);
+}
+
+
+/*
+ * vGetNode:
+ * @storage: storage object
+ * @handle: virtoso storage connection handle
+ * @col: column number
+ * @is_null: pointer to NULL flag to set
+ *
+ * INTERNAL - Get the given column in the current result row as a node
+ *
+ * Return value: new node or NULL on failure or SQL NULL value. SQL
+ * NULLness is distinguished from error by the *is_null being non-0.
+ */
+static librdf_node*
+vGetNode(librdf_storage *storage, librdf_storage_virtuoso_connection *handle,
+         int col, int *is_null)
+{
+  librdf_node *node;
+  char *data;
+
+  *is_null = 0;
+
+  if(handle->block_cols && col <= handle->block_cols) {
+    size_t cell = (size_t)(col - 1) * LIBRDF_VIRTUOSO_BLOCK_SIZE +
+                  (size_t)(handle->block_row - 1);
+    SQLLEN len = handle->block_ind[cell];
+
+    if(len == SQL_NULL_DATA) {
+      *is_null = 1;
+      return NULL;
+    }
+
+    /* Complete value in the bound buffer */
+    if(len >= 0 && len < LIBRDF_VIRTUOSO_BLOCK_WIDTH)
+      return rdf2node(storage, handle, col,
+                      handle->block_data + cell * LIBRDF_VIRTUOSO_BLOCK_WIDTH);
+  }
+
+  data = vGetDataCHAR(storage->world, handle, col, is_null);
+  if(!data)
+    return NULL;
+
+  node = rdf2node(storage, handle, col, data);
+  LIBRDF_FREE(char*, data);
+
+  return node;
+}
+
+
 static char*
 librdf_storage_virtuoso_node2string(librdf_storage *storage, librdf_node *node)
 {
@@ -799,11 +999,18 @@ librdf_storage_virtuoso_finish_connections(librdf_storage* storage)
                     context->connections[i]->handle);
 #endif
       handle=context->connections[i];
+      vBlockUnbind(handle);
       if(handle->hstmt) {
 	SQLCloseCursor(handle->hstmt);
 	SQLFreeHandle(SQL_HANDLE_STMT, handle->hstmt);
       }
 
+      if(handle->hstmt_insert)
+	SQLFreeHandle(SQL_HANDLE_STMT, handle->hstmt_insert);
+
+      if(handle->hstmt_delete)
+	SQLFreeHandle(SQL_HANDLE_STMT, handle->hstmt_delete);
+
       if(handle->hdbc) {
 	SQLDisconnect(handle->hdbc);
 	SQLFreeHandle(SQL_HANDLE_DBC, handle->hdbc);
@@ -825,7 +1032,7 @@ librdf_storage_virtuoso_finish_connections(librdf_storage* storage)
 
 
 /*
- * librdf_storage_virtuoso_get_handle:
+ * librdf_storage_virtuoso_pool_handle:
  * @storage: the storage
  *
  * INTERNAL - get a connection handle to the Virtuoso server
@@ -836,7 +1043,7 @@ librdf_storage_virtuoso_finish_connections(librdf_storage* storage)
  * Return value: Non-zero on succes.
  **/
 static librdf_storage_virtuoso_connection *
-librdf_storage_virtuoso_get_handle(librdf_storage* storage)
+librdf_storage_virtuoso_pool_handle(librdf_storage* storage)
 {
   librdf_storage_virtuoso_instance* context;
   librdf_storage_virtuoso_connection* connection= NULL;
@@ -911,11 +1118,15 @@ librdf_storage_virtuoso_get_handle(librdf_storage* storage)
     connection->henv = NULL;
     connection->hdbc = NULL;
     connection->hstmt = NULL;
+    connection->hstmt_insert = NULL;
+    connection->hstmt_delete = NULL;
 
     connections[context->connections_count - 1]->status = VIRTUOSO_CONNECTION_CLOSED;
     connections[context->connections_count - 1]->henv = NULL;
     connections[context->connections_count - 1]->hdbc = NULL;
     connections[context->connections_count - 1]->hstmt = NULL;
+    connections[context->connections_count - 1]->hstmt_insert = NULL;
+    connections[context->connections_count - 1]->hstmt_delete = NULL;
     context->connections = connections;
   }
 
@@ -961,6 +1172,10 @@ librdf_storage_virtuoso_get_handle(librdf_storage* storage)
   connection->v_rdf2node = rdf2node;
   connection->v_GetDataCHAR = vGetDataCHAR;
   connection->v_GetDataINT = vGetDataINT;
+  connection->v_BlockBind = vBlockBind;
+  connection->v_BlockUnbind = vBlockUnbind;
+  connection->v_Fetch = vFetch;
+  connection->v_GetNode = vGetNode;
   connection->status = VIRTUOSO_CONNECTION_BUSY;
   return connection;
 
@@ -987,6 +1202,78 @@ end:
 }
 
 
+/*
+ * librdf_storage_virtuoso_get_handle:
+ * @storage: the storage
+ *
+ * INTERNAL - get a connection handle to the Virtuoso server
+ *
+ * Any statements queued for a parameter array insert are sent first
+ * so that the caller sees them.
+ *
+ * Return value: Non-zero on succes.
+ **/
+static librdf_storage_virtuoso_connection *
+librdf_storage_virtuoso_get_handle(librdf_storage* storage)
+{
+  librdf_storage_virtuoso_instance* context;
+
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
+  if(context->batch_count)
+    librdf_storage_virtuoso_batch_flush(storage);
+
+  return librdf_storage_virtuoso_pool_handle(storage);
+}
+
+
+/*
+ * librdf_storage_virtuoso_prepare:
+ * @storage: the storage
+ * @handle: the Virtuoso connection handle
+ * @hstmt: pointer to the statement handle to prepare
+ * @sql: statement text
+ *
+ * INTERNAL - Prepare a statement once on a connection and keep it
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_virtuoso_prepare(librdf_storage* storage,
+                                librdf_storage_virtuoso_connection *handle,
+                                HSTMT *hstmt, const char *sql)
+{
+  HSTMT old_hstmt;
+  int rc;
+
+  if(*hstmt)
+    return 0;
+
+  rc = SQLAllocHandle(SQL_HANDLE_STMT, handle->hdbc, hstmt);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors("SQLAllocHandle(hstmt)", storage->world, handle);
+    *hstmt = NULL;
+    return 1;
+  }
+
+#ifdef LIBRDF_DEBUG_SQL
+  LIBRDF_DEBUG2("SQL: >>%s<<\n", sql);
+#endif
+  rc = SQLPrepare(*hstmt, (SQLCHAR *)sql, SQL_NTS);
+  if(!SQL_SUCCEEDED(rc)) {
+    old_hstmt = handle->hstmt;
+    handle->hstmt = *hstmt;
+    rdf_virtuoso_ODBC_Errors("SQLPrepare()", storage->world, handle);
+    handle->hstmt = old_hstmt;
+    SQLFreeHandle(SQL_HANDLE_STMT, *hstmt);
+    *hstmt = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
+
 /*
  * librdf_storage_virtuoso_release_handle;
  * @storage: the storage
@@ -1034,9 +1321,10 @@ librdf_storage_virtuoso_release_handle(librdf_storage* storage,
  *
  * INTERNAL - Create connection to database.
  *
- * The boolean bulk option can be set to true if optimized inserts(table
- * locks and temporary key disabling) is wanted. Note that this will block
- * all other access, and requires table locking and alter table privileges.
+ * The boolean bulk option can be set to true to queue every added
+ * statement and send them to the server in ODBC parameter arrays of up
+ * to LIBRDF_VIRTUOSO_BATCH_SIZE rows.  The queue is sent before any
+ * read, on sync and at the end of a transaction.
  *
  * Return value: Non-zero on failure.
  **/
@@ -1116,6 +1404,9 @@ librdf_storage_virtuoso_init(librdf_storage* storage, const char *name,
   /* Optimize loads? */
   context->bulk = (librdf_hash_get_as_boolean(options, "bulk") > 0);
 
+  /* Model size is not known until counted */
+  context->cached_size = -1;
+
   /* Truncate model? */
 #if 0
 /* ?? FIXME */
@@ -1186,8 +1477,16 @@ librdf_storage_virtuoso_terminate(librdf_storage* storage)
 #ifdef VIRTUOSO_STORAGE_DEBUG
   fprintf(stderr, "librdf_storage_virtuoso_terminate \n");
 #endif
+  librdf_storage_virtuoso_batch_flush(storage);
+
   librdf_storage_virtuoso_finish_connections(storage);
 
+  if(context->batch_values)
+    LIBRDF_FREE(char**, context->batch_values);
+
+  if(context->batch_types)
+    LIBRDF_FREE(SQLINTEGER*, context->batch_types);
+
   if(context->password)
     LIBRDF_FREE(char*, (char*)context->password);
 
@@ -1289,11 +1588,9 @@ librdf_storage_virtuoso_sync(librdf_storage* storage)
   fprintf(stderr, "librdf_storage_virtuoso_sync \n");
 #endif
 
-  /* Make sure optimizing for bulk operations is stopped? */
-  if(context->bulk)
-    librdf_storage_virtuoso_stop_bulk(storage);
-
-  return 0;
+  /* Send any statements queued by bulk loads */
+  context->batching = 0;
+  return librdf_storage_virtuoso_batch_flush(storage);
 }
 
 
@@ -1311,11 +1608,11 @@ static int
 librdf_storage_virtuoso_size(librdf_storage* storage)
 {
   librdf_storage_virtuoso_instance *context;
-  char model_size[]="select count(*) from(sparql define input:storage \"\" select * from named <%s> where { graph ?g {?s ?p ?o}})f";
-  char *query;
+  const char *model_size="sparql define input:storage \"\" select count(*) where { graph `iri(\?\?)` { ?s ?p ?o } }";
   int count = -1;
   int rc;
   librdf_storage_virtuoso_connection *handle;
+  SQLLEN ind = SQL_NTS;
 
   context = (librdf_storage_virtuoso_instance*)storage->instance;
 
@@ -1323,26 +1620,29 @@ librdf_storage_virtuoso_size(librdf_storage* storage)
   fprintf(stderr, "librdf_storage_virtuoso_size \n");
 #endif
 
+  /* Queued statements count towards the size */
+  if(context->batch_count)
+    librdf_storage_virtuoso_batch_flush(storage);
+
+  if(context->cached_size >= 0)
+    return context->cached_size;
+
   /* Get Virtuoso connection handle */
   handle = librdf_storage_virtuoso_get_handle(storage);
   if(!handle)
     return -1;
 
-  /* Query for number of statements */
-  query = LIBRDF_MALLOC(char*, 
-                        strlen(model_size) + strlen(context->model_name) + 2);
-  if(!query) {
+  /* Count statements in the model graph on the server */
+  if(BindCtxt(storage, handle, 1, context->model_name, &ind)) {
     librdf_storage_virtuoso_release_handle(storage, handle);
     return -1;
   }
 
-  sprintf(query, model_size, context->model_name);
-
 #ifdef LIBRDF_DEBUG_SQL
-  LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
+  LIBRDF_DEBUG2("SQL: >>%s<<\n", model_size);
 #endif
 
-  rc = SQLExecDirect(handle->hstmt,(UCHAR *) query, SQL_NTS);
+  rc = SQLExecDirect(handle->hstmt,(UCHAR *) model_size, SQL_NTS);
   if(!SQL_SUCCEEDED(rc)) {
     rdf_virtuoso_ODBC_Errors("SQLExecDirect()", storage->world, handle);
     count = -1;
@@ -1357,8 +1657,11 @@ librdf_storage_virtuoso_size(librdf_storage* storage)
   }
   SQLCloseCursor(handle->hstmt);
 
+  /* Keep until the next write through this storage */
+  context->cached_size = count;
+
 end:
-  LIBRDF_FREE(char*, query);
+  SQLFreeStmt(handle->hstmt, SQL_RESET_PARAMS);
   librdf_storage_virtuoso_release_handle(storage, handle);
 
   return count;
@@ -1414,21 +1717,12 @@ static int
 librdf_storage_virtuoso_add_statements(librdf_storage* storage,
                                        librdf_stream* statement_stream)
 {
-  int helper = 0;
-
 #ifdef VIRTUOSO_STORAGE_DEBUG
   fprintf(stderr, "librdf_storage_virtuoso_add_statements \n");
 #endif
 
-  while(!helper && !librdf_stream_end(statement_stream)) {
-    librdf_statement* statement = librdf_stream_get_object(statement_stream);
-    helper = librdf_storage_virtuoso_context_add_statement_helper(storage,
-                                                                  NULL,
-                                                                  statement);
-    librdf_stream_next(statement_stream);
-  }
-
-  return helper;
+  return librdf_storage_virtuoso_context_add_statements(storage, NULL,
+                                                        statement_stream);
 }
 
 
@@ -1457,11 +1751,9 @@ librdf_storage_virtuoso_context_add_statements(librdf_storage* storage,
   fprintf(stderr, "librdf_storage_virtuoso_context_add_statements \n");
 #endif
 
-  /* Optimize for bulk loads? */
-  if(context->bulk) {
-    if(librdf_storage_virtuoso_start_bulk(storage))
-      return 1;
-  }
+  /* Queue the statements and send them in parameter arrays */
+  if(librdf_storage_virtuoso_start_bulk(storage))
+    return 1;
 
   while(!helper && !librdf_stream_end(statement_stream)) {
     librdf_statement* statement = librdf_stream_get_object(statement_stream);
@@ -1472,11 +1764,11 @@ librdf_storage_virtuoso_context_add_statements(librdf_storage* storage,
     librdf_stream_next(statement_stream);
   }
 
-  /* Optimize for bulk loads? */
-  if(context->bulk) {
-    if(librdf_storage_virtuoso_stop_bulk(storage))
-      return 1;
-  }
+  /* The bulk option keeps queueing until the next read or sync */
+  if(context->bulk)
+    context->batching = 0;
+  else if(librdf_storage_virtuoso_stop_bulk(storage))
+    return 1;
 
   return helper;
 }
@@ -1688,6 +1980,338 @@ error:
 }
 
 
+/*
+ * librdf_storage_virtuoso_batch_string:
+ * @prefix: string prefix or NULL
+ * @value: string value
+ *
+ * INTERNAL - Copy a string, with an optional prefix, for the batch queue
+ *
+ * Return value: new string or NULL on failure
+ **/
+static char*
+librdf_storage_virtuoso_batch_string(const char *prefix, const char *value)
+{
+  size_t prefix_len = prefix ? strlen(prefix) : 0;
+  size_t value_len = strlen(value);
+  char *str;
+
+  str = LIBRDF_MALLOC(char*, prefix_len + value_len + 1);
+  if(!str)
+    return NULL;
+
+  if(prefix_len)
+    memcpy(str, prefix, prefix_len);
+  memcpy(str + prefix_len, value, value_len + 1);
+
+  return str;
+}
+
+
+/*
+ * librdf_storage_virtuoso_node2params:
+ * @node: the node
+ * @value: pointer to set to the value string
+ * @extra: pointer to set to the language or datatype string, or NULL if the node must not be a literal
+ * @type: pointer to set to the object type or NULL
+ *
+ * INTERNAL - Get the parameter values for a node as BindSP() and BindObject() would bind them
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_virtuoso_node2params(librdf_node *node, char **value,
+                                    char **extra, SQLINTEGER *type)
+{
+  librdf_node_type node_type = librdf_node_get_type(node);
+
+  *value = NULL;
+  if(extra)
+    *extra = NULL;
+
+  if(node_type == LIBRDF_NODE_TYPE_RESOURCE) {
+    *value = librdf_storage_virtuoso_batch_string(NULL,
+               (const char*)librdf_uri_as_string(librdf_node_get_uri(node)));
+    if(type)
+      *type = 1;
+  } else if(node_type == LIBRDF_NODE_TYPE_BLANK) {
+    *value = librdf_storage_virtuoso_batch_string("_:",
+               (const char*)librdf_node_get_blank_identifier(node));
+    if(type)
+      *type = 1;
+  } else if(node_type == LIBRDF_NODE_TYPE_LITERAL && extra) {
+    char *lang = librdf_node_get_literal_value_language(node);
+    librdf_uri *dt = librdf_node_get_literal_value_datatype_uri(node);
+
+    *value = librdf_storage_virtuoso_batch_string(NULL,
+               (const char*)librdf_node_get_literal_value(node));
+    if(!*value)
+      return 1;
+
+    if(lang) {
+      *extra = librdf_storage_virtuoso_batch_string(NULL, lang);
+      *type = 5;
+    } else if(dt) {
+      *extra = librdf_storage_virtuoso_batch_string(NULL,
+                 (const char*)librdf_uri_as_string(dt));
+      *type = 4;
+    } else
+      *type = 3;
+
+    if((lang || dt) && !*extra) {
+      LIBRDF_FREE(char*, *value);
+      *value = NULL;
+      return 1;
+    }
+  } else
+    return 1;
+
+  return (*value == NULL);
+}
+
+
+/*
+ * librdf_storage_virtuoso_batch_clear:
+ * @storage: the storage
+ *
+ * INTERNAL - Drop all statements queued for a parameter array insert
+ *
+ * Return value: None.
+ **/
+static void
+librdf_storage_virtuoso_batch_clear(librdf_storage* storage)
+{
+  librdf_storage_virtuoso_instance* context;
+  int i;
+
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
+  for(i = 0; i < context->batch_count * LIBRDF_VIRTUOSO_BATCH_COLUMNS; i++) {
+    if(context->batch_values[i]) {
+      LIBRDF_FREE(char*, context->batch_values[i]);
+      context->batch_values[i] = NULL;
+    }
+  }
+  context->batch_count = 0;
+}
+
+
+/*
+ * librdf_storage_virtuoso_batch_flush:
+ * @storage: the storage
+ *
+ * INTERNAL - Send all queued statements with one parameter array insert
+ *
+ * The queued rows are copied into column-wise parameter buffers and
+ * executed once through the prepared insert statement with
+ * SQL_ATTR_PARAMSET_SIZE set to the number of rows.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_virtuoso_batch_flush(librdf_storage* storage)
+{
+  /* parameter number of each batch column; parameter 4 is the object type */
+  static const SQLUSMALLINT params[LIBRDF_VIRTUOSO_BATCH_COLUMNS] = {
+    1, 2, 3, 5, 6
+  };
+  librdf_storage_virtuoso_instance* context;
+  librdf_storage_virtuoso_connection *handle;
+  HSTMT hstmt = NULL;
+  char *buffers[LIBRDF_VIRTUOSO_BATCH_COLUMNS];
+  SQLLEN *inds[LIBRDF_VIRTUOSO_BATCH_COLUMNS];
+  int count;
+  int col;
+  int i;
+  int rc;
+  int ret = 0;
+
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
+  count = context->batch_count;
+  if(!count)
+    return 0;
+
+  memset(buffers, 0, sizeof(buffers));
+  memset(inds, 0, sizeof(inds));
+
+  handle = librdf_storage_virtuoso_pool_handle(storage);
+  if(!handle) {
+    librdf_storage_virtuoso_batch_clear(storage);
+    return 1;
+  }
+
+  if(librdf_storage_virtuoso_prepare(storage, handle, &handle->hstmt_insert,
+                                     librdf_storage_virtuoso_insert_sql)) {
+    ret = 1;
+    goto end;
+  }
+
+  /* Run on the prepared statement so errors are reported against it */
+  hstmt = handle->hstmt;
+  handle->hstmt = handle->hstmt_insert;
+
+  rc = SQLSetStmtAttr(handle->hstmt, SQL_ATTR_PARAM_BIND_TYPE,
+                      (SQLPOINTER)SQL_PARAM_BIND_BY_COLUMN, 0);
+  if(SQL_SUCCEEDED(rc))
+    rc = SQLSetStmtAttr(handle->hstmt, SQL_ATTR_PARAMSET_SIZE,
+                        (SQLPOINTER)(SQLULEN)count, 0);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors("SQLSetStmtAttr()", storage->world, handle);
+    ret = 1;
+    goto end;
+  }
+
+  for(col = 0; col < LIBRDF_VIRTUOSO_BATCH_COLUMNS; col++) {
+    size_t width = 1;
+
+    for(i = 0; i < count; i++) {
+      char *value = context->batch_values[i * LIBRDF_VIRTUOSO_BATCH_COLUMNS + col];
+      if(value && strlen(value) >= width)
+        width = strlen(value) + 1;
+    }
+
+    buffers[col] = LIBRDF_CALLOC(char*, LIBRDF_GOOD_CAST(size_t, count), width);
+    inds[col] = LIBRDF_CALLOC(SQLLEN*, LIBRDF_GOOD_CAST(size_t, count),
+                              sizeof(SQLLEN));
+    if(!buffers[col] || !inds[col]) {
+      ret = 1;
+      goto end;
+    }
+
+    for(i = 0; i < count; i++) {
+      char *value = context->batch_values[i * LIBRDF_VIRTUOSO_BATCH_COLUMNS + col];
+      if(value) {
+        strcpy(buffers[col] + (size_t)i * width, value);
+        inds[col][i] = SQL_NTS;
+      } else
+        inds[col][i] = SQL_NULL_DATA;
+    }
+
+    rc = SQLBindParameter(handle->hstmt, params[col], SQL_PARAM_INPUT,
+                          SQL_C_CHAR, SQL_VARCHAR,
+                          LIBRDF_BAD_CAST(SQLULEN, width - 1), 0,
+                          buffers[col], LIBRDF_BAD_CAST(SQLLEN, width),
+                          inds[col]);
+    if(!SQL_SUCCEEDED(rc)) {
+      rdf_virtuoso_ODBC_Errors("SQLBindParameter()", storage->world, handle);
+      ret = 1;
+      goto end;
+    }
+  }
+
+  rc = SQLBindParameter(handle->hstmt, 4, SQL_PARAM_INPUT, SQL_C_SLONG,
+                        SQL_INTEGER, 0, 0, context->batch_types, 0, NULL);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors("SQLBindParameter()", storage->world, handle);
+    ret = 1;
+    goto end;
+  }
+
+  rc = SQLExecute(handle->hstmt);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors("SQLExecute()", storage->world, handle);
+    ret = -1;
+  }
+
+end:
+  if(hstmt) {
+    SQLFreeStmt(handle->hstmt, SQL_RESET_PARAMS);
+    SQLSetStmtAttr(handle->hstmt, SQL_ATTR_PARAMSET_SIZE, (SQLPOINTER)1, 0);
+    handle->hstmt = hstmt;
+  }
+  for(col = 0; col < LIBRDF_VIRTUOSO_BATCH_COLUMNS; col++) {
+    if(buffers[col])
+      LIBRDF_FREE(char*, buffers[col]);
+    if(inds[col])
+      LIBRDF_FREE(SQLLEN*, inds[col]);
+  }
+  librdf_storage_virtuoso_batch_clear(storage);
+  librdf_storage_virtuoso_release_handle(storage, handle);
+  context->cached_size = -1;
+
+  return ret;
+}
+
+
+/*
+ * librdf_storage_virtuoso_batch_add:
+ * @storage: the storage
+ * @context_node: context node or NULL
+ * @statement: statement to queue
+ *
+ * INTERNAL - Queue a statement for a parameter array insert
+ *
+ * The queue is sent when it holds LIBRDF_VIRTUOSO_BATCH_SIZE
+ * statements, at the end of a bulk load and before any other use of
+ * a connection.
+ *
+ * Return value: non-0 on failure
+ **/
+static int
+librdf_storage_virtuoso_batch_add(librdf_storage* storage,
+                                  librdf_node* context_node,
+                                  librdf_statement* statement)
+{
+  librdf_storage_virtuoso_instance* context;
+  librdf_node* nsubject;
+  librdf_node* npredicate;
+  librdf_node* nobject;
+  char *ctxt_node;
+  char **row;
+  int i;
+
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
+  if(!context->batch_values) {
+    context->batch_values = LIBRDF_CALLOC(char**,
+                                          LIBRDF_VIRTUOSO_BATCH_SIZE *
+                                          LIBRDF_VIRTUOSO_BATCH_COLUMNS,
+                                          sizeof(char*));
+    if(!context->batch_values)
+      return 1;
+  }
+  if(!context->batch_types) {
+    context->batch_types = LIBRDF_CALLOC(SQLINTEGER*,
+                                         LIBRDF_VIRTUOSO_BATCH_SIZE,
+                                         sizeof(SQLINTEGER));
+    if(!context->batch_types)
+      return 1;
+  }
+
+  ctxt_node = librdf_storage_virtuoso_icontext2string(storage, context_node);
+  nsubject = librdf_statement_get_subject(statement);
+  npredicate = librdf_statement_get_predicate(statement);
+  nobject = librdf_statement_get_object(statement);
+
+  if(!nsubject || !npredicate || !nobject || !ctxt_node)
+    return 1;
+
+  row = context->batch_values +
+        context->batch_count * LIBRDF_VIRTUOSO_BATCH_COLUMNS;
+
+  row[0] = librdf_storage_virtuoso_batch_string(NULL, ctxt_node);
+  if(!row[0] ||
+     librdf_storage_virtuoso_node2params(nsubject, &row[1], NULL, NULL) ||
+     librdf_storage_virtuoso_node2params(npredicate, &row[2], NULL, NULL) ||
+     librdf_storage_virtuoso_node2params(nobject, &row[3], &row[4],
+                                         &context->batch_types[context->batch_count])) {
+    for(i = 0; i < LIBRDF_VIRTUOSO_BATCH_COLUMNS; i++) {
+      if(row[i]) {
+        LIBRDF_FREE(char*, row[i]);
+        row[i] = NULL;
+      }
+    }
+    return 1;
+  }
+
+  if(++context->batch_count == LIBRDF_VIRTUOSO_BATCH_SIZE)
+    return librdf_storage_virtuoso_batch_flush(storage);
+
+  return 0;
+}
+
+
 /*
  * librdf_storage_virtuoso_context_add_statement_helper - Perform actual addition of a statement to a storage context
  * @storage: #librdf_storage object
@@ -1700,8 +2324,9 @@ librdf_storage_virtuoso_context_add_statement_helper(librdf_storage* storage,
                                                      librdf_node* context_node,
                                                      librdf_statement* statement)
 {
-  const char *insert_statement="sparql define output:format '_JAVA_' insert into graph iri(\?\?) { `iri(\?\?)` `iri(\?\?)` `bif:__rdf_long_from_batch_params(\?\?,\?\?,\?\?)` }";
+  librdf_storage_virtuoso_instance* context;
   librdf_storage_virtuoso_connection *handle = NULL;
+  HSTMT hstmt = NULL;
   int rc;
   int ret = 0;
   char *subject = NULL;
@@ -1718,11 +2343,27 @@ librdf_storage_virtuoso_context_add_statement_helper(librdf_storage* storage,
 #ifdef VIRTUOSO_STORAGE_DEBUG
   fprintf(stderr, "librdf_storage_virtuoso_context_add_statement_helper \n");
 #endif
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
+  /* Queue for a parameter array insert during bulk loads */
+  if(context->batching || context->bulk)
+    return librdf_storage_virtuoso_batch_add(storage, context_node, statement);
+
   /* Get Virtuoso connection handle */
   handle = librdf_storage_virtuoso_get_handle(storage);
   if(!handle)
     return 1;
 
+  if(librdf_storage_virtuoso_prepare(storage, handle, &handle->hstmt_insert,
+                                     librdf_storage_virtuoso_insert_sql)) {
+    librdf_storage_virtuoso_release_handle(storage, handle);
+    return 1;
+  }
+
+  /* Bind to the prepared statement */
+  hstmt = handle->hstmt;
+  handle->hstmt = handle->hstmt_insert;
+
   ctxt_node = librdf_storage_virtuoso_icontext2string(storage, context_node);
 
   nsubject = librdf_statement_get_subject(statement);
@@ -1758,20 +2399,19 @@ librdf_storage_virtuoso_context_add_statement_helper(librdf_storage* storage,
   }
 
 #ifdef VIRTUOSO_STORAGE_DEBUG
-  printf("SQL: >>%s<<\n", insert_statement);
+  printf("SQL: >>%s<<\n", librdf_storage_virtuoso_insert_sql);
 #endif
-#ifdef LIBRDF_DEBUG_SQL
-  LIBRDF_DEBUG2("SQL: >>%s<<\n", insert_statement);
-#endif
-  rc = SQLExecDirect(handle->hstmt,(SQLCHAR *)insert_statement, SQL_NTS);
+  context->cached_size = -1;
+  rc = SQLExecute(handle->hstmt);
   if(!SQL_SUCCEEDED(rc)) {
-    rdf_virtuoso_ODBC_Errors("SQLExecDirect()", storage->world, handle);
+    rdf_virtuoso_ODBC_Errors("SQLExecute()", storage->world, handle);
     ret = -1;
     goto end;
   }
 
 end:
   SQLFreeStmt(handle->hstmt, SQL_RESET_PARAMS);
+  handle->hstmt = hstmt;
   if(subject)
     LIBRDF_FREE(char*, subject);
   if(predicate)
@@ -1789,12 +2429,20 @@ end:
  * librdf_storage_virtuoso_start_bulk - Prepare for bulk insert operation
  * @storage: the storage
  *
+ * Added statements are queued and sent in parameter arrays of up to
+ * LIBRDF_VIRTUOSO_BATCH_SIZE rows.
+ *
  * Return value: Non-zero on failure.
  */
 static int
 librdf_storage_virtuoso_start_bulk(librdf_storage* storage)
 {
-  return 1;
+  librdf_storage_virtuoso_instance* context;
+
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+  context->batching = 1;
+
+  return 0;
 }
 
 
@@ -1802,12 +2450,19 @@ librdf_storage_virtuoso_start_bulk(librdf_storage* storage)
  * librdf_storage_virtuoso_stop_bulk - End bulk insert operation
  * @storage: the storage
  *
+ * Sends any statements still queued.
+ *
  * Return value: Non-zero on failure.
  */
 static int
 librdf_storage_virtuoso_stop_bulk(librdf_storage* storage)
 {
-  return 1;
+  librdf_storage_virtuoso_instance* context;
+
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+  context->batching = 0;
+
+  return librdf_storage_virtuoso_batch_flush(storage);
 }
 
 
@@ -1843,8 +2498,7 @@ librdf_storage_virtuoso_context_contains_statement(librdf_storage* storage,
                                                    librdf_node* context_node,
                                                    librdf_statement* statement)
 {
-  char find_statement[]="sparql define input:storage \"\" select * where {graph %s { %s %s %s }} limit 1";
-  char *query = NULL;
+  const char *ask_statement="sparql define input:storage \"\" ask where { graph `iri(\?\?)` { `iri(\?\?)` `iri(\?\?)` `bif:__rdf_long_from_batch_params(\?\?,\?\?,\?\?)` } }";
   librdf_storage_virtuoso_connection *handle = NULL;
   int rc;
   int ret = 0;
@@ -1852,70 +2506,66 @@ librdf_storage_virtuoso_context_contains_statement(librdf_storage* storage,
   char *predicate = NULL;
   char *object = NULL;
   char *ctxt_node = NULL;
+  librdf_node* nsubject = NULL;
+  librdf_node* npredicate = NULL;
+  librdf_node* nobject = NULL;
+  SQLLEN ind, ind1, ind2;
+  SQLLEN ind31, ind32, ind33;
+  long iData;
+  int is_null;
+  int found = 0;
 
 
 #ifdef VIRTUOSO_STORAGE_DEBUG
   fprintf(stderr, "librdf_storage_virtuoso_contains_statement \n");
 #endif
 
+  nsubject = librdf_statement_get_subject(statement);
+  npredicate = librdf_statement_get_predicate(statement);
+  nobject = librdf_statement_get_object(statement);
+  if(!nsubject || !npredicate || !nobject)
+    return 0;
+
   /* Get Virtuoso connection handle */
   handle = librdf_storage_virtuoso_get_handle(storage);
   if(!handle)
     return 0;
 
-  subject = librdf_storage_virtuoso_node2string(storage,
-                                                librdf_statement_get_subject(statement));
-  predicate = librdf_storage_virtuoso_node2string(storage,
-                                                  librdf_statement_get_predicate(statement));
-  object = librdf_storage_virtuoso_node2string(storage,
-                                               librdf_statement_get_object(statement));
-  if(!subject || !predicate || !object) {
-    ret = 0;
-    goto end;
-  }
-
-  ctxt_node = librdf_storage_virtuoso_context2string(storage, context_node);
-  if(!ctxt_node) {
-    ret = 1;
+  ctxt_node = librdf_storage_virtuoso_icontext2string(storage, context_node);
+  if(!ctxt_node)
     goto end;
-  }
 
-  query = LIBRDF_MALLOC(char*, strlen(find_statement)+ strlen(ctxt_node)+ strlen(subject) + strlen(predicate) + strlen(object) + 1);
-  if(!query) {
-    ret = 0;
+  if(BindCtxt(storage, handle, 1, ctxt_node, &ind) ||
+     BindSP(storage, handle, 2, nsubject, &subject, &ind1) ||
+     BindSP(storage, handle, 3, npredicate, &predicate, &ind2) ||
+     BindObject(storage, handle, 4, nobject, &object, &iData, &ind31,
+                &ind32, &ind33))
     goto end;
-  }
-
-  sprintf(query, find_statement, ctxt_node, subject, predicate, object);
 
 #ifdef VIRTUOSO_STORAGE_DEBUG
-  printf("SQL: >>%s<<\n", query);
+  printf("SQL: >>%s<<\n", ask_statement);
 #endif
 #ifdef LIBRDF_DEBUG_SQL
-  LIBRDF_DEBUG2("SQL: >>%s<<\n", query);
+  LIBRDF_DEBUG2("SQL: >>%s<<\n", ask_statement);
 #endif
 
-  rc = SQLExecDirect(handle->hstmt,(SQLCHAR *)query, SQL_NTS);
+  rc = SQLExecDirect(handle->hstmt,(SQLCHAR *)ask_statement, SQL_NTS);
   if(!SQL_SUCCEEDED(rc)) {
     rdf_virtuoso_ODBC_Errors("SQLExecDirect()", storage->world, handle);
-    ret = 0;
     goto end;
   }
 
   rc = SQLFetch(handle->hstmt);
   if(SQL_SUCCEEDED(rc)) {
-    ret = 1;
-  } else if(rc == SQL_NO_DATA_FOUND) {
-    ret = 0;
+    if(vGetDataINT(storage->world, handle, 1, &is_null, &found) != -1 &&
+       !is_null)
+      ret = (found != 0);
   }
 
   SQLCloseCursor(handle->hstmt);
 
 end:
-  if(query)
-    LIBRDF_FREE(char*, query);
-  if(ctxt_node)
-    LIBRDF_FREE(char*, ctxt_node);
+  SQLFreeStmt(handle->hstmt, SQL_RESET_PARAMS);
   if(subject)
     LIBRDF_FREE(char*, subject);
   if(predicate)
@@ -1961,11 +2611,12 @@ librdf_storage_virtuoso_context_remove_statement(librdf_storage* storage,
                                                  librdf_node* context_node,
                                                  librdf_statement* statement)
 {
-  const char *sdelete="sparql define output:format '_JAVA_' delete from graph iri(\?\?) {`iri(\?\?)` `iri(\?\?)` `bif:__rdf_long_from_batch_params(\?\?,\?\?,\?\?)`}";
   const char *sdelete_match="sparql delete from graph <%s> { %s %s %s } from <%s> where { %s %s %s }";
   const char *sdelete_graph="sparql clear graph iri(\?\?)";
   char *query = NULL;
+  librdf_storage_virtuoso_instance* context;
   librdf_storage_virtuoso_connection *handle = NULL;
+  HSTMT hstmt = NULL;
   int rc;
   int ret = 0;
   char *subject = NULL;
@@ -1984,11 +2635,15 @@ librdf_storage_virtuoso_context_remove_statement(librdf_storage* storage,
   fprintf(stderr, "librdf_storage_virtuoso_context_remove_statement \n");
 #endif
 
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
   /* Get Virtuoso connection handle */
   handle = librdf_storage_virtuoso_get_handle(storage);
   if(!handle)
     return 1;
 
+  context->cached_size = -1;
+
   ctxt_node = librdf_storage_virtuoso_icontext2string(storage, context_node);
   if(!ctxt_node) {
     ret = 1;
@@ -2014,6 +2669,16 @@ librdf_storage_virtuoso_context_remove_statement(librdf_storage* storage,
     }
   } else if(nsubject != NULL && npredicate != NULL && nobject != NULL &&
             ctxt_node != NULL) {
+    if(librdf_storage_virtuoso_prepare(storage, handle, &handle->hstmt_delete,
+                                       librdf_storage_virtuoso_delete_sql)) {
+      ret = 1;
+      goto end;
+    }
+
+    /* Bind to the prepared statement */
+    hstmt = handle->hstmt;
+    handle->hstmt = handle->hstmt_delete;
+
     ind = SQL_NTS;
     rc = BindCtxt(storage, handle, 1, ctxt_node, &ind);
     if(rc) {
@@ -2039,11 +2704,11 @@ librdf_storage_virtuoso_context_remove_statement(librdf_storage* storage,
       goto end;
     }
 #ifdef VIRTUOSO_STORAGE_DEBUG
-    printf("SQL: >>%s<<\n", sdelete);
+    printf("SQL: >>%s<<\n", librdf_storage_virtuoso_delete_sql);
 #endif
-    rc = SQLExecDirect(handle->hstmt,(SQLCHAR *)sdelete, SQL_NTS);
+    rc = SQLExecute(handle->hstmt);
     if(!SQL_SUCCEEDED(rc)) {
-      rdf_virtuoso_ODBC_Errors("SQLExecDirect()", storage->world, handle);
+      rdf_virtuoso_ODBC_Errors("SQLExecute()", storage->world, handle);
       ret = -1;
       goto end;
     }
@@ -2082,6 +2747,8 @@ librdf_storage_virtuoso_context_remove_statement(librdf_storage* storage,
 
 end:
   SQLFreeStmt(handle->hstmt, SQL_RESET_PARAMS);
+  if(hstmt)
+    handle->hstmt = hstmt;
   if(query)
     LIBRDF_FREE(char*, query);
   if(ctxt_node)
@@ -2114,6 +2781,7 @@ librdf_storage_virtuoso_context_remove_statements(librdf_storage* storage,
                                                   librdf_node* context_node)
 {
   const char *remove_statements="sparql clear graph iri(\?\?)";
+  librdf_storage_virtuoso_instance* context;
   librdf_storage_virtuoso_connection *handle = NULL;
   int rc;
   int ret = 0;
@@ -2124,11 +2792,15 @@ librdf_storage_virtuoso_context_remove_statements(librdf_storage* storage,
   fprintf(stderr, "librdf_storage_virtuoso_context_remove_statements \n");
 #endif
 
+  context = (librdf_storage_virtuoso_instance*)storage->instance;
+
   /* Get Virtuoso connection handle */
   handle = librdf_storage_virtuoso_get_handle(storage);
   if(!handle)
     return 1;
 
+  context->cached_size = -1;
+
   ctxt_node = librdf_storage_virtuoso_context2string(storage, context_node);
   if(!ctxt_node) {
     ret = 1;
@@ -2256,7 +2928,37 @@ librdf_storage_virtuoso_find_statements_in_context(librdf_storage* storage,
                                                    librdf_statement* statement,
                                                    librdf_node* context_node)
 {
-  char find_statement[]="sparql select * from %s where { %s %s %s }";
+  return librdf_storage_virtuoso_find_statements_with_options(storage,
+                                                              statement,
+                                                              context_node,
+                                                              NULL);
+}
+
+
+/*
+ * librdf_storage_virtuoso_find_statements_with_options - Find a graph of statements in a storage context with options.
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: the context to search
+ * @options: #librdf_hash of match options or NULL
+ *
+ * Return a stream of statements matching the given statement(or
+ * all statements if NULL).  Parts(subject, predicate, object) of the
+ * statement can be empty in which case any statement part will match that.
+ *
+ * The limit, offset and order options are added to the SPARQL query.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_virtuoso_find_statements_with_options(librdf_storage* storage,
+                                                     librdf_statement* statement,
+                                                     librdf_node* context_node,
+                                                     librdf_hash* options)
+{
+  char find_statement[]="sparql select * from %s where { %s %s %s }%s";
+  char paging[64];
+  int limit, offset, order;
   char *query = NULL;
   librdf_storage_virtuoso_sos_context *sos = NULL;
   int rc = 0;
@@ -2265,6 +2967,7 @@ librdf_storage_virtuoso_find_statements_in_context(librdf_storage* storage,
   const char *s_predicate = NULL;
   const char *s_object = NULL;
   const char *ctxt_node = NULL;
+  short numCols;
 
   librdf_stream *stream = NULL;
 
@@ -2335,15 +3038,32 @@ librdf_storage_virtuoso_find_statements_in_context(librdf_storage* storage,
   if(!ctxt_node)
     goto end;
 
+  *paging = '\0';
+  if(librdf_storage_get_find_options(options, &limit, &offset, &order)) {
+    /* ordering by a given term is no ordering */
+    if(order == 1 && !subject)
+      strcat(paging, " ORDER BY ?s");
+    else if(order == 2 && !predicate)
+      strcat(paging, " ORDER BY ?p");
+    else if(order == 3 && !object)
+      strcat(paging, " ORDER BY ?o");
+    if(limit >= 0)
+      sprintf(paging + strlen(paging), " LIMIT %d", limit);
+    if(offset > 0)
+      sprintf(paging + strlen(paging), " OFFSET %d", offset);
+  }
+
   query = LIBRDF_MALLOC(char*, strlen(find_statement) + 
                                strlen(ctxt_node) + strlen(s_subject) +
-                               strlen(s_predicate) + strlen(s_object)+1);
+                               strlen(s_predicate) + strlen(s_object) +
+                               strlen(paging) + 1);
   if(!query) {
     librdf_storage_virtuoso_find_statements_in_context_finished((void*)sos);
     goto end;
   }
 
-  sprintf(query, find_statement, ctxt_node, s_subject, s_predicate, s_object);
+  sprintf(query, find_statement, ctxt_node, s_subject, s_predicate, s_object,
+          paging);
 
 #ifdef VIRTUOSO_STORAGE_DEBUG
   printf("SQL: >>%s<<\n", query);
@@ -2359,6 +3079,17 @@ librdf_storage_virtuoso_find_statements_in_context(librdf_storage* storage,
     goto end;
   }
 
+  rc = SQLNumResultCols(sos->handle->hstmt, &numCols);
+  if(!SQL_SUCCEEDED(rc)) {
+    rdf_virtuoso_ODBC_Errors("SQLNumResultCols()", storage->world,
+                             sos->handle);
+    librdf_storage_virtuoso_find_statements_in_context_finished((void*)sos);
+    goto end;
+  }
+
+  /* Fetch the result in blocks of rows */
+  vBlockBind(storage->world, sos->handle, numCols);
+
   /* Get first statement, if any, and initialize stream */
   if(librdf_storage_virtuoso_find_statements_in_context_next_statement(sos) ) {
     librdf_storage_virtuoso_find_statements_in_context_finished((void*)sos);
@@ -2393,30 +3124,6 @@ end:
 }
 
 
-/*
- * librdf_storage_virtuoso_find_statements_with_options - Find a graph of statements in a storage context with options.
- * @storage: the storage
- * @statement: the statement to match
- * @context_node: the context to search
- * @options: #librdf_hash of match options or NULL
- *
- * Return a stream of statements matching the given statement(or
- * all statements if NULL).  Parts(subject, predicate, object) of the
- * statement can be empty in which case any statement part will match that.
- *
- * Return value: a #librdf_stream or NULL on failure
- **/
-static librdf_stream*
-librdf_storage_virtuoso_find_statements_with_options(librdf_storage* storage,
-                                                     librdf_statement* statement,
-                                                     librdf_node* context_node,
-                                                     librdf_hash* options)
-{
-  return librdf_storage_virtuoso_find_statements_in_context(storage, statement,
-                                                            context_node);
-}
-
-
 static int
 librdf_storage_virtuoso_find_statements_in_context_end_of_stream(void* context)
 {
@@ -2433,21 +3140,13 @@ librdf_storage_virtuoso_find_statements_in_context_next_statement(void* context)
   librdf_node *subject = NULL, *predicate = NULL, *object = NULL;
   librdf_node *node;
   SQLUSMALLINT colNum;
-  short numCols;
   int rc;
 
 #ifdef VIRTUOSO_STORAGE_DEBUG
   printf("librdf_storage_virtuoso_find_statements_in_context_next_statement\n");
 #endif
 
-  rc = SQLNumResultCols(sos->handle->hstmt, &numCols);
-  if(!SQL_SUCCEEDED(rc)) {
-    rdf_virtuoso_ODBC_Errors("SQLNumResultCols()", sos->storage->world,
-                             sos->handle);
-    return 1;
-  }
-
-  rc = SQLFetch(sos->handle->hstmt);
+  rc = vFetch(sos->storage->world, sos->handle);
   if(rc == SQL_NO_DATA_FOUND) {
 
     if(sos->current_statement)
@@ -2492,7 +3191,6 @@ librdf_storage_virtuoso_find_statements_in_context_next_statement(void* context)
     librdf_statement_set_object(sos->current_statement,librdf_new_node_from_node(object));
     sos->current_context = librdf_new_node_from_node(sos->query_context);
   } else {
-      char * data;
       int is_null;
 
       colNum = 1;
@@ -2500,12 +3198,8 @@ librdf_storage_virtuoso_find_statements_in_context_next_statement(void* context)
       if(sos->query_context) {
         sos->current_context = librdf_new_node_from_node(sos->query_context);
       } else {
-        data = vGetDataCHAR(sos->storage->world, sos->handle, colNum, &is_null);
-        if(!data || is_null)
-          return 1;
-
-        sos->current_context = rdf2node(sos->storage, sos->handle, colNum, data);
-        LIBRDF_FREE(char*, (char*)data);
+        sos->current_context = vGetNode(sos->storage, sos->handle, colNum,
+                                        &is_null);
         if(!sos->current_context)
           return 1;
 
@@ -2516,12 +3210,7 @@ librdf_storage_virtuoso_find_statements_in_context_next_statement(void* context)
         librdf_statement_set_subject(sos->current_statement,librdf_new_node_from_node(subject));
       } else {
 
-        data = vGetDataCHAR(sos->storage->world, sos->handle, colNum, &is_null);
-        if(!data || is_null)
-          return 1;
-
-        node = rdf2node(sos->storage, sos->handle, colNum, data);
-        LIBRDF_FREE(char*, (char*)data);
+        node = vGetNode(sos->storage, sos->handle, colNum, &is_null);
         if(!node)
           return 1;
 
@@ -2532,12 +3221,7 @@ librdf_storage_virtuoso_find_statements_in_context_next_statement(void* context)
       if(predicate) {
         librdf_statement_set_predicate(sos->current_statement,librdf_new_node_from_node(predicate));
       } else {
-        data = vGetDataCHAR(sos->storage->world, sos->handle, colNum, &is_null);
-        if(!data || is_null)
-          return 1;
-
-        node = rdf2node(sos->storage, sos->handle, colNum, data);
-        LIBRDF_FREE(char*, (char*)data);
+        node = vGetNode(sos->storage, sos->handle, colNum, &is_null);
         if(!node)
           return 1;
 
@@ -2548,12 +3232,7 @@ librdf_storage_virtuoso_find_statements_in_context_next_statement(void* context)
       if(object) {
         librdf_statement_set_object(sos->current_statement,librdf_new_node_from_node(object));
       } else {
-        data = vGetDataCHAR(sos->storage->world, sos->handle, colNum, &is_null);
-        if(!data || is_null)
-          return 1;
-
-        node = rdf2node(sos->storage, sos->handle, colNum, data);
-        LIBRDF_FREE(char*, (char*)data);
+        node = vGetNode(sos->storage, sos->handle, colNum, &is_null);
         if(!node)
           return 1;
 
@@ -2593,6 +3272,7 @@ librdf_storage_virtuoso_find_statements_in_context_finished(void* context)
 
   if(sos->handle) {
     SQLCloseCursor(sos->handle->hstmt);
+    vBlockUnbind(sos->handle);
     librdf_storage_virtuoso_release_handle(sos->storage, sos->handle);
   }
 
@@ -2702,6 +3382,9 @@ librdf_storage_virtuoso_get_contexts(librdf_storage* storage)
     goto end;
   }
 
+  /* Fetch the result in blocks of rows */
+  vBlockBind(storage->world, gccontext->handle, 1);
+
   /* Get first statement, if any, and initialize stream */
   if(librdf_storage_virtuoso_get_contexts_next_context(gccontext) ||
      !gccontext->current_context) {
@@ -2742,20 +3425,11 @@ librdf_storage_virtuoso_get_contexts_next_context(void* context)
   librdf_storage_virtuoso_get_contexts_context* gccontext;
   int rc;
   SQLUSMALLINT colNum;
-  short numCols;
-  char *data;
   int is_null;
 
   gccontext = (librdf_storage_virtuoso_get_contexts_context*)context;
 
-  rc = SQLNumResultCols(gccontext->handle->hstmt, &numCols);
-  if(!SQL_SUCCEEDED(rc)) {
-    rdf_virtuoso_ODBC_Errors("SQLNumResultCols()", gccontext->storage->world,
-                             gccontext->handle);
-    return 1;
-  }
-
-  rc = SQLFetch(gccontext->handle->hstmt);
+  rc = vFetch(gccontext->storage->world, gccontext->handle);
   if(rc == SQL_NO_DATA_FOUND) {
     if(gccontext->current_context)
       librdf_free_node(gccontext->current_context);
@@ -2772,14 +3446,8 @@ librdf_storage_virtuoso_get_contexts_next_context(void* context)
     librdf_free_node(gccontext->current_context);
 
   colNum = 1;
-  data = vGetDataCHAR(gccontext->storage->world, gccontext->handle, colNum,
-                      &is_null);
-  if(!data || is_null)
-    return 1;
-
-  gccontext->current_context = rdf2node(gccontext->storage, gccontext->handle,
-                                        colNum, data);
-  LIBRDF_FREE(char*, (char*)data);
+  gccontext->current_context = vGetNode(gccontext->storage, gccontext->handle,
+                                        colNum, &is_null);
   if(!gccontext->current_context)
     return 1;
 
@@ -2807,6 +3475,7 @@ librdf_storage_virtuoso_get_contexts_finished(void* context)
 
   if(gccontext->handle) {
     SQLCloseCursor(gccontext->handle->hstmt);
+    vBlockUnbind(gccontext->handle);
     librdf_storage_virtuoso_release_handle(gccontext->storage,
                                            gccontext->handle);
   }
@@ -2908,6 +3577,14 @@ librdf_storage_virtuoso_transaction_commit(librdf_storage* storage)
   if(!context->transaction_handle)
     return 1;
 
+  /* Queued statements belong to the transaction */
+  if(librdf_storage_virtuoso_batch_flush(storage)) {
+    librdf_storage_virtuoso_transaction_rollback(storage);
+    return 1;
+  }
+
+  context->cached_size = -1;
+
   rc = SQLEndTran(SQL_HANDLE_DBC, context->transaction_handle->hdbc, SQL_COMMIT);
   if(!SQL_SUCCEEDED(rc))
     rdf_virtuoso_ODBC_Errors("SQLEndTran(hdbc,COMMIT)", storage->world,
@@ -2943,6 +3620,9 @@ librdf_storage_virtuoso_transaction_rollback(librdf_storage* storage)
   if(!context->transaction_handle)
     return 1;
 
+  librdf_storage_virtuoso_batch_clear(storage);
+  context->cached_size = -1;
+
   rc = SQLEndTran(SQL_HANDLE_DBC, context->transaction_handle->hdbc,
                   SQL_ROLLBACK);
   if(!SQL_SUCCEEDED(rc))
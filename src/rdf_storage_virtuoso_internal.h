@@ -40,6 +40,19 @@ struct librdf_storage_virtuoso_connection_s {
    HSTMT hstmt;
    short numCols;
 
+  /* insert and delete statements prepared once on this connection */
+  HSTMT hstmt_insert;
+  HSTMT hstmt_delete;
+
+  /* block cursor over the current result of hstmt, see vBlockBind() */
+  short block_cols;
+  SQLULEN block_rows;
+  SQLULEN block_row;
+  char *block_data;
+  SQLLEN *block_ind;
+  /* 0 not yet checked, 1 SQLGetData() allowed on a bound block cursor, -1 not */
+  int getdata_block;
+
   librdf_hash *h_lang;
   librdf_hash *h_type;
 
@@ -47,6 +60,10 @@ struct librdf_storage_virtuoso_connection_s {
   librdf_node* (*v_rdf2node)(librdf_storage *storage, librdf_storage_virtuoso_connection *handle, int col, char *data);
   char* (*v_GetDataCHAR)(librdf_world *world, librdf_storage_virtuoso_connection *handle, int col, int *is_null);
   int (*v_GetDataINT)(librdf_world *world, librdf_storage_virtuoso_connection *handle, int col, int *is_null, int *val);
+  void (*v_BlockBind)(librdf_world *world, librdf_storage_virtuoso_connection *handle, short numCols);
+  void (*v_BlockUnbind)(librdf_storage_virtuoso_connection *handle);
+  SQLRETURN (*v_Fetch)(librdf_world *world, librdf_storage_virtuoso_connection *handle);
+  librdf_node* (*v_GetNode)(librdf_storage *storage, librdf_storage_virtuoso_connection *handle, int col, int *is_null);
 };
 
 
@@ -84,6 +101,21 @@ typedef struct
 
 #define LIBRDF_VIRTUOSO_CONTEXT_DSN_SIZE 4096
 
+/* Rows fetched per SQLFetch() on a block cursor and the bound buffer
+ * size per value; longer values are read with SQLGetData()
+ */
+#define LIBRDF_VIRTUOSO_BLOCK_SIZE 100
+#define LIBRDF_VIRTUOSO_BLOCK_WIDTH 512
+
+/* Number of queued statements sent per parameter array execute */
+#define LIBRDF_VIRTUOSO_BATCH_SIZE 1000
+
+/* Parameter columns of a queued statement: graph, subject, predicate,
+ * object value and object language or datatype.  The object type is
+ * kept separately in batch_types.
+ */
+#define LIBRDF_VIRTUOSO_BATCH_COLUMNS 5
+
 typedef struct {
   /* Virtuoso connection parameters */
   librdf_storage *storage;
@@ -112,6 +144,19 @@ typedef struct {
 
   librdf_storage_virtuoso_connection *transaction_handle;
 
+  /* statements queued between start_bulk and stop_bulk, sent with ODBC
+   * parameter arrays; LIBRDF_VIRTUOSO_BATCH_COLUMNS strings per row
+   */
+  int batching;
+  char **batch_values;
+  SQLINTEGER *batch_types;
+  int batch_count;
+
+  /* number of statements in the model graph as last counted by
+   * librdf_storage_virtuoso_size() or <0 if a write happened since
+   */
+  int cached_size;
+
   /* for output connection DSN from SQLDriverConnect() as called by
    * librdf_storage_virtuoso_get_handle() 
    */
@@ -32,6 +32,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
@@ -102,17 +103,23 @@ librdf_new_stream(librdf_world *world,
 }
 
 
-/* helper function for deleting list map */
+/* Release the statements and contexts copied for the last batch */
 static void
-librdf_stream_free_stream_map(void *list_data, void *user_data) 
+librdf_stream_clear_batch(librdf_stream* stream)
 {
-  librdf_stream_map* map=(librdf_stream_map*)list_data;
-  if(map->free_context)
-    map->free_context(map->context);
-  LIBRDF_FREE(librdf_stream_map, map);
+  int i;
+
+  for(i=0; i < stream->batch_count; i++) {
+    librdf_statement_clear(&stream->batch[i]);
+    if(stream->batch_nodes[i]) {
+      librdf_free_node(stream->batch_nodes[i]);
+      stream->batch_nodes[i]=NULL;
+    }
+  }
+  stream->batch_count=0;
 }
 
-  
+
 
 /**
  * librdf_free_stream:
@@ -130,10 +137,21 @@ librdf_free_stream(librdf_stream* stream)
   if(stream->finished_method)
     stream->finished_method(stream->context);
 
-  if(stream->map_list) {
-    librdf_list_foreach(stream->map_list,
-                        librdf_stream_free_stream_map, NULL);
-    librdf_free_list(stream->map_list);
+  if(stream->maps) {
+    int i;
+
+    for(i=0; i < stream->maps_count; i++) {
+      if(stream->maps[i].free_context)
+        stream->maps[i].free_context(stream->maps[i].context);
+    }
+    LIBRDF_FREE(librdf_stream_map*, stream->maps);
+  }
+
+  if(stream->batch) {
+    librdf_stream_clear_batch(stream);
+    LIBRDF_FREE(librdf_statement*, stream->batch);
+    LIBRDF_FREE(librdf_node**, stream->batch_nodes);
+    LIBRDF_FREE(librdf_node**, stream->batch_contexts);
   }
   
   LIBRDF_FREE(librdf_stream, stream);
@@ -161,34 +179,16 @@ librdf_stream_update_current_statement(librdf_stream* stream)
 
   /* find next statement subject to map */
   while(!stream->is_end_method(stream->context)) {
-    librdf_iterator* map_iterator; /* Iterator over stream->map_list librdf_list */
+    int i;
+
     statement=(librdf_statement*)stream->get_method(stream->context,
                                  LIBRDF_STREAM_GET_METHOD_GET_OBJECT);
     if(!statement)
       break;
 
-    if(!stream->map_list || !librdf_list_size(stream->map_list))
-      break;
-    
-    map_iterator=librdf_list_get_iterator(stream->map_list);
-    if(!map_iterator) {
-      statement=NULL;
-      break;
-    }
-    
-    while(!librdf_iterator_end(map_iterator)) {
-      librdf_stream_map *map=(librdf_stream_map*)librdf_iterator_get_object(map_iterator);
-      if(!map)
-        break;
-      
-      /* apply the map to the element  */
-      statement=map->fn(stream, map->context, statement);
-      if(!statement)
-        break;
-
-      librdf_iterator_next(map_iterator);
-    }
-    librdf_free_iterator(map_iterator);
+    /* apply the maps to the element in order */
+    for(i=0; statement && i < stream->maps_count; i++)
+      statement=stream->maps[i].fn(stream, stream->maps[i].context, statement);
     
 
     /* found something, return it */
@@ -296,6 +296,10 @@ librdf_stream_get_object(librdf_stream* stream)
 librdf_node*
 librdf_stream_get_context2(librdf_stream* stream) 
 {
+  /* maps applied to a batch see the context of each statement */
+  if(stream->in_batch)
+    return stream->batch_context;
+
   if(stream->is_finished)
     return NULL;
 
@@ -359,39 +363,306 @@ librdf_stream_add_map(librdf_stream* stream,
                       librdf_stream_map_free_context_handler free_context,
                       void *map_context)
 {
-  librdf_stream_map *map;
+  librdf_stream_map *maps;
   
-  if(!stream->map_list) {
-    stream->map_list=librdf_new_list(stream->world);
-    if(!stream->map_list) {
-      if(free_context && map_context)
-        (*free_context)(map_context);
-      return 1;
-    }
-  }
-
-  map = LIBRDF_CALLOC(librdf_stream_map*, 1, sizeof(*map));
-  if(!map) {
+  /* kept in one array so applying them is a single loop */
+  maps=LIBRDF_MALLOC(librdf_stream_map*,
+                     (stream->maps_count + 1) * sizeof(*maps));
+  if(!maps) {
     if(free_context && map_context)
       (*free_context)(map_context);
     return 1;
   }
 
-  map->fn=map_function;
-  map->free_context=free_context;
-  map->context=map_context;
+  if(stream->maps) {
+    memcpy(maps, stream->maps, stream->maps_count * sizeof(*maps));
+    LIBRDF_FREE(librdf_stream_map*, stream->maps);
+  }
+  stream->maps=maps;
 
-  if(librdf_list_add(stream->map_list, map)) {
-    LIBRDF_FREE(librdf_stream_map, map);
-    if(free_context && map_context)
-      (*free_context)(map_context);
+  maps[stream->maps_count].fn=map_function;
+  maps[stream->maps_count].free_context=free_context;
+  maps[stream->maps_count].context=map_context;
+  stream->maps_count++;
+  
+  return 0;
+}
+
+
+/**
+ * librdf_stream_set_next_batch_method:
+ * @stream: the stream
+ * @next_batch_method: function getting the next statements at once
+ *
+ * INTERNAL - Set the function a stream implementation uses to return many statements in one call
+ *
+ * The function gets up to the given number of statements and their
+ * contexts from the current statement on and moves the stream past
+ * them.  It returns how many it got, 0 at the end of the stream or
+ * <0 on failure.  The statements and contexts must stay valid until
+ * the next call of a method of the stream.
+ **/
+void
+librdf_stream_set_next_batch_method(librdf_stream* stream,
+                                    int (*next_batch_method)(void*, librdf_statement**, librdf_node**, int))
+{
+  stream->next_batch_method=next_batch_method;
+}
+
+
+/* Make room for copies of size statements, once the last batch is cleared */
+static int
+librdf_stream_reserve_batch(librdf_stream* stream, int size)
+{
+  librdf_statement* batch;
+  librdf_node** nodes;
+  librdf_node** contexts;
+  int i;
+
+  if(size <= stream->batch_size)
+    return 0;
+
+  batch=LIBRDF_CALLOC(librdf_statement*, size, sizeof(*batch));
+  nodes=LIBRDF_CALLOC(librdf_node**, size, sizeof(*nodes));
+  contexts=LIBRDF_CALLOC(librdf_node**, size, sizeof(*contexts));
+  if(!batch || !nodes || !contexts) {
+    if(batch)
+      LIBRDF_FREE(librdf_statement*, batch);
+    if(nodes)
+      LIBRDF_FREE(librdf_node**, nodes);
+    if(contexts)
+      LIBRDF_FREE(librdf_node**, contexts);
     return 1;
   }
-  
+
+  for(i=0; i < size; i++)
+    librdf_statement_init(stream->world, &batch[i]);
+
+  if(stream->batch) {
+    LIBRDF_FREE(librdf_statement*, stream->batch);
+    LIBRDF_FREE(librdf_node**, stream->batch_nodes);
+    LIBRDF_FREE(librdf_node**, stream->batch_contexts);
+  }
+  stream->batch=batch;
+  stream->batch_nodes=nodes;
+  stream->batch_contexts=contexts;
+  stream->batch_size=size;
+
   return 0;
 }
 
 
+/* Copy a statement and its context into a batch slot, sharing the nodes */
+static void
+librdf_stream_copy_to_batch(librdf_stream* stream, int i,
+                            librdf_statement* statement,
+                            librdf_node* context_node)
+{
+  librdf_statement* slot=&stream->batch[i];
+
+  if(statement->subject)
+    slot->subject=librdf_new_node_from_node(statement->subject);
+  if(statement->predicate)
+    slot->predicate=librdf_new_node_from_node(statement->predicate);
+  if(statement->object)
+    slot->object=librdf_new_node_from_node(statement->object);
+  if(context_node)
+    stream->batch_nodes[i]=librdf_new_node_from_node(context_node);
+
+  if(i >= stream->batch_count)
+    stream->batch_count=i + 1;
+}
+
+
+/*
+ * librdf_stream_map_batch - Apply the maps to part of a batch
+ * @stream: the stream
+ * @statements: batch statements
+ * @contexts: batch contexts
+ * @start: first statement to map
+ * @end: end of the statements to map
+ * @copied: non 0 if the statements are the stream copies
+ *
+ * Each map is called as it is by librdf_stream_get_object() and the
+ * statements it keeps are moved down over the removed ones.
+ *
+ * Return value: end of the statements kept
+ */
+static int
+librdf_stream_map_batch(librdf_stream* stream, librdf_statement** statements,
+                        librdf_node** contexts, int start, int end, int copied)
+{
+  int kept=start;
+  int i;
+  int j;
+
+  if(!stream->maps_count)
+    return end;
+
+  stream->in_batch=1;
+  for(i=start; i < end; i++) {
+    librdf_statement* statement=statements[i];
+
+    stream->batch_context=contexts[i];
+    for(j=0; statement && j < stream->maps_count; j++)
+      statement=stream->maps[j].fn(stream, stream->maps[j].context, statement);
+
+    if(!statement) {
+      if(copied) {
+        librdf_statement_clear(&stream->batch[i]);
+        if(stream->batch_nodes[i]) {
+          librdf_free_node(stream->batch_nodes[i]);
+          stream->batch_nodes[i]=NULL;
+        }
+      }
+      continue;
+    }
+
+    if(copied && kept != i) {
+      /* the slot at kept is empty: move the copy down into it */
+      librdf_statement slot=stream->batch[kept];
+
+      stream->batch[kept]=stream->batch[i];
+      stream->batch[i]=slot;
+      stream->batch_nodes[kept]=stream->batch_nodes[i];
+      stream->batch_nodes[i]=NULL;
+      if(statement == &stream->batch[i])
+        statement=&stream->batch[kept];
+    }
+
+    statements[kept]=statement;
+    contexts[kept]=contexts[i];
+    kept++;
+  }
+  stream->in_batch=0;
+  stream->batch_context=NULL;
+
+  return kept;
+}
+
+
+/**
+ * librdf_stream_next_batch:
+ * @stream: #librdf_stream object
+ * @statements: array to store the statements in
+ * @contexts: array to store the statement contexts in or NULL
+ * @size: size of the arrays
+ *
+ * Get the next statements of the stream at once.
+ *
+ * Gets up to @size statements from the current one on, with any
+ * maps applied, and moves the stream to the statement after them.
+ * Streams of the storages and parsers that can, return them without
+ * a call per statement; others are read one statement at a time.
+ *
+ * The statements and contexts are SHARED pointers, valid until the
+ * next call of a method of the stream; they should be copied with
+ * librdf_new_statement_from_statement() and librdf_new_node_from_node()
+ * to keep them longer.
+ *
+ * Return value: number of statements got, 0 at the end of the stream
+ * or <0 on failure
+ **/
+int
+librdf_stream_next_batch(librdf_stream* stream, librdf_statement** statements,
+                         librdf_node** contexts, int size)
+{
+  int count=0;
+  int ended=0;
+
+  if(!stream || stream->is_finished || size <= 0)
+    return 0;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statements, librdf_statement*, -1);
+
+  librdf_stream_clear_batch(stream);
+  if(librdf_stream_reserve_batch(stream, size))
+    return -1;
+  if(!contexts)
+    contexts=stream->batch_contexts;
+
+  /* a current statement already found has had the maps applied */
+  if(stream->is_updated) {
+    if(!stream->current)
+      return 0;
+
+    librdf_stream_copy_to_batch(stream, 0, stream->current,
+                                (librdf_node*)stream->get_method(stream->context,
+                                                                 LIBRDF_STREAM_GET_METHOD_GET_CONTEXT));
+    statements[0]=&stream->batch[0];
+    contexts[0]=stream->batch_nodes[0];
+    count=1;
+
+    stream->is_updated=0;
+    stream->current=NULL;
+    if(stream->next_method(stream->context))
+      ended=1;
+  }
+
+  while(!ended && count < size) {
+    int start=count;
+
+    if(stream->next_batch_method) {
+      int n;
+
+      n=stream->next_batch_method(stream->context, statements + count,
+                                  contexts + count, size - count);
+      if(n < 0) {
+        stream->is_finished=1;
+        return -1;
+      }
+      if(!n) {
+        ended=1;
+        break;
+      }
+
+      count=librdf_stream_map_batch(stream, statements, contexts,
+                                    start, count + n, 0);
+      /* another call would end the life of the statements got */
+      if(count)
+        break;
+      continue;
+    }
+
+    while(count < size) {
+      librdf_statement* statement;
+
+      if(stream->is_end_method(stream->context)) {
+        ended=1;
+        break;
+      }
+
+      statement=(librdf_statement*)stream->get_method(stream->context,
+                                                      LIBRDF_STREAM_GET_METHOD_GET_OBJECT);
+      if(!statement) {
+        ended=1;
+        break;
+      }
+
+      librdf_stream_copy_to_batch(stream, count, statement,
+                                  (librdf_node*)stream->get_method(stream->context,
+                                                                   LIBRDF_STREAM_GET_METHOD_GET_CONTEXT));
+      statements[count]=&stream->batch[count];
+      contexts[count]=stream->batch_nodes[count];
+      count++;
+
+      if(stream->next_method(stream->context)) {
+        ended=1;
+        break;
+      }
+    }
+
+    count=librdf_stream_map_batch(stream, statements, contexts,
+                                  start, count, 1);
+  }
+
+  if(ended)
+    stream->is_finished=1;
+
+  return count;
+}
+
+
 
 static int librdf_stream_from_node_iterator_end_of_stream(void* context);
 static int librdf_stream_from_node_iterator_next_statement(void* context);
@@ -735,6 +1006,69 @@ int main(int argc, char *argv[]);
 #define STREAM_NODES_COUNT 6
 #define NODE_URI_PREFIX "http://example.org/node"
 
+/* map removing the statements with the odd numbered nodes as object */
+static librdf_statement*
+test_stream_map_even(librdf_stream *stream, void *map_context,
+                     librdf_statement *item)
+{
+  librdf_node** nodes=(librdf_node**)map_context;
+  int i;
+
+  for(i=1; i < STREAM_NODES_COUNT; i += 2) {
+    if(librdf_node_equals(librdf_statement_get_object(item), nodes[i]))
+      return NULL;
+  }
+
+  return item;
+}
+
+
+/* Check a mapped stream gives the even numbered nodes in batches */
+static int
+test_stream_batches(const char *program, librdf_stream* stream,
+                    librdf_node** nodes, int ordered)
+{
+  librdf_statement* statements[4];
+  librdf_node* contexts[4];
+  int count=0;
+  int n;
+
+  librdf_stream_add_map(stream, &test_stream_map_even, NULL, nodes);
+
+  /* a statement already got has been mapped and starts the first batch */
+  if(ordered && !librdf_stream_get_object(stream)) {
+    fprintf(stderr, "%s: Mapped stream has no first statement\n", program);
+    return 1;
+  }
+
+  while((n=librdf_stream_next_batch(stream, statements, contexts, 2)) > 0) {
+    int i;
+
+    for(i=0; i < n; i++, count++) {
+      librdf_node* object=librdf_statement_get_object(statements[i]);
+      int j;
+
+      for(j=0; j < STREAM_NODES_COUNT; j += 2) {
+        if(librdf_node_equals(object, nodes[j]))
+          break;
+      }
+      if(j == STREAM_NODES_COUNT || (ordered && j != count * 2)) {
+        fprintf(stderr, "%s: Stream batch statement %d has an unexpected object\n",
+                program, count);
+        return 1;
+      }
+    }
+  }
+
+  if(n < 0 || count != STREAM_NODES_COUNT / 2) {
+    fprintf(stderr, "%s: Stream batches returned %d statements, expected %d\n",
+            program, count, STREAM_NODES_COUNT / 2);
+    return 1;
+  }
+
+  return 0;
+}
+
 int
 main(int argc, char *argv[]) 
 {
@@ -829,6 +1163,48 @@ main(int argc, char *argv[])
   librdf_free_stream(stream);
 
 
+  fprintf(stdout, "%s: Getting batches of a mapped node stream\n", program);
+  iterator = librdf_node_new_static_node_iterator(world, nodes, STREAM_NODES_COUNT);
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/resource"),
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/property"),
+                                            NULL);
+  stream=librdf_new_stream_from_node_iterator(iterator, statement, LIBRDF_STATEMENT_OBJECT);
+  librdf_free_statement(statement);
+  if(!stream || test_stream_batches(program, stream, nodes, 1))
+    return(1);
+  librdf_free_stream(stream);
+
+#ifdef STORAGE_HASHES
+  fprintf(stdout, "%s: Getting batches of a mapped storage stream\n", program);
+  {
+    librdf_storage* storage;
+    librdf_model* model;
+
+    storage=librdf_new_storage(world, "hashes", "test",
+                               "hash-type='memory',new='yes'");
+    model=librdf_new_model(world, storage, NULL);
+    if(!model) {
+      fprintf(stderr, "%s: Failed to create hashes model\n", program);
+      return(1);
+    }
+    for(i=0; i < STREAM_NODES_COUNT; i++)
+      librdf_model_add(model,
+                       librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/resource"),
+                       librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/property"),
+                       librdf_new_node_from_node(nodes[i]));
+
+    stream=librdf_model_as_stream(model);
+    if(!stream || test_stream_batches(program, stream, nodes, 0))
+      return(1);
+    librdf_free_stream(stream);
+
+    librdf_free_model(model);
+    librdf_free_storage(storage);
+  }
+#endif
+
+
   fprintf(stdout, "%s: Freeing nodes\n", program);
   for (i=0; i<STREAM_NODES_COUNT; i++) {
     librdf_free_node(nodes[i]);
@@ -91,6 +91,8 @@ int librdf_stream_end(librdf_stream* stream);
 REDLAND_API
 int librdf_stream_next(librdf_stream* stream);
 REDLAND_API
+int librdf_stream_next_batch(librdf_stream* stream, librdf_statement** statements, librdf_node** contexts, int size);
+REDLAND_API
 librdf_statement* librdf_stream_get_object(librdf_stream* stream);
 REDLAND_API
 librdf_node* librdf_stream_get_context2(librdf_stream* stream);
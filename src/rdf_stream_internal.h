@@ -30,7 +30,7 @@
 extern "C" {
 #endif
 
-/* used in map_list below */
+/* used in maps below */
 typedef struct {
   void *context; /* context to pass on to map */
   librdf_stream_map_handler fn;
@@ -47,15 +47,33 @@ struct librdf_stream_s {
   
   /* Used when mapping */
   librdf_statement *current;
-  librdf_list *map_list; /* non-empty means there is a list of maps */
+  librdf_stream_map *maps; /* maps_count maps applied in order, or NULL */
+  int maps_count;
   
   int (*is_end_method)(void*);
   int (*next_method)(void*);
   void* (*get_method)(void*, int); /* flags: type of get */
   void (*finished_method)(void*);
+
+  /* OPTIONAL: get up to size statements and contexts from the current
+   * one on and move past them, returning how many, 0 at the end or
+   * <0 on failure.  They stay valid until the next call of a method */
+  int (*next_batch_method)(void*, librdf_statement**, librdf_node**, int);
+
+  /* Used by librdf_stream_next_batch(): batch_size statements and
+   * contexts copied from the stream, the first batch_count in use, and
+   * the contexts returned when none are asked for */
+  librdf_statement *batch;
+  librdf_node **batch_nodes;
+  librdf_node **batch_contexts;
+  int batch_count;
+  int batch_size;
+  int in_batch; /* 1 while the maps are applied to a batch */
+  librdf_node *batch_context; /* context of the statement being mapped */
 };
 
 librdf_statement* librdf_stream_statement_find_map(librdf_stream *stream, void* context, librdf_statement* statement);
+void librdf_stream_set_next_batch_method(librdf_stream* stream, int (*next_batch_method)(void*, librdf_statement**, librdf_node**, int));
 
 #ifdef __cplusplus
 }
@@ -46,6 +46,121 @@
 
 #ifndef STANDALONE
 
+/*
+ * Relative URI references resolved by librdf_new_uri_relative_to_base()
+ * are remembered per thread in a small direct mapped table keyed by
+ * the base and reference strings, so a reference repeated against the
+ * same base is not resolved again.  Only strings are kept; the URI is
+ * made from the resolved string, which raptor finds in its URI intern
+ * table when it is still in use.
+ */
+
+/* Entries per thread, a power of 2 */
+#define LIBRDF_URI_CACHE_SIZE 256
+
+/* Longest base or reference string remembered */
+#define LIBRDF_URI_CACHE_MAX_LENGTH 1024
+
+typedef struct {
+  unsigned char *base;
+  size_t base_len;
+  unsigned char *reference;
+  size_t reference_len;
+  unsigned char *resolved;
+  size_t resolved_len;
+} librdf_uri_cache_entry;
+
+typedef struct {
+  librdf_uri_cache_entry entries[LIBRDF_URI_CACHE_SIZE];
+} librdf_uri_cache;
+
+#ifdef WITH_THREADS
+static pthread_key_t librdf_uri_cache_key;
+static pthread_once_t librdf_uri_cache_key_once = PTHREAD_ONCE_INIT;
+#else
+static librdf_uri_cache librdf_uri_static_cache;
+#endif
+
+
+static void
+librdf_uri_cache_entry_clear(librdf_uri_cache_entry* entry)
+{
+  if(entry->base)
+    LIBRDF_FREE(char*, entry->base);
+  if(entry->reference)
+    LIBRDF_FREE(char*, entry->reference);
+  if(entry->resolved)
+    LIBRDF_FREE(char*, entry->resolved);
+  memset(entry, 0, sizeof(*entry));
+}
+
+
+static void
+librdf_uri_cache_empty(librdf_uri_cache* cache)
+{
+  int i;
+
+  for(i = 0; i < LIBRDF_URI_CACHE_SIZE; i++)
+    librdf_uri_cache_entry_clear(&cache->entries[i]);
+}
+
+
+#ifdef WITH_THREADS
+static void
+librdf_uri_cache_free(void* data)
+{
+  librdf_uri_cache* cache = (librdf_uri_cache*)data;
+
+  librdf_uri_cache_empty(cache);
+  LIBRDF_FREE(librdf_uri_cache, cache);
+}
+
+
+static void
+librdf_uri_cache_make_key(void)
+{
+  pthread_key_create(&librdf_uri_cache_key, librdf_uri_cache_free);
+}
+#endif
+
+
+/* Get the cache of the calling thread, making it if create is set */
+static librdf_uri_cache*
+librdf_uri_get_cache(int create)
+{
+#ifdef WITH_THREADS
+  librdf_uri_cache* cache;
+
+  pthread_once(&librdf_uri_cache_key_once, librdf_uri_cache_make_key);
+  cache = (librdf_uri_cache*)pthread_getspecific(librdf_uri_cache_key);
+  if(!cache && create) {
+    cache = LIBRDF_CALLOC(librdf_uri_cache*, 1, sizeof(*cache));
+    if(cache && pthread_setspecific(librdf_uri_cache_key, cache)) {
+      LIBRDF_FREE(librdf_uri_cache, cache);
+      cache = NULL;
+    }
+  }
+  return cache;
+#else
+  return &librdf_uri_static_cache;
+#endif
+}
+
+
+/* Copy len bytes of string and a NUL */
+static unsigned char*
+librdf_uri_cache_copy(const unsigned char *string, size_t len)
+{
+  unsigned char *copy = LIBRDF_MALLOC(unsigned char*, len + 1);
+
+  if(copy) {
+    memcpy(copy, string, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+
 /* class methods */
 
 
@@ -73,6 +188,10 @@ librdf_init_uri(librdf_world *world)
 void
 librdf_finish_uri(librdf_world *world)
 {
+  librdf_uri_cache* cache = librdf_uri_get_cache(0);
+
+  if(cache)
+    librdf_uri_cache_empty(cache);
 }
 
 
@@ -96,8 +215,13 @@ librdf_new_uri2(librdf_world *world,
                 const unsigned char *uri_string,
                 size_t length)
 {
-  return raptor_new_uri_from_counted_string(world->raptor_world_ptr,
-                                            uri_string, length);
+  librdf_uri* uri;
+
+  librdf_usage_lock();
+  uri = raptor_new_uri_from_counted_string(world->raptor_world_ptr,
+                                           uri_string, length);
+  librdf_usage_unlock();
+  return uri;
 }
 
 
@@ -137,10 +261,14 @@ librdf_new_uri(librdf_world *world,
 librdf_uri*
 librdf_new_uri_from_uri (librdf_uri* old_uri)
 {
+  librdf_uri* uri;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(old_uri, librdf_uri, NULL);
 
-  return raptor_uri_copy(old_uri);
+  librdf_usage_lock();
+  uri = raptor_uri_copy(old_uri);
+  librdf_usage_unlock();
+  return uri;
 }
 
 
@@ -157,8 +285,13 @@ librdf_uri*
 librdf_new_uri_from_uri_local_name (librdf_uri* old_uri, 
                                     const unsigned char *local_name)
 {
-  return raptor_new_uri_from_uri_local_name(raptor_uri_get_world(old_uri),
-                                            old_uri, local_name);
+  librdf_uri* uri;
+
+  librdf_usage_lock();
+  uri = raptor_new_uri_from_uri_local_name(raptor_uri_get_world(old_uri),
+                                           old_uri, local_name);
+  librdf_usage_unlock();
+  return uri;
 }
 
 
@@ -195,7 +328,10 @@ librdf_new_uri_normalised_to_base(const unsigned char *uri_string,
 
   /* empty URI - easy, just make from base_uri */
   if(!*uri_string && base_uri) {
-    return raptor_uri_copy(base_uri);
+    librdf_usage_lock();
+    new_uri = raptor_uri_copy(base_uri);
+    librdf_usage_unlock();
+    return new_uri;
   }
   
   source_uri_string = librdf_uri_as_counted_string(source_uri,
@@ -208,7 +344,11 @@ librdf_new_uri_normalised_to_base(const unsigned char *uri_string,
      strncmp((const char*)uri_string, (const char*)source_uri_string,
              source_uri_string_length)) {
     raptor_world* rworld = raptor_uri_get_world(base_uri);
-    return raptor_new_uri(rworld, uri_string);
+
+    librdf_usage_lock();
+    new_uri = raptor_new_uri(rworld, uri_string);
+    librdf_usage_unlock();
+    return new_uri;
   }
 
   /* darn - is a fragment or matches, is a prefix of the source URI */
@@ -235,7 +375,9 @@ librdf_new_uri_normalised_to_base(const unsigned char *uri_string,
   strcpy((char*)new_uri_string + base_uri_string_length,
          (const char*)uri_string);
   
+  librdf_usage_lock();
   new_uri = raptor_new_uri(raptor_uri_get_world(source_uri), new_uri_string);
+  librdf_usage_unlock();
   LIBRDF_FREE(char*, new_uri_string); /* always free this even on failure */
 
   return new_uri; /* new URI or NULL from librdf_new_uri failure */
@@ -259,9 +401,82 @@ librdf_uri*
 librdf_new_uri_relative_to_base(librdf_uri* base_uri,
                                 const unsigned char *uri_string)
 {
-  return raptor_new_uri_relative_to_base(raptor_uri_get_world(base_uri),
-                                         base_uri,
-                                         uri_string);
+  raptor_world* rworld;
+  librdf_uri_cache* cache;
+  librdf_uri_cache_entry* entry;
+  const unsigned char *base_string;
+  size_t base_len;
+  size_t reference_len;
+  librdf_uri* new_uri;
+  const unsigned char *p;
+  unsigned int hash = 2166136261U;
+
+  if(!base_uri)
+    return NULL;
+
+  rworld = raptor_uri_get_world(base_uri);
+
+  if(!uri_string || !*uri_string) {
+    librdf_usage_lock();
+    new_uri = raptor_new_uri_relative_to_base(rworld, base_uri, uri_string);
+    librdf_usage_unlock();
+    return new_uri;
+  }
+
+  base_string = librdf_uri_as_counted_string(base_uri, &base_len);
+  reference_len = strlen((const char*)uri_string);
+  cache = librdf_uri_get_cache(1);
+  if(!cache || base_len > LIBRDF_URI_CACHE_MAX_LENGTH ||
+     reference_len > LIBRDF_URI_CACHE_MAX_LENGTH) {
+    librdf_usage_lock();
+    new_uri = raptor_new_uri_relative_to_base(rworld, base_uri, uri_string);
+    librdf_usage_unlock();
+    return new_uri;
+  }
+
+  /* FNV-1a of the reference then the end of the base, which is where
+   * bases of one document differ */
+  for(p = uri_string; *p; p++)
+    hash = (hash ^ *p) * 16777619U;
+  for(p = base_string + (base_len > 32 ? base_len - 32 : 0);
+      p < base_string + base_len; p++)
+    hash = (hash ^ *p) * 16777619U;
+  entry = &cache->entries[hash & (LIBRDF_URI_CACHE_SIZE - 1)];
+
+  if(entry->resolved &&
+     entry->reference_len == reference_len &&
+     entry->base_len == base_len &&
+     !memcmp(entry->reference, uri_string, reference_len) &&
+     !memcmp(entry->base, base_string, base_len)) {
+    librdf_usage_lock();
+    new_uri = raptor_new_uri_from_counted_string(rworld, entry->resolved,
+                                                 entry->resolved_len);
+    librdf_usage_unlock();
+    return new_uri;
+  }
+
+  librdf_usage_lock();
+  new_uri = raptor_new_uri_relative_to_base(rworld, base_uri, uri_string);
+  librdf_usage_unlock();
+  if(new_uri) {
+    const unsigned char *resolved;
+    size_t resolved_len;
+
+    resolved = librdf_uri_as_counted_string(new_uri, &resolved_len);
+    librdf_uri_cache_entry_clear(entry);
+    entry->base = librdf_uri_cache_copy(base_string, base_len);
+    entry->reference = librdf_uri_cache_copy(uri_string, reference_len);
+    entry->resolved = librdf_uri_cache_copy(resolved, resolved_len);
+    if(!entry->base || !entry->reference || !entry->resolved)
+      librdf_uri_cache_entry_clear(entry);
+    else {
+      entry->base_len = base_len;
+      entry->reference_len = reference_len;
+      entry->resolved_len = resolved_len;
+    }
+  }
+
+  return new_uri;
 }
 
 
@@ -308,7 +523,9 @@ librdf_free_uri(librdf_uri* uri)
   if(!uri)
     return;
   
+  librdf_usage_lock();
   raptor_free_uri(uri);
+  librdf_usage_unlock();
 }
 
 
@@ -0,0 +1,158 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_uri_bench.c - RDF relative URI resolution micro-benchmark
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#include <redland.h>
+
+
+/* one prototype needed */
+int main(int argc, char *argv[]);
+
+
+#define BENCH_ROUNDS 20
+
+
+/*
+ * References are the kind RDF/XML documents repeat: rdf:about and
+ * rdf:resource fragments and relative paths from one document base.
+ */
+static unsigned char**
+bench_make_references(int count, int distinct)
+{
+  const char * const formats[]={
+    "#item-%d",
+    "../images/photo-%d.jpg",
+    "people/person-%d",
+    "#section-%d",
+    "?page=%d"
+  };
+  unsigned char** references;
+  char reference[64];
+  int i;
+
+  references = LIBRDF_CALLOC(unsigned char**, count, sizeof(unsigned char*));
+  if(!references)
+    return NULL;
+
+  for(i=0; i < count; i++) {
+    int n=i % distinct;
+    size_t len;
+
+    sprintf(reference, formats[n % 5], n);
+    len=strlen(reference);
+    references[i] = LIBRDF_MALLOC(unsigned char*, len + 1);
+    if(!references[i])
+      return NULL;
+    memcpy(references[i], reference, len + 1);
+  }
+
+  return references;
+}
+
+
+static void
+bench_report(const char* program, const char* name, int count,
+             clock_t ticks)
+{
+  double seconds=(double)ticks / CLOCKS_PER_SEC;
+
+  fprintf(stdout, "%s: %-10s %8.1f ns/reference\n", program, name,
+          seconds * 1e9 / ((double)count * BENCH_ROUNDS));
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  librdf_world* world;
+  raptor_world* raptor_world_ptr;
+  const char *program=librdf_basename((const char*)argv[0]);
+  int count=100000;
+  int distinct=200;
+  unsigned char** references;
+  librdf_uri* base_uri;
+  clock_t start;
+  int round;
+  int i;
+
+  if(argc > 1)
+    count=atoi(argv[1]);
+  if(argc > 2)
+    distinct=atoi(argv[2]);
+  if(count < 1 || distinct < 1) {
+    fprintf(stderr, "USAGE: %s [REFERENCE-COUNT [DISTINCT-REFERENCES]]\n",
+            program);
+    return 1;
+  }
+
+  world=librdf_new_world();
+  librdf_world_open(world);
+  raptor_world_ptr=librdf_world_get_raptor(world);
+
+  base_uri=librdf_new_uri(world, (const unsigned char*)"http://data.example.org/dataset/2008/documents/catalogue.rdf");
+  references=bench_make_references(count, distinct);
+  if(!base_uri || !references) {
+    fprintf(stderr, "%s: Failed to create references\n", program);
+    return 1;
+  }
+
+  fprintf(stdout, "%s: %d references, %d distinct, %d rounds\n",
+          program, count, distinct, BENCH_ROUNDS);
+
+  start=clock();
+  for(round=0; round < BENCH_ROUNDS; round++)
+    for(i=0; i < count; i++)
+      raptor_free_uri(raptor_new_uri_relative_to_base(raptor_world_ptr,
+                                                      base_uri,
+                                                      references[i]));
+  bench_report(program, "raptor", count, clock() - start);
+
+  start=clock();
+  for(round=0; round < BENCH_ROUNDS; round++)
+    for(i=0; i < count; i++)
+      librdf_free_uri(librdf_new_uri_relative_to_base(base_uri,
+                                                      references[i]));
+  bench_report(program, "cached", count, clock() - start);
+
+  for(i=0; i < count; i++)
+    LIBRDF_FREE(char*, references[i]);
+  LIBRDF_FREE(char**, references);
+  librdf_free_uri(base_uri);
+
+  librdf_free_world(world);
+
+  return 0;
+}
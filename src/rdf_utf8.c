@@ -39,12 +39,163 @@
 #include <stdlib.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <redland.h>
+#include <rdf_types.h>
 #include <rdf_utf8.h>
 
 
 #ifndef STANDALONE
 
+/* Every byte of a u64 with the top bit set */
+#define LIBRDF_UTF8_HIGH_BITS ((((u64)0x80808080UL) << 32) | (u64)0x80808080UL)
+
+
+/*
+ * librdf_utf8_ascii_prefix - INTERNAL - Count the leading ASCII bytes
+ * @input: string buffer
+ * @length: buffer size
+ *
+ * Checks 16 bytes at a time with SSE2 or NEON when compiled for them
+ * and 8 bytes at a time otherwise.
+ *
+ * Return value: number of bytes before the first non-ASCII byte
+ */
+static size_t
+librdf_utf8_ascii_prefix(const unsigned char *input, size_t length)
+{
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for(; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i*)(const void*)(input + i));
+    if(_mm_movemask_epi8(block))
+      break;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  for(; i + 16 <= length; i += 16) {
+    if(vmaxvq_u8(vld1q_u8(input + i)) & 0x80)
+      break;
+  }
+#endif
+
+  for(; i + sizeof(u64) <= length; i += sizeof(u64)) {
+    u64 word;
+
+    memcpy(&word, input + i, sizeof(word));
+    if(word & LIBRDF_UTF8_HIGH_BITS)
+      break;
+  }
+
+  while(i < length && input[i] < 0x80)
+    i++;
+
+  return i;
+}
+
+
+/**
+ * librdf_utf8_check:
+ * @input: UTF-8 string buffer
+ * @length: buffer size
+ *
+ * Check a string is valid UTF-8.
+ *
+ * Rejects overlong forms, UTF-16 surrogates and code points above
+ * U+10FFFF.  Runs of ASCII are skipped a block at a time, so an ASCII
+ * string costs little more than reading it.
+ *
+ * Return value: non 0 if @input is valid UTF-8
+ **/
+int
+librdf_utf8_check(const unsigned char *input, size_t length)
+{
+  size_t i = 0;
+
+  while(i < length) {
+    unsigned char c;
+    size_t size;
+    size_t j;
+
+    i += librdf_utf8_ascii_prefix(input + i, length - i);
+    if(i == length)
+      break;
+
+    c = input[i];
+    if(c >= 0xc2 && c <= 0xdf)
+      size = 2;
+    else if(c >= 0xe0 && c <= 0xef)
+      size = 3;
+    else if(c >= 0xf0 && c <= 0xf4)
+      size = 4;
+    else
+      return 0; /* continuation byte, overlong 2 byte form or too big */
+
+    if(size > length - i)
+      return 0;
+
+    for(j = 1; j < size; j++) {
+      if((input[i + j] & 0xc0) != 0x80)
+        return 0;
+    }
+
+    /* overlong 3 and 4 byte forms, surrogates and > U+10FFFF */
+    if((c == 0xe0 && input[i + 1] < 0xa0) ||
+       (c == 0xed && input[i + 1] > 0x9f) ||
+       (c == 0xf0 && input[i + 1] < 0x90) ||
+       (c == 0xf4 && input[i + 1] > 0x8f))
+      return 0;
+
+    i += size;
+  }
+
+  return 1;
+}
+
+
+/*
+ * librdf_utf8_copy_ascii - INTERNAL - Copy a string up to its first NUL if it is all ASCII
+ * @input: string buffer
+ * @length: buffer size
+ * @output_length: Pointer to variable to store resulting string length or NULL
+ *
+ * ASCII is the same in UTF-8 and ISO Latin-1, so the conversions in
+ * both directions are a copy for it.
+ *
+ * Return value: new string, or NULL if not ASCII or on failure
+ */
+static unsigned char*
+librdf_utf8_copy_ascii(const unsigned char *input, size_t length,
+                       size_t *output_length)
+{
+  const unsigned char *nul;
+  unsigned char *output;
+
+  nul = (const unsigned char*)memchr(input, '\0', length);
+  if(nul)
+    length = LIBRDF_GOOD_CAST(size_t, nul - input);
+
+  if(librdf_utf8_ascii_prefix(input, length) != length)
+    return NULL;
+
+  output = LIBRDF_MALLOC(unsigned char*, length + 1);
+  if(!output)
+    return NULL;
+  memcpy(output, input, length);
+  output[length] = '\0';
+
+  if(output_length)
+    *output_length = length;
+
+  return output;
+}
+
+
 /**
  * librdf_unicode_char_to_utf8:
  * @c: Unicode character
@@ -126,6 +277,10 @@ librdf_utf8_to_latin1_2(const unsigned char *input, size_t length,
   size_t j;
   unsigned char *output;
 
+  output = librdf_utf8_copy_ascii(input, length, output_length);
+  if(output)
+    return output;
+
   i = 0;
   while(input[i]) {
     int size = raptor_unicode_utf8_string_get_char(&input[i], length - i, NULL);
@@ -238,6 +393,10 @@ librdf_latin1_to_utf8_2(const unsigned char *input, size_t length,
   size_t j;
   unsigned char *output;
 
+  output = librdf_utf8_copy_ascii(input, length, output_length);
+  if(output)
+    return output;
+
   for(i = 0; input[i]; i++) {
     int size = raptor_unicode_utf8_string_put_char(input[i], NULL, length - i);
     if(size <= 0)
@@ -392,6 +551,21 @@ main(int argc, char *argv[])
   size_t utf8_string_length;
   int failures = 0;
   int verbose = 0;
+  const struct {
+    const char *string;
+    int valid;
+  } check_tests[] = {
+    { "An ASCII string longer than one block of sixteen bytes", 1 },
+    { "An ASCII string longer than one block " "\xc3\xa9" " then more", 1 },
+    { "\xe2\x82\xac" "3.50 and " "\xf0\x9f\x98\x80", 1 },
+    { "Stray continuation " "\x80", 0 },
+    { "Overlong " "\xc0\xaf", 0 },
+    { "Overlong " "\xe0\x80\xaf", 0 },
+    { "Surrogate " "\xed\xa0\x80", 0 },
+    { "Too big " "\xf4\x90\x80\x80", 0 },
+    { "Truncated at the end " "\xe2\x82", 0 },
+    { NULL, 0 }
+  };
 
   latin1_string = librdf_utf8_to_latin1_2(test_utf8_string, 
                                           test_utf8_string_length,
@@ -445,6 +619,21 @@ main(int argc, char *argv[])
   LIBRDF_FREE(char*, latin1_string);
   LIBRDF_FREE(char*, utf8_string);
 
+
+  for(i = 0; check_tests[i].string; i++) {
+    const unsigned char *string = (const unsigned char*)check_tests[i].string;
+    size_t length = strlen(check_tests[i].string);
+    int valid = librdf_utf8_check(string, length);
+
+    if(valid != check_tests[i].valid) {
+      fprintf(stderr, "%s: librdf_utf8_check FAILED on string '", program);
+      librdf_bad_string_print(string, LIBRDF_GOOD_CAST(int, length), stderr);
+      fprintf(stderr, "' - returned %d but expected %d\n", valid,
+              check_tests[i].valid);
+      failures++;
+    }
+  }
+
 #ifdef LIBRDF_MEMORY_DEBUG 
   librdf_memory_report(stderr);
 #endif
@@ -55,6 +55,8 @@ REDLAND_API REDLAND_DEPRECATED
 unsigned char* librdf_latin1_to_utf8(const unsigned char *input, int length, int *output_length);
 REDLAND_API
 void librdf_utf8_print(const unsigned char *input, int length, FILE *stream);
+REDLAND_API
+int librdf_utf8_check(const unsigned char *input, size_t length);
 
 
 
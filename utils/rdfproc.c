@@ -47,6 +47,18 @@
 #include <unistd.h>
 #endif
 
+/* for gettimeofday */
+#if TIME_WITH_SYS_TIME
+#include <sys/time.h>
+#include <time.h>
+#else
+#if HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <time.h>
+#endif
+#endif
+
 #include <redland.h>
 #include <raptor.h>
 
@@ -87,7 +99,11 @@ enum command_type {
   CMD_REMOVE_CONTEXT,
   CMD_CONTEXTS,
   CMD_MATCH,
-  CMD_SIZE
+  CMD_SIZE,
+  CMD_HASH_STATS,
+  CMD_LOAD,
+  CMD_DUMP,
+  CMD_COMPACT
 };
 
 typedef struct
@@ -127,6 +143,10 @@ static command commands[]={
   {CMD_CONTEXTS, "contexts", 0, 0, 0},
   {CMD_MATCH, "match", 3, 4, 0},
   {CMD_SIZE, "size", 0, 0, 0},
+  {CMD_HASH_STATS, "hash-stats", 0, 0, 0},
+  {CMD_LOAD, "load", 1, 4, 1},
+  {CMD_DUMP, "dump", 0, 3, 0},
+  {CMD_COMPACT, "compact", 0, 0, 1},
   {(enum command_type)-1, NULL, 0, 0, 0}  
 };
  
@@ -140,7 +160,7 @@ static command commands[]={
 #endif
 
 
-#define GETOPT_STRING "chno:pqr:s:t:TvV"
+#define GETOPT_STRING "chj:no:pqr:s:t:TvV"
 
 #ifdef HAVE_GETOPT_LONG
 static struct option long_options[] =
@@ -148,6 +168,7 @@ static struct option long_options[] =
   /* name, has_arg, flag, val */
   {"contexts", 0, 0, 'c'},
   {"help", 0, 0, 'h'},
+  {"jobs", 1, 0, 'j'},
   {"new", 0, 0, 'n'},
   {"output", 1, 0, 'o'},
   {"password", 0, 0, 'p'},
@@ -199,6 +220,96 @@ log_handler(void *user_data, librdf_log_message *message)
 
 
 
+/* seconds between progress reports of load and dump */
+#define PROGRESS_INTERVAL 10.0
+
+/* progress of the statements passing through a load or dump stream */
+typedef struct {
+  const char* action;
+  int verbosity;
+  long count;
+  double start;
+  double last;
+} progress_state;
+
+
+static double
+progress_now(void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+  struct timeval tv;
+
+  if(!gettimeofday(&tv, NULL))
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1e6;
+#endif
+  return (double)time(NULL);
+}
+
+
+static void
+progress_init(progress_state* progress, const char* action, int verbosity)
+{
+  progress->action=action;
+  progress->verbosity=verbosity;
+  progress->count=0;
+  progress->start=progress_now();
+  progress->last=progress->start;
+}
+
+
+static void
+progress_report(progress_state* progress)
+{
+  double seconds=progress_now() - progress->start;
+
+  fprintf(stderr, "%s: %s %ld triples in %.1f seconds (%.0f triples/s)\n",
+          program, progress->action, progress->count, seconds,
+          seconds > 0.0 ? (double)progress->count / seconds : 0.0);
+}
+
+
+static librdf_statement*
+progress_map(librdf_stream* stream, void* map_context,
+             librdf_statement* item)
+{
+  progress_state* progress=(progress_state*)map_context;
+
+  progress->count++;
+  /* look at the clock now and then */
+  if(progress->verbosity && !(progress->count % 10000)) {
+    double now=progress_now();
+
+    if(now - progress->last >= PROGRESS_INTERVAL) {
+      progress_report(progress);
+      progress->last=now;
+    }
+  }
+
+  return item;
+}
+
+
+static int
+set_serializer_feature(librdf_world* world, librdf_serializer* serializer,
+                       const char* feature, const char* value)
+{
+  librdf_uri* feature_uri;
+  librdf_node* value_node;
+  int rc=1;
+
+  feature_uri=librdf_new_uri(world, (const unsigned char*)feature);
+  value_node=librdf_new_node_from_literal(world, (const unsigned char*)value,
+                                          NULL, 0);
+  if(feature_uri && value_node)
+    rc=librdf_serializer_set_feature(serializer, feature_uri, value_node);
+  if(value_node)
+    librdf_free_node(value_node);
+  if(feature_uri)
+    librdf_free_uri(feature_uri);
+  return rc;
+}
+
+
 static void
 print_nodes(FILE* fh, librdf_iterator* iterator) 
 {
@@ -292,6 +403,9 @@ main(int argc, char *argv[])
   size_t size;
   const char *query_graph_serializer_syntax_name="rdfxml";
   char* results_format=NULL;
+  char* jobs=NULL;
+  int load_failed=0;
+  progress_state progress;
 
   program=argv[0];
   if((p=strrchr(program, '/')))
@@ -345,6 +459,17 @@ main(int argc, char *argv[])
         help=1;
         break;
 
+      case 'j':
+        if(optarg) {
+          if(atoi(optarg) < 1) {
+            fprintf(stderr, "%s: invalid argument `%s' for `" HELP_ARG(j, jobs) "'\n",
+                    program, optarg);
+            usage=1;
+          } else
+            jobs=optarg;
+        }
+        break;
+
       case 'n':
         is_new=1;
         break;
@@ -580,6 +705,7 @@ main(int argc, char *argv[])
     puts("\nOptions:");
     puts(HELP_TEXT(c, "contexts        ", "Use Redland contexts"));
     puts(HELP_TEXT(h, "help            ", "Print this help, then exit"));
+    puts(HELP_TEXT(j, "jobs N          ", "Use N threads to format dump output (default 1)"));
     puts(HELP_TEXT(n, "new             ", "Create a new store (default no)"));
     puts(HELP_TEXT(o, "output FORMAT   ", "Set the triple output format"));
     for(i = 0; 1; i++) {
@@ -628,6 +754,11 @@ main(int argc, char *argv[])
     puts("  parse-stream FILE|URI [SYNTAX [BASEURI [CONTEXT]]]");
     puts("      Parse RDF syntax (default RDF/XML) in FILE or URI into the graph");
     puts("      with optional BASEURI, into the optional CONTEXT.");
+    puts("  load FILE|URI [SYNTAX [BASEURI [CONTEXT]]]");
+    puts("      Parse as parse-stream using the storage bulk load paths,");
+    puts("      reporting progress and throughput.");
+    puts("  dump [SYNTAX [FILE [CONTEXT]]]            Stream the graph (or CONTEXT) to FILE");
+    puts("      (default standard output) as SYNTAX (N-Triples, N-Quads with contexts).");
     puts("  print                                     Print the graph triples.");
     puts("  serialize [SYNTAX [URI [MIME-TYPE]]]      Serializes to a syntax (RDF/XML).");
     puts("  query NAME|- URI|- QUERY-STRING           Run QUERY-STRING query in language NAME for bindings");
@@ -646,6 +777,8 @@ main(int argc, char *argv[])
     puts("  source | target | arc NODE1 NODE2         Show 1 matching node.");
     puts("  arcs-in | arcs-out NODE                   Show properties in/out of NODE");
     puts("  has-arc-in | has-arc-out NODE ARC         Check for property in/out of NODE.");
+    puts("  hash-stats                                Print the statistics of each storage hash.");
+    puts("  compact                                   Rewrite the store files to reclaim free space.");
     puts("  size                                      Print the number of triples in the graph.");
     puts("\nNotation:");
     puts("  nodes are either blank node identifiers like _:ABC,");
@@ -679,6 +812,14 @@ main(int argc, char *argv[])
 
   librdf_hash_from_string(options, storage_options);
 
+  if(type == CMD_LOAD) {
+    /* turn on the bulk load paths of the storages that have one */
+    if(librdf_hash_get_as_boolean(options, "bulk-load") < 0)
+      librdf_hash_put_strings(options, "bulk-load", "yes");
+    if(librdf_hash_get_as_boolean(options, "bulk") < 0)
+      librdf_hash_put_strings(options, "bulk", "yes");
+  }
+
 
   storage=librdf_new_storage_with_options(world, storage_name, identifier, 
                                           options);
@@ -726,6 +867,7 @@ main(int argc, char *argv[])
 
     case CMD_PARSE_MODEL:
     case CMD_PARSE_STREAM:
+    case CMD_LOAD:
       uri_string=(unsigned char *)argv[0];
       if(!access((const char*)uri_string, R_OK)) {
         uri_string=raptor_uri_filename_to_uri_string((char*)uri_string);
@@ -783,6 +925,37 @@ main(int argc, char *argv[])
           fprintf(stderr, "%s: Failed to parse into the graph\n", program);
           rc=1;
         }
+      } else if(type == CMD_LOAD) {
+        /* the whole stream goes to the storage in one add so it can
+         * batch, sort and drop duplicates as it loads */
+        count=librdf_model_size(model);
+        if(!(stream=librdf_parser_parse_as_stream(parser, uri, base_uri))) {
+          fprintf(stderr, "%s: Failed to parse RDF as stream\n", program);
+          load_failed=1;
+        } else {
+          progress_init(&progress, "Loaded", verbosity);
+          if(librdf_stream_add_map(stream, progress_map, NULL, &progress) ||
+             (target ? librdf_model_context_add_statements(model, target, stream) :
+                       librdf_model_add_statements(model, stream))) {
+            fprintf(stderr, "%s: Failed to add triples to the graph\n",
+                    program);
+            load_failed=1;
+          }
+          librdf_free_stream(stream);
+
+          if(verbosity) {
+            progress_report(&progress);
+            if(count >= 0 && librdf_model_size(model) >= 0)
+              fprintf(stderr, "%s: Graph grew by %d triples\n", program,
+                      librdf_model_size(model) - count);
+          }
+        }
+
+        if(target) {
+          librdf_free_node(target);
+          target=NULL;
+        }
+        rc=1;
       } else {
         /* either CMD_PARSE_STREAM or it's a parse into context */
         count=0;
@@ -851,7 +1024,7 @@ main(int argc, char *argv[])
          
         librdf_free_uri(error_count_uri);
         librdf_free_uri(warning_count_uri);
-        rc = (error_count == 0) ? 0 : 1;
+        rc = (error_count == 0 && !load_failed) ? 0 : 1;
       }
       
       librdf_free_parser(parser);
@@ -1565,6 +1738,120 @@ main(int argc, char *argv[])
         fprintf(stdout, "%s: graph has unknown number of triples\n", program);
       break;
 
+    case CMD_DUMP:
+      /* args are syntax name, file name and context node, all optional */
+      name=NULL;
+      if(argc > 0 && strcmp(argv[0], "-"))
+        name=argv[0];
+      if(!name)
+        name=(char*)((librdf_hash_get_as_boolean(options, "contexts") > 0) ?
+                     "nquads" : "ntriples");
+
+      serializer=librdf_new_serializer(world, name, NULL, NULL);
+      if(!serializer) {
+        fprintf(stderr, "%s: Failed to create new serializer %s\n", program,
+                name);
+        rc=1;
+        break;
+      }
+      if(jobs &&
+         set_serializer_feature(world, serializer,
+                                LIBRDF_SERIALIZER_FEATURE_THREADS, jobs))
+        fprintf(stderr, "%s: Serializer %s cannot use several threads\n",
+                program, name);
+      /* write turtle as it is read rather than collecting the graph */
+      if(!strcmp(name, "turtle"))
+        set_serializer_feature(world, serializer,
+                               LIBRDF_SERIALIZER_FEATURE_STREAMING, "1");
+
+      if(argc > 2) {
+        if(librdf_heuristic_is_blank_node(argv[2]))
+          context_node=librdf_new_node_from_blank_identifier(world, (const unsigned char *)librdf_heuristic_get_blank_node(argv[2]));
+        else
+          context_node=librdf_new_node_from_uri_string(world, (const unsigned char *)argv[2]);
+        stream=librdf_model_context_as_stream(model, context_node);
+        librdf_free_node(context_node);
+      } else
+        stream=librdf_model_as_stream(model);
+
+      if(!stream) {
+        fprintf(stderr, "%s: Failed to serialize the graph as a stream\n",
+                program);
+        librdf_free_serializer(serializer);
+        rc=1;
+        break;
+      }
+
+      progress_init(&progress, "Dumped", verbosity);
+      rc=librdf_stream_add_map(stream, progress_map, NULL, &progress);
+      if(!rc) {
+        /* file names ending .gz or .zst are compressed */
+        if(argc > 1 && strcmp(argv[1], "-"))
+          rc=librdf_serializer_serialize_stream_to_file(serializer, argv[1],
+                                                        NULL, stream);
+        else
+          rc=librdf_serializer_serialize_stream_to_file_handle(serializer,
+                                                               stdout, NULL,
+                                                               stream);
+      }
+      librdf_free_stream(stream);
+      librdf_free_serializer(serializer);
+
+      if(rc)
+        fprintf(stderr, "%s: Failed to dump the graph\n", program);
+      else if(verbosity)
+        progress_report(&progress);
+      break;
+
+    case CMD_HASH_STATS:
+      uri=librdf_new_uri(world, (const unsigned char*)LIBRDF_STORAGE_FEATURE_HASH_STATS);
+      if(!uri) {
+        fprintf(stderr, "%s: Failed to create feature URI\n", program);
+        rc=1;
+        break;
+      }
+      node=librdf_storage_get_feature(storage, uri);
+      librdf_free_uri(uri);
+      uri=NULL;
+      if(!node) {
+        fprintf(stderr, "%s: %s storage has no hash statistics\n", program,
+                storage_name);
+        rc=1;
+        break;
+      }
+      fputs((const char*)librdf_node_get_literal_value(node), stdout);
+      librdf_free_node(node);
+      break;
+
+    case CMD_COMPACT:
+      uri=librdf_new_uri(world, (const unsigned char*)LIBRDF_STORAGE_FEATURE_COMPACT);
+      if(!uri) {
+        fprintf(stderr, "%s: Failed to create feature URI\n", program);
+        rc=1;
+        break;
+      }
+      node=librdf_new_node_from_literal(world, (const unsigned char*)"1",
+                                        NULL, 0);
+      if(node) {
+        result=librdf_storage_set_feature(storage, uri, node);
+        librdf_free_node(node);
+      } else
+        result=1;
+      librdf_free_uri(uri);
+      uri=NULL;
+      if(result < 0) {
+        fprintf(stderr, "%s: %s storage cannot be compacted\n", program,
+                storage_name);
+        rc=1;
+      } else if(result) {
+        fprintf(stderr, "%s: Failed to compact the %s storage\n", program,
+                storage_name);
+        rc=1;
+      } else if(verbosity)
+        fprintf(stderr, "%s: Compacted the %s storage\n", program,
+                storage_name);
+      break;
+
     default:
       fprintf(stderr, "%s: Unknown command %d\n", program, type);
       return(1);